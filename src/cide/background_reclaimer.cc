@@ -0,0 +1,70 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/background_reclaimer.h"
+
+#include "cide/util.h"
+
+BackgroundReclaimer& BackgroundReclaimer::Instance() {
+  static BackgroundReclaimer instance;
+  return instance;
+}
+
+BackgroundReclaimer::~BackgroundReclaimer() {
+  Exit();
+}
+
+void BackgroundReclaimer::Exit() {
+  objectsMutex.lock();
+  mExit = true;
+  objectsMutex.unlock();
+  newObjectsCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+BackgroundReclaimer::BackgroundReclaimer() {
+  mExit = false;
+  mThread.reset(new std::thread(&BackgroundReclaimer::ThreadMain, this));
+}
+
+void BackgroundReclaimer::ReleaseImpl(std::shared_ptr<void>&& object, bool returnFreedMemory) {
+  std::unique_lock<std::mutex> lock(objectsMutex);
+  if (mExit) {
+    // Drop the reference outside of the lock.
+    lock.unlock();
+    object.reset();
+    return;
+  }
+  objects.push_back(std::move(object));
+  returnFreedMemoryRequested |= returnFreedMemory;
+  lock.unlock();
+  newObjectsCondition.notify_one();
+}
+
+void BackgroundReclaimer::ThreadMain() {
+  std::vector<std::shared_ptr<void>> objectsToDestroy;
+  while (true) {
+    std::unique_lock<std::mutex> lock(objectsMutex);
+    while (objects.empty()) {
+      if (mExit) {
+        return;
+      }
+      newObjectsCondition.wait(lock);
+    }
+    objectsToDestroy.swap(objects);
+    bool returnFreedMemory = returnFreedMemoryRequested;
+    returnFreedMemoryRequested = false;
+    lock.unlock();
+    
+    // Destroy the objects (or drop the references to them) without holding the
+    // lock, such that releasing further objects does not block meanwhile.
+    objectsToDestroy.clear();
+    if (returnFreedMemory) {
+      ReturnFreedMemoryToSystem();
+    }
+  }
+}
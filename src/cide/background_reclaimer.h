@@ -0,0 +1,60 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Destroys objects in a background thread. This is used for objects whose
+/// destruction may take long (such as libclang TUs, or the text and undo
+/// history of large documents) and which would otherwise often be destroyed in
+/// the Qt thread, making the UI freeze (for example, when closing many tabs at
+/// once).
+class BackgroundReclaimer {
+ public:
+  static BackgroundReclaimer& Instance();
+  
+  ~BackgroundReclaimer();
+  
+  /// Takes over the reference @p object. If it is the last reference, the
+  /// object is destroyed in the background thread. The object must not require
+  /// to be destroyed in a specific thread (in particular, it must not be a
+  /// QObject). After Exit(), the reference is dropped immediately instead.
+  ///
+  /// If @p returnFreedMemory is true, the freed heap memory is returned to the
+  /// operating system afterwards (see ReturnFreedMemoryToSystem()). This
+  /// should be used for large objects that consist of many small allocations,
+  /// which otherwise tend to keep the heap fragmented.
+  template <typename T>
+  inline void Release(std::shared_ptr<T>&& object, bool returnFreedMemory = false) {
+    ReleaseImpl(std::shared_ptr<void>(std::move(object)), returnFreedMemory);
+  }
+  
+  /// Destroys the remaining objects, makes the background thread exit and
+  /// waits for it.
+  void Exit();
+  
+ private:
+  BackgroundReclaimer();
+  
+  void ReleaseImpl(std::shared_ptr<void>&& object, bool returnFreedMemory);
+  
+  void ThreadMain();
+  
+  
+  // Thread input handling
+  std::mutex objectsMutex;
+  std::condition_variable newObjectsCondition;
+  std::vector<std::shared_ptr<void>> objects;
+  bool returnFreedMemoryRequested = false;
+  
+  // Threading
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
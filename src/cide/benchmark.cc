@@ -0,0 +1,279 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <QCoreApplication>
+#include <QString>
+
+#include "cide/document.h"
+#include "cide/text_utils.h"
+
+// Microbenchmarks for the editor hot paths. Run as:
+//   CIDEBenchmark [maxLineCount]
+// The benchmarks are run on synthetic documents of 1k lines up to
+// maxLineCount lines (default: 1M). The program prints one line per
+// measurement, which can be compared between builds to detect performance
+// regressions.
+
+/// Returns the time in seconds that it takes to run @p func.
+template <typename Func>
+static double MeasureSeconds(const Func& func) {
+  auto startTime = std::chrono::steady_clock::now();
+  func();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+/// Prints the throughput of a measurement: @p count items of the given
+/// @p unit were processed in @p seconds.
+static void PrintResult(const char* name, const QString& parameters, double count, const char* unit, double seconds) {
+  std::cout << name << " [" << parameters.toStdString() << "]: "
+            << static_cast<int64_t>(count / seconds) << " " << unit << "/s ("
+            << (1000 * seconds) << " ms total)" << std::endl;
+}
+
+/// Returns a random identifier-like word.
+static QString CreateRandomWord(std::mt19937* generator) {
+  static const char* kChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+  std::uniform_int_distribution<int> lengthDistribution(2, 14);
+  std::uniform_int_distribution<int> charDistribution(0, 62);
+  
+  int length = lengthDistribution(*generator);
+  QString word;
+  word.reserve(length);
+  for (int i = 0; i < length; ++ i) {
+    // Do not start words with a digit.
+    word += QChar(kChars[(i == 0) ? (charDistribution(*generator) % 53) : charDistribution(*generator)]);
+  }
+  return word;
+}
+
+/// Creates C++-like text with the given number of lines and varying line
+/// lengths and indentation.
+static QString CreateSyntheticText(int lineCount) {
+  std::mt19937 generator(/*seed*/ 0);
+  std::uniform_int_distribution<int> wordCountDistribution(0, 10);
+  std::uniform_int_distribution<int> indentDistribution(0, 4);
+  
+  QString text;
+  text.reserve(lineCount * 48);
+  for (int line = 0; line < lineCount; ++ line) {
+    text += QString(2 * indentDistribution(generator), ' ');
+    int wordCount = wordCountDistribution(generator);
+    for (int w = 0; w < wordCount; ++ w) {
+      if (w > 0) {
+        text += (w % 3 == 0) ? QStringLiteral(", ") : QStringLiteral(" ");
+      }
+      text += CreateRandomWord(&generator);
+    }
+    if (wordCount > 0) {
+      text += ';';
+    }
+    if (line < lineCount - 1) {
+      text += '\n';
+    }
+  }
+  return text;
+}
+
+/// Adds a highlight range for every word in the document, roughly like the
+/// libclang-based highlighting does.
+static int AddWordHighlightRanges(Document* document, const QString& text) {
+  int rangeCount = 0;
+  int wordStart = -1;
+  for (int i = 0, size = text.size(); i <= size; ++ i) {
+    bool isWordChar = (i < size) && (text[i].isLetterOrNumber() || text[i] == '_');
+    if (isWordChar && wordStart < 0) {
+      wordStart = i;
+    } else if (!isWordChar && wordStart >= 0) {
+      document->AddHighlightRange(DocumentRange(wordStart, i), false, (rangeCount % 2 == 0) ? qRgb(0, 0, 255) : qRgb(0, 127, 0), rangeCount % 3 == 0);
+      ++ rangeCount;
+      wordStart = -1;
+    }
+  }
+  document->FinishedHighlightingChanges();
+  return rangeCount;
+}
+
+static void BenchmarkReplace(int lineCount, const QString& text) {
+  constexpr int kEditCount = 20000;
+  std::vector<int> blockSizes = {32, 128, 512, 2048};
+  
+  for (int blockSize : blockSizes) {
+    // Edit both in small blocks only, and in large blocks (as created by
+    // Document::CompactBlocks()) that get split on the first edit.
+    for (bool compactBlocks : {false, true}) {
+      Document document(blockSize);
+      document.Replace(document.FullDocumentRange(), text);
+      if (compactBlocks) {
+        document.CompactBlocks();
+      }
+      
+      // Alternately insert and remove a character at random positions.
+      std::mt19937 generator(/*seed*/ 0);
+      double seconds = MeasureSeconds([&]() {
+        for (int i = 0; i < kEditCount; ++ i) {
+          int documentSize = document.FullDocumentRange().end.offset;
+          int offset = std::uniform_int_distribution<int>(0, std::max(0, documentSize - 1))(generator);
+          if (i % 2 == 0) {
+            document.Replace(DocumentRange(offset, offset), QStringLiteral("x"));
+          } else {
+            document.Replace(DocumentRange(offset, std::min(documentSize, offset + 1)), QStringLiteral(""));
+          }
+        }
+      });
+      PrintResult("Document::Replace", QStringLiteral("lines: %1, desiredBlockSize: %2, compacted: %3").arg(lineCount).arg(blockSize).arg(compactBlocks), kEditCount, "edits", seconds);
+    }
+  }
+}
+
+static void BenchmarkIteration(int lineCount, const QString& text) {
+  for (bool compactBlocks : {false, true}) {
+    Document document;
+    document.Replace(document.FullDocumentRange(), text);
+    AddWordHighlightRanges(&document, text);
+    
+    double compactSeconds = 0;
+    if (compactBlocks) {
+      compactSeconds = MeasureSeconds([&]() {
+        document.CompactBlocks();
+      });
+    }
+    int blockCount;
+    float avgBlockSize;
+    int maxBlockSize;
+    float avgStyleRanges;
+    document.DebugGetBlockStatistics(&blockCount, &avgBlockSize, &maxBlockSize, &avgStyleRanges);
+    if (compactBlocks) {
+      PrintResult("Document::CompactBlocks", QStringLiteral("lines: %1, blocks: %2").arg(lineCount).arg(blockCount), lineCount, "lines", compactSeconds);
+    }
+    
+    int characterCount = 0;
+    int styleChangeCount = 0;
+    double seconds = MeasureSeconds([&]() {
+      Document::CharacterAndStyleIterator it(&document);
+      while (it.IsValid()) {
+        if (it.StyleChanged()) {
+          ++ styleChangeCount;
+        }
+        ++ characterCount;
+        ++ it;
+      }
+    });
+    PrintResult("Document::CharacterAndStyleIterator", QStringLiteral("lines: %1, blocks: %2, style changes: %3").arg(lineCount).arg(blockCount).arg(styleChangeCount), characterCount, "characters", seconds);
+    
+    int runCharacterCount = 0;
+    int runCount = 0;
+    double runSeconds = MeasureSeconds([&]() {
+      Document::StyleRunIterator it(&document, 0);
+      while (it.IsValid()) {
+        runCharacterCount += it.GetSize();
+        ++ runCount;
+        ++ it;
+      }
+    });
+    PrintResult("Document::StyleRunIterator", QStringLiteral("lines: %1, blocks: %2, runs: %3").arg(lineCount).arg(blockCount).arg(runCount), runCharacterCount, "characters", runSeconds);
+  }
+}
+
+static void BenchmarkHighlighting(int lineCount, const QString& text) {
+  Document document;
+  document.Replace(document.FullDocumentRange(), text);
+  
+  int rangeCount;
+  double addSeconds = MeasureSeconds([&]() {
+    rangeCount = AddWordHighlightRanges(&document, text);
+  });
+  PrintResult("Document::AddHighlightRange", QStringLiteral("lines: %1").arg(lineCount), rangeCount, "ranges", addSeconds);
+  
+  // ClearHighlightRanges() re-applies the remaining ranges with
+  // ReapplyHighlightRanges().
+  double clearSeconds = MeasureSeconds([&]() {
+    document.ClearHighlightRanges(0);
+  });
+  PrintResult("Document::ReapplyHighlightRanges", QStringLiteral("lines: %1").arg(lineCount), lineCount, "lines", clearSeconds);
+}
+
+static void BenchmarkGetDocumentText(int lineCount, const QString& text) {
+  Document document;
+  document.Replace(document.FullDocumentRange(), text);
+  
+  constexpr int kRepetitions = 5;
+  int characterCount = 0;
+  double seconds = MeasureSeconds([&]() {
+    for (int i = 0; i < kRepetitions; ++ i) {
+      characterCount += document.GetDocumentText().size();
+    }
+  });
+  PrintResult("Document::GetDocumentText", QStringLiteral("lines: %1").arg(lineCount), characterCount, "characters", seconds);
+}
+
+static void BenchmarkFuzzyTextMatch(int candidateCount) {
+  std::mt19937 generator(/*seed*/ 0);
+  std::vector<QString> candidates(candidateCount);
+  for (QString& candidate : candidates) {
+    candidate = CreateRandomWord(&generator) + CreateRandomWord(&generator);
+  }
+  
+  std::vector<QString> foldedCandidates(candidateCount);
+  for (int i = 0; i < candidateCount; ++ i) {
+    foldedCandidates[i] = FoldCaseForFuzzyTextMatch(candidates[i]);
+  }
+  
+  std::vector<QString> queries = {QStringLiteral("a"), QStringLiteral("GetDoc"), QStringLiteral("abcdefgh")};
+  for (const QString& query : queries) {
+    int matchCount = 0;
+    double seconds = MeasureSeconds([&]() {
+      for (const QString& candidate : candidates) {
+        FuzzyTextMatchScore score;
+        ComputeFuzzyTextMatch(query, candidate, &score);
+        if (score.matchedCharacters > 0) {
+          ++ matchCount;
+        }
+      }
+    });
+    PrintResult("ComputeFuzzyTextMatch", QStringLiteral("candidates: %1, query: %2, matches: %3").arg(candidateCount).arg(query).arg(matchCount), candidateCount, "candidates", seconds);
+    
+    // Matching with pre-folded candidates, as done by the completion and
+    // search lists.
+    matchCount = 0;
+    QString foldedQuery = FoldCaseForFuzzyTextMatch(query);
+    seconds = MeasureSeconds([&]() {
+      for (int i = 0; i < candidateCount; ++ i) {
+        FuzzyTextMatchScore score;
+        ComputeFuzzyTextMatch(query, foldedQuery, candidates[i], foldedCandidates[i], &score);
+        if (score.matchedCharacters > 0) {
+          ++ matchCount;
+        }
+      }
+    });
+    PrintResult("ComputeFuzzyTextMatch (folded)", QStringLiteral("candidates: %1, query: %2, matches: %3").arg(candidateCount).arg(query).arg(matchCount), candidateCount, "candidates", seconds);
+  }
+}
+
+
+int main(int argc, char** argv) {
+  QCoreApplication qapp(argc, argv);
+  InitializeSymbolArray();
+  
+  int maxLineCount = 1000 * 1000;
+  if (argc >= 2) {
+    maxLineCount = QString::fromLocal8Bit(argv[1]).toInt();
+  }
+  
+  for (int lineCount = 1000; lineCount <= maxLineCount; lineCount *= 10) {
+    QString text = CreateSyntheticText(lineCount);
+    
+    BenchmarkReplace(lineCount, text);
+    BenchmarkIteration(lineCount, text);
+    BenchmarkHighlighting(lineCount, text);
+    BenchmarkGetDocumentText(lineCount, text);
+    BenchmarkFuzzyTextMatch(/*candidateCount*/ lineCount);
+  }
+  
+  return 0;
+}
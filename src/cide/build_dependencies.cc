@@ -0,0 +1,215 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/build_dependencies.h"
+
+#include <cstring>
+
+#include <QDirIterator>
+#include <QFile>
+#include <QtDebug>
+
+#include "cide/canonical_path_cache.h"
+
+/// Ninja does not write records that are larger than this, so a larger size
+/// indicates a corrupted log.
+constexpr quint32 kMaxNinjaRecordSize = (1 << 19) - 1;
+
+/// Dependency files that are larger than this are not read.
+constexpr qint64 kMaxDepFileSize = 16 * 1024 * 1024;
+
+static inline quint32 ReadLittleEndianUInt32(const char* data) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return static_cast<quint32>(bytes[0]) |
+         (static_cast<quint32>(bytes[1]) << 8) |
+         (static_cast<quint32>(bytes[2]) << 16) |
+         (static_cast<quint32>(bytes[3]) << 24);
+}
+
+/// Returns the canonical path of the given path from a dependency file or log,
+/// resolving relative paths against @p buildDir, or an empty string if the
+/// file does not exist.
+static QString CanonicalDependencyPath(const QString& path, const QDir& buildDir) {
+  return CachedCanonicalFilePath(buildDir.absoluteFilePath(path));
+}
+
+/// Stores the dependencies of a source given as canonical paths (the source
+/// first) in @p dependencies, replacing an existing entry for the source.
+static void StoreDependencies(const std::vector<QString>& canonicalPaths, BuildDependencyMap* dependencies) {
+  if (canonicalPaths.empty() || canonicalPaths.front().isEmpty()) {
+    return;
+  }
+  std::vector<QString>& sourceDependencies = (*dependencies)[canonicalPaths.front()];
+  sourceDependencies.clear();
+  for (std::size_t i = 1; i < canonicalPaths.size(); ++ i) {
+    if (!canonicalPaths[i].isEmpty() && canonicalPaths[i] != canonicalPaths.front()) {
+      sourceDependencies.push_back(canonicalPaths[i]);
+    }
+  }
+}
+
+bool ReadNinjaDependencyLog(const QString& path, const QDir& buildDir, BuildDependencyMap* dependencies) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QByteArray log = file.readAll();
+  const char* data = log.constData();
+  const int size = log.size();
+  
+  constexpr char kSignature[] = "# ninjadeps\n";
+  constexpr int kSignatureSize = sizeof(kSignature) - 1;
+  if (size < kSignatureSize + 4 || std::memcmp(data, kSignature, kSignatureSize) != 0) {
+    return false;
+  }
+  quint32 version = ReadLittleEndianUInt32(data + kSignatureSize);
+  if (version != 3 && version != 4) {
+    qDebug() << "Unsupported ninja dependency log version" << version << "in" << path;
+    return false;
+  }
+  const int mtimeSize = (version == 4) ? 8 : 4;
+  
+  // The path records implicitly assign increasing IDs to the paths. The
+  // canonical paths are determined once per ID, since most paths are referenced
+  // by many deps records.
+  std::vector<QString> canonicalPathsById;
+  std::vector<QString> recordPaths;
+  
+  int offset = kSignatureSize + 4;
+  while (offset + 4 <= size) {
+    quint32 header = ReadLittleEndianUInt32(data + offset);
+    bool isDepsRecord = (header & 0x80000000u) != 0;
+    quint32 recordSize = header & 0x7FFFFFFFu;
+    offset += 4;
+    if (recordSize > kMaxNinjaRecordSize || recordSize > static_cast<quint32>(size - offset)) {
+      // The log is corrupted or truncated (for example, because ninja was
+      // interrupted while writing it). Ninja itself uses the log up to here.
+      break;
+    }
+    const char* record = data + offset;
+    offset += recordSize;
+    
+    if (isDepsRecord) {
+      if (recordSize < 4 + mtimeSize || (recordSize - 4 - mtimeSize) % 4 != 0) {
+        break;
+      }
+      int inputCount = (recordSize - 4 - mtimeSize) / 4;
+      recordPaths.resize(inputCount);
+      bool valid = true;
+      for (int i = 0; i < inputCount; ++ i) {
+        quint32 id = ReadLittleEndianUInt32(record + 4 + mtimeSize + 4 * i);
+        if (id >= canonicalPathsById.size()) {
+          valid = false;
+          break;
+        }
+        recordPaths[i] = canonicalPathsById[id];
+      }
+      if (!valid) {
+        break;
+      }
+      StoreDependencies(recordPaths, dependencies);
+    } else {
+      int pathSize = recordSize;
+      if (version == 4) {
+        if (recordSize < 4) {
+          break;
+        }
+        pathSize -= 4;
+        quint32 checksum = ReadLittleEndianUInt32(record + pathSize);
+        if (checksum != ~static_cast<quint32>(canonicalPathsById.size())) {
+          break;
+        }
+      }
+      // Strip the padding to a multiple of four bytes.
+      while (pathSize > 0 && record[pathSize - 1] == '\0') {
+        -- pathSize;
+      }
+      canonicalPathsById.push_back(CanonicalDependencyPath(QString::fromLocal8Bit(record, pathSize), buildDir));
+    }
+  }
+  
+  return true;
+}
+
+bool ReadDepFile(const QString& path, const QDir& buildDir, BuildDependencyMap* dependencies) {
+  QFile file(path);
+  if (file.size() > kMaxDepFileSize || !file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QByteArray text = file.readAll();
+  const char* data = text.constData();
+  const int size = text.size();
+  
+  // Splits the rule into words. Words are separated by whitespace and
+  // backslash-newline continuations; "\ " and "$$" escape a space and a dollar
+  // sign. The targets end at the first colon that is followed by whitespace
+  // (other colons are part of Windows drive letters).
+  std::vector<QString> prerequisites;
+  QByteArray word;
+  bool inPrerequisites = false;
+  int i = 0;
+  auto finishWord = [&]() {
+    if (!word.isEmpty()) {
+      if (inPrerequisites) {
+        prerequisites.push_back(QString::fromLocal8Bit(word));
+      }
+      word.clear();
+    }
+  };
+  while (i < size) {
+    char c = data[i];
+    if (c == '\\' && i + 1 < size && (data[i + 1] == '\n' || data[i + 1] == '\r')) {
+      finishWord();
+      i += (data[i + 1] == '\r' && i + 2 < size && data[i + 2] == '\n') ? 3 : 2;
+    } else if (c == '\\' && i + 1 < size && (data[i + 1] == ' ' || data[i + 1] == '#')) {
+      word += data[i + 1];
+      i += 2;
+    } else if (c == '$' && i + 1 < size && data[i + 1] == '$') {
+      word += '$';
+      i += 2;
+    } else if (c == '\n' || c == '\r') {
+      if (inPrerequisites) {
+        break;  // end of the first rule
+      }
+      word.clear();
+      ++ i;
+    } else if (c == ' ' || c == '\t') {
+      finishWord();
+      ++ i;
+    } else if (c == ':' && !inPrerequisites && (i + 1 == size || data[i + 1] == ' ' || data[i + 1] == '\t' || data[i + 1] == '\n' || data[i + 1] == '\r')) {
+      word.clear();
+      inPrerequisites = true;
+      ++ i;
+    } else {
+      word += c;
+      ++ i;
+    }
+  }
+  finishWord();
+  
+  if (prerequisites.empty()) {
+    return false;
+  }
+  for (QString& prerequisite : prerequisites) {
+    prerequisite = CanonicalDependencyPath(prerequisite, buildDir);
+  }
+  StoreDependencies(prerequisites, dependencies);
+  return true;
+}
+
+bool ReadBuildDependencies(const QDir& buildDir, BuildDependencyMap* dependencies) {
+  dependencies->clear();
+  
+  QString ninjaLogPath = buildDir.filePath(".ninja_deps");
+  if (QFile::exists(ninjaLogPath)) {
+    ReadNinjaDependencyLog(ninjaLogPath, buildDir, dependencies);
+  } else {
+    QDirIterator it(buildDir.path(), QStringList{QStringLiteral("*.d")}, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+      ReadDepFile(it.next(), buildDir, dependencies);
+    }
+  }
+  
+  return !dependencies->empty();
+}
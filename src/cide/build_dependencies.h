@@ -0,0 +1,42 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include <QDir>
+#include <QString>
+
+#include "cide/util.h"
+
+/// Maps the canonical paths of compiled source files to the canonical paths of
+/// the files that they depend on (i.e., that they include directly or
+/// transitively), as recorded by the build system. The source file itself is
+/// not contained in its list.
+typedef std::unordered_map<QString, std::vector<QString>> BuildDependencyMap;
+
+/// Reads the dependency log that ninja writes into the build directory
+/// (.ninja_deps, versions 3 and 4 of the format are supported), which contains
+/// the header dependencies of all outputs that were built with "deps = gcc" or
+/// "deps = msvc". Relative paths in the log are resolved against @p buildDir.
+/// Files that do not exist (anymore) are skipped. If the log contains multiple
+/// records for the same source, the last one is used. Returns true if the log
+/// could be read (a truncated log is read up to the truncation), false
+/// otherwise.
+bool ReadNinjaDependencyLog(const QString& path, const QDir& buildDir, BuildDependencyMap* dependencies);
+
+/// Reads a Makefile-syntax dependency file, as written by compilers with -MD
+/// (for example, by Makefile generators). Only the first rule is read; its
+/// first prerequisite is taken to be the compiled source file, the remaining
+/// ones are its dependencies. Relative paths are resolved against
+/// @p buildDir. Returns true if a rule was found, false otherwise.
+bool ReadDepFile(const QString& path, const QDir& buildDir, BuildDependencyMap* dependencies);
+
+/// Reads the header dependencies that the build system recorded in
+/// @p buildDir: the ninja dependency log if it exists, otherwise all
+/// dependency files (*.d) below the build directory. Returns true if any
+/// dependencies were found, false otherwise.
+bool ReadBuildDependencies(const QDir& buildDir, BuildDependencyMap* dependencies);
@@ -0,0 +1,374 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/build_output.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+void LineRingBuffer::Append(const char* data, int size) {
+  if (size <= 0) {
+    return;
+  }
+  
+  int capacity = mBuffer.size();
+  if (mSize + size > capacity) {
+    // Grow the buffer, moving the existing bytes to its start.
+    int newCapacity = std::max(256, capacity);
+    while (newCapacity < mSize + size) {
+      newCapacity *= 2;
+    }
+    std::vector<char> newBuffer(newCapacity);
+    int firstSegmentSize = std::min(mSize, capacity - mStart);
+    if (firstSegmentSize > 0) {
+      memcpy(newBuffer.data(), mBuffer.data() + mStart, firstSegmentSize);
+      memcpy(newBuffer.data() + firstSegmentSize, mBuffer.data(), mSize - firstSegmentSize);
+    }
+    mBuffer.swap(newBuffer);
+    mStart = 0;
+    capacity = newCapacity;
+  }
+  
+  int writePos = (mStart + mSize) & (capacity - 1);
+  int firstSegmentSize = std::min(size, capacity - writePos);
+  memcpy(mBuffer.data() + writePos, data, firstSegmentSize);
+  memcpy(mBuffer.data(), data + firstSegmentSize, size - firstSegmentSize);
+  mSize += size;
+}
+
+bool LineRingBuffer::TakeLine(QByteArray* line) {
+  const int capacity = mBuffer.size();
+  while (mScannedSize < mSize) {
+    int scanPos = (mStart + mScannedSize) & (capacity - 1);
+    int segmentSize = std::min(mSize - mScannedSize, capacity - scanPos);
+    const char* newline = static_cast<const char*>(memchr(mBuffer.data() + scanPos, '\n', segmentSize));
+    if (!newline) {
+      mScannedSize += segmentSize;
+      continue;
+    }
+    
+    int lineSize = mScannedSize + (newline - (mBuffer.data() + scanPos));
+    line->resize(lineSize);
+    int firstSegmentSize = std::min(lineSize, capacity - mStart);
+    memcpy(line->data(), mBuffer.data() + mStart, firstSegmentSize);
+    memcpy(line->data() + firstSegmentSize, mBuffer.data(), lineSize - firstSegmentSize);
+    
+    mStart = (mStart + lineSize + 1) & (capacity - 1);
+    mSize -= lineSize + 1;
+    mScannedSize = 0;
+    return true;
+  }
+  return false;
+}
+
+void LineRingBuffer::Clear() {
+  mBuffer.clear();
+  mStart = 0;
+  mSize = 0;
+  mScannedSize = 0;
+}
+
+
+void BuildOutputUpdate::Append(const BuildOutputUpdate& other) {
+  outputText += other.outputText;
+  if (other.progressMaximum >= 0) {
+    progressValue = other.progressValue;
+    progressMaximum = other.progressMaximum;
+  }
+  issues.insert(issues.end(), other.issues.begin(), other.issues.end());
+}
+
+
+BuildOutputParser::BuildOutputParser() {
+  mExit = false;
+  mThread.reset(new std::thread(&BuildOutputParser::ThreadMain, this));
+}
+
+BuildOutputParser::~BuildOutputParser() {
+  mutex.lock();
+  mExit = true;
+  mutex.unlock();
+  newOutputCondition.notify_all();
+  idleCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void BuildOutputParser::Reset(Mode mode) {
+  std::unique_lock<std::mutex> lock(mutex);
+  stdoutBuffer.Clear();
+  stderrBuffer.Clear();
+  haveNewOutput = false;
+  pendingUpdate = BuildOutputUpdate();
+  this->mode = mode;
+  ++ generation;
+}
+
+void BuildOutputParser::AddOutput(const QByteArray& output, bool isStderr) {
+  if (output.isEmpty()) {
+    return;
+  }
+  
+  mutex.lock();
+  (isStderr ? stderrBuffer : stdoutBuffer).Append(output.constData(), output.size());
+  haveNewOutput = true;
+  mutex.unlock();
+  newOutputCondition.notify_one();
+}
+
+void BuildOutputParser::WaitUntilIdle() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idleCondition.wait(lock, [&]() { return (!haveNewOutput && !busy) || mExit; });
+}
+
+bool BuildOutputParser::TakeUpdate(BuildOutputUpdate* update) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (pendingUpdate.IsEmpty()) {
+    return false;
+  }
+  *update = std::move(pendingUpdate);
+  pendingUpdate = BuildOutputUpdate();
+  return true;
+}
+
+void BuildOutputParser::ThreadMain() {
+  // State of parsing the current generation. Only accessed by this thread.
+  int parsedGeneration = -1;
+  QString partialIssueText;
+  
+  std::vector<std::pair<QByteArray, bool>> lines;
+  QByteArray lineBytes;
+  
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!haveNewOutput && !mExit) {
+      newOutputCondition.wait(lock);
+    }
+    if (mExit) {
+      return;
+    }
+    
+    // Take all complete lines from the buffers.
+    haveNewOutput = false;
+    busy = true;
+    int currentGeneration = generation;
+    Mode currentMode = mode;
+    lines.clear();
+    while (stdoutBuffer.TakeLine(&lineBytes)) {
+      lines.emplace_back(lineBytes, false);
+    }
+    while (stderrBuffer.TakeLine(&lineBytes)) {
+      lines.emplace_back(lineBytes, true);
+    }
+    lock.unlock();
+    
+    // Parse the lines.
+    if (parsedGeneration != currentGeneration) {
+      parsedGeneration = currentGeneration;
+      partialIssueText.clear();
+    }
+    BuildOutputUpdate update;
+    for (const auto& item : lines) {
+      QString line = QString::fromUtf8(item.first);
+      update.outputText += line;
+      update.outputText += QLatin1Char('\n');
+      ParseLine(line, item.second, currentMode, &partialIssueText, &update);
+    }
+    
+    lock.lock();
+    if (currentGeneration == generation) {
+      pendingUpdate.Append(update);
+    }
+    busy = false;
+    lock.unlock();
+    idleCondition.notify_all();
+  }
+}
+
+void BuildOutputParser::ParseLine(const QString& line, bool isStderr, Mode mode, QString* partialIssueText, BuildOutputUpdate* update) {
+  if (isStderr) {
+    ParseLineForIssue(line, partialIssueText, update);
+    return;
+  }
+  
+  bool hasBeenParsed = false;
+  
+  // Ignore messages like "ninja: build stopped: subcommand failed."
+  if (!hasBeenParsed && mode != Mode::Make && line.startsWith(QStringLiteral("ninja: "))) {
+    hasBeenParsed = true;
+  }
+  
+  // Ignore messages like "FAILED: CMakeFiles/CIDEBaseLib.dir/src/cide/main.cc.o"
+  // TODO: Does ninja always print the failed command afterwards? Then we could skip that line safely.
+  if (!hasBeenParsed && mode != Mode::Make && line.startsWith(QStringLiteral("FAILED: "))) {
+    hasBeenParsed = true;
+  }
+  
+  // Ignore "collect2: error: ld returned 1 exit status"
+  if (!hasBeenParsed && line == QStringLiteral("collect2: error: ld returned 1 exit status")) {
+    hasBeenParsed = true;
+  }
+  
+  // Format of ninja progress output: "[X/Y] Message ...\n"
+  if (!hasBeenParsed && mode != Mode::Make && line.size() >= 6 && line[0] == '[') {
+    int slashPos = line.indexOf('/', 2);
+    if (slashPos >= 0) {
+      int closingBracketPos = line.indexOf(']', slashPos + 1);
+      if (closingBracketPos >= 0) {
+        bool ok;
+        int currentItem = line.midRef(1, slashPos - 1).toInt(&ok);
+        if (ok) {
+          int itemCount = line.midRef(slashPos + 1, closingBracketPos - slashPos - 1).toInt(&ok);
+          if (ok) {
+            update->progressMaximum = itemCount;
+            update->progressValue = currentItem;
+            hasBeenParsed = true;
+          }
+        }
+      }
+    }
+  }
+  
+  // Format of make progress output: "[ 50%] Message ...\n"
+  if (!hasBeenParsed && mode != Mode::Ninja && line.size() >= 6 && line[0] == '[') {
+    int closingBracketPos = line.indexOf(']', 1);
+    if (closingBracketPos >= 3 && line[closingBracketPos - 1] == '%') {
+      bool ok;
+      int percentage = line.midRef(1, closingBracketPos - 2).toInt(&ok);
+      if (ok) {
+        update->progressMaximum = 100;
+        update->progressValue = percentage;
+        hasBeenParsed = true;
+      }
+    }
+  }
+  
+  if (!hasBeenParsed) {
+    ParseLineForIssue(line, partialIssueText, update);
+  }
+}
+
+void BuildOutputParser::ParseLineForIssue(const QString& line, QString* partialIssueText, BuildOutputUpdate* update) {
+  bool hasBeenParsed = false;
+  
+  // Format of GCC 5 build error output:
+  // "<path>:line:column: error: <description>"
+  // "<line with the error>"
+  // "               ^     "  (pointing to the error)
+  // 
+  // ../src/cide/main.cc: In instantiation of ‘void Test<T>::Foo() [with T = int]’:
+  // ../src/cide/main.cc:22:12:   required from here
+  // ../src/cide/main.cc:11:10: error: invalid conversion from ‘const char*’ to ‘int’ [-fpermissive]
+  //      test = "bar";
+  //           ^
+  // 
+  // Format of clang-cl build error output:
+  // "<path>"(line,column): error: <description>"
+  // "<line with the error>"
+  // "               ^     "  (pointing to the error)
+  if (!hasBeenParsed &&
+      (line.endsWith(QStringLiteral("required from here")) ||
+        line.indexOf("In instantiation of") > 0)) {
+    int firstSpace = line.indexOf(' ');
+    if (firstSpace >= 0) {
+      *partialIssueText += QStringLiteral(
+          "<a href=\"%1\">%1</a> %2<br/>")
+              .arg(line.midRef(0, firstSpace))
+              .arg(line.midRef(firstSpace + 1));
+      hasBeenParsed = true;
+    }
+  }
+  
+  if (!hasBeenParsed && line.size() >= 12) {
+    bool isError = true;
+    bool isNote = false;
+    int prefixLen = 9;
+    int errorOrWarningStringPos = line.indexOf(QStringLiteral(": error: "));
+    if (errorOrWarningStringPos <= 0) {
+      isError = true;
+      prefixLen = 15;
+      errorOrWarningStringPos = line.indexOf(QStringLiteral(": fatal error: "));
+      if (errorOrWarningStringPos <= 0) {
+        isError = false;
+        prefixLen = 11;
+        errorOrWarningStringPos = line.indexOf(QStringLiteral(": warning: "));
+        if (errorOrWarningStringPos <= 0) {
+          isNote = true;
+          prefixLen = 8;
+          errorOrWarningStringPos = line.indexOf(QStringLiteral(": note: "));
+        }
+      }
+    }
+    if (errorOrWarningStringPos >= 5) {
+      int lineNumber = -1;
+      int columnNumber = -1;
+      QString path;
+      QString problemText;
+      
+      if (line[errorOrWarningStringPos - 1] == ')') {
+        // The output seems to be in clang-cl format.
+        int openingBracePos = line.lastIndexOf('(', errorOrWarningStringPos - 2);
+        if (openingBracePos >= 0) {
+          int commaPos = line.indexOf(',', openingBracePos + 1);
+          if (commaPos >= 0) {
+            bool ok;
+            lineNumber = line.midRef(openingBracePos + 1, commaPos - openingBracePos - 1).toInt(&ok);
+            if (ok) {
+              columnNumber = line.midRef(commaPos + 1, errorOrWarningStringPos - 1 - commaPos - 1).toInt(&ok);
+              if (ok) {
+                path = line.left(openingBracePos);
+                problemText = line.mid(errorOrWarningStringPos + prefixLen);
+              }
+            }
+          }
+        }
+      } else {
+        // The output is assumed to be in gcc/clang format.
+        int columnColonPos = line.lastIndexOf(':', errorOrWarningStringPos - 1);
+        if (columnColonPos >= 0) {
+          int lineColonPos = line.lastIndexOf(':', columnColonPos - 1);
+          if (lineColonPos >= 0) {
+            bool ok;
+            lineNumber = line.midRef(lineColonPos + 1, columnColonPos - lineColonPos - 1).toInt(&ok);
+            if (ok) {
+              columnNumber = line.midRef(columnColonPos + 1, errorOrWarningStringPos - columnColonPos - 1).toInt(&ok);
+              if (ok) {
+                path = line.left(lineColonPos);
+                problemText = line.mid(errorOrWarningStringPos + prefixLen);
+              }
+            }
+          }
+        }
+      }
+      
+      if (!problemText.isEmpty()) {
+        // TODO: Also append any following lines that also belong to this error?
+        //       It would be easy to recognize lines containing only whitespace and ^, this signals that the line before is a code excerpt.
+        //       However, the code can also easily be looked at by clicking the issue link, so maybe we don't need the excerpt.
+        QString htmlText = QStringLiteral("%5<a href=\"%1:%2:%3\">%1:%2:%3</a> <b>%4</b>")
+            .arg(path)
+            .arg(lineNumber)
+            .arg(columnNumber)
+            .arg(problemText.toHtmlEscaped())
+            .arg(*partialIssueText);
+        update->issues.emplace_back(htmlText, isNote ? BuildIssue::Type::Note : (isError ? BuildIssue::Type::Error : BuildIssue::Type::Warning));
+        partialIssueText->clear();
+        hasBeenParsed = true;
+      }
+    }
+  }
+  
+  // Format of linker errors:
+  // "libCIDEBaseLib.so: undefined reference to `DockWidgetWithClosedSignal::staticMetaObject'"
+  if (!hasBeenParsed && line.size() >= 21) {
+    int undefinedReferencePos = line.indexOf(QStringLiteral(": undefined reference"));
+    if (undefinedReferencePos >= 0) {
+      update->issues.emplace_back(QStringLiteral("<b>%1</b>").arg(line.trimmed().toHtmlEscaped()), BuildIssue::Type::Error);
+      hasBeenParsed = true;
+    }
+  }
+}
@@ -0,0 +1,152 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+/// Buffer for a stream of bytes that is split into lines. The bytes are stored
+/// in a ring buffer that grows as needed, so appending and taking lines takes
+/// time linear in the number of bytes, regardless of how the stream is split
+/// into chunks.
+class LineRingBuffer {
+ public:
+  /// Appends @p size bytes to the end of the buffer.
+  void Append(const char* data, int size);
+  
+  /// If the buffer contains a complete line, removes it from the buffer
+  /// (including its terminating '\n'), stores it in @p line (without the '\n'),
+  /// and returns true. Otherwise, returns false.
+  bool TakeLine(QByteArray* line);
+  
+  void Clear();
+  
+  /// Returns the number of bytes in the buffer.
+  inline int size() const { return mSize; }
+  
+ private:
+  /// Storage of the ring buffer. Its size is always zero or a power of two.
+  std::vector<char> mBuffer;
+  
+  /// Index in mBuffer of the first byte in the ring buffer.
+  int mStart = 0;
+  
+  /// Number of bytes in the ring buffer.
+  int mSize = 0;
+  
+  /// Number of bytes at the start of the ring buffer that are known not to
+  /// contain a '\n'. This prevents scanning partial lines multiple times.
+  int mScannedSize = 0;
+};
+
+
+/// A build issue (error, warning, or note) parsed from the build output.
+struct BuildIssue {
+  enum class Type {
+    Error = 0,
+    Warning,
+    
+    /// A note that belongs to the previous issue.
+    Note
+  };
+  
+  inline BuildIssue(const QString& htmlText, Type type)
+      : htmlText(htmlText),
+        type(type) {}
+  
+  QString htmlText;
+  Type type;
+};
+
+/// The result of parsing a part of the build output.
+struct BuildOutputUpdate {
+  /// Returns whether the update contains anything.
+  inline bool IsEmpty() const {
+    return outputText.isEmpty() && progressMaximum < 0 && issues.empty();
+  }
+  
+  /// Appends @p other to this update.
+  void Append(const BuildOutputUpdate& other);
+  
+  /// The new lines of the output, each terminated by a '\n'.
+  QString outputText;
+  
+  /// The build progress as given by the most recent progress line, or -1 if
+  /// there was no progress line.
+  int progressValue = -1;
+  int progressMaximum = -1;
+  
+  /// Build issues found in the new lines.
+  std::vector<BuildIssue> issues;
+};
+
+/// Splits the output of a build process into lines and parses them for build
+/// progress and issues in a background thread, such that long build logs do
+/// not block the UI.
+class BuildOutputParser {
+ public:
+  enum class Mode {
+    Ninja = 0,
+    Make,
+    Unknown
+  };
+  
+  BuildOutputParser();
+  
+  /// Waits for the parsing thread to exit.
+  ~BuildOutputParser();
+  
+  /// Discards all output and parse results, and sets the mode for parsing the
+  /// output of a new build process.
+  void Reset(Mode mode);
+  
+  /// Appends output of the build process. @p isStderr specifies whether the
+  /// output comes from stderr (true) or stdout (false).
+  void AddOutput(const QByteArray& output, bool isStderr);
+  
+  /// Waits until all complete lines that have been added have been parsed.
+  void WaitUntilIdle();
+  
+  /// Moves the results parsed since the last call into @p update. Returns
+  /// false if there were no new results.
+  bool TakeUpdate(BuildOutputUpdate* update);
+  
+  /// Parses a single line of build output and appends the results to
+  /// @p update. @p partialIssueText holds the context lines (such as "In
+  /// instantiation of ...") that will be prepended to the next issue.
+  static void ParseLine(const QString& line, bool isStderr, Mode mode, QString* partialIssueText, BuildOutputUpdate* update);
+  
+ private:
+  void ThreadMain();
+  
+  /// Parses a line for an error, warning, or note.
+  static void ParseLineForIssue(const QString& line, QString* partialIssueText, BuildOutputUpdate* update);
+  
+  // Input and output, protected by mutex.
+  std::mutex mutex;
+  LineRingBuffer stdoutBuffer;
+  LineRingBuffer stderrBuffer;
+  bool haveNewOutput = false;
+  bool busy = false;
+  Mode mode = Mode::Unknown;
+  BuildOutputUpdate pendingUpdate;
+  
+  /// Increased by each call to Reset() in order to discard the results of
+  /// lines that were being parsed during the call.
+  int generation = 0;
+  
+  // Threading
+  std::condition_variable newOutputCondition;
+  std::condition_variable idleCondition;
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,35 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/canonical_path_cache.h"
+
+#include <QFileInfo>
+
+CanonicalPathCache& CanonicalPathCache::Instance() {
+  static CanonicalPathCache instance;
+  return instance;
+}
+
+QString CanonicalPathCache::CanonicalFilePath(const QString& path) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = canonicalPaths.find(path);
+  if (it != canonicalPaths.end()) {
+    return it->second;
+  }
+  lock.unlock();
+  
+  // Resolve the path without holding the lock. If another thread resolves it
+  // in the meantime, both get the same result.
+  QString canonicalPath = QFileInfo(path).canonicalFilePath();
+  if (!canonicalPath.isEmpty()) {
+    lock.lock();
+    canonicalPaths[path] = canonicalPath;
+  }
+  return canonicalPath;
+}
+
+void CanonicalPathCache::Invalidate() {
+  std::unique_lock<std::mutex> lock(mutex);
+  canonicalPaths.clear();
+}
@@ -0,0 +1,48 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+
+#include <QString>
+
+#include "cide/util.h"
+
+/// Caches the results of QFileInfo::canonicalFilePath() for the whole process.
+/// Canonicalizing a path requires system calls for each of its components,
+/// while the same paths (for example, those of included headers reported by
+/// libclang) are canonicalized again and again for each parsed or indexed
+/// translation unit.
+///
+/// Only paths of existing files are cached, so files that get created later
+/// are still found. Since files may be moved or replaced by symlinks, the
+/// cache is cleared with Invalidate() whenever the project directories change
+/// on disk or a project gets (re)configured.
+///
+/// This class is thread-safe.
+class CanonicalPathCache {
+ public:
+  static CanonicalPathCache& Instance();
+  
+  /// Returns the canonical path of the file with the given path, or an empty
+  /// string if the file does not exist.
+  QString CanonicalFilePath(const QString& path);
+  
+  /// Clears all cached paths.
+  void Invalidate();
+  
+ private:
+  CanonicalPathCache() = default;
+  
+  /// Maps the paths as given to CanonicalFilePath() to their canonical paths.
+  std::unordered_map<QString, QString> canonicalPaths;
+  std::mutex mutex;
+};
+
+/// Shorthand for CanonicalPathCache::Instance().CanonicalFilePath(path).
+inline QString CachedCanonicalFilePath(const QString& path) {
+  return CanonicalPathCache::Instance().CanonicalFilePath(path);
+}
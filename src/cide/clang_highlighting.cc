@@ -4,6 +4,8 @@
 
 #include "cide/clang_highlighting.h"
 
+#include <algorithm>
+
 #include <QColor>
 
 #include "cide/clang_utils.h"
@@ -11,6 +13,141 @@
 #include "cide/settings.h"
 #include "cide/text_utils.h"
 
+void ClangReferenceMap::Add(CXCursor referencedCursor, CXSourceRange range) {
+  CXCursor canonicalCursor = clang_getCanonicalCursor(referencedCursor);
+  unsigned hash = clang_hashCursor(canonicalCursor);
+  auto entryRange = entries.equal_range(hash);
+  for (auto it = entryRange.first; it != entryRange.second; ++ it) {
+    if (clang_equalCursors(it->second.canonicalCursor, canonicalCursor)) {
+      it->second.ranges.push_back(range);
+      return;
+    }
+  }
+  auto it = entries.insert(std::make_pair(hash, Entry()));
+  it->second.canonicalCursor = canonicalCursor;
+  it->second.ranges.push_back(range);
+}
+
+bool ClangReferenceMap::Find(CXCursor cursor, std::vector<CXSourceRange>* ranges) const {
+  CXCursor referencedCursor = clang_getCursorReferenced(cursor);
+  if (clang_Cursor_isNull(referencedCursor)) {
+    return false;
+  }
+  CXCursor canonicalCursor = clang_getCanonicalCursor(referencedCursor);
+  auto entryRange = entries.equal_range(clang_hashCursor(canonicalCursor));
+  for (auto it = entryRange.first; it != entryRange.second; ++ it) {
+    if (clang_equalCursors(it->second.canonicalCursor, canonicalCursor)) {
+      ranges->insert(ranges->end(), it->second.ranges.begin(), it->second.ranges.end());
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Adds @p cursor to data->referenceMap if it is a declaration or a reference
+/// of the kinds that clang_findReferencesInFile() reports.
+static void AddToReferenceMap(CXCursor cursor, CXCursorKind kind, HighlightingASTVisitorData* data) {
+  CXSourceRange range;
+  if (clang_isDeclaration(kind)) {
+    range = clang_Cursor_getSpellingNameRange(cursor, 0, 0);
+  } else if (clang_isReference(kind) ||
+             kind == CXCursor_DeclRefExpr ||
+             kind == CXCursor_MemberRefExpr) {
+    range = clang_getCursorReferenceNameRange(cursor, CXNameRange_WantSinglePiece, 0);
+  } else {
+    return;
+  }
+  if (clang_Range_isNull(range)) {
+    return;
+  }
+  
+  // When visiting the AST in chunks, cursors that overlap several chunks are
+  // visited multiple times. Only add the reference for the chunk that
+  // contains its start.
+  if (data->visitEnd > data->visitStart) {
+    unsigned offset;
+    clang_getFileLocation(clang_getRangeStart(range), nullptr, nullptr, nullptr, &offset);
+    if (offset < data->visitStart || offset >= data->visitEnd) {
+      return;
+    }
+  }
+  
+  CXCursor referencedCursor = clang_getCursorReferenced(cursor);
+  if (clang_Cursor_isNull(referencedCursor)) {
+    return;
+  }
+  data->referenceMap->Add(referencedCursor, range);
+}
+
+/// Chooses the color index for the variable @p name that is declared in the
+/// function whose variables got the colors @p functionColors in this
+/// highlighting pass so far, and @p previousFunctionColors (may be null) in
+/// the previous one. The variable keeps its previous color unless another
+/// variable took it already. Otherwise, the least used color is chosen,
+/// avoiding the colors that are likely to be taken by the other variables
+/// again.
+static int ChooseVariableColorIndex(const QByteArray& name, const std::unordered_map<QByteArray, int>& functionColors, const std::unordered_map<QByteArray, int>* previousFunctionColors, int poolSize) {
+  std::vector<int> usage(poolSize, 0);
+  for (const auto& item : functionColors) {
+    usage[item.second] += 2;
+  }
+  
+  if (previousFunctionColors) {
+    for (const auto& item : *previousFunctionColors) {
+      if (item.second >= poolSize) {
+        continue;
+      }
+      if (item.first == name) {
+        if (usage[item.second] == 0) {
+          return item.second;
+        }
+      } else if (functionColors.count(item.first) == 0) {
+        usage[item.second] |= 1;
+      }
+    }
+  }
+  
+  return std::min_element(usage.begin(), usage.end()) - usage.begin();
+}
+
+/// Returns the per-variable color for the variable that is declared by
+/// @p declCursor, or an invalid color if it is not declared in a function.
+/// The colors are assigned per function and variable name, such that they do
+/// not depend on the order in which the AST is visited.
+static QColor GetPerVariableColor(CXCursor declCursor, HighlightingASTVisitorData* data) {
+  unsigned offset;
+  clang_getFileLocation(clang_getCursorLocation(declCursor), nullptr, nullptr, nullptr, &offset);
+  auto cachedIt = data->perVariableColorMap.find(offset);
+  if (cachedIt != data->perVariableColorMap.end()) {
+    return cachedIt->second;
+  }
+  
+  QColor color;
+  CXCursor parent = clang_getCursorSemanticParent(declCursor);
+  if (IsFunctionDeclLikeCursorKind(clang_getCursorKind(parent))) {
+    QByteArray functionUSR = ClangString(clang_getCursorUSR(parent)).ToQByteArray();
+    QByteArray name = ClangString(clang_getCursorSpelling(declCursor)).ToQByteArray();
+    
+    std::unordered_map<QByteArray, int>& functionColors = data->variableColorIndices.byFunction[functionUSR];
+    auto it = functionColors.find(name);
+    if (it == functionColors.end()) {
+      const std::unordered_map<QByteArray, int>* previousFunctionColors = nullptr;
+      if (data->previousVariableColorIndices) {
+        auto previousIt = data->previousVariableColorIndices->byFunction.find(functionUSR);
+        if (previousIt != data->previousVariableColorIndices->byFunction.end()) {
+          previousFunctionColors = &previousIt->second;
+        }
+      }
+      int colorIndex = ChooseVariableColorIndex(name, functionColors, previousFunctionColors, data->variableColors.size());
+      it = functionColors.insert(std::make_pair(name, colorIndex)).first;
+    }
+    color = data->variableColors[it->second];
+  }
+  
+  data->perVariableColorMap[offset] = color;
+  return color;
+}
+
 bool IsWithinComment(int character, HighlightingASTVisitorData* visitorData) {
   for (const DocumentRange& range : visitorData->commentRanges) {
     if (range.ContainsCharacter(character)) {
@@ -64,20 +201,22 @@ void FindCommentMarkerRanges(CXToken* tokens, unsigned numTokens, HighlightingAS
   }
 }
 
-void ApplyCommentMarkerRanges(Document* document, const std::vector<DocumentRange>& ranges) {
-  const auto& commentMarkerStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::CommentMarker);
+void ApplyCommentMarkerRanges(HighlightBuffer* highlights, const std::vector<DocumentRange>& ranges) {
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
+  const auto& commentMarkerStyle = styles->GetTextStyle(Settings::TextStyle::CommentMarker);
   for (const DocumentRange& range : ranges) {
-    document->AddHighlightRange(range, true, commentMarkerStyle);
+    highlights->AddHighlightRange(range, true, commentMarkerStyle);
   }
 }
 
-void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numTokens, HighlightingASTVisitorData* visitorData) {
+void AddTokenHighlighting(HighlightBuffer* highlights, CXToken* tokens, unsigned numTokens, HighlightingASTVisitorData* visitorData) {
   constexpr bool kDebug = false;
   
-  const auto& languageKeywordStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::LanguageKeyword);
-  const auto& commentStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::Comment);
-  const auto& extraPunctuationStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ExtraPunctuation);
-  const auto& preprocessorDirectiveStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::PreprocessorDirective);
+  const Settings::StyleSnapshot& styles = *visitorData->styles;
+  const auto& languageKeywordStyle = styles.GetTextStyle(Settings::TextStyle::LanguageKeyword);
+  const auto& commentStyle = styles.GetTextStyle(Settings::TextStyle::Comment);
+  const auto& extraPunctuationStyle = styles.GetTextStyle(Settings::TextStyle::ExtraPunctuation);
+  const auto& preprocessorDirectiveStyle = styles.GetTextStyle(Settings::TextStyle::PreprocessorDirective);
   
   // Note: "#pragma once" is not reported via cursors at all. So we highlight it here via tokens.
   // The token sequence we need to watch out for is:
@@ -94,14 +233,14 @@ void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numToken
     
     if (kind == CXToken_Keyword) {
       DocumentRange tokenRange = CXSourceRangeToDocumentRange(clang_getTokenExtent(visitorData->TU, tokens[t]), *visitorData->lineOffsets);
-      document->AddHighlightRange(tokenRange, false, languageKeywordStyle);
+      highlights->AddHighlightRange(tokenRange, false, languageKeywordStyle);
       
       if (kDebug) {
         qDebug() << "Keyword token: " << ClangString(clang_getTokenSpelling(visitorData->TU, tokens[t])).ToQString();
       }
     } else if (kind == CXToken_Comment) {
       DocumentRange tokenRange = CXSourceRangeToDocumentRange(clang_getTokenExtent(visitorData->TU, tokens[t]), *visitorData->lineOffsets);
-      document->AddHighlightRange(tokenRange, true, commentStyle);
+      highlights->AddHighlightRange(tokenRange, true, commentStyle);
       
       visitorData->commentRanges.push_back(tokenRange);
       
@@ -114,7 +253,7 @@ void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numToken
       
       char token = clang_getCString(tokenSpelling)[0];
       if (token == ';' || token == '{' || token == '}') {
-        document->AddHighlightRange(tokenRange, false, extraPunctuationStyle);
+        highlights->AddHighlightRange(tokenRange, false, extraPunctuationStyle);
       } else if (token == '#') {
         visitorData->pragmaOnceState = 1;
         pragmaOnceStateUpdated = true;
@@ -139,7 +278,7 @@ void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numToken
           cSpelling[8] == 0) {
         // TODO: "override" only acts as a keyword in the correct context. So we should also only highlight it in this case, instead of highlighting it always.
         DocumentRange tokenRange = CXSourceRangeToDocumentRange(clang_getTokenExtent(visitorData->TU, tokens[t]), *visitorData->lineOffsets);
-        document->AddHighlightRange(tokenRange, false, languageKeywordStyle);
+        highlights->AddHighlightRange(tokenRange, false, languageKeywordStyle);
       } else if (visitorData->pragmaOnceState == 1 &&
                  cSpelling[0] == 'p' &&
                  cSpelling[1] == 'r' &&
@@ -166,7 +305,7 @@ void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numToken
           CXTokenKind kind = clang_getTokenKind(tokens[currentToken]);
           if (kind != CXToken_Comment) {
             DocumentRange tokenRange = CXSourceRangeToDocumentRange(clang_getTokenExtent(visitorData->TU, tokens[currentToken]), *visitorData->lineOffsets);
-            document->AddHighlightRange(tokenRange, false, preprocessorDirectiveStyle);
+            highlights->AddHighlightRange(tokenRange, false, preprocessorDirectiveStyle);
             
             -- tokensToHighlight;
           }
@@ -190,42 +329,45 @@ void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numToken
   }
 }
 
-CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+/// Visitor for the top-level cursors of the TU, see
+/// VisitMainFileAST_AddHighlightingAndContexts().
+static CXChildVisitResult VisitTopLevelCursor_AddHighlightingAndContexts(CXCursor cursor, CXCursor parent, CXClientData client_data) {
   HighlightingASTVisitorData* data = reinterpret_cast<HighlightingASTVisitorData*>(client_data);
-  Document* document = data->document;
   
-  const auto& macroDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::MacroDefinition);
-  const auto& macroInvocationStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::MacroInvocation);
-  const auto& templateParameterDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::TemplateParameterDefinition);
-  const auto& templateParameterUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::TemplateParameterUse);
-  const auto& variableDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::VariableDefinition);
-  const auto& variableUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::VariableUse);
-  const auto& memberVariableUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::MemberVariableUse);
-  const auto& typedefDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::TypedefDefinition);
-  const auto& typedefUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::TypedefUse);
-  const auto& enumConstantDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::EnumConstantDefinition);
-  const auto& enumConstantUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::EnumConstantUse);
-  const auto& constructorOrDestructorDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ConstructorOrDestructorDefinition);
-  const auto& constructorOrDestructorUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ConstructorOrDestructorUse);
-  const auto& functionDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::FunctionDefinition);
-  const auto& functionUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::FunctionUse);
-  const auto& unionDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::UnionDefinition);
-  // TODO: Union use?
-  const auto& enumDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::EnumDefinition);
-  // TODO: Enum use?
-  const auto& classOrStructDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ClassOrStructDefinition);
-  const auto& classOrStructUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ClassOrStructUse);
-  const auto& labelStatementStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::LabelStatement);
-  const auto& labelReferenceStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::LabelReference);
-  const auto& integerLiteralStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::IntegerLiteral);
-  const auto& floatingLiteralStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::FloatingLiteral);
-  const auto& imaginaryLiteralStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ImaginaryLiteral);
-  const auto& stringLiteralStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::StringLiteral);
-  const auto& characterLiteralStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::CharacterLiteral);
-  const auto& preprocessorDirectiveStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::PreprocessorDirective);
-  const auto& includePathStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::IncludePath);
-  const auto& namespaceDefinitionStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::NamespaceDefinition);
-  const auto& namespaceUseStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::NamespaceUse);
+  // Most top-level cursors are usually declarations in included files. Reject
+  // them based on their location only, which is cheaper to query than the
+  // extent that VisitClangAST_AddHighlightingAndContexts() needs.
+  CXFile file;
+  unsigned offset;
+  clang_getFileLocation(clang_getCursorLocation(cursor), &file, nullptr, nullptr, &offset);
+  if (!clang_File_isEqual(data->file, file)) {
+    return CXChildVisit_Continue;
+  }
+  
+  // The top-level cursors are visited in the order of their appearance in the
+  // file. So when visiting the AST in chunks, all remaining cursors of the file
+  // are after the chunk once a cursor starts after it.
+  if (data->visitEnd > data->visitStart && offset >= data->visitEnd) {
+    unsigned startOffset;
+    clang_getFileLocation(clang_getRangeStart(clang_getCursorExtent(cursor)), nullptr, nullptr, nullptr, &startOffset);
+    if (startOffset >= data->visitEnd) {
+      return CXChildVisit_Break;
+    }
+  }
+  
+  if (VisitClangAST_AddHighlightingAndContexts(cursor, parent, client_data) == CXChildVisit_Recurse) {
+    clang_visitChildren(cursor, &VisitClangAST_AddHighlightingAndContexts, client_data);
+  }
+  return CXChildVisit_Continue;
+}
+
+void VisitMainFileAST_AddHighlightingAndContexts(HighlightingASTVisitorData* data) {
+  clang_visitChildren(clang_getTranslationUnitCursor(data->TU), &VisitTopLevelCursor_AddHighlightingAndContexts, data);
+}
+
+CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+  HighlightingASTVisitorData* data = reinterpret_cast<HighlightingASTVisitorData*>(client_data);
+  HighlightBuffer* highlights = data->highlights;
   
   // Skip over cursors which are in included files
   CXSourceRange clangExtent = clang_getCursorExtent(cursor);
@@ -241,6 +383,52 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     return CXChildVisit_Continue;
   }
   
+  // Skip over cursors outside of the range to visit (if any)
+  if (data->visitEnd > data->visitStart) {
+    unsigned startOffset, endOffset;
+    clang_getFileLocation(extentStart, nullptr, nullptr, nullptr, &startOffset);
+    clang_getFileLocation(clang_getRangeEnd(clangExtent), nullptr, nullptr, nullptr, &endOffset);
+    if (endOffset <= data->visitStart || startOffset >= data->visitEnd) {
+      return CXChildVisit_Continue;
+    }
+  }
+  
+  // Resolve the styles only after skipping the cursors above, which are the
+  // majority in TUs with many included declarations.
+  const Settings::StyleSnapshot& styles = *data->styles;
+  const auto& macroDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::MacroDefinition);
+  const auto& macroInvocationStyle = styles.GetTextStyle(Settings::TextStyle::MacroInvocation);
+  const auto& templateParameterDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::TemplateParameterDefinition);
+  const auto& templateParameterUseStyle = styles.GetTextStyle(Settings::TextStyle::TemplateParameterUse);
+  const auto& variableDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::VariableDefinition);
+  const auto& variableUseStyle = styles.GetTextStyle(Settings::TextStyle::VariableUse);
+  const auto& memberVariableUseStyle = styles.GetTextStyle(Settings::TextStyle::MemberVariableUse);
+  const auto& typedefDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::TypedefDefinition);
+  const auto& typedefUseStyle = styles.GetTextStyle(Settings::TextStyle::TypedefUse);
+  const auto& enumConstantDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::EnumConstantDefinition);
+  const auto& enumConstantUseStyle = styles.GetTextStyle(Settings::TextStyle::EnumConstantUse);
+  const auto& constructorOrDestructorDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::ConstructorOrDestructorDefinition);
+  const auto& constructorOrDestructorUseStyle = styles.GetTextStyle(Settings::TextStyle::ConstructorOrDestructorUse);
+  const auto& functionDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::FunctionDefinition);
+  const auto& functionUseStyle = styles.GetTextStyle(Settings::TextStyle::FunctionUse);
+  const auto& unionDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::UnionDefinition);
+  // TODO: Union use?
+  const auto& enumDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::EnumDefinition);
+  // TODO: Enum use?
+  const auto& classOrStructDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::ClassOrStructDefinition);
+  const auto& classOrStructUseStyle = styles.GetTextStyle(Settings::TextStyle::ClassOrStructUse);
+  const auto& labelStatementStyle = styles.GetTextStyle(Settings::TextStyle::LabelStatement);
+  const auto& labelReferenceStyle = styles.GetTextStyle(Settings::TextStyle::LabelReference);
+  const auto& integerLiteralStyle = styles.GetTextStyle(Settings::TextStyle::IntegerLiteral);
+  const auto& floatingLiteralStyle = styles.GetTextStyle(Settings::TextStyle::FloatingLiteral);
+  const auto& imaginaryLiteralStyle = styles.GetTextStyle(Settings::TextStyle::ImaginaryLiteral);
+  const auto& stringLiteralStyle = styles.GetTextStyle(Settings::TextStyle::StringLiteral);
+  const auto& characterLiteralStyle = styles.GetTextStyle(Settings::TextStyle::CharacterLiteral);
+  const auto& preprocessorDirectiveStyle = styles.GetTextStyle(Settings::TextStyle::PreprocessorDirective);
+  const auto& includePathStyle = styles.GetTextStyle(Settings::TextStyle::IncludePath);
+  const auto& namespaceDefinitionStyle = styles.GetTextStyle(Settings::TextStyle::NamespaceDefinition);
+  const auto& namespaceUseStyle = styles.GetTextStyle(Settings::TextStyle::NamespaceUse);
+  
   // qDebug() << "Cursor kind:" << ClangString(clang_getCursorKindSpelling(clang_getCursorKind(cursor))).ToQString()
   //          << "Spelling:" << ClangString(clang_getCursorSpelling(cursor)).ToQString();
   
@@ -251,7 +439,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     
     data->macroExpansionRanges.push_back(std::make_pair(startOffset, endOffset));
     
-    document->AddHighlightRange(CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets), false, macroInvocationStyle);
+    highlights->AddHighlightRange(CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets), false, macroInvocationStyle);
     return CXChildVisit_Continue;
   }
   
@@ -276,6 +464,10 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     }
   }
   
+  if (data->referenceMap) {
+    AddToReferenceMap(cursor, clang_getCursorKind(cursor), data);
+  }
+  
   // Handle indent
   if (clang_equalCursors(parent, data->prevCursor)) {
     data->indent += "- ";
@@ -310,7 +502,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
 //   std::cout << std::endl;
 //   clang_disposeString(spelling);
 //   clang_disposeString(kindSpelling);
-  
+
   bool addContext = false;
   
   CXCursorKind kind = clang_getCursorKind(cursor);
@@ -334,45 +526,33 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
       
       // Determine whether to apply per-variable coloring to this definition.
       QColor overrideColor;
-      if (data->perVariableColoring && kind != CXCursor_FieldDecl && Settings::Instance().GetLocalVariableColorPoolSize() > 0) {
-        CXCursor parent = clang_getCursorSemanticParent(cursor);
-        CXCursorKind parentKind = clang_getCursorKind(parent);
-        if (IsFunctionDeclLikeCursorKind(parentKind)) {
-          // Apply per-variable coloring.
-          unsigned offset;
-          clang_getFileLocation(clang_getCursorLocation(cursor), nullptr, nullptr, nullptr, &offset);
-          overrideColor = Settings::Instance().GetLocalVariableColor(data->variableCounterPerFunction % Settings::Instance().GetLocalVariableColorPoolSize());
-          data->perVariableColorMap[offset] = overrideColor;
-          ++ data->variableCounterPerFunction;
-        }
+      if (data->perVariableColoring && kind != CXCursor_FieldDecl && !data->variableColors.empty()) {
+        overrideColor = GetPerVariableColor(cursor, data);
       }
       
       if (overrideColor.isValid()) {
         // We usually override the text color, but do override the background color instead if the style does not affect the text color.
-        document->AddHighlightRange(spellingRange, false, overrideColor, style.bold, style.affectsText, style.affectsBackground, style.affectsText ? style.backgroundColor : overrideColor);
+        highlights->AddHighlightRange(spellingRange, false, overrideColor, style.bold, style.affectsText, style.affectsBackground, style.affectsText ? style.backgroundColor : overrideColor);
       } else {
-        document->AddHighlightRange(spellingRange, false, style);
+        highlights->AddHighlightRange(spellingRange, false, style);
       }
     }
   } else if (kind == CXCursor_TypedefDecl) {
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, typedefDefinitionStyle);
+    highlights->AddHighlightRange(spellingRange, false, typedefDefinitionStyle);
   } else if (kind == CXCursor_EnumConstantDecl) {
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, enumConstantDefinitionStyle);
+    highlights->AddHighlightRange(spellingRange, false, enumConstantDefinitionStyle);
   } else if (IsFunctionDeclLikeCursorKind(kind)) {
     bool isConstructorOrDestructor = kind == CXCursor_Constructor || kind == CXCursor_Destructor;
     
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, isConstructorOrDestructor ? constructorOrDestructorDefinitionStyle : functionDefinitionStyle);
-    
-    data->variableCounterPerFunction = 0;
-    data->perVariableColorMap.clear();
+    highlights->AddHighlightRange(spellingRange, false, isConstructorOrDestructor ? constructorOrDestructorDefinitionStyle : functionDefinitionStyle);
     
     addContext = clang_isCursorDefinition(cursor);
   } else if (kind == CXCursor_UnionDecl || kind == CXCursor_EnumDecl) {
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, (kind == CXCursor_UnionDecl) ? unionDefinitionStyle : enumDefinitionStyle);
+    highlights->AddHighlightRange(spellingRange, false, (kind == CXCursor_UnionDecl) ? unionDefinitionStyle : enumDefinitionStyle);
     addContext = clang_isCursorDefinition(cursor);
   } else if (kind == CXCursor_ClassTemplate ||
              kind == CXCursor_ClassDecl ||
@@ -391,8 +571,8 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     } else {
       style = &classOrStructDefinitionStyle;
     }
-    document->AddHighlightRange(spellingRange, false, *style);
-  
+    highlights->AddHighlightRange(spellingRange, false, *style);
+    
     // Add a contexts for definitions (not for forward declarations).
     addContext = kind != CXCursor_TypeRef && clang_isCursorDefinition(cursor);
   } else if (kind == CXCursor_CallExpr) {
@@ -400,7 +580,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     CXCursorKind referencedKind = clang_getCursorKind(referencedCursor);
     if (referencedKind == CXCursor_Constructor) {
       DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-      document->AddHighlightRange(spellingRange, false, constructorOrDestructorUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, constructorOrDestructorUseStyle);
     }
   } else if (kind == CXCursor_MemberRefExpr) {
     // Find out whether the member is a function or an attribute
@@ -408,13 +588,13 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     CXCursorKind memberKind = clang_getCursorKind(memberCursor);
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
     if (memberKind == CXCursor_FieldDecl) {
-      document->AddHighlightRange(spellingRange, false, memberVariableUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, memberVariableUseStyle);
     } else if (memberKind == CXCursor_CXXMethod ||
                memberKind == CXCursor_ConversionFunction ||
                memberKind == CXCursor_OverloadedDeclRef) {
-      document->AddHighlightRange(spellingRange, false, functionUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, functionUseStyle);
     } else if (memberKind == CXCursor_Destructor){
-      document->AddHighlightRange(spellingRange, false, constructorOrDestructorUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, constructorOrDestructorUseStyle);
     } else if (memberKind == CXCursor_InvalidFile) {
       // This happens for calling functions on template types, for example
       // for "SomeFunction" here:
@@ -424,7 +604,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
       // }
       // In this case, the spelling range is only "T", while the extent
       // is "T.SomeFunction".
-      document->AddHighlightRange(CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets), false, functionUseStyle);
+      highlights->AddHighlightRange(CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets), false, functionUseStyle);
     } else {
       qDebug() << "Warning: MemberRefExpr cursor to unhandled member type" << memberKind;
     }
@@ -452,22 +632,23 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
     
     if (IsFunctionDeclLikeCursorKind(referencedKind)) {
       DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-      document->AddHighlightRange(spellingRange, false, functionUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, functionUseStyle);
     } else if (referencedKind == CXCursor_EnumConstantDecl) {
       DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-      document->AddHighlightRange(spellingRange, false, enumConstantUseStyle);
+      highlights->AddHighlightRange(spellingRange, false, enumConstantUseStyle);
     } else if (referencedKind == CXCursor_VarDecl || referencedKind == CXCursor_ParmDecl) {
       QColor color = variableUseStyle.textColor;
       
-      if (data->perVariableColoring) {
+      if (data->perVariableColoring && !data->variableColors.empty()) {
         if (!clang_Cursor_isNull(referencedCursor)) {
+          // Note that the reference may be visited before the definition if
+          // the AST is visited in chunks (see HighlightingASTVisitorData::visitStart).
           CXFile referencedFile;
-          unsigned offset;
-          clang_getFileLocation(clang_getCursorLocation(referencedCursor), &referencedFile, nullptr, nullptr, &offset);
+          clang_getFileLocation(clang_getCursorLocation(referencedCursor), &referencedFile, nullptr, nullptr, nullptr);
           if (clang_File_isEqual(referencedFile, data->file)) {
-            auto it = data->perVariableColorMap.find(offset);
-            if (it != data->perVariableColorMap.end()) {
-              color = it->second;
+            QColor variableColor = GetPerVariableColor(referencedCursor, data);
+            if (variableColor.isValid()) {
+              color = variableColor;
             }
           }
         }
@@ -475,7 +656,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
       
       // We usually override the text color, but do override the background color instead if the style does not affect the text color.
       DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
-      document->AddHighlightRange(range, false, color, variableUseStyle.bold, variableUseStyle.affectsText, variableUseStyle.affectsBackground, variableUseStyle.affectsText ? variableUseStyle.backgroundColor : color);
+      highlights->AddHighlightRange(range, false, color, variableUseStyle.bold, variableUseStyle.affectsText, variableUseStyle.affectsBackground, variableUseStyle.affectsText ? variableUseStyle.backgroundColor : color);
     } else {
       qDebug() << "Clang highlighting: Encountered CXCursor_DeclRefExpr cursor which references an unhandled cursor kind: " << ClangString(clang_getCursorKindSpelling(referencedKind)).ToQString();
     }
@@ -495,10 +676,10 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
       qDebug() << "Clang highlighting: Encountered CXCursor_TemplateRef cursor that references an unhandled cursor type: " << ClangString(clang_getCursorKindSpelling(referencedKind)).ToQString();
     }
     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
-    document->AddHighlightRange(range, false, *style);
+    highlights->AddHighlightRange(range, false, *style);
   } else if (kind == CXCursor_LabelStmt || kind == CXCursor_LabelRef) {
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, (kind == CXCursor_LabelStmt) ? labelStatementStyle : labelReferenceStyle);
+    highlights->AddHighlightRange(spellingRange, false, (kind == CXCursor_LabelStmt) ? labelStatementStyle : labelReferenceStyle);
   } else if (kind == CXCursor_CXXStaticCastExpr ||
              kind == CXCursor_CXXDynamicCastExpr ||
              kind == CXCursor_CXXReinterpretCastExpr ||
@@ -510,18 +691,18 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
 //     document->AddHighlightRange(range, false, qRgb(0, 0, 0), true);
   } else if (kind == CXCursor_IntegerLiteral) {
     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
-    document->AddHighlightRange(range, false, integerLiteralStyle);
+    highlights->AddHighlightRange(range, false, integerLiteralStyle);
   } else if (kind == CXCursor_FloatingLiteral ||
              kind == CXCursor_ImaginaryLiteral) {
     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
-    document->AddHighlightRange(range, false, (kind == CXCursor_FloatingLiteral) ? floatingLiteralStyle : imaginaryLiteralStyle);
+    highlights->AddHighlightRange(range, false, (kind == CXCursor_FloatingLiteral) ? floatingLiteralStyle : imaginaryLiteralStyle);
   } else if (kind == CXCursor_StringLiteral ||
              kind == CXCursor_CharacterLiteral) {
     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
-    document->AddHighlightRange(range, true, (kind == CXCursor_StringLiteral) ? stringLiteralStyle : characterLiteralStyle);
+    highlights->AddHighlightRange(range, true, (kind == CXCursor_StringLiteral) ? stringLiteralStyle : characterLiteralStyle);
   } else if (kind == CXCursor_MacroDefinition) {
 //     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent);
-    
+
     // The macro definition range does not include the "#define" unfortunately.
     // We have to find it manually, going back from the start of the definition
     // range and skipping over comments, whitespace, and \ characters at the ends
@@ -542,16 +723,16 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
 //         document->AddHighlightRange(defineRange, false, qRgb(5, 113, 44), false);
 //       }
 //     }
-    
+
     DocumentRange nameRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(nameRange, false, macroDefinitionStyle);
+    highlights->AddHighlightRange(nameRange, false, macroDefinitionStyle);
   } else if (kind == CXCursor_InclusionDirective) {
     DocumentRange range = CXSourceRangeToDocumentRange(clangExtent, *data->lineOffsets);
     
     DocumentRange includeRange;
     includeRange.start = range.start;
     includeRange.end.offset = range.start.offset + 8;
-    document->AddHighlightRange(includeRange, false, preprocessorDirectiveStyle);
+    highlights->AddHighlightRange(includeRange, false, preprocessorDirectiveStyle);
     
     // Highlight the path range. Unfortunately, it seems that we cannot retrieve
     // it directly. Include statements can go over multiple lines (with the \ separator)
@@ -574,13 +755,13 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
           DocumentRange pathRange;
           pathRange.end = range.end;
           pathRange.start = range.end - (rangeText.size() - c);
-          document->AddHighlightRange(pathRange, true, includePathStyle);
+          highlights->AddHighlightRange(pathRange, true, includePathStyle);
         }
       }
     }
   } else if (kind == CXCursor_Namespace || kind == CXCursor_NamespaceRef) {
     DocumentRange spellingRange = CXSourceRangeToDocumentRange(clang_Cursor_getSpellingNameRange(cursor, 0, 0), *data->lineOffsets);
-    document->AddHighlightRange(spellingRange, false, (kind == CXCursor_Namespace) ? namespaceDefinitionStyle : namespaceUseStyle);
+    highlights->AddHighlightRange(spellingRange, false, (kind == CXCursor_Namespace) ? namespaceDefinitionStyle : namespaceUseStyle);
   }
   
   if (addContext) {
@@ -633,7 +814,7 @@ CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXC
       }
     }
     
-    document->AddContext(
+    highlights->AddContext(
         name,
         displayName,
         (namePos >= 0) ? DocumentRange(namePos, namePos + name.size()) : DocumentRange::Invalid(),
@@ -12,20 +12,73 @@
 #include <QColor>
 
 #include "cide/document_range.h"
+#include "cide/settings.h"
+#include "cide/util.h"
 
-class Document;
+struct HighlightBuffer;
+
+
+/// The colors that were assigned to the local variables of a file for
+/// per-variable coloring, as indices into the local variable color pool. The
+/// variables are grouped by the USR of the function that declares them, and
+/// identified by their name within it.
+struct VariableColorIndices {
+  std::unordered_map<QByteArray, std::unordered_map<QByteArray, int>> byFunction;
+};
+
+
+/// The references within the main file of a TU, grouped by the canonical
+/// declaration cursor that they refer to. This is filled while visiting the
+/// AST for highlighting (see VisitClangAST_AddHighlightingAndContexts()), such
+/// that the references to a cursor can be looked up without traversing the AST
+/// again, as clang_findReferencesInFile() does. The ranges are only valid as
+/// long as the TU is not reparsed or disposed.
+class ClangReferenceMap {
+ public:
+  inline explicit ClangReferenceMap(CXFile file)
+      : mFile(file) {}
+  
+  /// Adds a reference to (or a declaration of) @p referencedCursor at @p range.
+  void Add(CXCursor referencedCursor, CXSourceRange range);
+  
+  /// Appends the ranges of all references to the cursor that @p cursor refers
+  /// to (or of all declarations of @p cursor, if it is a declaration) to
+  /// @p ranges. Returns false if the map does not contain the cursor, in which
+  /// case its references need to be searched for otherwise.
+  bool Find(CXCursor cursor, std::vector<CXSourceRange>* ranges) const;
+  
+  /// Returns the file that the references are located in.
+  inline CXFile file() const { return mFile; }
+  
+ private:
+  struct Entry {
+    CXCursor canonicalCursor;
+    std::vector<CXSourceRange> ranges;
+  };
+  
+  /// Maps clang_hashCursor() of the canonical cursors to the entries.
+  std::unordered_multimap<unsigned, Entry> entries;
+  
+  CXFile mFile;
+};
 
 
 /// Data that needs to be passed to the visitor function visiting libclang's AST,
 /// VisitClangAST_AddHighlightingAndContexts() (and related functions).
 struct HighlightingASTVisitorData {
-  /// The document being parsed.
-  Document* document;
+  /// Receives the highlight ranges and contexts for the document being parsed.
+  HighlightBuffer* highlights;
   
   CXTranslationUnit TU;
   CXFile file;
   std::vector<unsigned>* lineOffsets;
   
+  /// If visitEnd > visitStart, only cursors whose extent overlaps the file
+  /// offsets [visitStart, visitEnd) are visited (together with their children).
+  /// This allows to visit the AST in chunks.
+  unsigned visitStart = 0;
+  unsigned visitEnd = 0;
+  
   /// Ranges of all comments in the document.
   std::vector<DocumentRange> commentRanges;
   
@@ -36,10 +89,24 @@ struct HighlightingASTVisitorData {
   /// State for highlighting "#pragma once" (consisting of a sequence of tokens)
   int pragmaOnceState = 0;
   
+  /// The configured text styles, which are used for the whole highlighting pass.
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
+  
+  /// If non-null, receives the references within the file.
+  ClangReferenceMap* referenceMap = nullptr;
+  
   // Per-variable coloring for local variables
   bool perVariableColoring;
-  int variableCounterPerFunction = 0;
-  /// Maps file offsets of variable definitions to their assigned colors.
+  /// The local variable color pool (see Settings::GetLocalVariableColor()).
+  std::vector<QColor> variableColors;
+  /// If non-null, the colors that were assigned in the previous highlighting
+  /// pass for the file. Variables keep their previous colors if possible, such
+  /// that edits do not change the colors of the other variables.
+  const VariableColorIndices* previousVariableColorIndices = nullptr;
+  /// The colors that are assigned in this highlighting pass.
+  VariableColorIndices variableColorIndices;
+  /// Maps file offsets of variable declarations to their assigned colors
+  /// (which are invalid for variables that are not declared in a function).
   std::unordered_map<unsigned, QColor> perVariableColorMap;
   
   // NOTE: For debug printing only:
@@ -53,10 +120,17 @@ struct HighlightingASTVisitorData {
 void FindCommentMarkerRanges(CXToken* tokens, unsigned numTokens, HighlightingASTVisitorData* visitorData, std::vector<DocumentRange>* ranges);
 
 /// Adds highlight ranges for the given comment marker ranges found by FindCommentMarkerRanges().
-void ApplyCommentMarkerRanges(Document* document, const std::vector<DocumentRange>& ranges);
+void ApplyCommentMarkerRanges(HighlightBuffer* highlights, const std::vector<DocumentRange>& ranges);
 
 /// Adds highlighting ranges to the document based on the given tokens.
-void AddTokenHighlighting(Document* document, CXToken* tokens, unsigned numTokens, HighlightingASTVisitorData* visitorData);
+void AddTokenHighlighting(HighlightBuffer* highlights, CXToken* tokens, unsigned numTokens, HighlightingASTVisitorData* visitorData);
 
 /// AST visitor function for libclang to add syntax highlighting ranges and extract "contexts" for navigation.
 CXChildVisitResult VisitClangAST_AddHighlightingAndContexts(CXCursor cursor, CXCursor parent, CXClientData client_data);
+
+/// Visits the AST of @p data->TU with VisitClangAST_AddHighlightingAndContexts(),
+/// starting from the top-level cursors in @p data->file only. The top-level
+/// cursors of included files are rejected cheaply without visiting them, and
+/// when visiting a chunk, the visit stops after the chunk's last top-level
+/// cursor. Use this instead of visiting the TU cursor's children directly.
+void VisitMainFileAST_AddHighlightingAndContexts(HighlightingASTVisitorData* data);
@@ -4,56 +4,74 @@
 
 #include "cide/clang_parser.h"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <iterator>
 
 #include <clang-c/Index.h>
 #include <QMessageBox>
 
+#include "cide/background_reclaimer.h"
+#include "cide/canonical_path_cache.h"
 #include "cide/clang_highlighting.h"
 #include "cide/clang_index.h"
 #include "cide/clang_utils.h"
+#include "cide/comment_marker_index.h"
+#include "cide/diagnostics_sweep.h"
 #include "cide/document.h"
+#include "cide/file_id_table.h"
+#include "cide/index_service.h"
+#include "cide/index_worker.h"
+#include "cide/indexing_statistics.h"
 #include "cide/main_window.h"
 #include "cide/parse_thread_pool.h"
+#include "cide/preamble_cache.h"
+#include "cide/profiler.h"
 #include "cide/problem.h"
 #include "cide/project.h"
 #include "cide/qt_thread.h"
 #include "cide/settings.h"
 #include "cide/text_utils.h"
+#include "cide/tu_cache.h"
+#include "cide/usr_index_cache.h"
 
 
-void RetrieveDiagnostics(Document* document, CXFile file, const std::shared_ptr<ClangTU>& TU, const std::vector<unsigned>& lineOffsets) {
-  document->ClearProblems();
-  
+/// Retrieves the problems of the parsed TU into @p highlights. @p document is
+/// only read from; it must contain the text which the TU was parsed with.
+void RetrieveDiagnostics(Document* document, HighlightBuffer* highlights, CXFile file, const std::shared_ptr<ClangTU>& TU, const std::vector<unsigned>& lineOffsets) {
   std::vector<Problem*> lastProblems;
   
   auto addProblem = [&](CXDiagnostic diagnostic, CXDiagnostic diagnosticForRanges, CXSourceLocation diagnosticLoc, int diagnosticLine, CXDiagnosticSeverity severity) {
     // Add warning/error line attribute to color the line in green/red
-    document->AddLineAttributes(
-        diagnosticLine,
-        (severity == CXDiagnostic_Warning) ?
-            static_cast<int>(LineAttribute::Warning) :
-            static_cast<int>(LineAttribute::Error));
+    if (diagnosticLine >= 0 && diagnosticLine < lineOffsets.size()) {
+      highlights->AddProblemLineAttributes(
+          DocumentLocation(lineOffsets[diagnosticLine]),
+          (severity == CXDiagnostic_Warning) ?
+              static_cast<int>(LineAttribute::Warning) :
+              static_cast<int>(LineAttribute::Error));
+    }
     
     // Create the problem and add it to the document
     std::shared_ptr<Problem> newProblem(new Problem(diagnostic, TU->TU(), lineOffsets));
-    int problemIndex = document->AddProblem(newProblem);
+    int problemIndex = highlights->AddProblem(newProblem);
     lastProblems.push_back(newProblem.get());
     
     // Add the problem ranges to the document to underline them
     unsigned numRanges = clang_getDiagnosticNumRanges(diagnosticForRanges);
     for (int rangeIndex = 0; rangeIndex < numRanges; ++ rangeIndex) {
       CXSourceRange range = clang_getDiagnosticRange(diagnosticForRanges, rangeIndex);
-      document->AddProblemRange(problemIndex, CXSourceRangeToDocumentRange(range, lineOffsets));
+      highlights->AddProblemRange(problemIndex, CXSourceRangeToDocumentRange(range, *document));
     }
     
     // Since many types of problems do not have ranges associated with them,
     // determine the word that contains the given problem location and add it
     // as an additional range.
-    // TODO: We would need to transform this location through all edits that
-    //       happened between the parse and now if we apply parse results to
-    //       updated document versions.
-    DocumentLocation diagnosticDocLoc = CXSourceLocationToDocumentLocation(diagnosticLoc, lineOffsets);
+    // NOTE: This uses the parsed version of the document. If it changed in the
+    //       meantime, the resulting range gets rebased with the other results.
+    DocumentLocation diagnosticDocLoc = CXSourceLocationToDocumentLocation(diagnosticLoc, *document);
     Document::CharacterIterator charIt(document, diagnosticDocLoc.offset);
     if (diagnosticDocLoc.offset > 0 &&
         charIt.IsValid() &&
@@ -80,19 +98,12 @@ void RetrieveDiagnostics(Document* document, CXFile file, const std::shared_ptr<
       }
       
       // NOTE: Could check for overlaps with existing ranges here and merge
-      document->AddProblemRange(problemIndex, DocumentRange(wordStartIt.GetCharacterOffset(), wordEndIt.GetCharacterOffset()));
+      highlights->AddProblemRange(problemIndex, DocumentRange(wordStartIt.GetCharacterOffset(), wordEndIt.GetCharacterOffset()));
     }
     
     return newProblem;
   };
   
-  // Clear warning/error line attributes
-  Document::LineIterator lineIt(document);
-  while (lineIt.IsValid()) {
-    lineIt.SetAttributes(lineIt.GetAttributes() & ~(static_cast<int>(LineAttribute::Warning) | static_cast<int>(LineAttribute::Error)));
-    ++ lineIt;
-  }
-  
   // Loop over all diagnostics from libclang
   unsigned numDiagnostics = clang_getNumDiagnostics(TU->TU());
   for (unsigned diagnosticIndex = 0; diagnosticIndex < numDiagnostics; ++ diagnosticIndex) {
@@ -171,26 +182,197 @@ void VisitInclusions_GetPathsAndLastModificationTimes(
 }
 
 
+/// Documents with at least this number of lines are highlighted in chunks
+/// when they are parsed for the first time, starting with the visible lines.
+constexpr int kStreamingHighlightingMinLineCount = 20000;
+constexpr int kStreamingHighlightingChunkLineCount = 20000;
+/// Number of lines above and below the visible lines that are highlighted
+/// together with the visible lines.
+constexpr int kStreamingHighlightingMarginLines = 200;
+
+/// Maximum time that a reparse waits for a TU of its document while all of
+/// them are in use by code info requests.
+constexpr std::chrono::seconds kTUWaitTimeout(30);
+
+/// If at least this number of USRMaps is dropped at once (for example, when
+/// closing or reconfiguring a project), the freed memory is returned to the
+/// operating system after freeing them. Otherwise, the heap would often keep
+/// the memory since it is fragmented by the many small allocations.
+constexpr int kMinDroppedUSRMapsForReturningMemory = 64;
+
+/// Adds the highlight ranges and contexts for the lines [firstLine, endLine)
+/// of the parsed file to visitorData->highlights. If @p restrictToLines is
+/// false, the whole file is processed. @p tokens must contain the tokens of
+/// the whole file, and @p commentMarkerRanges the result of
+/// FindCommentMarkerRanges() for them. @p documentSize and @p utf8FileSize
+/// give the size of the file in UTF-16 and UTF-8 characters.
+static void AddHighlightingForLines(
+    int firstLine, int endLine, bool restrictToLines,
+    CXToken* tokens, unsigned numTokens,
+    const std::vector<DocumentRange>& commentMarkerRanges,
+    int documentSize, unsigned utf8FileSize,
+    HighlightingASTVisitorData* visitorData) {
+  HighlightBuffer* highlights = visitorData->highlights;
+  const std::vector<unsigned>& lineOffsets = *visitorData->lineOffsets;
+  int lineCount = lineOffsets.size();
+  if (firstLine >= endLine) {
+    return;
+  }
+  
+  unsigned firstToken = 0;
+  unsigned endToken = numTokens;
+  if (restrictToLines) {
+    // Get the range of the lines in UTF-16 and UTF-8 (libclang file) offsets
+    highlights->chunkRange = DocumentRange(
+        lineOffsets[firstLine],
+        (endLine < lineCount) ? lineOffsets[endLine] : documentSize);
+    
+    auto getLineFileOffset = [&](int line) {
+      if (line >= lineCount) {
+        return utf8FileSize;
+      }
+      unsigned offset;
+      clang_getFileLocation(clang_getLocation(visitorData->TU, visitorData->file, line + 1, 1), nullptr, nullptr, nullptr, &offset);
+      return offset;
+    };
+    visitorData->visitStart = getLineFileOffset(firstLine);
+    visitorData->visitEnd = getLineFileOffset(endLine);
+    
+    // Find the tokens that start within the lines (the tokens are sorted)
+    auto findFirstTokenAtOrAfter = [&](unsigned fileOffset) {
+      unsigned low = 0;
+      unsigned high = numTokens;
+      while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        unsigned tokenOffset;
+        clang_getFileLocation(clang_getTokenLocation(visitorData->TU, tokens[mid]), nullptr, nullptr, nullptr, &tokenOffset);
+        if (tokenOffset < fileOffset) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      return low;
+    };
+    firstToken = findFirstTokenAtOrAfter(visitorData->visitStart);
+    endToken = findFirstTokenAtOrAfter(visitorData->visitEnd);
+  }
+  
+  AddTokenHighlighting(highlights, tokens + firstToken, endToken - firstToken, visitorData);
+  ApplyCommentMarkerRanges(highlights, commentMarkerRanges);
+  
+  // Visit the resulting AST and extract information for highlighting
+  VisitMainFileAST_AddHighlightingAndContexts(visitorData);
+  
+  highlights->chunkRange = DocumentRange::Invalid();
+  visitorData->visitStart = 0;
+  visitorData->visitEnd = 0;
+}
+
+
+/// Returns the total number of USRs in @p USRs.
+static int CountUSRs(const USRsByFile& USRs) {
+  int count = 0;
+  for (const auto& item : USRs) {
+    count += item.second.size();
+  }
+  return count;
+}
+
+/// Returns the libclang parse options for parsing files for indexing only.
+/// Sets @p functionBodiesSkipped to whether the options include
+/// CXTranslationUnit_SkipFunctionBodies.
+static unsigned GetIndexingParseOptions(bool* functionBodiesSkipped) {
+  unsigned parseOptions =
+      CXTranslationUnit_Incomplete |
+      CXTranslationUnit_KeepGoing;
+  *functionBodiesSkipped = false;
+  #if CINDEX_VERSION_MINOR >= 47
+    // Function bodies are not needed for indexing declarations, since
+    // VisitClangAST_StoreUSRs() does not store declarations within them.
+    // The references within them are missing from the USR reference index
+    // then, which is recorded with USRMap::referencesComplete. Unfortunately,
+    // libclang cannot restrict the skipping to included files (except for
+    // the preamble, which we do not create for indexing). Also, libclang does
+    // not report functions with skipped bodies as definitions anymore, which
+    // FunctionHasSkippedBody() compensates for (this requires
+    // clang_getFileContents(), thus the version check).
+    parseOptions |= CXTranslationUnit_SkipFunctionBodies;
+    *functionBodiesSkipped = true;
+  #endif
+  return parseOptions;
+}
+
+/// Returns the path of a source file of @p project that includes the header
+/// with the given path and that the header should be parsed with, or an empty
+/// string if the file is not such a header. Includers that are open in the
+/// editor are preferred (recently current ones first), since their files are
+/// likely in the OS cache and their context matches what the user works on.
+/// Otherwise, the includer with the smallest path is returned, such that the
+/// choice is stable between parses and the header's TU can be reparsed.
+static QString FindIncluderForParsingHeader(const QString& canonicalPath, Project* project, MainWindow* mainWindow) {
+  if (project->GetSourceFile(canonicalPath)) {
+    return QString();
+  }
+  
+  std::unordered_set<QString> includers;
+  project->FindAllFilesThatInclude(canonicalPath, &includers);
+  
+  QString bestIncluder;
+  int bestRank = -1;
+  for (const QString& includer : includers) {
+    int rank;
+    if (ParseThreadPool::Instance().UseFullParseProfileFor(includer)) {
+      rank = 2;
+    } else if (mainWindow->GetDocumentForPath(includer)) {
+      rank = 1;
+    } else {
+      rank = 0;
+    }
+    if (rank > bestRank || (rank == bestRank && includer < bestIncluder)) {
+      bestIncluder = includer;
+      bestRank = rank;
+    }
+  }
+  return bestIncluder;
+}
+
 /// @p document may be null. In this case, @p canonicalPath must be valid. If
 /// @p document is valid, @p canonicalPath may be empty. @p canonicalPath must
 /// be given if @p alwaysIndex is true.
 void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWindow* mainWindow, bool alwaysIndex) {
-  std::vector<QByteArray> commandLineArgs;
+  ProfilerScope profilerScope(document ? "ParseFile" : "IndexFile");
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  
+  std::shared_ptr<const CompileCommandLine> commandLine;
   std::vector<const char*> commandLineArgPtrs;
   std::vector<CXUnsavedFile> unsavedFiles;
-  std::vector<std::string> unsavedFileContents;
-  std::vector<std::string> unsavedFilePaths;
+  std::vector<std::shared_ptr<const QByteArray>> unsavedFileContents;
+  std::vector<QByteArray> unsavedFilePaths;
   
   std::vector<unsigned> lineOffsets;
   unsigned utf8FileSize = 0;
   
+  /// Path of the main file of the TU. This differs from canonicalPath for
+  /// headers that are parsed in the context of an including source file.
+  QString mainFilePath;
+  
   CompileSettings* settings = nullptr;
   std::shared_ptr<CompileSettings> settingsDeleter;
   std::shared_ptr<ClangTU> TU;
+  unsigned int TUReturnCounter = 0;
   QString parseSettingsAreGuessedNotification;
   QString parseNotification;
-  int parsedDocumentVersion = -1;
+  int parsedTextChangeCounter = -1;
+  std::size_t preambleHash = 0;
+  std::shared_ptr<const DocumentSnapshot> parsedDocumentSnapshot;
+  bool streamHighlighting = false;
+  int visibleFirstLine = 0;
+  int visibleLastLine = 0;
   bool usePerVariableColoring;
+  std::vector<QColor> localVariableColors;
+  bool useTUCache;
+  bool useReducedParseProfile = false;
   bool exit = false;
   
   RunInQtThreadBlocking([&]() {
@@ -210,10 +392,19 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
     
     if (document) {
       canonicalPath = QFileInfo(document->path()).canonicalFilePath();
-      parsedDocumentVersion = document->version();
+      parsedTextChangeCounter = document->textChangeCounter();
+      preambleHash = document->preambleHash();
+      
+      // Keep the parsed text for retrieving the diagnostics in the background
+      // thread. This is cheap since the text blocks are shared.
+      parsedDocumentSnapshot = document->UpdateSnapshot();
+      if (!parsedDocumentSnapshot) {
+        parsedDocumentSnapshot.reset(new DocumentSnapshot(document));
+      }
     }
     
     // Find the parse settings for the source file
+    ProfilerScope settingsScope("Settings lookup");
     bool settingsAreGuessed;
     std::shared_ptr<Project> usedProject;
     settings = FindParseSettingsForFile(canonicalPath, mainWindow->GetProjects(), &usedProject, &settingsAreGuessed);
@@ -247,49 +438,103 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
       return;
     }
     
-    commandLineArgs = settings->BuildCommandLineArgs(true, canonicalPath, usedProject.get());
-    commandLineArgPtrs.resize(commandLineArgs.size());
-    for (int i = 0; i < commandLineArgs.size(); ++ i) {
-      commandLineArgPtrs[i] = commandLineArgs[i].data();
+    // Parse headers of a project in the context of a source file that includes
+    // them, rather than standalone. This way, the header sees the same
+    // preprocessor state as when it is compiled, which avoids spurious errors
+    // (and the reparses that these cause) for headers that are not
+    // self-contained. Highlighting, diagnostics, and code info are then
+    // restricted to the header's CXFile within the includer's TU.
+    mainFilePath = canonicalPath;
+    if (document && usedProject && !settingsAreGuessed) {
+      QString includerPath = FindIncluderForParsingHeader(canonicalPath, usedProject.get(), mainWindow);
+      bool includerSettingsAreGuessed;
+      int guessQuality;
+      CompileSettings* includerSettings = includerPath.isEmpty() ? nullptr : usedProject->FindSettingsForFile(includerPath, &includerSettingsAreGuessed, &guessQuality);
+      if (includerSettings && !includerSettingsAreGuessed) {
+        mainFilePath = includerPath;
+        settings = includerSettings;
+      }
+    }
+    
+    commandLine = settings->GetCommandLine(true, mainFilePath, usedProject.get());
+    commandLineArgPtrs.resize(commandLine->args.size());
+    for (int i = 0; i < commandLine->args.size(); ++ i) {
+      commandLineArgPtrs[i] = commandLine->args[i].constData();
     }
+    settingsScope.End();
     // qDebug() << "PARSE ARGS: ";
-    // for (QByteArray& arg : commandLineArgs) {
+    // for (const QByteArray& arg : commandLine->args) {
     //   qDebug() << "  " << arg;
     // }
     
     
     usePerVariableColoring = Settings::Instance().GetUsePerVariableColoring();
+    if (usePerVariableColoring) {
+      int poolSize = Settings::Instance().GetLocalVariableColorPoolSize();
+      localVariableColors.reserve(poolSize);
+      for (int i = 0; i < poolSize; ++ i) {
+        localVariableColors.emplace_back(Settings::Instance().GetLocalVariableColor(i));
+      }
+    }
+    useTUCache = Settings::Instance().GetUseTUCache();
     
     // Get all unsaved files that are opened
     if (document) {
-      std::string documentStringUtf8 = document->GetDocumentText().toStdString();
-      utf8FileSize = documentStringUtf8.size();
+      utf8FileSize = document->Utf8Size();
     }
     
+    ProfilerScope unsavedFilesScope("Unsaved files");
     GetAllUnsavedFiles(mainWindow, &unsavedFiles, &unsavedFileContents, &unsavedFilePaths);
+    unsavedFilesScope.End();
     
     if (document) {
-      // Get the newline positions of the main file to be able to map the "line, column"
-      // positions given by libclang to offsets in our UTF-16 (QString) version of
-      // the document.
-      // NOTE: We could also get this after parsing finished, since currently we
-      //       anyway only use the parsing result if the document has not changed.
-      lineOffsets.resize(document->LineCount());
-      Document::LineIterator lineIt(document);
-      int lineIndex = 0;
-      while (lineIt.IsValid()) {
-        lineOffsets[lineIndex] = lineIt.GetLineStart().offset;
-        
-        ++ lineIndex;
-        ++ lineIt;
-      }
-      if (lineIndex != lineOffsets.size()) {
-        qDebug() << "Error: Line iterator returned a different line count than Document::LineCount().";
+      // For large documents that are not highlighted yet (i.e., that have just
+      // been opened), highlight the visible lines first and the rest in chunks.
+      streamHighlighting =
+          document->LineCount() >= kStreamingHighlightingMinLineCount &&
+          document->GetHighlightRanges(0).size() <= 1;
+      if (streamHighlighting) {
+        DocumentWidget* widget = mainWindow->GetWidgetForDocument(document);
+        if (widget) {
+          widget->GetVisibleLines(&visibleFirstLine, &visibleLastLine);
+        }
       }
       
       
+      TUReturnCounter = document->GetTUPool()->GetReturnCounter();
       TU = document->GetTUPool()->TakeLeastUpToDateTU();
-      if (!TU) {
+      
+      useReducedParseProfile = !ParseThreadPool::Instance().UseFullParseProfileFor(canonicalPath);
+    }
+  });
+  if (exit) {
+    return;
+  }
+  
+  if (document && !TU) {
+    // All TUs of the document are in use by code info requests. Since these
+    // are interactive, the parser yields to them: it waits until one of the
+    // TUs is returned instead of keeping one reserved for itself.
+    ProfilerScope waitScope("Wait for TU");
+    ClangTUPool* TUPool = document->GetTUPoolIfAllocated();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + kTUWaitTimeout;
+    while (!TU && std::chrono::steady_clock::now() < deadline) {
+      // Wake up regularly to notice if the document has been closed.
+      TUPool->WaitForReturnedTU(TUReturnCounter, std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(100)));
+      if (!ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+        return;
+      }
+      RunInQtThreadBlocking([&]() {
+        TUReturnCounter = TUPool->GetReturnCounter();
+        TU = TUPool->TakeLeastUpToDateTU();
+      });
+    }
+    
+    if (!TU) {
+      RunInQtThreadBlocking([&]() {
+        if (!ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+          return;
+        }
         DocumentWidget* widget = mainWindow->GetWidgetForDocument(document);
         if (widget) {
           widget->GetContainer()->SetMessage(
@@ -299,14 +544,103 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
               DocumentWidgetContainer::MessageType::ParseNotification,
               QObject::tr("Failed to obtain a libclang TU for parsing."));
         }
-        
-        exit = true;
+      });
+      return;
+    }
+  }
+  
+  if (parsedDocumentSnapshot) {
+    // Get the newline positions of the main file to be able to map the "line, column"
+    // positions given by libclang to offsets in our UTF-16 (QString) version of
+    // the document. The snapshot allows to do this outside of the main thread.
+    // NOTE: We could also get this after parsing finished, since currently we
+    //       anyway only use the parsing result if the document has not changed.
+    lineOffsets = parsedDocumentSnapshot->GetLineStarts();
+  }
+  
+  // If we only index the file, try to use the indexing result from the
+  // USRIndexCache instead of parsing the file. This is only done if none of the
+  // relevant files have unsaved changes, since the cache reflects the files'
+  // state on disk.
+  std::unordered_set<QString> unsavedCanonicalPaths;
+  for (const QByteArray& unsavedFilePath : unsavedFilePaths) {
+    unsavedCanonicalPaths.insert(QString::fromUtf8(unsavedFilePath));
+  }
+  
+  if (!document) {
+    USRIndexCache::Entry cacheEntry;
+    bool useCacheEntry = USRIndexCache::Instance().Load(canonicalPath, commandLine->args, &cacheEntry);
+    
+    // If enabled, let the index service that is shared with other CIDE
+    // instances (see IndexFileInIndexService()) or a helper process (see
+    // IndexFileInWorkerProcess()) index the file into the cache. This requires
+    // the files on disk to be up-to-date, like the cache itself.
+    bool useSharedService = Settings::Instance().GetIndexInSharedService();
+    if (!useCacheEntry &&
+        unsavedCanonicalPaths.empty() &&
+        (useSharedService || Settings::Instance().GetIndexInWorkerProcesses())) {
+      ProfilerScope workerScope("Index in worker process");
+      IndexWorkerResult workerResult = IndexWorkerResult::Unavailable;
+      if (useSharedService) {
+        workerResult = IndexFileInIndexService(canonicalPath, commandLine->args);
+      }
+      if (workerResult == IndexWorkerResult::Unavailable &&
+          Settings::Instance().GetIndexInWorkerProcesses()) {
+        workerResult = IndexFileInWorkerProcess(canonicalPath, commandLine->args);
+      }
+      workerScope.End();
+      if (workerResult == IndexWorkerResult::Indexed) {
+        useCacheEntry = USRIndexCache::Instance().Load(canonicalPath, commandLine->args, &cacheEntry);
+      } else if (workerResult == IndexWorkerResult::Crashed) {
+        // Do not retry in this process, since libclang would likely crash
+        // here as well.
+        qDebug() << "Indexing" << canonicalPath << "crashed the index worker process, skipping the file";
         return;
       }
+      // Otherwise, index the file in this process.
+    }
+    std::unordered_set<QString> cachedIncludedPaths;
+    if (useCacheEntry) {
+      cachedIncludedPaths.reserve(cacheEntry.includes.size());
+      for (const std::pair<QString, qint64>& include : cacheEntry.includes) {
+        if (unsavedCanonicalPaths.count(include.first) > 0) {
+          useCacheEntry = false;
+          break;
+        }
+        cachedIncludedPaths.insert(include.first);
+      }
+    }
+    
+    if (useCacheEntry) {
+      RunInQtThreadBlocking([&]() {
+        SourceFile* sourceFile = nullptr;
+        std::shared_ptr<Project> usedProject = nullptr;
+        for (auto& project : mainWindow->GetProjects()) {
+          sourceFile = project->GetSourceFile(canonicalPath);
+          if (sourceFile) {
+            usedProject = project;
+            break;
+          }
+        }
+        USRStorage::Instance().Lock();
+        if (sourceFile) {
+          IndexFile_SetInclusions(cachedIncludedPaths, sourceFile, usedProject.get(), mainWindow);
+        }
+        USRStorage::Instance().Unlock();
+      });
+      
+      USRStorage::Instance().Lock();
+      USRStorage::Instance().StoreUSRsForTU(canonicalPath, USRIndexCache::HashCommandLineArgs(commandLine->args), cacheEntry.includes, cacheEntry.USRs, cacheEntry.references, cacheEntry.referencesComplete);
+      USRStorage::Instance().Unlock();
+      
+      CommentMarkerIndex::Instance().UpdateFiles(cacheEntry.includes, &cacheEntry.commentMarkers, nullptr);
+      
+      IndexingStatistics::Instance().AddIndexedFile(
+          canonicalPath,
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count(),
+          CountUSRs(cacheEntry.USRs), cacheEntry.includes.size(), /*fromCache*/ true);
+      return;
     }
-  });
-  if (exit) {
-    return;
   }
   
   if (!TU) {
@@ -316,14 +650,31 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
   
   
   // Parse translation unit.
-  /// preambleIsLikelyUnchanged is set to true if the list of includes and their
-  /// modification times, as well as the global compile flags have not changed.
-  /// In principle, it should also check whether the #defines in front of any
-  /// #include have changed, but this is currently not done as it is unclear how
-  /// much effort that would be. Therefore it is only "likely unchanged".
+  /// preambleIsLikelyUnchanged is set to true if the text of the preamble
+  /// region of the document (see Document::preambleHash()), the list of
+  /// includes and their modification times, as well as the global compile
+  /// flags have not changed. It is only "likely unchanged" since the included
+  /// files may have been changed without changing their modification times
+  /// (e.g., as unsaved files in other documents).
   bool preambleIsLikelyUnchanged = true;
+  bool functionBodiesSkipped = false;
   unsigned parseOptions;
-  if (document) {
+  if (document && useReducedParseProfile) {
+    // Documents in the background are parsed without the detailed
+    // preprocessing record, the precompiled preamble, and the completion
+    // cache, and with skipped function bodies, which reduces their memory
+    // usage considerably. They are parsed again with the full options once
+    // they get activated (see DocumentWidget::showEvent()). Note that libclang
+    // cannot restrict the skipping to bodies outside of the visible area.
+    parseOptions = CXTranslationUnit_KeepGoing;
+    #if CINDEX_VERSION_MINOR >= 47
+      parseOptions |= CXTranslationUnit_SkipFunctionBodies;
+      functionBodiesSkipped = true;
+    #endif
+    #if CINDEX_VERSION_MINOR >= 59
+      parseOptions |= CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles;
+    #endif
+  } else if (document) {
     parseOptions =
         CXTranslationUnit_DetailedPreprocessingRecord |
         CXTranslationUnit_PrecompiledPreamble |
@@ -339,18 +690,21 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
       parseOptions |= CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles;
     #endif
   } else {
-    parseOptions =
-        CXTranslationUnit_Incomplete |
-        // TODO: It seems that if we skip function bodies, we cannot determine
-        //       whether something is a definition or a declaration. However, if
-        //       we changed to index things in the parsed source file only, we
-        //       could enable skipping function bodies in other files.
-        // CXTranslationUnit_SkipFunctionBodies |
-        CXTranslationUnit_KeepGoing;
+    parseOptions = GetIndexingParseOptions(&functionBodiesSkipped);
   }
   
   CXErrorCode parseResult = CXError_Failure;
-  if (TU->CanBeReparsed(canonicalPath, commandLineArgs)) {
+  if (TU->CanBeReparsed(mainFilePath, commandLine) &&
+      TU->IsParsedWithReducedProfile() == useReducedParseProfile) {
+    // If the preamble text changed, libclang rebuilds the preamble during the
+    // reparse, which may take much longer than a usual reparse. Show this as a
+    // separate span in the trace.
+    if (document && TU->GetPreambleHash() != preambleHash) {
+      preambleIsLikelyUnchanged = false;
+    }
+    ProfilerScope reparseScope(preambleIsLikelyUnchanged ? "Reparse" : "Reparse (preamble invalidated)");
+    TU->SetReferenceMap(nullptr);
+    TU->SetImplementationCandidates(nullptr);
     parseResult = static_cast<CXErrorCode>(clang_reparseTranslationUnit(
         TU->TU(),
         unsavedFiles.size(),
@@ -361,20 +715,65 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
     }
   }
   
+  // When a document is parsed for the first time, try to load the TU that was
+  // saved when it was last closed. This TU is used until a normal parse, which
+  // is requested below, finishes.
+  bool loadedTUFromCache = false;
+  if (parseResult != CXError_Success &&
+      document &&
+      !TU->isInitialized() &&
+      unsavedFilePaths.empty() &&
+      useTUCache) {
+    ProfilerScope loadScope("Load TU from cache");
+    CXTranslationUnit clangTU;
+    if (TUCache::Instance().Load(canonicalPath, commandLine->args, TU->index(), &clangTU)) {
+      TU->Set(clangTU, commandLine);
+      TU->SetLoadedFromCache(true);
+      parseResult = CXError_Success;
+      preambleIsLikelyUnchanged = false;
+      loadedTUFromCache = true;
+      functionBodiesSkipped = false;  // cached TUs are parsed with the full options
+    }
+  }
+  
   if (parseResult != CXError_Success) {
     preambleIsLikelyUnchanged = false;
     
+    // For documents, try to use a PCH for the include prefix of the file that
+    // is shared with other files (see PreambleCache). This is only done if no
+    // other file has unsaved changes, since the PCH is built from the files on
+    // disk. Note that the TU stores the original commandLine, such that
+    // CanBeReparsed() is unaffected by this. Headers that are parsed in the
+    // context of an includer do not use a PCH, since their include prefix is
+    // not the one of the TU's main file.
+    std::vector<const char*> parseArgPtrs = commandLineArgPtrs;
+    QByteArray pchPath;
+    if (document &&
+        mainFilePath == canonicalPath &&
+        (unsavedCanonicalPaths.empty() ||
+         (unsavedCanonicalPaths.size() == 1 && unsavedCanonicalPaths.count(canonicalPath) == 1))) {
+      QByteArray includePrefix = PreambleCache::ExtractIncludePrefix(parsedDocumentSnapshot->document()->GetDocumentText(), QFileInfo(canonicalPath).path());
+      QString pchPathString;
+      if (PreambleCache::Instance().GetPCH(canonicalPath, includePrefix, commandLine->args, &pchPathString)) {
+        pchPath = pchPathString.toLocal8Bit();
+        parseArgPtrs.push_back("-include-pch");
+        parseArgPtrs.push_back(pchPath.data());
+      }
+    }
+    
+    ProfilerScope parseScope("Parse");
     CXTranslationUnit clangTU;
     parseResult = clang_parseTranslationUnit2(
         TU->index(),
-        canonicalPath.toLocal8Bit().data(),
-        commandLineArgPtrs.data(),
-        commandLineArgPtrs.size(),
+        mainFilePath.toLocal8Bit().data(),
+        parseArgPtrs.data(),
+        parseArgPtrs.size(),
         unsavedFiles.data(),
         unsavedFiles.size(),
         parseOptions,
         &clangTU);
-    TU->Set(clangTU, commandLineArgs);
+    TU->Set(clangTU, commandLine);
+    TU->SetParsedWithReducedProfile(useReducedParseProfile);
   }
   
   if (parseResult == CXError_Crashed) {
@@ -427,6 +826,10 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
     return;
   }
   
+  TU->SetPreambleHash(preambleHash);
+  TU->SetTextChangeCounter(parsedTextChangeCounter);
+  TU->SetParsedFromFilesOnDisk(unsavedFilePaths.empty());
+  
   // (Approximately) determine whether the preamble changed.
   // TODO: It would be great if clang_reparseTranslationUnit() would simply
   //       return this piece of information.
@@ -461,11 +864,12 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
       // meantime, as we always want to update the file's indexing information,
       // even if it got closed.
       
-      // First, check whether the file acts as a source file in a project.
+      // First, check whether the TU's main file acts as a source file in a
+      // project.
       SourceFile* sourceFile = nullptr;
       std::shared_ptr<Project> usedProject = nullptr;
       for (auto& project : mainWindow->GetProjects()) {
-        sourceFile = project->GetSourceFile(canonicalPath);
+        sourceFile = project->GetSourceFile(mainFilePath);
         if (sourceFile) {
           usedProject = project;
           break;
@@ -490,24 +894,64 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
   //       defines. For a correct update, we would need to parse the header
   //       with all used configurations after it is edited. But that seems
   //       infeasible.
-  USRStorage::Instance().Lock();
-  IndexFile_StoreUSRs(TU->TU(), preambleIsLikelyUnchanged);
+  USRIndexCache::Entry cacheEntry;
+  bool updateCache = !document;
+  if (updateCache) {
+    cacheEntry.includes.reserve(fileIncludes.size());
+    for (const ClangTU::IncludeWithModificationTime& include : fileIncludes) {
+      QString includePath = CachedCanonicalFilePath(QString::fromUtf8(include.path));
+      if (unsavedCanonicalPaths.count(includePath) > 0) {
+        // The indexing result does not correspond to the file state on disk.
+        updateCache = false;
+        break;
+      }
+      cacheEntry.includes.emplace_back(includePath, static_cast<qint64>(include.lastModificationTime));
+    }
+  }
+  
+  ProfilerScope indexScope("Store USRs");
+  IndexFile_StoreUSRs(
+      TU->TU(),
+      preambleIsLikelyUnchanged,
+      USRIndexCache::HashCommandLineArgs(commandLine->args),
+      functionBodiesSkipped,
+      &cacheEntry.USRs,
+      &cacheEntry.references);
   // USRStorage::Instance().DebugPrintInfo();
-  USRStorage::Instance().Unlock();
+  indexScope.End();
+  
+  if (updateCache) {
+    ProfilerScope markerScope("Find comment markers");
+    CommentMarkerIndex::Instance().UpdateFiles(cacheEntry.includes, nullptr, &cacheEntry.commentMarkers);
+    markerScope.End();
+    
+    cacheEntry.referencesComplete = !functionBodiesSkipped;
+    USRIndexCache::Instance().Save(canonicalPath, commandLine->args, cacheEntry);
+  }
   
   // Indexing finished, so we can return if we do not have a document.
   if (!document) {
+    IndexingStatistics::Instance().AddIndexedFile(
+        canonicalPath,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count(),
+        CountUSRs(cacheEntry.USRs), fileIncludes.size(), /*fromCache*/ false);
     return;
   }
   
   // Prepare AST visitor data
+  HighlightBuffer highlights;
   HighlightingASTVisitorData visitorData;
-  visitorData.document = document;
+  visitorData.highlights = &highlights;
   visitorData.TU = TU->TU();
   visitorData.file = clang_getFile(TU->TU(), canonicalPath.toUtf8().data());
   visitorData.lineOffsets = &lineOffsets;
   visitorData.prevCursor = clang_getNullCursor();
   visitorData.perVariableColoring = usePerVariableColoring;
+  visitorData.variableColors.swap(localVariableColors);
+  std::shared_ptr<const VariableColorIndices> previousVariableColorIndices = TU->GetVariableColorIndices();
+  visitorData.previousVariableColorIndices = previousVariableColorIndices.get();
+  std::shared_ptr<ClangReferenceMap> referenceMap(new ClangReferenceMap(visitorData.file));
+  visitorData.referenceMap = referenceMap.get();
   
   // Build a CXSourceRange for the whole document
   CXSourceLocation startLocation = clang_getLocationForOffset(
@@ -516,32 +960,129 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
       visitorData.TU, visitorData.file, utf8FileSize);
   CXSourceRange clangRange = clang_getRange(startLocation, endLocation);
   
-  // Tokenize the document
+  // Tokenize the whole document range in order to get keywords and comments
+  // (which are not reported by clang_visitChildren() unfortunately). This is
+  // always done for the whole document, since tokenizing from an arbitrary
+  // line might start within a comment.
+  ProfilerScope tokenizeScope("Tokenize");
   CXToken* tokens;
   unsigned numTokens;
   clang_tokenize(visitorData.TU, clangRange, &tokens, &numTokens);
   
-  // Find comment marker ranges while in the background thread
   std::vector<DocumentRange> commentMarkerRanges;
   FindCommentMarkerRanges(tokens, numTokens, &visitorData, &commentMarkerRanges);
+  tokenizeScope.End();
+  
+  // Determine the chunks of lines to highlight, given as pairs of
+  // [firstLine, endLine). If streaming, the visible lines come first.
+  int lineCount = lineOffsets.size();
+  std::vector<std::pair<int, int>> chunks;
+  if (streamHighlighting) {
+    int visibleStart = std::min(lineCount, std::max(0, visibleFirstLine - kStreamingHighlightingMarginLines));
+    int visibleEnd = std::min(lineCount, visibleLastLine + 1 + kStreamingHighlightingMarginLines);
+    chunks.emplace_back(visibleStart, visibleEnd);
+    for (int chunkStart = 0; chunkStart < lineCount; chunkStart += kStreamingHighlightingChunkLineCount) {
+      int chunkEnd = std::min(lineCount, chunkStart + kStreamingHighlightingChunkLineCount);
+      if (chunkStart < visibleStart) {
+        chunks.emplace_back(chunkStart, std::min(chunkEnd, visibleStart));
+      }
+      if (chunkEnd > visibleEnd) {
+        chunks.emplace_back(std::max(chunkStart, visibleEnd), chunkEnd);
+      }
+    }
+  } else {
+    chunks.emplace_back(0, lineCount);
+  }
+  
+  // Collect all highlighting information in the background thread, such that
+  // the main thread only needs to swap it into the document. When streaming,
+  // the highlight ranges of each chunk are additionally added to the document
+  // as soon as they are available. This does not wait for the main thread,
+  // such that the next chunk can be processed in the meantime. Since functions
+  // posted to the main thread run in order, the chunks are added before the
+  // final result below.
+  std::shared_ptr<std::atomic<bool>> documentClosed(new std::atomic<bool>(false));
+  for (const std::pair<int, int>& chunk : chunks) {
+    std::size_t chunkRangesBegin = highlights.ranges.size();
+    ProfilerScope visitScope("AST visit");
+    AddHighlightingForLines(chunk.first, chunk.second, streamHighlighting, tokens, numTokens, commentMarkerRanges, parsedDocumentSnapshot->document()->FullDocumentRange().end.offset, utf8FileSize, &visitorData);
+    visitScope.End();
+    
+    if (streamHighlighting) {
+      std::shared_ptr<HighlightBuffer> chunkHighlights(new HighlightBuffer());
+      chunkHighlights->ranges.assign(highlights.ranges.begin() + chunkRangesBegin, highlights.ranges.end());
+      chunkHighlights->styles = highlights.styles;
+      
+      int chunkTextChangeCounter = parsedTextChangeCounter;
+      PostToQtThread([document, chunkHighlights, chunkTextChangeCounter, documentClosed]() {
+        if (!ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+          *documentClosed = true;
+          return;
+        }
+        std::vector<TextReplacement> replacements;
+        if (document->GetTextReplacementsSince(chunkTextChangeCounter, &replacements)) {
+          chunkHighlights->Rebase(replacements);
+          document->AddHighlightRanges(chunkHighlights->ranges, chunkHighlights->styles, /*layer*/ 0);
+          document->FinishedHighlightingChanges();
+        }
+      });
+      if (*documentClosed) {
+        clang_disposeTokens(visitorData.TU, tokens, numTokens);
+        return;
+      }
+    }
+  }
+  clang_disposeTokens(visitorData.TU, tokens, numTokens);
+  visitorData.referenceMap = nullptr;
+  TU->SetReferenceMap(referenceMap);
+  if (usePerVariableColoring) {
+    std::shared_ptr<VariableColorIndices> variableColorIndices(new VariableColorIndices());
+    variableColorIndices->byFunction.swap(visitorData.variableColorIndices.byFunction);
+    TU->SetVariableColorIndices(variableColorIndices);
+  }
+  
+  // Retrieve the problems and fix-its
+  ProfilerScope diagnosticsScope("Diagnostics");
+  RetrieveDiagnostics(parsedDocumentSnapshot->document().get(), &highlights, visitorData.file, TU, lineOffsets);
+  diagnosticsScope.End();
+  parsedDocumentSnapshot.reset();
+  
+  // If the document was edited during parsing, map the results to its current
+  // version instead of discarding them, such that they can be shown right away.
+  // The reparse for the edits (which should already have been triggered) will
+  // then refine them. Most of the edits are mapped here in the background
+  // thread, the remaining ones in the main thread below.
+  std::vector<TextReplacement> replacements;
+  bool canRebase = true;
+  RunInQtThreadBlocking([&]() {
+    if (!ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+      exit = true;
+      return;
+    }
+    canRebase = document->GetTextReplacementsSince(parsedTextChangeCounter, &replacements);
+    parsedTextChangeCounter = document->textChangeCounter();
+  });
+  if (exit) {
+    return;
+  }
+  highlights.Rebase(replacements);
   
   RunInQtThreadBlocking([&]() {
     // If the document has been closed in the meantime, we must not access it or
     // its widget anymore.
     if (!ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
-      clang_disposeTokens(visitorData.TU, tokens, numTokens);
       exit = true;
       return;
     }
-    if (parsedDocumentVersion != document->version()) {
-      // Do the next reparse instead. It should already have been triggered.
-      // TODO: We could instead try to adjust the ranges to the changes in the
-      //       document here
-      clang_disposeTokens(visitorData.TU, tokens, numTokens);
+    replacements.clear();
+    if (!canRebase || !document->GetTextReplacementsSince(parsedTextChangeCounter, &replacements)) {
+      // The document text was re-assigned, or there were too many edits. Do the
+      // next reparse instead. It should already have been triggered.
       document->GetTUPool()->PutTU(TU, true);
       exit = true;
       return;
     }
+    highlights.Rebase(replacements);
     
     DocumentWidget* widget = mainWindow->GetWidgetForDocument(document);
     
@@ -558,9 +1099,8 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
         CompileSettings* fileSettings = project->FindSettingsForFile(canonicalPath, &isGuess, &guessQuality);
         
         if (fileSettings && !isGuess) {
-          std::vector<QByteArray> commandLineArgs;
-          commandLineArgs = fileSettings->BuildCommandLineArgs(true, canonicalPath, project.get());
-          if (TU->CanBeReparsed(canonicalPath, commandLineArgs)) {
+          std::shared_ptr<const CompileCommandLine> commandLine = fileSettings->GetCommandLine(true, canonicalPath, project.get());
+          if (TU->CanBeReparsed(canonicalPath, commandLine)) {
             // The compile settings are equal. Remove the warning about guessed compile settings.
             parseSettingsAreGuessedNotification = QStringLiteral("");
           } else {
@@ -582,29 +1122,22 @@ void ParseAndOrIndexFileImpl(QString canonicalPath, Document* document, MainWind
           DocumentWidgetContainer::MessageType::ParseNotification, parseNotification);
     }
     
-    document->ClearHighlightRanges(/*layer*/ 0);
-    document->ClearContexts();
-    
-    // Tokenize the whole document range in order to get keywords and comments
-    // (which are not reported by clang_visitChildren() unfortunately)
-    // TODO: Check the performance of this approach. If this takes too long,
-    //       it would be possible to restrict the tokenization to smaller ranges
-    //       (or even do it manually).
-    AddTokenHighlighting(document, tokens, numTokens, &visitorData);
-    clang_disposeTokens(visitorData.TU, tokens, numTokens);
-    ApplyCommentMarkerRanges(document, commentMarkerRanges);
-    
-    // Visit the resulting AST, extract information for highlighting, and add it
-    // to the document
-    clang_visitChildren(clang_getTranslationUnitCursor(TU->TU()),
-                        &VisitClangAST_AddHighlightingAndContexts, &visitorData);
-    
-    // Retrieve the problems and fix-its
-    RetrieveDiagnostics(document, visitorData.file, TU, lineOffsets);
+    document->ApplyHighlightBuffer(&highlights, /*layer*/ 0);
     
     // Return the TU back to the pool, signaling that it has been reparsed.
     document->GetTUPool()->PutTU(TU, true);
     
+    // A TU from the TUCache cannot be reparsed or used for code completion,
+    // so parse the document normally now (using another TU of the pool).
+    // Otherwise, look up the cursors of the visible identifiers in the new TU
+    // such that hovering them is fast.
+    if (loadedTUFromCache && widget) {
+      widget->ParseFile();
+    } else if (widget) {
+      widget->PrefetchHoverInfo();
+      widget->ScheduleTUCatchUp();
+    }
+    
     // Notify the main window about the parse.
     mainWindow->DocumentParsed(document);
     
@@ -652,142 +1185,465 @@ void ParseFileIfOpenElseIndex(const QString& canonicalPath, Document* document,
   ParseAndOrIndexFileImpl(canonicalPath, document, mainWindow, true);
 }
 
+bool IndexFileIntoCache(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs) {
+  std::vector<const char*> commandLineArgPtrs(commandLineArgs.size());
+  for (int i = 0; i < commandLineArgs.size(); ++ i) {
+    commandLineArgPtrs[i] = commandLineArgs[i].constData();
+  }
+  
+  bool functionBodiesSkipped;
+  unsigned parseOptions = GetIndexingParseOptions(&functionBodiesSkipped);
+  
+  ClangTU TU;
+  CXTranslationUnit clangTU;
+  CXErrorCode parseResult = clang_parseTranslationUnit2(
+      TU.index(),
+      canonicalPath.toLocal8Bit().data(),
+      commandLineArgPtrs.data(),
+      commandLineArgPtrs.size(),
+      nullptr,
+      0,
+      parseOptions,
+      &clangTU);
+  if (parseResult != CXError_Success) {
+    return false;
+  }
+  TU.Set(clangTU, std::make_shared<CompileCommandLine>(std::vector<QByteArray>(commandLineArgs)));
+  
+  std::vector<ClangTU::IncludeWithModificationTime> includes;
+  includes.reserve(512);
+  clang_getInclusions(clangTU, &VisitInclusions_GetPathsAndLastModificationTimes, &includes);
+  
+  USRIndexCache::Entry cacheEntry;
+  cacheEntry.includes.reserve(includes.size());
+  for (const ClangTU::IncludeWithModificationTime& include : includes) {
+    cacheEntry.includes.emplace_back(
+        CachedCanonicalFilePath(QString::fromUtf8(include.path)),
+        static_cast<qint64>(include.lastModificationTime));
+  }
+  
+  // IndexFile_StoreUSRs() only visits included files that have a USRMap (see
+  // ShouldSkipFileIndexedByOtherTU()). Since this process does not know which
+  // files the caller indexes, create the maps for all included files, and
+  // remove them again afterwards. The caller decides which of the resulting
+  // USRs it stores (see USRStorage::StoreUSRsForTU()).
+  USRStorage::Instance().Lock();
+  for (const std::pair<QString, qint64>& include : cacheEntry.includes) {
+    USRStorage::Instance().AddUSRMapReference(include.first);
+  }
+  USRStorage::Instance().Unlock();
+  
+  IndexFile_StoreUSRs(
+      clangTU,
+      /*onlyForTUFile*/ false,
+      USRIndexCache::HashCommandLineArgs(commandLineArgs),
+      functionBodiesSkipped,
+      &cacheEntry.USRs,
+      &cacheEntry.references);
+  
+  USRStorage::Instance().Lock();
+  for (const std::pair<QString, qint64>& include : cacheEntry.includes) {
+    USRStorage::Instance().RemoveUSRMapReference(include.first);
+  }
+  USRStorage::Instance().Unlock();
+  
+  CommentMarkerIndex::Instance().UpdateFiles(cacheEntry.includes, nullptr, &cacheEntry.commentMarkers);
+  
+  cacheEntry.referencesComplete = !functionBodiesSkipped;
+  return USRIndexCache::Instance().Save(canonicalPath, commandLineArgs, cacheEntry);
+}
+
+bool CheckFileDiagnostics(const QString& canonicalPath, MainWindow* mainWindow, std::vector<SweepDiagnostic>* diagnostics) {
+  // The projects must only be accessed from the Qt thread.
+  std::shared_ptr<const CompileCommandLine> commandLine;
+  RunInQtThreadBlocking([&]() {
+    std::shared_ptr<Project> usedProject;
+    CompileSettings* settings = FindParseSettingsForFile(canonicalPath, mainWindow->GetProjects(), &usedProject);
+    if (settings) {
+      commandLine = settings->GetCommandLine(true, canonicalPath, usedProject.get());
+    }
+  });
+  if (!commandLine) {
+    return false;
+  }
+  
+  std::vector<const char*> commandLineArgPtrs(commandLine->args.size());
+  for (int i = 0; i < commandLine->args.size(); ++ i) {
+    commandLineArgPtrs[i] = commandLine->args[i].constData();
+  }
+  
+  // Use the indexing options, but without skipping function bodies, since
+  // errors within them should be found as well.
+  ClangTU TU;
+  CXTranslationUnit clangTU;
+  CXErrorCode parseResult = clang_parseTranslationUnit2(
+      TU.index(),
+      canonicalPath.toLocal8Bit().data(),
+      commandLineArgPtrs.data(),
+      commandLineArgPtrs.size(),
+      nullptr,
+      0,
+      CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing,
+      &clangTU);
+  if (parseResult != CXError_Success) {
+    return false;
+  }
+  TU.Set(clangTU, commandLine);
+  
+  unsigned numDiagnostics = clang_getNumDiagnostics(clangTU);
+  for (unsigned diagnosticIndex = 0; diagnosticIndex < numDiagnostics; ++ diagnosticIndex) {
+    CXDiagnostic diagnostic = clang_getDiagnostic(clangTU, diagnosticIndex);
+    CXDiagnosticSeverity severity = clang_getDiagnosticSeverity(diagnostic);
+    if (severity == CXDiagnostic_Warning ||
+        severity == CXDiagnostic_Error ||
+        severity == CXDiagnostic_Fatal) {
+      CXFile file;
+      unsigned line;
+      unsigned column;
+      clang_getFileLocation(clang_getDiagnosticLocation(diagnostic), &file, &line, &column, nullptr);
+      
+      diagnostics->emplace_back();
+      SweepDiagnostic& newDiagnostic = diagnostics->back();
+      newDiagnostic.filePath = file ? CachedCanonicalFilePath(GetClangFilePath(file)) : canonicalPath;
+      newDiagnostic.line = line;
+      newDiagnostic.column = column;
+      newDiagnostic.isError = severity != CXDiagnostic_Warning;
+      newDiagnostic.text = ClangString(clang_getDiagnosticSpelling(diagnostic)).ToQString();
+    }
+    clang_disposeDiagnostic(diagnostic);
+  }
+  
+  return true;
+}
+
 
 struct StoreDefinitionsVisitorData {
   bool updateTUFileOnly;
+  bool functionBodiesSkipped;
+  CXTranslationUnit TU;
   CXFile TUFile;
+  QString TUFilePath;
+  QByteArray compileSettingsHash;
+  
+  /// Caches for each included file whether it is skipped since another TU
+  /// indexes it.
+  std::unordered_map<CXFile, bool> skipFile;
+  
+  /// Modification times of the included files that are not skipped.
+  std::vector<std::pair<QString, qint64>> includes;
   
   /// The file of the last visited cursor. The file of a new cursor can be
-  /// compared to this. If equal, the cached lastFileUSRMap can be used.
+  /// compared to this. If equal, the cached lastFileKnownUSRs,
+  /// lastFileVisitedUSRs, and lastFileReferencedUSRs can be used.
   QString lastFile;
   
-  /// Cached pointer to the USRMap of lastFile.
-  USRMap* lastFileUSRMap;
+  /// For each file that has a USRMap, the USRs that are known to be stored
+  /// for it: for included files, this starts with the USRs that were stored by
+  /// previous indexing runs, such that their spelling does not need to be
+  /// determined again.
+  std::unordered_map<QString, std::unordered_multimap<QByteArray, USRDecl>> knownUSRs;
+  
+  /// All USRs visited in the TU, which are stored in the USRStorage after the
+  /// visit.
+  USRsByFile* visitedUSRs;
+  
+  /// For each file that has a USRMap, the USRs referenced within the file.
+  std::unordered_map<QString, std::unordered_set<QByteArray>> referencedUSRs;
+  
+  /// Cached pointers to the entries of lastFile in knownUSRs, visitedUSRs,
+  /// and referencedUSRs, or null if there is no USRMap for lastFile.
+  std::unordered_multimap<QByteArray, USRDecl>* lastFileKnownUSRs;
+  std::vector<std::pair<QByteArray, USRDecl>>* lastFileVisitedUSRs;
+  std::unordered_set<QByteArray>* lastFileReferencedUSRs;
 };
 
+/// Returns whether USRs of cursors with the given kind are stored in the
+/// USRMaps. To reduce the effort / memory use, this is only done for certain
+/// cursor kinds.
+static bool IsStoredUSRCursorKind(CXCursorKind kind) {
+  return IsClassDeclLikeCursorKind(kind) ||
+         kind == CXCursor_FunctionDecl ||
+         kind == CXCursor_FunctionTemplate ||
+         kind == CXCursor_CXXMethod ||
+         kind == CXCursor_Constructor ||
+         kind == CXCursor_Destructor ||
+         kind == CXCursor_ConversionFunction ||
+         kind == CXCursor_FieldDecl ||
+         kind == CXCursor_VarDecl;
+}
+
+/// If @p cursor references an entity whose USR is stored in the USRMaps, adds
+/// the USR to @p referencedUSRs.
+static void AddReferencedUSR(CXCursor cursor, std::unordered_set<QByteArray>* referencedUSRs) {
+  CXCursorKind kind = clang_getCursorKind(cursor);
+  if (!clang_isReference(kind) &&
+      kind != CXCursor_DeclRefExpr &&
+      kind != CXCursor_MemberRefExpr &&
+      kind != CXCursor_CallExpr) {
+    return;
+  }
+  
+  CXCursor referencedCursor = clang_getCursorReferenced(cursor);
+  if (clang_Cursor_isNull(referencedCursor) ||
+      !IsStoredUSRCursorKind(clang_getCursorKind(referencedCursor))) {
+    return;
+  }
+  QByteArray USR = ClangString(clang_getCursorUSR(referencedCursor)).ToQByteArray();
+  if (!USR.isEmpty()) {
+    referencedUSRs->insert(USR);
+  }
+}
+
+CXChildVisitResult VisitClangAST_StoreUSRReferences(CXCursor cursor, CXCursor /*parent*/, CXClientData client_data) {
+  AddReferencedUSR(cursor, reinterpret_cast<std::unordered_set<QByteArray>*>(client_data));
+  return CXChildVisit_Recurse;
+}
+
+/// Returns whether the given file (which is not the TU file) shall be skipped
+/// for indexing because another TU with the same compile settings takes care of
+/// it and the file did not change since. If the file is not handled by another
+/// TU yet, the current TU takes over this responsibility.
+bool ShouldSkipFileIndexedByOtherTU(CXFile file, StoreDefinitionsVisitorData* data) {
+  auto it = data->skipFile.find(file);
+  if (it != data->skipFile.end()) {
+    return it->second;
+  }
+  
+  bool skip = false;
+  QString canonicalPath = CachedCanonicalFilePath(GetClangFilePath(file));
+  qint64 modificationTime = clang_getFileTime(file);
+  USRStorage::Instance().Lock();
+  USRMap* usrMap = USRStorage::Instance().GetUSRMapForFile(canonicalPath);
+  if (!usrMap) {
+    // No USRs can be stored for this file anyway.
+    skip = true;
+  } else {
+    skip = !usrMap->RegisterIndexingTU(data->compileSettingsHash, data->TUFilePath, modificationTime);
+  }
+  USRStorage::Instance().Unlock();
+  
+  if (!skip) {
+    data->includes.emplace_back(canonicalPath, modificationTime);
+  }
+  data->skipFile[file] = skip;
+  return skip;
+}
+
+/// When parsing with CXTranslationUnit_SkipFunctionBodies, libclang does not
+/// report functions with skipped bodies as definitions. This heuristically
+/// determines whether the function declaration given by @p cursor has a
+/// (skipped) body by looking at the source code following the declaration.
+bool FunctionHasSkippedBody(CXCursor cursor, CXTranslationUnit TU) {
+#if CINDEX_VERSION_MINOR >= 47
+  CXSourceLocation declarationEnd = clang_getRangeEnd(clang_getCursorExtent(cursor));
+  CXFile file;
+  unsigned offset;
+  clang_getFileLocation(declarationEnd, &file, nullptr, nullptr, &offset);
+  if (!file) {
+    return false;
+  }
+  
+  std::size_t size;
+  const char* text = clang_getFileContents(TU, file, &size);
+  if (!text) {
+    return false;
+  }
+  
+  auto isWordAt = [&](std::size_t pos, const char* word) {
+    std::size_t wordLength = strlen(word);
+    if (pos + wordLength > size ||
+        strncmp(text + pos, word, wordLength) != 0) {
+      return false;
+    }
+    return pos + wordLength == size ||
+           !(isalnum(text[pos + wordLength]) || text[pos + wordLength] == '_');
+  };
+  
+  // Skip whitespace, comments, and virt-specifiers (which are not part of the
+  // declaration's extent).
+  std::size_t pos = offset;
+  while (pos < size) {
+    char c = text[pos];
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      ++ pos;
+    } else if (c == '/' && pos + 1 < size && text[pos + 1] == '/') {
+      while (pos < size && text[pos] != '\n') {
+        ++ pos;
+      }
+    } else if (c == '/' && pos + 1 < size && text[pos + 1] == '*') {
+      pos += 2;
+      while (pos + 1 < size && !(text[pos] == '*' && text[pos + 1] == '/')) {
+        ++ pos;
+      }
+      pos += 2;
+    } else if (isWordAt(pos, "override")) {
+      pos += 8;
+    } else if (isWordAt(pos, "final")) {
+      pos += 5;
+    } else {
+      break;
+    }
+  }
+  if (pos >= size) {
+    return false;
+  }
+  
+  // A function body, a constructor initializer list, or a function-try-block
+  // follows for definitions.
+  return text[pos] == '{' ||
+         (text[pos] == ':' && !(pos + 1 < size && text[pos + 1] == ':')) ||
+         isWordAt(pos, "try");
+#else
+  (void) cursor;
+  (void) TU;
+  return false;
+#endif
+}
+
 CXChildVisitResult VisitClangAST_StoreUSRs(CXCursor cursor, CXCursor /*parent*/, CXClientData client_data) {
   StoreDefinitionsVisitorData* data = reinterpret_cast<StoreDefinitionsVisitorData*>(client_data);
   
   // If we need to update the TU file only, skip over everything outside of that
-  // file.
-  if (data->updateTUFileOnly) {
-    CXSourceLocation location = clang_getCursorLocation(cursor);
-    CXFile locationFile;
-    clang_getFileLocation(location, &locationFile, nullptr, nullptr, nullptr);
-    if (!clang_File_isEqual(locationFile, data->TUFile)) {
+  // file. Otherwise, skip over files that are indexed by other TUs.
+  CXSourceLocation cursorLocation = clang_getCursorLocation(cursor);
+  CXFile cursorFile;
+  clang_getFileLocation(cursorLocation, &cursorFile, nullptr, nullptr, nullptr);
+  if (!clang_File_isEqual(cursorFile, data->TUFile)) {
+    if (data->updateTUFileOnly ||
+        ShouldSkipFileIndexedByOtherTU(cursorFile, data)) {
       return CXChildVisit_Continue;
     }
   }
   
-  // Try to reduce the effort / memory use by only storing USRs for certain
-  // cursor kinds.
   CXCursorKind kind = clang_getCursorKind(cursor);
-  if (IsClassDeclLikeCursorKind(kind) ||
-      kind == CXCursor_FunctionDecl ||
-      kind == CXCursor_FunctionTemplate ||
-      kind == CXCursor_CXXMethod ||
-      kind == CXCursor_Constructor ||
-      kind == CXCursor_Destructor ||
-      kind == CXCursor_ConversionFunction ||
-      kind == CXCursor_FieldDecl ||
-      kind == CXCursor_VarDecl) {
+  bool recurse =
+      kind == CXCursor_Namespace ||
+      kind == CXCursor_UnexposedDecl ||  // this is required to recurse into: extern "C" { ... }
+      IsClassDeclLikeCursorKind(kind);
+  bool storeUSR = IsStoredUSRCursorKind(kind);
+  if (recurse && !storeUSR) {
+    return CXChildVisit_Recurse;
+  }
+  
+  // Get the known USRs of the current file.
+  QString filePath = GetClangFilePath(cursorFile);
+  if (filePath != data->lastFile) {
+    data->lastFile = filePath;
+    filePath = CachedCanonicalFilePath(filePath);
+    
+    auto knownIt = data->knownUSRs.find(filePath);
+    if (knownIt == data->knownUSRs.end()) {
+      // Check whether there is a USRMap for the file. Only lock the
+      // USRStorage briefly (once per file), such that other indexing threads
+      // and USR lookups are not blocked while visiting the AST.
+      USRStorage::Instance().Lock();
+      USRMap* usrMap = USRStorage::Instance().GetUSRMapForFile(filePath);
+      if (usrMap) {
+        knownIt = data->knownUSRs.insert(std::make_pair(filePath, std::unordered_multimap<QByteArray, USRDecl>())).first;
+        if (filePath != data->TUFilePath) {
+          knownIt->second = usrMap->map;
+        }
+      }
+      USRStorage::Instance().Unlock();
+    }
+    
+    data->lastFileKnownUSRs = (knownIt != data->knownUSRs.end()) ? &knownIt->second : nullptr;
+    data->lastFileVisitedUSRs = data->lastFileKnownUSRs ? &(*data->visitedUSRs)[filePath] : nullptr;
+    data->lastFileReferencedUSRs = data->lastFileKnownUSRs ? &data->referencedUSRs[filePath] : nullptr;
+    
+    if (data->lastFileKnownUSRs == nullptr) {
+      // NOTE: This can happen if a header (that is not listed as a source
+      //       file) is parsed before any source file is parsed that created
+      //       the USRMaps seen by the header. So, this is not an error.
+      //       (But maybe still a situation that we might want to improve:
+      //        perhaps it could be useful to let each open file add their
+      //        own references on USRMaps, not only project source files?)
+      // qDebug() << "ERROR: While indexing, found no USRMap for file " << filePath << " of a cursor -> the USR cannot be stored. The existence of the USRMap should have been ensured in the included file list update.";
+    }
+  }
+  
+  std::unordered_multimap<QByteArray, USRDecl>* knownUSRs = data->lastFileKnownUSRs;
+  if (!knownUSRs) {
+    return recurse ? CXChildVisit_Recurse : CXChildVisit_Continue;
+  }
+  
+  if (storeUSR) {
     // Get the cursor's location.
-    CXSourceLocation location = clang_getCursorLocation(cursor);
-    CXFile locationFile;
     unsigned line;
     unsigned column;
     clang_getFileLocation(
-        location,
-        &locationFile,
+        cursorLocation,
+        /*CXFile* file*/ nullptr,
         &line,
         &column,
         /*unsigned* offset*/ nullptr);
     
-    // Get the current file's USRMap.
-    USRMap* usrMap;
-    QString filePath = GetClangFilePath(locationFile);
-    if (filePath == data->lastFile) {
-      usrMap = data->lastFileUSRMap;
-    } else {
-      data->lastFile = filePath;
-      filePath = QFileInfo(filePath).canonicalFilePath();
-      
-      // Get or create the USR map for the file.
-      usrMap = USRStorage::Instance().GetUSRMapForFile(filePath);
-      data->lastFileUSRMap = usrMap;
-      
-      if (usrMap == nullptr) {
-        // NOTE: This can happen if a header (that is not listed as a source
-        //       file) is parsed before any source file is parsed that created
-        //       the USRMaps seen by the header. So, this is not an error.
-        //       (But maybe still a situation that we might want to improve:
-        //        perhaps it could be useful to let each open file add their
-        //        own references on USRMaps, not only project source files?)
-        // qDebug() << "ERROR: While indexing, found no USRMap for file " << filePath << " of a cursor -> the USR cannot be stored. The existence of the USRMap should have been ensured in the included file list update.";
-      }
-    }
-    
-    if (usrMap) {
-      // Build the USR.
-      bool isDefinition =
-          clang_isCursorDefinition(cursor) ||
-          clang_Cursor_isFunctionInlined(cursor);
-      
-      // Store the USR if it does not exist already.
-      bool existsAlready = false;
-      QByteArray USR = ClangString(clang_getCursorUSR(cursor)).ToQByteArray();
-      if (!USR.isEmpty()) {
-        auto range = usrMap->map.equal_range(USR);
-        for (auto it = range.first; it != range.second; ++ it) {
-          if (it->second.line == line &&
-              it->second.column == column) {
-            existsAlready = true;
-            break;
-          }
+    // Build the USR.
+    bool isDefinition =
+        clang_isCursorDefinition(cursor) ||
+        clang_Cursor_isFunctionInlined(cursor);
+    if (!isDefinition &&
+        data->functionBodiesSkipped &&
+        (IsFunctionDeclLikeCursorKind(kind) || kind == CXCursor_ConversionFunction)) {
+      isDefinition = FunctionHasSkippedBody(cursor, data->TU);
+    }
+    
+    // Determine the USRDecl if the USR is not known already.
+    bool existsAlready = false;
+    QByteArray USR = ClangString(clang_getCursorUSR(cursor)).ToQByteArray();
+    if (!USR.isEmpty()) {
+      auto range = knownUSRs->equal_range(USR);
+      for (auto it = range.first; it != range.second; ++ it) {
+        if (it->second.line == line &&
+            it->second.column == column) {
+          existsAlready = true;
+          data->lastFileVisitedUSRs->emplace_back(USR, it->second);
+          break;
         }
-        if (!existsAlready) {
-          // TODO: This is somewhat duplicated from the context creation code.
-          // Use clang_getCursorPrettyPrinted() to get a "nice" version of the function spelling.
-          // TODO: It would be preferable to get this as a semantic string, the same
-          //       way that code completion results are delivered, such that we can
-          //       easily semantically color the different parts. Not sure how easy
-          //       this is with the current libclang interface though.
-          CXPrintingPolicy printingPolicy = clang_getCursorPrintingPolicy(cursor);
-          clang_PrintingPolicy_setProperty(printingPolicy, CXPrintingPolicy_TerseOutput, 1);  // print declaration only, skip body
-          CXString cursorDisplayName = clang_getCursorPrettyPrinted(cursor, printingPolicy);
-          clang_PrintingPolicy_dispose(printingPolicy);
-          QString displayName = QString::fromUtf8(clang_getCString(cursorDisplayName));
-          clang_disposeString(cursorDisplayName);
-          if (displayName.endsWith(QStringLiteral(" {}"))) {
-            displayName.chop(3);
-          } else if (displayName.endsWith(QStringLiteral(" {\n}"))) {
-            displayName.chop(4);
-          }
-          
-          // Try to find the name within the displayName (TODO: Is there any way to do this without heuristics?).
-          QString name = ClangString(clang_getCursorSpelling(cursor)).ToQString();
-          int namePos = -1;
-          if (!name.isEmpty()) {
-            int from = 0;
-            while (from + name.size() <= displayName.size()) {
-              int pos = displayName.indexOf(name, from, Qt::CaseSensitive);
-              if (pos < 0) {
-                break;
-              }
-              
-              namePos = pos;
-              // If the match seems to be good, stop looking for other matches
-              if (pos > 0 && (displayName[pos - 1] == ' ' || displayName[pos - 1] == ':')) {
-                break;
-              }
-              from = pos + name.size();
+      }
+      if (!existsAlready) {
+        // TODO: This is somewhat duplicated from the context creation code.
+        // Use clang_getCursorPrettyPrinted() to get a "nice" version of the function spelling.
+        // TODO: It would be preferable to get this as a semantic string, the same
+        //       way that code completion results are delivered, such that we can
+        //       easily semantically color the different parts. Not sure how easy
+        //       this is with the current libclang interface though.
+        CXPrintingPolicy printingPolicy = clang_getCursorPrintingPolicy(cursor);
+        clang_PrintingPolicy_setProperty(printingPolicy, CXPrintingPolicy_TerseOutput, 1);  // print declaration only, skip body
+        CXString cursorDisplayName = clang_getCursorPrettyPrinted(cursor, printingPolicy);
+        clang_PrintingPolicy_dispose(printingPolicy);
+        QString displayName = QString::fromUtf8(clang_getCString(cursorDisplayName));
+        clang_disposeString(cursorDisplayName);
+        if (displayName.endsWith(QStringLiteral(" {}"))) {
+          displayName.chop(3);
+        } else if (displayName.endsWith(QStringLiteral(" {\n}"))) {
+          displayName.chop(4);
+        }
+        
+        // Try to find the name within the displayName (TODO: Is there any way to do this without heuristics?).
+        QString name = ClangString(clang_getCursorSpelling(cursor)).ToQString();
+        int namePos = -1;
+        if (!name.isEmpty()) {
+          int from = 0;
+          while (from + name.size() <= displayName.size()) {
+            int pos = displayName.indexOf(name, from, Qt::CaseSensitive);
+            if (pos < 0) {
+              break;
+            }
+            
+            namePos = pos;
+            // If the match seems to be good, stop looking for other matches
+            if (pos > 0 && (displayName[pos - 1] == ' ' || displayName[pos - 1] == ':')) {
+              break;
             }
+            from = pos + name.size();
           }
-          
-          usrMap->map.insert(std::make_pair(
-              USR,
-              USRDecl(displayName, line, column, isDefinition, kind, namePos, name.size())));
         }
+        
+        auto insertedIt = knownUSRs->insert(std::make_pair(
+            USR,
+            USRDecl(displayName, line, column, isDefinition, kind, namePos, name.size())));
+        data->lastFileVisitedUSRs->emplace_back(insertedIt->first, insertedIt->second);
       }
     }
   }
@@ -796,30 +1652,58 @@ CXChildVisitResult VisitClangAST_StoreUSRs(CXCursor cursor, CXCursor /*parent*/,
   //            << ", Spelling: " << ClangString(clang_getCursorSpelling(cursor)).ToQString()
   //            << ", USR: " << ClangString(clang_getCursorUSR(cursor)).ToQString();
   
-  if (kind == CXCursor_Namespace ||
-      kind == CXCursor_UnexposedDecl ||  // this is required to recurse into: extern "C" { ... }
-      IsClassDeclLikeCursorKind(kind)) {
+  if (recurse) {
     return CXChildVisit_Recurse;
-  } else {
-    return CXChildVisit_Continue;
   }
+  
+  // Record the references within the cursor's subtree (for example, in
+  // function signatures and bodies) for the global USR reference index.
+  // Declarations within the subtree (such as local variables) are not stored.
+  AddReferencedUSR(cursor, data->lastFileReferencedUSRs);
+  clang_visitChildren(cursor, &VisitClangAST_StoreUSRReferences, data->lastFileReferencedUSRs);
+  return CXChildVisit_Continue;
 }
 
-void IndexFile_StoreUSRs(CXTranslationUnit clangTU, bool onlyForTUFile) {
-  // Clear USRs of this file.
-  QString TUFilePath = QFileInfo(ClangString(clang_getTranslationUnitSpelling(clangTU)).ToQString()).canonicalFilePath();
-  USRStorage::Instance().ClearUSRsForFile(TUFilePath);
+void IndexFile_StoreUSRs(CXTranslationUnit clangTU, bool onlyForTUFile, const QByteArray& compileSettingsHash, bool functionBodiesSkipped, USRsByFile* visitedUSRs, USRReferencesByFile* visitedReferences) {
+  QString TUFilePath = CachedCanonicalFilePath(ClangString(clang_getTranslationUnitSpelling(clangTU)).ToQString());
+  USRsByFile localVisitedUSRs;
+  if (!visitedUSRs) {
+    visitedUSRs = &localVisitedUSRs;
+  }
+  USRReferencesByFile localVisitedReferences;
+  if (!visitedReferences) {
+    visitedReferences = &localVisitedReferences;
+  }
   
   // Visit the AST to collect definitions / declarations for cross-referencing
   // with the corresponding definitions / declarations seen in other
-  // translations units.
+  // translations units. This is done without locking the USRStorage.
   StoreDefinitionsVisitorData visitorData;
   visitorData.updateTUFileOnly = onlyForTUFile;
+  visitorData.functionBodiesSkipped = functionBodiesSkipped;
+  visitorData.TU = clangTU;
   visitorData.TUFile = clang_getFile(clangTU, TUFilePath.toUtf8().data());
+  visitorData.TUFilePath = TUFilePath;
+  visitorData.compileSettingsHash = compileSettingsHash;
+  visitorData.visitedUSRs = visitedUSRs;
+  visitorData.lastFileKnownUSRs = nullptr;
+  visitorData.lastFileVisitedUSRs = nullptr;
+  visitorData.lastFileReferencedUSRs = nullptr;
   clang_visitChildren(
       clang_getTranslationUnitCursor(clangTU),
       &VisitClangAST_StoreUSRs,
       &visitorData);
+  
+  for (const auto& item : visitorData.referencedUSRs) {
+    std::vector<QByteArray>& fileReferences = (*visitedReferences)[item.first];
+    fileReferences.assign(item.second.begin(), item.second.end());
+    std::sort(fileReferences.begin(), fileReferences.end());
+  }
+  
+  // Replace the USRs of the TU file and add the new USRs of the included files.
+  USRStorage::Instance().Lock();
+  USRStorage::Instance().StoreUSRsForTU(TUFilePath, compileSettingsHash, visitorData.includes, *visitedUSRs, *visitedReferences, !functionBodiesSkipped);
+  USRStorage::Instance().Unlock();
 }
 
 void VisitInclusionsForIndexing(
@@ -828,74 +1712,117 @@ void VisitInclusionsForIndexing(
     unsigned /*include_len*/,
     CXClientData client_data) {
   std::unordered_set<QString>* includedPaths = reinterpret_cast<std::unordered_set<QString>*>(client_data);
-  includedPaths->insert(QFileInfo(GetClangFilePath(included_file)).canonicalFilePath());
+  includedPaths->insert(CachedCanonicalFilePath(GetClangFilePath(included_file)));
 }
 
 void IndexFile_GetInclusions(CXTranslationUnit clangTU, SourceFile* sourceFile, Project* project, MainWindow* mainWindow) {
-  // Clear included paths
-  std::unordered_set<QString> oldIncludedPaths;
-  oldIncludedPaths.swap(sourceFile->includedPaths);
-  
   // Iterate over all file inclusions to collect the list of included files.
-  clang_getInclusions(clangTU, &VisitInclusionsForIndexing, &sourceFile->includedPaths);
+  std::unordered_set<QString> includedPaths;
+  clang_getInclusions(clangTU, &VisitInclusionsForIndexing, &includedPaths);
+  
+  IndexFile_SetInclusions(includedPaths, sourceFile, project, mainWindow);
+}
+
+void IndexFile_SetInclusions(const std::unordered_set<QString>& includedPaths, SourceFile* sourceFile, Project* project, MainWindow* mainWindow) {
+  // Replace the included paths
+  std::vector<int> oldIncludedFileIds;
+  oldIncludedFileIds.swap(sourceFile->includedFileIds);
+  FileIdTable::Instance().GetOrAddSortedIds(includedPaths, &sourceFile->includedFileIds);
+  project->IncludedPathsChanged(sourceFile, oldIncludedFileIds);
   
   // Add references to newly included files
-  for (const QString& newPath : sourceFile->includedPaths) {
-    if (oldIncludedPaths.count(newPath) == 0) {
-      // Add reference.
-      bool newUSRMapCreated = USRStorage::Instance().AddUSRMapReference(newPath);
-      
-      // If this include file is open in the editor, and its compile settings
-      // were guessed before, then this has changed now. We compare the old
-      // compile settings to the new ones and schedule a reparse if they differ,
-      // respectively remove the warning about guessed compile settings if they
-      // are the same.
-      if (newUSRMapCreated) {
-        Document* document;
-        DocumentWidget* widget;
-        if (mainWindow->GetDocumentAndWidgetForPath(newPath, &document, &widget)) {
-          std::shared_ptr<ClangTU> includeTU = document->GetTUPool()->TakeMostUpToDateTU();
-          if (includeTU) {
-            if (includeTU->isInitialized()) {
-              bool isGuess;
-              int guessQuality;
-              CompileSettings* fileSettings = project->FindSettingsForFile(newPath, &isGuess, &guessQuality);
-              if (!fileSettings || isGuess) {
-                qDebug() << "Error: After adding an include to the list of includes of a SourceFile, querying project->FindSettingsForFile() for this include returned none or guessed compile settings. fileSettings:" << fileSettings << ", isGuess:" << isGuess;
+  std::vector<int> addedIds;
+  std::set_difference(
+      sourceFile->includedFileIds.begin(), sourceFile->includedFileIds.end(),
+      oldIncludedFileIds.begin(), oldIncludedFileIds.end(),
+      std::back_inserter(addedIds));
+  std::vector<QString> addedPaths;
+  FileIdTable::Instance().GetPaths(addedIds, &addedPaths);
+  for (const QString& newPath : addedPaths) {
+    // Add reference.
+    bool newUSRMapCreated = USRStorage::Instance().AddUSRMapReference(newPath);
+    
+    // If this include file is open in the editor, and its compile settings
+    // were guessed before, then this has changed now. We compare the old
+    // compile settings to the new ones and schedule a reparse if they differ,
+    // respectively remove the warning about guessed compile settings if they
+    // are the same.
+    if (newUSRMapCreated) {
+      Document* document;
+      DocumentWidget* widget;
+      if (mainWindow->GetDocumentAndWidgetForPath(newPath, &document, &widget)) {
+        std::shared_ptr<ClangTU> includeTU = document->GetTUPool()->TakeMostUpToDateTU();
+        if (includeTU) {
+          if (includeTU->isInitialized()) {
+            bool isGuess;
+            int guessQuality;
+            CompileSettings* fileSettings = project->FindSettingsForFile(newPath, &isGuess, &guessQuality);
+            if (!fileSettings || isGuess) {
+              qDebug() << "Error: After adding an include to the list of includes of a SourceFile, querying project->FindSettingsForFile() for this include returned none or guessed compile settings. fileSettings:" << fileSettings << ", isGuess:" << isGuess;
+            } else {
+              std::shared_ptr<const CompileCommandLine> commandLine = fileSettings->GetCommandLine(true, newPath, project);
+              if (includeTU->CanBeReparsed(newPath, commandLine)) {
+                // The compile settings are equal. Remove the warning about guessed compile settings.
+                widget->GetContainer()->SetMessage(
+                    DocumentWidgetContainer::MessageType::ParseSettingsAreGuessedNotification,
+                    QStringLiteral(""));
               } else {
-                std::vector<QByteArray> commandLineArgs;
-                commandLineArgs = fileSettings->BuildCommandLineArgs(true, newPath, project);
-                if (includeTU->CanBeReparsed(newPath, commandLineArgs)) {
-                  // The compile settings are equal. Remove the warning about guessed compile settings.
-                  widget->GetContainer()->SetMessage(
-                      DocumentWidgetContainer::MessageType::ParseSettingsAreGuessedNotification,
-                      QStringLiteral(""));
-                } else {
-                  // The compile settings changed. Schedule a reparse for the document.
-                  widget->ParseFile();
-                }
+                // The compile settings changed. Schedule a reparse for the document.
+                widget->ParseFile();
               }
             }
-            document->GetTUPool()->PutTU(includeTU, false);
-          } else {
-            // TODO: Currently we do nothing if both TUs of the document are in use here. It would be good to
-            //       decide properly in this case as well. Maybe store the most recent parse settings in the
-            //       TU pool in order to keep them accessible even when all TUs are taken? However, this is a
-            //       minor issue, since both TUs being in use means that the file is being reparsed at the
-            //       moment anyways, so it will arrive at a good state soon.
           }
+          document->GetTUPool()->PutTU(includeTU, false);
+        } else {
+          // TODO: Currently we do nothing if both TUs of the document are in use here. It would be good to
+          //       decide properly in this case as well. Maybe store the most recent parse settings in the
+          //       TU pool in order to keep them accessible even when all TUs are taken? However, this is a
+          //       minor issue, since both TUs being in use means that the file is being reparsed at the
+          //       moment anyways, so it will arrive at a good state soon.
         }
       }
     }
   }
   
   // Remove references to files that had been included, but are not included anymore now
-  for (const QString& oldPath : oldIncludedPaths) {
-    if (sourceFile->includedPaths.count(oldPath) == 0) {
-      // Remove reference.
-      USRStorage::Instance().RemoveUSRMapReference(oldPath);
+  std::vector<int> removedIds;
+  std::set_difference(
+      oldIncludedFileIds.begin(), oldIncludedFileIds.end(),
+      sourceFile->includedFileIds.begin(), sourceFile->includedFileIds.end(),
+      std::back_inserter(removedIds));
+  std::vector<QString> removedPaths;
+  FileIdTable::Instance().GetPaths(removedIds, &removedPaths);
+  for (const QString& oldPath : removedPaths) {
+    // Remove reference.
+    USRStorage::Instance().RemoveUSRMapReference(oldPath);
+  }
+  
+  project->AddFilesToContentIndex(includedPaths);
+}
+
+
+bool USRMap::RegisterIndexingTU(const QByteArray& compileSettingsHash, const QString& TUPath, qint64 modificationTime) {
+  if (!indexingTUs.empty() &&
+      indexedModificationTime != modificationTime) {
+    // The file changed since it was indexed. Discard the outdated USRs.
+    map.clear();
+    referencedUSRs.clear();
+    referencesComplete = false;
+    indexingTUs.clear();
+    indexesOutdated = true;
+  }
+  if (indexingTUs.empty()) {
+    indexedModificationTime = modificationTime;
+  }
+  
+  for (const std::pair<QByteArray, QString>& indexingTU : indexingTUs) {
+    if (indexingTU.first == compileSettingsHash) {
+      return indexingTU.second == TUPath;
     }
   }
+  
+  indexingTUs.emplace_back(compileSettingsHash, TUPath);
+  return true;
 }
 
 
@@ -904,12 +1831,113 @@ USRStorage& USRStorage::Instance() {
   return instance;
 }
 
+struct USRStorage::DroppedData {
+  std::vector<std::shared_ptr<USRMap>> USRMaps;
+  std::vector<std::unordered_multimap<QByteArray, USRDecl>> maps;
+  std::vector<std::shared_ptr<const GlobalSymbolFile>> globalSymbolFiles;
+};
+
 void USRStorage::ClearUSRsForFile(const QString& canonicalPath) {
   auto it = USRs.find(canonicalPath.toUtf8());
   if (it != USRs.end()) {
-    it->second->map.clear();
+    // Free the old map's nodes in the background.
+    std::vector<std::unordered_multimap<QByteArray, USRDecl>>& droppedMaps = GetDroppedData()->maps;
+    droppedMaps.emplace_back();
+    droppedMaps.back().swap(it->second->map);
     it->second->map.reserve(32);
+    it->second->referencedUSRs.clear();
+    it->second->referencesComplete = false;
+    it->second->indexesOutdated = true;
+  }
+}
+
+void USRStorage::StoreUSRsForTU(
+    const QString& canonicalPath,
+    const QByteArray& compileSettingsHash,
+    const std::vector<std::pair<QString, qint64>>& includes,
+    const USRsByFile& USRs,
+    const USRReferencesByFile& references,
+    bool referencesComplete) {
+  ClearUSRsForFile(canonicalPath);
+  
+  std::unordered_map<QString, qint64> modificationTimes;
+  modificationTimes.reserve(includes.size());
+  for (const std::pair<QString, qint64>& include : includes) {
+    modificationTimes.insert(include);
+  }
+  
+  // Returns the USRMap of the given file if the TU is responsible for
+  // updating it, or null otherwise.
+  auto getUSRMapToUpdate = [&](const QString& path) -> USRMap* {
+    USRMap* usrMap = GetUSRMapForFile(path);
+    if (!usrMap) {
+      return nullptr;
+    }
+    
+    // Take over the responsibility for indexing included files, unless
+    // another TU with the same compile settings is responsible already.
+    if (path != canonicalPath) {
+      auto timeIt = modificationTimes.find(path);
+      if (!usrMap->RegisterIndexingTU(
+              compileSettingsHash,
+              canonicalPath,
+              (timeIt == modificationTimes.end()) ? 0 : timeIt->second)) {
+        return nullptr;
+      }
+    }
+    return usrMap;
+  };
+  
+  for (const auto& fileUSRs : USRs) {
+    USRMap* usrMap = getUSRMapToUpdate(fileUSRs.first);
+    if (!usrMap) {
+      continue;
+    }
+    
+    for (const std::pair<QByteArray, USRDecl>& item : fileUSRs.second) {
+      // Store the USR if it does not exist already.
+      bool existsAlready = false;
+      auto range = usrMap->map.equal_range(item.first);
+      for (auto it = range.first; it != range.second; ++ it) {
+        if (it->second.line == item.second.line &&
+            it->second.column == item.second.column) {
+          existsAlready = true;
+          break;
+        }
+      }
+      if (!existsAlready) {
+        USRDecl decl = item.second;
+        decl.spelling = InternSpelling(decl.spelling);
+        usrMap->map.insert(std::make_pair(InternUSR(item.first), decl));
+        usrMap->indexesOutdated = true;
+      }
+    }
   }
+  
+  for (const auto& fileReferences : references) {
+    USRMap* usrMap = getUSRMapToUpdate(fileReferences.first);
+    if (!usrMap) {
+      continue;
+    }
+    
+    // Add the referenced USRs, merging the sorted lists.
+    std::vector<QByteArray> merged;
+    merged.reserve(usrMap->referencedUSRs.size() + fileReferences.second.size());
+    std::set_union(
+        usrMap->referencedUSRs.begin(), usrMap->referencedUSRs.end(),
+        fileReferences.second.begin(), fileReferences.second.end(),
+        std::back_inserter(merged));
+    if (merged.size() != usrMap->referencedUSRs.size()) {
+      for (QByteArray& USR : merged) {
+        USR = InternUSR(USR);
+      }
+      usrMap->referencedUSRs.swap(merged);
+      usrMap->indexesOutdated = true;
+    }
+    usrMap->referencesComplete |= referencesComplete;
+  }
+  
+  UpdateIndexes();
 }
 
 bool USRStorage::AddUSRMapReference(const QString& canonicalPath) {
@@ -930,8 +1958,17 @@ void USRStorage::RemoveUSRMapReference(const QString& canonicalPath) {
   if (it != USRs.end()) {
     USRMap* usrMap = it->second.get();
     if (usrMap->referenceCount == 1) {
-      // Delete the USRMap.
+      // Delete the USRMap. It is freed in the background.
+      RemoveFromUSRIndex(&*it);
+      DroppedData* dropped = GetDroppedData();
+      dropped->USRMaps.push_back(std::move(it->second));
       USRs.erase(it);
+      auto symbolsIt = globalSymbols.find(canonicalPath);
+      if (symbolsIt != globalSymbols.end()) {
+        dropped->globalSymbolFiles.push_back(std::move(symbolsIt->second));
+        globalSymbols.erase(symbolsIt);
+        globalSymbolsChanged = true;
+      }
     } else {
       -- usrMap->referenceCount;
     }
@@ -940,63 +1977,272 @@ void USRStorage::RemoveUSRMapReference(const QString& canonicalPath) {
   }
 }
 
+void USRStorage::UpdateIndexes() {
+  for (const auto& item : USRs) {
+    USRMap* usrMap = item.second.get();
+    if (!usrMap->indexesOutdated) {
+      continue;
+    }
+    usrMap->indexesOutdated = false;
+    
+    // Update the global USR index. Equal USRs are adjacent in the multimap.
+    RemoveFromUSRIndex(&item);
+    for (auto it = usrMap->map.begin(); it != usrMap->map.end(); ++ it) {
+      if (usrMap->indexedUSRs.empty() || usrMap->indexedUSRs.back() != it->first) {
+        usrMap->indexedUSRs.push_back(it->first);
+        filesByUSR[it->first].push_back(&item);
+      }
+    }
+    
+    // Update the global USR reference index.
+    usrMap->indexedReferencedUSRs = usrMap->referencedUSRs;
+    for (const QByteArray& USR : usrMap->indexedReferencedUSRs) {
+      filesReferencingUSR[USR].push_back(&item);
+    }
+    
+    std::shared_ptr<GlobalSymbolFile> file(new GlobalSymbolFile());
+    file->path = item.first;
+    for (const auto& usr : usrMap->map) {
+      const USRDecl& decl = usr.second;
+      if (decl.namePos < 0) {
+        continue;
+      }
+      bool isClassDeclLike = IsClassDeclLikeCursorKind(decl.kind);
+      if (!isClassDeclLike && !IsFunctionDeclLikeCursorKind(decl.kind)) {
+        continue;
+      }
+      if (isClassDeclLike && !decl.isDefinition) {
+        continue;
+      }
+      
+      file->symbols.emplace_back();
+      GlobalSymbol& symbol = file->symbols.back();
+      symbol.spelling = decl.spelling;
+      symbol.name = decl.spelling.mid(decl.namePos, decl.nameSize);
+      symbol.foldedName = FoldCaseForFuzzyTextMatch(symbol.name);
+      symbol.namePos = decl.namePos;
+      symbol.line = decl.line;
+      symbol.column = decl.column;
+    }
+    
+    if (file->symbols.empty()) {
+      if (globalSymbols.erase(item.first) > 0) {
+        globalSymbolsChanged = true;
+      }
+    } else {
+      globalSymbols[item.first] = file;
+      globalSymbolsChanged = true;
+    }
+  }
+}
+
+void USRStorage::RemoveFromUSRIndex(const std::pair<const QString, std::shared_ptr<USRMap>>* file) {
+  USRMap* usrMap = file->second.get();
+  for (const QByteArray& USR : usrMap->indexedUSRs) {
+    auto it = filesByUSR.find(USR);
+    if (it == filesByUSR.end()) {
+      qDebug() << "Error: USR missing in the global USR index:" << USR;
+      continue;
+    }
+    auto& files = it->second;
+    auto fileIt = std::find(files.begin(), files.end(), file);
+    if (fileIt != files.end()) {
+      *fileIt = files.back();
+      files.pop_back();
+    }
+    if (files.empty()) {
+      filesByUSR.erase(it);
+    }
+  }
+  usrMap->indexedUSRs.clear();
+  
+  for (const QByteArray& USR : usrMap->indexedReferencedUSRs) {
+    auto it = filesReferencingUSR.find(USR);
+    if (it == filesReferencingUSR.end()) {
+      qDebug() << "Error: USR missing in the global USR reference index:" << USR;
+      continue;
+    }
+    auto& files = it->second;
+    auto fileIt = std::find(files.begin(), files.end(), file);
+    if (fileIt != files.end()) {
+      *fileIt = files.back();
+      files.pop_back();
+    }
+    if (files.empty()) {
+      filesReferencingUSR.erase(it);
+    }
+  }
+  usrMap->indexedReferencedUSRs.clear();
+}
+
+USRStorageMemoryUsage USRStorage::EstimateMemoryUsage() const {
+  // Approximate overhead of a node in an unordered container (the pointer to
+  // the next node and the cached hash), not counting the bucket array.
+  constexpr std::size_t kNodeOverhead = 2 * sizeof(void*);
+  
+  USRStorageMemoryUsage result;
+  
+  result.USRMaps = USRs.bucket_count() * sizeof(void*);
+  for (const auto& file : USRs) {
+    const USRMap& usrMap = *file.second;
+    result.USRMaps += kNodeOverhead + sizeof(file) + sizeof(USRMap);
+    result.USRMaps += usrMap.map.bucket_count() * sizeof(void*) +
+                      usrMap.map.size() * (kNodeOverhead + sizeof(std::pair<QByteArray, USRDecl>));
+    result.USRMaps += (usrMap.indexedUSRs.capacity() +
+                       usrMap.referencedUSRs.capacity() +
+                       usrMap.indexedReferencedUSRs.capacity()) * sizeof(QByteArray);
+    result.USRMaps += usrMap.indexingTUs.capacity() * sizeof(std::pair<QByteArray, QString>);
+  }
+  
+  for (const auto* index : {&filesByUSR, &filesReferencingUSR}) {
+    result.indexes += index->bucket_count() * sizeof(void*);
+    for (const auto& item : *index) {
+      result.indexes += kNodeOverhead + sizeof(item) + item.second.capacity() * sizeof(void*);
+    }
+  }
+  
+  result.globalSymbols = globalSymbols.bucket_count() * sizeof(void*);
+  for (const auto& file : globalSymbols) {
+    result.globalSymbols += kNodeOverhead + sizeof(file) + sizeof(GlobalSymbolFile) +
+                            file.second->symbols.capacity() * sizeof(GlobalSymbol);
+    for (const GlobalSymbol& symbol : file.second->symbols) {
+      // The spelling is shared with the USRDecl.
+      result.globalSymbols += StringDataMemoryUsage(symbol.name) + StringDataMemoryUsage(symbol.foldedName);
+    }
+  }
+  
+  result.internedStrings = internedUSRs.EstimateMemoryUsage() + internedSpellings.EstimateMemoryUsage();
+  return result;
+}
+
+void USRStorage::GetGlobalSymbols(std::vector<std::shared_ptr<const GlobalSymbolFile>>* files) {
+  std::shared_ptr<const std::vector<std::shared_ptr<const GlobalSymbolFile>>> snapshot;
+  publishedGlobalSymbolsMutex.lock();
+  snapshot = publishedGlobalSymbols;
+  publishedGlobalSymbolsMutex.unlock();
+  
+  if (snapshot) {
+    *files = *snapshot;
+  }
+}
+
+USRStorage::DroppedData* USRStorage::GetDroppedData() {
+  if (!droppedData) {
+    droppedData.reset(new DroppedData());
+  }
+  return droppedData.get();
+}
+
+void USRStorage::ReleaseDroppedData() {
+  bool returnFreedMemory = droppedData->USRMaps.size() >= kMinDroppedUSRMapsForReturningMemory;
+  BackgroundReclaimer::Instance().Release(std::move(droppedData), returnFreedMemory);
+}
+
+void USRStorage::PublishGlobalSymbols() {
+  if (!globalSymbolsChanged) {
+    return;
+  }
+  globalSymbolsChanged = false;
+  
+  std::shared_ptr<std::vector<std::shared_ptr<const GlobalSymbolFile>>> snapshot(new std::vector<std::shared_ptr<const GlobalSymbolFile>>());
+  snapshot->reserve(globalSymbols.size());
+  for (const auto& item : globalSymbols) {
+    snapshot->push_back(item.second);
+  }
+  
+  publishedGlobalSymbolsMutex.lock();
+  publishedGlobalSymbols = snapshot;
+  publishedGlobalSymbolsMutex.unlock();
+}
+
 void USRStorage::GetFilesForUSRLookup(const QString& canonicalPath, MainWindow* mainWindow, std::unordered_set<QString>* relevantFiles) {
-  // Get all targets that contain or include that file, as well as the
-  // targets that these depend on
-  std::set<const Target*> relevantTargets;
+  // Get all targets that contain or include that file (using the projects'
+  // reverse index of inclusions), as well as the targets that these depend on
+  std::vector<const Target*> containingTargets;
   for (auto& project : mainWindow->GetProjects()) {
-    for (int targetIndex = 0; targetIndex < project->GetNumTargets(); ++ targetIndex) {
-      const Target& target = project->GetTarget(targetIndex);
-      if (target.ContainsOrIncludesFile(canonicalPath)) {
-        relevantTargets.insert(&target);
-        for (Target* dependency : target.dependencies) {
-          relevantTargets.insert(dependency);
-        }
-      }
+    project->FindTargetsThatContainOrInclude(canonicalPath, &containingTargets);
+  }
+  std::set<const Target*> relevantTargets;
+  for (const Target* target : containingTargets) {
+    relevantTargets.insert(target);
+    for (Target* dependency : target->dependencies) {
+      relevantTargets.insert(dependency);
     }
   }
   
-  // Assemble all files contained in or included by these targets
-  relevantFiles->reserve(2048);
+  // Assemble all files contained in or included by these targets, which
+  // each target maintains as the keys of its fileReferenceCounts
+  std::size_t maxNumFiles = 0;
   for (const Target* target : relevantTargets) {
-    for (const SourceFile& source : target->sources) {
-      relevantFiles->insert(source.path);
-      for (const QString& includedPath : source.includedPaths) {
-        relevantFiles->insert(includedPath);
-      }
+    maxNumFiles += target->fileReferenceCounts.size();
+  }
+  relevantFiles->reserve(maxNumFiles);
+  for (const Target* target : relevantTargets) {
+    for (const auto& item : target->fileReferenceCounts) {
+      relevantFiles->insert(item.first);
     }
   }
 }
 
-void USRStorage::LookupUSRs(const QByteArray& USR, std::unordered_set<QString> relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls) {
+void USRStorage::LookupUSRs(const QByteArray& USR, const std::unordered_set<QString>& relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls) {
   foundDecls->reserve(8);
   
-  USRStorage::Instance().Lock();
+  Lock();
+  auto indexIt = filesByUSR.find(USR);
+  if (indexIt != filesByUSR.end()) {
+    for (const auto* file : indexIt->second) {
+      const QString& path = file->first;
+      if (relevantFiles.count(path) == 0) {
+        continue;
+      }
+      
+      // Found occurrences of the USR. Since each file's USRs are stored only
+      // once and each file is listed once in the index, there is no need to
+      // check for duplicates.
+      auto range = file->second->map.equal_range(USR);
+      for (auto it = range.first; it != range.second; ++ it) {
+        foundDecls->push_back(std::make_pair(path, it->second));
+      }
+    }
+  }
+  Unlock();
+}
+
+void USRStorage::LookupDeclsByName(const QString& name, const std::unordered_set<QString>& relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls) {
+  Lock();
   for (const QString& path : relevantFiles) {
-    USRMap* usrMap = USRStorage::Instance().GetUSRMapForFile(path);
+    USRMap* usrMap = GetUSRMapForFile(path);
     if (!usrMap) {
       continue;
     }
-    
-    auto range = usrMap->map.equal_range(USR);
-    for (auto it = range.first; it != range.second; ++ it) {
-      // Found an occurrence of the USR.
-      // TODO: Is this redundancy check still necessary? Each file's USRs should only be stored once now, so I think we can drop it.
-      bool existsAlready = false;
-      for (const std::pair<QString, USRDecl>& existingDecl : *foundDecls) {
-        if (existingDecl.first == path &&
-            existingDecl.second.line == it->second.line &&
-            existingDecl.second.column == it->second.column) {
-          existsAlready = true;
-          break;
-        }
+    for (const auto& item : usrMap->map) {
+      const USRDecl& decl = item.second;
+      if (decl.namePos >= 0 &&
+          decl.nameSize == name.size() &&
+          decl.spelling.midRef(decl.namePos, decl.nameSize) == name) {
+        foundDecls->push_back(std::make_pair(path, decl));
       }
-      
-      if (!existsAlready) {
-        // qDebug() << "Adding:" << path << ":" << it->second.line << ":" << it->second.column;
-        foundDecls->push_back(std::make_pair(path, it->second));
+    }
+  }
+  Unlock();
+}
+
+void USRStorage::LookupUSRReferences(const QByteArray& USR, const std::unordered_set<QString>& relevantFiles, std::unordered_set<QString>* referencingFiles, std::unordered_set<QString>* filesWithIncompleteReferences) {
+  Lock();
+  auto indexIt = filesReferencingUSR.find(USR);
+  if (indexIt != filesReferencingUSR.end()) {
+    for (const auto* file : indexIt->second) {
+      if (relevantFiles.count(file->first) > 0) {
+        referencingFiles->insert(file->first);
       }
     }
   }
-  USRStorage::Instance().Unlock();
+  
+  for (const QString& path : relevantFiles) {
+    auto it = USRs.find(path);
+    if (it == USRs.end() || !it->second->referencesComplete) {
+      filesWithIncompleteReferences->insert(path);
+    }
+  }
+  Unlock();
 }
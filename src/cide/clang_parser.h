@@ -4,10 +4,12 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <clang-c/Index.h>
 #include <QByteArray>
@@ -21,7 +23,15 @@ class Document;
 class MainWindow;
 class Project;
 struct SourceFile;
+struct SweepDiagnostic;
+struct USRDecl;
 
+/// Maps canonical file path --> list of (USR, USRDecl) pairs located in this file.
+typedef std::unordered_map<QString, std::vector<std::pair<QByteArray, USRDecl>>> USRsByFile;
+
+/// Maps canonical file path --> sorted list of distinct USRs that are
+/// referenced by cursors located in this file.
+typedef std::unordered_map<QString, std::vector<QByteArray>> USRReferencesByFile;
 
 CompileSettings* FindParseSettingsForFile(const QString& canonicalPath, const std::vector<std::shared_ptr<Project>>& projects, std::shared_ptr<Project>* usedProject, bool* settingsAreGuessed = nullptr);
 
@@ -33,13 +43,44 @@ void ParseFile(Document* document, MainWindow* mainWindow);
 /// normally. Otherwise, indexes it only.
 void ParseFileIfOpenElseIndex(const QString& canonicalPath, Document* document, MainWindow* mainWindow);
 
+/// Indexes the file @p canonicalPath (as read from disk) with the given
+/// command line and saves the result in the USRIndexCache, without storing
+/// anything in the USRStorage. This is what index worker processes do (see
+/// RunIndexWorker()). Returns false if parsing or saving failed.
+bool IndexFileIntoCache(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs);
+
+/// Parses the file @p canonicalPath (as read from disk) with the indexing
+/// options and appends its errors and warnings, including the ones located in
+/// included files, to @p diagnostics. This is used by the DiagnosticsSweep.
+/// Returns false if no compile settings were found or parsing failed.
+bool CheckFileDiagnostics(const QString& canonicalPath, MainWindow* mainWindow, std::vector<SweepDiagnostic>* diagnostics);
+
 /// Given a parsed TU, extracts indexing information (part 1: inclusions) into @p sourceFile.
 /// This function must be called from the main (Qt) thread.
 void IndexFile_GetInclusions(CXTranslationUnit clangTU, SourceFile* sourceFile, Project* project, MainWindow* mainWindow);
 
+/// Variant of IndexFile_GetInclusions() which takes the list of (canonical)
+/// included paths directly instead of extracting it from a TU.
+/// This function must be called from the main (Qt) thread.
+void IndexFile_SetInclusions(const std::unordered_set<QString>& includedPaths, SourceFile* sourceFile, Project* project, MainWindow* mainWindow);
+
 /// Given a parsed TU, extracts indexing information (part 2: USRs).
-/// This function can be called from any thread.
-void IndexFile_StoreUSRs(CXTranslationUnit clangTU, bool onlyForTUFile);
+/// This function can be called from any thread. The USRStorage must not be
+/// locked when calling it: it is only locked briefly for each visited file and
+/// for storing the results in the end, such that indexing threads do not
+/// block each other (or USR lookups) while visiting the AST.
+/// If @p onlyForTUFile is true, only the USRs within the TU file itself are
+/// updated. Otherwise, included files that are already indexed by another TU
+/// with equal compile settings (see USRMap::indexingTUs) are skipped, given by
+/// @p compileSettingsHash (see USRIndexCache::HashCommandLineArgs()).
+/// @p functionBodiesSkipped must be set if the TU was parsed with
+/// CXTranslationUnit_SkipFunctionBodies.
+/// If @p visitedUSRs is non-null, all USRs that were seen in the TU (regardless
+/// of whether they were stored already before) are additionally returned in it,
+/// such that they can be put into the USRIndexCache. The same applies to the
+/// referenced USRs and @p visitedReferences. The references are only complete
+/// if the function bodies were not skipped.
+void IndexFile_StoreUSRs(CXTranslationUnit clangTU, bool onlyForTUFile, const QByteArray& compileSettingsHash, bool functionBodiesSkipped, USRsByFile* visitedUSRs = nullptr, USRReferencesByFile* visitedReferences = nullptr);
 
 
 /// Stores the location of a definition or declaration together with the "USR"
@@ -85,12 +126,156 @@ struct USRDecl {
 /// the map in which the USRMap is stored, so it is not stored redundantly in
 /// this struct again.
 struct USRMap {
+  /// Registers the TU @p TUPath with the given compile settings for indexing
+  /// this (included) file, whose current modification time is
+  /// @p modificationTime. If the file changed since it was last indexed, the
+  /// outdated USRs are discarded. Returns true if TUPath is responsible for
+  /// indexing the file, or false if another TU with the same compile settings
+  /// is responsible already.
+  bool RegisterIndexingTU(const QByteArray& compileSettingsHash, const QString& TUPath, qint64 modificationTime);
+  
   /// Reference count for how many project source files are equal to, or include
   /// this file. If this reaches zero, the USRMap can be removed.
   int referenceCount;
   
+  /// For included files: the TUs that are responsible for indexing this file,
+  /// as pairs of compile settings hash and canonical TU path. There is at most
+  /// one TU for each distinct compile settings hash. When indexing, other TUs
+  /// with the same compile settings skip over this file, such that its AST is
+  /// not visited redundantly.
+  std::vector<std::pair<QByteArray, QString>> indexingTUs;
+  
+  /// Last modification time of the file at the time it was indexed by the
+  /// indexingTUs. If the file changes, the indexing information is discarded.
+  qint64 indexedModificationTime = 0;
+  
   /// Maps USR string -> USRDecl
   std::unordered_multimap<QByteArray, USRDecl> map;
+  
+  /// The distinct USRs of the map at the time the file was last entered into
+  /// USRStorage's global USR index. These are used to remove the file's
+  /// entries from the index when the map changes.
+  std::vector<QByteArray> indexedUSRs;
+  
+  /// Sorted list of the distinct USRs that are referenced within this file,
+  /// for example by uses of types, functions, or variables. Only USRs of the
+  /// cursor kinds that are stored in the map are recorded.
+  std::vector<QByteArray> referencedUSRs;
+  
+  /// Whether referencedUSRs is known to contain all references in the file.
+  /// This is not the case if the file was indexed with skipped function
+  /// bodies only, since references within the bodies are not seen then.
+  bool referencesComplete = false;
+  
+  /// The referencedUSRs at the time the file was last entered into
+  /// USRStorage's global USR reference index.
+  std::vector<QByteArray> indexedReferencedUSRs;
+  
+  /// Set whenever the map changes, such that the file's entries in the global
+  /// USR index and symbol table get updated (see USRStorage::UpdateIndexes()).
+  bool indexesOutdated = false;
+};
+
+
+/// Entry of the global symbol table, which lists the symbols that can be
+/// searched for in the search bar: definitions of classes and declarations
+/// or definitions of functions.
+struct GlobalSymbol {
+  /// Spelling of the symbol. This shares its data with the corresponding
+  /// USRDecl.
+  QString spelling;
+  
+  /// The name of the symbol (i.e., the sub-string of the spelling starting at
+  /// namePos), and its case-folded version (see FoldCaseForFuzzyTextMatch()).
+  QString name;
+  QString foldedName;
+  
+  /// Position of the name within the spelling.
+  int namePos;
+  
+  /// Location of the symbol (1-based).
+  int line;
+  int column;
+};
+
+/// The global symbols within one file.
+struct GlobalSymbolFile {
+  /// Canonical path of the file.
+  QString path;
+  
+  std::vector<GlobalSymbol> symbols;
+};
+
+
+/// Returns the approximate memory used by the data of the given string (not
+/// accounting for sharing with other strings).
+inline std::size_t StringDataMemoryUsage(const QString& string) { return sizeof(QArrayData) + string.capacity() * sizeof(QChar); }
+inline std::size_t StringDataMemoryUsage(const QByteArray& string) { return sizeof(QArrayData) + string.capacity(); }
+
+/// Pool of interned strings (QString or QByteArray): returns a copy of each
+/// string that shares its data with all other interned copies of equal
+/// strings (via Qt's implicit sharing). This avoids storing the same USR and
+/// spelling strings many times, once for each file (and TU) that they are seen
+/// in. Strings that are only referenced by the pool anymore are freed
+/// periodically, with the period growing with the pool size.
+template <typename T>
+class InternedStringPool {
+ public:
+  inline T Intern(const T& string) {
+    if (strings.size() >= nextCollectionSize) {
+      Collect();
+    }
+    return *strings.insert(string).first;
+  }
+  
+  inline std::size_t size() const { return strings.size(); }
+  
+  /// Returns the approximate memory used by the pool and its strings.
+  std::size_t EstimateMemoryUsage() const {
+    std::size_t result = strings.bucket_count() * sizeof(void*);
+    for (const T& string : strings) {
+      result += 2 * sizeof(void*) + sizeof(T) + StringDataMemoryUsage(string);
+    }
+    return result;
+  }
+  
+ private:
+  void Collect() {
+    for (auto it = strings.begin(); it != strings.end(); ) {
+      if (it->isDetached()) {
+        it = strings.erase(it);
+      } else {
+        ++ it;
+      }
+    }
+    nextCollectionSize = 2 * strings.size();
+    if (nextCollectionSize < kMinCollectionSize) {
+      nextCollectionSize = kMinCollectionSize;
+    }
+  }
+  
+  static constexpr std::size_t kMinCollectionSize = 4096;
+  
+  std::unordered_set<T> strings;
+  std::size_t nextCollectionSize = kMinCollectionSize;
+};
+
+
+/// Approximate memory used by the USRStorage, in bytes.
+struct USRStorageMemoryUsage {
+  inline std::size_t Total() const { return USRMaps + indexes + globalSymbols + internedStrings; }
+  
+  /// The USRMaps of all files (not counting the interned strings).
+  std::size_t USRMaps = 0;
+  
+  /// The global USR index and USR reference index.
+  std::size_t indexes = 0;
+  
+  /// The global symbol table.
+  std::size_t globalSymbols = 0;
+  
+  /// The interned USR and spelling strings, which are shared by the USRMaps.
+  std::size_t internedStrings = 0;
 };
 
 
@@ -111,8 +296,21 @@ class USRStorage {
   ///       thread first and then the USRStorage to avoid deadlocks.
   inline void Lock() { lock.lock(); }
   
-  /// Unlocks the USRStorage mutex.
-  inline void Unlock() { lock.unlock(); }
+  /// Unlocks the USRStorage mutex. If the global symbol table changed, a new
+  /// snapshot of it is published for GetGlobalSymbols() beforehand. Data that
+  /// was dropped while the mutex was locked is freed in the background.
+  inline void Unlock() {
+    PublishGlobalSymbols();
+    numUSRs = filesByUSR.size();
+    if (droppedData) {
+      ReleaseDroppedData();
+    }
+    lock.unlock();
+  }
+  
+  /// Returns the number of distinct USRs in the global USR index, as of the
+  /// last Unlock(). This does not lock the USRStorage.
+  inline std::size_t GetUSRCount() const { return numUSRs; }
   
   void ClearUSRsForFile(const QString& canonicalPath);
   
@@ -121,6 +319,25 @@ class USRStorage {
   bool AddUSRMapReference(const QString& canonicalPath);
   void RemoveUSRMapReference(const QString& canonicalPath);
   
+  /// Replaces the USRs of the TU file @p canonicalPath with the given @p USRs,
+  /// which were collected by IndexFile_StoreUSRs() or loaded from the
+  /// USRIndexCache. USRs for other files are added to the existing USRMaps of
+  /// those files (if they exist) unless they are stored already, or another TU
+  /// with the same compile settings is responsible for indexing the file.
+  /// @p includes gives the modification times of the files,
+  /// and @p compileSettingsHash identifies the compile settings of the TU.
+  /// The referenced USRs given by @p references are stored likewise;
+  /// @p referencesComplete specifies whether they were collected with function
+  /// bodies (see USRMap::referencesComplete).
+  /// The USRStorage must be locked when calling this.
+  void StoreUSRsForTU(
+      const QString& canonicalPath,
+      const QByteArray& compileSettingsHash,
+      const std::vector<std::pair<QString, qint64>>& includes,
+      const USRsByFile& USRs,
+      const USRReferencesByFile& references = USRReferencesByFile(),
+      bool referencesComplete = false);
+  
   // NOTE: The complete process to look up USRs looks like this:
   // 
   // std::unordered_set<QString> relevantFiles;
@@ -138,7 +355,25 @@ class USRStorage {
   void GetFilesForUSRLookup(const QString& canonicalPath, MainWindow* mainWindow, std::unordered_set<QString>* relevantFiles);
   /// Second stage of USR lookup. Returns pairs of file path and USR in @p foundDecls. Does not need to be done in the main thread.
   /// This function internally locks the USRStorage during the operation. It must not be locked already when the function is called.
-  void LookupUSRs(const QByteArray& USR, std::unordered_set<QString> relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls);
+  /// The files containing the USR are looked up in the global USR index, so
+  /// the cost does not depend on the number of relevant files.
+  void LookupUSRs(const QByteArray& USR, const std::unordered_set<QString>& relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls);
+  
+  /// Returns the declarations and definitions in @p relevantFiles whose name
+  /// (see USRDecl::namePos) equals @p name, as pairs of file path and USRDecl
+  /// in @p foundDecls. This is a linear search over the USRs of the relevant
+  /// files, intended for resolving a name while no parsed TU is available.
+  /// Like LookupUSRs(), this locks the USRStorage internally.
+  void LookupDeclsByName(const QString& name, const std::unordered_set<QString>& relevantFiles, std::vector<std::pair<QString, USRDecl>>* foundDecls);
+  
+  /// Looks up the files among @p relevantFiles that reference the given USR
+  /// according to the global USR reference index, and returns them in
+  /// @p referencingFiles. The files among @p relevantFiles for which the
+  /// references are not known completely (see USRMap::referencesComplete),
+  /// including files without a USRMap, are returned in
+  /// @p filesWithIncompleteReferences, since they may reference the USR as
+  /// well. Like LookupUSRs(), this locks the USRStorage internally.
+  void LookupUSRReferences(const QByteArray& USR, const std::unordered_set<QString>& relevantFiles, std::unordered_set<QString>* referencingFiles, std::unordered_set<QString>* filesWithIncompleteReferences);
   
   inline USRMap* GetUSRMapForFile(const QString& canonicalPath) {
     auto it = USRs.find(canonicalPath);
@@ -151,13 +386,52 @@ class USRStorage {
   
   inline const std::unordered_map<QString, std::shared_ptr<USRMap>>& GetAllUSRs() const { return USRs; }
   
+  /// Return interned copies of the given USR or spelling, which share their
+  /// data with all other stored copies of equal strings. The USRStorage must
+  /// be locked when calling these.
+  inline QByteArray InternUSR(const QByteArray& USR) { return internedUSRs.Intern(USR); }
+  inline QString InternSpelling(const QString& spelling) { return internedSpellings.Intern(spelling); }
+  
+  /// Updates the global USR index and the global symbol table entries of all
+  /// files whose USRMaps changed since the last update. This is done at the
+  /// end of indexing each TU, such that only the changed files need to be
+  /// processed. The USRStorage must be locked when calling this.
+  void UpdateIndexes();
+  
+  /// Returns the global symbol table, as one entry per file. The entries are
+  /// never modified after creation (updates replace them), so they can be
+  /// used without locking the USRStorage. This function returns the last
+  /// published snapshot of the table, so it does not wait for indexing
+  /// threads that hold the USRStorage lock.
+  void GetGlobalSymbols(std::vector<std::shared_ptr<const GlobalSymbolFile>>* files);
+  
+  /// Returns an estimate of the memory used by the stored USRs and the indexes
+  /// derived from them. The USRStorage must be locked when calling this.
+  USRStorageMemoryUsage EstimateMemoryUsage() const;
+  
   inline void DebugPrintInfo() {
-    qDebug() << "USRStorage: Storing USRMaps for" << USRs.size() << "files";
+    qDebug() << "USRStorage: Storing USRMaps for" << USRs.size() << "files," << internedUSRs.size() << "interned USRs," << internedSpellings.size() << "interned spellings";
   }
   
  private:
   USRStorage() = default;
   
+  /// Publishes a new snapshot of globalSymbols if it changed since the last
+  /// snapshot. The USRStorage must be locked when calling this.
+  void PublishGlobalSymbols();
+  
+  /// Removes the entries of the given file from the global USR index and the
+  /// global USR reference index.
+  void RemoveFromUSRIndex(const std::pair<const QString, std::shared_ptr<USRMap>>* file);
+  
+  /// Returns droppedData, creating it if it does not exist yet.
+  struct DroppedData;
+  DroppedData* GetDroppedData();
+  
+  /// Hands droppedData over to the BackgroundReclaimer. The USRStorage must be
+  /// locked when calling this.
+  void ReleaseDroppedData();
+  
   
   /// Maps file name --> USR multimap shared_ptr.
   /// The USR multimap maps USR string --> USRDecl.
@@ -165,5 +439,43 @@ class USRStorage {
   /// first-level map needs to be resized.
   std::unordered_map<QString, std::shared_ptr<USRMap>> USRs;
   
+  /// Global USR index: maps USR string --> entries in USRs for all files whose
+  /// USRMap contains this USR. The pointers remain valid since the nodes of
+  /// an unordered_map are never moved. This avoids probing the USRMaps of all
+  /// relevant files in LookupUSRs().
+  std::unordered_map<QByteArray, std::vector<const std::pair<const QString, std::shared_ptr<USRMap>>*>> filesByUSR;
+  
+  /// Global USR reference index: maps USR string --> entries in USRs for all
+  /// files that reference this USR (see USRMap::referencedUSRs).
+  std::unordered_map<QByteArray, std::vector<const std::pair<const QString, std::shared_ptr<USRMap>>*>> filesReferencingUSR;
+  
+  /// Maps file name --> global symbols in this file. Files without global
+  /// symbols have no entry.
+  std::unordered_map<QString, std::shared_ptr<const GlobalSymbolFile>> globalSymbols;
+  
+  /// Whether globalSymbols changed since publishedGlobalSymbols was created.
+  bool globalSymbolsChanged = false;
+  
+  /// Snapshot of the values in globalSymbols, which is replaced by
+  /// PublishGlobalSymbols(). Protected by publishedGlobalSymbolsMutex instead
+  /// of the USRStorage lock, which is only held briefly for swapping it.
+  std::shared_ptr<const std::vector<std::shared_ptr<const GlobalSymbolFile>>> publishedGlobalSymbols;
+  std::mutex publishedGlobalSymbolsMutex;
+  
+  /// Interned USRs and spellings, see InternUSR() and InternSpelling().
+  InternedStringPool<QByteArray> internedUSRs;
+  InternedStringPool<QString> internedSpellings;
+  
+  /// Size of filesByUSR at the last Unlock(), see GetUSRCount().
+  std::atomic<std::size_t> numUSRs{0};
+  
+  /// The USRMaps and other data that were removed from the storage while it
+  /// was locked. Freeing them consists of many small deallocations, which
+  /// takes long for the USRMaps of a whole project (when closing or
+  /// reconfiguring it). So instead of freeing them under the lock, they are
+  /// collected here and freed in the background after unlocking. Defined in
+  /// clang_parser.cc. May be null.
+  std::shared_ptr<DroppedData> droppedData;
+  
   std::mutex lock;
 };
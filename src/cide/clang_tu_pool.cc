@@ -4,11 +4,59 @@
 
 #include "cide/clang_tu_pool.h"
 
+#include <algorithm>
+#include <limits>
+
+#include <QHash>
+
+#include "cide/background_reclaimer.h"
 #include "cide/clang_utils.h"
+#include "cide/settings.h"
+
+/// Counter for the parse stamps of all TUs.
+static std::atomic<unsigned int> nextParseStamp(1);
+
+CompileCommandLine::CompileCommandLine(std::vector<QByteArray>&& args)
+    : args(std::move(args)) {
+  hash = std::hash<std::size_t>()(this->args.size());
+  for (const QByteArray& arg : this->args) {
+    hash ^= qHash(arg) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+}
+
+bool CompileCommandLine::Equal(const std::shared_ptr<const CompileCommandLine>& a, const std::shared_ptr<const CompileCommandLine>& b) {
+  if (a == b) {
+    return true;
+  }
+  if (!a || !b || a->hash != b->hash) {
+    return false;
+  }
+  return a->args == b->args;
+}
+
+std::size_t TUMemoryUsage::Total() const {
+  return AST + preamble + sourceManager + preprocessor + completion + other;
+}
+
+TUMemoryUsage& TUMemoryUsage::operator+= (const TUMemoryUsage& other) {
+  AST += other.AST;
+  preamble += other.preamble;
+  sourceManager += other.sourceManager;
+  preprocessor += other.preprocessor;
+  completion += other.completion;
+  this->other += other.other;
+  return *this;
+}
+
 
 ClangTU::ClangTU()
-    : parseStamp(0),
-      initialized(false) {}
+    : preambleHash(0),
+      textChangeCounter(-1),
+      parseStamp(0),
+      initialized(false),
+      loadedFromCache(false),
+      parsedFromFilesOnDisk(false),
+      parsedWithReducedProfile(false) {}
 
 ClangTU::~ClangTU() {
   if (initialized) {
@@ -16,33 +64,91 @@ ClangTU::~ClangTU() {
   }
 }
 
-bool ClangTU::CanBeReparsed(const QString& path, const std::vector<QByteArray>& commandLineArgs) {
-  if (!initialized) {
-    return false;
-  }
-  if (path != GetPath()) {
+bool ClangTU::CanBeReparsed(const QString& path, const std::shared_ptr<const CompileCommandLine>& commandLine) {
+  if (!initialized || loadedFromCache) {
     return false;
   }
-  if (commandLineArgs.size() != mCommandLineArgs.size()) {
+  if (!CompileCommandLine::Equal(commandLine, mCommandLine)) {
     return false;
   }
-  for (int i = 0; i < mCommandLineArgs.size(); ++ i) {
-    if (mCommandLineArgs[i] != commandLineArgs[i]) {
-      return false;
-    }
-  }
-  
-  return true;
+  return path == GetPath();
 }
 
-void ClangTU::Set(CXTranslationUnit TU, const std::vector<QByteArray>& commandLineArgs) {
+void ClangTU::Set(CXTranslationUnit TU, const std::shared_ptr<const CompileCommandLine>& commandLine) {
   if (initialized) {
     clang_disposeTranslationUnit(mTU);
   }
   
   mTU = TU;
-  mCommandLineArgs = commandLineArgs;
+  mCommandLine = commandLine;
+  referenceMap.reset();
+  implementationCandidates.reset();
+  variableColorIndices.reset();
+  textChangeCounter = -1;
   initialized = true;
+  loadedFromCache = false;
+  parsedFromFilesOnDisk = false;
+  parsedWithReducedProfile = false;
+}
+
+void ClangTU::Clear() {
+  if (initialized) {
+    clang_disposeTranslationUnit(mTU);
+    initialized = false;
+  }
+  includesWithModificationTimes.clear();
+  mCommandLine.reset();
+  referenceMap.reset();
+  implementationCandidates.reset();
+  variableColorIndices.reset();
+  preambleHash = 0;
+  textChangeCounter = -1;
+  parseStamp = 0;
+  loadedFromCache = false;
+  parsedFromFilesOnDisk = false;
+  memoryUsage = TUMemoryUsage();
+}
+
+void ClangTU::UpdateMemoryUsage() {
+  memoryUsage = TUMemoryUsage();
+  if (!initialized) {
+    return;
+  }
+  
+  CXTUResourceUsage usage = clang_getCXTUResourceUsage(mTU);
+  for (unsigned int i = 0; i < usage.numEntries; ++ i) {
+    std::size_t amount = usage.entries[i].amount;
+    switch (usage.entries[i].kind) {
+    case CXTUResourceUsage_AST:
+    case CXTUResourceUsage_AST_SideTables:
+    case CXTUResourceUsage_Identifiers:
+    case CXTUResourceUsage_Selectors:
+      memoryUsage.AST += amount;
+      break;
+    case CXTUResourceUsage_ExternalASTSource_Membuffer_Malloc:
+    case CXTUResourceUsage_ExternalASTSource_Membuffer_MMap:
+      memoryUsage.preamble += amount;
+      break;
+    case CXTUResourceUsage_SourceManagerContentCache:
+    case CXTUResourceUsage_SourceManager_Membuffer_Malloc:
+    case CXTUResourceUsage_SourceManager_Membuffer_MMap:
+    case CXTUResourceUsage_SourceManager_DataStructures:
+      memoryUsage.sourceManager += amount;
+      break;
+    case CXTUResourceUsage_Preprocessor:
+    case CXTUResourceUsage_PreprocessingRecord:
+    case CXTUResourceUsage_Preprocessor_HeaderSearch:
+      memoryUsage.preprocessor += amount;
+      break;
+    case CXTUResourceUsage_GlobalCompletionResults:
+      memoryUsage.completion += amount;
+      break;
+    default:
+      memoryUsage.other += amount;
+      break;
+    }
+  }
+  clang_disposeCXTUResourceUsage(usage);
 }
 
 QString ClangTU::GetPath() {
@@ -51,16 +157,32 @@ QString ClangTU::GetPath() {
 
 
 ClangTUPool::ClangTUPool(int numTUs)
-    : parseCounter(1),
-      mTUs(numTUs) {
+    : mTUs(numTUs) {
   for (int i = 0; i < numTUs; ++ i) {
     mTUs[i].reset(new ClangTU());
   }
+  
+  allTUsEvicted = false;
+  lastParseUsedReducedProfile = false;
+  lastUseStamp = ClangTUPoolManager::Instance().GetNextUseStamp();
+  ClangTUPoolManager::Instance().RegisterPool(this);
+}
+
+ClangTUPool::~ClangTUPool() {
+  ClangTUPoolManager::Instance().UnregisterPool(this);
+  
+  // Disposing TUs may take long, so do it in the background.
+  for (std::shared_ptr<ClangTU>& TU : mTUs) {
+    BackgroundReclaimer::Instance().Release(std::move(TU));
+  }
 }
 
-ClangTUPool::~ClangTUPool() {}
+void ClangTUPool::MarkAsUsed() {
+  lastUseStamp = ClangTUPoolManager::Instance().GetNextUseStamp();
+}
 
 std::shared_ptr<ClangTU> ClangTUPool::TakeLeastUpToDateTU() {
+  MarkAsUsed();
   std::unique_lock<std::mutex> lock(accessMutex);
   
   unsigned int minParseStamp = std::numeric_limits<unsigned int>::max();
@@ -83,6 +205,7 @@ std::shared_ptr<ClangTU> ClangTUPool::TakeLeastUpToDateTU() {
 }
 
 std::shared_ptr<ClangTU> ClangTUPool::TakeMostUpToDateTU() {
+  MarkAsUsed();
   std::unique_lock<std::mutex> lock(accessMutex);
   
   unsigned int maxParseStamp = 0;
@@ -104,12 +227,203 @@ std::shared_ptr<ClangTU> ClangTUPool::TakeMostUpToDateTU() {
   }
 }
 
+std::shared_ptr<ClangTU> ClangTUPool::TakeStaleTUForCatchUp() {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  if (mTUs.size() < 2) {
+    return nullptr;
+  }
+  
+  int leastUpToDateIndex = 0;
+  int mostUpToDateIndex = 0;
+  for (int i = 1; i < mTUs.size(); ++ i) {
+    if (mTUs[i]->GetParseStamp() < mTUs[leastUpToDateIndex]->GetParseStamp()) {
+      leastUpToDateIndex = i;
+    }
+    if (mTUs[i]->GetParseStamp() > mTUs[mostUpToDateIndex]->GetParseStamp()) {
+      mostUpToDateIndex = i;
+    }
+  }
+  
+  const std::shared_ptr<ClangTU>& stale = mTUs[leastUpToDateIndex];
+  const std::shared_ptr<ClangTU>& fresh = mTUs[mostUpToDateIndex];
+  if (leastUpToDateIndex == mostUpToDateIndex ||
+      !stale->isInitialized() ||
+      !fresh->isInitialized() ||
+      stale->IsLoadedFromCache() ||
+      stale->GetTextChangeCounter() < 0 ||
+      stale->GetTextChangeCounter() == fresh->GetTextChangeCounter() ||
+      stale->IsParsedWithReducedProfile() != fresh->IsParsedWithReducedProfile() ||
+      !CompileCommandLine::Equal(stale->GetCommandLine(), fresh->GetCommandLine())) {
+    return nullptr;
+  }
+  
+  std::shared_ptr<ClangTU> result = stale;
+  mTUs.erase(mTUs.begin() + leastUpToDateIndex);
+  return result;
+}
+
+int ClangTUPool::GetNumFreeTUs() {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  return mTUs.size();
+}
+
 void ClangTUPool::PutTU(const std::shared_ptr<ClangTU>& TU, bool reparsed) {
   if (reparsed) {
-    TU->SetParseStamp(parseCounter);
-    ++ parseCounter;
+    TU->SetParseStamp(nextParseStamp++);
+    TU->UpdateMemoryUsage();
+    allTUsEvicted = false;
+    lastParseUsedReducedProfile = TU->IsParsedWithReducedProfile();
   }
   
   std::unique_lock<std::mutex> lock(accessMutex);
   mTUs.push_back(TU);
+  ++ returnCounter;
+  lock.unlock();
+  TUReturnedCondition.notify_all();
+  
+  if (reparsed) {
+    ClangTUPoolManager::Instance().EnforceBudget();
+  }
+  
+  ClangTUPoolManager::Instance().NotifyTUReturned(this);
+}
+
+unsigned int ClangTUPool::GetReturnCounter() {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  return returnCounter;
+}
+
+bool ClangTUPool::WaitForReturnedTU(unsigned int returnCounter, std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  return TUReturnedCondition.wait_until(lock, deadline, [&]() {
+    return this->returnCounter != returnCounter;
+  });
+}
+
+TUMemoryUsage ClangTUPool::GetMemoryUsage(int* numParsedTUs) {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  
+  TUMemoryUsage result;
+  if (numParsedTUs) {
+    *numParsedTUs = 0;
+  }
+  for (const std::shared_ptr<ClangTU>& TU : mTUs) {
+    if (TU->isInitialized()) {
+      result += TU->GetMemoryUsageByCategory();
+      if (numParsedTUs) {
+        ++ *numParsedTUs;
+      }
+    }
+  }
+  return result;
+}
+
+void ClangTUPool::EvictTUs(int maxParsedTUs, std::size_t memoryBudget, std::size_t* totalMemoryUsage) {
+  std::unique_lock<std::mutex> lock(accessMutex);
+  
+  // Sort the parsed TUs by decreasing parse stamp, such that the most
+  // up-to-date ones are kept.
+  std::vector<ClangTU*> parsedTUs;
+  for (const std::shared_ptr<ClangTU>& TU : mTUs) {
+    if (TU->isInitialized()) {
+      parsedTUs.push_back(TU.get());
+    }
+  }
+  std::sort(parsedTUs.begin(), parsedTUs.end(), [](ClangTU* a, ClangTU* b) {
+    return a->GetParseStamp() > b->GetParseStamp();
+  });
+  
+  for (int i = static_cast<int>(parsedTUs.size()) - 1; i >= 0; -- i) {
+    bool overBudget = memoryBudget > 0 && totalMemoryUsage && *totalMemoryUsage > memoryBudget;
+    if (i < maxParsedTUs && !overBudget) {
+      break;
+    }
+    
+    if (totalMemoryUsage) {
+      *totalMemoryUsage -= std::min(*totalMemoryUsage, parsedTUs[i]->GetMemoryUsage());
+    }
+    parsedTUs[i]->Clear();
+    if (i == 0) {
+      allTUsEvicted = true;
+    }
+  }
+}
+
+
+ClangTUPoolManager& ClangTUPoolManager::Instance() {
+  static ClangTUPoolManager instance;
+  return instance;
+}
+
+ClangTUPoolManager::ClangTUPoolManager() {
+  memoryBudget = static_cast<std::size_t>(Settings::Instance().GetTUMemoryBudgetMB()) * 1024 * 1024;
+  useCounter = 1;
+}
+
+void ClangTUPoolManager::SetTUReturnedCallback(const std::function<void(ClangTUPool*)>& callback) {
+  std::unique_lock<std::mutex> lock(TUReturnedCallbackMutex);
+  TUReturnedCallback = callback;
+}
+
+void ClangTUPoolManager::NotifyTUReturned(ClangTUPool* pool) {
+  std::unique_lock<std::mutex> lock(TUReturnedCallbackMutex);
+  if (TUReturnedCallback) {
+    TUReturnedCallback(pool);
+  }
+}
+
+void ClangTUPoolManager::SetMemoryBudget(std::size_t bytes) {
+  memoryBudget = bytes;
+  EnforceBudget();
+}
+
+void ClangTUPoolManager::EnforceBudget() {
+  std::unique_lock<std::mutex> lock(poolsMutex);
+  
+  // Sort the pools from the most to the least recently used one.
+  std::vector<ClangTUPool*> sortedPools = pools;
+  std::sort(sortedPools.begin(), sortedPools.end(), [](ClangTUPool* a, ClangTUPool* b) {
+    return a->lastUseStamp > b->lastUseStamp;
+  });
+  
+  // Reduce the background pools to at most one parsed TU, and determine the
+  // total memory usage.
+  std::size_t totalMemoryUsage = 0;
+  for (int i = 0; i < sortedPools.size(); ++ i) {
+    ClangTUPool* pool = sortedPools[i];
+    if (i >= kNumRecentPoolsWithAllTUs) {
+      pool->EvictTUs(1, 0, nullptr);
+    }
+    totalMemoryUsage += pool->GetMemoryUsage().Total();
+  }
+  
+  // If the budget is exceeded, dispose the TUs of the least recently used
+  // pools, but never those of the most recently used one.
+  std::size_t budget = memoryBudget;
+  for (int i = static_cast<int>(sortedPools.size()) - 1; i >= 1; -- i) {
+    if (budget == 0 || totalMemoryUsage <= budget) {
+      break;
+    }
+    sortedPools[i]->EvictTUs(std::numeric_limits<int>::max(), budget, &totalMemoryUsage);
+  }
+}
+
+TUMemoryUsage ClangTUPoolManager::GetTotalMemoryUsage() {
+  std::unique_lock<std::mutex> lock(poolsMutex);
+  
+  TUMemoryUsage result;
+  for (ClangTUPool* pool : pools) {
+    result += pool->GetMemoryUsage();
+  }
+  return result;
+}
+
+void ClangTUPoolManager::RegisterPool(ClangTUPool* pool) {
+  std::unique_lock<std::mutex> lock(poolsMutex);
+  pools.push_back(pool);
+}
+
+void ClangTUPoolManager::UnregisterPool(ClangTUPool* pool) {
+  std::unique_lock<std::mutex> lock(poolsMutex);
+  pools.erase(std::remove(pools.begin(), pools.end(), pool), pools.end());
 }
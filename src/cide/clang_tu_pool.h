@@ -4,15 +4,67 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <vector>
 
 #include <clang-c/Index.h>
+#include <QByteArray>
 #include <QString>
 
 #include "cide/clang_index.h"
 
+class ClangReferenceMap;
+struct ImplementationCandidates;
+struct VariableColorIndices;
+
+/// Command-line arguments for parsing a file, together with their hash. These
+/// are built once per CompileSettings group and file kind (see
+/// CompileSettings::GetCommandLine()), and shared immutably among all TUs
+/// parsed with them.
+struct CompileCommandLine {
+  explicit CompileCommandLine(std::vector<QByteArray>&& args);
+  
+  /// Returns whether both command lines contain the same arguments. This only
+  /// compares the arguments if the pointers and hashes do not decide it.
+  static bool Equal(const std::shared_ptr<const CompileCommandLine>& a, const std::shared_ptr<const CompileCommandLine>& b);
+  
+  std::vector<QByteArray> args;
+  std::size_t hash;
+};
+
+/// Memory used by a libclang TU as reported by clang_getCXTUResourceUsage(),
+/// grouped into categories (in bytes).
+struct TUMemoryUsage {
+  /// Total over all categories.
+  std::size_t Total() const;
+  
+  TUMemoryUsage& operator+= (const TUMemoryUsage& other);
+  
+  /// The AST, its side tables, identifiers and selectors.
+  std::size_t AST = 0;
+  
+  /// Memory buffers of the external AST source, i.e., of the precompiled
+  /// preamble or PCH.
+  std::size_t preamble = 0;
+  
+  /// Contents of the source files and the source manager data structures.
+  std::size_t sourceManager = 0;
+  
+  /// The preprocessor, preprocessing record and header search.
+  std::size_t preprocessor = 0;
+  
+  /// Cached global code completion results.
+  std::size_t completion = 0;
+  
+  /// Any other kind of usage reported by libclang.
+  std::size_t other = 0;
+};
+
 /// Wraps a libclang translation unit together with the settings that have been
 /// used to create it.
 class ClangTU {
@@ -31,30 +83,101 @@ class ClangTU {
   ~ClangTU();
   
   /// Returns true if this ClangTU instance contains a TU that has been parsed
-  /// with the given path and commandLineArgs before, such that it can be
+  /// with the given path and commandLine before, such that it can be
   /// reparsed to obtain an up-to-date TU. If this returns false, the TU has
   /// to be created from scratch instead.
   bool CanBeReparsed(
       const QString& path,
-      const std::vector<QByteArray>& commandLineArgs);
+      const std::shared_ptr<const CompileCommandLine>& commandLine);
   
   /// Sets the contents of this ClangTU instance.
   void Set(
       CXTranslationUnit TU,
-      const std::vector<QByteArray>& commandLineArgs);
+      const std::shared_ptr<const CompileCommandLine>& commandLine);
+  
+  /// Disposes the libclang TU (if any) in order to free its memory. The TU
+  /// then needs to be parsed from scratch again.
+  void Clear();
+  
+  /// Queries libclang for the amount of memory used by the TU. This should be
+  /// called after each (re-)parse; GetMemoryUsage() then returns the result.
+  void UpdateMemoryUsage();
+  
+  /// Returns the total memory usage of the TU at the last call to
+  /// UpdateMemoryUsage().
+  inline std::size_t GetMemoryUsage() const { return memoryUsage.Total(); }
+  
+  /// Returns the memory usage of the TU at the last call to
+  /// UpdateMemoryUsage(), by category.
+  inline const TUMemoryUsage& GetMemoryUsageByCategory() const { return memoryUsage; }
   
   QString GetPath();
   
   inline const CXTranslationUnit& TU() const { return mTU; }
   inline CXIndex index() const { return mIndex.index(); }
   
+  /// Returns the stamp of the last parse of the TU, or 0 if it has not been
+  /// parsed. Later parses have larger stamps, and the stamps are unique among
+  /// all TUs, so they may be used to identify a version of a TU.
   inline unsigned int GetParseStamp() const { return parseStamp; }
   inline void SetParseStamp(unsigned int value) { parseStamp = value; }
   
   inline bool isInitialized() const { return initialized; }
   
   inline std::vector<IncludeWithModificationTime>& GetIncludes() { return includesWithModificationTimes; }
-  inline const std::vector<QByteArray>& GetCommandLineArgs() const { return mCommandLineArgs; }
+  
+  /// Document::preambleHash() of the text that the TU was last parsed with,
+  /// or 0 if unknown.
+  inline std::size_t GetPreambleHash() const { return preambleHash; }
+  inline void SetPreambleHash(std::size_t value) { preambleHash = value; }
+  
+  /// Document::textChangeCounter() of the text that the TU was last parsed
+  /// with, or -1 if unknown (for example, for TUs that were only used for
+  /// indexing). Reset by Set() and Clear().
+  inline int GetTextChangeCounter() const { return textChangeCounter; }
+  inline void SetTextChangeCounter(int value) { textChangeCounter = value; }
+  
+  inline const std::shared_ptr<const CompileCommandLine>& GetCommandLine() const { return mCommandLine; }
+  
+  /// Whether the TU was loaded from the TUCache instead of being parsed. Such
+  /// TUs cannot be reparsed (CanBeReparsed() returns false) or used for code
+  /// completion. Reset by Set().
+  inline bool IsLoadedFromCache() const { return loadedFromCache; }
+  inline void SetLoadedFromCache(bool value) { loadedFromCache = value; }
+  
+  /// Whether the TU was last parsed without any unsaved files, such that it
+  /// corresponds to the files on disk and may be saved in the TUCache. Reset
+  /// by Set().
+  inline bool IsParsedFromFilesOnDisk() const { return parsedFromFilesOnDisk; }
+  inline void SetParsedFromFilesOnDisk(bool value) { parsedFromFilesOnDisk = value; }
+  
+  /// Whether the TU was parsed with the reduced parse options for documents
+  /// in the background (see ParseThreadPool::UseFullParseProfileFor()). Such
+  /// TUs lack function bodies and the completion cache, and are only reparsed
+  /// with the same options. Reset by Set().
+  inline bool IsParsedWithReducedProfile() const { return parsedWithReducedProfile; }
+  inline void SetParsedWithReducedProfile(bool value) { parsedWithReducedProfile = value; }
+  
+  /// The references within the TU's main file, as collected while
+  /// highlighting the last parse result, or null if not available. Must be
+  /// reset before reparsing the TU, since the map refers to the AST. Reset by
+  /// Set() and Clear().
+  inline const std::shared_ptr<const ClangReferenceMap>& GetReferenceMap() const { return referenceMap; }
+  inline void SetReferenceMap(const std::shared_ptr<const ClangReferenceMap>& map) { referenceMap = map; }
+  
+  /// The candidates for implementation completion items that were found in
+  /// the last parse result, or null if not determined yet. Like the reference
+  /// map, this must be reset before reparsing the TU. Reset by Set() and
+  /// Clear().
+  inline const std::shared_ptr<const ImplementationCandidates>& GetImplementationCandidates() const { return implementationCandidates; }
+  inline void SetImplementationCandidates(const std::shared_ptr<const ImplementationCandidates>& candidates) { implementationCandidates = candidates; }
+  
+  /// The colors that were assigned to the local variables of the TU's main
+  /// file for per-variable coloring when highlighting the last parse result,
+  /// or null. Unlike the reference map, this is kept across reparses, such
+  /// that the variables keep their colors. Reset by Set() and Clear().
+  inline const std::shared_ptr<const VariableColorIndices>& GetVariableColorIndices() const { return variableColorIndices; }
+  inline void SetVariableColorIndices(const std::shared_ptr<const VariableColorIndices>& indices) { variableColorIndices = indices; }
   
  private:
   /// List of included files and their last modification times as given by
@@ -64,10 +187,19 @@ class ClangTU {
   std::vector<IncludeWithModificationTime> includesWithModificationTimes;
   
   /// Command-line arguments that were used to parse the TU
-  std::vector<QByteArray> mCommandLineArgs;
+  std::shared_ptr<const CompileCommandLine> mCommandLine;
+  std::shared_ptr<const ClangReferenceMap> referenceMap;
+  std::shared_ptr<const ImplementationCandidates> implementationCandidates;
+  std::shared_ptr<const VariableColorIndices> variableColorIndices;
+  std::size_t preambleHash;
+  int textChangeCounter;
   unsigned int parseStamp;
+  TUMemoryUsage memoryUsage;
   CXTranslationUnit mTU;
   bool initialized;
+  bool loadedFromCache;
+  bool parsedFromFilesOnDisk;
+  bool parsedWithReducedProfile;
   
   // We create a CXIndex for every TU in the hope that this avoids issues
   // with multithreaded access to libclang functionality.
@@ -77,12 +209,33 @@ class ClangTU {
 /// Stores a pool of libclang translation units (TUs). At least two TUs should
 /// be used for a document that is edited, such that one remains available for
 /// code completion / AST queries while the other one is being used for re-parsing.
+/// 
+/// All pools are registered with the ClangTUPoolManager, which may dispose the
+/// parsed TUs of pools that have not been used recently in order to limit the
+/// memory usage.
 class ClangTUPool {
+ friend class ClangTUPoolManager;
  public:
   ClangTUPool(int numTUs);
   
   ~ClangTUPool();
   
+  /// Marks the pool as the most recently used one (for example, because its
+  /// document has been activated). This is also done by the Take...()
+  /// functions.
+  void MarkAsUsed();
+  
+  /// Returns true if the parsed TUs of the pool have been disposed by the
+  /// ClangTUPoolManager since the last parse, such that the document needs to
+  /// be parsed again before code completion and AST queries can be used.
+  inline bool AllTUsEvicted() const { return allTUsEvicted; }
+  
+  /// Returns true if the last parse result that was put into the pool was
+  /// parsed with the reduced profile for background documents, such that the
+  /// document should be parsed again with the full profile once it gets
+  /// activated.
+  inline bool LastParseUsedReducedProfile() const { return lastParseUsedReducedProfile; }
+  
   /// If any free TU is available, takes it out of the pool and returns it.
   /// Prefers the least up to date TU in case multiple ones are available.
   /// 
@@ -96,12 +249,124 @@ class ClangTUPool {
   /// queries.
   std::shared_ptr<ClangTU> TakeMostUpToDateTU();
   
+  /// If at least two TUs are available and the least up-to-date one of them
+  /// was parsed from an older version of the document than the most
+  /// up-to-date one (see ClangTU::GetTextChangeCounter()), with the same
+  /// command line and parse profile, takes the least up-to-date TU out of the
+  /// pool and returns it. Otherwise, returns nullptr.
+  /// 
+  /// This is used to reparse the stale TU while the user is idle (see
+  /// TUCatchUpOperation), such that all TUs of the pool stay within one
+  /// version of the document. At least one TU remains available for code
+  /// completion and AST queries.
+  std::shared_ptr<ClangTU> TakeStaleTUForCatchUp();
+  
+  /// Returns the number of TUs that are currently in the pool, i.e., that
+  /// are not taken out by any thread.
+  int GetNumFreeTUs();
+  
   /// Inserts the TU into the pool, making it available to the Take...()
-  /// functions again.
+  /// functions again. If @p reparsed is true, this lets the ClangTUPoolManager
+  /// enforce the memory budget afterwards. Wakes up the threads that wait in
+  /// WaitForReturnedTU() and calls the ClangTUPoolManager's TU-returned
+  /// callback (if any).
   void PutTU(const std::shared_ptr<ClangTU>& TU, bool reparsed);
   
+  /// Returns the number of PutTU() calls so far. To wait for a TU without
+  /// missing one that is returned in between, this should be queried before
+  /// trying to take a TU, and passed to WaitForReturnedTU() if that failed.
+  unsigned int GetReturnCounter();
+  
+  /// Blocks until GetReturnCounter() differs from @p returnCounter, i.e., a TU
+  /// has been put into the pool since, or until @p deadline has passed.
+  /// Returns false in the latter case. Must not be called from the Qt thread,
+  /// since TUs are usually returned from there.
+  bool WaitForReturnedTU(unsigned int returnCounter, std::chrono::steady_clock::time_point deadline);
+  
+  /// Returns the summed memory usage of the parsed TUs that are in the pool
+  /// (TUs that are taken out of it at the moment are not counted), and
+  /// optionally their number in @p numParsedTUs.
+  TUMemoryUsage GetMemoryUsage(int* numParsedTUs = nullptr);
+  
  private:
+  /// Disposes available parsed TUs (the least up-to-date first) until at most
+  /// @p maxParsedTUs parsed TUs remain in the pool. Further TUs are disposed
+  /// while @p *totalMemoryUsage exceeds @p memoryBudget (if both are
+  /// non-zero). Decreases @p *totalMemoryUsage (if non-null) by the memory
+  /// usage of the disposed TUs.
+  void EvictTUs(int maxParsedTUs, std::size_t memoryBudget, std::size_t* totalMemoryUsage);
+  
   std::mutex accessMutex;
-  unsigned int parseCounter;
   std::vector<std::shared_ptr<ClangTU>> mTUs;
+  
+  /// Number of PutTU() calls, protected by accessMutex.
+  unsigned int returnCounter = 0;
+  std::condition_variable TUReturnedCondition;
+  
+  /// Stamp for the last use of the pool, see ClangTUPoolManager.
+  std::atomic<unsigned int> lastUseStamp;
+  
+  std::atomic<bool> allTUsEvicted;
+  std::atomic<bool> lastParseUsedReducedProfile;
+};
+
+/// Singleton class which limits the number and memory usage of the parsed
+/// TUs in all ClangTUPools (i.e., of all open documents):
+/// 
+/// * The pools of the kNumRecentPoolsWithAllTUs most recently used documents
+///   keep all of their TUs, such that re-parsing and code completion can be
+///   done in parallel.
+/// * The pools of other documents keep at most one parsed TU.
+/// * If the total memory usage of the parsed TUs exceeds the configured budget,
+///   the TUs of the least recently used pools are disposed (except for the
+///   most recently used pool). These documents are parsed again once they get
+///   activated.
+class ClangTUPoolManager {
+ public:
+  static constexpr int kNumRecentPoolsWithAllTUs = 2;
+  
+  static ClangTUPoolManager& Instance();
+  
+  /// Sets the memory budget for all parsed TUs in bytes. Zero means that there
+  /// is no limit.
+  void SetMemoryBudget(std::size_t bytes);
+  
+  inline std::size_t GetMemoryBudget() const { return memoryBudget; }
+  
+  /// Disposes TUs according to the rules given in the class description.
+  void EnforceBudget();
+  
+  /// Returns the memory usage of the parsed TUs in all pools, which is what
+  /// EnforceBudget() compares with the budget.
+  TUMemoryUsage GetTotalMemoryUsage();
+  
+  /// Returns a new stamp for marking a pool as used.
+  inline unsigned int GetNextUseStamp() { return useCounter++; }
+  
+  /// Sets a function that is called with the pool whenever a TU is put back
+  /// into any pool (without holding the pool's mutex). CodeInfo uses this to
+  /// wake up its workers that wait for a TU. Pass an empty function to remove
+  /// the callback.
+  void SetTUReturnedCallback(const std::function<void(ClangTUPool*)>& callback);
+  
+ private:
+  friend class ClangTUPool;
+  
+  ClangTUPoolManager();
+  
+  void RegisterPool(ClangTUPool* pool);
+  void UnregisterPool(ClangTUPool* pool);
+  
+  void NotifyTUReturned(ClangTUPool* pool);
+  
+  /// Protects pools. If locking both this and a pool's accessMutex, this must
+  /// be locked first.
+  std::mutex poolsMutex;
+  std::vector<ClangTUPool*> pools;
+  
+  std::atomic<std::size_t> memoryBudget;
+  std::atomic<unsigned int> useCounter;
+  
+  std::mutex TUReturnedCallbackMutex;
+  std::function<void(ClangTUPool*)> TUReturnedCallback;
 };
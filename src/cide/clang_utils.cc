@@ -4,46 +4,66 @@
 
 #include "cide/clang_utils.h"
 
+#include "cide/document.h"
 #include "cide/main_window.h"
 
 void GetAllUnsavedFiles(
     MainWindow* mainWindow,
     std::vector<CXUnsavedFile>* unsavedFiles,
-    std::vector<std::string>* unsavedFileContents,
-    std::vector<std::string>* unsavedFilePaths) {
-  int numDocuments = mainWindow->GetNumDocuments();
-  
-  int numDocumentsWithUnsavedChanges = 0;
-  for (int i = 0; i < numDocuments; ++ i) {
+    std::vector<std::shared_ptr<const QByteArray>>* unsavedFileContents,
+    std::vector<QByteArray>* unsavedFilePaths) {
+  std::vector<Document*> documentsWithUnsavedChanges;
+  for (int i = 0, numDocuments = mainWindow->GetNumDocuments(); i < numDocuments; ++ i) {
     Document* document = mainWindow->GetDocument(i).get();
     if (document->HasUnsavedChanges()) {
-      ++ numDocumentsWithUnsavedChanges;
+      documentsWithUnsavedChanges.push_back(document);
     }
   }
   
-  unsavedFiles->resize(numDocumentsWithUnsavedChanges);
-  unsavedFileContents->resize(numDocumentsWithUnsavedChanges);
-  unsavedFilePaths->resize(numDocumentsWithUnsavedChanges);
+  unsavedFiles->resize(documentsWithUnsavedChanges.size());
+  unsavedFileContents->resize(documentsWithUnsavedChanges.size());
+  unsavedFilePaths->resize(documentsWithUnsavedChanges.size());
   
-  int outIndex = 0;
-  for (int i = 0; i < numDocuments; ++ i) {
-    Document* document = mainWindow->GetDocument(i).get();
-    if (!document->HasUnsavedChanges()) {
-      continue;
-    }
+  for (int outIndex = 0; outIndex < documentsWithUnsavedChanges.size(); ++ outIndex) {
+    Document* document = documentsWithUnsavedChanges[outIndex];
     
     CXUnsavedFile& unsavedFile = (*unsavedFiles)[outIndex];
-    std::string& unsavedFileContent = (*unsavedFileContents)[outIndex];
-    std::string& unsavedFilePath = (*unsavedFilePaths)[outIndex];
-    
-    unsavedFileContent = document->GetDocumentText().toStdString();
-    unsavedFilePath = QFileInfo(document->path()).canonicalFilePath().toStdString();
-    unsavedFile.Filename = unsavedFilePath.c_str();
-    unsavedFile.Contents = unsavedFileContent.c_str();
-    unsavedFile.Length = unsavedFileContent.size();
+    std::shared_ptr<const QByteArray>& unsavedFileContent = (*unsavedFileContents)[outIndex];
+    QByteArray& unsavedFilePath = (*unsavedFilePaths)[outIndex];
     
-    ++ outIndex;
+    unsavedFileContent = document->GetDocumentTextUtf8();
+    unsavedFilePath = document->path().toUtf8();  // the path is canonical already
+    unsavedFile.Filename = unsavedFilePath.constData();
+    unsavedFile.Contents = unsavedFileContent->constData();
+    unsavedFile.Length = unsavedFileContent->size();
+  }
+}
+
+DocumentLocation CXSourceLocationToDocumentLocation(const CXSourceLocation& location, const Document& document) {
+  unsigned offset;
+  clang_getFileLocation(location, nullptr, nullptr, nullptr, &offset);
+  return document.LocationForUtf8Offset(offset);
+}
+
+DocumentRange CXSourceRangeToDocumentRange(const CXSourceRange& range, const Document& document) {
+  if (clang_Range_isNull(range)) {
+    return DocumentRange::Invalid();
   }
+  
+  CXFile startFile;
+  unsigned startOffset;
+  clang_getFileLocation(clang_getRangeStart(range), &startFile, nullptr, nullptr, &startOffset);
+  
+  CXFile endFile;
+  unsigned endOffset;
+  clang_getFileLocation(clang_getRangeEnd(range), &endFile, nullptr, nullptr, &endOffset);
+  
+  if (!clang_File_isEqual(startFile, endFile) || endOffset < startOffset) {
+    // See CXSourceRangeToDocumentRange() with line offsets.
+    return DocumentRange::Invalid();
+  }
+  
+  return DocumentRange(document.LocationForUtf8Offset(startOffset), document.LocationForUtf8Offset(endOffset));
 }
 
 
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include <clang-c/Index.h>
 #include <QByteArray>
 #include <QString>
@@ -11,6 +14,7 @@
 #include "cide/document_location.h"
 #include "cide/document_range.h"
 
+class Document;
 class MainWindow;
 
 class ClangString {
@@ -110,6 +114,15 @@ inline DocumentRange CXSourceRangeToDocumentRange(const CXSourceRange& range, co
   return DocumentRange(startLocation, endLocation);
 }
 
+/// Versions of CXSourceLocationToDocumentLocation() and
+/// CXSourceRangeToDocumentRange() which map libclang's UTF-8 file offsets to
+/// the (UTF-16) offsets of @p document with Document::LocationForUtf8Offset().
+/// Unlike the line offset based versions, these also handle lines with
+/// non-ASCII characters correctly. @p document must contain the text which
+/// the TU was parsed with.
+DocumentLocation CXSourceLocationToDocumentLocation(const CXSourceLocation& location, const Document& document);
+DocumentRange CXSourceRangeToDocumentRange(const CXSourceRange& range, const Document& document);
+
 // NOTE: This would need to take into account UTF8-UTF16 differences
 // inline CXSourceRange DocumentRangeToCXSourceRange(const DocumentRange& range, CXFile file, CXTranslationUnit tu) {
 //   CXSourceLocation startLocation = clang_getLocationForOffset(
@@ -166,11 +179,19 @@ inline QString GetClangText(const CXSourceRange& range, CXTranslationUnit tu) {
   return QString::fromUtf8(text + startOffset, endOffset - startOffset);
 }
 
+/// Returns the contents of all open documents with unsaved changes in
+/// @p unsavedFiles for passing them to libclang. The buffers that these point
+/// to are returned in @p unsavedFileContents and @p unsavedFilePaths, which
+/// must be kept alive as long as @p unsavedFiles is used. The contents are
+/// shared with the documents' UTF-8 text caches (see
+/// Document::GetDocumentTextUtf8()), so this is cheap for documents that did
+/// not change since the last call.
+/// This function must be called from the main (Qt) thread.
 void GetAllUnsavedFiles(
     MainWindow* mainWindow,
     std::vector<CXUnsavedFile>* unsavedFiles,
-    std::vector<std::string>* unsavedFileContents,
-    std::vector<std::string>* unsavedFilePaths);
+    std::vector<std::shared_ptr<const QByteArray>>* unsavedFileContents,
+    std::vector<QByteArray>* unsavedFilePaths);
 
 /// Attempts to find the while, do, for, or switch statement that the given
 /// break or continue statement cursor refers to. Returns true if successful,
@@ -8,15 +8,25 @@
 #include <QPainter>
 #include <QPaintEvent>
 #include <QScrollBar>
+#include <QTimer>
 
 #include "cide/clang_utils.h"
 #include "cide/document_widget.h"
 #include "cide/settings.h"
 #include "cide/text_utils.h"
 
-CompletionItem::CompletionItem() {}
+/// Item count from which on the items are scored in background threads
+/// instead of in the Qt thread.
+constexpr int kMinItemsForBackgroundScoring = 2000;
 
-CompletionItem::CompletionItem(const CXCodeCompleteResults* libclangResults, int index) {
+/// Number of items that are scored by a thread at a time.
+constexpr int kScoringChunkSize = 512;
+
+CompletionItem::CompletionItem()
+    : haveDisplayText(true) {}
+
+CompletionItem::CompletionItem(const CXCodeCompleteResults* libclangResults, int index)
+    : haveDisplayText(false) {
   const CXCompletionString& completion = libclangResults->Results[index].CompletionString;
   
   clangCompletionIndex = index;
@@ -26,6 +36,27 @@ CompletionItem::CompletionItem(const CXCodeCompleteResults* libclangResults, int
   // Note: This also classified deprecated items as "not available".
   isAvailable = clang_getCompletionAvailability(completion) == CXAvailability_Available;
   
+  // Extract the filter text only. The typed-text chunk is never within an
+  // optional chunk.
+  unsigned numChunks = clang_getNumCompletionChunks(completion);
+  for (int chunkIndex = 0; chunkIndex < numChunks; ++ chunkIndex) {
+    if (clang_getCompletionChunkKind(completion, chunkIndex) == CXCompletionChunk_TypedText) {
+      CXString clangText = clang_getCompletionChunkText(completion, chunkIndex);
+      filterText = QString::fromUtf8(clang_getCString(clangText));
+      clang_disposeString(clangText);
+      break;
+    }
+  }
+}
+
+void CompletionItem::CreateDisplayText(const CXCodeCompleteResults* libclangResults) {
+  if (haveDisplayText) {
+    return;
+  }
+  haveDisplayText = true;
+  
+  const CXCompletionString& completion = libclangResults->Results[clangCompletionIndex].CompletionString;
+  
   DisplayStyle currentStyle = DisplayStyle::Default;
   if (numFixits > 0) {
     displayStyles.emplace_back(std::make_pair(0, DisplayStyle::Fixit));
@@ -33,7 +64,7 @@ CompletionItem::CompletionItem(const CXCodeCompleteResults* libclangResults, int
     
     for (int i = 0; i < numFixits; ++ i) {
       CXSourceRange range;
-      CXString clangReplacement = clang_getCompletionFixIt(const_cast<CXCodeCompleteResults*>(libclangResults), index, i, &range);
+      CXString clangReplacement = clang_getCompletionFixIt(const_cast<CXCodeCompleteResults*>(libclangResults), clangCompletionIndex, i, &range);
       QString replacement = QString::fromUtf8(clang_getCString(clangReplacement));
       clang_disposeString(clangReplacement);
       if (!replacement.isEmpty()) {
@@ -69,7 +100,6 @@ void CompletionItem::AppendCompletionString(const CXCompletionString& completion
       clang_disposeString(clangText);
       
       if (kind == CXCompletionChunk_TypedText) {
-        filterText = text;
         setStyle(DisplayStyle::FilterText);
       } else if (kind == CXCompletionChunk_Placeholder) {
         setStyle(DisplayStyle::Placeholder);
@@ -89,8 +119,16 @@ void CompletionItem::AppendCompletionString(const CXCompletionString& completion
 
 
 struct CompletionItemSorter {
-  inline CompletionItemSorter(CompletionItem* items)
-      : items(items) {}
+  /// Sorts the items based on their matchScore attributes.
+  inline CompletionItemSorter(const CompletionItem* items)
+      : items(items),
+        scores(nullptr) {}
+  
+  /// Sorts the items based on the given scores (with scores[i] belonging to
+  /// items[i]) instead of their matchScore attributes.
+  inline CompletionItemSorter(const CompletionItem* items, const FuzzyTextMatchScore* scores)
+      : items(items),
+        scores(scores) {}
   
   inline bool operator() (int indexA, int indexB) const {
     const CompletionItem& itemA = items[indexA];
@@ -98,7 +136,9 @@ struct CompletionItemSorter {
     
     // Sort based on the match quality between the items' filter texts and the
     // text input by the user.
-    int scoreComparison = itemA.matchScore.Compare(itemB.matchScore);
+    const FuzzyTextMatchScore& scoreA = scores ? scores[indexA] : itemA.matchScore;
+    const FuzzyTextMatchScore& scoreB = scores ? scores[indexB] : itemB.matchScore;
+    int scoreComparison = scoreA.Compare(scoreB);
     if (scoreComparison != -1) {
       return scoreComparison;
     }
@@ -118,17 +158,20 @@ struct CompletionItemSorter {
     return indexA < indexB;
   }
   
-  CompletionItem* items;
+  const CompletionItem* items;
+  const FuzzyTextMatchScore* scores;
 };
 
 
-CodeCompletionWidget::CodeCompletionWidget(std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults, QPoint invocationPoint, QWidget* parentWidget, QWidget* parent)
+CodeCompletionWidget::CodeCompletionWidget(std::vector<CompletionItem>&& items, const std::shared_ptr<CXCodeCompleteResults>& libclangResults, QPoint invocationPoint, QWidget* parentWidget, QWidget* parent)
     : QWidget(parent, GetCustomTooltipWindowFlags()) {
   mLibclangResults = libclangResults;
   items.swap(mItems);
   mSortOrder.resize(mItems.size());
+  mFoldedFilterTexts.resize(mItems.size());
   for (int i = 0, size = mItems.size(); i < size; ++ i) {
     mSortOrder[i] = i;
+    mFoldedFilterTexts[i] = FoldCaseForFuzzyTextMatch(mItems[i].filterText);
   }
   
   setFocusPolicy(Qt::NoFocus);
@@ -137,31 +180,161 @@ CodeCompletionWidget::CodeCompletionWidget(std::vector<CompletionItem>&& items,
   scrollBar = new QScrollBar(Qt::Vertical, this);
   connect(scrollBar, &QScrollBar::valueChanged, this, &CodeCompletionWidget::ScrollChanged);
   
+  numCandidateItems = mItems.size();
+  
   this->parentWidget = parentWidget;
   invocationPosition = invocationPoint;
+  
+  scoringCanceled = false;
 }
 
 CodeCompletionWidget::~CodeCompletionWidget() {
-  clang_disposeCodeCompleteResults(mLibclangResults);
+  StopScoringJob();
 }
 
 void CodeCompletionWidget::SetFilterText(const QString& text) {
-  // Score each item according to how well it matches the new filter text. Note
-  // that this must be very fast since the number of items may be huge (and we
-  // currently perform the sorting in the foreground thread, i.e., the UI will
-  // lock up for the duration this takes). Even with only some Qt headers
-  // included, the item count was in the range of 10'000 items already!
-  for (int i = 0, numItems = mItems.size(); i < numItems; ++ i) {
-    CompletionItem& item = mItems[i];
-    ComputeFuzzyTextMatch(text, item.filterText, &item.matchScore);
+  StopScoringJob();
+  
+  // Even with only some Qt headers included, the item count was in the range
+  // of 10'000 items already. Scoring this many items on every keystroke would
+  // make the UI lag, so for large item counts, the items are scored in the
+  // background.
+  int numItemsToScore = GetNumCandidateItems(text);
+  if (numItemsToScore < kMinItemsForBackgroundScoring) {
+    ApplyFilterText(text);
+    return;
+  }
+  
+  pendingFilterText = text;
+  filterPending = true;
+  scoringCanceled = false;
+  scoringAbortData.aborted = false;
+  std::vector<int> candidates(mSortOrder.begin(), mSortOrder.begin() + numItemsToScore);
+  scoringThread.reset(new std::thread(&CodeCompletionWidget::ScoringThreadMain, this, text, candidates));
+}
+
+int CodeCompletionWidget::GetNumCandidateItems(const QString& text) const {
+  // If the new filter text extends the previous one, then the items that did
+  // not match the previous text cannot match the new text either (see
+  // ComputeFuzzyTextMatch()), so only the previous candidates need to be
+  // scored again.
+  return text.startsWith(filterText) ? numCandidateItems : mItems.size();
+}
+
+void CodeCompletionWidget::ApplyFilterText(const QString& text) {
+  // Score each candidate item according to how well it matches the new filter
+  // text.
+  QString textFolded = FoldCaseForFuzzyTextMatch(text);
+  auto candidatesEnd = mSortOrder.begin() + GetNumCandidateItems(text);
+  for (auto it = mSortOrder.begin(); it != candidatesEnd; ++ it) {
+    CompletionItem& item = mItems[*it];
+    ComputeFuzzyTextMatch(text, textFolded, item.filterText, mFoldedFilterTexts[*it], &item.matchScore);
   }
   
+  // Move the items that still match to the start of mSortOrder. The others
+  // remain candidates only for shorter filter texts.
+  auto matchingEnd = std::partition(mSortOrder.begin(), candidatesEnd, [&](int index) {
+    return IsFuzzyTextMatch(mItems[index].matchScore, text.size());
+  });
+  numCandidateItems = matchingEnd - mSortOrder.begin();
+  
   // Sort the items.
-  numSortedItems = std::min<std::size_t>(maxNumVisibleItems, mSortOrder.size());
-  std::partial_sort(mSortOrder.begin(), mSortOrder.begin() + numSortedItems, mSortOrder.end(), CompletionItemSorter(mItems.data()));
+  numSortedItems = 0;
+  ExtendItemSort(0);
   
   filterText = text;
+  FilterTextChanged();
+}
+
+void CodeCompletionWidget::StopScoringJob() {
+  if (!scoringThread) {
+    return;
+  }
+  
+  scoringCanceled = true;
+  scoringAbortData.Abort();
+  scoringThread->join();
+  scoringThread.reset();
+  filterPending = false;
+}
+
+void CodeCompletionWidget::ScoringThreadMain(QString text, std::vector<int> candidates) {
+  // Note: The filterText and priority attributes of the items (as well as
+  // mFoldedFilterTexts) are never changed after construction, so they can be
+  // read here while the Qt thread uses the items (and creates their display
+  // texts).
+  const int numCandidates = candidates.size();
+  const QString textFolded = FoldCaseForFuzzyTextMatch(text);
+  std::vector<FuzzyTextMatchScore> scores(mItems.size());
+  
+  // Score the items in chunks, distributed over multiple threads.
+  std::atomic<int> nextChunkStart(0);
+  auto scoreChunks = [&]() {
+    while (!scoringCanceled) {
+      int chunkStart = nextChunkStart.fetch_add(kScoringChunkSize);
+      if (chunkStart >= numCandidates) {
+        return;
+      }
+      int chunkEnd = std::min(numCandidates, chunkStart + kScoringChunkSize);
+      for (int i = chunkStart; i < chunkEnd; ++ i) {
+        int index = candidates[i];
+        ComputeFuzzyTextMatch(text, textFolded, mItems[index].filterText, mFoldedFilterTexts[index], &scores[index]);
+      }
+    }
+  };
+  
+  int numThreads = std::min<int>(
+      std::max<int>(1, std::thread::hardware_concurrency()),
+      (numCandidates + kScoringChunkSize - 1) / kScoringChunkSize);
+  std::vector<std::thread> helperThreads;
+  for (int i = 1; i < numThreads; ++ i) {
+    helperThreads.emplace_back(scoreChunks);
+  }
+  scoreChunks();
+  for (std::thread& thread : helperThreads) {
+    thread.join();
+  }
+  if (scoringCanceled) {
+    return;
+  }
+  
+  // Move the candidates that still match to the front and sort the best ones.
+  auto matchingEnd = std::partition(candidates.begin(), candidates.end(), [&](int index) {
+    return IsFuzzyTextMatch(scores[index], text.size());
+  });
+  int numMatching = matchingEnd - candidates.begin();
+  int numSorted = std::min(maxNumVisibleItems, numMatching);
+  std::partial_sort(candidates.begin(), candidates.begin() + numSorted, matchingEnd, CompletionItemSorter(mItems.data(), scores.data()));
+  if (scoringCanceled) {
+    return;
+  }
   
+  RunInQtThreadBlocking([&]() {
+    if (scoringCanceled) {
+      return;
+    }
+    
+    // Since SetFilterText() cancels this job, the first numCandidates
+    // elements of mSortOrder are still a permutation of the candidates (while
+    // their order might have been changed by ExtendItemSort()).
+    for (int index : candidates) {
+      mItems[index].matchScore = scores[index];
+    }
+    std::copy(candidates.begin(), candidates.end(), mSortOrder.begin());
+    numCandidateItems = numMatching;
+    numSortedItems = numSorted;
+    filterText = text;
+    filterPending = false;
+    FilterTextChanged();
+    
+    // Emit the signal only after this thread returned from
+    // RunInQtThreadBlocking(), since receivers may delete the widget, which
+    // waits for this thread to exit.
+    QTimer::singleShot(0, this, &CodeCompletionWidget::FilterApplied);
+  }, &scoringAbortData);
+}
+
+void CodeCompletionWidget::FilterTextChanged() {
   // We currently never preserve the selection when the filter text changes.
   selectedItem = 0;
   yScroll = 0;
@@ -193,7 +366,8 @@ void CodeCompletionWidget::paintEvent(QPaintEvent* event) {
   
   int currentY = 1 + minItem * lineHeight - yScroll;
   for (int itemIndex = minItem; itemIndex <= maxItem; ++ itemIndex) {
-    const CompletionItem& item = mItems[mSortOrder[itemIndex]];
+    CompletionItem& item = mItems[mSortOrder[itemIndex]];
+    item.CreateDisplayText(mLibclangResults.get());
     
     int visibleHeight = std::min(height() - 1 - currentY, lineHeight);
     
@@ -436,7 +610,17 @@ void CodeCompletionWidget::ExtendItemSort(int itemIndex) {
   // Note: we arbitrarily add maxNumVisibleItems to itemIndex here such that we
   // won't need to sort again until this new index is reached.
   int newNumSortedItems = std::min<std::size_t>(itemIndex + maxNumVisibleItems, mSortOrder.size());
-  std::partial_sort(mSortOrder.begin() + numSortedItems, mSortOrder.begin() + newNumSortedItems, mSortOrder.end(), CompletionItemSorter(mItems.data()));
+  
+  // The candidates and the remaining items are sorted separately, since all
+  // candidates match the filter text better than the remaining items (whose
+  // scores may stem from shorter filter texts).
+  auto candidatesEnd = mSortOrder.begin() + numCandidateItems;
+  if (numSortedItems < numCandidateItems) {
+    std::partial_sort(mSortOrder.begin() + numSortedItems, mSortOrder.begin() + std::min(newNumSortedItems, numCandidateItems), candidatesEnd, CompletionItemSorter(mItems.data()));
+  }
+  if (newNumSortedItems > numCandidateItems) {
+    std::partial_sort(mSortOrder.begin() + std::max(numSortedItems, numCandidateItems), mSortOrder.begin() + newNumSortedItems, mSortOrder.end(), CompletionItemSorter(mItems.data()));
+  }
   numSortedItems = newNumSortedItems;
 }
 
@@ -445,6 +629,10 @@ void CodeCompletionWidget::SetInvocationPoint(const QPoint& point) {
 }
 
 bool CodeCompletionWidget::HasSingleExactMatch() {
+  if (filterPending) {
+    return false;
+  }
+  
   if (numSortedItems < 2) {
     ExtendItemSort(2);
     if (numSortedItems < 2) {
@@ -481,7 +669,51 @@ bool CodeCompletionWidget::HasSingleExactMatch() {
   return insertionText == filterText;
 }
 
+/// If we complete a path for an inclusion directive, extends the replacement
+/// range to the end of the current line. libclang gives a
+/// "CXCursor_NotImplemented" for these kinds of completions currently, so
+/// instead check for the #include at the start of the line.
+static void ExtendReplacementRangeForInclusionDirective(Document* document, const DocumentLocation& invocationLoc, DocumentRange* replacementRange) {
+  Document::CharacterIterator charIt(document, invocationLoc.offset);
+  while (charIt.IsValid() && charIt.GetChar() != '\n') {
+    -- charIt;
+  }
+  if (charIt.IsValid()) {
+    ++ charIt;
+  } else {
+    charIt = Document::CharacterIterator(document, 0);
+  }
+  while (charIt.IsValid() && IsWhitespace(charIt.GetChar())) {
+    ++ charIt;
+  }
+  QString include = QStringLiteral("#include");
+  int pos = 0;
+  while (pos < include.size() && charIt.IsValid()) {
+    if (charIt.GetChar() == include[pos]) {
+      ++ charIt;
+      ++ pos;
+    } else {
+      break;
+    }
+  }
+  bool lineStartsWithInclude = pos == include.size();
+  if (lineStartsWithInclude) {
+    charIt = Document::CharacterIterator(document, replacementRange->end.offset);
+    while (charIt.IsValid() && charIt.GetChar() != '\n') {
+      ++ charIt;
+    }
+    replacementRange->end = charIt.GetCharacterOffset();
+  }
+}
+
 void CodeCompletionWidget::Accept(DocumentWidget* widget, const DocumentLocation& invocationLoc) {
+  if (filterPending) {
+    // Make sure that the item is selected from the results for the current
+    // filter text.
+    StopScoringJob();
+    ApplyFilterText(pendingFilterText);
+  }
+  
   CompletionItem& item = mItems[mSortOrder[selectedItem]];
   
   // Get the line start offsets, required for CXSourceRangeToDocumentRange.
@@ -517,7 +749,7 @@ void CodeCompletionWidget::Accept(DocumentWidget* widget, const DocumentLocation
   if (item.numFixits > 0) {
     for (int fixitIndex = 0; fixitIndex < item.numFixits; ++ fixitIndex) {
       CXSourceRange fixitRange;
-      CXString replacement = clang_getCompletionFixIt(mLibclangResults, item.clangCompletionIndex, fixitIndex, &fixitRange);
+      CXString replacement = clang_getCompletionFixIt(mLibclangResults.get(), item.clangCompletionIndex, fixitIndex, &fixitRange);
       
       // Transform the range through the replacements applied so far
       DocumentRange docRange = CXSourceRangeToDocumentRange(fixitRange, lineOffsets);
@@ -547,6 +779,9 @@ void CodeCompletionWidget::Accept(DocumentWidget* widget, const DocumentLocation
   // Insert the completion text
   if (item.clangCompletionIndex < 0) {
     // The completion item does not come from libclang. Insert the item's filter text directly.
+    // Such items also complete the paths in inclusion directives (see
+    // CodeCompletionOperation), which replace the rest of the line as well.
+    ExtendReplacementRangeForInclusionDirective(widget->GetDocument().get(), invocationLoc, &replacementRange);
     widget->GetDocument()->Replace(replacementRange, item.filterText);
     widget->SetSelection(DocumentRange::Invalid());
     widget->SetCursor(replacementRange.start + item.filterText.size(), false);
@@ -601,39 +836,7 @@ void CodeCompletionWidget::Accept(DocumentWidget* widget, const DocumentLocation
     CXCompletionString& completion = clangResult.CompletionString;
     bool isFunction = IsFunctionDeclLikeCursorKind(clangResult.CursorKind);
     
-    // If we complete a path for an inclusion directive, extend the replacement range to the end of the current line.
-    // libclang gives a "CXCursor_NotImplemented" for these kinds of completions currently, so instead check
-    // for the #include at the start of the line.
-    charIt = Document::CharacterIterator(widget->GetDocument().get(), invocationLoc.offset);
-    while (charIt.IsValid() && charIt.GetChar() != '\n') {
-      -- charIt;
-    }
-    if (charIt.IsValid()) {
-      ++ charIt;
-    } else {
-      charIt = Document::CharacterIterator(widget->GetDocument().get(), 0);
-    }
-    while (charIt.IsValid() && IsWhitespace(charIt.GetChar())) {
-      ++ charIt;
-    }
-    QString include = QStringLiteral("#include");
-    int pos = 0;
-    while (pos < include.size() && charIt.IsValid()) {
-      if (charIt.GetChar() == include[pos]) {
-        ++ charIt;
-        ++ pos;
-      } else {
-        break;
-      }
-    }
-    bool lineStartsWithInclude = pos == include.size();
-    if (lineStartsWithInclude) {
-      charIt = Document::CharacterIterator(widget->GetDocument().get(), replacementRange.end.offset);
-      while (charIt.IsValid() && charIt.GetChar() != '\n') {
-        ++ charIt;
-      }
-      replacementRange.end = charIt.GetCharacterOffset();
-    }
+    ExtendReplacementRangeForInclusionDirective(widget->GetDocument().get(), invocationLoc, &replacementRange);
     
     QString completionString;
     std::vector<DocumentRange> placeholders;
@@ -683,7 +886,8 @@ void CodeCompletionWidget::Relayout() {
   int maxDisplayCharacters = 0;
   
   for (int itemIndex = minItem; itemIndex <= maxItem; ++ itemIndex) {
-    const CompletionItem& item = mItems[mSortOrder[itemIndex]];
+    CompletionItem& item = mItems[mSortOrder[itemIndex]];
+    item.CreateDisplayText(mLibclangResults.get());
     
     maxReturnTypeCharacters = std::max(maxReturnTypeCharacters, item.returnTypeText.size());
     maxDisplayCharacters = std::max(maxDisplayCharacters, item.displayText.size());
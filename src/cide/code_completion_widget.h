@@ -4,12 +4,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <thread>
 
 #include <clang-c/Index.h>
 #include <QScrollBar>
 #include <QWidget>
 
+#include "cide/qt_thread.h"
 #include "cide/text_utils.h"
 
 struct DocumentLocation;
@@ -35,25 +38,40 @@ struct CompletionItem {
   };
   
   
-  /// Creates an empty completion item.
+  /// Creates an empty completion item. Its display attributes must be set
+  /// directly.
   CompletionItem();
   
   /// Creates a completion item from the given libclang completion result.
+  /// Since libclang may return tens of thousands of results, of which only few
+  /// get displayed, this only extracts the filter text and the attributes
+  /// required for sorting. CreateDisplayText() creates the rest.
   CompletionItem(const CXCodeCompleteResults* libclangResults, int index);
   
+  /// Creates displayText, returnTypeText, and displayStyles from the libclang
+  /// completion result if that has not been done yet. @p libclangResults must
+  /// be the results that the item was created from.
+  void CreateDisplayText(const CXCodeCompleteResults* libclangResults);
   
-  /// Text displayed in the completion list.
+  
+  /// Text displayed in the completion list. Only valid after
+  /// CreateDisplayText().
   QString displayText;
   
-  /// Text displayed on the left side of the completion list.
+  /// Text displayed on the left side of the completion list. Only valid after
+  /// CreateDisplayText().
   QString returnTypeText;
   
   /// Array of (character index, style) pairs for styling displayText. Each item
   /// represents the start of a style range, which is ended by the next item.
   /// The initial style (at character index 0) is DisplayStyle::Default (unless
-  /// another style is specified in displayStyles).
+  /// another style is specified in displayStyles). Only valid after
+  /// CreateDisplayText().
   std::vector<std::pair<int, DisplayStyle>> displayStyles;
   
+  /// Whether the display attributes above have been created.
+  bool haveDisplayText;
+  
   /// Text used for filtering (and sorting), which is matched with the user input.
   QString filterText;
   
@@ -83,19 +101,25 @@ struct CompletionItem {
 class CodeCompletionWidget : public QWidget {
  Q_OBJECT
  public:
-  /// Creates a completion widget with the given items. The widget takes
+  /// Creates a completion widget with the given items. The widget shares
   /// ownership over the libclang results.
-  CodeCompletionWidget(std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults, QPoint invocationPoint, QWidget* parentWidget, QWidget* parent = nullptr);
+  CodeCompletionWidget(std::vector<CompletionItem>&& items, const std::shared_ptr<CXCodeCompleteResults>& libclangResults, QPoint invocationPoint, QWidget* parentWidget, QWidget* parent = nullptr);
   
-  /// Destructor. Frees the libclang results.
+  /// Destructor. Cancels a running scoring job.
   ~CodeCompletionWidget();
   
   /// Updates the filter text (i.e., the text typed by the user) with which the
-  /// completions are filtered. Automatically recognizes if the new filter text
-  /// is an extension of the previous one, which allows for faster (incremental)
-  /// filtering.
+  /// completions are filtered. If the new filter text extends the previous one,
+  /// only the items that matched the previous text are scored again. For large
+  /// numbers of items, the items are scored in background threads, and the
+  /// widget keeps showing the previous results until FilterApplied() is
+  /// emitted. A new call cancels a running job.
   void SetFilterText(const QString& text);
   
+  /// Returns whether the items are being scored for a new filter text in the
+  /// background.
+  inline bool IsFilterPending() const { return filterPending; }
+  
   /// Re-positions the widget to the given invocation point (relative to the
   /// containing widget). Relayout() should be called afterwards (potentially
   /// implicitly via SetFilterText()).
@@ -103,10 +127,11 @@ class CodeCompletionWidget : public QWidget {
   
   /// Returns whether there is only one good match which matches filterText
   /// exactly, and for which the insertion text is equal to its filter text.
+  /// Returns false while a filter is pending.
   bool HasSingleExactMatch();
   
   /// Applies the currently selected completion item to the document text. Does
-  /// not close the widget.
+  /// not close the widget. If a filter is pending, it is applied first.
   void Accept(DocumentWidget* widget, const DocumentLocation& invocationLoc);
   
   /// Re-computes the widget size and potentially moves it to adapt to the new
@@ -119,6 +144,7 @@ class CodeCompletionWidget : public QWidget {
     std::vector<CompletionItem> result(mItems.size());
     for (int i = 0; i < mItems.size(); ++ i) {
       result[i] = mItems[mSortOrder[i]];
+      result[i].CreateDisplayText(mLibclangResults.get());
     }
     return result;
   }
@@ -126,6 +152,10 @@ class CodeCompletionWidget : public QWidget {
  signals:
   void Accepted();
   
+  /// Emitted after the results of a filter that was scored in the background
+  /// have been applied.
+  void FilterApplied();
+  
  protected:
   void paintEvent(QPaintEvent* event) override;
   
@@ -145,6 +175,24 @@ class CodeCompletionWidget : public QWidget {
   /// Extends the sorting of items to at least the given index.
   void ExtendItemSort(int itemIndex);
   
+  /// Returns the number of items at the start of mSortOrder that need to be
+  /// scored for the new filter text @p text.
+  int GetNumCandidateItems(const QString& text) const;
+  
+  /// Scores and sorts the items for @p text in the calling thread.
+  void ApplyFilterText(const QString& text);
+  
+  /// Cancels the running scoring job (if any) and waits for it to exit.
+  void StopScoringJob();
+  
+  /// Scores the @p candidates (indexes into mItems) for @p text using multiple
+  /// threads, sorts the best items, and applies the results in the Qt thread
+  /// unless the job has been canceled.
+  void ScoringThreadMain(QString text, std::vector<int> candidates);
+  
+  /// Resets the selection and scroll after the filter text changed.
+  void FilterTextChanged();
+  
   
   /// The text by which the items have been filtered. This corresponds to the
   /// text input by the user in the document after the code completion
@@ -155,6 +203,10 @@ class CodeCompletionWidget : public QWidget {
   /// item is mItems[mSortOrder[0]].
   std::vector<CompletionItem> mItems;
   
+  /// Case-folded filterText of each item in mItems, as returned by
+  /// FoldCaseForFuzzyTextMatch().
+  std::vector<QString> mFoldedFilterTexts;
+  
   /// The order of items in this vector determines the order in which items are
   /// displayed. Indexes into mItems.
   std::vector<int> mSortOrder;
@@ -162,7 +214,7 @@ class CodeCompletionWidget : public QWidget {
   /// The original code completion results provided by libclang. They are
   /// retained here such that the corresponding completion items can still
   /// access this original data instead of having to copy everything.
-  CXCodeCompleteResults* mLibclangResults;
+  std::shared_ptr<CXCodeCompleteResults> mLibclangResults;
   
   /// Indexes into mSortOrder.
   int selectedItem = 0;
@@ -173,6 +225,12 @@ class CodeCompletionWidget : public QWidget {
   /// index gets into the view, the sorting must be extended first.
   int numSortedItems;
   
+  /// Number of items at the start of mSortOrder that match filterText
+  /// according to IsFuzzyTextMatch(). Only these items need to be scored again
+  /// if the filter text gets extended. The remaining items keep their scores
+  /// for the filter texts for which they stopped matching.
+  int numCandidateItems;
+  
   
   /// Containing widget, used to re-compute the global tooltip position after
   /// widget movements.
@@ -194,6 +252,17 @@ class CodeCompletionWidget : public QWidget {
   /// Maximum number of visible items in this widget.
   int maxNumVisibleItems = 15;
   
+  // Background scoring job
+  std::shared_ptr<std::thread> scoringThread;
+  std::atomic<bool> scoringCanceled;
+  RunInQtThreadAbortData scoringAbortData;
+  
+  /// Whether a job is scoring the items for pendingFilterText.
+  bool filterPending = false;
+  
+  /// The filter text that is being scored in the background.
+  QString pendingFilterText;
+  
   
   int lineHeight;
   int charWidth;
@@ -4,20 +4,52 @@
 
 #include "cide/code_info.h"
 
+#include <chrono>
+
 #include "cide/argument_hint_widget.h"
 #include "cide/clang_utils.h"
 #include "cide/code_info_code_completion.h"
 #include "cide/code_info_get_info.h"
 #include "cide/code_info_get_right_click_info.h"
 #include "cide/code_info_goto_referenced_cursor.h"
+#include "cide/code_info_hover_prefetch.h"
+#include "cide/code_info_tu_catch_up.h"
+#include "cide/cpu_budget.h"
 #include "cide/main_window.h"
+#include "cide/performance_counters.h"
+#include "cide/profiler.h"
 #include "cide/qt_thread.h"
 #include "cide/text_utils.h"
 
 
+/// Returns the maximum time that a request of the given type waits for a TU
+/// if all TUs of its document are in use. Hover info is pointless once the
+/// mouse moved on, and prefetches are only speculative, so these give up
+/// earlier than requests that the user explicitly waits for.
+static std::chrono::milliseconds GetTUWaitTimeout(CodeInfoRequest::Type type) {
+  switch (type) {
+  case CodeInfoRequest::Type::GotoReferencedCursor:
+  case CodeInfoRequest::Type::RightClickInfo:
+  case CodeInfoRequest::Type::CodeCompletion:
+    return std::chrono::milliseconds(5000);
+  case CodeInfoRequest::Type::Info:
+    return std::chrono::milliseconds(1000);
+  case CodeInfoRequest::Type::CodeCompletionPrefetch:
+  case CodeInfoRequest::Type::HoverPrefetch:
+  case CodeInfoRequest::Type::TUCatchUp:
+    break;
+  }
+  return std::chrono::milliseconds(300);
+}
+
 CodeInfo::CodeInfo() {
   mExit = false;
-  mThread.reset(new std::thread(&CodeInfo::ThreadMain, this));
+  for (Worker& worker : workers) {
+    worker.thread.reset(new std::thread(&CodeInfo::ThreadMain, this, &worker));
+  }
+  ClangTUPoolManager::Instance().SetTUReturnedCallback([this](ClangTUPool* TUPool) {
+    TUReturned(TUPool);
+  });
 }
 
 CodeInfo::~CodeInfo() {
@@ -29,7 +61,7 @@ CodeInfo& CodeInfo::Instance() {
   return instance;
 }
 
-DocumentLocation CodeInfo::RequestCodeCompletion(DocumentWidget* widget) {
+DocumentLocation CodeInfo::GetCodeCompletionInvocationLocation(DocumentWidget* widget) {
   // Find the location to invoke the completion at. It must point directly after
   // the relevant token. For example, for someObject->get^ with the cursor at
   // ^, the completion must be invoked after the "->", not after "get". Thus,
@@ -50,180 +82,384 @@ DocumentLocation CodeInfo::RequestCodeCompletion(DocumentWidget* widget) {
     }
     codeCompletionInvocationLocation = it.IsValid() ? (it.GetCharacterOffset() + 1) : 0;
   }
+  return codeCompletionInvocationLocation;
+}
+
+DocumentLocation CodeInfo::RequestCodeCompletion(DocumentWidget* widget) {
+  DocumentLocation codeCompletionInvocationLocation = GetCodeCompletionInvocationLocation(widget);
   
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::CodeCompletion)) {
     return DocumentLocation::Invalid();
   }
   
-  lastRequest.widget = widget;
-  lastRequest.codeCompletionInvocationLocation = codeCompletionInvocationLocation;
-  lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();
-  lastRequest.type = CodeInfoRequest::Type::CodeCompletion;
-  haveRequest = true;
-  newCodeInfoRequestCondition.notify_one();
+  Worker& worker = GetWorker(CodeInfoRequest::Type::CodeCompletion);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = codeCompletionInvocationLocation;
+  worker.lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();
+  worker.lastRequest.type = CodeInfoRequest::Type::CodeCompletion;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
+  
+  return codeCompletionInvocationLocation;
+}
+
+DocumentLocation CodeInfo::PrefetchCodeCompletion(DocumentWidget* widget) {
+  DocumentLocation codeCompletionInvocationLocation = GetCodeCompletionInvocationLocation(widget);
+  
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::CodeCompletionPrefetch)) {
+    return DocumentLocation::Invalid();
+  }
+  
+  Worker& worker = GetWorker(CodeInfoRequest::Type::CodeCompletionPrefetch);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = codeCompletionInvocationLocation;
+  worker.lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // unused
+  worker.lastRequest.type = CodeInfoRequest::Type::CodeCompletionPrefetch;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
   
   return codeCompletionInvocationLocation;
 }
 
+bool CodeInfo::PrefetchHoverInfo(DocumentWidget* widget, const std::vector<DocumentLocation>& locations) {
+  if (locations.empty()) {
+    return false;
+  }
+  
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::HoverPrefetch)) {
+    return false;
+  }
+  
+  Worker& worker = GetWorker(CodeInfoRequest::Type::HoverPrefetch);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = locations.front();
+  worker.lastRequest.prefetchLocations = locations;
+  worker.lastRequest.invocationCounter = -1;  // unused
+  worker.lastRequest.type = CodeInfoRequest::Type::HoverPrefetch;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
+  return true;
+}
+
+bool CodeInfo::RequestTUCatchUp(DocumentWidget* widget) {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::TUCatchUp)) {
+    return false;
+  }
+  
+  Worker& worker = GetWorker(CodeInfoRequest::Type::TUCatchUp);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = DocumentLocation(0);  // unused
+  worker.lastRequest.invocationCounter = -1;  // unused
+  worker.lastRequest.type = CodeInfoRequest::Type::TUCatchUp;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
+  return true;
+}
+
 bool CodeInfo::RequestRightClickInfo(DocumentWidget* widget, DocumentLocation invocationLocation) {
+  // These requests use the locations in the parsed TU.
+  widget->ReparseIfPostponed();
+  
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::RightClickInfo)) {
     return false;
   }
   
-  lastRequest.widget = widget;
-  lastRequest.codeCompletionInvocationLocation = invocationLocation;
-  lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
-  lastRequest.type = CodeInfoRequest::Type::RightClickInfo;
-  haveRequest = true;
-  newCodeInfoRequestCondition.notify_one();
+  Worker& worker = GetWorker(CodeInfoRequest::Type::RightClickInfo);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = invocationLocation;
+  worker.lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
+  worker.lastRequest.type = CodeInfoRequest::Type::RightClickInfo;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
   return true;
 }
 
 bool CodeInfo::RequestCodeInfo(DocumentWidget* widget, DocumentLocation invocationLocation) {
+  // These requests use the locations in the parsed TU.
+  widget->ReparseIfPostponed();
+  
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::Info)) {
     return false;
   }
   
-  lastRequest.widget = widget;
-  lastRequest.codeCompletionInvocationLocation = invocationLocation;
-  lastRequest.pathForReferences = widget->GetDocument()->path();
-  lastRequest.dropUninterestingTokens = true;
-  lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
-  lastRequest.type = CodeInfoRequest::Type::Info;
-  haveRequest = true;
-  newCodeInfoRequestCondition.notify_one();
+  Worker& worker = GetWorker(CodeInfoRequest::Type::Info);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = invocationLocation;
+  worker.lastRequest.pathForReferences = widget->GetDocument()->path();
+  worker.lastRequest.dropUninterestingTokens = true;
+  worker.lastRequest.maxClassMembers = CodeInfoRequest::kClassMembersPerPage;
+  worker.lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
+  worker.lastRequest.type = CodeInfoRequest::Type::Info;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
   return true;
 }
 
-bool CodeInfo::RequestCodeInfo(DocumentWidget* widget, const QString& path, int line, int column, const QString& pathForReferences, bool dropUninterestingTokens) {
+bool CodeInfo::RequestCodeInfo(DocumentWidget* widget, const QString& path, int line, int column, const QString& pathForReferences, bool dropUninterestingTokens, int maxClassMembers) {
+  // These requests use the locations in the parsed TU.
+  widget->ReparseIfPostponed();
+  
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::Info)) {
     return false;
   }
   
-  lastRequest.widget = widget;
-  lastRequest.codeCompletionInvocationLocation = DocumentLocation::Invalid();
-  lastRequest.invocationFile = path;
-  lastRequest.invocationLine = line;
-  lastRequest.invocationColumn = column;
-  lastRequest.pathForReferences = pathForReferences;
-  lastRequest.dropUninterestingTokens = dropUninterestingTokens;
-  lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
-  lastRequest.type = CodeInfoRequest::Type::Info;
-  haveRequest = true;
-  newCodeInfoRequestCondition.notify_one();
+  Worker& worker = GetWorker(CodeInfoRequest::Type::Info);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = DocumentLocation::Invalid();
+  worker.lastRequest.invocationFile = path;
+  worker.lastRequest.invocationLine = line;
+  worker.lastRequest.invocationColumn = column;
+  worker.lastRequest.pathForReferences = pathForReferences;
+  worker.lastRequest.dropUninterestingTokens = dropUninterestingTokens;
+  worker.lastRequest.maxClassMembers = maxClassMembers;
+  worker.lastRequest.invocationCounter = widget->GetCodeCompletionInvocationCounter();  // TODO: This value is currently unused here
+  worker.lastRequest.type = CodeInfoRequest::Type::Info;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
   return true;
 }
 
 bool CodeInfo::GotoReferencedCursor(DocumentWidget* widget, DocumentLocation invocationLocation) {
+  // These requests use the locations in the parsed TU.
+  widget->ReparseIfPostponed();
+  
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   if (!CheckDiscardPreviousRequest(widget, CodeInfoRequest::Type::GotoReferencedCursor)) {
     return false;
   }
   
-  lastRequest.widget = widget;
-  lastRequest.codeCompletionInvocationLocation = invocationLocation;
-  lastRequest.invocationCounter = -1;  // unused
-  lastRequest.type = CodeInfoRequest::Type::GotoReferencedCursor;
-  haveRequest = true;
-  newCodeInfoRequestCondition.notify_one();
+  Worker& worker = GetWorker(CodeInfoRequest::Type::GotoReferencedCursor);
+  worker.lastRequest.widget = widget;
+  worker.lastRequest.codeCompletionInvocationLocation = invocationLocation;
+  worker.lastRequest.invocationCounter = -1;  // unused
+  worker.lastRequest.type = CodeInfoRequest::Type::GotoReferencedCursor;
+  worker.haveRequest = true;
+  worker.newCodeInfoRequestCondition.notify_one();
   return true;
 }
 
 void CodeInfo::WidgetRemoved(DocumentWidget* widget) {
   std::unique_lock<std::mutex> lock(completeRequestMutex);
   
-  if (haveRequest && lastRequest.widget == widget) {
-    haveRequest = false;
+  for (Worker& worker : workers) {
+    if (worker.haveRequest && worker.lastRequest.widget == widget) {
+      worker.haveRequest = false;
+    }
+    
+    if (worker.haveRequestInProgress && worker.requestInProgress.widget == widget) {
+      worker.haveRequestInProgress = false;
+      worker.requestInProgress.wasCanceled = true;
+    }
   }
-  
-  if (haveRequestInProgress && requestInProgress.widget == widget) {
-    haveRequestInProgress = false;
-    requestInProgress.wasCanceled = true;
+}
+
+void CodeInfo::WaitUntilIdle() {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  while (!mExit) {
+    bool idle = true;
+    for (const Worker& worker : workers) {
+      if (worker.haveRequest || worker.haveRequestInProgress) {
+        idle = false;
+        break;
+      }
+    }
+    if (idle) {
+      return;
+    }
+    requestFinishedCondition.wait(lock);
   }
 }
 
+CodeInfo::Statistics CodeInfo::GetStatistics() {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  return statistics;
+}
+
+void CodeInfo::SetRequestFinishedCallback(const std::function<void(CodeInfoRequest::Type type, double durationMs)>& callback) {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  requestFinishedCallback = callback;
+}
+
 void CodeInfo::Exit() {
-  if (mThread) {
-    mExit = true;
-    newCodeInfoRequestCondition.notify_all();
-    mThread->join();
-    mThread = nullptr;
+  ClangTUPoolManager::Instance().SetTUReturnedCallback(nullptr);
+  mExit = true;
+  {
+    // Lock the mutex to ensure that no worker misses the notification while
+    // it is about to wait.
+    std::unique_lock<std::mutex> lock(completeRequestMutex);
+    for (Worker& worker : workers) {
+      worker.newCodeInfoRequestCondition.notify_all();
+    }
+    requestFinishedCondition.notify_all();
+  }
+  for (Worker& worker : workers) {
+    if (worker.thread) {
+      worker.thread->join();
+      worker.thread = nullptr;
+    }
   }
 }
 
+CodeInfo::Worker& CodeInfo::GetWorker(CodeInfoRequest::Type type) {
+  switch (type) {
+  case CodeInfoRequest::Type::CodeCompletion:
+  case CodeInfoRequest::Type::CodeCompletionPrefetch:
+    return workers[static_cast<int>(Lane::CodeCompletion)];
+  case CodeInfoRequest::Type::Info:
+  case CodeInfoRequest::Type::HoverPrefetch:
+    return workers[static_cast<int>(Lane::Info)];
+  case CodeInfoRequest::Type::TUCatchUp:
+    return workers[static_cast<int>(Lane::CatchUp)];
+  case CodeInfoRequest::Type::GotoReferencedCursor:
+  case CodeInfoRequest::Type::RightClickInfo:
+    break;
+  }
+  return workers[static_cast<int>(Lane::Navigation)];
+}
+
 bool CodeInfo::CheckDiscardPreviousRequest(DocumentWidget* widget, CodeInfoRequest::Type newRequestType) {
-  if (!haveRequest) {
+  Worker& worker = GetWorker(newRequestType);
+  if (!worker.haveRequest) {
     return true;
   }
   
-  if (static_cast<int>(lastRequest.type) < static_cast<int>(newRequestType)) {
+  if (static_cast<int>(worker.lastRequest.type) < static_cast<int>(newRequestType)) {
     // There is a higher-priority request already, discard the new one.
+    ++ statistics.numRejectedRequests;
     return false;
   }
   
   // Discard the old request in favor of the new one.
-  if (lastRequest.type == CodeInfoRequest::Type::CodeCompletion) {
+  ++ statistics.numDiscardedRequests;
+  if (worker.lastRequest.type == CodeInfoRequest::Type::CodeCompletion) {
     widget->CodeCompletionRequestWasDiscarded();
   }
   return true;
 }
 
-void CodeInfo::ThreadMain() {
+void CodeInfo::ThreadMain(Worker* worker) {
   while (true) {
     std::unique_lock<std::mutex> lock(completeRequestMutex);
     if (mExit) {
       return;
     }
-    while (!haveRequest) {
-      newCodeInfoRequestCondition.wait(lock);
+    while (!worker->haveRequest) {
+      worker->newCodeInfoRequestCondition.wait(lock);
       if (mExit) {
         return;
       }
     }
-    requestInProgress = lastRequest;
-    requestInProgress.wasCanceled = false;
-    haveRequest = false;
-    haveRequestInProgress = true;
+    worker->requestInProgress = worker->lastRequest;
+    worker->requestInProgress.wasCanceled = false;
+    worker->haveRequest = false;
+    worker->haveRequestInProgress = true;
+    CodeInfoRequest::Type type = worker->requestInProgress.type;
     lock.unlock();
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
     
-    // Perform the code completion
-    if (requestInProgress.type == CodeInfoRequest::Type::CodeCompletion) {
+    // Perform the operation within the CPUBudget. Prefetches are not
+    // interactive, since the user does not wait for them yet. Hover prefetches
+    // and TU catch-ups may never be used at all, so they run with the lowest
+    // priority.
+    CPUBudget::QoS qos = CPUBudget::QoS::Interactive;
+    if (type == CodeInfoRequest::Type::CodeCompletionPrefetch) {
+      qos = CPUBudget::QoS::Normal;
+    } else if (type == CodeInfoRequest::Type::HoverPrefetch ||
+               type == CodeInfoRequest::Type::TUCatchUp) {
+      qos = CPUBudget::QoS::Background;
+    }
+    CPUBudgetScope budgetScope(qos, &mExit);
+    if (!budgetScope.acquired()) {
+      // Exiting.
+    } else if (type == CodeInfoRequest::Type::CodeCompletion ||
+        type == CodeInfoRequest::Type::CodeCompletionPrefetch) {
       CodeCompletionOperation operation;
-      LockTUForOperation(requestInProgress, true, &operation);
-    } else if (requestInProgress.type == CodeInfoRequest::Type::Info) {
+      LockTUForOperation(worker, true, &operation);
+      if (type == CodeInfoRequest::Type::CodeCompletion) {
+        PerformanceCounters::Instance().RecordCodeCompletion(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+      }
+    } else if (type == CodeInfoRequest::Type::Info) {
       GetInfoOperation operation;
-      LockTUForOperation(requestInProgress, false, &operation);
-    } else if (requestInProgress.type == CodeInfoRequest::Type::RightClickInfo) {
+      LockTUForOperation(worker, false, &operation);
+    } else if (type == CodeInfoRequest::Type::RightClickInfo) {
       GetRightClickInfoOperation operation;
-      LockTUForOperation(requestInProgress, false, &operation);
-    } else if (requestInProgress.type == CodeInfoRequest::Type::GotoReferencedCursor) {
+      LockTUForOperation(worker, false, &operation);
+    } else if (type == CodeInfoRequest::Type::GotoReferencedCursor) {
       GotoReferencedCursorOperation operation;
-      LockTUForOperation(requestInProgress, false, &operation);
+      LockTUForOperation(worker, false, &operation);
+    } else if (type == CodeInfoRequest::Type::HoverPrefetch) {
+      HoverPrefetchOperation operation([this, worker]() {
+        return ShouldYieldIdleRequest(worker);
+      });
+      LockTUForOperation(worker, false, &operation);
+    } else if (type == CodeInfoRequest::Type::TUCatchUp) {
+      TUCatchUpOperation operation([this, worker]() {
+        return ShouldYieldIdleRequest(worker);
+      });
+      LockTUForOperation(worker, true, &operation);
+    }
+    
+    // Call the callback before the request counts as finished, such that it
+    // has returned when WaitUntilIdle() returns.
+    lock.lock();
+    std::function<void(CodeInfoRequest::Type, double)> callback = requestFinishedCallback;
+    lock.unlock();
+    if (callback) {
+      callback(type, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+    }
+    
+    lock.lock();
+    worker->haveRequestInProgress = false;
+    worker->TUPoolWaitedFor = nullptr;
+    ++ statistics.numProcessedRequests;
+    requestFinishedCondition.notify_all();
+  }
+}
+
+bool CodeInfo::ShouldYieldIdleRequest(Worker* worker) {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  if (mExit || worker->haveRequest || !worker->haveRequestInProgress) {
+    return true;
+  }
+  for (const Worker& other : workers) {
+    if (&other != worker && (other.haveRequest || other.TUPoolWaitedFor != nullptr)) {
+      return true;
     }
   }
+  return false;
 }
 
 void CodeInfo::LockTUForOperation(
-    const CodeInfoRequest& request,
+    Worker* worker,
     bool getUnsavedFileContents,
     TUOperationBase* operation) {
+  ProfilerScope profilerScope("LockTUForOperation");
+  const CodeInfoRequest& request = worker->requestInProgress;
   QString canonicalFilePath;
   int invocationLine;
   int invocationCol;
   std::vector<CXUnsavedFile> unsavedFiles;
-  std::vector<std::string> unsavedFileContents;
-  std::vector<std::string> unsavedFilePaths;
+  std::vector<std::shared_ptr<const QByteArray>> unsavedFileContents;
+  std::vector<QByteArray> unsavedFilePaths;
   std::shared_ptr<ClangTU> TU;
+  ClangTUPool* TUPool = nullptr;
   bool exit = false;
+  bool retry = false;
+  bool TUIsNotParsed = false;
+  bool operatedWithoutTU = false;
   
-  RunInQtThreadBlocking([&]() {
+  auto takeTU = [&]() {
     // If the document has been closed in the meantime, we must not access its
     // widget anymore.
-    if (!haveRequestInProgress) {
+    if (!worker->haveRequestInProgress) {
       exit = true;
       return;
     }
@@ -246,12 +482,25 @@ void CodeInfo::LockTUForOperation(
       canonicalFilePath = QFileInfo(request.invocationFile).canonicalFilePath();
     }
     
-    // Get the most up-to-date libclang translation unit
-    TU = document->GetTUPool()->TakeMostUpToDateTU();
-    if (!TU || !TU->isInitialized()) {
+    // Get the most up-to-date libclang translation unit. If all TUs are in
+    // use at the moment (by the parser or by the workers of other lanes),
+    // wait until one is returned.
+    TUPool = document->GetTUPool();
+    TU = TakeTUForWorker(worker, TUPool);
+    if (!TU) {
+      if (request.type == CodeInfoRequest::Type::TUCatchUp) {
+        // There is no stale TU that could be caught up at the moment.
+        exit = true;
+      } else {
+        retry = true;
+      }
+      return;
+    }
+    if (!TU->isInitialized()) {
       // NOTE: This is not logged as this may happen when the operation is
       //       invoked before the file was parsed.
       // qDebug() << "Could not get a libclang TU in LockTUForOperation()";
+      TUIsNotParsed = true;
       exit = true;
       return;
     }
@@ -262,27 +511,150 @@ void CodeInfo::LockTUForOperation(
     }
     
     operation->InitializeInQtThread(request, TU, canonicalFilePath, invocationLine, invocationCol, unsavedFiles);
-  });
+  };
+  
+  auto releaseTU = [&]() {
+    std::unique_lock<std::mutex> lock(completeRequestMutex);
+    worker->TUPoolInUse = nullptr;
+  };
+  
+  ProfilerScope takeTUScope("Take TU");
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + GetTUWaitTimeout(request.type);
+  while (true) {
+    retry = false;
+    RunInQtThreadBlocking(takeTU);
+    if (!retry) {
+      break;
+    }
+    
+    // Let the operation provide an approximate result while waiting.
+    if (!operatedWithoutTU) {
+      operatedWithoutTU = true;
+      operation->OperateWithoutTU(request);
+    }
+    
+    // Wait until a TU is returned to the pool. Abort if the request has been
+    // superseded by a newer one in the meantime, or if the deadline passed.
+    std::unique_lock<std::mutex> lock(completeRequestMutex);
+    bool TUReturned = worker->newCodeInfoRequestCondition.wait_until(lock, deadline, [&]() {
+      return mExit || worker->haveRequest || worker->TUReturned;
+    });
+    if (mExit || worker->haveRequest || !TUReturned) {
+      worker->TUPoolWaitedFor = nullptr;
+      ++ statistics.numDroppedWhileWaitingForTU;
+      lock.unlock();
+      
+      if (!TUReturned) {
+        qDebug() << "Timed out waiting for a libclang TU for a code info request";
+        if (request.type == CodeInfoRequest::Type::CodeCompletion) {
+          RunInQtThreadBlocking([&]() {
+            if (worker->haveRequestInProgress) {
+              request.widget->CodeCompletionRequestWasDiscarded();
+            }
+          });
+        }
+      }
+      return;
+    }
+  }
   if (exit) {
     if (TU) {
-      request.widget->GetDocument()->GetTUPool()->PutTU(TU, false);
+      TUPool->PutTU(TU, false);
+      releaseTU();
+    }
+    if (TUIsNotParsed && !operatedWithoutTU) {
+      operation->OperateWithoutTU(request);
     }
     return;
   }
   
+  takeTUScope.End();
+  
+  ProfilerScope operateScope("Operate on TU");
   TUOperationBase::Result reparsed = operation->OperateOnTU(request, TU, canonicalFilePath, invocationLine, invocationCol, unsavedFiles);
+  operateScope.End();
   
   RunInQtThreadBlocking([&]() {
     // If the document has been closed in the meantime, we must not access its
     // widget anymore.
-    if (!haveRequestInProgress) {
+    if (!worker->haveRequestInProgress) {
       exit = true;
       return;
     }
     
-    const std::shared_ptr<Document>& document = request.widget->GetDocument();
-    document->GetTUPool()->PutTU(TU, reparsed == TUOperationBase::Result::TUHasBeenReparsed);
+    TUPool->PutTU(TU, reparsed == TUOperationBase::Result::TUHasBeenReparsed);
     
     operation->FinalizeInQtThread(request);
   });
+  releaseTU();
+}
+
+std::shared_ptr<ClangTU> CodeInfo::TakeTUForWorker(Worker* worker, ClangTUPool* TUPool) {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  
+  auto waitForTU = [&]() {
+    worker->TUPoolWaitedFor = TUPool;
+    worker->TUReturned = false;
+    ++ statistics.numTUWaits;
+    return nullptr;
+  };
+  
+  // Catch-up reparses only use a TU that nobody else needs right now, and do
+  // not wait for one.
+  CodeInfoRequest::Type type = worker->requestInProgress.type;
+  if (type == CodeInfoRequest::Type::TUCatchUp) {
+    for (const Worker& other : workers) {
+      if (&other != worker &&
+          (other.TUPoolInUse == TUPool || other.TUPoolWaitedFor == TUPool)) {
+        return nullptr;
+      }
+    }
+    std::shared_ptr<ClangTU> TU = TUPool->TakeStaleTUForCatchUp();
+    if (TU) {
+      worker->TUPoolInUse = TUPool;
+    }
+    return TU;
+  }
+  
+  // Leave the TUs to workers with higher-priority requests that wait for them.
+  for (const Worker& other : workers) {
+    if (&other != worker &&
+        other.TUPoolWaitedFor == TUPool &&
+        static_cast<int>(other.requestInProgress.type) < static_cast<int>(type)) {
+      return waitForTU();
+    }
+  }
+  
+  // The parser holds at most one TU at a time. So if another worker
+  // operates on a TU of the same pool, one TU remains in the pool for the
+  // parser, unless the request is at least as important as code completion.
+  // The parser waits for a TU to be returned in this case.
+  if (static_cast<int>(type) > static_cast<int>(CodeInfoRequest::Type::CodeCompletion)) {
+    for (const Worker& other : workers) {
+      if (&other != worker && other.TUPoolInUse == TUPool) {
+        if (TUPool->GetNumFreeTUs() < 2) {
+          return waitForTU();
+        }
+        break;
+      }
+    }
+  }
+  
+  std::shared_ptr<ClangTU> TU = TUPool->TakeMostUpToDateTU();
+  if (!TU) {
+    return waitForTU();
+  }
+  worker->TUPoolInUse = TUPool;
+  worker->TUPoolWaitedFor = nullptr;
+  return TU;
+}
+
+void CodeInfo::TUReturned(ClangTUPool* TUPool) {
+  std::unique_lock<std::mutex> lock(completeRequestMutex);
+  for (Worker& worker : workers) {
+    if (worker.TUPoolWaitedFor == TUPool) {
+      worker.TUReturned = true;
+      worker.newCodeInfoRequestCondition.notify_all();
+    }
+  }
 }
@@ -9,23 +9,39 @@
 #include <functional>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "cide/document_widget.h"
 
 
 // Groups the information that is needed for a code info request.
 struct CodeInfoRequest {
-  /// The types are ordered by priority. There can only be one pending request at each
-  /// point in time, and lower-priority requests are discarded if a higher-priority
-  /// request is made while the lower-priority one has not been started processing yet.
+  /// The types are ordered by priority. Requests are processed in independent
+  /// lanes (see CodeInfo::Lane). There can only be one pending request per lane
+  /// at each point in time, and lower-priority requests are discarded if a
+  /// higher-priority request for the same lane is made while the lower-priority
+  /// one has not been started processing yet.
   /// The type with the lowest number has the highest priority.
   enum class Type {
     GotoReferencedCursor = 0,
     RightClickInfo,
     CodeCompletion,
-    Info
+    Info,
+    /// Speculative code completion whose results are not shown, but kept for
+    /// reuse by the next code completion at the same location.
+    CodeCompletionPrefetch,
+    /// Idle-priority lookup of the cursors of the visible identifiers after a
+    /// parse, such that hovering them is fast (see PrefetchHoverInfo()).
+    HoverPrefetch,
+    /// Idle-time reparse of a stale TU of the document's pool (see
+    /// RequestTUCatchUp()).
+    TUCatchUp
   };
   
+  /// Number of class members that are listed in the info for a class at
+  /// first. Further members are listed in pages of this size on request.
+  static constexpr int kClassMembersPerPage = 200;
+  
   DocumentWidget* widget;
   DocumentLocation codeCompletionInvocationLocation;
   int invocationCounter;
@@ -44,6 +60,12 @@ struct CodeInfoRequest {
   /// For RequestCodeInfo(): Whether to abort if the token at the invocation
   /// position is uninteresting.
   bool dropUninterestingTokens;
+  
+  /// For RequestCodeInfo(): Maximum number of members to list for classes.
+  int maxClassMembers;
+  
+  /// For PrefetchHoverInfo(): Start locations of the identifiers to prefetch.
+  std::vector<DocumentLocation> prefetchLocations;
 };
 
 
@@ -90,12 +112,26 @@ struct TUOperationBase {
   /// This is called after the TU has been returned, and is executed within the
   /// main (Qt) thread, so this function may interact with the UI.
   virtual void FinalizeInQtThread(const CodeInfoRequest& request) = 0;
+  
+  /// This is called (at most once per request) in the background thread if no
+  /// parsed TU is available for the request: because the document has not
+  /// been parsed yet, or because all of its TUs are in use at the moment. In
+  /// the latter case, the request continues to wait for a TU afterwards, and
+  /// the functions above are called once it gets one. Operations may provide
+  /// an approximate result here without using a TU. They must use
+  /// RunInQtThreadBlocking() to interact with the UI, and check
+  /// request.wasCanceled within it before accessing the request's widget.
+  virtual inline void OperateWithoutTU(const CodeInfoRequest& /*request*/) {}
 };
 
 
-/// Singleton class maintaining a thread that performs operations on the
+/// Singleton class maintaining threads that perform operations on the
 /// most up-to-date libclang translation unit, such as code completion or
 /// querying the AST (abstract syntax tree) for information about the code.
+/// Code completion, hover info, and navigation requests are handled by
+/// separate threads which operate on different TUs of the document's
+/// ClangTUPool, such that for example slow info requests do not delay code
+/// completion.
 class CodeInfo {
  public:
   ~CodeInfo();
@@ -103,11 +139,42 @@ class CodeInfo {
   /// Returns the singleton instance.
   static CodeInfo& Instance();
   
+  /// Returns the location at which code completion is invoked for the given
+  /// widget's current cursor position: directly after the last token before the
+  /// cursor that is not part of an identifier.
+  static DocumentLocation GetCodeCompletionInvocationLocation(DocumentWidget* widget);
+  
   /// Requests code completion for the given widget (at the current cursor
   /// position) in the background thread.
   /// If the request was rejected because there is a higher-priority request already, returns an invalid location.
   DocumentLocation RequestCodeCompletion(DocumentWidget* widget);
   
+  /// Requests a speculative code completion for the given widget (at the
+  /// current cursor position) in the background thread, see
+  /// DocumentWidget::SetPrefetchedCodeCompletion(). This is discarded if any
+  /// other code completion request is made before it is started.
+  /// Returns the invocation location, or an invalid location if the request was
+  /// rejected because there is a higher-priority request already.
+  DocumentLocation PrefetchCodeCompletion(DocumentWidget* widget);
+  
+  /// Requests to resolve the cursors at the given identifier @p locations of
+  /// the given widget's document in the background thread, such that later
+  /// info requests at these locations can use the cached results (see
+  /// CursorFactsCache). This has the lowest priority: it is discarded by any
+  /// other info request and stops early once a request for another lane is
+  /// made or after a fixed time budget.
+  /// Returns true if the request was accepted, false otherwise (if there was a higher-priority request already).
+  bool PrefetchHoverInfo(DocumentWidget* widget, const std::vector<DocumentLocation>& locations);
+  
+  /// Requests to reparse the least up-to-date TU of the given widget's
+  /// document in the background thread if it is older than the most
+  /// up-to-date one, such that both stay within one version of the document
+  /// (see TUCatchUpOperation). This is done in its own lane, with background
+  /// priority, and only uses a TU that no other lane needs. It is skipped if
+  /// another request is made before the reparse starts.
+  /// Returns true if the request was accepted.
+  bool RequestTUCatchUp(DocumentWidget* widget);
+  
   /// Requests info for showing the right-click menu.
   /// Returns true if the request was accepted, false otherwise (if there was a higher-priority request already).
   bool RequestRightClickInfo(DocumentWidget* widget, DocumentLocation invocationLocation);
@@ -117,48 +184,147 @@ class CodeInfo {
   bool RequestCodeInfo(DocumentWidget* widget, DocumentLocation invocationLocation);
   /// In this variant of RequestInfo(), line and column are 1-based.
   /// @p pathForReferences specifies the file in which references to the
-  /// obtained cursor will be searched for.
+  /// obtained cursor will be searched for. For classes, at most
+  /// @p maxClassMembers members are listed.
   /// Returns true if the request was accepted, false otherwise (if there was a higher-priority request already).
-  bool RequestCodeInfo(DocumentWidget* widget, const QString& path, int line, int column, const QString& pathForReferences, bool dropUninterestingTokens);
+  bool RequestCodeInfo(DocumentWidget* widget, const QString& path, int line, int column, const QString& pathForReferences, bool dropUninterestingTokens, int maxClassMembers = CodeInfoRequest::kClassMembersPerPage);
   
   /// Requests to jump to the libclang cursor referenced at the given document
   /// location, performed in the background thread.
   /// Returns true if the request was accepted, false otherwise (if there was a higher-priority request already).
   bool GotoReferencedCursor(DocumentWidget* widget, DocumentLocation invocationLocation);
   
-  /// Notifies the background thread about the given @p widget being
+  /// Notifies the background threads about the given @p widget being
   /// removed, such that it will not try to access it anymore.
   void WidgetRemoved(DocumentWidget* widget);
   
+  /// Blocks until all requests that were made so far have been processed
+  /// (including their FinalizeInQtThread() step) or discarded. Must not be
+  /// called from the Qt thread. This is used by the performance harness to
+  /// measure request latencies.
+  void WaitUntilIdle();
+  
+  /// Counters about requests that could not be served directly, used by the
+  /// soak benchmark. All counters start at program start.
+  struct Statistics {
+    /// Requests that were processed by a worker (including those which were
+    /// then dropped while waiting for a TU).
+    int numProcessedRequests = 0;
+    
+    /// Requests that were rejected since a higher-priority request was queued
+    /// already (the Request...() function returned false / invalid).
+    int numRejectedRequests = 0;
+    
+    /// Queued requests that were discarded in favor of a newer request before
+    /// a worker started on them.
+    int numDiscardedRequests = 0;
+    
+    /// Number of times that a worker could not take a TU from the pool (since
+    /// TakeMostUpToDateTU() failed or the TUs were left to others) and had to
+    /// wait for one.
+    int numTUWaits = 0;
+    
+    /// Requests that were dropped while waiting for a TU, since they were
+    /// superseded by a newer request or the wait timed out.
+    int numDroppedWhileWaitingForTU = 0;
+  };
+  
+  /// Returns the current request statistics.
+  Statistics GetStatistics();
+  
+  /// Sets a callback that is called in the worker threads after each
+  /// processed request with its type and the time it took from the start of
+  /// its processing until it was finished (or dropped). Pass an empty
+  /// function to remove the callback.
+  void SetRequestFinishedCallback(const std::function<void(CodeInfoRequest::Type type, double durationMs)>& callback);
+  
   void Exit();
   
  private:
+  /// Lanes in which requests are processed independently of each other.
+  enum class Lane {
+    CodeCompletion = 0,
+    Info,
+    /// GotoReferencedCursor and RightClickInfo requests
+    Navigation,
+    /// TUCatchUp requests
+    CatchUp,
+    Count
+  };
+  
+  /// State of the thread processing the requests of one lane. Protected by
+  /// completeRequestMutex.
+  struct Worker {
+    /// Request which was made, but is not being worked on yet
+    bool haveRequest = false;
+    CodeInfoRequest lastRequest;
+    
+    /// Request which is being worked on
+    bool haveRequestInProgress = false;
+    CodeInfoRequest requestInProgress;
+    
+    /// The pool from which the worker has taken a TU, or nullptr.
+    ClangTUPool* TUPoolInUse = nullptr;
+    
+    /// The pool for which the worker waits to get a TU, or nullptr, and
+    /// whether a TU has been put into this pool since the worker started
+    /// waiting.
+    ClangTUPool* TUPoolWaitedFor = nullptr;
+    bool TUReturned = false;
+    
+    std::condition_variable newCodeInfoRequestCondition;
+    std::shared_ptr<std::thread> thread;
+  };
+  
   CodeInfo();
   
+  /// Returns the worker for the lane that handles the given request type.
+  Worker& GetWorker(CodeInfoRequest::Type type);
+  
   /// Checks whether the new request type will discard the potentially already queued old request.
   /// Returns true if the new request can be made, false if the old request has higher priority.
   bool CheckDiscardPreviousRequest(DocumentWidget* widget, CodeInfoRequest::Type newRequestType);
   
-  void ThreadMain();
+  void ThreadMain(Worker* worker);
+  
+  /// Returns whether the idle-priority request (hover prefetch or TU catch-up)
+  /// of the given worker should stop, since another request has been made or
+  /// waits for a TU.
+  bool ShouldYieldIdleRequest(Worker* worker);
   
   void LockTUForOperation(
-      const CodeInfoRequest& request,
+      Worker* worker,
       bool getUnsavedFileContents,
       TUOperationBase* operation);
   
+  /// Takes the most up-to-date TU out of @p TUPool for the given worker. Must be
+  /// called from the main (Qt) thread. Returns nullptr if no TU is available
+  /// for the worker at the moment, and registers the worker as waiting for
+  /// @p TUPool in this case. A worker does not get a TU while a worker with a
+  /// higher-priority request waits for the same pool. For requests with a
+  /// lower priority than code completion, one TU is left in the pool for the
+  /// parser if other workers operate on TUs of the same pool already. Higher-
+  /// priority requests may take the last TU, the parser then waits for it.
+  /// For TUCatchUp requests, returns a stale TU (see
+  /// ClangTUPool::TakeStaleTUForCatchUp()) if no other worker uses or waits
+  /// for the pool, and never registers the worker as waiting.
+  std::shared_ptr<ClangTU> TakeTUForWorker(Worker* worker, ClangTUPool* TUPool);
   
-  /// Request which was made, but is not being worked on yet
-  bool haveRequest = false;
-  CodeInfoRequest lastRequest;
+  /// Wakes up the workers that wait for a TU of @p TUPool. Called by the
+  /// ClangTUPoolManager whenever a TU has been put back into a pool.
+  void TUReturned(ClangTUPool* TUPool);
   
-  /// Request which is being worked on
-  bool haveRequestInProgress = false;
-  CodeInfoRequest requestInProgress;
+  
+  Worker workers[static_cast<int>(Lane::Count)];
   
   std::atomic<bool> mExit;
   
   std::mutex completeRequestMutex;
-  std::condition_variable newCodeInfoRequestCondition;
   
-  std::shared_ptr<std::thread> mThread;
+  /// Notified whenever a worker finished processing a request.
+  std::condition_variable requestFinishedCondition;
+  
+  /// Protected by completeRequestMutex.
+  Statistics statistics;
+  std::function<void(CodeInfoRequest::Type, double)> requestFinishedCallback;
 };
@@ -4,9 +4,14 @@
 
 #include "cide/code_info_code_completion.h"
 
+#include <QDir>
+#include <QFileInfo>
+#include <QRegularExpression>
+
 #include "cide/clang_parser.h"
 #include "cide/clang_utils.h"
 #include "cide/cpp_utils.h"
+#include "cide/include_file_index.h"
 #include "cide/main_window.h"
 #include "cide/qt_thread.h"
 
@@ -37,9 +42,37 @@ inline void CodeCompletionOperation::InitializeInQtThread(
     const CodeInfoRequest& request,
     const std::shared_ptr<ClangTU>& /*TU*/,
     const QString& canonicalFilePath,
-    int /*invocationLine*/,
+    int invocationLine,
     int /*invocationCol*/,
-    std::vector<CXUnsavedFile>& /*unsavedFiles*/) {
+    std::vector<CXUnsavedFile>& unsavedFiles) {
+  // Check whether completion is invoked for the path in an #include directive,
+  // directly after the opening bracket or after a '/'. libclang lists the
+  // include directories for each such completion, so these items are created
+  // from the cached IncludeFileIndex instead.
+  Document* document = request.widget->GetDocument().get();
+  QString lineText = document->TextForRange(DocumentRange(document->LineStart(invocationLine), request.codeCompletionInvocationLocation));
+  static QRegularExpression includeRegex(QStringLiteral("^\\s*#\\s*include\\s*([<\"])([^<>\"]*)$"));
+  QRegularExpressionMatch includeMatch = includeRegex.match(lineText);
+  isIncludeCompletion = includeMatch.hasMatch() && (includeMatch.capturedLength(2) == 0 || includeMatch.captured(2).endsWith('/'));
+  if (isIncludeCompletion) {
+    includeIsAngled = includeMatch.captured(1) == QStringLiteral("<");
+    includeSubPath = includeMatch.captured(2);
+    
+    // Search the directories in the order of the compiler: the directory of
+    // the file for "" includes, then -I, then -isystem.
+    includeDirs.clear();
+    if (!includeIsAngled) {
+      includeDirs.push_back(QFileInfo(canonicalFilePath).dir().path());
+    }
+    std::shared_ptr<Project> usedProject;
+    CompileSettings* settings = FindParseSettingsForFile(canonicalFilePath, request.widget->GetMainWindow()->GetProjects(), &usedProject);
+    if (settings) {
+      includeDirs.insert(includeDirs.end(), settings->includes.begin(), settings->includes.end());
+      includeDirs.insert(includeDirs.end(), settings->systemIncludes.begin(), settings->systemIncludes.end());
+    }
+    return;
+  }
+  
   if (!GuessIsHeader(canonicalFilePath, nullptr)) {
     correspondingHeaderPath = FindCorrespondingHeaderOrSource(canonicalFilePath, request.widget->GetMainWindow()->GetProjects());
     // qDebug() << "Implementation completion debug: Guessed correspondingHeaderPath:" << correspondingHeaderPath;
@@ -48,6 +81,19 @@ inline void CodeCompletionOperation::InitializeInQtThread(
   }
   
   cursorIsOutsideOfAnyClassOrFunctionDefinition = request.widget->GetDocument()->GetContextsAt(request.codeCompletionInvocationLocation).empty();
+  
+  // Remember whether the corresponding header has unsaved changes, and which.
+  correspondingHeaderIsUnsaved = false;
+  if (!correspondingHeaderPath.isEmpty()) {
+    QByteArray correspondingHeaderPathUtf8 = correspondingHeaderPath.toUtf8();
+    for (const CXUnsavedFile& unsavedFile : unsavedFiles) {
+      if (correspondingHeaderPathUtf8 == unsavedFile.Filename) {
+        correspondingHeaderIsUnsaved = true;
+        correspondingHeaderContentHash = qHash(QByteArray::fromRawData(unsavedFile.Contents, unsavedFile.Length));
+        break;
+      }
+    }
+  }
 }
 
 CodeCompletionOperation::Result CodeCompletionOperation::OperateOnTU(
@@ -59,12 +105,20 @@ CodeCompletionOperation::Result CodeCompletionOperation::OperateOnTU(
     std::vector<CXUnsavedFile>& unsavedFiles) {
   TUOperationBase::Result result = Result::TUHasNotBeenReparsed;
   
+  if (isIncludeCompletion) {
+    CreateIncludeCompletionItems();
+    return result;
+  }
+  
   // If code completion is invoked in a place where we might want to show "Implement <...>" completion items,
-  // do a full re-parse first. This is necessary to pick up added function declarations in header files
-  // if code completion is invoked in the corresponding source files before those are re-parsed.
-  // TODO: Should we only do this if we know that the corresponding header changed since the last parse?
-  if (cursorIsOutsideOfAnyClassOrFunctionDefinition) {
-    // qDebug() << "Implementation completion debug: Triggering reparse since code completion is invoked outside of a context";
+  // and the corresponding header changed since the last parse, do a full re-parse first. This is necessary to
+  // pick up added function declarations in header files if code completion is invoked in the corresponding
+  // source files before those are re-parsed.
+  if (cursorIsOutsideOfAnyClassOrFunctionDefinition &&
+      !IsCorrespondingHeaderUpToDate(TU)) {
+    // qDebug() << "Implementation completion debug: Triggering reparse since the corresponding header changed";
+    TU->SetReferenceMap(nullptr);
+    TU->SetImplementationCandidates(nullptr);
     CXErrorCode parseResult = static_cast<CXErrorCode>(clang_reparseTranslationUnit(
         TU->TU(),
         unsavedFiles.size(),
@@ -110,6 +164,32 @@ CodeCompletionOperation::Result CodeCompletionOperation::OperateOnTU(
 }
 
 void CodeCompletionOperation::FinalizeInQtThread(const CodeInfoRequest& request) {
+  if (isIncludeCompletion) {
+    // These items are not prefetched, since the directory listings are cached
+    // already and the typed path usually changes until the next invocation.
+    if (request.type == CodeInfoRequest::Type::CodeCompletionPrefetch ||
+        request.widget->GetCodeCompletionInvocationCounter() != request.invocationCounter) {
+      return;
+    }
+    if (items.empty()) {
+      request.widget->CloseCodeCompletion();
+    } else {
+      request.widget->ShowCodeCompletion(request.codeCompletionInvocationLocation, std::move(items), nullptr);
+    }
+    request.widget->CloseArgumentHint();
+    success = true;
+    return;
+  }
+  
+  if (request.type == CodeInfoRequest::Type::CodeCompletionPrefetch) {
+    // Only hand the results to the widget for later reuse, without showing them.
+    if (results && results->NumResults > 0 && !items.empty()) {
+      request.widget->SetPrefetchedCodeCompletion(request.codeCompletionInvocationLocation, std::move(items), results, std::move(hints), currentParameter);
+      success = true;
+    }
+    return;
+  }
+  
   if (!results) {
     qDebug() << "clang_codeCompleteAt() failed";
     request.widget->CloseCodeCompletion();
@@ -146,6 +226,36 @@ void CodeCompletionOperation::FinalizeInQtThread(const CodeInfoRequest& request)
   success = true;
 }
 
+void CodeCompletionOperation::CreateIncludeCompletionItems() {
+  std::vector<IncludeFileIndex::Entry> entries;
+  IncludeFileIndex::Instance().GetEntries(includeDirs, includeSubPath, &entries);
+  
+  items.reserve(entries.size());
+  for (const IncludeFileIndex::Entry& entry : entries) {
+    // Offer directories, and files that look like headers. Many system headers
+    // (and Qt's class headers) do not have an extension.
+    bool isCertain;
+    if (!entry.isDirectory &&
+        entry.name.contains('.') &&
+        !(GuessIsHeader(entry.name, &isCertain) && isCertain)) {
+      continue;
+    }
+    
+    // As libclang does, complete directories with a '/', and files with the
+    // closing bracket.
+    items.emplace_back();
+    CompletionItem& newItem = items.back();
+    newItem.filterText = entry.name + (entry.isDirectory ? QStringLiteral("/") : (includeIsAngled ? QStringLiteral(">") : QStringLiteral("\"")));
+    newItem.displayText = newItem.filterText;
+    newItem.returnTypeText = QStringLiteral("");
+    newItem.displayStyles.emplace_back(std::make_pair(0, CompletionItem::DisplayStyle::FilterText));
+    newItem.clangCompletionIndex = -1;
+    newItem.numFixits = 0;
+    newItem.isAvailable = true;
+    newItem.priority = 0;
+  }
+}
+
 void CodeCompletionOperation::CreateCodeCompletionItems() {
   // NOTE: Not sure whether the information below is of any use for us
   //   unsigned long long codeCompleteContexts = clang_codeCompleteGetContexts(results);
@@ -241,13 +351,38 @@ void CodeCompletionOperation::CreateCodeCompletionItems() {
   }
 }
 
+bool CodeCompletionOperation::IsCorrespondingHeaderUpToDate(const std::shared_ptr<ClangTU>& TU) {
+  if (correspondingHeaderPath.isEmpty()) {
+    return true;
+  }
+  
+  // If the implementation candidates have been determined for this parse
+  // already, they record the state of the header that the TU was parsed with.
+  const std::shared_ptr<const ImplementationCandidates>& candidates = TU->GetImplementationCandidates();
+  if (candidates && candidates->headerPath == correspondingHeaderPath) {
+    if (candidates->headerWasUnsaved || correspondingHeaderIsUnsaved) {
+      return candidates->headerWasUnsaved == correspondingHeaderIsUnsaved &&
+             candidates->headerContentHash == correspondingHeaderContentHash;
+    }
+  } else if (correspondingHeaderIsUnsaved) {
+    // We do not know whether the TU was parsed with the current unsaved
+    // contents of the header.
+    return false;
+  }
+  
+  // Compare the header's modification time with the one seen by the TU. If the
+  // TU does not include the header, there is nothing to pick up from it.
+  CXFile headerFile = clang_getFile(TU->TU(), correspondingHeaderPath.toLocal8Bit());
+  if (headerFile == nullptr) {
+    return true;
+  }
+  return clang_getFileTime(headerFile) == QFileInfo(correspondingHeaderPath).lastModified().toSecsSinceEpoch();
+}
+
 struct FindUnimplementedFunctionsVisitorData {
-  const CodeInfoRequest* request;
-  QString canonicalFilePath;
   CXFile invocationFile;
   CXFile headerFile;
-  std::vector<CompletionItem>* items;
-  QString invocationScopeQualifiers;
+  ImplementationCandidates* candidates;
   bool inQtSignalsRegion;
 };
 
@@ -465,35 +600,20 @@ CXChildVisitResult VisitClangAST_FindUnimplementedFunctions(CXCursor cursor, CXC
     return CXChildVisit_Continue;
   }
   
-  // We have a declaration without definition. Try to find the definition via USRs.
-  std::unordered_set<QString> relevantFiles;
+  // We have a declaration without definition in the AST. Whether the function
+  // is defined elsewhere is checked when creating the completion items.
+  data->candidates->candidates.emplace_back();
+  ImplementationCandidates::Candidate& candidate = data->candidates->candidates.back();
+  candidate.cursor = cursor;
+  candidate.USR = ClangString(clang_getCursorUSR(cursor)).ToQByteArray();
   
-  bool exit = false;
-  RunInQtThreadBlocking([&]() {
-    // If the document has been closed in the meantime, we must not access its
-    // widget anymore.
-    if (data->request->wasCanceled) {
-      exit = true;
-      return;
-    }
-    USRStorage::Instance().GetFilesForUSRLookup(data->canonicalFilePath, data->request->widget->GetMainWindow(), &relevantFiles);
-  });
-  if (exit) {
-    return CXChildVisit_Break;
-  }
-  std::vector<std::pair<QString, USRDecl>> foundDecls;  // pair of file path and USR
-  USRStorage::Instance().LookupUSRs(
-      ClangString(clang_getCursorUSR(cursor)).ToQByteArray(),
-      relevantFiles,
-      &foundDecls);
-  
-  for (const auto& item : foundDecls) {
-    if (item.second.isDefinition) {
-      return CXChildVisit_Continue;
-    }
-  }
-  
-  // We did not find a definition. Create an implementation completion item.
+  return CXChildVisit_Continue;
+}
+
+/// Adds an "Implement <...>" completion item for the function declared by
+/// @p cursor to @p items.
+static void AddImplementationCompletionItem(CXCursor cursor, const QString& invocationScopeQualifiers, std::vector<CompletionItem>* items) {
+  // Create an implementation completion item.
   // - Remove "static", "override", "virtual" if present.
   // - Remove default values for arguments.
   // - Add qualifiers if required, e.g., turn SomeNestedStruct into
@@ -501,15 +621,17 @@ CXChildVisitResult VisitClangAST_FindUnimplementedFunctions(CXCursor cursor, CXC
   //   Or add a namespace if the class is defined within one, but we are currently
   //   not in it.
   
+  CXCursorKind kind = clang_getCursorKind(cursor);
+  QString functionName = ClangString(clang_getCursorSpelling(cursor)).ToQString();
   QString declarationQualifiers = GetCursorScopeQualifiers(clang_getCursorSemanticParent(cursor));
-  QString definitionQualifiers = PrintRequiredScopeQualifiers(data->invocationScopeQualifiers, declarationQualifiers);
+  QString definitionQualifiers = PrintRequiredScopeQualifiers(invocationScopeQualifiers, declarationQualifiers);
   
   QString completionString;
   QString qualifiedFunctionName;
   
   if (kind != CXCursor_Constructor &&
       kind != CXCursor_Destructor) {
-    completionString += PrintTypeForImplementationCompletion(clang_getCursorResultType(cursor), data->invocationScopeQualifiers) + QStringLiteral(" ");
+    completionString += PrintTypeForImplementationCompletion(clang_getCursorResultType(cursor), invocationScopeQualifiers) + QStringLiteral(" ");
   }
   qualifiedFunctionName = definitionQualifiers + functionName;
   completionString += qualifiedFunctionName + QStringLiteral("(");
@@ -545,8 +667,8 @@ CXChildVisitResult VisitClangAST_FindUnimplementedFunctions(CXCursor cursor, CXC
   }
   completionString += QStringLiteral(" {\n  \n}");
   
-  data->items->emplace_back();
-  CompletionItem& newItem = data->items->back();
+  items->emplace_back();
+  CompletionItem& newItem = items->back();
   newItem.displayText = QStringLiteral("-> Implement: %1").arg(qualifiedFunctionName);
   newItem.returnTypeText = QStringLiteral("");
   newItem.displayStyles.emplace_back(std::make_pair(0, CompletionItem::DisplayStyle::FilterText));
@@ -556,10 +678,10 @@ CXChildVisitResult VisitClangAST_FindUnimplementedFunctions(CXCursor cursor, CXC
   newItem.numFixits = 0;
   newItem.isAvailable = true;
   newItem.priority = 0;  // always show the implementation completions at the beginning
-  
-  return CXChildVisit_Continue;
 }
 
+
+
 void CodeCompletionOperation::CreateImplementationCompletionItems(
     const CodeInfoRequest& request,
     const std::shared_ptr<ClangTU>& TU,
@@ -582,19 +704,64 @@ void CodeCompletionOperation::CreateImplementationCompletionItems(
     return;
   }
   
-  // Iterate over all function declarations before the cursor in this file.
+  // Get the function declarations in this file without definition in the AST.
   // If we think that the current file is a source file, also include the header that we believe corresponds to this source file.
   // We cannot simply iterate over all headers, since implementations of functions in libraries might be linked
   // in without being visible to the compiler. So we might get lots of invalid items from those.
-  // For each visited declaration, if no definition is found for it via USRs, an implementation completion item is added for it.
-  FindUnimplementedFunctionsVisitorData visitorData;
-  visitorData.request = &request;
-  visitorData.canonicalFilePath = canonicalFilePath;
-  visitorData.invocationFile = clangFile;
-  visitorData.headerFile = correspondingHeader;
-  visitorData.items = &items;
-  visitorData.invocationScopeQualifiers = GetCursorScopeQualifiers(cursor);
-  visitorData.inQtSignalsRegion = false;
-  
-  clang_visitChildren(clang_getTranslationUnitCursor(TU->TU()), &VisitClangAST_FindUnimplementedFunctions, &visitorData);
+  // Since this requires visiting the whole AST, the result is cached in the TU until it gets reparsed.
+  std::shared_ptr<const ImplementationCandidates> candidates = TU->GetImplementationCandidates();
+  if (!candidates || candidates->headerPath != correspondingHeaderPath) {
+    std::shared_ptr<ImplementationCandidates> newCandidates(new ImplementationCandidates());
+    newCandidates->headerPath = correspondingHeaderPath;
+    newCandidates->headerWasUnsaved = correspondingHeaderIsUnsaved;
+    newCandidates->headerContentHash = correspondingHeaderIsUnsaved ? correspondingHeaderContentHash : 0;
+    
+    FindUnimplementedFunctionsVisitorData visitorData;
+    visitorData.invocationFile = clangFile;
+    visitorData.headerFile = correspondingHeader;
+    visitorData.candidates = newCandidates.get();
+    visitorData.inQtSignalsRegion = false;
+    
+    clang_visitChildren(clang_getTranslationUnitCursor(TU->TU()), &VisitClangAST_FindUnimplementedFunctions, &visitorData);
+    
+    candidates = newCandidates;
+    TU->SetImplementationCandidates(candidates);
+  }
+  if (candidates->candidates.empty()) {
+    return;
+  }
+  
+  // For each candidate, if no definition is found for it via USRs, an implementation completion item is added for it.
+  std::unordered_set<QString> relevantFiles;
+  bool exit = false;
+  RunInQtThreadBlocking([&]() {
+    // If the document has been closed in the meantime, we must not access its
+    // widget anymore.
+    if (request.wasCanceled) {
+      exit = true;
+      return;
+    }
+    USRStorage::Instance().GetFilesForUSRLookup(canonicalFilePath, request.widget->GetMainWindow(), &relevantFiles);
+  });
+  if (exit) {
+    return;
+  }
+  
+  QString invocationScopeQualifiers = GetCursorScopeQualifiers(cursor);
+  std::vector<std::pair<QString, USRDecl>> foundDecls;  // pair of file path and USR
+  for (const ImplementationCandidates::Candidate& candidate : candidates->candidates) {
+    foundDecls.clear();
+    USRStorage::Instance().LookupUSRs(candidate.USR, relevantFiles, &foundDecls);
+    
+    bool haveDefinition = false;
+    for (const auto& item : foundDecls) {
+      if (item.second.isDefinition) {
+        haveDefinition = true;
+        break;
+      }
+    }
+    if (!haveDefinition) {
+      AddImplementationCompletionItem(candidate.cursor, invocationScopeQualifiers, &items);
+    }
+  }
 }
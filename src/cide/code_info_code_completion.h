@@ -6,6 +6,30 @@
 
 #include "cide/code_info.h"
 
+/// The function declarations in the main file of a TU and in its corresponding
+/// header that may be offered for implementation by code completion, i.e.,
+/// those that are not defined inline, not pure virtual, and neither Qt signals
+/// nor generated by moc. Whether they are defined elsewhere is not checked
+/// here, since this may change without the TU being reparsed. Finding the
+/// candidates requires visiting the whole AST, so they are cached in the
+/// ClangTU for the parse that they were found in.
+struct ImplementationCandidates {
+  struct Candidate {
+    CXCursor cursor;
+    QByteArray USR;
+  };
+  
+  std::vector<Candidate> candidates;
+  
+  /// Canonical path of the corresponding header that was considered, or empty.
+  QString headerPath;
+  
+  /// Whether the TU was parsed with unsaved contents of the header, and if so,
+  /// the qHash() of these contents.
+  bool headerWasUnsaved;
+  uint headerContentHash;
+};
+
 struct CodeCompletionOperation : public TUOperationBase {
   CXCodeCompleteResults* results = nullptr;
   bool success = false;
@@ -33,6 +57,10 @@ struct CodeCompletionOperation : public TUOperationBase {
  private:
   void CreateCodeCompletionItems();
   
+  /// Creates the items for completing the path in an #include directive from
+  /// the IncludeFileIndex.
+  void CreateIncludeCompletionItems();
+  
   void CreateImplementationCompletionItems(
       const CodeInfoRequest& request,
       const std::shared_ptr<ClangTU>& TU,
@@ -40,11 +68,27 @@ struct CodeCompletionOperation : public TUOperationBase {
       int invocationLine,
       int invocationCol);
   
+  /// Returns whether @p TU contains the current version of the corresponding
+  /// header, such that it does not need to be reparsed before determining the
+  /// implementation completion items.
+  bool IsCorrespondingHeaderUpToDate(const std::shared_ptr<ClangTU>& TU);
+  
   std::vector<CompletionItem> items;
   std::vector<ArgumentHintItem> hints;
   int currentParameter = -1;
   
+  /// Whether code completion is invoked for the path in an #include
+  /// directive. If so, includeSubPath is the path typed so far (empty or
+  /// ending with '/'), includeDirs are the directories to search it in, and
+  /// includeIsAngled tells whether the path is enclosed in <> or "".
+  bool isIncludeCompletion = false;
+  bool includeIsAngled;
+  QString includeSubPath;
+  std::vector<QString> includeDirs;
+  
   bool cursorIsOutsideOfAnyClassOrFunctionDefinition;
   QString correspondingHeaderPath;
   CXFile correspondingHeader;
+  bool correspondingHeaderIsUnsaved = false;
+  uint correspondingHeaderContentHash = 0;
 };
@@ -0,0 +1,169 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/code_info_cursor_facts.h"
+
+#include <QDebug>
+#include <QStringList>
+
+#include "cide/clang_tu_pool.h"
+#include "cide/clang_utils.h"
+
+/// Maximum number of entries kept in CursorFactsCache::Instance().
+constexpr int kCursorFactsCacheSize = 256;
+
+CursorFactsCache::CursorFactsCache(int maxSize)
+    : maxSize(maxSize) {}
+
+CursorFactsCache& CursorFactsCache::Instance() {
+  static CursorFactsCache instance(kCursorFactsCacheSize);
+  return instance;
+}
+
+bool CursorFactsCache::Lookup(const QString& key, CursorFacts* facts) {
+  std::unique_lock<std::mutex> lock(mutex);
+  
+  auto it = entryMap.find(key);
+  if (it == entryMap.end()) {
+    return false;
+  }
+  entries.splice(entries.begin(), entries, it->second);
+  *facts = it->second->facts;
+  return true;
+}
+
+void CursorFactsCache::Insert(const QString& key, const CursorFacts& facts) {
+  std::unique_lock<std::mutex> lock(mutex);
+  
+  auto it = entryMap.find(key);
+  if (it != entryMap.end()) {
+    entries.erase(it->second);
+    entryMap.erase(it);
+  }
+  
+  entries.emplace_front();
+  Entry& entry = entries.front();
+  entry.key = key;
+  entry.facts = facts;
+  entryMap[key] = entries.begin();
+  
+  while (entries.size() > maxSize) {
+    entryMap.erase(entries.back().key);
+    entries.pop_back();
+  }
+}
+
+
+/// Finds the token within the extent of @p cursor that contains
+/// @p requestLocation and stores it in @p facts. Note that simply using
+/// clang_getToken() does not work, since its use would require to know the
+/// location at which the token starts.
+static void FindTokenAtLocation(CXTranslationUnit TU, CXCursor cursor, CXSourceLocation requestLocation, CursorFacts* facts) {
+  facts->tokenSpelling = QString();
+  facts->tokenKind = CXToken_Punctuation;
+  facts->tokenRange = clang_getNullRange();
+  
+  unsigned invocationOffset;
+  clang_getSpellingLocation(requestLocation, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &invocationOffset);
+  
+  CXToken* tokens;
+  unsigned numTokens;
+  clang_tokenize(TU, clang_getCursorExtent(cursor), &tokens, &numTokens);
+  for (int tokenIndex = 0; tokenIndex < numTokens; ++ tokenIndex) {
+    CXSourceRange tokenRange = clang_getTokenExtent(TU, tokens[tokenIndex]);
+    
+    CXSourceLocation start = clang_getRangeStart(tokenRange);
+    unsigned startOffset;
+    clang_getSpellingLocation(start, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &startOffset);
+    if (startOffset > invocationOffset) {
+      continue;
+    }
+    
+    CXSourceLocation end = clang_getRangeEnd(tokenRange);
+    unsigned endOffset;
+    clang_getSpellingLocation(end, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &endOffset);
+    if (endOffset <= invocationOffset) {
+      continue;
+    }
+    
+    // Found the token under the cursor.
+    facts->tokenSpelling = ClangString(clang_getTokenSpelling(TU, tokens[tokenIndex])).ToQString();
+    facts->tokenKind = clang_getTokenKind(tokens[tokenIndex]);
+    facts->tokenRange = tokenRange;
+    break;
+  }
+  clang_disposeTokens(TU, tokens, numTokens);
+}
+
+bool GetCursorFacts(
+    const std::shared_ptr<ClangTU>& TU,
+    const QString& canonicalFilePath,
+    int invocationLine,
+    int invocationCol,
+    CursorFacts* facts,
+    CXCursor* cursor) {
+  QString cacheKey = QStringList{
+      QString::number(TU->GetParseStamp()),
+      canonicalFilePath,
+      QString::number(invocationLine),
+      QString::number(invocationCol)}.join('\n');
+  bool haveCachedFacts = CursorFactsCache::Instance().Lookup(cacheKey, facts);
+  if (haveCachedFacts && !cursor) {
+    return true;
+  }
+  
+  // Try to get a cursor for the given source location
+  CXFile clangFile = clang_getFile(TU->TU(), canonicalFilePath.toUtf8().data());
+  if (clangFile == nullptr) {
+    qDebug() << "Warning: GetCursorFacts(): Cannot get the CXFile for" << canonicalFilePath << "in the TU.";
+    return false;
+  }
+  
+  CXSourceLocation requestLocation = clang_getLocation(TU->TU(), clangFile, invocationLine + 1, invocationCol + 1);
+  CXCursor requestCursor = clang_getCursor(TU->TU(), requestLocation);
+  if (clang_Cursor_isNull(requestCursor)) {
+    return false;
+  }
+  if (cursor) {
+    *cursor = requestCursor;
+  }
+  if (haveCachedFacts) {
+    return true;
+  }
+  
+  facts->kind = clang_getCursorKind(requestCursor);
+  facts->spelling = ClangString(clang_getCursorSpelling(requestCursor)).ToQString();
+  clang_getFileLocation(clang_getCursorLocation(requestCursor), nullptr, &facts->line, &facts->column, nullptr);
+  
+  FindTokenAtLocation(TU->TU(), requestCursor, requestLocation, facts);
+  
+  CXCursor referencedCursor = clang_getCursorReferenced(requestCursor);
+  facts->hasReferencedCursor = !clang_Cursor_isNull(referencedCursor);
+  if (facts->hasReferencedCursor) {
+    facts->referencedLocation = clang_getCursorLocation(referencedCursor);
+    facts->referencedUSR = ClangString(clang_getCursorUSR(referencedCursor)).ToQByteArray();
+    facts->USR = facts->referencedUSR;
+  } else {
+    facts->referencedLocation = clang_getNullLocation();
+    facts->referencedUSR = QByteArray();
+    facts->USR = ClangString(clang_getCursorUSR(requestCursor)).ToQByteArray();
+  }
+  
+  // Check whether the cursor's definition is within a function body.
+  facts->hasLocalDefinition = false;
+  CXCursor definition = clang_getCursorDefinition(requestCursor);
+  if (!clang_Cursor_isNull(definition)) {
+    CXCursor definitionParent = clang_getCursorSemanticParent(definition);
+    while (!clang_Cursor_isNull(definitionParent)) {
+      if (IsFunctionDeclLikeCursorKind(clang_getCursorKind(definitionParent))) {
+        facts->hasLocalDefinition = true;
+        break;
+      }
+      definitionParent = clang_getCursorSemanticParent(definitionParent);
+    }
+  }
+  
+  CursorFactsCache::Instance().Insert(cacheKey, *facts);
+  return true;
+}
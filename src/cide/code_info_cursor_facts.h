@@ -0,0 +1,104 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <clang-c/Index.h>
+#include <QByteArray>
+#include <QString>
+
+#include "cide/util.h"
+
+class ClangTU;
+
+/// Facts about the cursor at the location of a code info request, which are
+/// needed by several kinds of requests (GetInfoOperation,
+/// GetRightClickInfoOperation and GotoReferencedCursorOperation). The source
+/// ranges and locations are only valid for the parse of the TU that they were
+/// obtained from.
+struct CursorFacts {
+  /// Kind and spelling of the cursor (clang_getCursorSpelling()).
+  CXCursorKind kind;
+  QString spelling;
+  
+  /// 1-based line and column of the cursor's location.
+  unsigned line;
+  unsigned column;
+  
+  /// The token at the request location, or a null range if there is none.
+  QString tokenSpelling;
+  CXTokenKind tokenKind;
+  CXSourceRange tokenRange;
+  
+  /// Whether the cursor references another cursor
+  /// (clang_getCursorReferenced()), the location of that cursor, and its USR.
+  bool hasReferencedCursor;
+  CXSourceLocation referencedLocation;
+  QByteArray referencedUSR;
+  
+  /// USR of the referenced cursor, or of the cursor itself if it does not
+  /// reference another cursor.
+  QByteArray USR;
+  
+  /// Whether the cursor's definition (clang_getCursorDefinition()) is within
+  /// a function body.
+  bool hasLocalDefinition;
+};
+
+/// LRU cache for CursorFacts. The keys contain the TU's parse stamp, so entries
+/// are no longer used once the TU has been reparsed. Hovering a token and then
+/// right-clicking it or jumping to its definition thus only resolves the
+/// cursor once.
+///
+/// This class is thread-safe.
+class CursorFactsCache {
+ public:
+  /// Constructs a cache that holds at most @p maxSize entries.
+  explicit CursorFactsCache(int maxSize);
+  
+  static CursorFactsCache& Instance();
+  
+  /// If there is an entry for @p key, marks it as the most recently used one,
+  /// returns its content in @p facts, and returns true. Otherwise, returns
+  /// false.
+  bool Lookup(const QString& key, CursorFacts* facts);
+  
+  /// Adds an entry (or replaces an existing one) as the most recently used
+  /// one. If the cache is full, the least recently used entry is removed.
+  void Insert(const QString& key, const CursorFacts& facts);
+  
+ private:
+  struct Entry {
+    QString key;
+    CursorFacts facts;
+  };
+  
+  int maxSize;
+  
+  /// Ordered from the most recently to the least recently used entry.
+  std::list<Entry> entries;
+  
+  /// Maps key --> entry in entries.
+  std::unordered_map<QString, std::list<Entry>::iterator> entryMap;
+  
+  std::mutex mutex;
+};
+
+/// Returns the facts about the cursor at the given 0-based
+/// @p invocationLine and @p invocationCol in the file @p canonicalFilePath of
+/// @p TU, using CursorFactsCache. If @p cursor is non-null, the cursor itself
+/// is returned in it as well. Returns false if there is no cursor at the
+/// location.
+bool GetCursorFacts(
+    const std::shared_ptr<ClangTU>& TU,
+    const QString& canonicalFilePath,
+    int invocationLine,
+    int invocationCol,
+    CursorFacts* facts,
+    CXCursor* cursor = nullptr);
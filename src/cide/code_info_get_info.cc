@@ -4,12 +4,19 @@
 
 #include "cide/code_info_get_info.h"
 
+#include <QStringList>
+
+#include "cide/clang_highlighting.h"
 #include "cide/clang_utils.h"
+#include "cide/code_info_cursor_facts.h"
 #include "cide/main_window.h"
 #include "cide/clang_parser.h"
 #include "cide/qt_help.h"
 #include "cide/qt_thread.h"
 
+/// Maximum number of infos kept in GetInfoCache::Instance().
+constexpr int kGetInfoCacheSize = 64;
+
 struct MemberAccessStruct {
   enum MemberType {
     Public = 0,
@@ -40,6 +47,11 @@ struct MemberList {
   
   QString nameFilter;
   
+  /// Maximum number of members to print, or -1 for no limit. Further members
+  /// are only counted in numMembers.
+  int maxMembers = -1;
+  int numMembers = 0;
+  
   // Helper
   std::shared_ptr<ClangTU> TU;
 };
@@ -91,7 +103,8 @@ QString PrintLinkToDefinitionOrDeclarationLocation(CXCursor cursor) {
              QStringLiteral("</a>"));
 }
 
-QString PrintLinkToCursorInfo(CXCursor cursor) {
+/// Returns the location of the given cursor as "path:line:column".
+QString GetCursorLocationString(CXCursor cursor) {
   CXSourceLocation location = clang_getCursorLocation(cursor);
   CXFile file;
   unsigned line, column;
@@ -104,8 +117,11 @@ QString PrintLinkToCursorInfo(CXCursor cursor) {
   
   QString fullPath = GetClangFilePath(file);
   
-  QString locationString = fullPath + QStringLiteral(":") + QString::number(line) + QStringLiteral(":") + QString::number(column);
-  return QStringLiteral("<a href=\"info://") + locationString + QStringLiteral("\">");
+  return fullPath + QStringLiteral(":") + QString::number(line) + QStringLiteral(":") + QString::number(column);
+}
+
+QString PrintLinkToCursorInfo(CXCursor cursor) {
+  return QStringLiteral("<a href=\"info://") + GetCursorLocationString(cursor) + QStringLiteral("\">");
 }
 
 /// Called to print types in documentation displays.
@@ -443,6 +459,13 @@ CXChildVisitResult VisitClangAST_ListMembers(CXCursor cursor, CXCursor /*parent*
     return CXChildVisit_Continue;
   }
   
+  // Only count the members beyond the limit. Printing them is the expensive
+  // part for classes with thousands of members.
+  ++ result->numMembers;
+  if (result->maxMembers >= 0 && result->numMembers > result->maxMembers) {
+    return CXChildVisit_Continue;
+  }
+  
   // Determine access specifier of member
   QString* desc;
   CX_CXXAccessSpecifier accessSpecifier = clang_getCXXAccessSpecifier(cursor);
@@ -479,12 +502,12 @@ CXChildVisitResult VisitClangAST_GetChildCursor(CXCursor cursor, CXCursor /*pare
     state->result = cursor;
   }
   state->foundResultWithDefinition = hasDefinition;
-  
+
 //   qDebug() << "Child cursor kind: " << ClangString(clang_getCursorKindSpelling(clang_getCursorKind(cursor))).ToQString()
 //            << " spelling:" << ClangString(clang_getCursorSpelling(cursor)).ToQString()
 //            << " has definition:" << hasDefinition
 //            << " parent spelling:" << ClangString(clang_getCursorSpelling(parent)).ToQString();
-  
+
   return CXChildVisit_Recurse;
 }
 
@@ -535,13 +558,18 @@ CXChildVisitResult VisitClangAST_ListBaseClasses(CXCursor cursor, CXCursor /*par
 }
 
 
+/// Prints the members of the class @p definition. If @p maxMembers is not -1,
+/// only the first @p maxMembers members are printed, followed by a
+/// "members://" link to show the next page of members if there are more.
 QString PrintClassMembers(
     CXCursor definition,
     std::shared_ptr<ClangTU> TU,
-    const QString& memberNameFilter = "") {
+    const QString& memberNameFilter = "",
+    int maxMembers = -1) {
   MemberList memberList;
   memberList.TU = TU;
   memberList.nameFilter = memberNameFilter;
+  memberList.maxMembers = maxMembers;
   clang_visitChildren(definition, &VisitClangAST_ListMembers, &memberList);
   
   const QString accessHeadingStart = QStringLiteral("<hr/><b style=\"color:#cccccc;\">");  // <h4 style=\"color:#555555;\">
@@ -584,6 +612,15 @@ QString PrintClassMembers(
     }
   }
   
+  if (maxMembers >= 0 && memberList.numMembers > maxMembers) {
+    int numRemainingMembers = memberList.numMembers - maxMembers;
+    membersString +=
+        QStringLiteral("<hr/><a href=\"members://") +
+        QString::number(maxMembers + CodeInfoRequest::kClassMembersPerPage) + QStringLiteral("@") +
+        GetCursorLocationString(definition) + QStringLiteral("\">") +
+        QObject::tr("Show more members (%1 not shown)").arg(numRemainingMembers) + QStringLiteral("</a>");
+  }
+  
   return membersString;
 }
 
@@ -650,9 +687,10 @@ QString PrintClass(
     const QString& USRString,
     const QString& accessString,
     const QString& commentString,
+    int maxMembers,
     std::shared_ptr<ClangTU> TU) {
   // Retrieve the members.
-  QString membersString = PrintClassMembers(definition, TU);
+  QString membersString = PrintClassMembers(definition, TU, "", maxMembers);
   
   // Get the record type (e.g., "class" or "struct" or "union" ...)
   QString recordTypeString = GetClassLikeRecordType(definition, definitionKind);
@@ -1141,68 +1179,36 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
   // Set the infoTokenRange output variable to null
   infoTokenRange = clang_getNullRange();
   
-  // Try to get a cursor for the given source location
-  CXFile clangFile = clang_getFile(TU->TU(), canonicalFilePath.toUtf8().data());
-  if (clangFile == nullptr) {
-    qDebug() << "Warning: GetInfo(): Cannot get the CXFile for" << canonicalFilePath << "in the TU.";
-    return Result::TUHasNotBeenReparsed;
-  }
-  
-  CXSourceLocation requestLocation = clang_getLocation(TU->TU(), clangFile, invocationLine + 1, invocationCol + 1);
-  CXCursor cursor = clang_getCursor(TU->TU(), requestLocation);
-  if (clang_Cursor_isNull(cursor)) {
+  // Get the cursor for the given source location, and the facts about it
+  // that are shared with the other code info operations.
+  CursorFacts facts;
+  CXCursor cursor;
+  if (!GetCursorFacts(TU, canonicalFilePath, invocationLine, invocationCol, &facts, &cursor)) {
     return Result::TUHasNotBeenReparsed;
   }
+  CXFile clangFile = clang_getFile(TU->TU(), canonicalFilePath.toUtf8().data());
   
   // --- Get information about the cursor ---
   
   if (kDebug) {
     qDebug() << "Cursor extent:" << GetClangText(clang_getCursorExtent(cursor), TU->TU());
-    qDebug() << "Cursor spelling:" << ClangString(clang_getCursorSpelling(cursor)).ToQString();
+    qDebug() << "Cursor spelling:" << facts.spelling;
   }
   
   // Get cursor kind.
-  CXCursorKind kind = clang_getCursorKind(cursor);
+  CXCursorKind kind = facts.kind;
   if (kDebug) {
     CXString kindString = clang_getCursorKindSpelling(kind);
     qDebug() << "Cursor kind:" << QString::fromUtf8(clang_getCString(kindString));
     clang_disposeString(kindString);
   }
   
-  // Get the token under the cursor. Note that simply using clang_getToken()
-  // does not work, since its use would require to know the location at which
-  // the token starts.
-  bool tokenFound = false;
-  QString tokenString;
-  
-  unsigned invocationOffset;
-  clang_getSpellingLocation(requestLocation, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &invocationOffset);
-  
-  CXToken* tokens;
-  unsigned numTokens;
-  clang_tokenize(TU->TU(), clang_getCursorExtent(cursor), &tokens, &numTokens);
-  for (int tokenIndex = 0; tokenIndex < numTokens; ++ tokenIndex) {
-    CXSourceRange tokenRange = clang_getTokenExtent(TU->TU(), tokens[tokenIndex]);
-    
-    CXSourceLocation start = clang_getRangeStart(tokenRange);
-    unsigned startOffset;
-    clang_getSpellingLocation(start, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &startOffset);
-    if (startOffset > invocationOffset) {
-      continue;
-    }
-    
-    CXSourceLocation end = clang_getRangeEnd(tokenRange);
-    unsigned endOffset;
-    clang_getSpellingLocation(end, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &endOffset);
-    if (endOffset <= invocationOffset) {
-      continue;
-    }
-    
-    // Found the token under the cursor.
-    tokenString = ClangString(clang_getTokenSpelling(TU->TU(), tokens[tokenIndex])).ToQString();
-    
+  // Get the token under the cursor.
+  bool tokenFound = !clang_Range_isNull(facts.tokenRange);
+  QString tokenString = facts.tokenSpelling;
+  if (tokenFound) {
     if (request.dropUninterestingTokens) {
-      CXTokenKind tokenKind = clang_getTokenKind(tokens[tokenIndex]);
+      CXTokenKind tokenKind = facts.tokenKind;
       if (((tokenKind == CXToken_Keyword) &&
           (tokenString != QStringLiteral("break") && tokenString != QStringLiteral("continue"))) ||
           tokenKind == CXToken_Literal ||
@@ -1212,17 +1218,12 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
             tokenString == QStringLiteral("}") ||
             tokenString == QStringLiteral(";")))) {
         // The token under the cursor is of an uninteresting kind. Stop.
-        clang_disposeTokens(TU->TU(), tokens, numTokens);
         return Result::TUHasNotBeenReparsed;
       }
     }
     
-    infoTokenRange = tokenRange;
-    
-    tokenFound = true;
-    break;
+    infoTokenRange = facts.tokenRange;
   }
-  clang_disposeTokens(TU->TU(), tokens, numTokens);
   
   if (kDebug) {
     if (tokenFound) {
@@ -1235,9 +1236,8 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
   // Prefer the cursor spelling over the raw token, if available. Otherwise,
   // when hovering the '(' for a constructor call, we would show 'ClassName::('
   // instead of 'ClassName::ClassName'.
-  QString spellingString = ClangString(clang_getCursorSpelling(cursor)).ToQString();
-  if (!spellingString.isEmpty()) {
-    tokenString = spellingString;
+  if (!facts.spelling.isEmpty()) {
+    tokenString = facts.spelling;
   }
   
   // Get the cursor's type.
@@ -1283,7 +1283,28 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
     CXCursor childCursor = GetChildCursorWithDefinition(cursor);
     definition = clang_getCursorDefinition(childCursor);
   }
+  
+  // If the info for this definition and cursor has been rendered with this
+  // version of the TU before, use the cached result.
+  QByteArray definitionUSR;
+  QString cacheKey;
+  bool haveCachedInfo = false;
   if (!clang_Cursor_isNull(definition)) {
+    definitionUSR = ClangString(clang_getCursorUSR(definition)).ToQByteArray();
+    if (!definitionUSR.isEmpty()) {
+      cacheKey = QStringList{
+          QString::number(TU->GetParseStamp()),
+          QString::fromUtf8(definitionUSR),
+          QString::number(static_cast<int>(kind)),
+          clang_equalCursors(cursor, definition) ? QStringLiteral("1") : QStringLiteral("0"),
+          tokenString,
+          typeString,
+          QString::number(request.maxClassMembers)}.join('\n');
+      haveCachedInfo = GetInfoCache::Instance().Lookup(cacheKey, &htmlString, &helpUrl);
+    }
+  }
+  
+  if (!haveCachedInfo && !clang_Cursor_isNull(definition)) {
     // Get file/line/column of the definition
     CXSourceLocation definitionLocation = clang_getCursorLocation(definition);
     CXFile definitionFile;
@@ -1315,7 +1336,7 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
     // In the USRStorage, search over all these files for the USR.
     std::vector<std::pair<QString, USRDecl>> foundDecls;  // pair of file path and USR
     USRStorage::Instance().LookupUSRs(
-        ClangString(clang_getCursorUSR(definition)).ToQByteArray(),
+        definitionUSR,
         relevantFiles,
         &foundDecls);
     
@@ -1521,6 +1542,7 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
             USRString,
             accessString,
             commentString,
+            request.maxClassMembers,
             TU);
       }
     } else if (definitionKind == CXCursor_FunctionDecl ||
@@ -1607,6 +1629,10 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
           .arg(valueString.isEmpty() ? "" : QObject::tr("<br/><br/><b>Value: %1</b>").arg(valueString.toHtmlEscaped()))
           .arg(referenceString);
     }
+    
+    if (!cacheKey.isEmpty()) {
+      GetInfoCache::Instance().Insert(cacheKey, htmlString, helpUrl);
+    }
   }
   
   // Check for CXCursor_MemberRefExpr without a definition. At least in one case
@@ -1680,9 +1706,14 @@ GetInfoOperation::Result GetInfoOperation::OperateOnTU(
       }
     }
   } else {
+    // Look up the references in the map that was collected while highlighting
+    // the file, if available. Otherwise, search for them in the AST.
+    const std::shared_ptr<const ClangReferenceMap>& referenceMap = TU->GetReferenceMap();
     if (referencesFile == nullptr) {
       qDebug() << "Warning: GetInfo(): Cannot get the CXFile for" << request.pathForReferences << "in the TU for finding references.";
-    } else {
+    } else if (!referenceMap ||
+               !clang_File_isEqual(referencesFile, referenceMap->file()) ||
+               !referenceMap->Find(cursor, &referenceRanges)) {
       CXCursorAndRangeVisitor referencesVisitor;
       referencesVisitor.context = &referenceRanges;
       referencesVisitor.visit = &VisitReferences;
@@ -1740,3 +1771,47 @@ void GetInfoOperation::FinalizeInQtThread(const CodeInfoRequest& request) {
   // Make the gathered information available to the DocumentWidget
   request.widget->SetCodeTooltip(tokenDocumentRange, htmlString, helpUrl, referenceDocumentRanges);
 }
+
+
+GetInfoCache::GetInfoCache(int maxSize)
+    : maxSize(maxSize) {}
+
+GetInfoCache& GetInfoCache::Instance() {
+  static GetInfoCache instance(kGetInfoCacheSize);
+  return instance;
+}
+
+bool GetInfoCache::Lookup(const QString& key, QString* htmlString, QUrl* helpUrl) {
+  std::unique_lock<std::mutex> lock(mutex);
+  
+  auto it = entryMap.find(key);
+  if (it == entryMap.end()) {
+    return false;
+  }
+  entries.splice(entries.begin(), entries, it->second);
+  *htmlString = it->second->htmlString;
+  *helpUrl = it->second->helpUrl;
+  return true;
+}
+
+void GetInfoCache::Insert(const QString& key, const QString& htmlString, const QUrl& helpUrl) {
+  std::unique_lock<std::mutex> lock(mutex);
+  
+  auto it = entryMap.find(key);
+  if (it != entryMap.end()) {
+    entries.erase(it->second);
+    entryMap.erase(it);
+  }
+  
+  entries.emplace_front();
+  Entry& entry = entries.front();
+  entry.key = key;
+  entry.htmlString = htmlString;
+  entry.helpUrl = helpUrl;
+  entryMap[key] = entries.begin();
+  
+  while (entries.size() > maxSize) {
+    entryMap.erase(entries.back().key);
+    entries.pop_back();
+  }
+}
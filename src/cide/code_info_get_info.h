@@ -4,7 +4,55 @@
 
 #pragma once
 
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <QUrl>
+
 #include "cide/code_info.h"
+#include "cide/util.h"
+
+/// LRU cache for the info HTML (and help URL) that GetInfoOperation renders
+/// for a cursor's definition. The keys contain the TU's parse stamp, so
+/// entries are no longer used once the TU has been reparsed. Hovering the
+/// same symbol repeatedly thus does not render the info again, which in
+/// particular avoids listing the members of classes each time.
+/// 
+/// This class is thread-safe.
+class GetInfoCache {
+ public:
+  /// Constructs a cache that holds at most @p maxSize entries.
+  explicit GetInfoCache(int maxSize);
+  
+  static GetInfoCache& Instance();
+  
+  /// If there is an entry for @p key, marks it as the most recently used one,
+  /// returns its content in @p htmlString and @p helpUrl, and returns true.
+  /// Otherwise, returns false.
+  bool Lookup(const QString& key, QString* htmlString, QUrl* helpUrl);
+  
+  /// Adds an entry (or replaces an existing one) as the most recently used
+  /// one. If the cache is full, the least recently used entry is removed.
+  void Insert(const QString& key, const QString& htmlString, const QUrl& helpUrl);
+  
+ private:
+  struct Entry {
+    QString key;
+    QString htmlString;
+    QUrl helpUrl;
+  };
+  
+  int maxSize;
+  
+  /// Ordered from the most recently to the least recently used entry.
+  std::list<Entry> entries;
+  
+  /// Maps key --> entry in entries.
+  std::unordered_map<QString, std::list<Entry>::iterator> entryMap;
+  
+  std::mutex mutex;
+};
 
 struct GetInfoOperation : public TUOperationBase {
   // The information that we hope to gather
@@ -5,6 +5,7 @@
 #include "cide/code_info_get_right_click_info.h"
 
 #include "cide/clang_utils.h"
+#include "cide/code_info_cursor_facts.h"
 #include "cide/main_window.h"
 #include "cide/clang_parser.h"
 #include "cide/qt_help.h"
@@ -24,72 +25,18 @@ GetRightClickInfoOperation::Result GetRightClickInfoOperation::OperateOnTU(
   clickedTokenSpellingRange = clang_getNullRange();
   cursorHasLocalDefinition = false;
   
-  // Try to get a cursor for the given source location
-  CXFile clangFile = clang_getFile(TU->TU(), canonicalFilePath.toUtf8().data());
-  if (clangFile == nullptr) {
-    qDebug() << "Warning: GetInfo(): Cannot get the CXFile for" << canonicalFilePath << "in the TU.";
+  // Get information about the cursor at the given source location. This
+  // likely has been cached already by the hover info for the same location.
+  CursorFacts facts;
+  if (!GetCursorFacts(TU, canonicalFilePath, invocationLine, invocationCol, &facts)) {
     return Result::TUHasNotBeenReparsed;
   }
   
-  CXSourceLocation requestLocation = clang_getLocation(TU->TU(), clangFile, invocationLine + 1, invocationCol + 1);
-  CXCursor cursor = clang_getCursor(TU->TU(), requestLocation);
-  if (clang_Cursor_isNull(cursor)) {
-    return Result::TUHasNotBeenReparsed;
-  }
-  
-  // Find the token at the given source location
-  unsigned invocationOffset;
-  clang_getSpellingLocation(requestLocation, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &invocationOffset);
-  
-  CXToken* tokens;
-  unsigned numTokens;
-  clang_tokenize(TU->TU(), clang_getCursorExtent(cursor), &tokens, &numTokens);
-  for (int tokenIndex = 0; tokenIndex < numTokens; ++ tokenIndex) {
-    CXSourceRange tokenRange = clang_getTokenExtent(TU->TU(), tokens[tokenIndex]);
-    
-    CXSourceLocation start = clang_getRangeStart(tokenRange);
-    unsigned startOffset;
-    clang_getSpellingLocation(start, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &startOffset);
-    if (startOffset > invocationOffset) {
-      continue;
-    }
-    
-    CXSourceLocation end = clang_getRangeEnd(tokenRange);
-    unsigned endOffset;
-    clang_getSpellingLocation(end, /*file*/ nullptr, /*line*/ nullptr, /*column*/ nullptr, &endOffset);
-    if (endOffset <= invocationOffset) {
-      continue;
-    }
-    
-    // Found the token under the cursor.
-    clickedTokenSpelling = ClangString(clang_getTokenSpelling(TU->TU(), tokens[tokenIndex])).ToQString();
-    clickedTokenSpellingRange = tokenRange;
-    
-    break;
-  }
-  clang_disposeTokens(TU->TU(), tokens, numTokens);
-  
-  
-  // --- Get information about the cursor ---
-  clickedCursorSpelling = ClangString(clang_getCursorSpelling(cursor)).ToQString();
-  
-  CXCursor referencedCursor = clang_getCursorReferenced(cursor);
-  if (!clang_Cursor_isNull(referencedCursor)) {
-    clickedCursorUSR = ClangString(clang_getCursorUSR(referencedCursor)).ToQString();
-  }
-  
-  // Check whether the cursor's definition is within a function body.
-  CXCursor definition = clang_getCursorDefinition(cursor);
-  if (!clang_Cursor_isNull(definition)) {
-    CXCursor definitionParent = clang_getCursorSemanticParent(definition);
-    while (!clang_Cursor_isNull(definitionParent)) {
-      if (IsFunctionDeclLikeCursorKind(clang_getCursorKind(definitionParent))) {
-        cursorHasLocalDefinition = true;
-        break;
-      }
-      definitionParent = clang_getCursorSemanticParent(definitionParent);
-    }
-  }
+  clickedTokenSpelling = facts.tokenSpelling;
+  clickedTokenSpellingRange = facts.tokenRange;
+  clickedCursorSpelling = facts.spelling;
+  clickedCursorUSR = QString::fromUtf8(facts.referencedUSR);
+  cursorHasLocalDefinition = facts.hasLocalDefinition;
   
   // qDebug() << "-- right click: --";
   // qDebug() << "clickedCursorUSR: " << clickedCursorUSR;
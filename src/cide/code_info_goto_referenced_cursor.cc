@@ -4,10 +4,128 @@
 
 #include "cide/code_info_goto_referenced_cursor.h"
 
+#include <algorithm>
+
+#include <QFileInfo>
+
 #include "cide/clang_utils.h"
+#include "cide/code_info_cursor_facts.h"
 #include "cide/main_window.h"
 #include "cide/clang_parser.h"
 #include "cide/qt_thread.h"
+#include "cide/text_utils.h"
+
+/// The identifier at a location in a document together with the tokens around
+/// it, as far as they are relevant for guessing what the identifier refers to
+/// without a TU.
+struct IdentifierAtLocation {
+  QString name;
+  
+  /// If the identifier is qualified (as in "qualifier::name"), the last
+  /// component of the qualifier. Empty otherwise.
+  QString qualifier;
+  
+  /// Whether the identifier is followed by "(", respectively by "::".
+  bool followedByParenthesis = false;
+  bool followedByScope = false;
+  
+  /// Whether the identifier follows "." or "->".
+  bool isMemberAccess = false;
+  
+  /// Start of the identifier.
+  DocumentLocation start;
+};
+
+/// Number of characters before and after the invocation location that are
+/// considered by GetIdentifierAtLocation().
+constexpr int kIdentifierContextSize = 256;
+
+/// Reads the identifier that contains (or ends at) @p location in @p document,
+/// together with the tokens around it. Returns false if there is no
+/// identifier.
+static bool GetIdentifierAtLocation(Document* document, const DocumentLocation& location, IdentifierAtLocation* result) {
+  int textStart = std::max(0, location.offset - kIdentifierContextSize);
+  int textEnd = std::min(document->FullDocumentRange().end.offset, location.offset + kIdentifierContextSize);
+  QString text = document->TextForRange(DocumentRange(textStart, textEnd));
+  
+  int pos = location.offset - textStart;
+  if (pos >= text.size() || !IsIdentifierChar(text[pos])) {
+    -- pos;
+  }
+  if (pos < 0 || pos >= text.size() || !IsIdentifierChar(text[pos])) {
+    return false;
+  }
+  
+  int nameStart = pos;
+  while (nameStart > 0 && IsIdentifierChar(text[nameStart - 1])) {
+    -- nameStart;
+  }
+  int nameEnd = pos + 1;
+  while (nameEnd < text.size() && IsIdentifierChar(text[nameEnd])) {
+    ++ nameEnd;
+  }
+  if (text[nameStart].isDigit()) {
+    return false;
+  }
+  result->name = text.mid(nameStart, nameEnd - nameStart);
+  result->start = textStart + nameStart;
+  
+  // Look at the tokens after the identifier.
+  int after = nameEnd;
+  while (after < text.size() && IsWhitespace(text[after])) {
+    ++ after;
+  }
+  result->followedByParenthesis = after < text.size() && text[after] == '(';
+  result->followedByScope = text.midRef(after, 2) == QStringLiteral("::");
+  
+  // Look at the tokens before the identifier.
+  int before = nameStart;
+  while (before > 0 && IsWhitespace(text[before - 1])) {
+    -- before;
+  }
+  result->isMemberAccess =
+      (before >= 1 && text[before - 1] == '.') ||
+      (before >= 2 && text.midRef(before - 2, 2) == QStringLiteral("->"));
+  if (before >= 2 && text.midRef(before - 2, 2) == QStringLiteral("::")) {
+    int qualifierEnd = before - 2;
+    while (qualifierEnd > 0 && IsWhitespace(text[qualifierEnd - 1])) {
+      -- qualifierEnd;
+    }
+    int qualifierStart = qualifierEnd;
+    while (qualifierStart > 0 && IsIdentifierChar(text[qualifierStart - 1])) {
+      -- qualifierStart;
+    }
+    result->qualifier = text.mid(qualifierStart, qualifierEnd - qualifierStart);
+  }
+  return true;
+}
+
+/// Rates how well the declaration @p decl in file @p path fits the usage of
+/// @p identifier in @p currentPath. Higher is better.
+static int RateDeclForIdentifier(const IdentifierAtLocation& identifier, const QString& currentPath, const QString& path, const USRDecl& decl) {
+  // Does the kind of the declaration fit the tokens around the identifier?
+  bool kindFits;
+  if (identifier.followedByScope) {
+    kindFits = IsClassDeclLikeCursorKind(decl.kind) || decl.kind == CXCursor_Namespace;
+  } else if (identifier.followedByParenthesis) {
+    kindFits = IsFunctionDeclLikeCursorKind(decl.kind) || IsClassDeclLikeCursorKind(decl.kind);
+  } else if (identifier.isMemberAccess) {
+    kindFits = decl.kind == CXCursor_FieldDecl || decl.kind == CXCursor_CXXMethod;
+  } else {
+    kindFits = !IsFunctionDeclLikeCursorKind(decl.kind);
+  }
+  
+  // Is the declaration's spelling qualified with the same qualifier?
+  bool qualifierFits =
+      !identifier.qualifier.isEmpty() &&
+      decl.namePos >= identifier.qualifier.size() + 2 &&
+      decl.spelling.midRef(decl.namePos - identifier.qualifier.size() - 2, identifier.qualifier.size() + 2) == identifier.qualifier + QStringLiteral("::");
+  
+  return (kindFits ? 8 : 0) +
+         (qualifierFits ? 4 : 0) +
+         (decl.isDefinition ? 2 : 0) +
+         ((path == currentPath) ? 1 : 0);
+}
 
 void GotoReferencedCursorOperation::SetJumpLocation(CXSourceLocation location) {
   CXFile cursorFile;
@@ -30,27 +148,30 @@ GotoReferencedCursorOperation::Result GotoReferencedCursorOperation::OperateOnTU
     std::vector<CXUnsavedFile>& /*unsavedFiles*/) {
   constexpr bool kDebug = false;
   
-  // Try to get a cursor for the given source location
-  CXFile clangFile = clang_getFile(TU->TU(), canonicalFilePath.toUtf8().data());
-  if (clangFile == nullptr) {
-    qDebug() << "Warning: GetInfo(): Cannot get the CXFile for" << canonicalFilePath << "in the TU.";
-    return Result::TUHasNotBeenReparsed;
-  }
-  
-  CXSourceLocation requestLocation = clang_getLocation(TU->TU(), clangFile, invocationLine + 1, invocationCol + 1);
-  CXCursor cursor = clang_getCursor(TU->TU(), requestLocation);
-  if (clang_Cursor_isNull(cursor)) {
+  // Get information about the cursor at the given source location. This
+  // likely has been cached already by the hover info for the same location.
+  CursorFacts facts;
+  if (!GetCursorFacts(TU, canonicalFilePath, invocationLine, invocationCol, &facts)) {
     return Result::TUHasNotBeenReparsed;
   }
   
   if (kDebug) {
     qDebug() << "--- Ctrl-Click jump ---";
-    qDebug() << "Cursor spelling:" << ClangString(clang_getCursorSpelling(cursor)).ToQString();
+    qDebug() << "Cursor spelling:" << facts.spelling;
+  }
+  
+  // The cursor itself is only needed for inclusion directives and for break
+  // and continue statements.
+  CXCursorKind kind = facts.kind;
+  CXCursor cursor = clang_getNullCursor();
+  if (kind == CXCursor_InclusionDirective || kind == CXCursor_ContinueStmt || kind == CXCursor_BreakStmt) {
+    if (!GetCursorFacts(TU, canonicalFilePath, invocationLine, invocationCol, &facts, &cursor)) {
+      return Result::TUHasNotBeenReparsed;
+    }
   }
   
   // Check whether we have an inclusion directive.
   // TODO: Unfortunately, it seems that for system includes, libclang yields a "NoDeclFound" cursor, making this fail.
-  CXCursorKind kind = clang_getCursorKind(cursor);
   if (kind == CXCursor_InclusionDirective) {
     CXFile includedFile = clang_getIncludedFile(cursor);
     jumpUrl = QStringLiteral("file://") + GetClangFilePath(includedFile);
@@ -74,8 +195,7 @@ GotoReferencedCursorOperation::Result GotoReferencedCursorOperation::OperateOnTU
   }
   
   // Check whether we can find a matching definition/declaration via USRs.
-  CXCursor referencedCursor = clang_getCursorReferenced(cursor);
-  QByteArray USR = ClangString(clang_getCursorUSR(clang_Cursor_isNull(referencedCursor) ? cursor : referencedCursor)).ToQByteArray();
+  const QByteArray& USR = facts.USR;
   if (!USR.isEmpty()) {
     if (kDebug) {
       qDebug() << "Checking USRs. The (referenced) cursor's USR is:" << USR;
@@ -100,20 +220,10 @@ GotoReferencedCursorOperation::Result GotoReferencedCursorOperation::OperateOnTU
         &foundDecls);
     
     // If the cursor points to one of the retrieved Decls, remove it from the list
-    CXSourceLocation cursorLocation = clang_getCursorLocation(cursor);
-    CXFile cursorFile;
-    unsigned cursorLine, cursorColumn;
-    clang_getFileLocation(
-        cursorLocation,
-        &cursorFile,
-        &cursorLine,
-        &cursorColumn,
-        nullptr);
-    
     for (int i = 0; i < foundDecls.size(); ++ i) {
       const auto& item = foundDecls[i];
-      if (cursorLine == item.second.line &&
-          cursorColumn == item.second.column &&
+      if (facts.line == item.second.line &&
+          facts.column == item.second.column &&
           canonicalFilePath == item.first) {
         foundDecls.erase(foundDecls.begin() + i);
         break;
@@ -144,22 +254,101 @@ GotoReferencedCursorOperation::Result GotoReferencedCursorOperation::OperateOnTU
   }
   
   // Try whether we get something from clang_getCursorReferenced()
-  if (!clang_Cursor_isNull(referencedCursor)) {
-    CXSourceLocation referencedLocation = clang_getCursorLocation(referencedCursor);
-    SetJumpLocation(referencedLocation);
+  if (facts.hasReferencedCursor) {
+    SetJumpLocation(facts.referencedLocation);
     if (kDebug) {
       qDebug() << "Jumping to clang_getCursorReferenced(). jumpUrl:" << jumpUrl;
     }
     return Result::TUHasNotBeenReparsed;
   }
   
-  qDebug() << "No jump target found (cursor kind: " << ClangString(clang_getCursorKindSpelling(clang_getCursorKind(cursor))).ToQString()
-           << " spelling:" << ClangString(clang_getCursorSpelling(cursor)).ToQString() << ").";
+  qDebug() << "No jump target found (cursor kind: " << ClangString(clang_getCursorKindSpelling(kind)).ToQString()
+           << " spelling:" << facts.spelling << ").";
   return Result::TUHasNotBeenReparsed;
 }
 
+void GotoReferencedCursorOperation::OperateWithoutTU(const CodeInfoRequest& request) {
+  IdentifierAtLocation identifier;
+  QString canonicalFilePath;
+  int identifierLine;
+  int identifierCol;
+  std::unordered_set<QString> relevantFiles;
+  bool haveIdentifier = false;
+  
+  RunInQtThreadBlocking([&]() {
+    // If the document has been closed in the meantime, we must not access its
+    // widget anymore.
+    if (request.wasCanceled) {
+      return;
+    }
+    
+    Document* document = request.widget->GetDocument().get();
+    if (!GetIdentifierAtLocation(document, request.codeCompletionInvocationLocation, &identifier) ||
+        !request.widget->MapDocumentToLayout(identifier.start, &identifierLine, &identifierCol)) {
+      return;
+    }
+    canonicalFilePath = QFileInfo(document->path()).canonicalFilePath();
+    USRStorage::Instance().GetFilesForUSRLookup(canonicalFilePath, request.widget->GetMainWindow(), &relevantFiles);
+    haveIdentifier = true;
+  });
+  if (!haveIdentifier) {
+    return;
+  }
+  
+  std::vector<std::pair<QString, USRDecl>> foundDecls;  // pair of file path and USR
+  USRStorage::Instance().LookupDeclsByName(identifier.name, relevantFiles, &foundDecls);
+  
+  // Pick the best-fitting declaration, except for the one at the invocation
+  // location itself.
+  const std::pair<QString, USRDecl>* jumpItem = nullptr;
+  int bestRating = -1;
+  for (const auto& item : foundDecls) {
+    if (item.first == canonicalFilePath &&
+        item.second.line == identifierLine + 1 &&
+        item.second.column == identifierCol + 1) {
+      continue;
+    }
+    int rating = RateDeclForIdentifier(identifier, canonicalFilePath, item.first, item.second);
+    if (rating > bestRating) {
+      bestRating = rating;
+      jumpItem = &item;
+    }
+  }
+  if (!jumpItem) {
+    return;
+  }
+  
+  QString url = QStringLiteral("file://") + jumpItem->first + QStringLiteral(":") + QString::number(jumpItem->second.line) + QStringLiteral(":") + QString::number(jumpItem->second.column);
+  RunInQtThreadBlocking([&]() {
+    if (request.wasCanceled) {
+      return;
+    }
+    
+    MainWindow* mainWindow = request.widget->GetMainWindow();
+    mainWindow->GotoDocumentLocation(url);
+    indexOnlyJumpUrl = url;
+    indexOnlyJumpWidget = mainWindow->GetCurrentDocumentWidget();
+    if (indexOnlyJumpWidget) {
+      indexOnlyJumpCursor = indexOnlyJumpWidget->MapCursorToDocument();
+    }
+  });
+}
+
 void GotoReferencedCursorOperation::FinalizeInQtThread(const CodeInfoRequest& request) {
-  if (!jumpUrl.isEmpty()) {
-    request.widget->GetMainWindow()->GotoDocumentLocation(jumpUrl);
+  if (jumpUrl.isEmpty() || jumpUrl == indexOnlyJumpUrl) {
+    return;
+  }
+  
+  MainWindow* mainWindow = request.widget->GetMainWindow();
+  if (!indexOnlyJumpUrl.isEmpty()) {
+    // Correct the jump that was done based on the index only, unless the user
+    // moved on since.
+    DocumentWidget* currentWidget = mainWindow->GetCurrentDocumentWidget();
+    if (!currentWidget ||
+        currentWidget != indexOnlyJumpWidget ||
+        currentWidget->MapCursorToDocument() != indexOnlyJumpCursor) {
+      return;
+    }
   }
+  mainWindow->GotoDocumentLocation(jumpUrl);
 }
@@ -9,8 +9,21 @@
 struct GotoReferencedCursorOperation : public TUOperationBase {
   QString jumpUrl;
   
+  /// Jump target that was found by OperateWithoutTU() and jumped to, and the
+  /// current widget and its cursor location directly after the jump. If the
+  /// jump target found with the TU differs, it is only jumped to if the user
+  /// did not move on in the meantime.
+  QString indexOnlyJumpUrl;
+  DocumentWidget* indexOnlyJumpWidget = nullptr;
+  DocumentLocation indexOnlyJumpCursor;
+  
   void SetJumpLocation(CXSourceLocation location);
   
+  /// Resolves the identifier at the invocation location via the USRStorage
+  /// only, using its name and heuristics based on the surrounding tokens, and
+  /// jumps to the result right away.
+  void OperateWithoutTU(const CodeInfoRequest& request) override;
+  
   Result OperateOnTU(
       const CodeInfoRequest& request,
       const std::shared_ptr<ClangTU>& TU,
@@ -0,0 +1,55 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/code_info_hover_prefetch.h"
+
+#include <chrono>
+
+#include "cide/code_info_cursor_facts.h"
+
+/// Maximum time that a hover prefetch spends on a TU. Prefetches run after
+/// each parse, so this bounds the time that a TU is kept away from the parser
+/// and from interactive requests.
+constexpr std::chrono::milliseconds kHoverPrefetchTimeBudget(30);
+
+HoverPrefetchOperation::HoverPrefetchOperation(const std::function<bool()>& shouldYield)
+    : shouldYield(shouldYield) {}
+
+void HoverPrefetchOperation::InitializeInQtThread(
+    const CodeInfoRequest& request,
+    const std::shared_ptr<ClangTU>& /*TU*/,
+    const QString& /*canonicalFilePath*/,
+    int /*invocationLine*/,
+    int /*invocationCol*/,
+    std::vector<CXUnsavedFile>& /*unsavedFiles*/) {
+  prefetchLineAndColumns.reserve(request.prefetchLocations.size());
+  for (const DocumentLocation& location : request.prefetchLocations) {
+    int line, column;
+    if (request.widget->MapDocumentToLayout(location, &line, &column)) {
+      prefetchLineAndColumns.emplace_back(line, column);
+    }
+  }
+}
+
+HoverPrefetchOperation::Result HoverPrefetchOperation::OperateOnTU(
+    const CodeInfoRequest& /*request*/,
+    const std::shared_ptr<ClangTU>& TU,
+    const QString& canonicalFilePath,
+    int /*invocationLine*/,
+    int /*invocationCol*/,
+    std::vector<CXUnsavedFile>& /*unsavedFiles*/) {
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + kHoverPrefetchTimeBudget;
+  
+  CursorFacts facts;
+  for (const std::pair<int, int>& lineAndColumn : prefetchLineAndColumns) {
+    if (shouldYield() || std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    GetCursorFacts(TU, canonicalFilePath, lineAndColumn.first, lineAndColumn.second, &facts);
+  }
+  
+  return Result::TUHasNotBeenReparsed;
+}
+
+void HoverPrefetchOperation::FinalizeInQtThread(const CodeInfoRequest& /*request*/) {}
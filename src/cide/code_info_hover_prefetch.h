@@ -0,0 +1,42 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <functional>
+
+#include "cide/code_info.h"
+
+/// Resolves the CursorFacts for the identifiers in request.prefetchLocations
+/// and stores them in the CursorFactsCache, such that hovering one of these
+/// identifiers afterwards does not need to look up its cursor anymore.
+struct HoverPrefetchOperation : public TUOperationBase {
+  /// @p shouldYield is called before each identifier. The prefetch stops as
+  /// soon as it returns true.
+  explicit HoverPrefetchOperation(const std::function<bool()>& shouldYield);
+  
+  void InitializeInQtThread(
+      const CodeInfoRequest& request,
+      const std::shared_ptr<ClangTU>& TU,
+      const QString& canonicalFilePath,
+      int invocationLine,
+      int invocationCol,
+      std::vector<CXUnsavedFile>& unsavedFiles) override;
+  
+  Result OperateOnTU(
+      const CodeInfoRequest& request,
+      const std::shared_ptr<ClangTU>& TU,
+      const QString& canonicalFilePath,
+      int invocationLine,
+      int invocationCol,
+      std::vector<CXUnsavedFile>& unsavedFiles) override;
+  
+  void FinalizeInQtThread(const CodeInfoRequest& request) override;
+  
+ private:
+  std::function<bool()> shouldYield;
+  
+  /// 0-based (line, column) of each location in request.prefetchLocations.
+  std::vector<std::pair<int, int>> prefetchLineAndColumns;
+};
@@ -0,0 +1,65 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/code_info_tu_catch_up.h"
+
+#include <QDebug>
+
+#include "cide/parse_thread_pool.h"
+#include "cide/profiler.h"
+
+TUCatchUpOperation::TUCatchUpOperation(const std::function<bool()>& shouldYield)
+    : shouldYield(shouldYield) {}
+
+void TUCatchUpOperation::InitializeInQtThread(
+    const CodeInfoRequest& request,
+    const std::shared_ptr<ClangTU>& /*TU*/,
+    const QString& /*canonicalFilePath*/,
+    int /*invocationLine*/,
+    int /*invocationCol*/,
+    std::vector<CXUnsavedFile>& /*unsavedFiles*/) {
+  const std::shared_ptr<Document>& document = request.widget->GetDocument();
+  
+  // If the document changed since the last parse, the parse for the change
+  // brings one of the TUs up to date anyway and schedules another catch-up.
+  skip = ParseThreadPool::Instance().DoesAParseRequestExistForDocument(document.get());
+  
+  textChangeCounter = document->textChangeCounter();
+  preambleHash = document->preambleHash();
+}
+
+TUCatchUpOperation::Result TUCatchUpOperation::OperateOnTU(
+    const CodeInfoRequest& /*request*/,
+    const std::shared_ptr<ClangTU>& TU,
+    const QString& /*canonicalFilePath*/,
+    int /*invocationLine*/,
+    int /*invocationCol*/,
+    std::vector<CXUnsavedFile>& unsavedFiles) {
+  if (skip || shouldYield()) {
+    return Result::TUHasNotBeenReparsed;
+  }
+  
+  ProfilerScope reparseScope("Catch-up reparse");
+  TU->SetReferenceMap(nullptr);
+  TU->SetImplementationCandidates(nullptr);
+  CXErrorCode result = static_cast<CXErrorCode>(clang_reparseTranslationUnit(
+      TU->TU(),
+      unsavedFiles.size(),
+      unsavedFiles.data(),
+      clang_defaultReparseOptions(TU->TU())));
+  if (result != CXError_Success) {
+    // libclang requires to dispose the TU after a failed reparse. The next
+    // regular parse then creates it from scratch.
+    qDebug() << "Catch-up reparse failed.";
+    TU->Clear();
+    return Result::TUHasNotBeenReparsed;
+  }
+  
+  TU->SetPreambleHash(preambleHash);
+  TU->SetTextChangeCounter(textChangeCounter);
+  TU->SetParsedFromFilesOnDisk(unsavedFiles.empty());
+  return Result::TUHasBeenReparsed;
+}
+
+void TUCatchUpOperation::FinalizeInQtThread(const CodeInfoRequest& /*request*/) {}
@@ -0,0 +1,54 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <functional>
+
+#include "cide/code_info.h"
+
+/// Reparses a stale TU of the document's ClangTUPool (see
+/// ClangTUPool::TakeStaleTUForCatchUp()) while the user is idle, such that a
+/// code completion or AST query that gets this TU while the most up-to-date
+/// one is in use does not see outdated code or need to reparse it first.
+///
+/// Only the TU itself is updated: the highlighting and the indexing
+/// information are left to the regular parses. In particular, the TU's list
+/// of includes is not updated, such that the next regular parse of the TU
+/// still notices include changes since its previous regular parse.
+struct TUCatchUpOperation : public TUOperationBase {
+  /// @p shouldYield is called before reparsing. The reparse is skipped if it
+  /// returns true.
+  explicit TUCatchUpOperation(const std::function<bool()>& shouldYield);
+  
+  void InitializeInQtThread(
+      const CodeInfoRequest& request,
+      const std::shared_ptr<ClangTU>& TU,
+      const QString& canonicalFilePath,
+      int invocationLine,
+      int invocationCol,
+      std::vector<CXUnsavedFile>& unsavedFiles) override;
+  
+  Result OperateOnTU(
+      const CodeInfoRequest& request,
+      const std::shared_ptr<ClangTU>& TU,
+      const QString& canonicalFilePath,
+      int invocationLine,
+      int invocationCol,
+      std::vector<CXUnsavedFile>& unsavedFiles) override;
+  
+  void FinalizeInQtThread(const CodeInfoRequest& request) override;
+  
+ private:
+  std::function<bool()> shouldYield;
+  
+  /// Whether the reparse is skipped since a regular parse of the document is
+  /// queued already.
+  bool skip = false;
+  
+  /// Document::textChangeCounter() and Document::preambleHash() of the text
+  /// that the TU is reparsed with.
+  int textChangeCounter = -1;
+  std::size_t preambleHash = 0;
+};
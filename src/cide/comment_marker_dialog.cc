@@ -0,0 +1,119 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/comment_marker_dialog.h"
+
+#include <QBoxLayout>
+#include <QDialogButtonBox>
+#include <QHeaderView>
+#include <QIcon>
+#include <QLabel>
+#include <QLineEdit>
+#include <QPushButton>
+#include <QTableWidget>
+
+#include "cide/comment_marker_index.h"
+#include "cide/main_window.h"
+#include "cide/project.h"
+
+CommentMarkerDialog::CommentMarkerDialog(MainWindow* mainWindow, QWidget* parent)
+    : QDialog(parent),
+      mainWindow(mainWindow) {
+  setWindowTitle(tr("Comment markers"));
+  setWindowIcon(QIcon(":/cide/cide.png"));
+  
+  countLabel = new QLabel();
+  
+  filterEdit = new QLineEdit();
+  filterEdit->setPlaceholderText(tr("Filter"));
+  filterEdit->setClearButtonEnabled(true);
+  connect(filterEdit, &QLineEdit::textChanged, this, &CommentMarkerDialog::UpdateMarkers);
+  
+  markerTable = new QTableWidget(0, 4);
+  markerTable->setHorizontalHeaderLabels(QStringList() << tr("File") << tr("Line") << tr("Marker") << tr("Text"));
+  markerTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+  markerTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+  markerTable->verticalHeader()->setVisible(false);
+  markerTable->horizontalHeader()->setSectionResizeMode(3, QHeaderView::Stretch);
+  connect(markerTable, &QTableWidget::itemActivated, [&](QTableWidgetItem* item) {
+    QString locationString = markerTable->item(item->row(), 0)->data(Qt::UserRole).toString();
+    if (!locationString.isEmpty()) {
+      this->mainWindow->GotoDocumentLocation(locationString);
+    }
+  });
+  
+  QPushButton* refreshButton = new QPushButton(tr("Refresh"));
+  connect(refreshButton, &QPushButton::clicked, this, &CommentMarkerDialog::UpdateMarkers);
+  
+  QDialogButtonBox* buttonBox = new QDialogButtonBox(QDialogButtonBox::Close);
+  buttonBox->addButton(refreshButton, QDialogButtonBox::ResetRole);
+  connect(buttonBox, &QDialogButtonBox::rejected, this, &QDialog::reject);
+  
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->addWidget(filterEdit);
+  layout->addWidget(markerTable);
+  layout->addWidget(countLabel);
+  layout->addWidget(buttonBox);
+  setLayout(layout);
+  
+  resize(1000, 600);
+  
+  UpdateMarkers();
+}
+
+void CommentMarkerDialog::UpdateMarkers() {
+  std::vector<std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>> files;
+  CommentMarkerIndex::Instance().GetAllMarkers(&files);
+  
+  // Only list the files of the open projects, not for example the system
+  // headers that they include.
+  std::vector<QString> projectDirs;
+  for (const std::shared_ptr<Project>& project : mainWindow->GetProjects()) {
+    projectDirs.push_back(project->GetDir() + QLatin1Char('/'));
+  }
+  auto isProjectFile = [&](const QString& canonicalPath) {
+    for (const QString& dir : projectDirs) {
+      if (canonicalPath.startsWith(dir)) {
+        return true;
+      }
+    }
+    for (const std::shared_ptr<Project>& project : mainWindow->GetProjects()) {
+      if (project->ContainsFile(canonicalPath)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  
+  QString filter = filterEdit->text();
+  
+  markerTable->setRowCount(0);
+  int row = 0;
+  for (const auto& file : files) {
+    if (!isProjectFile(file.first)) {
+      continue;
+    }
+    for (const CommentMarker& marker : *file.second) {
+      if (!filter.isEmpty() &&
+          !marker.text.contains(filter, Qt::CaseInsensitive) &&
+          !marker.marker.contains(filter, Qt::CaseInsensitive) &&
+          !file.first.contains(filter, Qt::CaseInsensitive)) {
+        continue;
+      }
+      
+      markerTable->insertRow(row);
+      QTableWidgetItem* fileItem = new QTableWidgetItem(file.first);
+      fileItem->setData(Qt::UserRole, QStringLiteral("file://%1:%2:%3").arg(file.first).arg(marker.line + 1).arg(marker.column + 1));
+      markerTable->setItem(row, 0, fileItem);
+      QTableWidgetItem* lineItem = new QTableWidgetItem();
+      lineItem->setData(Qt::DisplayRole, marker.line + 1);
+      markerTable->setItem(row, 1, lineItem);
+      markerTable->setItem(row, 2, new QTableWidgetItem(marker.marker));
+      markerTable->setItem(row, 3, new QTableWidgetItem(marker.text));
+      ++ row;
+    }
+  }
+  
+  countLabel->setText(tr("%1 markers in the indexed files").arg(row));
+}
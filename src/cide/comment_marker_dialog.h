@@ -0,0 +1,31 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QDialog>
+
+class MainWindow;
+class QLabel;
+class QLineEdit;
+class QTableWidget;
+
+/// Lists the comment markers (such as "TODO", see CommentMarkerIndex) in the
+/// files of the open projects. The list is taken from the index, so it only
+/// contains files that have been indexed. Activating a row jumps to the marker.
+class CommentMarkerDialog : public QDialog {
+ Q_OBJECT
+ public:
+  CommentMarkerDialog(MainWindow* mainWindow, QWidget* parent = nullptr);
+  
+ public slots:
+  void UpdateMarkers();
+  
+ private:
+  MainWindow* mainWindow;
+  
+  QLabel* countLabel;
+  QLineEdit* filterEdit;
+  QTableWidget* markerTable;
+};
@@ -0,0 +1,258 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/comment_marker_index.h"
+
+#include <algorithm>
+
+#include <QFile>
+
+#include "cide/settings.h"
+#include "cide/text_utils.h"
+
+/// Files that are larger than this are not scanned for comment markers.
+constexpr qint64 kMaxScannedFileSize = 16 * 1024 * 1024;
+
+/// Maximum number of bytes of the comment text after a marker that is stored.
+constexpr int kMaxMarkerTextSize = 200;
+
+/// Maximum length of the delimiter of a raw string literal.
+constexpr int kMaxRawStringDelimiterSize = 16;
+
+/// Returns GetCharType() for a byte of UTF-8 encoded text. Non-ASCII bytes are
+/// parts of multi-byte characters, which are treated as letters.
+static inline int GetByteCharType(char c) {
+  if (static_cast<unsigned char>(c) >= 0x80) {
+    return static_cast<int>(CharacterType::Letter);
+  }
+  return GetCharType(QChar::fromLatin1(c));
+}
+
+static inline bool IsHexDigit(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+CommentMarkerIndex& CommentMarkerIndex::Instance() {
+  static CommentMarkerIndex instance;
+  return instance;
+}
+
+void CommentMarkerIndex::UpdateFiles(const std::vector<std::pair<QString, qint64>>& files, const CommentMarkerSet* knownMarkers, CommentMarkerSet* markers) {
+  QStringList currentMarkers = Settings::Instance().GetCommentMarkers();
+  bool useKnownMarkers = knownMarkers && knownMarkers->markerWords == currentMarkers;
+  if (markers) {
+    markers->markerWords = currentMarkers;
+    markers->files.clear();
+  }
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  CheckMarkerWords(currentMarkers);
+  
+  for (const std::pair<QString, qint64>& file : files) {
+    std::shared_ptr<const std::vector<CommentMarker>> fileMarkers;
+    
+    auto it = this->files.find(file.first);
+    if (it != this->files.end() && it->second.lastModificationTime == file.second) {
+      fileMarkers = it->second.markers;
+    } else {
+      if (useKnownMarkers) {
+        auto knownIt = knownMarkers->files.find(file.first);
+        if (knownIt != knownMarkers->files.end() && !knownIt->second.empty()) {
+          fileMarkers.reset(new std::vector<CommentMarker>(knownIt->second));
+        }
+      } else {
+        // Do not block other threads while reading the file.
+        lock.unlock();
+        std::vector<CommentMarker> scannedMarkers;
+        QFile qfile(file.first);
+        if (qfile.size() <= kMaxScannedFileSize && qfile.open(QIODevice::ReadOnly)) {
+          FindCommentMarkers(qfile.readAll(), currentMarkers, &scannedMarkers);
+        }
+        if (!scannedMarkers.empty()) {
+          fileMarkers.reset(new std::vector<CommentMarker>(std::move(scannedMarkers)));
+        }
+        lock.lock();
+      }
+      
+      // Only store the result if the marker words did not change in the
+      // meantime.
+      if (markerWords == currentMarkers) {
+        IndexedFile& indexedFile = this->files[file.first];
+        indexedFile.lastModificationTime = file.second;
+        indexedFile.markers = fileMarkers;
+      }
+    }
+    
+    if (markers && fileMarkers) {
+      markers->files[file.first] = *fileMarkers;
+    }
+  }
+}
+
+void CommentMarkerIndex::GetAllMarkers(std::vector<std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>>* files) {
+  files->clear();
+  
+  mutex.lock();
+  for (const auto& item : this->files) {
+    if (item.second.markers) {
+      files->emplace_back(item.first, item.second.markers);
+    }
+  }
+  mutex.unlock();
+  
+  std::sort(files->begin(), files->end(), [](const std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>& a,
+                                              const std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>& b) {
+    return a.first < b.first;
+  });
+}
+
+void CommentMarkerIndex::FindCommentMarkers(const QByteArray& text, const QStringList& markers, std::vector<CommentMarker>* result) {
+  std::vector<QByteArray> utf8Markers;
+  std::vector<QString> markerStrings;
+  for (const QString& marker : markers) {
+    if (!marker.isEmpty()) {
+      utf8Markers.push_back(marker.toUtf8());
+      markerStrings.push_back(marker);
+    }
+  }
+  if (utf8Markers.empty()) {
+    return;
+  }
+  
+  const char* data = text.constData();
+  const int size = text.size();
+  
+  // The line of the offset lineCountOffset, and the offset of its start.
+  int line = 0;
+  int lineStart = 0;
+  int lineCountOffset = 0;
+  auto advanceLineCountTo = [&](int offset) {
+    for (; lineCountOffset < offset; ++ lineCountOffset) {
+      if (data[lineCountOffset] == '\n') {
+        ++ line;
+        lineStart = lineCountOffset + 1;
+      }
+    }
+  };
+  
+  // Pairs of offset and index in utf8Markers.
+  std::vector<std::pair<int, int>> matches;
+  
+  auto searchComment = [&](int commentStart, int commentEnd) {
+    matches.clear();
+    QByteArray comment = QByteArray::fromRawData(data + commentStart, commentEnd - commentStart);
+    for (int m = 0; m < utf8Markers.size(); ++ m) {
+      const QByteArray& marker = utf8Markers[m];
+      int pos = 0;
+      while (true) {
+        pos = comment.indexOf(marker, pos);
+        if (pos < 0) {
+          break;
+        }
+        
+        int end = pos + marker.size();
+        if (pos > 0 && GetByteCharType(comment[pos - 1]) == GetByteCharType(marker[0])) {
+          // Skip this occurrence.
+        } else if (end < comment.size() && GetByteCharType(comment[end - 1]) == GetByteCharType(comment[end])) {
+          // Skip this occurrence.
+        } else {
+          matches.emplace_back(commentStart + pos, m);
+        }
+        
+        pos = end;
+      }
+    }
+    std::sort(matches.begin(), matches.end());
+    
+    for (const std::pair<int, int>& match : matches) {
+      advanceLineCountTo(match.first);
+      
+      int textStart = match.first + utf8Markers[match.second].size();
+      int textEnd = textStart;
+      while (textEnd < commentEnd && data[textEnd] != '\n' && textEnd - textStart < kMaxMarkerTextSize) {
+        ++ textEnd;
+      }
+      // Do not cut off the text within a multi-byte character.
+      while (textEnd > textStart && textEnd < commentEnd && (data[textEnd] & 0xC0) == 0x80) {
+        -- textEnd;
+      }
+      
+      CommentMarker marker;
+      marker.line = line;
+      marker.column = QString::fromUtf8(data + lineStart, match.first - lineStart).size();
+      marker.marker = markerStrings[match.second];
+      marker.text = QString::fromUtf8(data + textStart, textEnd - textStart).trimmed();
+      if (marker.text.startsWith(QLatin1Char(':'))) {
+        marker.text = marker.text.mid(1).trimmed();
+      }
+      result->push_back(marker);
+    }
+  };
+  
+  // Skips over a string or character literal that starts at the given offset,
+  // which must contain its opening quote. Literals end at the line end at the
+  // latest, which limits the effect of misinterpreting a quote character.
+  auto skipLiteral = [&](int offset) {
+    char quote = data[offset];
+    ++ offset;
+    while (offset < size && data[offset] != quote && data[offset] != '\n') {
+      if (data[offset] == '\\') {
+        ++ offset;
+      }
+      ++ offset;
+    }
+    return std::min(size, offset + 1);
+  };
+  
+  int i = 0;
+  while (i < size) {
+    char c = data[i];
+    if (c == '/' && i + 1 < size && data[i + 1] == '/') {
+      int commentEnd = i + 2;
+      while (commentEnd < size && data[commentEnd] != '\n') {
+        ++ commentEnd;
+      }
+      searchComment(i + 2, commentEnd);
+      i = commentEnd;
+    } else if (c == '/' && i + 1 < size && data[i + 1] == '*') {
+      int commentEnd = i + 2;
+      while (commentEnd + 1 < size && !(data[commentEnd] == '*' && data[commentEnd + 1] == '/')) {
+        ++ commentEnd;
+      }
+      if (commentEnd + 1 >= size) {
+        commentEnd = size;
+      }
+      searchComment(i + 2, commentEnd);
+      i = std::min(size, commentEnd + 2);
+    } else if (c == '"' && i > 0 && data[i - 1] == 'R') {
+      // Raw string literal: R"delimiter( ... )delimiter"
+      int parenthesis = i + 1;
+      while (parenthesis < size && parenthesis - i - 1 <= kMaxRawStringDelimiterSize &&
+             data[parenthesis] != '(' && data[parenthesis] != '"' && data[parenthesis] != '\n') {
+        ++ parenthesis;
+      }
+      if (parenthesis < size && data[parenthesis] == '(') {
+        QByteArray terminator = ")" + QByteArray(data + i + 1, parenthesis - i - 1) + "\"";
+        int end = text.indexOf(terminator, parenthesis + 1);
+        i = (end < 0) ? size : (end + terminator.size());
+      } else {
+        i = skipLiteral(i);
+      }
+    } else if (c == '"') {
+      i = skipLiteral(i);
+    } else if (c == '\'' && !(i > 0 && IsHexDigit(data[i - 1]))) {
+      // Quotes after digits are digit separators (as in 1'000'000).
+      i = skipLiteral(i);
+    } else {
+      ++ i;
+    }
+  }
+}
+
+void CommentMarkerIndex::CheckMarkerWords(const QStringList& currentMarkers) {
+  if (markerWords != currentMarkers) {
+    files.clear();
+    markerWords = currentMarkers;
+  }
+}
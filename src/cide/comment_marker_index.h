@@ -0,0 +1,97 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+/// An occurrence of a comment marker word (such as "TODO", see
+/// Settings::GetCommentMarkers()) in a comment.
+struct CommentMarker {
+  /// Zero-based line and column (in UTF-16 code units) of the marker.
+  int line;
+  int column;
+  
+  /// The marker word.
+  QString marker;
+  
+  /// The remainder of the comment line after the marker, trimmed.
+  QString text;
+};
+
+/// The comment markers in a set of files, together with the marker words that
+/// were searched for.
+struct CommentMarkerSet {
+  QStringList markerWords;
+  
+  /// Maps canonical file paths to their markers. Files without markers are
+  /// omitted.
+  std::unordered_map<QString, std::vector<CommentMarker>> files;
+};
+
+/// Stores the comment markers of all files that were seen while indexing,
+/// such that a list of all markers in the project can be shown without
+/// searching through the files. The markers are found with a lexical pass over
+/// each file (see FindCommentMarkers()) that is only repeated if the file's
+/// modification time changed. They are also stored in the USRIndexCache, such
+/// that TUs that are indexed from the cache do not need to read their files.
+///
+/// This class is thread-safe.
+class CommentMarkerIndex {
+ public:
+  static CommentMarkerIndex& Instance();
+  
+  /// Updates the markers of the given files (pairs of canonical path and last
+  /// modification time). Files whose modification time changed since they
+  /// were stored are scanned for the currently configured comment markers.
+  /// If @p knownMarkers is non-null and was found for the current marker
+  /// words, it must contain the markers of all of @p files (for example, as
+  /// loaded from the USRIndexCache), and it is used instead of scanning. If
+  /// @p markers is non-null, the markers of @p files are returned in it.
+  void UpdateFiles(const std::vector<std::pair<QString, qint64>>& files, const CommentMarkerSet* knownMarkers, CommentMarkerSet* markers);
+  
+  /// Returns the markers of all files that have markers, as pairs of canonical
+  /// path and markers (sorted by position). The returned lists are never
+  /// modified (updates replace them).
+  void GetAllMarkers(std::vector<std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>>* files);
+  
+  /// Finds the occurrences of the given @p markers within the comments of the
+  /// given UTF-8 encoded C/C++ source text and appends them to @p result,
+  /// sorted by position. Like for highlighting the markers, only whole-word
+  /// occurrences are reported. This is a cheap lexical pass that only tracks
+  /// comments, string and character literals, so it does not need a TU.
+  static void FindCommentMarkers(const QByteArray& text, const QStringList& markers, std::vector<CommentMarker>* result);
+  
+ private:
+  struct IndexedFile {
+    qint64 lastModificationTime;
+    
+    /// Null if the file has no markers.
+    std::shared_ptr<const std::vector<CommentMarker>> markers;
+  };
+  
+  CommentMarkerIndex() = default;
+  
+  /// If the configured comment markers changed, drops all stored files, since
+  /// they were scanned for other markers. mutex must be locked.
+  void CheckMarkerWords(const QStringList& currentMarkers);
+  
+  
+  /// Protects the attributes below.
+  std::mutex mutex;
+  
+  /// Maps canonical file paths to their markers.
+  std::unordered_map<QString, IndexedFile> files;
+  
+  /// The comment markers that the files were scanned for.
+  QStringList markerWords;
+};
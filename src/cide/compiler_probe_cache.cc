@@ -0,0 +1,128 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/compiler_probe_cache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+/// Identifies the cache file format. Must be increased whenever the format
+/// changes, such that existing cache files are discarded.
+constexpr quint32 kCompilerProbeCacheMagic = 0x43505243;  // "CPRC"
+constexpr quint32 kCompilerProbeCacheVersion = 1;
+
+CompilerProbeCache& CompilerProbeCache::Instance() {
+  static CompilerProbeCache instance;
+  return instance;
+}
+
+bool CompilerProbeCache::Load(const QString& compiler, const QStringList& arguments, Entry* entry) {
+  QByteArray key;
+  if (!GetKey(compiler, arguments, &key)) {
+    return false;
+  }
+  
+  QFile file(GetCacheFilePath(key));
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  quint32 magic;
+  quint32 version;
+  QByteArray storedKey;
+  stream >> magic >> version;
+  if (magic != kCompilerProbeCacheMagic || version != kCompilerProbeCacheVersion) {
+    return false;
+  }
+  stream >> storedKey;
+  if (storedKey != key) {
+    return false;
+  }
+  
+  stream >> entry->standardOutput >> entry->standardError;
+  return stream.status() == QDataStream::Ok;
+}
+
+bool CompilerProbeCache::Save(const QString& compiler, const QStringList& arguments, const Entry& entry) {
+  QByteArray key;
+  if (!GetKey(compiler, arguments, &key)) {
+    return false;
+  }
+  
+  QDir cacheQDir(cacheDir);
+  if (!cacheQDir.exists()) {
+    cacheQDir.mkpath(".");
+  }
+  
+  QSaveFile file(GetCacheFilePath(key));
+  if (!file.open(QIODevice::WriteOnly)) {
+    qDebug() << "Error: Cannot write compiler probe cache file:" << file.fileName();
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  stream << kCompilerProbeCacheMagic << kCompilerProbeCacheVersion;
+  stream << key;
+  stream << entry.standardOutput << entry.standardError;
+  
+  if (stream.status() != QDataStream::Ok) {
+    file.cancelWriting();
+    return false;
+  }
+  return file.commit();
+}
+
+CompilerProbeCache::CompilerProbeCache() {
+  QString cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir dir(cachePath);
+  dir = dir.filePath("compiler_probes");
+  dir.mkpath(".");
+  cacheDir = dir.path();
+}
+
+bool CompilerProbeCache::GetKey(const QString& compiler, const QStringList& arguments, QByteArray* key) {
+  // Resolve compilers that are given without a path in the same way as
+  // QProcess does, and follow symlinks (such as /usr/bin/c++), such that
+  // changing the actual executable invalidates the entry.
+  QString executablePath = compiler;
+  if (!compiler.contains('/') && !compiler.contains('\\')) {
+    executablePath = QStandardPaths::findExecutable(compiler);
+  }
+  QFileInfo executableInfo(executablePath);
+  QString canonicalPath = executableInfo.canonicalFilePath();
+  if (canonicalPath.isEmpty()) {
+    return false;
+  }
+  QFileInfo canonicalInfo(canonicalPath);
+  
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(compiler.toUtf8());
+  hash.addData("\0", 1);
+  hash.addData(canonicalPath.toUtf8());
+  hash.addData("\0", 1);
+  hash.addData(QByteArray::number(canonicalInfo.size()));
+  hash.addData("\0", 1);
+  hash.addData(QByteArray::number(canonicalInfo.lastModified().toMSecsSinceEpoch()));
+  for (const QString& argument : arguments) {
+    hash.addData("\0", 1);
+    hash.addData(argument.toUtf8());
+  }
+  *key = hash.result();
+  return true;
+}
+
+QString CompilerProbeCache::GetCacheFilePath(const QByteArray& key) const {
+  return QDir(cacheDir).filePath(QString::fromLatin1(key.toHex()));
+}
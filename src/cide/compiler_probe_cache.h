@@ -0,0 +1,53 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+/// Stores the output of compiler invocations that query the compiler's
+/// defaults (such as its default include directories or its resource
+/// directory) on disk. These queries are made on each configuration of a
+/// project, and running the compiler may take seconds (for example, for
+/// toolchains on network drives), while its output only changes if the
+/// compiler changes.
+/// 
+/// An entry is identified by the compiler path and the arguments. It is only
+/// valid if the compiler executable still has the same size and modification
+/// time as when the entry was created.
+/// 
+/// This class is thread-safe (each cache file is written atomically).
+class CompilerProbeCache {
+ public:
+  struct Entry {
+    QByteArray standardOutput;
+    QByteArray standardError;
+  };
+  
+  static CompilerProbeCache& Instance();
+  
+  /// Tries to load the cached output of running @p compiler with
+  /// @p arguments. Returns true if a valid entry was found.
+  bool Load(const QString& compiler, const QStringList& arguments, Entry* entry);
+  
+  /// Stores the output of running @p compiler with @p arguments, which should
+  /// only be done if the compiler ran successfully. Returns true on success,
+  /// false otherwise (for example, if the compiler executable cannot be found).
+  bool Save(const QString& compiler, const QStringList& arguments, const Entry& entry);
+  
+ private:
+  CompilerProbeCache();
+  
+  /// Determines the cache key for running @p compiler with @p arguments, which
+  /// includes the compiler executable's path, size, and modification time.
+  /// Returns false if the compiler executable cannot be found.
+  static bool GetKey(const QString& compiler, const QStringList& arguments, QByteArray* key);
+  
+  QString GetCacheFilePath(const QByteArray& key) const;
+  
+  
+  QString cacheDir;
+};
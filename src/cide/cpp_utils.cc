@@ -4,6 +4,8 @@
 
 #include "cide/cpp_utils.h"
 
+#include <algorithm>
+
 #include <QDir>
 #include <QFileInfo>
 
@@ -77,65 +79,79 @@ bool GuessIsHeader(const QString& path, bool* certain) {
   return isHeader;
 }
 
+/// Decides for one of the @p candidates for the corresponding header or
+/// source of a file: the first candidate that differs from the file in being
+/// a header or not, or the last candidate if all are of the same kind.
+static QString ChooseCorrespondingCandidate(const std::vector<QString>& candidates, bool isHeader) {
+  QString bestCandidate;
+  for (const QString& candidate : candidates) {
+    bestCandidate = candidate;
+    if (GuessIsHeader(candidate, nullptr) != isHeader) {
+      break;
+    }
+  }
+  return bestCandidate;
+}
+
 QString FindCorrespondingHeaderOrSource(const QString& path, const std::vector<std::shared_ptr<Project>>& projects) {
   QFileInfo thisFileInfo = QFileInfo(path);
-  QString canonicalPath = thisFileInfo.canonicalFilePath();
   QString baseName = thisFileInfo.completeBaseName();
   QString extension = thisFileInfo.suffix();
+  QString dirPath = thisFileInfo.path();
   
   bool isHeader = GuessIsHeader(path, nullptr);
   
-  // Look for other files with the same base name in the same directory.
-  QDir dir = QFileInfo(path).dir();
-  QStringList fileList = dir.entryList(QDir::Files | QDir::NoDotAndDotDot | QDir::System);
-  QStringList candidates;
-  for (const QString& fileName : fileList) {
-    QFileInfo fileInfo = QFileInfo(fileName);
-    if (fileInfo.baseName() == baseName && fileInfo.suffix() != extension) {
-      candidates << dir.filePath(fileName);
+  // Look for other files with the same base name in the file indexes of the
+  // projects, preferring files in the same directory. Files in other
+  // directories are only considered within projects that contain the file.
+  std::vector<QString> indexedPaths;
+  std::vector<QString> sameDirCandidates;
+  std::vector<QString> otherDirCandidates;
+  for (const auto& project : projects) {
+    indexedPaths.clear();
+    project->GetProjectFilePathsWithBaseName(baseName, &indexedPaths);
+    if (indexedPaths.empty()) {
+      continue;
     }
-  }
-  
-  // If anything was found, decide for one of those files.
-  QString bestCandidate;
-  if (!candidates.isEmpty()) {
-    for (const QString& candidate : candidates) {
-      bestCandidate = candidate;
-      if (GuessIsHeader(candidate, nullptr) != isHeader) {
-        break;
+    bool containsFile = project->ContainsFile(path);
+    for (const QString& indexedPath : indexedPaths) {
+      QFileInfo fileInfo = QFileInfo(indexedPath);
+      if (indexedPath == path || fileInfo.suffix() == extension) {
+        continue;
+      }
+      if (fileInfo.path() == dirPath) {
+        sameDirCandidates.push_back(indexedPath);
+      } else if (containsFile) {
+        otherDirCandidates.push_back(indexedPath);
       }
     }
-    return bestCandidate;
   }
   
-  // Look for other project files with the same base name (in any other
-  // directory), and decide for one of those.
-  for (const auto& project : projects) {
-    if (project->ContainsFile(canonicalPath)) {
-      int numTargets = project->GetNumTargets();
-      for (int targetIndex = 0; targetIndex < numTargets; ++ targetIndex) {
-        const Target& target = project->GetTarget(targetIndex);
-        
-        for (const SourceFile& source : target.sources) {
-          QFileInfo fileInfo = QFileInfo(source.path);
-          if (fileInfo.baseName() == baseName && fileInfo.suffix() != extension) {
-            candidates << source.path;
-          }
-        }
-      }
-    }
+  if (!sameDirCandidates.empty()) {
+    std::sort(sameDirCandidates.begin(), sameDirCandidates.end());
+    sameDirCandidates.erase(std::unique(sameDirCandidates.begin(), sameDirCandidates.end()), sameDirCandidates.end());
+    return ChooseCorrespondingCandidate(sameDirCandidates, isHeader);
   }
   
-  // If anything was found, decide for one of those files.
-  // TODO: Code duplicated from above
-  if (!candidates.isEmpty()) {
-    for (const QString& candidate : candidates) {
-      bestCandidate = candidate;
-      if (GuessIsHeader(candidate, nullptr) != isHeader) {
-        break;
-      }
+  // Look for files with the same base name in the same directory that are not
+  // in any project's file index. This is the only case that accesses the file
+  // system.
+  QDir dir = thisFileInfo.dir();
+  QStringList fileList = dir.entryList(QDir::Files | QDir::NoDotAndDotDot | QDir::System);
+  for (const QString& fileName : fileList) {
+    QFileInfo fileInfo = QFileInfo(fileName);
+    if (fileInfo.baseName() == baseName && fileInfo.suffix() != extension) {
+      sameDirCandidates.push_back(dir.filePath(fileName));
     }
-    return bestCandidate;
+  }
+  if (!sameDirCandidates.empty()) {
+    return ChooseCorrespondingCandidate(sameDirCandidates, isHeader);
+  }
+  
+  if (!otherDirCandidates.empty()) {
+    std::sort(otherDirCandidates.begin(), otherDirCandidates.end());
+    otherDirCandidates.erase(std::unique(otherDirCandidates.begin(), otherDirCandidates.end()), otherDirCandidates.end());
+    return ChooseCorrespondingCandidate(otherDirCandidates, isHeader);
   }
   
   return QStringLiteral("");
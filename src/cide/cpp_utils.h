@@ -21,5 +21,7 @@ bool GuessIsCFile(const QString& path);
 bool GuessIsHeader(const QString& path, bool* certain);
 
 /// Tries to find the corresponding header or source file for the file with the
-/// given path. Returns an empty string if no corresponding file was found.
+/// given canonical path. Returns an empty string if no corresponding file was
+/// found. The projects' file indexes are searched first, such that the file
+/// system is only accessed if the file is not in any project's file index.
 QString FindCorrespondingHeaderOrSource(const QString& path, const std::vector<std::shared_ptr<Project>>& projects);
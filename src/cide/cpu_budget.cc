@@ -0,0 +1,131 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/cpu_budget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "cide/performance_profile.h"
+
+/// Interval in which waiting Acquire() calls check their cancel flag, and
+/// whether background throttling ended.
+constexpr std::chrono::milliseconds kCancelPollInterval(20);
+
+/// Background work is throttled until the user was idle for this long.
+constexpr std::chrono::milliseconds kUserActivityThrottleDuration(1500);
+
+/// Number of slots that background work may use while it is throttled.
+constexpr int kThrottledBackgroundSlotCount = 1;
+
+CPUBudget& CPUBudget::Instance() {
+  static CPUBudget instance;
+  return instance;
+}
+
+bool CPUBudget::Acquire(QoS qos, const std::atomic<bool>* cancel) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (qos == QoS::Normal) {
+    ++ waitingNormalCount;
+  }
+  while (!mExit && !CanAcquire(qos)) {
+    if (cancel && *cancel) {
+      break;
+    }
+    if (cancel || qos == QoS::Background) {
+      slotReleasedCondition.wait_for(lock, kCancelPollInterval);
+    } else {
+      slotReleasedCondition.wait(lock);
+    }
+  }
+  if (qos == QoS::Normal) {
+    -- waitingNormalCount;
+  }
+  
+  if (mExit || !CanAcquire(qos)) {
+    // A background thread may be able to proceed now that this one stops
+    // waiting.
+    lock.unlock();
+    slotReleasedCondition.notify_all();
+    return false;
+  }
+  ++ usedSlotCount;
+  if (qos == QoS::Background) {
+    ++ usedBackgroundSlotCount;
+  }
+  return true;
+}
+
+bool CPUBudget::TryAcquire(QoS qos) {
+  std::unique_lock<std::mutex> lock(mutex);
+  // Interactive work may exceed the budget only with its main thread, so
+  // helper threads need a free slot in any case.
+  if (mExit || usedSlotCount >= slotCount || (qos != QoS::Interactive && !CanAcquire(qos))) {
+    return false;
+  }
+  ++ usedSlotCount;
+  if (qos == QoS::Background) {
+    ++ usedBackgroundSlotCount;
+  }
+  return true;
+}
+
+void CPUBudget::Release(QoS qos) {
+  mutex.lock();
+  -- usedSlotCount;
+  if (qos == QoS::Background) {
+    -- usedBackgroundSlotCount;
+  }
+  mutex.unlock();
+  slotReleasedCondition.notify_all();
+}
+
+void CPUBudget::NotifyUserActivity() {
+  std::unique_lock<std::mutex> lock(mutex);
+  lastUserActivityTime = std::chrono::steady_clock::now();
+}
+
+void CPUBudget::SetBuildRunning(bool running) {
+  mutex.lock();
+  buildRunning = running;
+  mutex.unlock();
+  slotReleasedCondition.notify_all();
+}
+
+int CPUBudget::GetUsedSlotCount() {
+  std::unique_lock<std::mutex> lock(mutex);
+  return usedSlotCount;
+}
+
+void CPUBudget::Exit() {
+  mutex.lock();
+  mExit = true;
+  mutex.unlock();
+  slotReleasedCondition.notify_all();
+}
+
+CPUBudget::CPUBudget() {
+  slotCount = std::max<int>(2, std::thread::hardware_concurrency());
+}
+
+bool CPUBudget::CanAcquire(QoS qos) const {
+  switch (qos) {
+  case QoS::Interactive:
+    return true;
+  case QoS::Normal:
+    return usedSlotCount < slotCount;
+  case QoS::Background:
+    return usedSlotCount < slotCount - GetPerformanceProfileParameters().reservedBackgroundSlotCount &&
+           waitingNormalCount == 0 &&
+           (usedBackgroundSlotCount < kThrottledBackgroundSlotCount || !IsBackgroundThrottled());
+  }
+  return false;
+}
+
+bool CPUBudget::IsBackgroundThrottled() const {
+  return buildRunning ||
+         GetPerformanceProfileParameters().alwaysThrottleBackgroundWork ||
+         std::chrono::steady_clock::now() - lastUserActivityTime < kUserActivityThrottleDuration;
+}
@@ -0,0 +1,123 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+/// Bounds the number of threads of all background subsystems (parse threads,
+/// code info workers, git diff, crash backup, minimap and rename search) that
+/// perform work at the same time to the number of CPU cores. Each subsystem
+/// keeps its own threads and request queue, but takes a slot of the budget
+/// while it processes a request, and returns it when done (see
+/// CPUBudgetScope). Idle threads thus do not count against the budget.
+///
+/// Slots are handed out by quality-of-service class:
+/// - Interactive work (which the user directly waits for) never waits for a
+///   slot, but counts against the budget, delaying the other classes.
+/// - Normal work waits until a slot is free.
+/// - Background work (such as indexing) additionally leaves one slot free for
+///   the other classes, and does not get a slot while normal work waits.
+///   While the user types or a build started from CIDE runs, background work
+///   is throttled to a single slot (see NotifyUserActivity() and
+///   SetBuildRunning()).
+///
+/// To avoid deadlocks, a thread must take its slot before acquiring other
+/// resources (such as TUs), and must not take a second slot. Waiting for a
+/// slot can be cancelled, which must be used by threads that another thread
+/// may join.
+class CPUBudget {
+ public:
+  enum class QoS {
+    Interactive = 0,
+    Normal,
+    Background
+  };
+  
+  static CPUBudget& Instance();
+  
+  /// Takes a slot for work of the given class, waiting until one is available
+  /// if necessary. Returns false without taking a slot if @p cancel (if
+  /// non-null) becomes true while waiting, or if Exit() has been called.
+  bool Acquire(QoS qos, const std::atomic<bool>* cancel = nullptr);
+  
+  /// Takes a slot for work of the given class only if one is available right
+  /// away. This is intended for additional helper threads that speed up a task
+  /// that runs anyway. Returns true if a slot was taken.
+  bool TryAcquire(QoS qos);
+  
+  /// Returns a slot that was taken with Acquire() or TryAcquire() for the
+  /// given class.
+  void Release(QoS qos);
+  
+  /// Throttles background work until the user was idle for a moment. Must be
+  /// called for user input such as typing.
+  void NotifyUserActivity();
+  
+  /// Throttles background work while @p running is true. Must be set while a
+  /// build process that was started from CIDE runs.
+  void SetBuildRunning(bool running);
+  
+  /// Returns the total number of slots.
+  inline int GetSlotCount() const { return slotCount; }
+  
+  /// Returns the number of slots that are currently taken. This may exceed
+  /// GetSlotCount() because of interactive work.
+  int GetUsedSlotCount();
+  
+  /// Makes all current and future calls to Acquire() return false, such that
+  /// threads do not wait for slots while the program exits.
+  void Exit();
+  
+ private:
+  CPUBudget();
+  
+  /// Returns whether a slot can be given to work of the given class now.
+  /// Must be called with mutex locked.
+  bool CanAcquire(QoS qos) const;
+  
+  /// Returns whether background work is throttled. Must be called with mutex
+  /// locked.
+  bool IsBackgroundThrottled() const;
+  
+  
+  std::mutex mutex;
+  std::condition_variable slotReleasedCondition;
+  int slotCount;
+  int usedSlotCount = 0;
+  int usedBackgroundSlotCount = 0;
+  int waitingNormalCount = 0;
+  std::chrono::steady_clock::time_point lastUserActivityTime;
+  bool buildRunning = false;
+  bool mExit = false;
+};
+
+/// Holds a slot of the CPUBudget for the lifetime of the object, if it could
+/// be acquired (see acquired()).
+class CPUBudgetScope {
+ public:
+  inline CPUBudgetScope(CPUBudget::QoS qos, const std::atomic<bool>* cancel = nullptr)
+      : mQoS(qos),
+        mAcquired(CPUBudget::Instance().Acquire(qos, cancel)) {}
+  
+  inline ~CPUBudgetScope() {
+    if (mAcquired) {
+      CPUBudget::Instance().Release(mQoS);
+    }
+  }
+  
+  CPUBudgetScope(const CPUBudgetScope& other) = delete;
+  CPUBudgetScope& operator= (const CPUBudgetScope& other) = delete;
+  
+  /// Returns false if acquiring the slot was cancelled. The work should be
+  /// skipped in this case.
+  inline bool acquired() const { return mAcquired; }
+  
+ private:
+  CPUBudget::QoS mQoS;
+  bool mAcquired;
+};
@@ -4,8 +4,21 @@
 
 #include "cide/crash_backup.h"
 
+#include <algorithm>
+
+#include <QSaveFile>
+
+#include "cide/cpu_budget.h"
 #include "cide/document.h"
 #include "cide/main_window.h"
+#include "cide/performance_profile.h"
+
+/// A journal is compacted once the records appended after its full-text record
+/// would become larger than both this size and the full-text record.
+constexpr qint64 kMinJournalSizeForCompaction = 1024 * 1024;
+
+/// Maximum time for which a backup is delayed while a document keeps changing.
+constexpr int kMaxBackupDelayMilliseconds = 10000;
 
 CrashBackup& CrashBackup::Instance() {
   static CrashBackup instance;
@@ -18,8 +31,23 @@ void CrashBackup::MakeBackup(const QString& path, std::shared_ptr<Document>& con
     return;
   }
   
+  auto now = std::chrono::steady_clock::now();
+  
+  // If there is a pending request for this path, replace its document, since
+  // only the newest version needs to be backed up
   backupMutex.lock();
-  backupRequests.push_back(BackupRequest(path, constantDocumentCopy));
+  bool coalesced = false;
+  for (BackupRequest& request : backupRequests) {
+    if (request.path == path) {
+      request.document = constantDocumentCopy;
+      request.lastRequestTime = now;
+      coalesced = true;
+      break;
+    }
+  }
+  if (!coalesced) {
+    backupRequests.push_back(BackupRequest(path, constantDocumentCopy, now));
+  }
   backupMutex.unlock();
   newBackupRequestCondition.notify_one();
 }
@@ -37,6 +65,7 @@ void CrashBackup::RemoveBackup(const QString& path) {
       backupRequests.erase(backupRequests.begin() + i);
     }
   }
+  lastBackupTimes.erase(path);
   backupMutex.unlock();
   
   // If the document for this path is currently being backed up, wait for this
@@ -47,13 +76,13 @@ void CrashBackup::RemoveBackup(const QString& path) {
   }
   
   // Delete the backup file for this path
-  pathToBackupFilenameMutex.lock();
-  auto it = pathToBackupFilename.find(path);
-  if (it != pathToBackupFilename.end()) {
-    QFile::remove(it->second);
-    pathToBackupFilename.erase(it);
+  journalsMutex.lock();
+  auto it = journals.find(path);
+  if (it != journals.end()) {
+    QFile::remove(it->second.backupPath);
+    journals.erase(it);
   }
-  pathToBackupFilenameMutex.unlock();
+  journalsMutex.unlock();
 }
 
 bool CrashBackup::DoBackupsExist() {
@@ -86,10 +115,10 @@ void CrashBackup::RestoreBackups(MainWindow* mainWindow) {
   for (const QString& backupFilename : backupFiles) {
     QString backupPath = backupQDir.filePath(backupFilename);
     
-    // Read the backup file
+    // Replay the backup journal
     std::shared_ptr<Document> backupDocument(new Document());
     QString originalFilePath;
-    if (!backupDocument->OpenBackup(backupPath, &originalFilePath)) {
+    if (!ReadBackup(backupPath, backupDocument.get(), &originalFilePath)) {
       qDebug() << "Error: Cannot read backup file:" << backupPath;
       continue;
     }
@@ -116,6 +145,42 @@ void CrashBackup::RestoreBackups(MainWindow* mainWindow) {
   }
 }
 
+bool CrashBackup::ReadBackup(const QString& backupPath, Document* document, QString* originalPath) {
+  // Note: The file is not opened in text mode, since this would drop '\r'
+  // characters within the records.
+  QFile file(backupPath);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  
+  QByteArray header = file.readLine();
+  if (!header.endsWith('\n')) {
+    return false;
+  }
+  *originalPath = QString::fromUtf8(header.chopped(1));
+  
+  while (!file.atEnd()) {
+    // Each record starts with a line "<start offset> <end offset> <text size>",
+    // followed by the UTF-8 encoded text and a '\n'.
+    QList<QByteArray> words = file.readLine().trimmed().split(' ');
+    bool ok = words.size() == 3;
+    int start = ok ? words[0].toInt(&ok) : 0;
+    int end = ok ? words[1].toInt(&ok) : 0;
+    int textSize = ok ? words[2].toInt(&ok) : 0;
+    QByteArray text = ok ? file.read(textSize + 1) : QByteArray();
+    if (!ok || start < 0 || end < start || end > document->FullDocumentRange().end.offset ||
+        textSize < 0 || text.size() != textSize + 1 || !text.endsWith('\n')) {
+      qDebug() << "Warning: Ignoring truncated or invalid record in backup file:" << backupPath;
+      break;
+    }
+    text.chop(1);
+    
+    document->Replace(DocumentRange(start, end), QString::fromUtf8(text), /*createUndoStep*/ false);
+  }
+  
+  return true;
+}
+
 void CrashBackup::DeleteAllBackups() {
   // Wait for the backup thread to be idle
   while (!pathBeingBackedUp.isEmpty()) {
@@ -130,10 +195,10 @@ void CrashBackup::DeleteAllBackups() {
     QFile::remove(backupPath);
   }
   
-  // Clear backup file map
-  pathToBackupFilenameMutex.lock();
-  pathToBackupFilename.clear();
-  pathToBackupFilenameMutex.unlock();
+  // Clear journal map
+  journalsMutex.lock();
+  journals.clear();
+  journalsMutex.unlock();
 }
 
 void CrashBackup::Exit() {
@@ -158,56 +223,128 @@ CrashBackup::CrashBackup() {
   mThread.reset(new std::thread(&CrashBackup::ThreadMain, this));
 }
 
-int CrashBackup::GetNextBackupRequest() {
-  if (backupRequests.empty()) {
-    return -1;
+int CrashBackup::GetNextBackupRequest(std::chrono::steady_clock::time_point* dueTime) {
+  // Note that there is at most one request per path, see MakeBackup().
+  // The idle time and backup interval are given by the performance profile.
+  const PerformanceProfileParameters& profile = GetPerformanceProfileParameters();
+  int nextRequest = -1;
+  for (int i = 0; i < backupRequests.size(); ++ i) {
+    const BackupRequest& request = backupRequests[i];
+    
+    // The request is due once the document was idle for a while, or once it
+    // has been delayed for too long ...
+    auto requestDueTime = std::min(
+        request.lastRequestTime + std::chrono::milliseconds(profile.backupIdleMilliseconds),
+        request.firstRequestTime + std::chrono::milliseconds(kMaxBackupDelayMilliseconds));
+    
+    // ... but not before the minimum interval since the last backup passed.
+    auto it = lastBackupTimes.find(request.path);
+    if (it != lastBackupTimes.end()) {
+      requestDueTime = std::max(requestDueTime, it->second + std::chrono::milliseconds(profile.minBackupIntervalMilliseconds));
+    }
+    
+    if (nextRequest < 0 || requestDueTime < *dueTime) {
+      nextRequest = i;
+      *dueTime = requestDueTime;
+    }
   }
+  return nextRequest;
+}
+
+void CrashBackup::CreateBackup(const BackupRequest& request) {
+  journalsMutex.lock();
+  Journal journal = journals[request.path];
+  journalsMutex.unlock();
   
-  // Find all requests with the same document path as the first one
-  const QString& path = backupRequests.front().path;
-  std::vector<int> requestsForPath = {0};
-  for (int i = 1; i < backupRequests.size(); ++ i) {
-    if (backupRequests[i].path == path) {
-      requestsForPath.push_back(i);
+  bool success;
+  Replacement replacement;
+  if (!journal.document) {
+    // Ensure that the backup folder exists
+    QDir backupQDir(backupDir);
+    if (!backupQDir.exists()) {
+      backupQDir.mkpath(".");
+    }
+    
+    // Generate a filename for the new journal, unless writing a journal for
+    // this path failed before
+    if (journal.backupPath.isEmpty()) {
+      do {
+        journal.backupPath = backupQDir.filePath(QString::number(nextBackupNumber));
+        ++ nextBackupNumber;
+      } while (QFile::exists(journal.backupPath));
+    }
+    
+    success = WriteFullJournal(request.path, *request.document, &journal);
+  } else if (!request.document->GetReplacementFrom(*journal.document, &replacement)) {
+    // The text did not change since the last backup
+    success = true;
+  } else {
+    QByteArray record = SerializeRecord(replacement.range, replacement.text.toUtf8());
+    if (journal.appendedSize + record.size() > std::max(kMinJournalSizeForCompaction, journal.fullTextSize)) {
+      success = WriteFullJournal(request.path, *request.document, &journal);
+    } else {
+      // If appending fails, the journal may end with a partial record, so it
+      // is rewritten in this case
+      success = AppendToJournal(record, &journal) ||
+                WriteFullJournal(request.path, *request.document, &journal);
     }
   }
   
-  // Delete all but the latest request, as they are outdated
-  int numDeleted = 0;
-  for (int i = 0; i < requestsForPath.size() - 1; ++ i) {
-    backupRequests.erase(backupRequests.begin() + requestsForPath[i] - numDeleted);
-    ++ numDeleted;
-  }
+  // Remember the state that the journal restores to. If writing failed, the
+  // next backup writes the full text again.
+  journal.document = success ? request.document : nullptr;
   
-  // Return the latest request
-  return requestsForPath.back() - numDeleted;
+  journalsMutex.lock();
+  journals[request.path] = journal;
+  journalsMutex.unlock();
 }
 
-void CrashBackup::CreateBackup(const BackupRequest& request) {
-  // Ensure that the backup folder exists
-  QDir backupQDir(backupDir);
-  if (!backupQDir.exists()) {
-    backupQDir.mkpath(".");
+bool CrashBackup::WriteFullJournal(const QString& originalPath, const Document& document, Journal* journal) {
+  // Use QSaveFile such that an existing journal is replaced atomically
+  QSaveFile file(journal->backupPath);
+  if (!file.open(QIODevice::WriteOnly)) {
+    qDebug() << "Error: Cannot write backup file:" << journal->backupPath;
+    return false;
   }
   
-  // Generate a filename for the new backup file
-  QString backupPath;
-  do {
-    backupPath = backupQDir.filePath(QString::number(nextBackupNumber));
-    ++ nextBackupNumber;
-  } while (QFile::exists(backupPath));
-  
-  // Write the backup file
-  request.document->SaveBackup(backupPath, request.path);
+  QByteArray header = originalPath.toUtf8() + "\n";
+  QByteArray record = SerializeRecord(DocumentRange(0, 0), document.EncodeDocumentTextUtf8());
+  if (file.write(header) != header.size() ||
+      file.write(record) != record.size() ||
+      !file.commit()) {
+    qDebug() << "Error: Cannot write backup file:" << journal->backupPath;
+    return false;
+  }
   
-  // Delete the old backup file for this path, if any, and remember the new filename
-  pathToBackupFilenameMutex.lock();
-  QString& storedBackupPath = pathToBackupFilename[request.path];
-  if (!storedBackupPath.isEmpty()) {
-    QFile::remove(storedBackupPath);
+  journal->fullTextSize = record.size();
+  journal->appendedSize = 0;
+  return true;
+}
+
+bool CrashBackup::AppendToJournal(const QByteArray& record, Journal* journal) {
+  QFile file(journal->backupPath);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+    return false;
   }
-  storedBackupPath = backupPath;
-  pathToBackupFilenameMutex.unlock();
+  if (file.write(record) != record.size() || !file.flush()) {
+    return false;
+  }
+  journal->appendedSize += record.size();
+  return true;
+}
+
+QByteArray CrashBackup::SerializeRecord(const DocumentRange& range, const QByteArray& text) {
+  QByteArray record;
+  record.reserve(text.size() + 32);
+  record += QByteArray::number(range.start.offset);
+  record += ' ';
+  record += QByteArray::number(range.end.offset);
+  record += ' ';
+  record += QByteArray::number(text.size());
+  record += '\n';
+  record += text;
+  record += '\n';
+  return record;
 }
 
 void CrashBackup::ThreadMain() {
@@ -218,18 +355,31 @@ void CrashBackup::ThreadMain() {
     }
     pathBeingBackedUp = "";
     int requestIndex;
-    while ((requestIndex = GetNextBackupRequest()) == -1) {
-      newBackupRequestCondition.wait(lock);
+    std::chrono::steady_clock::time_point dueTime;
+    while (true) {
+      requestIndex = GetNextBackupRequest(&dueTime);
+      if (requestIndex == -1) {
+        newBackupRequestCondition.wait(lock);
+      } else if (dueTime > std::chrono::steady_clock::now()) {
+        newBackupRequestCondition.wait_until(lock, dueTime);
+      } else {
+        break;
+      }
       if (mExit) {
         return;
       }
     }
     BackupRequest request = backupRequests[requestIndex];
     backupRequests.erase(backupRequests.begin() + requestIndex);
+    lastBackupTimes[request.path] = std::chrono::steady_clock::now();
     pathBeingBackedUp = request.path;
     lock.unlock();
     
-    // Make the backup
-    CreateBackup(request);
+    // Make the backup. This is not background work, such that backups are not
+    // delayed by indexing.
+    CPUBudgetScope budgetScope(CPUBudget::QoS::Normal, &mExit);
+    if (budgetScope.acquired()) {
+      CreateBackup(request);
+    }
   }
 }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
@@ -12,8 +13,10 @@
 #include <unordered_map>
 #include <vector>
 
+#include <QByteArray>
 #include <QString>
 
+#include "cide/document_range.h"
 #include "cide/util.h"
 
 class Document;
@@ -21,6 +24,13 @@ class MainWindow;
 
 /// Saves unsaved versions of documents in a temporary directory such that they
 /// can be restored from there after a crash of CIDE.
+///
+/// The backup of each document is an append-only journal: its first line is the
+/// original file path, followed by records that each replace a range of the
+/// text (starting from an empty text) with new text. The first record contains
+/// the full text, and each further backup only appends a record for the
+/// changes since the previous one. Once the journal grows too large compared to
+/// the text, it is compacted by rewriting it with the full text only.
 /// TODO: Make the backup directory configurable.
 class CrashBackup {
  public:
@@ -29,6 +39,10 @@ class CrashBackup {
   /// Backs up the given document. Important: As the backup is done in a
   /// background thread, the Document instance passed in here must be a constant
   /// copy of the actual document that will not be modified anymore.
+  /// Requests for the same path are coalesced, such that only the newest copy
+  /// is backed up. The backup is delayed until the document was not changed
+  /// for a moment (or has been changed for a long time), and is done at most
+  /// once within a minimum interval for each path.
   void MakeBackup(const QString& path, std::shared_ptr<Document>& constantDocumentCopy);
   
   /// Removes the backup for the document with the given path. This should be
@@ -45,6 +59,12 @@ class CrashBackup {
   /// Restores all backup files and deletes them.
   void RestoreBackups(MainWindow* mainWindow);
   
+  /// Replays the journal at @p backupPath into @p document, which must be
+  /// empty. Returns the original path of the file in @p originalPath. A
+  /// truncated record at the end (e.g., from a crash while writing it) is
+  /// ignored. Returns true if successful, false otherwise.
+  static bool ReadBackup(const QString& backupPath, Document* document, QString* originalPath);
+  
   /// Deletes all backup files.
   void DeleteAllBackups();
   
@@ -53,20 +73,52 @@ class CrashBackup {
   
  private:
   struct BackupRequest {
-    inline BackupRequest(const QString& path, const std::shared_ptr<Document>& document)
+    inline BackupRequest(const QString& path, const std::shared_ptr<Document>& document, std::chrono::steady_clock::time_point time)
         : path(path),
-          document(document) {}
+          document(document),
+          firstRequestTime(time),
+          lastRequestTime(time) {}
     
     QString path;
     std::shared_ptr<Document> document;
+    
+    /// Times of the first and of the latest request that were coalesced into
+    /// this one.
+    std::chrono::steady_clock::time_point firstRequestTime;
+    std::chrono::steady_clock::time_point lastRequestTime;
+  };
+  
+  struct Journal {
+    /// Path of the journal file.
+    QString backupPath;
+    
+    /// The document state that the journal currently restores to.
+    std::shared_ptr<Document> document;
+    
+    /// Size of the full-text record at the start of the journal, and the size
+    /// of all records that were appended after it.
+    qint64 fullTextSize = 0;
+    qint64 appendedSize = 0;
   };
   
   
   CrashBackup();
   
-  int GetNextBackupRequest();
+  /// Returns the index of the backup request that is due first, and the time
+  /// at which it is due in @p dueTime. Returns -1 if there is no request.
+  int GetNextBackupRequest(std::chrono::steady_clock::time_point* dueTime);
   void CreateBackup(const BackupRequest& request);
   
+  /// Writes a new journal (or replaces the existing one) for @p journal that
+  /// only contains the full text of @p document.
+  static bool WriteFullJournal(const QString& originalPath, const Document& document, Journal* journal);
+  
+  /// Appends the serialized @p record (see SerializeRecord()) to the journal.
+  static bool AppendToJournal(const QByteArray& record, Journal* journal);
+  
+  /// Returns the serialized record for replacing @p range with @p text.
+  static QByteArray SerializeRecord(const DocumentRange& range, const QByteArray& text);
+  
   void ThreadMain();
   
   
@@ -75,12 +127,15 @@ class CrashBackup {
   std::condition_variable newBackupRequestCondition;
   std::vector<BackupRequest> backupRequests;
   
+  /// Time of the last backup for each path, used to rate-limit the backups.
+  std::unordered_map<QString, std::chrono::steady_clock::time_point> lastBackupTimes;
+  
   // Thread state
   QString pathBeingBackedUp;
   
   // Backup state
-  std::mutex pathToBackupFilenameMutex;
-  std::unordered_map<QString, QString> pathToBackupFilename;
+  std::mutex journalsMutex;
+  std::unordered_map<QString, Journal> journals;
   int nextBackupNumber = 0;
   
   // Settings
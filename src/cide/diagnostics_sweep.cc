@@ -0,0 +1,212 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/diagnostics_sweep.h"
+
+#include <QBoxLayout>
+#include <QDockWidget>
+#include <QLabel>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QTreeWidget>
+
+#include "cide/main_window.h"
+#include "cide/parse_thread_pool.h"
+#include "cide/project.h"
+
+void DiagnosticsSweep::Initialize(MainWindow* mainWindow) {
+  this->mainWindow = mainWindow;
+  
+  pollTimer.setInterval(100);
+  connect(&pollTimer, &QTimer::timeout, this, &DiagnosticsSweep::PollResults);
+}
+
+void DiagnosticsSweep::AddFileResults(int generation, const QString& /*canonicalPath*/, std::vector<SweepDiagnostic>&& diagnostics) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (generation != this->generation || !running) {
+    return;
+  }
+  
+  ++ numFilesChecked;
+  for (SweepDiagnostic& diagnostic : diagnostics) {
+    QString key = QStringLiteral("%1:%2:%3:%4:%5")
+        .arg(diagnostic.filePath)
+        .arg(diagnostic.line)
+        .arg(diagnostic.column)
+        .arg(diagnostic.isError ? 1 : 0)
+        .arg(diagnostic.text);
+    if (foundDiagnosticKeys.insert(key).second) {
+      newDiagnostics.push_back(std::move(diagnostic));
+    }
+  }
+}
+
+void DiagnosticsSweep::CheckProject() {
+  std::vector<std::shared_ptr<Project>>& projects = mainWindow->GetProjects();
+  if (projects.empty()) {
+    QMessageBox::warning(mainWindow, tr("Check project"), tr("No project is open that can be checked."));
+    return;
+  }
+  
+  // As for building, use the first project.
+  // TODO: Allow to select the project
+  const Project* project = projects.front().get();
+  
+  // Collect the compiled sources of the build target (or of all targets).
+  std::vector<QString> paths;
+  std::unordered_set<QString> pathSet;
+  auto addTargetSources = [&](bool onlyBuildTarget) {
+    for (int targetIndex = 0; targetIndex < project->GetNumTargets(); ++ targetIndex) {
+      const Target& target = project->GetTarget(targetIndex);
+      if (onlyBuildTarget && target.name != project->GetBuildTarget()) {
+        continue;
+      }
+      for (const SourceFile& source : target.sources) {
+        if (source.compileSettingsIndex >= 0 && pathSet.insert(source.path).second) {
+          paths.push_back(source.path);
+        }
+      }
+    }
+  };
+  if (!project->GetBuildTarget().isEmpty()) {
+    addTargetSources(true);
+  }
+  if (paths.empty()) {
+    addTargetSources(false);
+  }
+  if (paths.empty()) {
+    QMessageBox::warning(mainWindow, tr("Check project"), tr("The project does not contain any source files."));
+    return;
+  }
+  
+  Stop();
+  
+  if (!dock) {
+    CreateDockWidget();
+  } else if (!dock->isVisible()) {
+    dock->setVisible(true);
+  }
+  problemsTree->clear();
+  fileItems.clear();
+  numErrors = 0;
+  numWarnings = 0;
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  ++ generation;
+  running = true;
+  numFilesChecked = 0;
+  numFilesToCheck = paths.size();
+  foundDiagnosticKeys.clear();
+  newDiagnostics.clear();
+  int currentGeneration = generation;
+  lock.unlock();
+  
+  ParseThreadPool::Instance().RequestDiagnosticsChecks(paths, currentGeneration, mainWindow);
+  
+  statusLabel->setText(tr("Checking files..."));
+  stopButton->setEnabled(true);
+  pollTimer.start();
+}
+
+void DiagnosticsSweep::Stop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!running) {
+    return;
+  }
+  running = false;
+  lock.unlock();
+  
+  ParseThreadPool::Instance().CancelDiagnosticsChecks();
+  
+  // Display the results that were found before the check stopped.
+  PollResults();
+  pollTimer.stop();
+  
+  statusLabel->setText(tr("Check stopped (%1 errors, %2 warnings found).").arg(numErrors).arg(numWarnings));
+  stopButton->setEnabled(false);
+}
+
+void DiagnosticsSweep::PollResults() {
+  std::vector<SweepDiagnostic> diagnostics;
+  std::unique_lock<std::mutex> lock(mutex);
+  diagnostics.swap(newDiagnostics);
+  int filesChecked = numFilesChecked;
+  int filesToCheck = numFilesToCheck;
+  bool finished = running && numFilesChecked == numFilesToCheck;
+  if (finished) {
+    running = false;
+  }
+  bool isRunning = running;
+  lock.unlock();
+  
+  for (const SweepDiagnostic& diagnostic : diagnostics) {
+    QTreeWidgetItem*& fileItem = fileItems[diagnostic.filePath];
+    if (!fileItem) {
+      fileItem = new QTreeWidgetItem(problemsTree, QStringList() << diagnostic.filePath);
+      fileItem->setExpanded(true);
+    }
+    
+    QTreeWidgetItem* item = new QTreeWidgetItem(fileItem, QStringList() << tr("%1:%2: %3: %4")
+        .arg(diagnostic.line)
+        .arg(diagnostic.column)
+        .arg(diagnostic.isError ? tr("error") : tr("warning"))
+        .arg(diagnostic.text));
+    item->setForeground(0, diagnostic.isError ? QColor(Qt::darkRed) : QColor(Qt::darkYellow));
+    item->setData(0, Qt::UserRole, QStringLiteral("file://%1:%2:%3").arg(diagnostic.filePath).arg(diagnostic.line).arg(diagnostic.column));
+    
+    if (diagnostic.isError) {
+      ++ numErrors;
+    } else {
+      ++ numWarnings;
+    }
+  }
+  
+  if (isRunning) {
+    statusLabel->setText(tr("Checking files... (%1 / %2 files, %3 errors, %4 warnings so far)").arg(filesChecked).arg(filesToCheck).arg(numErrors).arg(numWarnings));
+  } else if (finished) {
+    pollTimer.stop();
+    statusLabel->setText(tr("Checked %1 files: %2 errors, %3 warnings.").arg(filesToCheck).arg(numErrors).arg(numWarnings));
+    stopButton->setEnabled(false);
+  }
+}
+
+void DiagnosticsSweep::CreateDockWidget() {
+  dock = new QDockWidget(tr("Problems"));
+  dock->setFeatures(
+      QDockWidget::DockWidgetClosable |
+      QDockWidget::DockWidgetMovable |
+      QDockWidget::DockWidgetFloatable |
+      QDockWidget::DockWidgetVerticalTitleBar);
+  
+  statusLabel = new QLabel();
+  stopButton = new QPushButton(tr("Stop"));
+  stopButton->setEnabled(false);
+  connect(stopButton, &QPushButton::clicked, this, &DiagnosticsSweep::Stop);
+  
+  problemsTree = new QTreeWidget();
+  problemsTree->setColumnCount(1);
+  problemsTree->setHeaderHidden(true);
+  connect(problemsTree, &QTreeWidget::itemActivated, [&](QTreeWidgetItem* item, int /*column*/) {
+    QString locationString = item->data(0, Qt::UserRole).toString();
+    if (!locationString.isEmpty()) {
+      mainWindow->GotoDocumentLocation(locationString);
+    }
+  });
+  
+  QHBoxLayout* topLayout = new QHBoxLayout();
+  topLayout->setContentsMargins(0, 0, 0, 0);
+  topLayout->addWidget(statusLabel, 1);
+  topLayout->addWidget(stopButton);
+  
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->setContentsMargins(0, 0, 0, 0);
+  layout->addLayout(topLayout);
+  layout->addWidget(problemsTree, 1);
+  
+  QWidget* containerWidget = new QWidget();
+  containerWidget->setLayout(layout);
+  dock->setWidget(containerWidget);
+  
+  mainWindow->addDockWidget(Qt::BottomDockWidgetArea, dock);
+}
@@ -0,0 +1,100 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+class MainWindow;
+class QDockWidget;
+class QLabel;
+class QPushButton;
+class QTreeWidget;
+class QTreeWidgetItem;
+
+/// An error or warning found by a DiagnosticsSweep.
+struct SweepDiagnostic {
+  /// Canonical path of the file that contains the diagnostic location. This
+  /// may be a header that is included by the checked source file.
+  QString filePath;
+  
+  /// One-based line and column.
+  int line;
+  int column;
+  
+  bool isError;
+  QString text;
+};
+
+/// Checks all source files of the build target for errors and warnings without
+/// running the build. The files are queued in the ParseThreadPool behind all
+/// other requests, and the diagnostics of each file are shown in a "Problems"
+/// dock as soon as it has been checked. Diagnostics that are reported by
+/// several source files (for example, in a header that they include) are only
+/// shown once.
+class DiagnosticsSweep : public QObject {
+ Q_OBJECT
+ public:
+  void Initialize(MainWindow* mainWindow);
+  
+  /// Adds the diagnostics that were found for the source file
+  /// @p canonicalPath by the sweep with the given @p generation. Results of
+  /// an outdated or stopped sweep are dropped. This is called from the parse
+  /// threads.
+  void AddFileResults(int generation, const QString& canonicalPath, std::vector<SweepDiagnostic>&& diagnostics);
+  
+ public slots:
+  /// Starts checking the sources of the build target of the first project (or
+  /// of all of its targets if no build target is set). A running check is
+  /// stopped.
+  void CheckProject();
+  
+  /// Stops the running check, if any. The results found so far remain
+  /// displayed.
+  void Stop();
+  
+ private slots:
+  /// Adds the diagnostics that were found since the last call to the problems
+  /// tree, and updates the progress display.
+  void PollResults();
+  
+ private:
+  void CreateDockWidget();
+  
+  QDockWidget* dock = nullptr;
+  QLabel* statusLabel;
+  QPushButton* stopButton;
+  QTreeWidget* problemsTree;
+  
+  /// Maps file paths to their top-level item in problemsTree.
+  std::unordered_map<QString, QTreeWidgetItem*> fileItems;
+  
+  int numErrors = 0;
+  int numWarnings = 0;
+  
+  /// Timer which periodically calls PollResults() while a check is running.
+  QTimer pollTimer;
+  
+  // State that is shared with the parse threads, protected by mutex.
+  std::mutex mutex;
+  int generation = 0;
+  bool running = false;
+  int numFilesChecked = 0;
+  int numFilesToCheck = 0;
+  
+  /// Identifies the diagnostics that were found so far, for de-duplication.
+  std::unordered_set<QString> foundDiagnosticKeys;
+  
+  /// Diagnostics that have not been taken by PollResults() yet.
+  std::vector<SweepDiagnostic> newDiagnostics;
+  
+  MainWindow* mainWindow;
+};
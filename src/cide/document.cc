@@ -4,15 +4,133 @@
 
 #include "cide/document.h"
 
+#include <algorithm>
+#include <limits>
+#include <functional>
 #include <iostream>
+#include <queue>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <QFile>
-
+#include <QHash>
+#include <QMetaMethod>
+#include <QPointer>
+#include <QSaveFile>
+#include <QTimer>
+
+#include "cide/background_reclaimer.h"
+#include "cide/file_stat_cache.h"
+#include "cide/git_diff.h"
+#include "cide/performance_profile.h"
 #include "cide/qt_thread.h"
 #include "cide/settings.h"
 #include "cide/text_utils.h"
 
+/// Files with at least this many bytes are decoded by multiple threads when
+/// they are opened.
+constexpr qint64 kMinFileSizeForParallelDecoding = 4 * 1024 * 1024;
+
+/// Inserted texts with at least this many characters are split into blocks by
+/// multiple threads, see Document::InsertLargeText().
+constexpr int kMinTextSizeForParallelBlockCreation = 2 * 1024 * 1024;
+
+/// Approximate number of bytes that are encoded and written at once when
+/// saving a document.
+constexpr int kSaveChunkSize = 256 * 1024;
+
+/// Texts of undo and redo steps with at least this many characters are stored
+/// in compressed form.
+constexpr int kMinReplacementTextSizeForCompression = 16 * 1024;
+
+/// When the undo history exceeds the memory limit, it is pruned to this
+/// fraction of the limit, such that pruning does not happen on every step.
+constexpr double kUndoHistoryPruningTarget = 0.75;
+
+/// Blocks are compacted (see Document::CompactBlocks()) once a document has
+/// not been edited for this many milliseconds.
+constexpr int kBlockCompactionDelayMs = 3000;
+
+/// Number of desired block sizes before and after the last edit in which
+/// Document::CompactBlocks() keeps the small blocks, such that continuing to
+/// edit at the same place does not need to split a large block again.
+constexpr int kSmallBlocksAroundLastEdit = 8;
+
+/// Returns the memory limit for the undo history of each document, see
+/// Document::SetUndoHistoryMemoryLimit().
+static std::size_t& UndoHistoryMemoryLimit() {
+  static std::size_t limit = static_cast<std::size_t>(Settings::Instance().GetUndoHistoryMemoryLimitMB()) * 1024 * 1024;
+  return limit;
+}
+
+/// Documents with at least this many blocks are destroyed in the background
+/// (see Document::~Document()).
+constexpr int kMinBlockCountForBackgroundDestruction = 64;
+
+/// Deletes all nodes of the version graph with the given root.
+static void DeleteVersionGraph(DocumentVersion* root) {
+  // (Depth-first) deletion of all nodes in the version graph.
+  std::vector<DocumentVersion*> workList = {root};
+  while (!workList.empty()) {
+    DocumentVersion* curItem = workList.back();
+    workList.pop_back();
+    
+    for (const DocumentVersionLink& link : curItem->links) {
+      workList.push_back(link.linkedVersion);
+    }
+    
+    delete curItem;
+  }
+}
+
+/// The parts of a Document that may take long to free, see
+/// Document::~Document().
+struct ReclaimedDocumentData {
+  ~ReclaimedDocumentData() {
+    DeleteVersionGraph(versionGraphRoot);
+  }
+  
+  std::unique_ptr<ClangTUPool> TUPool;
+  DocumentVersion* versionGraphRoot;
+  std::vector<std::shared_ptr<TextBlock>> blocks;
+  std::vector<HighlightRange> ranges[TextBlock::kLayerCount];
+  std::set<Context> contexts;
+  std::vector<std::shared_ptr<Problem>> problems;
+};
+
+
+void Replacement::Compress() {
+  if (text.size() < kMinReplacementTextSizeForCompression) {
+    return;
+  }
+  // Use the fastest compression level, since this runs for each large undo
+  // step in the main thread.
+  compressedText = qCompress(reinterpret_cast<const uchar*>(text.constData()), text.size() * sizeof(QChar), 1);
+  text = QString();
+}
+
+QString Replacement::GetText() const {
+  if (compressedText.isEmpty()) {
+    return text;
+  }
+  QByteArray data = qUncompress(compressedText);
+  return QString(reinterpret_cast<const QChar*>(data.constData()), data.size() / sizeof(QChar));
+}
+
+std::size_t Replacement::MemoryUsage() const {
+  return sizeof(Replacement) + text.size() * sizeof(QChar) + compressedText.size();
+}
+
+std::size_t DocumentVersionLink::MemoryUsage() const {
+  std::size_t result = sizeof(DocumentVersionLink) + sizeof(DocumentVersion);
+  for (const Replacement& replacement : replacements) {
+    result += replacement.MemoryUsage();
+  }
+  return result;
+}
+
+
 
 Document::LineIterator::LineIterator(Document* document)
     : document(document),
@@ -22,44 +140,16 @@ Document::LineIterator::LineIterator(Document* document)
 
 Document::LineIterator::LineIterator(Document* document, int initialOffset)
     : document(document) {
-  document->EnsureOffsetCacheIsUpToDate();
-  
-  int l = 0;
-  unsigned int lOffset = document->mBlocks[l]->GetCachedStartLine();
-  int r = static_cast<int>(document->mBlocks.size()) - 1;
-  unsigned int rLine = document->mBlocks[r]->GetCachedEndLine();
-  
-  while (l <= r) {
-    blockIndex = l + (initialOffset - lOffset) / static_cast<float>(rLine - lOffset) * (r - l) + 0.5f;
-    if (blockIndex < 0 || blockIndex >= document->mBlocks.size()) {
-      break;
-    }
-    
-    int blockStartLine = document->mBlocks[blockIndex]->GetCachedStartLine();
-    int blockEndLine = document->mBlocks[blockIndex]->GetCachedEndLine();
-    if (blockStartLine <= initialOffset && blockEndLine > initialOffset) {
-      blockStartOffset = document->mBlocks[blockIndex]->GetCachedStartOffset();
-      lineInBlockIndex = initialOffset - blockStartLine;
-      return;
-    }
-    
-    if (initialOffset >= blockEndLine) {
-      l = blockIndex + 1;
-      if (l >= document->mBlocks.size()) {
-        break;
-      }
-      lOffset = document->mBlocks[l]->GetCachedStartLine();
-    } else {
-      r = blockIndex - 1;
-      if (r < 0) {
-        break;
-      }
-      rLine = document->mBlocks[r]->GetCachedEndLine();
-    }
+  if (initialOffset < 0 || initialOffset >= document->mBlockLines.Total()) {
+    blockIndex = document->mBlocks.size();
+    // qDebug() << "Error: LineIterator initializing constructor did not find the given initialOffset (" << initialOffset << ")";
+    return;
   }
   
-  blockIndex = document->mBlocks.size();
-  // qDebug() << "Error: LineIterator initializing constructor did not find the given initialOffset (" << initialOffset << ")";
+  int blockStartLine;
+  blockIndex = document->mBlockLines.FindLastPrefixAtMost(initialOffset, &blockStartLine);
+  blockStartOffset = document->mBlockOffsets.PrefixSum(blockIndex);
+  lineInBlockIndex = initialOffset - blockStartLine;
 }
 
 Document::LineIterator::LineIterator(const LineIterator& other)
@@ -108,15 +198,15 @@ int Document::LineIterator::GetAttributes() {
 }
 
 void Document::LineIterator::SetAttributes(int attributes) {
-  document->mBlocks[blockIndex]->lineAttributes()[lineInBlockIndex].attributes = attributes;
+  document->SetBlockLineAttributes(blockIndex, lineInBlockIndex, attributes);
 }
 
 void Document::LineIterator::AddAttributes(int attributes) {
-  document->mBlocks[blockIndex]->lineAttributes()[lineInBlockIndex].attributes |= attributes;
+  document->SetBlockLineAttributes(blockIndex, lineInBlockIndex, GetAttributes() | attributes);
 }
 
 void Document::LineIterator::RemoveAttributes(int attributes) {
-  document->mBlocks[blockIndex]->lineAttributes()[lineInBlockIndex].attributes &= ~attributes;
+  document->SetBlockLineAttributes(blockIndex, lineInBlockIndex, GetAttributes() & ~attributes);
 }
 
 Document::CharacterIterator Document::LineIterator::GetCharacterIterator() const {
@@ -283,36 +373,14 @@ QChar Document::CharacterAndStyleIterator::GetChar() const {
   return document->mBlocks[blockIndex]->text()[charInBlockIndex];
 }
 
-HighlightRange Document::CharacterAndStyleIterator::GetStyle() const {
-  const auto& block = document->mBlocks[blockIndex];
-  
-  // Apply all layers of highlight ranges on top of each other.
-  int layer = 0;
-  int rangeIndex = block->styleRanges(layer)[styleInBlockIndex[layer]].rangeIndex;
-  HighlightRange result = document->mRanges[layer][rangeIndex];
-  
-  for (layer = 1; layer < TextBlock::kLayerCount; ++ layer) {
-    rangeIndex = block->styleRanges(layer)[styleInBlockIndex[layer]].rangeIndex;
-    const HighlightRange& highlight = document->mRanges[layer][rangeIndex];
-    
-    if (highlight.affectsText) {
-      result.affectsText = true;
-      result.textColor = highlight.textColor;
-      result.bold = highlight.bold;
-    }
-    if (highlight.affectsBackground) {
-      result.affectsBackground = true;
-      result.backgroundColor = highlight.backgroundColor;
-    }
-  }
-  
-  return result;
+HighlightStyle Document::CharacterAndStyleIterator::GetStyle() const {
+  return document->MergeLayerStyles(*document->mBlocks[blockIndex], styleInBlockIndex);
 }
 
-const HighlightRange& Document::CharacterAndStyleIterator::GetStyleOfLayer(int layer) const {
+const HighlightStyle& Document::CharacterAndStyleIterator::GetStyleOfLayer(int layer) const {
   const auto& block = document->mBlocks[blockIndex];
   int rangeIndex = block->styleRanges(layer)[styleInBlockIndex[layer]].rangeIndex;
-  return document->mRanges[layer][rangeIndex];
+  return document->mStyles[document->mRanges[layer][rangeIndex].styleId];
 }
 
 void Document::CharacterAndStyleIterator::operator--() {
@@ -372,28 +440,252 @@ void Document::CharacterAndStyleIterator::operator++() {
 }
 
 
+
+Document::StyleRunIterator::StyleRunIterator(Document* document, int characterOffset)
+    : document(document) {
+  blockIndex = document->BlockForCharacter(characterOffset, &blockStartOffset);
+  if (blockIndex < 0) {
+    // Make GetRunStart() return the given offset for iterators that start at
+    // (or after) the end of the document.
+    blockIndex = document->mBlocks.size();
+    blockStartOffset = characterOffset;
+    runStart = 0;
+    runEnd = 0;
+    isNonCode = false;
+    return;
+  }
+  runStart = characterOffset - blockStartOffset;
+  for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+    styleInBlockIndex[layer] = document->mBlocks[blockIndex]->FindStyleIndexForCharacter(runStart, layer);
+  }
+  InitializeRun();
+}
+
+bool Document::StyleRunIterator::IsValid() const {
+  return blockIndex >= 0 && blockIndex < document->mBlocks.size();
+}
+
+const QChar* Document::StyleRunIterator::GetText() const {
+  return document->mBlocks[blockIndex]->text().constData() + runStart;
+}
+
+void Document::StyleRunIterator::operator++() {
+  runStart = runEnd;
+  
+  const TextBlock* block = document->mBlocks[blockIndex].get();
+  if (runStart < block->text().size()) {
+    for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+      const auto& styleRanges = block->styleRanges(layer);
+      while (styleRanges.size() > styleInBlockIndex[layer] + 1 &&
+             styleRanges[styleInBlockIndex[layer] + 1].start.offset <= runStart) {
+        ++ styleInBlockIndex[layer];
+      }
+    }
+    InitializeRun();
+    return;
+  }
+  
+  // Continue with the next non-empty block.
+  do {
+    blockStartOffset += document->mBlocks[blockIndex]->text().size();
+    ++ blockIndex;
+    // runStart and runEnd must be set to 0 before exiting such that
+    // GetRunStart() returns the correct offset after reaching the end of the
+    // document.
+    runStart = 0;
+    runEnd = 0;
+    if (!IsValid()) {
+      return;
+    }
+  } while (document->mBlocks[blockIndex]->text().isEmpty());
+  
+  for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+    styleInBlockIndex[layer] = 0;
+  }
+  InitializeRun();
+}
+
+void Document::StyleRunIterator::InitializeRun() {
+  const TextBlock& block = *document->mBlocks[blockIndex];
+  
+  runEnd = block.text().size();
+  for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+    const auto& styleRanges = block.styleRanges(layer);
+    if (styleRanges.size() > styleInBlockIndex[layer] + 1) {
+      runEnd = std::min(runEnd, styleRanges[styleInBlockIndex[layer] + 1].start.offset);
+    }
+  }
+  
+  style = document->MergeLayerStyles(block, styleInBlockIndex);
+  int rangeIndex = block.styleRanges(0)[styleInBlockIndex[0]].rangeIndex;
+  isNonCode = document->mStyles[document->mRanges[0][rangeIndex].styleId].isNonCodeRange;
+}
+
+std::size_t HighlightStyleTable::StyleHash::operator() (const HighlightStyle& style) const {
+  std::size_t flags =
+      (style.affectsText ? 1 : 0) |
+      (style.bold ? 2 : 0) |
+      (style.affectsBackground ? 4 : 0) |
+      (style.isNonCodeRange ? 8 : 0);
+  return std::hash<quint64>()((static_cast<quint64>(style.textColor.rgba()) << 32) | style.backgroundColor.rgba()) ^ flags;
+}
+
+int HighlightStyleTable::Intern(const HighlightStyle& style) {
+  auto it = mStyleIndices.find(style);
+  if (it != mStyleIndices.end()) {
+    return it->second;
+  }
+  
+  int index = mStyles.size();
+  mStyles.push_back(style);
+  mStyleIndices.emplace(style, index);
+  return index;
+}
+
+std::vector<int> HighlightStyleTable::InternTable(const HighlightStyleTable& other) {
+  std::vector<int> indexMap(other.size());
+  for (int i = 0; i < other.size(); ++ i) {
+    indexMap[i] = Intern(other[i]);
+  }
+  return indexMap;
+}
+
+
+DocumentRange TextReplacement::MapRange(const DocumentRange& range) const {
+  int shift = newTextSize - oldRange.size();
+  DocumentLocation newRangeEnd = oldRange.start + newTextSize;
+  
+  if (range.start >= oldRange.end) {
+    return DocumentRange(range.start + shift, range.end + shift);
+  } else if (range.start >= oldRange.start) {
+    if (range.end <= oldRange.end) {
+      return DocumentRange::Invalid();
+    } else {
+      return DocumentRange(newRangeEnd, range.end + shift);
+    }
+  } else if (range.end >= oldRange.start) {
+    if (range.end > oldRange.end) {
+      return DocumentRange(range.start, range.end + shift);
+    } else {
+      return DocumentRange(range.start, oldRange.start);
+    }
+  } else {
+    return range;
+  }
+}
+
+DocumentLocation TextReplacement::MapLocation(const DocumentLocation& location) const {
+  if (location >= oldRange.end) {
+    return location + (newTextSize - oldRange.size());
+  } else if (location > oldRange.start) {
+    return oldRange.start;
+  } else {
+    return location;
+  }
+}
+
+
+void HighlightBuffer::Rebase(const std::vector<TextReplacement>& replacements) {
+  if (replacements.empty()) {
+    return;
+  }
+  
+  auto mapRange = [&](const DocumentRange& range) {
+    DocumentRange result = range;
+    for (const TextReplacement& replacement : replacements) {
+      result = replacement.MapRange(result);
+      if (result.IsInvalid()) {
+        break;
+      }
+    }
+    return result;
+  };
+  
+  // Highlight ranges
+  int outIndex = 0;
+  for (int i = 0, size = ranges.size(); i < size; ++ i) {
+    DocumentRange newRange = mapRange(ranges[i].range);
+    if (newRange.IsInvalid() || newRange.IsEmpty()) {
+      continue;
+    }
+    if (outIndex != i) {
+      ranges[outIndex] = std::move(ranges[i]);
+    }
+    ranges[outIndex].range = newRange;
+    ++ outIndex;
+  }
+  ranges.resize(outIndex);
+  
+  // Contexts
+  std::set<Context> newContexts;
+  for (const Context& context : contexts) {
+    DocumentRange newRange = mapRange(context.range);
+    if (newRange.IsValid()) {
+      Context newContext = context;
+      newContext.range = newRange;
+      newContexts.insert(newContext);
+    }
+  }
+  newContexts.swap(contexts);
+  
+  // Problem ranges and fix-its
+  std::set<ProblemRange> newProblemRanges;
+  for (const ProblemRange& problemRange : problemRanges) {
+    DocumentRange newRange = mapRange(problemRange.range);
+    if (newRange.IsValid()) {
+      newProblemRanges.insert(ProblemRange(newRange, problemRange.problemIndex));
+    }
+  }
+  newProblemRanges.swap(problemRanges);
+  
+  for (const std::shared_ptr<Problem>& problem : problems) {
+    std::vector<Problem::FixIt>& fixits = problem->fixits();
+    for (int i = 0; i < static_cast<int>(fixits.size()); ++ i) {
+      DocumentRange newRange = mapRange(fixits[i].range);
+      if (newRange.IsInvalid()) {
+        fixits.erase(fixits.begin() + i);
+        -- i;
+      } else {
+        fixits[i].range = newRange;
+      }
+    }
+  }
+  
+  // Line attributes
+  for (std::pair<DocumentLocation, int>& lineAttributes : problemLineAttributes) {
+    for (const TextReplacement& replacement : replacements) {
+      lineAttributes.first = replacement.MapLocation(lineAttributes.first);
+    }
+  }
+}
+
+
 Document::Document(int desiredBlockSize)
     : mVersion(0),
       mSavedVersion(0),
-      mOffsetCacheVersion(-1),
+      mBlockPool(new TextBlockPool()),
       desiredBlockSize(desiredBlockSize) {
-  mBlocks = {std::shared_ptr<TextBlock>(new TextBlock())};
+  mBlocks = {TextBlockPool::MakeBlock(mBlockPool)};
+  RebuildBlockIndex();
   
   versionGraphRoot = new DocumentVersion(mVersion, nullptr);
   
   creatingCombinedUndoStep = false;
   
   // Add default font style
-  const auto& defaultStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::Default);
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
+  const auto& defaultStyle = styles->GetTextStyle(Settings::TextStyle::Default);
   for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
     mRanges[layer].emplace_back(
         /*range*/ DocumentRange::Invalid(),
-        /*affectsText*/ layer == 0,
-        /*textColor*/ defaultStyle.textColor,
-        /*bold*/ defaultStyle.bold,
-        /*affectsBackground*/ defaultStyle.affectsBackground,
-        /*backgroundColor*/ defaultStyle.backgroundColor,
-        /*isNonCodeRange*/ false);
+        mStyles.Intern(HighlightStyle(
+            /*affectsText*/ layer == 0,
+            /*textColor*/ defaultStyle.textColor,
+            /*bold*/ defaultStyle.bold,
+            /*affectsBackground*/ defaultStyle.affectsBackground,
+            /*backgroundColor*/ defaultStyle.backgroundColor,
+            /*isNonCodeRange*/ false)));
+    mRangesTextChangeCounter[layer] = mTextChangeCounter;
   }
 }
 
@@ -403,21 +695,112 @@ Document::~Document() {
       watcher.reset();
     });
   }
-  ClearVersionGraph();
-  delete versionGraphRoot;
+  
+  // Freeing the TUs, the undo history and the text of large documents may take
+  // long, while documents are usually destroyed in the Qt thread. Thus, hand
+  // these over to the BackgroundReclaimer. Small documents (such as temporary
+  // copies) are destroyed directly.
+  if (mTUPool ||
+      !versionGraphRoot->links.empty() ||
+      mBlocks.size() >= kMinBlockCountForBackgroundDestruction) {
+    std::shared_ptr<ReclaimedDocumentData> reclaimedData(new ReclaimedDocumentData());
+    reclaimedData->TUPool = std::move(mTUPool);
+    reclaimedData->versionGraphRoot = versionGraphRoot;
+    reclaimedData->blocks.swap(mBlocks);
+    for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+      reclaimedData->ranges[layer].swap(mRanges[layer]);
+    }
+    reclaimedData->contexts.swap(mContexts);
+    reclaimedData->problems.swap(mProblems);
+    BackgroundReclaimer::Instance().Release(std::move(reclaimedData));
+  } else {
+    DeleteVersionGraph(versionGraphRoot);
+  }
 }
 
 void Document::AssignTextAndStyles(const Document& other) {
-  // Copy blocks
-  mBlocks.resize(other.mBlocks.size());
-  for (int i = 0; i < mBlocks.size(); ++ i) {
-    mBlocks[i].reset(new TextBlock(*other.mBlocks[i]));
-  }
+  AssignText(other);
   
   // Copy style ranges
   for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
     mRanges[layer] = other.mRanges[layer];
+    mRangesTextChangeCounter[layer] = -1;
+  }
+  mStyles = other.mStyles;
+}
+
+void Document::AssignText(const Document& other) {
+  RecordUnmappableTextChange();
+  
+  // Share the blocks. They are copied on write by both documents, see
+  // MutableBlock().
+  mBlocks = other.mBlocks;
+  mBracketSummaries.clear();
+  mIdentifierIndexes.clear();
+  
+  mBlockOffsets = other.mBlockOffsets;
+  mBlockLines = other.mBlockLines;
+  mBlockLinesWithAttributes = other.mBlockLinesWithAttributes;
+  mBlockUtf8Sizes = other.mBlockUtf8Sizes;
+}
+
+bool Document::GetReplacementFrom(const Document& older, Replacement* replacement) const {
+  auto blocksEqual = [](const std::shared_ptr<TextBlock>& a, const std::shared_ptr<TextBlock>& b) {
+    return a == b || a->text() == b->text();
+  };
+  
+  // Skip the equal blocks at the start and at the end
+  int oldBlockCount = older.mBlocks.size();
+  int newBlockCount = mBlocks.size();
+  int prefixBlocks = 0;
+  while (prefixBlocks < oldBlockCount && prefixBlocks < newBlockCount &&
+         blocksEqual(older.mBlocks[prefixBlocks], mBlocks[prefixBlocks])) {
+    ++ prefixBlocks;
+  }
+  int suffixBlocks = 0;
+  while (prefixBlocks + suffixBlocks < oldBlockCount && prefixBlocks + suffixBlocks < newBlockCount &&
+         blocksEqual(older.mBlocks[oldBlockCount - 1 - suffixBlocks], mBlocks[newBlockCount - 1 - suffixBlocks])) {
+    ++ suffixBlocks;
+  }
+  if (prefixBlocks + suffixBlocks == oldBlockCount && oldBlockCount == newBlockCount) {
+    return false;
+  }
+  
+  QString oldText;
+  for (int b = prefixBlocks; b < oldBlockCount - suffixBlocks; ++ b) {
+    oldText += older.mBlocks[b]->text();
+  }
+  QString newText;
+  for (int b = prefixBlocks; b < newBlockCount - suffixBlocks; ++ b) {
+    newText += mBlocks[b]->text();
+  }
+  
+  // Skip the equal characters at the start and at the end of the remaining
+  // text, without splitting surrogate pairs
+  int prefixChars = 0;
+  while (prefixChars < oldText.size() && prefixChars < newText.size() &&
+         oldText[prefixChars] == newText[prefixChars]) {
+    ++ prefixChars;
+  }
+  if (prefixChars > 0 && oldText[prefixChars - 1].isHighSurrogate()) {
+    -- prefixChars;
+  }
+  int suffixChars = 0;
+  while (prefixChars + suffixChars < oldText.size() && prefixChars + suffixChars < newText.size() &&
+         oldText[oldText.size() - 1 - suffixChars] == newText[newText.size() - 1 - suffixChars]) {
+    ++ suffixChars;
+  }
+  if (suffixChars > 0 && oldText[oldText.size() - suffixChars].isLowSurrogate()) {
+    -- suffixChars;
+  }
+  if (prefixChars + suffixChars == oldText.size() && oldText.size() == newText.size()) {
+    return false;
   }
+  
+  int start = older.mBlockOffsets.PrefixSum(prefixBlocks) + prefixChars;
+  replacement->range = DocumentRange(start, start + oldText.size() - prefixChars - suffixChars);
+  replacement->text = newText.mid(prefixChars, newText.size() - prefixChars - suffixChars);
+  return true;
 }
 
 bool Document::Open(const QString& path) {
@@ -433,63 +816,128 @@ bool Document::Open(const QString& path) {
   ++ mVersion;
   mSavedVersion = mVersion;
   ClearVersionGraph();
-  emit Changed();
+  ScheduleChangedSignal();
   return true;
 }
 
-bool Document::Save(const QString& path) {
-  QString pathCopy = path;  // Copy the path for the case that the passed-in reference goes to mPath
-  setPath(QStringLiteral(""));  // stop watching any old file
+void Document::Open(const QString& path, const QByteArray& content) {
+  setPath(QFileInfo(path).canonicalFilePath());
+  mFileName = QFileInfo(path).fileName();
   
-  QFile file(pathCopy);
-  if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-    return false;
-  }
+  ReadTextFromData(content.constData(), content.size());
   
-  for (int b = 0; b < mBlocks.size(); ++ b) {
-    QByteArray utf8Data = mBlocks[b]->text().toUtf8();
-    if (file.write(utf8Data) != utf8Data.size()) {
-      return false;
+  ++ mVersion;
+  mSavedVersion = mVersion;
+  ClearVersionGraph();
+  ScheduleChangedSignal();
+}
+
+/// Returns the offsets of the line starts in @p text, followed by the end
+/// offset of the last line (unless the text ends with a newline, in which case
+/// the last line start is that offset already).
+static void GetTextLineStarts(const QString& text, std::vector<int>* lineStarts) {
+  lineStarts->clear();
+  lineStarts->push_back(0);
+  for (int i = 0; i < text.size(); ++ i) {
+    if (text[i] == '\n') {
+      lineStarts->push_back(i + 1);
     }
   }
-  
-  file.close();
-  setPath(QFileInfo(pathCopy).canonicalFilePath());
-  mFileName = QFileInfo(pathCopy).fileName();
-  mSavedVersion = mVersion;
-  return true;
+  if (!text.isEmpty() && text[text.size() - 1] != '\n') {
+    lineStarts->push_back(text.size());
+  }
 }
 
-bool Document::OpenBackup(const QString& backupPath, QString* originalPath) {
-  QFile file(backupPath);
+bool Document::Reload() {
+  QFile file(mPath);
   if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
     return false;
   }
+  QByteArray newContent = file.readAll();
+  file.close();
+  if (newContent.contains('\r')) {
+    newContent.replace("\r\n", "\n");
+  }
   
-  *originalPath = QString::fromUtf8(file.readLine().chopped(1));
+  QString oldText = GetDocumentText();
+  std::vector<LineHunk> hunks;
+  if (!ComputeLineHunks(*GetDocumentTextUtf8(), newContent, &hunks)) {
+    return Open(mPath);
+  }
   
-  ReadTextFromFile(&file);
+  QString newText = QString::fromUtf8(newContent);
+  std::vector<int> oldLineStarts;
+  GetTextLineStarts(oldText, &oldLineStarts);
+  std::vector<int> newLineStarts;
+  GetTextLineStarts(newText, &newLineStarts);
   
+  std::vector<Replacement> replacements;
+  replacements.reserve(hunks.size());
+  for (const LineHunk& hunk : hunks) {
+    if (hunk.oldStart < 0 || hunk.oldStart + hunk.oldLines >= static_cast<int>(oldLineStarts.size()) ||
+        hunk.newStart < 0 || hunk.newStart + hunk.newLines >= static_cast<int>(newLineStarts.size())) {
+      qDebug() << "Document::Reload(): Got an invalid diff hunk, opening the file instead.";
+      return Open(mPath);
+    }
+    int newStartOffset = newLineStarts[hunk.newStart];
+    replacements.emplace_back(
+        DocumentRange(oldLineStarts[hunk.oldStart], oldLineStarts[hunk.oldStart + hunk.oldLines]),
+        newText.mid(newStartOffset, newLineStarts[hunk.newStart + hunk.newLines] - newStartOffset));
+  }
+  if (!replacements.empty()) {
+    ReplaceMany(replacements);
+  }
+  
+  FileStatCache::Instance().Invalidate(mPath);
+  mSavedVersion = mVersion;
+  ScheduleChangedSignal();
   return true;
 }
 
-bool Document::SaveBackup(const QString& backupPath, const QString& originalPath) {
-  QFile file(backupPath);
+bool Document::WriteToFile(const QString& path) const {
+  // Use QSaveFile such that the file is replaced atomically once it has been
+  // written completely. A crash or a write error thus does not leave a
+  // partially written file behind.
+  QSaveFile file(path);
   if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
     return false;
   }
-  
-  file.write(originalPath.toUtf8() + "\n");
-  
-  for (int b = 0; b < mBlocks.size(); ++ b) {
-    QByteArray utf8Data = mBlocks[b]->text().toUtf8();
-    if (file.write(utf8Data) != utf8Data.size()) {
-      return false;
-    }
+  return WriteTextToDevice(&file) && file.commit();
+}
+
+bool Document::Save(const QString& path) {
+  QString pathCopy = path;  // Copy the path for the case that the passed-in reference goes to mPath
+  if (watcher && !mPath.isEmpty()) {
+    watcher->removePath(mPath);  // stop watching the old file
+  }
+  bool success = WriteToFile(pathCopy);
+  FinishSave(pathCopy, mVersion, success);
+  return success;
+}
+
+std::shared_ptr<const DocumentSnapshot> Document::BeginSave() {
+  if (watcher && !mPath.isEmpty()) {
+    watcher->removePath(mPath);
+  }
+  return std::shared_ptr<const DocumentSnapshot>(new DocumentSnapshot(this));
+}
+
+bool Document::WriteSnapshot(const DocumentSnapshot& snapshot, const QString& path) {
+  return snapshot.document()->WriteToFile(path);
+}
+
+void Document::FinishSave(const QString& path, int savedVersion, bool success) {
+  // The old file is not watched anymore, so do not let setPath() remove it.
+  QString newPath = success ? path : mPath;
+  mPath.clear();
+  setPath(newPath);
+  if (!success) {
+    return;
   }
   
-  file.close();
-  return true;
+  FileStatCache::Instance().Invalidate(mPath);
+  mFileName = QFileInfo(path).fileName();
+  mSavedVersion = savedVersion;
 }
 
 void Document::Replace(const DocumentRange& range, const QString& newText, bool createUndoStep, Replacement* undoReplacement, bool forceNewUndoStep) {
@@ -542,95 +990,10 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
     qDebug() << "Replacement: " << newText;
   }
   
-  int firstBlockOffset;
-  int firstBlock = BlockForLocation(range.start, true, &firstBlockOffset);
-  int lastBlockOffset;
-  int lastBlock;
-  if (range.size() == 0) {
-    lastBlock = firstBlock;
-    lastBlockOffset = firstBlockOffset;
-  } else {
-    lastBlock = BlockForLocation(range.end, false, &lastBlockOffset);
-  }
+  bool affectsCode = !IsCommentOrWhitespaceReplacement(range, newText);
   
   QString oldText;
-  
-  if (firstBlock == lastBlock) {
-    TextBlock& block = *mBlocks[firstBlock];
-    DocumentRange localRange = DocumentRange(range.start.offset - firstBlockOffset,
-                                             range.end.offset - lastBlockOffset);
-    oldText = block.TextForRange(localRange);
-    block.Replace(
-        localRange, newText,
-        (firstBlock == 0) ? nullptr : mBlocks[firstBlock - 1].get(),
-        (firstBlock == mBlocks.size() - 1) ? nullptr : mBlocks[firstBlock + 1].get());
-    
-    CheckBlockSplitOrMerge(firstBlock);
-  } else {
-    // Get the old text to make the undo step later
-    oldText += mBlocks[firstBlock]->TextForRange(
-        DocumentRange(range.start.offset - firstBlockOffset,
-                      mBlocks[firstBlock]->text().size()));
-    for (int block = firstBlock + 1; block < lastBlock; ++ block) {
-      oldText += mBlocks[block]->text();
-    }
-    oldText += mBlocks[lastBlock]->TextForRange(
-        DocumentRange(0,
-                      range.end.offset - lastBlockOffset));
-    
-    // Replace the partial range in the last block with an empty string. This is
-    // done before inserting the new text in the first block to handle style
-    // updates properly (it makes the correct subsequent style available that
-    // may need to be extended into the replaced region).
-    mBlocks[lastBlock]->Replace(
-        DocumentRange(0,
-                      range.end.offset - lastBlockOffset),
-        QStringLiteral(""),
-        mBlocks[lastBlock - 1].get(),
-        (lastBlock == mBlocks.size() - 1) ? nullptr : mBlocks[lastBlock + 1].get());
-    
-    // Replace the partial range in the first block with the whole newText. Note
-    // that we tell Replace() here that the lastBlock is the following one
-    // already (although we only delete the in-between blocks below). This way,
-    // styles can be updated correctly.
-    mBlocks[firstBlock]->Replace(
-        DocumentRange(range.start.offset - firstBlockOffset,
-                      mBlocks[firstBlock]->text().size()),
-        newText,
-        (firstBlock == 0) ? nullptr : mBlocks[firstBlock - 1].get(),
-        mBlocks[lastBlock].get());
-    
-    // Delete the blocks in the middle
-    if (lastBlock > firstBlock + 1) {
-      mBlocks.erase(mBlocks.begin() + (firstBlock + 1), mBlocks.begin() + lastBlock);
-    }
-    
-    if (kDebug) {
-      qDebug() << "Blocks before split/merge:";
-      QString debugBlocks = "|";
-      for (int b = 0; b < mBlocks.size(); ++ b) {
-        for (int c = 0; c < mBlocks[b]->text().size(); ++ c) {
-          QChar character = mBlocks[b]->text()[c];
-          if (character == '\n') {
-            debugBlocks += "\\n";
-          } else {
-            debugBlocks += character;
-          }
-        }
-        
-        debugBlocks += "|";
-      }
-      std::cout << debugBlocks.toStdString() << std::endl;
-    }
-    
-    // Split/merge both remaining blocks. We call this on the second block
-    // first, since regardless of splitting or merging, this leaves the first
-    // block at the same index, such that we can also call the function on it
-    // later. The other way round, the indices would be likely to change, and
-    // we would lose track of the second block.
-    CheckBlockSplitOrMerge(firstBlock + 1);
-    CheckBlockSplitOrMerge(firstBlock);
-  }
+  ReplaceInBlocks(range, newText, &oldText, true);
   
   // Debug: Pretty-print the resulting blocks
   if (kDebug) {
@@ -652,141 +1015,12 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
     qDebug() << "-------------------";
   }
   
-  int shift = newText.size() - range.size();
-  DocumentLocation newRangeEnd = range.start + newText.size();
-  
-  // Adjust the problem ranges
-  // TODO: Would it be better to use a vector for the problem ranges to make it
-  //       faster to modify them?
-  std::set<ProblemRange> newProblemRanges;
-  
-  for (auto it = mProblemRanges.begin(), end = mProblemRanges.end(); it != end; ++ it) {
-    if (it->range.start >= range.end) {
-      newProblemRanges.insert(ProblemRange(DocumentRange(it->range.start + shift, it->range.end + shift), it->problemIndex));
-    } else if (it->range.start >= range.start) {
-      if (it->range.end <= range.end) {
-        // Delete the problem range
-      } else {
-        newProblemRanges.insert(ProblemRange(DocumentRange(newRangeEnd, it->range.end + shift), it->problemIndex));
-      }
-    } else if (it->range.end >= range.start) {
-      if (it->range.end > range.end) {
-        newProblemRanges.insert(ProblemRange(DocumentRange(it->range.start, it->range.end + shift), it->problemIndex));
-      } else {
-        newProblemRanges.insert(ProblemRange(DocumentRange(it->range.start, range.start), it->problemIndex));
-      }
-    } else {
-      // The problem range lies before the edit range, take it over unmodified.
-      newProblemRanges.insert(ProblemRange(it->range, it->problemIndex));
-    }
-  }
-  newProblemRanges.swap(mProblemRanges);
-  
-  // Adjust the fix-it ranges
-  for (const std::shared_ptr<Problem>& problem : mProblems) {
-    for (int i = 0; i < static_cast<int>(problem->fixits().size()); ++ i) {
-      Problem::FixIt& fixit = problem->fixits()[i];
-      
-      // TODO: This duplicates the logic above
-      if (fixit.range.start >= range.end) {
-        fixit.range = DocumentRange(fixit.range.start + shift, fixit.range.end + shift);
-      } else if (fixit.range.start >= range.start) {
-        if (fixit.range.end <= range.end) {
-          // Delete the fixit
-          problem->fixits().erase(problem->fixits().begin() + i);
-          -- i;
-          continue;
-        } else {
-          fixit.range = DocumentRange(newRangeEnd, fixit.range.end + shift);
-        }
-      } else if (fixit.range.end >= range.start) {
-        if (fixit.range.end > range.end) {
-          fixit.range = DocumentRange(fixit.range.start, fixit.range.end + shift);
-        } else {
-          fixit.range = DocumentRange(fixit.range.start, range.start);
-        }
-      } else {
-        // The problem range lies before the edit range, take it over unmodified.
-      }
-    }
-  }
-  
-  // Adjust the context ranges
-  // TODO: Would storing this as a vector be better to make modifications faster (no need to build a new set)?
-  std::set<Context> newContexts;
-  for (auto it = mContexts.begin(), end = mContexts.end(); it != end; ++ it) {
-    Context newContext = *it;
-    
-    // TODO: This duplicates the logic above
-    if (it->range.start >= range.end) {
-      newContext.range = DocumentRange(it->range.start + shift, it->range.end + shift);
-    } else if (it->range.start >= range.start) {
-      if (it->range.end <= range.end) {
-        // Delete the context
-        continue;
-      } else {
-        newContext.range = DocumentRange(newRangeEnd, it->range.end + shift);
-      }
-    } else if (it->range.end >= range.start) {
-      if (it->range.end > range.end) {
-        newContext.range = DocumentRange(it->range.start, it->range.end + shift);
-      } else {
-        newContext.range = DocumentRange(it->range.start, range.start);
-      }
-    } else {
-      // The problem range lies before the edit range, take it over unmodified.
-      newContext.range = it->range;
-    }
-    
-    newContexts.insert(newContext);
-  }
-  newContexts.swap(mContexts);
+  AdaptRangesToReplacements({Replacement{range, newText}});
   
   if (createUndoStep) {
     ++ mVersion;
     
-    // Delete any redo steps in case there are any: Go to the highest version,
-    // track back to the current version, deleting all versions that are not also
-    // referenced by another step.
-    std::vector<DocumentVersion*> redoList;
-    DocumentVersion* curItem = versionGraphRoot;
-    while (!curItem->links.empty()) {
-      int latestVersion = -1;
-      DocumentVersion* latestVersionPtr = nullptr;
-      for (const DocumentVersionLink& link : curItem->links) {
-        if (link.linkedVersion->version > latestVersion) {
-          latestVersion = link.linkedVersion->version;
-          latestVersionPtr = link.linkedVersion;
-        }
-      }
-      if (latestVersion < curItem->version) {
-        break;
-      }
-      if (!latestVersionPtr) {
-        qDebug() << "Error: This should never happen (only in case the version counter overflows)";
-        break;
-      }
-      
-      curItem = latestVersionPtr;
-      redoList.push_back(curItem);
-    }
-    
-    for (int i = static_cast<int>(redoList.size()) - 1; i >= 0; -- i) {
-      // TODO: Check whether this version needs to be kept due to being used by parsing
-      constexpr bool needsToBeKeptForParsing = false;
-      bool needsToBeKeptDueToExternalReference = !redoList[i]->links.empty();
-      if (needsToBeKeptForParsing || needsToBeKeptDueToExternalReference) {
-        // Finished deleting redo steps.
-        break;
-      }
-      
-      // Delete this node since it is not required anymore.
-      int backLinkIndex = redoList[i]->FindBackLink();
-      if (backLinkIndex >= 0) {
-        redoList[i]->towardsCurrentVersion->links.erase(redoList[i]->towardsCurrentVersion->links.begin() + backLinkIndex);
-      }
-      delete redoList[i];
-    }
+    DeleteRedoSteps();
     
     // Check whether the last undo step should be extended to include the current change.
     // Criteria:
@@ -800,7 +1034,8 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
     if (!forceNewUndoStep &&
         !creatingCombinedUndoStep &&
         versionGraphRoot->links.size() == 1 &&
-        versionGraphRoot->links[0].replacements.size() == 1) {
+        versionGraphRoot->links[0].replacements.size() == 1 &&
+        versionGraphRoot->links[0].replacements[0].compressedText.isEmpty()) {
       constexpr int kMaxMillisecondsForUndoMerging = 500;  // TODO: Make configurable
       QTime currentTime = QTime::currentTime();
       if (versionGraphRoot->creationTime.msecsTo(currentTime) <= kMaxMillisecondsForUndoMerging) {
@@ -833,6 +1068,21 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
           replacement.range = DocumentRange(range.start, range.start + newText.size());
           replacement.text = oldText + replacement.text;
           mergedUndoStep = true;
+        } else if (!replacement.text.isEmpty() &&
+                   replacement.text.size() == replacement.range.size() &&
+                   replacement.range.end == range.start &&
+                   !newText.isEmpty() &&
+                   newText.size() == oldText.size()) {
+          // Merge two overwrites of the same length (for example, typing in
+          // overwrite mode)
+          versionGraphRoot->creationTime = currentTime;
+          versionGraphRoot->version = mVersion;
+          replacement.range.end = range.start + newText.size();
+          replacement.text = replacement.text + oldText;
+          mergedUndoStep = true;
+        }
+        if (mergedUndoStep) {
+          mUndoMemoryUsageBound += oldText.size() * sizeof(QChar);
         }
       }
     }
@@ -850,16 +1100,15 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
         versionGraphRoot->towardsCurrentVersion = newVersion;
         newVersion->links.emplace_back(versionGraphRoot, undoReplacement);
         versionGraphRoot = newVersion;
+        AddedVersionLink(&newVersion->links.back());
       }
     }
     
-    emit Changed();
+    RecordTextReplacement(range, newText.size(), affectsCode);
+    ScheduleChangedSignal();
   } else {
     // In this case, we do not create an undo step and do not increase mVersion.
-    // As a side effect, the offset cache may be invalidated and would not be
-    // updated on the next access. So we force an update here.
-    // TODO: Would it be better to instead always increase mVersion?
-    UpdateOffsetCache();
+    RecordTextReplacement(range, newText.size(), affectsCode);
   }
   if (undoReplacement) {
     undoReplacement->range = DocumentRange(range.start, range.start + newText.size());
@@ -867,6 +1116,537 @@ void Document::Replace(const DocumentRange& range, const QString& newText, bool
   }
 }
 
+void Document::ReplaceMany(const std::vector<Replacement>& replacements, bool createUndoStep, std::vector<Replacement>* undoReplacements) {
+  if (replacements.empty()) {
+    return;
+  }
+  for (int i = 1, size = replacements.size(); i < size; ++ i) {
+    if (replacements[i].range.start < replacements[i - 1].range.end) {
+      qDebug() << "Error: ReplaceMany() called with unsorted or overlapping ranges";
+      return;
+    }
+  }
+  
+  // For many replacements, the listeners are not notified of each of them
+  // individually, since they would likely spend more time on updating for
+  // each replacement than on re-computing their state once.
+  constexpr int kMaxIndividuallyRecordedReplacements = 256;
+  bool recordIndividually = replacements.size() <= kMaxIndividuallyRecordedReplacements;
+  
+  // Apply the replacements back to front, such that the ranges of the
+  // remaining replacements stay valid. Splitting and merging the blocks is
+  // done once at the end.
+  std::vector<QString> oldTexts(replacements.size());
+  for (int i = static_cast<int>(replacements.size()) - 1; i >= 0; -- i) {
+    ReplaceInBlocks(replacements[i].range, replacements[i].text, &oldTexts[i], false);
+    if (recordIndividually) {
+      RecordTextReplacement(replacements[i].range, replacements[i].text.size());
+    }
+  }
+  NormalizeBlockSizes();
+  if (!recordIndividually) {
+    RecordUnmappableTextChange();
+  }
+  
+  AdaptRangesToReplacements(replacements);
+  
+  if (createUndoStep) {
+    ++ mVersion;
+    DeleteRedoSteps();
+    
+    // Record the undo replacements in the order in which the replacements were
+    // applied (the undo step reverses this order, see EndUndoStep()).
+    bool ownUndoStep = !creatingCombinedUndoStep;
+    if (ownUndoStep) {
+      StartUndoStep();
+    }
+    combinedUndoReplacements.reserve(combinedUndoReplacements.size() + replacements.size());
+    for (int i = static_cast<int>(replacements.size()) - 1; i >= 0; -- i) {
+      Replacement undoReplacement;
+      undoReplacement.range = DocumentRange(replacements[i].range.start, replacements[i].range.start + replacements[i].text.size());
+      undoReplacement.text.swap(oldTexts[i]);
+      combinedUndoReplacements.push_back(std::move(undoReplacement));
+    }
+    if (ownUndoStep) {
+      EndUndoStep();
+    }
+    
+    ScheduleChangedSignal();
+  } else if (undoReplacements) {
+    // Reverting the replacements front to back keeps the ranges of the
+    // remaining ones valid, since each restores the text before the next one.
+    undoReplacements->resize(replacements.size());
+    for (int i = 0, size = replacements.size(); i < size; ++ i) {
+      Replacement& undoReplacement = (*undoReplacements)[i];
+      undoReplacement.range = DocumentRange(replacements[i].range.start, replacements[i].range.start + replacements[i].text.size());
+      undoReplacement.text.swap(oldTexts[i]);
+    }
+  }
+}
+
+bool Document::IsCommentOrWhitespaceReplacement(const DocumentRange& range, const QString& newText) {
+  // Larger replacements are not the result of typing, and not worth checking.
+  constexpr int kMaxCheckedSize = 256;
+  if (range.size() > kMaxCheckedSize || newText.size() > kMaxCheckedSize ||
+      range.start.offset <= 0 ||
+      (range.size() == 0 && newText.isEmpty())) {
+    return false;
+  }
+  
+  // Get the characters around and within the replaced range, and whether they
+  // are highlighted as non-code (comments, literals, or include paths).
+  CharacterAndStyleIterator it(this, range.start.offset - 1);
+  if (!it.IsValid()) {
+    return false;
+  }
+  QChar prevChar = it.GetChar();
+  bool prevIsNonCode = it.GetStyleOfLayer(0).isNonCodeRange;
+  
+  QString oldText;
+  oldText.reserve(range.size());
+  bool oldTextIsNonCode = true;
+  for (int i = 0; i < range.size(); ++ i) {
+    ++ it;
+    if (!it.IsValid()) {
+      return false;
+    }
+    oldText += it.GetChar();
+    oldTextIsNonCode &= it.GetStyleOfLayer(0).isNonCodeRange;
+  }
+  ++ it;
+  bool haveNext = it.IsValid();
+  QChar nextChar = haveNext ? it.GetChar() : QChar();
+  bool nextIsNonCode = haveNext && it.GetStyleOfLayer(0).isNonCodeRange;
+  
+  // Backslashes may continue lines, so be conservative with them.
+  if (prevChar == '\\' || nextChar == '\\' || oldText.contains('\\') || newText.contains('\\')) {
+    return false;
+  }
+  
+  auto isBlank = [](const QString& text) {
+    for (QChar c : text) {
+      if (c != ' ' && c != '\t') {
+        return false;
+      }
+    }
+    return true;
+  };
+  
+  if (!prevIsNonCode) {
+    // Whitespace in code: the adjacent tokens must be separated after the
+    // replacement if and only if they were separated before. Newlines are not
+    // allowed since they end preprocessor directives.
+    if (!isBlank(oldText) || !isBlank(newText)) {
+      return false;
+    }
+    bool separatedAnyway = prevChar.isSpace() || !haveNext || nextChar.isSpace();
+    return separatedAnyway || (!oldText.isEmpty() && !newText.isEmpty());
+  }
+  
+  // Within non-code ranges, only replacements in comments are considered.
+  // Find the start of the non-code range to see whether it is a comment.
+  if (!oldTextIsNonCode) {
+    return false;
+  }
+  int rangeStart = range.start.offset - 1;
+  CharacterAndStyleIterator startIt(this, rangeStart);
+  QChar rightChar = prevChar;
+  while (rangeStart > 0) {
+    -- startIt;
+    if (!startIt.GetStyleOfLayer(0).isNonCodeRange) {
+      break;
+    }
+    if (startIt.GetChar() == '*' && rightChar == '/') {
+      // The end of a block comment, directly followed by another non-code range
+      return false;
+    }
+    rightChar = startIt.GetChar();
+    -- rangeStart;
+  }
+  if (range.start.offset < rangeStart + 2) {
+    return false;
+  }
+  QString opener = TextForRange(DocumentRange(rangeStart, rangeStart + 2));
+  
+  if (opener == QStringLiteral("/*")) {
+    // The replacement must neither touch the end of the comment nor end it
+    // early.
+    QString oldWindow = prevChar + oldText + nextChar;
+    QString newWindow = prevChar + newText + nextChar;
+    return nextIsNonCode &&
+           !oldWindow.contains(QStringLiteral("*/")) &&
+           !newWindow.contains(QStringLiteral("*/"));
+  } else if (opener == QStringLiteral("//")) {
+    // Line comments end at the next newline.
+    return (nextIsNonCode || !haveNext || nextChar == '\n') &&
+           !oldText.contains('\n') &&
+           !newText.contains('\n');
+  }
+  return false;
+}
+
+void Document::ReplaceInBlocks(const DocumentRange& range, const QString& newText, QString* oldText, bool checkBlockSizes) {
+  mLastEditOffset = range.start.offset;
+  mLastEditTimer.start();
+  ScheduleBlockCompaction();
+  
+  if (checkBlockSizes && newText.size() >= 2 * LargeBlockSize()) {
+    // Large insertions (for example, pasting a log file) are split into blocks
+    // directly, instead of inserting the whole text into one block and
+    // splitting that afterwards.
+    if (range.size() > 0) {
+      ReplaceInBlocks(range, QStringLiteral(""), oldText, true);
+    }
+    InsertLargeText(range.start, newText);
+    mLastEditOffset = range.start.offset + newText.size();
+    return;
+  }
+  
+  int firstBlockOffset;
+  int firstBlock = BlockForLocation(range.start, true, &firstBlockOffset);
+  int lastBlockOffset;
+  int lastBlock;
+  if (range.size() == 0) {
+    lastBlock = firstBlock;
+    lastBlockOffset = firstBlockOffset;
+  } else {
+    lastBlock = BlockForLocation(range.end, false, &lastBlockOffset);
+  }
+  
+  if (firstBlock == lastBlock) {
+    TextBlock& block = MutableBlock(firstBlock);
+    DocumentRange localRange = DocumentRange(range.start.offset - firstBlockOffset,
+                                             range.end.offset - lastBlockOffset);
+    *oldText = block.TextForRange(localRange);
+    block.Replace(
+        localRange, newText,
+        (firstBlock == 0) ? nullptr : mBlocks[firstBlock - 1].get(),
+        (firstBlock == mBlocks.size() - 1) ? nullptr : mBlocks[firstBlock + 1].get());
+    UpdateBlockIndex(firstBlock);
+    
+    if (checkBlockSizes) {
+      CheckBlockSplitOrMerge(firstBlock);
+    }
+  } else {
+    // Get the old text to make the undo step later
+    *oldText += mBlocks[firstBlock]->TextForRange(
+        DocumentRange(range.start.offset - firstBlockOffset,
+                      mBlocks[firstBlock]->text().size()));
+    for (int block = firstBlock + 1; block < lastBlock; ++ block) {
+      *oldText += mBlocks[block]->text();
+    }
+    *oldText += mBlocks[lastBlock]->TextForRange(
+        DocumentRange(0,
+                      range.end.offset - lastBlockOffset));
+    
+    // Replace the partial range in the last block with an empty string. This is
+    // done before inserting the new text in the first block to handle style
+    // updates properly (it makes the correct subsequent style available that
+    // may need to be extended into the replaced region).
+    MutableBlock(lastBlock).Replace(
+        DocumentRange(0,
+                      range.end.offset - lastBlockOffset),
+        QStringLiteral(""),
+        mBlocks[lastBlock - 1].get(),
+        (lastBlock == mBlocks.size() - 1) ? nullptr : mBlocks[lastBlock + 1].get());
+    
+    // Replace the partial range in the first block with the whole newText. Note
+    // that we tell Replace() here that the lastBlock is the following one
+    // already (although we only delete the in-between blocks below). This way,
+    // styles can be updated correctly.
+    MutableBlock(firstBlock).Replace(
+        DocumentRange(range.start.offset - firstBlockOffset,
+                      mBlocks[firstBlock]->text().size()),
+        newText,
+        (firstBlock == 0) ? nullptr : mBlocks[firstBlock - 1].get(),
+        mBlocks[lastBlock].get());
+    
+    // Delete the blocks in the middle
+    if (lastBlock > firstBlock + 1) {
+      mBlocks.erase(mBlocks.begin() + (firstBlock + 1), mBlocks.begin() + lastBlock);
+      RebuildBlockIndex();
+    } else {
+      UpdateBlockIndex(firstBlock);
+      UpdateBlockIndex(lastBlock);
+    }
+    
+    // Split/merge both remaining blocks. We call this on the second block
+    // first, since regardless of splitting or merging, this leaves the first
+    // block at the same index, such that we can also call the function on it
+    // later. The other way round, the indices would be likely to change, and
+    // we would lose track of the second block.
+    if (checkBlockSizes) {
+      CheckBlockSplitOrMerge(firstBlock + 1);
+      CheckBlockSplitOrMerge(firstBlock);
+    }
+  }
+}
+
+void Document::InsertLargeText(const DocumentLocation& location, const QString& text) {
+  // Split the text into chunks of the large block size, such that no surrogate
+  // pair is split (as for reading files, see Open()).
+  int largeBlockSize = LargeBlockSize();
+  int numChunks = std::max(1, (text.size() + largeBlockSize / 2) / largeBlockSize);
+  std::vector<int> chunkStarts(numChunks + 1);
+  chunkStarts[0] = 0;
+  chunkStarts[numChunks] = text.size();
+  for (int i = 1; i < numChunks; ++ i) {
+    int pos = (static_cast<qint64>(i) * text.size()) / numChunks;
+    if (pos > chunkStarts[i - 1] + 1 && text[pos].isLowSurrogate()) {
+      -- pos;
+    }
+    chunkStarts[i] = pos;
+  }
+  
+  // Insert the first chunk into the block at the insertion point, as for
+  // regular replacements, which also extends the styles at this point. Then,
+  // split off the remaining part of this block.
+  int blockOffset;
+  int blockIndex = BlockForLocation(location, false, &blockOffset);
+  int localOffset = location.offset - blockOffset;
+  TextBlock& block = MutableBlock(blockIndex);
+  block.Replace(
+      DocumentRange(localOffset, localOffset), text.left(chunkStarts[1]),
+      (blockIndex == 0) ? nullptr : mBlocks[blockIndex - 1].get(),
+      (blockIndex == mBlocks.size() - 1) ? nullptr : mBlocks[blockIndex + 1].get());
+  int splitOffset = localOffset + chunkStarts[1];
+  std::shared_ptr<TextBlock> remainder;
+  if (splitOffset < block.text().size()) {
+    remainder = block.SplitAt(splitOffset, mBlockPool);
+  }
+  
+  // Create the blocks for the other chunks, using multiple threads for large
+  // texts.
+  std::vector<std::shared_ptr<TextBlock>> newBlocks(numChunks - 1 + (remainder ? 1 : 0));
+  auto createBlocks = [&](int firstChunk, int endChunk) {
+    for (int i = firstChunk; i < endChunk; ++ i) {
+      newBlocks[i - 1] = TextBlockPool::MakeBlock(mBlockPool, text.mid(chunkStarts[i], chunkStarts[i + 1] - chunkStarts[i]), false);
+    }
+  };
+  int threadCount = (text.size() < kMinTextSizeForParallelBlockCreation) ? 1 : std::max<int>(1, std::thread::hardware_concurrency());
+  if (threadCount == 1) {
+    createBlocks(1, numChunks);
+  } else {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++ t) {
+      threads.emplace_back(createBlocks,
+                           1 + (static_cast<qint64>(t) * (numChunks - 1)) / threadCount,
+                           1 + (static_cast<qint64>(t + 1) * (numChunks - 1)) / threadCount);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  if (remainder) {
+    newBlocks.back() = remainder;
+  }
+  
+  // Splice in all new blocks at once.
+  mBlocks.insert(mBlocks.begin() + (blockIndex + 1), newBlocks.begin(), newBlocks.end());
+  RebuildBlockIndex();
+  
+  // Only the blocks at both ends of the inserted text may have an unsuitable
+  // size. See ReplaceInBlocks() for the order of the calls.
+  if (remainder) {
+    CheckBlockSplitOrMerge(blockIndex + newBlocks.size());
+  }
+  CheckBlockSplitOrMerge(blockIndex);
+}
+
+void Document::NormalizeBlockSizes() {
+  int minBlockSize = std::max(1, desiredBlockSize / 2);
+  auto mutableBlock = [this](std::shared_ptr<TextBlock>& block) -> TextBlock& {
+    if (block.use_count() > 1) {
+      block = TextBlockPool::MakeBlock(mBlockPool, *block);
+    }
+    return *block;
+  };
+  
+  // Build the new block list in a single pass: Merge each too small block with
+  // the following one, and split each too large block. Large blocks in
+  // untouched parts of the document are kept.
+  std::vector<std::shared_ptr<TextBlock>> oldBlocks;
+  oldBlocks.swap(mBlocks);
+  mBlocks.reserve(oldBlocks.size());
+  for (std::shared_ptr<TextBlock>& block : oldBlocks) {
+    if (!mBlocks.empty() && mBlocks.back()->text().size() < minBlockSize) {
+      mutableBlock(mBlocks.back()).Append(*block);
+      block.reset();
+    } else {
+      mBlocks.push_back(std::move(block));
+    }
+    
+    if (mBlocks.back()->text().size() >= 2 * LargeBlockSize()) {
+      std::vector<std::shared_ptr<TextBlock>> newBlocks = mutableBlock(mBlocks.back()).Split(LargeBlockSize(), mBlockPool);
+      mBlocks.insert(mBlocks.end(), newBlocks.begin(), newBlocks.end());
+    }
+  }
+  
+  // The last block may still be too small.
+  if (mBlocks.size() >= 2 && mBlocks.back()->text().size() < minBlockSize) {
+    mutableBlock(mBlocks[mBlocks.size() - 2]).Append(*mBlocks.back());
+    mBlocks.pop_back();
+    if (mBlocks.back()->text().size() >= 2 * LargeBlockSize()) {
+      std::vector<std::shared_ptr<TextBlock>> newBlocks = mutableBlock(mBlocks.back()).Split(LargeBlockSize(), mBlockPool);
+      mBlocks.insert(mBlocks.end(), newBlocks.begin(), newBlocks.end());
+    }
+  }
+  
+  RebuildBlockIndex();
+}
+
+/// Returns a key for each of the @p problems that combines its
+/// Problem::ContentHash() with its ranges in @p problemRanges.
+static std::vector<std::size_t> GetProblemKeys(const std::vector<std::shared_ptr<Problem>>& problems, const std::set<ProblemRange>& problemRanges) {
+  std::vector<std::size_t> keys(problems.size());
+  for (int i = 0, size = problems.size(); i < size; ++ i) {
+    keys[i] = problems[i]->ContentHash();
+  }
+  for (const ProblemRange& problemRange : problemRanges) {
+    std::size_t& key = keys[problemRange.problemIndex];
+    key ^= std::hash<int>()(problemRange.range.start.offset) + 0x9e3779b9 + (key << 6) + (key >> 2);
+    key ^= std::hash<int>()(problemRange.range.end.offset) + 0x9e3779b9 + (key << 6) + (key >> 2);
+  }
+  return keys;
+}
+
+/// Adapts @p range to the replacement of @p replacedRange with a text of size
+/// @p newTextSize. Returns false if the range gets deleted.
+static bool AdaptRangeToReplacement(DocumentRange* range, const DocumentRange& replacedRange, int newTextSize) {
+  int shift = newTextSize - replacedRange.size();
+  DocumentLocation newRangeEnd = replacedRange.start + newTextSize;
+  
+  if (range->start >= replacedRange.end) {
+    *range = DocumentRange(range->start + shift, range->end + shift);
+  } else if (range->start >= replacedRange.start) {
+    if (range->end <= replacedRange.end) {
+      return false;
+    } else {
+      *range = DocumentRange(newRangeEnd, range->end + shift);
+    }
+  } else if (range->end >= replacedRange.start) {
+    if (range->end > replacedRange.end) {
+      *range = DocumentRange(range->start, range->end + shift);
+    } else {
+      *range = DocumentRange(range->start, replacedRange.start);
+    }
+  } else {
+    // The range lies before the replaced range, keep it unmodified.
+  }
+  return true;
+}
+
+void Document::AdaptRangesToReplacements(const std::vector<Replacement>& replacements) {
+  // shiftBefore[i] is the total size change of the replacements before the
+  // one with index i.
+  std::vector<int> shiftBefore(replacements.size() + 1);
+  shiftBefore[0] = 0;
+  for (int i = 0, size = replacements.size(); i < size; ++ i) {
+    shiftBefore[i + 1] = shiftBefore[i] + replacements[i].text.size() - replacements[i].range.size();
+  }
+  
+  // Applies the replacements to the range (as if they were applied one by one
+  // from back to front). Only the replacements that overlap or touch the range
+  // need to be considered individually, the ones before it only shift it.
+  // Returns false if the range gets deleted.
+  auto adaptRange = [&](DocumentRange* range) {
+    int firstIndex = std::partition_point(replacements.begin(), replacements.end(), [&](const Replacement& replacement) {
+      return replacement.range.end <= range->start;
+    }) - replacements.begin();
+    int endIndex = std::partition_point(replacements.begin() + firstIndex, replacements.end(), [&](const Replacement& replacement) {
+      return replacement.range.start <= range->end;
+    }) - replacements.begin();
+    
+    for (int i = endIndex - 1; i >= firstIndex; -- i) {
+      if (!AdaptRangeToReplacement(range, replacements[i].range, replacements[i].text.size())) {
+        return false;
+      }
+    }
+    *range = DocumentRange(range->start + shiftBefore[firstIndex], range->end + shiftBefore[firstIndex]);
+    return true;
+  };
+  
+  // Adjust the problem ranges
+  // TODO: Would it be better to use a vector for the problem ranges to make it
+  //       faster to modify them?
+  std::set<ProblemRange> newProblemRanges;
+  for (const ProblemRange& problemRange : mProblemRanges) {
+    DocumentRange range = problemRange.range;
+    if (adaptRange(&range)) {
+      newProblemRanges.insert(newProblemRanges.end(), ProblemRange(range, problemRange.problemIndex));
+    }
+  }
+  newProblemRanges.swap(mProblemRanges);
+  
+  // Adjust the fix-it ranges
+  for (const std::shared_ptr<Problem>& problem : mProblems) {
+    std::vector<Problem::FixIt>& fixits = problem->fixits();
+    for (int i = 0; i < static_cast<int>(fixits.size()); ++ i) {
+      if (!adaptRange(&fixits[i].range)) {
+        fixits.erase(fixits.begin() + i);
+        -- i;
+      }
+    }
+  }
+  
+  // Adjust the context ranges
+  // TODO: Would storing this as a vector be better to make modifications faster (no need to build a new set)?
+  std::set<Context> newContexts;
+  for (const Context& context : mContexts) {
+    Context newContext = context;
+    if (adaptRange(&newContext.range)) {
+      newContexts.insert(newContext);
+    }
+  }
+  newContexts.swap(mContexts);
+  mContextIndexValid = false;
+}
+
+void Document::DeleteRedoSteps() {
+  // Delete any redo steps in case there are any: Go to the highest version,
+  // track back to the current version, deleting all versions that are not also
+  // referenced by another step.
+  std::vector<DocumentVersion*> redoList;
+  DocumentVersion* curItem = versionGraphRoot;
+  while (!curItem->links.empty()) {
+    int latestVersion = -1;
+    DocumentVersion* latestVersionPtr = nullptr;
+    for (const DocumentVersionLink& link : curItem->links) {
+      if (link.linkedVersion->version > latestVersion) {
+        latestVersion = link.linkedVersion->version;
+        latestVersionPtr = link.linkedVersion;
+      }
+    }
+    if (latestVersion < curItem->version) {
+      break;
+    }
+    if (!latestVersionPtr) {
+      qDebug() << "Error: This should never happen (only in case the version counter overflows)";
+      break;
+    }
+    
+    curItem = latestVersionPtr;
+    redoList.push_back(curItem);
+  }
+  
+  for (int i = static_cast<int>(redoList.size()) - 1; i >= 0; -- i) {
+    // TODO: Check whether this version needs to be kept due to being used by parsing
+    constexpr bool needsToBeKeptForParsing = false;
+    bool needsToBeKeptDueToExternalReference = !redoList[i]->links.empty();
+    if (needsToBeKeptForParsing || needsToBeKeptDueToExternalReference) {
+      // Finished deleting redo steps.
+      break;
+    }
+    
+    // Delete this node since it is not required anymore.
+    int backLinkIndex = redoList[i]->FindBackLink();
+    if (backLinkIndex >= 0) {
+      redoList[i]->towardsCurrentVersion->links.erase(redoList[i]->towardsCurrentVersion->links.begin() + backLinkIndex);
+    }
+    delete redoList[i];
+  }
+}
+
 void Document::StartUndoStep() {
   if (creatingCombinedUndoStep) {
     qDebug() << "ERROR: Called StartUndoStep() when creatingCombinedUndoStep was already true";
@@ -883,12 +1663,43 @@ void Document::EndUndoStep() {
   // Bring accumulated undo steps into the correct order
   std::reverse(combinedUndoReplacements.begin(), combinedUndoReplacements.end());
   
+  // Coalesce replacements of adjacent ranges, for example from replacing many
+  // consecutive occurrences. Each replacement's range refers to the text after
+  // applying the previous ones.
+  std::vector<Replacement> coalescedReplacements;
+  coalescedReplacements.reserve(combinedUndoReplacements.size());
+  for (Replacement& replacement : combinedUndoReplacements) {
+    if (!coalescedReplacements.empty()) {
+      Replacement& previous = coalescedReplacements.back();
+      if (replacement.range.start == previous.range.start + previous.text.size()) {
+        // The replacement directly follows the text inserted by the previous one.
+        int previousSizeChange = previous.text.size() - previous.range.size();
+        previous.range.end = replacement.range.end - previousSizeChange;
+        previous.text += replacement.text;
+        continue;
+      } else if (replacement.range.end == previous.range.start) {
+        // The replacement directly precedes the previous one.
+        previous.range.start = replacement.range.start;
+        previous.text = replacement.text + previous.text;
+        continue;
+      }
+    }
+    coalescedReplacements.emplace_back();
+    std::swap(coalescedReplacements.back(), replacement);
+  }
+  combinedUndoReplacements.clear();
+  
   // Add the new document version
   DocumentVersion* newVersion = new DocumentVersion(mVersion, nullptr);
   versionGraphRoot->towardsCurrentVersion = newVersion;
   newVersion->links.emplace_back(versionGraphRoot, std::vector<Replacement>());
-  newVersion->links.back().replacements.swap(combinedUndoReplacements);
+  newVersion->links.back().replacements.swap(coalescedReplacements);
   versionGraphRoot = newVersion;
+  AddedVersionLink(&newVersion->links.back());
+}
+
+void Document::SetUndoHistoryMemoryLimit(std::size_t bytes) {
+  UndoHistoryMemoryLimit() = bytes;
 }
 
 QString Document::TextForRange(const DocumentRange& range) {
@@ -933,7 +1744,7 @@ QString Document::TextForRange(const DocumentRange& range) {
 }
 
 void Document::CheckBlockSplitOrMerge(int index) {
-  TextBlock& block = *mBlocks[index];
+  const TextBlock& block = *mBlocks[index];
   int blockSize = block.text().size();
   
   if (blockSize < std::max(1, desiredBlockSize / 2)) {
@@ -956,20 +1767,60 @@ void Document::CheckBlockSplitOrMerge(int index) {
     
     if (prevBlockSize < nextBlockSize) {
       // Merge with previous block
-      mBlocks[index - 1]->Append(block);
+      MutableBlock(index - 1).Append(block);
       mBlocks.erase(mBlocks.begin() + index);
     } else {
       // Merge with next block
-      block.Append(*mBlocks[index + 1]);
+      MutableBlock(index).Append(*mBlocks[index + 1]);
       mBlocks.erase(mBlocks.begin() + (index + 1));
     }
+    RebuildBlockIndex();
   } else if (blockSize >= 2 * desiredBlockSize) {
     // The block is too large. Split it.
-    std::vector<std::shared_ptr<TextBlock>> newBlocks = block.Split(desiredBlockSize);
+    std::vector<std::shared_ptr<TextBlock>> newBlocks = MutableBlock(index).Split(desiredBlockSize, mBlockPool);
     mBlocks.insert(mBlocks.begin() + (index + 1), newBlocks.begin(), newBlocks.end());
+    RebuildBlockIndex();
+  }
+}
+
+void Document::CompactBlocks() {
+  int largeBlockSize = LargeBlockSize();
+  int keptRangeStart = mLastEditOffset - kSmallBlocksAroundLastEdit * desiredBlockSize;
+  int keptRangeEnd = mLastEditOffset + kSmallBlocksAroundLastEdit * desiredBlockSize;
+  
+  // Append each block to the previous one if both are outside of the range
+  // around the last edit and the result does not exceed the large block size.
+  std::vector<std::shared_ptr<TextBlock>> oldBlocks;
+  oldBlocks.swap(mBlocks);
+  mBlocks.reserve(oldBlocks.size());
+  bool previousIsMergeable = false;
+  int blockStart = 0;
+  for (std::shared_ptr<TextBlock>& block : oldBlocks) {
+    int blockSize = block->text().size();
+    int blockEnd = blockStart + blockSize;
+    bool isMergeable =
+        blockSize < largeBlockSize &&
+        (mLastEditOffset < 0 || blockEnd <= keptRangeStart || blockStart >= keptRangeEnd);
+    blockStart = blockEnd;
+    
+    if (isMergeable && previousIsMergeable &&
+        mBlocks.back()->text().size() + blockSize <= largeBlockSize) {
+      MutableBlock(mBlocks.size() - 1).Append(*block);
+    } else {
+      mBlocks.push_back(std::move(block));
+      previousIsMergeable = isMergeable;
+    }
+  }
+  
+  if (mBlocks.size() != oldBlocks.size()) {
+    RebuildBlockIndex();
   }
 }
 
+void Document::SetCompactBlocksWhenIdle(bool enable) {
+  mCompactBlocksWhenIdle = enable;
+}
+
 bool Document::Undo(DocumentRange* newTextRange) {
   return UndoRedoImpl(false, newTextRange);
 }
@@ -978,151 +1829,411 @@ bool Document::Redo(DocumentRange* newTextRange) {
   return UndoRedoImpl(true, newTextRange);
 }
 
-void Document::setPath(const QString &path) {
-  // Lazily create the file watcher if it does not exist yet
-  if (!watcher) {
-    RunInQtThreadBlocking([&]() {
-      watcher.reset(new QFileSystemWatcher());
-    });
-    connect(watcher.get(), &QFileSystemWatcher::fileChanged, this, &Document::FileWatcherNotification);
+void Document::setPath(const QString &path) {
+  // Lazily create the file watcher if it does not exist yet
+  if (!watcher) {
+    RunInQtThreadBlocking([&]() {
+      watcher.reset(new QFileSystemWatcher());
+    });
+    connect(watcher.get(), &QFileSystemWatcher::fileChanged, this, &Document::FileWatcherNotification);
+  }
+  
+  // Change the path.
+  if (!mPath.isEmpty()) {
+    watcher->removePath(mPath);
+  }
+  mPath = QFileInfo(path).canonicalFilePath();
+  if (!mPath.isEmpty()) {
+    watcher->addPath(mPath);
+  }
+  
+  mFileName = QFileInfo(mPath).fileName();
+}
+
+DocumentRange Document::FullDocumentRange() const {
+  return DocumentRange(0, mBlockOffsets.Total());
+}
+
+DocumentRange Document::RangeForWordAt(int characterOffset) const {
+  int blockStartOffset;
+  int blockIndex = BlockForCharacter(characterOffset, &blockStartOffset);
+  if (blockIndex < 0) {
+    return DocumentRange::Invalid();
+  }
+  
+  int wordType = GetCharType(mBlocks[blockIndex]->text()[characterOffset - blockStartOffset]);
+  if (wordType == static_cast<int>(CharacterType::Symbol)) {
+    return DocumentRange(characterOffset, characterOffset + 1);
+  }
+  
+  // Extend the word backwards, continuing in the previous block as long as
+  // the word reaches the start of the current one.
+  int firstCharacter = characterOffset;
+  int index = blockIndex;
+  int indexStartOffset = blockStartOffset;
+  while (true) {
+    const QString& text = mBlocks[index]->text();
+    int runStart = FindCharTypeRunStart(text.constData(), 0, firstCharacter - indexStartOffset, wordType, true);
+    firstCharacter = indexStartOffset + runStart;
+    if (runStart > 0 || index == 0) {
+      break;
+    }
+    -- index;
+    indexStartOffset -= mBlocks[index]->text().size();
+  }
+  
+  // Extend the word forwards in the same way.
+  int endCharacter = characterOffset + 1;
+  index = blockIndex;
+  indexStartOffset = blockStartOffset;
+  while (true) {
+    const QString& text = mBlocks[index]->text();
+    int runEnd = FindCharTypeRunEnd(text.constData(), endCharacter - indexStartOffset, text.size(), wordType, true);
+    endCharacter = indexStartOffset + runEnd;
+    if (runEnd < text.size() || index == mBlocks.size() - 1) {
+      break;
+    }
+    indexStartOffset += text.size();
+    ++ index;
+  }
+  
+  return DocumentRange(firstCharacter, endCharacter);
+}
+
+/// Returns the index of the given bracket type in Document::BracketSummary,
+/// or -1 if @p c is not a bracket.
+static int BracketTypeIndex(QChar c) {
+  if (c == '(' || c == ')') {
+    return 0;
+  } else if (c == '[' || c == ']') {
+    return 1;
+  } else if (c == '{' || c == '}') {
+    return 2;
+  }
+  return -1;
+}
+
+int Document::FindMatchingBracket(const CharacterAndStyleIterator& pos) {
+  QChar c = pos.GetChar();
+  int type = BracketTypeIndex(c);
+  if (type < 0) {
+    return -1;
   }
+  bool forwards = IsOpeningBracket(c);
+  QChar matchingBracket = GetMatchingBracketCharacter(c);
+  int bracketCounter = 1;
   
-  // Change the path.
-  if (!mPath.isEmpty()) {
-    watcher->removePath(mPath);
+  // Scan the remaining part of the block that contains the bracket.
+  int posOffset = pos.GetCharacterOffset();
+  int blockStartOffset;
+  int blockIndex = BlockForCharacter(posOffset, &blockStartOffset);
+  if (blockIndex < 0) {
+    return -1;
   }
-  mPath = QFileInfo(path).canonicalFilePath();
-  if (!mPath.isEmpty()) {
-    watcher->addPath(mPath);
+  int posInBlock = posOffset - blockStartOffset;
+  int blockSize = mBlocks[blockIndex]->text().size();
+  int match = forwards ?
+      ScanBlockForMatchingBracket(blockIndex, blockStartOffset, posInBlock + 1, blockSize, true, c, matchingBracket, &bracketCounter) :
+      ScanBlockForMatchingBracket(blockIndex, blockStartOffset, 0, posInBlock, false, c, matchingBracket, &bracketCounter);
+  if (match >= 0) {
+    return match;
   }
   
-  mFileName = QFileInfo(mPath).fileName();
+  // Skip over the following (or preceding) blocks whose brackets cannot
+  // reduce the counter to zero, and scan the first block that can.
+  // For backward search, the minimum over the suffixes of (closing - opening)
+  // brackets is given by minPrefix - net.
+  if (forwards) {
+    blockStartOffset += blockSize;
+    for (++ blockIndex; blockIndex < mBlocks.size(); ++ blockIndex) {
+      const BracketSummary& summary = GetBracketSummary(blockIndex);
+      blockSize = mBlocks[blockIndex]->text().size();
+      if (bracketCounter + summary.minPrefix[type] > 0) {
+        bracketCounter += summary.net[type];
+      } else {
+        return ScanBlockForMatchingBracket(blockIndex, blockStartOffset, 0, blockSize, true, c, matchingBracket, &bracketCounter);
+      }
+      blockStartOffset += blockSize;
+    }
+  } else {
+    for (-- blockIndex; blockIndex >= 0; -- blockIndex) {
+      const BracketSummary& summary = GetBracketSummary(blockIndex);
+      blockSize = mBlocks[blockIndex]->text().size();
+      blockStartOffset -= blockSize;
+      if (bracketCounter + summary.minPrefix[type] - summary.net[type] > 0) {
+        bracketCounter -= summary.net[type];
+      } else {
+        return ScanBlockForMatchingBracket(blockIndex, blockStartOffset, 0, blockSize, false, c, matchingBracket, &bracketCounter);
+      }
+    }
+  }
+  
+  // Did not find a matching bracket.
+  return -1;
 }
 
-DocumentRange Document::FullDocumentRange() const {
-  int size = 0;
-  for (int b = 0; b < mBlocks.size(); ++ b) {
-    size += mBlocks[b]->text().size();
+const Document::BracketSummary& Document::GetBracketSummary(int blockIndex) {
+  if (mBracketSummaries.size() != mBlocks.size()) {
+    mBracketSummaries.clear();
+    mBracketSummaries.resize(mBlocks.size());
+  }
+  BracketSummary& summary = mBracketSummaries[blockIndex];
+  if (summary.valid) {
+    return summary;
+  }
+  
+  for (int type = 0; type < BracketSummary::kTypeCount; ++ type) {
+    summary.net[type] = 0;
+    summary.minPrefix[type] = 0;
+  }
+  const TextBlock& block = *mBlocks[blockIndex];
+  const std::vector<TextBlock::StyleRange>& styleRanges = block.styleRanges(0);
+  for (int styleIndex = 0, numStyles = styleRanges.size(); styleIndex < numStyles; ++ styleIndex) {
+    if (mStyles[mRanges[0][styleRanges[styleIndex].rangeIndex].styleId].isNonCodeRange) {
+      continue;
+    }
+    int styleEnd = (styleIndex + 1 < numStyles) ? styleRanges[styleIndex + 1].start.offset : block.text().size();
+    for (int i = styleRanges[styleIndex].start.offset; i < styleEnd; ++ i) {
+      QChar c = block.text()[i];
+      int type = BracketTypeIndex(c);
+      if (type < 0) {
+        continue;
+      }
+      if (IsOpeningBracket(c)) {
+        ++ summary.net[type];
+      } else {
+        -- summary.net[type];
+        summary.minPrefix[type] = std::min(summary.minPrefix[type], summary.net[type]);
+      }
+    }
   }
-  return DocumentRange(0, size);
+  summary.valid = true;
+  return summary;
 }
 
-DocumentRange Document::RangeForWordAt(int characterOffset, const std::function<int(QChar)>& charClassifier, int noWordType) const {
-  CharacterIterator it(const_cast<Document*>(this), characterOffset);  // TODO: Avoid const_cast
-  if (!it.IsValid()) {
-    return DocumentRange::Invalid();
+void Document::FindIdentifierOccurrences(const QString& identifier, std::vector<DocumentRange>* occurrences) {
+  occurrences->clear();
+  if (identifier.isEmpty()) {
+    return;
   }
-  
-  int wordType = charClassifier(it.GetChar());
-  if (wordType == noWordType) {
-    return DocumentRange(characterOffset, characterOffset + 1);
+  for (QChar c : identifier) {
+    if (GetCharType(c) != static_cast<int>(CharacterType::Letter)) {
+      return;
+    }
   }
   
-  CharacterIterator prevIt(it);
-  int firstCharacter;
-  while (true) {
-    -- prevIt;
-    if (!prevIt.IsValid()) {
-      firstCharacter = 0;
-      break;
+  IdentifierIndex::Entry searchEntry;
+  searchEntry.hash = qHash(QStringRef(&identifier));
+  searchEntry.offset = -1;
+  
+  int blockStartOffset = 0;
+  bool previousBlockEndsWithIdentifier = false;
+  for (int blockIndex = 0; blockIndex < mBlocks.size(); ++ blockIndex) {
+    const QString& blockText = mBlocks[blockIndex]->text();
+    const IdentifierIndex& index = GetIdentifierIndex(blockIndex);
+    
+    // Identifiers within the block
+    for (auto it = std::lower_bound(index.entries.begin(), index.entries.end(), searchEntry);
+         it != index.entries.end() && it->hash == searchEntry.hash;
+         ++ it) {
+      if (it->size == identifier.size() &&
+          !(it->offset == 0 && previousBlockEndsWithIdentifier) &&
+          blockText.midRef(it->offset, it->size) == identifier) {
+        occurrences->emplace_back(blockStartOffset + it->offset, blockStartOffset + it->offset + it->size);
+      }
     }
     
-    QChar c = prevIt.GetChar();
-    if (c == '\n' || charClassifier(c) != wordType) {
-      firstCharacter = prevIt.GetCharacterOffset() + 1;
-      break;
+    // The identifier that starts in this block and extends to its end
+    if (index.trailingStart >= 0 &&
+        !(index.trailingStart == 0 && previousBlockEndsWithIdentifier)) {
+      int start = blockStartOffset + index.trailingStart;
+      CharacterIterator charIt(this, start);
+      int matchedSize = 0;
+      while (charIt.IsValid() && matchedSize < identifier.size() && charIt.GetChar() == identifier[matchedSize]) {
+        ++ charIt;
+        ++ matchedSize;
+      }
+      if (matchedSize == identifier.size() &&
+          (!charIt.IsValid() || GetCharType(charIt.GetChar()) != static_cast<int>(CharacterType::Letter))) {
+        occurrences->emplace_back(start, start + matchedSize);
+      }
     }
+    
+    previousBlockEndsWithIdentifier = index.trailingStart >= 0;
+    blockStartOffset += blockText.size();
+  }
+}
+
+const Document::IdentifierIndex& Document::GetIdentifierIndex(int blockIndex) {
+  if (mIdentifierIndexes.size() != mBlocks.size()) {
+    mIdentifierIndexes.clear();
+    mIdentifierIndexes.resize(mBlocks.size());
+  }
+  IdentifierIndex& index = mIdentifierIndexes[blockIndex];
+  if (index.valid) {
+    return index;
   }
   
-  int lastCharacter;
-  while (true) {
-    ++ it;
-    if (!it.IsValid()) {
-      lastCharacter = FullDocumentRange().end.offset - 1;
-      break;
+  index.entries.clear();
+  index.trailingStart = -1;
+  const QString& text = mBlocks[blockIndex]->text();
+  int size = text.size();
+  for (int i = 0; i < size; ) {
+    if (GetCharType(text[i]) != static_cast<int>(CharacterType::Letter)) {
+      ++ i;
+      continue;
     }
     
-    QChar c = it.GetChar();
-    if (c == '\n' || charClassifier(c) != wordType) {
-      lastCharacter = it.GetCharacterOffset() - 1;
+    int start = i;
+    i = FindCharTypeRunEnd(text.constData(), i, size, static_cast<int>(CharacterType::Letter), false);
+    if (i == size) {
+      index.trailingStart = start;
       break;
     }
+    
+    IdentifierIndex::Entry entry;
+    entry.hash = qHash(QStringRef(&text, start, i - start));
+    entry.offset = start;
+    entry.size = i - start;
+    index.entries.push_back(entry);
   }
+  std::sort(index.entries.begin(), index.entries.end());
+  index.entries.shrink_to_fit();
   
-  return DocumentRange(firstCharacter, lastCharacter + 1);
+  index.valid = true;
+  return index;
 }
 
-int Document::FindMatchingBracket(const CharacterAndStyleIterator& pos) {
-  QChar c = pos.GetChar();
-  if (IsOpeningBracket(c)) {
-    // Find the matching closing bracket to the right
-    const QChar& openBracket = c;
-    const QChar closeBracket = GetMatchingBracketCharacter(openBracket);
-    int bracketCounter = 1;
-    
-    Document::CharacterAndStyleIterator it = pos;
-    ++ it;
-    while (it.IsValid()) {
-      if (!it.GetStyleOfLayer(0).isNonCodeRange) {
-        QChar c = it.GetChar();
-        if (c == openBracket) {
-          ++ bracketCounter;
-        } else if (c == closeBracket) {
-          -- bracketCounter;
-          if (bracketCounter == 0) {
-            // Found the matching bracket.
-            return it.GetCharacterOffset();
-          }
-        }
+int Document::ScanBlockForMatchingBracket(int blockIndex, int blockStartOffset, int begin, int end, bool forwards, QChar bracket, QChar matchingBracket, int* counter) const {
+  if (begin >= end) {
+    return -1;
+  }
+  const TextBlock& block = *mBlocks[blockIndex];
+  const std::vector<TextBlock::StyleRange>& styleRanges = block.styleRanges(0);
+  int numStyles = styleRanges.size();
+  int styleIndex = block.FindStyleIndexForCharacter(forwards ? begin : (end - 1), 0);
+  if (styleIndex < 0) {
+    return -1;
+  }
+  
+  for (int step = 0; step < end - begin; ++ step) {
+    int i = forwards ? (begin + step) : (end - 1 - step);
+    if (forwards) {
+      while (styleIndex + 1 < numStyles && styleRanges[styleIndex + 1].start.offset <= i) {
+        ++ styleIndex;
       }
-      
-      ++ it;
-    }
-    // Did not find a matching bracket.
-  } else if (IsClosingBracket(c)) {
-    // Find the matching opening bracket to the left
-    const QChar& closeBracket = c;
-    const QChar openBracket = GetMatchingBracketCharacter(closeBracket);
-    int bracketCounter = 1;
+    } else {
+      while (styleIndex > 0 && styleRanges[styleIndex].start.offset > i) {
+        -- styleIndex;
+      }
+    }
+    if (mStyles[mRanges[0][styleRanges[styleIndex].rangeIndex].styleId].isNonCodeRange) {
+      continue;
+    }
     
-    Document::CharacterAndStyleIterator it = pos;
-    -- it;
-    while (it.IsValid()) {
-      if (!it.GetStyleOfLayer(0).isNonCodeRange) {
-        QChar c = it.GetChar();
-        if (c == closeBracket) {
-          ++ bracketCounter;
-        } else if (c == openBracket) {
-          -- bracketCounter;
-          if (bracketCounter == 0) {
-            // Found the matching bracket.
-            return it.GetCharacterOffset();
-          }
-        }
+    QChar c = block.text()[i];
+    if (c == bracket) {
+      ++ *counter;
+    } else if (c == matchingBracket) {
+      -- *counter;
+      if (*counter == 0) {
+        return blockStartOffset + i;
       }
-      
-      -- it;
     }
-    // Did not find a matching bracket.
   }
-  
   return -1;
 }
 
 int Document::LineCount() const {
-  int count = 0;
-  for (int b = 0; b < mBlocks.size(); ++ b) {
-    count += mBlocks[b]->lineAttributes().size();
+  return mBlockLines.Total();
+}
+
+int Document::LineForLocation(const DocumentLocation& location) const {
+  int blockStartOffset;
+  int blockIndex = BlockForCharacter(location.offset, &blockStartOffset);
+  if (blockIndex < 0) {
+    return (location.offset <= 0) ? 0 : (LineCount() - 1);
+  }
+  
+  // Count the lines that start in this block up to the location. Each entry in
+  // lineAttributes() stores the offset of the newline before its line start.
+  const std::vector<TextBlock::NewlineAttributes>& lineAttributes = mBlocks[blockIndex]->lineAttributes();
+  int offsetInBlock = location.offset - blockStartOffset;
+  auto it = std::upper_bound(
+      lineAttributes.begin(), lineAttributes.end(), offsetInBlock - 1,
+      [](int offset, const TextBlock::NewlineAttributes& attributes) {
+        return offset < attributes.offset;
+      });
+  return mBlockLines.PrefixSum(blockIndex) + static_cast<int>(it - lineAttributes.begin()) - 1;
+}
+
+DocumentLocation Document::LineStart(int line) const {
+  if (line < 0 || line >= LineCount()) {
+    return DocumentLocation::Invalid();
+  }
+  
+  int blockStartLine;
+  int blockIndex = mBlockLines.FindLastPrefixAtMost(line, &blockStartLine);
+  return mBlockOffsets.PrefixSum(blockIndex) + mBlocks[blockIndex]->lineAttributes()[line - blockStartLine].offset + 1;
+}
+
+void Document::GetLineStarts(std::vector<unsigned>* lineStarts) const {
+  lineStarts->clear();
+  lineStarts->reserve(LineCount());
+  
+  // Each entry in lineAttributes() stores the offset of the newline before its
+  // line start (or -1 for the first line), relative to the block.
+  int blockStartOffset = 0;
+  for (const std::shared_ptr<TextBlock>& block : mBlocks) {
+    for (const TextBlock::NewlineAttributes& attributes : block->lineAttributes()) {
+      lineStarts->push_back(blockStartOffset + attributes.offset + 1);
+    }
+    blockStartOffset += block->text().size();
+  }
+}
+
+int Document::Utf8OffsetForLocation(const DocumentLocation& location) const {
+  int blockStartOffset;
+  int blockIndex = BlockForCharacter(location.offset, &blockStartOffset);
+  if (blockIndex < 0) {
+    return (location.offset <= 0) ? 0 : Utf8Size();
+  }
+  return mBlockUtf8Sizes.PrefixSum(blockIndex) + mBlocks[blockIndex]->Utf8OffsetForCharacter(location.offset - blockStartOffset);
+}
+
+DocumentLocation Document::LocationForUtf8Offset(int utf8Offset) const {
+  if (utf8Offset <= 0) {
+    return DocumentLocation(0);
+  } else if (utf8Offset >= Utf8Size()) {
+    return FullDocumentRange().end;
   }
-  return count;
+  
+  int blockUtf8StartOffset;
+  int blockIndex = mBlockUtf8Sizes.FindLastPrefixAtMost(utf8Offset, &blockUtf8StartOffset);
+  return mBlockOffsets.PrefixSum(blockIndex) + mBlocks[blockIndex]->CharacterForUtf8Offset(utf8Offset - blockUtf8StartOffset);
 }
 
 bool Document::DebugCheckNewlineoffsets() const {
+  if (mBlockOffsets.size() != mBlocks.size() ||
+      mBlockLines.size() != mBlocks.size() ||
+      mBlockLinesWithAttributes.size() != mBlocks.size() ||
+      mBlockUtf8Sizes.size() != mBlocks.size()) {
+    qDebug() << "ERROR: DebugCheckNewlineoffsets(): The block index size does not match the block count";
+    return false;
+  }
+  
   for (int b = 0; b < mBlocks.size(); ++ b) {
     if (!mBlocks[b]->DebugCheckNewlineoffsets(b == 0)) {
       qDebug() << "ERROR: DebugCheckNewlineoffsets() failed for block" << b;
       return false;
     }
+    if (mBlockOffsets.Value(b) != mBlocks[b]->text().size() ||
+        mBlockLines.Value(b) != mBlocks[b]->lineAttributes().size() ||
+        mBlockLinesWithAttributes.Value(b) != mBlocks[b]->CountLinesWithAttributes() ||
+        mBlockUtf8Sizes.Value(b) != mBlocks[b]->utf8Size()) {
+      qDebug() << "ERROR: DebugCheckNewlineoffsets(): The block index is outdated for block" << b;
+      return false;
+    }
   }
   return true;
 }
@@ -1146,7 +2257,7 @@ bool Document::DebugCheckVersionGraph() const {
 //     }
 //     qDebug() << "====================================";
 //   }
-  
+
   std::unordered_set<DocumentVersion*> visited;
   std::vector<DocumentVersion*> workList = {versionGraphRoot};
   while (!workList.empty()) {
@@ -1199,33 +2310,226 @@ void Document::DebugGetBlockStatistics(int* blockCount, float* avgBlockSize, int
   *avgStyleRanges /= (TextBlock::kLayerCount * mBlocks.size());
 }
 
+/// Appends the UTF-8 encoding of the text of @p block to @p output. Since a
+/// surrogate pair may be split between blocks, a high surrogate at the end of
+/// the block is stored in @p pendingHighSurrogate instead, and prepended to the
+/// text of the next block. Blocks with ASCII text only (whose UTF-8 size equals
+/// their length) are copied directly, without going through
+/// QString::toUtf8(). This is the common case for source code.
+static void AppendBlockUtf8(const TextBlock& block, QChar* pendingHighSurrogate, QByteArray* output) {
+  const QString& text = block.text();
+  if (pendingHighSurrogate->isNull() && block.utf8Size() == text.size()) {
+    int oldSize = output->size();
+    output->resize(oldSize + text.size());
+    char* dest = output->data() + oldSize;
+    const QChar* src = text.constData();
+    for (int i = 0, size = text.size(); i < size; ++ i) {
+      dest[i] = static_cast<char>(src[i].unicode());
+    }
+    return;
+  }
+  
+  QString piece;
+  if (!pendingHighSurrogate->isNull()) {
+    piece += *pendingHighSurrogate;
+    *pendingHighSurrogate = QChar();
+  }
+  piece += text;
+  if (!piece.isEmpty() && piece.back().isHighSurrogate()) {
+    *pendingHighSurrogate = piece.back();
+    piece.chop(1);
+  }
+  output->append(piece.toUtf8());
+}
+
+/// Appends the high surrogate that may be left over from AppendBlockUtf8()
+/// after the last block (which is invalid UTF-16) to @p output.
+static void FinishBlocksUtf8(QChar* pendingHighSurrogate, QByteArray* output) {
+  if (!pendingHighSurrogate->isNull()) {
+    output->append(QString(*pendingHighSurrogate).toUtf8());
+    *pendingHighSurrogate = QChar();
+  }
+}
+
 QString Document::GetDocumentText() const {
   QString text = "";
+  text.reserve(mBlockOffsets.Total());
   for (int b = 0; b < mBlocks.size(); ++ b) {
     text += mBlocks[b]->text();
   }
   return text;
 }
 
+QByteArray Document::EncodeDocumentTextUtf8() const {
+  QByteArray text;
+  text.reserve(Utf8Size());
+  QChar pendingHighSurrogate;
+  for (int b = 0; b < mBlocks.size(); ++ b) {
+    AppendBlockUtf8(*mBlocks[b], &pendingHighSurrogate, &text);
+  }
+  FinishBlocksUtf8(&pendingHighSurrogate, &text);
+  return text;
+}
+
+std::shared_ptr<const QByteArray> Document::GetDocumentTextUtf8() {
+  if (!mUtf8Text || mUtf8TextCounter != mTextChangeCounter) {
+    mUtf8Text.reset(new QByteArray(EncodeDocumentTextUtf8()));
+    mUtf8TextCounter = mTextChangeCounter;
+  }
+  return mUtf8Text;
+}
+
+void Document::SetPublishSnapshots(bool enable) {
+  mPublishSnapshots = enable;
+  if (enable) {
+    UpdateSnapshot();
+  } else {
+    std::atomic_store(&mSnapshot, std::shared_ptr<const DocumentSnapshot>());
+  }
+}
+
+std::shared_ptr<const DocumentSnapshot> Document::UpdateSnapshot() {
+  std::shared_ptr<const DocumentSnapshot> snapshot = std::atomic_load(&mSnapshot);
+  if (!mPublishSnapshots ||
+      (snapshot &&
+       snapshot->textChangeCounter() == mTextChangeCounter &&
+       snapshot->version() == mVersion)) {
+    return snapshot;
+  }
+  
+  snapshot.reset(new DocumentSnapshot(this));
+  std::atomic_store(&mSnapshot, snapshot);
+  return snapshot;
+}
+
+void Document::ScheduleSnapshotUpdate() {
+  if (!mPublishSnapshots || mSnapshotUpdateScheduled) {
+    return;
+  }
+  mSnapshotUpdateScheduled = true;
+  
+  // Functions posted to the Qt thread run after the current event, so all
+  // changes that are made while processing it are covered by one snapshot.
+  QPointer<Document> document(this);
+  PostToQtThread([document]() {
+    if (document) {
+      document->mSnapshotUpdateScheduled = false;
+      document->UpdateSnapshot();
+    }
+  });
+}
+
+void Document::ScheduleChangedSignal() {
+  if (mChangedSignalScheduled) {
+    return;
+  }
+  if (!isSignalConnected(QMetaMethod::fromSignal(&Document::Changed))) {
+    mPendingChangedRange = DocumentRange::Invalid();
+    mPendingChangeIsUnmappable = false;
+    return;
+  }
+  mChangedSignalScheduled = true;
+  
+  // As for the snapshot updates, this runs after the current event.
+  QPointer<Document> document(this);
+  PostToQtThread([document]() {
+    if (!document) {
+      return;
+    }
+    DocumentRange changedRange = document->FullDocumentRange();
+    if (!document->mPendingChangeIsUnmappable && !document->mPendingChangedRange.IsInvalid()) {
+      changedRange = DocumentRange(
+          std::min(document->mPendingChangedRange.start.offset, changedRange.end.offset),
+          std::min(document->mPendingChangedRange.end.offset, changedRange.end.offset));
+    }
+    document->mChangedSignalScheduled = false;
+    document->mPendingChangedRange = DocumentRange::Invalid();
+    document->mPendingChangeIsUnmappable = false;
+    emit document->Changed(changedRange);
+  });
+}
+
+void Document::ScheduleBlockCompaction() {
+  if (!mCompactBlocksWhenIdle || mBlockCompactionScheduled) {
+    return;
+  }
+  mBlockCompactionScheduled = true;
+  
+  // Instead of restarting a timer on every edit, the timer checks when it
+  // fires whether there were edits in the meantime and waits for the remaining
+  // time in this case.
+  int delay = std::max<qint64>(0, kBlockCompactionDelayMs - mLastEditTimer.elapsed());
+  QTimer::singleShot(delay, this, [this]() {
+    mBlockCompactionScheduled = false;
+    if (!mCompactBlocksWhenIdle) {
+      return;
+    }
+    if (mLastEditTimer.elapsed() < kBlockCompactionDelayMs) {
+      ScheduleBlockCompaction();
+    } else {
+      CompactBlocks();
+    }
+  });
+}
+
+std::size_t Document::HashRangeContent(const DocumentRange& range) const {
+  std::size_t hash = std::hash<int>()(range.size());
+  auto combine = [&hash](std::size_t value) {
+    hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  };
+  
+  int blockStartOffset;
+  int blockIndex = range.IsEmpty() ? -1 : BlockForCharacter(range.start.offset, &blockStartOffset);
+  if (blockIndex < 0) {
+    return hash;
+  }
+  for (; blockIndex < mBlocks.size() && blockStartOffset < range.end.offset; ++ blockIndex) {
+    const TextBlock& block = *mBlocks[blockIndex];
+    int startInBlock = std::max(0, range.start.offset - blockStartOffset);
+    int endInBlock = std::min(block.text().size(), range.end.offset - blockStartOffset);
+    combine(std::hash<const TextBlock*>()(&block));
+    combine(startInBlock);
+    combine(endInBlock);
+    
+    // The style ranges refer to the highlight ranges of the document, so the
+    // resolved styles are hashed instead of the range indices
+    for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+      const std::vector<TextBlock::StyleRange>& styleRanges = block.styleRanges(layer);
+      int firstStyle = block.FindStyleIndexForCharacter(startInBlock, layer);
+      for (int i = std::max(0, firstStyle); i < styleRanges.size(); ++ i) {
+        if (i != firstStyle && styleRanges[i].start.offset >= endInBlock) {
+          break;
+        }
+        const HighlightStyle& style = mStyles[mRanges[layer][styleRanges[i].rangeIndex].styleId];
+        combine(std::max(startInBlock, styleRanges[i].start.offset));
+        combine(style.textColor.rgb());
+        combine(style.affectsText);
+      }
+    }
+    
+    blockStartOffset += block.text().size();
+  }
+  return hash;
+}
+
 int Document::BlockForLocation(const DocumentLocation& loc, bool forwards, int* blockStartOffset) const {
   if (loc.offset < 0) {
     return -1;
   }
   
-  EnsureOffsetCacheIsUpToDate();
-  
-  if (loc.offset > mBlocks.back()->GetCachedEndOffset()) {
+  int documentSize = mBlockOffsets.Total();
+  if (loc.offset > documentSize) {
     return -1;
   }
   // We handle this case by looking for the offset after (if forwards == true) or before (if forwards == false)
   // the given DocumentLocation. However, this does not work with empty blocks. This should however only
   // occur if the document is empty. Thus, handle this as a special case.
-  if (mBlocks.back()->GetCachedEndOffset() == 0) {
+  if (documentSize == 0) {
     // We already bounds-checked the given location, so just return the empty block.
     *blockStartOffset = 0;
     return 0;
   }
-  int searchOffset = std::max(0, std::min(static_cast<int>(mBlocks.back()->GetCachedEndOffset()) - 1, forwards ? loc.offset : (loc.offset - 1)));
+  int searchOffset = std::max(0, std::min(documentSize - 1, forwards ? loc.offset : (loc.offset - 1)));
   
   int result = BlockForCharacter(searchOffset, blockStartOffset);
   if (result < 0) {
@@ -1237,46 +2541,36 @@ int Document::BlockForLocation(const DocumentLocation& loc, bool forwards, int*
 int Document::BlockForCharacter(int characterOffset, int* blockStartOffset) const {
   // TODO: Cache the last used block (for this and similar functions)? Need a benchmark to see whether that would be useful.
   
-  if (characterOffset < 0) {
+  if (characterOffset < 0 || characterOffset >= mBlockOffsets.Total()) {
+    // qDebug() << "BlockForCharacter(): Invalid characterOffset given.";
     return -1;
   }
   
-  EnsureOffsetCacheIsUpToDate();
-  
-  int l = 0;
-  unsigned int lOffset = mBlocks[l]->GetCachedStartOffset();
-  int r = static_cast<int>(mBlocks.size()) - 1;
-  unsigned int rOffset = mBlocks[r]->GetCachedEndOffset();
+  return mBlockOffsets.FindLastPrefixAtMost(characterOffset, blockStartOffset);
+}
+
+HighlightStyle Document::MergeLayerStyles(const TextBlock& block, const int* styleInBlockIndex) const {
+  // Apply all layers of highlight ranges on top of each other.
+  int layer = 0;
+  int rangeIndex = block.styleRanges(layer)[styleInBlockIndex[layer]].rangeIndex;
+  HighlightStyle result = mStyles[mRanges[layer][rangeIndex].styleId];
   
-  while (l <= r) {
-    int blockIndex = l + (characterOffset - lOffset) / static_cast<float>(rOffset - lOffset) * (r - l) + 0.5f;
-    if (blockIndex < 0 || blockIndex >= mBlocks.size()) {
-      break;
-    }
+  for (layer = 1; layer < TextBlock::kLayerCount; ++ layer) {
+    rangeIndex = block.styleRanges(layer)[styleInBlockIndex[layer]].rangeIndex;
+    const HighlightStyle& highlight = mStyles[mRanges[layer][rangeIndex].styleId];
     
-    *blockStartOffset = mBlocks[blockIndex]->GetCachedStartOffset();
-    int blockEndOffset = mBlocks[blockIndex]->GetCachedEndOffset();
-    if (*blockStartOffset <= characterOffset && blockEndOffset > characterOffset) {
-      return blockIndex;
+    if (highlight.affectsText) {
+      result.affectsText = true;
+      result.textColor = highlight.textColor;
+      result.bold = highlight.bold;
     }
-    
-    if (characterOffset >= blockEndOffset) {
-      l = blockIndex + 1;
-      if (l >= mBlocks.size()) {
-        break;
-      }
-      lOffset = mBlocks[l]->GetCachedStartOffset();
-    } else {
-      r = blockIndex - 1;
-      if (r < 0) {
-        break;
-      }
-      rOffset = mBlocks[r]->GetCachedEndOffset();
+    if (highlight.affectsBackground) {
+      result.affectsBackground = true;
+      result.backgroundColor = highlight.backgroundColor;
     }
   }
   
-  // qDebug() << "BlockForCharacter(): Invalid characterOffset given.";
-  return -1;
+  return result;
 }
 
 DocumentLocation Document::Find(const QString& searchString, const DocumentLocation& searchStart, bool forwards, bool matchCase) {
@@ -1284,63 +2578,177 @@ DocumentLocation Document::Find(const QString& searchString, const DocumentLocat
     return DocumentLocation::Invalid();
   }
   
-  auto matches = [&](const QChar& a, const QChar& b) {
-    if (matchCase) {
-      return a == b;
-    } else {
-      return a.toLower() == b.toLower();
+  // The search runs directly on the text of the blocks. Occurrences that
+  // start in a block but extend into the following block(s) are searched for
+  // in a small buffer containing the end of the block and the start of the
+  // following text.
+  TextSearchPattern pattern(searchString, matchCase);
+  const int size = searchString.size();
+  const int documentSize = FullDocumentRange().end.offset;
+  
+  auto getBlockEndWithFollowingText = [&](int blockIndex, int startInBlock) {
+    QString buffer = mBlocks[blockIndex]->text().mid(startInBlock);
+    int followingCharacters = size - 1;
+    for (int b = blockIndex + 1; b < mBlocks.size() && followingCharacters > 0; ++ b) {
+      const QString& text = mBlocks[b]->text();
+      buffer += text.left(followingCharacters);
+      followingCharacters -= std::min(followingCharacters, text.size());
     }
+    return buffer;
   };
   
-  // NOTE: As a possible micro-optimization, could stop searching if the remaining
-  //       text in the document is too short to fit the search string into.
   if (forwards) {
-    Document::CharacterIterator it(this, searchStart.offset);
-    while (it.IsValid()) {
-      if (matches(it.GetChar(), searchString[0])) {
-        // The first character matches, test if the rest matches as well
-        Document::CharacterIterator testIt = it;
-        ++ testIt;
-        int i = 1;
-        for (; testIt.IsValid() && i < searchString.size(); ++ i, ++ testIt) {
-          if (!matches(testIt.GetChar(), searchString[i])) {
-            break;
-          }
+    // Range of the possible start offsets of an occurrence
+    const int minStart = std::max(0, searchStart.offset);
+    const int maxStart = documentSize - size;
+    if (minStart > maxStart) {
+      return DocumentLocation::Invalid();
+    }
+    
+    int blockStart;
+    int blockIndex = BlockForCharacter(minStart, &blockStart);
+    if (blockIndex < 0) {
+      return DocumentLocation::Invalid();
+    }
+    for (; blockIndex < mBlocks.size() && blockStart <= maxStart; ++ blockIndex) {
+      const QString& text = mBlocks[blockIndex]->text();
+      const int blockSize = text.size();
+      const int blockMinStart = std::max(minStart, blockStart);
+      const int blockMaxStart = std::min(maxStart, blockStart + blockSize - 1);
+      
+      // Occurrences within the block
+      const int innerMaxStart = std::min(blockMaxStart, blockStart + blockSize - size);
+      if (blockMinStart <= innerMaxStart) {
+        int result = pattern.FindForwards(text.constData(), blockMinStart - blockStart, innerMaxStart - blockStart);
+        if (result >= 0) {
+          return blockStart + result;
         }
-        if (i == searchString.size()) {
-          return it.GetCharacterOffset();
+      }
+      
+      // Occurrences that extend into the following block(s)
+      const int spanningMinStart = std::max(blockMinStart, blockStart + blockSize - size + 1);
+      if (spanningMinStart <= blockMaxStart) {
+        QString buffer = getBlockEndWithFollowingText(blockIndex, spanningMinStart - blockStart);
+        int result = pattern.FindForwards(buffer.constData(), 0, blockMaxStart - spanningMinStart);
+        if (result >= 0) {
+          return spanningMinStart + result;
         }
       }
-      ++ it;
-    };
+      
+      blockStart += blockSize;
+    }
   } else {
-    if (searchStart.offset == 0) {
+    // Range of the possible start offsets of an occurrence
+    const int maxStart = std::min(searchStart.offset, documentSize) - size;
+    if (maxStart < 0) {
       return DocumentLocation::Invalid();
     }
     
-    Document::CharacterIterator it(this, searchStart.offset - 1);
-    while (it.IsValid()) {
-      if (matches(it.GetChar(), searchString[searchString.size() - 1])) {
-        // The last character matches, test if the rest matches as well
-        Document::CharacterIterator testIt = it;
-        -- testIt;
-        int i = searchString.size() - 2;
-        for (; testIt.IsValid() && i >= 0; -- i, -- testIt) {
-          if (!matches(testIt.GetChar(), searchString[i])) {
-            break;
-          }
+    int blockStart;
+    int blockIndex = BlockForCharacter(maxStart, &blockStart);
+    if (blockIndex < 0) {
+      return DocumentLocation::Invalid();
+    }
+    for (; blockIndex >= 0; -- blockIndex) {
+      const QString& text = mBlocks[blockIndex]->text();
+      const int blockSize = text.size();
+      const int blockMaxStart = std::min(maxStart, blockStart + blockSize - 1);
+      
+      // Occurrences that extend into the following block(s)
+      const int spanningMinStart = std::max(blockStart, blockStart + blockSize - size + 1);
+      if (spanningMinStart <= blockMaxStart) {
+        QString buffer = getBlockEndWithFollowingText(blockIndex, spanningMinStart - blockStart);
+        int result = pattern.FindBackwards(buffer.constData(), 0, blockMaxStart - spanningMinStart);
+        if (result >= 0) {
+          return spanningMinStart + result;
         }
-        if (i == -1) {
-          return testIt.GetCharacterOffset() + 1;
+      }
+      
+      // Occurrences within the block
+      const int innerMaxStart = std::min(blockMaxStart, blockStart + blockSize - size);
+      if (blockStart <= innerMaxStart) {
+        int result = pattern.FindBackwards(text.constData(), 0, innerMaxStart - blockStart);
+        if (result >= 0) {
+          return blockStart + result;
         }
       }
-      -- it;
-    };
+      
+      if (blockIndex > 0) {
+        blockStart -= mBlocks[blockIndex - 1]->text().size();
+      }
+    }
   }
   
   return DocumentLocation::Invalid();
 }
 
+DocumentRange Document::FindRegex(const TextRegex& regex, const DocumentLocation& searchStart, bool forwards) {
+  TextRegexMatcher matcher(regex);
+  const int documentSize = FullDocumentRange().end.offset;
+  DocumentRange match;
+  
+  if (forwards) {
+    if (FindRegexMatch(&matcher, std::max(0, searchStart.offset), documentSize, &match)) {
+      return match;
+    }
+    return DocumentRange::Invalid();
+  }
+  
+  // The matches are defined from the start of the document on (since a match
+  // may overlap with a match that starts later), so find the last one of them
+  // that ends before searchStart.
+  const int end = std::min(searchStart.offset, documentSize);
+  DocumentRange lastMatch = DocumentRange::Invalid();
+  int offset = 0;
+  while (offset < end && FindRegexMatch(&matcher, offset, end, &match)) {
+    lastMatch = match;
+    offset = match.end.offset;
+  }
+  return lastMatch;
+}
+
+void Document::FindAllRegex(const TextRegex& regex, const DocumentRange& range, std::vector<DocumentRange>* matches) {
+  TextRegexMatcher matcher(regex);
+  DocumentRange match;
+  int offset = range.start.offset;
+  while (offset < range.end.offset && FindRegexMatch(&matcher, offset, range.end.offset, &match)) {
+    matches->push_back(match);
+    offset = match.end.offset;
+  }
+}
+
+bool Document::FindRegexMatch(TextRegexMatcher* matcher, int start, int end, DocumentRange* match) {
+  auto characterAt = [&](int offset) {
+    int blockStart;
+    int blockIndex = BlockForCharacter(offset, &blockStart);
+    return (blockIndex < 0) ? -1 : static_cast<int>(mBlocks[blockIndex]->text()[offset - blockStart].unicode());
+  };
+  
+  matcher->Reset(start, (start > 0) ? characterAt(start - 1) : -1);
+  
+  int blockStart;
+  int blockIndex = (start < end) ? BlockForCharacter(start, &blockStart) : -1;
+  if (blockIndex >= 0) {
+    for (; blockIndex < mBlocks.size() && blockStart < end; ++ blockIndex) {
+      const QString& text = mBlocks[blockIndex]->text();
+      int feedStart = std::max(start, blockStart);
+      int feedEnd = std::min(end, blockStart + text.size());
+      if (feedStart < feedEnd &&
+          matcher->Feed(text.constData() + (feedStart - blockStart), feedEnd - feedStart)) {
+        *match = DocumentRange(matcher->matchStart(), matcher->matchEnd());
+        return true;
+      }
+      blockStart += text.size();
+    }
+  }
+  
+  if (matcher->Finish(characterAt(end))) {
+    *match = DocumentRange(matcher->matchStart(), matcher->matchEnd());
+    return true;
+  }
+  return false;
+}
+
 DocumentRange Document::GetRangeForLine(int l) {
   LineIterator it(this, l);
   if (it.IsValid()) {
@@ -1350,6 +2758,23 @@ DocumentRange Document::GetRangeForLine(int l) {
   }
 }
 
+QString Document::GetLineDiffOldText(const LineDiff& diff) const {
+  QString oldText;
+  if (mDiffBase && diff.oldLine >= 0 && diff.numRemovedLines > 0) {
+    oldText = mDiffBase->GetLines(diff.oldLine, diff.numRemovedLines);
+  }
+  
+  if (diff.endOfFileNewline != LineDiff::EndOfFileNewline::Unchanged) {
+    if (!oldText.isEmpty() && !oldText.endsWith('\n')) {
+      oldText += '\n';
+    }
+    oldText += (diff.endOfFileNewline == LineDiff::EndOfFileNewline::Added) ?
+               tr("(newline added at end of line)\n") :
+               tr("(newline removed at end of line)\n");
+  }
+  return oldText;
+}
+
 int Document::lineAttributes(int l) {
   LineIterator it(this, l);
   if (it.IsValid()) {
@@ -1387,6 +2812,104 @@ void Document::RemoveLineAttributes(int l, int attributes) {
   }
 }
 
+int Document::FindNextLineWithAttributes(int line, int attributes) {
+  if (line < 0) {
+    line = 0;
+  }
+  if (line >= mBlockLines.Total()) {
+    return -1;
+  }
+  
+  int blockStartLine;
+  int blockIndex = mBlockLines.FindLastPrefixAtMost(line, &blockStartLine);
+  int lineInBlockIndex = line - blockStartLine;
+  while (blockIndex < mBlocks.size()) {
+    const std::vector<TextBlock::NewlineAttributes>& lines = mBlocks[blockIndex]->lineAttributes();
+    for (int i = lineInBlockIndex, size = lines.size(); i < size; ++ i) {
+      if (lines[i].attributes & attributes) {
+        return mBlockLines.PrefixSum(blockIndex) + i;
+      }
+    }
+    
+    blockIndex = FindNextBlockWithLineAttributes(blockIndex);
+    lineInBlockIndex = 0;
+  }
+  return -1;
+}
+
+int Document::FindPreviousLineWithAttributes(int line, int attributes) {
+  if (line < 0 || mBlockLinesWithAttributes.Total() == 0) {
+    return -1;
+  }
+  if (line >= mBlockLines.Total()) {
+    line = mBlockLines.Total() - 1;
+  }
+  
+  int blockStartLine;
+  int blockIndex = mBlockLines.FindLastPrefixAtMost(line, &blockStartLine);
+  int lineInBlockIndex = line - blockStartLine;
+  while (true) {
+    const std::vector<TextBlock::NewlineAttributes>& lines = mBlocks[blockIndex]->lineAttributes();
+    for (int i = std::min<int>(lineInBlockIndex, static_cast<int>(lines.size()) - 1); i >= 0; -- i) {
+      if (lines[i].attributes & attributes) {
+        return mBlockLines.PrefixSum(blockIndex) + i;
+      }
+    }
+    
+    // Go to the last preceding block that has lines with attributes. Since the
+    // prefix sum counts the lines with attributes before the current block,
+    // the block that contains the last of them is found with the prefix
+    // search.
+    int numLinesWithAttributesBefore = mBlockLinesWithAttributes.PrefixSum(blockIndex);
+    if (numLinesWithAttributesBefore == 0) {
+      return -1;
+    }
+    int unusedPrefixSum;
+    blockIndex = mBlockLinesWithAttributes.FindLastPrefixAtMost(numLinesWithAttributesBefore - 1, &unusedPrefixSum);
+    lineInBlockIndex = std::numeric_limits<int>::max();
+  }
+}
+
+void Document::GetLinesWithAttributes(std::vector<std::pair<int, int>>* lines) {
+  lines->clear();
+  lines->reserve(mBlockLinesWithAttributes.Total());
+  int blockIndex = FindNextBlockWithLineAttributes(-1);
+  while (blockIndex < mBlocks.size()) {
+    int blockStartLine = mBlockLines.PrefixSum(blockIndex);
+    const std::vector<TextBlock::NewlineAttributes>& blockLines = mBlocks[blockIndex]->lineAttributes();
+    for (int i = 0, size = blockLines.size(); i < size; ++ i) {
+      if (blockLines[i].attributes != 0) {
+        lines->emplace_back(blockStartLine + i, blockLines[i].attributes);
+      }
+    }
+    
+    blockIndex = FindNextBlockWithLineAttributes(blockIndex);
+  }
+}
+
+void Document::SetBlockLineAttributes(int blockIndex, int lineInBlockIndex, int attributes) {
+  int oldAttributes = mBlocks[blockIndex]->lineAttributes()[lineInBlockIndex].attributes;
+  if (oldAttributes == attributes) {
+    return;
+  }
+  MutableBlock(blockIndex).lineAttributes()[lineInBlockIndex].attributes = attributes;
+  if ((oldAttributes != 0) != (attributes != 0)) {
+    mBlockLinesWithAttributes.Add(blockIndex, (attributes != 0) ? 1 : -1);
+  }
+}
+
+int Document::FindNextBlockWithLineAttributes(int blockIndex) const {
+  // The lines with attributes in the blocks up to and including blockIndex are
+  // counted by the prefix sum, so the next such line is in the block that
+  // contains the line with this number (if it exists).
+  int numLinesWithAttributes = mBlockLinesWithAttributes.PrefixSum(blockIndex + 1);
+  if (numLinesWithAttributes >= mBlockLinesWithAttributes.Total()) {
+    return mBlocks.size();
+  }
+  int unusedPrefixSum;
+  return mBlockLinesWithAttributes.FindLastPrefixAtMost(numLinesWithAttributes, &unusedPrefixSum);
+}
+
 void Document::AddHighlightRange(const DocumentRange& range, bool isNonCodeRange, const QColor& textColor, bool bold, bool affectsText, bool affectsBackground, const QColor& backgroundColor, int layer) {
   if (range.IsInvalid() || range.IsEmpty()) {
     return;
@@ -1400,27 +2923,349 @@ void Document::AddHighlightRange(const DocumentRange& range, bool isNonCodeRange
   // Add highlight range
   mRanges[layer].emplace_back(
       range,
-      affectsText,
-      textColor,
-      bold,
-      affectsBackground,
-      backgroundColor,
-      isNonCodeRange);
+      mStyles.Intern(HighlightStyle(
+          affectsText,
+          textColor,
+          bold,
+          affectsBackground,
+          backgroundColor,
+          isNonCodeRange)));
   
   // Update style ranges in blocks
+  if (mRangesTextChangeCounter[layer] != mTextChangeCounter) {
+    mRangesTextChangeCounter[layer] = -1;
+  }
   ApplyHighlightRange(range, mRanges[layer].size() - 1, layer);
 }
 
 void Document::ClearHighlightRanges(int layer) {
   // Delete all highlight ranges except the default text style range
-  mRanges[layer].erase(mRanges[layer].begin() + 1, mRanges[layer].end());
+  std::vector<HighlightRange> oldRanges;
+  oldRanges.swap(mRanges[layer]);
+  mRanges[layer].push_back(oldRanges.front());
+  mRangesTextChangeCounter[layer] = mTextChangeCounter;
   
   // Recompute style ranges in blocks
-  ReapplyHighlightRanges(layer);
+  ReapplyHighlightRanges(layer, oldRanges);
+}
+
+/// Computes the style changes that result from the given highlight ranges as
+/// pairs of (document offset, index in @p ranges), sorted by offset. Later
+/// ranges take precedence over earlier ones, thus at each position, the style
+/// is given by the active range with the highest index (or the default style
+/// 0 if there is none).
+static void ComputeStyleChanges(const std::vector<HighlightRange>& ranges, int documentSize, std::vector<std::pair<int, int>>* styleChanges) {
+  std::vector<int> rangesByStart;
+  rangesByStart.reserve(ranges.size());
+  std::vector<int> rangeEnds;
+  rangeEnds.reserve(ranges.size());
+  int outsideRangeCount = 0;
+  for (int i = 1, size = ranges.size(); i < size; ++ i) {
+    const DocumentRange& range = ranges[i].range;
+    if (range.IsInvalid() || range.IsEmpty()) {
+      continue;
+    }
+    if (range.start.offset < 0 || range.end.offset > documentSize) {
+      ++ outsideRangeCount;
+      continue;
+    }
+    rangesByStart.push_back(i);
+    rangeEnds.push_back(range.end.offset);
+  }
+  if (outsideRangeCount > 0) {
+    qDebug() << "Error: In ComputeStyleChanges()," << outsideRangeCount << "highlight ranges are outside of the document (document.end.offset:" << documentSize << ")";
+  }
+  std::sort(rangesByStart.begin(), rangesByStart.end(), [&](int a, int b) {
+    return ranges[a].range.start < ranges[b].range.start;
+  });
+  std::sort(rangeEnds.begin(), rangeEnds.end());
+  
+  styleChanges->assign({std::make_pair(0, 0)});
+  std::priority_queue<int> activeRanges;
+  std::size_t nextStart = 0;
+  std::size_t nextEnd = 0;
+  while (nextStart < rangesByStart.size() || nextEnd < rangeEnds.size()) {
+    int position = (nextStart < rangesByStart.size()) ? ranges[rangesByStart[nextStart]].range.start.offset : documentSize;
+    if (nextEnd < rangeEnds.size()) {
+      position = std::min(position, rangeEnds[nextEnd]);
+    }
+    
+    while (nextStart < rangesByStart.size() && ranges[rangesByStart[nextStart]].range.start.offset == position) {
+      activeRanges.push(rangesByStart[nextStart]);
+      ++ nextStart;
+    }
+    while (nextEnd < rangeEnds.size() && rangeEnds[nextEnd] == position) {
+      ++ nextEnd;
+    }
+    // Ranges that ended are removed lazily once they are at the top.
+    while (!activeRanges.empty() && ranges[activeRanges.top()].range.end.offset <= position) {
+      activeRanges.pop();
+    }
+    
+    int style = activeRanges.empty() ? 0 : activeRanges.top();
+    if (style != styleChanges->back().second) {
+      if (styleChanges->back().first == position) {
+        styleChanges->back().second = style;
+      } else {
+        styleChanges->emplace_back(position, style);
+      }
+    }
+  }
+}
+
+/// Converts style changes as returned by ComputeStyleChanges() into pairs of
+/// (document offset, style ID), omitting the changes that do not change the
+/// style.
+static void ResolveStyleChanges(const std::vector<std::pair<int, int>>& styleChanges, const std::vector<HighlightRange>& ranges, std::vector<std::pair<int, int>>* resolvedChanges) {
+  resolvedChanges->clear();
+  resolvedChanges->reserve(styleChanges.size());
+  for (const std::pair<int, int>& change : styleChanges) {
+    int styleId = ranges[change.second].styleId;
+    if (resolvedChanges->empty() || resolvedChanges->back().second != styleId) {
+      resolvedChanges->emplace_back(change.first, styleId);
+    }
+  }
+}
+
+/// Determines the indices at which the new highlight @p ranges (given in
+/// their order of precedence) are stored such that ranges that are equal to
+/// one of the @p oldRanges (after mapping it through the @p replacements)
+/// keep its index. The other ranges fill the remaining indices in their
+/// order. Index 0 (the default style) is kept. Returns false if no range
+/// keeps its index.
+static bool AssignStableRangeIndices(const std::vector<HighlightRange>& ranges, const std::vector<HighlightRange>& oldRanges, const std::vector<TextReplacement>& replacements, std::vector<int>* rangeIndices) {
+  auto isLess = [](const HighlightRange& a, const HighlightRange& b) {
+    if (a.range.start != b.range.start) {
+      return a.range.start < b.range.start;
+    }
+    if (a.range.end != b.range.end) {
+      return a.range.end < b.range.end;
+    }
+    return a.styleId < b.styleId;
+  };
+  
+  // Map the old ranges to the current text. Old ranges at indices that do not
+  // exist anymore cannot be kept.
+  std::vector<HighlightRange> mappedOldRanges(std::min(oldRanges.size(), ranges.size()));
+  std::vector<int> oldOrder;
+  oldOrder.reserve(mappedOldRanges.size());
+  for (int i = 1, size = mappedOldRanges.size(); i < size; ++ i) {
+    DocumentRange range = oldRanges[i].range;
+    for (const TextReplacement& replacement : replacements) {
+      if (range.IsInvalid()) {
+        break;
+      }
+      range = replacement.MapRange(range);
+    }
+    if (range.IsInvalid() || range.IsEmpty()) {
+      continue;
+    }
+    mappedOldRanges[i] = HighlightRange(range, oldRanges[i].styleId);
+    oldOrder.push_back(i);
+  }
+  std::sort(oldOrder.begin(), oldOrder.end(), [&](int a, int b) {
+    return isLess(mappedOldRanges[a], mappedOldRanges[b]);
+  });
+  
+  std::vector<int> newOrder(ranges.size() - 1);
+  for (int i = 1, size = ranges.size(); i < size; ++ i) {
+    newOrder[i - 1] = i;
+  }
+  std::sort(newOrder.begin(), newOrder.end(), [&](int a, int b) {
+    return isLess(ranges[a], ranges[b]);
+  });
+  
+  // Match equal ranges with a sorted merge
+  rangeIndices->assign(ranges.size(), -1);
+  (*rangeIndices)[0] = 0;
+  std::vector<bool> indexUsed(ranges.size(), false);
+  indexUsed[0] = true;
+  int matchCount = 0;
+  std::size_t oldIndex = 0;
+  std::size_t newIndex = 0;
+  while (oldIndex < oldOrder.size() && newIndex < newOrder.size()) {
+    const HighlightRange& oldRange = mappedOldRanges[oldOrder[oldIndex]];
+    const HighlightRange& newRange = ranges[newOrder[newIndex]];
+    if (isLess(oldRange, newRange)) {
+      ++ oldIndex;
+    } else if (isLess(newRange, oldRange)) {
+      ++ newIndex;
+    } else {
+      (*rangeIndices)[newOrder[newIndex]] = oldOrder[oldIndex];
+      indexUsed[oldOrder[oldIndex]] = true;
+      ++ matchCount;
+      ++ oldIndex;
+      ++ newIndex;
+    }
+  }
+  if (matchCount == 0) {
+    return false;
+  }
+  
+  // Assign the remaining indices
+  int freeIndex = 1;
+  for (int i = 1, size = ranges.size(); i < size; ++ i) {
+    if ((*rangeIndices)[i] < 0) {
+      while (indexUsed[freeIndex]) {
+        ++ freeIndex;
+      }
+      (*rangeIndices)[i] = freeIndex;
+      indexUsed[freeIndex] = true;
+    }
+  }
+  return true;
+}
+
+bool Document::ApplyHighlightBuffer(HighlightBuffer* buffer, int layer) {
+  // Replace all highlight ranges except the default text style range
+  std::vector<HighlightRange> oldRanges;
+  oldRanges.swap(mRanges[layer]);
+  std::vector<HighlightRange>& ranges = mRanges[layer];
+  ranges.reserve(1 + buffer->ranges.size());
+  ranges.push_back(oldRanges.front());
+  std::vector<int> styleIdMap = mStyles.InternTable(buffer->styles);
+  for (const HighlightRange& range : buffer->ranges) {
+    ranges.emplace_back(range.range, styleIdMap[range.styleId]);
+  }
+  buffer->ranges.clear();
+  
+  std::vector<std::pair<int, int>> styleChanges;
+  int documentSize = mBlockOffsets.Total();
+  ComputeStyleChanges(ranges, documentSize, &styleChanges);
+  
+  // Consecutive parses mostly yield the same highlight ranges. If a range was
+  // there before, store it at its previous index, such that the style ranges
+  // of the blocks without changes stay the same and these blocks do not need
+  // to be modified. Since the indices also determine the precedence of
+  // overlapping ranges, the new order is only used if it results in the same
+  // styles.
+  std::vector<TextReplacement> replacements;
+  std::vector<int> rangeIndices;
+  if (mRangesTextChangeCounter[layer] >= 0 &&
+      GetTextReplacementsSince(mRangesTextChangeCounter[layer], &replacements) &&
+      AssignStableRangeIndices(ranges, oldRanges, replacements, &rangeIndices)) {
+    std::vector<HighlightRange> reorderedRanges(ranges.size());
+    for (int i = 0, size = ranges.size(); i < size; ++ i) {
+      reorderedRanges[rangeIndices[i]] = ranges[i];
+    }
+    std::vector<std::pair<int, int>> reorderedStyleChanges;
+    ComputeStyleChanges(reorderedRanges, documentSize, &reorderedStyleChanges);
+    
+    std::vector<std::pair<int, int>> resolvedChanges;
+    ResolveStyleChanges(styleChanges, ranges, &resolvedChanges);
+    std::vector<std::pair<int, int>> reorderedResolvedChanges;
+    ResolveStyleChanges(reorderedStyleChanges, reorderedRanges, &reorderedResolvedChanges);
+    if (resolvedChanges == reorderedResolvedChanges) {
+      ranges.swap(reorderedRanges);
+      styleChanges.swap(reorderedStyleChanges);
+    }
+  }
+  mRangesTextChangeCounter[layer] = mTextChangeCounter;
+  
+  SetBlockStyleRanges(layer, styleChanges, oldRanges);
+  
+  mContexts.swap(buffer->contexts);
+  mContextIndexValid = false;
+  
+  // Consecutive parses mostly report the same problems, so the new problems
+  // are compared with the current ones by their content and ranges (which have
+  // been adapted to the edits since the last parse, like the buffer's ranges).
+  // The problems are only replaced if they differ, and the Problem objects of
+  // the unchanged problems are kept in this case.
+  std::vector<std::size_t> oldProblemKeys = GetProblemKeys(mProblems, mProblemRanges);
+  std::vector<std::size_t> newProblemKeys = GetProblemKeys(buffer->problems, buffer->problemRanges);
+  bool problemsChanged = oldProblemKeys != newProblemKeys;
+  if (problemsChanged) {
+    std::unordered_multimap<std::size_t, int> oldProblemForKey;
+    oldProblemForKey.reserve(oldProblemKeys.size());
+    for (int i = 0, size = oldProblemKeys.size(); i < size; ++ i) {
+      oldProblemForKey.emplace(oldProblemKeys[i], i);
+    }
+    for (int i = 0, size = newProblemKeys.size(); i < size; ++ i) {
+      auto it = oldProblemForKey.find(newProblemKeys[i]);
+      if (it != oldProblemForKey.end()) {
+        buffer->problems[i] = mProblems[it->second];
+        oldProblemForKey.erase(it);
+      }
+    }
+    
+    // The underlines of the old and new problems need to be redrawn.
+    for (const std::set<ProblemRange>* problemRanges : {&mProblemRanges, &buffer->problemRanges}) {
+      if (!problemRanges->empty()) {
+        int endOffset = 0;
+        for (const ProblemRange& problemRange : *problemRanges) {
+          endOffset = std::max(endOffset, problemRange.range.end.offset);
+        }
+        RecordHighlightingChange(problemRanges->begin()->range.start.offset, endOffset);
+      }
+    }
+    
+    mProblems.swap(buffer->problems);
+    mProblemRanges.swap(buffer->problemRanges);
+    mProblemLineSpansValid = false;
+  }
+  
+  // Replace the warning / error line attributes. Only the lines whose
+  // attributes differ are modified.
+  const int problemAttributes = static_cast<int>(LineAttribute::Warning) | static_cast<int>(LineAttribute::Error);
+  std::vector<std::pair<int, int>> newLineAttributes;  // (line, attributes)
+  newLineAttributes.reserve(buffer->problemLineAttributes.size());
+  for (const std::pair<DocumentLocation, int>& lineAttributes : buffer->problemLineAttributes) {
+    newLineAttributes.emplace_back(LineForLocation(lineAttributes.first), lineAttributes.second & problemAttributes);
+  }
+  std::sort(newLineAttributes.begin(), newLineAttributes.end());
+  
+  // Only the lines that have attributes now or get problem attributes need to
+  // be visited.
+  std::vector<std::pair<int, int>> oldLineAttributes;  // (line, attributes)
+  GetLinesWithAttributes(&oldLineAttributes);
+  
+  int oldIndex = 0;
+  int newIndex = 0;
+  while (oldIndex < oldLineAttributes.size() || newIndex < newLineAttributes.size()) {
+    int line = (newIndex == newLineAttributes.size() ||
+                (oldIndex < oldLineAttributes.size() && oldLineAttributes[oldIndex].first < newLineAttributes[newIndex].first)) ?
+               oldLineAttributes[oldIndex].first :
+               newLineAttributes[newIndex].first;
+    int attributes = 0;
+    if (oldIndex < oldLineAttributes.size() && oldLineAttributes[oldIndex].first == line) {
+      attributes = oldLineAttributes[oldIndex].second;
+      ++ oldIndex;
+    }
+    int newAttributes = 0;
+    while (newIndex < newLineAttributes.size() && newLineAttributes[newIndex].first == line) {
+      newAttributes |= newLineAttributes[newIndex].second;
+      ++ newIndex;
+    }
+    if ((attributes & problemAttributes) != newAttributes) {
+      SetLineAttributes(line, (attributes & ~problemAttributes) | newAttributes);
+    }
+  }
+  return problemsChanged;
+}
+
+void Document::AddHighlightRanges(const std::vector<HighlightRange>& ranges, const HighlightStyleTable& styles, int layer) {
+  std::vector<int> styleIdMap = mStyles.InternTable(styles);
+  if (mRangesTextChangeCounter[layer] != mTextChangeCounter) {
+    mRangesTextChangeCounter[layer] = -1;
+  }
+  mRanges[layer].reserve(mRanges[layer].size() + ranges.size());
+  for (const HighlightRange& range : ranges) {
+    mRanges[layer].emplace_back(range.range, styleIdMap[range.styleId]);
+    ApplyHighlightRange(range.range, mRanges[layer].size() - 1, layer);
+  }
 }
 
 void Document::FinishedHighlightingChanges() {
-  emit HighlightingChanged();
+  DocumentRange changedRange = mPendingHighlightingChangedRange;
+  mPendingHighlightingChangedRange = DocumentRange::Invalid();
+  if (changedRange.IsValid()) {
+    int documentSize = mBlockOffsets.Total();
+    changedRange = DocumentRange(
+        std::min(changedRange.start.offset, documentSize),
+        std::min(changedRange.end.offset, documentSize));
+  }
+  emit HighlightingChanged(changedRange);
 }
 
 int Document::AddProblem(const std::shared_ptr<Problem>& problem) {
@@ -1433,6 +3278,7 @@ void Document::AddProblemRange(int problemIndex, const DocumentRange& range) {
     return;
   }
   mProblemRanges.insert(ProblemRange(range, problemIndex));
+  mProblemLineSpansValid = false;
 }
 
 void Document::RemoveProblem(const std::shared_ptr<Problem>& problem) {
@@ -1453,6 +3299,7 @@ void Document::RemoveProblem(const std::shared_ptr<Problem>& problem) {
           ++ it;
         }
       }
+      mProblemLineSpansValid = false;
       
       return;
     }
@@ -1463,16 +3310,105 @@ void Document::RemoveProblem(const std::shared_ptr<Problem>& problem) {
 void Document::ClearProblems() {
   mProblems.clear();
   mProblemRanges.clear();
+  mProblemLineSpansValid = false;
+}
+
+void Document::GetProblemLineSpans(int line, const ProblemLineSpan** begin, const ProblemLineSpan** end) {
+  if (!mProblemLineSpansValid || mProblemLineSpansCounter != mTextChangeCounter) {
+    // Split the problem ranges at the line starts.
+    mProblemLineSpans.clear();
+    for (const ProblemRange& problemRange : mProblemRanges) {
+      bool isError = mProblems[problemRange.problemIndex]->type() != Problem::Type::Warning;
+      int firstLine = LineForLocation(problemRange.range.start);
+      int lastLine = LineForLocation(problemRange.range.end);
+      for (int spanLine = firstLine; spanLine <= lastLine; ++ spanLine) {
+        int spanStart = (spanLine == firstLine) ? problemRange.range.start.offset : LineStart(spanLine).offset;
+        int spanEnd = (spanLine == lastLine) ? problemRange.range.end.offset : LineStart(spanLine + 1).offset;
+        if (spanStart < spanEnd) {
+          mProblemLineSpans.emplace_back(spanLine, spanStart, spanEnd, problemRange.problemIndex, isError);
+        }
+      }
+    }
+    
+    // The spans are already ordered by start, except for the continuations
+    // of multi-line ranges.
+    std::stable_sort(mProblemLineSpans.begin(), mProblemLineSpans.end(), [](const ProblemLineSpan& a, const ProblemLineSpan& b) {
+      return a.start < b.start;
+    });
+    
+    mProblemLineSpansCounter = mTextChangeCounter;
+    mProblemLineSpansValid = true;
+  }
+  
+  const ProblemLineSpan* spans = mProblemLineSpans.data();
+  *begin = spans + (std::lower_bound(mProblemLineSpans.begin(), mProblemLineSpans.end(), line, [](const ProblemLineSpan& span, int line) {
+    return span.line < line;
+  }) - mProblemLineSpans.begin());
+  *end = spans + (std::upper_bound(mProblemLineSpans.begin(), mProblemLineSpans.end(), line, [](int line, const ProblemLineSpan& span) {
+    return line < span.line;
+  }) - mProblemLineSpans.begin());
 }
 
 ClangTUPool* Document::GetTUPool() {
   if (!mTUPool) {
-    mTUPool.reset(new ClangTUPool(2));
+    mTUPool.reset(new ClangTUPool(GetPerformanceProfileParameters().TUsPerDocument));
   }
   return mTUPool.get();
 }
 
+DocumentMemoryUsage Document::EstimateMemoryUsage() const {
+  DocumentMemoryUsage result;
+  
+  // Text blocks, with the three Fenwick trees over them
+  result.text = mBlocks.capacity() * sizeof(std::shared_ptr<TextBlock>) +
+                3 * (mBlocks.size() + 1) * sizeof(int);
+  for (const std::shared_ptr<TextBlock>& block : mBlocks) {
+    result.text += block->TextMemoryUsage();
+    result.highlights += block->StyleMemoryUsage();
+  }
+  
+  // Highlight ranges
+  for (int layer = 0; layer < TextBlock::kLayerCount; ++ layer) {
+    result.highlights += mRanges[layer].capacity() * sizeof(HighlightRange);
+  }
+  
+  // Version graph
+  std::vector<const DocumentVersion*> workList = {versionGraphRoot};
+  result.undoHistory = sizeof(DocumentVersion);
+  while (!workList.empty()) {
+    const DocumentVersion* version = workList.back();
+    workList.pop_back();
+    
+    for (const DocumentVersionLink& link : version->links) {
+      result.undoHistory += link.MemoryUsage();
+      workList.push_back(link.linkedVersion);
+    }
+  }
+  for (const Replacement& replacement : combinedUndoReplacements) {
+    result.undoHistory += replacement.MemoryUsage();
+  }
+  
+  // Problems, contexts, diff lines and blame lines. Each node of a std::set is
+  // counted with three pointers and the node color.
+  result.other = mProblems.capacity() * sizeof(std::shared_ptr<Problem>) +
+                 mProblems.size() * sizeof(Problem) +
+                 mProblemRanges.size() * (sizeof(ProblemRange) + 4 * sizeof(void*)) +
+                 mDiffLines.capacity() * sizeof(LineDiff) +
+                 mBlameLines.capacity() * sizeof(LineBlame);
+  for (const Context& context : mContexts) {
+    result.other += sizeof(Context) + 4 * sizeof(void*) +
+                    (context.name.size() + context.description.size()) * sizeof(QChar);
+  }
+  result.other += mIdentifierIndexes.capacity() * sizeof(IdentifierIndex);
+  for (const IdentifierIndex& index : mIdentifierIndexes) {
+    result.other += index.entries.capacity() * sizeof(IdentifierIndex::Entry);
+  }
+  
+  return result;
+}
+
 void Document::FileWatcherNotification() {
+  FileStatCache::Instance().Invalidate(mPath);
   emit FileChangedExternally();
 }
 
@@ -1480,6 +3416,7 @@ void Document::ApplyHighlightRange(const DocumentRange& range, int highlightRang
   if (range.IsInvalid()) {
     return;
   }
+  RecordHighlightingChange(range.start.offset, range.end.offset);
   
   int firstBlockOffset;
   int firstBlock = BlockForLocation(range.start, true, &firstBlockOffset);
@@ -1498,36 +3435,125 @@ void Document::ApplyHighlightRange(const DocumentRange& range, int highlightRang
   }
   
   if (firstBlock == lastBlock) {
-    TextBlock& block = *mBlocks[firstBlock];
+    TextBlock& block = MutableBlock(firstBlock);
     DocumentRange localRange = DocumentRange(range.start.offset - firstBlockOffset,
                                              range.end.offset - lastBlockOffset);
     block.InsertStyleRange(localRange, highlightRangeIndex, layer);
   } else {
-    mBlocks[firstBlock]->InsertStyleRange(
+    MutableBlock(firstBlock).InsertStyleRange(
         DocumentRange(range.start.offset - firstBlockOffset,
                       mBlocks[firstBlock]->text().size()), highlightRangeIndex, layer);
     
     for (int block = firstBlock + 1; block < lastBlock; ++ block) {
-      mBlocks[block]->InsertStyleRange(DocumentRange(0, mBlocks[block]->text().size()), highlightRangeIndex, layer);
+      MutableBlock(block).InsertStyleRange(DocumentRange(0, mBlocks[block]->text().size()), highlightRangeIndex, layer);
     }
     
-    mBlocks[lastBlock]->InsertStyleRange(
+    MutableBlock(lastBlock).InsertStyleRange(
         DocumentRange(0,
                       range.end.offset - lastBlockOffset), highlightRangeIndex, layer);
   }
 }
 
-void Document::ReapplyHighlightRanges(int layer) {
-  // Reset styles
+void Document::ReapplyHighlightRanges(int layer, const std::vector<HighlightRange>& oldRanges) {
+  // Instead of inserting the highlight ranges into the blocks one by one, do a
+  // single sweep over the sorted range boundaries and build the style ranges of
+  // all blocks directly.
+  std::vector<std::pair<int, int>> styleChanges;
+  ComputeStyleChanges(mRanges[layer], mBlockOffsets.Total(), &styleChanges);
+  SetBlockStyleRanges(layer, styleChanges, oldRanges);
+}
+
+void Document::SetBlockStyleRanges(int layer, const std::vector<std::pair<int, int>>& styleChanges, const std::vector<HighlightRange>& oldRanges) {
+  const std::vector<HighlightRange>& ranges = mRanges[layer];
+  
+  // Distribute the style changes to the blocks
+  std::size_t change = 0;
+  int blockStartOffset = 0;
   for (int b = 0, size = mBlocks.size(); b < size; ++ b) {
-    mBlocks[b]->ClearStyleRanges(layer);
+    int blockEndOffset = blockStartOffset + mBlocks[b]->text().size();
+    while (change + 1 < styleChanges.size() && styleChanges[change + 1].first <= blockStartOffset) {
+      ++ change;
+    }
+    
+    std::vector<TextBlock::StyleRange> blockStyleRanges;
+    blockStyleRanges.emplace_back(0, styleChanges[change].second);
+    for (std::size_t c = change + 1; c < styleChanges.size() && styleChanges[c].first < blockEndOffset; ++ c) {
+      blockStyleRanges.emplace_back(styleChanges[c].first - blockStartOffset, styleChanges[c].second);
+    }
+    
+    // The block is unchanged if it refers to the same ranges, and if these
+    // ranges still have the same styles. Its cached data (such as the bracket
+    // summary) then stays valid as well.
+    const std::vector<TextBlock::StyleRange>& oldStyleRanges = mBlocks[b]->styleRanges(layer);
+    bool unchanged = oldStyleRanges.size() == blockStyleRanges.size();
+    for (std::size_t i = 0; unchanged && i < blockStyleRanges.size(); ++ i) {
+      int rangeIndex = blockStyleRanges[i].rangeIndex;
+      unchanged = oldStyleRanges[i].start == blockStyleRanges[i].start &&
+                  oldStyleRanges[i].rangeIndex == rangeIndex &&
+                  rangeIndex < oldRanges.size() &&
+                  oldRanges[rangeIndex].styleId == ranges[rangeIndex].styleId;
+    }
+    if (!unchanged) {
+      MutableBlock(b).SetStyleRanges(&blockStyleRanges, layer);
+      RecordHighlightingChange(blockStartOffset, blockEndOffset);
+    }
+    
+    blockStartOffset = blockEndOffset;
+  }
+}
+
+void Document::RecordHighlightingChange(int startOffset, int endOffset) {
+  if (mPendingHighlightingChangedRange.IsInvalid()) {
+    mPendingHighlightingChangedRange = DocumentRange(startOffset, endOffset);
+  } else {
+    mPendingHighlightingChangedRange = DocumentRange(
+        std::min(mPendingHighlightingChangedRange.start.offset, startOffset),
+        std::max(mPendingHighlightingChangedRange.end.offset, endOffset));
+  }
+}
+
+/// Converts the @p sequentialReplacements of an undo step, whose ranges each
+/// refer to the text after applying the previous ones, to replacements whose
+/// ranges refer to the text before applying any of them, sorted by their
+/// ranges as required by Document::ReplaceMany(). This is possible if the
+/// replacements are ordered front to back or back to front without
+/// overlapping, which is the case for the steps created by ReplaceMany() and
+/// by combined undo steps of edits at several places. Returns false if it is
+/// not possible.
+static bool ToSimultaneousReplacements(const std::vector<Replacement>& sequentialReplacements, std::vector<Replacement>* simultaneousReplacements) {
+  int size = sequentialReplacements.size();
+  simultaneousReplacements->resize(size);
+  
+  // Front to back: each replacement's range is shifted by the size changes of
+  // the previous ones.
+  bool frontToBack = true;
+  int sizeChange = 0;
+  for (int i = 0; i < size; ++ i) {
+    const Replacement& replacement = sequentialReplacements[i];
+    Replacement& result = (*simultaneousReplacements)[i];
+    result.range = DocumentRange(replacement.range.start.offset - sizeChange, replacement.range.end.offset - sizeChange);
+    if (i > 0 && result.range.start < (*simultaneousReplacements)[i - 1].range.end) {
+      frontToBack = false;
+      break;
+    }
+    result.text = replacement.GetText();
+    sizeChange += result.text.size() - replacement.range.size();
+  }
+  if (frontToBack) {
+    return true;
   }
   
-  // Apply all highlight ranges that are in the stack (excluding the default
-  // style).
-  for (std::size_t i = 1, size = mRanges[layer].size(); i < size; ++ i) {
-    ApplyHighlightRange(mRanges[layer][i].range, i, layer);
+  // Back to front: the previous replacements do not affect the ranges.
+  for (int i = 0; i < size; ++ i) {
+    const Replacement& replacement = sequentialReplacements[i];
+    if (i > 0 && replacement.range.end > sequentialReplacements[i - 1].range.start) {
+      return false;
+    }
+    Replacement& result = (*simultaneousReplacements)[size - 1 - i];
+    result.range = replacement.range;
+    result.text = replacement.GetText();
   }
+  return true;
 }
 
 bool Document::UndoRedoImpl(bool redo, DocumentRange* newTextRange) {
@@ -1551,15 +3577,28 @@ bool Document::UndoRedoImpl(bool redo, DocumentRange* newTextRange) {
     return false;
   }
   
-  // Perform the operation.
-  std::vector<Replacement> redoReplacements(doLink->replacements.size());
-  for (int i = 0, size = doLink->replacements.size(); i < size; ++ i) {
-    Replace(doLink->replacements[i].range, doLink->replacements[i].text, false, &redoReplacements[redoReplacements.size() - 1 - i]);
+  // Perform the operation. Steps with several replacements (for example, from
+  // "replace all") are applied at once if possible, which avoids splitting
+  // and merging the blocks and adapting the highlight ranges for each one.
+  std::vector<Replacement> redoReplacements;
+  std::vector<Replacement> simultaneousReplacements;
+  int lastTextSize = 0;
+  if (doLink->replacements.size() > 1 &&
+      ToSimultaneousReplacements(doLink->replacements, &simultaneousReplacements)) {
+    lastTextSize = doLink->replacements.back().GetText().size();
+    ReplaceMany(simultaneousReplacements, false, &redoReplacements);
+  } else {
+    redoReplacements.resize(doLink->replacements.size());
+    for (int i = 0, size = doLink->replacements.size(); i < size; ++ i) {
+      QString text = doLink->replacements[i].GetText();
+      lastTextSize = text.size();
+      Replace(doLink->replacements[i].range, text, false, &redoReplacements[redoReplacements.size() - 1 - i]);
+    }
   }
   
   if (newTextRange) {
     // TODO: This only outputs the data of the last replacement, should we output all?
-    *newTextRange = DocumentRange(doLink->replacements.back().range.start, doLink->replacements.back().range.start + doLink->replacements.back().text.size());
+    *newTextRange = DocumentRange(doLink->replacements.back().range.start, doLink->replacements.back().range.start + lastTextSize);
   }
   
   // Update the version graph.
@@ -1573,63 +3612,426 @@ bool Document::UndoRedoImpl(bool redo, DocumentRange* newTextRange) {
   
   versionGraphRoot = newCurVersion;
   mVersion = versionGraphRoot->version;
-  emit Changed();
+  AddedVersionLink(&newCurVersion->links.back());
+  ScheduleChangedSignal();
   return true;
 }
 
-void Document::ClearVersionGraph() {
-  // (Depth-first) deletion of all nodes in the version graph.
-  std::vector<DocumentVersion*> workList = {versionGraphRoot};
+void Document::AddedVersionLink(DocumentVersionLink* link) {
+  for (Replacement& replacement : link->replacements) {
+    replacement.Compress();
+  }
+  mUndoMemoryUsageBound += link->MemoryUsage();
+  
+  std::size_t limit = UndoHistoryMemoryLimit();
+  if (limit == 0 || mUndoMemoryUsageBound <= limit) {
+    return;
+  }
+  
+  // Determine the exact memory usage, and the distance (in steps) of each
+  // version to the current version.
+  std::size_t memoryUsage = 0;
+  std::vector<std::pair<int, DocumentVersion*>> versions;
+  std::vector<std::pair<int, DocumentVersion*>> workList = {std::make_pair(0, versionGraphRoot)};
   while (!workList.empty()) {
-    DocumentVersion* curItem = workList.back();
+    std::pair<int, DocumentVersion*> item = workList.back();
     workList.pop_back();
     
-    for (const DocumentVersionLink& link : curItem->links) {
-      workList.push_back(link.linkedVersion);
+    for (const DocumentVersionLink& versionLink : item.second->links) {
+      memoryUsage += versionLink.MemoryUsage();
+      versions.emplace_back(item.first + 1, versionLink.linkedVersion);
+      workList.emplace_back(item.first + 1, versionLink.linkedVersion);
+    }
+  }
+  
+  // Delete the versions that are farthest from the current version first.
+  // Since these are visited before the versions that are closer, each one is a
+  // leaf of the graph once it gets deleted. The versions that are directly
+  // reachable from the current version are always kept.
+  std::size_t targetMemoryUsage = static_cast<std::size_t>(kUndoHistoryPruningTarget * limit);
+  if (memoryUsage > targetMemoryUsage) {
+    std::sort(versions.begin(), versions.end(), [](const std::pair<int, DocumentVersion*>& a, const std::pair<int, DocumentVersion*>& b) {
+      return a.first > b.first;
+    });
+    for (const std::pair<int, DocumentVersion*>& item : versions) {
+      DocumentVersion* version = item.second;
+      if (memoryUsage <= targetMemoryUsage || item.first <= 1) {
+        break;
+      }
+      if (!version->links.empty()) {
+        continue;
+      }
+      
+      int backLinkIndex = version->FindBackLink();
+      if (backLinkIndex < 0) {
+        continue;
+      }
+      std::vector<DocumentVersionLink>& parentLinks = version->towardsCurrentVersion->links;
+      memoryUsage -= parentLinks[backLinkIndex].MemoryUsage();
+      parentLinks.erase(parentLinks.begin() + backLinkIndex);
+      delete version;
     }
-    
-    delete curItem;
   }
   
+  mUndoMemoryUsageBound = memoryUsage;
+}
+
+void Document::ClearVersionGraph() {
+  DeleteVersionGraph(versionGraphRoot);
+  
   // Restore the root node.
   versionGraphRoot = new DocumentVersion(mVersion, nullptr);
+  mUndoMemoryUsageBound = 0;
+}
+
+void Document::RebuildBlockIndex() {
+  mBracketSummaries.clear();
+  mIdentifierIndexes.clear();
+  mBlockOffsets.Build(mBlocks.size(), [&](int index) {
+    return mBlocks[index]->text().size();
+  });
+  mBlockLines.Build(mBlocks.size(), [&](int index) {
+    return static_cast<int>(mBlocks[index]->lineAttributes().size());
+  });
+  mBlockLinesWithAttributes.Build(mBlocks.size(), [&](int index) {
+    return mBlocks[index]->CountLinesWithAttributes();
+  });
+  mBlockUtf8Sizes.Build(mBlocks.size(), [&](int index) {
+    return mBlocks[index]->utf8Size();
+  });
+}
+
+void Document::RecordTextReplacement(const DocumentRange& oldRange, int newTextSize, bool affectsCode) {
+  constexpr int kMaxRecordedReplacements = 4096;
+  
+  ++ mTextChangeCounter;
+  if (affectsCode) {
+    mLastCodeChangeCounter = mTextChangeCounter;
+  }
+  // Replacements after the preamble region do not change it. The character
+  // directly after the region is included since it may start a comment
+  // together with the first character of the token at its end.
+  if (oldRange.start.offset <= mPreambleEndOffset + 1) {
+    mPreambleHashValid = false;
+  }
+  mTextReplacements.emplace_back(oldRange, newTextSize);
+  if (mTextReplacements.size() > kMaxRecordedReplacements) {
+    mTextReplacements.pop_front();
+  }
+  ScheduleSnapshotUpdate();
+  
+  // Map the pending changed range through the replacement and extend it by
+  // the new text.
+  int newEnd = oldRange.start.offset + newTextSize;
+  if (mPendingChangedRange.IsInvalid()) {
+    mPendingChangedRange = DocumentRange(oldRange.start.offset, newEnd);
+  } else {
+    int delta = newTextSize - oldRange.size();
+    auto mapOffset = [&](int offset, int offsetWithinReplacement) {
+      if (offset <= oldRange.start.offset) {
+        return offset;
+      } else if (offset >= oldRange.end.offset) {
+        return offset + delta;
+      }
+      return offsetWithinReplacement;
+    };
+    mPendingChangedRange = DocumentRange(
+        std::min(mapOffset(mPendingChangedRange.start.offset, oldRange.start.offset), oldRange.start.offset),
+        std::max(mapOffset(mPendingChangedRange.end.offset, newEnd), newEnd));
+  }
+  
+  emit TextReplaced(oldRange, newTextSize, mTextChangeCounter);
+}
+
+void Document::RecordUnmappableTextChange() {
+  ++ mTextChangeCounter;
+  mLastCodeChangeCounter = mTextChangeCounter;
+  mPreambleHashValid = false;
+  mTextReplacements.clear();
+  ScheduleSnapshotUpdate();
+  mPendingChangeIsUnmappable = true;
+}
+
+std::size_t Document::preambleHash() {
+  if (mPreambleHashValid) {
+    return mPreambleHash;
+  }
+  
+  // Find the first token that is neither in a comment nor in a preprocessor
+  // directive. Directives end at a newline that is not escaped with a
+  // backslash. String literals in directives are not considered, since
+  // comment markers within them only affect the result in unusual cases.
+  bool atLineStart = true;
+  bool inDirective = false;
+  bool inLineComment = false;
+  bool inBlockComment = false;
+  QChar previous;
+  mPreambleEndOffset = -1;
+  for (CharacterIterator it(this); it.IsValid(); ++ it) {
+    QChar c = it.GetChar();
+    if (c == '\r') {
+      continue;  // such that a backslash before "\r\n" escapes the newline
+    } else if (inBlockComment) {
+      if (previous == '*' && c == '/') {
+        inBlockComment = false;
+        c = QChar();  // do not let the '/' start another comment marker
+      }
+    } else if (c == '\n') {
+      if (previous != '\\') {
+        inDirective = false;
+        inLineComment = false;
+        atLineStart = true;
+      }
+    } else if (inLineComment || c.isSpace()) {
+      // Nothing to do
+    } else if (c == '/') {
+      CharacterIterator next(it);
+      ++ next;
+      QChar nextChar = next.IsValid() ? next.GetChar() : QChar();
+      if (nextChar == '/' || nextChar == '*') {
+        inLineComment = (nextChar == '/');
+        inBlockComment = (nextChar == '*');
+        it = next;
+        c = QChar();
+      } else if (!inDirective) {
+        mPreambleEndOffset = it.GetCharacterOffset();
+        break;
+      }
+    } else if (c == '#' && atLineStart) {
+      inDirective = true;
+      atLineStart = false;
+    } else if (!inDirective) {
+      mPreambleEndOffset = it.GetCharacterOffset();
+      break;
+    }
+    previous = c;
+  }
+  if (mPreambleEndOffset < 0) {
+    mPreambleEndOffset = FullDocumentRange().end.offset;
+  }
+  
+  mPreambleHash = qHash(TextForRange(DocumentRange(0, mPreambleEndOffset)));
+  mPreambleHashValid = true;
+  return mPreambleHash;
+}
+
+bool Document::GetTextReplacementsSince(int textChangeCounter, std::vector<TextReplacement>* replacements) const {
+  int count = mTextChangeCounter - textChangeCounter;
+  if (count < 0 || count > static_cast<int>(mTextReplacements.size())) {
+    return false;
+  }
+  replacements->assign(mTextReplacements.end() - count, mTextReplacements.end());
+  return true;
 }
 
 void Document::ReadTextFromFile(QFile* file) {
-  // Read lines from file while removing possible unwanted \r characters
-  QString fileText = "";
-  while (!file->atEnd()) {
-    QByteArray line = file->readLine();
-    fileText += QString::fromUtf8(line);  // TODO: Allow reading other formats than UTF-8 only?
+  // Map the remaining part of the file into memory if possible. Otherwise,
+  // read it.
+  qint64 offset = file->pos();
+  qint64 size = file->size() - offset;
+  uchar* mappedData = (size > 0) ? file->map(offset, size) : nullptr;
+  QByteArray fileContent;
+  const char* data;
+  if (mappedData) {
+    data = reinterpret_cast<const char*>(mappedData);
+  } else {
+    fileContent = file->readAll();
+    data = fileContent.constData();
+    size = fileContent.size();
+  }
+  
+  ReadTextFromData(data, size);
+  
+  if (mappedData) {
+    file->unmap(mappedData);
+  }
+}
+
+void Document::ReadTextFromData(const char* data, qint64 size) {
+  RecordUnmappableTextChange();
+  mLastEditOffset = -1;
+  
+  // Split the bytes into chunks for the blocks, such that no UTF-8 character
+  // and no \r\n line ending is split. Large blocks are used since most of
+  // the file will likely never be edited (see CompactBlocks()).
+  int largeBlockSize = LargeBlockSize();
+  int numBlocks = std::max<qint64>(1, (size + largeBlockSize / 2) / largeBlockSize);
+  std::vector<qint64> chunkStarts(numBlocks + 1);
+  chunkStarts[0] = 0;
+  chunkStarts[numBlocks] = size;
+  for (int i = 1; i < numBlocks; ++ i) {
+    qint64 pos = (static_cast<qint64>(i) * size) / numBlocks;
+    while (pos > chunkStarts[i - 1] &&
+           (static_cast<unsigned char>(data[pos]) & 0xC0) == 0x80) {
+      -- pos;
+    }
+    if (pos > chunkStarts[i - 1] && data[pos] == '\n' && data[pos - 1] == '\r') {
+      -- pos;
+    }
+    chunkStarts[i] = pos;
   }
   
-  // Convert text to blocks
-  int numBlocks = std::max(1, (fileText.size() + desiredBlockSize / 2) / desiredBlockSize);
+  // Decode the chunks directly into blocks, using multiple threads for large
+  // files.
   mBlocks.resize(numBlocks);
-  // Note: This calculation actually overflows for large files if using int for i.
-  for (uint64_t i = 0; i < numBlocks; ++ i) {
-    int pos = (i * fileText.size()) / numBlocks;
-    int posNext = ((i + 1) * fileText.size()) / numBlocks;
-    mBlocks[i].reset(new TextBlock(fileText.mid(pos, posNext - pos), i == 0));
+  auto decodeChunks = [&](int firstBlock, int endBlock) {
+    for (int i = firstBlock; i < endBlock; ++ i) {
+      QString text = QString::fromUtf8(data + chunkStarts[i], chunkStarts[i + 1] - chunkStarts[i]);  // TODO: Allow reading other formats than UTF-8 only?
+      // Remove possible unwanted \r characters
+      if (text.contains('\r')) {
+        text.replace(QStringLiteral("\r\n"), QStringLiteral("\n"));
+      }
+      mBlocks[i] = TextBlockPool::MakeBlock(mBlockPool, text, i == 0);
+    }
+  };
+  int threadCount = (size < kMinFileSizeForParallelDecoding) ? 1 : std::max<int>(1, std::thread::hardware_concurrency());
+  if (threadCount == 1) {
+    decodeChunks(0, numBlocks);
+  } else {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++ t) {
+      threads.emplace_back(decodeChunks,
+                           (static_cast<qint64>(t) * numBlocks) / threadCount,
+                           (static_cast<qint64>(t + 1) * numBlocks) / threadCount);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  
+  // Chunks that only consisted of removed \r characters result in empty
+  // blocks. Remove those (except the first one).
+  mBlocks.erase(std::remove_if(mBlocks.begin() + 1, mBlocks.end(), [](const std::shared_ptr<TextBlock>& block) {
+    return block->text().isEmpty();
+  }), mBlocks.end());
+  
+  RebuildBlockIndex();
+}
+
+bool Document::WriteTextToDevice(QIODevice* device) const {
+  // Each UTF-16 code unit takes at most three bytes in UTF-8.
+  QByteArray chunk;
+  chunk.reserve(kSaveChunkSize + 3 * LargeBlockSize());
+  QChar pendingHighSurrogate;
+  
+  for (int b = 0, numBlocks = mBlocks.size(); b < numBlocks; ++ b) {
+    AppendBlockUtf8(*mBlocks[b], &pendingHighSurrogate, &chunk);
+    bool isLastBlock = b == numBlocks - 1;
+    if (isLastBlock) {
+      FinishBlocksUtf8(&pendingHighSurrogate, &chunk);
+    } else if (chunk.size() < kSaveChunkSize) {
+      continue;
+    }
+    
+    if (device->write(chunk) != chunk.size()) {
+      return false;
+    }
+    // Unlike clear(), resize() keeps the allocated memory.
+    chunk.resize(0);
   }
+  return true;
 }
 
 void Document::ClearContexts() {
   mContexts.clear();
+  mContextIndexValid = false;
 }
 
 void Document::AddContext(const QString& name, const QString& description, const DocumentRange& nameInDescriptionRange, const DocumentRange& range) {
   mContexts.insert(Context(name, description, nameInDescriptionRange, range));
+  mContextIndexValid = false;
+}
+
+/// Appends the contexts among the first @p count entries of @p contexts that
+/// contain @p location to @p result, in the order of @p contexts. @p maxEnds is
+/// the tree described for Document::mContextMaxEnds, and @p node covers the
+/// entries [@p nodeStart, @p nodeEnd). Subtrees whose contexts all end before
+/// the location are skipped.
+static void CollectContextsContaining(
+    const std::vector<const Context*>& contexts, const std::vector<int>& maxEnds,
+    int node, int nodeStart, int nodeEnd, int count,
+    const DocumentLocation& location, std::vector<const Context*>* result) {
+  if (nodeStart >= count || maxEnds[node] < location.offset) {
+    return;
+  }
+  if (nodeEnd - nodeStart == 1) {
+    if (contexts[nodeStart]->range.Contains(location)) {
+      result->push_back(contexts[nodeStart]);
+    }
+    return;
+  }
+  int nodeMiddle = (nodeStart + nodeEnd) / 2;
+  CollectContextsContaining(contexts, maxEnds, 2 * node, nodeStart, nodeMiddle, count, location, result);
+  CollectContextsContaining(contexts, maxEnds, 2 * node + 1, nodeMiddle, nodeEnd, count, location, result);
 }
 
-std::vector<Context> Document::GetContextsAt(const DocumentLocation& location) {
-  std::vector<Context> result;
-  for (const auto& item : mContexts) {
-    if (item.range.Contains(location)) {
-      result.push_back(item);
-    }
+/// Fills @p maxEnds for the node @p node of the tree described for
+/// Document::mContextMaxEnds, which covers the entries
+/// [@p nodeStart, @p nodeEnd) of @p contexts. Returns the node's value.
+static int BuildContextMaxEnds(const std::vector<const Context*>& contexts, int node, int nodeStart, int nodeEnd, std::vector<int>* maxEnds) {
+  if (nodeEnd - nodeStart == 1) {
+    (*maxEnds)[node] = contexts[nodeStart]->range.end.offset;
+  } else {
+    int nodeMiddle = (nodeStart + nodeEnd) / 2;
+    (*maxEnds)[node] = std::max(
+        BuildContextMaxEnds(contexts, 2 * node, nodeStart, nodeMiddle, maxEnds),
+        BuildContextMaxEnds(contexts, 2 * node + 1, nodeMiddle, nodeEnd, maxEnds));
   }
-  // Since the ranges are ordered by increasing start location in mContexts,
-  // we should not need to do any sorting here.
+  return (*maxEnds)[node];
+}
+
+std::vector<const Context*> Document::GetContextsAt(const DocumentLocation& location) {
+  std::vector<const Context*> result;
+  if (mContexts.empty()) {
+    return result;
+  }
+  
+  if (!mContextIndexValid) {
+    mContextIndex.clear();
+    mContextIndex.reserve(mContexts.size());
+    for (const Context& context : mContexts) {
+      mContextIndex.push_back(&context);
+    }
+    mContextMaxEnds.resize(4 * mContextIndex.size());
+    BuildContextMaxEnds(mContextIndex, 1, 0, mContextIndex.size(), &mContextMaxEnds);
+    mContextIndexValid = true;
+  }
+  
+  // Only the contexts that start before the location can contain it. Since
+  // these are ordered by increasing start location, the result is ordered
+  // from the outermost to the innermost context without sorting.
+  int count = std::upper_bound(mContextIndex.begin(), mContextIndex.end(), location, [](const DocumentLocation& location, const Context* context) {
+    return location < context->range.start;
+  }) - mContextIndex.begin();
+  CollectContextsContaining(mContextIndex, mContextMaxEnds, 1, 0, mContextIndex.size(), count, location, &result);
   return result;
 }
+
+
+DocumentSnapshot::DocumentSnapshot(Document* document)
+    : mDocument(new Document()),
+      mVersion(document->version()),
+      mTextChangeCounter(document->textChangeCounter()) {
+  mDocument->AssignText(*document);
+  
+  // Share the UTF-8 text if the document has it already.
+  if (document->mUtf8Text && document->mUtf8TextCounter == mTextChangeCounter) {
+    mTextUtf8 = document->mUtf8Text;
+  }
+}
+
+const std::vector<unsigned>& DocumentSnapshot::GetLineStarts() const {
+  std::call_once(mLineStartsOnce, [&]() {
+    mDocument->GetLineStarts(&mLineStarts);
+  });
+  return mLineStarts;
+}
+
+const std::shared_ptr<const QByteArray>& DocumentSnapshot::GetTextUtf8() const {
+  std::call_once(mTextUtf8Once, [&]() {
+    if (!mTextUtf8) {
+      mTextUtf8.reset(new QByteArray(mDocument->EncodeDocumentTextUtf8()));
+    }
+  });
+  return mTextUtf8;
+}
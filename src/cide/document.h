@@ -4,22 +4,29 @@
 
 #pragma once
 
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include <QColor>
 #include <QFileSystemWatcher>
+#include <QElapsedTimer>
 #include <QObject>
 #include <QString>
 #include <QTime>
 
 #include "cide/clang_tu_pool.h"
 #include "cide/document_range.h"
+#include "cide/fenwick_tree.h"
 #include "cide/problem.h"
 #include "cide/settings.h"
 #include "cide/text_block.h"
+#include "cide/text_regex.h"
 
 enum class LineAttribute {
   Bookmark = 1 << 0,
@@ -28,30 +35,34 @@ enum class LineAttribute {
 };
 
 
-/// A highlight range stored in a Document. It represents a range of text that
-/// a specific font style is applied to.
-struct HighlightRange {
-  HighlightRange() = default;
+/// The font style of highlight ranges. Since there are only a few distinct
+/// styles, each of them is stored once in a HighlightStyleTable and the
+/// highlight ranges refer to it by its index.
+struct HighlightStyle {
+  HighlightStyle() = default;
   
-  HighlightRange(
-      const DocumentRange& range,
+  HighlightStyle(
       bool affectsText,
       const QColor& textColor,
       bool bold,
       bool affectsBackground,
       const QColor& backgroundColor,
       bool isNonCodeRange)
-      : range(range),
-        affectsText(affectsText),
+      : affectsText(affectsText),
         textColor(textColor),
         bold(bold),
         affectsBackground(affectsBackground),
         isNonCodeRange(isNonCodeRange),
         backgroundColor(backgroundColor) {}
   
-  /// Range of this highlight. This may be invalid, in this case it applies to
-  /// the whole text in the document.
-  DocumentRange range;
+  inline bool operator== (const HighlightStyle& other) const {
+    return affectsText == other.affectsText &&
+           textColor.rgba() == other.textColor.rgba() &&
+           bold == other.bold &&
+           affectsBackground == other.affectsBackground &&
+           isNonCodeRange == other.isNonCodeRange &&
+           backgroundColor.rgba() == other.backgroundColor.rgba();
+  }
   
   /// Whether the textColor and bold attributes should be used.
   bool affectsText;
@@ -74,6 +85,51 @@ struct HighlightRange {
 };
 
 
+/// Stores each distinct HighlightStyle once, such that it can be referred to
+/// by its index.
+class HighlightStyleTable {
+ public:
+  /// Returns the index of @p style in the table. If the table does not contain
+  /// the style yet, it is appended.
+  int Intern(const HighlightStyle& style);
+  
+  /// Interns all styles of @p other into this table. Returns a vector that
+  /// maps each style index in @p other to the corresponding index in this
+  /// table.
+  std::vector<int> InternTable(const HighlightStyleTable& other);
+  
+  inline const HighlightStyle& operator[] (int index) const { return mStyles[index]; }
+  inline int size() const { return mStyles.size(); }
+  
+ private:
+  struct StyleHash {
+    std::size_t operator() (const HighlightStyle& style) const;
+  };
+  
+  std::vector<HighlightStyle> mStyles;
+  std::unordered_map<HighlightStyle, int, StyleHash> mStyleIndices;
+};
+
+
+/// A highlight range stored in a Document. It represents a range of text that
+/// a specific font style is applied to. The style is stored in the
+/// HighlightStyleTable of the document (or of the HighlightBuffer).
+struct HighlightRange {
+  HighlightRange() = default;
+  
+  HighlightRange(const DocumentRange& range, int styleId)
+      : range(range),
+        styleId(styleId) {}
+  
+  /// Range of this highlight. This may be invalid, in this case it applies to
+  /// the whole text in the document.
+  DocumentRange range;
+  
+  /// Index of the style of this highlight in the style table.
+  int styleId;
+};
+
+
 /// A context within the source code with a name and a range. Used to display
 /// the name of the current function/class/struct, and to jump to functions/
 /// classes/structs in the current file via the search bar.
@@ -101,22 +157,138 @@ struct Context {
 };
 
 
+/// Records that the text in @a oldRange was replaced by @a newTextSize
+/// characters. Used to map ranges that refer to an older version of a document
+/// to the current version, see Document::GetTextReplacementsSince().
+struct TextReplacement {
+  inline TextReplacement(const DocumentRange& oldRange, int newTextSize)
+      : oldRange(oldRange), newTextSize(newTextSize) {}
+  
+  /// Maps a range from before the replacement to after it, in the same way as
+  /// Document::Replace() adapts the problem and context ranges. Returns an
+  /// invalid range if the range is removed by the replacement.
+  DocumentRange MapRange(const DocumentRange& range) const;
+  
+  /// Maps a location from before the replacement to after it. Locations within
+  /// the replaced range are mapped to its start.
+  DocumentLocation MapLocation(const DocumentLocation& location) const;
+  
+  DocumentRange oldRange;
+  int newTextSize;
+};
+
+
+/// Collects highlight ranges, contexts, and problems for a Document without
+/// accessing the document itself. This allows to compute them in a background
+/// thread (e.g., from a libclang parse) and then to apply them to the document
+/// at once in the main thread with Document::ApplyHighlightBuffer().
+struct HighlightBuffer {
+  /// Analogous to Document::AddHighlightRange().
+  inline void AddHighlightRange(const DocumentRange& range, bool isNonCodeRange, const QColor& textColor, bool bold, bool affectsText = true, bool affectsBackground = false, const QColor& backgroundColor = qRgb(255, 255, 255)) {
+    if (range.IsInvalid() || range.IsEmpty() ||
+        (chunkRange.IsValid() && !chunkRange.ContainsCharacter(range.start.offset))) {
+      return;
+    }
+    ranges.emplace_back(range, styles.Intern(HighlightStyle(affectsText, textColor, bold, affectsBackground, backgroundColor, isNonCodeRange)));
+  }
+  inline void AddHighlightRange(const DocumentRange& range, bool isNonCodeRange, const Settings::ConfigurableTextStyle& style) {
+    AddHighlightRange(range, isNonCodeRange, style.textColor, style.bold, style.affectsText, style.affectsBackground, style.backgroundColor);
+  }
+  
+  /// Analogous to Document::AddContext().
+  inline void AddContext(const QString& name, const QString& description, const DocumentRange& nameInDescriptionRange, const DocumentRange& range) {
+    if (chunkRange.IsValid() && !chunkRange.ContainsCharacter(range.start.offset)) {
+      return;
+    }
+    contexts.insert(Context(name, description, nameInDescriptionRange, range));
+  }
+  
+  /// Analogous to Document::AddProblem().
+  inline int AddProblem(const std::shared_ptr<Problem>& problem) {
+    problems.push_back(problem);
+    return problems.size() - 1;
+  }
+  
+  /// Analogous to Document::AddProblemRange().
+  inline void AddProblemRange(int problemIndex, const DocumentRange& range) {
+    if (!range.IsValid()) {
+      return;
+    }
+    problemRanges.insert(ProblemRange(range, problemIndex));
+  }
+  
+  /// Adds the Warning or Error line attribute to the line that starts at
+  /// @p lineStart.
+  inline void AddProblemLineAttributes(const DocumentLocation& lineStart, int attributes) {
+    problemLineAttributes.emplace_back(lineStart, attributes);
+  }
+  
+  /// Maps all collected data through the given @p replacements (applied in
+  /// order), such that data that was computed for an older version of the
+  /// document can be applied to a newer version. Ranges that get removed by
+  /// the replacements are dropped.
+  void Rebase(const std::vector<TextReplacement>& replacements);
+  
+  
+  /// The highlight ranges, whose style IDs refer to the buffer's own style
+  /// table. They are mapped to the document's style table when applying them.
+  std::vector<HighlightRange> ranges;
+  HighlightStyleTable styles;
+  
+  std::set<Context> contexts;
+  std::vector<std::shared_ptr<Problem>> problems;
+  std::set<ProblemRange> problemRanges;
+  
+  /// Pairs of (line start, attributes). Line starts are stored as locations
+  /// instead of line indices such that they can be rebased.
+  std::vector<std::pair<DocumentLocation, int>> problemLineAttributes;
+  
+  /// If valid, only highlight ranges and contexts that start within this range
+  /// are added. This is used to collect the highlighting in chunks without
+  /// adding ranges that span several chunks more than once.
+  DocumentRange chunkRange = DocumentRange::Invalid();
+};
+
+
+/// The version of a document that its diffLines() were computed against (for
+/// example, the file in the HEAD commit of a git repository). The removed text
+/// of a LineDiff is only fetched from it when it is displayed.
+class LineDiffBase {
+ public:
+  virtual ~LineDiffBase() = default;
+  
+  /// Returns the text of the lines [firstLine, firstLine + numLines) (0-based)
+  /// of this version, including their newline characters. Can be called from
+  /// any thread.
+  virtual QString GetLines(int firstLine, int numLines) const = 0;
+};
+
 struct LineDiff {
-  enum class Type {
+  enum class Type : unsigned char {
     Added = 0,
     Modified,
     Removed
   };
   
-  inline LineDiff(Type type, int line, int numLines, const QString& oldText)
+  /// Change of the newline at the end of the file that this diff includes.
+  enum class EndOfFileNewline : unsigned char {
+    Unchanged = 0,
+    Added,
+    Removed
+  };
+  
+  inline LineDiff(Type type, int line, int numLines, int oldLine)
       : type(type),
         line(line),
         numLines(numLines),
-        oldText(oldText) {}
+        oldLine(oldLine) {}
   
   /// Type of change performed to this line.
   Type type;
   
+  /// Change of the newline at the end of the file.
+  EndOfFileNewline endOfFileNewline = EndOfFileNewline::Unchanged;
+  
   /// Line at which to display this diff in the current version of
   /// the document. For type == Type::Removed, the removal should be
   /// displayed *on the top* (instead of bottom) of this line.
@@ -126,23 +298,71 @@ struct LineDiff {
   /// of the document (for Type::Added and Type::Modified).
   int numLines;
   
+  /// First removed line in the old version of the document (see
+  /// LineDiffBase), or -1 if no lines were removed.
+  int oldLine;
+  
   /// Number of removed lines that this diff went over in the old version
   /// of the document (for Type::Removed and Type::Modified).
   int numRemovedLines = 0;
+};
+
+/// The commit that last changed a range of lines, as determined by git blame.
+struct LineBlame {
+  inline LineBlame(int line, int numLines, const QString& commitId, const QString& author, qint64 time)
+      : line(line),
+        numLines(numLines),
+        commitId(commitId),
+        author(author),
+        time(time) {}
   
-  /// The old text of the line. This is empty for new lines.
-  QString oldText;
+  /// First line of the range in the current version of the document.
+  int line;
+  
+  /// Number of lines in the range.
+  int numLines;
+  
+  /// Abbreviated ID of the commit.
+  QString commitId;
+  
+  /// Name of the commit's author.
+  QString author;
+  
+  /// Time of the commit, in seconds since the epoch.
+  qint64 time;
 };
 
 
 /// Stores information about a replacement operation. This is used to store
 /// undo/redo steps.
 struct Replacement {
+  inline Replacement() = default;
+  
+  inline Replacement(const DocumentRange& range, const QString& text)
+      : range(range),
+        text(text) {}
+  
+  /// If the text is large, moves it into compressedText in compressed form to
+  /// reduce the memory used by the undo history.
+  void Compress();
+  
+  /// Returns the text that the range shall be replaced with (decompressing it
+  /// if necessary).
+  QString GetText() const;
+  
+  /// Returns the approximate number of bytes used by this replacement.
+  std::size_t MemoryUsage() const;
+  
+  
   /// The range that shall be replaced when applying this step.
   DocumentRange range;
   
   /// The text that the range shall be replaced with when applying this step.
+  /// This is empty if the text is compressed, see Compress().
   QString text;
+  
+  /// If not empty, the text in compressed form (see Compress()).
+  QByteArray compressedText;
 };
 
 
@@ -156,6 +376,11 @@ struct DocumentVersionLink {
   inline DocumentVersionLink(DocumentVersion* version, const std::vector<Replacement>& replacements)
       : linkedVersion(version), replacements{replacements} {}
   
+  /// Returns the approximate number of bytes used by this link and the
+  /// linked version (without the versions that are linked from it).
+  std::size_t MemoryUsage() const;
+  
+  
   /// The version that can be reached with this link.
   DocumentVersion* linkedVersion;
   
@@ -215,12 +440,34 @@ struct DocumentVersion {
 };
 
 
+class DocumentSnapshot;
+
+/// Approximate memory used by a Document, in bytes, see
+/// Document::EstimateMemoryUsage().
+struct DocumentMemoryUsage {
+  inline std::size_t Total() const { return text + highlights + undoHistory + other; }
+  
+  /// The text blocks and the indexes over them.
+  std::size_t text = 0;
+  
+  /// The highlight ranges and the style ranges derived from them.
+  std::size_t highlights = 0;
+  
+  /// The graph of undo / redo steps.
+  std::size_t undoHistory = 0;
+  
+  /// Problems, contexts and the git diff.
+  std::size_t other = 0;
+};
+
 /// A text document.
 class Document : public QObject {
  Q_OBJECT
+ friend class DocumentSnapshot;
  public:
   class CharacterIterator;
   class CharacterAndStyleIterator;
+  class StyleRunIterator;
   
   class LineIterator {
    public:
@@ -304,9 +551,9 @@ class Document : public QObject {
     
     QChar GetChar() const;
     /// Returns the style at the iterator's location, considering all style layers.
-    HighlightRange GetStyle() const;
+    HighlightStyle GetStyle() const;
     /// Returns the style at the iterator's location, considering only the given style layer.
-    const HighlightRange& GetStyleOfLayer(int layer) const;
+    const HighlightStyle& GetStyleOfLayer(int layer) const;
     
     inline int GetCharacterOffset() const {
       return blockStartOffset + charInBlockIndex;
@@ -345,36 +592,121 @@ class Document : public QObject {
     bool styleChanged;
   };
   
+  /// Iterates over the document in runs of characters that have the same
+  /// style in all style layers. In contrast to CharacterAndStyleIterator, the
+  /// layers are merged only once per run rather than for each character, and
+  /// the text of a run can be accessed at once. Runs do not extend over text
+  /// block boundaries, so consecutive runs may have the same style.
+  class StyleRunIterator {
+   public:
+    /// Creates an iterator whose first run starts at the given character.
+    StyleRunIterator(Document* document, int characterOffset);
+    
+    bool IsValid() const;
+    
+    /// Returns the document offset of the first character of the run. After
+    /// the iterator reached the end of the document, this returns the
+    /// document size.
+    inline int GetRunStart() const { return blockStartOffset + runStart; }
+    /// Returns the document offset after the last character of the run.
+    inline int GetRunEnd() const { return blockStartOffset + runEnd; }
+    inline int GetSize() const { return runEnd - runStart; }
+    
+    /// Returns the text of the run (GetSize() characters). The pointer is
+    /// invalidated by modifications of the document.
+    const QChar* GetText() const;
+    
+    /// Returns the style of the run, considering all style layers.
+    inline const HighlightStyle& GetStyle() const { return style; }
+    /// Returns whether the run is a non-code range (a comment or a string,
+    /// for example), as given by the first style layer.
+    inline bool IsNonCode() const { return isNonCode; }
+    
+    void operator++();
+    
+   private:
+    /// Determines runEnd and the style of the run that starts at runStart.
+    void InitializeRun();
+    
+    Document* document;
+    int blockIndex;
+    int blockStartOffset;
+    int runStart;
+    int runEnd;
+    int styleInBlockIndex[TextBlock::kLayerCount];
+    HighlightStyle style;
+    bool isNonCode;
+  };
+  
   /// Creates an empty document.
   Document(int desiredBlockSize = 128);
   
   /// Destructor. Frees the document version graph.
   ~Document();
   
-  // Assigns the text and styles from the other document to this document.
+  /// Assigns the text and styles from the other document to this document.
+  /// This is cheap since the text blocks are shared among both documents until
+  /// one of them modifies a block (copy-on-write). This makes it suitable for
+  /// creating snapshots of the document to be used in background threads.
   void AssignTextAndStyles(const Document& other);
   
+  /// Version of AssignTextAndStyles() that only assigns the text.
+  void AssignText(const Document& other);
+  
+  /// Determines a single replacement that transforms the text of @p older into
+  /// the text of this document, and returns it in @p replacement (with its
+  /// range referring to @p older). Blocks at the start and end that are shared
+  /// (see AssignTextAndStyles()) or that have equal text are skipped, so this
+  /// is cheap if @p older is an earlier snapshot of this document. Returns
+  /// false if both texts are equal.
+  bool GetReplacementFrom(const Document& older, Replacement* replacement) const;
+  
   /// Attempts to open the file at the given path.
   bool Open(const QString& path);
   
+  /// Like Open(const QString&), but uses @p content as the file content instead
+  /// of reading it. This allows to read the files for many documents at once
+  /// in parallel (see MainWindow::OpenFiles()).
+  void Open(const QString& path, const QByteArray& content);
+  
+  /// Reads the file at path() again and applies its differences to the
+  /// current text as replacements of the changed lines (in a single undo
+  /// step). In contrast to Open(), this keeps the highlight ranges, bookmarks,
+  /// and line attributes of the unchanged lines, as well as the undo history.
+  /// Falls back to Open() if the differences cannot be computed.
+  bool Reload();
+  
   /// Attempts to save the file to the given path.
   bool Save(const QString& path);
   
-  /// Attempts to open the backup file at @p backupPath. Returns the original
-  /// path of the file in @p originalPath. Returns true if successful, false
-  /// otherwise.
-  /// NOTE: Does not set the path of this document.
-  bool OpenBackup(const QString& backupPath, QString* originalPath);
-  
-  /// Attempts to save a backup file to the given path. The backup file contains
-  /// the original file path in its first line.
-  /// NOTE: Does not set the path of this document.
-  bool SaveBackup(const QString& backupPath, const QString& originalPath);
+  /// Saving in steps, which allows to write the files of several documents in
+  /// parallel (see MainWindow::SaveAll()). BeginSave() stops watching the file
+  /// (such that the write does not cause a change notification) and returns a
+  /// snapshot of the text to be saved. WriteSnapshot() writes it and may be
+  /// called from any thread. FinishSave() must be called afterwards with the
+  /// result; it watches the (new or old) file again and marks the snapshot's
+  /// version as saved if the write succeeded. BeginSave() and FinishSave() must
+  /// be called from the Qt thread.
+  std::shared_ptr<const DocumentSnapshot> BeginSave();
+  static bool WriteSnapshot(const DocumentSnapshot& snapshot, const QString& path);
+  void FinishSave(const QString& path, int savedVersion, bool success);
   
   /// The basic editing operation that all edits are implemented with: text replacement.
   /// This replaces the given @p range in the document with @p newText.
   void Replace(const DocumentRange& range, const QString& newText, bool createUndoStep = true, Replacement* undoReplacement = nullptr, bool forceNewUndoStep = false);
   
+  /// Performs all given @p replacements at once, which is much faster than
+  /// calling Replace() for each of them if there are many (for example, for
+  /// "replace all" or renaming). The ranges must be sorted and must not
+  /// overlap, and all of them refer to the text before the replacements. The
+  /// blocks are split and merged and the highlight ranges are adapted only
+  /// once. If @p createUndoStep is true, a single undo step is created for all
+  /// replacements (or they are added to the current combined undo step, see
+  /// StartUndoStep()). Otherwise, if @p undoReplacements is given, the
+  /// replacements that revert this are returned in it, in the order in which
+  /// they need to be applied one after another.
+  void ReplaceMany(const std::vector<Replacement>& replacements, bool createUndoStep = true, std::vector<Replacement>* undoReplacements = nullptr);
+  
   /// This may be called before a series of calls to Replace() to mark the start
   /// of a single undo step that encompasses multiple replacements. For example,
   /// the "replace all" functionality would group all individual replacements
@@ -385,6 +717,12 @@ class Document : public QObject {
   /// Counterpart to StartUndoStep().
   void EndUndoStep();
   
+  /// Sets the approximate maximum memory in bytes that the undo history of
+  /// each document may use (zero meaning no limit). If a document exceeds it,
+  /// the undo and redo steps that are farthest from the current version are
+  /// deleted. The default is given by Settings::GetUndoHistoryMemoryLimitMB().
+  static void SetUndoHistoryMemoryLimit(std::size_t bytes);
+  
   /// Returns the document text for the given range.
   QString TextForRange(const DocumentRange& range);
   
@@ -393,6 +731,23 @@ class Document : public QObject {
   /// size.
   void CheckBlockSplitOrMerge(int index);
   
+  /// Merges runs of consecutive blocks into blocks of up to LargeBlockSize()
+  /// characters, except for the blocks close to the last edit. Small blocks
+  /// make editing fast, while large blocks have less overhead in memory and
+  /// are faster to iterate over, so this keeps the parts of the document that
+  /// are not being edited in large blocks. An edit in a large block splits it
+  /// into blocks of the desired size again (see CheckBlockSplitOrMerge()).
+  void CompactBlocks();
+  
+  /// Enables or disables calling CompactBlocks() after the document has not
+  /// been edited for a while. This is enabled for the documents that are open
+  /// in the editor. This function must be called from the main (Qt) thread.
+  void SetCompactBlocksWhenIdle(bool enable);
+  
+  /// Returns the size of the large blocks that CompactBlocks() creates. Files
+  /// are also read into blocks of this size.
+  inline int LargeBlockSize() const { return 32 * desiredBlockSize; }
+  
   /// Undoes the last replacement (if there is any). Returns true if a step has
   /// been undone, false if there was nothing to undo. If @p newTextRange is
   /// given, it will be set to the range of the new text (if any) inserted as
@@ -413,6 +768,25 @@ class Document : public QObject {
   /// an invalid location on failure. Does not perform wrap-around.
   DocumentLocation Find(const QString& searchString, const DocumentLocation& searchStart, bool forwards, bool matchCase);
   
+  /// Returns the range of the first match of @p regex that starts at or after
+  /// @p searchStart if @p forwards is true, or of the last match that ends at
+  /// or before @p searchStart otherwise (of the non-overlapping matches
+  /// starting from the document start). Returns an invalid range if there is
+  /// no match. Does not perform wrap-around.
+  DocumentRange FindRegex(const TextRegex& regex, const DocumentLocation& searchStart, bool forwards);
+  
+  /// Appends all (non-overlapping) matches of @p regex within @p range to
+  /// @p matches, in order.
+  void FindAllRegex(const TextRegex& regex, const DocumentRange& range, std::vector<DocumentRange>* matches);
+  
+  /// Sets @p occurrences to the ranges of all occurrences of @p identifier in
+  /// the document that are not part of a longer word, in order. Identifiers
+  /// are runs of word characters (see GetCharType()); for other strings, no
+  /// occurrences are returned. This uses a per-block index of the identifiers
+  /// (see IdentifierIndex) that is only re-built for blocks that changed, so
+  /// repeated queries do not need to look at the text.
+  void FindIdentifierOccurrences(const QString& identifier, std::vector<DocumentRange>* occurrences);
+  
   inline const QString& path() const { return mPath; }
   inline const QString& fileName() const { return mFileName; }
   void setPath(const QString& path);
@@ -421,24 +795,51 @@ class Document : public QObject {
   DocumentRange FullDocumentRange() const;
   
   /// Returns a range for the "word" that contains the given @p characterOffset.
-  /// A word is defined as a continuous range of characters that are classified
-  /// to be of the same type by @p charClassifier. This function must return the
-  /// type (an arbitrary integer) for the QChar parameter passed to it.
-  /// The type noWordType is treated as an exception: Characters of this type
+  /// A word is defined as a continuous range of characters within a line that
+  /// have the same GetCharType(). Symbols are treated as an exception: they
   /// are never merged together into words.
-  DocumentRange RangeForWordAt(int characterOffset, const std::function<int(QChar)>& charClassifier, int noWordType) const;
+  DocumentRange RangeForWordAt(int characterOffset) const;
   
   /// Returns the offset of the matching bracket to the bracket at @p pos, or -1
-  /// if no matching bracket was found.
-  /// TODO: This function does not account for brackets in strings or macros.
+  /// if no matching bracket was found. Brackets in non-code ranges (e.g.,
+  /// comments and string literals, according to the highlighting) are ignored.
+  /// Text blocks that cannot contain the match are skipped using a per-block
+  /// summary of their brackets, see BracketSummary.
+  /// TODO: This function does not account for brackets in macros.
   ///       It may thus return wrong results.
   int FindMatchingBracket(const CharacterAndStyleIterator& pos);
   
   /// Returns the number of lines in the document.
   int LineCount() const;
   
+  /// Returns the (0-based) index of the line that contains the given location.
+  int LineForLocation(const DocumentLocation& location) const;
+  
+  /// Returns the start of the line with the given (0-based) index, or an
+  /// invalid location if there is no such line. This takes logarithmic time,
+  /// since the line starts are maintained per block (with prefix sums over the
+  /// blocks) instead of being searched for.
+  DocumentLocation LineStart(int line) const;
+  
+  /// Returns the character offsets of the starts of all lines in
+  /// @p lineStarts. This is faster than using a LineIterator.
+  void GetLineStarts(std::vector<unsigned>* lineStarts) const;
+  
+  /// Returns the size of the document text in UTF-8 encoding, without encoding
+  /// the text.
+  inline int Utf8Size() const { return mBlockUtf8Sizes.Total(); }
+  
+  /// Maps between (UTF-16) document locations and offsets in the UTF-8 encoded
+  /// text (as used by libclang) in logarithmic time, without encoding the
+  /// text. UTF-8 offsets within the encoding of a character are mapped to the
+  /// start of the character. Out-of-range arguments are clamped to the
+  /// document.
+  int Utf8OffsetForLocation(const DocumentLocation& location) const;
+  DocumentLocation LocationForUtf8Offset(int utf8Offset) const;
+  
   /// For debugging, verifies that the newline offsets (as stored in the lineAttributes
-  /// elements of the TextBlocks) are at the correct places.
+  /// elements of the TextBlocks) are at the correct places, and that the block
+  /// index is up-to-date.
   bool DebugCheckNewlineoffsets() const;
   
   /// For debugging, verifies that the version graph is an acyclic graph.
@@ -450,12 +851,71 @@ class Document : public QObject {
   /// Returns the complete document as a QString.
   QString GetDocumentText() const;
   
+  /// Returns the complete document in UTF-8 encoding, encoding it from the
+  /// blocks directly (without creating the UTF-16 text of the whole document
+  /// first). Prefer GetDocumentTextUtf8() in the Qt thread, which caches the
+  /// result.
+  QByteArray EncodeDocumentTextUtf8() const;
+  
+  /// Returns the complete document in UTF-8 encoding. The result is cached
+  /// until the next change to the text, such that the consumers that need the
+  /// UTF-8 text (parsing, code info requests, git diff) do not convert the
+  /// document again if it did not change. The returned buffer is never
+  /// modified, so it can be used in background threads after this call.
+  /// This function must be called from the main (Qt) thread.
+  std::shared_ptr<const QByteArray> GetDocumentTextUtf8();
+  
+  /// Enables or disables publishing snapshots of the document text (see
+  /// GetSnapshot()). This is enabled for the documents that are open in the
+  /// editor. Enabling it publishes a snapshot right away.
+  /// This function must be called from the main (Qt) thread.
+  void SetPublishSnapshots(bool enable);
+  
+  /// Returns the most recently published snapshot of the document text, or
+  /// null if snapshots are not published for this document. This can be
+  /// called from any thread without locking and without waiting for the main
+  /// thread (as long as the document exists). After text changes, a new
+  /// snapshot is published once the main thread has finished processing the
+  /// current batch of changes, so the snapshot may briefly lag behind the
+  /// document. Its textChangeCounter() tells which state it shows.
+  inline std::shared_ptr<const DocumentSnapshot> GetSnapshot() const {
+    return std::atomic_load(&mSnapshot);
+  }
+  
+  /// Publishes a snapshot of the current document text (if the last published
+  /// snapshot is outdated) and returns it. This can be used to get an
+  /// up-to-date snapshot right away. Snapshots must be enabled with
+  /// SetPublishSnapshots(). This function must be called from the main (Qt)
+  /// thread.
+  std::shared_ptr<const DocumentSnapshot> UpdateSnapshot();
+  
+  /// Returns a hash of the text and of the resolved text colors within
+  /// @p range, which allows to detect unchanged ranges between snapshots of a
+  /// document (see AssignTextAndStyles()) without reading the text. The text
+  /// blocks are hashed by identity, since shared blocks are copied before they
+  /// are modified. Thus, hashes from different snapshots may only be compared
+  /// while the older snapshot is still alive, and equal text in different
+  /// blocks usually results in different hashes.
+  std::size_t HashRangeContent(const DocumentRange& range) const;
+  
   /// Returns the range of the characters in the given line.
   DocumentRange GetRangeForLine(int l);
   
   /// Line diffs
   inline const std::vector<LineDiff>& diffLines() const { return mDiffLines; }
-  inline void SwapDiffLines(std::vector<LineDiff>* lineDiff) { lineDiff->swap(mDiffLines); }
+  inline void SwapDiffLines(std::vector<LineDiff>* lineDiff, const std::shared_ptr<const LineDiffBase>& base) {
+    lineDiff->swap(mDiffLines);
+    mDiffBase = base;
+  }
+  
+  /// Returns the text that was removed by @p diff (which must be one of the
+  /// diffLines()), or an empty string if it did not remove anything.
+  QString GetLineDiffOldText(const LineDiff& diff) const;
+  
+  /// Git blame of the lines. Lines that were added or modified since the HEAD
+  /// commit are not covered.
+  inline const std::vector<LineBlame>& blameLines() const { return mBlameLines; }
+  inline void SwapBlameLines(std::vector<LineBlame>* lineBlame) { lineBlame->swap(mBlameLines); }
   
   /// Line attributes, see the LineAttribute enum.
   int lineAttributes(int l);
@@ -463,11 +923,51 @@ class Document : public QObject {
   void AddLineAttributes(int l, int attributes);
   void RemoveLineAttributes(int l, int attributes);
   
+  /// Returns the first line at or after @p line (respectively, the last line
+  /// at or before it) that has any of the given @p attributes (a combination
+  /// of LineAttribute flags), or -1 if there is none. Blocks without any line
+  /// attributes are skipped without looking at their lines.
+  int FindNextLineWithAttributes(int line, int attributes);
+  int FindPreviousLineWithAttributes(int line, int attributes);
+  
+  /// Returns all lines that have non-zero attributes, together with their
+  /// attributes, in ascending order of the lines.
+  void GetLinesWithAttributes(std::vector<std::pair<int, int>>* lines);
+  
   /// Returns a number that is always increased if any text change is made to
   /// the document. This can be used to determine whether the text has changed
   /// from when the document was last accessed.
   inline int version() const { return mVersion; }
   
+  /// Returns a number that is increased by one for every change to the text
+  /// of the document. In contrast to version(), this never decreases (e.g.,
+  /// on undo). Each Replace() emits TextReplaced() with the new value, so a
+  /// listener that has seen all values in sequence knows about all changes and
+  /// can adapt its own data incrementally instead of re-computing it.
+  inline int textChangeCounter() const { return mTextChangeCounter; }
+  
+  /// Returns the value of textChangeCounter() after the last change that may
+  /// have affected the code of the document. Changes that are confined to the
+  /// contents of a comment or to the whitespace between two tokens (judging
+  /// by the current highlighting) do not count.
+  inline int lastCodeChangeCounter() const { return mLastCodeChangeCounter; }
+  
+  /// Returns a hash of the preamble region of the document, i.e., of the text
+  /// before the first token that is not part of a comment or preprocessor
+  /// directive. This is the part of the file that libclang precompiles as the
+  /// preamble, so if the hash did not change since the last parse, a reparse
+  /// can re-use the preamble (unless included files changed). The hash is
+  /// cached and only re-computed after edits at or before the end of the
+  /// preamble region, so that typing in the code below is not affected.
+  std::size_t preambleHash();
+  
+  /// Returns the replacements that were made since textChangeCounter() had
+  /// the value @p textChangeCounter, in the order in which they were made.
+  /// Returns false if this is not possible since the document text was
+  /// re-assigned in the meantime, or since the replacements are too old to be
+  /// stored anymore.
+  bool GetTextReplacementsSince(int textChangeCounter, std::vector<TextReplacement>* replacements) const;
+  
   /// Highlight ranges.
   void AddHighlightRange(const DocumentRange& range, bool isNonCodeRange, const QColor& textColor, bool bold, bool affectsText = true, bool affectsBackground = false, const QColor& backgroundColor = qRgb(255, 255, 255), int layer = 0);
   inline void AddHighlightRange(const DocumentRange& range, bool isNonCodeRange, const Settings::ConfigurableTextStyle& style, int layer = 0) {
@@ -475,6 +975,25 @@ class Document : public QObject {
   }
   void ClearHighlightRanges(int layer);
   inline std::vector<HighlightRange>& GetHighlightRanges(int layer) { return mRanges[layer]; }
+  /// Returns the style table that the style IDs of the highlight ranges refer to.
+  inline const HighlightStyleTable& GetHighlightStyles() const { return mStyles; }
+  
+  /// Replaces the highlight ranges in @p layer, the contexts, the problems,
+  /// and the Warning / Error line attributes with the content of @p buffer.
+  /// The highlight ranges are applied as a delta: ranges that are equal to
+  /// current ones keep their indices, such that only the blocks whose styles
+  /// actually change are modified (and reported by HighlightingChanged()).
+  /// The problems and line attributes are only replaced if the problems
+  /// differ from the current ones; problems that remain keep their Problem
+  /// objects. Returns whether the problems changed.
+  /// This takes the data out of the buffer, leaving it in an unspecified state.
+  /// FinishedHighlightingChanges() must be called afterwards.
+  bool ApplyHighlightBuffer(HighlightBuffer* buffer, int layer = 0);
+  
+  /// Adds the given highlight ranges in addition to the existing ones, as with
+  /// AddHighlightRange(). The style IDs of the ranges refer to @p styles.
+  /// FinishedHighlightingChanges() must be called afterwards.
+  void AddHighlightRanges(const std::vector<HighlightRange>& ranges, const HighlightStyleTable& styles, int layer = 0);
   /// To be called after adding/clearing highlight ranges.
   void FinishedHighlightingChanges();
   
@@ -489,28 +1008,123 @@ class Document : public QObject {
   const std::vector<std::shared_ptr<Problem>>& problems() const { return mProblems; }
   const std::set<ProblemRange>& problemRanges() const { return mProblemRanges; }
   
+  /// Returns the parts of the problem ranges that lie within the given line,
+  /// sorted by their start, as the range [*begin, *end). This allows to
+  /// handle the problems of a line without searching through all problem
+  /// ranges. The spans are indexed by line on first use after the problem
+  /// ranges or the text changed. The returned pointers are invalidated by the
+  /// next such change.
+  void GetProblemLineSpans(int line, const ProblemLineSpan** begin, const ProblemLineSpan** end);
+  
   // Contexts.
   void ClearContexts();
   void AddContext(const QString& name, const QString& description, const DocumentRange& nameInDescriptionRange, const DocumentRange& range);
   /// Returns the stack of context at the given document location. Items at
   /// earlier indices are supposed to enclose the items at later indices in the
-  /// returned vector.
-  std::vector<Context> GetContextsAt(const DocumentLocation& location);
+  /// returned vector. The pointers stay valid until the contexts are changed
+  /// (including by edits of the document text). This takes O(log(n) + k)
+  /// time for n contexts in the document and k returned contexts, using an
+  /// index that is re-built after the contexts change.
+  std::vector<const Context*> GetContextsAt(const DocumentLocation& location);
   const std::set<Context>& GetContexts() const { return mContexts; }
   
   /// Returns the libclang TU pool for this document. Allocates the pool if it
   /// does not exist yet.
   ClangTUPool* GetTUPool();
   
+  /// Returns the libclang TU pool for this document, or null if it has not
+  /// been allocated yet.
+  inline ClangTUPool* GetTUPoolIfAllocated() const { return mTUPool.get(); }
+  
+  /// Returns an estimate of the memory used by the document (not counting its
+  /// libclang TUs). Text blocks that are shared with snapshots are counted
+  /// fully.
+  DocumentMemoryUsage EstimateMemoryUsage() const;
+  
  signals:
-  void Changed();
-  void HighlightingChanged();
+  /// Emitted after changes to the text that create a new document version
+  /// (including loading and undo / redo). All changes that are made while
+  /// the Qt thread processes one event are reported together by a single
+  /// emission after that event, such that listeners update only once for
+  /// operations that consist of many replacements. @p changedRange covers all
+  /// text that was changed since the previous emission, in the coordinates of
+  /// the document at the time of the emission.
+  void Changed(const DocumentRange& changedRange);
+  /// Emitted by Replace() after the text in @p oldRange has been replaced by
+  /// @p newTextSize characters. @p textChangeCounter is the new value of
+  /// textChangeCounter(). Note that in contrast to Changed(), this is also
+  /// emitted for the individual replacements of undo / redo steps.
+  void TextReplaced(const DocumentRange& oldRange, int newTextSize, int textChangeCounter);
+  /// Emitted by FinishedHighlightingChanges(). @p changedRange covers all text
+  /// whose highlighting or problems changed since the previous emission. It
+  /// is invalid if nothing changed.
+  void HighlightingChanged(const DocumentRange& changedRange);
   void FileChangedExternally();
   
  private slots:
   void FileWatcherNotification();
   
  private:
+  /// Summary of the brackets in a text block that are not in non-code ranges
+  /// of layer 0, for each bracket type ((), [], {}). This allows
+  /// FindMatchingBracket() to skip over blocks without looking at their text.
+  struct BracketSummary {
+    static constexpr int kTypeCount = 3;
+    
+    /// Number of opening minus closing brackets.
+    int net[kTypeCount];
+    
+    /// Minimum of the number of opening minus closing brackets over all
+    /// prefixes of the block (including the empty prefix, so this is <= 0).
+    int minPrefix[kTypeCount];
+    
+    bool valid = false;
+  };
+  
+  /// Returns the summary for the block with the given index, computing it if
+  /// it is not cached.
+  const BracketSummary& GetBracketSummary(int blockIndex);
+  
+  /// Scans the characters [@p begin, @p end) of the block with the given index
+  /// (forwards or backwards) for a bracket that matches, skipping non-code
+  /// ranges. Each occurrence of @p bracket increases @p counter and each
+  /// occurrence of @p matchingBracket decreases it. Returns the document offset
+  /// of the character at which the counter reaches zero, or -1.
+  int ScanBlockForMatchingBracket(int blockIndex, int blockStartOffset, int begin, int end, bool forwards, QChar bracket, QChar matchingBracket, int* counter) const;
+  
+  /// Index of the identifiers in a text block, used by
+  /// FindIdentifierOccurrences().
+  struct IdentifierIndex {
+    struct Entry {
+      inline bool operator< (const Entry& other) const {
+        return hash < other.hash || (hash == other.hash && offset < other.offset);
+      }
+      
+      /// qHash() of the identifier text.
+      uint hash;
+      
+      /// Offset and size of the identifier within the block.
+      int offset;
+      int size;
+    };
+    
+    /// The identifiers that do not extend to the end of the block, sorted by
+    /// hash and offset. An identifier at offset 0 may be the end of an
+    /// identifier that starts in a preceding block.
+    std::vector<Entry> entries;
+    
+    /// Start offset of the identifier that extends to the end of the block
+    /// (and possibly continues in the following blocks), or -1 if the block
+    /// does not end with a word character.
+    int trailingStart = -1;
+    
+    bool valid = false;
+  };
+  
+  /// Returns the identifier index for the block with the given index,
+  /// computing it if it is not cached.
+  const IdentifierIndex& GetIdentifierIndex(int blockIndex);
+  
   /// Returns the block index for the block containing the given location.
   /// For locations that are at the border between two blocks, @p forwards is
   /// used to disambiguate: if true, the following block is returned,
@@ -524,48 +1138,158 @@ class Document : public QObject {
   /// characters).
   int BlockForCharacter(int characterOffset, int* blockStartOffset) const;
   
+  /// Returns the style that results from applying all style layers of the
+  /// given block on top of each other, where styleInBlockIndex gives the
+  /// index of the style range for each layer.
+  HighlightStyle MergeLayerStyles(const TextBlock& block, const int* styleInBlockIndex) const;
+  
   /// Deletes all (non-default) style ranges in the TextBlocks and re-applies
-  /// the current stack of mRanges.
-  void ReapplyHighlightRanges(int layer);
+  /// the current stack of mRanges. @p oldRanges are the highlight ranges that
+  /// the style ranges of the blocks referred to before; blocks whose styles
+  /// stay the same are not modified.
+  void ReapplyHighlightRanges(int layer, const std::vector<HighlightRange>& oldRanges);
+  
+  /// Sets the style ranges of all blocks in @p layer according to
+  /// @p styleChanges, which are pairs of (document offset, index in mRanges)
+  /// sorted by offset. Blocks whose style ranges and styles are unchanged
+  /// compared to @p oldRanges are not modified.
+  void SetBlockStyleRanges(int layer, const std::vector<std::pair<int, int>>& styleChanges, const std::vector<HighlightRange>& oldRanges);
+  
+  /// Adds the given range to mPendingHighlightingChangedRange.
+  void RecordHighlightingChange(int startOffset, int endOffset);
   
   /// Updates the style ranges in blocks with the highlight range.
   void ApplyHighlightRange(const DocumentRange& range, int highlightRangeIndex, int layer);
   
+  /// Searches for the first match of the matcher's regex within
+  /// [@p start, @p end) by streaming the text of the blocks through the
+  /// matcher. Returns true and sets @p match if a match was found.
+  bool FindRegexMatch(TextRegexMatcher* matcher, int start, int end, DocumentRange* match);
+  
   /// Implementation for undo and redo. Returns true if a step was (un/re)done,
   /// false if there was no step to do.
   bool UndoRedoImpl(bool redo, DocumentRange* newTextRange);
   
+  /// Must be called after adding @p link to the version graph. Compresses
+  /// its large replacement texts and prunes the version graph if it uses more
+  /// memory than the limit set with SetUndoHistoryMemoryLimit().
+  void AddedVersionLink(DocumentVersionLink* link);
+  
+  /// Deletes the redo steps from the current version, unless they are
+  /// referenced by other steps.
+  void DeleteRedoSteps();
+  
   /// Deletes all non-root nodes in the version graph.
   void ClearVersionGraph();
   
   /// Reads the document text from the given open file and converts it to blocks.
   void ReadTextFromFile(QFile* file);
   
-  /// If mVersion != mOffsetCacheVersion, updates the offset cache.
-  inline void EnsureOffsetCacheIsUpToDate() const {
-    if (mVersion == mOffsetCacheVersion) {
-      return;
-    }
-    mOffsetCacheVersion = mVersion;
-    
-    UpdateOffsetCache();
+  /// Converts the given UTF-8 encoded bytes to blocks that form the document text.
+  void ReadTextFromData(const char* data, qint64 size);
+  
+  /// Writes the document text UTF-8 encoded to the given open device. The
+  /// text of many blocks is encoded and written at once in order to avoid many
+  /// small writes. Returns true if successful.
+  bool WriteTextToDevice(QIODevice* device) const;
+  
+  /// Writes the document text to the file at @p path, replacing the file only
+  /// once it has been written completely. Returns true if successful.
+  bool WriteToFile(const QString& path) const;
+  
+  /// Increases mTextChangeCounter for a replacement of @p oldRange by
+  /// @p newTextSize characters, records it in mTextReplacements, and emits
+  /// TextReplaced(). @p affectsCode specifies whether the replacement may have
+  /// changed the code, see lastCodeChangeCounter().
+  void RecordTextReplacement(const DocumentRange& oldRange, int newTextSize, bool affectsCode = true);
+  
+  /// Increases mTextChangeCounter for a change of the text that is not recorded
+  /// as a replacement (for example, re-assigning the whole text).
+  void RecordUnmappableTextChange();
+  
+  /// Schedules UpdateSnapshot() to run once the main thread has processed the
+  /// current batch of changes, if snapshots are published for this document.
+  void ScheduleSnapshotUpdate();
+  
+  /// Schedules the emission of Changed() for the changes recorded since its
+  /// last emission, once the main thread has processed the current batch of
+  /// changes. Does nothing if Changed() is not connected.
+  void ScheduleChangedSignal();
+  
+  /// Replaces @p range in the blocks with @p newText and returns the replaced
+  /// text in @p oldText. Only the blocks' text and styles are updated, not the
+  /// problems, contexts and undo history. If @p checkBlockSizes is false, the
+  /// blocks that were modified are not split or merged, see
+  /// NormalizeBlockSizes().
+  void ReplaceInBlocks(const DocumentRange& range, const QString& newText, QString* oldText, bool checkBlockSizes);
+  
+  /// Inserts the large @p text at @p location for ReplaceInBlocks(). The text
+  /// is split into blocks of LargeBlockSize() directly, which are then
+  /// inserted into mBlocks in one operation.
+  void InsertLargeText(const DocumentLocation& location, const QString& text);
+  
+  /// Returns whether replacing @p range with @p newText only changes the
+  /// contents of a comment, or the whitespace between two tokens without
+  /// joining or splitting them, based on the current highlighting. Must be
+  /// called before the replacement is made. Returns false if unsure.
+  bool IsCommentOrWhitespaceReplacement(const DocumentRange& range, const QString& newText);
+  
+  /// Splits and merges all blocks that are too large or too small in a single
+  /// pass over the blocks. Since this is used for bulk edits, only blocks of
+  /// at least 2 * LargeBlockSize() are split.
+  void NormalizeBlockSizes();
+  
+  /// Schedules CompactBlocks() to run once the document has not been edited
+  /// for a while, if enabled with SetCompactBlocksWhenIdle().
+  void ScheduleBlockCompaction();
+  
+  /// Adapts the problem ranges, fix-its and contexts to the given replacements,
+  /// which must be sorted and non-overlapping, and refer to the text before the
+  /// replacements (as for ReplaceMany()).
+  void AdaptRangesToReplacements(const std::vector<Replacement>& replacements);
+  
+  /// Re-computes mBlockOffsets, mBlockLines, mBlockLinesWithAttributes and
+  /// mBlockUtf8Sizes from scratch. This must be called after inserting or
+  /// removing blocks.
+  void RebuildBlockIndex();
+  
+  /// Updates mBlockOffsets, mBlockLines, mBlockLinesWithAttributes and
+  /// mBlockUtf8Sizes after the text of the block with the given index has
+  /// changed (without inserting or removing blocks).
+  inline void UpdateBlockIndex(int index) {
+    const TextBlock& block = *mBlocks[index];
+    mBlockOffsets.Add(index, block.text().size() - mBlockOffsets.Value(index));
+    mBlockLines.Add(index, static_cast<int>(block.lineAttributes().size()) - mBlockLines.Value(index));
+    mBlockLinesWithAttributes.Add(index, block.CountLinesWithAttributes() - mBlockLinesWithAttributes.Value(index));
+    mBlockUtf8Sizes.Add(index, block.utf8Size() - mBlockUtf8Sizes.Value(index));
   }
   
-  /// Updates the offset cache. Note that usually, EnsureOffsetCacheIsUpToDate()
-  /// should be used instead.
-  inline void UpdateOffsetCache() const {
-    unsigned int blockStartLine = 0;
-    unsigned int blockStartOffset = 0;
-    
-    int numBlocks = mBlocks.size();
-    for (int blockIndex = 0; blockIndex < numBlocks; ++ blockIndex) {
-      TextBlock& block = *mBlocks[blockIndex];
-      
-      block.SetCachedOffsets(blockStartOffset, blockStartLine);
-      
-      blockStartLine += mBlocks[blockIndex]->lineAttributes().size();
-      blockStartOffset += mBlocks[blockIndex]->text().size();
+  /// Sets the attributes of the line with index @p lineInBlockIndex within the
+  /// block with index @p blockIndex, keeping mBlockLinesWithAttributes
+  /// up-to-date. All changes to line attributes must go through this function.
+  void SetBlockLineAttributes(int blockIndex, int lineInBlockIndex, int attributes);
+  
+  /// Returns the index of the first block after the block with index
+  /// @p blockIndex (which may be -1) that has lines with non-zero attributes,
+  /// or mBlocks.size() if there is none.
+  int FindNextBlockWithLineAttributes(int blockIndex) const;
+  
+  /// Returns the block with the given index for modification. If the block is
+  /// shared with another document (see AssignTextAndStyles()), it is copied
+  /// first, such that the other document remains unchanged. All modifications
+  /// of blocks must go through this function.
+  inline TextBlock& MutableBlock(int index) {
+    if (index < mBracketSummaries.size()) {
+      mBracketSummaries[index].valid = false;
+    }
+    if (index < mIdentifierIndexes.size()) {
+      mIdentifierIndexes[index].valid = false;
     }
+    std::shared_ptr<TextBlock>& block = mBlocks[index];
+    if (block.use_count() > 1) {
+      block = TextBlockPool::MakeBlock(mBlockPool, *block);
+    }
+    return *block;
   }
   
   
@@ -584,14 +1308,95 @@ class Document : public QObject {
   /// TODO: Replace that by accessing versionGraphRoot->version instead?
   int mVersion;
   
+  /// See textChangeCounter().
+  int mTextChangeCounter = 0;
+  
+  /// See lastCodeChangeCounter().
+  int mLastCodeChangeCounter = 0;
+  
+  /// Cached bracket summaries of the blocks (with the same indexing as
+  /// mBlocks), see GetBracketSummary(). Entries are invalidated by
+  /// MutableBlock(), and all entries are dropped if blocks are inserted or
+  /// removed.
+  std::vector<BracketSummary> mBracketSummaries;
+  
+  /// Cached identifier indexes of the blocks (with the same indexing as
+  /// mBlocks), see GetIdentifierIndex(). Entries are invalidated by
+  /// MutableBlock(), and all entries are dropped if blocks are inserted or
+  /// removed.
+  std::vector<IdentifierIndex> mIdentifierIndexes;
+  
+  /// Cache for preambleHash(), valid if mPreambleHashValid is true.
+  /// mPreambleEndOffset is the end offset of the preamble region.
+  std::size_t mPreambleHash = 0;
+  int mPreambleEndOffset = 0;
+  bool mPreambleHashValid = false;
+  
+  /// The most recent replacements, see GetTextReplacementsSince(). The last
+  /// entry corresponds to the current mTextChangeCounter.
+  std::deque<TextReplacement> mTextReplacements;
+  
+  /// Cache for GetDocumentTextUtf8(), valid if mUtf8TextCounter is equal to
+  /// mTextChangeCounter.
+  std::shared_ptr<const QByteArray> mUtf8Text;
+  int mUtf8TextCounter = -1;
+  
+  /// The published snapshot, see GetSnapshot(). This is only accessed with
+  /// std::atomic_load() and std::atomic_store(), since other threads may read
+  /// it while the main thread replaces it.
+  std::shared_ptr<const DocumentSnapshot> mSnapshot;
+  
+  /// Whether snapshots are published, see SetPublishSnapshots().
+  bool mPublishSnapshots = false;
+  
+  /// Whether ScheduleSnapshotUpdate() posted an update that did not run yet.
+  bool mSnapshotUpdateScheduled = false;
+  
+  /// Whether ScheduleChangedSignal() posted an emission that did not run yet.
+  bool mChangedSignalScheduled = false;
+  
+  /// Range of the text that was changed since the last emission of Changed(),
+  /// in current document coordinates. Invalid if there was no change.
+  DocumentRange mPendingChangedRange = DocumentRange::Invalid();
+  
+  /// Whether a change since the last emission of Changed() could not be
+  /// mapped to a range (see RecordUnmappableTextChange()), such that the whole
+  /// document must be considered as changed.
+  bool mPendingChangeIsUnmappable = false;
+  
+  /// Whether blocks are compacted when idle, see SetCompactBlocksWhenIdle().
+  bool mCompactBlocksWhenIdle = false;
+  
+  /// Whether ScheduleBlockCompaction() started a timer that did not run yet.
+  bool mBlockCompactionScheduled = false;
+  
+  /// The character offset of the last edit (or -1 if there was none), around
+  /// which CompactBlocks() keeps the small blocks, and the time since then.
+  int mLastEditOffset = -1;
+  QElapsedTimer mLastEditTimer;
+  
   /// The version which is stored on disk. If mVersion == mSavedVersion, the
   /// document can be closed without losing information.
   int mSavedVersion;
   
-  /// The version for which the initial character and line offsets have been
-  /// cached in the TextBlocks. If mVersion == mOffsetCacheVersion, the cached
-  /// data is valid and may be used.
-  mutable int mOffsetCacheVersion;
+  /// Index over the text sizes of the blocks in mBlocks, used to map between
+  /// character offsets and blocks in O(log(number of blocks)). It is kept
+  /// up-to-date on every change to the blocks. Since the blocks may be shared
+  /// between documents, the absolute block offsets are not stored in the blocks.
+  FenwickTree mBlockOffsets;
+  
+  /// Index over the number of newline entries of the blocks in mBlocks (see
+  /// TextBlock::lineAttributes()), used to map between lines and blocks.
+  FenwickTree mBlockLines;
+  
+  /// Index over the number of lines with non-zero attributes of the blocks in
+  /// mBlocks, used to skip the blocks without line attributes when searching
+  /// for them (e.g., for bookmarks).
+  FenwickTree mBlockLinesWithAttributes;
+  
+  /// Index over the UTF-8 sizes of the blocks in mBlocks (see
+  /// TextBlock::utf8Size()), used to map between UTF-8 offsets and blocks.
+  FenwickTree mBlockUtf8Sizes;
   
   /// Pointer to the root of the directed graph that contains undo/redo steps.
   /// The whole graph is owned by this Document instance. The root is never null.
@@ -604,6 +1409,11 @@ class Document : public QObject {
   /// Used for accumulating undo steps if creatingCombinedUndoStep is true.
   std::vector<Replacement> combinedUndoReplacements;
   
+  /// Upper bound for the memory used by the version graph, in bytes. It is
+  /// increased for each change of the graph and re-computed exactly when it
+  /// exceeds the memory limit, see AddedVersionLink().
+  std::size_t mUndoMemoryUsageBound = 0;
+  
   /// Translation unit pool for parsing with libclang.
   std::unique_ptr<ClangTUPool> mTUPool;
   
@@ -612,24 +1422,106 @@ class Document : public QObject {
   /// TODO: These are currently not adapted on Replace().
   std::vector<LineDiff> mDiffLines;
   
+  /// The version that mDiffLines were computed against. May be null.
+  std::shared_ptr<const LineDiffBase> mDiffBase;
+  
+  /// Stores the git blame of the document's lines, in increasing order of the
+  /// lines. This is updated together with mDiffLines.
+  std::vector<LineBlame> mBlameLines;
+  
   /// Stores all added highlight ranges, as well as the default style at index
   /// 0.
   /// NOTE: The ranges stored here are currently NOT updated on edits to the
   ///       document. Only the derived StyleRanges in the TextBlocks are.
   std::vector<HighlightRange> mRanges[TextBlock::kLayerCount];
   
+  /// For each layer, the textChangeCounter() that the positions of the ranges
+  /// in mRanges refer to, or -1 if they refer to different versions. This
+  /// allows ApplyHighlightBuffer() to map them to the current text in order
+  /// to compare them with the new ranges.
+  int mRangesTextChangeCounter[TextBlock::kLayerCount];
+  
+  /// Range of the text whose highlighting changed since the last emission of
+  /// HighlightingChanged(). Invalid if there was no change.
+  DocumentRange mPendingHighlightingChangedRange = DocumentRange::Invalid();
+  
+  /// The styles referred to by the highlight ranges in mRanges (of all layers).
+  HighlightStyleTable mStyles;
+  
   /// Stores all problems that have been added to this document.
   std::vector<std::shared_ptr<Problem>> mProblems;
   
   /// Stores all problem ranges, ordered by the start of the range.
   std::set<ProblemRange> mProblemRanges;
   
+  /// Index for GetProblemLineSpans(): the parts of the problem ranges within
+  /// each line, ordered by line and start. Valid if mProblemLineSpansValid is
+  /// true and mProblemLineSpansCounter is equal to mTextChangeCounter.
+  std::vector<ProblemLineSpan> mProblemLineSpans;
+  int mProblemLineSpansCounter = -1;
+  bool mProblemLineSpansValid = false;
+  
   /// Stores all contexts, ordered by the start of the context range.
   std::set<Context> mContexts;
   
-  /// Small text blocks that make up the document text.
+  /// Index for GetContextsAt(), valid if mContextIndexValid is true:
+  /// mContextIndex lists the contexts in the order of mContexts, and
+  /// mContextMaxEnds is a binary tree over it (stored as an array with the
+  /// children of node i at 2 * i and 2 * i + 1) that holds the maximum end
+  /// offset of the contexts within each node.
+  std::vector<const Context*> mContextIndex;
+  std::vector<int> mContextMaxEnds;
+  bool mContextIndexValid = false;
+  
+  /// Small text blocks that make up the document text. The blocks may be
+  /// shared with copies of the document that were created with
+  /// AssignTextAndStyles(), thus they must only be modified after obtaining
+  /// them with MutableBlock().
   std::vector<std::shared_ptr<TextBlock>> mBlocks;
   
+  /// Pool from which the blocks in mBlocks are allocated.
+  std::shared_ptr<TextBlockPool> mBlockPool;
+  
   /// The desired text length within a single TextBlock.
   int desiredBlockSize;
 };
+
+
+/// Immutable snapshot of the text of a Document, see Document::GetSnapshot().
+/// Snapshots never change after they have been created (the line starts and
+/// the UTF-8 text are computed on first use in a thread-safe way), so they can
+/// be used from any thread without locking. Creating a snapshot is cheap since
+/// it shares the text blocks with the document (see Document::AssignText()).
+class DocumentSnapshot {
+ public:
+  /// Creates a snapshot of the current text of @p document. This must be
+  /// called from the thread that owns @p document.
+  DocumentSnapshot(Document* document);
+  
+  /// Returns the copy of the document that holds the snapshot text. It only
+  /// contains the text (no styles), and it must never be modified. It is
+  /// returned as non-const pointer for use with the document iterators.
+  inline const std::shared_ptr<Document>& document() const { return mDocument; }
+  
+  /// The values of Document::version() and Document::textChangeCounter() for
+  /// the snapshot text.
+  inline int version() const { return mVersion; }
+  inline int textChangeCounter() const { return mTextChangeCounter; }
+  
+  /// Returns the character offsets of the starts of all lines.
+  const std::vector<unsigned>& GetLineStarts() const;
+  
+  /// Returns the text in UTF-8 encoding.
+  const std::shared_ptr<const QByteArray>& GetTextUtf8() const;
+  
+ private:
+  std::shared_ptr<Document> mDocument;
+  int mVersion;
+  int mTextChangeCounter;
+  
+  mutable std::once_flag mLineStartsOnce;
+  mutable std::vector<unsigned> mLineStarts;
+  
+  mutable std::once_flag mTextUtf8Once;
+  mutable std::shared_ptr<const QByteArray> mTextUtf8;
+};
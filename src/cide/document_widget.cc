@@ -4,12 +4,15 @@
 
 #include "cide/document_widget.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <mutex>
 
 #include <QAction>
 #include <QApplication>
 #include <QClipboard>
+#include <QDateTime>
 #include <QDesktopWidget>
 #include <QGuiApplication>
 #include <QMessageBox>
@@ -24,17 +27,46 @@
 #include "cide/code_completion_widget.h"
 #include "cide/code_info.h"
 #include "cide/cpp_utils.h"
+#include "cide/cpu_budget.h"
 #include "cide/crash_backup.h"
 #include "cide/document_widget_container.h"
 #include "cide/git_diff.h"
 #include "cide/main_window.h"
 #include "cide/parse_thread_pool.h"
+#include "cide/performance_profile.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/profiler.h"
 #include "cide/rename_dialog.h"
 #include "cide/scroll_bar_minimap.h"
 #include "cide/settings.h"
 #include "cide/text_utils.h"
 #include "cide/util.h"
 
+/// Number of recently used rendered lines that are kept when evicting lines from
+/// the line raster cache. This corresponds to a few screens of lines, such that
+/// scrolling back and forth mostly re-uses the rendered lines.
+constexpr int kMaxCachedLineRasters = 256;
+
+/// Maximum number of characters that DocumentWidget::FindCallSiteStart()
+/// searches backwards for the opening parenthesis of a call.
+constexpr int kMaxCallSiteSearchDistance = 4096;
+
+/// Width of the git diff markers at the right side of the sidebar, in pixels.
+constexpr int kGitDiffMarkerWidth = 5;
+
+/// Width of the git blame gutter, in characters.
+constexpr int kGitBlameGutterCharacters = 30;
+
+/// Maximum number of visible identifiers for which DocumentWidget::
+/// PrefetchHoverInfo() requests a prefetch. This is kept below the size of the
+/// CursorFactsCache, such that the prefetch does not evict the entries of
+/// other documents completely.
+constexpr int kMaxHoverPrefetchIdentifiers = 128;
+
+/// Time without edits and key presses after which DocumentWidget::
+/// ScheduleTUCatchUp() requests the reparse of the stale pooled TU.
+constexpr int kTUCatchUpIdleDelayMs = 1000;
+
 
 DocumentWidget::DocumentWidget(const std::shared_ptr<Document>& document, DocumentWidgetContainer* container, MainWindow* mainWindow, QWidget* parent)
     : QWidget(parent),
@@ -44,6 +76,10 @@ DocumentWidget::DocumentWidget(const std::shared_ptr<Document>& document, Docume
   setFocusPolicy(Qt::StrongFocus);
   setCursor(Qt::IBeamCursor);
   setAutoFillBackground(false);
+  // paintEvent() paints every pixel of the updated area. Declaring this is
+  // also required for scroll() to move the painted content instead of
+  // repainting everything, see RepaintScrolledContent().
+  setAttribute(Qt::WA_OpaquePaintEvent);
   
   connect(&Settings::Instance(), &Settings::FontChanged, this, &DocumentWidget::FontChanged);
   FontChanged();
@@ -158,9 +194,23 @@ DocumentWidget::DocumentWidget(const std::shared_ptr<Document>& document, Docume
   parseTimer = new QTimer(this);
   parseTimer->setSingleShot(true);
   connect(parseTimer, &QTimer::timeout, this, &DocumentWidget::ParseFile);
+  TUCatchUpTimer = new QTimer(this);
+  TUCatchUpTimer->setSingleShot(true);
+  connect(TUCatchUpTimer, &QTimer::timeout, [&]() {
+    CodeInfo::Instance().RequestTUCatchUp(this);
+  });
   connect(document.get(), &Document::Changed, this, &DocumentWidget::StartParseTimer);
   StartParseTimer();
   connect(document.get(), &Document::HighlightingChanged, this, &DocumentWidget::HighlightingChanged);
+  connect(document.get(), &Document::TextReplaced, this, &DocumentWidget::TextReplaced);
+  
+  lexicalHighlightTimer = new QTimer(this);
+  lexicalHighlightTimer->setSingleShot(true);
+  connect(lexicalHighlightTimer, &QTimer::timeout, [&]() {
+    if (lexicalHighlighter.HighlightChangedLines(document.get())) {
+      document->FinishedHighlightingChanges();
+    }
+  });
   
   mouseHoverTimer.setSingleShot(true);
   connect(&mouseHoverTimer, &QTimer::timeout, [&]() {
@@ -179,7 +229,15 @@ DocumentWidget::DocumentWidget(const std::shared_ptr<Document>& document, Docume
       return;
     }
     
-    codeInfoRequestRect = GetTextRect(GetWordForCharacter(offset));
+    DocumentRange wordRange = GetWordForCharacter(offset);
+    codeInfoRequestRect = GetTextRect(wordRange);
+    
+    // Request the info for the start of identifiers, which yields the same
+    // cursor, such that the results of PrefetchHoverInfo() are found in the
+    // cache.
+    if (charIt.IsValid() && IsIdentifierChar(charIt.GetChar()) && wordRange.IsValid()) {
+      offset = wordRange.start.offset;
+    }
     
     CodeInfo::Instance().RequestCodeInfo(this, DocumentLocation(offset));
   });
@@ -193,6 +251,7 @@ DocumentWidget::~DocumentWidget() {
   ParseThreadPool::Instance().WidgetRemoved(this);
   CodeInfo::Instance().WidgetRemoved(this);
   GitDiff::Instance().WidgetRemoved(this);
+  PhraseHighlighter::Instance().WidgetRemoved(this);
   
   delete argumentHintWidget;
   delete codeCompletionWidget;
@@ -277,8 +336,51 @@ void DocumentWidget::Replace(const DocumentRange& range, const QString& newText,
   }
 }
 
-void DocumentWidget::ReplaceAll(const QString& find, const QString& replacement, bool matchCase, bool inSelectionOnly) {
-  document->StartUndoStep();
+void DocumentWidget::ReplaceMany(const std::vector<Replacement>& replacements, bool createUndoStep) {
+  DocumentRange selectionRange;
+  bool placeCursorAtEnd = true;
+  if (selection.IsEmpty()) {
+    selectionRange.start = MapCursorToDocument();
+    selectionRange.end = selectionRange.start;
+  } else {
+    selectionRange = selection;
+    placeCursorAtEnd = MapCursorToDocument() == selectionRange.end;
+  }
+  
+  document->ReplaceMany(replacements, createUndoStep);
+  
+  auto adaptDocumentLocation = [&](DocumentLocation* loc) {
+    int shift = 0;
+    for (const Replacement& replacement : replacements) {
+      if (*loc < replacement.range.start) {
+        break;
+      } else if (*loc < replacement.range.end) {
+        *loc = replacement.range.start + shift + replacement.text.size();
+        return;
+      }
+      shift += replacement.text.size() - replacement.range.size();
+    }
+    *loc += shift;
+  };
+  adaptDocumentLocation(&selectionRange.start);
+  adaptDocumentLocation(&selectionRange.end);
+  
+  if (selection.IsEmpty()) {
+    SetCursor(selectionRange.start, false, false);
+  } else {
+    SetSelection(selectionRange, placeCursorAtEnd, false);
+  }
+}
+
+void DocumentWidget::ReplaceAll(const QString& find, const QString& replacement, bool matchCase, bool inSelectionOnly, bool useRegex) {
+  TextRegex regex;
+  if (useRegex) {
+    QString errorMessage;
+    if (!regex.Compile(find, matchCase, &errorMessage)) {
+      GetMainWindow()->SetStatusText(tr("Invalid regular expression: %1").arg(errorMessage));
+      return;
+    }
+  }
   
   std::vector<DocumentLocation> locsToPreserve;
   if (GetSelection().IsEmpty()) {
@@ -288,37 +390,58 @@ void DocumentWidget::ReplaceAll(const QString& find, const QString& replacement,
   }
   DocumentRange selectionRange = GetSelection();
   
-  int numReplacements = 0;
-  std::vector<DocumentRange> replacedRanges;
-  DocumentLocation findStart = inSelectionOnly ? selectionRange.end : document->FullDocumentRange().end;
-  while (true) {
-    DocumentLocation result = document->Find(find, findStart, false, matchCase);
-    if (result.IsInvalid() ||
-        (inSelectionOnly && result < selectionRange.start)) {
-      break;
+  // Find all occurrences (searching backwards, such that the occurrences do not
+  // overlap in the same way as when replacing them one after another).
+  std::vector<Replacement> replacements;
+  if (useRegex) {
+    std::vector<DocumentRange> matches;
+    document->FindAllRegex(regex, inSelectionOnly ? selectionRange : document->FullDocumentRange(), &matches);
+    replacements.reserve(matches.size());
+    for (const DocumentRange& match : matches) {
+      replacements.emplace_back(match, replacement);
     }
-    
-    for (DocumentLocation& loc : locsToPreserve) {
-      if (loc >= result + find.size()) {
-        loc += replacement.size() - find.size();
-      } else if (loc >= result) {
-        loc = result;
+  } else {
+    DocumentLocation findStart = inSelectionOnly ? selectionRange.end : document->FullDocumentRange().end;
+    while (true) {
+      DocumentLocation result = document->Find(find, findStart, false, matchCase);
+      if (result.IsInvalid() ||
+          (inSelectionOnly && result < selectionRange.start)) {
+        break;
       }
+      
+      replacements.emplace_back(DocumentRange(result, result + find.size()), replacement);
+      findStart = result;
     }
-    
-    document->Replace(DocumentRange(result, result + find.size()), replacement);
-    int offset = replacement.size() - find.size();
-    for (DocumentRange& range : replacedRanges) {
-      range.start += offset;
-      range.end += offset;
+    std::reverse(replacements.begin(), replacements.end());
+  }
+  int numReplacements = replacements.size();
+  
+  // Adapt the cursor / selection and compute the ranges of the new texts.
+  for (DocumentLocation& loc : locsToPreserve) {
+    int shift = 0;
+    for (const Replacement& r : replacements) {
+      if (loc >= r.range.end) {
+        shift += r.text.size() - r.range.size();
+      } else {
+        if (loc >= r.range.start) {
+          loc = r.range.start;
+        }
+        break;
+      }
     }
-    replacedRanges.emplace_back(result, result + replacement.size());
-    ++ numReplacements;
-    
-    findStart = result;
+    loc += shift;
+  }
+  std::vector<DocumentRange> replacedRanges(replacements.size());
+  int shift = 0;
+  for (int i = 0; i < numReplacements; ++ i) {
+    DocumentLocation newStart = replacements[i].range.start + shift;
+    replacedRanges[i] = DocumentRange(newStart, newStart + replacement.size());
+    shift += replacement.size() - replacements[i].range.size();
   }
   
-  document->EndUndoStep();
+  if (!replacements.empty()) {
+    document->ReplaceMany(replacements);
+  }
   
   if (locsToPreserve.size() == 1) {
     SetCursor(locsToPreserve[0], false);
@@ -455,7 +578,7 @@ void DocumentWidget::GetDocumentLocationAt(int x, int y, DocumentLocation* loc,
 }
 
 DocumentRange DocumentWidget::GetWordForCharacter(int characterOffset) {
-  return document->RangeForWordAt(characterOffset, &GetCharType, static_cast<int>(CharacterType::Symbol));
+  return document->RangeForWordAt(characterOffset);
 }
 
 void DocumentWidget::SetSelection(const DocumentRange& range, bool placeCursorAtEnd, bool ensureCursorIsVisible) {
@@ -493,11 +616,25 @@ void DocumentWidget::CloseCodeCompletion() {
 }
 
 void DocumentWidget::ShowCodeCompletion(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults) {
+  // NOTE: Ownership of "libclangResults" is passed on to this shared pointer here.
+  std::shared_ptr<CXCodeCompleteResults> sharedResults(libclangResults, &clang_disposeCodeCompleteResults);
+  
   if (codeCompletionInvocationLocation.IsInvalid()) {
     qDebug() << "ShowCodeCompletion(): codeCompletionInvocationLocation is invalid";
     return;
   }
   
+  // Remember the results for reusing them (see ReuseCodeCompletion()).
+  reusableCodeCompletionLocation = invocationLocation;
+  reusableCodeCompletionItems = items;
+  reusableCodeCompletionResults = sharedResults;
+  reusableArgumentHintItems.clear();
+  reusableCallSiteLocation = DocumentLocation::Invalid();
+  
+  OpenCodeCompletionWidget(invocationLocation, std::move(items), sharedResults);
+}
+
+void DocumentWidget::OpenCodeCompletionWidget(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, const std::shared_ptr<CXCodeCompleteResults>& libclangResults) {
   // Close the widget in case it is open.
   delete codeCompletionWidget;
   
@@ -510,13 +647,163 @@ void DocumentWidget::ShowCodeCompletion(DocumentLocation invocationLocation, std
   
   // Open the new widget.
   QPoint invocationPoint = GetTextRect(DocumentRange(invocationLocation, invocationLocation)).bottomLeft() + QPoint(0, 1);
-  // NOTE: Ownership of "results" is passed on to the widget here.
   codeCompletionWidget = new CodeCompletionWidget(std::move(items), libclangResults, invocationPoint, this);
   connect(codeCompletionWidget, &CodeCompletionWidget::Accepted, this, &DocumentWidget::AcceptCodeCompletion);
+  connect(codeCompletionWidget, &CodeCompletionWidget::FilterApplied, this, &DocumentWidget::CodeCompletionFilterApplied);
+  closeCodeCompletionOnSingleExactMatch = false;
   codeCompletionWidget->SetFilterText(document->TextForRange(DocumentRange(codeCompletionInvocationLocation, cursorLoc)));
   codeCompletionWidget->show();
 }
 
+bool DocumentWidget::ReuseCodeCompletion() {
+  if (!reusableCodeCompletionResults) {
+    return false;
+  }
+  
+  DocumentLocation invocationLocation = CodeInfo::GetCodeCompletionInvocationLocation(this);
+  int currentParameter = reusableArgumentHintCurrentParameter;
+  if (invocationLocation != reusableCodeCompletionLocation) {
+    // Within the argument list of the same call (for example, after typing
+    // ','), the results only differ in the current parameter of the argument
+    // hint, which is determined from the text.
+    if (reusableCallSiteLocation.IsInvalid() ||
+        FindCallSiteStart(invocationLocation, &currentParameter) != reusableCallSiteLocation) {
+      return false;
+    }
+  }
+  
+  // Outside of any context, CodeCompletionOperation reparses the TU to pick
+  // up new declarations in the corresponding header for "Implement <...>"
+  // items. Do not reuse the results in this case.
+  if (document->GetContextsAt(invocationLocation).empty()) {
+    return false;
+  }
+  
+  codeCompletionInvocationLocation = invocationLocation;
+  argumentHintInvocationLocation = invocationLocation;
+  OpenCodeCompletionWidget(invocationLocation, std::vector<CompletionItem>(reusableCodeCompletionItems), reusableCodeCompletionResults);
+  if (reusableArgumentHintItems.empty()) {
+    CloseArgumentHint();
+  } else {
+    ShowArgumentHint(invocationLocation, std::vector<ArgumentHintItem>(reusableArgumentHintItems), currentParameter);
+  }
+  return true;
+}
+
+void DocumentWidget::ClearReusableCodeCompletion() {
+  reusableCodeCompletionLocation = DocumentLocation::Invalid();
+  reusableCodeCompletionItems.clear();
+  reusableCodeCompletionResults.reset();
+  reusableArgumentHintItems.clear();
+  reusableCallSiteLocation = DocumentLocation::Invalid();
+}
+
+void DocumentWidget::UpdateReusableCallSite() {
+  reusableCallSiteLocation = DocumentLocation::Invalid();
+  if (reusableArgumentHintItems.empty() || reusableCodeCompletionLocation.IsInvalid()) {
+    return;
+  }
+  int parameterIndex;
+  reusableCallSiteLocation = FindCallSiteStart(reusableCodeCompletionLocation, &parameterIndex);
+}
+
+DocumentLocation DocumentWidget::FindCallSiteStart(const DocumentLocation& location, int* parameterIndex) {
+  int commaCount = 0;
+  int nestingDepth = 0;
+  Document::CharacterAndStyleIterator it(document.get(), location.offset);
+  -- it;
+  for (int distance = 0; it.IsValid() && distance < kMaxCallSiteSearchDistance; -- it, ++ distance) {
+    if (it.GetStyleOfLayer(0).isNonCodeRange) {
+      continue;
+    }
+    QChar character = it.GetChar();
+    if (character == ';' || character == '{' || character == '}') {
+      break;
+    } else if (IsClosingBracket(character)) {
+      ++ nestingDepth;
+    } else if (IsOpeningBracket(character)) {
+      if (nestingDepth == 0) {
+        if (character != '(') {
+          break;
+        }
+        *parameterIndex = commaCount;
+        return DocumentLocation(it.GetCharacterOffset() + 1);
+      }
+      -- nestingDepth;
+    } else if (character == ',' && nestingDepth == 0) {
+      ++ commaCount;
+    }
+  }
+  return DocumentLocation::Invalid();
+}
+
+void DocumentWidget::SetPrefetchedCodeCompletion(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults, std::vector<ArgumentHintItem>&& hints, int currentParameter) {
+  // NOTE: Ownership of "libclangResults" is passed on to this shared pointer here.
+  std::shared_ptr<CXCodeCompleteResults> sharedResults(libclangResults, &clang_disposeCodeCompleteResults);
+  
+  if (codeCompletionPrefetchLocation.IsInvalid() ||
+      invocationLocation != codeCompletionPrefetchLocation) {
+    return;
+  }
+  codeCompletionPrefetchLocation = DocumentLocation::Invalid();
+  
+  reusableCodeCompletionLocation = invocationLocation;
+  reusableCodeCompletionItems.swap(items);
+  reusableCodeCompletionResults = sharedResults;
+  reusableArgumentHintItems.swap(hints);
+  reusableArgumentHintCurrentParameter = currentParameter;
+  UpdateReusableCallSite();
+  
+  // If code completion has been invoked at this location while the prefetch
+  // was running, show the results right away. Increasing the invocation
+  // counter discards the results of the pending request.
+  if (!codeCompletionWidget &&
+      codeCompletionInvocationLocation == invocationLocation &&
+      ReuseCodeCompletion()) {
+    ++ codeCompletionInvocationCounter;
+  }
+}
+
+void DocumentWidget::CheckForCodeCompletionPrefetch() {
+  DocumentLocation cursorLoc = MapCursorToDocument();
+  if (cursorLoc.offset < 1) {
+    return;
+  }
+  QString tokenText = document->TextForRange(DocumentRange(std::max(0, cursorLoc.offset - 2), cursorLoc.offset));
+  bool isMemberAccess =
+      tokenText.endsWith('.') ||
+      tokenText == QStringLiteral("->") ||
+      tokenText == QStringLiteral("::");
+  if (!isMemberAccess) {
+    return;
+  }
+  
+  // Outside of any context, the results would not be reused (see
+  // ReuseCodeCompletion()).
+  if (document->GetContextsAt(cursorLoc).empty()) {
+    return;
+  }
+  
+  DocumentLocation invocationLocation = CodeInfo::Instance().PrefetchCodeCompletion(this);
+  if (invocationLocation.IsValid()) {
+    codeCompletionPrefetchLocation = invocationLocation;
+  }
+}
+
+bool DocumentWidget::IsReplacementWithinIdentifierAt(const DocumentLocation& location, const DocumentRange& oldRange, int newTextSize) {
+  if (oldRange.start < location) {
+    return false;
+  }
+  Document::CharacterIterator it(document.get(), location.offset);
+  while (it.IsValid() && it.GetCharacterOffset() < oldRange.start.offset + newTextSize) {
+    if (!IsIdentifierChar(it.GetChar())) {
+      return false;
+    }
+    ++ it;
+  }
+  return true;
+}
+
 void DocumentWidget::CodeCompletionRequestWasDiscarded() {
   // Set the invocation location to invalid in order not to expect
   // getting code completion results anymore. This enables making
@@ -566,20 +853,23 @@ void DocumentWidget::UpdateCodeCompletion(const DocumentLocation& cursorLoc) {
       if (codeCompletionWidget) {
         codeCompletionInvocationLocation = cursorLoc;
         codeCompletionWidget->SetInvocationPoint(GetTextRect(DocumentRange(cursorLoc, cursorLoc)).bottomLeft() + QPoint(0, 1));
+        closeCodeCompletionOnSingleExactMatch = false;
         codeCompletionWidget->SetFilterText(QStringLiteral(""));
       }
     } else if (closeCompletion) {
       CloseCodeCompletion();
     } else {
       if (codeCompletionWidget) {
+        closeCodeCompletionOnSingleExactMatch = true;
         codeCompletionWidget->SetFilterText(filterText);
         
         // If there is only one good match which matches filterText exactly,
         // then automatically close the completion widget, unless the insertion
         // text of the match is different from its filter text (this is for
         // example the case for functions which insert placeholders for their
-        // parameters).
-        if (codeCompletionWidget->HasSingleExactMatch()) {
+        // parameters). If the filter is applied in the background, this is
+        // checked in CodeCompletionFilterApplied() instead.
+        if (!codeCompletionWidget->IsFilterPending() && codeCompletionWidget->HasSingleExactMatch()) {
           CloseCodeCompletion();
         }
       }
@@ -598,6 +888,12 @@ void DocumentWidget::ShowArgumentHint(DocumentLocation invocationLocation, std::
     return;
   }
   
+  if (reusableCodeCompletionResults && invocationLocation == reusableCodeCompletionLocation) {
+    reusableArgumentHintItems = items;
+    reusableArgumentHintCurrentParameter = currentParameter;
+    UpdateReusableCallSite();
+  }
+  
   // Close the widget in case it is open.
   delete argumentHintWidget;
   
@@ -698,7 +994,7 @@ void DocumentWidget::HandleMouseMoveEvent() {
       
       for (const LineDiff& diff : document->diffLines()) {
         if (diff.type == LineDiff::Type::Removed &&
-            abs(lastMouseMoveEventPos.y() - (diff.line * lineHeight - yScroll)) <= std::min(sidebarWidth, lineHeight)) {
+            abs(lastMouseMoveEventPos.y() - (diff.line * lineHeight - yScroll)) <= std::min(kGitDiffMarkerWidth, lineHeight)) {
           hoveredDiff = &diff;
           break;
         }
@@ -713,7 +1009,7 @@ void DocumentWidget::HandleMouseMoveEvent() {
         
         // If hovering over a word and code info has not been requested for that
         // word yet, request code info for it.
-        if (isCFile &&
+        if (isCFile && !largeFileMode &&
             !tooltipCodeRect.contains(lastMouseMoveEventPos) &&
             !codeInfoRequestRect.contains(lastMouseMoveEventPos)) {
           constexpr int kHoverDelayMilliseconds = 120;
@@ -882,32 +1178,30 @@ void DocumentWidget::ToggleBookmark() {
 }
 
 void DocumentWidget::JumpToPreviousBookmark() {
-  for (int line = cursorLine - 1; line >= 0; -- line) {
-    if (document->lineAttributes(line) & static_cast<int>(LineAttribute::Bookmark)) {
-      StartMovingCursor();
-      cursorLine = line;
-      EndMovingCursor(false);
-      break;
-    }
+  int line = document->FindPreviousLineWithAttributes(cursorLine - 1, static_cast<int>(LineAttribute::Bookmark));
+  if (line >= 0) {
+    StartMovingCursor();
+    cursorLine = line;
+    EndMovingCursor(false);
   }
 }
 
 void DocumentWidget::JumpToNextBookmark() {
-  for (int line = cursorLine + 1, end = document->LineCount(); line < end; ++ line) {
-    if (document->lineAttributes(line) & static_cast<int>(LineAttribute::Bookmark)) {
-      StartMovingCursor();
-      cursorLine = line;
-      EndMovingCursor(false);
-      break;
-    }
+  int line = document->FindNextLineWithAttributes(cursorLine + 1, static_cast<int>(LineAttribute::Bookmark));
+  if (line >= 0) {
+    StartMovingCursor();
+    cursorLine = line;
+    EndMovingCursor(false);
   }
 }
 
 void DocumentWidget::RemoveAllBookmarks() {
-  Document::LineIterator lineIt(document.get());
-  while (lineIt.IsValid()) {
-    lineIt.SetAttributes(lineIt.GetAttributes() & ~(static_cast<int>(LineAttribute::Bookmark)));
-    ++ lineIt;
+  std::vector<std::pair<int, int>> linesWithAttributes;
+  document->GetLinesWithAttributes(&linesWithAttributes);
+  for (const std::pair<int, int>& line : linesWithAttributes) {
+    if (line.second & static_cast<int>(LineAttribute::Bookmark)) {
+      document->SetLineAttributes(line.first, line.second & ~static_cast<int>(LineAttribute::Bookmark));
+    }
   }
   update(rect());
   BookmarksChanged();
@@ -1133,17 +1427,45 @@ void DocumentWidget::FixAll() {
     return a->fixits()[0].range.start < b->fixits()[0].range.start;
   });
   
-  // Apply back to front such that applying a fix-it does not change the range
-  // of the next fix-its to apply.
-  for (int i = static_cast<int>(sortedProblems.size()) - 1; i >= 0; -- i) {
-    ApplyFixIt(sortedProblems[i], 0, true);
+  // Apply all fix-its at once (skipping those that overlap a previous one).
+  // Copy the fix-it data before applying them, since the resulting change to
+  // the document may modify the fix-its.
+  std::vector<Replacement> replacements;
+  std::vector<std::shared_ptr<Problem>> fixedProblems;
+  replacements.reserve(sortedProblems.size());
+  fixedProblems.reserve(sortedProblems.size());
+  for (const std::shared_ptr<Problem>& problem : sortedProblems) {
+    const Problem::FixIt& fixit = problem->fixits()[0];
+    if (!replacements.empty() && fixit.range.start < replacements.back().range.end) {
+      continue;
+    }
+    replacements.emplace_back(fixit.range, fixit.newText);
+    fixedProblems.push_back(problem);
+  }
+  if (replacements.empty()) {
+    return;
   }
+  
+  ReplaceMany(replacements);
+  for (const std::shared_ptr<Problem>& problem : fixedProblems) {
+    document->RemoveProblem(problem);
+  }
+  update(rect());
 }
 
 void DocumentWidget::CheckFileType() {
+  CheckLargeFileMode(document->LineCount());
+  
   if (GuessIsCFile(document->path())) {
     if (!isCFile) {
       parseTimer->start(0);
+      
+      // Color the document lexically until the parse provides the semantic
+      // highlighting.
+      if (document->GetHighlightRanges(0).size() <= 1) {
+        lexicalHighlighter.HighlightDocument(document.get());
+        document->FinishedHighlightingChanges();
+      }
     }
     
     isCFile = true;
@@ -1156,13 +1478,110 @@ void DocumentWidget::CheckFileType() {
   }
 }
 
+void DocumentWidget::CheckLargeFileMode(int lineCount) {
+  if (largeFileMode) {
+    return;
+  }
+  
+  int lineThreshold = Settings::Instance().GetLargeFileLineThreshold();
+  qint64 sizeThreshold = static_cast<qint64>(Settings::Instance().GetLargeFileSizeThresholdMB()) * 1024 * 1024;
+  if ((lineThreshold <= 0 || lineCount < lineThreshold) &&
+      (sizeThreshold <= 0 || static_cast<qint64>(sizeof(QChar)) * document->FullDocumentRange().end.offset < sizeThreshold)) {
+    return;
+  }
+  
+  largeFileMode = true;
+  container->SetMessage(
+      DocumentWidgetContainer::MessageType::LargeFileNotification,
+      tr("This is a large file (%1 lines). It is only highlighted lexically and the git diff is not updated automatically. <a href=\"diff\">Update git diff</a>").arg(lineCount));
+}
+
+void DocumentWidget::UpdateGitDiff() {
+  GitDiff::Instance().RequestDiff(document, this, mainWindow);
+}
+
 void DocumentWidget::StartParseTimer() {
-  constexpr int parseDelay = 0;
+  // Documents that parse quickly are reparsed right after each change. For
+  // documents that are slow to parse, the results of a parse during typing
+  // would be outdated right away, so the parse is delayed until the user
+  // pauses typing (but at most until kMaxParseWaitMs after the first change).
+  constexpr double kFastParseDurationMs = 150;
+  constexpr double kMaxTypingIntervalMs = 1500;
+  constexpr int kMaxParseDelayMs = 1500;
+  constexpr int kMaxParseWaitMs = 3000;
+  constexpr double kSmoothingFactor = 0.3;
+  
+  // The catch-up reparse would parse an outdated version of the document.
+  TUCatchUpTimer->stop();
+  
+  if (lastChangeTimer.isValid()) {
+    double interval = lastChangeTimer.restart();
+    if (interval < kMaxTypingIntervalMs) {
+      averageChangeIntervalMs = (averageChangeIntervalMs < 0) ? interval :
+          ((1 - kSmoothingFactor) * averageChangeIntervalMs + kSmoothingFactor * interval);
+    }
+  } else {
+    lastChangeTimer.start();
+  }
+  
+  // Changes that are confined to comments or to whitespace between tokens do
+  // not change the parse result: the highlight and problem ranges are shifted
+  // with the text anyway. Postpone the reparse for those until the next
+  // change to the code or until the document is saved.
+  if (isCFile && !parseTimer->isActive() &&
+      parsedTextChangeCounter >= 0 &&
+      document->lastCodeChangeCounter() <= parsedTextChangeCounter) {
+    reparsePostponed = true;
+    if (!largeFileMode) {
+      GitDiff::Instance().RequestDiff(document, this, mainWindow);
+    }
+    ScheduleTUCatchUp();
+    return;
+  }
+  
+  if (!parseTimer->isActive()) {
+    firstUnparsedChangeTimer.start();
+  }
+  
+  int parseDelay = 0;
+  if (averageParseDurationMs > kFastParseDurationMs) {
+    parseDelay = std::min<double>(
+        kMaxParseDelayMs,
+        std::max(0.5 * averageParseDurationMs, 1.5 * averageChangeIntervalMs));
+    parseDelay = std::min<qint64>(parseDelay, std::max<qint64>(0, kMaxParseWaitMs - firstUnparsedChangeTimer.elapsed()));
+  }
+  parseDelay = std::max(parseDelay, GetPerformanceProfileParameters().minParseDelayMilliseconds);
   parseTimer->start(parseDelay);
 }
 
+void DocumentWidget::ReportParseDuration(double durationMs) {
+  constexpr double kSmoothingFactor = 0.3;
+  
+  // The first parse additionally creates the TU and its preamble, so it is
+  // not representative for the reparses that follow changes.
+  ++ numReportedParses;
+  if (numReportedParses == 1) {
+    return;
+  }
+  
+  averageParseDurationMs = (averageParseDurationMs < 0) ? durationMs :
+      ((1 - kSmoothingFactor) * averageParseDurationMs + kSmoothingFactor * durationMs);
+}
+
 void DocumentWidget::ParseFile() {
+  if (parseDeferredUntilActivation) {
+    // showEvent() will call this function again.
+    return;
+  }
+  
+  if (largeFileMode) {
+    // Large files are only highlighted lexically, and diffed on request.
+    return;
+  }
+  
   if (isCFile) {
+    parsedTextChangeCounter = document->textChangeCounter();
+    reparsePostponed = false;
     ParseThreadPool::Instance().RequestParse(document, this, mainWindow);
   }
   
@@ -1170,12 +1589,59 @@ void DocumentWidget::ParseFile() {
   GitDiff::Instance().RequestDiff(document, this, mainWindow);
 }
 
+void DocumentWidget::ReparseIfPostponed() {
+  if (reparsePostponed) {
+    ParseFile();
+  }
+}
+
+void DocumentWidget::ScheduleTUCatchUp() {
+  if (!isCFile || largeFileMode) {
+    return;
+  }
+  TUCatchUpTimer->start(kTUCatchUpIdleDelayMs);
+}
+
+void DocumentWidget::PrefetchHoverInfo() {
+  if (!isVisible() || layoutLines.empty()) {
+    return;
+  }
+  
+  int firstLine, lastLine;
+  GetVisibleLines(&firstLine, &lastLine);
+  
+  std::vector<DocumentLocation> identifierStarts;
+  bool previousIsIdentifierChar = false;
+  Document::CharacterIterator it(document.get(), layoutLines[firstLine].start.offset);
+  while (it.IsValid() && it.GetCharacterOffset() < layoutLines[lastLine].end.offset) {
+    QChar character = it.GetChar();
+    bool isIdentifierChar = IsIdentifierChar(character);
+    if (isIdentifierChar && !previousIsIdentifierChar && !character.isDigit()) {
+      identifierStarts.push_back(it.GetCharacterOffset());
+      if (static_cast<int>(identifierStarts.size()) >= kMaxHoverPrefetchIdentifiers) {
+        break;
+      }
+    }
+    previousIsIdentifierChar = isIdentifierChar;
+    ++ it;
+  }
+  
+  CodeInfo::Instance().PrefetchHoverInfo(this, identifierStarts);
+}
+
 void DocumentWidget::SetReparseOnNextActivation() {
   reparseOnNextActivation = true;
 }
 
+void DocumentWidget::DeferParseUntilActivation() {
+  parseDeferredUntilActivation = true;
+}
+
 void DocumentWidget::InvokeCodeCompletion() {
   ++ codeCompletionInvocationCounter;
+  if (ReuseCodeCompletion()) {
+    return;
+  }
   codeCompletionInvocationLocation = CodeInfo::Instance().RequestCodeCompletion(this);
   argumentHintInvocationLocation = codeCompletionInvocationLocation;
 }
@@ -1189,6 +1655,14 @@ void DocumentWidget::AcceptCodeCompletion() {
   CloseCodeCompletion();
 }
 
+void DocumentWidget::CodeCompletionFilterApplied() {
+  if (codeCompletionWidget &&
+      closeCodeCompletionOnSingleExactMatch &&
+      codeCompletionWidget->HasSingleExactMatch()) {
+    CloseCodeCompletion();
+  }
+}
+
 void DocumentWidget::CheckPhraseHighlight() {
   if (selection.IsValid() && selection.start < selection.end) {
     Document::CharacterIterator it(document.get(), selection.start.offset);
@@ -1207,57 +1681,52 @@ void DocumentWidget::CheckPhraseHighlight() {
 }
 
 void DocumentWidget::RequestPhraseHighlight(const QString& phrase) {
-  // Find occurrences
-  // TODO: Do this in a background thread like the clang parse threads?
-  std::vector<DocumentRange> occurrences;
-  occurrences.reserve(128);
+  // Prefer the occurrences in the visible part of the document.
+  DocumentRange focusRange = selection;
+  if (haveLayout &&
+      layoutLinesTextChangeCounter == document->textChangeCounter() &&
+      !layoutLines.empty()) {
+    int firstLine, lastLine;
+    GetVisibleLines(&firstLine, &lastLine);
+    focusRange = DocumentRange(layoutLines[firstLine].start, layoutLines[lastLine].end);
+  }
   
-  DocumentLocation findStart = document->FullDocumentRange().end;
-  while (true) {
-    DocumentLocation result = document->Find(phrase, findStart, false, true);
-    if (result.IsInvalid()) {
-      break;
-    }
-    
-    DocumentRange occurrence(result, result + phrase.size());
-    
-    // Is this a word/phrase occurrence, or part of another word? Only highlight
-    // it in the former case.
-    Document::CharacterIterator it(document.get(), occurrence.start.offset);
-    int wordCharType = GetCharType(it.GetChar());
-    -- it;
-    if (!it.IsValid() || GetCharType(it.GetChar()) != wordCharType || wordCharType == static_cast<int>(CharacterType::Symbol)) {
-      Document::CharacterIterator it2(document.get(), occurrence.end.offset - 1);
-      int wordEndCharType = GetCharType(it2.GetChar());
-      ++ it2;
-      if (!it2.IsValid() || GetCharType(it2.GetChar()) != wordEndCharType || wordEndCharType == static_cast<int>(CharacterType::Symbol)) {
-        occurrences.emplace_back(occurrence);
-      }
-    }
-    
-    findStart = result;
+  ++ phraseHighlightRequestCounter;
+  
+  // For identifiers, the occurrences can be looked up in the document's
+  // identifier index right away. Other phrases are searched for in a
+  // background thread.
+  std::vector<DocumentRange> occurrences;
+  document->FindIdentifierOccurrences(phrase, &occurrences);
+  if (!occurrences.empty()) {
+    PhraseHighlighter::KeepOccurrencesClosestTo(focusRange, Settings::Instance().GetMaxPhraseHighlightCount(), &occurrences);
+    AddPhraseHighlights(occurrences);
+    return;
   }
   
-  // Add highlight ranges.
+  PhraseHighlighter::Instance().RequestHighlight(this, phrase, focusRange, phraseHighlightRequestCounter);
+}
+
+void DocumentWidget::AddPhraseHighlights(const std::vector<DocumentRange>& occurrences) {
   // We should always find at least one occurrence, which is the actual selection.
   // Highlighting this will not be visible because the selection is drawn on top.
   // So, we only add highlights if we have at least two occurrences.
-  if (occurrences.empty()) {
-    qDebug() << "Warning: RequestPhraseHighlight() found no occurrence, this is not supposed to happen since the selected occurrence should always be found.";
+  if (occurrences.size() <= 1) {
     return;
-  } else if (occurrences.size() <= 1) {
-    return;
-  } else {
-    const auto& copyHighlightStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::CopyHighlight);
-    for (const DocumentRange& range : occurrences) {
-      document->AddHighlightRange(range, false, copyHighlightStyle, /*layer*/ kHighlightLayer);
-    }
-    document->FinishedHighlightingChanges();
-    update(rect());
   }
+  
+  const auto& copyHighlightStyle = Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::CopyHighlight);
+  for (const DocumentRange& range : occurrences) {
+    document->AddHighlightRange(range, false, copyHighlightStyle, /*layer*/ kHighlightLayer);
+  }
+  document->FinishedHighlightingChanges();
+  update(rect());
 }
 
 void DocumentWidget::RemoveHighlights() {
+  // Discard the results of pending phrase highlight requests
+  ++ phraseHighlightRequestCounter;
+  
   if (document->GetHighlightRanges(kHighlightLayer).size() > 1) {
     document->ClearHighlightRanges(kHighlightLayer);
     document->FinishedHighlightingChanges();
@@ -1272,6 +1741,7 @@ void DocumentWidget::CheckBracketHighlight() {
   
   DocumentLocation cursorLoc = MapCursorToDocument();
   Document::CharacterAndStyleIterator it(document.get(), cursorLoc.offset);
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
   
   // Checks for a bracket to the right of pos
   auto checkBracketHighlight = [&](const Document::CharacterAndStyleIterator& pos, const Settings::TextStyle highlightStyleType) {
@@ -1282,7 +1752,7 @@ void DocumentWidget::CheckBracketHighlight() {
     int matchOffset = document->FindMatchingBracket(pos);
     if (matchOffset != -1) {
       int posOffset = pos.GetCharacterOffset();
-      const auto& highlightStyle = Settings::Instance().GetConfiguredTextStyle(highlightStyleType);
+      const auto& highlightStyle = styles->GetTextStyle(highlightStyleType);
       document->AddHighlightRange(DocumentRange(posOffset, posOffset + 1), false, highlightStyle, /*layer*/ kHighlightLayer);
       document->AddHighlightRange(DocumentRange(matchOffset, matchOffset + 1), false, highlightStyle, /*layer*/ kHighlightLayer);
       update(rect());
@@ -1303,11 +1773,30 @@ void DocumentWidget::CheckBracketHighlight() {
   }
 }
 
-void DocumentWidget::HighlightingChanged() {
+void DocumentWidget::HighlightingChanged(const DocumentRange& changedRange) {
+  // Nothing needs to be redrawn if the highlighting did not change, e.g., if
+  // a reparse yielded the same highlighting as before.
+  if (changedRange.IsInvalid()) {
+    return;
+  }
+  
   // Perform a map update if a relayout check does not do that anyway.
   if (!CheckRelayout()) {
     container->GetMinimap()->UpdateMap(layoutLines, nullptr);
   }
+  if (layoutLines.empty()) {
+    return;
+  }
+  
+  // Redraw the layout lines that contain the changed range
+  auto compareToLineStart = [](const DocumentLocation& location, const DocumentRange& line) {
+    return location < line.start;
+  };
+  int firstLine = std::max<int>(0, (std::upper_bound(layoutLines.begin(), layoutLines.end(), changedRange.start, compareToLineStart) - layoutLines.begin()) - 1);
+  int lastLine = std::max<int>(firstLine, (std::upper_bound(layoutLines.begin() + firstLine, layoutLines.end(), changedRange.end, compareToLineStart) - layoutLines.begin()) - 1);
+  QRect updateRect = GetLineRect(firstLine).united(GetLineRect(lastLine));
+  updateRect.setLeft(0);
+  update(updateRect);
 }
 
 void DocumentWidget::MoveCursorLeft(bool shiftHeld, bool controlHeld) {
@@ -1429,9 +1918,15 @@ void DocumentWidget::SetXYScroll(int x, int y) {
   if (xScroll == x && yScroll == y) {
     return;
   }
+  int dy = yScroll - y;
+  bool xChanged = xScroll != x;
   xScroll = x;
   yScroll = y;
-  update(rect());
+  if (xChanged) {
+    update(rect());
+  } else {
+    RepaintScrolledContent(dy);
+  }
   
   container->GetScrollbar()->setValue(x);
   
@@ -1443,7 +1938,7 @@ void DocumentWidget::SetXYScroll(int x, int y) {
     argumentHintWidget->SetInvocationPoint(GetTextRect(DocumentRange(argumentHintInvocationLocation, argumentHintInvocationLocation)).topLeft());
     argumentHintWidget->Relayout();
   }
-  container->GetMinimap()->update(rect());
+  container->GetMinimap()->ScrollChanged();
 }
 
 void DocumentWidget::SetXScroll(int value) {
@@ -1465,12 +1960,24 @@ void DocumentWidget::SetXScroll(int value) {
   }
 }
 
+void DocumentWidget::GetVisibleLines(int* firstLine, int* lastLine) const {
+  if (lineHeight <= 0) {
+    *firstLine = 0;
+    *lastLine = 0;
+    return;
+  }
+  int lastLayoutLine = std::max(0, static_cast<int>(layoutLines.size()) - 1);
+  *firstLine = std::max(0, std::min(lastLayoutLine, yScroll / lineHeight));
+  *lastLine = std::max(*firstLine, std::min(lastLayoutLine, (yScroll + height()) / lineHeight));
+}
+
 void DocumentWidget::SetYScroll(int value) {
   if (yScroll == value) {
     return;
   }
+  int dy = yScroll - value;
   yScroll = value;
-  update(rect());
+  RepaintScrolledContent(dy);
   
   if (codeCompletionWidget) {
     codeCompletionWidget->SetInvocationPoint(GetTextRect(DocumentRange(codeCompletionInvocationLocation, codeCompletionInvocationLocation)).bottomLeft() + QPoint(0, 1));
@@ -1480,7 +1987,33 @@ void DocumentWidget::SetYScroll(int value) {
     argumentHintWidget->SetInvocationPoint(GetTextRect(DocumentRange(argumentHintInvocationLocation, argumentHintInvocationLocation)).topLeft());
     argumentHintWidget->Relayout();
   }
-  container->GetMinimap()->update(rect());
+  container->GetMinimap()->ScrollChanged();
+}
+
+void DocumentWidget::RepaintScrolledContent(int dy) {
+  // The git blame gutter labels the first painted line of each paint event,
+  // so in this case, the lines that are not repainted would be labeled
+  // wrongly.
+  bool showGitBlame = sidebarWidth > kGitDiffMarkerWidth;
+  if (showGitBlame || std::abs(dy) >= height()) {
+    update(rect());
+    return;
+  }
+  
+  // The fix-it buttons are painted as part of the content, so they move with
+  // it.
+  for (auto it = fixitButtons.begin(); it != fixitButtons.end(); ) {
+    it->buttonRect.translate(0, dy);
+    if (it->buttonRect.intersects(rect())) {
+      ++ it;
+    } else {
+      it = fixitButtons.erase(it);
+    }
+  }
+  
+  // Passing the rect prevents child widgets from being moved; the popups are
+  // positioned by the callers.
+  scroll(0, dy, rect());
 }
 
 void DocumentWidget::ShowDocumentationInDock() {
@@ -1504,41 +2037,83 @@ void DocumentWidget::FontChanged() {
   fontMetrics.reset(new QFontMetrics(Settings::Instance().GetDefaultFont()));
   lineHeight = fontMetrics->ascent() + fontMetrics->descent();
   charWidth = fontMetrics->/*horizontalAdvance*/ width(' ');
+  
+  // The cached line widths and rendered lines depend on the font.
+  haveLayout = false;
+  lineRasterCache.clear();
+  
+  UpdateSidebarWidth();
+}
+
+void DocumentWidget::UpdateSidebarWidth() {
+  sidebarWidth = kGitDiffMarkerWidth;
+  if (Settings::Instance().GetShowGitBlame()) {
+    sidebarWidth += kGitBlameGutterCharacters * charWidth;
+  }
 }
 
 bool DocumentWidget::CheckRelayout() {
-  if (haveLayout &&
-      layoutVersion == document->version() /*&&
+  ProfilerScope profilerScope("CheckRelayout");
+  bool layoutLinesValid =
+      haveLayout &&
+      layoutLinesTextChangeCounter == document->textChangeCounter();
+  if (layoutLinesValid &&
+      layoutTextChangeCounter == document->textChangeCounter() /*&&
       (!wordWrap || width() == layoutWidth)*/) {
     return false;
   }
-  haveLayout = true;
-  layoutVersion = document->version();
-  
-  // Compute layoutLines and maximum x extent
-  // TODO: It seems like a waste to re-compute these completely after every change
-  //       to the document. Should those instead be kept as a part of Document and be
-  //       adapted iteratively to changes?
-  maxTextWidth = 0;
-  layoutLines.clear();
-  layoutLines.reserve(document->LineCount());
-  Document::LineIterator it(document.get());
-  while (it.IsValid()) {
-    DocumentRange range = it.GetLineRange();
-    maxTextWidth = std::max(maxTextWidth, GetTextWidth(document->TextForRange(range), 0, nullptr));  // TODO: Implement GetText() in LineIterator to get it faster (already knowing the start block)
-    layoutLines.push_back(range);
-    ++ it;
+  layoutTextChangeCounter = document->textChangeCounter();
+  
+  if (!layoutLinesValid) {
+    // Compute layoutLines and their widths from scratch. Afterwards, they are
+    // kept up-to-date by TextReplaced().
+    haveLayout = true;
+    layoutLinesTextChangeCounter = document->textChangeCounter();
+    
+    std::vector<unsigned> lineStarts;
+    document->GetLineStarts(&lineStarts);
+    int documentSize = document->FullDocumentRange().end.offset;
+    
+    // The document may have grown beyond the large-file thresholds, e.g.,
+    // when it was reloaded.
+    CheckLargeFileMode(lineStarts.size());
+    
+    layoutLines.clear();
+    layoutLines.reserve(lineStarts.size());
+    layoutLineWidths.clear();
+    layoutLineWidths.reserve(lineStarts.size());
+    for (int line = 0, lineCount = lineStarts.size(); line < lineCount; ++ line) {
+      // Each line ends at the newline before the next line start.
+      DocumentRange range(
+          lineStarts[line],
+          (line + 1 < lineCount) ? (lineStarts[line + 1] - 1) : documentSize);
+      layoutLines.push_back(range);
+      // In large-file mode, estimate the width from the character count
+      // instead of looking at the text of every line.
+      layoutLineWidths.push_back(largeFileMode ? (range.size() * charWidth) : GetTextWidth(document->TextForRange(range), 0, nullptr));
+    }
+    maxTextWidthDirty = true;
+  }
+  
+  // Determine the maximum x extent
+  if (maxTextWidthDirty) {
+    maxTextWidth = 0;
+    for (int width : layoutLineWidths) {
+      maxTextWidth = std::max(maxTextWidth, width);
+    }
+    maxTextWidthDirty = false;
   }
   
   // Update the x-scroll range
   UpdateScrollbar();
   
   // Copy the document for both the scrollbar minimap update and a possible
-  // backup
+  // backup. This only copies the block pointers, the blocks are shared until
+  // the document modifies them.
   std::shared_ptr<Document> documentCopy(new Document());
   documentCopy->AssignTextAndStyles(*document);
   
-  container->GetMinimap()->UpdateMap(layoutLines, documentCopy);
+  container->GetMinimap()->UpdateMap(layoutLines, documentCopy, /*sampled*/ largeFileMode);
   
   if (document->HasUnsavedChanges()) {
     CrashBackup::Instance().MakeBackup(document->path(), documentCopy);
@@ -1549,6 +2124,99 @@ bool DocumentWidget::CheckRelayout() {
   return true;
 }
 
+void DocumentWidget::TextReplaced(const DocumentRange& oldRange, int newTextSize, int textChangeCounter) {
+  if (lexicalHighlighter.IsActive(document.get())) {
+    lexicalHighlighter.TextReplaced(document.get(), oldRange, newTextSize, textChangeCounter);
+    lexicalHighlightTimer->start(0);
+  }
+  
+  // The last (or prefetched) code completion results remain reusable only
+  // while all edits are within the identifier that directly follows their
+  // invocation location.
+  // However, if they were obtained within the argument list of a call, edits
+  // after the call's opening parenthesis keep them reusable for other
+  // invocations within this argument list (see ReuseCodeCompletion()).
+  if (reusableCodeCompletionResults &&
+      !IsReplacementWithinIdentifierAt(reusableCodeCompletionLocation, oldRange, newTextSize)) {
+    if (reusableCallSiteLocation.IsValid() && oldRange.start >= reusableCallSiteLocation) {
+      reusableCodeCompletionLocation = DocumentLocation::Invalid();
+    } else {
+      ClearReusableCodeCompletion();
+    }
+  }
+  if (codeCompletionPrefetchLocation.IsValid() &&
+      !IsReplacementWithinIdentifierAt(codeCompletionPrefetchLocation, oldRange, newTextSize)) {
+    codeCompletionPrefetchLocation = DocumentLocation::Invalid();
+  }
+  
+  if (!haveLayout || layoutLines.empty() ||
+      layoutLinesTextChangeCounter != textChangeCounter - 1) {
+    // The layout does not correspond to the text before this replacement, so
+    // it cannot be adapted. Re-compute it completely in CheckRelayout().
+    haveLayout = false;
+    return;
+  }
+  layoutLinesTextChangeCounter = textChangeCounter;
+  
+  // Find the (old) layout lines which contain the start and end of the
+  // replaced range. Only these lines are laid out again below.
+  auto compareToLineStart = [](const DocumentLocation& location, const DocumentRange& line) {
+    return location < line.start;
+  };
+  int firstLine = (std::upper_bound(layoutLines.begin(), layoutLines.end(), oldRange.start, compareToLineStart) - layoutLines.begin()) - 1;
+  int lastLine = (std::upper_bound(layoutLines.begin() + firstLine, layoutLines.end(), oldRange.end, compareToLineStart) - layoutLines.begin()) - 1;
+  int shift = newTextSize - oldRange.size();
+  
+  DocumentLocation affectedStart = layoutLines[firstLine].start;
+  DocumentLocation affectedEnd = layoutLines[lastLine].end + shift;
+  QString affectedText = document->TextForRange(DocumentRange(affectedStart, affectedEnd));
+  
+  std::vector<DocumentRange> newLines;
+  std::vector<int> newLineWidths;
+  int lineStart = 0;
+  for (int i = 0, size = affectedText.size(); i <= size; ++ i) {
+    if (i == size || affectedText[i] == '\n') {
+      newLines.emplace_back(affectedStart + lineStart, affectedStart + i);
+      newLineWidths.push_back(GetTextWidth(affectedText.mid(lineStart, i - lineStart), 0, nullptr));
+      lineStart = i + 1;
+    }
+  }
+  
+  // Update the maximum x extent. If a line that was as wide as the maximum is
+  // replaced, the new maximum is only known after checking all lines, which is
+  // deferred to CheckRelayout().
+  for (int l = firstLine; l <= lastLine; ++ l) {
+    if (layoutLineWidths[l] >= maxTextWidth) {
+      maxTextWidthDirty = true;
+    }
+  }
+  for (int width : newLineWidths) {
+    maxTextWidth = std::max(maxTextWidth, width);
+  }
+  
+  // Shift the lines after the replacement.
+  if (shift != 0) {
+    for (int l = lastLine + 1, size = layoutLines.size(); l < size; ++ l) {
+      layoutLines[l].start += shift;
+      layoutLines[l].end += shift;
+    }
+  }
+  
+  // Replace the affected lines.
+  int oldLineCount = lastLine - firstLine + 1;
+  int newLineCount = newLines.size();
+  int commonLineCount = std::min(oldLineCount, newLineCount);
+  std::copy(newLines.begin(), newLines.begin() + commonLineCount, layoutLines.begin() + firstLine);
+  std::copy(newLineWidths.begin(), newLineWidths.begin() + commonLineCount, layoutLineWidths.begin() + firstLine);
+  if (newLineCount > oldLineCount) {
+    layoutLines.insert(layoutLines.begin() + firstLine + commonLineCount, newLines.begin() + commonLineCount, newLines.end());
+    layoutLineWidths.insert(layoutLineWidths.begin() + firstLine + commonLineCount, newLineWidths.begin() + commonLineCount, newLineWidths.end());
+  } else if (oldLineCount > newLineCount) {
+    layoutLines.erase(layoutLines.begin() + firstLine + commonLineCount, layoutLines.begin() + firstLine + oldLineCount);
+    layoutLineWidths.erase(layoutLineWidths.begin() + firstLine + commonLineCount, layoutLineWidths.begin() + firstLine + oldLineCount);
+  }
+}
+
 QRect DocumentWidget::GetCursorRect() {
   constexpr int kCursorExtent = 1;
   
@@ -1802,7 +2470,6 @@ void DocumentWidget::ApplyFixIt(const std::shared_ptr<Problem>& problem, int fix
 }
 
 std::vector<std::shared_ptr<Problem>> DocumentWidget::GetHoveredProblems() {
-  const std::set<ProblemRange>& problemRanges = document->problemRanges();
   std::vector<std::shared_ptr<Problem>> hoveredProblems;
   QPoint cursorPos = mapFromGlobal(QCursor::pos());
   
@@ -1813,34 +2480,27 @@ std::vector<std::shared_ptr<Problem>> DocumentWidget::GetHoveredProblems() {
   int maxLine = std::min<int>(static_cast<int>(layoutLines.size()) - 1, (yScroll + cursorPos.y()) / lineHeight);
   
   for (int line = minLine; line <= maxLine; ++ line) {
-    int minCharacterOffset = layoutLines[line].start.offset;
-    int maxCharacterOffset = layoutLines[line].start.offset + layoutLines[line].size() - 1;
-    
     // Iterate over ranges within this line
-    auto problemRangeIt = problemRanges.begin();  // TODO: Use the set to find the first relevant problem range faster
-    while (problemRangeIt != problemRanges.end()) {
-      if (problemRangeIt->range.start.offset <= maxCharacterOffset &&
-          problemRangeIt->range.end.offset >= minCharacterOffset) {
-        // This problem range starts before or in this line and has at least
-        // some part within the line.
-        QRect textRect = GetTextRect(problemRangeIt->range);
-        if (textRect.contains(cursorPos)) {
-          std::shared_ptr<Problem> hoveredProblem = document->problems()[problemRangeIt->problemIndex];
-          bool alreadyThere = false;
-          for (const std::shared_ptr<Problem>& problem : hoveredProblems) {
-            if (problem.get() == hoveredProblem.get()) {
-              alreadyThere = true;
-              break;
-            }
-          }
-          if (!alreadyThere) {
-            hoveredProblems.push_back(hoveredProblem);
+    const ProblemLineSpan* problemSpanIt;
+    const ProblemLineSpan* problemSpansEnd;
+    document->GetProblemLineSpans(line, &problemSpanIt, &problemSpansEnd);
+    for (; problemSpanIt != problemSpansEnd; ++ problemSpanIt) {
+      // Spans of multi-line ranges end at the next line start; clip them to
+      // the line such that the rect does not extend into the next line.
+      QRect textRect = GetTextRect(DocumentRange(problemSpanIt->start, std::min(problemSpanIt->end, layoutLines[line].end.offset)));
+      if (textRect.contains(cursorPos)) {
+        std::shared_ptr<Problem> hoveredProblem = document->problems()[problemSpanIt->problemIndex];
+        bool alreadyThere = false;
+        for (const std::shared_ptr<Problem>& problem : hoveredProblems) {
+          if (problem.get() == hoveredProblem.get()) {
+            alreadyThere = true;
+            break;
           }
         }
-      } else if (problemRangeIt->range.start.offset > maxCharacterOffset) {
-        break;
+        if (!alreadyThere) {
+          hoveredProblems.push_back(hoveredProblem);
+        }
       }
-      ++ problemRangeIt;
     }
   }
   
@@ -2002,6 +2662,19 @@ void DocumentWidget::UpdateTooltip(
         
         showCodeInfoInExistingWidget = true;
         CodeInfo::Instance().RequestCodeInfo(this, path, pathLine, pathCol, document->path(), false);
+      } else if (linkTarget.startsWith(QStringLiteral("members://"))) {
+        // This is a link to show more members of the class at the given
+        // location, in the format "members://maxMembers@path:line:column".
+        int separatorPos = linkTarget.indexOf('@');
+        int maxClassMembers = linkTarget.midRef(10, separatorPos - 10).toInt();
+        QString path;
+        int pathLine;
+        int pathCol;
+        SplitPathAndLineAndColumn(linkTarget.mid(separatorPos + 1), &path, &pathLine, &pathCol);
+        path = QFileInfo(path).canonicalFilePath();
+        
+        showCodeInfoInExistingWidget = true;
+        CodeInfo::Instance().RequestCodeInfo(this, path, pathLine, pathCol, document->path(), false, maxClassMembers);
       } else {
         // This is a link to a file location. Close the tooltip and go there.
         CloseTooltip();
@@ -2053,12 +2726,18 @@ void DocumentWidget::UpdateTooltip(
   // Create the "line diff" part of the tooltip?
   QFrame* diffFrame = nullptr;
   tooltipDiffLabel = nullptr;
-  if (isVisible() && hoveredDiff && !hoveredDiff->oldText.isEmpty()) {
+  // The removed text is only fetched from the diff base here, when the diff
+  // gets hovered.
+  QString oldText;
+  if (isVisible() && hoveredDiff) {
+    oldText = document->GetLineDiffOldText(*hoveredDiff);
+  }
+  if (!oldText.isEmpty()) {
     tooltipDiffLabel = new QLabel();
     tooltipDiffLabel->setTextInteractionFlags(Qt::TextBrowserInteraction);
     tooltipDiffLabel->setTextFormat(Qt::RichText);
-    int numToChop = hoveredDiff->oldText.endsWith('\n') ? 1 : 0;
-    tooltipDiffLabel->setText(tr("<b>Removed text:</b><br/>%1").arg(hoveredDiff->oldText.chopped(numToChop).toHtmlEscaped().replace('\n', "<br/>").replace(' ', "&nbsp;")));
+    int numToChop = oldText.endsWith('\n') ? 1 : 0;
+    tooltipDiffLabel->setText(tr("<b>Removed text:</b><br/>%1").arg(oldText.chopped(numToChop).toHtmlEscaped().replace('\n', "<br/>").replace(' ', "&nbsp;")));
     
     QVBoxLayout* layout = new QVBoxLayout();
     layout->setContentsMargins(0, 0, 0, 0);
@@ -2577,30 +3256,181 @@ void DocumentWidget::resizeEvent(QResizeEvent* /*event*/) {
   UpdateScrollbar();
 }
 
+void DocumentWidget::PaintCharacters(QPainter* painter, const QString& text, const std::vector<PaintedCharacter>& characters, int y, bool drawFrameLines, int columnMarkerX, QRgb columnMarkerColor) {
+  if (characters.empty()) {
+    return;
+  }
+  
+  // Draw the backgrounds, with one rectangle for each run of characters with
+  // the same background color
+  for (int i = 0; i < characters.size(); ) {
+    int end = i + 1;
+    while (end < characters.size() && characters[end].backgroundColor == characters[i].backgroundColor) {
+      ++ end;
+    }
+    int startX = characters[i].x;
+    int endX = characters[end - 1].x + characters[end - 1].width;
+    painter->fillRect(startX, y, endX - startX, lineHeight, characters[i].backgroundColor);
+    if (drawFrameLines) {
+      painter->setPen(characters[i].backgroundColor.darker(200));
+      painter->drawLine(startX, y, endX, y);
+      painter->drawLine(startX, y + lineHeight - 1, endX, y + lineHeight - 1);
+    }
+    i = end;
+  }
+  
+  if (columnMarkerX >= characters.front().x &&
+      columnMarkerX < characters.back().x + characters.back().width) {
+    painter->setPen(columnMarkerColor);
+    painter->drawLine(columnMarkerX, y, columnMarkerX, y + lineHeight - 1);
+  }
+  
+  // Draw the text, with one call for each run of characters with the same
+  // style. Characters that do not take up exactly one regular character cell
+  // are drawn individually, since their positions might not match the font's
+  // advances otherwise.
+  bool haveFontAndPen = false;
+  bool fontIsBold = false;
+  QColor penColor;
+  for (int i = 0; i < characters.size(); ) {
+    const PaintedCharacter& first = characters[i];
+    int end = i + 1;
+    if (first.canBeDrawnInRun) {
+      while (end < characters.size() &&
+             characters[end].canBeDrawnInRun &&
+             characters[end].bold == first.bold &&
+             characters[end].textColor == first.textColor) {
+        ++ end;
+      }
+    }
+    
+    // Runs of spaces do not need to be drawn
+    QString runText = text.mid(first.index, end - i);
+    if (runText.trimmed().isEmpty()) {
+      i = end;
+      continue;
+    }
+    
+    if (!haveFontAndPen || fontIsBold != first.bold) {
+      painter->setFont(first.bold ? Settings::Instance().GetBoldFont() : Settings::Instance().GetDefaultFont());
+      fontIsBold = first.bold;
+    }
+    if (!haveFontAndPen || penColor != first.textColor) {
+      painter->setPen(QPen(first.textColor));
+      penColor = first.textColor;
+    }
+    haveFontAndPen = true;
+    
+    int runWidth = characters[end - 1].x + characters[end - 1].width - first.x;
+    painter->drawText(QRect(first.x, y, runWidth, lineHeight), Qt::AlignLeft | Qt::AlignTop | Qt::TextSingleLine, runText);
+    i = end;
+  }
+  
+  // Draw the underlining, with one line for each run of characters with the
+  // same underline color
+  // TODO: Maybe use drawRect() for high-DPI screens?
+  for (int i = 0; i < characters.size(); ) {
+    int end = i + 1;
+    if (!characters[i].underlined) {
+      i = end;
+      continue;
+    }
+    while (end < characters.size() &&
+           characters[end].underlined &&
+           characters[end].underlineColor == characters[i].underlineColor) {
+      ++ end;
+    }
+    painter->setPen(characters[i].underlineColor);
+    painter->drawLine(characters[i].x, y + fontMetrics->ascent(), characters[end - 1].x + characters[end - 1].width, y + fontMetrics->ascent());
+    i = end;
+  }
+}
+
+void DocumentWidget::PaintCharactersCached(QPainter* painter, const QString& text, std::vector<PaintedCharacter>* characters, int y, bool drawFrameLines, int columnMarkerX, QRgb columnMarkerColor) {
+  if (characters->empty()) {
+    return;
+  }
+  
+  // Make the parameters relative to the start of the line raster
+  int startX = characters->front().x;
+  for (PaintedCharacter& character : *characters) {
+    character.x -= startX;
+  }
+  int rasterWidth = characters->back().x + characters->back().width;
+  columnMarkerX -= startX;
+  if (columnMarkerX < 0 || columnMarkerX >= rasterWidth) {
+    columnMarkerX = -1;
+  }
+  qreal pixelRatio = devicePixelRatioF();
+  
+  std::size_t hash = qHash(text);
+  auto combine = [&hash](std::size_t value) {
+    hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  };
+  combine(drawFrameLines);
+  combine(columnMarkerX);
+  for (const PaintedCharacter& character : *characters) {
+    combine(character.x);
+    combine(character.backgroundColor.rgba());
+    combine(character.textColor.rgba());
+    combine(character.bold);
+    combine(character.underlined ? character.underlineColor : 0);
+  }
+  
+  LineRaster& raster = lineRasterCache[hash];
+  if (raster.pixmap.isNull() ||
+      raster.text != text ||
+      raster.characters != *characters ||
+      raster.drawFrameLines != drawFrameLines ||
+      raster.columnMarkerX != columnMarkerX ||
+      (columnMarkerX >= 0 && raster.columnMarkerColor != columnMarkerColor) ||
+      raster.devicePixelRatio != pixelRatio) {
+    raster.text = text;
+    raster.characters = *characters;
+    raster.drawFrameLines = drawFrameLines;
+    raster.columnMarkerX = columnMarkerX;
+    raster.columnMarkerColor = columnMarkerColor;
+    raster.devicePixelRatio = pixelRatio;
+    
+    // Since the characters' backgrounds cover the whole pixmap, it does not
+    // need an alpha channel (which allows for subpixel antialiasing).
+    raster.pixmap = QPixmap(QSize(rasterWidth, lineHeight) * pixelRatio);
+    raster.pixmap.setDevicePixelRatio(pixelRatio);
+    QPainter rasterPainter(&raster.pixmap);
+    PaintCharacters(&rasterPainter, text, *characters, 0, drawFrameLines, columnMarkerX, columnMarkerColor);
+  }
+  raster.lastUsedPaint = paintCounter;
+  
+  painter->drawPixmap(startX, y, raster.pixmap);
+}
+
 void DocumentWidget::paintEvent(QPaintEvent* event) {
+  ProfilerScope profilerScope("DocumentWidget::paintEvent");
   auto& settings = Settings::Instance();
+  std::shared_ptr<const Settings::StyleSnapshot> styles = settings.GetStyleSnapshot();
   
-  QRgb editorBackgroundColor = settings.GetConfiguredColor(Settings::Color::EditorBackground);
+  QRgb editorBackgroundColor = styles->GetColor(Settings::Color::EditorBackground);
   QColor sidebarDefaultColor = palette().window().color();
-  QRgb highlightTrailingSpaceColor = settings.GetConfiguredColor(Settings::Color::TrailingSpaceHighlight);
-  QRgb outsideOfContextLineColor = settings.GetConfiguredColor(Settings::Color::OutsizeOfContextLine);
-  QRgb highlightLineColor = settings.GetConfiguredColor(Settings::Color::CurrentLine);
-  QRgb selectionColor = settings.GetConfiguredColor(Settings::Color::EditorSelection);
-  QRgb bookmarkColor = settings.GetConfiguredColor(Settings::Color::BookmarkLine);
-  QRgb errorUnderlineColor = settings.GetConfiguredColor(Settings::Color::ErrorUnderline);
-  QRgb warningUnderlineColor = settings.GetConfiguredColor(Settings::Color::WarningUnderline);
-  QRgb columnMarkerColor = settings.GetConfiguredColor(Settings::Color::ColumnMarker);
-  QRgb gitDiffAddedColor = settings.GetConfiguredColor(Settings::Color::GitDiffAdded);
-  QRgb gitDiffModifiedColor = settings.GetConfiguredColor(Settings::Color::GitDiffModified);
-  QRgb gitDiffRemovedColor = settings.GetConfiguredColor(Settings::Color::GitDiffRemoved);
-  const auto& defaultStyle = settings.GetConfiguredTextStyle(Settings::TextStyle::Default);
-  const auto& inlineErrorStyle = settings.GetConfiguredTextStyle(Settings::TextStyle::ErrorInlineDisplay);
-  const auto& inlineWarningStyle = settings.GetConfiguredTextStyle(Settings::TextStyle::WarningInlineDisplay);
+  QRgb highlightTrailingSpaceColor = styles->GetColor(Settings::Color::TrailingSpaceHighlight);
+  QRgb outsideOfContextLineColor = styles->GetColor(Settings::Color::OutsizeOfContextLine);
+  QRgb highlightLineColor = styles->GetColor(Settings::Color::CurrentLine);
+  QRgb selectionColor = styles->GetColor(Settings::Color::EditorSelection);
+  QRgb bookmarkColor = styles->GetColor(Settings::Color::BookmarkLine);
+  QRgb errorUnderlineColor = styles->GetColor(Settings::Color::ErrorUnderline);
+  QRgb warningUnderlineColor = styles->GetColor(Settings::Color::WarningUnderline);
+  QRgb columnMarkerColor = styles->GetColor(Settings::Color::ColumnMarker);
+  QRgb gitDiffAddedColor = styles->GetColor(Settings::Color::GitDiffAdded);
+  QRgb gitDiffModifiedColor = styles->GetColor(Settings::Color::GitDiffModified);
+  QRgb gitDiffRemovedColor = styles->GetColor(Settings::Color::GitDiffRemoved);
+  const auto& defaultStyle = styles->GetTextStyle(Settings::TextStyle::Default);
+  const auto& inlineErrorStyle = styles->GetTextStyle(Settings::TextStyle::ErrorInlineDisplay);
+  const auto& inlineWarningStyle = styles->GetTextStyle(Settings::TextStyle::WarningInlineDisplay);
   
   bool highlightCurrentLine = settings.GetHighlightCurrentLine();
   bool highlightTrailingSpaces = settings.GetHighlightTrailingSpaces();
   bool darkenNonContextRegions = settings.GetDarkenNonContextRegions();
   bool showColumnMarker = settings.GetShowColumnMarker();
+  UpdateSidebarWidth();
   int columnMarkerX = -1;
   if (showColumnMarker) {
     columnMarkerX = -xScroll + sidebarWidth + charWidth * settings.GetColumnMarkerPosition();
@@ -2609,6 +3439,8 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
   // Re-layout?
   CheckRelayout();
   
+  ++ paintCounter;
+  
   // Always "re-layout" the fix-it buttons
   // Note: Since we may erase elements here, we cannot cache the end() of the vector.
   fixitButtonsDocumentVersion = document->version();
@@ -2632,19 +3464,21 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
   const std::vector<LineDiff>& diffLines = document->diffLines();
   int currentDiffLine = 0;
   
+  // Get the blame lines for the git blame gutter
+  bool showGitBlame = sidebarWidth > kGitDiffMarkerWidth;
+  int gitBlameGutterWidth = sidebarWidth - kGitDiffMarkerWidth;
+  QRgb gitBlameTextColor = styles->GetColor(Settings::Color::GitBlameText);
+  const std::vector<LineBlame>& blameLines = document->blameLines();
+  int currentBlameLine = 0;
+  
   // Start painting
   QPainter painter(this);
   QRect rect = event->rect();
   painter.setClipRect(rect);
   
-  // Start problem range handling
-  const std::set<ProblemRange>& problemRanges = document->problemRanges();
-  auto problemRangeIt = problemRanges.begin();
-  int lastProblem = -1;
-  int warningRangeEnd = -1;
-  int errorRangeEnd = -1;
-  
-  // Draw lines
+  // Draw lines. The visible characters of each line are collected in
+  // paintedCharacters first, such that they can be drawn in runs.
+  std::vector<PaintedCharacter> paintedCharacters;
   int minLine = (yScroll + rect.top()) / lineHeight;
   int maxLine = std::min<int>(static_cast<int>(layoutLines.size()) - 1, (yScroll + rect.bottom()) / lineHeight);
   
@@ -2661,19 +3495,19 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
     int xCoord = -xScroll + sidebarWidth;
     
     // Note that the iterator will be invalid if the last character in the document is a newline character
-    Document::CharacterAndStyleIterator it = lineIt.GetCharacterAndStyleIterator();
+    Document::StyleRunIterator runIt(document.get(), lineIt.GetLineStart().offset);
     int lineAttributes = lineIt.GetAttributes();
     
     // Get the line text
     QString text;
-    Document::CharacterIterator charIt = it.ToCharacterIterator();
-    while (charIt.IsValid()) {
-      QChar c = charIt.GetChar();
-      if (c == '\n') {
+    for (Document::StyleRunIterator textIt = runIt; textIt.IsValid(); ++ textIt) {
+      const QChar* runText = textIt.GetText();
+      int runSize = textIt.GetSize();
+      int lineSize = std::find(runText, runText + runSize, QChar('\n')) - runText;
+      text.append(runText, lineSize);
+      if (lineSize < runSize) {
         break;
       }
-      text += c;
-      ++ charIt;
     }
     
     // Check whether the line is empty or there is trailing whitespace at the end
@@ -2731,7 +3565,7 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
       blue += qBlue(highlightLineColor);
       ++ bgColorCount;
     }
-    if (darkenNonContextRegions && isCFile && !withinAnyContext && lineIsEmptyOrOnlyWhitespace) {
+    if (darkenNonContextRegions && isCFile && !largeFileMode && !withinAnyContext && lineIsEmptyOrOnlyWhitespace) {
       red += qRed(outsideOfContextLineColor);
       green += qGreen(outsideOfContextLineColor);
       blue += qBlue(outsideOfContextLineColor);
@@ -2748,93 +3582,95 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
     QColor styleBackgroundColor;
     bool haveStyleBackgroundColor = false;
     
+    // Get the problem ranges within the line
+    const ProblemLineSpan* problemSpanIt;
+    const ProblemLineSpan* problemSpansEnd;
+    document->GetProblemLineSpans(line, &problemSpanIt, &problemSpansEnd);
+    int lastProblem = -1;
+    int warningRangeEnd = -1;
+    int errorRangeEnd = -1;
     int lastProblemInLine = -1;
     
+    QColor textColor;
+    bool bold = false;
+    
+    // The style is updated when the characters reach the end of the current
+    // style run. -1 makes the first character apply the style of its run.
+    int styleRunEnd = -1;
+    
+    paintedCharacters.clear();
     int column = 0;
-    for (int c = 0; c < text.size(); ++ c, ++ it) {
+    for (int c = 0; c < text.size(); ++ c) {
       int characterOffset = layoutLines[line].start.offset + c;
       
       // Handle underlining
-      while (problemRangeIt != document->problemRanges().end()) {
-        if (characterOffset >= problemRangeIt->range.start.offset) {
-          if (document->problems()[problemRangeIt->problemIndex]->type() == Problem::Type::Warning) {
-            warningRangeEnd = std::max(warningRangeEnd, problemRangeIt->range.end.offset);
-          } else {  // if (document->problems[problemRangeIt->problemIndex].type == Problem::Type::Error) {
-            errorRangeEnd = std::max(errorRangeEnd, problemRangeIt->range.end.offset);
-          }
-          lastProblem = problemRangeIt->problemIndex;
-          ++ problemRangeIt;
+      while (problemSpanIt != problemSpansEnd && characterOffset >= problemSpanIt->start) {
+        if (problemSpanIt->isError) {
+          errorRangeEnd = std::max(errorRangeEnd, problemSpanIt->end);
         } else {
-          break;
+          warningRangeEnd = std::max(warningRangeEnd, problemSpanIt->end);
         }
+        lastProblem = problemSpanIt->problemIndex;
+        ++ problemSpanIt;
       }
       
       // Handle style changes due to highlight range boundaries
-      if (it.StyleChanged()) {
-        const HighlightRange& style = it.GetStyle();
-        if (style.bold) {
-          painter.setFont(Settings::Instance().GetBoldFont());
-        } else {
-          painter.setFont(Settings::Instance().GetDefaultFont());
+      if (characterOffset >= styleRunEnd) {
+        while (runIt.GetRunEnd() <= characterOffset) {
+          ++ runIt;
         }
-        painter.setPen(QPen(style.textColor));
+        styleRunEnd = runIt.GetRunEnd();
+        
+        const HighlightStyle& style = runIt.GetStyle();
+        bold = style.bold;
+        textColor = style.textColor;
         
         haveStyleBackgroundColor = style.affectsBackground;
         styleBackgroundColor = style.backgroundColor;
       }
       
-      // Draw the character
+      // Determine how to draw the character
       int charColumns;
       int charWidth = GetTextWidth(text.at(c), column, &charColumns);
       column += charColumns;
       if (xCoord + charWidth - 1 >= 0 && xCoord < width()) {
-        // Draw background color (based on line background color and highlighting)
-        QColor backgroundColor;
+        paintedCharacters.emplace_back();
+        PaintedCharacter& painted = paintedCharacters.back();
+        painted.index = c;
+        painted.x = xCoord;
+        painted.width = charWidth;
+        painted.textColor = textColor;
+        painted.bold = bold;
+        painted.canBeDrawnInRun =
+            charColumns == 1 && charWidth == this->charWidth &&
+            text.at(c).unicode() >= 0x20 && text.at(c).unicode() < 0x7f;
+        
+        // Determine the background color (based on line background color and highlighting)
         if (selection.ContainsCharacter(layoutLines[line].start.offset + c)) {
-          backgroundColor = selectionColor;
+          painted.backgroundColor = selectionColor;
         } else if (c >= highlightTrailingSpaceStart && (line != cursorLine || cursorCol <= c)) {
-          backgroundColor = highlightTrailingSpaceColor;
+          painted.backgroundColor = highlightTrailingSpaceColor;
         } else if (haveStyleBackgroundColor) {
-          backgroundColor = styleBackgroundColor;
+          painted.backgroundColor = styleBackgroundColor;
         } else {
-          backgroundColor = lineBackgroundColor;
-        }
-        painter.fillRect(xCoord, currentY, charWidth, lineHeight, backgroundColor);
-        if (showColumnMarker && columnMarkerX >= xCoord && columnMarkerX < xCoord + charWidth) {
-          QColor oldColor = painter.pen().color();
-          painter.setPen(columnMarkerColor);
-          painter.drawLine(columnMarkerX, currentY, columnMarkerX, currentY + lineHeight - 1);
-          painter.setPen(oldColor);
-        }
-        if (currentFrameInFile && mainWindow->GetCurrentFrameLine() == line) {
-          QColor oldColor = painter.pen().color();
-          painter.setPen(backgroundColor.darker(200));
-          painter.drawLine(xCoord, currentY, xCoord + charWidth, currentY);
-          painter.drawLine(xCoord, currentY + lineHeight - 1, xCoord + charWidth, currentY + lineHeight - 1);
-          painter.setPen(oldColor);
-        }
-        
-        // Draw text character
-        if (text.at(c) != ' ') {
-          painter.drawText(QRect(xCoord, currentY, charWidth, lineHeight), Qt::AlignLeft | Qt::AlignTop | Qt::TextSingleLine, text.at(c));
+          painted.backgroundColor = lineBackgroundColor;
         }
         
-        // Draw underlining
-        if (errorRangeEnd > characterOffset || warningRangeEnd > characterOffset) {
+        // Determine the underlining
+        painted.underlined = errorRangeEnd > characterOffset || warningRangeEnd > characterOffset;
+        if (painted.underlined) {
           lastProblemInLine = lastProblem;
-          
-          QColor color = (errorRangeEnd > characterOffset) ? errorUnderlineColor : warningUnderlineColor;
-          
-          QPen oldPen = painter.pen();
-          painter.setPen(color);
-          // TODO: Maybe use drawRect() for high-DPI screens?
-          painter.drawLine(xCoord, currentY + fontMetrics->ascent(), xCoord + charWidth, currentY + fontMetrics->ascent());
-          painter.setPen(oldPen);
+          painted.underlineColor = (errorRangeEnd > characterOffset) ? errorUnderlineColor : warningUnderlineColor;
         }
       }
       xCoord += charWidth;
     }
     
+    PaintCharactersCached(
+        &painter, text, &paintedCharacters, currentY,
+        currentFrameInFile && mainWindow->GetCurrentFrameLine() == line,
+        showColumnMarker ? columnMarkerX : -1, columnMarkerColor);
+    
     // Draw line background color to the right of the text
     if (xCoord <= rect.right()) {
       QColor backgroundColor = selection.ContainsCharacter(layoutLines[line].end.offset) ? selectionColor : lineBackgroundColor;
@@ -2974,12 +3810,35 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
         qDebug() << "Unhandled diff type:" << static_cast<int>(diff.type);
       }
     }
-    painter.fillRect(0, currentY, sidebarWidth, lineHeight, sidebarColor);
+    if (showGitBlame) {
+      // Show the commit at the first line of each blamed range, and at the
+      // first painted line.
+      painter.fillRect(0, currentY, gitBlameGutterWidth, lineHeight, sidebarDefaultColor);
+      while (currentBlameLine < blameLines.size() &&
+             blameLines[currentBlameLine].line + blameLines[currentBlameLine].numLines <= line) {
+        ++ currentBlameLine;
+      }
+      if (currentBlameLine < blameLines.size() &&
+          blameLines[currentBlameLine].line <= line &&
+          (blameLines[currentBlameLine].line == line || line == minLine)) {
+        const LineBlame& blame = blameLines[currentBlameLine];
+        QString text = blame.commitId + QStringLiteral(" ") +
+                       QDateTime::fromSecsSinceEpoch(blame.time).toString(QStringLiteral("yyyy-MM-dd")) + QStringLiteral(" ") +
+                       blame.author;
+        painter.setPen(gitBlameTextColor);
+        painter.setFont(Settings::Instance().GetDefaultFont());
+        painter.drawText(QRect(charWidth / 2, currentY, gitBlameGutterWidth - charWidth, lineHeight), Qt::AlignLeft | Qt::AlignTop | Qt::TextSingleLine,
+                         fontMetrics->elidedText(text, Qt::ElideRight, gitBlameGutterWidth - charWidth));
+      }
+    }
+    
+    int diffMarkerX = sidebarWidth - kGitDiffMarkerWidth;
+    painter.fillRect(diffMarkerX, currentY, kGitDiffMarkerWidth, lineHeight, sidebarColor);
     if (drawRedDot) {
       painter.setPen(Qt::NoPen);
       painter.setBrush(QBrush(gitDiffRemovedColor));
-      int diameter = std::min(sidebarWidth, lineHeight);
-      painter.drawEllipse(0 + (sidebarWidth - diameter) / 2, currentY - diameter / 2, diameter, diameter);
+      int diameter = std::min(kGitDiffMarkerWidth, lineHeight);
+      painter.drawEllipse(diffMarkerX + (kGitDiffMarkerWidth - diameter) / 2, currentY - diameter / 2, diameter, diameter);
     }
     if (line == static_cast<int>(layoutLines.size()) - 1 &&
         currentDiffLine < diffLines.size() &&
@@ -2987,8 +3846,8 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
         diffLines[currentDiffLine].type == LineDiff::Type::Removed) {
       painter.setPen(Qt::NoPen);
       painter.setBrush(QBrush(gitDiffRemovedColor));
-      int diameter = std::min(sidebarWidth, lineHeight);
-      painter.drawEllipse(0 + (sidebarWidth - diameter) / 2, currentY + lineHeight - diameter / 2, diameter, diameter);
+      int diameter = std::min(kGitDiffMarkerWidth, lineHeight);
+      painter.drawEllipse(diffMarkerX + (kGitDiffMarkerWidth - diameter) / 2, currentY + lineHeight - diameter / 2, diameter, diameter);
     }
     
     currentY += lineHeight;
@@ -3005,6 +3864,41 @@ void DocumentWidget::paintEvent(QPaintEvent* event) {
   painter.fillRect(rect.left(), currentY, rect.right() + 1, rect.bottom() + 1 - currentY, Qt::gray);
   
   painter.end();
+  
+  // If there are too many line rasters, evict the least recently used ones
+  if (lineRasterCache.size() > 2 * kMaxCachedLineRasters) {
+    EvictLineRasters(kMaxCachedLineRasters);
+  }
+  
+  // If the widget has just been shown, do the remaining work for that now
+  // that its first frame has been painted.
+  if (activationPending) {
+    activationPending = false;
+    QTimer::singleShot(0, this, &DocumentWidget::Activate);
+  }
+}
+
+void DocumentWidget::EvictLineRasters(int maxCount) {
+  maxCount = std::max(1, maxCount);
+  if (lineRasterCache.size() <= maxCount) {
+    return;
+  }
+  
+  std::vector<int> lastUsedPaints;
+  lastUsedPaints.reserve(lineRasterCache.size());
+  for (const auto& item : lineRasterCache) {
+    lastUsedPaints.push_back(item.second.lastUsedPaint);
+  }
+  std::nth_element(lastUsedPaints.begin(), lastUsedPaints.end() - maxCount, lastUsedPaints.end());
+  int oldestKeptPaint = std::min(paintCounter, *(lastUsedPaints.end() - maxCount));
+  
+  for (auto it = lineRasterCache.begin(); it != lineRasterCache.end(); ) {
+    if (it->second.lastUsedPaint < oldestKeptPaint) {
+      it = lineRasterCache.erase(it);
+    } else {
+      ++ it;
+    }
+  }
 }
 
 void DocumentWidget::mousePressEvent(QMouseEvent* event) {
@@ -3110,6 +4004,14 @@ bool DocumentWidget::event(QEvent* event) {
 }
 
 void DocumentWidget::keyPressEvent(QKeyEvent* event) {
+  // Give the CPU to the user while typing
+  CPUBudget::Instance().NotifyUserActivity();
+  
+  // Defer the catch-up reparse until the user is idle
+  if (TUCatchUpTimer->isActive()) {
+    TUCatchUpTimer->start(kTUCatchUpIdleDelayMs);
+  }
+  
   // Make any keypress close the mouse-over tooltip
   CloseTooltip();
   mouseHoverTimer.stop();
@@ -3376,6 +4278,14 @@ void DocumentWidget::keyPressEvent(QKeyEvent* event) {
           InvokeCodeCompletion();
         }
       }
+      
+      // If code completion has not been invoked after a member access token
+      // (for example, for "::" since the first ':' closes the completion),
+      // prefetch its results such that they are ready once the user starts
+      // typing the member name.
+      if (!(codeCompletionWidget || codeCompletionInvocationLocation.IsValid())) {
+        CheckForCodeCompletionPrefetch();
+      }
     }
   }
 }
@@ -3424,8 +4334,38 @@ void DocumentWidget::focusOutEvent(QFocusEvent* /*event*/) {
 }
 
 void DocumentWidget::showEvent(QShowEvent* /*event*/) {
+  // The layout, minimap, and line rasters are kept while the widget is
+  // hidden, so it can be painted right away. Defer the remaining work until
+  // after that.
+  activationPending = true;
+  update(rect());
+}
+
+void DocumentWidget::Activate() {
+  if (!isVisible()) {
+    return;
+  }
+  
+  // Do the deferred initial parse and diff of a restored background tab.
+  if (parseDeferredUntilActivation) {
+    parseDeferredUntilActivation = false;
+    ParseFile();
+    return;
+  }
+  
+  // If the document's TUs have been disposed to save memory while it was in
+  // the background, or it was parsed with the reduced options for background
+  // documents, parse it again.
+  if (isCFile && !largeFileMode) {
+    ClangTUPool* TUPool = document->GetTUPool();
+    TUPool->MarkAsUsed();
+    if (TUPool->AllTUsEvicted() || TUPool->LastParseUsedReducedProfile()) {
+      reparseOnNextActivation = true;
+    }
+  }
+  
   if (reparseOnNextActivation) {
-    if (isCFile) {
+    if (isCFile && !largeFileMode) {
       ParseThreadPool::Instance().RequestParse(document, this, mainWindow);
     }
     reparseOnNextActivation = false;
@@ -3434,4 +4374,10 @@ void DocumentWidget::showEvent(QShowEvent* /*event*/) {
 
 void DocumentWidget::hideEvent(QHideEvent* /*event*/) {
   CloseAllPopups();
+  
+  // While hidden, keep only about a screenful of line rasters, which is what
+  // the first paint after showing the widget again needs.
+  int firstLine, lastLine;
+  GetVisibleLines(&firstLine, &lastLine);
+  EvictLineRasters(lastLine - firstLine + 1);
 }
@@ -5,8 +5,12 @@
 #pragma once
 
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
+#include <QElapsedTimer>
 #include <QFrame>
+#include <QPixmap>
 #include <QTimer>
 #include <QWidget>
 
@@ -15,12 +19,14 @@
 #include "cide/document.h"
 #include "cide/document_location.h"
 #include "cide/document_range.h"
+#include "cide/lexical_highlighter.h"
 #include "cide/qt_help.h"
 
 class DocumentWidgetContainer;
 class MainWindow;
 class Problem;
 class QLabel;
+class QPainter;
 class QScrollArea;
 struct WordCompletion;
 
@@ -49,8 +55,14 @@ class DocumentWidget : public QWidget {
   /// to the inserted text.
   void Replace(const DocumentRange& range, const QString& newText, bool createUndoStep = true, Replacement* undoReplacement = nullptr);
   
-  /// Replaces all occurrences of @p find with @p replacement.
-  void ReplaceAll(const QString& find, const QString& replacement, bool matchCase, bool inSelectionOnly);
+  /// Performs multiple replacements at once with Document::ReplaceMany() and
+  /// adapts the cursor and selection to them.
+  void ReplaceMany(const std::vector<Replacement>& replacements, bool createUndoStep = true);
+  
+  /// Replaces all occurrences of @p find with @p replacement. If @p useRegex
+  /// is true, @p find is a regular expression (see TextRegex), and all of its
+  /// matches are replaced.
+  void ReplaceAll(const QString& find, const QString& replacement, bool matchCase, bool inSelectionOnly, bool useRegex = false);
   
   /// Inserts the given text into the document (as if typed). This will replace
   /// the current selection (if any) with the text, respectively insert it at
@@ -115,6 +127,13 @@ class DocumentWidget : public QWidget {
   /// thread finishes.
   void ShowCodeCompletion(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults);
   
+  /// Called by the code completion thread with the results of a request made by
+  /// CodeInfo::PrefetchCodeCompletion(). Keeps them for reuse by the next code
+  /// completion at the same location, unless the text has been edited outside
+  /// of the identifier after the location in the meantime. If code completion
+  /// has been invoked at this location in the meantime, the results are shown.
+  void SetPrefetchedCodeCompletion(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, CXCodeCompleteResults* libclangResults, std::vector<ArgumentHintItem>&& hints, int currentParameter);
+  
   /// This is called by the CodeInfo class if it discards a code completion request
   /// after it was initially made successfully. This happens when a higher-priority
   /// request is made afterwards, before the code completion request was handled.
@@ -137,6 +156,26 @@ class DocumentWidget : public QWidget {
   /// their results, showing them as a tooltip.
   void SetCodeTooltip(const DocumentRange& tooltipRange, const QString& codeHtml, const QUrl& helpUrl, const std::vector<DocumentRange>& referenceRanges);
   
+  /// Called in the Qt thread after the document of this widget was parsed,
+  /// with the duration of the parse. StartParseTimer() derives the parse delay
+  /// from the recent parse durations.
+  void ReportParseDuration(double durationMs);
+  
+  /// Parses the document if reparsing was postponed since only comments or
+  /// whitespace changed since the last parse (see StartParseTimer()). Called
+  /// on saving and before code info requests, which require an up-to-date TU.
+  void ReparseIfPostponed();
+  
+  /// Requests CodeInfo::PrefetchHoverInfo() for the identifiers in the visible
+  /// lines. Called after each parse of the document.
+  void PrefetchHoverInfo();
+  
+  /// Requests CodeInfo::RequestTUCatchUp() once the user has been idle for a
+  /// while, such that the stale TU of the document's pool is reparsed before
+  /// it is needed. Called after each parse of the document; edits cancel the
+  /// request and key presses defer it.
+  void ScheduleTUCatchUp();
+  
   inline int GetMaxYScroll() const { return (static_cast<int>(layoutLines.size()) - 1) * lineHeight; }
   
   inline int GetCodeCompletionInvocationCounter() const { return codeCompletionInvocationCounter; }
@@ -173,24 +212,65 @@ class DocumentWidget : public QWidget {
   void FixAll();
   
   void CheckFileType();
+  
+  /// Enables large-file mode (see IsLargeFileMode()) if the document with
+  /// @p lineCount lines exceeds the thresholds.
+  void CheckLargeFileMode(int lineCount);
+  
   void StartParseTimer();
   void ParseFile();
   void SetReparseOnNextActivation();
+  
+  /// Defers parsing and diffing the document until the widget is shown for
+  /// the first time. Used for restoring background tabs of a session.
+  void DeferParseUntilActivation();
+  
+  /// Returns whether the document has not been parsed yet since parsing is
+  /// deferred until the widget is shown (see DeferParseUntilActivation()).
+  inline bool IsParseDeferred() const { return parseDeferredUntilActivation; }
+  
+  /// Returns whether the document exceeds the large-file thresholds in the
+  /// settings. In this mode, the document is not parsed with libclang (only
+  /// lexically highlighted), the git diff is only computed on request (see
+  /// UpdateGitDiff()), the line widths are estimated from the character
+  /// counts, and the minimap only renders a sample of the lines.
+  inline bool IsLargeFileMode() const { return largeFileMode; }
+  
+  /// Requests an update of the git diff of the document.
+  void UpdateGitDiff();
+  
   void InvokeCodeCompletion();
   void AcceptCodeCompletion();
+  void CodeCompletionFilterApplied();
   
   /// Checks whether the current selection is on a word or phrase, and if so,
   /// highlights all occurrences of this word/phrase in the document.
   void CheckPhraseHighlight();
-  /// Requests to highlight all occurrences of phrase. Might be performed in a
-  /// background thread and added asynchronously.
+  /// Requests to highlight all occurrences of phrase. This is performed in a
+  /// background thread by PhraseHighlighter, and the highlights are added
+  /// asynchronously.
   void RequestPhraseHighlight(const QString& phrase);
   
+  /// Returns a counter that is increased with each phrase highlight request
+  /// and each call to RemoveHighlights(). PhraseHighlighter only applies its
+  /// results if the counter did not change in the meantime.
+  inline int GetPhraseHighlightRequestCounter() const { return phraseHighlightRequestCounter; }
+  
+  /// Highlights the given occurrences of the selected phrase (if there are at
+  /// least two of them, since one is the selection itself).
+  void AddPhraseHighlights(const std::vector<DocumentRange>& occurrences);
+  
   void CheckBracketHighlight();
   
   void RemoveHighlights();
   
-  void HighlightingChanged();
+  /// Redraws the lines in @p changedRange and updates the minimap, see
+  /// Document::HighlightingChanged().
+  void HighlightingChanged(const DocumentRange& changedRange);
+  
+  /// Adapts the layout to a replacement in the document (see
+  /// Document::TextReplaced()) by re-computing only the affected lines.
+  void TextReplaced(const DocumentRange& oldRange, int newTextSize, int textChangeCounter);
   
   void MoveCursorLeft(bool shiftHeld, bool controlHeld);  // called when the left arrow key is pressed
   void MoveCursorRight(bool shiftHeld, bool controlHeld);  // called when the right arrow key is pressed
@@ -213,6 +293,10 @@ class DocumentWidget : public QWidget {
   /// Returns the vertical scroll value (yScroll).
   inline int GetYScroll() const { return yScroll; }
   
+  /// Returns the range of (0-based) lines that is currently visible, given by
+  /// the first visible line and the last visible line (inclusive).
+  void GetVisibleLines(int* firstLine, int* lastLine) const;
+  
   inline int GetLineHeight() const { return lineHeight; }
   inline int GetCharWidth() const { return charWidth; }
   
@@ -234,10 +318,65 @@ class DocumentWidget : public QWidget {
     QRect buttonRect;
   };
   
+  /// A visible character of a line, as determined by paintEvent() before
+  /// drawing the line. Adjacent cells with equal properties are drawn together.
+  struct PaintedCharacter {
+    /// Index of the character in the line text.
+    int index;
+    
+    int x;
+    int width;
+    
+    QColor backgroundColor;
+    QColor textColor;
+    bool bold;
+    
+    /// Whether the character may be drawn as part of a run of characters,
+    /// which requires it to take up exactly one regular character cell.
+    bool canBeDrawnInRun;
+    
+    /// Whether the character is underlined with @a underlineColor.
+    bool underlined;
+    QRgb underlineColor;
+    
+    inline bool operator== (const PaintedCharacter& other) const {
+      return index == other.index &&
+             x == other.x &&
+             width == other.width &&
+             backgroundColor == other.backgroundColor &&
+             textColor == other.textColor &&
+             bold == other.bold &&
+             canBeDrawnInRun == other.canBeDrawnInRun &&
+             underlined == other.underlined &&
+             (!underlined || underlineColor == other.underlineColor);
+    }
+  };
+  
+  /// A cached rendering of the characters of a line, see PaintCharactersCached().
+  struct LineRaster {
+    // The parameters of PaintCharacters() that the pixmap was rendered with.
+    // The x coordinates of the characters are relative to the pixmap.
+    QString text;
+    std::vector<PaintedCharacter> characters;
+    bool drawFrameLines;
+    int columnMarkerX;
+    QRgb columnMarkerColor;
+    qreal devicePixelRatio;
+    
+    QPixmap pixmap;
+    
+    /// Value of paintCounter in the last paintEvent() that used this raster.
+    int lastUsedPaint;
+  };
+  
   /// Checks whether the layout needs to be re-computed and does that in this case.
   /// Returns true if the layout has been re-computed, false otherwise.
   bool CheckRelayout();
   
+  /// Updates sidebarWidth according to the font and to whether the git blame
+  /// gutter is shown.
+  void UpdateSidebarWidth();
+  
   /// Returns the area taken up by the insertion cursor in widget coordinates
   /// (i.e., accounting for the current scroll position).
   QRect GetCursorRect();
@@ -247,6 +386,38 @@ class DocumentWidget : public QWidget {
   
   QRect GetLineRect(int line);
   
+  /// Draws the given characters of a line with the text @p text at the
+  /// vertical position @p y, merging adjacent characters with equal
+  /// backgrounds, styles, and underlines into single drawing operations. If
+  /// @p drawFrameLines is true, the line is marked as the current debugger
+  /// frame. The column marker is drawn at @p columnMarkerX if it is not -1.
+  void PaintCharacters(QPainter* painter, const QString& text, const std::vector<PaintedCharacter>& characters, int y, bool drawFrameLines, int columnMarkerX, QRgb columnMarkerColor);
+  
+  /// Version of PaintCharacters() that renders the characters into a pixmap
+  /// once and then draws them from lineRasterCache as long as all parameters
+  /// (except for the position) stay the same. This way, lines that only moved
+  /// (by scrolling) or that are repainted for other reasons (for example, for
+  /// the cursor blinking) are not rendered again. Modifies the x coordinates in
+  /// @p characters.
+  void PaintCharactersCached(QPainter* painter, const QString& text, std::vector<PaintedCharacter>* characters, int y, bool drawFrameLines, int columnMarkerX, QRgb columnMarkerColor);
+  
+  /// Evicts the least recently used rasters from lineRasterCache such that at
+  /// most @p maxCount remain, keeping those that were used in the last paint
+  /// event in any case.
+  void EvictLineRasters(int maxCount);
+  
+  /// Repaints the widget after the vertical scroll position changed by
+  /// @p dy pixels (positive if the content moved down). If possible, the
+  /// already painted content is moved instead of being repainted, such that
+  /// only the newly exposed lines are painted.
+  void RepaintScrolledContent(int dy);
+  
+  /// Performs the work that is due when the widget is shown (for example,
+  /// after switching tabs), such as a deferred parse. This is called after the
+  /// first paint event following showEvent(), such that the tab appears
+  /// without waiting for it.
+  void Activate();
+  
   /// Returns the text width as displayed in the widget (this allows to account
   /// for different tab size settings).
   int GetTextWidth(const QString& text, int startColumn, int* numColumns);
@@ -292,6 +463,42 @@ class DocumentWidget : public QWidget {
   
   void BookmarksChanged();
   
+  /// Opens the code completion widget with the given items (closing the
+  /// previous one, if any).
+  void OpenCodeCompletionWidget(DocumentLocation invocationLocation, std::vector<CompletionItem>&& items, const std::shared_ptr<CXCodeCompleteResults>& libclangResults);
+  
+  /// If the results of the last code completion can be reused for completion
+  /// at the current cursor position, shows them and returns true. Otherwise,
+  /// returns false.
+  bool ReuseCodeCompletion();
+  
+  /// Discards the results of the last code completion such that they are not
+  /// reused.
+  void ClearReusableCodeCompletion();
+  
+  /// Sets reusableCallSiteLocation for the reusable argument hint items (if
+  /// any) and reusableCodeCompletionLocation.
+  void UpdateReusableCallSite();
+  
+  /// If @p location is within the argument list of a function call, returns
+  /// the location directly after the opening parenthesis of the call, and the
+  /// index of the argument that contains @p location in @p parameterIndex.
+  /// Otherwise, returns an invalid location. Like UpdateArgumentHintWidget(),
+  /// this counts the commas (outside of non-code ranges) rather than parsing
+  /// the arguments.
+  DocumentLocation FindCallSiteStart(const DocumentLocation& location, int* parameterIndex);
+  
+  /// If the text before the cursor ends with a member access token ("." "->"
+  /// or "::"), prefetches the code completion results for the member name that
+  /// is likely typed next.
+  void CheckForCodeCompletionPrefetch();
+  
+  /// Returns whether the replacement of @p oldRange with @p newTextSize
+  /// characters was only within the identifier that directly follows
+  /// @p location (i.e., that all characters from @p location up to the end of
+  /// the new text are identifier characters).
+  bool IsReplacementWithinIdentifierAt(const DocumentLocation& location, const DocumentRange& oldRange, int newTextSize);
+  
   void CheckForWordCompletion();
   /// Tries to determine whether the cursor is likely in a 'code' section rather
   /// than within a comment or a string. This is checked heuristically and may be wrong.
@@ -327,11 +534,29 @@ class DocumentWidget : public QWidget {
   /// Cursor column.
   int cursorCol = 0;
   
-  // Document layout.
+  // Document layout. layoutLines and layoutLineWidths are adapted in
+  // TextReplaced() on each edit. They are only re-computed completely by
+  // CheckRelayout() if haveLayout is false or a change was missed.
   bool haveLayout = false;
-  int layoutVersion;
+  /// Document::textChangeCounter() that layoutLines corresponds to.
+  int layoutLinesTextChangeCounter;
+  /// Document::textChangeCounter() at the last CheckRelayout() that returned
+  /// true (i.e., that updated the scrollbar, minimap, and crash backup).
+  int layoutTextChangeCounter;
   std::vector<DocumentRange> layoutLines;
+  /// Text width of each line in layoutLines.
+  std::vector<int> layoutLineWidths;
   int maxTextWidth = 0;
+  /// Set if a line which might have had the maximum width was changed or
+  /// removed, such that maxTextWidth must be re-computed from layoutLineWidths.
+  bool maxTextWidthDirty = false;
+  
+  /// Cache of rendered lines, indexed by a hash of their LineRaster
+  /// parameters. See PaintCharactersCached().
+  std::unordered_map<std::size_t, LineRaster> lineRasterCache;
+  /// Counter that is increased by each paintEvent(), used for evicting the
+  /// line rasters that were not used recently.
+  int paintCounter = 0;
   
   // Icons for inline problem display.
   QImage warningIcon;
@@ -381,6 +606,26 @@ class DocumentWidget : public QWidget {
   /// Counter that can be used by the completion thread to identify cases where
   /// its completion results are outdated.
   int codeCompletionInvocationCounter = 0;
+  /// Whether to close the code completion widget if its current filter text
+  /// results in a single exact match once the filter has been applied.
+  bool closeCodeCompletionOnSingleExactMatch = false;
+  /// The results of the last code completion. They are reused if code
+  /// completion is invoked at the same location again while the text has only
+  /// been edited within the identifier that follows this location (see
+  /// TextReplaced()). reusableCodeCompletionItems holds the items as they were
+  /// created, i.e., before they were scored for any filter text.
+  DocumentLocation reusableCodeCompletionLocation = DocumentLocation::Invalid();
+  std::vector<CompletionItem> reusableCodeCompletionItems;
+  std::shared_ptr<CXCodeCompleteResults> reusableCodeCompletionResults;
+  std::vector<ArgumentHintItem> reusableArgumentHintItems;
+  int reusableArgumentHintCurrentParameter = -1;
+  /// If the reusable results contain argument hints, the location directly
+  /// after the opening parenthesis of their call. The results are also reused
+  /// for other invocations within the argument list of this call, see
+  /// ReuseCodeCompletion(). Otherwise, this is invalid.
+  DocumentLocation reusableCallSiteLocation = DocumentLocation::Invalid();
+  /// Invocation location of the pending code completion prefetch, or invalid.
+  DocumentLocation codeCompletionPrefetchLocation = DocumentLocation::Invalid();
   
   // Argument hint.
   ArgumentHintWidget* argumentHintWidget = nullptr;
@@ -397,7 +642,10 @@ class DocumentWidget : public QWidget {
   
   // Settings. TODO: Make configurable.
   bool intelligentHomeAndEnd = true;
-  const int sidebarWidth = 5;
+  
+  /// Width of the sidebar left of the text, which consists of the git blame
+  /// gutter (if shown) and the git diff markers. See UpdateSidebarWidth().
+  int sidebarWidth = 0;
   
   bool movingCursor = false;
   DocumentLocation movingCursorOldLocation;
@@ -407,6 +655,9 @@ class DocumentWidget : public QWidget {
   DocumentLocation preSelectionCursor;
   int selectionDoubleClickOffset;
   
+  /// See GetPhraseHighlightRequestCounter().
+  int phraseHighlightRequestCounter = 0;
+  
   bool cursorBlinkState = true;
   QTimer* cursorBlinkTimer;
   int cursorBlinkInterval = 500;
@@ -415,7 +666,38 @@ class DocumentWidget : public QWidget {
   
   bool isCFile = false;
   QTimer* parseTimer;
+  QTimer* TUCatchUpTimer;
+  
+  /// See IsLargeFileMode(). Once enabled, the mode stays enabled.
+  bool largeFileMode = false;
   bool reparseOnNextActivation = false;
+  bool parseDeferredUntilActivation = false;
+  /// Set by showEvent(), such that the next paintEvent() schedules Activate().
+  bool activationPending = false;
+  
+  /// Moving averages of the recent parse durations and of the intervals
+  /// between the changes of the document (-1 if unknown), used to adapt the
+  /// parse delay to the cost of parsing and to the typing cadence.
+  double averageParseDurationMs = -1;
+  double averageChangeIntervalMs = -1;
+  int numReportedParses = 0;
+  QElapsedTimer lastChangeTimer;
+  
+  /// Started with the first change that is not being parsed yet, limiting
+  /// how long consecutive changes may postpone the parse.
+  QElapsedTimer firstUnparsedChangeTimer;
+  
+  /// Value of Document::textChangeCounter() when the document was last
+  /// requested to be parsed (-1 if never), and whether a reparse for later
+  /// changes has been postponed since they did not affect the code.
+  int parsedTextChangeCounter = -1;
+  bool reparsePostponed = false;
+  
+  /// Colors the document until the first parse finished, see
+  /// LexicalHighlighter. Edited lines are lexed again with a zero-delay timer,
+  /// such that all replacements of an edit are processed at once.
+  LexicalHighlighter lexicalHighlighter;
+  QTimer* lexicalHighlightTimer;
   
   QTimer mouseHoverTimer;
   QPoint mouseHoverPosGlobal;
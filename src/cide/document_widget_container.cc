@@ -51,7 +51,8 @@ DocumentWidgetContainer::DocumentWidgetContainer(const std::shared_ptr<Document>
   static const QColor messageColors[static_cast<int>(MessageType::HighestMessageType) + 1] = {
     qRgb(255, 255, 80),
     qRgb(255, 80, 80),
-    qRgb(150, 150, 255)
+    qRgb(150, 150, 255),
+    qRgb(255, 200, 120)
   };
   mMessageLabels.resize(static_cast<int>(MessageType::HighestMessageType) + 1);
   for (int i = 0; i < mMessageLabels.size(); ++ i) {
@@ -75,6 +76,7 @@ DocumentWidgetContainer::DocumentWidgetContainer(const std::shared_ptr<Document>
   // Document widget
   mDocumentWidget = new DocumentWidget(document, this, mainWindow, this);
   connect(mDocumentWidget, &DocumentWidget::CursorMoved, this, &DocumentWidgetContainer::DocumentCursorMoved);
+  connect(mMessageLabels[static_cast<int>(MessageType::LargeFileNotification)], &QLabel::linkActivated, mDocumentWidget, &DocumentWidget::UpdateGitDiff);
   
   // Horizontal scrollbar
   scrollbar = new QScrollBar(Qt::Horizontal);
@@ -155,6 +157,10 @@ DocumentWidgetContainer::DocumentWidgetContainer(const std::shared_ptr<Document>
   connect(findMatchCase, &QCheckBox::stateChanged, this, &DocumentWidgetContainer::FindTextChanged);
   findLayout->addWidget(findMatchCase);
   
+  findRegex = new QCheckBox(tr("Regex"));
+  connect(findRegex, &QCheckBox::stateChanged, this, &DocumentWidgetContainer::FindTextChanged);
+  findLayout->addWidget(findRegex);
+  
   findReplaceLayout->addLayout(findLayout);
   
   replaceContainer = new QWidget();
@@ -204,7 +210,8 @@ DocumentWidgetContainer::DocumentWidgetContainer(const std::shared_ptr<Document>
   setTabOrder(replaceEdit, replaceButton);
   setTabOrder(replaceButton, replaceAllButton);
   setTabOrder(replaceAllButton, findMatchCase);
-  setTabOrder(findMatchCase, replaceInSelectionOnly);
+  setTabOrder(findMatchCase, findRegex);
+  setTabOrder(findRegex, replaceInSelectionOnly);
 }
 
 void DocumentWidgetContainer::SetMessage(MessageType type, const QString& message) {
@@ -325,8 +332,21 @@ void DocumentWidgetContainer::ReplaceReturnPressed(bool ctrlHeld) {
 }
 
 void DocumentWidgetContainer::Replace() {
-  Qt::CaseSensitivity caseSensitivity = findMatchCase->isChecked() ? Qt::CaseSensitive : Qt::CaseInsensitive;
-  if (mDocumentWidget->GetSelectedText().compare(findEdit->text(), caseSensitivity) == 0) {
+  bool selectionMatches;
+  if (findRegex->isChecked()) {
+    // The selection must be exactly a match of the regex.
+    TextRegex regex;
+    DocumentRange selection = mDocumentWidget->GetSelection();
+    selectionMatches = regex.Compile(findEdit->text(), findMatchCase->isChecked()) && !selection.IsEmpty();
+    if (selectionMatches) {
+      DocumentRange match = FindInDocument(selection.start, true, regex);
+      selectionMatches = match.IsValid() && match.start == selection.start && match.end == selection.end;
+    }
+  } else {
+    Qt::CaseSensitivity caseSensitivity = findMatchCase->isChecked() ? Qt::CaseSensitive : Qt::CaseInsensitive;
+    selectionMatches = mDocumentWidget->GetSelectedText().compare(findEdit->text(), caseSensitivity) == 0;
+  }
+  if (selectionMatches) {
     // The current selection contains the search string, replace it
     mDocumentWidget->InsertText(replaceEdit->text());
     findReplaceStartRange = mDocumentWidget->GetSelection();
@@ -336,7 +356,7 @@ void DocumentWidgetContainer::Replace() {
 }
 
 void DocumentWidgetContainer::ReplaceAll() {
-  mDocumentWidget->ReplaceAll(findEdit->text(), replaceEdit->text(), findMatchCase->isChecked(), replaceInSelectionOnly->isChecked());
+  mDocumentWidget->ReplaceAll(findEdit->text(), replaceEdit->text(), findMatchCase->isChecked(), replaceInSelectionOnly->isChecked(), findRegex->isChecked());
 }
 
 void DocumentWidgetContainer::DocumentCursorMoved() {
@@ -380,25 +400,30 @@ void DocumentWidgetContainer::FindImpl(bool startFromSelection, bool forwards, b
   
   DocumentRange startRange = startFromSelection ? mDocumentWidget->GetSelection() : findReplaceStartRange;
   
-  DocumentLocation result;
-  if (forwards) {
-    result = mDocumentWidget->GetDocument()->Find(findText, startRange.end, true, findMatchCase->isChecked());
+  TextRegex regex;
+  bool regexValid = !findRegex->isChecked() || regex.Compile(findText, findMatchCase->isChecked());
+  
+  DocumentRange result = DocumentRange::Invalid();
+  if (!regexValid) {
+    // Show the invalid pattern like a text that is not found.
+  } else if (forwards) {
+    result = FindInDocument(startRange.end, true, regex);
     if (result.IsInvalid()) {
       // Try again from the start of the document for wrap-around.
       // TODO: Speed this up by only searching up to startRange.end.
-      result = mDocumentWidget->GetDocument()->Find(findText, 0, true, findMatchCase->isChecked());
-      if (result.IsValid() && result >= startRange.end) {
-        result = DocumentLocation::Invalid();
+      result = FindInDocument(0, true, regex);
+      if (result.IsValid() && result.start >= startRange.end) {
+        result = DocumentRange::Invalid();
       }
     }
   } else {
-    result = mDocumentWidget->GetDocument()->Find(findText, startRange.start, false, findMatchCase->isChecked());
+    result = FindInDocument(startRange.start, false, regex);
     if (result.IsInvalid()) {
       // Try again from the end of the document for wrap-around.
       // TODO: Speed this up by only searching up to startRange.start.
-      result = mDocumentWidget->GetDocument()->Find(findText, mDocumentWidget->GetDocument()->FullDocumentRange().end, false, findMatchCase->isChecked());
-      if (result.IsValid() && result <= startRange.start) {
-        result = DocumentLocation::Invalid();
+      result = FindInDocument(mDocumentWidget->GetDocument()->FullDocumentRange().end, false, regex);
+      if (result.IsValid() && result.start <= startRange.start) {
+        result = DocumentRange::Invalid();
       }
     }
   }
@@ -419,7 +444,7 @@ void DocumentWidgetContainer::FindImpl(bool startFromSelection, bool forwards, b
   palette.setColor(QPalette::Base, Qt::white);
   findEdit->setPalette(palette);
   
-  DocumentRange foundRange = DocumentRange(result, result + findText.size());
+  DocumentRange foundRange = result;
   mDocumentWidget->SetSelection(foundRange);
   
   if (updateSearchStart) {
@@ -427,4 +452,18 @@ void DocumentWidgetContainer::FindImpl(bool startFromSelection, bool forwards, b
   }
 }
 
+DocumentRange DocumentWidgetContainer::FindInDocument(const DocumentLocation& searchStart, bool forwards, const TextRegex& regex) {
+  auto& document = mDocumentWidget->GetDocument();
+  if (findRegex->isChecked()) {
+    return document->FindRegex(regex, searchStart, forwards);
+  }
+  
+  const QString& findText = findEdit->text();
+  DocumentLocation result = document->Find(findText, searchStart, forwards, findMatchCase->isChecked());
+  if (result.IsInvalid()) {
+    return DocumentRange::Invalid();
+  }
+  return DocumentRange(result, result + findText.size());
+}
+
 #include "document_widget_container.moc"
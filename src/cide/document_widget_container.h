@@ -27,8 +27,9 @@ class DocumentWidgetContainer : public QWidget {
     ParseSettingsAreGuessedNotification = 0,
     ParseNotification = 1,
     ExternalModificationNotification = 2,
+    LargeFileNotification = 3,
     
-    HighestMessageType = ExternalModificationNotification
+    HighestMessageType = LargeFileNotification
   };
   
   DocumentWidgetContainer(const std::shared_ptr<Document>& document, MainWindow* mainWindow, QWidget* parent = nullptr);
@@ -64,6 +65,11 @@ class DocumentWidgetContainer : public QWidget {
  private:
   void FindImpl(bool startFromSelection, bool forwards, bool updateSearchStart);
   
+  /// Searches for the find text (or regular expression) in the document,
+  /// starting from @p searchStart, see Document::Find() and
+  /// Document::FindRegex(). Returns the found range, or an invalid range.
+  DocumentRange FindInDocument(const DocumentLocation& searchStart, bool forwards, const TextRegex& regex);
+  
   
   // Message labels (indexed by static_cast<int>(messageType)).
   std::vector<QLabel*> mMessageLabels;
@@ -88,6 +94,7 @@ class DocumentWidgetContainer : public QWidget {
   QPushButton* findNextButton;
   QPushButton* findPreviousButton;
   QCheckBox* findMatchCase;
+  QCheckBox* findRegex;
   DocumentRange findReplaceStartRange;
   bool doNotSearchOnTextChange = false;
   
@@ -0,0 +1,87 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+/// Fenwick tree (binary indexed tree) over a sequence of non-negative integer
+/// values. Supports changing single values, computing prefix sums, and
+/// searching for the position of a given prefix sum in O(log n). Inserting or
+/// removing values requires re-building the tree with Build(), which is O(n).
+class FenwickTree {
+ public:
+  /// Re-initializes the tree with @p size values, where the value with index i
+  /// is given by @p getValue(i).
+  template <typename GetValueFunc>
+  void Build(int size, const GetValueFunc& getValue) {
+    mTree.assign(size + 1, 0);
+    for (int i = 1; i <= size; ++ i) {
+      mTree[i] += getValue(i - 1);
+      int parent = i + (i & (-i));
+      if (parent <= size) {
+        mTree[parent] += mTree[i];
+      }
+    }
+    
+    mHighestStep = (size == 0) ? 0 : 1;
+    while (2 * mHighestStep <= size) {
+      mHighestStep *= 2;
+    }
+  }
+  
+  /// Adds @p delta to the value with the given @p index.
+  inline void Add(int index, int delta) {
+    for (int i = index + 1, treeSize = mTree.size(); i < treeSize; i += i & (-i)) {
+      mTree[i] += delta;
+    }
+  }
+  
+  /// Returns the sum of the first @p count values.
+  inline int PrefixSum(int count) const {
+    int sum = 0;
+    for (int i = count; i > 0; i -= i & (-i)) {
+      sum += mTree[i];
+    }
+    return sum;
+  }
+  
+  /// Returns the value with the given @p index.
+  inline int Value(int index) const {
+    return PrefixSum(index + 1) - PrefixSum(index);
+  }
+  
+  /// Returns the sum of all values.
+  inline int Total() const {
+    return PrefixSum(size());
+  }
+  
+  /// Returns the largest count for which PrefixSum(count) <= @p sum, and
+  /// returns this prefix sum in @p prefixSum. For sum < Total(), the returned
+  /// count is thus the index of the value which "contains" the given sum.
+  inline int FindLastPrefixAtMost(int sum, int* prefixSum) const {
+    int count = 0;
+    int countSum = 0;
+    for (int step = mHighestStep; step > 0; step /= 2) {
+      int next = count + step;
+      if (next < static_cast<int>(mTree.size()) && countSum + mTree[next] <= sum) {
+        count = next;
+        countSum += mTree[next];
+      }
+    }
+    *prefixSum = countSum;
+    return count;
+  }
+  
+  /// Returns the number of values.
+  inline int size() const { return static_cast<int>(mTree.size()) - 1; }
+  
+ private:
+  /// 1-based tree array, element 0 is unused.
+  std::vector<int> mTree = {0};
+  
+  /// Largest power of two that is less than or equal to size(), or 0 if the
+  /// tree is empty.
+  int mHighestStep = 0;
+};
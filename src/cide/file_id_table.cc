@@ -0,0 +1,51 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/file_id_table.h"
+
+#include <QDebug>
+
+FileIdTable& FileIdTable::Instance() {
+  static FileIdTable instance;
+  return instance;
+}
+
+int FileIdTable::GetOrAddId(const QString& canonicalPath) {
+  std::unique_lock<std::mutex> lock(mutex);
+  return GetOrAddIdLocked(canonicalPath);
+}
+
+int FileIdTable::GetId(const QString& canonicalPath) const {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = ids.find(canonicalPath);
+  return (it == ids.end()) ? -1 : it->second;
+}
+
+QString FileIdTable::GetPath(int id) const {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (id < 0 || id >= static_cast<int>(paths.size())) {
+    qDebug() << "Error: FileIdTable::GetPath() called with invalid ID:" << id;
+    return QString();
+  }
+  return paths[id];
+}
+
+void FileIdTable::GetPaths(const std::vector<int>& ids, std::vector<QString>* paths) const {
+  paths->reserve(paths->size() + ids.size());
+  std::unique_lock<std::mutex> lock(mutex);
+  for (int id : ids) {
+    paths->push_back(this->paths[id]);
+  }
+}
+
+int FileIdTable::GetOrAddIdLocked(const QString& canonicalPath) {
+  auto it = ids.find(canonicalPath);
+  if (it != ids.end()) {
+    return it->second;
+  }
+  int id = paths.size();
+  paths.push_back(canonicalPath);
+  ids.insert(std::make_pair(paths.back(), id));
+  return id;
+}
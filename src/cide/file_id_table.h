@@ -0,0 +1,68 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+#include "cide/util.h"
+
+/// Interns canonical file paths as integer IDs. This allows to store the
+/// (possibly thousands of) files included by each source file compactly as
+/// sorted ID vectors instead of as sets of strings. IDs are never freed, which
+/// is fine since the number of distinct files in a session is bounded.
+///
+/// This class is thread-safe.
+class FileIdTable {
+ public:
+  static FileIdTable& Instance();
+  
+  /// Returns the ID of the given path, adding the path to the table if it is
+  /// not contained in it yet.
+  int GetOrAddId(const QString& canonicalPath);
+  
+  /// Returns the ID of the given path, or -1 if the path is not in the table.
+  int GetId(const QString& canonicalPath) const;
+  
+  /// Returns the path for the given ID. The returned string shares its data
+  /// with the table's copy.
+  QString GetPath(int id) const;
+  
+  /// Converts @p paths to a sorted vector of unique IDs in @p ids.
+  template <typename PathContainer>
+  void GetOrAddSortedIds(const PathContainer& paths, std::vector<int>* ids) {
+    ids->clear();
+    ids->reserve(paths.size());
+    std::unique_lock<std::mutex> lock(mutex);
+    for (const QString& path : paths) {
+      ids->push_back(GetOrAddIdLocked(path));
+    }
+    lock.unlock();
+    std::sort(ids->begin(), ids->end());
+    ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+  }
+  
+  /// Appends the paths for all @p ids to @p paths.
+  void GetPaths(const std::vector<int>& ids, std::vector<QString>* paths) const;
+  
+ private:
+  FileIdTable() = default;
+  
+  int GetOrAddIdLocked(const QString& canonicalPath);
+  
+  /// Maps path --> ID.
+  std::unordered_map<QString, int> ids;
+  
+  /// Maps ID --> path. A deque is used since it does not copy the strings when
+  /// growing.
+  std::deque<QString> paths;
+  
+  mutable std::mutex mutex;
+};
@@ -0,0 +1,104 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/file_replace.h"
+
+#include <algorithm>
+
+#include <QFile>
+#include <QObject>
+#include <QSaveFile>
+
+#include "cide/file_stat_cache.h"
+
+FileReplace::FileReplace(const std::vector<QString>& filePaths, const ModifyFunction& modify)
+    : filePaths(filePaths),
+      modify(modify) {
+  nextFileIndex = 0;
+  mCancel = false;
+  mThread.reset(new std::thread(&FileReplace::ThreadMain, this));
+}
+
+FileReplace::~FileReplace() {
+  Cancel();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void FileReplace::Cancel() {
+  mCancel = true;
+}
+
+bool FileReplace::GetProgress(int* numFilesDone, int* numFiles) {
+  std::unique_lock<std::mutex> lock(progressMutex);
+  *numFilesDone = this->numFilesDone;
+  *numFiles = filePaths.size();
+  return finished;
+}
+
+QString FileReplace::GetErrorMessages() {
+  std::unique_lock<std::mutex> lock(progressMutex);
+  return errorMessages;
+}
+
+void FileReplace::ThreadMain() {
+  int threadCount = std::max<int>(1, std::min<int>(filePaths.size(), std::thread::hardware_concurrency()));
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < threadCount; ++ i) {
+    workerThreads.emplace_back(&FileReplace::WorkerThreadMain, this);
+  }
+  for (std::thread& thread : workerThreads) {
+    thread.join();
+  }
+  
+  progressMutex.lock();
+  finished = true;
+  progressMutex.unlock();
+}
+
+void FileReplace::WorkerThreadMain() {
+  while (!mCancel) {
+    int fileIndex = nextFileIndex++;
+    if (fileIndex >= filePaths.size()) {
+      return;
+    }
+    ReplaceInFile(filePaths[fileIndex]);
+    
+    progressMutex.lock();
+    ++ numFilesDone;
+    progressMutex.unlock();
+  }
+}
+
+void FileReplace::ReplaceInFile(const QString& path) {
+  QString errorMessage;
+  
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    errorMessage = QObject::tr("Failed to open file: %1\n").arg(path);
+  } else {
+    QString text = QString::fromUtf8(file.readAll());  // TODO: Allow reading other formats than UTF-8 only?
+    file.close();
+    
+    if (modify(path, &text)) {
+      // QSaveFile writes to a temporary file and renames it to the target
+      // path on commit().
+      QSaveFile saveFile(path);
+      if (!saveFile.open(QIODevice::WriteOnly) ||
+          saveFile.write(text.toUtf8()) < 0 ||
+          !saveFile.commit()) {
+        errorMessage = QObject::tr("File not writable: %1\n").arg(path);
+      }
+      FileStatCache::Instance().Invalidate(path);
+    }
+  }
+  
+  if (!errorMessage.isEmpty()) {
+    progressMutex.lock();
+    errorMessages += errorMessage;
+    progressMutex.unlock();
+  }
+}
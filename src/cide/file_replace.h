@@ -0,0 +1,69 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QString>
+
+/// Modifies the text of files on disk using multiple background threads. Each
+/// file is read as UTF-8 and modified with the function given to the
+/// constructor. The result is written to a temporary file in the same
+/// directory, which then atomically replaces the original file (using
+/// QSaveFile), such that a failure never leaves a partially written file
+/// behind. The progress can be polled with GetProgress().
+class FileReplace {
+ public:
+  /// Function that modifies the @p text of the file with the given @p path.
+  /// It is called in the worker threads. Returns false if the file shall be
+  /// left unchanged.
+  typedef std::function<bool(const QString& path, QString* text)> ModifyFunction;
+  
+  /// Starts modifying the files with the given @p filePaths with @p modify.
+  FileReplace(const std::vector<QString>& filePaths, const ModifyFunction& modify);
+  
+  /// Cancels the remaining files and waits for the worker threads to exit.
+  ~FileReplace();
+  
+  /// Makes the worker threads stop after the files that they are currently
+  /// processing.
+  void Cancel();
+  
+  /// Returns the number of files that have been processed so far, and the
+  /// total number of files. Returns true once all files have been processed
+  /// (or the job was canceled) and the worker threads exited.
+  bool GetProgress(int* numFilesDone, int* numFiles);
+  
+  /// Returns the error messages for the files that could not be modified, one
+  /// per line.
+  QString GetErrorMessages();
+  
+ private:
+  void ThreadMain();
+  void WorkerThreadMain();
+  
+  void ReplaceInFile(const QString& path);
+  
+  std::vector<QString> filePaths;
+  ModifyFunction modify;
+  
+  /// Index of the next file to be processed by a worker thread.
+  std::atomic<int> nextFileIndex;
+  
+  // Progress and errors, protected by progressMutex.
+  std::mutex progressMutex;
+  int numFilesDone = 0;
+  QString errorMessages;
+  bool finished = false;
+  
+  // Threading
+  std::atomic<bool> mCancel;
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,392 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/file_search.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+static inline char ToLowerAscii(char c) {
+  return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c;
+}
+
+static inline char ToUpperAscii(char c) {
+  return (c >= 'a' && c <= 'z') ? (c - 'a' + 'A') : c;
+}
+
+/// Returns the offset of the next occurrence of @p c in @p data at or after
+/// @p offset, or @p size if there is none. Uses memchr(), which is vectorized
+/// in common C libraries.
+static inline qint64 FindByte(const char* data, qint64 size, qint64 offset, char c) {
+  const void* result = memchr(data + offset, c, size - offset);
+  return result ? (static_cast<const char*>(result) - data) : size;
+}
+
+/// Returns the number of UTF-16 code units that the UTF-8 text
+/// [data, data + size) decodes to.
+static int Utf16Length(const char* data, qint64 size) {
+  int length = 0;
+  for (qint64 i = 0; i < size; ++ i) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    if ((c & 0xC0) != 0x80) {
+      // This is not a continuation byte, so it starts a new code point.
+      // Code points with 4-byte encodings are encoded as surrogate pairs in
+      // UTF-16.
+      length += (c >= 0xF0) ? 2 : 1;
+    }
+  }
+  return length;
+}
+
+/// Version of FindOccurrencesInUtf8Text() that searches in the decoded text.
+/// This is used for case-insensitive searches for non-ASCII text, for which
+/// the case folding rules cannot be applied to the raw bytes.
+static void FindOccurrencesInDecodedText(const char* data, qint64 size, const QString& findText, Qt::CaseSensitivity caseSensitivity, std::vector<FileSearchMatch>* matches) {
+  QString text = QString::fromUtf8(data, size);
+  int line = 1;
+  int lineStart = 0;
+  while (lineStart <= text.size()) {
+    int lineEnd = text.indexOf('\n', lineStart);
+    if (lineEnd < 0) {
+      lineEnd = text.size();
+    }
+    QString lineText = text.mid(lineStart, lineEnd - lineStart);
+    if (lineText.endsWith('\r')) {
+      lineText.chop(1);
+    }
+    
+    std::vector<int> columns;
+    int column = 0;
+    while ((column = lineText.indexOf(findText, column, caseSensitivity)) != -1) {
+      columns.push_back(column);
+      column += findText.size();
+    }
+    if (!columns.empty()) {
+      matches->emplace_back();
+      matches->back().line = line;
+      matches->back().lineText = lineText;
+      matches->back().columns.swap(columns);
+    }
+    
+    lineStart = lineEnd + 1;
+    ++ line;
+  }
+}
+
+void FindOccurrencesInUtf8Text(const char* data, qint64 size, const QString& findText, Qt::CaseSensitivity caseSensitivity, std::vector<FileSearchMatch>* matches) {
+  if (findText.isEmpty()) {
+    return;
+  }
+  
+  QByteArray pattern = findText.toUtf8();
+  bool ignoreCase = caseSensitivity == Qt::CaseInsensitive;
+  if (ignoreCase) {
+    for (char c : pattern) {
+      if (static_cast<unsigned char>(c) >= 0x80) {
+        FindOccurrencesInDecodedText(data, size, findText, caseSensitivity, matches);
+        return;
+      }
+    }
+    for (int i = 0; i < pattern.size(); ++ i) {
+      pattern[i] = ToLowerAscii(pattern[i]);
+    }
+  }
+  
+  const int patternSize = pattern.size();
+  const char* patternData = pattern.constData();
+  const char firstChar = patternData[0];
+  const char firstCharAlt = ignoreCase ? ToUpperAscii(firstChar) : firstChar;
+  
+  auto matchesAt = [&](qint64 offset) {
+    if (ignoreCase) {
+      for (int i = 1; i < patternSize; ++ i) {
+        if (ToLowerAscii(data[offset + i]) != patternData[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+    return memcmp(data + offset + 1, patternData + 1, patternSize - 1) == 0;
+  };
+  
+  // State of the line that the last occurrence was found in.
+  int line = 1;
+  qint64 lineStart = 0;
+  qint64 newlinesCountedUntil = 0;
+  
+  // Occurrences in the current line that have not been added to matches yet.
+  // Their columns are given as byte offsets from lineStart.
+  std::vector<qint64> pendingByteColumns;
+  
+  auto flushPendingColumns = [&]() {
+    if (pendingByteColumns.empty()) {
+      return;
+    }
+    qint64 lineEnd = FindByte(data, size, lineStart, '\n');
+    if (lineEnd > lineStart && data[lineEnd - 1] == '\r') {
+      -- lineEnd;
+    }
+    
+    matches->emplace_back();
+    FileSearchMatch& match = matches->back();
+    match.line = line;
+    match.lineText = QString::fromUtf8(data + lineStart, lineEnd - lineStart);
+    match.columns.reserve(pendingByteColumns.size());
+    qint64 previousByteColumn = 0;
+    int column = 0;
+    for (qint64 byteColumn : pendingByteColumns) {
+      column += Utf16Length(data + lineStart + previousByteColumn, byteColumn - previousByteColumn);
+      match.columns.push_back(column);
+      previousByteColumn = byteColumn;
+    }
+    pendingByteColumns.clear();
+  };
+  
+  // Positions of the next occurrences of the first pattern character (in both
+  // cases if the search is case-insensitive).
+  qint64 nextFirstChar = -1;
+  qint64 nextFirstCharAlt = (firstCharAlt == firstChar) ? size : -1;
+  
+  qint64 offset = 0;
+  while (offset + patternSize <= size) {
+    if (nextFirstChar < offset) {
+      nextFirstChar = FindByte(data, size, offset, firstChar);
+    }
+    if (nextFirstCharAlt < offset) {
+      nextFirstCharAlt = FindByte(data, size, offset, firstCharAlt);
+    }
+    qint64 candidate = std::min(nextFirstChar, nextFirstCharAlt);
+    if (candidate + patternSize > size) {
+      break;
+    }
+    
+    if (!matchesAt(candidate)) {
+      offset = candidate + 1;
+      continue;
+    }
+    
+    // Determine the line of the occurrence.
+    qint64 newline;
+    while ((newline = FindByte(data, candidate, newlinesCountedUntil, '\n')) < candidate) {
+      flushPendingColumns();
+      ++ line;
+      lineStart = newline + 1;
+      newlinesCountedUntil = newline + 1;
+    }
+    newlinesCountedUntil = candidate;
+    
+    pendingByteColumns.push_back(candidate - lineStart);
+    offset = candidate + patternSize;
+  }
+  flushPendingColumns();
+}
+
+void FindRegexMatchesInUtf8Text(const char* data, qint64 size, const TextRegex& regex, std::vector<FileSearchMatch>* matches) {
+  TextRegexMatcher matcher(regex);
+  std::vector<std::pair<int, int>> lineMatches;
+  int line = 1;
+  qint64 lineStart = 0;
+  while (lineStart <= size) {
+    qint64 lineEnd = FindByte(data, size, lineStart, '\n');
+    qint64 lineTextEnd = lineEnd;
+    if (lineTextEnd > lineStart && data[lineTextEnd - 1] == '\r') {
+      -- lineTextEnd;
+    }
+    
+    QString lineText = QString::fromUtf8(data + lineStart, lineTextEnd - lineStart);
+    lineMatches.clear();
+    matcher.FindAll(lineText, &lineMatches);
+    if (!lineMatches.empty()) {
+      matches->emplace_back();
+      FileSearchMatch& match = matches->back();
+      match.line = line;
+      match.lineText = lineText;
+      match.columns.reserve(lineMatches.size());
+      match.lengths.reserve(lineMatches.size());
+      for (const std::pair<int, int>& lineMatch : lineMatches) {
+        match.columns.push_back(lineMatch.first);
+        match.lengths.push_back(lineMatch.second);
+      }
+    }
+    
+    lineStart = lineEnd + 1;
+    ++ line;
+  }
+}
+
+
+FileSearch::FileSearch(
+    const QString& rootPath,
+    const QString& findText,
+    Qt::CaseSensitivity caseSensitivity,
+    const std::unordered_map<QString, std::shared_ptr<const QByteArray>>& documentTexts,
+    const std::unordered_set<QString>& skippedFiles,
+    const std::shared_ptr<const TextRegex>& regex)
+    : rootPath(rootPath),
+      findText(findText),
+      caseSensitivity(caseSensitivity),
+      documentTexts(documentTexts),
+      skippedFiles(skippedFiles),
+      regex(regex) {
+  nextFileIndex = 0;
+  mCancel = false;
+  mThread.reset(new std::thread(&FileSearch::ThreadMain, this));
+}
+
+FileSearch::~FileSearch() {
+  Cancel();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void FileSearch::Cancel() {
+  mCancel = true;
+}
+
+bool FileSearch::TakeResults(std::vector<FileSearchResult>* results) {
+  std::unique_lock<std::mutex> lock(resultsMutex);
+  while (nextResultIndex < fileSearched.size() && fileSearched[nextResultIndex]) {
+    if (fileResults[nextResultIndex]) {
+      results->emplace_back();
+      std::swap(results->back(), *fileResults[nextResultIndex]);
+      fileResults[nextResultIndex].reset();
+    }
+    ++ nextResultIndex;
+  }
+  return finished && nextResultIndex == fileSearched.size();
+}
+
+void FileSearch::GetProgress(int* numFilesSearched, int* numFilesToSearch) {
+  std::unique_lock<std::mutex> lock(resultsMutex);
+  *numFilesSearched = this->numFilesSearched;
+  *numFilesToSearch = this->numFilesToSearch;
+}
+
+void FileSearch::ThreadMain() {
+  ListFiles();
+  
+  resultsMutex.lock();
+  if (mCancel) {
+    // Do not return any results for files that have not been listed.
+    filePaths.clear();
+  }
+  fileSearched.resize(filePaths.size(), false);
+  fileResults.resize(filePaths.size());
+  numFilesToSearch = filePaths.size();
+  resultsMutex.unlock();
+  
+  int threadCount = std::max<int>(1, std::thread::hardware_concurrency());
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < threadCount; ++ i) {
+    workerThreads.emplace_back(&FileSearch::WorkerThreadMain, this);
+  }
+  for (std::thread& thread : workerThreads) {
+    thread.join();
+  }
+  
+  resultsMutex.lock();
+  if (mCancel) {
+    // Only return the results up to the first file that was not searched.
+    while (nextResultIndex < fileSearched.size() && fileSearched[nextResultIndex]) {
+      ++ nextResultIndex;
+    }
+    fileSearched.resize(nextResultIndex);
+  }
+  finished = true;
+  resultsMutex.unlock();
+}
+
+void FileSearch::WorkerThreadMain() {
+  while (!mCancel) {
+    int fileIndex = nextFileIndex++;
+    if (fileIndex >= filePaths.size()) {
+      return;
+    }
+    SearchFile(fileIndex);
+  }
+}
+
+void FileSearch::ListFiles() {
+  std::unordered_set<QString> visitedDirs;
+  
+  QDir startDir(rootPath);
+  visitedDirs.insert(startDir.canonicalPath());
+  std::vector<QDir> workList = {startDir};
+  while (!workList.empty()) {
+    if (mCancel) {
+      return;
+    }
+    
+    QDir dir = workList.back();
+    workList.pop_back();
+    
+    for (const QFileInfo& fileInfo : dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Readable | QDir::Hidden)) {
+      if (fileInfo.isDir()) {
+        // Add this directory to the list of directories to search in if we did
+        // not visit it yet (which might be the case if there was a symlink).
+        if (visitedDirs.insert(fileInfo.canonicalFilePath()).second) {
+          workList.push_back(QDir(fileInfo.filePath()));
+        }
+      } else {
+        filePaths.push_back(fileInfo.filePath());
+      }
+    }
+  }
+}
+
+void FileSearch::SearchFile(int fileIndex) {
+  const QString& filePath = filePaths[fileIndex];
+  
+  std::shared_ptr<FileSearchResult> result(new FileSearchResult());
+  result->filePath = filePath;
+  
+  QString canonicalPath;
+  if (!documentTexts.empty() || !skippedFiles.empty()) {
+    canonicalPath = QFileInfo(filePath).canonicalFilePath();
+  }
+  
+  auto findInText = [&](const char* data, qint64 size) {
+    if (regex) {
+      FindRegexMatchesInUtf8Text(data, size, *regex, &result->matches);
+    } else {
+      FindOccurrencesInUtf8Text(data, size, findText, caseSensitivity, &result->matches);
+    }
+  };
+  
+  auto documentIt = documentTexts.empty() ? documentTexts.end() : documentTexts.find(canonicalPath);
+  if (documentIt != documentTexts.end()) {
+    const QByteArray& text = *documentIt->second;
+    findInText(text.constData(), text.size());
+  } else if (skippedFiles.count(canonicalPath) == 0) {
+    // TODO: Allow reading other formats than UTF-8 only?
+    QFile file(filePath);
+    if (file.open(QIODevice::ReadOnly)) {
+      qint64 size = file.size();
+      if (size > 0) {
+        uchar* data = file.map(0, size);
+        if (data) {
+          findInText(reinterpret_cast<const char*>(data), size);
+          file.unmap(data);
+        } else {
+          QByteArray content = file.readAll();
+          findInText(content.constData(), content.size());
+        }
+      }
+    }
+  }
+  
+  std::unique_lock<std::mutex> lock(resultsMutex);
+  fileSearched[fileIndex] = true;
+  if (!result->matches.empty()) {
+    fileResults[fileIndex] = result;
+  }
+  ++ numFilesSearched;
+}
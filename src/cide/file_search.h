@@ -0,0 +1,129 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+#include "cide/text_regex.h"
+#include "cide/util.h"
+
+/// A line containing one or more occurrences of the searched text.
+struct FileSearchMatch {
+  /// One-based line number.
+  int line;
+  
+  /// Text of the line, without the line ending.
+  QString lineText;
+  
+  /// Zero-based columns (in lineText) of the occurrences.
+  std::vector<int> columns;
+  
+  /// Lengths of the occurrences (for regular expression searches). If this is
+  /// empty, all occurrences have the length of the searched text.
+  std::vector<int> lengths;
+};
+
+/// The occurrences of the searched text within one file.
+struct FileSearchResult {
+  QString filePath;
+  std::vector<FileSearchMatch> matches;
+};
+
+/// Finds all occurrences of @p findText in the UTF-8 encoded @p data and
+/// appends them to @p matches, ordered by line. Occurrences do not overlap and
+/// do not extend over line breaks.
+void FindOccurrencesInUtf8Text(const char* data, qint64 size, const QString& findText, Qt::CaseSensitivity caseSensitivity, std::vector<FileSearchMatch>* matches);
+
+/// Finds all matches of @p regex in the UTF-8 encoded @p data and appends them
+/// to @p matches, ordered by line. The text is decoded and matched line by
+/// line, so matches do not extend over line breaks.
+void FindRegexMatchesInUtf8Text(const char* data, qint64 size, const TextRegex& regex, std::vector<FileSearchMatch>* matches);
+
+/// Searches for a text in all files within a directory (recursively), using
+/// multiple background threads. The files are memory-mapped and searched
+/// as raw UTF-8 bytes. The results can be retrieved in the order of the files
+/// while the search is running with TakeResults().
+class FileSearch {
+ public:
+  /// Starts the search for @p findText in all files within @p rootPath. For
+  /// files that are in @p documentTexts (which maps file paths to their
+  /// UTF-8 encoded text), the given text is searched instead of the file's
+  /// content, which allows to search in documents with unsaved changes.
+  /// Files whose canonical paths are in @p skippedFiles are known not to
+  /// contain the text (for example, from a TrigramIndex) and are not read.
+  /// If @p regex is given, its matches are searched for instead of
+  /// @p findText.
+  FileSearch(
+      const QString& rootPath,
+      const QString& findText,
+      Qt::CaseSensitivity caseSensitivity,
+      const std::unordered_map<QString, std::shared_ptr<const QByteArray>>& documentTexts,
+      const std::unordered_set<QString>& skippedFiles = std::unordered_set<QString>(),
+      const std::shared_ptr<const TextRegex>& regex = nullptr);
+  
+  /// Cancels the search and waits for the search threads to exit.
+  ~FileSearch();
+  
+  /// Makes the search threads stop as soon as possible.
+  void Cancel();
+  
+  /// Appends the results of the files that have been searched since the last
+  /// call to @p results. The results are returned in the order of the files,
+  /// so they may be retained until the previous files have been searched.
+  /// Only files with occurrences are returned. Returns true once the search
+  /// has finished and all results have been taken.
+  bool TakeResults(std::vector<FileSearchResult>* results);
+  
+  /// Returns the number of files that have been searched so far, and the total
+  /// number of files to search (which is -1 while the files are still being
+  /// listed).
+  void GetProgress(int* numFilesSearched, int* numFilesToSearch);
+  
+ private:
+  void ThreadMain();
+  void WorkerThreadMain();
+  
+  /// Lists all files within rootPath, without following symlinks to
+  /// directories that have been visited already.
+  void ListFiles();
+  
+  void SearchFile(int fileIndex);
+  
+  QString rootPath;
+  QString findText;
+  Qt::CaseSensitivity caseSensitivity;
+  std::unordered_map<QString, std::shared_ptr<const QByteArray>> documentTexts;
+  std::unordered_set<QString> skippedFiles;
+  std::shared_ptr<const TextRegex> regex;
+  
+  /// Paths of all files to search. Written only before the worker threads are
+  /// started.
+  std::vector<QString> filePaths;
+  
+  /// Index of the next file to be searched by a worker thread.
+  std::atomic<int> nextFileIndex;
+  
+  // Results, protected by resultsMutex.
+  std::mutex resultsMutex;
+  std::vector<bool> fileSearched;
+  std::vector<std::shared_ptr<FileSearchResult>> fileResults;
+  int numFilesSearched = 0;
+  int numFilesToSearch = -1;
+  int nextResultIndex = 0;
+  bool finished = false;
+  
+  // Threading
+  std::atomic<bool> mCancel;
+  std::shared_ptr<std::thread> mThread;
+};
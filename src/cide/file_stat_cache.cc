@@ -0,0 +1,47 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/file_stat_cache.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+
+constexpr int FileStatCache::kMaxAgeMSecs;
+
+FileStatCache& FileStatCache::Instance() {
+  static FileStatCache instance;
+  return instance;
+}
+
+qint64 FileStatCache::GetModificationTime(const QString& path) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(path);
+  if (it != entries.end() &&
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second.queryTime).count() < kMaxAgeMSecs) {
+    return it->second.modificationTime;
+  }
+  lock.unlock();
+  
+  // Query the file without holding the lock.
+  QFileInfo info(path);
+  Entry entry;
+  entry.modificationTime = info.exists() ? info.lastModified().toSecsSinceEpoch() : -1;
+  entry.queryTime = now;
+  
+  lock.lock();
+  entries[path] = entry;
+  return entry.modificationTime;
+}
+
+void FileStatCache::Invalidate(const QString& path) {
+  std::unique_lock<std::mutex> lock(mutex);
+  entries.erase(path);
+}
+
+void FileStatCache::InvalidateAll() {
+  std::unique_lock<std::mutex> lock(mutex);
+  entries.clear();
+}
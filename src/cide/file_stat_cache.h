@@ -0,0 +1,59 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+#include <QString>
+
+#include "cide/util.h"
+
+/// Caches the modification times of files for the whole process. These are
+/// used to check whether cached results that depend on included files (such as
+/// preambles, cached translation units, and cached indexing results) are still
+/// up-to-date. Each such check requires one stat() for each of the often
+/// thousands of included headers, while most TUs include the same headers.
+///
+/// Cached entries are dropped when a file watcher reports a change (see
+/// Invalidate() and InvalidateAll()), and when CIDE writes a file itself.
+/// Since most included files (for example, system headers) are not watched,
+/// an entry additionally expires after kMaxAgeMSecs. This bounds the time in
+/// which external changes to unwatched files can go unnoticed, while still
+/// avoiding the repeated stat()s when many TUs are checked in succession (for
+/// example, while indexing a project).
+///
+/// This class is thread-safe.
+class FileStatCache {
+ public:
+  /// Time after which a cached modification time is re-queried from the file
+  /// system.
+  static constexpr int kMaxAgeMSecs = 2000;
+  
+  static FileStatCache& Instance();
+  
+  /// Returns the last modification time of the given file in seconds since
+  /// the epoch (as QFileInfo::lastModified().toSecsSinceEpoch()), or -1 if the
+  /// file does not exist.
+  qint64 GetModificationTime(const QString& path);
+  
+  /// Drops the cached entry for the file with the given path.
+  void Invalidate(const QString& path);
+  
+  /// Drops all cached entries.
+  void InvalidateAll();
+  
+ private:
+  struct Entry {
+    qint64 modificationTime;
+    std::chrono::steady_clock::time_point queryTime;
+  };
+  
+  FileStatCache() = default;
+  
+  std::unordered_map<QString, Entry> entries;
+  std::mutex mutex;
+};
@@ -4,6 +4,10 @@
 
 #include "cide/find_and_replace_in_files.h"
 
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <QDialog>
 #include <QDialogButtonBox>
 #include <QDockWidget>
@@ -11,32 +15,65 @@
 #include <QLabel>
 #include <QLineEdit>
 #include <QMessageBox>
-#include <QMouseEvent>
-#include <QProgressDialog>
 #include <QPushButton>
-#include <QTreeWidget>
+#include <QTreeView>
 
+#include "cide/file_replace.h"
+#include "cide/file_search.h"
+#include "cide/find_in_files_results.h"
 #include "cide/main_window.h"
+#include "cide/project.h"
 #include "cide/settings.h"
+#include "cide/stall_detector.h"
 
 
-class LabelWithClickedSignal : public QLabel {
- Q_OBJECT
- public:
-  LabelWithClickedSignal(const QString& text, QWidget* parent = nullptr)
-      : QLabel(text, parent) {}
-  
- signals:
-  void clicked();
-  
- protected:
-  void mousePressEvent(QMouseEvent* event) override {
-    QLabel::mousePressEvent(event);
-    if (event->button() == Qt::LeftButton) {
-      emit clicked();
+/// Replaces all occurrences of @p findText (or all matches of @p regex, if it
+/// is non-null) in @p text with @p replacementText. As for the search, the text
+/// is processed line by line. Returns whether anything was replaced.
+static bool ReplaceOccurrencesInText(const QString& findText, Qt::CaseSensitivity caseSensitivity, const TextRegex* regex, const QString& replacementText, QString* text) {
+  QString modifiedText;
+  modifiedText.reserve(text->size());
+  bool replaced = false;
+  
+  std::shared_ptr<TextRegexMatcher> regexMatcher(regex ? new TextRegexMatcher(*regex) : nullptr);
+  std::vector<std::pair<int, int>> matches;
+  
+  int lineStart = 0;
+  while (lineStart < text->size()) {
+    // TODO: Support finding strings that go beyond a single line
+    int lineEnd = text->indexOf('\n', lineStart);
+    lineEnd = (lineEnd < 0) ? text->size() : (lineEnd + 1);
+    QString lineText = text->mid(lineStart, lineEnd - lineStart);
+    lineStart = lineEnd;
+    
+    if (regex) {
+      // Match without the line ending, as for the search.
+      int lineEndSize = lineText.endsWith(QStringLiteral("\r\n")) ? 2 : (lineText.endsWith('\n') ? 1 : 0);
+      matches.clear();
+      regexMatcher->FindAll(lineText.left(lineText.size() - lineEndSize), &matches);
+      for (int i = static_cast<int>(matches.size()) - 1; i >= 0; -- i) {
+        lineText.replace(matches[i].first, matches[i].second, replacementText);
+        replaced = true;
+      }
+    } else {
+      int column = lineText.size() - 1;
+      while ((column = lineText.lastIndexOf(findText, column, caseSensitivity)) != -1) {
+        // Replace this occurrence
+        lineText.replace(column, findText.size(), replacementText);
+        replaced = true;
+        
+        column -= 1;
+      }
     }
+    
+    modifiedText += lineText;
+  }
+  
+  if (replaced) {
+    text->swap(modifiedText);
   }
-};
+  return replaced;
+}
 
 
 QAction* FindAndReplaceInFiles::Initialize(MainWindow* mainWindow) {
@@ -46,6 +83,12 @@ QAction* FindAndReplaceInFiles::Initialize(MainWindow* mainWindow) {
   connect(findAndReplaceInFilesAction, &QAction::triggered, this, &FindAndReplaceInFiles::ShowDialogWithDefaultSettings);
   mainWindow->addAction(findAndReplaceInFilesAction);
   
+  searchResultsTimer.setInterval(50);
+  connect(&searchResultsTimer, &QTimer::timeout, this, &FindAndReplaceInFiles::PollSearchResults);
+  
+  replaceProgressTimer.setInterval(50);
+  connect(&replaceProgressTimer, &QTimer::timeout, this, &FindAndReplaceInFiles::PollReplaceProgress);
+  
   return findAndReplaceInFilesAction;
 }
 
@@ -63,20 +106,25 @@ void FindAndReplaceInFiles::CreateDockWidget() {
   findAndReplaceEdit->setMinimumWidth(400);
   findAndReplaceReplaceButton = new QPushButton(tr("Replace"));
   connect(findAndReplaceReplaceButton, &QPushButton::clicked, this, &FindAndReplaceInFiles::ReplaceClicked);
+  findAndReplaceStopButton = new QPushButton(tr("Stop"));
+  findAndReplaceStopButton->setEnabled(false);
+  connect(findAndReplaceStopButton, &QPushButton::clicked, this, &FindAndReplaceInFiles::StopSearch);
   
-  findAndReplaceResultsTree = new QTreeWidget();
-  findAndReplaceResultsTree->setColumnCount(1);
+  findAndReplaceResultsModel = new FindInFilesResultsModel(this);
+  findAndReplaceResultsTree = new QTreeView();
   findAndReplaceResultsTree->setHeaderHidden(true);
-  connect(findAndReplaceResultsTree, &QTreeWidget::itemActivated, [&](QTreeWidgetItem* item, int /*column*/) {
-    QString locationString = item->data(0, Qt::UserRole).toString();
-    if (!locationString.isEmpty()) {
-      mainWindow->GotoDocumentLocation(locationString);
-    }
-  });
+  findAndReplaceResultsTree->setUniformRowHeights(true);
+  findAndReplaceResultsTree->setItemDelegate(new FindInFilesResultsDelegate(findAndReplaceResultsTree));
+  findAndReplaceResultsTree->setModel(findAndReplaceResultsModel);
+  // Jump to an occurrence on a single click, as well as on activation with
+  // the keyboard.
+  connect(findAndReplaceResultsTree, &QTreeView::clicked, this, &FindAndReplaceInFiles::ResultActivated);
+  connect(findAndReplaceResultsTree, &QTreeView::activated, this, &FindAndReplaceInFiles::ResultActivated);
   
   QHBoxLayout* topLayout = new QHBoxLayout();
   topLayout->setContentsMargins(0, 0, 0, 0);
   topLayout->addWidget(findAndReplaceResultsLabel, 1);
+  topLayout->addWidget(findAndReplaceStopButton);
   topLayout->addWidget(findAndReplaceReplacementLabel);
   topLayout->addWidget(findAndReplaceEdit);
   topLayout->addWidget(findAndReplaceReplaceButton);
@@ -110,88 +158,42 @@ void FindAndReplaceInFiles::ShowDialog(const QString& initialPath) {
     return;
   }
   
-  findAndReplaceResultsTree->clear();
+  // Stop a previous search that might still be running.
+  searchResultsTimer.stop();
+  search.reset();
+  
   findAndReplaceEdit->setEnabled(false);
   findAndReplaceReplaceButton->setEnabled(false);
   
-  QProgressDialog progress(tr("Searching in files..."), "Abort", 0, 0, mainWindow);
-  progress.setMinimumDuration(200);
-  progress.setValue(0);
-  progress.setWindowModality(Qt::WindowModal);
-  
-  // Count the number of files to search in to be able to show a progress estimate.
-  // Also cache all the paths to the files to avoid iterating over the directories again.
-  int numFilesToSearch = 0;
-  filePaths.clear();
-  filesWithOccurrencesPaths.clear();
-  
-  std::vector<QDir> doneList;
-  std::vector<QDir> workList = {startDir};
-  while (!workList.empty()) {
-    if (progress.wasCanceled()) {
-      findAndReplaceResultsLabel->setText(tr("Search canceled."));
-      return;
-    }
-    
-    QDir dir = workList.back();
-    workList.pop_back();
-    doneList.push_back(dir);
-    
-    for (const QFileInfo& fileInfo : dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Readable | QDir::Hidden)) {
-      if (fileInfo.isDir()) {
-        // Add this directory to the list of directories to search in if we did
-        // not visit it yet (which might be the case if there was a symlink).
-        bool alreadyVisited = false;
-        QDir childDir(fileInfo.filePath());
-        for (const QDir& doneDir : doneList) {
-          if (doneDir == childDir) {
-            alreadyVisited = true;
-            break;
-          }
-        }
-        if (!alreadyVisited) {
-          workList.push_back(childDir);
-        }
-      } else {
-        ++ numFilesToSearch;
-        filePaths.push_back(fileInfo.filePath());
-      }
+  // For open documents, search in their current text instead of in the file
+  // on disk, such that unsaved changes are taken into account.
+  std::unordered_map<QString, std::shared_ptr<const QByteArray>> documentTexts;
+  for (int i = 0; i < mainWindow->GetNumDocuments(); ++ i) {
+    std::shared_ptr<Document> document = mainWindow->GetDocument(i);
+    if (!document->path().isEmpty()) {
+      documentTexts[document->path()] = document->GetDocumentTextUtf8();
     }
   }
   
-  progress.setMaximum(numFilesToSearch);
-  
-  // Perform the actual search.
-  QTreeWidgetItem* lastFileItem = nullptr;
-  QString lastFilePath;
-  int numFilesSearched = 0;
-  int numOccurrences = 0;
-  int occurrencesInFile = 0;
-  
-  for (const QString& filePath : filePaths) {
-    progress.setValue(numFilesSearched);
-    if (progress.wasCanceled()) {
-      findAndReplaceResultsLabel->setText(tr("Search canceled."));
-      return;
-    }
-    
-    ++ numFilesSearched;
-    
-    Document* fileDocument;
-    DocumentWidget* fileWidget;
-    if (mainWindow->GetDocumentAndWidgetForPath(filePath, &fileDocument, &fileWidget)) {
-      SearchInDocument(fileDocument, startDir, filePath, lastFileItem, lastFilePath, occurrencesInFile, numOccurrences);
-    } else {
-      SearchInFile(startDir, filePath, lastFileItem, lastFilePath, occurrencesInFile, numOccurrences);
+  // Skip the files that the projects' content indexes know not to contain the
+  // text. Open documents are always searched since they may have unsaved
+  // changes.
+  std::unordered_set<QString> skippedFiles;
+  if (!regex) {
+    for (const auto& project : mainWindow->GetProjects()) {
+      project->GetContentIndex().FindFilesThatCannotContain(findText, caseSensitivity, &skippedFiles);
     }
   }
-  if (lastFileItem) {
-    SetLastFileItem(startDir, lastFileItem, lastFilePath, occurrencesInFile);
+  for (const auto& item : documentTexts) {
+    skippedFiles.erase(item.first);
   }
   
-  findAndReplaceResultsLabel->setText(tr("Found %1 occurrences of %2 in %3.").arg(numOccurrences).arg(findText).arg(searchFolderPath));
-  findAndReplaceEdit->setEnabled(true);
-  findAndReplaceReplaceButton->setEnabled(true);
+  findAndReplaceResultsModel->Clear(searchFolderPath, documentTexts);
+  
+  search.reset(new FileSearch(searchFolderPath, findText, caseSensitivity, documentTexts, skippedFiles, regex));
+  findAndReplaceResultsLabel->setText(tr("Searching in files..."));
+  findAndReplaceStopButton->setEnabled(true);
+  searchResultsTimer.start();
 }
 
 bool FindAndReplaceInFiles::ShowDialogInternal(const QString initialPath) {
@@ -218,7 +220,14 @@ bool FindAndReplaceInFiles::ShowDialogInternal(const QString initialPath) {
   
   QCheckBox* matchCaseCheck = new QCheckBox(tr("Match case"));
   matchCaseCheck->setChecked(true);
-  layout->addWidget(matchCaseCheck, 0, 2);
+  QCheckBox* regexCheck = new QCheckBox(tr("Regex"));
+  regexCheck->setChecked(settings.value("findAndReplaceInFiles/regex", false).toBool());
+  
+  QHBoxLayout* optionsLayout = new QHBoxLayout();
+  optionsLayout->setContentsMargins(0, 0, 0, 0);
+  optionsLayout->addWidget(matchCaseCheck);
+  optionsLayout->addWidget(regexCheck);
+  layout->addLayout(optionsLayout, 0, 2);
   
   // In: [   ](...)(Set to current directory)
   QLabel* inLabel = new QLabel(tr("In:"));
@@ -282,204 +291,152 @@ bool FindAndReplaceInFiles::ShowDialogInternal(const QString initialPath) {
   
   settings.setValue("findAndReplaceInFiles/find", findText);
   settings.setValue("findAndReplaceInFiles/in", searchFolderPath);
+  settings.setValue("findAndReplaceInFiles/regex", regexCheck->isChecked());
+  
+  regex.reset();
+  if (regexCheck->isChecked()) {
+    regex.reset(new TextRegex());
+    QString errorMessage;
+    if (!regex->Compile(findText, matchCaseCheck->isChecked(), &errorMessage)) {
+      QMessageBox::warning(mainWindow, tr("Find in files"), tr("Invalid regular expression: %1").arg(errorMessage));
+      regex.reset();
+      return false;
+    }
+  }
   
   return true;
 }
 
 void FindAndReplaceInFiles::ReplaceClicked() {
-  QString errorMessages;
+  if (replace) {
+    return;
+  }
+  StallMarker stallMarker("FindAndReplaceInFiles::ReplaceClicked");
   QString replacementText = findAndReplaceEdit->text();
   
-  for (const QString& filePath : filesWithOccurrencesPaths) {
+  // Open documents are modified in memory (with a single ReplaceMany() each),
+  // all other files on disk in the background.
+  std::vector<QString> filePaths;
+  for (int fileIndex = 0; fileIndex < findAndReplaceResultsModel->GetNumFiles(); ++ fileIndex) {
+    const QString& filePath = findAndReplaceResultsModel->GetFilePath(fileIndex);
     Document* fileDocument;
     DocumentWidget* fileWidget;
     if (mainWindow->GetDocumentAndWidgetForPath(filePath, &fileDocument, &fileWidget)) {
       ReplaceInDocument(fileWidget, replacementText);
     } else {
-      ReplaceInFile(filePath, replacementText, &errorMessages);
+      filePaths.push_back(filePath);
     }
   }
-  
-  if (!errorMessages.isEmpty()) {
-    QMessageBox::warning(mainWindow, tr("Error(s) while replacing"), errorMessages);
-  }
   findAndReplaceReplaceButton->setEnabled(false);
-}
-
-void FindAndReplaceInFiles::ShowDialogWithDefaultSettings() {
-  ShowDialog();
-}
-
-void FindAndReplaceInFiles::SetLastFileItem(const QDir& startDir, QTreeWidgetItem* lastFileItem, QString lastFilePath, int occurrencesInFile) {
-  findAndReplaceResultsTree->setItemWidget(
-      lastFileItem, 0,
-      new QLabel(QStringLiteral("<b>%1</b>: %2 matches").arg(startDir.relativeFilePath(lastFilePath).toHtmlEscaped()).arg(occurrencesInFile)));
-}
-
-void FindAndReplaceInFiles::SearchInDocument(Document* document, const QDir& startDir, const QString& filePath, QTreeWidgetItem*& lastFileItem, QString& lastFilePath, int& occurrencesInFile, int& numOccurrences) {
-  bool haveOccurrenceInFile = false;
-  QTreeWidgetItem* lastLineItem = nullptr;
-  std::vector<int> occurrenceColumns;  // zero-based
-  int line = 0;  // one-based
-  
-  Document::LineIterator lineIt(document);
-  while (lineIt.IsValid()) {
-    ++ line;
-    QString lineText = document->TextForRange(lineIt.GetLineRange());
-    ++ lineIt;
-    
-    SearchInLine(
-        line,
-        lineText,
-        haveOccurrenceInFile,
-        lastLineItem,
-        occurrenceColumns,
-        startDir,
-        filePath,
-        lastFileItem,
-        lastFilePath,
-        occurrencesInFile,
-        numOccurrences);
+  
+  if (filePaths.empty()) {
+    return;
   }
+  
+  QString findText = this->findText;
+  Qt::CaseSensitivity caseSensitivity = this->caseSensitivity;
+  std::shared_ptr<TextRegex> regex = this->regex;
+  replace.reset(new FileReplace(filePaths, [=](const QString& /*path*/, QString* text) {
+    return ReplaceOccurrencesInText(findText, caseSensitivity, regex.get(), replacementText, text);
+  }));
+  findAndReplaceEdit->setEnabled(false);
+  findAndReplaceResultsLabel->setText(tr("Replacing in files..."));
+  replaceProgressTimer.start();
 }
 
-void FindAndReplaceInFiles::SearchInFile(const QDir& startDir, const QString& filePath, QTreeWidgetItem*& lastFileItem, QString& lastFilePath, int& occurrencesInFile, int& numOccurrences) {
-  QFile file(filePath);
-  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+void FindAndReplaceInFiles::StopSearch() {
+  if (!search) {
     return;
   }
   
-  bool haveOccurrenceInFile = false;
-  QTreeWidgetItem* lastLineItem = nullptr;
-  std::vector<int> occurrenceColumns;  // zero-based
-  int line = 0;  // one-based
+  searchResultsTimer.stop();
+  search->Cancel();
   
-  while (!file.atEnd()) {
-    ++ line;
-    QString lineText = QString::fromUtf8(file.readLine());  // TODO: Allow reading other formats than UTF-8 only?
-    
-    SearchInLine(
-        line,
-        lineText,
-        haveOccurrenceInFile,
-        lastLineItem,
-        occurrenceColumns,
-        startDir,
-        filePath,
-        lastFileItem,
-        lastFilePath,
-        occurrencesInFile,
-        numOccurrences);
+  // Display the results that were found before the search stopped.
+  std::vector<FileSearchResult> results;
+  while (!search->TakeResults(&results)) {
+    std::this_thread::yield();
   }
+  AddResults(results);
+  search.reset();
+  
+  findAndReplaceResultsLabel->setText(tr("Search canceled."));
+  findAndReplaceStopButton->setEnabled(false);
 }
 
-void FindAndReplaceInFiles::SearchInLine(
-    int line,
-    QString lineText,
-    bool& haveOccurrenceInFile,
-    QTreeWidgetItem*& lastLineItem,
-    std::vector<int>& occurrenceColumns,
-    const QDir& startDir,
-    const QString& filePath,
-    QTreeWidgetItem*& lastFileItem,
-    QString& lastFilePath,
-    int& occurrencesInFile,
-    int& numOccurrences) {
-  occurrenceColumns.clear();
-  int column = 0;
-  while ((column = lineText.indexOf(findText, column, caseSensitivity)) != -1) {
-    // Found an occurrence at (line, column)
-    occurrenceColumns.push_back(column);
-    
-    column += findText.size();
+void FindAndReplaceInFiles::ShowDialogWithDefaultSettings() {
+  ShowDialog();
+}
+
+void FindAndReplaceInFiles::PollSearchResults() {
+  if (!search) {
+    searchResultsTimer.stop();
+    return;
   }
   
-  if (!occurrenceColumns.empty()) {
-    if (!haveOccurrenceInFile) {
-      // Insert the top-level tree widget item for the file.
-      if (lastFileItem) {
-        SetLastFileItem(startDir, lastFileItem, lastFilePath, occurrencesInFile);
-      }
-      occurrencesInFile = 0;
-      lastFileItem = new QTreeWidgetItem(findAndReplaceResultsTree, lastFileItem);
-      lastFilePath = filePath;
-      lastFileItem->setExpanded(true);
-      
-      filesWithOccurrencesPaths.push_back(filePath);
-      
-      haveOccurrenceInFile = true;
-    }
-    
-    numOccurrences += occurrenceColumns.size();
-    occurrencesInFile += occurrenceColumns.size();
-    
-    lastLineItem = new QTreeWidgetItem(lastFileItem, lastLineItem);
-    lastLineItem->setFlags(lastLineItem->flags() | Qt::ItemNeverHasChildren);
-    lastLineItem->setData(0, Qt::UserRole, QStringLiteral("file://%1:%2:%3").arg(filePath).arg(line).arg(occurrenceColumns[0] + 1));
-    
-    // Highlight the occurrences in the text
-    if (lineText.endsWith('\n')) {
-      lineText.chop(1);
-    }
-    
-    QString markupText;
-    int cursor = 0;
-    for (int column : occurrenceColumns) {
-      markupText += lineText.mid(cursor, column - cursor).toHtmlEscaped();
-      markupText += QStringLiteral("<b style=\"background-color:#efedec;\">");
-      markupText += lineText.mid(column, findText.size()).toHtmlEscaped();
-      markupText += QStringLiteral("</b>");
-      cursor = column + findText.size();
+  std::vector<FileSearchResult> results;
+  bool finished = search->TakeResults(&results);
+  AddResults(results);
+  
+  if (!finished) {
+    int numFilesSearched;
+    int numFilesToSearch;
+    search->GetProgress(&numFilesSearched, &numFilesToSearch);
+    if (numFilesToSearch < 0) {
+      findAndReplaceResultsLabel->setText(tr("Searching in files... (%1 occurrences so far)").arg(findAndReplaceResultsModel->GetNumOccurrences()));
+    } else {
+      findAndReplaceResultsLabel->setText(tr("Searching in files... (%1 / %2 files, %3 occurrences so far)").arg(numFilesSearched).arg(numFilesToSearch).arg(findAndReplaceResultsModel->GetNumOccurrences()));
     }
-    markupText += lineText.mid(cursor).toHtmlEscaped();
-    
-    LabelWithClickedSignal* lineLabel = new LabelWithClickedSignal(tr("<span style=\"color:gray;\">Line %1:</span> %2").arg(line).arg(markupText));
-    connect(lineLabel, &LabelWithClickedSignal::clicked, [=]() {
-      // Invoke the itemActivated() signal of the QTreeWidget for this item.
-      QMetaObject::invokeMethod(
-          findAndReplaceResultsTree,
-          "itemActivated",
-          Qt::DirectConnection,
-          Q_ARG(QTreeWidgetItem*, lastLineItem),
-          Q_ARG(int, 0));
-    });
-    findAndReplaceResultsTree->setItemWidget(lastLineItem, 0, lineLabel);
+    return;
   }
+  
+  searchResultsTimer.stop();
+  search.reset();
+  
+  findAndReplaceResultsLabel->setText(tr("Found %1 occurrences of %2 in %3.").arg(findAndReplaceResultsModel->GetNumOccurrences()).arg(findText).arg(searchFolderPath));
+  findAndReplaceStopButton->setEnabled(false);
+  findAndReplaceEdit->setEnabled(true);
+  findAndReplaceReplaceButton->setEnabled(true);
 }
 
-void FindAndReplaceInFiles::ReplaceInDocument(DocumentWidget* widget, const QString& replacementText) {
-  widget->ReplaceAll(findText, replacementText, caseSensitivity == Qt::CaseSensitive, false);
-}
-
-void FindAndReplaceInFiles::ReplaceInFile(const QString& filePath, const QString& replacementText, QString* errorMessages) {
-  QFile file(filePath);
-  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+void FindAndReplaceInFiles::PollReplaceProgress() {
+  if (!replace) {
+    replaceProgressTimer.stop();
     return;
   }
   
-  QString modifiedFileText;
-  
-  while (!file.atEnd()) {
-    // TODO: Support finding strings that go beyond a single line
-    QString lineText = QString::fromUtf8(file.readLine());  // TODO: Allow reading other formats than UTF-8 only?
-    
-    int column = lineText.size() - 1;
-    while ((column = lineText.lastIndexOf(findText, column, caseSensitivity)) != -1) {
-      // Replace this occurrence
-      lineText.replace(column, findText.size(), replacementText);
-      
-      column -= 1;
-    }
-    
-    modifiedFileText += lineText;
+  int numFilesDone;
+  int numFiles;
+  if (!replace->GetProgress(&numFilesDone, &numFiles)) {
+    findAndReplaceResultsLabel->setText(tr("Replacing in files... (%1 / %2 files)").arg(numFilesDone).arg(numFiles));
+    return;
   }
   
-  file.close();
-  if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-    file.write(modifiedFileText.toUtf8());
-  } else {
-    *errorMessages += tr("File not writable: %1\n").arg(filePath);
+  replaceProgressTimer.stop();
+  QString errorMessages = replace->GetErrorMessages();
+  replace.reset();
+  
+  findAndReplaceResultsLabel->setText(tr("Replaced the occurrences of %1 in %2.").arg(findText).arg(searchFolderPath));
+  if (!errorMessages.isEmpty()) {
+    QMessageBox::warning(mainWindow, tr("Error(s) while replacing"), errorMessages);
+  }
+}
+
+void FindAndReplaceInFiles::AddResults(const std::vector<FileSearchResult>& results) {
+  int firstNewFile = findAndReplaceResultsModel->GetNumFiles();
+  findAndReplaceResultsModel->AddResults(results, findText.size());
+  for (int fileIndex = firstNewFile; fileIndex < findAndReplaceResultsModel->GetNumFiles(); ++ fileIndex) {
+    findAndReplaceResultsTree->expand(findAndReplaceResultsModel->index(fileIndex, 0));
+  }
+}
+
+void FindAndReplaceInFiles::ResultActivated(const QModelIndex& index) {
+  QString locationString = index.data(Qt::UserRole).toString();
+  if (!locationString.isEmpty()) {
+    mainWindow->GotoDocumentLocation(locationString);
   }
 }
 
-#include "find_and_replace_in_files.moc"
+void FindAndReplaceInFiles::ReplaceInDocument(DocumentWidget* widget, const QString& replacementText) {
+  widget->ReplaceAll(findText, replacementText, caseSensitivity == Qt::CaseSensitive, false, regex != nullptr);
+}
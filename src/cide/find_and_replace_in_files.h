@@ -4,10 +4,18 @@
 
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include <QObject>
+#include <QTimer>
 
 class Document;
 class DocumentWidget;
+class FileReplace;
+class FileSearch;
+struct FileSearchResult;
+class FindInFilesResultsModel;
 class MainWindow;
 class QAction;
 class QDir;
@@ -15,8 +23,9 @@ class QDockWidget;
 class QLabel;
 class QLineEdit;
 class QPushButton;
-class QTreeWidget;
-class QTreeWidgetItem;
+class QModelIndex;
+class QTreeView;
+class TextRegex;
 
 class FindAndReplaceInFiles : public QObject {
  Q_OBJECT
@@ -31,9 +40,21 @@ class FindAndReplaceInFiles : public QObject {
   
   void ReplaceClicked();
   
+  /// Cancels the running search, if any. The results found so far remain
+  /// displayed.
+  void StopSearch();
+  
  private slots:
   void ShowDialogWithDefaultSettings();
   
+  /// Adds the results that the background search found since the last call
+  /// to the results tree, and updates the progress display.
+  void PollSearchResults();
+  
+  /// Updates the progress display of the background replacement in files,
+  /// and reports errors once it has finished.
+  void PollReplaceProgress();
+  
  private:
   /// Shows the search dialog that allows entering the text to serach for, set
   /// the search directory, etc. Returns true if the dialog was accepted. The
@@ -41,34 +62,23 @@ class FindAndReplaceInFiles : public QObject {
   /// class (findText, searchFolderPath).
   bool ShowDialogInternal(const QString initialPath);
   
-  void SetLastFileItem(const QDir& startDir, QTreeWidgetItem* lastFileItem, QString lastFilePath, int occurrencesInFile);
-  
-  void SearchInDocument(Document* document, const QDir& startDir, const QString& filePath, QTreeWidgetItem*& lastFileItem, QString& lastFilePath, int& occurrencesInFile, int& numOccurrences);
-  void SearchInFile(const QDir& startDir, const QString& filePath, QTreeWidgetItem*& lastFileItem, QString& lastFilePath, int& occurrencesInFile, int& numOccurrences);
-  
-  // TODO: Support finding strings that go beyond a single line. So, make a SearchInDocumentText() instead.
-  void SearchInLine(
-      int line,
-      QString lineText,
-      bool& haveOccurrenceInFile,
-      QTreeWidgetItem*& lastLineItem,
-      std::vector<int>& occurrenceColumns,
-      const QDir& startDir,
-      const QString& filePath,
-      QTreeWidgetItem*& lastFileItem,
-      QString& lastFilePath,
-      int& occurrencesInFile,
-      int& numOccurrences);
+  /// Adds the occurrences in some files to the results tree.
+  void AddResults(const std::vector<FileSearchResult>& results);
+  
+  /// Jumps to the location of the occurrences of a line item in the results
+  /// tree.
+  void ResultActivated(const QModelIndex& index);
   
   void ReplaceInDocument(DocumentWidget* widget, const QString& replacementText);
-  void ReplaceInFile(const QString& filePath, const QString& replacementText, QString* errorMessages);
   
   
   QDockWidget* findAndReplaceInFilesDock = nullptr;
   QLabel* findAndReplaceResultsLabel;
   QLineEdit* findAndReplaceEdit;
   QPushButton* findAndReplaceReplaceButton;
-  QTreeWidget* findAndReplaceResultsTree;
+  QPushButton* findAndReplaceStopButton;
+  QTreeView* findAndReplaceResultsTree;
+  FindInFilesResultsModel* findAndReplaceResultsModel;
   
   /// Text that should be searched for.
   QString findText;
@@ -76,14 +86,27 @@ class FindAndReplaceInFiles : public QObject {
   /// Case sensitivity mode for the search.
   Qt::CaseSensitivity caseSensitivity;
   
+  /// If findText is a regular expression, the compiled expression, otherwise
+  /// null.
+  std::shared_ptr<TextRegex> regex;
+  
   /// Path of the root folder for the search.
   QString searchFolderPath;
   
-  /// Paths of all files in which the search / replace should be done.
-  std::vector<QString> filePaths;
+  /// The running (or last) background search.
+  std::shared_ptr<FileSearch> search;
+  
+  /// Timer which periodically calls PollSearchResults() while a search is
+  /// running.
+  QTimer searchResultsTimer;
+  
+  /// The running background replacement in the files that are not open, if
+  /// any.
+  std::shared_ptr<FileReplace> replace;
   
-  /// Paths of all files in which occurrences were found.
-  std::vector<QString> filesWithOccurrencesPaths;
+  /// Timer which periodically calls PollReplaceProgress() while the
+  /// replacement is running.
+  QTimer replaceProgressTimer;
   
   MainWindow* mainWindow;
 };
@@ -0,0 +1,266 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/find_in_files_results.h"
+
+#include <algorithm>
+
+#include <QApplication>
+#include <QDir>
+#include <QFile>
+#include <QPainter>
+
+#include "cide/file_search.h"
+
+/// Maximum number of files whose texts are kept for extracting line texts.
+/// The visible items usually span only a few files.
+constexpr int kMaxPreviewFiles = 8;
+
+/// Background color of the highlighted occurrences.
+static const QColor kOccurrenceBackgroundColor(0xef, 0xed, 0xec);
+
+FindInFilesResultsModel::FindInFilesResultsModel(QObject* parent)
+    : QAbstractItemModel(parent) {
+  fileFirstLine.push_back(0);
+  lineFirstRange.push_back(0);
+}
+
+void FindInFilesResultsModel::Clear(const QString& searchFolderPath, const std::unordered_map<QString, std::shared_ptr<const QByteArray>>& documentTexts) {
+  beginResetModel();
+  
+  this->searchFolderPath = searchFolderPath;
+  this->documentTexts = documentTexts;
+  
+  filePaths.clear();
+  fileFirstLine.assign(1, 0);
+  lineNumbers.clear();
+  lineFirstRange.assign(1, 0);
+  rangeColumns.clear();
+  rangeLengths.clear();
+  previewFiles.clear();
+  
+  endResetModel();
+}
+
+void FindInFilesResultsModel::AddResults(const std::vector<FileSearchResult>& results, int findTextSize) {
+  if (results.empty()) {
+    return;
+  }
+  
+  int firstNewFile = filePaths.size();
+  beginInsertRows(QModelIndex(), firstNewFile, firstNewFile + results.size() - 1);
+  
+  for (const FileSearchResult& result : results) {
+    filePaths.push_back(result.filePath);
+    
+    for (const FileSearchMatch& match : result.matches) {
+      lineNumbers.push_back(match.line);
+      for (int i = 0; i < match.columns.size(); ++ i) {
+        rangeColumns.push_back(match.columns[i]);
+        rangeLengths.push_back(match.lengths.empty() ? findTextSize : match.lengths[i]);
+      }
+      lineFirstRange.push_back(rangeColumns.size());
+    }
+    fileFirstLine.push_back(lineNumbers.size());
+  }
+  
+  endInsertRows();
+}
+
+int FindInFilesResultsModel::GetLine(const QModelIndex& index) const {
+  int fileIndex = index.internalId() - 1;
+  return lineNumbers[fileFirstLine[fileIndex] + index.row()];
+}
+
+QString FindInFilesResultsModel::GetLineText(const QModelIndex& index) const {
+  int fileIndex = index.internalId() - 1;
+  int lineIndex = lineNumbers[fileFirstLine[fileIndex] + index.row()] - 1;
+  
+  const PreviewFile& file = GetPreviewFile(fileIndex);
+  if (lineIndex >= static_cast<int>(file.lineStarts.size())) {
+    return QString();
+  }
+  
+  int start = file.lineStarts[lineIndex];
+  int end = (lineIndex + 1 < static_cast<int>(file.lineStarts.size())) ? file.lineStarts[lineIndex + 1] : file.text->size();
+  const char* data = file.text->constData();
+  if (end > start && data[end - 1] == '\n') {
+    -- end;
+  }
+  if (end > start && data[end - 1] == '\r') {
+    -- end;
+  }
+  return QString::fromUtf8(data + start, end - start);
+}
+
+void FindInFilesResultsModel::GetOccurrenceRanges(const QModelIndex& index, std::vector<std::pair<int, int>>* ranges) const {
+  int fileIndex = index.internalId() - 1;
+  int lineIndex = fileFirstLine[fileIndex] + index.row();
+  
+  ranges->clear();
+  for (int r = lineFirstRange[lineIndex]; r < lineFirstRange[lineIndex + 1]; ++ r) {
+    ranges->emplace_back(rangeColumns[r], rangeLengths[r]);
+  }
+}
+
+void FindInFilesResultsModel::GetFileInfo(const QModelIndex& index, QString* displayPath, int* numOccurrences) const {
+  int fileIndex = index.row();
+  *displayPath = QDir(searchFolderPath).relativeFilePath(filePaths[fileIndex]);
+  *numOccurrences = lineFirstRange[fileFirstLine[fileIndex + 1]] - lineFirstRange[fileFirstLine[fileIndex]];
+}
+
+QModelIndex FindInFilesResultsModel::index(int row, int column, const QModelIndex& parent) const {
+  if (!hasIndex(row, column, parent)) {
+    return QModelIndex();
+  }
+  // File items have the internal id 0, line items the index of their file
+  // plus one.
+  return createIndex(row, column, parent.isValid() ? static_cast<quintptr>(parent.row() + 1) : 0);
+}
+
+QModelIndex FindInFilesResultsModel::parent(const QModelIndex& index) const {
+  if (!IsLineItem(index)) {
+    return QModelIndex();
+  }
+  return createIndex(index.internalId() - 1, 0, static_cast<quintptr>(0));
+}
+
+int FindInFilesResultsModel::rowCount(const QModelIndex& parent) const {
+  if (!parent.isValid()) {
+    return filePaths.size();
+  } else if (IsLineItem(parent) || parent.column() != 0) {
+    return 0;
+  }
+  return fileFirstLine[parent.row() + 1] - fileFirstLine[parent.row()];
+}
+
+int FindInFilesResultsModel::columnCount(const QModelIndex& /*parent*/) const {
+  return 1;
+}
+
+QVariant FindInFilesResultsModel::data(const QModelIndex& index, int role) const {
+  if (!index.isValid()) {
+    return QVariant();
+  }
+  
+  if (!IsLineItem(index)) {
+    if (role == Qt::DisplayRole) {
+      QString displayPath;
+      int numOccurrences;
+      GetFileInfo(index, &displayPath, &numOccurrences);
+      return tr("%1: %2 matches").arg(displayPath).arg(numOccurrences);
+    }
+    return QVariant();
+  }
+  
+  if (role == Qt::DisplayRole) {
+    return tr("Line %1: %2").arg(GetLine(index)).arg(GetLineText(index));
+  } else if (role == Qt::UserRole) {
+    int fileIndex = index.internalId() - 1;
+    int lineIndex = fileFirstLine[fileIndex] + index.row();
+    return QStringLiteral("file://%1:%2:%3").arg(filePaths[fileIndex]).arg(lineNumbers[lineIndex]).arg(rangeColumns[lineFirstRange[lineIndex]] + 1);
+  }
+  return QVariant();
+}
+
+const FindInFilesResultsModel::PreviewFile& FindInFilesResultsModel::GetPreviewFile(int fileIndex) const {
+  for (auto it = previewFiles.begin(); it != previewFiles.end(); ++ it) {
+    if (it->fileIndex == fileIndex) {
+      previewFiles.splice(previewFiles.begin(), previewFiles, it);
+      return previewFiles.front();
+    }
+  }
+  
+  // Use the searched document text if there is one, such that the columns of
+  // the occurrences match. Otherwise, read the file.
+  previewFiles.emplace_front();
+  PreviewFile& file = previewFiles.front();
+  file.fileIndex = fileIndex;
+  auto textIt = documentTexts.find(filePaths[fileIndex]);
+  if (textIt != documentTexts.end()) {
+    file.text = textIt->second;
+  } else {
+    QFile qFile(filePaths[fileIndex]);
+    file.text.reset(new QByteArray(qFile.open(QIODevice::ReadOnly) ? qFile.readAll() : QByteArray()));
+  }
+  
+  const char* data = file.text->constData();
+  int size = file.text->size();
+  file.lineStarts.push_back(0);
+  for (int i = 0; i < size; ++ i) {
+    if (data[i] == '\n') {
+      file.lineStarts.push_back(i + 1);
+    }
+  }
+  
+  if (previewFiles.size() > kMaxPreviewFiles) {
+    previewFiles.pop_back();
+  }
+  return file;
+}
+
+
+void FindInFilesResultsDelegate::paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const {
+  const FindInFilesResultsModel* model = static_cast<const FindInFilesResultsModel*>(index.model());
+  
+  // Draw the item background (and selection) without text.
+  QStyleOptionViewItem itemOption = option;
+  initStyleOption(&itemOption, index);
+  itemOption.text = QString();
+  const QWidget* widget = option.widget;
+  QStyle* style = widget ? widget->style() : QApplication::style();
+  style->drawControl(QStyle::CE_ItemViewItem, &itemOption, painter, widget);
+  
+  QRect textRect = style->subElementRect(QStyle::SE_ItemViewItemText, &itemOption, widget);
+  painter->save();
+  painter->setClipRect(textRect);
+  
+  QFont normalFont = option.font;
+  QFont boldFont = option.font;
+  boldFont.setBold(true);
+  QColor textColor = option.palette.color(
+      (option.state & QStyle::State_Selected) ? QPalette::HighlightedText : QPalette::Text);
+  
+  int x = textRect.left();
+  auto drawSegment = [&](const QString& text, const QFont& font, const QColor& color, const QColor& backgroundColor) {
+    if (text.isEmpty()) {
+      return;
+    }
+    int width = QFontMetrics(font)./*horizontalAdvance*/ width(text);
+    QRect segmentRect(x, textRect.top(), width, textRect.height());
+    if (backgroundColor.isValid()) {
+      painter->fillRect(segmentRect, backgroundColor);
+    }
+    painter->setFont(font);
+    painter->setPen(color);
+    painter->drawText(segmentRect, Qt::AlignLeft | Qt::AlignVCenter | Qt::TextSingleLine, text);
+    x += width;
+  };
+  
+  if (model->IsLineItem(index)) {
+    drawSegment(tr("Line %1:").arg(model->GetLine(index)) + QStringLiteral(" "), normalFont, Qt::gray, QColor());
+    
+    QString lineText = model->GetLineText(index);
+    std::vector<std::pair<int, int>> ranges;
+    model->GetOccurrenceRanges(index, &ranges);
+    int cursor = 0;
+    for (const auto& range : ranges) {
+      // The ranges may be out of bounds if the file changed since the search.
+      int column = std::max(cursor, std::min<int>(range.first, lineText.size()));
+      int end = std::max(column, std::min<int>(range.first + range.second, lineText.size()));
+      drawSegment(lineText.mid(cursor, column - cursor), normalFont, textColor, QColor());
+      drawSegment(lineText.mid(column, end - column), boldFont, Qt::black, kOccurrenceBackgroundColor);
+      cursor = end;
+    }
+    drawSegment(lineText.mid(cursor), normalFont, textColor, QColor());
+  } else {
+    QString displayPath;
+    int numOccurrences;
+    model->GetFileInfo(index, &displayPath, &numOccurrences);
+    drawSegment(displayPath, boldFont, textColor, QColor());
+    drawSegment(tr(": %1 matches").arg(numOccurrences), normalFont, textColor, QColor());
+  }
+  
+  painter->restore();
+}
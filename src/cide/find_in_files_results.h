@@ -0,0 +1,123 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QAbstractItemModel>
+#include <QByteArray>
+#include <QString>
+#include <QStyledItemDelegate>
+
+#include "cide/util.h"
+
+struct FileSearchResult;
+
+/// Model for the results of a search in files, with one top-level item per
+/// file and one child item per line with occurrences. The results are stored
+/// in flat arrays (line ranges per file, line numbers, and column ranges)
+/// instead of one object per item, since a search for a common token may find
+/// millions of occurrences. The line texts are not stored; they are extracted
+/// from the searched text when an item's data is requested, which only happens
+/// for the visible items.
+class FindInFilesResultsModel : public QAbstractItemModel {
+ Q_OBJECT
+ public:
+  explicit FindInFilesResultsModel(QObject* parent = nullptr);
+  
+  /// Removes all results. @p searchFolderPath is used to display the file
+  /// paths relative to it. @p documentTexts maps the paths of documents whose
+  /// current text was searched (instead of the file on disk) to that text,
+  /// such that the line texts can be extracted from it.
+  void Clear(const QString& searchFolderPath, const std::unordered_map<QString, std::shared_ptr<const QByteArray>>& documentTexts);
+  
+  /// Appends the results for some files. @p findTextSize is the length of all
+  /// occurrences in matches that do not specify their lengths.
+  void AddResults(const std::vector<FileSearchResult>& results, int findTextSize);
+  
+  inline int GetNumFiles() const { return filePaths.size(); }
+  inline const QString& GetFilePath(int fileIndex) const { return filePaths[fileIndex]; }
+  
+  /// Returns the total number of occurrences in all files.
+  inline int GetNumOccurrences() const { return rangeColumns.size(); }
+  
+  /// Returns whether @p index refers to a line item (rather than a file item).
+  inline bool IsLineItem(const QModelIndex& index) const { return index.isValid() && index.internalId() != 0; }
+  
+  /// For a line item, returns its one-based line number.
+  int GetLine(const QModelIndex& index) const;
+  
+  /// For a line item, returns the text of the line (without the line ending).
+  QString GetLineText(const QModelIndex& index) const;
+  
+  /// For a line item, returns the (column, length) ranges of the occurrences
+  /// within the text returned by GetLineText().
+  void GetOccurrenceRanges(const QModelIndex& index, std::vector<std::pair<int, int>>* ranges) const;
+  
+  /// For a file item, returns its path relative to the search folder, and
+  /// the number of occurrences in the file.
+  void GetFileInfo(const QModelIndex& index, QString* displayPath, int* numOccurrences) const;
+  
+  QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex()) const override;
+  QModelIndex parent(const QModelIndex& index) const override;
+  int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+  int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+  
+  /// Returns the displayed text for Qt::DisplayRole, and for line items, the
+  /// location string of the first occurrence (for
+  /// MainWindow::GotoDocumentLocation()) for Qt::UserRole.
+  QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+  
+ private:
+  /// Text of a file whose line texts were requested recently.
+  struct PreviewFile {
+    int fileIndex;
+    std::shared_ptr<const QByteArray> text;
+    
+    /// Offset of the start of each line in text.
+    std::vector<int> lineStarts;
+  };
+  
+  /// Returns the text of the file with the given index, reading it if it is
+  /// not in previewFiles.
+  const PreviewFile& GetPreviewFile(int fileIndex) const;
+  
+  QString searchFolderPath;
+  std::unordered_map<QString, std::shared_ptr<const QByteArray>> documentTexts;
+  
+  /// Per file: its path, and the index of its first line in the line arrays.
+  /// fileFirstLine has an additional entry at the end, such that the lines of
+  /// file i are in [fileFirstLine[i], fileFirstLine[i + 1]).
+  std::vector<QString> filePaths;
+  std::vector<int> fileFirstLine;
+  
+  /// Per line with occurrences: the one-based line number, and the index of
+  /// its first occurrence in the range arrays. lineFirstRange has an
+  /// additional entry at the end.
+  std::vector<int> lineNumbers;
+  std::vector<int> lineFirstRange;
+  
+  /// Per occurrence: its column and length within the line text.
+  std::vector<int> rangeColumns;
+  std::vector<int> rangeLengths;
+  
+  /// Files whose line texts were requested recently, ordered from the most
+  /// recently to the least recently used one.
+  mutable std::list<PreviewFile> previewFiles;
+};
+
+/// Draws the items of a FindInFilesResultsModel, highlighting the occurrences
+/// in the line texts.
+class FindInFilesResultsDelegate : public QStyledItemDelegate {
+ Q_OBJECT
+ public:
+  inline FindInFilesResultsDelegate(QObject* parent = nullptr)
+      : QStyledItemDelegate(parent) {}
+  
+  void paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+};
@@ -0,0 +1,273 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/gdb_mi_parser.h"
+
+bool GDBMIRecord::Parse(QByteArray* line) {
+  mText.swap(*line);
+  // C strings are unescaped in place, so the text must not be shared with
+  // another QByteArray. Detach once here such that pointers into it stay valid.
+  mText.detach();
+  mNodes.clear();
+  mToken = -1;
+  mType = 0;
+  mClassOffset = 0;
+  mClassSize = 0;
+  
+  const int size = mText.size();
+  const char* data = mText.constData();
+  
+  // The root node holds the results of the record.
+  AddNode(ValueType::Tuple, 0, 0);
+  
+  // Handle the "(gdb) " prompt (possibly without the trailing space).
+  if (mText.startsWith("(gdb)")) {
+    return true;
+  }
+  
+  // Check for a numerical token (sequence of digits)
+  int cursor = 0;
+  while (cursor < size && data[cursor] >= '0' && data[cursor] <= '9') {
+    mToken = ((mToken == -1) ? 0 : (10 * mToken)) + (data[cursor] - '0');
+    ++ cursor;
+  }
+  if (cursor >= size) {
+    return false;
+  }
+  
+  mType = data[cursor];
+  ++ cursor;
+  
+  int lastChild = -1;
+  if (mType == '&' || mType == '@' || mType == '~') {
+    // Read C string
+    if (cursor >= size || data[cursor] != '"') {
+      return false;
+    }
+    int child = AddNode(ValueType::String, cursor, 0);
+    int valueOffset;
+    int valueSize;
+    if (!ReadCString(&cursor, &valueOffset, &valueSize)) {
+      return false;
+    }
+    mNodes[child].valueOffset = valueOffset;
+    mNodes[child].valueSize = valueSize;
+    AppendChild(root(), child, &lastChild);
+    return true;
+  } else if (mType == '=' || mType == '*' || mType == '+' || mType == '^') {
+    // Read the async or result class until the line end or comma
+    mClassOffset = cursor;
+    while (cursor < size && data[cursor] != ',') {
+      ++ cursor;
+    }
+    mClassSize = cursor - mClassOffset;
+    
+    if (mType == '^') {
+      // For this type of message, the set of possible result classes is well-known.
+      if (!IsClass("done") &&
+          !IsClass("running") &&
+          !IsClass("connected") &&
+          !IsClass("error") &&
+          !IsClass("exit")) {
+        return false;
+      }
+    }
+    
+    // Parse the results (variable = value), separated by commas.
+    while (cursor < size) {
+      ++ cursor;  // jump over the comma
+      if (!ReadResult(root(), &cursor, &lastChild)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  return false;
+}
+
+int GDBMIRecord::Find(int index, const char* key) const {
+  for (int child = mNodes[index].firstChild; child != -1; child = mNodes[child].nextSibling) {
+    if (IsKey(child, key)) {
+      return child;
+    }
+  }
+  return -1;
+}
+
+int GDBMIRecord::LastChild(int index) const {
+  int result = -1;
+  for (int child = mNodes[index].firstChild; child != -1; child = mNodes[child].nextSibling) {
+    result = child;
+  }
+  return result;
+}
+
+int GDBMIRecord::IntValue(int index, int defaultValue) const {
+  const Node& n = mNodes[index];
+  if (n.type != ValueType::String) {
+    return defaultValue;
+  }
+  bool ok;
+  int value = QByteArray::fromRawData(mText.constData() + n.valueOffset, n.valueSize).toInt(&ok);
+  return ok ? value : defaultValue;
+}
+
+QString GDBMIRecord::ChildString(int index, const char* key) const {
+  int child = Find(index, key);
+  return (child == -1) ? QString() : StringValue(child);
+}
+
+int GDBMIRecord::ChildInt(int index, const char* key, int defaultValue) const {
+  int child = Find(index, key);
+  return (child == -1) ? defaultValue : IntValue(child, defaultValue);
+}
+
+int GDBMIRecord::AddNode(ValueType type, int keyOffset, int keySize) {
+  mNodes.emplace_back();
+  Node& n = mNodes.back();
+  n.type = type;
+  n.keyOffset = keyOffset;
+  n.keySize = keySize;
+  n.valueOffset = 0;
+  n.valueSize = 0;
+  n.firstChild = -1;
+  n.nextSibling = -1;
+  n.childCount = 0;
+  return mNodes.size() - 1;
+}
+
+void GDBMIRecord::AppendChild(int parent, int child, int* lastChild) {
+  if (*lastChild == -1) {
+    mNodes[parent].firstChild = child;
+  } else {
+    mNodes[*lastChild].nextSibling = child;
+  }
+  ++ mNodes[parent].childCount;
+  *lastChild = child;
+}
+
+bool GDBMIRecord::ReadResult(int parent, int* cursor, int* lastChild) {
+  const int size = mText.size();
+  const char* data = mText.constData();
+  
+  // Read variable name
+  int keyOffset = *cursor;
+  while (*cursor < size && data[*cursor] != '=') {
+    ++ *cursor;
+  }
+  if (*cursor >= size) {
+    return false;
+  }
+  int child = AddNode(ValueType::String, keyOffset, *cursor - keyOffset);
+  ++ *cursor;
+  
+  // Read value
+  if (!ReadValue(child, cursor)) {
+    return false;
+  }
+  AppendChild(parent, child, lastChild);
+  return true;
+}
+
+bool GDBMIRecord::ReadValue(int index, int* cursor) {
+  const int size = mText.size();
+  if (*cursor >= size) {
+    return false;
+  }
+  char c = mText.constData()[*cursor];
+  
+  if (c == '"') {
+    mNodes[index].type = ValueType::String;
+    int valueOffset;
+    int valueSize;
+    if (!ReadCString(cursor, &valueOffset, &valueSize)) {
+      return false;
+    }
+    mNodes[index].valueOffset = valueOffset;
+    mNodes[index].valueSize = valueSize;
+    return true;
+  } else if (c == '{' || c == '[') {
+    mNodes[index].type = (c == '{') ? ValueType::Tuple : ValueType::List;
+    char endChar = (c == '{') ? '}' : ']';
+    
+    // Read a value list or result list
+    ++ *cursor;
+    int lastChild = -1;
+    while (*cursor < size) {
+      c = mText.constData()[*cursor];
+      if (c == endChar) {
+        // End of list
+        ++ *cursor;
+        return true;
+      } else if (c == ',') {
+        // Read the next item in a list
+        ++ *cursor;
+      } else if (c == '"' || c == '{' || c == '[') {
+        // Read a value list item
+        int child = AddNode(ValueType::String, *cursor, 0);
+        if (!ReadValue(child, cursor)) {
+          return false;
+        }
+        AppendChild(index, child, &lastChild);
+      } else if (QChar::fromLatin1(c).isLetter()) {
+        // Read a result list item
+        if (!ReadResult(index, cursor, &lastChild)) {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    
+    // End of list/tuple missing
+    return false;
+  }
+  
+  return false;
+}
+
+bool GDBMIRecord::ReadCString(int* cursor, int* valueOffset, int* valueSize) {
+  const int size = mText.size();
+  char* data = mText.data();
+  
+  ++ *cursor;  // jump over the opening quote
+  *valueOffset = *cursor;
+  int writePos = *cursor;
+  while (*cursor < size && data[*cursor] != '"') {
+    if (data[*cursor] == '\\' && *cursor < size - 1) {
+      char escaped = data[*cursor + 1];
+      *cursor += 2;
+      if (escaped == 'n') {
+        data[writePos] = '\n';
+      } else if (escaped == 't') {
+        data[writePos] = '\t';
+      } else if (escaped == 'r') {
+        data[writePos] = '\r';
+      } else if (escaped >= '0' && escaped <= '7') {
+        // Octal escape with up to three digits
+        int value = escaped - '0';
+        for (int i = 0; i < 2 && *cursor < size && data[*cursor] >= '0' && data[*cursor] <= '7'; ++ i) {
+          value = 8 * value + (data[*cursor] - '0');
+          ++ *cursor;
+        }
+        data[writePos] = static_cast<char>(value);
+      } else {
+        data[writePos] = escaped;
+      }
+      ++ writePos;
+      continue;
+    }
+    data[writePos] = data[*cursor];
+    ++ writePos;
+    ++ *cursor;
+  }
+  if (*cursor >= size) {
+    // Unexpected end of C string
+    return false;
+  }
+  ++ *cursor;  // jump over the closing quote
+  *valueSize = writePos - *valueOffset;
+  return true;
+}
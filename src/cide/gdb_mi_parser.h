@@ -0,0 +1,150 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+/// A parsed line of GDB/MI output, see:
+/// https://sourceware.org/gdb/onlinedocs/gdb/GDB_002fMI-Output-Syntax.html
+///
+/// The record keeps the line text and refers to keys and values by offsets
+/// into it, instead of copying them. C strings are unescaped in place, which is
+/// possible since unescaping never makes a string longer. The values form a
+/// tree whose nodes are stored in a single vector, with the root node (index 0)
+/// being the tuple of results that follow the async or result class.
+///
+/// A record can be re-used for parsing many lines. This keeps the allocated
+/// memory of the line and of the node vector, such that parsing a line usually
+/// does not allocate memory at all.
+class GDBMIRecord {
+ public:
+  enum class ValueType {
+    String = 0,
+    Tuple,
+    List
+  };
+  
+  /// A value in the record tree. Children of tuples and lists are linked via
+  /// firstChild and nextSibling.
+  struct Node {
+    ValueType type;
+    
+    /// Key of the value within the record text. For values in lists that are
+    /// not results, keySize is zero.
+    int keyOffset;
+    int keySize;
+    
+    /// For strings, the (unescaped) value within the record text.
+    int valueOffset;
+    int valueSize;
+    
+    /// Index of the first child node (for tuples and lists), or -1.
+    int firstChild;
+    
+    /// Index of the next node within the same tuple or list, or -1.
+    int nextSibling;
+    
+    /// Number of children (for tuples and lists).
+    int childCount;
+  };
+  
+  /// Parses the given line (without line ending) into this record, taking
+  /// over the line's memory (the object pointed to by @p line receives the old
+  /// memory of the record, which allows to re-use it for reading the next line).
+  /// Returns true if successful. The record contents are undefined otherwise.
+  bool Parse(QByteArray* line);
+  
+  /// Returns the record text. Note that C strings within it are unescaped.
+  inline const QByteArray& text() const { return mText; }
+  
+  /// Returns the numerical token that preceded the record, or -1 if there was
+  /// none.
+  inline int token() const { return mToken; }
+  
+  /// Returns the character indicating the type of the record:
+  /// - '&' GDB internal log, '@' target output, '~' console output. For these,
+  ///   the root node has a single string child with the C string.
+  /// - '=' asynchronous notification, '*' asynchronous execution state change,
+  ///   '+' asynchronous status output, '^' response to a command.
+  /// - 0 for the "(gdb) " prompt.
+  inline char type() const { return mType; }
+  
+  /// Returns the async or result class (for example "done" or "stopped") as
+  /// a view into the record text.
+  inline QByteArray asyncOrResultClass() const { return QByteArray::fromRawData(mText.constData() + mClassOffset, mClassSize); }
+  
+  inline bool IsClass(const char* name) const { return Equals(mClassOffset, mClassSize, name); }
+  
+  inline int root() const { return 0; }
+  
+  inline const Node& node(int index) const { return mNodes[index]; }
+  inline int nodeCount() const { return mNodes.size(); }
+  
+  inline int FirstChild(int index) const { return mNodes[index].firstChild; }
+  inline int NextSibling(int index) const { return mNodes[index].nextSibling; }
+  
+  /// Returns the index of the first child of @p index with the given key, or
+  /// -1 if there is none.
+  int Find(int index, const char* key) const;
+  
+  /// Returns the index of the last child of @p index, or -1 if there is none.
+  int LastChild(int index) const;
+  
+  inline bool IsKey(int index, const char* key) const { return Equals(mNodes[index].keyOffset, mNodes[index].keySize, key); }
+  
+  /// Returns the key of the node as a view into the record text. The view
+  /// becomes invalid when the record is re-used.
+  inline QByteArray Key(int index) const { return QByteArray::fromRawData(mText.constData() + mNodes[index].keyOffset, mNodes[index].keySize); }
+  
+  /// Returns the string value of the node as a view into the record text. The
+  /// view becomes invalid when the record is re-used.
+  inline QByteArray Value(int index) const { return QByteArray::fromRawData(mText.constData() + mNodes[index].valueOffset, mNodes[index].valueSize); }
+  
+  /// Returns the string value of the node, decoded from UTF-8.
+  inline QString StringValue(int index) const { return QString::fromUtf8(mText.constData() + mNodes[index].valueOffset, mNodes[index].valueSize); }
+  
+  /// Returns the string value of the node parsed as an integer, or
+  /// @p defaultValue if it is not an integer.
+  int IntValue(int index, int defaultValue = -1) const;
+  
+  /// Convenience functions returning the value of the child of @p index with
+  /// the given key, or an empty string / @p defaultValue if there is no such
+  /// child.
+  QString ChildString(int index, const char* key) const;
+  int ChildInt(int index, const char* key, int defaultValue = -1) const;
+  
+ private:
+  inline bool Equals(int offset, int size, const char* str) const {
+    return static_cast<int>(strlen(str)) == size && memcmp(mText.constData() + offset, str, size) == 0;
+  }
+  
+  int AddNode(ValueType type, int keyOffset, int keySize);
+  
+  /// Parses a result (key=value) starting at *cursor and adds it as a child
+  /// of @p parent.
+  bool ReadResult(int parent, int* cursor, int* lastChild);
+  
+  /// Parses a value starting at *cursor into the node @p index.
+  bool ReadValue(int index, int* cursor);
+  
+  /// Parses a C string starting at *cursor (on the opening quote) and
+  /// unescapes it in place.
+  bool ReadCString(int* cursor, int* valueOffset, int* valueSize);
+  
+  void AppendChild(int parent, int child, int* lastChild);
+  
+  
+  QByteArray mText;
+  std::vector<Node> mNodes;
+  
+  int mToken = -1;
+  char mType = 0;
+  int mClassOffset = 0;
+  int mClassSize = 0;
+};
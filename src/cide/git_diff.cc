@@ -4,13 +4,394 @@
 
 #include "cide/git_diff.h"
 
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+
 #include <git2.h>
 
+#include "cide/cpu_budget.h"
 #include "cide/document.h"
 #include "cide/document_widget.h"
 #include "cide/main_window.h"
+#include "cide/performance_profile.h"
 #include "cide/qt_thread.h"
 #include "cide/scroll_bar_minimap.h"
+#include "cide/settings.h"
+#include "cide/util.h"
+
+/// Maximum number of file blobs that are cached per repository. If more would
+/// be cached, the cache is cleared.
+constexpr int kMaxCachedBlobsPerRepository = 128;
+
+/// Number of unchanged lines around the edited lines that are included in
+/// incremental diffs.
+constexpr int kIncrementalDiffContextLines = 3;
+
+/// Number of lines above and below the visible lines that are included when
+/// blaming the visible part of a file first.
+constexpr int kVisibleBlameContextLines = 20;
+
+/// A blob of a file in the HEAD tree of a repository. It is also the
+/// LineDiffBase of the documents that were diffed against it, such that the
+/// removed text of their diffs is only fetched from the blob when it is
+/// displayed. It is not modified after its creation, so it may be accessed
+/// from any thread.
+struct CachedBlob : public LineDiffBase {
+  /// Looks up the line starts. Must be called once after setting the blob.
+  void Initialize() {
+    if (!blob) {
+      return;
+    }
+    const char* content = static_cast<const char*>(git_blob_rawcontent(blob.get()));
+    int size = git_blob_rawsize(blob.get());
+    lineStarts.push_back(0);
+    for (int i = 0; i < size; ++ i) {
+      if (content[i] == '\n') {
+        lineStarts.push_back(i + 1);
+      }
+    }
+  }
+  
+  /// Returns the byte offsets of the starts of all lines in the blob.
+  inline const std::vector<int>& GetLineStarts() const { return lineStarts; }
+  
+  QString GetLines(int firstLine, int numLines) const override {
+    if (!blob || firstLine < 0 || firstLine >= lineStarts.size() || numLines <= 0) {
+      return QString();
+    }
+    const char* content = static_cast<const char*>(git_blob_rawcontent(blob.get()));
+    int start = lineStarts[firstLine];
+    int end = (firstLine + numLines < lineStarts.size()) ?
+              lineStarts[firstLine + numLines] :
+              static_cast<int>(git_blob_rawsize(blob.get()));
+    return QString::fromUtf8(content + start, end - start);  // TODO: Use the document's encoding setting (if we add such a setting)
+  }
+  
+  /// The repository that the blob belongs to. The blob must not be accessed
+  /// after the repository has been freed, so documents that keep the blob as
+  /// their LineDiffBase also keep the repository.
+  std::shared_ptr<git_repository> repo;
+  
+  /// The blob. May be null if the file is not in the tree.
+  std::shared_ptr<git_blob> blob;
+  
+  /// Byte offsets of the line starts in the blob. Empty if blob is null.
+  std::vector<int> lineStarts;
+};
+
+/// A range of lines in the HEAD version of a file, together with the commit
+/// that last changed them.
+struct BlameHunk {
+  int firstOldLine;
+  int numLines;
+  QString commitId;
+  QString author;
+  qint64 time;
+};
+
+/// The result of blaming a file in the HEAD tree of a repository.
+struct CachedBlame {
+  /// The hunks, sorted by their first line.
+  std::vector<BlameHunk> hunks;
+  
+  /// Whether the hunks cover the whole file. If false, they only cover the
+  /// lines that were visible when the blame was requested.
+  bool complete = false;
+};
+
+struct GitDiff::CachedRepository {
+  /// Returns the blob for the file at @p relativePath in the HEAD tree. Its
+  /// blob pointer is null if the file is not in the tree.
+  std::shared_ptr<CachedBlob> GetHeadBlob(const QByteArray& relativePath) {
+    auto it = headBlobs.find(relativePath);
+    if (it != headBlobs.end()) {
+      return it->second;
+    }
+    
+    if (headBlobs.size() >= kMaxCachedBlobsPerRepository) {
+      headBlobs.clear();
+    }
+    
+    git_blob* blob = nullptr;
+    git_tree_entry* entry = nullptr;
+    int result = git_tree_entry_bypath(&entry, headTree.get(), relativePath);
+    std::shared_ptr<git_tree_entry> entry_deleter(entry, [&](git_tree_entry* entry){ git_tree_entry_free(entry); });
+    if (result == 0) {
+      git_object_t entryType = git_tree_entry_type(entry);
+      if (entryType == GIT_OBJECT_BLOB) {
+        result = git_blob_lookup(&blob, repo.get(), git_tree_entry_id(entry));
+        if (result != 0) {
+          blob = nullptr;
+        }
+      }
+    }
+    
+    std::shared_ptr<CachedBlob> cachedBlob(new CachedBlob());
+    cachedBlob->repo = repo;
+    cachedBlob->blob.reset(blob, [](git_blob* blob){ git_blob_free(blob); });
+    cachedBlob->Initialize();
+    headBlobs[relativePath] = cachedBlob;
+    return cachedBlob;
+  }
+  
+  std::shared_ptr<git_repository> repo;
+  QDir workdir;
+  
+  /// ID of the commit that HEAD pointed to when headTree was looked up.
+  git_oid headCommitId;
+  std::shared_ptr<git_tree> headTree;
+  
+  /// Maps the relative path of files to their blobs in headTree.
+  std::unordered_map<QByteArray, std::shared_ptr<CachedBlob>> headBlobs;
+  
+  /// Maps the relative path of files to their blame at the HEAD commit.
+  std::unordered_map<QByteArray, std::shared_ptr<CachedBlame>> headBlames;
+};
+
+struct GitDiff::IncrementalDiffState {
+  /// The diffLines() of this document ...
+  std::weak_ptr<Document> document;
+  
+  /// ... were computed for this Document::textChangeCounter() ...
+  int textChangeCounter;
+  
+  /// ... with this number of lines in the document ...
+  int lineCount;
+  
+  /// ... against this file in the HEAD commit of this repository.
+  std::weak_ptr<CachedRepository> repository;
+  git_oid headCommitId;
+  QByteArray fileRelativePath;
+};
+
+/// Range of lines that is re-diffed for an incremental diff, see
+/// ComputeIncrementalDiffWindow().
+struct IncrementalDiffWindow {
+  /// Range of lines [firstLine, endLine) in the current document that is
+  /// re-diffed. Lines before it are unchanged, lines after it are shifted by
+  /// lineCountDelta.
+  int firstLine;
+  int endLine;
+  
+  /// The exclusive end line of the range in the version of the document that
+  /// the previous diff was computed for.
+  int previousEndLine;
+  
+  int lineCountDelta;
+  
+  /// Range [firstOldLine, endOldLine) of lines in the HEAD version of the file
+  /// that corresponds to the window. endOldLine is -1 if the window extends to
+  /// the end of the file.
+  int firstOldLine;
+  int endOldLine;
+  
+  /// The UTF-8 text of the lines in the window.
+  QByteArray text;
+  
+  /// The result of the previous diff.
+  std::vector<LineDiff> previousDiffLines;
+};
+
+/// Returns the range of document lines [start, end) that @p diff is displayed
+/// at. Removals are treated as covering the line that they are displayed on.
+static void GetLineDiffSpan(const LineDiff& diff, int* start, int* end) {
+  *start = diff.line;
+  *end = diff.line + std::max(1, diff.numLines);
+}
+
+/// Computes the window of lines that needs to be re-diffed to update the
+/// document's diffLines() from the version with the given text change counter
+/// and line count to its current version. Must be called in the Qt thread.
+/// Returns false if an incremental diff is not possible, for example because
+/// the edits since the previous diff are not known.
+static bool ComputeIncrementalDiffWindow(Document* document, int previousTextChangeCounter, int previousLineCount, IncrementalDiffWindow* window) {
+  std::vector<TextReplacement> replacements;
+  if (!document->GetTextReplacementsSince(previousTextChangeCounter, &replacements)) {
+    return false;
+  }
+  
+  // Determine the range of characters in the current document that was
+  // affected by the replacements.
+  DocumentRange changedRange = DocumentRange::Invalid();
+  for (const TextReplacement& replacement : replacements) {
+    DocumentRange newTextRange(replacement.oldRange.start, replacement.oldRange.start + replacement.newTextSize);
+    if (changedRange.IsInvalid()) {
+      changedRange = newTextRange;
+    } else {
+      changedRange = DocumentRange(
+          std::min(replacement.MapLocation(changedRange.start), newTextRange.start),
+          std::max(replacement.MapLocation(changedRange.end), newTextRange.end));
+    }
+  }
+  
+  int lineCount = document->LineCount();
+  window->lineCountDelta = lineCount - previousLineCount;
+  window->previousDiffLines = document->diffLines();
+  
+  // Extend the edited lines by some context, and such that they do not
+  // partially cover any of the previous line diffs.
+  int firstLine = 0;
+  int previousEndLine = previousLineCount;
+  if (changedRange.IsValid()) {
+    firstLine = std::max(0, document->LineForLocation(changedRange.start) - kIncrementalDiffContextLines);
+    previousEndLine = std::min(previousLineCount, document->LineForLocation(changedRange.end) + 1 - window->lineCountDelta + kIncrementalDiffContextLines);
+  }
+  if (previousEndLine < firstLine) {
+    return false;
+  }
+  
+  bool windowChanged = true;
+  while (windowChanged) {
+    windowChanged = false;
+    for (const LineDiff& diff : window->previousDiffLines) {
+      int spanStart, spanEnd;
+      GetLineDiffSpan(diff, &spanStart, &spanEnd);
+      if (spanEnd > firstLine && spanStart < previousEndLine &&
+          (spanStart < firstLine || spanEnd > previousEndLine)) {
+        firstLine = std::min(firstLine, spanStart);
+        previousEndLine = std::max(previousEndLine, spanEnd);
+        windowChanged = true;
+      }
+    }
+  }
+  
+  window->firstLine = firstLine;
+  window->previousEndLine = previousEndLine;
+  bool windowReachesEnd = previousEndLine >= previousLineCount;
+  window->endLine = windowReachesEnd ? lineCount : (previousEndLine + window->lineCountDelta);
+  
+  // Determine the corresponding lines in the HEAD version of the file. Outside
+  // of the line diffs, the lines are shifted by the number of removed minus the
+  // number of added lines before them.
+  window->firstOldLine = firstLine;
+  window->endOldLine = previousEndLine;
+  for (const LineDiff& diff : window->previousDiffLines) {
+    int spanStart, spanEnd;
+    GetLineDiffSpan(diff, &spanStart, &spanEnd);
+    int addedLines = (diff.type == LineDiff::Type::Removed) ? 0 : diff.numLines;
+    int removedLines = (diff.type == LineDiff::Type::Added) ? 0 : diff.numRemovedLines;
+    if (spanEnd <= firstLine) {
+      window->firstOldLine += removedLines - addedLines;
+    }
+    if (spanEnd <= previousEndLine) {
+      window->endOldLine += removedLines - addedLines;
+    }
+  }
+  if (windowReachesEnd) {
+    window->endOldLine = -1;
+  }
+  
+  // Get the text of the window.
+  DocumentLocation textStart = Document::LineIterator(document, firstLine).GetLineStart();
+  DocumentLocation textEnd = windowReachesEnd ? document->FullDocumentRange().end : Document::LineIterator(document, window->endLine).GetLineStart();
+  window->text = document->TextForRange(DocumentRange(textStart, textEnd)).toUtf8();
+  return true;
+}
+
+/// Returns the line in the HEAD version of a file that corresponds to the
+/// given @p line of the current document version, as given by @p diffLines.
+/// For added or modified lines, an approximate line is returned.
+static int MapDocumentLineToOldLine(int line, const std::vector<LineDiff>& diffLines) {
+  int oldLine = line;
+  for (const LineDiff& diff : diffLines) {
+    int spanStart, spanEnd;
+    GetLineDiffSpan(diff, &spanStart, &spanEnd);
+    if (spanEnd > line) {
+      break;
+    }
+    int addedLines = (diff.type == LineDiff::Type::Removed) ? 0 : diff.numLines;
+    int removedLines = (diff.type == LineDiff::Type::Added) ? 0 : diff.numRemovedLines;
+    oldLine += removedLines - addedLines;
+  }
+  return std::max(0, oldLine);
+}
+
+/// Maps the blame @p hunks, which refer to lines in the HEAD version of a
+/// file, to the current version of the document by shifting them through
+/// @p diffLines, in the same way as ComputeIncrementalDiffWindow() does for the
+/// line diffs. Lines that were added or modified since HEAD get no blame.
+static void MapBlameToDocument(const std::vector<BlameHunk>& hunks, const std::vector<LineDiff>& diffLines, int documentNumLines, std::vector<LineBlame>* result) {
+  result->clear();
+  if (hunks.empty()) {
+    return;
+  }
+  
+  // Maps the unchanged document lines [firstLine, endLine), which correspond
+  // to the old lines starting at firstOldLine.
+  int hunkIndex = 0;
+  auto mapUnchangedLines = [&](int firstLine, int endLine, int firstOldLine) {
+    int endOldLine = firstOldLine + endLine - firstLine;
+    while (hunkIndex < hunks.size() &&
+           hunks[hunkIndex].firstOldLine + hunks[hunkIndex].numLines <= firstOldLine) {
+      ++ hunkIndex;
+    }
+    for (int i = hunkIndex; i < hunks.size() && hunks[i].firstOldLine < endOldLine; ++ i) {
+      const BlameHunk& hunk = hunks[i];
+      int start = std::max(firstOldLine, hunk.firstOldLine);
+      int end = std::min(endOldLine, hunk.firstOldLine + hunk.numLines);
+      result->emplace_back(firstLine + start - firstOldLine, end - start, hunk.commitId, hunk.author, hunk.time);
+    }
+  };
+  
+  int line = 0;
+  int oldLine = 0;
+  for (const LineDiff& diff : diffLines) {
+    if (diff.line > line) {
+      mapUnchangedLines(line, diff.line, oldLine);
+      oldLine += diff.line - line;
+      line = diff.line;
+    }
+    if (diff.type != LineDiff::Type::Removed) {
+      line = std::max(line, diff.line + diff.numLines);
+    }
+    if (diff.type != LineDiff::Type::Added) {
+      oldLine += diff.numRemovedLines;
+    }
+  }
+  if (line < documentNumLines) {
+    mapUnchangedLines(line, documentNumLines, oldLine);
+  }
+}
+
+/// Runs git blame for the file at @p relativePath as of the commit
+/// @p headCommitId, restricted to the lines [firstOldLine, endOldLine) unless
+/// endOldLine is negative. Returns false on failure.
+static bool BlameFile(git_repository* repo, const git_oid& headCommitId, const QByteArray& relativePath, int firstOldLine, int endOldLine, std::vector<BlameHunk>* hunks) {
+  git_blame_options options = GIT_BLAME_OPTIONS_INIT;
+  options.newest_commit = headCommitId;
+  if (endOldLine >= 0) {
+    options.min_line = firstOldLine + 1;
+    options.max_line = endOldLine;
+  }
+  
+  git_blame* blame = nullptr;
+  if (git_blame_file(&blame, repo, relativePath.constData(), &options) != 0) {
+    qDebug() << "GitDiff: git_blame_file() failed.";
+    return false;
+  }
+  std::shared_ptr<git_blame> blame_deleter(blame, [](git_blame* blame){ git_blame_free(blame); });
+  
+  int hunkCount = git_blame_get_hunk_count(blame);
+  hunks->resize(hunkCount);
+  for (int i = 0; i < hunkCount; ++ i) {
+    const git_blame_hunk* hunk = git_blame_get_hunk_byindex(blame, i);
+    BlameHunk& result = hunks->at(i);
+    result.firstOldLine = hunk->final_start_line_number - 1;
+    result.numLines = hunk->lines_in_hunk;
+    
+    char commitId[8];
+    git_oid_tostr(commitId, sizeof(commitId), &hunk->final_commit_id);
+    result.commitId = QString::fromLatin1(commitId);
+    if (hunk->final_signature) {
+      result.author = QString::fromUtf8(hunk->final_signature->name);
+      result.time = hunk->final_signature->when.time;
+    } else {
+      result.time = 0;
+    }
+  }
+  return true;
+}
 
 GitDiff& GitDiff::Instance() {
   static GitDiff instance;
@@ -49,6 +430,10 @@ void GitDiff::WidgetRemoved(DocumentWidget* widget) {
   }
 }
 
+void GitDiff::InvalidateCache() {
+  cacheInvalidated = true;
+}
+
 void GitDiff::Exit() {
   mExit = true;
   newDiffRequestCondition.notify_all();
@@ -60,6 +445,7 @@ void GitDiff::Exit() {
 
 GitDiff::GitDiff() {
   mExit = false;
+  cacheInvalidated = false;
   mThread.reset(new std::thread(&GitDiff::ThreadMain, this));
 }
 
@@ -80,12 +466,30 @@ void GitDiff::ThreadMain() {
         return;
       }
     }
+    
+    // Depending on the performance profile, wait for further edits before
+    // diffing. Repeated requests for a document do not queue up (see
+    // RequestDiff()), so the edits are diffed together.
+    int delayMilliseconds = GetPerformanceProfileParameters().gitDiffDelayMilliseconds;
+    if (delayMilliseconds > 0) {
+      auto delayEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMilliseconds);
+      while (!mExit && std::chrono::steady_clock::now() < delayEnd) {
+        newDiffRequestCondition.wait_until(lock, delayEnd);
+      }
+      if (mExit) {
+        return;
+      }
+    }
+    
     DiffRequest request = newDiffRequests.front();
     newDiffRequests.erase(newDiffRequests.begin());
     documentBeingDiffed = request.document;
     lock.unlock();
     
-    CreateDiff(request);
+    CPUBudgetScope budgetScope(CPUBudget::QoS::Normal, &mExit);
+    if (budgetScope.acquired()) {
+      CreateDiff(request);
+    }
   }
 }
 
@@ -118,7 +522,7 @@ int GitDiffLineCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* /*
           LineDiff::Type::Added,
           line->new_lineno - 1,
           line->num_lines,
-          QStringLiteral(""));
+          -1);
     }
     
     status->newToOldLineOffset -= line->num_lines;
@@ -130,15 +534,15 @@ int GitDiffLineCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* /*
     if (!status->result.empty() &&
         status->result.back().type == LineDiff::Type::Removed &&
         status->result.back().line == showAtLine) {
-      // Merge into the existing LineDiff.
-      status->result.back().oldText += QString::fromUtf8(line->content, line->content_len);
+      // Merge into the existing LineDiff. The removed text is not copied here,
+      // but looked up from the old lines if it gets displayed.
       ++ status->result.back().numRemovedLines;
     } else {
       status->result.emplace_back(
           LineDiff::Type::Removed,
           showAtLine,
           1,
-          QString::fromUtf8(line->content, line->content_len));  // TODO: Use the document's encoding setting (if we add such a setting)
+          line->old_lineno - 1);
       status->result.back().numRemovedLines = line->num_lines;
     }
     
@@ -149,16 +553,14 @@ int GitDiffLineCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* /*
     if (!status->result.empty() &&
         status->result.back().line == status->documentNumLines - 1) {
       status->result.back().type = LineDiff::Type::Modified;
-      if (!status->result.back().oldText.endsWith('\n')) {
-        status->result.back().oldText += '\n';
-      }
-      status->result.back().oldText += QObject::tr("(newline added at end of line)\n");
+      status->result.back().endOfFileNewline = LineDiff::EndOfFileNewline::Added;
     } else {
       status->result.emplace_back(
           LineDiff::Type::Modified,
           status->documentNumLines - 1,
           line->num_lines,
-          QObject::tr("(newline added at end of line)"));
+          -1);
+      status->result.back().endOfFileNewline = LineDiff::EndOfFileNewline::Added;
     }
     
     status->newToOldLineOffset -= line->num_lines;
@@ -168,16 +570,14 @@ int GitDiffLineCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* /*
     if (!status->result.empty() &&
         status->result.back().line == status->documentNumLines - 1) {
       status->result.back().type = LineDiff::Type::Modified;
-      if (!status->result.back().oldText.endsWith('\n')) {
-        status->result.back().oldText += '\n';
-      }
-      status->result.back().oldText += QObject::tr("(newline added at end of line)\n");
+      status->result.back().endOfFileNewline = LineDiff::EndOfFileNewline::Removed;
     } else {
       status->result.emplace_back(
           LineDiff::Type::Modified,
           status->documentNumLines - 1,
           1,
-          QObject::tr("(newline removed at end of line)"));
+          -1);
+      status->result.back().endOfFileNewline = LineDiff::EndOfFileNewline::Removed;
     }
     
     status->newToOldLineOffset += line->num_lines;
@@ -187,12 +587,25 @@ int GitDiffLineCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* /*
 }
 
 void GitDiff::CreateDiff(const DiffRequest& request) {
-  // Get the current document content
-  QByteArray documentTextUtf8;
+  if (diffStates.size() > 4 * kMaxCachedBlobsPerRepository) {
+    diffStates.clear();
+  }
+  std::shared_ptr<IncrementalDiffState>& diffState = diffStates[request.document.get()];
+  
+  // Get the current document content. If the document's current diffLines()
+  // can be updated incrementally, only the text around the edits is needed.
+  std::shared_ptr<const QByteArray> documentTextUtf8;
+  std::shared_ptr<const DocumentSnapshot> documentSnapshot;
+  IncrementalDiffWindow window;
+  bool incremental = false;
   int documentNumLines;
   QString documentPath;
   QString projectPath;
   int documentVersion;
+  int documentTextChangeCounter;
+  bool showBlame;
+  int firstVisibleLine;
+  int lastVisibleLine;
   
   bool exit = false;
   RunInQtThreadBlocking([&]() {
@@ -202,10 +615,23 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
       return;
     }
     
-    documentTextUtf8 = request.document->GetDocumentText().toUtf8();
     documentNumLines = request.document->LineCount();
     documentPath = request.document->path();
     documentVersion = request.document->version();
+    documentTextChangeCounter = request.document->textChangeCounter();
+    showBlame = Settings::Instance().GetShowGitBlame();
+    request.widget->GetVisibleLines(&firstVisibleLine, &lastVisibleLine);
+    
+    // If available, the snapshot allows to get the full text later (and to
+    // convert it to UTF-8) without returning to the main thread.
+    documentSnapshot = request.document->UpdateSnapshot();
+    
+    if (diffState && diffState->document.lock() == request.document) {
+      incremental = ComputeIncrementalDiffWindow(request.document.get(), diffState->textChangeCounter, diffState->lineCount, &window);
+    }
+    if (!incremental && !documentSnapshot) {
+      documentTextUtf8 = request.document->GetDocumentTextUtf8();
+    }
     
     for (const auto& project : request.mainWindow->GetProjects()) {
       if (project->ContainsFileOrInclude(request.document->path())) {
@@ -217,6 +643,9 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
   if (exit) {
     return;
   }
+  if (!incremental && !documentTextUtf8) {
+    documentTextUtf8 = documentSnapshot->GetTextUtf8();
+  }
   
   int gitOpenFlags = GIT_REPOSITORY_OPEN_NO_SEARCH;
   if (projectPath.isEmpty() ||
@@ -225,52 +654,48 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
     projectPath = QFileInfo(documentPath).dir().path();
   }
   
-  // Open repository
-  git_repository* repo = nullptr;
-  int result = git_repository_open_ext(&repo, projectPath.toLocal8Bit(), gitOpenFlags, nullptr);
-  std::shared_ptr<git_repository> repo_deleter(repo, [&](git_repository* repo){ git_repository_free(repo); });
-  if (result == GIT_ENOTFOUND) {
-    // There is no git repository at the project path.
-    return;
-  } else if (result != 0) {
-    qDebug() << "Failed to open the git repository at" << projectPath << "(some possible reasons: repo corruption or system errors)";
-    return;
+  if (cacheInvalidated) {
+    cacheInvalidated = false;
+    repositoryCache.clear();
   }
   
-  if (git_repository_is_bare(repo)) {
-    return;
-  }
-  
-  QDir repoWorkdir(QString::fromLocal8Bit(git_repository_workdir(repo)));
-  
-  // Get the HEAD tree
-  git_object* head = nullptr;
-  result = git_revparse_single(&head, repo, "HEAD^{tree}");
-  std::shared_ptr<git_object> head_deleter(head, [&](git_object* head){ git_object_free(head); });
-  if (result != 0) {
-    qDebug() << "GitDiff: failed to get \"HEAD^{tree}\" object from the git repository.";
-    return;
-  }
-  
-  git_tree* tree = nullptr;
-  result = git_tree_lookup(&tree, repo, git_object_id(head));
-  if (result != 0) {
-    qDebug() << "GitDiff: failed to lookup the HEAD tree in the git repository.";
+  std::shared_ptr<CachedRepository> repository = GetRepository(projectPath, gitOpenFlags);
+  if (!repository) {
     return;
   }
   
   // Get the blob for the old file state
-  git_blob* oldFileBlob = nullptr;
-  git_tree_entry* oldFileEntry = nullptr;
-  QByteArray fileRelativePath = repoWorkdir.relativeFilePath(documentPath).toLocal8Bit();
-  result = git_tree_entry_bypath(&oldFileEntry, tree, fileRelativePath);
-  std::shared_ptr<git_tree_entry> entry_deleter(oldFileEntry, [&](git_tree_entry* entry){ git_tree_entry_free(entry); });
-  if (result == 0) {
-    git_object_t oldFileEntryType = git_tree_entry_type(oldFileEntry);
-    if (oldFileEntryType == GIT_OBJECT_BLOB) {
-      result = git_blob_lookup(&oldFileBlob, repo, git_tree_entry_id(oldFileEntry));
-      if (result != 0) {
-        oldFileBlob = nullptr;
+  QByteArray fileRelativePath = repository->workdir.relativeFilePath(documentPath).toLocal8Bit();
+  std::shared_ptr<CachedBlob> oldFileBlob = repository->GetHeadBlob(fileRelativePath);
+  
+  // The incremental diff is only possible if the previous diff was computed
+  // against the same blob.
+  if (incremental) {
+    int oldLineCount = oldFileBlob->GetLineStarts().size();
+    if (!oldFileBlob->blob ||
+        diffState->repository.lock() != repository ||
+        git_oid_cmp(&diffState->headCommitId, &repository->headCommitId) != 0 ||
+        diffState->fileRelativePath != fileRelativePath ||
+        window.firstOldLine < 0 ||
+        window.firstOldLine >= oldLineCount ||
+        window.endOldLine > oldLineCount ||
+        (window.endOldLine >= 0 && window.endOldLine < window.firstOldLine)) {
+      incremental = false;
+      
+      if (documentSnapshot) {
+        documentTextUtf8 = documentSnapshot->GetTextUtf8();
+      } else {
+        RunInQtThreadBlocking([&]() {
+          if (documentBeingDiffed != request.document ||
+              documentVersion != request.document->version()) {
+            exit = true;
+            return;
+          }
+          documentTextUtf8 = request.document->GetDocumentTextUtf8();
+        });
+        if (exit) {
+          return;
+        }
       }
     }
   }
@@ -286,22 +711,79 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
   
   GitDiffLineCallbackStatus status;
   status.result.reserve(32);
-  status.documentNumLines = documentNumLines;
-  result = git_diff_blob_to_buffer(
-      oldFileBlob,  // may be nullptr
-      fileRelativePath,
-      documentTextUtf8,
-      documentTextUtf8.size(),
-      fileRelativePath,
-      &options,
-      /*git_diff_file_cb file_cb*/ nullptr,
-      /*git_diff_binary_cb binary_cb*/ nullptr,
-      /*git_diff_hunk_cb hunk_cb*/ nullptr,
-      &GitDiffLineCallback,
-      &status);
-  if (result != 0) {
-    qDebug() << "GitDiff: git_diff_blob_to_buffer() failed.";
-    return;
+  int result;
+  if (incremental) {
+    // Diff the window against the corresponding lines of the old file state.
+    const std::vector<int>& oldLineStarts = oldFileBlob->GetLineStarts();
+    const char* oldContent = static_cast<const char*>(git_blob_rawcontent(oldFileBlob->blob.get()));
+    int oldStart = oldLineStarts[window.firstOldLine];
+    int oldEnd = (window.endOldLine < 0 || window.endOldLine == oldLineStarts.size()) ?
+                 static_cast<int>(git_blob_rawsize(oldFileBlob->blob.get())) :
+                 oldLineStarts[window.endOldLine];
+    
+    status.documentNumLines = window.endLine - window.firstLine;
+    result = git_diff_buffers(
+        oldContent + oldStart,
+        oldEnd - oldStart,
+        fileRelativePath,
+        window.text.constData(),
+        window.text.size(),
+        fileRelativePath,
+        &options,
+        /*git_diff_file_cb file_cb*/ nullptr,
+        /*git_diff_binary_cb binary_cb*/ nullptr,
+        /*git_diff_hunk_cb hunk_cb*/ nullptr,
+        &GitDiffLineCallback,
+        &status);
+    if (result != 0) {
+      qDebug() << "GitDiff: git_diff_buffers() failed.";
+      return;
+    }
+    
+    // Patch the previous diff lines with the result.
+    std::vector<LineDiff> patchedResult;
+    patchedResult.reserve(window.previousDiffLines.size() + status.result.size());
+    for (const LineDiff& diff : window.previousDiffLines) {
+      int spanStart, spanEnd;
+      GetLineDiffSpan(diff, &spanStart, &spanEnd);
+      if (spanEnd <= window.firstLine) {
+        patchedResult.push_back(diff);
+      }
+    }
+    for (LineDiff& diff : status.result) {
+      diff.line += window.firstLine;
+      if (diff.oldLine >= 0) {
+        diff.oldLine += window.firstOldLine;
+      }
+      patchedResult.push_back(diff);
+    }
+    for (const LineDiff& diff : window.previousDiffLines) {
+      int spanStart, spanEnd;
+      GetLineDiffSpan(diff, &spanStart, &spanEnd);
+      if (spanStart >= window.previousEndLine) {
+        patchedResult.push_back(diff);
+        patchedResult.back().line += window.lineCountDelta;
+      }
+    }
+    status.result.swap(patchedResult);
+  } else {
+    status.documentNumLines = documentNumLines;
+    result = git_diff_blob_to_buffer(
+        oldFileBlob->blob.get(),  // may be nullptr
+        fileRelativePath,
+        documentTextUtf8->constData(),
+        documentTextUtf8->size(),
+        fileRelativePath,
+        &options,
+        /*git_diff_file_cb file_cb*/ nullptr,
+        /*git_diff_binary_cb binary_cb*/ nullptr,
+        /*git_diff_hunk_cb hunk_cb*/ nullptr,
+        &GitDiffLineCallback,
+        &status);
+    if (result != 0) {
+      qDebug() << "GitDiff: git_diff_blob_to_buffer() failed.";
+      return;
+    }
   }
   
   // TODO: Debug check for that we receive lines in successive order
@@ -312,6 +794,37 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
     }
   }
   
+  // Get the blame of the lines. It is cached per file and HEAD commit, such
+  // that edits only require to shift it through the new diff lines. Since
+  // blaming a file with a long history can take long, the visible lines are
+  // blamed first if the file has not been blamed yet.
+  std::vector<LineBlame> blameLines;
+  std::shared_ptr<CachedBlame> blame;
+  if (showBlame && oldFileBlob->blob) {
+    auto blameIt = repository->headBlames.find(fileRelativePath);
+    if (blameIt != repository->headBlames.end()) {
+      blame = blameIt->second;
+    } else {
+      if (repository->headBlames.size() >= kMaxCachedBlobsPerRepository) {
+        repository->headBlames.clear();
+      }
+      blame.reset(new CachedBlame());
+      repository->headBlames[fileRelativePath] = blame;
+      
+      const std::vector<int>& oldLineStarts = oldFileBlob->GetLineStarts();
+      int oldLineCount = oldLineStarts.size();
+      if (oldLineStarts.back() == git_blob_rawsize(oldFileBlob->blob.get())) {
+        -- oldLineCount;
+      }
+      int firstOldLine = std::min(oldLineCount, MapDocumentLineToOldLine(std::max(0, firstVisibleLine - kVisibleBlameContextLines), status.result));
+      int endOldLine = std::min(oldLineCount, MapDocumentLineToOldLine(lastVisibleLine + kVisibleBlameContextLines, status.result) + 1);
+      if (endOldLine > firstOldLine) {
+        BlameFile(repository->repo.get(), repository->headCommitId, fileRelativePath, firstOldLine, endOldLine, &blame->hunks);
+      }
+    }
+    MapBlameToDocument(blame->hunks, status.result, documentNumLines, &blameLines);
+  }
+  
   RunInQtThreadBlocking([&]() {
     // Abort if the document widget does not exist anymore
     if (documentBeingDiffed != request.document) {
@@ -319,7 +832,8 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
       return;
     }
     
-    if (documentVersion != request.document->version()) {
+    if (documentVersion != request.document->version() ||
+        documentTextChangeCounter != request.document->textChangeCounter()) {
       // The document version changed. Discard our results.
       // The next diff should already have been invoked.
       exit = true;
@@ -327,11 +841,156 @@ void GitDiff::CreateDiff(const DiffRequest& request) {
     }
     
     // Store the result and invoke redraw of the widget
-    request.document->SwapDiffLines(&status.result);
+    request.document->SwapDiffLines(&status.result, oldFileBlob);
+    request.document->SwapBlameLines(&blameLines);
     request.widget->update(request.widget->rect());
     request.widget->GetContainer()->GetMinimap()->SetDiffLines(request.document->diffLines());
+    
+    // Remember what the result was computed for, such that the next diff can
+    // update it incrementally.
+    if (!diffState) {
+      diffState.reset(new IncrementalDiffState());
+    }
+    diffState->document = request.document;
+    diffState->textChangeCounter = documentTextChangeCounter;
+    diffState->lineCount = documentNumLines;
+    diffState->repository = repository;
+    diffState->headCommitId = repository->headCommitId;
+    diffState->fileRelativePath = fileRelativePath;
   });
   if (exit) {
     return;
   }
+  
+  // If only the visible lines were blamed, blame the whole file now.
+  if (blame && !blame->complete) {
+    std::vector<BlameHunk> hunks;
+    if (BlameFile(repository->repo.get(), repository->headCommitId, fileRelativePath, 0, -1, &hunks)) {
+      blame->hunks.swap(hunks);
+    }
+    blame->complete = true;
+    
+    RunInQtThreadBlocking([&]() {
+      // If the document changed, the next diff will show the complete blame.
+      if (documentBeingDiffed != request.document ||
+          documentTextChangeCounter != request.document->textChangeCounter()) {
+        return;
+      }
+      
+      MapBlameToDocument(blame->hunks, request.document->diffLines(), documentNumLines, &blameLines);
+      request.document->SwapBlameLines(&blameLines);
+      request.widget->update(request.widget->rect());
+    });
+  }
+}
+
+std::shared_ptr<GitDiff::CachedRepository> GitDiff::GetRepository(const QString& path, int openFlags) {
+  std::shared_ptr<CachedRepository> repository;
+  
+  auto key = std::make_pair(path, openFlags);
+  auto it = repositoryCache.find(key);
+  if (it != repositoryCache.end()) {
+    repository = it->second;
+  } else {
+    // Open repository
+    git_repository* repo = nullptr;
+    int result = git_repository_open_ext(&repo, path.toLocal8Bit(), openFlags, nullptr);
+    std::shared_ptr<git_repository> repo_deleter(repo, [](git_repository* repo){ git_repository_free(repo); });
+    if (result == GIT_ENOTFOUND) {
+      // There is no git repository at the project path.
+      return nullptr;
+    } else if (result != 0) {
+      qDebug() << "Failed to open the git repository at" << path << "(some possible reasons: repo corruption or system errors)";
+      return nullptr;
+    }
+    
+    if (git_repository_is_bare(repo)) {
+      return nullptr;
+    }
+    
+    repository.reset(new CachedRepository());
+    repository->repo = repo_deleter;
+    repository->workdir = QDir(QString::fromLocal8Bit(git_repository_workdir(repo)));
+    repositoryCache[key] = repository;
+  }
+  
+  // Check whether HEAD still refers to the same commit. This is cheap compared
+  // to looking up the tree.
+  git_oid headCommitId;
+  int result = git_reference_name_to_id(&headCommitId, repository->repo.get(), "HEAD");
+  if (result != 0) {
+    qDebug() << "GitDiff: failed to resolve HEAD in the git repository.";
+    return nullptr;
+  }
+  if (repository->headTree && git_oid_cmp(&headCommitId, &repository->headCommitId) == 0) {
+    return repository;
+  }
+  
+  repository->headTree.reset();
+  repository->headBlobs.clear();
+  repository->headBlames.clear();
+  
+  // Get the HEAD tree
+  git_object* head = nullptr;
+  result = git_revparse_single(&head, repository->repo.get(), "HEAD^{tree}");
+  std::shared_ptr<git_object> head_deleter(head, [&](git_object* head){ git_object_free(head); });
+  if (result != 0) {
+    qDebug() << "GitDiff: failed to get \"HEAD^{tree}\" object from the git repository.";
+    return nullptr;
+  }
+  
+  git_tree* tree = nullptr;
+  result = git_tree_lookup(&tree, repository->repo.get(), git_object_id(head));
+  if (result != 0) {
+    qDebug() << "GitDiff: failed to lookup the HEAD tree in the git repository.";
+    return nullptr;
+  }
+  repository->headTree.reset(tree, [](git_tree* tree){ git_tree_free(tree); });
+  repository->headCommitId = headCommitId;
+  
+  return repository;
+}
+
+static int GitDiffHunkCallback(const git_diff_delta* /*delta*/, const git_diff_hunk* hunk, void* payload) {
+  std::vector<LineHunk>* hunks = static_cast<std::vector<LineHunk>*>(payload);
+  
+  // Without context lines, the start of an empty side of a hunk is the
+  // (1-based) line after which the other side's lines are inserted.
+  LineHunk lineHunk;
+  lineHunk.oldStart = (hunk->old_lines == 0) ? hunk->old_start : (hunk->old_start - 1);
+  lineHunk.oldLines = hunk->old_lines;
+  lineHunk.newStart = (hunk->new_lines == 0) ? hunk->new_start : (hunk->new_start - 1);
+  lineHunk.newLines = hunk->new_lines;
+  hunks->push_back(lineHunk);
+  return 0;
+}
+
+bool ComputeLineHunks(const QByteArray& oldText, const QByteArray& newText, std::vector<LineHunk>* hunks) {
+  hunks->clear();
+  
+  git_diff_options options;
+  memset(&options, 0, sizeof(git_diff_options));
+  options.version = GIT_DIFF_OPTIONS_VERSION;
+  options.flags = GIT_DIFF_FORCE_TEXT;
+  options.context_lines = 0;
+  options.interhunk_lines = 0;
+  
+  int result = git_diff_buffers(
+      oldText.constData(),
+      oldText.size(),
+      /*old_as_path*/ nullptr,
+      newText.constData(),
+      newText.size(),
+      /*new_as_path*/ nullptr,
+      &options,
+      /*git_diff_file_cb file_cb*/ nullptr,
+      /*git_diff_binary_cb binary_cb*/ nullptr,
+      &GitDiffHunkCallback,
+      /*git_diff_line_cb line_cb*/ nullptr,
+      hunks);
+  if (result != 0) {
+    qDebug() << "ComputeLineHunks(): git_diff_buffers() failed.";
+    return false;
+  }
+  return true;
 }
@@ -6,19 +6,39 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <QByteArray>
+#include <QString>
+
 class Document;
 class DocumentWidget;
 class MainWindow;
 
+/// A run of lines that differs between two texts, see ComputeLineHunks().
+/// The line indices are 0-based. If oldLines (newLines) is zero, oldStart
+/// (newStart) is the line before which the lines are inserted (removed).
+struct LineHunk {
+  int oldStart;
+  int oldLines;
+  int newStart;
+  int newLines;
+};
+
+/// Computes the runs of lines in which @p newText differs from @p oldText with
+/// libgit2's line diff (without context lines), ordered by their position.
+/// Returns false if the diff failed.
+bool ComputeLineHunks(const QByteArray& oldText, const QByteArray& newText, std::vector<LineHunk>* hunks);
+
 class GitDiff {
  public:
   static GitDiff& Instance();
-
+  
   ~GitDiff();
   
   void RequestDiff(const std::shared_ptr<Document>& document, DocumentWidget* widget, MainWindow* mainWindow);
@@ -27,6 +47,11 @@ class GitDiff {
   /// that parse threads will not try to access it anymore.
   void WidgetRemoved(DocumentWidget* widget);
   
+  /// Drops the cached git repositories, HEAD trees, and file blobs. This
+  /// should be called if the HEAD or the index of a repository might have
+  /// changed. Note that changes to HEAD are also detected without this.
+  void InvalidateCache();
+  
   void Exit();
   
  private:
@@ -46,8 +71,30 @@ class GitDiff {
   
   void ThreadMain();
   
+  /// An opened git repository together with the tree of its HEAD commit and
+  /// the blobs of the files that were diffed against it. Defined in
+  /// git_diff.cc. Only accessed by the diff thread.
+  struct CachedRepository;
+  
+  /// Describes what the current diffLines() of a document were computed for.
+  /// Defined in git_diff.cc. Only accessed by the diff thread.
+  struct IncrementalDiffState;
+  
   void CreateDiff(const DiffRequest& request);
   
+  /// Returns the cached repository for opening @p path with @p openFlags,
+  /// opening it if necessary, with an up-to-date HEAD tree. Returns null if
+  /// there is no usable repository.
+  std::shared_ptr<CachedRepository> GetRepository(const QString& path, int openFlags);
+  
+  // Repository cache. Maps (path, open flags) to the repository.
+  std::map<std::pair<QString, int>, std::shared_ptr<CachedRepository>> repositoryCache;
+  std::atomic<bool> cacheInvalidated;
+  
+  // State for incremental diffs. Maps each document to the state that its
+  // diffLines() were computed for.
+  std::unordered_map<const Document*, std::shared_ptr<IncrementalDiffState>> diffStates;
+  
   // Thread input handling
   std::mutex diffMutex;
   std::condition_variable newDiffRequestCondition;
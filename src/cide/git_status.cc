@@ -0,0 +1,283 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/git_status.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <git2.h>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QObject>
+
+#include "cide/performance_profile.h"
+#include "cide/qt_thread.h"
+
+/// Maximum number of visible files whose status is queried before the status
+/// of the whole repository. For more files, the quick query is skipped.
+constexpr int kMaxQuickStatusFiles = 4096;
+
+GitStatus& GitStatus::Instance() {
+  static GitStatus instance;
+  return instance;
+}
+
+void GitStatus::RequestStatus(const std::vector<QString>& repositoryPaths, const std::unordered_map<QString, std::vector<QString>>& visibleFiles, const Callback& callback) {
+  requestMutex.lock();
+  requestedPaths = repositoryPaths;
+  requestedVisibleFiles = visibleFiles;
+  requestCallback = callback;
+  haveRequest = true;
+  ++ requestCounter;
+  requestMutex.unlock();
+  newRequestCondition.notify_one();
+}
+
+void GitStatus::Exit() {
+  mExit = true;
+  newRequestCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+GitStatus::GitStatus() {
+  mExit = false;
+  mThread.reset(new std::thread(&GitStatus::ThreadMain, this));
+}
+
+GitStatus::~GitStatus() {
+  Exit();
+}
+
+void GitStatus::ThreadMain() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(requestMutex);
+    if (mExit) {
+      return;
+    }
+    while (!haveRequest) {
+      newRequestCondition.wait(lock);
+      if (mExit) {
+        return;
+      }
+    }
+    
+    // Wait until there were no new requests for a while.
+    int lastRequestCounter;
+    do {
+      lastRequestCounter = requestCounter;
+      newRequestCondition.wait_for(lock, std::chrono::milliseconds(GetPerformanceProfileParameters().gitStatusDebounceMilliseconds));
+      if (mExit) {
+        return;
+      }
+    } while (requestCounter != lastRequestCounter);
+    
+    std::vector<QString> paths;
+    paths.swap(requestedPaths);
+    std::unordered_map<QString, std::vector<QString>> visibleFiles;
+    visibleFiles.swap(requestedVisibleFiles);
+    Callback callback = requestCallback;
+    haveRequest = false;
+    lock.unlock();
+    
+    // Drop the repositories that are not requested anymore.
+    for (auto it = repositoryCache.begin(); it != repositoryCache.end(); ) {
+      if (std::find(paths.begin(), paths.end(), it->first) == paths.end()) {
+        it = repositoryCache.erase(it);
+      } else {
+        ++ it;
+      }
+    }
+    
+    // Query the status of the visible files first. Querying a whole repository
+    // requires to walk its entire working tree, which may take long.
+    ProjectGitStatusMap statuses;
+    for (const QString& path : paths) {
+      auto visibleIt = visibleFiles.find(path);
+      if (visibleIt == visibleFiles.end() ||
+          visibleIt->second.empty() ||
+          visibleIt->second.size() > kMaxQuickStatusFiles) {
+        continue;
+      }
+      std::shared_ptr<ProjectGitStatus> status = QueryStatus(path, &visibleIt->second);
+      if (status) {
+        statuses[path] = status;
+      }
+      if (mExit) {
+        return;
+      }
+    }
+    if (!statuses.empty()) {
+      RunInQtThreadBlocking([&]() {
+        callback(&statuses);
+      });
+      statuses.clear();
+    }
+    
+    for (const QString& path : paths) {
+      std::shared_ptr<ProjectGitStatus> status = QueryStatus(path, nullptr);
+      if (status) {
+        statuses[path] = status;
+      }
+      if (mExit) {
+        return;
+      }
+    }
+    
+    RunInQtThreadBlocking([&]() {
+      callback(&statuses);
+    });
+  }
+}
+
+std::shared_ptr<git_repository> GitStatus::GetRepository(const QString& repositoryPath) {
+  auto it = repositoryCache.find(repositoryPath);
+  if (it != repositoryCache.end()) {
+    return it->second;
+  }
+  
+  git_repository* repo = nullptr;
+  int result = git_repository_open_ext(&repo, repositoryPath.toLocal8Bit(), GIT_REPOSITORY_OPEN_NO_SEARCH, nullptr);
+  std::shared_ptr<git_repository> repo_deleter(repo, [](git_repository* repo){ git_repository_free(repo); });
+  if (result == GIT_ENOTFOUND) {
+    // There is no git repository at the project path.
+    return nullptr;
+  } else if (result != 0) {
+    qDebug() << "Failed to open the git repository at" << repositoryPath << "(some possible reasons: repo corruption or system errors), libgit2 error code:" << result;
+    return nullptr;
+  }
+  
+  if (git_repository_is_bare(repo)) {
+    return nullptr;
+  }
+  
+  repositoryCache[repositoryPath] = repo_deleter;
+  return repo_deleter;
+}
+
+std::shared_ptr<ProjectGitStatus> GitStatus::QueryStatus(const QString& repositoryPath, const std::vector<QString>* onlyPaths) {
+  std::shared_ptr<git_repository> repo_deleter = GetRepository(repositoryPath);
+  if (!repo_deleter) {
+    return nullptr;
+  }
+  git_repository* repo = repo_deleter.get();
+  int result;
+  
+  std::shared_ptr<ProjectGitStatus> projectStatus(new ProjectGitStatus());
+  
+  // Get the branch name for HEAD
+  git_reference* head = nullptr;
+  result = git_repository_head(&head, repo);
+  std::shared_ptr<git_reference> head_deleter(head, [&](git_reference* ref){ git_reference_free(ref); });
+  
+  if (result == GIT_EUNBORNBRANCH || result == GIT_ENOTFOUND) {
+    projectStatus->branchName = QObject::tr("(not on any branch)");
+  } else if (result != 0) {
+    qDebug() << "There was an error getting the branch for the git repository at" << repositoryPath << ", libgit2 error code:" << result;
+    return projectStatus;
+  } else {
+    projectStatus->branchName = QString::fromUtf8(git_reference_shorthand(head));
+  }
+  
+  // Get the working directory of the repository. Returned paths will be relative to this directory.
+  QDir workDir(QString::fromLocal8Bit(git_repository_workdir(repo)));
+  
+  // Query repository status (i.e.: lists of untracked files in working copy, and modified files between HEAD->index and index->worktree).
+  // We display the merged HEAD<->index and index<->worktree differences here.
+  // The stat data of files whose content turns out to be unchanged is written
+  // back to the index (GIT_STATUS_OPT_UPDATE_INDEX), such that later queries
+  // do not need to read these files again.
+  git_status_options opts;
+  memset(&opts, 0, sizeof(git_status_options));
+  opts.version = GIT_STATUS_OPTIONS_INIT;
+  opts.show  = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+  opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
+               GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX |
+               GIT_STATUS_OPT_UPDATE_INDEX;
+  
+  // If only some files are queried, pass them as a path list. This lets
+  // libgit2 skip all other directories of the working tree.
+  std::vector<QByteArray> relativePaths;
+  std::vector<char*> relativePathPointers;
+  if (onlyPaths) {
+    QDir canonicalWorkDir(QFileInfo(workDir.path()).canonicalFilePath());
+    for (const QString& path : *onlyPaths) {
+      QString relativePath = canonicalWorkDir.relativeFilePath(path);
+      if (!relativePath.startsWith(QStringLiteral("../"))) {
+        relativePaths.push_back(relativePath.toLocal8Bit());
+      }
+    }
+    if (relativePaths.empty()) {
+      return nullptr;
+    }
+    for (QByteArray& relativePath : relativePaths) {
+      relativePathPointers.push_back(relativePath.data());
+    }
+    opts.flags |= GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+    opts.pathspec.strings = relativePathPointers.data();
+    opts.pathspec.count = relativePathPointers.size();
+    
+    projectStatus->queriedPaths = *onlyPaths;
+  }
+  
+  git_status_list* status = nullptr;
+  result = git_status_list_new(&status, repo, &opts);
+  if (result != 0) {
+    // Updating the index fails if it is locked, for example by a concurrent
+    // git command. Query the status without updating it then.
+    opts.flags &= ~GIT_STATUS_OPT_UPDATE_INDEX;
+    result = git_status_list_new(&status, repo, &opts);
+  }
+  std::shared_ptr<git_status_list> status_deleter(status, [&](git_status_list* status){ git_status_list_free(status); });
+  if (result != 0) {
+    qDebug() << "There was an error getting the status list for the git repository at" << repositoryPath << ", libgit2 error code:" << result;
+    return projectStatus;
+  }
+  
+  int numStatusItems = git_status_list_entrycount(status);
+  for (int i = 0; i < numStatusItems; ++ i) {
+    const git_status_entry* s = git_status_byindex(status, i);
+    
+    if (s->index_to_workdir && s->status == GIT_STATUS_WT_NEW) {
+      // Untracked file.
+      QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(s->index_to_workdir->old_file.path))).canonicalFilePath();
+      projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Untracked;
+    } else if (s->status == GIT_STATUS_CURRENT) {
+      // No changes to this file.
+      continue;
+    } else if ((s->status & GIT_STATUS_INDEX_NEW) ||
+               (s->status & GIT_STATUS_INDEX_MODIFIED) ||
+               (s->status & GIT_STATUS_INDEX_TYPECHANGE)) {
+      // Modified file (HEAD<->index).
+      const char* old_path = s->head_to_index->old_file.path;
+      const char* new_path = s->head_to_index->new_file.path;
+      QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(old_path ? old_path : new_path))).canonicalFilePath();
+      projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Modified;
+    } else if (s->index_to_workdir &&
+               ((s->status & GIT_STATUS_WT_MODIFIED) ||
+                (s->status & GIT_STATUS_WT_TYPECHANGE) ||
+                (s->status & GIT_STATUS_WT_RENAMED))) {
+      // Modified file (index<->worktree).
+      const char* old_path = s->index_to_workdir->old_file.path;
+      const char* new_path = s->index_to_workdir->new_file.path;
+      QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(old_path ? old_path : new_path))).canonicalFilePath();
+      projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Modified;
+    }
+  }
+  
+  for (const auto& item : projectStatus->fileStatuses) {
+    if (item.second == ProjectGitStatus::FileStatus::Modified) {
+      ++ projectStatus->numModifications;
+    } else if (item.second == ProjectGitStatus::FileStatus::Untracked) {
+      ++ projectStatus->numUntracked;
+    }
+  }
+  
+  return projectStatus;
+}
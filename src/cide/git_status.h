@@ -0,0 +1,109 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+#include "cide/util.h"
+
+struct git_repository;
+
+/// The git status of a project's repository, as displayed in the project tree.
+struct ProjectGitStatus {
+  enum class FileStatus {
+    Modified = 0,
+    Untracked,
+    
+    NotModified,
+    Invalid
+  };
+  
+  QString branchName;
+  
+  /// Maps the full canonical path of the file to its status
+  std::unordered_map<QString, FileStatus> fileStatuses;
+  
+  /// Number of entries in fileStatuses with status Modified respectively
+  /// Untracked.
+  int numModifications = 0;
+  int numUntracked = 0;
+  
+  /// If non-empty, the status was only queried for these files (as a quick
+  /// preview before the status of the whole repository is available), and
+  /// fileStatuses as well as the counts above only refer to them.
+  std::vector<QString> queriedPaths;
+};
+
+/// Maps the root path of each repository to its status.
+typedef std::unordered_map<QString, std::shared_ptr<ProjectGitStatus>> ProjectGitStatusMap;
+
+/// Queries the git status of repositories in a background thread, such that
+/// large repositories do not block the UI.
+class GitStatus {
+ public:
+  typedef std::function<void(ProjectGitStatusMap* statuses)> Callback;
+  
+  static GitStatus& Instance();
+  
+  ~GitStatus();
+  
+  /// Requests the status of the git repositories at the given paths. Once it
+  /// has been determined, @p callback is called in the Qt thread with the
+  /// statuses of all paths that contain a (non-bare) git repository. If
+  /// another request is made before the previous one started to be processed,
+  /// the previous one is dropped. The thread also waits for a short time
+  /// without new requests before it starts, such that bursts of requests only
+  /// cause a single status query.
+  ///
+  /// @p visibleFiles may map repository paths to the canonical paths of the
+  /// files that are currently displayed. The status of these files is queried
+  /// first, and @p callback is called with the result before the whole
+  /// repositories are queried (see ProjectGitStatus::queriedPaths).
+  void RequestStatus(const std::vector<QString>& repositoryPaths, const std::unordered_map<QString, std::vector<QString>>& visibleFiles, const Callback& callback);
+  
+  void Exit();
+  
+ private:
+  GitStatus();
+  
+  void ThreadMain();
+  
+  /// Returns the repository at @p repositoryPath, opening it if it is not in
+  /// repositoryCache yet. Returns null if there is no (non-bare) repository.
+  std::shared_ptr<git_repository> GetRepository(const QString& repositoryPath);
+  
+  /// Returns the status of the repository at @p repositoryPath, or null if
+  /// there is no (non-bare) repository or an error occurred. If @p onlyPaths
+  /// is non-null, only the status of the files with these canonical paths is
+  /// queried.
+  std::shared_ptr<ProjectGitStatus> QueryStatus(const QString& repositoryPath, const std::vector<QString>* onlyPaths);
+  
+  /// Opened repositories by their path. These are kept open between queries,
+  /// such that libgit2 only re-reads their index if it changed. Only accessed
+  /// by the status thread.
+  std::unordered_map<QString, std::shared_ptr<git_repository>> repositoryCache;
+  
+  // Thread input handling
+  std::mutex requestMutex;
+  std::condition_variable newRequestCondition;
+  bool haveRequest = false;
+  int requestCounter = 0;
+  std::vector<QString> requestedPaths;
+  std::unordered_map<QString, std::vector<QString>> requestedVisibleFiles;
+  Callback requestCallback;
+  
+  // Threading
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,108 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/header_prefetcher.h"
+
+#include "cide/main_window.h"
+#include "cide/project.h"
+#include "cide/util.h"
+
+HeaderPrefetcher::~HeaderPrefetcher() {
+  Exit();
+}
+
+void HeaderPrefetcher::Prefetch(const std::vector<QString>& canonicalSourcePaths, MainWindow* mainWindow) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (mExit) {
+    return;
+  }
+  
+  bool haveNewPaths = false;
+  for (const QString& path : canonicalSourcePaths) {
+    if (queuedSourcePathsSet.insert(path).second) {
+      queuedSourcePaths.push_back(path);
+      haveNewPaths = true;
+    }
+  }
+  if (!haveNewPaths) {
+    return;
+  }
+  if (queuedSourcePathsSet.size() > kMaxRememberedFiles) {
+    queuedSourcePathsSet.clear();
+  }
+  this->mainWindow = mainWindow;
+  
+  if (!mThread) {
+    mThread.reset(new std::thread(&HeaderPrefetcher::ThreadMain, this));
+  }
+  lock.unlock();
+  newWorkCondition.notify_one();
+}
+
+void HeaderPrefetcher::Exit() {
+  mutex.lock();
+  mExit = true;
+  mutex.unlock();
+  newWorkCondition.notify_all();
+  abortData.Abort();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void HeaderPrefetcher::ThreadMain() {
+  // Prefetching is background work, and the reads that it triggers should not
+  // delay the reads of the parse threads that actually need the data.
+  LowerCurrentThreadPriority();
+  
+  std::unordered_set<QString> prefetchedFiles;
+  std::vector<QString> sourcePaths;
+  std::vector<QString> filePaths;
+  
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (queuedSourcePaths.empty() && !mExit) {
+      newWorkCondition.wait(lock);
+    }
+    if (mExit) {
+      return;
+    }
+    sourcePaths.swap(queuedSourcePaths);
+    queuedSourcePaths.clear();
+    MainWindow* currentMainWindow = mainWindow;
+    lock.unlock();
+    
+    // Look up the included files. The projects must only be accessed from
+    // the Qt thread.
+    filePaths.clear();
+    bool lookedUp = RunInQtThreadBlocking([&]() {
+      for (const QString& sourcePath : sourcePaths) {
+        for (const std::shared_ptr<Project>& project : currentMainWindow->GetProjects()) {
+          SourceFile* source = project->GetSourceFile(sourcePath);
+          if (source) {
+            filePaths.push_back(sourcePath);
+            source->GetIncludedPaths(&filePaths);
+            break;
+          }
+        }
+      }
+    }, &abortData);
+    if (!lookedUp) {
+      return;
+    }
+    
+    if (prefetchedFiles.size() + filePaths.size() > kMaxRememberedFiles) {
+      prefetchedFiles.clear();
+    }
+    for (const QString& path : filePaths) {
+      if (mExit) {
+        return;
+      }
+      if (prefetchedFiles.insert(path).second) {
+        AdviseWillReadFile(path);
+      }
+    }
+  }
+}
@@ -0,0 +1,71 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <QString>
+
+#include "cide/qt_thread.h"
+
+class MainWindow;
+
+/// Asks the operating system to read the files that upcoming indexing requests
+/// will read into its page cache, while the parse threads are still busy with
+/// the current requests. When indexing with a cold cache on slow (network or
+/// spinning) storage, the parse threads otherwise spend much of their time
+/// blocked on reading the included headers one after another.
+///
+/// The included files of a source are known from its last indexing, or from
+/// the build system's dependency information before that (see
+/// SourceFile::includedFileIds). Sources for which neither is available are not
+/// prefetched. Since most TUs include the same headers, each file is only
+/// prefetched once within a while.
+class HeaderPrefetcher {
+ public:
+  /// Maximum number of file paths that are remembered as prefetched. If this
+  /// is exceeded, all files may get prefetched again.
+  static constexpr int kMaxRememberedFiles = 64 * 1024;
+  
+  /// Waits for the prefetch thread to exit.
+  ~HeaderPrefetcher();
+  
+  /// Queues the given source files (and their included files) for
+  /// prefetching. The thread is started with the first call. Can be called
+  /// from any thread.
+  void Prefetch(const std::vector<QString>& canonicalSourcePaths, MainWindow* mainWindow);
+  
+  /// Stops the prefetch thread.
+  void Exit();
+  
+ private:
+  void ThreadMain();
+  
+  /// Protects the attributes below.
+  std::mutex mutex;
+  std::condition_variable newWorkCondition;
+  
+  /// Queued source paths, and the main window to look up their includes with.
+  std::vector<QString> queuedSourcePaths;
+  MainWindow* mainWindow = nullptr;
+  
+  /// Source paths that were queued before, to avoid repeating the lookup of
+  /// their includes when they are still within the look-ahead window of the
+  /// next request.
+  std::unordered_set<QString> queuedSourcePathsSet;
+  
+  /// Allows Exit() to abort the lookup of included files in the Qt thread,
+  /// which would deadlock if Exit() is called from the Qt thread.
+  RunInQtThreadAbortData abortData;
+  
+  std::atomic<bool> mExit{false};
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,259 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/highlight_cache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "cide/document.h"
+#include "cide/usr_index_cache.h"
+
+/// Identifies the cache file format. Must be increased whenever the format
+/// changes, such that existing cache files are discarded.
+constexpr quint32 kHighlightCacheMagic = 0x4349484C;  // "CIHL"
+constexpr quint32 kHighlightCacheVersion = 1;
+
+HighlightCache& HighlightCache::Instance() {
+  static HighlightCache instance;
+  return instance;
+}
+
+bool HighlightCache::Save(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Document* document) {
+  QDir cacheQDir(cacheDir);
+  if (!cacheQDir.exists()) {
+    cacheQDir.mkpath(".");
+  }
+  
+  QSaveFile file(GetCacheFilePath(canonicalPath));
+  if (!file.open(QIODevice::WriteOnly)) {
+    qDebug() << "Error: Cannot write highlight cache file:" << file.fileName();
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  stream << kHighlightCacheMagic << kHighlightCacheVersion;
+  stream << canonicalPath << HashContent(document) << USRIndexCache::HashCommandLineArgs(commandLineArgs);
+  
+  // Highlight ranges (except for the default text style range at index 0),
+  // with a style table that only contains the used styles.
+  const std::vector<HighlightRange>& ranges = document->GetHighlightRanges(0);
+  const HighlightStyleTable& documentStyles = document->GetHighlightStyles();
+  HighlightStyleTable styles;
+  std::vector<int> styleIds(ranges.size());
+  for (int i = 1, size = ranges.size(); i < size; ++ i) {
+    styleIds[i] = styles.Intern(documentStyles[ranges[i].styleId]);
+  }
+  stream << static_cast<quint32>(styles.size());
+  for (int i = 0; i < styles.size(); ++ i) {
+    const HighlightStyle& style = styles[i];
+    stream << style.affectsText << style.textColor.rgba() << style.bold
+           << style.affectsBackground << style.backgroundColor.rgba() << style.isNonCodeRange;
+  }
+  stream << static_cast<quint32>(ranges.empty() ? 0 : (ranges.size() - 1));
+  for (int i = 1, size = ranges.size(); i < size; ++ i) {
+    stream << static_cast<qint32>(ranges[i].range.start.offset)
+           << static_cast<qint32>(ranges[i].range.end.offset)
+           << static_cast<qint32>(styleIds[i]);
+  }
+  
+  // Contexts
+  const std::set<Context>& contexts = document->GetContexts();
+  stream << static_cast<quint32>(contexts.size());
+  for (const Context& context : contexts) {
+    stream << context.name << context.description
+           << static_cast<qint32>(context.nameInDescriptionRange.start.offset)
+           << static_cast<qint32>(context.nameInDescriptionRange.end.offset)
+           << static_cast<qint32>(context.range.start.offset)
+           << static_cast<qint32>(context.range.end.offset);
+  }
+  
+  // Problems, their ranges, and the lines that are marked with them
+  const std::vector<std::shared_ptr<Problem>>& problems = document->problems();
+  stream << static_cast<quint32>(problems.size());
+  for (const std::shared_ptr<Problem>& problem : problems) {
+    problem->Write(&stream);
+  }
+  
+  const std::set<ProblemRange>& problemRanges = document->problemRanges();
+  stream << static_cast<quint32>(problemRanges.size());
+  for (const ProblemRange& problemRange : problemRanges) {
+    stream << static_cast<qint32>(problemRange.problemIndex)
+           << static_cast<qint32>(problemRange.range.start.offset)
+           << static_cast<qint32>(problemRange.range.end.offset);
+  }
+  
+  const int problemAttributes = static_cast<int>(LineAttribute::Warning) | static_cast<int>(LineAttribute::Error);
+  std::vector<std::pair<int, int>> lineAttributes;  // (line, attributes)
+  document->GetLinesWithAttributes(&lineAttributes);
+  std::vector<std::pair<int, int>> problemLineAttributes;  // (line start, attributes)
+  for (const std::pair<int, int>& line : lineAttributes) {
+    if (line.second & problemAttributes) {
+      problemLineAttributes.emplace_back(document->LineStart(line.first).offset, line.second & problemAttributes);
+    }
+  }
+  stream << static_cast<quint32>(problemLineAttributes.size());
+  for (const std::pair<int, int>& line : problemLineAttributes) {
+    stream << static_cast<qint32>(line.first) << static_cast<qint32>(line.second);
+  }
+  
+  if (stream.status() != QDataStream::Ok) {
+    file.cancelWriting();
+    return false;
+  }
+  return file.commit();
+}
+
+bool HighlightCache::Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Document* document, HighlightBuffer* buffer) {
+  QFile file(GetCacheFilePath(canonicalPath));
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  quint32 magic;
+  quint32 version;
+  QString storedPath;
+  QByteArray storedContentHash;
+  QByteArray storedArgsHash;
+  stream >> magic >> version;
+  if (magic != kHighlightCacheMagic || version != kHighlightCacheVersion) {
+    return false;
+  }
+  stream >> storedPath >> storedContentHash >> storedArgsHash;
+  if (storedPath != canonicalPath ||
+      storedArgsHash != USRIndexCache::HashCommandLineArgs(commandLineArgs) ||
+      storedContentHash != HashContent(document)) {
+    return false;
+  }
+  
+  // Highlight ranges
+  quint32 numStyles;
+  stream >> numStyles;
+  if (stream.status() != QDataStream::Ok) {
+    return false;
+  }
+  std::vector<int> styleIds(numStyles);
+  for (quint32 i = 0; i < numStyles; ++ i) {
+    bool affectsText;
+    QRgb textColor;
+    bool bold;
+    bool affectsBackground;
+    QRgb backgroundColor;
+    bool isNonCodeRange;
+    stream >> affectsText >> textColor >> bold >> affectsBackground >> backgroundColor >> isNonCodeRange;
+    styleIds[i] = buffer->styles.Intern(HighlightStyle(affectsText, QColor::fromRgba(textColor), bold, affectsBackground, QColor::fromRgba(backgroundColor), isNonCodeRange));
+  }
+  
+  const int documentSize = document->FullDocumentRange().end.offset;
+  auto isValidRange = [&](qint32 start, qint32 end) {
+    return start >= 0 && start <= end && end <= documentSize;
+  };
+  
+  quint32 numRanges;
+  stream >> numRanges;
+  if (stream.status() != QDataStream::Ok) {
+    return false;
+  }
+  buffer->ranges.reserve(numRanges);
+  for (quint32 i = 0; i < numRanges; ++ i) {
+    qint32 start;
+    qint32 end;
+    qint32 styleId;
+    stream >> start >> end >> styleId;
+    if (stream.status() != QDataStream::Ok ||
+        !isValidRange(start, end) ||
+        styleId < 0 || styleId >= static_cast<qint32>(styleIds.size())) {
+      return false;
+    }
+    buffer->ranges.emplace_back(DocumentRange(start, end), styleIds[styleId]);
+  }
+  
+  // Contexts
+  quint32 numContexts;
+  stream >> numContexts;
+  for (quint32 i = 0; i < numContexts; ++ i) {
+    QString name;
+    QString description;
+    qint32 nameStart;
+    qint32 nameEnd;
+    qint32 start;
+    qint32 end;
+    stream >> name >> description >> nameStart >> nameEnd >> start >> end;
+    if (stream.status() != QDataStream::Ok || !isValidRange(start, end)) {
+      return false;
+    }
+    buffer->contexts.insert(Context(name, description, DocumentRange(nameStart, nameEnd), DocumentRange(start, end)));
+  }
+  
+  // Problems
+  quint32 numProblems;
+  stream >> numProblems;
+  for (quint32 i = 0; i < numProblems; ++ i) {
+    std::shared_ptr<Problem> problem = Problem::Read(&stream);
+    if (!problem) {
+      return false;
+    }
+    buffer->AddProblem(problem);
+  }
+  
+  quint32 numProblemRanges;
+  stream >> numProblemRanges;
+  for (quint32 i = 0; i < numProblemRanges; ++ i) {
+    qint32 problemIndex;
+    qint32 start;
+    qint32 end;
+    stream >> problemIndex >> start >> end;
+    if (stream.status() != QDataStream::Ok ||
+        !isValidRange(start, end) ||
+        problemIndex < 0 || problemIndex >= static_cast<qint32>(numProblems)) {
+      return false;
+    }
+    buffer->AddProblemRange(problemIndex, DocumentRange(start, end));
+  }
+  
+  quint32 numProblemLines;
+  stream >> numProblemLines;
+  for (quint32 i = 0; i < numProblemLines; ++ i) {
+    qint32 lineStart;
+    qint32 attributes;
+    stream >> lineStart >> attributes;
+    if (stream.status() != QDataStream::Ok || !isValidRange(lineStart, lineStart)) {
+      return false;
+    }
+    buffer->AddProblemLineAttributes(lineStart, attributes);
+  }
+  
+  return stream.status() == QDataStream::Ok;
+}
+
+void HighlightCache::Remove(const QString& canonicalPath) {
+  QFile::remove(GetCacheFilePath(canonicalPath));
+}
+
+HighlightCache::HighlightCache() {
+  QString cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir dir(cachePath);
+  dir = dir.filePath("highlighting");
+  dir.mkpath(".");
+  cacheDir = dir.path();
+}
+
+QString HighlightCache::GetCacheFilePath(const QString& canonicalPath) const {
+  QByteArray pathHash = QCryptographicHash::hash(canonicalPath.toUtf8(), QCryptographicHash::Sha1).toHex();
+  return QDir(cacheDir).filePath(QString::fromLatin1(pathHash));
+}
+
+QByteArray HighlightCache::HashContent(Document* document) {
+  return QCryptographicHash::hash(*document->GetDocumentTextUtf8(), QCryptographicHash::Sha1);
+}
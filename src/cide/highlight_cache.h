@@ -0,0 +1,54 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+class Document;
+struct HighlightBuffer;
+
+/// Stores the semantic highlighting (the highlight ranges of layer 0), the
+/// contexts, and the problems of closed documents on disk, such that reopening
+/// a document that did not change shows them right away instead of only after
+/// the first parse. The parse then replaces them as usual.
+///
+/// An entry is only valid if the document text and the command-line arguments
+/// for parsing the file are unchanged, which is checked with hashes of both.
+/// In contrast to the TUCache, the entries do not depend on the included
+/// files; changes to them are only reflected after the parse.
+///
+/// This class must only be used from the Qt thread.
+class HighlightCache {
+ public:
+  static HighlightCache& Instance();
+  
+  /// Stores the highlighting, contexts, and problems of @p document, which
+  /// must be the content of the file @p canonicalPath, replacing any existing
+  /// entry for it. Returns true on success, false otherwise.
+  bool Save(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Document* document);
+  
+  /// Tries to load the entry for the file @p canonicalPath into @p buffer,
+  /// which can then be applied with Document::ApplyHighlightBuffer(). Returns
+  /// true if an entry was found for the current text of @p document and the
+  /// given @p commandLineArgs, false otherwise.
+  bool Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Document* document, HighlightBuffer* buffer);
+  
+  /// Removes the entry for the file @p canonicalPath, if any.
+  void Remove(const QString& canonicalPath);
+  
+ private:
+  HighlightCache();
+  
+  QString GetCacheFilePath(const QString& canonicalPath) const;
+  
+  /// Returns a hash of the document text.
+  static QByteArray HashContent(Document* document);
+  
+  
+  QString cacheDir;
+};
@@ -0,0 +1,89 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/include_file_index.h"
+
+#include <algorithm>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileSystemWatcher>
+
+#include "cide/qt_thread.h"
+
+IncludeFileIndex& IncludeFileIndex::Instance() {
+  static IncludeFileIndex instance;
+  return instance;
+}
+
+void IncludeFileIndex::GetEntries(const std::vector<QString>& includeDirs, const QString& subPath, std::vector<Entry>* entries) {
+  entries->clear();
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  for (const QString& includeDir : includeDirs) {
+    QString dirPath = includeDir.endsWith('/') ? (includeDir + subPath) : (includeDir + '/' + subPath);
+    if (dirPath.size() > 1 && dirPath.endsWith('/')) {
+      dirPath.chop(1);
+    }
+    const std::vector<Entry>& dirEntries = GetDirectoryEntries(dirPath);
+    entries->insert(entries->end(), dirEntries.begin(), dirEntries.end());
+  }
+  lock.unlock();
+  
+  // Sort the entries and remove duplicates. stable_sort keeps the entry from
+  // the first include directory, which is the one that the compiler uses.
+  std::stable_sort(entries->begin(), entries->end(), [](const Entry& a, const Entry& b) {
+    return a.name < b.name;
+  });
+  entries->erase(std::unique(entries->begin(), entries->end(), [](const Entry& a, const Entry& b) {
+    return a.name == b.name;
+  }), entries->end());
+}
+
+const std::vector<IncludeFileIndex::Entry>& IncludeFileIndex::GetDirectoryEntries(const QString& dirPath) {
+  auto it = directories.find(dirPath);
+  if (it != directories.end()) {
+    return it->second;
+  }
+  
+  // Directories that do not exist are not cached, since they cannot be
+  // watched for getting created.
+  QDir dir(dirPath);
+  if (!dir.exists()) {
+    static const std::vector<Entry> noEntries;
+    return noEntries;
+  }
+  
+  std::vector<Entry>& entries = directories[dirPath];
+  QFileInfoList infos = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
+  entries.reserve(infos.size());
+  for (const QFileInfo& info : infos) {
+    entries.emplace_back();
+    Entry& newEntry = entries.back();
+    newEntry.name = info.fileName();
+    newEntry.isDirectory = info.isDir();
+  }
+  
+  // Watch the directory for added, removed, or renamed entries.
+  PostToQtThread([this, dirPath]() {
+    if (!watcher) {
+      watcher = new QFileSystemWatcher(QCoreApplication::instance());
+      QObject::connect(watcher, &QFileSystemWatcher::directoryChanged, [this](const QString& path) {
+        DirectoryChanged(path);
+      });
+    }
+    watcher->addPath(dirPath);
+  });
+  
+  return entries;
+}
+
+void IncludeFileIndex::DirectoryChanged(const QString& dirPath) {
+  std::unique_lock<std::mutex> lock(mutex);
+  directories.erase(dirPath);
+  lock.unlock();
+  
+  // The directory is listed (and watched) again on its next use.
+  watcher->removePath(dirPath);
+}
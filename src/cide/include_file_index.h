@@ -0,0 +1,59 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+class QFileSystemWatcher;
+
+/// Caches the contents of the directories within the include search paths,
+/// such that completing #include directives does not need to list the
+/// directories again for each invocation. The search paths of all TUs are
+/// mostly the same few directories, and only few sub-directories of them are
+/// ever looked at, so the cache is only filled on demand. Each cached
+/// directory is watched, and its entry is dropped when the watcher reports a
+/// change.
+///
+/// This class is thread-safe.
+class IncludeFileIndex {
+ public:
+  /// A file or directory within an include directory.
+  struct Entry {
+    QString name;
+    bool isDirectory;
+  };
+  
+  static IncludeFileIndex& Instance();
+  
+  /// Returns the entries of the directory @p subPath (which must be empty or
+  /// end with a '/') relative to each of the @p includeDirs. The entries are
+  /// sorted by name. If several include directories contain an entry with the
+  /// same name, it is only returned once.
+  void GetEntries(const std::vector<QString>& includeDirs, const QString& subPath, std::vector<Entry>* entries);
+  
+ private:
+  IncludeFileIndex() = default;
+  
+  /// Returns the sorted entries of the directory with the given path, listing
+  /// it if it is not cached. mutex must be locked.
+  const std::vector<Entry>& GetDirectoryEntries(const QString& dirPath);
+  
+  /// Drops the cached entries for the given directory.
+  void DirectoryChanged(const QString& dirPath);
+  
+  /// Maps the paths of the listed directories to their sorted entries.
+  std::unordered_map<QString, std::vector<Entry>> directories;
+  
+  /// Protects directories.
+  std::mutex mutex;
+  
+  /// Watches the directories in the cache. This is only accessed in the Qt
+  /// thread, where it is created on first use.
+  QFileSystemWatcher* watcher = nullptr;
+};
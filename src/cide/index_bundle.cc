@@ -0,0 +1,343 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/index_bundle.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <git2.h>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtDebug>
+
+#include "cide/clang_parser.h"
+#include "cide/project.h"
+#include "cide/usr_index_cache.h"
+
+/// Identifies the bundle file format. Must be increased whenever the format
+/// changes (including the format of USRIndexCache::WriteEntryData()).
+constexpr quint32 kIndexBundleMagic = 0x43494442;  // "CIDB"
+constexpr quint32 kIndexBundleVersion = 1;
+
+/// Placeholders for the directories that bundle paths are relative to.
+constexpr const char* kProjectDirPlaceholder = "$PROJECT_DIR";
+constexpr const char* kBuildDirPlaceholder = "$BUILD_DIR";
+
+/// Replaces the project and build directories in paths and command lines by
+/// placeholders (and back), such that bundles apply to checkouts at other
+/// locations.
+class BundlePathMapping {
+ public:
+  explicit BundlePathMapping(const Project* project) {
+    QString projectDir = QFileInfo(project->GetDir()).canonicalFilePath();
+    QString buildDir = project->GetBuildDir().canonicalPath();
+    if (!projectDir.isEmpty()) {
+      dirs.emplace_back(projectDir, QString::fromLatin1(kProjectDirPlaceholder));
+    }
+    if (!buildDir.isEmpty()) {
+      dirs.emplace_back(buildDir, QString::fromLatin1(kBuildDirPlaceholder));
+    }
+    
+    // Match nested directories (usually, the build directory within the
+    // project directory) first.
+    std::sort(dirs.begin(), dirs.end(), [](const std::pair<QString, QString>& a, const std::pair<QString, QString>& b) {
+      return a.first.size() > b.first.size();
+    });
+  }
+  
+  QString ToBundlePath(const QString& path) const {
+    for (const auto& dir : dirs) {
+      if (path.startsWith(dir.first) &&
+          (path.size() == dir.first.size() || path[dir.first.size()] == QChar('/'))) {
+        return dir.second + path.mid(dir.first.size());
+      }
+    }
+    return path;
+  }
+  
+  QString FromBundlePath(const QString& path) const {
+    for (const auto& dir : dirs) {
+      if (path.startsWith(dir.second) &&
+          (path.size() == dir.second.size() || path[dir.second.size()] == QChar('/'))) {
+        return dir.first + path.mid(dir.second.size());
+      }
+    }
+    return path;
+  }
+  
+  /// Returns a hash of the command line arguments with the directories
+  /// replaced, which is equal for equal compile settings in different
+  /// checkouts.
+  QByteArray HashCommandLineArgs(const std::vector<QByteArray>& args) const {
+    std::vector<QByteArray> mappedArgs = args;
+    for (QByteArray& arg : mappedArgs) {
+      for (const auto& dir : dirs) {
+        arg.replace(dir.first.toUtf8(), dir.second.toUtf8());
+      }
+    }
+    return USRIndexCache::HashCommandLineArgs(mappedArgs);
+  }
+  
+ private:
+  /// Pairs of (canonical directory path, placeholder), sorted by descending
+  /// length of the directory path.
+  std::vector<std::pair<QString, QString>> dirs;
+};
+
+/// Returns the SHA-1 hash of the content of the file at @p path, or an empty
+/// array if it cannot be read. Results are cached in @p cache, since many
+/// headers are included by many sources.
+static QByteArray GetFileContentHash(const QString& path, std::unordered_map<QString, QByteArray>* cache) {
+  auto it = cache->find(path);
+  if (it != cache->end()) {
+    return it->second;
+  }
+  
+  QByteArray result;
+  QFile file(path);
+  if (file.open(QIODevice::ReadOnly)) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (hash.addData(&file)) {
+      result = hash.result();
+    }
+  }
+  (*cache)[path] = result;
+  return result;
+}
+
+/// Replaces all paths in the USRs and references of @p entry with the result
+/// of @p mapPath.
+static void MapEntryPaths(const std::function<QString(const QString&)>& mapPath, USRIndexCache::Entry* entry) {
+  USRsByFile mappedUSRs;
+  mappedUSRs.reserve(entry->USRs.size());
+  for (auto& item : entry->USRs) {
+    mappedUSRs[mapPath(item.first)].swap(item.second);
+  }
+  entry->USRs.swap(mappedUSRs);
+  
+  USRReferencesByFile mappedReferences;
+  mappedReferences.reserve(entry->references.size());
+  for (auto& item : entry->references) {
+    mappedReferences[mapPath(item.first)].swap(item.second);
+  }
+  entry->references.swap(mappedReferences);
+}
+
+/// Returns the ID of the HEAD commit of the git repository that contains
+/// @p path, or an empty string if there is none.
+static QString GetHeadCommit(const QString& path) {
+  git_repository* repo = nullptr;
+  if (git_repository_open_ext(&repo, path.toLocal8Bit(), 0, nullptr) != 0) {
+    return QString();
+  }
+  std::shared_ptr<git_repository> repo_deleter(repo, [](git_repository* repo){ git_repository_free(repo); });
+  
+  git_oid headCommitId;
+  if (git_reference_name_to_id(&headCommitId, repo, "HEAD") != 0) {
+    return QString();
+  }
+  char buffer[GIT_OID_HEXSZ + 1];
+  git_oid_tostr(buffer, sizeof(buffer), &headCommitId);
+  return QString::fromLatin1(buffer);
+}
+
+/// Returns the command line that is used to parse the source file
+/// @p canonicalPath of @p project, or null if it has no known compile settings.
+static std::shared_ptr<const CompileCommandLine> GetSourceCommandLine(Project* project, const QString& canonicalPath) {
+  bool isGuess;
+  int guessQuality;
+  CompileSettings* settings = project->FindSettingsForFile(canonicalPath, &isGuess, &guessQuality);
+  if (!settings || isGuess) {
+    return nullptr;
+  }
+  return settings->GetCommandLine(true, canonicalPath, project);
+}
+
+int ExportIndexBundle(Project* project, const QString& bundlePath, bool indexMissingFiles, QString* errorReason) {
+  QSaveFile file(bundlePath);
+  if (!file.open(QIODevice::WriteOnly)) {
+    *errorReason = QObject::tr("Cannot write file: %1").arg(bundlePath);
+    return -1;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  stream << kIndexBundleMagic << kIndexBundleVersion << GetHeadCommit(project->GetDir());
+  
+  BundlePathMapping mapping(project);
+  std::unordered_map<QString, QByteArray> contentHashes;
+  std::unordered_set<QString> exportedPaths;
+  int numExported = 0;
+  
+  for (int targetIdx = 0; targetIdx < project->GetNumTargets(); ++ targetIdx) {
+    for (const SourceFile& source : project->GetTarget(targetIdx).sources) {
+      if (source.compileSettingsIndex < 0 ||
+          !exportedPaths.insert(source.path).second) {
+        continue;
+      }
+      std::shared_ptr<const CompileCommandLine> commandLine = GetSourceCommandLine(project, source.path);
+      if (!commandLine) {
+        continue;
+      }
+      
+      USRIndexCache::Entry entry;
+      if (!USRIndexCache::Instance().Load(source.path, commandLine->args, &entry)) {
+        if (!indexMissingFiles ||
+            !IndexFileIntoCache(source.path, commandLine->args) ||
+            !USRIndexCache::Instance().Load(source.path, commandLine->args, &entry)) {
+          qDebug() << "Index bundle export: no index available for" << source.path;
+          continue;
+        }
+      }
+      
+      // Identify the included files by their content, since modification
+      // times differ between checkouts.
+      std::vector<std::pair<QString, QByteArray>> includes;
+      includes.reserve(entry.includes.size());
+      for (const std::pair<QString, qint64>& include : entry.includes) {
+        QByteArray contentHash = GetFileContentHash(include.first, &contentHashes);
+        if (contentHash.isEmpty()) {
+          break;
+        }
+        includes.emplace_back(mapping.ToBundlePath(include.first), contentHash);
+      }
+      if (includes.size() != entry.includes.size()) {
+        continue;
+      }
+      
+      MapEntryPaths([&](const QString& path) { return mapping.ToBundlePath(path); }, &entry);
+      
+      stream << true << mapping.ToBundlePath(source.path) << mapping.HashCommandLineArgs(commandLine->args);
+      stream << static_cast<quint32>(includes.size());
+      for (const std::pair<QString, QByteArray>& include : includes) {
+        stream << include.first << include.second;
+      }
+      USRIndexCache::WriteEntryData(entry, &stream);
+      ++ numExported;
+    }
+  }
+  stream << false;
+  
+  if (stream.status() != QDataStream::Ok || !file.commit()) {
+    file.cancelWriting();
+    *errorReason = QObject::tr("Failed to write file: %1").arg(bundlePath);
+    return -1;
+  }
+  return numExported;
+}
+
+bool ImportIndexBundle(Project* project, const QString& bundlePath, std::vector<QString>* importedPaths, int* numSkipped, QString* bundleCommit, QString* errorReason) {
+  importedPaths->clear();
+  *numSkipped = 0;
+  
+  QFile file(bundlePath);
+  if (!file.open(QIODevice::ReadOnly)) {
+    *errorReason = QObject::tr("Cannot read file: %1").arg(bundlePath);
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  quint32 magic;
+  quint32 version;
+  stream >> magic >> version;
+  if (magic != kIndexBundleMagic || version != kIndexBundleVersion) {
+    *errorReason = QObject::tr("The file is not an index bundle of this CIDE version: %1").arg(bundlePath);
+    return false;
+  }
+  stream >> *bundleCommit;
+  
+  BundlePathMapping mapping(project);
+  std::unordered_map<QString, QByteArray> contentHashes;
+  
+  while (true) {
+    bool hasEntry = false;
+    stream >> hasEntry;
+    if (stream.status() != QDataStream::Ok) {
+      *errorReason = QObject::tr("The index bundle is truncated: %1").arg(bundlePath);
+      return false;
+    }
+    if (!hasEntry) {
+      break;
+    }
+    
+    QString sourcePath;
+    QByteArray argsHash;
+    quint32 numIncludes;
+    stream >> sourcePath >> argsHash >> numIncludes;
+    std::vector<std::pair<QString, QByteArray>> includes(numIncludes);
+    for (quint32 i = 0; i < numIncludes; ++ i) {
+      stream >> includes[i].first >> includes[i].second;
+    }
+    USRIndexCache::Entry entry;
+    if (!USRIndexCache::ReadEntryData(&stream, &entry)) {
+      *errorReason = QObject::tr("The index bundle is truncated: %1").arg(bundlePath);
+      return false;
+    }
+    
+    // Only import the entry if the source is compiled with equal settings
+    // here, and all of its inputs are unchanged.
+    sourcePath = mapping.FromBundlePath(sourcePath);
+    std::shared_ptr<const CompileCommandLine> commandLine = GetSourceCommandLine(project, sourcePath);
+    if (!commandLine ||
+        mapping.HashCommandLineArgs(commandLine->args) != argsHash) {
+      ++ *numSkipped;
+      continue;
+    }
+    
+    entry.includes.resize(numIncludes);
+    bool includesUnchanged = true;
+    for (quint32 i = 0; i < numIncludes; ++ i) {
+      QString includePath = mapping.FromBundlePath(includes[i].first);
+      if (GetFileContentHash(includePath, &contentHashes) != includes[i].second) {
+        includesUnchanged = false;
+        break;
+      }
+      entry.includes[i] = std::make_pair(includePath, QFileInfo(includePath).lastModified().toSecsSinceEpoch());
+    }
+    if (!includesUnchanged) {
+      ++ *numSkipped;
+      continue;
+    }
+    
+    MapEntryPaths([&](const QString& path) { return mapping.FromBundlePath(path); }, &entry);
+    if (USRIndexCache::Instance().Save(sourcePath, commandLine->args, entry)) {
+      importedPaths->push_back(sourcePath);
+    } else {
+      ++ *numSkipped;
+    }
+  }
+  
+  return true;
+}
+
+int RunIndexBundleExport(const QString& projectPath, const QString& bundlePath) {
+  Project project;
+  if (!project.Load(projectPath)) {
+    qWarning() << "Failed to load the project:" << projectPath;
+    return 1;
+  }
+  
+  QString errorReason;
+  if (!project.Configure(&errorReason, nullptr)) {
+    qWarning() << "Failed to configure the project:" << errorReason;
+    return 1;
+  }
+  
+  int numExported = ExportIndexBundle(&project, bundlePath, /*indexMissingFiles*/ true, &errorReason);
+  if (numExported < 0) {
+    qWarning() << "Failed to export the index bundle:" << errorReason;
+    return 1;
+  }
+  qDebug() << "Exported the index of" << numExported << "source files to" << bundlePath;
+  return 0;
+}
@@ -0,0 +1,50 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QString>
+
+class Project;
+
+/// Command line argument that makes CIDE export an index bundle for a project
+/// (see RunIndexBundleExport()) instead of starting the editor. This is meant
+/// for CI jobs: "CIDE --export-index <project.cide> <bundle file>".
+constexpr const char* kExportIndexArgument = "--export-index";
+
+/// Writes the indexing results of all compiled source files of @p project (as
+/// stored in the USRIndexCache) to the single file @p bundlePath, such that
+/// they can be imported by other checkouts of the same code with
+/// ImportIndexBundle(). Sources without a valid cache entry are indexed first
+/// (in the calling thread) if @p indexMissingFiles is true, and are skipped
+/// otherwise.
+///
+/// Paths within the project and build directories are stored relative to
+/// these directories, and included files are identified by a hash of their
+/// content rather than by their modification time. The bundle also records
+/// the git commit of the project directory, if any.
+///
+/// Returns the number of exported sources, or -1 on failure, in which case
+/// @p errorReason is set.
+int ExportIndexBundle(Project* project, const QString& bundlePath, bool indexMissingFiles, QString* errorReason);
+
+/// Imports an index bundle that was created with ExportIndexBundle() into the
+/// USRIndexCache. An entry is only imported if its source file is compiled
+/// with the same settings in @p project, and all files that it includes have
+/// the same content locally as when the bundle was created. Thus, sources
+/// affected by local modifications are skipped and get indexed normally.
+///
+/// Returns false on failure to read the bundle, in which case @p errorReason is
+/// set. On success, the canonical paths of the imported sources are returned
+/// in @p importedPaths, the number of skipped entries in @p numSkipped, and
+/// the git commit that the bundle was created for in @p bundleCommit (empty if
+/// unknown).
+bool ImportIndexBundle(Project* project, const QString& bundlePath, std::vector<QString>* importedPaths, int* numSkipped, QString* bundleCommit, QString* errorReason);
+
+/// Main function for the kExportIndexArgument mode: loads and configures the
+/// project, indexes its files, and exports the index bundle. Returns the
+/// program's exit code.
+int RunIndexBundleExport(const QString& projectPath, const QString& bundlePath);
@@ -0,0 +1,401 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/index_service.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QLockFile>
+#include <QPointer>
+#include <QProcess>
+#include <QTimer>
+
+#include "cide/clang_parser.h"
+#include "cide/qt_thread.h"
+#include "cide/usr_index_cache.h"
+
+// Protocol between the CIDE instances and the service: The requests are
+// formatted like those for index worker processes (see FormatIndexRequest()).
+// The service answers each request with a single line containing one of the
+// responses below.
+constexpr const char* kIndexedResponse = "indexed";
+constexpr const char* kFailedResponse = "failed";
+constexpr const char* kCrashedResponse = "crashed";
+
+/// Timeout for connecting to a running service.
+constexpr int kServiceConnectTimeoutMs = 1000;
+
+/// Timeout for starting the service and connecting to it.
+constexpr int kServiceStartTimeoutMs = 10000;
+
+/// Time after which a request that was not answered is given up. This is
+/// longer than for worker processes, since the request may be queued behind
+/// those of other instances.
+constexpr std::chrono::minutes kServiceRequestTimeout(30);
+
+/// Interval for checking for AbortIndexServiceRequests() while waiting for the
+/// service.
+constexpr int kServicePollIntervalMs = 100;
+
+/// Time without any connected instance after which the service exits.
+constexpr int kServiceIdleExitTimeoutMs = 5 * 60 * 1000;
+
+static std::atomic<bool> serviceRequestsAborted(false);
+
+/// Set if the service could not be started, such that the remaining requests
+/// do not try again.
+static std::atomic<bool> serviceUnavailable(false);
+
+/// Serializes starting the service among the parse threads.
+static std::mutex serviceStartMutex;
+
+/// Connection of one parse thread to the service. Like QProcess, QLocalSocket
+/// objects may only be used from the thread that created them.
+static thread_local std::unique_ptr<QLocalSocket> threadServiceConnection;
+
+/// Returns the name of the service's local socket, which is unique per user.
+static QString GetIndexServiceName() {
+  QString userName = QString::fromLocal8Bit(qgetenv("USER"));
+  if (userName.isEmpty()) {
+    userName = QString::fromLocal8Bit(qgetenv("USERNAME"));
+  }
+  return QStringLiteral("CIDE-index-service-") + userName;
+}
+
+/// Connects the calling thread to the service (if it is not connected yet),
+/// starting the service if necessary. Returns false if this fails.
+static bool ConnectToIndexService() {
+  if (threadServiceConnection && threadServiceConnection->state() == QLocalSocket::ConnectedState) {
+    return true;
+  }
+  
+  QString serviceName = GetIndexServiceName();
+  threadServiceConnection.reset(new QLocalSocket());
+  threadServiceConnection->connectToServer(serviceName);
+  if (threadServiceConnection->waitForConnected(kServiceConnectTimeoutMs)) {
+    return true;
+  }
+  
+  // Start the service. Only one thread does this, the others then find the
+  // service started by it.
+  std::unique_lock<std::mutex> lock(serviceStartMutex);
+  if (serviceUnavailable) {
+    threadServiceConnection.reset();
+    return false;
+  }
+  threadServiceConnection->connectToServer(serviceName);
+  if (threadServiceConnection->waitForConnected(kServiceConnectTimeoutMs)) {
+    return true;
+  }
+  
+  if (!QProcess::startDetached(QCoreApplication::applicationFilePath(), QStringList() << kIndexServiceArgument)) {
+    qDebug() << "Failed to start the index service";
+    serviceUnavailable = true;
+    threadServiceConnection.reset();
+    return false;
+  }
+  
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kServiceStartTimeoutMs);
+  while (!serviceRequestsAborted && std::chrono::steady_clock::now() < deadline) {
+    threadServiceConnection->connectToServer(serviceName);
+    if (threadServiceConnection->waitForConnected(kServicePollIntervalMs)) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kServicePollIntervalMs));
+  }
+  
+  qDebug() << "Failed to connect to the index service after starting it";
+  serviceUnavailable = true;
+  threadServiceConnection.reset();
+  return false;
+}
+
+IndexWorkerResult IndexFileInIndexService(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs) {
+  if (serviceRequestsAborted || serviceUnavailable) {
+    return IndexWorkerResult::Unavailable;
+  }
+  
+  QByteArray request;
+  if (!FormatIndexRequest(canonicalPath, commandLineArgs, &request)) {
+    return IndexWorkerResult::Unavailable;
+  }
+  if (!ConnectToIndexService()) {
+    return IndexWorkerResult::Unavailable;
+  }
+  
+  // Send the request and wait for the response.
+  QLocalSocket& socket = *threadServiceConnection;
+  socket.write(request);
+  socket.flush();
+  
+  auto deadline = std::chrono::steady_clock::now() + kServiceRequestTimeout;
+  while (!socket.canReadLine()) {
+    if (serviceRequestsAborted) {
+      threadServiceConnection.reset();
+      return IndexWorkerResult::Unavailable;
+    }
+    if (socket.state() != QLocalSocket::ConnectedState) {
+      // The service exited while handling the request. Since it might have
+      // crashed on this file, do not index it in this process.
+      threadServiceConnection.reset();
+      return IndexWorkerResult::Crashed;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      qDebug() << "Index service timed out for:" << canonicalPath;
+      threadServiceConnection.reset();
+      return IndexWorkerResult::Crashed;
+    }
+    socket.waitForReadyRead(kServicePollIntervalMs);
+  }
+  
+  QByteArray response = socket.readLine().trimmed();
+  if (response == kIndexedResponse) {
+    return IndexWorkerResult::Indexed;
+  } else if (response == kCrashedResponse) {
+    return IndexWorkerResult::Crashed;
+  }
+  return IndexWorkerResult::Failed;
+}
+
+void AbortIndexServiceRequests() {
+  serviceRequestsAborted = true;
+}
+
+
+/// State of the index service process. The job queue is shared with the worker
+/// threads, all other members are only accessed in the Qt thread.
+class IndexService {
+ public:
+  ~IndexService();
+  
+  /// Starts listening for connections and starts the worker threads. Returns
+  /// false on failure.
+  bool Start();
+  
+ private:
+  struct Job {
+    /// The request, which identifies the job.
+    QByteArray key;
+    
+    QString canonicalPath;
+    std::vector<QByteArray> commandLineArgs;
+  };
+  
+  void HandleNewConnection();
+  void HandleReadyRead(QLocalSocket* socket);
+  void HandleDisconnected(QLocalSocket* socket);
+  
+  /// Sends @p response to all connections that wait for the job with @p key.
+  void FinishJob(const QByteArray& key, const char* response);
+  
+  void WorkerThreadMain();
+  
+  QLocalServer server;
+  
+  /// Makes the service exit once no instance has been connected for
+  /// kServiceIdleExitTimeoutMs.
+  QTimer idleTimer;
+  int numConnections = 0;
+  
+  /// Lines of the incomplete request of each connection.
+  std::unordered_map<QLocalSocket*, std::vector<QByteArray>> partialRequests;
+  
+  /// Connections that wait for each queued or running job, by job key.
+  /// Requests for a job that exists already only add a connection here.
+  std::map<QByteArray, std::vector<QPointer<QLocalSocket>>> waitingConnections;
+  
+  // Job queue, protected by jobsMutex.
+  std::mutex jobsMutex;
+  std::condition_variable jobsCondition;
+  std::deque<Job> jobs;
+  bool exit = false;
+  
+  std::vector<std::thread> workerThreads;
+};
+
+IndexService::~IndexService() {
+  jobsMutex.lock();
+  exit = true;
+  jobsMutex.unlock();
+  jobsCondition.notify_all();
+  
+  AbortIndexWorkerProcesses();
+  for (std::thread& thread : workerThreads) {
+    thread.join();
+  }
+}
+
+bool IndexService::Start() {
+  // Since the caller holds the service's lock file, an existing socket can
+  // only be a leftover of a service that crashed.
+  QString serviceName = GetIndexServiceName();
+  QLocalServer::removeServer(serviceName);
+  server.setSocketOptions(QLocalServer::UserAccessOption);
+  if (!server.listen(serviceName)) {
+    qDebug() << "Index service: Failed to listen on" << serviceName << ":" << server.errorString();
+    return false;
+  }
+  QObject::connect(&server, &QLocalServer::newConnection, [this]() {
+    HandleNewConnection();
+  });
+  
+  idleTimer.setSingleShot(true);
+  idleTimer.setInterval(kServiceIdleExitTimeoutMs);
+  QObject::connect(&idleTimer, &QTimer::timeout, []() {
+    QCoreApplication::quit();
+  });
+  idleTimer.start();
+  
+  // Leave some CPU for the editors themselves.
+  int threadCount = std::max<int>(1, std::thread::hardware_concurrency() / 2);
+  for (int i = 0; i < threadCount; ++ i) {
+    workerThreads.emplace_back(&IndexService::WorkerThreadMain, this);
+  }
+  return true;
+}
+
+void IndexService::HandleNewConnection() {
+  while (QLocalSocket* socket = server.nextPendingConnection()) {
+    ++ numConnections;
+    idleTimer.stop();
+    
+    QObject::connect(socket, &QLocalSocket::readyRead, socket, [this, socket]() {
+      HandleReadyRead(socket);
+    });
+    QObject::connect(socket, &QLocalSocket::disconnected, socket, [this, socket]() {
+      HandleDisconnected(socket);
+    });
+  }
+}
+
+void IndexService::HandleReadyRead(QLocalSocket* socket) {
+  std::vector<QByteArray>& lines = partialRequests[socket];
+  while (socket->canReadLine()) {
+    QByteArray line = socket->readLine();
+    line.chop(1);  // remove the '\n'
+    lines.push_back(line);
+    
+    if (lines.size() < 2) {
+      continue;
+    }
+    bool ok;
+    int argCount = lines[1].toInt(&ok);
+    if (!ok || argCount < 0) {
+      qDebug() << "Index service: Received an invalid request, closing the connection";
+      socket->abort();
+      return;
+    }
+    if (lines.size() < 2 + static_cast<std::size_t>(argCount)) {
+      continue;
+    }
+    
+    Job job;
+    job.canonicalPath = QString::fromUtf8(lines[0]);
+    job.commandLineArgs.assign(lines.begin() + 2, lines.end());
+    FormatIndexRequest(job.canonicalPath, job.commandLineArgs, &job.key);
+    lines.clear();
+    
+    std::vector<QPointer<QLocalSocket>>& waiting = waitingConnections[job.key];
+    waiting.emplace_back(socket);
+    if (waiting.size() > 1) {
+      // The file is being indexed for another request already.
+      continue;
+    }
+    
+    jobsMutex.lock();
+    jobs.push_back(std::move(job));
+    jobsMutex.unlock();
+    jobsCondition.notify_one();
+  }
+}
+
+void IndexService::HandleDisconnected(QLocalSocket* socket) {
+  // Jobs that the connection waits for are still finished, since their results
+  // are stored in the USRIndexCache.
+  partialRequests.erase(socket);
+  socket->deleteLater();
+  
+  -- numConnections;
+  if (numConnections == 0) {
+    idleTimer.start();
+  }
+}
+
+void IndexService::FinishJob(const QByteArray& key, const char* response) {
+  auto it = waitingConnections.find(key);
+  if (it == waitingConnections.end()) {
+    return;
+  }
+  for (QPointer<QLocalSocket>& socket : it->second) {
+    if (socket) {
+      socket->write(QByteArray(response) + '\n');
+    }
+  }
+  waitingConnections.erase(it);
+}
+
+void IndexService::WorkerThreadMain() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    jobsCondition.wait(lock, [&]() { return exit || !jobs.empty(); });
+    if (exit) {
+      return;
+    }
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    
+    // The file may have been indexed for an earlier request of another
+    // instance, which then did not wait for this job.
+    const char* response;
+    USRIndexCache::Entry cacheEntry;
+    if (USRIndexCache::Instance().Load(job.canonicalPath, job.commandLineArgs, &cacheEntry)) {
+      response = kIndexedResponse;
+    } else {
+      IndexWorkerResult result = IndexFileInWorkerProcess(job.canonicalPath, job.commandLineArgs);
+      if (result == IndexWorkerResult::Unavailable) {
+        result = IndexFileIntoCache(job.canonicalPath, job.commandLineArgs) ? IndexWorkerResult::Indexed : IndexWorkerResult::Failed;
+      }
+      response =
+          (result == IndexWorkerResult::Indexed) ? kIndexedResponse :
+          ((result == IndexWorkerResult::Crashed) ? kCrashedResponse : kFailedResponse);
+    }
+    
+    QByteArray key = job.key;
+    PostToQtThread([this, key, response]() {
+      FinishJob(key, response);
+    });
+  }
+}
+
+int RunIndexService() {
+  // Only one service may run per user. Since the service runs for a long time,
+  // the lock must only be considered stale if its process does not exist
+  // anymore.
+  QLockFile lockFile(QDir::temp().filePath(GetIndexServiceName() + QStringLiteral(".lock")));
+  lockFile.setStaleLockTime(0);
+  if (!lockFile.tryLock()) {
+    return 0;
+  }
+  
+  IndexService service;
+  if (!service.Start()) {
+    return 1;
+  }
+  return QCoreApplication::exec();
+}
@@ -0,0 +1,45 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+#include "cide/index_worker.h"
+
+/// Command line argument that makes CIDE run as the per-user index service
+/// (see RunIndexService()) instead of starting the editor.
+constexpr const char* kIndexServiceArgument = "--index-service";
+
+/// Indexes the file @p canonicalPath (as read from disk) in the index service,
+/// a background process that is shared by all CIDE instances of the current
+/// user. The service stores the result in the USRIndexCache, from which it can
+/// then be loaded, like for IndexFileInWorkerProcess(). Since the service
+/// handles the requests of all instances, several instances that work on the
+/// same code (for example, different worktrees that share most headers) do not
+/// index the same file at the same time, and their combined indexing work is
+/// limited to the service's thread count.
+///
+/// The service is started on first use if it is not running yet. Each calling
+/// thread uses its own connection to the service. Blocks until the file is
+/// indexed. Returns IndexWorkerResult::Unavailable if the service cannot be
+/// used, in which case the file should be indexed otherwise.
+IndexWorkerResult IndexFileInIndexService(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs);
+
+/// Makes all current and future calls to IndexFileInIndexService() return
+/// IndexWorkerResult::Unavailable quickly. Called on program exit, such that
+/// the parse threads do not wait for the service.
+void AbortIndexServiceRequests();
+
+/// Main function of the index service process. Accepts connections from CIDE
+/// instances and indexes the requested files in index worker processes (see
+/// IndexFileInWorkerProcess()), such that a libclang crash does not take down
+/// the service. Requests for a file that is already being indexed (with the
+/// same command line) wait for the running job instead of indexing the file
+/// again. Exits if another service is running already, and once no instance
+/// has been connected for some time. Returns the program's exit code.
+int RunIndexService();
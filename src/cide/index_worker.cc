@@ -0,0 +1,163 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/index_worker.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QProcess>
+
+#include "cide/clang_parser.h"
+
+// Protocol between the calling process and the worker process: For each
+// request, the caller writes the canonical path of the file, the number of
+// command line arguments, and the arguments, each on a separate line. The
+// worker answers with a single line containing kIndexedResponse or
+// kFailedResponse.
+constexpr const char* kIndexedResponse = "indexed";
+constexpr const char* kFailedResponse = "failed";
+
+/// Number of files that a worker process indexes before it is replaced by a
+/// new process.
+constexpr int kMaxFilesPerWorkerProcess = 64;
+
+/// Timeout for starting a worker process.
+constexpr int kWorkerStartTimeoutMs = 10000;
+
+/// Time after which a worker process that did not answer a request is
+/// considered to hang.
+constexpr std::chrono::minutes kWorkerRequestTimeout(10);
+
+/// Interval for checking for AbortIndexWorkerProcesses() while waiting for a
+/// worker process.
+constexpr int kWorkerPollIntervalMs = 100;
+
+static std::atomic<bool> workerProcessesAborted(false);
+
+/// A worker process owned by one parse thread. QProcess objects may only be
+/// used from the thread that created them, thus each thread uses its own.
+struct IndexWorkerProcess {
+  ~IndexWorkerProcess() {
+    if (process.state() != QProcess::NotRunning) {
+      // Closing stdin makes the worker exit.
+      process.closeWriteChannel();
+      if (!process.waitForFinished(1000)) {
+        process.kill();
+        process.waitForFinished(1000);
+      }
+    }
+  }
+  
+  QProcess process;
+  int indexedFileCount = 0;
+};
+
+static thread_local std::unique_ptr<IndexWorkerProcess> threadWorker;
+
+bool FormatIndexRequest(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, QByteArray* request) {
+  // Line breaks cannot be transmitted with the line-based protocol.
+  *request = canonicalPath.toUtf8();
+  if (request->contains('\n')) {
+    return false;
+  }
+  *request += '\n' + QByteArray::number(static_cast<int>(commandLineArgs.size())) + '\n';
+  for (const QByteArray& arg : commandLineArgs) {
+    if (arg.contains('\n')) {
+      return false;
+    }
+    *request += arg + '\n';
+  }
+  return true;
+}
+
+IndexWorkerResult IndexFileInWorkerProcess(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs) {
+  if (workerProcessesAborted) {
+    return IndexWorkerResult::Unavailable;
+  }
+  
+  QByteArray request;
+  if (!FormatIndexRequest(canonicalPath, commandLineArgs, &request)) {
+    return IndexWorkerResult::Unavailable;
+  }
+  
+  // Replace the worker process if it indexed enough files.
+  if (threadWorker && threadWorker->indexedFileCount >= kMaxFilesPerWorkerProcess) {
+    threadWorker.reset();
+  }
+  
+  // Start a worker process if necessary.
+  if (!threadWorker) {
+    threadWorker.reset(new IndexWorkerProcess());
+    threadWorker->process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    threadWorker->process.start(QCoreApplication::applicationFilePath(), QStringList() << kIndexWorkerArgument);
+    if (!threadWorker->process.waitForStarted(kWorkerStartTimeoutMs)) {
+      qDebug() << "Failed to start an index worker process:" << threadWorker->process.errorString();
+      threadWorker.reset();
+      return IndexWorkerResult::Unavailable;
+    }
+  }
+  
+  // Send the request and wait for the response.
+  QProcess& process = threadWorker->process;
+  process.write(request);
+  
+  auto deadline = std::chrono::steady_clock::now() + kWorkerRequestTimeout;
+  while (!process.canReadLine()) {
+    if (workerProcessesAborted) {
+      threadWorker.reset();
+      return IndexWorkerResult::Unavailable;
+    }
+    if (process.state() == QProcess::NotRunning) {
+      threadWorker.reset();
+      return IndexWorkerResult::Crashed;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      qDebug() << "Index worker process timed out for:" << canonicalPath;
+      threadWorker.reset();
+      return IndexWorkerResult::Crashed;
+    }
+    process.waitForReadyRead(kWorkerPollIntervalMs);
+  }
+  
+  QByteArray response = process.readLine().trimmed();
+  ++ threadWorker->indexedFileCount;
+  return (response == kIndexedResponse) ? IndexWorkerResult::Indexed : IndexWorkerResult::Failed;
+}
+
+void AbortIndexWorkerProcesses() {
+  workerProcessesAborted = true;
+}
+
+int RunIndexWorker() {
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    QString canonicalPath = QString::fromUtf8(line.data(), line.size());
+    
+    if (!std::getline(std::cin, line)) {
+      break;
+    }
+    bool ok;
+    int argCount = QByteArray(line.data(), line.size()).toInt(&ok);
+    if (!ok || argCount < 0) {
+      return 1;
+    }
+    std::vector<QByteArray> commandLineArgs(argCount);
+    for (int i = 0; i < argCount; ++ i) {
+      if (!std::getline(std::cin, line)) {
+        return 1;
+      }
+      commandLineArgs[i] = QByteArray(line.data(), line.size());
+    }
+    
+    bool success = IndexFileIntoCache(canonicalPath, commandLineArgs);
+    std::cout << (success ? kIndexedResponse : kFailedResponse) << std::endl;
+  }
+  return 0;
+}
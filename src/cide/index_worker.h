@@ -0,0 +1,55 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+/// Command line argument that makes CIDE run as an index worker process (see
+/// RunIndexWorker()) instead of starting the editor.
+constexpr const char* kIndexWorkerArgument = "--index-worker";
+
+enum class IndexWorkerResult {
+  /// The file was indexed, and the result can be loaded from the USRIndexCache.
+  Indexed = 0,
+  
+  /// Parsing the file failed (but the worker process survived).
+  Failed,
+  
+  /// The worker process crashed or hung while indexing the file.
+  Crashed,
+  
+  /// No worker process could be used. The file should be indexed in-process.
+  Unavailable
+};
+
+/// Formats a request to index @p canonicalPath with @p commandLineArgs in the
+/// line-based protocol of index worker processes (which the IndexService
+/// uses as well). Returns false if the request cannot be represented, i.e., if
+/// the path or an argument contains a line break.
+bool FormatIndexRequest(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, QByteArray* request);
+
+/// Indexes the file @p canonicalPath (as read from disk) in a worker process,
+/// which stores the result in the USRIndexCache (see IndexFileIntoCache()).
+/// This isolates the calling process from crashes in libclang, and the memory
+/// that libclang used is returned to the system when the worker process exits.
+///
+/// Each calling thread uses its own worker process, which is started on first
+/// use, replaced after it indexed a number of files (since libclang's memory
+/// usage tends to grow over time), and terminated when the thread exits.
+/// Blocks until the worker process is done.
+IndexWorkerResult IndexFileInWorkerProcess(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs);
+
+/// Makes all current and future calls to IndexFileInWorkerProcess() return
+/// IndexWorkerResult::Unavailable quickly. Called on program exit, such that
+/// the parse threads do not wait for their worker processes.
+void AbortIndexWorkerProcesses();
+
+/// Main function of index worker processes. Reads indexing requests from
+/// stdin, and writes one line to stdout for each processed request. Returns
+/// once stdin is closed.
+int RunIndexWorker();
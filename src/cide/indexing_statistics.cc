@@ -0,0 +1,86 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/indexing_statistics.h"
+
+#include <algorithm>
+
+/// Finish times older than this are dropped, which bounds the window that
+/// GetFilesPerSecond() can use.
+constexpr double kMaxThroughputWindowSeconds = 60;
+
+IndexingStatistics& IndexingStatistics::Instance() {
+  static IndexingStatistics instance;
+  return instance;
+}
+
+void IndexingStatistics::AddIndexedFile(const QString& canonicalPath, double durationMs, int USRCount, int includeCount, bool fromCache) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  
+  FileEntry& entry = files[canonicalPath];
+  entry.canonicalPath = canonicalPath;
+  entry.durationMs = durationMs;
+  entry.USRCount = USRCount;
+  entry.includeCount = includeCount;
+  entry.fromCache = fromCache;
+  
+  recentFinishTimes.push_back(now);
+  while (std::chrono::duration<double>(now - recentFinishTimes.front()).count() > kMaxThroughputWindowSeconds) {
+    recentFinishTimes.pop_front();
+  }
+}
+
+double IndexingStatistics::GetFilesPerSecond(double windowSeconds) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  int count = 0;
+  for (auto it = recentFinishTimes.rbegin(); it != recentFinishTimes.rend(); ++ it) {
+    if (std::chrono::duration<double>(now - *it).count() > windowSeconds) {
+      break;
+    }
+    ++ count;
+  }
+  return count / windowSeconds;
+}
+
+int IndexingStatistics::GetIndexedFileCount() {
+  std::unique_lock<std::mutex> lock(mutex);
+  return files.size();
+}
+
+double IndexingStatistics::GetTotalDurationMs() {
+  std::unique_lock<std::mutex> lock(mutex);
+  double result = 0;
+  for (const auto& item : files) {
+    result += item.second.durationMs;
+  }
+  return result;
+}
+
+std::vector<IndexingStatistics::FileEntry> IndexingStatistics::GetSlowestFiles(int count) {
+  std::vector<FileEntry> result;
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  result.reserve(files.size());
+  for (const auto& item : files) {
+    result.push_back(item.second);
+  }
+  lock.unlock();
+  
+  count = std::min<int>(count, result.size());
+  std::partial_sort(result.begin(), result.begin() + count, result.end(), [](const FileEntry& a, const FileEntry& b) {
+    return a.durationMs > b.durationMs;
+  });
+  result.resize(count);
+  return result;
+}
+
+void IndexingStatistics::Clear() {
+  std::unique_lock<std::mutex> lock(mutex);
+  files.clear();
+  recentFinishTimes.clear();
+}
@@ -0,0 +1,77 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+#include "cide/util.h"
+
+/// Collects timing information about indexed files, which is shown by the
+/// IndexingStatisticsDialog to find out where indexing time goes (for example,
+/// headers that make many translation units slow to parse).
+///
+/// Only the latest result for each file is kept. This class is thread-safe.
+class IndexingStatistics {
+ public:
+  struct FileEntry {
+    QString canonicalPath;
+    
+    /// Time taken to parse and index the file (or to load the indexing result
+    /// from the USRIndexCache), in milliseconds.
+    double durationMs;
+    
+    /// Number of USRs that indexing the file yielded (including those in
+    /// included files).
+    int USRCount;
+    
+    /// Number of files included by the translation unit (directly or
+    /// indirectly).
+    int includeCount;
+    
+    /// Whether the result was loaded from the USRIndexCache.
+    bool fromCache;
+  };
+  
+  static IndexingStatistics& Instance();
+  
+  /// Records the result of indexing a file.
+  void AddIndexedFile(const QString& canonicalPath, double durationMs, int USRCount, int includeCount, bool fromCache);
+  
+  /// Returns the number of files indexed within the last @p windowSeconds,
+  /// divided by @p windowSeconds.
+  double GetFilesPerSecond(double windowSeconds = 10);
+  
+  /// Returns the number of files for which a result was recorded.
+  int GetIndexedFileCount();
+  
+  /// Returns the sum of the durations of all recorded files, in milliseconds.
+  double GetTotalDurationMs();
+  
+  /// Returns the (at most) @p count files which took longest to index, sorted
+  /// by decreasing duration.
+  std::vector<FileEntry> GetSlowestFiles(int count);
+  
+  /// Removes all recorded results.
+  void Clear();
+  
+ private:
+  IndexingStatistics() = default;
+  
+  
+  std::mutex mutex;
+  
+  /// Latest result for each file, indexed by its canonical path.
+  std::unordered_map<QString, FileEntry> files;
+  
+  /// Times at which recent results were recorded, for computing the
+  /// throughput.
+  std::deque<std::chrono::steady_clock::time_point> recentFinishTimes;
+};
@@ -0,0 +1,92 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/indexing_statistics_dialog.h"
+
+#include <QBoxLayout>
+#include <QDialogButtonBox>
+#include <QHeaderView>
+#include <QIcon>
+#include <QLabel>
+#include <QPushButton>
+#include <QTableWidget>
+#include <QTimer>
+
+#include "cide/indexing_statistics.h"
+#include "cide/parse_thread_pool.h"
+
+/// Number of files listed in the table of slowest files.
+constexpr int kSlowestFilesCount = 50;
+
+IndexingStatisticsDialog::IndexingStatisticsDialog(QWidget* parent)
+    : QDialog(parent) {
+  setWindowTitle(tr("Indexing statistics"));
+  setWindowIcon(QIcon(":/cide/cide.png"));
+  
+  throughputLabel = new QLabel();
+  queueLabel = new QLabel();
+  totalsLabel = new QLabel();
+  
+  QLabel* slowestFilesLabel = new QLabel(tr("Slowest files:"));
+  
+  slowestFilesTable = new QTableWidget(0, 5);
+  slowestFilesTable->setHorizontalHeaderLabels(QStringList() << tr("File") << tr("Duration (ms)") << tr("USRs") << tr("Includes") << tr("Cached"));
+  slowestFilesTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+  slowestFilesTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+  slowestFilesTable->verticalHeader()->setVisible(false);
+  slowestFilesTable->horizontalHeader()->setSectionResizeMode(0, QHeaderView::Stretch);
+  
+  QPushButton* clearButton = new QPushButton(tr("Clear"));
+  connect(clearButton, &QPushButton::clicked, [&]() {
+    IndexingStatistics::Instance().Clear();
+    UpdateStatistics();
+  });
+  
+  QDialogButtonBox* buttonBox = new QDialogButtonBox(QDialogButtonBox::Close);
+  buttonBox->addButton(clearButton, QDialogButtonBox::ResetRole);
+  connect(buttonBox, &QDialogButtonBox::rejected, this, &QDialog::reject);
+  
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->addWidget(throughputLabel);
+  layout->addWidget(queueLabel);
+  layout->addWidget(totalsLabel);
+  layout->addWidget(slowestFilesLabel);
+  layout->addWidget(slowestFilesTable);
+  layout->addWidget(buttonBox);
+  setLayout(layout);
+  
+  resize(800, 600);
+  
+  updateTimer = new QTimer(this);
+  connect(updateTimer, &QTimer::timeout, this, &IndexingStatisticsDialog::UpdateStatistics);
+  updateTimer->start(1000);
+  UpdateStatistics();
+}
+
+void IndexingStatisticsDialog::UpdateStatistics() {
+  IndexingStatistics& statistics = IndexingStatistics::Instance();
+  
+  throughputLabel->setText(tr("Throughput: %1 files/s (over the last 10 s)").arg(statistics.GetFilesPerSecond(10), 0, 'f', 1));
+  
+  int numForClosedFiles;
+  int numForOpenDocuments;
+  int numForCurrentDocument;
+  ParseThreadPool::Instance().GetNumQueuedRequests(&numForClosedFiles, &numForOpenDocuments, &numForCurrentDocument);
+  queueLabel->setText(tr("Queued requests: %1 for closed files, %2 for open documents, %3 for the current document")
+      .arg(numForClosedFiles).arg(numForOpenDocuments).arg(numForCurrentDocument));
+  
+  totalsLabel->setText(tr("Indexed files: %1, total indexing time: %2 s")
+      .arg(statistics.GetIndexedFileCount()).arg(statistics.GetTotalDurationMs() / 1000., 0, 'f', 1));
+  
+  std::vector<IndexingStatistics::FileEntry> slowestFiles = statistics.GetSlowestFiles(kSlowestFilesCount);
+  slowestFilesTable->setRowCount(slowestFiles.size());
+  for (int row = 0; row < static_cast<int>(slowestFiles.size()); ++ row) {
+    const IndexingStatistics::FileEntry& entry = slowestFiles[row];
+    slowestFilesTable->setItem(row, 0, new QTableWidgetItem(entry.canonicalPath));
+    slowestFilesTable->setItem(row, 1, new QTableWidgetItem(QString::number(entry.durationMs, 'f', 1)));
+    slowestFilesTable->setItem(row, 2, new QTableWidgetItem(QString::number(entry.USRCount)));
+    slowestFilesTable->setItem(row, 3, new QTableWidgetItem(QString::number(entry.includeCount)));
+    slowestFilesTable->setItem(row, 4, new QTableWidgetItem(entry.fromCache ? tr("yes") : tr("no")));
+  }
+}
@@ -0,0 +1,30 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QDialog>
+
+class QLabel;
+class QTableWidget;
+class QTimer;
+
+/// Shows the indexing throughput, the number of queued parse requests and the
+/// files that took longest to index (see IndexingStatistics). The contents are
+/// updated periodically while the dialog is shown.
+class IndexingStatisticsDialog : public QDialog {
+ Q_OBJECT
+ public:
+  IndexingStatisticsDialog(QWidget* parent = nullptr);
+  
+ public slots:
+  void UpdateStatistics();
+  
+ private:
+  QLabel* throughputLabel;
+  QLabel* queueLabel;
+  QLabel* totalsLabel;
+  QTableWidget* slowestFilesTable;
+  QTimer* updateTimer;
+};
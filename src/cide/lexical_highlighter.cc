@@ -0,0 +1,402 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/lexical_highlighter.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include "cide/document.h"
+#include "cide/text_utils.h"
+#include "cide/util.h"
+
+/// Returns whether @p word is a C or C++ keyword.
+static bool IsKeyword(const QString& word) {
+  static const std::unordered_set<QString> keywords = {
+      "alignas", "alignof", "asm", "auto", "bool", "break", "case", "catch",
+      "char", "char8_t", "char16_t", "char32_t", "class", "co_await",
+      "co_return", "co_yield", "concept", "const", "consteval", "constexpr",
+      "constinit", "const_cast", "continue", "decltype", "default", "delete",
+      "do", "double", "dynamic_cast", "else", "enum", "explicit", "export",
+      "extern", "false", "final", "float", "for", "friend", "goto", "if",
+      "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+      "nullptr", "operator", "override", "private", "protected", "public",
+      "register", "reinterpret_cast", "requires", "restrict", "return",
+      "short", "signed", "sizeof", "static", "static_assert", "static_cast",
+      "struct", "switch", "template", "this", "thread_local", "throw", "true",
+      "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+      "virtual", "void", "volatile", "wchar_t", "while", "_Alignas",
+      "_Alignof", "_Atomic", "_Bool", "_Complex", "_Noreturn", "_Static_assert",
+      "_Thread_local"};
+  return keywords.count(word) > 0;
+}
+
+/// Returns whether @p word is an encoding prefix of a string or character
+/// literal, possibly including R for raw string literals.
+static bool IsLiteralPrefix(const QString& word) {
+  return word == QStringLiteral("L") || word == QStringLiteral("u") ||
+         word == QStringLiteral("U") || word == QStringLiteral("u8") ||
+         word == QStringLiteral("R") || word == QStringLiteral("LR") ||
+         word == QStringLiteral("uR") || word == QStringLiteral("UR") ||
+         word == QStringLiteral("u8R");
+}
+
+/// Returns the index after the "*/" that ends a block comment, searching from
+/// @p start, or -1 if the comment does not end within the text.
+static int FindBlockCommentEnd(const QChar* text, int size, int start) {
+  for (int i = start; i < size - 1; ++ i) {
+    if (text[i] == '*' && text[i + 1] == '/') {
+      return i + 2;
+    }
+  }
+  return -1;
+}
+
+/// Returns the index after the (unescaped) @p quote that ends a string or
+/// character literal, searching from @p start, or -1 if the literal does not
+/// end within the text.
+static int FindQuoteEnd(const QChar* text, int size, int start, QChar quote) {
+  for (int i = start; i < size; ++ i) {
+    if (text[i] == '\\') {
+      ++ i;
+    } else if (text[i] == quote) {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+/// Returns the index after the )delimiter" that ends a raw string literal,
+/// searching from @p start, or -1 if the literal does not end within the text.
+/// If the delimiter is not known (since the literal started on a previous
+/// line), any delimiter is accepted.
+static int FindRawStringEnd(const QChar* text, int size, int start, const QString* delimiter) {
+  for (int i = start; i < size; ++ i) {
+    if (text[i] != ')') {
+      continue;
+    }
+    if (delimiter) {
+      int quote = i + 1 + delimiter->size();
+      if (quote < size && text[quote] == '"' &&
+          QString::fromRawData(text + i + 1, delimiter->size()) == *delimiter) {
+        return quote + 1;
+      }
+    } else {
+      // The delimiter may be at most 16 characters long.
+      for (int quote = i + 1; quote < size && quote <= i + 17; ++ quote) {
+        if (text[quote] == '"') {
+          return quote + 1;
+        } else if (text[quote] == ')' || text[quote] == ' ' || text[quote] == '\\') {
+          break;
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+LexicalHighlighter::Styles::Styles(std::shared_ptr<const Settings::StyleSnapshot> snapshot)
+    : snapshot(snapshot),
+      defaultStyle(snapshot->GetTextStyle(Settings::TextStyle::Default)),
+      keyword(snapshot->GetTextStyle(Settings::TextStyle::LanguageKeyword)),
+      comment(snapshot->GetTextStyle(Settings::TextStyle::Comment)),
+      extraPunctuation(snapshot->GetTextStyle(Settings::TextStyle::ExtraPunctuation)),
+      preprocessorDirective(snapshot->GetTextStyle(Settings::TextStyle::PreprocessorDirective)),
+      integerLiteral(snapshot->GetTextStyle(Settings::TextStyle::IntegerLiteral)),
+      floatingLiteral(snapshot->GetTextStyle(Settings::TextStyle::FloatingLiteral)),
+      stringLiteral(snapshot->GetTextStyle(Settings::TextStyle::StringLiteral)),
+      characterLiteral(snapshot->GetTextStyle(Settings::TextStyle::CharacterLiteral)),
+      includePath(snapshot->GetTextStyle(Settings::TextStyle::IncludePath)) {}
+
+void LexicalHighlighter::HighlightDocument(Document* document) {
+  Styles styles;
+  HighlightBuffer highlights;
+  
+  QString text = document->GetDocumentText();
+  lineStates.clear();
+  LineState state = LineState::Code;
+  int lineStart = 0;
+  for (int i = 0, size = text.size(); i <= size; ++ i) {
+    if (i == size || text[i] == '\n') {
+      lineStates.push_back(state);
+      state = HighlightLine(text.constData() + lineStart, i - lineStart, lineStart, state, styles, &highlights);
+      lineStart = i + 1;
+    }
+  }
+  
+  document->ClearHighlightRanges(0);
+  document->AddHighlightRanges(highlights.ranges, highlights.styles, /*layer*/ 0);
+  
+  dirtyRange = DocumentRange::Invalid();
+  needsFullHighlight = false;
+  textChangeCounter = document->textChangeCounter();
+  expectedRangeCount = document->GetHighlightRanges(0).size();
+  fullDocumentRangeCount = expectedRangeCount;
+}
+
+void LexicalHighlighter::TextReplaced(Document* document, const DocumentRange& oldRange, int newTextSize, int textChangeCounter) {
+  if (needsFullHighlight || textChangeCounter != this->textChangeCounter + 1) {
+    // Not all changes were reported as replacements, so the line states
+    // cannot be updated.
+    needsFullHighlight = true;
+    return;
+  }
+  this->textChangeCounter = textChangeCounter;
+  
+  // Replace the states of the lines in the old range with unknown states for
+  // the lines in the new range. The state at the start of the first line is
+  // not affected by the replacement.
+  DocumentRange newRange(oldRange.start, oldRange.start + newTextSize);
+  int firstLine = document->LineForLocation(newRange.start);
+  int lastNewLine = document->LineForLocation(newRange.end);
+  int lastOldLine = lastNewLine - (document->LineCount() - static_cast<int>(lineStates.size()));
+  if (lastOldLine < firstLine || lastOldLine >= static_cast<int>(lineStates.size())) {
+    needsFullHighlight = true;
+    return;
+  }
+  lineStates.erase(lineStates.begin() + firstLine + 1, lineStates.begin() + lastOldLine + 1);
+  lineStates.insert(lineStates.begin() + firstLine + 1, lastNewLine - firstLine, LineState::Unknown);
+  
+  // Extend the range that needs to be lexed again
+  if (dirtyRange.IsValid()) {
+    DocumentRange mappedDirtyRange = TextReplacement(oldRange, newTextSize).MapRange(dirtyRange);
+    if (mappedDirtyRange.IsValid()) {
+      newRange.start = std::min(newRange.start, mappedDirtyRange.start);
+      newRange.end = std::max(newRange.end, mappedDirtyRange.end);
+    }
+  }
+  dirtyRange = newRange;
+}
+
+bool LexicalHighlighter::HighlightChangedLines(Document* document) {
+  if (!IsActive(document)) {
+    return false;
+  }
+  
+  // The ranges added for the edited lines accumulate in the document, so lex
+  // the whole document again once they clearly outnumber the original ones.
+  constexpr int kMinRangeCountForFullHighlight = 1024;
+  if (needsFullHighlight ||
+      expectedRangeCount > 4 * std::max(kMinRangeCountForFullHighlight, fullDocumentRangeCount)) {
+    HighlightDocument(document);
+    return true;
+  }
+  if (dirtyRange.IsInvalid()) {
+    return false;
+  }
+  
+  Styles styles;
+  HighlightBuffer highlights;
+  
+  // Lex the lines in the dirty range, and then the following lines until
+  // their start state does not change anymore.
+  int lineCount = document->LineCount();
+  int line = document->LineForLocation(dirtyRange.start);
+  int lastDirtyLine = document->LineForLocation(dirtyRange.end);
+  dirtyRange = DocumentRange::Invalid();
+  while (line > 0 && lineStates[line] == LineState::Unknown) {
+    -- line;
+  }
+  int firstLine = line;
+  
+  LineState state = lineStates[line];
+  for (; line < lineCount; ++ line) {
+    if (line > lastDirtyLine && lineStates[line] == state) {
+      break;
+    }
+    lineStates[line] = state;
+    
+    int lineStart = document->LineStart(line).offset;
+    int lineEnd = (line + 1 < lineCount) ? (document->LineStart(line + 1).offset - 1) : document->FullDocumentRange().end.offset;
+    QString lineText = document->TextForRange(DocumentRange(lineStart, lineEnd));
+    state = HighlightLine(lineText.constData(), lineText.size(), lineStart, state, styles, &highlights);
+  }
+  
+  // Reset the lexed lines to the default style before adding the new ranges.
+  HighlightBuffer reset;
+  reset.AddHighlightRange(
+      DocumentRange(document->LineStart(firstLine), (line < lineCount) ? document->LineStart(line) : document->FullDocumentRange().end),
+      false, styles.defaultStyle);
+  document->AddHighlightRanges(reset.ranges, reset.styles, /*layer*/ 0);
+  document->AddHighlightRanges(highlights.ranges, highlights.styles, /*layer*/ 0);
+  
+  expectedRangeCount = document->GetHighlightRanges(0).size();
+  return true;
+}
+
+bool LexicalHighlighter::IsActive(Document* document) const {
+  return expectedRangeCount >= 0 &&
+         static_cast<int>(document->GetHighlightRanges(0).size()) == expectedRangeCount;
+}
+
+LexicalHighlighter::LineState LexicalHighlighter::HighlightLine(const QChar* text, int size, int lineStartOffset, LineState state, const Styles& styles, HighlightBuffer* highlights) {
+  auto addRange = [&](int start, int end, bool isNonCodeRange, const Settings::ConfigurableTextStyle& style) {
+    highlights->AddHighlightRange(DocumentRange(lineStartOffset + start, lineStartOffset + end), isNonCodeRange, style);
+  };
+  
+  bool endsWithBackslash = size > 0 && text[size - 1] == '\\';
+  auto continuedState = [&](LineState continuation) {
+    return endsWithBackslash ? continuation : LineState::Code;
+  };
+  
+  // Continue a comment or literal from the previous line
+  int i = 0;
+  if (state == LineState::BlockComment) {
+    i = FindBlockCommentEnd(text, size, 0);
+    if (i < 0) {
+      addRange(0, size, true, styles.comment);
+      return LineState::BlockComment;
+    }
+    addRange(0, i, true, styles.comment);
+  } else if (state == LineState::LineComment) {
+    addRange(0, size, true, styles.comment);
+    return continuedState(LineState::LineComment);
+  } else if (state == LineState::StringLiteral) {
+    i = FindQuoteEnd(text, size, 0, '"');
+    if (i < 0) {
+      addRange(0, size, true, styles.stringLiteral);
+      return continuedState(LineState::StringLiteral);
+    }
+    addRange(0, i, true, styles.stringLiteral);
+  } else if (state == LineState::RawStringLiteral) {
+    i = FindRawStringEnd(text, size, 0, nullptr);
+    if (i < 0) {
+      addRange(0, size, true, styles.stringLiteral);
+      return LineState::RawStringLiteral;
+    }
+    addRange(0, i, true, styles.stringLiteral);
+  }
+  
+  // Preprocessor directives start with the first token of a line.
+  bool isFirstToken = (state == LineState::Code);
+  bool isIncludeDirective = false;
+  
+  while (i < size) {
+    QChar c = text[i];
+    if (c == ' ' || c == '\t') {
+      ++ i;
+      continue;
+    }
+    bool isFirstTokenOfLine = isFirstToken;
+    isFirstToken = false;
+    
+    if (c == '/' && i + 1 < size && text[i + 1] == '/') {
+      addRange(i, size, true, styles.comment);
+      return continuedState(LineState::LineComment);
+    } else if (c == '/' && i + 1 < size && text[i + 1] == '*') {
+      int end = FindBlockCommentEnd(text, size, i + 2);
+      if (end < 0) {
+        addRange(i, size, true, styles.comment);
+        return LineState::BlockComment;
+      }
+      addRange(i, end, true, styles.comment);
+      i = end;
+    } else if (c == '#' && isFirstTokenOfLine) {
+      int end = i + 1;
+      while (end < size && (text[end] == ' ' || text[end] == '\t')) {
+        ++ end;
+      }
+      int nameStart = end;
+      while (end < size && IsIdentifierChar(text[end])) {
+        ++ end;
+      }
+      addRange(i, end, false, styles.preprocessorDirective);
+      QString name = QString::fromRawData(text + nameStart, end - nameStart);
+      isIncludeDirective =
+          name == QStringLiteral("include") ||
+          name == QStringLiteral("include_next") ||
+          name == QStringLiteral("import");
+      i = end;
+    } else if (c == '<' && isIncludeDirective) {
+      int end = i + 1;
+      while (end < size && text[end] != '>') {
+        ++ end;
+      }
+      end = std::min(size, end + 1);
+      addRange(i, end, true, styles.includePath);
+      isIncludeDirective = false;
+      i = end;
+    } else if (c == '"' || c == '\'') {
+      const auto& style = isIncludeDirective ? styles.includePath : ((c == '"') ? styles.stringLiteral : styles.characterLiteral);
+      isIncludeDirective = false;
+      int end = FindQuoteEnd(text, size, i + 1, c);
+      if (end < 0) {
+        addRange(i, size, true, style);
+        return (c == '"') ? continuedState(LineState::StringLiteral) : LineState::Code;
+      }
+      addRange(i, end, true, style);
+      i = end;
+    } else if (IsIdentifierChar(c) && !c.isDigit()) {
+      int end = i + 1;
+      while (end < size && IsIdentifierChar(text[end])) {
+        ++ end;
+      }
+      QString word = QString::fromRawData(text + i, end - i);
+      
+      if (end < size && (text[end] == '"' || text[end] == '\'') && IsLiteralPrefix(word)) {
+        // Literal with an encoding prefix
+        QChar quote = text[end];
+        bool isRaw = word.endsWith('R');
+        int literalEnd;
+        if (isRaw && quote == '"') {
+          int delimiterEnd = end + 1;
+          while (delimiterEnd < size && text[delimiterEnd] != '(') {
+            ++ delimiterEnd;
+          }
+          QString delimiter = QString::fromRawData(text + end + 1, delimiterEnd - end - 1);
+          literalEnd = FindRawStringEnd(text, size, delimiterEnd + 1, &delimiter);
+          if (literalEnd < 0) {
+            addRange(i, size, true, styles.stringLiteral);
+            return LineState::RawStringLiteral;
+          }
+        } else {
+          literalEnd = FindQuoteEnd(text, size, end + 1, quote);
+          if (literalEnd < 0) {
+            addRange(i, size, true, (quote == '"') ? styles.stringLiteral : styles.characterLiteral);
+            return (quote == '"') ? continuedState(LineState::StringLiteral) : LineState::Code;
+          }
+        }
+        addRange(i, literalEnd, true, (quote == '"') ? styles.stringLiteral : styles.characterLiteral);
+        i = literalEnd;
+        continue;
+      }
+      
+      if (IsKeyword(word)) {
+        addRange(i, end, false, styles.keyword);
+      }
+      i = end;
+    } else if (c.isDigit() || (c == '.' && i + 1 < size && text[i + 1].isDigit())) {
+      bool isHex = c == '0' && i + 1 < size && (text[i + 1] == 'x' || text[i + 1] == 'X');
+      bool isFloat = false;
+      int end = i;
+      while (end < size) {
+        QChar d = text[end];
+        if ((!isHex && (d == 'e' || d == 'E')) || (isHex && (d == 'p' || d == 'P'))) {
+          // Exponent, possibly followed by a sign
+          isFloat = true;
+          ++ end;
+          if (end < size && (text[end] == '+' || text[end] == '-')) {
+            ++ end;
+          }
+        } else if (d == '.') {
+          isFloat = true;
+          ++ end;
+        } else if (IsIdentifierChar(d) || d == '\'') {
+          ++ end;
+        } else {
+          break;
+        }
+      }
+      addRange(i, end, false, isFloat ? styles.floatingLiteral : styles.integerLiteral);
+      i = end;
+    } else if (c == ';' || c == '{' || c == '}') {
+      addRange(i, i + 1, false, styles.extraPunctuation);
+      ++ i;
+    } else {
+      ++ i;
+    }
+  }
+  
+  return LineState::Code;
+}
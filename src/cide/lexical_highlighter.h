@@ -0,0 +1,116 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <QString>
+
+#include "cide/document_range.h"
+#include "cide/settings.h"
+
+class Document;
+struct HighlightBuffer;
+
+/// Fast, purely lexical highlighting of C/C++ code: keywords, comments, string
+/// and character literals, numbers, and preprocessor directives. This is used
+/// to color a document right after opening it, since the first libclang parse
+/// may take many seconds for heavy TUs. Once the semantic highlighting from
+/// the parse (see VisitClangAST_AddHighlightingAndContexts()) replaces the
+/// highlight ranges, the lexical highlighter becomes inactive.
+///
+/// The lexer state at the start of each line is stored, such that edits only
+/// require to lex the edited lines again, plus the following lines whose start
+/// state changes (for example, after opening a block comment).
+class LexicalHighlighter {
+ public:
+  /// Lexer state at the start of a line.
+  enum class LineState : unsigned char {
+    Code = 0,
+    
+    /// Within a /* */ comment
+    BlockComment,
+    
+    /// Within a // comment that was continued with a backslash
+    LineComment,
+    
+    /// Within a string literal that was continued with a backslash
+    StringLiteral,
+    
+    /// Within a raw string literal
+    RawStringLiteral,
+    
+    /// The state is not known, since the line was edited.
+    Unknown
+  };
+  
+  /// The text styles used by the highlighter, referring to the current style
+  /// snapshot of the settings.
+  struct Styles {
+    explicit Styles(std::shared_ptr<const Settings::StyleSnapshot> snapshot = Settings::Instance().GetStyleSnapshot());
+    
+    /// Keeps the referenced styles alive.
+    std::shared_ptr<const Settings::StyleSnapshot> snapshot;
+    
+    const Settings::ConfigurableTextStyle& defaultStyle;
+    const Settings::ConfigurableTextStyle& keyword;
+    const Settings::ConfigurableTextStyle& comment;
+    const Settings::ConfigurableTextStyle& extraPunctuation;
+    const Settings::ConfigurableTextStyle& preprocessorDirective;
+    const Settings::ConfigurableTextStyle& integerLiteral;
+    const Settings::ConfigurableTextStyle& floatingLiteral;
+    const Settings::ConfigurableTextStyle& stringLiteral;
+    const Settings::ConfigurableTextStyle& characterLiteral;
+    const Settings::ConfigurableTextStyle& includePath;
+  };
+  
+  /// Lexes the complete document and replaces the highlight ranges in its
+  /// layer 0 with the result. This activates the highlighter.
+  /// FinishedHighlightingChanges() must be called afterwards.
+  void HighlightDocument(Document* document);
+  
+  /// Must be called for each replacement in the document while the
+  /// highlighter is active (see Document::TextReplaced()). This only records
+  /// the lines that need to be lexed again, see HighlightChangedLines().
+  void TextReplaced(Document* document, const DocumentRange& oldRange, int newTextSize, int textChangeCounter);
+  
+  /// Lexes the lines that changed since the last call again, and adds the
+  /// resulting highlight ranges to the document. Returns true if the
+  /// highlighting changed, in which case FinishedHighlightingChanges() must be
+  /// called afterwards.
+  bool HighlightChangedLines(Document* document);
+  
+  /// Returns whether the highlight ranges in layer 0 of the document are still
+  /// the ones that were added by this highlighter, i.e., have not been
+  /// replaced by the semantic highlighting yet.
+  bool IsActive(Document* document) const;
+  
+  /// Lexes a single line (without the newline character) that starts at
+  /// document offset @p lineStartOffset with the given start state. Adds the
+  /// highlight ranges to @p highlights and returns the state at the start of
+  /// the next line.
+  static LineState HighlightLine(const QChar* text, int size, int lineStartOffset, LineState state, const Styles& styles, HighlightBuffer* highlights);
+  
+ private:
+  /// Lexer state at the start of each line of the document.
+  std::vector<LineState> lineStates;
+  
+  /// Range that contains all edits since the last HighlightChangedLines().
+  DocumentRange dirtyRange = DocumentRange::Invalid();
+  
+  /// The document's textChangeCounter() that the line states correspond to.
+  int textChangeCounter = -1;
+  
+  /// Whether the line states could not be updated for a change, such that
+  /// the whole document needs to be lexed again.
+  bool needsFullHighlight = false;
+  
+  /// Number of highlight ranges in layer 0 of the document after the last
+  /// change by this highlighter, used to detect whether the ranges have been
+  /// replaced, and the number after lexing the whole document.
+  int expectedRangeCount = -1;
+  int fullDocumentRangeCount = 0;
+};
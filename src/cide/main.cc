@@ -2,20 +2,35 @@
 // This file is part of CIDE, licensed under the new BSD license.
 // See the COPYING file in the project root for the license text.
 
+#include <cstring>
+
 #include <clang-c/Index.h>
 
 #include <git2.h>
 #include <QtWidgets>
 #include <QString>
 
+#include "cide/background_reclaimer.h"
 #include "cide/clang_utils.h"
+#include "cide/cpu_budget.h"
 #include "cide/crash_backup.h"
 #include "cide/code_info.h"
 #include "cide/git_diff.h"
+#include "cide/git_status.h"
+#include "cide/index_bundle.h"
+#include "cide/index_service.h"
+#include "cide/index_worker.h"
 #include "cide/main_window.h"
 #include "cide/parse_thread_pool.h"
+#include "cide/performance_counters.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/profiler.h"
+#include "cide/qt_help.h"
 #include "cide/settings.h"
+#include "cide/stall_detector.h"
 #include "cide/startup_dialog.h"
+#include "cide/startup_trace.h"
+#include "cide/tu_cache.h"
 #include "cide/util.h"
 
 
@@ -28,10 +43,19 @@ void CleanUp() {
   std::atomic<bool> exitFinished;
   exitFinished = false;
   std::thread exitThread([&]() {
+    CPUBudget::Instance().Exit();
+    AbortIndexWorkerProcesses();
+    AbortIndexServiceRequests();
     ParseThreadPool::Instance().ExitAllThreads();
+    TUCache::Instance().Exit();
     CodeInfo::Instance().Exit();
     CrashBackup::Instance().Exit();
     GitDiff::Instance().Exit();
+    GitStatus::Instance().Exit();
+    PhraseHighlighter::Instance().Exit();
+    QtHelp::Instance().Exit();
+    BackgroundReclaimer::Instance().Exit();
+    StallDetector::Instance().Exit();
     exitFinished = true;
   });
   QEventLoop exitEventLoop;
@@ -39,6 +63,8 @@ void CleanUp() {
     exitEventLoop.processEvents();
   }
   exitThread.join();
+  
+  Profiler::WriteTrace();
 }
 
 void CheckForLeftoverPreambles() {
@@ -77,9 +103,31 @@ void CheckForLeftoverPreambles() {
 }
 
 int main(int argc, char** argv) {
+  StartupTrace::Start();
+  Profiler::Initialize();
+  
   // Initialize libgit2
   git_libgit2_init();
   
+  // Run as an index worker process if requested (see IndexFileInWorkerProcess()).
+  // The application names must be set such that the USRIndexCache is found.
+  if (argc == 2 && strcmp(argv[1], kIndexWorkerArgument) == 0) {
+    QCoreApplication workerApp(argc, argv);
+    QCoreApplication::setOrganizationName("PuzzlePaint");
+    QCoreApplication::setOrganizationDomain("puzzlepaint.net");
+    QCoreApplication::setApplicationName("CIDE");
+    return RunIndexWorker();
+  }
+  
+  // Run as the index service if requested (see IndexFileInIndexService()).
+  if (argc == 2 && strcmp(argv[1], kIndexServiceArgument) == 0) {
+    QCoreApplication serviceApp(argc, argv);
+    QCoreApplication::setOrganizationName("PuzzlePaint");
+    QCoreApplication::setOrganizationDomain("puzzlepaint.net");
+    QCoreApplication::setApplicationName("CIDE");
+    return RunIndexService();
+  }
+  
   // Initialize Qt
   QApplication qapp(argc, argv);
   QCoreApplication::setOrganizationName("PuzzlePaint");
@@ -90,6 +138,13 @@ int main(int argc, char** argv) {
   // the next wheelEvent() that "got through", which could have been a long
   // time after the first one, resulting in choppy scrolling.
   qapp.setAttribute(Qt::AA_CompressHighFrequencyEvents, false);
+  StartupTrace::EndPhase("Qt initialization");
+  
+  // Export an index bundle without starting the editor if requested (see
+  // RunIndexBundleExport()).
+  if (argc == 4 && strcmp(argv[1], kExportIndexArgument) == 0) {
+    return RunIndexBundleExport(QString::fromLocal8Bit(argv[2]), QString::fromLocal8Bit(argv[3]));
+  }
   
   // Print used libclang version
   qDebug() << "CIDE using libclang" << GetLibclangVersion();
@@ -107,10 +162,28 @@ int main(int argc, char** argv) {
     // Look for preamble files that might be left over from a previous run that crashed.
     CheckForLeftoverPreambles();
   }
+  StartupTrace::EndPhase("Settings and leftover preamble check");
   
   // Create main window
   MainWindow* mainWindow = new MainWindow();
+  StartupTrace::EndPhase("Main window construction");
   mainWindow->show();
+  StartupTrace::EndPhase("Main window show");
+  
+  // Export the performance counters if requested (see PerformanceCounters).
+  PerformanceCounters::Instance().StartDumpIfRequested(mainWindow);
+  
+  // Log stalls of the Qt thread's event loop (see StallDetector).
+  StallDetector::Instance().Start();
+  
+  // Defer non-essential initialization until the event loop is idle for the
+  // first time, such that the window appears as early as possible. This sets
+  // up the help engine and indexes the documentation identifiers in the
+  // background, such that hover help lookups are fast.
+  QTimer::singleShot(0, []() {
+    StartupTrace::Finish("First event loop iteration");
+    QtHelp::Instance().BuildIdentifierIndex();
+  });
   
   // Parse command-line arguments
   bool loadedProject = false;
@@ -124,10 +197,17 @@ int main(int argc, char** argv) {
     
     firstFileArg += 2;
   }
+  QStringList filePaths;
   for (int i = firstFileArg; i < argc; ++ i) {
-    mainWindow->Open(QString::fromLocal8Bit(argv[i]));
-    openedFile = true;
+    filePaths.push_back(QString::fromLocal8Bit(argv[i]));
+  }
+  if (filePaths.size() == 1) {
+    mainWindow->Open(filePaths.front());
+  } else if (!filePaths.isEmpty()) {
+    mainWindow->OpenFiles(filePaths);
   }
+  openedFile = !filePaths.isEmpty();
+  StartupTrace::EndPhase("Loading project and files");
   
   // Restore backups if there are any
   if (CrashBackup::Instance().DoBackupsExist()) {
@@ -141,6 +221,7 @@ int main(int argc, char** argv) {
       CrashBackup::Instance().DeleteAllBackups();
     }
   }
+  StartupTrace::EndPhase("Backup check");
   
   if (!loadedProject && !openedFile) {
     // Show the startup dialog.
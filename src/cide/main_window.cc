@@ -4,6 +4,10 @@
 
 #include "main_window.h"
 
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+
 #include <QBoxLayout>
 #include <QCloseEvent>
 #include <QComboBox>
@@ -11,6 +15,7 @@
 #include <QDockWidget>
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QFontDatabase>
 #include <QListWidget>
 #include <QMenu>
 #include <QMenuBar>
@@ -18,6 +23,7 @@
 #include <QPlainTextEdit>
 #include <QProgressDialog>
 #include <QScrollArea>
+#include <QScrollBar>
 #include <QSettings>
 #include <QStatusBar>
 #include <QToolBar>
@@ -27,14 +33,27 @@
 #include "cide/about_dialog.h"
 #include "cide/cpp_utils.h"
 #include "cide/clang_parser.h"
+#include "cide/comment_marker_dialog.h"
+#include "cide/cpu_budget.h"
 #include "cide/crash_backup.h"
+#include "cide/highlight_cache.h"
+#include "cide/index_bundle.h"
+#include "cide/indexing_statistics.h"
+#include "cide/indexing_statistics_dialog.h"
+#include "cide/mapped_file_viewer.h"
+#include "cide/memory_report.h"
 #include "cide/new_project_dialog.h"
 #include "cide/parse_thread_pool.h"
 #include "cide/project_settings.h"
 #include "cide/search_bar.h"
 #include "cide/settings.h"
+#include "cide/tu_cache.h"
 #include "cide/util.h"
 
+/// Files from this size on are offered to be opened in a MappedFileViewer
+/// instead of a document.
+constexpr qint64 kMappedViewerSuggestionSize = 256 * 1024 * 1024;
+
 MainWindow::MainWindow(QWidget* parent)
     : QMainWindow(parent) {
   nextTabDataIndex = 0;
@@ -131,12 +150,16 @@ MainWindow::MainWindow(QWidget* parent)
   connect(buildAction, &QAction::triggered, this, &MainWindow::BuildCurrentTarget);
   addAction(buildAction);
   
+  QAction* compileFileAction = new ActionWithConfigurableShortcut(tr("Compile current file"), compileCurrentFileShortcut, this);
+  connect(compileFileAction, &QAction::triggered, this, &MainWindow::CompileCurrentFile);
+  addAction(compileFileAction);
+
 #ifndef WIN32
   QAction* debugAction = new ActionWithConfigurableShortcut(tr("Debug"), startDebuggingShortcut, this);
   connect(debugAction, &QAction::triggered, this, &MainWindow::DebugCurrentProject);
   addAction(debugAction);
 #endif
-  
+
   QVBoxLayout* vLayout = new QVBoxLayout();
   vLayout->setContentsMargins(0, 0, 0, 0);
   vLayout->setSpacing(0);
@@ -150,6 +173,9 @@ MainWindow::MainWindow(QWidget* parent)
   // Find-and-replace in files
   QAction* findAndReplaceInFilesAction = findAndReplaceInFiles.Initialize(this);
   
+  // Project-wide diagnostics
+  diagnosticsSweep.Initialize(this);
+  
   // Menu bar
   QMenuBar* menuBar = new QMenuBar();
   
@@ -163,6 +189,8 @@ MainWindow::MainWindow(QWidget* parent)
   connect(openFileAction, &QAction::triggered, this, QOverload<>::of(&MainWindow::Open));
   fileMenu->addAction(openFileAction);
   
+  fileMenu->addAction(tr("Open in read-only viewer..."), this, &MainWindow::OpenInViewer);
+  
   saveAction = new ActionWithConfigurableShortcut(tr("Save"), saveFileShortcut, this);
   connect(saveAction, &QAction::triggered, this, QOverload<>::of(&MainWindow::Save));
   fileMenu->addAction(saveAction);
@@ -171,6 +199,10 @@ MainWindow::MainWindow(QWidget* parent)
   connect(saveAsAction, &QAction::triggered, this, QOverload<>::of(&MainWindow::SaveAs));
   fileMenu->addAction(saveAsAction);
   
+  saveAllAction = new ActionWithConfigurableShortcut(tr("Save all"), saveAllFilesShortcut, this);
+  connect(saveAllAction, &QAction::triggered, this, &MainWindow::SaveAll);
+  fileMenu->addAction(saveAllAction);
+  
   fileMenu->addAction(reloadFileAction);
   
   closeAction = new ActionWithConfigurableShortcut(tr("Close"), closeFileShortcut, this);
@@ -199,16 +231,22 @@ MainWindow::MainWindow(QWidget* parent)
   
   QMenu* projectMenu = new QMenu(tr("Project"));
   projectMenu->addAction(buildAction);
+  projectMenu->addAction(compileFileAction);
   projectMenu->addAction(tr("Reconfigure"), this, &MainWindow::Reconfigure);
   projectMenu->addAction(tr("Project settings..."), this, &MainWindow::ShowProjectSettings);
+  projectMenu->addAction(tr("Check project for problems"), &diagnosticsSweep, &DiagnosticsSweep::CheckProject);
   projectMenu->addSeparator();
   currentFileParseSettingsAction = projectMenu->addAction(tr("Parse settings for current file..."), this, &MainWindow::ParseSettingsForCurrentFile);
+  projectMenu->addAction(tr("Indexing statistics..."), this, &MainWindow::ShowIndexingStatistics);
+  projectMenu->addAction(tr("Comment markers..."), this, &MainWindow::ShowCommentMarkers);
+  projectMenu->addAction(tr("Export index..."), this, &MainWindow::ExportIndex);
+  projectMenu->addAction(tr("Import index..."), this, &MainWindow::ImportIndex);
   projectMenu->addSeparator();
   newProjectAction = projectMenu->addAction(tr("New project..."), [&]() { NewProject(this); });
   openProjectAction = projectMenu->addAction(tr("Open project..."), [&]() { OpenProject(this); });
   closeProjectAction = projectMenu->addAction(tr("Close project"), this, &MainWindow::CloseProject);
   menuBar->addMenu(projectMenu);
-  
+
 #ifndef WIN32
   QMenu* runMenu = new QMenu(tr("Run"));
   runMenu->addAction(debugAction);
@@ -219,11 +257,12 @@ MainWindow::MainWindow(QWidget* parent)
   showRunDockAction->setChecked(false);
   menuBar->addMenu(runMenu);
 #endif
-  
+
   QMenu* toolsMenu = new QMenu(tr("Tools"));
   QAction* runGitkAction = new ActionWithConfigurableShortcut(tr("Run gitk..."), runGitkShortcut, this);
   connect(runGitkAction, &QAction::triggered, this, &MainWindow::RunGitk);
   toolsMenu->addAction(runGitkAction);
+  toolsMenu->addAction(tr("Memory report..."), this, &MainWindow::ShowMemoryReport);
   toolsMenu->addAction(tr("Program settings..."), this, &MainWindow::ShowProgramSettings);
   menuBar->addMenu(toolsMenu);
   
@@ -253,6 +292,9 @@ MainWindow::MainWindow(QWidget* parent)
   
   buildOutputWidget->setWidget(buildIssuesRichTextScrollArea);
   
+  buildOutputTimer.setInterval(50);
+  connect(&buildOutputTimer, &QTimer::timeout, this, &MainWindow::PollBuildOutput);
+  
   viewAsTextMenu = new QMenu();
   
   QAction* viewAsTextAction = viewAsTextMenu->addAction(tr("View as text"));
@@ -270,12 +312,13 @@ MainWindow::MainWindow(QWidget* parent)
   threadDropdown = new QComboBox();
   connect(threadDropdown, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &MainWindow::ThreadChanged);
   threadDropdown->setEnabled(false);
-  
+
 //   QPlainTextEdit* outputDisplay = new QPlainTextEdit();
 //   outputDisplay->setFont(Settings::Instance().GetDefaultFont());
-  
+
   stackFramesList = new QListWidget();
   connect(stackFramesList, &QListWidget::itemActivated, this, &MainWindow::ProgramFrameActivated);
+  connect(stackFramesList->verticalScrollBar(), &QScrollBar::valueChanged, this, &MainWindow::StackFramesScrolled);
   stackFramesList->setEnabled(false);
   
   expressionEdit = new QLineEdit();
@@ -356,11 +399,8 @@ MainWindow::MainWindow(QWidget* parent)
   connect(&gdbRunner, &GDBRunner::Resumed, this, &MainWindow::ProgramResumed);
   connect(&gdbRunner, &GDBRunner::Stopped, this, &MainWindow::ProgramStopped);
   connect(&gdbRunner, &GDBRunner::ThreadListUpdated, this, &MainWindow::ProgramThreadListUpdated);
+  connect(&gdbRunner, &GDBRunner::ThreadDetailsUpdated, this, &MainWindow::ProgramThreadDetailsUpdated);
   connect(&gdbRunner, &GDBRunner::StackTraceUpdated, this, &MainWindow::ProgramStackTraceUpdated);
-  connect(&gdbRunner, &GDBRunner::ResponseReceived, [&](const QString& message) {
-    // TODO: This signal does not clearly indicate that it belongs to expression evaluation; should we re-name it to be more specific, or change it to be more general?
-    QMessageBox::information(this, tr("Expression evaluation"), message);
-  });
   
   QTimer::singleShot(0, this, [&](){
     if (!tabs.empty()) {
@@ -447,12 +487,8 @@ DocumentWidget* MainWindow::GetCurrentDocumentWidget() const {
 }
 
 DocumentWidget* MainWindow::GetWidgetForDocument(Document* document) const {
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document.get() == document) {
-      return item.second.widget;
-    }
-  }
-  return nullptr;
+  const TabData* tabData = FindTabDataForDocument(document);
+  return tabData ? tabData->widget : nullptr;
 }
 
 std::shared_ptr<Project> MainWindow::GetCurrentProject() {
@@ -478,44 +514,42 @@ std::shared_ptr<Document> MainWindow::GetDocument(int index) {
 }
 
 bool MainWindow::IsFileOpen(const QString& canonicalPath) const {
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document->path() == canonicalPath) {
-      return true;
-    }
-  }
-  return false;
+  return FindTabDataForPath(canonicalPath) != nullptr;
+}
+
+std::shared_ptr<Document> MainWindow::GetDocumentForPath(const QString& canonicalPath) const {
+  const TabData* tabData = FindTabDataForPath(canonicalPath);
+  return tabData ? tabData->document : nullptr;
 }
 
 bool MainWindow::GetDocumentAndWidgetForPath(const QString& canonicalPath, Document** document, DocumentWidget** widget) const {
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document->path() == canonicalPath) {
-      *document = item.second.document.get();
-      *widget = item.second.widget;
-      return true;
-    }
+  const TabData* tabData = FindTabDataForPath(canonicalPath);
+  if (!tabData) {
+    return false;
   }
-  return false;
+  *document = tabData->document.get();
+  *widget = tabData->widget;
+  return true;
 }
 
 void MainWindow::DocumentParsed(Document* document) {
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document.get() == document) {
-      int tabIndex = FindTabIndexForTabDataIndex(item.first);
-      if (tabIndex >= 0) {
-        QColor tabColor = qRgb(0, 0, 0);
-        for (const std::shared_ptr<Problem>& problem : document->problems()) {
-          if (problem->type() == Problem::Type::Warning) {
-            tabColor = qRgb(0, 200, 0);
-          } else {
-            tabColor = qRgb(200, 0, 0);
-            break;
-          }
-        }
-        
-        tabBar->setTabTextColor(tabIndex, tabColor);
+  auto it = tabDataIndexByDocument.find(document);
+  if (it == tabDataIndexByDocument.end()) {
+    return;
+  }
+  int tabIndex = FindTabIndexForTabDataIndex(it->second);
+  if (tabIndex >= 0) {
+    QColor tabColor = qRgb(0, 0, 0);
+    for (const std::shared_ptr<Problem>& problem : document->problems()) {
+      if (problem->type() == Problem::Type::Warning) {
+        tabColor = qRgb(0, 200, 0);
+      } else {
+        tabColor = qRgb(200, 0, 0);
+        break;
       }
-      return;
     }
+    
+    tabBar->setTabTextColor(tabIndex, tabColor);
   }
 }
 
@@ -533,16 +567,16 @@ void MainWindow::Open() {
     defaultPath = settings.value("last_file_dir").toString();
   }
   
-  QString path = QFileDialog::getOpenFileName(
+  QStringList paths = QFileDialog::getOpenFileNames(
       this,
       tr("Load file"),
       defaultPath,
       tr("Text files (*)"));
-  if (path.isEmpty()) {
-    return;
+  if (paths.size() == 1) {
+    Open(paths.front());
+  } else if (!paths.isEmpty()) {
+    OpenFiles(paths);
   }
-  
-  Open(path);
 }
 
 void MainWindow::Open(const QString& path) {
@@ -551,9 +585,23 @@ void MainWindow::Open(const QString& path) {
   
   // Search for the document among the already open tabs
   QString canonicalFilePath = QFileInfo(path).canonicalFilePath();
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document->path() == canonicalFilePath) {
-      tabBar->setCurrentIndex(FindTabIndexForTabDataIndex(item.first));
+  auto it = canonicalFilePath.isEmpty() ? tabDataIndexByPath.end() : tabDataIndexByPath.find(canonicalFilePath);
+  if (it != tabDataIndexByPath.end()) {
+    tabBar->setCurrentIndex(FindTabIndexForTabDataIndex(it->second));
+    return;
+  }
+  
+  // Offer to view huge files without loading them into a document
+  if (QFileInfo(path).size() >= kMappedViewerSuggestionSize) {
+    QMessageBox::StandardButton response = QMessageBox::question(
+        this,
+        tr("Open %1").arg(QFileInfo(path).fileName()),
+        tr("This file is very large (%1 MiB). Loading it for editing needs about twice this size in memory and may take long. Would you like to open it in a read-only viewer instead?").arg(QFileInfo(path).size() / (1024 * 1024)),
+        QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
+    if (response == QMessageBox::Cancel) {
+      return;
+    } else if (response == QMessageBox::Yes) {
+      MappedFileViewer::Open(path, this);
       return;
     }
   }
@@ -569,6 +617,100 @@ void MainWindow::Open(const QString& path) {
   AddTab(newDocument, QFileInfo(path).fileName());
 }
 
+void MainWindow::OpenInViewer() {
+  QSettings settings;
+  QString path = QFileDialog::getOpenFileName(
+      this,
+      tr("View file"),
+      settings.value("last_file_dir").toString(),
+      tr("Text files (*)"));
+  if (!path.isEmpty()) {
+    settings.setValue("last_file_dir", QFileInfo(path).absoluteDir().absolutePath());
+    MappedFileViewer::Open(path, this);
+  }
+}
+
+void MainWindow::OpenFiles(const QStringList& paths) {
+  if (paths.isEmpty()) {
+    return;
+  }
+  QSettings settings;
+  settings.setValue("last_file_dir", QFileInfo(paths.back()).absoluteDir().absolutePath());
+  
+  // Skip the files that are open already (or listed multiple times).
+  QStringList failedPaths;
+  std::vector<QString> newPaths;
+  std::unordered_set<QString> newPathSet;
+  for (const QString& path : paths) {
+    QString canonicalFilePath = QFileInfo(path).canonicalFilePath();
+    if (canonicalFilePath.isEmpty()) {
+      failedPaths.push_back(path);
+    } else if (tabDataIndexByPath.count(canonicalFilePath) == 0 &&
+               newPathSet.insert(canonicalFilePath).second) {
+      newPaths.push_back(canonicalFilePath);
+    }
+  }
+  
+  // Read the files in parallel.
+  std::vector<QByteArray> contents(newPaths.size());
+  std::vector<char> readSucceeded(newPaths.size(), 0);
+  std::atomic<int> nextFileIndex(0);
+  auto readFiles = [&]() {
+    while (true) {
+      int fileIndex = nextFileIndex.fetch_add(1);
+      if (fileIndex >= static_cast<int>(newPaths.size())) {
+        return;
+      }
+      QFile file(newPaths[fileIndex]);
+      if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        contents[fileIndex] = file.readAll();
+        readSucceeded[fileIndex] = 1;
+      }
+    }
+  };
+  int threadCount = std::max<int>(1, std::min<int>(newPaths.size(), std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (int t = 1; t < threadCount; ++ t) {
+    threads.emplace_back(readFiles);
+  }
+  readFiles();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  
+  // Open the documents as new tabs. Their parse (and diff) is deferred until
+  // their tab is activated, and their widgets only do the work for becoming
+  // visible once they get painted (see DocumentWidget::Activate()), which only
+  // happens for the last one here.
+  std::vector<QString> openedPaths;
+  openingFiles = true;
+  for (int fileIndex = 0; fileIndex < static_cast<int>(newPaths.size()); ++ fileIndex) {
+    if (!readSucceeded[fileIndex]) {
+      failedPaths.push_back(newPaths[fileIndex]);
+      continue;
+    }
+    Document* newDocument = new Document();
+    newDocument->Open(newPaths[fileIndex], contents[fileIndex]);
+    contents[fileIndex] = QByteArray();
+    AddTab(newDocument, QFileInfo(newPaths[fileIndex]).fileName());
+    openedPaths.push_back(newPaths[fileIndex]);
+  }
+  openingFiles = false;
+  
+  // Queue the parse requests as a single batch. The deferred documents get
+  // indexed unless they have been activated in the meantime, in which case
+  // they get parsed.
+  int numRequests = ParseThreadPool::Instance().RequestReindex(openedPaths, openedPaths.size(), this);
+  if (numRequests > 0) {
+    numIndexingRequestsCreated += numRequests;
+    UpdateIndexingStatus();
+  }
+  
+  if (!failedPaths.isEmpty()) {
+    QMessageBox::warning(this, tr("Error"), tr("Cannot open the following files:\n\n%1").arg(failedPaths.join('\n')));
+  }
+}
+
 void MainWindow::Save() {
   TabData* tabData = GetCurrentTabData();
   if (!tabData) {
@@ -618,6 +760,8 @@ void MainWindow::CloseDocument(int tabIndex) {
   }
   
   CrashBackup::Instance().RemoveBackup(tabData.document->path());
+  SaveHighlightingToCache(tabData.document.get());
+  SaveTUToCache(tabData.document.get());
   
   bool hadFocus = tabData.widget->hasFocus();
   // Prevent the focus from going to the search bar (triggering a pop-up list)
@@ -625,6 +769,11 @@ void MainWindow::CloseDocument(int tabIndex) {
   
   documentLayout->removeWidget(tabData.container);
   tabBar->removeTab(tabIndex);
+  tabDataIndexByDocument.erase(tabData.document.get());
+  auto pathIt = tabDataIndexByPath.find(tabData.lookupPath);
+  if (pathIt != tabDataIndexByPath.end() && pathIt->second == tabDataIndex) {
+    tabDataIndexByPath.erase(pathIt);
+  }
   tabData.document.reset();
   delete tabData.container;
   tabs.erase(tabIt);
@@ -821,7 +970,7 @@ void MainWindow::DebugCurrentProject() {
 #ifndef WIN32
   showRunDockAction->setChecked(true);
 #endif
-  
+
   // Start the application
   if (gdbRunner.IsRunning()) {
     if (QMessageBox::question(nullptr, tr("Start debugging"), tr("The debugger is already running. Exit it and start anew?"), QMessageBox::Yes | QMessageBox::No) == QMessageBox::No) {
@@ -943,12 +1092,29 @@ void MainWindow::StopClicked() {
 }
 
 void MainWindow::ThreadChanged(int index) {
+  if (index < 0) {
+    return;
+  }
   stackFramesList->setEnabled(false);
   
+  // Only fetch the details and frames of the selected thread.
   int threadId = threadDropdown->itemData(index).toInt();
+  gdbRunner.GetThreadDetails(threadId);
   gdbRunner.GetStackTrace(threadId);
 }
 
+void MainWindow::StackFramesScrolled(int value) {
+  // Fetch the next page of stack frames when scrolling close to the end of
+  // the list.
+  if (gdbRunner.IsStackTraceComplete() ||
+      gdbRunner.IsStackTraceRequestPending() ||
+      value < stackFramesList->verticalScrollBar()->maximum() - stackFramesList->verticalScrollBar()->pageStep()) {
+    return;
+  }
+  int threadId = threadDropdown->itemData(threadDropdown->currentIndex()).toInt();
+  gdbRunner.GetStackTrace(threadId, currentStackFrames.size());
+}
+
 void MainWindow::ProgramFrameActivated(QListWidgetItem* item) {
   int frameIndex = item->data(Qt::UserRole).toInt();
   if (frameIndex < 0 || frameIndex >= currentStackFrames.size()) {
@@ -984,7 +1150,14 @@ void MainWindow::EvaluateExpression() {
   }
   
   int threadId = threadDropdown->itemData(threadDropdown->currentIndex()).toInt();
-  gdbRunner.EvaluateExpression(expressionEdit->text(), threadId, currentFrameLevel);
+  QString expression = expressionEdit->text();
+  gdbRunner.EvaluateExpression(expression, threadId, currentFrameLevel, [this, expression](bool success, const QString& value) {
+    if (success) {
+      QMessageBox::information(this, tr("Expression evaluation"), tr("%1 = %2").arg(expression).arg(value));
+    } else {
+      QMessageBox::warning(this, tr("Expression evaluation"), tr("Failed to evaluate %1: %2").arg(expression).arg(value));
+    }
+  });
 }
 
 void MainWindow::ProgramStarted() {
@@ -1006,10 +1179,10 @@ void MainWindow::ProgramInterrupted() {
   expressionEdit->setEnabled(true);
   evaluateExpressionButton->setEnabled(true);
   
-  // Request updated thread and frame info
-  // TODO: Disable the thread combo box here and enable it again once we got the update
+  // Request the updated thread list. The details and stack frames of the
+  // current thread are requested once it is selected in the thread combo box.
+  threadDropdown->setEnabled(false);
   gdbRunner.GetThreadList();
-  gdbRunner.GetStackTrace();
 }
 
 void MainWindow::ProgramResumed() {
@@ -1064,30 +1237,51 @@ void MainWindow::ProgramStopped(int exitCode) {
 }
 
 void MainWindow::ProgramThreadListUpdated() {
+  // Block the signals while filling the combo box, such that only the stack
+  // trace of the thread that is finally selected gets requested.
+  threadDropdown->blockSignals(true);
   threadDropdown->clear();
   
+  int currentIndex = 0;
   for (const auto& threadIdAndFrame : gdbRunner.GetThreadIdAndFrames()) {
-    // qDebug() << "Thread" << threadIdAndFrame.first << ":" << threadIdAndFrame.second;
+    if (threadIdAndFrame.first == gdbRunner.GetCurrentThreadId()) {
+      currentIndex = threadDropdown->count();
+    }
     threadDropdown->addItem(tr("Thread %1").arg(threadIdAndFrame.second), QVariant(threadIdAndFrame.first));
   }
   
-  // qDebug() << "Current thread ID:" << gdbRunner.GetCurrentThreadId();
-  for (int index = 0; index < threadDropdown->count(); ++ index) {
-    if (threadDropdown->itemData(index).toInt() == gdbRunner.GetCurrentThreadId()) {
-      threadDropdown->setCurrentIndex(index);
-      break;
-    }
+  threadDropdown->setCurrentIndex(currentIndex);
+  threadDropdown->blockSignals(false);
+  threadDropdown->setEnabled(true);
+  
+  ThreadChanged(threadDropdown->currentIndex());
+}
+
+void MainWindow::ProgramThreadDetailsUpdated(int threadId) {
+  int index = threadDropdown->findData(QVariant(threadId));
+  if (index < 0) {
+    return;
   }
   
-  threadDropdown->setEnabled(true);
+  const auto& threadIdAndFrames = gdbRunner.GetThreadIdAndFrames();
+  auto it = std::lower_bound(threadIdAndFrames.begin(), threadIdAndFrames.end(), threadId,
+                             [](const std::pair<int, QString>& a, int id) {
+    return a.first < id;
+  });
+  if (it != threadIdAndFrames.end() && it->first == threadId) {
+    threadDropdown->setItemText(index, tr("Thread %1").arg(it->second));
+  }
 }
 
-void MainWindow::ProgramStackTraceUpdated() {
+void MainWindow::ProgramStackTraceUpdated(int firstNewFrame) {
+  // Pages of frames are appended to the previously received frames, so only
+  // add list items for the new frames.
   currentStackFrames = gdbRunner.GetStackTraceResult();
+  if (firstNewFrame == 0) {
+    stackFramesList->clear();
+  }
   
-  stackFramesList->clear();
-  
-  for (int stackFrameIndex = 0; stackFrameIndex < currentStackFrames.size(); ++ stackFrameIndex) {
+  for (int stackFrameIndex = firstNewFrame; stackFrameIndex < currentStackFrames.size(); ++ stackFrameIndex) {
     const StackFrame& frame = currentStackFrames[stackFrameIndex];
     
     QListWidgetItem* newItem = new QListWidgetItem(frame.shortDescription);
@@ -1121,8 +1315,13 @@ void MainWindow::ProgramStackTraceUpdated() {
     stackFramesList->addItem(newItem);
   }
   
-  stackFramesList->setCurrentItem(nullptr);
+  if (firstNewFrame == 0) {
+    stackFramesList->setCurrentItem(nullptr);
+  }
   stackFramesList->setEnabled(true);
+  
+  // Fetch more frames if the list is not filled yet.
+  StackFramesScrolled(stackFramesList->verticalScrollBar()->value());
 }
 
 void MainWindow::ReloadFile() {
@@ -1144,7 +1343,7 @@ void MainWindow::ReloadFile() {
     }
   }
   
-  if (!tabData->document->Open(tabData->document->path())) {
+  if (!tabData->document->Reload()) {
     QMessageBox::warning(this, tr("Error"), tr("Cannot read file for re-loading: %1").arg(tabData->document->path()));
     return;
   }
@@ -1158,7 +1357,9 @@ void MainWindow::UpdateIndexingStatus() {
     statusTextLabel->setVisible(false);
   } else {
     statusTextLabel->setVisible(true);
-    statusTextLabel->setText(tr("Indexing (%1)").arg(QString::number(progressPercentage) + QStringLiteral("%")));
+    statusTextLabel->setText(tr("Indexing (%1, %2 files/s)")
+        .arg(QString::number(progressPercentage) + QStringLiteral("%"))
+        .arg(IndexingStatistics::Instance().GetFilesPerSecond(), 0, 'f', 1));
   }
 }
 
@@ -1173,11 +1374,78 @@ void MainWindow::BuildCurrentTarget() {
     return;
   }
   
+  // Get the current project.
+  // TODO: Add a UI element that allows to select the current project, instead of the current HACK taking always the first
+  std::shared_ptr<Project> currentProject = projects.front();
+  
+  QString binaryPath;
+  BuildOutputParser::Mode mode;
+  if (!GetBuildTool(currentProject.get(), tr("Build current target"), &binaryPath, &mode)) {
+    return;
+  }
+  
+  // Compile command-line arguments.
+  QStringList arguments;
+  if (currentProject->GetBuildThreads() != 0) {
+    arguments.push_back("-j");
+    arguments.push_back(QString::number(currentProject->GetBuildThreads()));
+  }
+  if (!buildTargetCombo->currentText().isEmpty()) {
+    arguments.push_back(buildTargetCombo->currentText());
+  }
+  
+  StartBuild(tr("Build current target"), currentProject.get(), binaryPath, mode, arguments);
+}
+
+void MainWindow::CompileCurrentFile() {
+  std::shared_ptr<Document> currentDocument = GetCurrentDocument();
+  if (!currentDocument || currentDocument->path().isEmpty()) {
+    QMessageBox::warning(this, tr("Compile current file"), tr("No file is open that can be compiled."));
+    return;
+  }
+  
+  // Use the first project that knows how to compile the file (or a source
+  // that includes it).
+  for (const std::shared_ptr<Project>& project : projects) {
+    QString binaryPath;
+    BuildOutputParser::Mode mode;
+    if (!GetBuildTool(project.get(), QString(), &binaryPath, &mode)) {
+      continue;
+    }
+    QString compiledSourcePath;
+    QStringList arguments;
+    if (!project->GetCompileFileBuildArguments(currentDocument->path(), mode == BuildOutputParser::Mode::Ninja, &compiledSourcePath, &arguments)) {
+      continue;
+    }
+    StartBuild(tr("Compile current file"), project.get(), binaryPath, mode, arguments);
+    return;
+  }
+  
+  QMessageBox::warning(this, tr("Compile current file"), tr("The current file is not compiled by any open project that has been configured and generated with Ninja or Makefiles, and it is not included by such a file."));
+}
+
+bool MainWindow::GetBuildTool(Project* project, const QString& errorTitle, QString* binaryPath, BuildOutputParser::Mode* mode) {
+  if (QFileInfo(project->GetBuildDir().filePath("build.ninja")).exists()) {
+    *binaryPath = "ninja";
+    *mode = BuildOutputParser::Mode::Ninja;
+  } else if (QFileInfo(project->GetBuildDir().filePath("Makefile")).exists()) {
+    *binaryPath = "make";
+    *mode = BuildOutputParser::Mode::Make;
+  } else {
+    if (!errorTitle.isEmpty()) {
+      QMessageBox::warning(this, errorTitle, tr("Neither 'Makefile' nor 'build.ninja' found in the build directory, thus cannot proceed. Maybe CMake needs to be run first?"));
+    }
+    return false;
+  }
+  return true;
+}
+
+void MainWindow::StartBuild(const QString& title, Project* project, const QString& binaryPath, BuildOutputParser::Mode mode, const QStringList& arguments) {
   if (buildProcess) {
     if (buildProcess->state() != QProcess::NotRunning) {
       if (QMessageBox::question(
           this,
-          tr("Build current target"),
+          title,
           tr("A build process is running already. Abort the old process and start a new one?"),
           QMessageBox::Yes | QMessageBox::No) == QMessageBox::No) {
         return;
@@ -1187,12 +1455,8 @@ void MainWindow::BuildCurrentTarget() {
   }
   
   // Save all modified files
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document->HasUnsavedChanges()) {
-      Save(&item.second, item.second.document->path());
-    }
-  }
-
+  SaveAll();
+  
   // Hide the build dock in case it is currently shown.
   buildOutputWidget->hide();
   
@@ -1212,32 +1476,27 @@ void MainWindow::BuildCurrentTarget() {
   connect(buildViewOutputButton, &QPushButton::clicked, this, &MainWindow::ViewBuildOutput);
   statusBar()->addWidget(buildViewOutputButton, 0);
   
-  // Get the current project.
-  // TODO: Add a UI element that allows to select the current project, instead of the current HACK taking always the first
-  std::shared_ptr<Project> currentProject = projects.front();
-  
   // Create QProcess and connect signals.
   buildProcess.reset(new QProcess());
   
   connect(buildProcess.get(),
           &QProcess::readyReadStandardOutput,
           [&]() {
-    buildStdout += buildProcess->readAllStandardOutput();
-    
-    TryParseBuildStdout();
+    buildOutputParser.AddOutput(buildProcess->readAllStandardOutput(), false);
   });
   
   connect(buildProcess.get(),
           &QProcess::readyReadStandardError,
           [&]() {
-    buildStderr += buildProcess->readAllStandardError();
-    
-    TryParseBuildStderr();
+    buildOutputParser.AddOutput(buildProcess->readAllStandardError(), true);
   });
   
   connect(buildProcess.get(),
           QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
           [&](int exitCode, QProcess::ExitStatus exitStatus) {
+    // Make sure that all output has been parsed before the issues are counted.
+    FlushBuildOutput();
+    
     switch (exitStatus) {
     case QProcess::NormalExit:
       if (buildErrors > 0 && buildWarnings > 0) {
@@ -1284,266 +1543,52 @@ void MainWindow::BuildCurrentTarget() {
     };
   });
   
-  // Determine whether to use make or ninja.
-  QString binaryPath;
-  if (QFileInfo(currentProject->GetBuildDir().filePath("build.ninja")).exists()) {
-    binaryPath = "ninja";
-    buildParseMode = BuildParseMode::Ninja;
-  } else if (QFileInfo(currentProject->GetBuildDir().filePath("Makefile")).exists()) {
-    binaryPath = "make";
-    buildParseMode = BuildParseMode::Make;
-  } else {
-    QMessageBox::warning(this, tr("Build current target"), tr("Neither 'Makefile' nor 'build.ninja' found in the build directory, thus cannot proceed. Maybe CMake needs to be run first?"));
-    StopBuilding();
-    return;
-  }
-  
-  // Compile command-line arguments.
-  QStringList arguments;
-  if (currentProject->GetBuildThreads() != 0) {
-    arguments.push_back("-j");
-    arguments.push_back(QString::number(currentProject->GetBuildThreads()));
-  }
-  if (!buildTargetCombo->currentText().isEmpty()) {
-    arguments.push_back(buildTargetCombo->currentText());
-  }
+  buildOutputParser.Reset(mode);
   
   // Start the process.
-  buildProcess->setWorkingDirectory(currentProject->GetBuildDir().path());
+  buildProcess->setWorkingDirectory(project->GetBuildDir().path());
+  CPUBudget::Instance().SetBuildRunning(true);
   buildProcess->start(binaryPath, arguments);
+  buildOutputTimer.start();
 }
 
-void MainWindow::TryParseBuildStdout() {
-  QByteArray lineBytes;
-  for (int i = 0; i < buildStdout.size(); ++ i) {
-    if (buildStdout[i] != '\n') {
-      lineBytes += buildStdout[i];
-      continue;
-    }
-    
-    QString line = QString::fromUtf8(lineBytes);
-    lineBytes.clear();
-    
-    buildOutputText += line + QStringLiteral("\n");
-    if (buildOutputTextLabel) {
-      buildOutputTextLabel->setText(buildOutputText);
-      buildIssuesWidget->resize(buildIssuesWidget->sizeHint());
-    }
-    
-    // Remove the line from buildStdout.
-    buildStdout.remove(0, i + 1);
-    i = -1;
-    
-    // Parse the line.
-    bool hasBeenParsed = false;
-    
-    // Ignore messages like "ninja: build stopped: subcommand failed."
-    if (!hasBeenParsed && buildParseMode != BuildParseMode::Make && line.startsWith(QStringLiteral("ninja: "))) {
-      hasBeenParsed = true;
-    }
-    
-    // Ignore messages like "FAILED: CMakeFiles/CIDEBaseLib.dir/src/cide/main.cc.o"
-    // TODO: Does ninja always print the failed command afterwards? Then we could skip that line safely.
-    if (!hasBeenParsed && buildParseMode != BuildParseMode::Make && line.startsWith(QStringLiteral("FAILED: "))) {
-      hasBeenParsed = true;
-    }
-    
-    // Ignore "collect2: error: ld returned 1 exit status"
-    if (!hasBeenParsed && line == QStringLiteral("collect2: error: ld returned 1 exit status")) {
-      hasBeenParsed = true;
-    }
-    
-    // Format of ninja progress output: "[X/Y] Message ...\n"
-    if (!hasBeenParsed && buildParseMode != BuildParseMode::Make && line.size() >= 6 && line[0] == '[') {
-      int slashPos = line.indexOf('/', 2);
-      if (slashPos >= 0) {
-        int closingBracketPos = line.indexOf(']', slashPos + 1);
-        if (closingBracketPos >= 0) {
-          bool ok;
-          int currentItem = line.midRef(1, slashPos - 1).toInt(&ok);
-          if (ok) {
-            int itemCount = line.midRef(slashPos + 1, closingBracketPos - slashPos - 1).toInt(&ok);
-            if (ok) {
-              buildProgressBar->setRange(0, itemCount);
-              buildProgressBar->setValue(currentItem);
-              hasBeenParsed = true;
-            }
-          }
-        }
-      }
-    }
-    
-    // Format of make progress output: "[ 50%] Message ...\n"
-    if (!hasBeenParsed && buildParseMode != BuildParseMode::Ninja && line.size() >= 6 && line[0] == '[') {
-      int closingBracketPos = line.indexOf(']', 1);
-      if (closingBracketPos >= 3 && line[closingBracketPos - 1] == '%') {
-        bool ok;
-        int percentage = line.midRef(1, closingBracketPos - 2).toInt(&ok);
-        if (ok) {
-          buildProgressBar->setRange(0, 100);
-          buildProgressBar->setValue(percentage);
-          hasBeenParsed = true;
-        }
-      }
-    }
-    
-    if (!hasBeenParsed) {
-      ParseBuildOutputForError(line);
-    }
+void MainWindow::PollBuildOutput() {
+  BuildOutputUpdate update;
+  if (!buildOutputParser.TakeUpdate(&update)) {
+    return;
   }
-}
-
-void MainWindow::TryParseBuildStderr() {
-  QByteArray lineBytes;
-  for (int i = 0; i < buildStderr.size(); ++ i) {
-    if (buildStderr[i] != '\n') {
-      lineBytes += buildStderr[i];
-      continue;
-    }
-    
-    QString line = QString::fromUtf8(lineBytes);
-    lineBytes.clear();
-    
-    buildOutputText += line + QStringLiteral("\n");
-    if (buildOutputTextLabel) {
-      buildOutputTextLabel->setText(buildOutputText);
-      buildIssuesWidget->resize(buildIssuesWidget->sizeHint());
-    }
-    
-    // Remove the line from buildStderr.
-    buildStderr.remove(0, i + 1);
-    i = -1;
-    
-    // Parse the line.
-    ParseBuildOutputForError(line);
-  }
-}
-
-void MainWindow::ParseBuildOutputForError(const QString& line) {
-  bool hasBeenParsed = false;
-  
-  // Format of GCC 5 build error output:
-  // "<path>:line:column: error: <description>"
-  // "<line with the error>"
-  // "               ^     "  (pointing to the error)
-  // 
-  // ../src/cide/main.cc: In instantiation of ‘void Test<T>::Foo() [with T = int]’:
-  // ../src/cide/main.cc:22:12:   required from here
-  // ../src/cide/main.cc:11:10: error: invalid conversion from ‘const char*’ to ‘int’ [-fpermissive]
-  //      test = "bar";
-  //           ^
-  // 
-  // Format of clang-cl build error output:
-  // "<path>"(line,column): error: <description>"
-  // "<line with the error>"
-  // "               ^     "  (pointing to the error)
-  if (!hasBeenParsed &&
-      (line.endsWith(QStringLiteral("required from here")) ||
-        line.indexOf("In instantiation of") > 0)) {
-    int firstSpace = line.indexOf(' ');
-    if (firstSpace >= 0) {
-      cachedPartialIssueText += QStringLiteral(
-          "<a href=\"%1\">%1</a> %2<br/>")
-              .arg(line.midRef(0, firstSpace))
-              .arg(line.midRef(firstSpace + 1));
-      hasBeenParsed = true;
-    }
+  
+  // Only append the new lines to the text view instead of setting the whole
+  // text again, which would take time linear in the length of the build log.
+  buildOutputText += update.outputText;
+  if (buildOutputTextView && !update.outputText.isEmpty()) {
+    update.outputText.chop(1);  // appendPlainText() starts a new paragraph itself
+    buildOutputTextView->appendPlainText(update.outputText);
   }
   
-  if (!hasBeenParsed && line.size() >= 12) {
-    bool isError = true;
-    bool isNote = false;
-    int prefixLen = 9;
-    int errorOrWarningStringPos = line.indexOf(QStringLiteral(": error: "));
-    if (errorOrWarningStringPos <= 0) {
-      isError = true;
-      prefixLen = 15;
-      errorOrWarningStringPos = line.indexOf(QStringLiteral(": fatal error: "));
-      if (errorOrWarningStringPos <= 0) {
-        isError = false;
-        prefixLen = 11;
-        errorOrWarningStringPos = line.indexOf(QStringLiteral(": warning: "));
-        if (errorOrWarningStringPos <= 0) {
-          isNote = true;
-          prefixLen = 8;
-          errorOrWarningStringPos = line.indexOf(QStringLiteral(": note: "));
-        }
-      }
-    }
-    if (errorOrWarningStringPos >= 5) {
-      int lineNumber = -1;
-      int columnNumber = -1;
-      QString path;
-      QString problemText;
-      
-      if (line[errorOrWarningStringPos - 1] == ')') {
-        // The output seems to be in clang-cl format.
-        int openingBracePos = line.lastIndexOf('(', errorOrWarningStringPos - 2);
-        if (openingBracePos >= 0) {
-          int commaPos = line.indexOf(',', openingBracePos + 1);
-          if (commaPos >= 0) {
-            bool ok;
-            lineNumber = line.midRef(openingBracePos + 1, commaPos - openingBracePos - 1).toInt(&ok);
-            if (ok) {
-              columnNumber = line.midRef(commaPos + 1, errorOrWarningStringPos - 1 - commaPos - 1).toInt(&ok);
-              if (ok) {
-                path = line.left(openingBracePos);
-                problemText = line.mid(errorOrWarningStringPos + prefixLen);
-              }
-            }
-          }
-        }
-      } else {
-        // The output is assumed to be in gcc/clang format.
-        int columnColonPos = line.lastIndexOf(':', errorOrWarningStringPos - 1);
-        if (columnColonPos >= 0) {
-          int lineColonPos = line.lastIndexOf(':', columnColonPos - 1);
-          if (lineColonPos >= 0) {
-            bool ok;
-            lineNumber = line.midRef(lineColonPos + 1, columnColonPos - lineColonPos - 1).toInt(&ok);
-            if (ok) {
-              columnNumber = line.midRef(columnColonPos + 1, errorOrWarningStringPos - columnColonPos - 1).toInt(&ok);
-              if (ok) {
-                path = line.left(lineColonPos);
-                problemText = line.mid(errorOrWarningStringPos + prefixLen);
-              }
-            }
-          }
-        }
-      }
-      
-      if (!problemText.isEmpty()) {
-        // TODO: Also append any following lines that also belong to this error?
-        //       It would be easy to recognize lines containing only whitespace and ^, this signals that the line before is a code excerpt.
-        //       However, the code can also easily be looked at by clicking the issue link, so maybe we don't need the excerpt.
-        QString htmlText = QStringLiteral("%5<a href=\"%1:%2:%3\">%1:%2:%3</a> <b>%4</b>")
-            .arg(path)
-            .arg(lineNumber)
-            .arg(columnNumber)
-            .arg(problemText.toHtmlEscaped())
-            .arg(cachedPartialIssueText);
-        if (isNote) {
-          AppendBuildIssue(htmlText);
-        } else {
-          AddBuildIssue(htmlText, isError);
-        }
-        cachedPartialIssueText.clear();
-        hasBeenParsed = true;
-      }
-    }
+  if (buildProgressBar && update.progressMaximum >= 0) {
+    buildProgressBar->setRange(0, update.progressMaximum);
+    buildProgressBar->setValue(update.progressValue);
   }
   
-  // Format of linker errors:
-  // "libCIDEBaseLib.so: undefined reference to `DockWidgetWithClosedSignal::staticMetaObject'"
-  if (!hasBeenParsed && line.size() >= 21) {
-    int undefinedReferencePos = line.indexOf(QStringLiteral(": undefined reference"));
-    if (undefinedReferencePos >= 0) {
-      AddBuildIssue(QStringLiteral("<b>%1</b>").arg(line.trimmed().toHtmlEscaped()), true);
-      hasBeenParsed = true;
+  for (const BuildIssue& issue : update.issues) {
+    if (issue.type == BuildIssue::Type::Note) {
+      AppendBuildIssue(issue.htmlText);
+    } else {
+      AddBuildIssue(issue.htmlText, issue.type == BuildIssue::Type::Error);
     }
   }
 }
 
+void MainWindow::FlushBuildOutput() {
+  if (buildProcess) {
+    buildOutputParser.AddOutput(buildProcess->readAllStandardOutput(), false);
+    buildOutputParser.AddOutput(buildProcess->readAllStandardError(), true);
+  }
+  buildOutputParser.WaitUntilIdle();
+  PollBuildOutput();
+}
+
 void MainWindow::ViewBuildOutput() {
   if (!buildOutputWidget->isVisible()) {
     addDockWidget(Qt::BottomDockWidgetArea, buildOutputWidget);
@@ -1560,11 +1605,20 @@ void MainWindow::ViewBuildOutputAsText() {
     buildOutputWidget->show();
   }
   
-  if (!buildOutputTextLabel) {
-    buildOutputTextLabel = new QLabel(buildOutputText);
-    buildOutputTextLabel->setTextInteractionFlags(Qt::TextBrowserInteraction);
-    buildOutputTextLabel->setFont(Settings::Instance().GetDefaultFont());
-    buildIssuesLayout->insertWidget(0, buildOutputTextLabel);
+  if (!buildOutputTextView) {
+    // QPlainTextEdit only lays out the visible part of the text, so it can
+    // display long build logs efficiently.
+    buildOutputTextView = new QPlainTextEdit();
+    buildOutputTextView->setReadOnly(true);
+    buildOutputTextView->setLineWrapMode(QPlainTextEdit::NoWrap);
+    buildOutputTextView->setFont(Settings::Instance().GetDefaultFont());
+    buildOutputTextView->setMinimumHeight(20 * buildOutputTextView->fontMetrics().lineSpacing());
+    QString text = buildOutputText;
+    if (text.endsWith('\n')) {
+      text.chop(1);
+    }
+    buildOutputTextView->setPlainText(text);
+    buildIssuesLayout->insertWidget(0, buildOutputTextView);
     buildIssuesWidget->resize(buildIssuesWidget->sizeHint());
   }
   buildIssuesRichTextScrollArea->ensureVisible(0, 0);
@@ -1589,6 +1643,9 @@ void MainWindow::StopBuilding() {
 }
 
 void MainWindow::FinishedBuilding(const QString& statusMessage) {
+  buildOutputTimer.stop();
+  CPUBudget::Instance().SetBuildRunning(false);
+  
   if (buildProgressBar) {
     statusBar()->removeWidget(buildProgressBar);
     delete buildProgressBar;
@@ -1806,6 +1863,109 @@ void MainWindow::ShowProgramSettings() {
   projectTreeView.UpdateHighlighting();
 }
 
+void MainWindow::ShowMemoryReport() {
+  QString report = CreateMemoryReport(this);
+  qDebug().noquote() << report;
+  
+  QDialog dialog(this);
+  dialog.setWindowTitle(tr("Memory report"));
+  
+  QPlainTextEdit* reportEdit = new QPlainTextEdit(report);
+  reportEdit->setReadOnly(true);
+  reportEdit->setLineWrapMode(QPlainTextEdit::NoWrap);
+  reportEdit->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+  
+  QDialogButtonBox* buttonBox = new QDialogButtonBox(QDialogButtonBox::Close);
+  connect(buttonBox, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+  
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->addWidget(reportEdit);
+  layout->addWidget(buttonBox);
+  dialog.setLayout(layout);
+  
+  dialog.resize(900, 600);
+  dialog.exec();
+}
+
+void MainWindow::ShowIndexingStatistics() {
+  IndexingStatisticsDialog* dialog = new IndexingStatisticsDialog(this);
+  dialog->setAttribute(Qt::WA_DeleteOnClose);
+  dialog->show();
+}
+
+void MainWindow::ShowCommentMarkers() {
+  CommentMarkerDialog* dialog = new CommentMarkerDialog(this, this);
+  dialog->setAttribute(Qt::WA_DeleteOnClose);
+  dialog->show();
+}
+
+void MainWindow::ExportIndex() {
+  std::shared_ptr<Project> project = GetCurrentProject();
+  if (!project) {
+    QMessageBox::warning(this, tr("Export index"), tr("No project is open."));
+    return;
+  }
+  
+  QString path = QFileDialog::getSaveFileName(
+      this,
+      tr("Export index"),
+      project->GetName() + QStringLiteral(".cidx"),
+      tr("CIDE index bundles (*.cidx)"));
+  if (path.isEmpty()) {
+    return;
+  }
+  
+  // Only export the files whose index is available, since indexing the
+  // remaining files would block the UI.
+  QString errorReason;
+  int numExported = ExportIndexBundle(project.get(), path, /*indexMissingFiles*/ false, &errorReason);
+  if (numExported < 0) {
+    QMessageBox::warning(this, tr("Export index"), errorReason);
+    return;
+  }
+  QMessageBox::information(this, tr("Export index"), tr("Exported the index of %1 source files.").arg(numExported));
+}
+
+void MainWindow::ImportIndex() {
+  std::shared_ptr<Project> project = GetCurrentProject();
+  if (!project) {
+    QMessageBox::warning(this, tr("Import index"), tr("No project is open."));
+    return;
+  }
+  
+  QString path = QFileDialog::getOpenFileName(
+      this,
+      tr("Import index"),
+      "",
+      tr("CIDE index bundles (*.cidx)"));
+  if (path.isEmpty()) {
+    return;
+  }
+  
+  std::vector<QString> importedPaths;
+  int numSkipped;
+  QString bundleCommit;
+  QString errorReason;
+  if (!ImportIndexBundle(project.get(), path, &importedPaths, &numSkipped, &bundleCommit, &errorReason)) {
+    QMessageBox::warning(this, tr("Import index"), errorReason);
+    return;
+  }
+  
+  // Load the imported entries into the USRStorage. Files that have been
+  // indexed already are loaded again, since the import may be more recent.
+  int numRequests = ParseThreadPool::Instance().RequestReindex(importedPaths, 0, this);
+  if (numRequests > 0) {
+    numIndexingRequestsCreated += numRequests;
+    UpdateIndexingStatus();
+  }
+  
+  QString message = tr("Imported the index of %1 source files. %2 files were skipped since their compile settings or their content differ locally; these are indexed normally.").arg(importedPaths.size()).arg(numSkipped);
+  if (!bundleCommit.isEmpty()) {
+    message += QStringLiteral("\n\n") + tr("The index was created for commit %1.").arg(bundleCommit);
+  }
+  QMessageBox::information(this, tr("Import index"), message);
+}
+
 void MainWindow::ShowAboutDialog() {
   AboutDialog dialog(this);
   dialog.exec();
@@ -1827,12 +1987,10 @@ void MainWindow::GotoDocumentLocation(const QString& url) {
   
   // If we can find this file among the open tabs, activate that tab.
   DocumentWidget* widget = nullptr;
-  for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document->path() == path) {
-      tabBar->setCurrentIndex(FindTabIndexForTabDataIndex(item.first));
-      widget = item.second.widget;
-      break;
-    }
+  auto it = path.isEmpty() ? tabDataIndexByPath.end() : tabDataIndexByPath.find(path);
+  if (it != tabDataIndexByPath.end()) {
+    tabBar->setCurrentIndex(FindTabIndexForTabDataIndex(it->second));
+    widget = tabs.at(it->second).widget;
   }
   
   // If the file is not open in a tab, try to open the file.
@@ -1875,6 +2033,10 @@ void MainWindow::DocumentChanged() {
 }
 
 void MainWindow::DocumentChanged(Document* changedDocument) {
+  DocumentsChanged({changedDocument});
+}
+
+void MainWindow::DocumentsChanged(const std::vector<Document*>& changedDocuments) {
   // Update tab bar items
   for (int i = 0; i < tabBar->count(); ++ i) {
     int tabDataIndex = tabBar->tabData(i).toInt();
@@ -1893,16 +2055,24 @@ void MainWindow::DocumentChanged(Document* changedDocument) {
   
   statusTextLabel->setVisible(false);
   
-  // Go through all other open files. For each one that includes the changed file,
+  // Go through all other open files. For each one that includes a changed file,
   // mark it as to be reparsed on next activation.
   for (const std::pair<int, TabData>& item : tabs) {
-    if (item.second.document.get() == changedDocument) {
-      continue;
-    }
-    
     for (const auto& project : projects) {
       SourceFile* sourceFile = project->GetSourceFile(item.second.document->path());
-      if (sourceFile && sourceFile->includedPaths.count(changedDocument->path()) > 0) {
+      if (!sourceFile) {
+        continue;
+      }
+      
+      bool includesChangedDocument = false;
+      for (Document* changedDocument : changedDocuments) {
+        if (item.second.document.get() != changedDocument &&
+            sourceFile->Includes(changedDocument->path())) {
+          includesChangedDocument = true;
+          break;
+        }
+      }
+      if (includesChangedDocument) {
         item.second.widget->SetReparseOnNextActivation();
         break;
       }
@@ -1990,16 +2160,9 @@ void MainWindow::closeEvent(QCloseEvent* event) {
       event->ignore();
       return;
     } else if (response == QMessageBox::Yes) {
-      for (int i = 0; i < tabBar->count(); ++ i) {
-        int tabDataIndex = tabBar->tabData(i).toInt();
-        const TabData& tabData = tabs.at(tabDataIndex);
-        Document* document = tabData.document.get();
-        if (document->HasUnsavedChanges()) {
-          if (!Save(&tabData, tabData.document->path())) {
-            event->ignore();
-            return;
-          }
-        }
+      if (!SaveAll()) {
+        event->ignore();
+        return;
       }
     }
   }
@@ -2012,6 +2175,13 @@ void MainWindow::closeEvent(QCloseEvent* event) {
   // Save the session (list of open documents)
   SaveSession();
   
+  // Keep the TUs of the open documents for the next session
+  for (int i = 0; i < tabBar->count(); ++ i) {
+    Document* document = tabs.at(tabBar->tabData(i).toInt()).document.get();
+    SaveHighlightingToCache(document);
+    SaveTUToCache(document);
+  }
+  
   // As we are exiting normally, remove all crash backups.
   CrashBackup::Instance().DeleteAllBackups();
   
@@ -2025,8 +2195,26 @@ void MainWindow::AddTab(Document* document, const QString& name, DocumentWidget*
   
   newTabData.document.reset(document);
   
+  // Allow background threads to read the document text without waiting for
+  // the main thread.
+  document->SetPublishSnapshots(true);
+  
+  // Keep the parts of the document that are not being edited in large blocks.
+  document->SetCompactBlocksWhenIdle(true);
+  
+  // Show the highlighting from the last time that the document was open until
+  // it is parsed. This must happen before the widget gets created, since that
+  // highlights C/C++ files lexically if they have no highlighting yet.
+  LoadHighlightingFromCache(document);
+  
   newTabData.container = new DocumentWidgetContainer(newTabData.document, this);
   newTabData.widget = newTabData.container->GetDocumentWidget();
+  if (restoringSession || openingFiles) {
+    // Only parse the documents of the session (or of OpenFiles()) once their
+    // tab is activated, such that the parse threads can focus on the visible
+    // document.
+    newTabData.widget->DeferParseUntilActivation();
+  }
   if (newWidget) {
     *newWidget = newTabData.widget;
   }
@@ -2035,6 +2223,8 @@ void MainWindow::AddTab(Document* document, const QString& name, DocumentWidget*
   connect(newTabData.widget, &DocumentWidget::CursorMoved, searchBar, &SearchBar::CursorMoved);
   
   tabs[nextTabDataIndex] = newTabData;
+  tabDataIndexByDocument[document] = nextTabDataIndex;
+  UpdateTabPathLookup(nextTabDataIndex);
   
   documentLayout->addWidget(newTabData.container);
   documentLayout->setCurrentWidget(newTabData.container);
@@ -2051,18 +2241,14 @@ void MainWindow::AddTab(Document* document, const QString& name, DocumentWidget*
   QString correspondingPath = QFileInfo(FindCorrespondingHeaderOrSource(document->path(), projects)).canonicalFilePath();
   if (!correspondingPath.isEmpty()) {
     // We found a corresponding path in the file system, search for it among the open tabs
-    for (const std::pair<int, TabData>& item : tabs) {
-      if (item.second.document->path() == correspondingPath) {
-        int correspondingIndex = FindTabIndexForTabDataIndex(item.first);
-        if (correspondingIndex >= 0) {
-          bool newFileIsHeader = GuessIsHeader(document->path(), nullptr);
-          if (Settings::Instance().GetSourceLeftOfHeaderOrdering()) {
-            newTabIndex = tabBar->insertTab(newFileIsHeader ? (correspondingIndex + 1) : correspondingIndex, name);
-          } else {
-            newTabIndex = tabBar->insertTab(newFileIsHeader ? correspondingIndex : (correspondingIndex + 1), name);
-          }
-          break;
-        }
+    auto it = tabDataIndexByPath.find(correspondingPath);
+    int correspondingIndex = (it == tabDataIndexByPath.end()) ? -1 : FindTabIndexForTabDataIndex(it->second);
+    if (correspondingIndex >= 0) {
+      bool newFileIsHeader = GuessIsHeader(document->path(), nullptr);
+      if (Settings::Instance().GetSourceLeftOfHeaderOrdering()) {
+        newTabIndex = tabBar->insertTab(newFileIsHeader ? (correspondingIndex + 1) : correspondingIndex, name);
+      } else {
+        newTabIndex = tabBar->insertTab(newFileIsHeader ? correspondingIndex : (correspondingIndex + 1), name);
       }
     }
   }
@@ -2115,27 +2301,173 @@ int MainWindow::FindTabIndexForTabData(const TabData* tabData) {
   return -1;
 }
 
+MainWindow::TabData* MainWindow::FindTabDataForDocument(Document* document) {
+  auto it = tabDataIndexByDocument.find(document);
+  return (it == tabDataIndexByDocument.end()) ? nullptr : &tabs.at(it->second);
+}
+
+const MainWindow::TabData* MainWindow::FindTabDataForDocument(Document* document) const {
+  auto it = tabDataIndexByDocument.find(document);
+  return (it == tabDataIndexByDocument.end()) ? nullptr : &tabs.at(it->second);
+}
+
+const MainWindow::TabData* MainWindow::FindTabDataForPath(const QString& canonicalPath) const {
+  if (canonicalPath.isEmpty()) {
+    return nullptr;
+  }
+  auto it = tabDataIndexByPath.find(canonicalPath);
+  return (it == tabDataIndexByPath.end()) ? nullptr : &tabs.at(it->second);
+}
+
+void MainWindow::UpdateTabPathLookup(int tabDataIndex) {
+  TabData& tabData = tabs.at(tabDataIndex);
+  const QString& newPath = tabData.document->path();
+  if (newPath == tabData.lookupPath) {
+    return;
+  }
+  
+  auto it = tabDataIndexByPath.find(tabData.lookupPath);
+  if (it != tabDataIndexByPath.end() && it->second == tabDataIndex) {
+    tabDataIndexByPath.erase(it);
+  }
+  tabData.lookupPath = newPath;
+  if (!newPath.isEmpty()) {
+    tabDataIndexByPath[newPath] = tabDataIndex;
+  }
+}
+
 bool MainWindow::Save(const TabData* tabData, const QString& oldPath) {
   Document* document = tabData->document.get();
   if (document->path().isEmpty()) {
     return SaveAs(tabData);
   } else {
-    if (!document->Save(document->path())) {
+    bool saved = document->Save(document->path());
+    UpdateTabPathLookup(tabDataIndexByDocument.at(document));
+    if (!saved) {
       QMessageBox::warning(this, tr("Error"), tr("Failed to write file: %1").arg(document->path()));
       return false;
     }
-    if (!oldPath.isEmpty()) {
-      CrashBackup::Instance().RemoveBackup(oldPath);
-    }
-    tabData->container->SetMessage(DocumentWidgetContainer::MessageType::ExternalModificationNotification, QStringLiteral(""));
-    tabBar->setTabToolTip(FindTabIndexForTabData(tabData), document->path());
-    tabData->widget->CheckFileType();
-    DocumentChanged(document);
-    emit DocumentSaved();
+    UpdateSavedTab(tabData, oldPath);
+    NotifyDocumentsSaved({document});
     return true;
   }
 }
 
+bool MainWindow::SaveAll() {
+  struct PendingSave {
+    const TabData* tabData;
+    QString path;
+    std::shared_ptr<const DocumentSnapshot> snapshot;
+    bool succeeded = false;
+  };
+  
+  // Documents without a path need a file dialog each, so they are saved
+  // individually afterwards.
+  std::vector<PendingSave> pendingSaves;
+  std::vector<const TabData*> unnamedTabs;
+  for (int i = 0; i < tabBar->count(); ++ i) {
+    const TabData& tabData = tabs.at(tabBar->tabData(i).toInt());
+    if (!tabData.document->HasUnsavedChanges()) {
+      continue;
+    }
+    if (tabData.document->path().isEmpty()) {
+      unnamedTabs.push_back(&tabData);
+      continue;
+    }
+    
+    pendingSaves.emplace_back();
+    PendingSave& save = pendingSaves.back();
+    save.tabData = &tabData;
+    save.path = tabData.document->path();
+    save.snapshot = tabData.document->BeginSave();
+  }
+  
+  // Encode and write the files in parallel.
+  std::atomic<int> nextSaveIndex(0);
+  auto writeFiles = [&]() {
+    while (true) {
+      int saveIndex = nextSaveIndex.fetch_add(1);
+      if (saveIndex >= static_cast<int>(pendingSaves.size())) {
+        return;
+      }
+      PendingSave& save = pendingSaves[saveIndex];
+      save.succeeded = Document::WriteSnapshot(*save.snapshot, save.path);
+    }
+  };
+  int threadCount = std::max<int>(1, std::min<int>(pendingSaves.size(), std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (int t = 1; t < threadCount; ++ t) {
+    threads.emplace_back(writeFiles);
+  }
+  writeFiles();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  
+  // Watch the files again, and update the tabs. The notifications that
+  // depend on all saved files (for example, updating the git status of the
+  // project tree) are sent only once for all of them.
+  std::vector<Document*> savedDocuments;
+  QStringList failedPaths;
+  for (PendingSave& save : pendingSaves) {
+    Document* document = save.tabData->document.get();
+    document->FinishSave(save.path, save.snapshot->version(), save.succeeded);
+    save.snapshot.reset();
+    UpdateTabPathLookup(tabDataIndexByDocument.at(document));
+    if (save.succeeded) {
+      UpdateSavedTab(save.tabData, save.path);
+      savedDocuments.push_back(document);
+    } else {
+      failedPaths.push_back(save.path);
+    }
+  }
+  if (!savedDocuments.empty()) {
+    NotifyDocumentsSaved(savedDocuments);
+  }
+  if (!failedPaths.isEmpty()) {
+    QMessageBox::warning(this, tr("Error"), tr("Failed to write the following files:\n\n%1").arg(failedPaths.join('\n')));
+    return false;
+  }
+  
+  for (const TabData* tabData : unnamedTabs) {
+    if (!Save(tabData, QStringLiteral(""))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MainWindow::UpdateSavedTab(const TabData* tabData, const QString& oldPath) {
+  Document* document = tabData->document.get();
+  if (!oldPath.isEmpty()) {
+    CrashBackup::Instance().RemoveBackup(oldPath);
+  }
+  tabData->container->SetMessage(DocumentWidgetContainer::MessageType::ExternalModificationNotification, QStringLiteral(""));
+  tabBar->setTabToolTip(FindTabIndexForTabData(tabData), document->path());
+  tabData->widget->CheckFileType();
+  tabData->widget->ReparseIfPostponed();
+}
+
+void MainWindow::NotifyDocumentsSaved(const std::vector<Document*>& savedDocuments) {
+  DocumentsChanged(savedDocuments);
+  
+  // Update the index for the sources that include the saved files
+  int numReindexRequests = 0;
+  for (Document* document : savedDocuments) {
+    for (const std::shared_ptr<Project>& project : projects) {
+      if (project->GetIndexAllProjectFiles()) {
+        numReindexRequests += project->ReindexSourcesThatInclude(document->path(), buildTargetCombo->currentText(), this);
+      }
+    }
+  }
+  if (numReindexRequests > 0) {
+    numIndexingRequestsCreated += numReindexRequests;
+    UpdateIndexingStatus();
+  }
+  
+  emit DocumentSaved();
+}
+
 bool MainWindow::SaveAs(const TabData* tabData) {
   QSettings settings;
   QString defaultPath;
@@ -2168,6 +2500,7 @@ bool MainWindow::SaveAs(const TabData* tabData) {
   Document* document = tabData->document.get();
   QString oldPath = document->path();
   document->setPath(path);
+  UpdateTabPathLookup(tabDataIndexByDocument.at(document));
   int tabIndex = FindTabIndexForTabData(tabData);
   if (tabIndex >= 0) {
     tabBar->setTabText(tabIndex, QFileInfo(path).fileName());
@@ -2176,6 +2509,86 @@ bool MainWindow::SaveAs(const TabData* tabData) {
   return Save(tabData, oldPath);
 }
 
+void MainWindow::SaveTUToCache(Document* document) {
+  if (!Settings::Instance().GetUseTUCache() ||
+      document->path().isEmpty() ||
+      document->HasUnsavedChanges()) {
+    return;
+  }
+  
+  std::shared_ptr<ClangTU> TU = document->GetTUPool()->TakeMostUpToDateTU();
+  if (!TU) {
+    return;
+  }
+  if (!TU->isInitialized() ||
+      TU->IsLoadedFromCache() ||  // the cache entry still exists then
+      TU->IsParsedWithReducedProfile() ||
+      !TU->IsParsedFromFilesOnDisk()) {
+    document->GetTUPool()->PutTU(TU, false);
+    return;
+  }
+  
+  // Note that the TU is not returned to the pool, since the TUCache uses it
+  // in its own thread.
+  TUCache::Instance().SaveAsync(QFileInfo(document->path()).canonicalFilePath(), TU);
+}
+
+void MainWindow::SaveHighlightingToCache(Document* document) {
+  if (!Settings::Instance().GetUseHighlightCache() ||
+      document->path().isEmpty() ||
+      document->HasUnsavedChanges()) {
+    return;
+  }
+  
+  // Only store the highlighting if the document has been parsed, since it is
+  // lexical otherwise (or it still is the highlighting from the cache, whose
+  // entry then still exists).
+  std::shared_ptr<ClangTU> TU = document->GetTUPool()->TakeMostUpToDateTU();
+  if (!TU) {
+    return;
+  }
+  bool parsed = TU->isInitialized() && !TU->IsLoadedFromCache();
+  document->GetTUPool()->PutTU(TU, false);
+  if (!parsed) {
+    return;
+  }
+  
+  QString canonicalPath = QFileInfo(document->path()).canonicalFilePath();
+  std::vector<QByteArray> commandLineArgs;
+  if (GetHighlightCacheCommandLineArgs(canonicalPath, &commandLineArgs)) {
+    HighlightCache::Instance().Save(canonicalPath, commandLineArgs, document);
+  }
+}
+
+void MainWindow::LoadHighlightingFromCache(Document* document) {
+  if (!Settings::Instance().GetUseHighlightCache() ||
+      document->path().isEmpty() ||
+      !GuessIsCFile(document->path())) {
+    return;
+  }
+  
+  QString canonicalPath = QFileInfo(document->path()).canonicalFilePath();
+  std::vector<QByteArray> commandLineArgs;
+  if (!GetHighlightCacheCommandLineArgs(canonicalPath, &commandLineArgs)) {
+    return;
+  }
+  HighlightBuffer highlights;
+  if (HighlightCache::Instance().Load(canonicalPath, commandLineArgs, document, &highlights)) {
+    document->ApplyHighlightBuffer(&highlights, /*layer*/ 0);
+    document->FinishedHighlightingChanges();
+  }
+}
+
+bool MainWindow::GetHighlightCacheCommandLineArgs(const QString& canonicalPath, std::vector<QByteArray>* args) {
+  std::shared_ptr<Project> usedProject;
+  CompileSettings* settings = FindParseSettingsForFile(canonicalPath, projects, &usedProject);
+  if (!settings) {
+    return false;
+  }
+  *args = settings->GetCommandLine(true, canonicalPath, usedProject.get())->args;
+  return true;
+}
+
 void MainWindow::SaveSession() {
   QSettings settings;
   settings.beginWriteArray("session");
@@ -2190,10 +2603,10 @@ void MainWindow::SaveSession() {
     settings.setValue("yScroll", tabData.widget->GetYScroll());
     
     QList<QVariant> bookmarkLines;
-    for (int line = 0, lineCount = document->LineCount(); line < lineCount; ++ line) {
-      if (document->lineAttributes(line) & static_cast<int>(LineAttribute::Bookmark)) {
-        bookmarkLines.push_back(line);
-      }
+    int bookmarkLine = document->FindNextLineWithAttributes(0, static_cast<int>(LineAttribute::Bookmark));
+    while (bookmarkLine >= 0) {
+      bookmarkLines.push_back(bookmarkLine);
+      bookmarkLine = document->FindNextLineWithAttributes(bookmarkLine + 1, static_cast<int>(LineAttribute::Bookmark));
     }
     settings.setValue("bookmarks", bookmarkLines);
   }
@@ -2201,6 +2614,7 @@ void MainWindow::SaveSession() {
 }
 
 void MainWindow::LoadSession() {
+  restoringSession = true;
   QSettings settings;
   int size = settings.beginReadArray("session");
   for (int i = 0; i < size; ++ i) {
@@ -2210,39 +2624,34 @@ void MainWindow::LoadSession() {
     if (!path.isEmpty()) {
       Open(path);
       
-      QString canonicalFilePath = QFileInfo(path).canonicalFilePath();
-      for (const std::pair<int, TabData>& item : tabs) {
-        Document* document = item.second.document.get();
-        if (document->path() == canonicalFilePath) {
-          item.second.widget->SetYScroll(settings.value("yScroll").toInt());
-          
-          int lineCount = document->LineCount();
-          QList<QVariant> bookmarks = settings.value("bookmarks").toList();
-          for (QVariant& bookmark : bookmarks) {
-            int line = bookmark.toInt();
-            if (line < lineCount) {
-              document->AddLineAttributes(line, static_cast<int>(LineAttribute::Bookmark));
-            }
+      const TabData* tabData = FindTabDataForPath(QFileInfo(path).canonicalFilePath());
+      if (tabData) {
+        Document* document = tabData->document.get();
+        tabData->widget->SetYScroll(settings.value("yScroll").toInt());
+        
+        int lineCount = document->LineCount();
+        QList<QVariant> bookmarks = settings.value("bookmarks").toList();
+        for (QVariant& bookmark : bookmarks) {
+          int line = bookmark.toInt();
+          if (line < lineCount) {
+            document->AddLineAttributes(line, static_cast<int>(LineAttribute::Bookmark));
           }
-          
-          break;
         }
       }
     }
   }
   settings.endArray();
+  restoringSession = false;
 }
 
 void MainWindow::ClearBuildIssues() {
-  buildStdout.clear();
-  buildStderr.clear();
+  buildOutputParser.Reset(BuildOutputParser::Mode::Unknown);
   buildOutputText.clear();
-  cachedPartialIssueText.clear();
   buildErrors = 0;
   buildWarnings = 0;
   
-  delete buildOutputTextLabel;
-  buildOutputTextLabel = nullptr;
+  delete buildOutputTextView;
+  buildOutputTextView = nullptr;
   
   lastAddedBuildIssueLabel = nullptr;
   
@@ -14,7 +14,10 @@
 #include <QPushButton>
 #include <QScrollArea>
 #include <QStackedLayout>
+#include <QTimer>
 
+#include "cide/build_output.h"
+#include "cide/diagnostics_sweep.h"
 #include "cide/document.h"
 #include "cide/document_widget_container.h"
 #include "cide/find_and_replace_in_files.h"
@@ -29,6 +32,7 @@ class QComboBox;
 class QLineEdit;
 class QListWidget;
 class QListWidgetItem;
+class QPlainTextEdit;
 class QTreeWidget;
 class SearchBar;
 
@@ -65,12 +69,22 @@ class MainWindow : public QMainWindow {
   /// Returns whether the given file is open in any tab.
   bool IsFileOpen(const QString& canonicalPath) const;
   
+  /// Returns the open document with the given path, or null if the file is not
+  /// open in any tab.
+  std::shared_ptr<Document> GetDocumentForPath(const QString& canonicalPath) const;
+  
   /// If the file is open in any tab, returns its Document and DocumentWidget.
   /// Returns true if successful, false otherwise.
   bool GetDocumentAndWidgetForPath(const QString& canonicalPath, Document** document, DocumentWidget** widget) const;
   
   inline std::vector<std::shared_ptr<Project>>& GetProjects() { return projects; }
   
+  inline DiagnosticsSweep* GetDiagnosticsSweep() { return &diagnosticsSweep; }
+  
+  /// Returns the number of indexing requests that were made for the projects,
+  /// see ParseThreadPool::GetNumFinishedIndexingRequests().
+  inline int GetNumIndexingRequestsCreated() const { return numIndexingRequestsCreated; }
+  
   inline const QString& GetCurrentFrameCanonicalPath() const { return currentFrameCanonicalPath; }
   inline int GetCurrentFrameLine() const { return currentFrameLine; }
   
@@ -90,8 +104,24 @@ class MainWindow : public QMainWindow {
   void New();
   void Open();
   void Open(const QString& path);
+  
+  /// Opens many files at once: reads them in parallel, and queues their parse
+  /// requests as a single batch instead of one per file. Files that are open
+  /// already are skipped.
+  void OpenFiles(const QStringList& paths);
+  
+  /// Asks for a file and opens it in a MappedFileViewer, which shows huge
+  /// files (such as logs) read-only without loading them into a document.
+  void OpenInViewer();
+  
   void Save();
   void SaveAs();
+  
+  /// Saves all documents with unsaved changes. The files of the documents
+  /// that have a path are written in parallel, and the notifications about
+  /// the saved files are sent once for all of them. Returns false if saving
+  /// any document failed or was canceled.
+  bool SaveAll();
   void CloseDocument();
   void CloseDocument(int tabIndex);
   void CloseAllOtherDocuments(int tabIndex);
@@ -113,9 +143,15 @@ class MainWindow : public QMainWindow {
   void SetStatusText(const QString& text);
   
   void BuildCurrentTarget();
-  void TryParseBuildStdout();
-  void TryParseBuildStderr();
-  void ParseBuildOutputForError(const QString& line);
+  /// Compiles only the object file of the current document (or of a source
+  /// that includes it, for headers), which is much faster than building the
+  /// whole target for checking whether the file compiles.
+  void CompileCurrentFile();
+  /// Applies the results of the build output parser to the UI.
+  void PollBuildOutput();
+  /// Waits for the build output parser to parse all output that has been
+  /// received so far, and applies the results.
+  void FlushBuildOutput();
   void ViewBuildOutput();
   void ViewBuildOutputAsText();
   void BuildOutputWidgetClosed();
@@ -143,6 +179,7 @@ class MainWindow : public QMainWindow {
   void RunPauseClicked();
   void StopClicked();
   void ThreadChanged(int index);
+  void StackFramesScrolled(int value);
   void ProgramFrameActivated(QListWidgetItem* item);
   void EvaluateExpression();
   
@@ -151,7 +188,8 @@ class MainWindow : public QMainWindow {
   void ProgramResumed();
   void ProgramStopped(int exitCode);
   void ProgramThreadListUpdated();
-  void ProgramStackTraceUpdated();
+  void ProgramThreadDetailsUpdated(int threadId);
+  void ProgramStackTraceUpdated(int firstNewFrame);
   
   void ReloadFile();
   void GoToLeftTab();
@@ -163,6 +201,26 @@ class MainWindow : public QMainWindow {
   void RunGitk();
   void ShowProgramSettings();
   
+  /// Shows a report of the memory used by the open documents, their libclang
+  /// TUs and the USR index, and also prints it to the debug output.
+  void ShowMemoryReport();
+  
+  /// Shows a (non-modal) dialog with information about the indexing progress
+  /// and the files that take longest to index.
+  void ShowIndexingStatistics();
+  
+  /// Shows a (non-modal) dialog that lists the comment markers (such as
+  /// "TODO") in the indexed project files.
+  void ShowCommentMarkers();
+  
+  /// Asks for a file name and exports the index of the current project to an
+  /// index bundle there (see ExportIndexBundle()).
+  void ExportIndex();
+  
+  /// Asks for an index bundle file and imports it for the current project
+  /// (see ImportIndexBundle()).
+  void ImportIndex();
+  
   void ShowAboutDialog();
   
   /// Expects an URL like "file://filepath:line:column". If the file is open in
@@ -175,6 +233,7 @@ class MainWindow : public QMainWindow {
   /// Called when any document has changed.
   void DocumentChanged();
   void DocumentChanged(Document* changedDocument);
+  void DocumentsChanged(const std::vector<Document*>& changedDocuments);
   
   /// Called when either the current document has changed, or any document got
   /// opened or closed.
@@ -194,6 +253,11 @@ class MainWindow : public QMainWindow {
     std::shared_ptr<Document> document;
     DocumentWidget* widget;
     DocumentWidgetContainer* container;
+    
+    /// The path under which the tab is stored in tabDataIndexByPath, which
+    /// may differ from the document's path after it was saved under a new
+    /// name, until UpdateTabPathLookup() is called.
+    QString lookupPath;
   };
   
   void AddTab(Document* document, const QString& name, DocumentWidget** newWidget = nullptr);
@@ -202,18 +266,70 @@ class MainWindow : public QMainWindow {
   int FindTabIndexForTabDataIndex(int tabDataIndex);
   int FindTabIndexForTabData(const TabData* tabData);
   
+  /// Returns the TabData for the given document or canonical path, or null if
+  /// the document, respectively file, is not open.
+  TabData* FindTabDataForDocument(Document* document);
+  const TabData* FindTabDataForDocument(Document* document) const;
+  const TabData* FindTabDataForPath(const QString& canonicalPath) const;
+  
+  /// Updates the entry of the given tab in tabDataIndexByPath after its
+  /// document's path changed (or was set for the first time).
+  void UpdateTabPathLookup(int tabDataIndex);
+  
   bool Save(const TabData* tabData, const QString& oldPath);
+  
+  /// Updates the tab of a document after it has been saved successfully.
+  /// @p oldPath is the path of the document before saving it.
+  void UpdateSavedTab(const TabData* tabData, const QString& oldPath);
+  
+  /// Notifies about having saved the given documents: marks the documents
+  /// that include them for reparsing, reindexes the including sources, and
+  /// emits DocumentSaved() once.
+  void NotifyDocumentsSaved(const std::vector<Document*>& savedDocuments);
   bool SaveAs(const TabData* tabData);
   
   void SaveSession();
+  
+  /// If the document has no unsaved changes and a free TU of it was parsed
+  /// from the files on disk, passes this TU to the TUCache. Called for
+  /// documents that are being closed, since the TU is taken out of the pool.
+  void SaveTUToCache(Document* document);
+  
+  /// If the document has no unsaved changes and its highlighting is from a
+  /// parse, stores the highlighting, contexts, and problems in the
+  /// HighlightCache. Must be called before SaveTUToCache().
+  void SaveHighlightingToCache(Document* document);
+  
+  /// Applies the highlighting, contexts, and problems from the HighlightCache
+  /// to a document that has just been opened, if there is an entry for its
+  /// text and compile settings.
+  void LoadHighlightingFromCache(Document* document);
+  
+  /// Returns the command-line arguments that the HighlightCache entries of
+  /// the given file are keyed with, or false if no compile settings are
+  /// known for it.
+  bool GetHighlightCacheCommandLineArgs(const QString& canonicalPath, std::vector<QByteArray>* args);
+  
+  /// Re-opens the documents of the last session. Only the current tab is
+  /// parsed right away, the others are parsed once they are activated.
   void LoadSession();
   
+  /// Determines the build tool for the build directory of @p project. If
+  /// there is none and @p errorTitle is non-empty, shows an error message with
+  /// this title. Returns true if a build tool was found, false otherwise.
+  bool GetBuildTool(Project* project, const QString& errorTitle, QString* binaryPath, BuildOutputParser::Mode* mode);
+  
+  /// Runs the build tool with the given arguments in the build directory of
+  /// @p project, showing its progress and issues in the UI.
+  void StartBuild(const QString& title, Project* project, const QString& binaryPath, BuildOutputParser::Mode mode, const QStringList& arguments);
+  
   void ClearBuildIssues();
   void AddBuildIssue(const QString& text, bool isError);
   void AppendBuildIssue(const QString& text);
   
   
   QAction* saveAction;
+  QAction* saveAllAction;
   QAction* saveAsAction;
   QAction* closeAction;
   
@@ -234,8 +350,20 @@ class MainWindow : public QMainWindow {
   TabBar* tabBar;
   /// Maps tabDataIndex -> TabData.
   std::unordered_map<int, TabData> tabs;
+  /// Map the documents, respectively the canonical paths of the documents,
+  /// to the tabDataIndex of the tab that shows them. These avoid looping over
+  /// all tabs for the frequent lookups from other components (for example,
+  /// for every indexing request).
+  std::unordered_map<Document*, int> tabDataIndexByDocument;
+  std::unordered_map<QString, int> tabDataIndexByPath;
   int nextTabDataIndex;
   
+  /// Set while LoadSession() opens documents, see AddTab().
+  bool restoringSession = false;
+  
+  /// Set while OpenFiles() opens documents, see AddTab().
+  bool openingFiles = false;
+  
   std::vector<std::shared_ptr<Project>> projects;
   
   std::shared_ptr<QProcess> gitkProcess;
@@ -244,21 +372,14 @@ class MainWindow : public QMainWindow {
   int numIndexingRequestsCreated = 0;
   
   // Building
-  enum class BuildParseMode {
-    Ninja = 0,
-    Make,
-    Unknown
-  };
   std::shared_ptr<QProcess> buildProcess = nullptr;
-  BuildParseMode buildParseMode;
+  BuildOutputParser buildOutputParser;
+  QTimer buildOutputTimer;
   QProgressBar* buildProgressBar = nullptr;
   QPushButton* buildStopButton = nullptr;
   QPushButton* buildViewOutputButton = nullptr;
   QMenu* viewAsTextMenu = nullptr;
-  QByteArray buildStdout;
-  QByteArray buildStderr;
   QString buildOutputText;
-  QString cachedPartialIssueText;
   int buildErrors;
   int buildWarnings;
   
@@ -267,7 +388,7 @@ class MainWindow : public QMainWindow {
   QScrollArea* buildIssuesRichTextScrollArea;
   WidgetWithRightClickSignal* buildIssuesWidget;
   QVBoxLayout* buildIssuesLayout;
-  QLabel* buildOutputTextLabel = nullptr;
+  QPlainTextEdit* buildOutputTextView = nullptr;
   QLabel* lastAddedBuildIssueLabel = nullptr;
   
   // Run dock widget
@@ -302,6 +423,9 @@ class MainWindow : public QMainWindow {
   // Find-and-replace in files dock widget
   FindAndReplaceInFiles findAndReplaceInFiles;
   
+  // Project-wide diagnostics ("Problems") dock widget
+  DiagnosticsSweep diagnosticsSweep;
+  
   // Documentation dock widget
   QDockWidget* documentationDock = nullptr;
   HelpBrowser* documentationBrowser;
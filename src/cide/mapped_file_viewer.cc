@@ -0,0 +1,397 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/mapped_file_viewer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <QBoxLayout>
+#include <QCheckBox>
+#include <QFileInfo>
+#include <QLabel>
+#include <QLineEdit>
+#include <QMessageBox>
+#include <QMouseEvent>
+#include <QPainter>
+#include <QPaintEvent>
+#include <QPushButton>
+#include <QScrollBar>
+
+#include "cide/settings.h"
+
+/// The index thread publishes its progress after each chunk of this many bytes.
+constexpr qint64 kIndexPublishInterval = 4 * 1024 * 1024;
+
+/// Only this many bytes of each line are displayed.
+constexpr int kMaxDisplayedLineBytes = 4096;
+
+MappedTextFile::~MappedTextFile() {
+  mExit = true;
+  if (indexThread) {
+    indexThread->join();
+    indexThread.reset();
+  }
+  if (data) {
+    file.unmap(reinterpret_cast<uchar*>(const_cast<char*>(data)));
+  }
+}
+
+bool MappedTextFile::Open(const QString& path) {
+  file.setFileName(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  mSize = file.size();
+  if (mSize > 0) {
+    data = reinterpret_cast<const char*>(file.map(0, mSize));
+    if (!data) {
+      return false;
+    }
+  }
+  
+  sparseLineStarts.push_back(0);
+  indexedLineCount = 1;
+  indexThread.reset(new std::thread(&MappedTextFile::IndexThreadMain, this));
+  return true;
+}
+
+int MappedTextFile::GetIndexedLineCount(bool* complete) const {
+  std::unique_lock<std::mutex> lock(indexMutex);
+  if (complete) {
+    *complete = indexComplete;
+  }
+  return indexedLineCount;
+}
+
+qint64 MappedTextFile::LineStart(int line) const {
+  std::unique_lock<std::mutex> lock(indexMutex);
+  if (line < 0 || line >= indexedLineCount) {
+    return -1;
+  }
+  qint64 offset = sparseLineStarts[line / kLineIndexStride];
+  lock.unlock();
+  
+  for (int i = line % kLineIndexStride; i > 0; -- i) {
+    offset = NextLineStart(offset);
+  }
+  return offset;
+}
+
+QString MappedTextFile::GetLineText(int line, int maxBytes) const {
+  qint64 start = LineStart(line);
+  if (start < 0) {
+    return QString();
+  }
+  qint64 end = NextLineStart(start);
+  if (end < 0) {
+    end = mSize;
+  } else {
+    -- end;  // exclude the '\n'
+  }
+  if (end > start && data[end - 1] == '\r') {
+    -- end;
+  }
+  return QString::fromUtf8(data + start, std::min<qint64>(end - start, maxBytes));
+}
+
+int MappedTextFile::LineForOffset(qint64 offset) const {
+  std::unique_lock<std::mutex> lock(indexMutex);
+  int sparseIndex = std::upper_bound(sparseLineStarts.begin(), sparseLineStarts.end(), offset) - sparseLineStarts.begin() - 1;
+  int line = std::max(0, sparseIndex) * kLineIndexStride;
+  qint64 lineStart = sparseLineStarts[std::max(0, sparseIndex)];
+  lock.unlock();
+  
+  qint64 nextLineStart;
+  while ((nextLineStart = NextLineStart(lineStart)) >= 0 && nextLineStart <= offset) {
+    lineStart = nextLineStart;
+    ++ line;
+  }
+  return line;
+}
+
+qint64 MappedTextFile::Find(const QByteArray& pattern, qint64 startOffset, bool forwards, bool matchCase) const {
+  const int patternSize = pattern.size();
+  if (patternSize == 0 || patternSize > mSize) {
+    return -1;
+  }
+  
+  auto toLower = [](char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+  };
+  QByteArray searchPattern = pattern;
+  if (!matchCase) {
+    for (int i = 0; i < patternSize; ++ i) {
+      searchPattern[i] = toLower(searchPattern[i]);
+    }
+  }
+  const char* patternData = searchPattern.constData();
+  
+  auto matchesAt = [&](qint64 pos) {
+    if (matchCase) {
+      return memcmp(data + pos, patternData, patternSize) == 0;
+    }
+    for (int i = 0; i < patternSize; ++ i) {
+      if (toLower(data[pos + i]) != patternData[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+  
+  const qint64 lastPos = mSize - patternSize;
+  if (forwards) {
+    qint64 pos = std::max<qint64>(0, startOffset);
+    while (pos <= lastPos) {
+      if (matchCase) {
+        // Jump to the next occurrence of the first pattern byte.
+        const char* candidate = static_cast<const char*>(memchr(data + pos, patternData[0], lastPos - pos + 1));
+        if (!candidate) {
+          return -1;
+        }
+        pos = candidate - data;
+      }
+      if (matchesAt(pos)) {
+        return pos;
+      }
+      ++ pos;
+    }
+  } else {
+    for (qint64 pos = std::min(startOffset, lastPos); pos >= 0; -- pos) {
+      if (matchesAt(pos)) {
+        return pos;
+      }
+    }
+  }
+  return -1;
+}
+
+void MappedTextFile::IndexThreadMain() {
+  std::vector<qint64> newLineStarts;
+  int lineCount = 1;
+  qint64 offset = 0;
+  qint64 lastPublishOffset = 0;
+  
+  auto publish = [&](bool complete) {
+    std::unique_lock<std::mutex> lock(indexMutex);
+    sparseLineStarts.insert(sparseLineStarts.end(), newLineStarts.begin(), newLineStarts.end());
+    indexedLineCount = lineCount;
+    indexComplete = complete;
+    lock.unlock();
+    newLineStarts.clear();
+    lastPublishOffset = offset;
+  };
+  
+  while (!mExit) {
+    qint64 nextLineStart = NextLineStart(offset);
+    if (nextLineStart < 0) {
+      break;
+    }
+    offset = nextLineStart;
+    if (lineCount % kLineIndexStride == 0) {
+      newLineStarts.push_back(offset);
+    }
+    ++ lineCount;
+    
+    if (offset - lastPublishOffset >= kIndexPublishInterval) {
+      publish(false);
+    }
+  }
+  
+  publish(!mExit);
+}
+
+qint64 MappedTextFile::NextLineStart(qint64 offset) const {
+  if (offset >= mSize) {
+    return -1;
+  }
+  const char* newline = static_cast<const char*>(memchr(data + offset, '\n', mSize - offset));
+  return newline ? (newline - data + 1) : -1;
+}
+
+
+MappedFileView::MappedFileView(const std::shared_ptr<MappedTextFile>& file, QWidget* parent)
+    : QAbstractScrollArea(parent),
+      file(file) {
+  QFontMetrics fontMetrics(Settings::Instance().GetDefaultFont());
+  lineHeight = fontMetrics.height();
+  charWidth = fontMetrics.width(' ');
+  
+  verticalScrollBar()->setSingleStep(1);
+  horizontalScrollBar()->setSingleStep(charWidth);
+  
+  connect(&indexProgressTimer, &QTimer::timeout, this, &MappedFileView::UpdateScrollBars);
+  indexProgressTimer.start(100);
+  UpdateScrollBars();
+}
+
+void MappedFileView::SetCurrentLine(int line) {
+  currentLine = line;
+  
+  // Scroll such that the line is in the upper part of the view.
+  int visibleLines = std::max(1, viewport()->height() / lineHeight);
+  if (line < GetFirstVisibleLine() || line >= GetFirstVisibleLine() + visibleLines) {
+    verticalScrollBar()->setValue(std::max(0, line - visibleLines / 3));
+  }
+  horizontalScrollBar()->setValue(0);
+  viewport()->update();
+}
+
+int MappedFileView::GetFirstVisibleLine() const {
+  return verticalScrollBar()->value();
+}
+
+void MappedFileView::paintEvent(QPaintEvent* event) {
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
+  
+  QPainter painter(viewport());
+  painter.fillRect(event->rect(), QColor(styles->GetColor(Settings::Color::EditorBackground)));
+  painter.setFont(Settings::Instance().GetDefaultFont());
+  painter.setPen(styles->GetTextStyle(Settings::TextStyle::Default).textColor);
+  
+  QFontMetrics fontMetrics(Settings::Instance().GetDefaultFont());
+  int lineCount = file->GetIndexedLineCount();
+  int xScroll = horizontalScrollBar()->value();
+  int maxLineWidth = 0;
+  int y = 0;
+  for (int line = GetFirstVisibleLine(); line < lineCount && y < viewport()->height(); ++ line, y += lineHeight) {
+    if (line == currentLine) {
+      painter.fillRect(0, y, viewport()->width(), lineHeight, QColor(styles->GetColor(Settings::Color::CurrentLine)));
+    }
+    
+    QString text = file->GetLineText(line, kMaxDisplayedLineBytes);
+    text.replace('\t', QStringLiteral("    "));
+    painter.drawText(-xScroll, y + fontMetrics.ascent(), text);
+    maxLineWidth = std::max(maxLineWidth, fontMetrics.width(text));
+  }
+  
+  // The line widths are only known for the lines that have been displayed, so
+  // the horizontal scroll range only grows while scrolling through the file.
+  int horizontalMaximum = std::max(0, maxLineWidth - viewport()->width() + charWidth);
+  if (horizontalMaximum > horizontalScrollBar()->maximum()) {
+    horizontalScrollBar()->setRange(0, horizontalMaximum);
+    horizontalScrollBar()->setPageStep(viewport()->width());
+  }
+}
+
+void MappedFileView::resizeEvent(QResizeEvent* event) {
+  QAbstractScrollArea::resizeEvent(event);
+  UpdateScrollBars();
+}
+
+void MappedFileView::mousePressEvent(QMouseEvent* event) {
+  int line = GetFirstVisibleLine() + event->pos().y() / lineHeight;
+  if (line < file->GetIndexedLineCount()) {
+    currentLine = line;
+    viewport()->update();
+  }
+}
+
+void MappedFileView::UpdateScrollBars() {
+  bool complete;
+  int lineCount = file->GetIndexedLineCount(&complete);
+  int visibleLines = std::max(1, viewport()->height() / lineHeight);
+  
+  int oldMaximum = verticalScrollBar()->maximum();
+  verticalScrollBar()->setRange(0, std::max(0, lineCount - visibleLines));
+  verticalScrollBar()->setPageStep(visibleLines);
+  if (verticalScrollBar()->maximum() != oldMaximum) {
+    viewport()->update();
+  }
+  
+  if (complete) {
+    indexProgressTimer.stop();
+  }
+}
+
+
+MappedFileViewer* MappedFileViewer::Open(const QString& path, QWidget* parent) {
+  std::shared_ptr<MappedTextFile> file(new MappedTextFile());
+  if (!file->Open(path)) {
+    QMessageBox::warning(parent, tr("Error"), tr("Cannot open file: %1").arg(path));
+    return nullptr;
+  }
+  
+  MappedFileViewer* viewer = new MappedFileViewer(file, path, parent);
+  viewer->show();
+  return viewer;
+}
+
+void MappedFileViewer::FindNext() {
+  Find(true);
+}
+
+void MappedFileViewer::FindPrevious() {
+  Find(false);
+}
+
+MappedFileViewer::MappedFileViewer(const std::shared_ptr<MappedTextFile>& file, const QString& path, QWidget* parent)
+    : QWidget(parent, Qt::Window),
+      file(file) {
+  setAttribute(Qt::WA_DeleteOnClose);
+  setWindowTitle(tr("%1 (read-only)").arg(QFileInfo(path).fileName()));
+  
+  view = new MappedFileView(file);
+  
+  searchEdit = new QLineEdit();
+  searchEdit->setPlaceholderText(tr("Find"));
+  QCheckBox* matchCaseCheck = new QCheckBox(tr("Match case"));
+  QPushButton* previousButton = new QPushButton(tr("Previous"));
+  QPushButton* nextButton = new QPushButton(tr("Next"));
+  statusLabel = new QLabel();
+  
+  connect(searchEdit, &QLineEdit::returnPressed, this, &MappedFileViewer::FindNext);
+  connect(searchEdit, &QLineEdit::textChanged, [this]() {
+    lastMatchOffset = -1;
+  });
+  connect(matchCaseCheck, &QCheckBox::stateChanged, [this, matchCaseCheck]() {
+    matchCase = matchCaseCheck->isChecked();
+    lastMatchOffset = -1;
+  });
+  connect(previousButton, &QPushButton::clicked, this, &MappedFileViewer::FindPrevious);
+  connect(nextButton, &QPushButton::clicked, this, &MappedFileViewer::FindNext);
+  
+  QHBoxLayout* searchLayout = new QHBoxLayout();
+  searchLayout->addWidget(searchEdit, 1);
+  searchLayout->addWidget(matchCaseCheck);
+  searchLayout->addWidget(previousButton);
+  searchLayout->addWidget(nextButton);
+  searchLayout->addWidget(statusLabel);
+  
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->setContentsMargins(0, 0, 0, 0);
+  layout->addLayout(searchLayout);
+  layout->addWidget(view, 1);
+  setLayout(layout);
+  
+  resize(1024, 768);
+}
+
+void MappedFileViewer::Find(bool forwards) {
+  QByteArray pattern = searchEdit->text().toUtf8();
+  if (pattern.isEmpty()) {
+    return;
+  }
+  
+  // Continue from the last match, or start at the current (or first visible)
+  // line.
+  qint64 startOffset;
+  if (lastMatchOffset >= 0) {
+    startOffset = forwards ? (lastMatchOffset + 1) : (lastMatchOffset - 1);
+  } else {
+    int startLine = (view->GetCurrentLine() >= 0) ? view->GetCurrentLine() : view->GetFirstVisibleLine();
+    startOffset = std::max<qint64>(0, file->LineStart(startLine));
+  }
+  
+  qint64 matchOffset = file->Find(pattern, startOffset, forwards, matchCase);
+  if (matchOffset < 0) {
+    statusLabel->setText(tr("Not found"));
+    return;
+  }
+  
+  lastMatchOffset = matchOffset;
+  int line = file->LineForOffset(matchOffset);
+  view->SetCurrentLine(line);
+  statusLabel->setText(tr("Line %1").arg(line + 1));
+}
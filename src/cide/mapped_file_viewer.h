@@ -0,0 +1,156 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QAbstractScrollArea>
+#include <QFile>
+#include <QString>
+#include <QTimer>
+#include <QWidget>
+
+class QLabel;
+class QLineEdit;
+
+/// Read-only access to the lines of a (possibly huge) UTF-8 text file that is
+/// memory-mapped instead of being read into a Document. This is used to view
+/// files such as large logs, for which a Document would need about twice the
+/// file size in memory (for the UTF-16 text) and a long time for reading it.
+///
+/// The line starts are indexed in a background thread. Only every
+/// kLineIndexStride-th line start is stored; the starts of the lines in
+/// between are found by scanning the mapped bytes on demand. Lines can be
+/// accessed as soon as they have been indexed.
+class MappedTextFile {
+ public:
+  /// Only the start of every kLineIndexStride-th line is stored in the index.
+  static constexpr int kLineIndexStride = 256;
+  
+  /// Stops the index thread and unmaps the file.
+  ~MappedTextFile();
+  
+  /// Maps the file at the given path and starts indexing it. Returns false if
+  /// the file cannot be opened or mapped.
+  bool Open(const QString& path);
+  
+  /// Returns the size of the file in bytes.
+  inline qint64 size() const { return mSize; }
+  
+  /// Returns the number of lines that have been indexed so far. If
+  /// @p complete is given, it is set to whether the whole file is indexed.
+  int GetIndexedLineCount(bool* complete = nullptr) const;
+  
+  /// Returns the byte offset of the start of the given line, or -1 if the
+  /// line has not been indexed yet.
+  qint64 LineStart(int line) const;
+  
+  /// Returns the text of the given line (without its line ending), decoded
+  /// from UTF-8. At most @p maxBytes bytes of the line are decoded. Returns
+  /// an empty string if the line has not been indexed yet.
+  QString GetLineText(int line, int maxBytes) const;
+  
+  /// Returns the index of the line that contains the given byte offset.
+  int LineForOffset(qint64 offset) const;
+  
+  /// Searches for @p pattern (in UTF-8) in the mapped bytes, starting at
+  /// @p startOffset, and returns the byte offset of the first occurrence
+  /// found, or -1 if there is none. If @p matchCase is false, ASCII letters
+  /// are compared case-insensitively.
+  qint64 Find(const QByteArray& pattern, qint64 startOffset, bool forwards, bool matchCase) const;
+  
+ private:
+  void IndexThreadMain();
+  
+  /// Returns the offset of the start of the line following the line that
+  /// contains @p offset, or -1 if that is the last line.
+  qint64 NextLineStart(qint64 offset) const;
+  
+  
+  QFile file;
+  const char* data = nullptr;
+  qint64 mSize = 0;
+  
+  /// Protects the index attributes below.
+  mutable std::mutex indexMutex;
+  
+  /// The start offsets of the lines 0, kLineIndexStride, 2 * kLineIndexStride, ...
+  std::vector<qint64> sparseLineStarts;
+  int indexedLineCount = 0;
+  bool indexComplete = false;
+  
+  std::atomic<bool> mExit{false};
+  std::shared_ptr<std::thread> indexThread;
+};
+
+
+/// Displays the lines of a MappedTextFile. Only the visible lines are decoded
+/// for painting.
+class MappedFileView : public QAbstractScrollArea {
+ Q_OBJECT
+ public:
+  MappedFileView(const std::shared_ptr<MappedTextFile>& file, QWidget* parent = nullptr);
+  
+  /// Scrolls to the given line and marks it as the current line.
+  void SetCurrentLine(int line);
+  inline int GetCurrentLine() const { return currentLine; }
+  
+  /// Returns the first line that is (at least partially) visible.
+  int GetFirstVisibleLine() const;
+  
+ protected:
+  void paintEvent(QPaintEvent* event) override;
+  void resizeEvent(QResizeEvent* event) override;
+  void mousePressEvent(QMouseEvent* event) override;
+  
+ private slots:
+  /// Updates the scroll bar ranges while the file is being indexed.
+  void UpdateScrollBars();
+  
+ private:
+  std::shared_ptr<MappedTextFile> file;
+  
+  int lineHeight;
+  int charWidth;
+  int currentLine = -1;
+  
+  /// Polls the indexing progress until the whole file is indexed.
+  QTimer indexProgressTimer;
+};
+
+
+/// A window that shows a memory-mapped file in a MappedFileView, with a search
+/// field for finding text within the file.
+class MappedFileViewer : public QWidget {
+ Q_OBJECT
+ public:
+  /// Opens the given file in a new viewer window. Returns nullptr (after
+  /// showing an error message) if the file cannot be mapped.
+  static MappedFileViewer* Open(const QString& path, QWidget* parent);
+  
+ private slots:
+  void FindNext();
+  void FindPrevious();
+  
+ private:
+  MappedFileViewer(const std::shared_ptr<MappedTextFile>& file, const QString& path, QWidget* parent);
+  
+  void Find(bool forwards);
+  
+  
+  std::shared_ptr<MappedTextFile> file;
+  
+  /// Byte offset of the last match, or -1 if there is none.
+  qint64 lastMatchOffset = -1;
+  bool matchCase = false;
+  
+  MappedFileView* view;
+  QLineEdit* searchEdit;
+  QLabel* statusLabel;
+};
@@ -0,0 +1,76 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/memory_report.h"
+
+#include <QObject>
+
+#include "cide/clang_parser.h"
+#include "cide/clang_tu_pool.h"
+#include "cide/document.h"
+#include "cide/main_window.h"
+
+static QString FormatMiB(std::size_t bytes) {
+  return QString::number(bytes / (1024. * 1024.), 'f', 2);
+}
+
+static QString FormatTUMemoryUsage(const TUMemoryUsage& usage) {
+  return QObject::tr("AST %1, preamble %2, sources %3, preprocessor %4, completion %5, other %6 (total %7)")
+      .arg(FormatMiB(usage.AST))
+      .arg(FormatMiB(usage.preamble))
+      .arg(FormatMiB(usage.sourceManager))
+      .arg(FormatMiB(usage.preprocessor))
+      .arg(FormatMiB(usage.completion))
+      .arg(FormatMiB(usage.other))
+      .arg(FormatMiB(usage.Total()));
+}
+
+QString CreateMemoryReport(MainWindow* mainWindow) {
+  QString report = QObject::tr("Memory report (approximate, in MiB)\n\n");
+  
+  // Open documents and their TUs
+  std::size_t documentsTotal = 0;
+  report += QObject::tr("Open documents:\n");
+  for (int i = 0; i < mainWindow->GetNumDocuments(); ++ i) {
+    std::shared_ptr<Document> document = mainWindow->GetDocument(i);
+    DocumentMemoryUsage documentUsage = document->EstimateMemoryUsage();
+    documentsTotal += documentUsage.Total();
+    
+    report += QStringLiteral("  %1\n").arg(document->path().isEmpty() ? document->fileName() : document->path());
+    report += QObject::tr("    Document: text %1, highlights %2, undo history %3, other %4 (total %5)\n")
+        .arg(FormatMiB(documentUsage.text))
+        .arg(FormatMiB(documentUsage.highlights))
+        .arg(FormatMiB(documentUsage.undoHistory))
+        .arg(FormatMiB(documentUsage.other))
+        .arg(FormatMiB(documentUsage.Total()));
+    
+    if (ClangTUPool* TUPool = document->GetTUPoolIfAllocated()) {
+      int numParsedTUs;
+      TUMemoryUsage TUUsage = TUPool->GetMemoryUsage(&numParsedTUs);
+      report += QObject::tr("    Parsed TUs (%1): %2\n").arg(numParsedTUs).arg(FormatTUMemoryUsage(TUUsage));
+    }
+  }
+  
+  // Totals
+  TUMemoryUsage TUTotal = ClangTUPoolManager::Instance().GetTotalMemoryUsage();
+  std::size_t TUBudget = ClangTUPoolManager::Instance().GetMemoryBudget();
+  
+  USRStorage::Instance().Lock();
+  USRStorageMemoryUsage indexUsage = USRStorage::Instance().EstimateMemoryUsage();
+  USRStorage::Instance().Unlock();
+  
+  report += QObject::tr("\nTotals:\n");
+  report += QObject::tr("  Documents: %1\n").arg(FormatMiB(documentsTotal));
+  report += QObject::tr("  Parsed TUs: %1\n").arg(FormatTUMemoryUsage(TUTotal));
+  report += QObject::tr("  TU memory budget: %1\n").arg((TUBudget == 0) ? QObject::tr("no limit") : FormatMiB(TUBudget));
+  report += QObject::tr("  Index: USR maps %1, indexes %2, global symbols %3, interned strings %4 (total %5)\n")
+      .arg(FormatMiB(indexUsage.USRMaps))
+      .arg(FormatMiB(indexUsage.indexes))
+      .arg(FormatMiB(indexUsage.globalSymbols))
+      .arg(FormatMiB(indexUsage.internedStrings))
+      .arg(FormatMiB(indexUsage.Total()));
+  report += QObject::tr("\nNote: TUs that are in use by a parse or code info operation at the moment are not counted.\n");
+  
+  return report;
+}
@@ -0,0 +1,14 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QString>
+
+class MainWindow;
+
+/// Creates a plain-text report of the (approximate) memory used by the open
+/// documents, their parsed libclang TUs, and the USR index. Must be called
+/// from the Qt thread.
+QString CreateMemoryReport(MainWindow* mainWindow);
@@ -4,21 +4,43 @@
 
 #include "cide/parse_thread_pool.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
 #include "cide/clang_parser.h"
+#include "cide/cpu_budget.h"
+#include "cide/diagnostics_sweep.h"
 #include "cide/document.h"
 #include "cide/document_widget.h"
 #include "cide/main_window.h"
+#include "cide/performance_counters.h"
+#include "cide/performance_profile.h"
 #include "cide/qt_thread.h"
+#include "cide/settings.h"
+#include "cide/util.h"
 
 ParseThreadPool::ParseThreadPool() {
   mExit = false;
   numFinishedIndexingRequests = 0;
   
-  constexpr int kThreadCount = 8;  // TODO: Make configurable
-  mThreads.resize(kThreadCount);
-  for (int i = 0; i < kThreadCount; ++ i) {
-    mThreads[i].reset(new std::thread(&ParseThreadPool::ThreadMain, this));
+  // Number of threads that are reserved for parsing open documents.
+  mInteractiveThreadCount = 1;
+  
+  // Determine the total number of threads. If it is not configured, use one
+  // thread per (logical) CPU core, limited by the performance profile.
+  int threadCount = Settings::Instance().GetParseThreadCount();
+  if (threadCount <= 0) {
+    threadCount = std::thread::hardware_concurrency();
+    if (threadCount <= 0) {
+      threadCount = 4;  // the number of cores is unknown
+    }
+    int maxThreadCount = GetPerformanceProfileParameters().maxParseThreadCount;
+    if (maxThreadCount > 0) {
+      threadCount = std::min(threadCount, maxThreadCount);
+    }
   }
+  mThreadCount = std::max(mInteractiveThreadCount + 1, threadCount);
 }
 
 ParseThreadPool::~ParseThreadPool() {
@@ -32,11 +54,9 @@ ParseThreadPool& ParseThreadPool::Instance() {
 
 void ParseThreadPool::RequestParse(const std::shared_ptr<Document>& document, DocumentWidget* widget, MainWindow* mainWindow) {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
-  for (const ParseRequest& request : parseRequests) {
-    if (request.document.get() == document.get()) {
-      // There is already a queued parse request for this document.
-      return;
-    }
+  if (requestsByDocument.count(document.get()) > 0) {
+    // There is already a queued parse request for this document.
+    return;
   }
   
   ParseRequest newRequest;
@@ -46,168 +66,398 @@ void ParseThreadPool::RequestParse(const std::shared_ptr<Document>& document, Do
   newRequest.mainWindow = mainWindow;
   newRequest.widget = widget;
   newRequest.isIndexingRequest = false;
-  parseRequests.push_back(newRequest);
+  EnqueueRequest(newRequest);
   lock.unlock();
-  newParseRequestCondition.notify_one();
+  NotifyThreads();
 }
 
 void ParseThreadPool::RequestParseIfOpenElseIndex(const QString& canonicalPath, MainWindow* mainWindow) {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
+  EnqueueRequest(CreateIndexingRequest(canonicalPath, mainWindow));
+  lock.unlock();
+  NotifyThreads();
+}
+
+int ParseThreadPool::RequestReindex(const std::vector<QString>& canonicalPaths, int numPrioritized, MainWindow* mainWindow) {
+  std::unique_lock<std::mutex> lock(parseRequestMutex);
   
-  ParseRequest newRequest;
-  newRequest.mode = ParseRequest::Mode::ParseIfOpenElseIndex;
-  newRequest.canonicalPath = canonicalPath;
-  newRequest.document = nullptr;
-  newRequest.widget = nullptr;
-  if (mainWindow) {
-    for (int i = 0; i < mainWindow->GetNumDocuments(); ++ i) {
-      if (mainWindow->GetDocument(i)->path() == canonicalPath) {
-        newRequest.document = mainWindow->GetDocument(i);
-        newRequest.widget = mainWindow->GetWidgetForDocument(newRequest.document.get());
-      }
+  int numRequestsCreated = 0;
+  for (int i = numPrioritized; i < canonicalPaths.size(); ++ i) {
+    if (requestsByPath.count(canonicalPaths[i]) == 0) {
+      EnqueueRequest(CreateIndexingRequest(canonicalPaths[i], mainWindow));
+      ++ numRequestsCreated;
+    }
+  }
+  // Insert the prioritized requests at the front in reverse order, such that
+  // they end up in the given order.
+  for (int i = std::min<int>(numPrioritized, canonicalPaths.size()) - 1; i >= 0; -- i) {
+    if (requestsByPath.count(canonicalPaths[i]) == 0) {
+      EnqueueRequest(CreateIndexingRequest(canonicalPaths[i], mainWindow), /*atFront*/ true);
+      ++ numRequestsCreated;
     }
   }
-  newRequest.mainWindow = mainWindow;
-  newRequest.isIndexingRequest = true;
   
-  parseRequests.push_back(newRequest);
   lock.unlock();
-  newParseRequestCondition.notify_one();
+  if (numRequestsCreated > 0) {
+    NotifyThreads();
+  }
+  return numRequestsCreated;
 }
 
-void ParseThreadPool::SetOpenAndCurrentDocuments(const QString& currentDocument, const QStringList& openDocuments) {
+void ParseThreadPool::RequestDiagnosticsChecks(const std::vector<QString>& canonicalPaths, int generation, MainWindow* mainWindow) {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
-  currentDocumentPath = currentDocument;
-  openDocumentPaths = openDocuments;
+  for (const QString& canonicalPath : canonicalPaths) {
+    ParseRequest newRequest;
+    newRequest.mode = ParseRequest::Mode::CheckDiagnostics;
+    newRequest.canonicalPath = canonicalPath;
+    newRequest.document = nullptr;
+    newRequest.widget = nullptr;
+    newRequest.mainWindow = mainWindow;
+    newRequest.isIndexingRequest = false;
+    newRequest.diagnosticsSweepGeneration = generation;
+    EnqueueRequest(newRequest);
+  }
+  lock.unlock();
+  if (!canonicalPaths.empty()) {
+    NotifyThreads();
+  }
 }
 
-bool ParseThreadPool::DoesAParseRequestExistForDocument(const Document* document) {
+void ParseThreadPool::CancelDiagnosticsChecks() {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
-  for (const ParseRequest& request : parseRequests) {
-    if (request.document.get() == document) {
-      return true;
+  std::list<ParseRequest>& queue = parseRequests[static_cast<int>(Priority::None)];
+  for (auto it = queue.begin(); it != queue.end(); ) {
+    auto nextIt = std::next(it);
+    if (it->mode == ParseRequest::Mode::CheckDiagnostics) {
+      RemoveRequest(RequestLocation(Priority::None, it));
     }
+    it = nextIt;
   }
-  return false;
 }
 
-bool ParseThreadPool::IsDocumentBeingParsed(const Document* document) {
+void ParseThreadPool::SetOpenAndCurrentDocuments(const QString& currentDocument, const QStringList& openDocuments) {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
-  for (const std::shared_ptr<Document>& otherDocument : documentsBeingParsed) {
-    if (otherDocument.get() == document) {
-      return true;
+  
+  // Determine the paths whose priority may change
+  std::unordered_set<QString> changedPaths;
+  changedPaths.insert(currentDocumentPath);
+  changedPaths.insert(currentDocument);
+  std::unordered_set<QString> newOpenDocumentPaths;
+  newOpenDocumentPaths.reserve(openDocuments.size());
+  for (const QString& path : openDocuments) {
+    newOpenDocumentPaths.insert(path);
+    if (openDocumentPaths.count(path) == 0) {
+      changedPaths.insert(path);
     }
   }
-  return false;
+  for (const QString& path : openDocumentPaths) {
+    if (newOpenDocumentPaths.count(path) == 0) {
+      changedPaths.insert(path);
+    }
+  }
+  
+  currentDocumentPath = currentDocument;
+  openDocumentPaths.swap(newOpenDocumentPaths);
+  
+  // Update the recently current documents
+  if (!currentDocument.isEmpty()) {
+    recentDocumentPaths.erase(std::remove(recentDocumentPaths.begin(), recentDocumentPaths.end(), currentDocument), recentDocumentPaths.end());
+    recentDocumentPaths.push_front(currentDocument);
+  }
+  recentDocumentPaths.erase(std::remove_if(recentDocumentPaths.begin(), recentDocumentPaths.end(), [&](const QString& path) {
+    return openDocumentPaths.count(path) == 0;
+  }), recentDocumentPaths.end());
+  if (recentDocumentPaths.size() > kNumRecentDocumentsWithFullParse) {
+    recentDocumentPaths.resize(kNumRecentDocumentsWithFullParse);
+  }
+  
+  // Re-prioritize the queued requests for these paths
+  for (const QString& path : changedPaths) {
+    UpdatePriorities(path);
+  }
+  
+  lock.unlock();
+  NotifyThreads();
+}
+
+bool ParseThreadPool::UseFullParseProfileFor(const QString& canonicalPath) {
+  std::unique_lock<std::mutex> lock(parseRequestMutex);
+  return std::find(recentDocumentPaths.begin(), recentDocumentPaths.end(), canonicalPath) != recentDocumentPaths.end();
+}
+
+bool ParseThreadPool::DoesAParseRequestExistForDocument(const Document* document) {
+  std::unique_lock<std::mutex> lock(parseRequestMutex);
+  return requestsByDocument.count(document) > 0;
+}
+
+bool ParseThreadPool::IsDocumentBeingParsed(const Document* document) {
+  std::unique_lock<std::mutex> lock(parseRequestMutex);
+  return documentsBeingParsed.count(document) > 0;
 }
 
 void ParseThreadPool::WidgetRemoved(DocumentWidget* widget) {
   std::unique_lock<std::mutex> lock(parseRequestMutex);
   
-  for (auto it = parseRequests.begin(); it != parseRequests.end(); ) {
-    if (it->widget == widget) {
-      it = parseRequests.erase(it);
-    } else {
-      ++ it;
-    }
-  }
+  const Document* document = widget->GetDocument().get();
   
-  for (auto it = documentsBeingParsed.begin(); it != documentsBeingParsed.end(); ) {
-    if ((*it).get() == widget->GetDocument().get()) {
-      it = documentsBeingParsed.erase(it);
-    } else {
-      ++ it;
+  std::vector<RequestLocation> requestsToRemove;
+  auto range = requestsByDocument.equal_range(document);
+  for (auto it = range.first; it != range.second; ++ it) {
+    if (it->second.it->widget == widget) {
+      requestsToRemove.push_back(it->second);
     }
   }
+  for (const RequestLocation& location : requestsToRemove) {
+    RemoveRequest(location);
+  }
+  
+  documentsBeingParsed.erase(document);
+}
+
+void ParseThreadPool::GetNumQueuedRequests(int* numForClosedFiles, int* numForOpenDocuments, int* numForCurrentDocument) {
+  std::unique_lock<std::mutex> lock(parseRequestMutex);
+  *numForClosedFiles = parseRequests[static_cast<int>(Priority::None)].size();
+  *numForOpenDocuments = parseRequests[static_cast<int>(Priority::Open)].size();
+  *numForCurrentDocument = parseRequests[static_cast<int>(Priority::Current)].size();
 }
 
 void ParseThreadPool::ExitAllThreads() {
+  std::unique_lock<std::mutex> lock(threadsMutex);
   mExit = true;
   newParseRequestCondition.notify_all();
+  newInteractiveParseRequestCondition.notify_all();
   for (int i = 0; i < mThreads.size(); ++ i) {
     mThreads[i]->join();
   }
   mThreads.clear();
+  
+  headerPrefetcher.Exit();
 }
 
-int ParseThreadPool::FindRequestToParse() {
-  // Priorities:
-  // 0 - no special prioritization
-  // 1 - document is open
-  // 2 - document is current
-  int bestPriority = -1;
-  constexpr int bestPossiblePriority = 2;
-  int bestIndex = -1;
+void ParseThreadPool::StartThreadsIfNecessary() {
+  std::unique_lock<std::mutex> lock(threadsMutex);
+  if (mExit || !mThreads.empty()) {
+    return;
+  }
   
-  // Iterate over all pending parse requests
-  for (std::size_t i = 0; i < parseRequests.size(); ++ i) {
-    const ParseRequest& candidateRequest = parseRequests[i];
-    
-    // If the document is being parsed, do not start parsing it again before the
-    // first parse exits.
-    bool isBeingParsed = false;
-    for (const std::shared_ptr<Document>& document : documentsBeingParsed) {
-      if (document.get() == candidateRequest.document.get()) {
-        isBeingParsed = true;
+  mThreads.resize(mThreadCount);
+  for (int i = 0; i < mThreadCount; ++ i) {
+    mThreads[i].reset(new std::thread(&ParseThreadPool::ThreadMain, this, i < mInteractiveThreadCount));
+  }
+}
+
+void ParseThreadPool::NotifyThreads() {
+  StartThreadsIfNecessary();
+  newInteractiveParseRequestCondition.notify_one();
+  newParseRequestCondition.notify_one();
+}
+
+ParseThreadPool::Priority ParseThreadPool::GetPriority(const ParseRequest& request) const {
+  if (request.mode == ParseRequest::Mode::CheckDiagnostics) {
+    return Priority::None;
+  } else if (request.canonicalPath == currentDocumentPath) {
+    return Priority::Current;
+  } else if (request.document ||
+             openDocumentPaths.count(request.canonicalPath) > 0) {
+    return Priority::Open;
+  }
+  return Priority::None;
+}
+
+ParseRequest ParseThreadPool::CreateIndexingRequest(const QString& canonicalPath, MainWindow* mainWindow) {
+  ParseRequest newRequest;
+  newRequest.mode = ParseRequest::Mode::ParseIfOpenElseIndex;
+  newRequest.canonicalPath = canonicalPath;
+  newRequest.document = nullptr;
+  newRequest.widget = nullptr;
+  std::shared_ptr<Document> document = mainWindow ? mainWindow->GetDocumentForPath(canonicalPath) : nullptr;
+  if (document) {
+    DocumentWidget* widget = mainWindow->GetWidgetForDocument(document.get());
+    // If the document has not been activated since it was restored, and
+    // equals the file on disk, index the file (which can use the persistent
+    // index) instead of parsing the document.
+    if (!widget || !widget->IsParseDeferred() || document->HasUnsavedChanges()) {
+      newRequest.document = document;
+      newRequest.widget = widget;
+    }
+  }
+  newRequest.mainWindow = mainWindow;
+  newRequest.isIndexingRequest = true;
+  return newRequest;
+}
+
+void ParseThreadPool::EnqueueRequest(const ParseRequest& request, bool atFront) {
+  Priority priority = GetPriority(request);
+  std::list<ParseRequest>& queue = parseRequests[static_cast<int>(priority)];
+  std::list<ParseRequest>::iterator it;
+  if (atFront) {
+    queue.push_front(request);
+    it = queue.begin();
+  } else {
+    queue.push_back(request);
+    it = std::prev(queue.end());
+  }
+  
+  RequestLocation location(priority, it);
+  if (request.mode != ParseRequest::Mode::CheckDiagnostics) {
+    // Diagnostics checks are not looked up by path, such that they neither
+    // keep RequestReindex() from queuing the file nor get re-prioritized.
+    requestsByPath.insert(std::make_pair(request.canonicalPath, location));
+  }
+  if (request.document) {
+    requestsByDocument.insert(std::make_pair(request.document.get(), location));
+  }
+}
+
+void ParseThreadPool::RemoveRequest(const RequestLocation& location) {
+  const ParseRequest& request = *location.it;
+  
+  auto pathRange = requestsByPath.equal_range(request.canonicalPath);
+  for (auto it = pathRange.first; it != pathRange.second; ++ it) {
+    if (it->second.it == location.it) {
+      requestsByPath.erase(it);
+      break;
+    }
+  }
+  
+  if (request.document) {
+    auto documentRange = requestsByDocument.equal_range(request.document.get());
+    for (auto it = documentRange.first; it != documentRange.second; ++ it) {
+      if (it->second.it == location.it) {
+        requestsByDocument.erase(it);
         break;
       }
     }
-    if (isBeingParsed) {
+  }
+  
+  parseRequests[static_cast<int>(location.priority)].erase(location.it);
+}
+
+void ParseThreadPool::UpdatePriorities(const QString& canonicalPath) {
+  auto pathRange = requestsByPath.equal_range(canonicalPath);
+  for (auto it = pathRange.first; it != pathRange.second; ++ it) {
+    RequestLocation& location = it->second;
+    Priority newPriority = GetPriority(*location.it);
+    if (newPriority == location.priority) {
       continue;
     }
     
-    // Determine the priority
-    int priority = 0;
-    if (candidateRequest.canonicalPath == currentDocumentPath) {
-      priority = 2;
-    } else if (openDocumentPaths.contains(candidateRequest.canonicalPath)) {
-      priority = 1;
-    }
+    // Move the request to the back of the queue for its new priority. This
+    // keeps all iterators to it valid.
+    std::list<ParseRequest>& newQueue = parseRequests[static_cast<int>(newPriority)];
+    newQueue.splice(newQueue.end(), parseRequests[static_cast<int>(location.priority)], location.it);
     
-    // New best request?
-    if (priority > bestPriority) {
-      bestPriority = priority;
-      bestIndex = i;
-      if (bestPriority == bestPossiblePriority) {
-        // No further search necessary
-        break;
+    if (location.it->document) {
+      auto documentRange = requestsByDocument.equal_range(location.it->document.get());
+      for (auto docIt = documentRange.first; docIt != documentRange.second; ++ docIt) {
+        if (docIt->second.it == location.it) {
+          docIt->second.priority = newPriority;
+          break;
+        }
+      }
+    }
+    location.priority = newPriority;
+  }
+}
+
+bool ParseThreadPool::FindRequestToParse(bool openDocumentsOnly, RequestLocation* location) {
+  int lowestPriority = static_cast<int>(openDocumentsOnly ? Priority::Open : Priority::None);
+  for (int priority = static_cast<int>(Priority::NumPriorities) - 1; priority >= lowestPriority; -- priority) {
+    std::list<ParseRequest>& queue = parseRequests[priority];
+    for (auto it = queue.begin(); it != queue.end(); ++ it) {
+      // If the document is being parsed, do not start parsing it again before the
+      // first parse exits. Since there is at most one parse per document, only
+      // few requests can be skipped here.
+      if (it->document &&
+          documentsBeingParsed.count(it->document.get()) > 0) {
+        continue;
       }
+      
+      *location = RequestLocation(static_cast<Priority>(priority), it);
+      return true;
     }
   }
   
-  return bestIndex;
+  return false;
 }
 
-void ParseThreadPool::ThreadMain() {
+void ParseThreadPool::ThreadMain(bool isInteractiveThread) {
+  std::condition_variable& requestCondition =
+      isInteractiveThread ? newInteractiveParseRequestCondition : newParseRequestCondition;
+  
+  // The non-interactive threads mostly index files in the background, so they
+  // run with lowered OS priority for their whole lifetime. Open documents that
+  // overflow onto them are thus parsed with lower priority as well, which is
+  // acceptable since the interactive thread handles the current document.
+  if (!isInteractiveThread) {
+    LowerCurrentThreadPriority();
+  }
+  
   while (true) {
     std::unique_lock<std::mutex> lock(parseRequestMutex);
     if (mExit) {
       return;
     }
-    int parseRequestIndex;
-    while ((parseRequestIndex = FindRequestToParse()) == -1) {
-      newParseRequestCondition.wait(lock);
+    RequestLocation requestLocation;
+    while (!FindRequestToParse(isInteractiveThread, &requestLocation)) {
+      requestCondition.wait(lock);
       if (mExit) {
         return;
       }
     }
-    ParseRequest request = parseRequests[parseRequestIndex];
-    parseRequests.erase(parseRequests.begin() + parseRequestIndex);
+    ParseRequest request = *requestLocation.it;
+    Priority priority = requestLocation.priority;
+    RemoveRequest(requestLocation);
     if (request.document) {
-      documentsBeingParsed.push_back(request.document);
+      documentsBeingParsed[request.document.get()] = request.document;
+    }
+    
+    // While this request is parsed, let the files of the next background
+    // requests be read into the OS cache.
+    std::vector<QString> prefetchPaths;
+    if (priority == Priority::None && request.mainWindow) {
+      const std::list<ParseRequest>& queue = parseRequests[static_cast<int>(Priority::None)];
+      for (auto it = queue.begin(); it != queue.end() && prefetchPaths.size() < kHeaderPrefetchDistance; ++ it) {
+        if (!it->document) {
+          prefetchPaths.push_back(it->canonicalPath);
+        }
+      }
     }
     lock.unlock();
     
-    // Perform the parsing.
-    if (request.mode == ParseRequest::Mode::ParseIfOpen || /* TODO ) {
+    if (!prefetchPaths.empty()) {
+      headerPrefetcher.Prefetch(prefetchPaths, request.mainWindow);
+    }
+    
+    // Perform the parsing within the CPUBudget. Parsing the current document
+    // is interactive, while indexing closed files is background work.
+    std::chrono::steady_clock::time_point parseStartTime = std::chrono::steady_clock::now();
+    CPUBudgetScope budgetScope(
+        (priority == Priority::Current) ? CPUBudget::QoS::Interactive :
+            ((priority == Priority::Open) ? CPUBudget::QoS::Normal : CPUBudget::QoS::Background),
+        &mExit);
+    if (!budgetScope.acquired()) {
+      // Exiting.
+    } else if (request.mode == ParseRequest::Mode::ParseIfOpen || /* TODO ) {
       ParseFile(request.document ? request.document.get() : nullptr, request.mainWindow);
     } else if (*/ request.mode == ParseRequest::Mode::ParseIfOpenElseIndex) {
       ParseFileIfOpenElseIndex(request.canonicalPath, request.document ? request.document.get() : nullptr, request.mainWindow);
+    } else if (request.mode == ParseRequest::Mode::CheckDiagnostics) {
+      std::vector<SweepDiagnostic> diagnostics;
+      CheckFileDiagnostics(request.canonicalPath, request.mainWindow, &diagnostics);
+      request.mainWindow->GetDiagnosticsSweep()->AddFileResults(request.diagnosticsSweepGeneration, request.canonicalPath, std::move(diagnostics));
     } else {
       qDebug() << "Error: Parse request mode not handled:" << static_cast<int>(request.mode);
     }
     
+    if (budgetScope.acquired()) {
+      PerformanceCounters::Instance().RecordParse(
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseStartTime).count(),
+          /*isIndexing*/ !request.document);
+    }
+    
     if (request.document && request.widget) {
+      double parseDurationMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseStartTime).count();
       RunInQtThreadBlocking([&]() {
         // If the document has been closed in the meantime, we must not access its
         // widget anymore.
@@ -215,6 +465,9 @@ void ParseThreadPool::ThreadMain() {
           return;
         }
         
+        if (request.mode == ParseRequest::Mode::ParseIfOpen) {
+          request.widget->ReportParseDuration(parseDurationMs);
+        }
         request.widget->update(request.widget->rect());
       });
     }
@@ -226,17 +479,12 @@ void ParseThreadPool::ThreadMain() {
     
     if (request.document) {
       lock.lock();
-      for (std::size_t i = 0; i < documentsBeingParsed.size(); ++ i) {
-        if (documentsBeingParsed[i].get() == request.document.get()) {
-          documentsBeingParsed.erase(documentsBeingParsed.begin() + i);
-          break;
-        }
-      }
+      documentsBeingParsed.erase(request.document.get());
       lock.unlock();
       
       // Removing the current document from documentsBeingParsed may cause another
       // parse request to become un-blocked, so wake up another thread.
-      newParseRequestCondition.notify_one();
+      NotifyThreads();
     }
   }
 }
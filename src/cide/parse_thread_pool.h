@@ -6,13 +6,20 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <list>
 #include <memory>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <QObject>
 #include <QString>
 
+#include "cide/header_prefetcher.h"
+#include "cide/util.h"
+
 class Document;
 class DocumentWidget;
 class MainWindow;
@@ -27,7 +34,11 @@ struct ParseRequest {
     /// TODO: This is deprecated since, if we got a parse request (originating
     ///       from a change to a document), it always seems desirable to update
     ///       the document's indexing information, even if it has been closed.
-    ParseIfOpen
+    ParseIfOpen,
+    
+    /// Parse the file from disk and report its diagnostics to the
+    /// DiagnosticsSweep. The file is not indexed.
+    CheckDiagnostics
   };
   
   Mode mode;
@@ -36,21 +47,55 @@ struct ParseRequest {
   DocumentWidget* widget;
   MainWindow* mainWindow;
   bool isIndexingRequest;
+  
+  /// For CheckDiagnostics requests: the generation of the DiagnosticsSweep
+  /// that created the request.
+  int diagnosticsSweepGeneration;
 };
 
 class ParseThreadPool : public QObject {
  Q_OBJECT
  public:
+  /// Number of recently current documents that are parsed with the full parse
+  /// options, see UseFullParseProfileFor().
+  static constexpr int kNumRecentDocumentsWithFullParse = 3;
+  
+  /// Number of queued background requests whose files are prefetched ahead of
+  /// parsing them (see HeaderPrefetcher).
+  static constexpr int kHeaderPrefetchDistance = 16;
+  
   static ParseThreadPool& Instance();
   
   void RequestParse(const std::shared_ptr<Document>& document, DocumentWidget* widget, MainWindow* mainWindow);
   
   void RequestParseIfOpenElseIndex(const QString& canonicalPath, MainWindow* mainWindow);
   
+  /// Requests to index (or parse, if open) the given files again, for example
+  /// after a header that they include changed. Files for which a request is
+  /// queued already are skipped. The first @p numPrioritized files are queued
+  /// in front of the other requests with the same priority, in the given order.
+  /// Returns the number of requests created.
+  int RequestReindex(const std::vector<QString>& canonicalPaths, int numPrioritized, MainWindow* mainWindow);
+  
+  /// Queues CheckDiagnostics requests for the given files behind all requests
+  /// for open documents. Unlike the other requests, these never block requests
+  /// for the same file from being queued.
+  void RequestDiagnosticsChecks(const std::vector<QString>& canonicalPaths, int generation, MainWindow* mainWindow);
+  
+  /// Removes all queued CheckDiagnostics requests.
+  void CancelDiagnosticsChecks();
+  
   /// Notifies the ParseThreadPool about the current and open documents, which
   /// it uses for prioritizing parse requests.
   void SetOpenAndCurrentDocuments(const QString& currentDocument, const QStringList& openDocuments);
   
+  /// Returns whether the open document with the given canonical path should be
+  /// parsed with the full parse options. This is the case for the
+  /// kNumRecentDocumentsWithFullParse documents that were current most
+  /// recently. Other (background) documents are parsed with reduced options
+  /// that need less memory, and are parsed again once they get activated.
+  bool UseFullParseProfileFor(const QString& canonicalPath);
+  
   bool DoesAParseRequestExistForDocument(const Document* document);
   
   bool IsDocumentBeingParsed(const Document* document);
@@ -63,6 +108,14 @@ class ParseThreadPool : public QObject {
   
   inline int GetNumFinishedIndexingRequests() const { return numFinishedIndexingRequests; }
   
+  /// Returns the number of queued requests for closed files, for open
+  /// documents, and for the current document.
+  void GetNumQueuedRequests(int* numForClosedFiles, int* numForOpenDocuments, int* numForCurrentDocument);
+  
+  /// Returns the total number of parse threads (including the ones reserved for
+  /// open documents). The threads are only started with the first request.
+  inline int GetThreadCount() const { return mThreadCount; }
+  
  signals:
   void IndexingRequestFinished();
   
@@ -70,23 +123,104 @@ class ParseThreadPool : public QObject {
   ParseThreadPool();
   ~ParseThreadPool();
   
-  int FindRequestToParse();
+  /// Priorities of parse requests. Requests with a higher priority are parsed
+  /// first. Requests with the same priority are parsed in FIFO order.
+  enum class Priority {
+    /// No special prioritization
+    None = 0,
+    
+    /// The document is open
+    Open,
+    
+    /// The document is the current one
+    Current,
+    
+    NumPriorities
+  };
+  
+  /// Identifies a queued request.
+  struct RequestLocation {
+    inline RequestLocation() = default;
+    inline RequestLocation(Priority priority, std::list<ParseRequest>::iterator it)
+        : priority(priority),
+          it(it) {}
+    
+    Priority priority;
+    std::list<ParseRequest>::iterator it;
+  };
+  
+  /// Determines the priority for the given request, given the current and
+  /// open documents.
+  Priority GetPriority(const ParseRequest& request) const;
+  
+  /// Creates a ParseIfOpenElseIndex request for the given file. Must be called
+  /// with parseRequestMutex locked.
+  ParseRequest CreateIndexingRequest(const QString& canonicalPath, MainWindow* mainWindow);
+  
+  /// Adds a request to the back (or, if @p atFront is true, to the front) of
+  /// the queue for its priority (and to the lookup maps).
+  void EnqueueRequest(const ParseRequest& request, bool atFront = false);
+  
+  /// Removes a request from the queue (and the lookup maps).
+  void RemoveRequest(const RequestLocation& location);
+  
+  /// Moves all queued requests for the given path to the queue corresponding
+  /// to their current priority.
+  void UpdatePriorities(const QString& canonicalPath);
+  
+  /// Determines the request that should be parsed next. Returns false if there
+  /// is none. If @p openDocumentsOnly is true, only requests for documents that
+  /// are open are considered.
+  bool FindRequestToParse(bool openDocumentsOnly, RequestLocation* location);
   
-  void ThreadMain();
+  /// Wakes up a thread of each lane to check for requests to parse.
+  void NotifyThreads();
+  
+  /// Starts the threads if they have not been started yet. This is deferred
+  /// until the first request to keep the program startup fast.
+  void StartThreadsIfNecessary();
+  
+  /// Main function of the parse threads. Threads with @p isInteractiveThread
+  /// set to true only parse documents that are open, such that bulk indexing
+  /// never delays the reparsing of the documents that are being edited.
+  void ThreadMain(bool isInteractiveThread);
   
   
   std::atomic<int> numFinishedIndexingRequests;
   
   // For request prioritization
   QString currentDocumentPath;
-  QStringList openDocumentPaths;
+  std::unordered_set<QString> openDocumentPaths;
+  
+  /// Paths of the open documents that were current most recently (the most
+  /// recent first), at most kNumRecentDocumentsWithFullParse.
+  std::deque<QString> recentDocumentPaths;
   
   std::atomic<bool> mExit;
   
   std::mutex parseRequestMutex;
   std::condition_variable newParseRequestCondition;
-  std::vector<ParseRequest> parseRequests;
-  std::vector<std::shared_ptr<Document>> documentsBeingParsed;
+  std::condition_variable newInteractiveParseRequestCondition;
+  
+  /// Queued requests, with one FIFO queue for each priority.
+  std::list<ParseRequest> parseRequests[static_cast<int>(Priority::NumPriorities)];
+  
+  /// Allows to look up queued requests by their canonicalPath.
+  std::unordered_multimap<QString, RequestLocation> requestsByPath;
+  
+  /// Allows to look up queued requests by their document (for requests which
+  /// have a document).
+  std::unordered_multimap<const Document*, RequestLocation> requestsByDocument;
+  
+  /// Documents that are being parsed, indexed by their raw pointer.
+  std::unordered_map<const Document*, std::shared_ptr<Document>> documentsBeingParsed;
+  
+  /// Prefetches the files of upcoming background requests.
+  HeaderPrefetcher headerPrefetcher;
   
+  /// Protects mThreads.
+  std::mutex threadsMutex;
   std::vector<std::shared_ptr<std::thread>> mThreads;
+  int mThreadCount;
+  int mInteractiveThreadCount;
 };
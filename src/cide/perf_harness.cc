@@ -0,0 +1,318 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <git2.h>
+#include <QApplication>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+
+#include "cide/background_reclaimer.h"
+#include "cide/code_info.h"
+#include "cide/crash_backup.h"
+#include "cide/document.h"
+#include "cide/document_widget.h"
+#include "cide/git_diff.h"
+#include "cide/git_status.h"
+#include "cide/indexing_statistics.h"
+#include "cide/main_window.h"
+#include "cide/parse_thread_pool.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/project.h"
+#include "cide/qt_help.h"
+#include "cide/qt_thread.h"
+#include "cide/tu_cache.h"
+
+// Headless performance harness for indexing, parsing and code info requests on
+// a real project. Run as:
+//   CIDEPerfHarness <project.cide> [script [repetitions]]
+// The harness loads the project (which configures it), indexes all of its
+// files, and then replays the requests of the script the given number of times
+// (default: 10), printing latency percentiles for each kind of request. The
+// script contains one request per line:
+//   complete <file> <line> <column>
+//   goto <file> <line> <column>
+// The paths are relative to the directory of the script (or absolute), and
+// line and column are 1-based. Empty lines and lines starting with '#' are
+// ignored. The program settings (e.g., the default compiler) of CIDE are used.
+
+/// Maximum time that the harness waits for a document to get parsed.
+constexpr double kParseTimeoutSeconds = 600;
+
+struct ScriptedRequest {
+  enum class Type {
+    CodeCompletion = 0,
+    GotoReferencedCursor
+  };
+  
+  Type type;
+  QString canonicalPath;
+  int line;  // 1-based
+  int column;  // 1-based
+};
+
+static double SecondsSince(std::chrono::steady_clock::time_point startTime) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+/// Prints the latency percentiles of the given measurements (in seconds).
+static void PrintLatencies(const char* name, std::vector<double> seconds) {
+  if (seconds.empty()) {
+    std::cout << name << ": no measurements" << std::endl;
+    return;
+  }
+  
+  std::sort(seconds.begin(), seconds.end());
+  auto percentile = [&](double p) {
+    int index = std::max(0, static_cast<int>(std::ceil(p * seconds.size())) - 1);
+    return 1000 * seconds[index];
+  };
+  double sum = 0;
+  for (double value : seconds) {
+    sum += value;
+  }
+  
+  std::cout << name << " [" << seconds.size() << " requests]: "
+            << "p50 " << percentile(0.5) << " ms, "
+            << "p90 " << percentile(0.9) << " ms, "
+            << "p99 " << percentile(0.99) << " ms, "
+            << "max " << (1000 * seconds.back()) << " ms, "
+            << "mean " << (1000 * sum / seconds.size()) << " ms" << std::endl;
+}
+
+static bool LoadScript(const QString& path, std::vector<ScriptedRequest>* requests) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    std::cout << "Cannot read the script file: " << path.toStdString() << std::endl;
+    return false;
+  }
+  QDir scriptDir = QFileInfo(path).dir();
+  
+  QTextStream stream(&file);
+  int lineNumber = 0;
+  while (!stream.atEnd()) {
+    QString line = stream.readLine().trimmed();
+    ++ lineNumber;
+    if (line.isEmpty() || line.startsWith('#')) {
+      continue;
+    }
+    
+    QStringList words = line.split(' ', QString::SkipEmptyParts);
+    ScriptedRequest request;
+    bool lineOk = false;
+    bool columnOk = false;
+    if (words.size() == 4) {
+      request.canonicalPath = QFileInfo(scriptDir.filePath(words[1])).canonicalFilePath();
+      request.line = words[2].toInt(&lineOk);
+      request.column = words[3].toInt(&columnOk);
+    }
+    if (!lineOk || !columnOk || request.canonicalPath.isEmpty() ||
+        (words[0] != "complete" && words[0] != "goto")) {
+      std::cout << "Invalid request in line " << lineNumber << " of the script (or the file does not exist): " << line.toStdString() << std::endl;
+      return false;
+    }
+    request.type = (words[0] == "complete") ? ScriptedRequest::Type::CodeCompletion : ScriptedRequest::Type::GotoReferencedCursor;
+    requests->push_back(request);
+  }
+  return true;
+}
+
+/// Waits until the given document has been parsed. Returns false on timeout.
+static bool WaitForParse(Document* document) {
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  while (SecondsSince(startTime) < kParseTimeoutSeconds) {
+    bool parsed = false;
+    RunInQtThreadBlocking([&]() {
+      if (ParseThreadPool::Instance().DoesAParseRequestExistForDocument(document) ||
+          ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+        return;
+      }
+      int numParsedTUs = 0;
+      if (ClangTUPool* TUPool = document->GetTUPoolIfAllocated()) {
+        TUPool->GetMemoryUsage(&numParsedTUs);
+      }
+      parsed = numParsedTUs > 0;
+    });
+    if (parsed) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return false;
+}
+
+static int RunHarness(const QString& projectPath, const QString& scriptPath, int repetitions) {
+  std::vector<ScriptedRequest> requests;
+  if (!scriptPath.isEmpty() && !LoadScript(scriptPath, &requests)) {
+    return 1;
+  }
+  
+  // Create a MainWindow in the Qt thread which will also get destructed in the Qt thread again
+  std::shared_ptr<MainWindow> mainWindow;
+  RunInQtThreadBlocking([&]() {
+    mainWindow.reset(new MainWindow(), [&](MainWindow* ptr) {
+      RunInQtThreadBlocking([&]() {
+        delete ptr;
+      });
+    });
+  });
+  
+  // Load and configure the project, and index all of its files
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  bool loaded = false;
+  int numIndexingRequests = 0;
+  RunInQtThreadBlocking([&]() {
+    loaded = mainWindow->LoadProject(projectPath, nullptr);
+    if (loaded && !mainWindow->GetProjects().empty()) {
+      // If the project does not index all files by itself, index them anyway.
+      numIndexingRequests = mainWindow->GetProjects().back()->IndexAllNewFiles(mainWindow.get());
+      numIndexingRequests += mainWindow->GetNumIndexingRequestsCreated();
+    }
+  });
+  if (!loaded) {
+    std::cout << "Failed to load the project: " << projectPath.toStdString() << std::endl;
+    return 1;
+  }
+  std::cout << "Loading and configuring the project: " << (1000 * SecondsSince(startTime)) << " ms" << std::endl;
+  
+  startTime = std::chrono::steady_clock::now();
+  while (ParseThreadPool::Instance().GetNumFinishedIndexingRequests() < numIndexingRequests) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  double indexingSeconds = SecondsSince(startTime);
+  std::cout << "Indexing " << numIndexingRequests << " files: " << (1000 * indexingSeconds) << " ms ("
+            << (numIndexingRequests / indexingSeconds) << " files/s, "
+            << IndexingStatistics::Instance().GetTotalDurationMs() << " ms summed over the parse threads)" << std::endl;
+  for (const IndexingStatistics::FileEntry& entry : IndexingStatistics::Instance().GetSlowestFiles(5)) {
+    std::cout << "  " << entry.durationMs << " ms, " << entry.includeCount << " includes: " << entry.canonicalPath.toStdString() << std::endl;
+  }
+  
+  // Open the files of the script and parse them
+  std::vector<double> parseSeconds;
+  for (const ScriptedRequest& request : requests) {
+    Document* document = nullptr;
+    DocumentWidget* widget = nullptr;
+    bool alreadyOpen = false;
+    startTime = std::chrono::steady_clock::now();
+    RunInQtThreadBlocking([&]() {
+      alreadyOpen = mainWindow->GetDocumentAndWidgetForPath(request.canonicalPath, &document, &widget);
+      if (!alreadyOpen) {
+        mainWindow->Open(request.canonicalPath);
+        mainWindow->GetDocumentAndWidgetForPath(request.canonicalPath, &document, &widget);
+      }
+    });
+    if (alreadyOpen) {
+      continue;
+    }
+    if (!document || !WaitForParse(document)) {
+      std::cout << "Failed to open and parse: " << request.canonicalPath.toStdString() << std::endl;
+      return 1;
+    }
+    parseSeconds.push_back(SecondsSince(startTime));
+  }
+  PrintLatencies("Open and parse", parseSeconds);
+  
+  // Replay the requests
+  std::vector<double> latencies[2];
+  int numRejectedRequests = 0;
+  for (int repetition = 0; repetition < repetitions; ++ repetition) {
+    for (const ScriptedRequest& request : requests) {
+      bool accepted = false;
+      startTime = std::chrono::steady_clock::now();
+      RunInQtThreadBlocking([&]() {
+        Document* document;
+        DocumentWidget* widget;
+        if (!mainWindow->GetDocumentAndWidgetForPath(request.canonicalPath, &document, &widget)) {
+          return;
+        }
+        DocumentLocation location = widget->MapLineColToDocumentLocation(request.line - 1, request.column - 1);
+        if (request.type == ScriptedRequest::Type::CodeCompletion) {
+          widget->SetCursor(location, false);
+          accepted = CodeInfo::Instance().RequestCodeCompletion(widget).IsValid();
+        } else {
+          accepted = CodeInfo::Instance().GotoReferencedCursor(widget, location);
+        }
+      });
+      CodeInfo::Instance().WaitUntilIdle();
+      double seconds = SecondsSince(startTime);
+      
+      if (accepted) {
+        latencies[static_cast<int>(request.type)].push_back(seconds);
+      } else {
+        ++ numRejectedRequests;
+      }
+      
+      RunInQtThreadBlocking([&]() {
+        Document* document;
+        DocumentWidget* widget;
+        if (mainWindow->GetDocumentAndWidgetForPath(request.canonicalPath, &document, &widget)) {
+          widget->CloseCodeCompletion();
+        }
+      });
+    }
+  }
+  PrintLatencies("Code completion", latencies[static_cast<int>(ScriptedRequest::Type::CodeCompletion)]);
+  PrintLatencies("Goto referenced cursor", latencies[static_cast<int>(ScriptedRequest::Type::GotoReferencedCursor)]);
+  if (numRejectedRequests > 0) {
+    std::cout << numRejectedRequests << " requests were rejected" << std::endl;
+  }
+  
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // Initialize libgit2
+  git_libgit2_init();
+  
+  QApplication qapp(argc, argv);
+  QCoreApplication::setOrganizationName("PuzzlePaint");
+  QCoreApplication::setOrganizationDomain("puzzlepaint.net");
+  QCoreApplication::setApplicationName("CIDE");
+  
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <project.cide> [script [repetitions]]" << std::endl;
+    return 1;
+  }
+  QString projectPath = QString::fromLocal8Bit(argv[1]);
+  QString scriptPath = (argc >= 3) ? QString::fromLocal8Bit(argv[2]) : QString();
+  int repetitions = (argc >= 4) ? atoi(argv[3]) : 10;
+  
+  // Run the harness in a second thread while the main thread runs a Qt event
+  // loop. This allows RunInQtThreadBlocking() to operate correctly.
+  int result;
+  std::atomic<bool> finished;
+  finished = false;
+  
+  std::thread harnessThread([&]() {
+    result = RunHarness(projectPath, scriptPath, repetitions);
+    ParseThreadPool::Instance().ExitAllThreads();
+    TUCache::Instance().Exit();
+    CodeInfo::Instance().Exit();
+    CrashBackup::Instance().Exit();
+    GitDiff::Instance().Exit();
+    GitStatus::Instance().Exit();
+    PhraseHighlighter::Instance().Exit();
+    QtHelp::Instance().Exit();
+    BackgroundReclaimer::Instance().Exit();
+    finished = true;
+  });
+  
+  QEventLoop exitEventLoop;
+  while (!finished) {
+    exitEventLoop.processEvents();
+  }
+  harnessThread.join();
+  
+  return result;
+}
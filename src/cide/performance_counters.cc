@@ -0,0 +1,178 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/performance_counters.h"
+
+#include <algorithm>
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QTimer>
+
+#include "cide/clang_parser.h"
+#include "cide/clang_tu_pool.h"
+#include "cide/document.h"
+#include "cide/indexing_statistics.h"
+#include "cide/main_window.h"
+#include "cide/parse_thread_pool.h"
+
+/// Length of the window for the "recent" values, which also makes the rates
+/// per minute.
+constexpr std::chrono::seconds kWindowDuration(60);
+
+/// Interval in which the counters are written to the dump file.
+constexpr int kDumpIntervalMilliseconds = 5000;
+
+void PerformanceCounters::EventStatistics::Add(std::chrono::steady_clock::time_point time, double durationMs) {
+  Prune(time);
+  recentEvents.emplace_back(time, durationMs);
+  ++ totalCount;
+  totalDurationMs += durationMs;
+}
+
+void PerformanceCounters::EventStatistics::Prune(std::chrono::steady_clock::time_point now) {
+  while (!recentEvents.empty() && now - recentEvents.front().first > kWindowDuration) {
+    recentEvents.pop_front();
+  }
+}
+
+double PerformanceCounters::EventStatistics::GetRecentAverageMs() const {
+  return recentEvents.empty() ? 0 : (GetRecentTotalMs() / recentEvents.size());
+}
+
+double PerformanceCounters::EventStatistics::GetRecentMaxMs() const {
+  double result = 0;
+  for (const auto& event : recentEvents) {
+    result = std::max(result, event.second);
+  }
+  return result;
+}
+
+double PerformanceCounters::EventStatistics::GetRecentTotalMs() const {
+  double result = 0;
+  for (const auto& event : recentEvents) {
+    result += event.second;
+  }
+  return result;
+}
+
+PerformanceCounters& PerformanceCounters::Instance() {
+  static PerformanceCounters instance;
+  return instance;
+}
+
+void PerformanceCounters::StartDumpIfRequested(MainWindow* mainWindow) {
+  dumpPath = QString::fromLocal8Bit(qgetenv("CIDE_COUNTERS"));
+  if (dumpPath.isEmpty()) {
+    return;
+  }
+  qDebug() << "Writing performance counters to:" << dumpPath;
+  
+  QTimer* dumpTimer = new QTimer(mainWindow);
+  QObject::connect(dumpTimer, &QTimer::timeout, [this, mainWindow]() {
+    WriteDump(mainWindow);
+  });
+  dumpTimer->start(kDumpIntervalMilliseconds);
+}
+
+void PerformanceCounters::RecordParse(double durationMs, bool isIndexing) {
+  std::unique_lock<std::mutex> lock(mutex);
+  (isIndexing ? indexings : parses).Add(std::chrono::steady_clock::now(), durationMs);
+}
+
+void PerformanceCounters::RecordCodeCompletion(double durationMs) {
+  std::unique_lock<std::mutex> lock(mutex);
+  codeCompletions.Add(std::chrono::steady_clock::now(), durationMs);
+}
+
+void PerformanceCounters::RecordQtThreadBlockingCall(double waitMs, double runMs) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex);
+  qtThreadWaits.Add(now, waitMs);
+  qtThreadStalls.Add(now, runMs);
+}
+
+/// Converts the given statistics to a JSON object.
+static QJsonObject EventStatisticsToJSON(double perMinute, double recentAverageMs, double recentMaxMs, std::uint64_t totalCount) {
+  QJsonObject result;
+  result[QStringLiteral("perMinute")] = perMinute;
+  result[QStringLiteral("averageMs")] = recentAverageMs;
+  result[QStringLiteral("maxMs")] = recentMaxMs;
+  result[QStringLiteral("total")] = static_cast<double>(totalCount);
+  return result;
+}
+
+QByteArray PerformanceCounters::CreateJSON(MainWindow* mainWindow) {
+  QJsonObject root;
+  root[QStringLiteral("timestamp")] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+  root[QStringLiteral("pid")] = static_cast<double>(QCoreApplication::applicationPid());
+  
+  // Latencies and rates
+  double perMinuteFactor = 60.0 / std::chrono::duration<double>(kWindowDuration).count();
+  mutex.lock();
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  for (EventStatistics* statistics : {&parses, &indexings, &codeCompletions, &qtThreadWaits, &qtThreadStalls}) {
+    statistics->Prune(now);
+  }
+  auto toJSON = [&](const EventStatistics& statistics) {
+    return EventStatisticsToJSON(perMinuteFactor * statistics.recentEvents.size(), statistics.GetRecentAverageMs(), statistics.GetRecentMaxMs(), statistics.totalCount);
+  };
+  root[QStringLiteral("parses")] = toJSON(parses);
+  root[QStringLiteral("indexing")] = toJSON(indexings);
+  root[QStringLiteral("codeCompletion")] = toJSON(codeCompletions);
+  
+  QJsonObject qtThread;
+  qtThread[QStringLiteral("blockingCalls")] = toJSON(qtThreadWaits);
+  qtThread[QStringLiteral("stalls")] = toJSON(qtThreadStalls);
+  qtThread[QStringLiteral("stallMsPerMinute")] = perMinuteFactor * qtThreadStalls.GetRecentTotalMs();
+  qtThread[QStringLiteral("totalStallMs")] = qtThreadStalls.totalDurationMs;
+  root[QStringLiteral("qtThread")] = qtThread;
+  mutex.unlock();
+  
+  // Parse queue
+  int numForClosedFiles, numForOpenDocuments, numForCurrentDocument;
+  ParseThreadPool::Instance().GetNumQueuedRequests(&numForClosedFiles, &numForOpenDocuments, &numForCurrentDocument);
+  QJsonObject parseQueue;
+  parseQueue[QStringLiteral("closedFiles")] = numForClosedFiles;
+  parseQueue[QStringLiteral("openDocuments")] = numForOpenDocuments;
+  parseQueue[QStringLiteral("currentDocument")] = numForCurrentDocument;
+  root[QStringLiteral("parseQueue")] = parseQueue;
+  
+  // TUs
+  int numParsedTUs = 0;
+  for (int i = 0; i < mainWindow->GetNumDocuments(); ++ i) {
+    if (ClangTUPool* TUPool = mainWindow->GetDocument(i)->GetTUPoolIfAllocated()) {
+      int numParsedTUsInPool;
+      TUPool->GetMemoryUsage(&numParsedTUsInPool);
+      numParsedTUs += numParsedTUsInPool;
+    }
+  }
+  QJsonObject TUs;
+  TUs[QStringLiteral("parsed")] = numParsedTUs;
+  TUs[QStringLiteral("memoryBytes")] = static_cast<double>(ClangTUPoolManager::Instance().GetTotalMemoryUsage().Total());
+  TUs[QStringLiteral("budgetBytes")] = static_cast<double>(ClangTUPoolManager::Instance().GetMemoryBudget());
+  root[QStringLiteral("TUs")] = TUs;
+  
+  // Index
+  QJsonObject index;
+  index[QStringLiteral("USRCount")] = static_cast<double>(USRStorage::Instance().GetUSRCount());
+  index[QStringLiteral("indexedFiles")] = IndexingStatistics::Instance().GetIndexedFileCount();
+  root[QStringLiteral("index")] = index;
+  
+  return QJsonDocument(root).toJson();
+}
+
+void PerformanceCounters::WriteDump(MainWindow* mainWindow) {
+  // Replace the file atomically, such that readers never see a partial dump.
+  QSaveFile file(dumpPath);
+  if (!file.open(QIODevice::WriteOnly) ||
+      file.write(CreateJSON(mainWindow)) < 0 ||
+      !file.commit()) {
+    qDebug() << "Failed to write the performance counters to:" << dumpPath;
+  }
+}
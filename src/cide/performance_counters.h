@@ -0,0 +1,93 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+#include <QByteArray>
+#include <QString>
+
+class MainWindow;
+
+/// Live counters about the behavior of CIDE's background work (parse queue
+/// depth, parse and code completion latencies, TUs, the USR index, and the
+/// time that worker threads stall the Qt thread in RunInQtThreadBlocking()).
+///
+/// The counters are always recorded, which is cheap. If the environment
+/// variable CIDE_COUNTERS is set to a file path, a JSON object with their
+/// current values is written to this file periodically (see
+/// StartDumpIfRequested()). This allows external tools, such as
+/// developer-experience dashboards, to monitor CIDE's behavior. This class is
+/// thread-safe.
+class PerformanceCounters {
+ public:
+  static PerformanceCounters& Instance();
+  
+  /// Starts writing the counters to the file given by the environment
+  /// variable every kDumpIntervalMilliseconds, if it is set. Must be called in
+  /// the Qt thread. @p mainWindow must outlive the dumping.
+  void StartDumpIfRequested(MainWindow* mainWindow);
+  
+  /// Records a parse of an open document, respectively the indexing of a file
+  /// that is not open, which took @p durationMs.
+  void RecordParse(double durationMs, bool isIndexing);
+  
+  /// Records a code completion request which took @p durationMs from the start
+  /// of its processing until the results were available.
+  void RecordCodeCompletion(double durationMs);
+  
+  /// Records a call to RunInQtThreadBlocking() from a worker thread, which
+  /// blocked the calling thread for @p waitMs in total, and stalled the Qt
+  /// thread for @p runMs while running the function.
+  void RecordQtThreadBlockingCall(double waitMs, double runMs);
+  
+  /// Returns the current values of the counters as a JSON object. Must be
+  /// called in the Qt thread.
+  QByteArray CreateJSON(MainWindow* mainWindow);
+  
+ private:
+  /// Durations of the recent events of one kind, and totals since the program
+  /// start.
+  struct EventStatistics {
+    /// Records an event, and forgets events that are older than the window.
+    void Add(std::chrono::steady_clock::time_point time, double durationMs);
+    
+    /// Forgets events that are older than the window.
+    void Prune(std::chrono::steady_clock::time_point now);
+    
+    /// Returns the average and maximum duration within the window, or zero if
+    /// there is no event in it.
+    double GetRecentAverageMs() const;
+    double GetRecentMaxMs() const;
+    
+    /// Returns the sum of the durations within the window.
+    double GetRecentTotalMs() const;
+    
+    /// Times and durations of the events within the window.
+    std::deque<std::pair<std::chrono::steady_clock::time_point, double>> recentEvents;
+    
+    std::uint64_t totalCount = 0;
+    double totalDurationMs = 0;
+  };
+  
+  PerformanceCounters() = default;
+  
+  void WriteDump(MainWindow* mainWindow);
+  
+  
+  std::mutex mutex;
+  EventStatistics parses;
+  EventStatistics indexings;
+  EventStatistics codeCompletions;
+  EventStatistics qtThreadWaits;
+  EventStatistics qtThreadStalls;
+  
+  /// Path that the counters are written to, empty if dumping is disabled.
+  QString dumpPath;
+};
@@ -0,0 +1,62 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/performance_profile.h"
+
+#include <atomic>
+
+static const PerformanceProfileParameters profileParameters[static_cast<int>(PerformanceProfile::NumProfiles)] = {
+  // Performance
+  {/*maxParseThreadCount*/ 0,
+   /*TUsPerDocument*/ 3,
+   /*TUMemoryBudgetMB*/ 16384,
+   /*reservedBackgroundSlotCount*/ 0,
+   /*alwaysThrottleBackgroundWork*/ false,
+   /*minParseDelayMilliseconds*/ 0,
+   /*minMinimapUpdateIntervalMilliseconds*/ 0,
+   /*gitStatusDebounceMilliseconds*/ 150,
+   /*gitDiffDelayMilliseconds*/ 0,
+   /*backupIdleMilliseconds*/ 1000,
+   /*minBackupIntervalMilliseconds*/ 3000},
+  
+  // Balanced
+  {/*maxParseThreadCount*/ 0,
+   /*TUsPerDocument*/ 3,
+   /*TUMemoryBudgetMB*/ 8192,
+   /*reservedBackgroundSlotCount*/ 1,
+   /*alwaysThrottleBackgroundWork*/ false,
+   /*minParseDelayMilliseconds*/ 0,
+   /*minMinimapUpdateIntervalMilliseconds*/ 100,
+   /*gitStatusDebounceMilliseconds*/ 150,
+   /*gitDiffDelayMilliseconds*/ 0,
+   /*backupIdleMilliseconds*/ 1000,
+   /*minBackupIntervalMilliseconds*/ 3000},
+  
+  // Battery
+  {/*maxParseThreadCount*/ 2,
+   /*TUsPerDocument*/ 2,
+   /*TUMemoryBudgetMB*/ 2048,
+   /*reservedBackgroundSlotCount*/ 1,
+   /*alwaysThrottleBackgroundWork*/ true,
+   /*minParseDelayMilliseconds*/ 500,
+   /*minMinimapUpdateIntervalMilliseconds*/ 500,
+   /*gitStatusDebounceMilliseconds*/ 1000,
+   /*gitDiffDelayMilliseconds*/ 500,
+   /*backupIdleMilliseconds*/ 3000,
+   /*minBackupIntervalMilliseconds*/ 10000},
+};
+
+static std::atomic<int> currentProfile(static_cast<int>(PerformanceProfile::Balanced));
+
+const PerformanceProfileParameters& GetPerformanceProfileParameters(PerformanceProfile profile) {
+  return profileParameters[static_cast<int>(profile)];
+}
+
+const PerformanceProfileParameters& GetPerformanceProfileParameters() {
+  return profileParameters[currentProfile];
+}
+
+void SetCurrentPerformanceProfile(PerformanceProfile profile) {
+  currentProfile = static_cast<int>(profile);
+}
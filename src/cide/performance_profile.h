@@ -0,0 +1,72 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+/// Profiles that configure the amount of background work (parsing, indexing,
+/// minimap updates, git queries, and backups) together, trading throughput
+/// against CPU usage and energy consumption.
+enum class PerformanceProfile {
+  /// Maximal throughput, for workstations.
+  Performance = 0,
+  
+  /// The default.
+  Balanced,
+  
+  /// Less and less frequent background work, for laptops on battery.
+  Battery,
+  
+  NumProfiles
+};
+
+/// Parameters of the background work that are determined by a
+/// PerformanceProfile.
+struct PerformanceProfileParameters {
+  /// Maximum number of parse threads if their number is not configured
+  /// explicitly. Zero means one per CPU core.
+  int maxParseThreadCount;
+  
+  /// Number of libclang TUs of each open document (see ClangTUPool).
+  int TUsPerDocument;
+  
+  /// Memory budget for the TUs of all open documents in MiB if it is not
+  /// configured explicitly.
+  int TUMemoryBudgetMB;
+  
+  /// Number of CPUBudget slots that background work leaves free for other
+  /// work.
+  int reservedBackgroundSlotCount;
+  
+  /// If true, background work is always throttled as while the user types
+  /// (see CPUBudget::NotifyUserActivity()).
+  bool alwaysThrottleBackgroundWork;
+  
+  /// Minimum delay between an edit and the reparse of the document.
+  int minParseDelayMilliseconds;
+  
+  /// Minimum time between two updates of the scrollbar minimap.
+  int minMinimapUpdateIntervalMilliseconds;
+  
+  /// Time without new requests that git status queries wait for.
+  int gitStatusDebounceMilliseconds;
+  
+  /// Time that git diff requests wait for further edits of the document.
+  int gitDiffDelayMilliseconds;
+  
+  /// Time without changes to a document after which it is backed up, and
+  /// minimum time between two backups of the same document (see CrashBackup).
+  int backupIdleMilliseconds;
+  int minBackupIntervalMilliseconds;
+};
+
+/// Returns the parameters of the given profile.
+const PerformanceProfileParameters& GetPerformanceProfileParameters(PerformanceProfile profile);
+
+/// Returns the parameters of the current profile. This may be called from any
+/// thread.
+const PerformanceProfileParameters& GetPerformanceProfileParameters();
+
+/// Sets the current profile. This is done by Settings, which stores the
+/// profile persistently.
+void SetCurrentPerformanceProfile(PerformanceProfile profile);
@@ -0,0 +1,253 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/phrase_highlighter.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "cide/document.h"
+#include "cide/document_widget.h"
+#include "cide/qt_thread.h"
+#include "cide/settings.h"
+#include "cide/text_utils.h"
+
+/// Number of characters that are searched at once after, respectively before,
+/// the focus range of a request.
+constexpr int kSearchChunkSize = 64 * 1024;
+
+/// Returns whether the occurrence of a phrase at [start, end) in @p text is an
+/// occurrence of the whole word or phrase, rather than part of another word.
+static bool IsWholeOccurrence(const QString& text, int start, int end) {
+  int wordCharType = GetCharType(text[start]);
+  if (start > 0 &&
+      GetCharType(text[start - 1]) == wordCharType &&
+      wordCharType != static_cast<int>(CharacterType::Symbol)) {
+    return false;
+  }
+  int wordEndCharType = GetCharType(text[end - 1]);
+  if (end < text.size() &&
+      GetCharType(text[end]) == wordEndCharType &&
+      wordEndCharType != static_cast<int>(CharacterType::Symbol)) {
+    return false;
+  }
+  return true;
+}
+
+/// Appends the whole occurrences of @p phrase in @p text which start within
+/// [begin, end) to @p occurrences, in ascending order.
+static void FindOccurrencesStartingIn(const QString& text, const QString& phrase, int begin, int end, std::vector<DocumentRange>* occurrences) {
+  int pos = begin;
+  while (pos < end) {
+    pos = text.indexOf(phrase, pos, Qt::CaseSensitive);
+    if (pos < 0 || pos >= end) {
+      break;
+    }
+    if (IsWholeOccurrence(text, pos, pos + phrase.size())) {
+      occurrences->emplace_back(pos, pos + phrase.size());
+    }
+    ++ pos;
+  }
+}
+
+PhraseHighlighter& PhraseHighlighter::Instance() {
+  static PhraseHighlighter instance;
+  return instance;
+}
+
+void PhraseHighlighter::RequestHighlight(DocumentWidget* widget, const QString& phrase, const DocumentRange& focusRange, int requestCounter) {
+  requestMutex.lock();
+  
+  // Replace an existing request for this widget, since its results would be
+  // discarded anyway.
+  for (int i = 0; i < newRequests.size(); ++ i) {
+    if (newRequests[i].widget == widget) {
+      newRequests.erase(newRequests.begin() + i);
+      break;
+    }
+  }
+  
+  newRequests.emplace_back(widget->GetDocument(), widget, phrase, focusRange, requestCounter);
+  requestMutex.unlock();
+  newRequestCondition.notify_one();
+}
+
+void PhraseHighlighter::WidgetRemoved(DocumentWidget* widget) {
+  std::unique_lock<std::mutex> lock(requestMutex);
+  
+  for (auto it = newRequests.begin(); it != newRequests.end(); ) {
+    if (it->widget == widget) {
+      it = newRequests.erase(it);
+    } else {
+      ++ it;
+    }
+  }
+  
+  if (widgetBeingProcessed == widget) {
+    widgetBeingProcessed = nullptr;
+  }
+}
+
+void PhraseHighlighter::Exit() {
+  mExit = true;
+  newRequestCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void PhraseHighlighter::FindOccurrences(const QString& text, const QString& phrase, const DocumentRange& focusRange, int maxCount, std::vector<DocumentRange>* occurrences) {
+  occurrences->clear();
+  if (phrase.isEmpty()) {
+    return;
+  }
+  std::size_t maxSize = (maxCount > 0) ? maxCount : std::numeric_limits<std::size_t>::max();
+  
+  int focusStart = std::max(0, std::min(text.size(), focusRange.start.offset));
+  int focusEnd = std::max(focusStart, std::min(text.size(), focusRange.end.offset));
+  
+  FindOccurrencesStartingIn(text, phrase, focusStart, focusEnd, occurrences);
+  if (occurrences->size() > maxSize) {
+    occurrences->resize(maxSize);
+  }
+  
+  // Search the text after and before the focus range in turns, proceeding
+  // outwards, until enough occurrences have been found.
+  std::vector<DocumentRange> chunkOccurrences;
+  int afterStart = focusEnd;
+  int beforeEnd = focusStart;
+  while (occurrences->size() < maxSize && (afterStart < text.size() || beforeEnd > 0)) {
+    if (afterStart < text.size()) {
+      int afterEnd = std::min(text.size(), afterStart + kSearchChunkSize);
+      chunkOccurrences.clear();
+      FindOccurrencesStartingIn(text, phrase, afterStart, afterEnd, &chunkOccurrences);
+      for (int i = 0; i < chunkOccurrences.size() && occurrences->size() < maxSize; ++ i) {
+        occurrences->push_back(chunkOccurrences[i]);
+      }
+      afterStart = afterEnd;
+    }
+    
+    if (beforeEnd > 0) {
+      int beforeStart = std::max(0, beforeEnd - kSearchChunkSize);
+      chunkOccurrences.clear();
+      FindOccurrencesStartingIn(text, phrase, beforeStart, beforeEnd, &chunkOccurrences);
+      // Prefer the occurrences that are closer to the focus range.
+      for (int i = static_cast<int>(chunkOccurrences.size()) - 1; i >= 0 && occurrences->size() < maxSize; -- i) {
+        occurrences->push_back(chunkOccurrences[i]);
+      }
+      beforeEnd = beforeStart;
+    }
+  }
+  
+  std::sort(occurrences->begin(), occurrences->end(), [](const DocumentRange& a, const DocumentRange& b) {
+    return a.start < b.start;
+  });
+}
+
+PhraseHighlighter::PhraseHighlighter() {
+  mExit = false;
+  mThread.reset(new std::thread(&PhraseHighlighter::ThreadMain, this));
+}
+
+PhraseHighlighter::~PhraseHighlighter() {
+  Exit();
+}
+
+void PhraseHighlighter::ThreadMain() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(requestMutex);
+    widgetBeingProcessed = nullptr;
+    if (mExit) {
+      return;
+    }
+    while (newRequests.empty()) {
+      newRequestCondition.wait(lock);
+      if (mExit) {
+        return;
+      }
+    }
+    HighlightRequest request = newRequests.front();
+    newRequests.erase(newRequests.begin());
+    widgetBeingProcessed = request.widget;
+    lock.unlock();
+    
+    Highlight(request);
+  }
+}
+
+void PhraseHighlighter::Highlight(const HighlightRequest& request) {
+  // Get a snapshot of the document text
+  std::shared_ptr<const DocumentSnapshot> snapshot;
+  int maxCount;
+  
+  bool exit = false;
+  RunInQtThreadBlocking([&]() {
+    // If the widget has been closed or the request is outdated, abort.
+    if (widgetBeingProcessed != request.widget ||
+        request.widget->GetPhraseHighlightRequestCounter() != request.requestCounter) {
+      exit = true;
+      return;
+    }
+    
+    snapshot = request.document->UpdateSnapshot();
+    if (!snapshot || snapshot->textChangeCounter() != request.document->textChangeCounter()) {
+      // Snapshots are not published for this document
+      snapshot.reset(new DocumentSnapshot(request.document.get()));
+    }
+    maxCount = Settings::Instance().GetMaxPhraseHighlightCount();
+  });
+  if (exit) {
+    return;
+  }
+  
+  if (snapshot != cachedSnapshot) {
+    cachedSnapshot = snapshot;
+    cachedText = snapshot->document()->TextForRange(snapshot->document()->FullDocumentRange());
+  }
+  
+  std::vector<DocumentRange> occurrences;
+  FindOccurrences(cachedText, request.phrase, request.focusRange, maxCount, &occurrences);
+  
+  // We should always find at least one occurrence, which is the actual selection.
+  // Highlighting this will not be visible because the selection is drawn on top.
+  // So, we only add highlights if we have at least two occurrences.
+  if (occurrences.size() <= 1) {
+    return;
+  }
+  
+  RunInQtThreadBlocking([&]() {
+    // Abort if the widget does not exist anymore, if the selection changed,
+    // or if the text changed.
+    if (widgetBeingProcessed != request.widget ||
+        request.widget->GetPhraseHighlightRequestCounter() != request.requestCounter ||
+        request.document->textChangeCounter() != snapshot->textChangeCounter()) {
+      return;
+    }
+    
+    request.widget->AddPhraseHighlights(occurrences);
+  });
+}
+
+void PhraseHighlighter::KeepOccurrencesClosestTo(const DocumentRange& focusRange, int maxCount, std::vector<DocumentRange>* occurrences) {
+  if (maxCount <= 0 || occurrences->size() <= maxCount) {
+    return;
+  }
+  
+  auto distance = [&](const DocumentRange& range) {
+    if (range.end.offset <= focusRange.start.offset) {
+      return focusRange.start.offset - range.end.offset;
+    } else if (range.start.offset >= focusRange.end.offset) {
+      return range.start.offset - focusRange.end.offset;
+    }
+    return 0;
+  };
+  std::nth_element(occurrences->begin(), occurrences->begin() + maxCount, occurrences->end(), [&](const DocumentRange& a, const DocumentRange& b) {
+    return distance(a) < distance(b);
+  });
+  occurrences->resize(maxCount);
+  std::sort(occurrences->begin(), occurrences->end(), [](const DocumentRange& a, const DocumentRange& b) {
+    return a.start < b.start;
+  });
+}
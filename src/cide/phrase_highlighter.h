@@ -0,0 +1,93 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QString>
+
+#include "cide/document_range.h"
+
+class Document;
+class DocumentSnapshot;
+class DocumentWidget;
+
+/// Searches for the occurrences of the word or phrase that is selected in a
+/// DocumentWidget in a background thread, and highlights them in the widget.
+class PhraseHighlighter {
+ public:
+  static PhraseHighlighter& Instance();
+  
+  ~PhraseHighlighter();
+  
+  /// Requests to highlight the occurrences of @p phrase in the document of
+  /// @p widget. Occurrences within or close to @p focusRange are found first.
+  /// The results are only applied if @p widget's
+  /// GetPhraseHighlightRequestCounter() still equals @p requestCounter once
+  /// they are ready. Replaces any pending request for the same widget. Must be
+  /// called from the Qt thread.
+  void RequestHighlight(DocumentWidget* widget, const QString& phrase, const DocumentRange& focusRange, int requestCounter);
+  
+  /// Notifies PhraseHighlighter about the given @p widget being removed, such
+  /// that the highlight thread will not try to access it anymore.
+  void WidgetRemoved(DocumentWidget* widget);
+  
+  void Exit();
+  
+  /// Finds the occurrences of @p phrase in @p text that are not part of a
+  /// longer word. The text within @p focusRange is searched first, and then
+  /// the text after and before it in turns. Stops after @p maxCount
+  /// occurrences have been found (if @p maxCount is larger than zero). The
+  /// resulting @p occurrences are sorted.
+  static void FindOccurrences(const QString& text, const QString& phrase, const DocumentRange& focusRange, int maxCount, std::vector<DocumentRange>* occurrences);
+  
+  /// Reduces the sorted @p occurrences to the @p maxCount ones that are
+  /// closest to @p focusRange (if @p maxCount is larger than zero).
+  static void KeepOccurrencesClosestTo(const DocumentRange& focusRange, int maxCount, std::vector<DocumentRange>* occurrences);
+  
+ private:
+  struct HighlightRequest {
+    inline HighlightRequest() = default;
+    inline HighlightRequest(const std::shared_ptr<Document>& document, DocumentWidget* widget, const QString& phrase, const DocumentRange& focusRange, int requestCounter)
+        : document(document),
+          widget(widget),
+          phrase(phrase),
+          focusRange(focusRange),
+          requestCounter(requestCounter) {}
+    
+    std::shared_ptr<Document> document;
+    DocumentWidget* widget;
+    QString phrase;
+    DocumentRange focusRange;
+    int requestCounter;
+  };
+  
+  PhraseHighlighter();
+  
+  void ThreadMain();
+  
+  void Highlight(const HighlightRequest& request);
+  
+  // The snapshot that the text was last taken from, and the text. Successive
+  // requests usually refer to the same snapshot. Only accessed by the
+  // highlight thread.
+  std::shared_ptr<const DocumentSnapshot> cachedSnapshot;
+  QString cachedText;
+  
+  // Thread input handling
+  std::mutex requestMutex;
+  std::condition_variable newRequestCondition;
+  std::vector<HighlightRequest> newRequests;
+  DocumentWidget* widgetBeingProcessed = nullptr;
+  
+  // Threading
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,274 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/preamble_cache.h"
+
+#include <clang-c/Index.h>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QStringList>
+
+#include "cide/clang_index.h"
+#include "cide/clang_utils.h"
+#include "cide/file_stat_cache.h"
+
+/// PCHs are only built for include prefixes with at least this many includes,
+/// since for less includes, the overhead likely is not worth it.
+constexpr int kMinIncludesForPCH = 2;
+
+PreambleCache& PreambleCache::Instance() {
+  static PreambleCache instance;
+  return instance;
+}
+
+QByteArray PreambleCache::ExtractIncludePrefix(const QString& text, const QString& directory) {
+  QByteArray result;
+  int numIncludes = 0;
+  bool inBlockComment = false;
+  
+  int lineStart = 0;
+  while (lineStart < text.size()) {
+    int lineEnd = text.indexOf('\n', lineStart);
+    if (lineEnd < 0) {
+      lineEnd = text.size();
+    }
+    QString line = text.mid(lineStart, lineEnd - lineStart).trimmed();
+    lineStart = lineEnd + 1;
+    
+    // Skip over comments.
+    if (inBlockComment) {
+      int commentEnd = line.indexOf(QStringLiteral("*/"));
+      if (commentEnd < 0) {
+        continue;
+      }
+      inBlockComment = false;
+      line = line.mid(commentEnd + 2).trimmed();
+    }
+    if (line.startsWith(QStringLiteral("/*"))) {
+      int commentEnd = line.indexOf(QStringLiteral("*/"), 2);
+      if (commentEnd < 0) {
+        inBlockComment = true;
+        continue;
+      }
+      line = line.mid(commentEnd + 2).trimmed();
+    }
+    if (line.isEmpty() || line.startsWith(QStringLiteral("//"))) {
+      continue;
+    }
+    
+    // Parse an #include directive.
+    if (!line.startsWith('#')) {
+      break;
+    }
+    line = line.mid(1).trimmed();
+    if (!line.startsWith(QStringLiteral("include"))) {
+      break;
+    }
+    line = line.mid(7).trimmed();
+    if (line.isEmpty()) {
+      break;
+    }
+    QChar closingChar;
+    if (line[0] == '"') {
+      closingChar = '"';
+    } else if (line[0] == '<') {
+      closingChar = '>';
+    } else {
+      break;
+    }
+    int pathEnd = line.indexOf(closingChar, 1);
+    if (pathEnd < 0) {
+      break;
+    }
+    QString rest = line.mid(pathEnd + 1).trimmed();
+    if (!rest.isEmpty() && !rest.startsWith(QStringLiteral("//"))) {
+      break;
+    }
+    QString path = line.mid(1, pathEnd - 1);
+    
+    if (closingChar == '"') {
+      QFileInfo relativeInfo(QDir(directory).filePath(path));
+      if (relativeInfo.exists()) {
+        path = relativeInfo.canonicalFilePath();
+      }
+      result += "#include \"" + path.toUtf8() + "\"\n";
+    } else {
+      result += "#include <" + path.toUtf8() + ">\n";
+    }
+    ++ numIncludes;
+  }
+  
+  if (numIncludes < kMinIncludesForPCH) {
+    return QByteArray();
+  }
+  return result;
+}
+
+bool PreambleCache::GetPCH(const QString& canonicalPath, const QByteArray& includePrefix, const std::vector<QByteArray>& commandLineArgs, QString* pchPath) {
+  if (includePrefix.isEmpty()) {
+    return false;
+  }
+  
+  // The PCH is parsed as a header of the source file's language. Files for
+  // which the language is given explicitly (for example, CUDA files) are not
+  // handled.
+  for (const QByteArray& arg : commandLineArgs) {
+    if (arg.startsWith("-x")) {
+      return false;
+    }
+  }
+  std::vector<QByteArray> pchCommandLineArgs = commandLineArgs;
+  pchCommandLineArgs.emplace_back("-x");
+  pchCommandLineArgs.emplace_back(canonicalPath.endsWith(QStringLiteral(".c")) ? "c-header" : "c++-header");
+  
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(includePrefix);
+  for (const QByteArray& arg : pchCommandLineArgs) {
+    hash.addData("\0", 1);
+    hash.addData(arg);
+  }
+  QByteArray key = hash.result();
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  Entry& entry = entries[key];
+  entry.sourceFiles.insert(canonicalPath);
+  if (entry.sourceFiles.size() < 2) {
+    return false;
+  }
+  
+  while (entry.building) {
+    buildFinishedCondition.wait(lock);
+  }
+  if ((!entry.pchPath.isEmpty() || entry.buildFailed) && IsUpToDate(entry)) {
+    *pchPath = entry.pchPath;
+    return !entry.pchPath.isEmpty();
+  }
+  
+  // Build the PCH (again).
+  entry.building = true;
+  QString basePath = QDir(cacheDir).filePath(QStringLiteral("preamble_%1").arg(pchCounter));
+  ++ pchCounter;
+  lock.unlock();
+  
+  std::vector<std::pair<QString, qint64>> includes;
+  bool success = BuildPCH(includePrefix, pchCommandLineArgs, basePath, &includes);
+  
+  lock.lock();
+  entry.building = false;
+  entry.includes.swap(includes);
+  entry.buildFailed = !success;
+  entry.pchPath = success ? (basePath + QStringLiteral(".pch")) : QString();
+  buildFinishedCondition.notify_all();
+  
+  *pchPath = entry.pchPath;
+  return success;
+}
+
+PreambleCache::PreambleCache() {
+  QString cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir dir(cachePath);
+  dir = dir.filePath("preambles");
+  dir.mkpath(".");
+  cacheDir = dir.path();
+  
+  // Delete the PCHs of previous runs.
+  QStringList files = dir.entryList(QDir::NoDotAndDotDot | QDir::Files);
+  for (const QString& filename : files) {
+    QFile::remove(dir.filePath(filename));
+  }
+}
+
+bool PreambleCache::IsUpToDate(const Entry& entry) {
+  for (const std::pair<QString, qint64>& include : entry.includes) {
+    if (FileStatCache::Instance().GetModificationTime(include.first) != include.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void VisitInclusionsForPCH(
+    CXFile included_file,
+    CXSourceLocation* /*inclusion_stack*/,
+    unsigned /*include_len*/,
+    CXClientData client_data) {
+  std::vector<std::pair<QString, qint64>>* includes = reinterpret_cast<std::vector<std::pair<QString, qint64>>*>(client_data);
+  QFileInfo info(GetClangFilePath(included_file));
+  includes->emplace_back(info.canonicalFilePath(), info.lastModified().toSecsSinceEpoch());
+}
+
+bool PreambleCache::BuildPCH(const QByteArray& content, const std::vector<QByteArray>& commandLineArgs, const QString& basePath, std::vector<std::pair<QString, qint64>>* includes) {
+  QString headerPath = basePath + QStringLiteral(".h");
+  QString pchPath = basePath + QStringLiteral(".pch");
+  
+  // The header is written to disk (instead of passing it as an unsaved file),
+  // since libclang verifies that the input files of a PCH exist when using it.
+  QFile headerFile(headerPath);
+  if (!headerFile.open(QIODevice::WriteOnly)) {
+    qDebug() << "Error: Cannot write preamble header:" << headerPath;
+    return false;
+  }
+  headerFile.write(content);
+  headerFile.close();
+  
+  std::vector<const char*> commandLineArgPtrs(commandLineArgs.size());
+  for (int i = 0; i < commandLineArgs.size(); ++ i) {
+    commandLineArgPtrs[i] = commandLineArgs[i].data();
+  }
+  
+  ClangIndex index;
+  CXTranslationUnit TU;
+  CXErrorCode parseResult = clang_parseTranslationUnit2(
+      index.index(),
+      headerPath.toLocal8Bit().data(),
+      commandLineArgPtrs.data(),
+      commandLineArgPtrs.size(),
+      nullptr,
+      0,
+      CXTranslationUnit_Incomplete |
+      CXTranslationUnit_ForSerialization,
+      &TU);
+  if (parseResult != CXError_Success) {
+    qDebug() << "Error: Failed to parse preamble header:" << headerPath;
+    QFile::remove(headerPath);
+    return false;
+  }
+  
+  clang_getInclusions(TU, &VisitInclusionsForPCH, includes);
+  QString canonicalHeaderPath = QFileInfo(headerPath).canonicalFilePath();
+  for (int i = static_cast<int>(includes->size()) - 1; i >= 0; -- i) {
+    if (includes->at(i).first == canonicalHeaderPath) {
+      includes->erase(includes->begin() + i);
+    }
+  }
+  
+  // Do not use the PCH if the includes have errors, since the diagnostics of
+  // the PCH would then be reported for all files that use it.
+  bool success = true;
+  unsigned numDiagnostics = clang_getNumDiagnostics(TU);
+  for (unsigned i = 0; i < numDiagnostics; ++ i) {
+    CXDiagnostic diagnostic = clang_getDiagnostic(TU, i);
+    if (clang_getDiagnosticSeverity(diagnostic) >= CXDiagnostic_Error) {
+      success = false;
+    }
+    clang_disposeDiagnostic(diagnostic);
+  }
+  
+  if (success &&
+      clang_saveTranslationUnit(TU, pchPath.toLocal8Bit().data(), clang_defaultSaveOptions(TU)) != CXSaveError_None) {
+    qDebug() << "Error: Failed to save precompiled preamble:" << pchPath;
+    success = false;
+  }
+  
+  clang_disposeTranslationUnit(TU);
+  if (!success) {
+    QFile::remove(headerPath);
+  }
+  return success;
+}
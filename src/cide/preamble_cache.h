@@ -0,0 +1,95 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+
+#include "cide/util.h"
+
+/// Cache of precompiled headers (PCHs) for the include prefixes of source files,
+/// i.e., for the #include directives at the start of a file. Many source files
+/// of a target start with the same includes and are parsed with the same
+/// compile settings; libclang however builds a separate preamble for each TU.
+/// If a second file with the same include prefix and command-line arguments
+/// gets parsed, a PCH with these includes is built and used with
+/// -include-pch for all of these files, such that the headers are only parsed
+/// once. The files' own preambles then only need to cover the remaining part.
+///
+/// The PCHs are stored in the cache directory and are deleted on startup.
+/// A PCH is rebuilt if any file that it includes changes.
+///
+/// This class is thread-safe.
+class PreambleCache {
+ public:
+  static PreambleCache& Instance();
+  
+  /// Returns the #include directives at the start of @p text (ignoring
+  /// comments and empty lines), up to the first line containing anything else,
+  /// with one directive per line. Includes with quotes that can be resolved
+  /// relative to @p directory are converted to absolute paths, such that the
+  /// result does not depend on the location of the file that contains it.
+  static QByteArray ExtractIncludePrefix(const QString& text, const QString& directory);
+  
+  /// Determines the PCH to use for parsing the source file @p canonicalPath,
+  /// whose include prefix (see ExtractIncludePrefix()) is @p includePrefix.
+  /// If another source file with the same include prefix and
+  /// @p commandLineArgs has been parsed before, builds the PCH (if it does not
+  /// exist yet or is outdated), returns its path in @p pchPath and returns
+  /// true. Otherwise, returns false. This may take a long time if the PCH
+  /// needs to be built, so it should not be called from the main (Qt) thread.
+  bool GetPCH(const QString& canonicalPath, const QByteArray& includePrefix, const std::vector<QByteArray>& commandLineArgs, QString* pchPath);
+  
+ private:
+  struct Entry {
+    /// Path of the PCH file, or empty if it has not been built (successfully).
+    QString pchPath;
+    
+    /// Canonical paths and modification times (in seconds since epoch) of all
+    /// files included by the PCH.
+    std::vector<std::pair<QString, qint64>> includes;
+    
+    /// Canonical paths of the source files that requested this entry.
+    std::unordered_set<QString> sourceFiles;
+    
+    /// Whether building the PCH failed. In this case, it is not attempted
+    /// again until one of the includes changes.
+    bool buildFailed = false;
+    
+    /// Whether a thread is currently building the PCH.
+    bool building = false;
+  };
+  
+  PreambleCache();
+  
+  /// Returns whether all files included by the entry's PCH are unchanged.
+  static bool IsUpToDate(const Entry& entry);
+  
+  /// Builds a PCH for a header with the given @p content. The header and the
+  /// PCH are stored as @p basePath + ".h" and @p basePath + ".pch". Returns
+  /// true on success. The included files are returned in @p includes in both
+  /// cases.
+  static bool BuildPCH(const QByteArray& content, const std::vector<QByteArray>& commandLineArgs, const QString& basePath, std::vector<std::pair<QString, qint64>>* includes);
+  
+  
+  /// Maps hash of (include prefix, command-line arguments) --> entry.
+  std::unordered_map<QByteArray, Entry> entries;
+  
+  /// Counter for creating unique PCH file names. Existing PCH files are never
+  /// overwritten, since they may still be in use by TUs.
+  int pchCounter = 0;
+  
+  QString cacheDir;
+  
+  std::mutex mutex;
+  std::condition_variable buildFinishedCondition;
+};
@@ -4,6 +4,10 @@
 
 #include "cide/problem.h"
 
+#include <functional>
+
+#include <QHash>
+
 #include "cide/clang_utils.h"
 
 Problem::Problem(CXDiagnostic diagnostic, CXTranslationUnit tu, const std::vector<unsigned>& lineOffsets) {
@@ -45,6 +49,100 @@ QString Problem::GetFormattedDescription(const QString& forFile, int forLine) {
   return text;
 }
 
+std::size_t Problem::ContentHash() const {
+  std::size_t hash = std::hash<int>()(static_cast<int>(mType));
+  hash ^= qHash(flagToDisable) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  HashItems(mItems, &hash);
+  for (const FixIt& fixit : fixIts) {
+    hash ^= qHash(fixit.newText) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+void Problem::Write(QDataStream* stream) const {
+  *stream << static_cast<qint32>(mType) << flagToDisable;
+  WriteItems(mItems, stream);
+  *stream << static_cast<quint32>(fixIts.size());
+  for (const FixIt& fixit : fixIts) {
+    *stream << fixit.oldText << fixit.newText
+            << static_cast<qint32>(fixit.range.start.offset)
+            << static_cast<qint32>(fixit.range.end.offset);
+  }
+}
+
+std::shared_ptr<Problem> Problem::Read(QDataStream* stream) {
+  std::shared_ptr<Problem> problem(new Problem());
+  
+  qint32 type;
+  *stream >> type >> problem->flagToDisable;
+  problem->mType = (type == static_cast<qint32>(Type::Warning)) ? Type::Warning : Type::Error;
+  if (!ReadItems(stream, &problem->mItems)) {
+    return nullptr;
+  }
+  
+  quint32 numFixIts;
+  *stream >> numFixIts;
+  if (stream->status() != QDataStream::Ok) {
+    return nullptr;
+  }
+  problem->fixIts.resize(numFixIts);
+  for (FixIt& fixit : problem->fixIts) {
+    qint32 start;
+    qint32 end;
+    *stream >> fixit.oldText >> fixit.newText >> start >> end;
+    fixit.range = DocumentRange(start, end);
+  }
+  
+  return (stream->status() == QDataStream::Ok) ? problem : nullptr;
+}
+
+void Problem::WriteItems(const std::vector<Item>& items, QDataStream* stream) {
+  *stream << static_cast<quint32>(items.size());
+  for (const Item& item : items) {
+    *stream << item.text << item.filePath
+            << static_cast<quint32>(item.line)
+            << static_cast<quint32>(item.col)
+            << static_cast<quint32>(item.offset);
+    WriteItems(item.children, stream);
+  }
+}
+
+bool Problem::ReadItems(QDataStream* stream, std::vector<Item>* items) {
+  quint32 numItems;
+  *stream >> numItems;
+  if (stream->status() != QDataStream::Ok) {
+    return false;
+  }
+  items->resize(numItems);
+  for (Item& item : *items) {
+    quint32 line;
+    quint32 col;
+    quint32 offset;
+    *stream >> item.text >> item.filePath >> line >> col >> offset;
+    item.line = line;
+    item.col = col;
+    item.offset = offset;
+    if (!ReadItems(stream, &item.children)) {
+      return false;
+    }
+  }
+  return stream->status() == QDataStream::Ok;
+}
+
+void Problem::HashItems(const std::vector<Item>& items, std::size_t* hash) {
+  auto combine = [hash](std::size_t value) {
+    *hash ^= value + 0x9e3779b9 + (*hash << 6) + (*hash >> 2);
+  };
+  for (const Item& item : items) {
+    combine(qHash(item.text));
+    combine(qHash(item.filePath));
+    combine(item.line);
+    combine(item.col);
+    HashItems(item.children, hash);
+    combine(item.children.size());
+  }
+}
+
 void Problem::AppendItemsToDescription(const std::vector<Item>& items, const QString& forFile, int forLine, QString* text) {
   if (&items == &mItems && items.size() == 1 && items[0].children.empty()) {
     *text += " " + items[0].text.toHtmlEscaped();
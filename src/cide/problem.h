@@ -4,9 +4,11 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include <clang-c/Index.h>
+#include <QDataStream>
 #include <QString>
 
 #include "cide/document_range.h"
@@ -23,6 +25,24 @@ struct ProblemRange {
   int problemIndex;
 };
 
+/// The part of a problem range that lies within a single line, see
+/// Document::GetProblemLineSpans().
+struct ProblemLineSpan {
+  inline ProblemLineSpan(int line, int start, int end, int problemIndex, bool isError)
+      : line(line), start(start), end(end), problemIndex(problemIndex), isError(isError) {}
+  
+  int line;
+  
+  /// Character offsets of the start and the end (exclusive) of the span.
+  int start;
+  int end;
+  
+  int problemIndex;
+  
+  /// Whether the problem is an error (otherwise, it is a warning).
+  bool isError;
+};
+
 class Problem {
  public:
   enum class Type {
@@ -76,6 +96,20 @@ class Problem {
   
   QString GetFormattedDescription(const QString& forFile, int forLine);
   
+  /// Returns a hash of the problem's type, description items (including their
+  /// locations) and fix-it texts. Equal problems from two parses of a file
+  /// have equal hashes. The fix-it ranges are not included, since they get
+  /// adapted to edits.
+  std::size_t ContentHash() const;
+  
+  /// Writes the problem to @p stream, such that it can be restored with
+  /// Read() without the libclang diagnostic (see HighlightCache).
+  void Write(QDataStream* stream) const;
+  
+  /// Reads a problem that was written with Write(). Returns nullptr if the
+  /// stream does not contain a valid problem.
+  static std::shared_ptr<Problem> Read(QDataStream* stream);
+  
   inline Type type() const { return mType; }
   
   inline const std::vector<Item>& items() const { return mItems; }
@@ -84,6 +118,13 @@ class Problem {
   inline std::vector<FixIt>& fixits() { return fixIts; }
   
  private:
+  Problem() = default;
+  
+  static void WriteItems(const std::vector<Item>& items, QDataStream* stream);
+  static bool ReadItems(QDataStream* stream, std::vector<Item>* items);
+  
+  static void HashItems(const std::vector<Item>& items, std::size_t* hash);
+  
   void AppendItemsToDescription(const std::vector<Item>& items, const QString& forFile, int forLine, QString* text);
   
   void ExtractItem(CXDiagnostic diagnostic, CXTranslationUnit tu, const std::vector<unsigned>& lineOffsets, std::vector<Item>* items);
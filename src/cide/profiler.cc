@@ -0,0 +1,102 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/profiler.h"
+
+#include <atomic>
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+
+/// Maximum number of recorded spans. Further spans are dropped, such that
+/// a long session does not use up an unbounded amount of memory.
+constexpr int kMaxSpanCount = 1000 * 1000;
+
+bool Profiler::enabled = false;
+QString Profiler::traceDirectory;
+std::chrono::steady_clock::time_point Profiler::startTime;
+std::mutex Profiler::spansMutex;
+std::vector<Profiler::Span> Profiler::spans;
+
+void Profiler::Initialize() {
+  traceDirectory = QString::fromLocal8Bit(qgetenv("CIDE_PROFILE"));
+  enabled = !traceDirectory.isEmpty();
+  startTime = std::chrono::steady_clock::now();
+  if (enabled) {
+    spans.reserve(64 * 1024);
+    
+    // Assign thread ID 0 to the Qt thread.
+    CurrentThreadId();
+  }
+}
+
+void Profiler::AddSpan(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+  int threadId = CurrentThreadId();
+  
+  std::unique_lock<std::mutex> lock(spansMutex);
+  if (static_cast<int>(spans.size()) >= kMaxSpanCount) {
+    return;
+  }
+  spans.push_back(Span{name, threadId, start, end});
+}
+
+void Profiler::WriteTrace() {
+  if (!enabled) {
+    return;
+  }
+  
+  QDir(traceDirectory).mkpath(".");
+  QString path = QDir(traceDirectory).filePath(
+      QStringLiteral("cide_trace_%1.json").arg(QDateTime::currentDateTime().toString("yyyyMMdd_hhmmss")));
+  QFile file(path);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    qDebug() << "Profiler: Failed to write the trace file:" << path;
+    return;
+  }
+  
+  std::unique_lock<std::mutex> lock(spansMutex);
+  
+  // Write the spans as "complete" events with timestamps in microseconds.
+  // The span names are literals without characters that need escaping.
+  const qint64 pid = QCoreApplication::applicationPid();
+  QByteArray buffer;
+  buffer.reserve(1024 * 1024);
+  buffer += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  buffer += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + QByteArray::number(pid) +
+            ",\"tid\":0,\"args\":{\"name\":\"Qt thread\"}}";
+  for (const Span& span : spans) {
+    buffer += ",\n{\"name\":\"";
+    buffer += span.name;
+    buffer += "\",\"ph\":\"X\",\"pid\":";
+    buffer += QByteArray::number(pid);
+    buffer += ",\"tid\":";
+    buffer += QByteArray::number(span.threadId);
+    buffer += ",\"ts\":";
+    buffer += QByteArray::number(std::chrono::duration_cast<std::chrono::microseconds>(span.start - startTime).count());
+    buffer += ",\"dur\":";
+    buffer += QByteArray::number(std::chrono::duration_cast<std::chrono::microseconds>(span.end - span.start).count());
+    buffer += "}";
+    
+    if (buffer.size() >= 1024 * 1024) {
+      file.write(buffer);
+      buffer.clear();
+    }
+  }
+  buffer += "\n]}\n";
+  file.write(buffer);
+  
+  if (static_cast<int>(spans.size()) >= kMaxSpanCount) {
+    qDebug() << "Profiler: The maximum number of spans was reached, later spans were dropped.";
+  }
+  qDebug() << "Profiler: Wrote" << spans.size() << "spans to:" << path;
+}
+
+int Profiler::CurrentThreadId() {
+  static std::atomic<int> nextThreadId(0);
+  thread_local int threadId = nextThreadId ++;
+  return threadId;
+}
@@ -0,0 +1,89 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <QString>
+
+/// Records the time taken by operations in the background threads (and some
+/// operations in the Qt thread) if the environment variable CIDE_PROFILE is
+/// set to the path of a directory. At exit, the recorded spans are written to
+/// a file cide_trace_<date>_<time>.json in this directory, which uses the
+/// Chrome trace event format. It can be viewed with chrome://tracing or
+/// https://ui.perfetto.dev.
+///
+/// Spans are recorded with ProfilerScope. If profiling is disabled, this only
+/// costs a check of a boolean.
+class Profiler {
+ public:
+  /// Reads the environment variable. Must be called at the start of main(),
+  /// before any other thread is started.
+  static void Initialize();
+  
+  /// Writes the trace file (if profiling is enabled). Must be called after
+  /// all other threads exited.
+  static void WriteTrace();
+  
+  inline static bool IsEnabled() { return enabled; }
+  
+  /// Records a span with the given name, which must be a string literal (since
+  /// only the pointer is stored). Thread-safe.
+  static void AddSpan(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+  
+ private:
+  struct Span {
+    const char* name;
+    int threadId;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+  };
+  
+  /// Returns a small integer for the calling thread, which is used as its
+  /// thread ID in the trace.
+  static int CurrentThreadId();
+  
+  
+  static bool enabled;
+  static QString traceDirectory;
+  static std::chrono::steady_clock::time_point startTime;
+  
+  static std::mutex spansMutex;
+  static std::vector<Span> spans;
+};
+
+/// Records a span in the profiler from its construction to its destruction:
+///
+///   {
+///     ProfilerScope scope("Tokenize");
+///     ...
+///   }
+class ProfilerScope {
+ public:
+  inline ProfilerScope(const char* name)
+      : name(Profiler::IsEnabled() ? name : nullptr) {
+    if (this->name) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+  
+  inline ~ProfilerScope() {
+    End();
+  }
+  
+  /// Ends the span before the scope ends.
+  inline void End() {
+    if (name) {
+      Profiler::AddSpan(name, start, std::chrono::steady_clock::now());
+      name = nullptr;
+    }
+  }
+  
+ private:
+  const char* name;
+  std::chrono::steady_clock::time_point start;
+};
@@ -4,22 +4,37 @@
 
 #include "cide/project.h"
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
+#include <QDateTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QMessageBox>
 #include <QProcess>
 #include <QProgressDialog>
 #include <QtDebug>
 #include <yaml-cpp/yaml.h>
 
+#include "cide/build_dependencies.h"
+#include "cide/canonical_path_cache.h"
 #include "cide/clang_index.h"
 #include "cide/clang_utils.h"
 #include "cide/clang_parser.h"
+#include "cide/compiler_probe_cache.h"
 #include "cide/main_window.h"
 #include "cide/parse_thread_pool.h"
 #include "cide/qt_thread.h"
 #include "cide/settings.h"
 
+/// Source of the unique values of Project::fileIndexVersion.
+static unsigned int lastFileIndexVersion = 0;
+
 
 std::vector<QByteArray> CompileSettings::BuildCommandLineArgs(bool enableSpellCheck, const QString& filePath, const Project* project) const {
   std::vector<QByteArray> commandLineArgs;
@@ -105,6 +120,27 @@ std::vector<QByteArray> CompileSettings::BuildCommandLineArgs(bool enableSpellCh
   return commandLineArgs;
 }
 
+std::shared_ptr<const CompileCommandLine> CompileSettings::GetCommandLine(bool enableSpellCheck, const QString& filePath, const Project* project) const {
+  // Determine the file kind in the same way as BuildCommandLineArgs().
+  int fileKind;
+  if (filePath.endsWith(".cu", Qt::CaseInsensitive) ||
+      filePath.endsWith(".cuh", Qt::CaseInsensitive)) {
+    fileKind = 0;
+  } else if (filePath.endsWith(".h")) {
+    fileKind = 1;
+  } else {
+    fileKind = 2;
+  }
+  int entryIndex = (enableSpellCheck ? 3 : 0) + fileKind;
+  
+  std::shared_ptr<const CompileCommandLine>& entry = commandLineCache.entries[entryIndex];
+  if (!entry || commandLineCache.projects[entryIndex] != project) {
+    entry.reset(new CompileCommandLine(BuildCommandLineArgs(enableSpellCheck, filePath, project)));
+    commandLineCache.projects[entryIndex] = project;
+  }
+  return entry;
+}
+
 bool CompileSettings::operator== (const CompileSettings& other) {
   if (language != other.language) {
     return false;
@@ -125,26 +161,246 @@ bool CompileSettings::operator== (const CompileSettings& other) {
   return true;
 }
 
+std::size_t CompileSettings::Hash() const {
+  std::size_t hash = std::hash<int>()(static_cast<int>(language));
+  auto combine = [&hash](const std::vector<QString>& strings) {
+    hash ^= strings.size() + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    for (const QString& string : strings) {
+      hash ^= qHash(string) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+  };
+  combine(compileCommandFragments);
+  combine(includes);
+  combine(systemIncludes);
+  combine(defines);
+  return hash;
+}
 
-bool Target::ContainsOrIncludesFile(const QString& canonicalPath) const {
-  for (const SourceFile& source : sources) {
-    if (source.path == canonicalPath ||
-        source.includedPaths.count(canonicalPath) > 0) {
-      return true;
+std::shared_ptr<CompileSettings> CompileSettingsPool::Intern(const std::shared_ptr<CompileSettings>& settings) {
+  std::size_t hash = settings->Hash();
+  auto range = settingsByHash.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++ it) {
+    if (*it->second == *settings) {
+      return it->second;
+    }
+  }
+  settingsByHash.insert(std::make_pair(hash, settings));
+  return settings;
+}
+
+void CompileSettingsPool::RemoveUnused() {
+  for (auto it = settingsByHash.begin(); it != settingsByHash.end(); ) {
+    if (it->second.use_count() == 1) {
+      it = settingsByHash.erase(it);
+    } else {
+      ++ it;
     }
   }
-  return false;
 }
 
-QStringList Target::FindAllFilesThatInclude(const QString& canonicalPath) const {
-  QStringList result;
-  for (const SourceFile& source : sources) {
-    if (source.path == canonicalPath ||
-        source.includedPaths.count(canonicalPath) > 0) {
-      result << source.path;
+/// Determines canonical file paths with a cache per directory. Instead of
+/// resolving each path separately (which requires system calls for each path
+/// component), the canonical path of each directory is determined once, and
+/// its regular files (which are not symlinks) are listed once. The canonical
+/// paths of these files then follow directly. Other files fall back to the
+/// process-wide CanonicalPathCache.
+///
+/// This class is thread-safe.
+class CachingPathCanonicalizer {
+ public:
+  /// Returns the canonical path of the file with the given path, or an empty
+  /// string if the file does not exist.
+  QString CanonicalFilePath(const QString& path) {
+    QFileInfo info(path);
+    QString fileName = info.fileName();
+    std::shared_ptr<Directory> directory = GetDirectory(info.path());
+    if (directory->regularFiles.count(fileName) > 0) {
+      return directory->canonicalPathWithSlash + fileName;
     }
+    return CachedCanonicalFilePath(path);
   }
-  return result;
+  
+ private:
+  struct Directory {
+    /// Canonical path of the directory with a trailing slash, or empty if the
+    /// directory does not exist.
+    QString canonicalPathWithSlash;
+    
+    /// Names of the regular files in the directory that are not symlinks.
+    std::unordered_set<QString> regularFiles;
+  };
+  
+  std::shared_ptr<Directory> GetDirectory(const QString& path) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = directories.find(path);
+    if (it != directories.end()) {
+      return it->second;
+    }
+    lock.unlock();
+    
+    // List the directory without holding the lock. If another thread lists it
+    // in the meantime, both produce the same result.
+    std::shared_ptr<Directory> directory(new Directory());
+    QString canonicalPath = QFileInfo(path).canonicalFilePath();
+    if (!canonicalPath.isEmpty()) {
+      directory->canonicalPathWithSlash = canonicalPath.endsWith('/') ? canonicalPath : (canonicalPath + '/');
+      QStringList fileNames = QDir(canonicalPath).entryList(QDir::Files | QDir::NoSymLinks | QDir::Hidden | QDir::System);
+      directory->regularFiles.reserve(fileNames.size());
+      for (const QString& fileName : fileNames) {
+        directory->regularFiles.insert(fileName);
+      }
+    }
+    
+    lock.lock();
+    return directories.insert(std::make_pair(path, directory)).first->second;
+  }
+  
+  std::unordered_map<QString, std::shared_ptr<Directory>> directories;
+  std::mutex mutex;
+};
+
+/// A target loaded from its CMake file API reply file.
+struct LoadedTarget {
+  Target target;
+  
+  /// IDs of the targets that this target depends on.
+  std::vector<QString> dependencyIds;
+  
+  bool success = false;
+  QString errorReason;
+};
+
+/// Loads the target reply file of the CMake file API at @p targetJsonFile.
+/// On failure, sets result->success to false and result->errorReason to the
+/// error. This is called on worker threads, so it must not use Qt's GUI
+/// classes.
+static void LoadTargetReplyFile(
+    const QString& targetJsonFile,
+    const QDir& projectDir,
+    const QDir& projectCMakeDir,
+    const std::vector<QString>& cDefaultIncludes,
+    const std::vector<QString>& cxxDefaultIncludes,
+    CachingPathCanonicalizer* canonicalizer,
+    LoadedTarget* result) {
+  QFile file(targetJsonFile);
+  if (!file.open(QIODevice::ReadOnly)) {
+    result->errorReason = QObject::tr("Cannot read target reply file: %1").arg(targetJsonFile);
+    return;
+  }
+  QJsonParseError parseError;
+  QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+  if (!document.isObject()) {
+    result->errorReason = QObject::tr("Cannot parse target reply file: %1 (%2).").arg(targetJsonFile).arg(parseError.errorString());
+    return;
+  }
+  QJsonObject targetObject = document.object();
+  Target& newTarget = result->target;
+  
+  QString type = targetObject.value(QStringLiteral("type")).toString();
+  if (type == QStringLiteral("EXECUTABLE")) {
+    newTarget.type = Target::Type::Executable;
+  } else if (type == QStringLiteral("STATIC_LIBRARY")) {
+    newTarget.type = Target::Type::StaticLibrary;
+  } else if (type == QStringLiteral("SHARED_LIBRARY")) {
+    newTarget.type = Target::Type::SharedLibrary;
+  } else if (type == QStringLiteral("MODULE_LIBRARY")) {
+    newTarget.type = Target::Type::ModuleLibrary;
+  } else if (type == QStringLiteral("OBJECT_LIBRARY")) {
+    newTarget.type = Target::Type::ObjectLibrary;
+  } else if (type == QStringLiteral("UTILITY")) {
+    newTarget.type = Target::Type::Utility;
+  } else {
+    qDebug() << "Error: Encountered unknown value" << type << "for a CMake target type";
+    newTarget.type = Target::Type::Unknown;
+  }
+  
+  QString targetBuildFolder = targetObject.value(QStringLiteral("paths")).toObject().value(QStringLiteral("build")).toString();
+  QDir targetBuildDir;
+  if (!targetBuildFolder.isEmpty() && targetBuildFolder[0] == '.') {
+    // Path is relative to build dir
+    targetBuildDir = projectCMakeDir;
+    targetBuildDir.cd(targetBuildFolder);
+  } else {
+    // Path is absolute.
+    targetBuildDir = QDir(targetBuildFolder);
+  }
+  
+  if (newTarget.type != Target::Type::Utility) {
+    newTarget.path = targetBuildDir.filePath(targetObject.value(QStringLiteral("nameOnDisk")).toString());
+  }
+  newTarget.buildDirPath = targetBuildDir.path();
+  newTarget.sourceDirPath = QFileInfo(projectDir.filePath(targetObject.value(QStringLiteral("paths")).toObject().value(QStringLiteral("source")).toString())).canonicalFilePath();
+  
+  newTarget.id = targetObject.value(QStringLiteral("id")).toString();
+  
+  QJsonArray dependenciesArray = targetObject.value(QStringLiteral("dependencies")).toArray();
+  result->dependencyIds.reserve(dependenciesArray.size());
+  for (const QJsonValue& dependency : dependenciesArray) {
+    result->dependencyIds.push_back(dependency.toObject().value(QStringLiteral("id")).toString());
+  }
+  
+  QJsonArray sourcesArray = targetObject.value(QStringLiteral("sources")).toArray();
+  newTarget.sources.reserve(sourcesArray.size());
+  for (const QJsonValue& sourceValue : sourcesArray) {
+    QJsonObject sourceObject = sourceValue.toObject();
+    QJsonValue compileGroupIndexValue = sourceObject.value(QStringLiteral("compileGroupIndex"));
+    if (!compileGroupIndexValue.isDouble()) {
+      continue;
+    }
+    QString canonicalPath = canonicalizer->CanonicalFilePath(projectDir.filePath(sourceObject.value(QStringLiteral("path")).toString()));
+    if (canonicalPath.isEmpty()) {
+      // TODO: This probably happens for generated files which don't exist (yet)?
+      //       Should we keep them?
+      continue;
+    }
+    newTarget.sources.emplace_back();
+    SourceFile& newSource = newTarget.sources.back();
+    newSource.path = canonicalPath;
+    newSource.compileSettingsIndex = compileGroupIndexValue.toInt();
+  }
+  
+  QJsonArray compileGroupsArray = targetObject.value(QStringLiteral("compileGroups")).toArray();
+  newTarget.compileSettings.reserve(compileGroupsArray.size());
+  for (const QJsonValue& settingsValue : compileGroupsArray) {
+    QJsonObject settingsObject = settingsValue.toObject();
+    
+    newTarget.compileSettings.emplace_back(new CompileSettings());
+    CompileSettings& newSettings = *newTarget.compileSettings.back();
+    
+    QString language = settingsObject.value(QStringLiteral("language")).toString();
+    if (language == QStringLiteral("C")) {
+      newSettings.language = CompileSettings::Language::C;
+      newSettings.systemIncludes.insert(newSettings.systemIncludes.end(), cDefaultIncludes.begin(), cDefaultIncludes.end());
+    } else if (language == QStringLiteral("CXX")) {
+      newSettings.language = CompileSettings::Language::CXX;
+      newSettings.systemIncludes.insert(newSettings.systemIncludes.end(), cxxDefaultIncludes.begin(), cxxDefaultIncludes.end());
+    } else {
+      newSettings.language = CompileSettings::Language::Other;
+    }
+    
+    for (const QJsonValue& fragmentValue : settingsObject.value(QStringLiteral("compileCommandFragments")).toArray()) {
+      QStringList fragments = fragmentValue.toObject().value(QStringLiteral("fragment")).toString().split(QChar(' '), QString::SplitBehavior::SkipEmptyParts);
+      for (const QString& fragment : fragments) {
+        newSettings.compileCommandFragments.emplace_back(fragment);
+      }
+    }
+    
+    for (const QJsonValue& includeValue : settingsObject.value(QStringLiteral("includes")).toArray()) {
+      QJsonObject includeObject = includeValue.toObject();
+      QString path = includeObject.value(QStringLiteral("path")).toString();
+      if (includeObject.value(QStringLiteral("isSystem")).toBool(false)) {
+        newSettings.systemIncludes.emplace_back(path);
+      } else {
+        newSettings.includes.emplace_back(path);
+      }
+    }
+    
+    for (const QJsonValue& defineValue : settingsObject.value(QStringLiteral("defines")).toArray()) {
+      newSettings.defines.emplace_back(defineValue.toObject().value(QStringLiteral("define")).toString());
+    }
+  }
+  
+  result->success = true;
 }
 
 
@@ -157,9 +413,12 @@ Project::~Project() {
   // Clean up loaded targets.
   RunInQtThreadBlocking([&]() {
     USRStorage::Instance().Lock();
+    std::vector<QString> includedPaths;
     for (Target& oldTarget : targets) {
       for (SourceFile& oldSource : oldTarget.sources) {
-        for (const QString& path : oldSource.includedPaths) {
+        includedPaths.clear();
+        oldSource.GetIncludedPaths(&includedPaths);
+        for (const QString& path : includedPaths) {
           USRStorage::Instance().RemoveUSRMapReference(path);
         }
       }
@@ -364,6 +623,9 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   // This uses the CMake file API. See:
   // https://cmake.org/cmake/help/latest/manual/cmake-file-api.7.html
   
+  // Files may have been moved since the last configuration.
+  CanonicalPathCache::Instance().Invalidate();
+  
   // Clear watcher.
   if (!cmakeFileWatcher.files().isEmpty()) {
     cmakeFileWatcher.removePaths(cmakeFileWatcher.files());
@@ -385,37 +647,13 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   QString cmakeExecutable = "cmake";  // default if not found in CMakeCache.txt
   ExtractCMakeCommandFromCache(projectCMakeDir.filePath("CMakeCache.txt"), &cmakeExecutable);
   
-  // Ensure that the CMake binary that we got is at least version 3.14.
-  // If we got an older version, running the configuration will potentially work just fine,
-  // but the API responses will (if they already exist) silently not get updated. Thus,
-  // we explicitly warn here in this case to prevent confusion.
-  std::shared_ptr<QProcess> cmakeVersionTestProcess(new QProcess());
-  QStringList versionTestArguments;
-  versionTestArguments << "--version";
-  cmakeVersionTestProcess->start(cmakeExecutable, versionTestArguments);
-  cmakeVersionTestProcess->waitForFinished(10000);
+  // Skip running CMake if its file API replies are still up-to-date with
+  // respect to all of its input files. Running CMake may take a long time for
+  // large projects.
+  bool cmakeRepliesAreUpToDate = !mayRequireReconfiguration && CMakeFileAPIRepliesAreUpToDate();
   
-  // Example first line output from CMake: cmake version 2.8.12.2
-  QString firstLine = cmakeVersionTestProcess->readLine();
-  QStringList versionWords = firstLine.trimmed().split(' ', QString::SkipEmptyParts);
-  if (versionWords.size() >= 3 &&
-      versionWords[0] == "cmake" &&
-      versionWords[1] == "version") {
-    QString cmakeVersionString = versionWords[2];
-    QStringList cmakeVersionNumberParts = cmakeVersionString.split('.');
-    bool versionIsAtLeast3_14 = false;
-    if (cmakeVersionNumberParts.size() == 1) {
-      versionIsAtLeast3_14 = cmakeVersionNumberParts[0].toInt() >= 4;
-    } else if (cmakeVersionNumberParts.size() >= 2) {
-      versionIsAtLeast3_14 =
-          cmakeVersionNumberParts[0].toInt() >= 4 ||
-          (cmakeVersionNumberParts[0].toInt() == 3 && cmakeVersionNumberParts[1].toInt() >= 14);
-    }
-    if (!versionIsAtLeast3_14) {
-      QMessageBox::warning(parent, tr("CMake version too old"), tr("The version of the CMake binary used for configuring (%1) is too old. At least version 3.14 is required for CIDE, since it uses the CMake file API.").arg(cmakeVersionString));
-    }
-  } else {
-    QMessageBox::warning(parent, tr("Cannot determine CMake version"), tr("Failed to parse the CMake version, thus cannot determine whether it is supported by CIDE. Continuing, but be aware that building might not work. The first line in the output of cmake --version is: %1").arg(firstLine));
+  if (!cmakeRepliesAreUpToDate) {
+    WarnIfCMakeVersionIsUnsupported(cmakeExecutable, parent);
   }
   
   // Start the progress dialog. It seems that this interferes with the QMessageBoxes that might be shown
@@ -425,55 +663,10 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   progress.setValue(0);
   progress.setWindowModality(Qt::WindowModal);
   
-  // Run CMake
-  std::shared_ptr<QProcess> cmakeProcess(new QProcess());
-  QStringList arguments;
-#ifdef WIN32
-  // On Windows, we force the use of the Ninja generator for new build directories, since
-  // it is the only supported one and the default is probably Visual Studio.
-  // (On Linux, the default is probably make, which is fine since we support it.)
-  // 
-  // We also force the use of clang-cl in order to get a configuration that
-  // CIDE is able to build.
-  if (!QFile(projectCMakeDir.filePath("CMakeCache.txt")).exists()) {
-    arguments << "-G";
-    arguments << "Ninja";
-    arguments << "-DCMAKE_C_COMPILER=clang-cl.exe";
-    arguments << "-DCMAKE_CXX_COMPILER=clang-cl.exe";
-  }
-#endif
-  arguments << projectDir.absolutePath();
-  // qDebug() << "CMake call:" << cmakeExecutable << arguments;
-  cmakeProcess->setWorkingDirectory(projectCMakeDir.path());
-  std::atomic<bool> cmakeProcessFinished;
-  cmakeProcessFinished = false;
-  connect(cmakeProcess.get(), QOverload<int>::of(&QProcess::finished), [&]() {
-    cmakeProcessFinished = true;
-  });
-  cmakeProcess->start(cmakeExecutable, arguments);
-  
   QEventLoop eventLoop;
-  while (!cmakeProcessFinished) {
-    progress.setValue(0);
-    eventLoop.processEvents();
-    QThread::msleep(10);
-    if (progress.wasCanceled()) {
-      cmakeProcess->kill();
-      *errorReason = QObject::tr("The process was canceled by the user.");
-      return false;
-    }
-  }
-  
-  if (cmakeProcess->exitStatus() != QProcess::NormalExit) {
-    *errorReason = QObject::tr("The CMake process exited abnormally.");
-    return false;
-  }
-  if (cmakeProcess->exitCode() != 0) {
-    cmakeProcess->setReadChannel(QProcess::StandardError);
-    *errorReason = QObject::tr("The CMake process exited with exit code: %1. Process output:\n\n%2").arg(cmakeProcess->exitCode()).arg(QString::fromLocal8Bit(cmakeProcess->readAll()));
+  if (!cmakeRepliesAreUpToDate && !RunCMake(cmakeExecutable, &progress, errorReason)) {
     return false;
   }
-  cmakeProcess.reset();
   
   // Verify that the reply directory exists.
   QDir replyIndexDir = projectCMakeDir;
@@ -629,165 +822,102 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   
   // TODO: Ignoring the CMake projects for now. We could associate each target with a CMake project.
   
+  // Load the reply files of the targets in parallel. This is done before
+  // replacing the old targets, such that they remain intact if loading fails.
+  YAML::Node targetsNode = configurationNode["targets"];
+  QDir codemodelReplyDir = QFileInfo(codemodelReplyPath).dir();
+  std::vector<QString> targetNames(targetsNode.size());
+  std::vector<QString> targetJsonFiles(targetsNode.size());
+  for (int targetIndex = 0; targetIndex < targetsNode.size(); ++ targetIndex) {
+    YAML::Node targetNode = targetsNode[targetIndex];
+    targetNames[targetIndex] = QString::fromStdString(targetNode["name"].as<std::string>());
+    targetJsonFiles[targetIndex] = codemodelReplyDir.filePath(QString::fromStdString(targetNode["jsonFile"].as<std::string>()));
+  }
+  
+  std::vector<LoadedTarget> loadedTargets(targetJsonFiles.size());
+  CachingPathCanonicalizer canonicalizer;
+  std::atomic<int> nextTargetIndex;
+  nextTargetIndex = 0;
+  std::atomic<int> numLoadedTargets;
+  numLoadedTargets = 0;
+  std::atomic<bool> loadingCanceled;
+  loadingCanceled = false;
+  auto loadTargets = [&]() {
+    while (!loadingCanceled) {
+      int targetIndex = nextTargetIndex++;
+      if (targetIndex >= targetJsonFiles.size()) {
+        return;
+      }
+      LoadTargetReplyFile(targetJsonFiles[targetIndex], projectDir, projectCMakeDir, cDefaultIncludes, cxxDefaultIncludes, &canonicalizer, &loadedTargets[targetIndex]);
+      ++ numLoadedTargets;
+    }
+  };
+  int threadCount = std::min<int>(std::max<int>(1, std::thread::hardware_concurrency()), targetJsonFiles.size());
+  std::vector<std::thread> loadingThreads;
+  for (int i = 0; i < threadCount; ++ i) {
+    loadingThreads.emplace_back(loadTargets);
+  }
+  
+  // Keep the UI responsive while the targets are loaded.
+  progress.setLabelText(tr("Loading the project targets ..."));
+  progress.setMaximum(targetJsonFiles.size());
+  while (numLoadedTargets < targetJsonFiles.size()) {
+    progress.setValue(numLoadedTargets);
+    eventLoop.processEvents();
+    QThread::msleep(10);
+    if (progress.wasCanceled()) {
+      loadingCanceled = true;
+      break;
+    }
+  }
+  for (std::thread& thread : loadingThreads) {
+    thread.join();
+  }
+  if (loadingCanceled) {
+    *errorReason = QObject::tr("The process was canceled by the user.");
+    return false;
+  }
+  for (const LoadedTarget& loadedTarget : loadedTargets) {
+    if (!loadedTarget.success) {
+      *errorReason = loadedTarget.errorReason;
+      return false;
+    }
+  }
+  
   // Load targets, sources, and compile settings.
   std::vector<Target> oldTargets;
   oldTargets.swap(targets);
+  sourcesByFile.clear();
+  filesByBaseName.clear();
+  sourcesSortedByPath.clear();
+  fileIndexVersion = ++ lastFileIndexVersion;
   
-  std::vector<std::vector<QString>> targetDependencies;
-  YAML::Node targetsNode = configurationNode["targets"];
   std::unordered_map<QString, int> idToTargetIndex;
   
   std::unordered_multimap<QString, std::pair<int, int>> pathToTargetAndSourceIndex;
   
-  for (int targetIndex = 0; targetIndex < targetsNode.size(); ++ targetIndex) {
-    YAML::Node targetNode = targetsNode[targetIndex];
-    
-    targets.emplace_back();
+  targets.reserve(loadedTargets.size());
+  for (int targetIndex = 0; targetIndex < loadedTargets.size(); ++ targetIndex) {
+    targets.emplace_back(std::move(loadedTargets[targetIndex].target));
     Target& newTarget = targets.back();
-    newTarget.name = QString::fromStdString(targetNode["name"].as<std::string>());
-    
-    targetDependencies.emplace_back();
-    std::vector<QString>& newTargetDependencies = targetDependencies.back();
-    
-    // qDebug("Loading target: %s", newTarget.name.toStdString().c_str());
-    
-    QString targetJsonFile = QFileInfo(codemodelReplyPath).dir().filePath(QString::fromStdString(targetNode["jsonFile"].as<std::string>()));
-    
-    // Load target JSON file
-    YAML::Node targetFileNode = YAML::LoadFile(targetJsonFile.toStdString());
-    if (targetFileNode.IsNull()) {
-      *errorReason = QObject::tr("Cannot parse target reply file: %1 (YAML parser failed).").arg(targetJsonFile);
-      return false;
-    }
-    
-    std::string type = targetFileNode["type"].as<std::string>();
-    // qDebug() << "- type:" << QString::fromStdString(type);
-    if (type == "EXECUTABLE") {
-      newTarget.type = Target::Type::Executable;
-    } else if (type == "STATIC_LIBRARY") {
-      newTarget.type = Target::Type::StaticLibrary;
-    } else if (type == "SHARED_LIBRARY") {
-      newTarget.type = Target::Type::SharedLibrary;
-    } else if (type == "MODULE_LIBRARY") {
-      newTarget.type = Target::Type::ModuleLibrary;
-    } else if (type == "OBJECT_LIBRARY") {
-      newTarget.type = Target::Type::ObjectLibrary;
-    } else if (type == "UTILITY") {
-      newTarget.type = Target::Type::Utility;
-    } else {
-      qDebug() << "Error: Encountered unknown value" << QString::fromStdString(type) << "for a CMake target type";
-      newTarget.type = Target::Type::Unknown;
-    }
+    newTarget.name = targetNames[targetIndex];
     
-    QString targetBuildFolder = QString::fromStdString(targetFileNode["paths"]["build"].as<std::string>());
-    QDir targetBuildDir;
-    if (!targetBuildFolder.isEmpty() && targetBuildFolder[0] == '.') {
-      // Path is relative to build dir
-      targetBuildDir = projectCMakeDir;
-      targetBuildDir.cd(targetBuildFolder);
-    } else {
-      // Path is absolute.
-      targetBuildDir = QDir(targetBuildFolder);
+    // Special case handling: If there is no run command set yet, we set it to
+    // the path of the first executable target.
+    if (runCmd.isEmpty() && newTarget.type == Target::Type::Executable) {
+      runCmd = runDir.relativeFilePath(newTarget.path);
     }
     
-    if (type != "UTILITY") {
-      QString targetPath = targetBuildDir.filePath(QString::fromStdString(targetFileNode["nameOnDisk"].as<std::string>()));
-      // qDebug() << "- path:" << targetPath;
-      newTarget.path = targetPath;
-      
-      // Special case handling: If there is no run command set yet, we set it to
-      // the path of the first executable target.
-      if (runCmd.isEmpty() && newTarget.type == Target::Type::Executable) {
-        runCmd = runDir.relativeFilePath(newTarget.path);
-      }
+    // Share the compile settings with equal ones of other targets (and of the
+    // old targets, such that their cached command lines remain in use).
+    for (std::shared_ptr<CompileSettings>& settings : newTarget.compileSettings) {
+      settings = compileSettingsPool.Intern(settings);
     }
     
-    newTarget.id = QString::fromStdString(targetFileNode["id"].as<std::string>());
     idToTargetIndex[newTarget.id] = targetIndex;
     
-    YAML::Node dependenciesNode = targetFileNode["dependencies"];
-    for (int i = 0; i < dependenciesNode.size(); ++ i) {
-      newTargetDependencies.push_back(QString::fromStdString(dependenciesNode[i]["id"].as<std::string>()));
-    }
-    
-    YAML::Node sourcesNode = targetFileNode["sources"];
-    for (int i = 0; i < sourcesNode.size(); ++ i) {
-      YAML::Node sourceNode = sourcesNode[i];
-      newTarget.sources.emplace_back();
-      SourceFile& newSource = newTarget.sources.back();
-      newSource.path = QFileInfo(projectDir.filePath(QString::fromStdString(sourceNode["path"].as<std::string>()))).canonicalFilePath();
-      if (newSource.path.isEmpty()) {
-        // TODO: This probably happens for generated files which don't exist (yet)?
-        //       Should we keep them?
-        newTarget.sources.pop_back();
-        continue;
-      }
-      // qDebug() << "- source file:" << newSource.path;
-      YAML::Node compileGroupIndexNode = sourceNode["compileGroupIndex"];
-      if (compileGroupIndexNode.IsScalar()) {
-        newSource.compileSettingsIndex = compileGroupIndexNode.as<int>();
-        // qDebug() << "  using compile settings:" << newSource.compileSettingsIndex;
-      } else {
-        newTarget.sources.pop_back();
-        continue;
-      }
-      pathToTargetAndSourceIndex.insert(std::make_pair(newSource.path, std::make_pair(targets.size() - 1, newTarget.sources.size() - 1)));
-    }
-    
-    YAML::Node compileGroupsNode = targetFileNode["compileGroups"];
-    for (int settingsIdx = 0; settingsIdx < compileGroupsNode.size(); ++ settingsIdx) {
-      YAML::Node settingsNode = compileGroupsNode[settingsIdx];
-      // qDebug() << "Compile settings:" << settingsIdx;
-      
-      newTarget.compileSettings.emplace_back();
-      CompileSettings& newSettings = newTarget.compileSettings.back();
-      
-      std::string language = settingsNode["language"].as<std::string>();
-      if (language == "C") {
-        newSettings.language = CompileSettings::Language::C;
-        newSettings.systemIncludes.insert(newSettings.systemIncludes.end(), cDefaultIncludes.begin(), cDefaultIncludes.end());
-      } else if (language == "CXX") {
-        newSettings.language = CompileSettings::Language::CXX;
-        newSettings.systemIncludes.insert(newSettings.systemIncludes.end(), cxxDefaultIncludes.begin(), cxxDefaultIncludes.end());
-      } else {
-        newSettings.language = CompileSettings::Language::Other;
-      }
-      // qDebug() << "- language:" << QString::fromStdString(language);
-      
-      YAML::Node compileCommandNode = settingsNode["compileCommandFragments"];
-      if (compileCommandNode.IsSequence()) {
-        for (int c = 0; c < compileCommandNode.size(); ++ c) {
-          QStringList fragments = QString::fromStdString(compileCommandNode[c]["fragment"].as<std::string>()).split(QChar(' '), QString::SplitBehavior::SkipEmptyParts);
-          for (const QString& fragment : fragments) {
-            newSettings.compileCommandFragments.emplace_back(fragment);
-            // qDebug() << "- compile command fragment:" << newSettings.compileCommandFragments.back();
-          }
-        }
-      }
-      
-      YAML::Node includesNode = settingsNode["includes"];
-      if (includesNode.IsSequence()) {
-        for (int c = 0; c < includesNode.size(); ++ c) {
-          QString path = QString::fromStdString(includesNode[c]["path"].as<std::string>());
-          YAML::Node systemIncludeNode = includesNode[c]["isSystem"];
-          if (systemIncludeNode.IsDefined() && systemIncludeNode.as<bool>() == true) {
-            newSettings.systemIncludes.emplace_back(path);
-            // qDebug() << "- system include:" << newSettings.systemIncludes.back();
-          } else {
-            newSettings.includes.emplace_back(path);
-            // qDebug() << "- include:" << newSettings.includes.back();
-          }
-        }
-      }
-      
-      YAML::Node definesNode = settingsNode["defines"];
-      if (definesNode.IsSequence()) {
-        for (int c = 0; c < definesNode.size(); ++ c) {
-          newSettings.defines.emplace_back(
-              QString::fromStdString(definesNode[c]["define"].as<std::string>()));
-          // qDebug() << "- define:" << newSettings.defines.back();
-        }
-      }
+    for (int sourceIndex = 0; sourceIndex < newTarget.sources.size(); ++ sourceIndex) {
+      pathToTargetAndSourceIndex.insert(std::make_pair(newTarget.sources[sourceIndex].path, std::make_pair(targetIndex, sourceIndex)));
     }
   }
   
@@ -795,7 +925,7 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   for (int targetIndex = 0; targetIndex < targets.size(); ++ targetIndex) {
     std::vector<Target*>& dependencies = targets[targetIndex].dependencies;
     
-    for (const QString& dependsOnId : targetDependencies[targetIndex]) {
+    for (const QString& dependsOnId : loadedTargets[targetIndex].dependencyIds) {
       auto it = idToTargetIndex.find(dependsOnId);
       if (it == idToTargetIndex.end()) {
         qDebug() << "ERROR: Cannot find target dependency with ID" << dependsOnId;
@@ -807,14 +937,18 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   
   // Clean up oldTargets, while taking over as much information as possible into
   // the new targets: SourceFile with the same path and compile settings are
-  // retained.
+  // retained, such that only the sources whose settings changed get indexed
+  // again by IndexAllNewFiles(). Since the old and new compile settings are
+  // interned with the same pool, equal settings are the same instance.
   USRStorage::Instance().Lock();
+  std::vector<QString> includedPaths;
   for (Target& oldTarget : oldTargets) {
     for (SourceFile& oldSource : oldTarget.sources) {
-      // qDebug() << "Considering old source for info transfer:" << oldSource.path << " (pathToTargetAndSourceIndex.size(): " << pathToTargetAndSourceIndex.size() << ")";
-      
-      // Look for new source files to transfer the information over.
+      // Look for new source files to transfer the information over. The
+      // information is moved to the first matching file and copied from there
+      // to any further ones.
       int numFilesThatInfoWasTransferredTo = 0;
+      SourceFile* firstReceiver = nullptr;
       
       auto range = pathToTargetAndSourceIndex.equal_range(oldSource.path);
       for (auto it = range.first; it != range.second; ++ it) {
@@ -828,8 +962,12 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
         if (oldTarget.compileSettings[oldSource.compileSettingsIndex] ==
             newTarget.compileSettings[newSource.compileSettingsIndex]) {
           // Transfer the information
-          oldSource.TransferInformationTo(&newSource);
-          // qDebug() << "Transferring info to new source file";
+          if (firstReceiver) {
+            firstReceiver->TransferInformationTo(&newSource);
+          } else {
+            oldSource.MoveInformationTo(&newSource);
+            firstReceiver = &newSource;
+          }
           
           ++ numFilesThatInfoWasTransferredTo;
           it->second.first = -1;  // mark as having received information
@@ -837,13 +975,19 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
       }
       
       // Adjust the reference count to the included files in USRStorage
+      if (numFilesThatInfoWasTransferredTo == 1) {
+        continue;
+      }
+      includedPaths.clear();
       if (numFilesThatInfoWasTransferredTo == 0) {
-        for (const QString& path : oldSource.includedPaths) {
+        oldSource.GetIncludedPaths(&includedPaths);
+        for (const QString& path : includedPaths) {
           USRStorage::Instance().RemoveUSRMapReference(path);
         }
-      } else if (numFilesThatInfoWasTransferredTo > 1) {
+      } else {
+        firstReceiver->GetIncludedPaths(&includedPaths);
         for (int i = 1; i < numFilesThatInfoWasTransferredTo; ++ i) {
-          for (const QString& path : oldSource.includedPaths) {
+          for (const QString& path : includedPaths) {
             USRStorage::Instance().AddUSRMapReference(path);
           }
         }
@@ -852,7 +996,14 @@ bool Project::Configure(QString* errorReason, QWidget* parent) {
   }
   USRStorage::Instance().Unlock();
   
+  oldTargets.clear();
+  compileSettingsPool.RemoveUnused();
+  
+  SeedIncludedPathsFromBuildDependencies();
+  RebuildFileIndex();
+  
   mayRequireReconfiguration = false;
+  UpdateContentIndexFiles();
   emit ProjectConfigured();
   return true;
 }
@@ -878,112 +1029,249 @@ int Project::IndexAllNewFiles(MainWindow* mainWindow) {
   return numRequestsCreated;
 }
 
-bool Project::ContainsFile(const QString& canonicalPath) {
-  // TODO: Enter file paths into an unordered_map for faster lookup?
+int Project::ReindexSourcesThatInclude(const QString& canonicalPath, const QString& prioritizedTargetName, MainWindow* mainWindow) {
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return 0;
+  }
   
-  for (Target& target : targets) {
-    for (SourceFile& source : target.sources) {
-      if (source.path == canonicalPath) {
-        return true;
-      }
+  // A source may be part of multiple targets, so de-duplicate the paths. A
+  // source that is itself the given file does not need to be indexed again
+  // because of it.
+  std::vector<QString> paths;
+  std::unordered_map<QString, bool> isInPrioritizedTarget;
+  for (const auto& item : it->second) {
+    const SourceFile* source = item.second;
+    if (source->compileSettingsIndex < 0 ||
+        source->path == canonicalPath) {
+      continue;
+    }
+    bool inPrioritizedTarget = item.first->name == prioritizedTargetName;
+    auto result = isInPrioritizedTarget.insert(std::make_pair(source->path, inPrioritizedTarget));
+    if (result.second) {
+      paths.push_back(source->path);
+    } else if (inPrioritizedTarget) {
+      result.first->second = true;
     }
   }
   
-  return false;
+  auto prioritizedEnd = std::stable_partition(paths.begin(), paths.end(), [&](const QString& path) {
+    return isInPrioritizedTarget[path];
+  });
+  return ParseThreadPool::Instance().RequestReindex(paths, prioritizedEnd - paths.begin(), mainWindow);
 }
 
-bool Project::ContainsFileOrInclude(const QString& canonicalPath, Target** target) {
-  // TODO: Enter file paths into an unordered_map for faster lookup?
-  
-  for (Target& testTarget : targets) {
-    if (testTarget.ContainsOrIncludesFile(canonicalPath)) {
-      if (target) {
-        *target = &testTarget;
-      }
+bool Project::ContainsFile(const QString& canonicalPath) {
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return false;
+  }
+  for (const auto& item : it->second) {
+    if (item.second->path == canonicalPath) {
       return true;
     }
   }
-  
   return false;
 }
 
+bool Project::ContainsFileOrInclude(const QString& canonicalPath, Target** target) {
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return false;
+  }
+  if (target) {
+    // Return the first target in the targets vector for consistency.
+    *target = it->second.front().first;
+    for (const auto& item : it->second) {
+      *target = std::min(*target, item.first);
+    }
+  }
+  return true;
+}
+
 SourceFile * Project::GetSourceFile(const QString& canonicalPath) {
-  // TODO: Enter file paths into an unordered_map for faster lookup?
+  return FindSourceThatIsOrIncludes(canonicalPath, /*requireEqualPath*/ true).second;
+}
+
+void Project::FindTargetsThatContainOrInclude(const QString& canonicalPath, std::vector<const Target*>* result) const {
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return;
+  }
+  std::size_t firstNewTarget = result->size();
+  for (const auto& item : it->second) {
+    if (std::find(result->begin() + firstNewTarget, result->end(), item.first) == result->end()) {
+      result->push_back(item.first);
+    }
+  }
+}
+
+void Project::FindAllFilesThatInclude(const QString& canonicalPath, std::unordered_set<QString>* result) const {
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return;
+  }
+  for (const auto& item : it->second) {
+    result->insert(item.second->path);
+  }
+}
+
+bool Project::GetCompileFileBuildArguments(const QString& canonicalPath, bool useNinja, QString* compiledSourcePath, QStringList* arguments) const {
+  std::pair<Target*, SourceFile*> match = FindSourceThatIsOrIncludes(canonicalPath, /*requireEqualPath*/ false);
+  if (!match.second) {
+    return false;
+  }
+  *compiledSourcePath = match.second->path;
+  arguments->clear();
   
-  for (Target& target : targets) {
-    for (SourceFile& source : target.sources) {
-      if (source.path == canonicalPath) {
-        return &source;
+  if (useNinja) {
+    // The "^" suffix makes ninja build the first output that has the file as
+    // an input, which is the file's object file.
+    arguments->push_back(match.second->path + QStringLiteral("^"));
+    return true;
+  }
+  
+  // The Makefiles generated by CMake have a target for each object file in
+  // the build directory of the CMakeLists.txt that defines the object's
+  // target. It is named after the path of the source relative to the source
+  // directory of that CMakeLists.txt, with the extension replaced by ".o".
+  if (match.first->sourceDirPath.isEmpty() || match.first->buildDirPath.isEmpty()) {
+    return false;
+  }
+  QString relativePath = QDir(match.first->sourceDirPath).relativeFilePath(match.second->path);
+  if (relativePath.startsWith(QStringLiteral("../"))) {
+    return false;
+  }
+  QString suffix = QFileInfo(relativePath).suffix();
+  if (!suffix.isEmpty()) {
+    relativePath.chop(suffix.size() + 1);
+  }
+  arguments->push_back(QStringLiteral("-C"));
+  arguments->push_back(match.first->buildDirPath);
+  arguments->push_back(relativePath + QStringLiteral(".o"));
+  return true;
+}
+
+void Project::IncludedPathsChanged(SourceFile* source, const std::vector<int>& oldIncludedFileIds) {
+  // Find the target of the source file.
+  Target* target = nullptr;
+  auto it = sourcesByFile.find(source->path);
+  if (it != sourcesByFile.end()) {
+    for (const auto& item : it->second) {
+      if (item.second == source) {
+        target = item.first;
+        break;
       }
     }
   }
-  
-  return nullptr;
+  if (!target) {
+    qDebug() << "Error: Project::IncludedPathsChanged() called for a source file that is not in the file index:" << source->path;
+    return;
+  }
+  
+  // Since both ID lists are sorted, the changes can be determined by merging
+  // them. Note: The reference of the source file to its own path is independent
+  // of its inclusions.
+  std::vector<int> removedIds;
+  std::set_difference(
+      oldIncludedFileIds.begin(), oldIncludedFileIds.end(),
+      source->includedFileIds.begin(), source->includedFileIds.end(),
+      std::back_inserter(removedIds));
+  std::vector<int> addedIds;
+  std::set_difference(
+      source->includedFileIds.begin(), source->includedFileIds.end(),
+      oldIncludedFileIds.begin(), oldIncludedFileIds.end(),
+      std::back_inserter(addedIds));
+  
+  std::vector<QString> paths;
+  FileIdTable::Instance().GetPaths(removedIds, &paths);
+  for (const QString& oldPath : paths) {
+    if (oldPath != source->path) {
+      RemoveFileReference(target, source, oldPath);
+    }
+  }
+  paths.clear();
+  FileIdTable::Instance().GetPaths(addedIds, &paths);
+  for (const QString& newPath : paths) {
+    if (newPath != source->path) {
+      AddFileReference(target, source, newPath);
+    }
+  }
+}
+
+static int CommonPrefixSize(const QString& a, const QString& b) {
+  int commonSize = std::min(a.size(), b.size());
+  int matchSize = 0;
+  for (; matchSize < commonSize; ++ matchSize) {
+    if (a[matchSize] != b[matchSize]) {
+      break;
+    }
+  }
+  return matchSize;
 }
 
 CompileSettings* Project::FindSettingsForFile(const QString& canonicalPath, bool* isGuess, int* guessQuality) {
-  // TODO: Enter file paths into an unordered_map for faster lookup?
-  
   constexpr bool kDebug = false;
   
-  // First, test for an exact match as a source file.
-  for (Target& target : targets) {
-    for (SourceFile& source : target.sources) {
-      if (source.path == canonicalPath) {
-        *isGuess = false;
-        if (kDebug) {
-          qDebug() << "FindSettingsForFile: Found source file match.";
-        }
-        return &target.compileSettings[source.compileSettingsIndex];
-      }
+  // Files that are not known to the file index get guessed settings. These
+  // remain valid until the file index changes.
+  if (guessedSettingsVersion != fileIndexVersion) {
+    guessedSettings.clear();
+    guessedSettingsVersion = fileIndexVersion;
+  } else {
+    auto cacheIt = guessedSettings.find(canonicalPath);
+    if (cacheIt != guessedSettings.end()) {
+      *isGuess = true;
+      *guessQuality = cacheIt->second.guessQuality;
+      return cacheIt->second.settings;
     }
   }
   
-  // Second, test for being included by a source file.
-  for (Target& target : targets) {
-    for (SourceFile& source : target.sources) {
-      if (source.includedPaths.count(canonicalPath) > 0) {
-        *isGuess = false;
-        if (kDebug) {
-          qDebug() << "FindSettingsForFile: Found header file match (source file:" << source.path << ")";
-        }
-        return &target.compileSettings[source.compileSettingsIndex];
-      }
+  // First, test for an exact match as a source file, second, test for being
+  // included by a source file.
+  std::pair<Target*, SourceFile*> match = FindSourceThatIsOrIncludes(canonicalPath, /*requireEqualPath*/ false);
+  if (match.second) {
+    *isGuess = false;
+    if (kDebug) {
+      qDebug() << "FindSettingsForFile: Found source or header file match (source file:" << match.second->path << ")";
     }
+    return match.first->compileSettings[match.second->compileSettingsIndex].get();
   }
   
-  // We have to guess. Iterate over all source files in the targets and return
-  // the compile settings of the source file whose path shares the most initial
-  // characters with the given canonical path.
+  // We have to guess. Return the compile settings of the source file whose
+  // path shares the most initial characters with the given canonical path.
+  // In the sorted list of source paths, this is one of the two paths next to
+  // the position at which the given path would be inserted.
   if (kDebug) {
     qDebug() << "Guessing the settings. Using canonicalPath:" << canonicalPath;
   }
-  const int canonicalPathSize = canonicalPath.size();
   CompileSettings* anyCompileSettings = nullptr;
   int bestMatchSize = 0;
   
-  for (Target& target : targets) {
-    for (SourceFile& source : target.sources) {
-      int commonSize = std::min(source.path.size(), canonicalPathSize);
-      int matchSize = 0;
-      for (; matchSize < commonSize; ++ matchSize) {
-        if (source.path[matchSize] != canonicalPath[matchSize]) {
-          break;
-        }
-      }
-      
-      if (matchSize >= bestMatchSize) {
-        if (kDebug) {
-          qDebug() << "FindSettingsForFile: New best guess from file:" << source.path;
-        }
-        bestMatchSize = matchSize;
-        anyCompileSettings = &target.compileSettings[source.compileSettingsIndex];
+  auto it = std::lower_bound(
+      sourcesSortedByPath.begin(), sourcesSortedByPath.end(), canonicalPath,
+      [](const std::pair<Target*, SourceFile*>& item, const QString& path) {
+        return item.second->path < path;
+      });
+  std::size_t insertIndex = it - sourcesSortedByPath.begin();
+  for (std::size_t i = (insertIndex > 0) ? (insertIndex - 1) : 0;
+       i < std::min(insertIndex + 1, sourcesSortedByPath.size());
+       ++ i) {
+    Target* target = sourcesSortedByPath[i].first;
+    SourceFile* source = sourcesSortedByPath[i].second;
+    int matchSize = CommonPrefixSize(source->path, canonicalPath);
+    if (!anyCompileSettings || matchSize > bestMatchSize) {
+      if (kDebug) {
+        qDebug() << "FindSettingsForFile: New best guess from file:" << source->path;
       }
+      bestMatchSize = matchSize;
+      anyCompileSettings = target->compileSettings[source->compileSettingsIndex].get();
     }
   }
   
   *isGuess = true;
   *guessQuality = bestMatchSize;
+  guessedSettings[canonicalPath] = {anyCompileSettings, bestMatchSize};
   if (kDebug) {
     qDebug() << "FindSettingsForFile: Used guess (quality:" << *guessQuality << ")";
   }
@@ -1012,6 +1300,20 @@ QString Project::GetFileTemplate(int templateIndex) {
   }
 }
 
+void Project::SetIndexAllProjectFiles(bool enable) {
+  if (indexAllProjectFiles == enable) {
+    return;
+  }
+  indexAllProjectFiles = enable;
+  UpdateContentIndexFiles();
+}
+
+void Project::AddFilesToContentIndex(const std::unordered_set<QString>& canonicalPaths) {
+  if (indexAllProjectFiles) {
+    contentIndex.AddFiles(canonicalPaths);
+  }
+}
+
 void Project::CMakeFileChanged() {
   mayRequireReconfiguration = true;
   emit ProjectMayRequireReconfiguration();
@@ -1020,30 +1322,38 @@ void Project::CMakeFileChanged() {
 bool Project::FindCompilerDefaults(
     const std::string& compilerPath,
     std::vector<QString>* includes) {
-  std::shared_ptr<QProcess> compilerProcess(new QProcess());
+  QString compiler = QString::fromStdString(GetCompilerPathForDirectoryQueries(compilerPath));
   QStringList arguments;
   arguments << "-x" << "c++" << "-v" << "-E" << "-";
   
-  compilerProcess->setStandardInputFile(QProcess::nullDevice());  // send end of input
-  compilerProcess->start(QString::fromStdString(GetCompilerPathForDirectoryQueries(compilerPath)), arguments);
-  
-  if (!compilerProcess->waitForFinished(10000)) {
-    // The process did not finish.
-    qDebug() << "FindCompilerDefaults(): The compiler process timed out (timeout is set to 10 seconds) (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
-    compilerProcess->kill();
-    return false;
-  }
-  if (compilerProcess->exitStatus() != QProcess::NormalExit) {
-    qDebug() << "FindCompilerDefaults(): The compiler process exited abnormally (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
-    return false;
-  }
-  if (compilerProcess->exitCode() != 0) {
-    qDebug() << "FindCompilerDefaults(): The compiler process exited with non-zero exit code (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
-    return false;
+  // Running the compiler may be slow, so its output is cached.
+  CompilerProbeCache::Entry probeOutput;
+  if (!CompilerProbeCache::Instance().Load(compiler, arguments, &probeOutput)) {
+    std::shared_ptr<QProcess> compilerProcess(new QProcess());
+    compilerProcess->setStandardInputFile(QProcess::nullDevice());  // send end of input
+    compilerProcess->start(compiler, arguments);
+    
+    if (!compilerProcess->waitForFinished(10000)) {
+      // The process did not finish.
+      qDebug() << "FindCompilerDefaults(): The compiler process timed out (timeout is set to 10 seconds) (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
+      compilerProcess->kill();
+      return false;
+    }
+    if (compilerProcess->exitStatus() != QProcess::NormalExit) {
+      qDebug() << "FindCompilerDefaults(): The compiler process exited abnormally (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
+      return false;
+    }
+    if (compilerProcess->exitCode() != 0) {
+      qDebug() << "FindCompilerDefaults(): The compiler process exited with non-zero exit code (call: " << compilerProcess->program() << " " << compilerProcess->arguments() << ").";
+      return false;
+    }
+    
+    probeOutput.standardOutput = compilerProcess->readAllStandardOutput();
+    probeOutput.standardError = compilerProcess->readAllStandardError();
+    CompilerProbeCache::Instance().Save(compiler, arguments, probeOutput);
   }
   
-  compilerProcess->setReadChannel(QProcess::StandardError);
-  QList<QByteArray> err = compilerProcess->readAll().split('\n');
+  QList<QByteArray> err = probeOutput.standardError.split('\n');
   
   // Relevant lines in err:
   // "#include \"...\" search starts here:",
@@ -1074,23 +1384,35 @@ bool Project::FindCompilerDefaults(
 bool Project::QueryClangResourceDir(
     const std::string& compilerPath,
     QString* resourceDir) {
-  QProcess compilerProcess;
+  QString compiler = QString::fromStdString(GetCompilerPathForDirectoryQueries(compilerPath));
   QStringList arguments;
   arguments << "-print-resource-dir";
-  compilerProcess.start(QString::fromStdString(GetCompilerPathForDirectoryQueries(compilerPath)), arguments);
+  
+  CompilerProbeCache::Entry probeOutput;
+  if (CompilerProbeCache::Instance().Load(compiler, arguments, &probeOutput)) {
+    *resourceDir = probeOutput.standardOutput.trimmed();
+    return true;
+  }
+  
+  QProcess compilerProcess;
+  compilerProcess.start(compiler, arguments);
   
   if (!compilerProcess.waitForFinished(10000)) {
     qDebug() << "QueryClangResourceDir(): The compiler process timed out (timeout is set to 10 seconds) (call: " << compilerProcess.program() << " " << compilerProcess.arguments() << ").";
     compilerProcess.kill();
     return false;
   }
-  if (compilerProcess.exitStatus() != QProcess::NormalExit ||
-      compilerProcess.exitCode() != 0) {
+  bool success = compilerProcess.exitStatus() == QProcess::NormalExit &&
+                 compilerProcess.exitCode() == 0;
+  if (!success) {
     qDebug() << "QueryClangResourceDir(): The compiler process exited abnormally (call: " << compilerProcess.program() << " " << compilerProcess.arguments() << "). Trying to fall back to the default clang binary.";
   }
   
-  compilerProcess.setReadChannel(QProcess::StandardOutput);
-  *resourceDir = compilerProcess.readAll().trimmed();
+  probeOutput.standardOutput = compilerProcess.readAllStandardOutput();
+  if (success) {
+    CompilerProbeCache::Instance().Save(compiler, arguments, probeOutput);
+  }
+  *resourceDir = probeOutput.standardOutput.trimmed();
   // qDebug() << "Got resource dir: " << *resourceDir;
   
   return true;
@@ -1130,6 +1452,165 @@ bool Project::CreateCMakeQueryFilesIfNotExisting(QString* errorReason) {
   return true;
 }
 
+bool Project::CMakeFileAPIRepliesAreUpToDate() {
+  // Find the latest reply index file.
+  QDir replyIndexDir = projectCMakeDir;
+  if (!replyIndexDir.cd(".cmake/api/v1/reply")) {
+    return false;
+  }
+  QStringList replyIndexFileList = replyIndexDir.entryList(
+      QStringList{"index-*.json"},
+      QDir::NoDotAndDotDot | QDir::Readable | QDir::Files,
+      QDir::Name | QDir::Reversed);
+  if (replyIndexFileList.isEmpty()) {
+    return false;
+  }
+  QString replyIndexFilePath = replyIndexDir.filePath(replyIndexFileList[0]);
+  QDateTime replyTime = QFileInfo(replyIndexFilePath).lastModified();
+  
+  // A file that was modified at the same time as the reply counts as
+  // modified after it, since the timestamp resolution may be coarse.
+  auto isModifiedAfterReply = [&](const QString& path) {
+    QFileInfo info(path);
+    return !info.exists() || info.lastModified() >= replyTime;
+  };
+  
+  // The query files are created if they do not exist yet, in which case the
+  // reply does not contain their results yet. Manual changes to the cache are
+  // also picked up by re-running CMake.
+  for (const char* fileName : {".cmake/api/v1/query/codemodel-v2", ".cmake/api/v1/query/cache-v2", ".cmake/api/v1/query/cmakeFiles-v1", "CMakeCache.txt"}) {
+    if (isModifiedAfterReply(projectCMakeDir.filePath(fileName))) {
+      return false;
+    }
+  }
+  
+  // Find the cmakeFiles reply, which lists CMake's input files.
+  YAML::Node fileNode = YAML::LoadFile(replyIndexFilePath.toStdString());
+  YAML::Node objectsNode = fileNode["objects"];
+  if (!objectsNode.IsSequence()) {
+    return false;
+  }
+  QString cmakeFilesReplyPath;
+  for (int i = 0; i < objectsNode.size(); ++ i) {
+    YAML::Node node = objectsNode[i];
+    if (node["kind"].as<std::string>() == "cmakeFiles" &&
+        node["version"]["major"].as<int>() == 1) {
+      cmakeFilesReplyPath = replyIndexDir.filePath(QString::fromStdString(node["jsonFile"].as<std::string>()));
+    }
+  }
+  if (cmakeFilesReplyPath.isEmpty()) {
+    return false;
+  }
+  
+  YAML::Node cmakefilesNode = YAML::LoadFile(cmakeFilesReplyPath.toStdString());
+  YAML::Node inputsNode = cmakefilesNode["inputs"];
+  if (!inputsNode.IsSequence()) {
+    return false;
+  }
+  for (int i = 0; i < inputsNode.size(); ++ i) {
+    YAML::Node node = inputsNode[i];
+    QString cmakeFilePath = QString::fromStdString(node["path"].as<std::string>());
+    if (cmakeFilePath.isEmpty()) {
+      continue;
+    } else if (cmakeFilePath[0] != '/') {
+      cmakeFilePath = projectDir.filePath(cmakeFilePath);
+    }
+    
+    if (isModifiedAfterReply(cmakeFilePath)) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+void Project::WarnIfCMakeVersionIsUnsupported(const QString& cmakeExecutable, QWidget* parent) {
+  // Ensure that the CMake binary that we got is at least version 3.14.
+  // If we got an older version, running the configuration will potentially work just fine,
+  // but the API responses will (if they already exist) silently not get updated. Thus,
+  // we explicitly warn here in this case to prevent confusion.
+  std::shared_ptr<QProcess> cmakeVersionTestProcess(new QProcess());
+  QStringList versionTestArguments;
+  versionTestArguments << "--version";
+  cmakeVersionTestProcess->start(cmakeExecutable, versionTestArguments);
+  cmakeVersionTestProcess->waitForFinished(10000);
+  
+  // Example first line output from CMake: cmake version 2.8.12.2
+  QString firstLine = cmakeVersionTestProcess->readLine();
+  QStringList versionWords = firstLine.trimmed().split(' ', QString::SkipEmptyParts);
+  if (versionWords.size() >= 3 &&
+      versionWords[0] == "cmake" &&
+      versionWords[1] == "version") {
+    QString cmakeVersionString = versionWords[2];
+    QStringList cmakeVersionNumberParts = cmakeVersionString.split('.');
+    bool versionIsAtLeast3_14 = false;
+    if (cmakeVersionNumberParts.size() == 1) {
+      versionIsAtLeast3_14 = cmakeVersionNumberParts[0].toInt() >= 4;
+    } else if (cmakeVersionNumberParts.size() >= 2) {
+      versionIsAtLeast3_14 =
+          cmakeVersionNumberParts[0].toInt() >= 4 ||
+          (cmakeVersionNumberParts[0].toInt() == 3 && cmakeVersionNumberParts[1].toInt() >= 14);
+    }
+    if (!versionIsAtLeast3_14) {
+      QMessageBox::warning(parent, tr("CMake version too old"), tr("The version of the CMake binary used for configuring (%1) is too old. At least version 3.14 is required for CIDE, since it uses the CMake file API.").arg(cmakeVersionString));
+    }
+  } else {
+    QMessageBox::warning(parent, tr("Cannot determine CMake version"), tr("Failed to parse the CMake version, thus cannot determine whether it is supported by CIDE. Continuing, but be aware that building might not work. The first line in the output of cmake --version is: %1").arg(firstLine));
+  }
+}
+
+bool Project::RunCMake(const QString& cmakeExecutable, QProgressDialog* progress, QString* errorReason) {
+  std::shared_ptr<QProcess> cmakeProcess(new QProcess());
+  QStringList arguments;
+#ifdef WIN32
+  // On Windows, we force the use of the Ninja generator for new build directories, since
+  // it is the only supported one and the default is probably Visual Studio.
+  // (On Linux, the default is probably make, which is fine since we support it.)
+  // 
+  // We also force the use of clang-cl in order to get a configuration that
+  // CIDE is able to build.
+  if (!QFile(projectCMakeDir.filePath("CMakeCache.txt")).exists()) {
+    arguments << "-G";
+    arguments << "Ninja";
+    arguments << "-DCMAKE_C_COMPILER=clang-cl.exe";
+    arguments << "-DCMAKE_CXX_COMPILER=clang-cl.exe";
+  }
+#endif
+  arguments << projectDir.absolutePath();
+  // qDebug() << "CMake call:" << cmakeExecutable << arguments;
+  cmakeProcess->setWorkingDirectory(projectCMakeDir.path());
+  std::atomic<bool> cmakeProcessFinished;
+  cmakeProcessFinished = false;
+  connect(cmakeProcess.get(), QOverload<int>::of(&QProcess::finished), [&]() {
+    cmakeProcessFinished = true;
+  });
+  cmakeProcess->start(cmakeExecutable, arguments);
+  
+  QEventLoop eventLoop;
+  while (!cmakeProcessFinished) {
+    progress->setValue(0);
+    eventLoop.processEvents();
+    QThread::msleep(10);
+    if (progress->wasCanceled()) {
+      cmakeProcess->kill();
+      *errorReason = QObject::tr("The process was canceled by the user.");
+      return false;
+    }
+  }
+  
+  if (cmakeProcess->exitStatus() != QProcess::NormalExit) {
+    *errorReason = QObject::tr("The CMake process exited abnormally.");
+    return false;
+  }
+  if (cmakeProcess->exitCode() != 0) {
+    cmakeProcess->setReadChannel(QProcess::StandardError);
+    *errorReason = QObject::tr("The CMake process exited with exit code: %1. Process output:\n\n%2").arg(cmakeProcess->exitCode()).arg(QString::fromLocal8Bit(cmakeProcess->readAll()));
+    return false;
+  }
+  return true;
+  
+}
+
 bool Project::ExtractCMakeCommandFromCache(const QString& CMakeCachePath, QString* cmakeExecutable) {
   QFile cmakeCacheFile(CMakeCachePath);
   if (cmakeCacheFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
@@ -1151,6 +1632,184 @@ bool Project::ExtractCMakeCommandFromCache(const QString& CMakeCachePath, QStrin
   return false;
 }
 
+void Project::SeedIncludedPathsFromBuildDependencies() {
+  BuildDependencyMap dependencies;
+  if (!ReadBuildDependencies(projectCMakeDir, &dependencies)) {
+    return;
+  }
+  
+  int numSeededSources = 0;
+  std::vector<QString> includedPaths;
+  USRStorage::Instance().Lock();
+  for (Target& target : targets) {
+    for (SourceFile& source : target.sources) {
+      if (source.hasBeenIndexed || !source.includedFileIds.empty()) {
+        continue;
+      }
+      auto it = dependencies.find(source.path);
+      if (it == dependencies.end() || it->second.empty()) {
+        continue;
+      }
+      
+      // The references to the included files in USRStorage are counted just
+      // like for indexed sources, such that indexing the source later can
+      // update them incrementally.
+      FileIdTable::Instance().GetOrAddSortedIds(it->second, &source.includedFileIds);
+      includedPaths.clear();
+      source.GetIncludedPaths(&includedPaths);
+      for (const QString& path : includedPaths) {
+        USRStorage::Instance().AddUSRMapReference(path);
+      }
+      ++ numSeededSources;
+    }
+  }
+  USRStorage::Instance().Unlock();
+  
+  qDebug() << "Seeded the includes of" << numSeededSources << "source(s) from the build dependencies";
+}
+
+void Project::RebuildFileIndex() {
+  fileIndexVersion = ++ lastFileIndexVersion;
+  sourcesByFile.clear();
+  filesByBaseName.clear();
+  sourcesSortedByPath.clear();
+  std::vector<QString> includedPaths;
+  for (Target& target : targets) {
+    target.fileReferenceCounts.clear();
+    for (SourceFile& source : target.sources) {
+      AddFileReference(&target, &source, source.path);
+      includedPaths.clear();
+      source.GetIncludedPaths(&includedPaths);
+      for (const QString& includedPath : includedPaths) {
+        if (includedPath != source.path) {
+          AddFileReference(&target, &source, includedPath);
+        }
+      }
+      sourcesSortedByPath.emplace_back(&target, &source);
+    }
+  }
+  std::sort(sourcesSortedByPath.begin(), sourcesSortedByPath.end(), [](const std::pair<Target*, SourceFile*>& a, const std::pair<Target*, SourceFile*>& b) {
+    return a.second->path < b.second->path;
+  });
+}
+
+std::pair<Target*, SourceFile*> Project::FindSourceThatIsOrIncludes(const QString& canonicalPath, bool requireEqualPath) const {
+  std::pair<Target*, SourceFile*> result(nullptr, nullptr);
+  bool resultHasEqualPath = false;
+  
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it == sourcesByFile.end()) {
+    return result;
+  }
+  
+  // Since the targets and their sources are stored in vectors, comparing the
+  // pointers yields their order.
+  for (const auto& item : it->second) {
+    bool hasEqualPath = item.second->path == canonicalPath;
+    if (requireEqualPath && !hasEqualPath) {
+      continue;
+    }
+    if (!result.second ||
+        (hasEqualPath && !resultHasEqualPath) ||
+        (hasEqualPath == resultHasEqualPath && item < result)) {
+      result = item;
+      resultHasEqualPath = hasEqualPath;
+    }
+  }
+  return result;
+}
+
+void Project::AddFileReference(Target* target, SourceFile* source, const QString& canonicalPath) {
+  ++ target->fileReferenceCounts[canonicalPath];
+  std::vector<std::pair<Target*, SourceFile*>>& sources = sourcesByFile[canonicalPath];
+  if (sources.empty()) {
+    filesByBaseName[QFileInfo(canonicalPath).baseName()].push_back(canonicalPath);
+    fileIndexVersion = ++ lastFileIndexVersion;
+  }
+  sources.emplace_back(target, source);
+}
+
+void Project::RemoveFileReference(Target* target, SourceFile* source, const QString& canonicalPath) {
+  auto countIt = target->fileReferenceCounts.find(canonicalPath);
+  if (countIt != target->fileReferenceCounts.end()) {
+    -- countIt->second;
+    if (countIt->second == 0) {
+      target->fileReferenceCounts.erase(countIt);
+    }
+  }
+  
+  auto it = sourcesByFile.find(canonicalPath);
+  if (it != sourcesByFile.end()) {
+    std::vector<std::pair<Target*, SourceFile*>>& sources = it->second;
+    auto sourceIt = std::find(sources.begin(), sources.end(), std::make_pair(target, source));
+    if (sourceIt != sources.end()) {
+      sources.erase(sourceIt);
+    }
+    if (sources.empty()) {
+      sourcesByFile.erase(it);
+      
+      auto baseNameIt = filesByBaseName.find(QFileInfo(canonicalPath).baseName());
+      if (baseNameIt != filesByBaseName.end()) {
+        std::vector<QString>& paths = baseNameIt->second;
+        paths.erase(std::remove(paths.begin(), paths.end(), canonicalPath), paths.end());
+        if (paths.empty()) {
+          filesByBaseName.erase(baseNameIt);
+        }
+      }
+      fileIndexVersion = ++ lastFileIndexVersion;
+    }
+  }
+}
+
+/// Returns whether the file with the given path, which is referenced by
+/// @p sources, is listed by GetProjectFilePaths().
+static bool IsListedProjectFile(const QString& canonicalPath, const std::vector<std::pair<Target*, SourceFile*>>& sources, const QString& projectDirPath) {
+  // Do not include external headers.
+  // TODO: Maybe these could be included as well as an option.
+  bool isListed = canonicalPath.startsWith(projectDirPath);
+  for (int i = 0, size = sources.size(); i < size && !isListed; ++ i) {
+    isListed = sources[i].second->path == canonicalPath;
+  }
+  return isListed;
+}
+
+void Project::GetProjectFilePaths(std::vector<QString>* paths) const {
+  QString dirPath = GetDir();
+  paths->clear();
+  paths->reserve(sourcesByFile.size());
+  for (const auto& item : sourcesByFile) {
+    if (IsListedProjectFile(item.first, item.second, dirPath)) {
+      paths->push_back(item.first);
+    }
+  }
+}
+
+void Project::GetProjectFilePathsWithBaseName(const QString& baseName, std::vector<QString>* paths) const {
+  auto it = filesByBaseName.find(baseName);
+  if (it == filesByBaseName.end()) {
+    return;
+  }
+  QString dirPath = GetDir();
+  for (const QString& path : it->second) {
+    auto sourcesIt = sourcesByFile.find(path);
+    if (sourcesIt != sourcesByFile.end() &&
+        IsListedProjectFile(path, sourcesIt->second, dirPath)) {
+      paths->push_back(path);
+    }
+  }
+}
+
+void Project::UpdateContentIndexFiles() {
+  std::unordered_set<QString> paths;
+  if (indexAllProjectFiles) {
+    paths.reserve(sourcesByFile.size());
+    for (const auto& item : sourcesByFile) {
+      paths.insert(item.first);
+    }
+  }
+  contentIndex.SetFiles(paths);
+}
+
 std::string Project::GetCompilerPathForDirectoryQueries(const std::string& projectCompiler) {
   if (useDefaultCompiler) {
     QString defaultCompiler = Settings::Instance().GetDefaultCompiler();
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
@@ -13,11 +14,16 @@
 #include <QDir>
 #include <QFileSystemWatcher>
 #include <QString>
+#include <QStringList>
 
+#include "cide/clang_tu_pool.h"
+#include "cide/file_id_table.h"
+#include "cide/trigram_index.h"
 #include "cide/util.h"
 
 
 class MainWindow;
+class QProgressDialog;
 class Project;
 
 
@@ -31,8 +37,18 @@ struct CompileSettings {
   
   std::vector<QByteArray> BuildCommandLineArgs(bool enableSpellCheck, const QString& filePath, const Project* project) const;
   
+  /// Returns the result of BuildCommandLineArgs() as a shared
+  /// CompileCommandLine. Since the arguments only depend on the kind of file
+  /// (as determined from its extension), they are cached for each kind. Thus,
+  /// the settings must not be modified after calling this. Must be called from
+  /// the Qt thread.
+  std::shared_ptr<const CompileCommandLine> GetCommandLine(bool enableSpellCheck, const QString& filePath, const Project* project) const;
+  
   bool operator== (const CompileSettings& other);
   
+  /// Returns a hash of all attributes that are compared by operator==.
+  std::size_t Hash() const;
+  
   static inline QString LanguageToString(Language language) {
     if (language == Language::C) {
       return QObject::tr("C");
@@ -52,6 +68,53 @@ struct CompileSettings {
   
   // Format: DEFINE, or DEFINE=VALUE
   std::vector<QString> defines;
+  
+ private:
+  /// Cache for GetCommandLine(). Copies of the settings start with an empty
+  /// cache, since they may get modified.
+  struct CommandLineCache {
+    inline CommandLineCache() {}
+    inline CommandLineCache(const CommandLineCache& /*other*/) {}
+    inline CommandLineCache& operator= (const CommandLineCache& /*other*/) {
+      for (int i = 0; i < kNumEntries; ++ i) {
+        entries[i].reset();
+        projects[i] = nullptr;
+      }
+      return *this;
+    }
+    
+    /// Number of combinations of the enableSpellCheck flag and the file kinds
+    /// that BuildCommandLineArgs() distinguishes.
+    static constexpr int kNumEntries = 2 * 3;
+    
+    std::shared_ptr<const CompileCommandLine> entries[kNumEntries];
+    
+    /// The project that each entry was built for.
+    const Project* projects[kNumEntries] = {};
+  };
+  
+  mutable CommandLineCache commandLineCache;
+};
+
+/// Interns CompileSettings: equal settings (e.g., of different targets that
+/// are compiled with the same flags) share a single instance, and thus also
+/// its cached command lines (see CompileSettings::GetCommandLine()), which in
+/// turn lets the TUs of these targets compare their command lines by pointer.
+/// The interned settings must not be modified. This class is not thread-safe.
+class CompileSettingsPool {
+ public:
+  /// Returns the pooled instance that is equal to @p settings. If there is
+  /// none, @p settings is added to the pool and returned.
+  std::shared_ptr<CompileSettings> Intern(const std::shared_ptr<CompileSettings>& settings);
+  
+  /// Removes the instances that are only referenced by the pool.
+  void RemoveUnused();
+  
+  inline int size() const { return settingsByHash.size(); }
+  
+ private:
+  /// Maps CompileSettings::Hash() --> pooled instances with this hash.
+  std::unordered_multimap<std::size_t, std::shared_ptr<CompileSettings>> settingsByHash;
 };
 
 
@@ -59,9 +122,28 @@ struct SourceFile {
   /// Transfers derived information from an old SourceFile instance to a new
   /// one resembling the same file. This is used on matching files after
   /// reloading the configuration.
-  inline void TransferInformationTo(SourceFile* dest) {
+  inline void TransferInformationTo(SourceFile* dest) const {
+    dest->hasBeenIndexed = hasBeenIndexed;
+    dest->includedFileIds = includedFileIds;
+  }
+  
+  /// Variant of TransferInformationTo() which moves the information instead of
+  /// copying it, leaving this SourceFile without it.
+  inline void MoveInformationTo(SourceFile* dest) {
     dest->hasBeenIndexed = hasBeenIndexed;
-    dest->includedPaths = includedPaths;
+    dest->includedFileIds.swap(includedFileIds);
+    includedFileIds.clear();
+  }
+  
+  /// Returns whether the file with the given path is in includedFileIds.
+  inline bool Includes(const QString& canonicalPath) const {
+    int id = FileIdTable::Instance().GetId(canonicalPath);
+    return id >= 0 && std::binary_search(includedFileIds.begin(), includedFileIds.end(), id);
+  }
+  
+  /// Appends the canonical paths of all included files to @p paths.
+  inline void GetIncludedPaths(std::vector<QString>* paths) const {
+    FileIdTable::Instance().GetPaths(includedFileIds, paths);
   }
   
   
@@ -78,17 +160,22 @@ struct SourceFile {
   /// been made.
   bool hasBeenIndexed = false;
   
-  /// List of canonical paths to all files included by this source file, either
-  /// directly or transitively, as determined by the indexing procedure. Note
-  /// that this is only known to be correct if no changes to the file were made
-  /// after indexing.
-  std::unordered_set<QString> includedPaths;
+  /// Sorted list of the FileIdTable IDs of all files included by this source
+  /// file, either directly or transitively, as determined by the indexing
+  /// procedure. Note that this is only known to be correct if no changes to the
+  /// file were made after indexing. Before the file has been indexed, this may
+  /// have been seeded from the build system's dependency information (see
+  /// Project::SeedIncludedPathsFromBuildDependencies()).
+  std::vector<int> includedFileIds;
 };
 
 
 struct Target {
-  bool ContainsOrIncludesFile(const QString& canonicalPath) const;
-  QStringList FindAllFilesThatInclude(const QString& canonicalPath) const;
+  /// Returns whether a source file of this target is equal to or includes the
+  /// file with the given path.
+  inline bool ContainsOrIncludesFile(const QString& canonicalPath) const {
+    return fileReferenceCounts.count(canonicalPath) > 0;
+  }
   
   
   enum class Type {
@@ -114,14 +201,26 @@ struct Target {
   /// created executable.
   QString path;
   
+  /// Canonical path of the source directory whose CMakeLists.txt defines the
+  /// target, and the path of the corresponding build directory.
+  QString sourceDirPath;
+  QString buildDirPath;
+  
   /// List of source files of this target (may exclude headers)
   std::vector<SourceFile> sources;
   
-  /// List of compile setting groups for this target
-  std::vector<CompileSettings> compileSettings;
+  /// List of compile setting groups for this target. These are interned with
+  /// the project's CompileSettingsPool, so they may be shared with other
+  /// targets.
+  std::vector<std::shared_ptr<CompileSettings>> compileSettings;
   
   /// List of other targets that this target depends on.
   std::vector<Target*> dependencies;
+  
+  /// Maps the canonical paths of all source files of this target and of all
+  /// files included by them to the number of source files that are equal to
+  /// or include the file. This is maintained by the Project.
+  std::unordered_map<QString, int> fileReferenceCounts;
 };
 
 
@@ -160,6 +259,12 @@ class Project : public QObject {
   /// background parse threads). Returns the number of requests created.
   int IndexAllNewFiles(MainWindow* mainWindow);
   
+  /// Requests indexing again for all source files that include the file with
+  /// the given path (for example, after it was saved), as known from their
+  /// last indexing. Sources of the target named @p prioritizedTargetName are
+  /// indexed first. Returns the number of requests created.
+  int ReindexSourcesThatInclude(const QString& canonicalPath, const QString& prioritizedTargetName, MainWindow* mainWindow);
+  
   /// Returns whether the project contains the file with the given path.
   bool ContainsFile(const QString& canonicalPath);
   
@@ -173,10 +278,48 @@ class Project : public QObject {
   /// correspond to a source file of this project.
   SourceFile* GetSourceFile(const QString& canonicalPath);
   
+  /// Appends all targets having a source file that is equal to or includes the
+  /// file with the given path to @p result. Each target is appended once.
+  void FindTargetsThatContainOrInclude(const QString& canonicalPath, std::vector<const Target*>* result) const;
+  
+  /// Inserts the paths of all source files that are equal to or include the
+  /// file with the given path into @p result.
+  void FindAllFilesThatInclude(const QString& canonicalPath, std::unordered_set<QString>* result) const;
+  
+  /// Determines the arguments for the build tool (ninja if @p useNinja is
+  /// true, make otherwise) that make it compile only the object file of the
+  /// source with the given path, instead of building a whole target. If the
+  /// file is not a source itself, a source that includes it is compiled.
+  /// The chosen source is returned in @p compiledSourcePath. Returns false if
+  /// neither the file nor any source that includes it is known.
+  bool GetCompileFileBuildArguments(const QString& canonicalPath, bool useNinja, QString* compiledSourcePath, QStringList* arguments) const;
+  
+  /// Returns the files of the project for listing them, for example in the
+  /// search bar: the source files of all targets, and the files within the
+  /// project directory that are included by them. Each path is returned once.
+  void GetProjectFilePaths(std::vector<QString>* paths) const;
+  
+  /// Returns a number that changes whenever files are added to or removed from
+  /// the project's file index, such that lists derived from
+  /// GetProjectFilePaths() can be cached. The numbers are unique among all
+  /// projects.
+  inline unsigned int GetFileIndexVersion() const { return fileIndexVersion; }
+  
+  /// Appends those paths returned by GetProjectFilePaths() to @p paths whose
+  /// file name without any extension (QFileInfo::baseName()) is @p baseName.
+  /// This uses an index that is maintained together with the file index, so
+  /// it does not access the file system.
+  void GetProjectFilePathsWithBaseName(const QString& baseName, std::vector<QString>* paths) const;
+  
+  /// Must be called after the includedFileIds of @p source changed from
+  /// @p oldIncludedFileIds, in order to update the reverse index of inclusions.
+  void IncludedPathsChanged(SourceFile* source, const std::vector<int>& oldIncludedFileIds);
+  
   /// Attempts to find the compile settings for the given file. If no concrete
   /// information is available, tries to guess and sets isGuess to true. In this
   /// case, guessQuality is set to a quality measure for the guess (larger is
-  /// better).
+  /// better). Guesses are cached until the file index changes (see
+  /// GetFileIndexVersion()).
   CompileSettings* FindSettingsForFile(const QString& canonicalPath, bool* isGuess, int* guessQuality);
   
   /// Returns the project name.
@@ -241,6 +384,15 @@ class Project : public QObject {
   
   inline QString GetClangResourceDir() const { return clangResourceDir; }
   
+  /// Returns the trigram index of the contents of the project's files, which
+  /// can be used to speed up text searches. The index is only maintained if
+  /// GetIndexAllProjectFiles() returns true; otherwise it is empty.
+  inline TrigramIndex& GetContentIndex() { return contentIndex; }
+  
+  /// Adds the given files to the content index (if it is maintained). This is
+  /// called when new included files of a project source file have been found.
+  void AddFilesToContentIndex(const std::unordered_set<QString>& canonicalPaths);
+  
  public slots:
   inline void SetName(const QString& name) { this->name = name; }
   inline void SetBuildDir(const QDir& dir) { buildDir = dir; }
@@ -248,7 +400,7 @@ class Project : public QObject {
   inline void SetBuildThreads(int numThreads) { buildThreads = numThreads; }
   inline void SetSpacesPerTab(int value) { spacesPerTab = value; }
   inline void SetInsertSpacesOnTab(bool enable) { insertSpacesOnTab = enable; }
-  inline void SetIndexAllProjectFiles(bool enable) { indexAllProjectFiles = enable; }
+  void SetIndexAllProjectFiles(bool enable);
   
  signals:
   void ProjectMayRequireReconfiguration();
@@ -266,10 +418,55 @@ class Project : public QObject {
       QString* resourceDir);
   
   bool CreateCMakeQueryFilesIfNotExisting(QString* errorReason);
+  
+  /// Returns whether the latest replies of the CMake file API are newer than
+  /// all of CMake's input files (as listed in the cmakeFiles reply), the
+  /// CMake cache, and the query files. In this case, the replies can be used
+  /// without running CMake again.
+  bool CMakeFileAPIRepliesAreUpToDate();
+  
+  /// Shows a warning if the given CMake executable does not support the CMake
+  /// file API (which requires CMake 3.14).
+  void WarnIfCMakeVersionIsUnsupported(const QString& cmakeExecutable, QWidget* parent);
+  
+  /// Runs CMake for the project's build directory, showing its progress in
+  /// @p progress. Returns true on success, false otherwise (in which case
+  /// @p errorReason is set).
+  bool RunCMake(const QString& cmakeExecutable, QProgressDialog* progress, QString* errorReason);
+  
   bool ExtractCMakeCommandFromCache(const QString& CMakeCachePath, QString* cmakeExecutable);
   
   std::string GetCompilerPathForDirectoryQueries(const std::string& projectCompiler);
   
+  /// Sets the files of the content index to all source files of the project
+  /// and the files included by them (or to none if the content index is not
+  /// maintained).
+  void UpdateContentIndexFiles();
+  
+  /// Rebuilds sourcesByFile, sourcesSortedByPath, and the fileReferenceCounts of
+  /// all targets.
+  void RebuildFileIndex();
+  
+  /// Sets the includedFileIds of all sources that have not been indexed yet to
+  /// the header dependencies that the build system recorded in the build
+  /// directory (see ReadBuildDependencies()), if any. This makes the include
+  /// graph usable (for example, for finding the compile settings of headers
+  /// and for the file index) before indexing finishes. Indexing the sources
+  /// replaces the seeded includes as usual.
+  void SeedIncludedPathsFromBuildDependencies();
+  
+  /// Returns the source file that has the given path or that includes it, or
+  /// a pair of nulls if there is none. Source files with the given path are
+  /// preferred. Among multiple candidates, the first one in the order of the
+  /// targets and their sources is returned.
+  std::pair<Target*, SourceFile*> FindSourceThatIsOrIncludes(const QString& canonicalPath, bool requireEqualPath) const;
+  
+  /// Adds or removes the reference of @p source (in @p target) to the file
+  /// with the given path in sourcesByFile and in the target's
+  /// fileReferenceCounts.
+  void AddFileReference(Target* target, SourceFile* source, const QString& canonicalPath);
+  void RemoveFileReference(Target* target, SourceFile* source, const QString& canonicalPath);
+  
   
   /// Path to the project YAML file.
   QString path;
@@ -308,6 +505,38 @@ class Project : public QObject {
   // --- Information retrieved from the build system ---
   std::vector<Target> targets;
   
+  /// Interns the compile settings of all targets.
+  CompileSettingsPool compileSettingsPool;
+  
+  /// Reverse index of the targets' source files and their inclusions: maps the
+  /// canonical path of each file to the source files (together with their
+  /// targets) that are equal to or include this file.
+  std::unordered_map<QString, std::vector<std::pair<Target*, SourceFile*>>> sourcesByFile;
+  
+  /// Maps the QFileInfo::baseName() of each path in sourcesByFile to these
+  /// paths. See GetProjectFilePathsWithBaseName().
+  std::unordered_map<QString, std::vector<QString>> filesByBaseName;
+  
+  /// All source files of the targets, sorted by their path. This is used to
+  /// quickly find the source file whose path shares the longest prefix with a
+  /// given path in FindSettingsForFile().
+  std::vector<std::pair<Target*, SourceFile*>> sourcesSortedByPath;
+  
+  /// See GetFileIndexVersion().
+  unsigned int fileIndexVersion = 0;
+  
+  /// A guess of FindSettingsForFile().
+  struct GuessedSettings {
+    CompileSettings* settings;
+    int guessQuality;
+  };
+  
+  /// Caches the guesses of FindSettingsForFile() by canonical path. The cache
+  /// is valid while guessedSettingsVersion equals fileIndexVersion, since the
+  /// guesses only depend on the file index.
+  std::unordered_map<QString, GuessedSettings> guessedSettings;
+  unsigned int guessedSettingsVersion = 0;
+  
   std::string cxxCompiler;
   std::vector<QString> cxxDefaultIncludes;
   
@@ -319,4 +548,6 @@ class Project : public QObject {
   // --- State / watcher ---
   QFileSystemWatcher cmakeFileWatcher;
   bool mayRequireReconfiguration;
+  
+  TrigramIndex contentIndex;
 };
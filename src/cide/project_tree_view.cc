@@ -4,23 +4,58 @@
 
 #include "cide/project_tree_view.h"
 
+#include <algorithm>
 #include <unordered_set>
 
-#include <git2.h>
 #include <QCheckBox>
 #include <QDialogButtonBox>
 #include <QFileInfo>
 #include <QFileSystemModel>
 #include <QInputDialog>
 #include <QMessageBox>
+#include <QPointer>
+#include <QStyledItemDelegate>
 #include <QTreeWidget>
 
+#include "cide/canonical_path_cache.h"
 #include "cide/create_class.h"
+#include "cide/file_stat_cache.h"
 #include "cide/git_diff.h"
 #include "cide/main_window.h"
 #include "cide/project_settings.h"
+#include "cide/stall_detector.h"
 #include "cide/util.h"
 
+/// Time in milliseconds without further watcher notifications after which the
+/// changed directories are reloaded.
+constexpr int kDirectoryReloadDelay = 100;
+
+/// Maximum time in milliseconds that the reload of changed directories may be
+/// postponed by continuing notifications.
+constexpr int kMaxDirectoryReloadDelay = 1000;
+
+/// Item data role that stores whether a (non-project) item is a directory.
+constexpr int kIsDirRole = Qt::UserRole + 1;
+
+/// Styles the file items of the project tree according to their git status and
+/// whether they are open. The styles are determined when the items are painted,
+/// such that only the visible items need to be considered.
+class ProjectTreeItemDelegate : public QStyledItemDelegate {
+ public:
+  inline ProjectTreeItemDelegate(ProjectTreeView* view, QObject* parent = nullptr)
+      : QStyledItemDelegate(parent),
+        view(view) {}
+        
+ protected:
+  void initStyleOption(QStyleOptionViewItem* option, const QModelIndex& index) const override {
+    QStyledItemDelegate::initStyleOption(option, index);
+    view->ApplyItemStyles(index, option);
+  }
+  
+ private:
+  ProjectTreeView* view;
+};
+
 ProjectTreeView::~ProjectTreeView() {
   delete contextMenu;
 }
@@ -54,6 +89,9 @@ void ProjectTreeView::Initialize(MainWindow* mainWindow, QAction* showProjectFil
   tree->setColumnCount(1);
   tree->setHeaderHidden(true);
   tree->setSelectionMode(QAbstractItemView::ExtendedSelection);
+  tree->setItemDelegate(new ProjectTreeItemDelegate(this, tree));
+  
+  folderIcon = iconProvider.icon(QFileIconProvider::Folder);
   
   connect(tree, &QTreeWidget::itemExpanded, this, &ProjectTreeView::ItemExpanded);
   connect(tree, &QTreeWidget::itemCollapsed, this, &ProjectTreeView::ItemCollapsed);
@@ -70,6 +108,8 @@ void ProjectTreeView::Initialize(MainWindow* mainWindow, QAction* showProjectFil
   mainWindow->addDockWidget(Qt::LeftDockWidgetArea, dock);
   
   connect(&watcher, &QFileSystemWatcher::directoryChanged, this, &ProjectTreeView::FileWatcherNotification);
+  changedDirectoriesTimer.setSingleShot(true);
+  connect(&changedDirectoriesTimer, &QTimer::timeout, this, &ProjectTreeView::ReloadChangedDirectories);
   gitUpdateTimer.setSingleShot(true);
   connect(&gitUpdateTimer, &QTimer::timeout, this, &ProjectTreeView::GitUpdate);
   connect(&gitWatcher, &QFileSystemWatcher::fileChanged, this, &ProjectTreeView::GitWatcherNotification);
@@ -131,9 +171,11 @@ bool ProjectTreeView::SelectCurrent() {
 
 void ProjectTreeView::UpdateProjects() {
   tree->clear();
-  if (!watcher.files().isEmpty()) {
-    watcher.removePaths(watcher.files());
+  if (!watcher.directories().isEmpty()) {
+    watcher.removePaths(watcher.directories());
   }
+  changedDirectories.clear();
+  changedDirectoriesTimer.stop();
   if (!gitWatcher.files().isEmpty()) {
     gitWatcher.removePaths(gitWatcher.files());
   }
@@ -151,6 +193,10 @@ void ProjectTreeView::UpdateProjects() {
       if (QFile::exists(gitIndexPath)) {
         gitWatcher.addPath(gitIndexPath);
       }
+      QString gitHeadPath = gitDir.filePath("HEAD");
+      if (QFile::exists(gitHeadPath)) {
+        gitWatcher.addPath(gitHeadPath);
+      }
     }
     
     watcher.addPath(rootDir.path());
@@ -169,106 +215,78 @@ void ProjectTreeView::UpdateProjects() {
 }
 
 void ProjectTreeView::UpdateHighlighting() {
-  std::vector<QTreeWidgetItem*> workList = {tree->invisibleRootItem()};
-  while (!workList.empty()) {
-    QTreeWidgetItem* item = workList.back();
-    workList.pop_back();
-    
-    for (int i = 0, count = item->childCount(); i < count; ++ i) {
-      QTreeWidgetItem* child = item->child(i);
-      if (child->childCount() > 0) {
-        workList.push_back(child);
-      } else {
-        // This might be a file or an (empty or not-expanded-yet) directory.
-        // It should not hurt to check directories in GetHighlightColor(),
-        // it should never return anything else than the default for them.
-        QString canonicalPath = QFileInfo(GetItemPath(child)).canonicalFilePath();
-        ApplyItemStyles(child, canonicalPath);
-      }
-      
-      if (child->parent() == nullptr ||
-          child->parent() == tree->invisibleRootItem()) {
-        QString projectPath = child->data(0, Qt::UserRole).toString();
-        
-        auto gitStatusIt = projectGitStatuses.find(projectPath);
-        if (gitStatusIt != projectGitStatuses.end()) {
-          ProjectGitStatus* status = gitStatusIt->second.get();
-          int numModifications = 0;
-          int numUntracked = 0;
-          for (const auto& item : status->fileStatuses) {
-            if (item.second == ProjectGitStatus::FileStatus::Modified) {
-              ++ numModifications;
-            } else if (item.second == ProjectGitStatus::FileStatus::Untracked) {
-              ++ numUntracked;
-            }
-          }
-          
-          if (numModifications == 0 && numUntracked == 0) {
-            child->setText(0, tr("%1 (branch: %2, clean)").arg(QDir(projectPath).dirName()).arg(status->branchName));
-          } else {
-            child->setText(0, tr("%1 (branch: %2, %3 %4, %5 untracked)")
-                .arg(QDir(projectPath).dirName())
-                .arg(status->branchName)
-                .arg(numModifications)
-                .arg((numModifications == 1) ? tr("modification") : tr("modifications"))
-                .arg(numUntracked));
-          }
-        }
-      }
-    }
+  // The item styles are applied when painting the items (see
+  // ProjectTreeItemDelegate), so only the visible items need to be repainted.
+  tree->viewport()->update();
+  
+  QTreeWidgetItem* treeRoot = tree->invisibleRootItem();
+  for (int i = 0, count = treeRoot->childCount(); i < count; ++ i) {
+    UpdateProjectItemText(treeRoot->child(i));
   }
 }
 
-void ProjectTreeView::ReloadDirectory(QTreeWidgetItem* dirItem) {
-  std::unordered_set<std::string> expandedDirs;
-  
-  // Delete all children and remove all watchers related to them (and
-  // grand-children etc.). Remember expanded directories such that they can be
-  // expanded again after the reload (at least if they still exist with the
-  // same name then).
-  std::vector<QTreeWidgetItem*> workList = {dirItem};
-  std::vector<QTreeWidgetItem*> doneList;
-  while (!workList.empty()) {
-    QTreeWidgetItem* item = workList.back();
-    workList.pop_back();
-    
-    // Add all children to the work list
-    for (int i = item->childCount() - 1; i >= 0; -- i) {
-      workList.push_back(item->child(i));
-    }
-    
-    // If this item was expanded, remember it
-    if (item->isExpanded()) {
-      expandedDirs.insert(GetItemPath(item).toStdString());
-    }
-    
-    if (item != dirItem) {
-      doneList.push_back(item);
-    }
+void ProjectTreeView::UpdateProjectItemText(QTreeWidgetItem* projectItem) {
+  QString projectPath = projectItem->data(0, Qt::UserRole).toString();
+  
+  auto gitStatusIt = projectGitStatuses.find(projectPath);
+  if (gitStatusIt == projectGitStatuses.end()) {
+    return;
   }
   
-  for (int i = static_cast<int>(doneList.size()) - 1; i >= 0; -- i) {
-    watcher.removePath(GetItemPath(doneList[i]));
-    delete doneList[i];
+  ProjectGitStatus* status = gitStatusIt->second.get();
+  if (status->numModifications == 0 && status->numUntracked == 0) {
+    projectItem->setText(0, tr("%1 (branch: %2, clean)").arg(QDir(projectPath).dirName()).arg(status->branchName));
+  } else {
+    projectItem->setText(0, tr("%1 (branch: %2, %3 %4, %5 untracked)")
+        .arg(QDir(projectPath).dirName())
+        .arg(status->branchName)
+        .arg(status->numModifications)
+        .arg((status->numModifications == 1) ? tr("modification") : tr("modifications"))
+        .arg(status->numUntracked));
+  }
+}
+
+void ProjectTreeView::ReloadDirectory(QTreeWidgetItem* dirItem) {
+  // Collapsed directories do not have child items.
+  if (!dirItem->isExpanded()) {
+    return;
   }
   
-  // Collapse the item
-  dirItem->setExpanded(false);
+  QDir dir(GetItemPath(dirItem));
+  QFileInfoList entries = dir.entryInfoList(
+      QDir::NoDotAndDotDot | QDir::Files | QDir::Dirs | QDir::Hidden,
+      QDir::Name | QDir::DirsFirst | QDir::IgnoreCase);
+  std::unordered_map<QString, bool> entryIsDir;
+  for (const QFileInfo& entry : entries) {
+    entryIsDir[entry.fileName()] = entry.isDir();
+  }
+  
+  // Delete the items for entries that do not exist anymore (or changed
+  // between being a file and a directory), and remember the remaining ones.
+  std::unordered_map<QString, QTreeWidgetItem*> existingItems;
+  for (int i = dirItem->childCount() - 1; i >= 0; -- i) {
+    QTreeWidgetItem* child = dirItem->child(i);
+    QString name = child->data(0, Qt::UserRole).toString();
+    auto it = entryIsDir.find(name);
+    if (it == entryIsDir.end() || it->second != child->data(0, kIsDirRole).toBool()) {
+      DeleteItemAndWatchers(child);
+    } else {
+      existingItems[name] = child;
+    }
+  }
   
-  // Expand the item(s) again, which will add the updated children
-  workList = {dirItem};
-  while (!workList.empty()) {
-    QTreeWidgetItem* item = workList.back();
-    workList.pop_back();
-    
-    if (expandedDirs.count(GetItemPath(item).toStdString()) > 0) {
-      item->setExpanded(true);
-      
-      // Add all children to the work list
-      for (int i = item->childCount() - 1; i >= 0; -- i) {
-        workList.push_back(item->child(i));
-      }
+  // Insert items for the new entries after the item of the preceding entry.
+  QTreeWidgetItem* prevItem = nullptr;
+  for (const QFileInfo& entry : entries) {
+    auto it = existingItems.find(entry.fileName());
+    if (it != existingItems.end()) {
+      prevItem = it->second;
+      continue;
     }
+    
+    QTreeWidgetItem* newItem = CreateItemFor(entry);
+    dirItem->insertChild(prevItem ? (dirItem->indexOfChild(prevItem) + 1) : 0, newItem);
+    prevItem = newItem;
   }
 }
 
@@ -309,14 +327,36 @@ void ProjectTreeView::ProjectConfigured() {
 }
 
 void ProjectTreeView::FileWatcherNotification(const QString& path) {
-  // Re-load the contents of the given directory.
-  QTreeWidgetItem* dirItem = GetItemForPath(path, false);
-  if (!dirItem) {
-    qDebug() << "ERROR: ProjectTreeView got a watcher notification for path" << path << ", however no corresponding tree view item can be found.";
-    return;
+  // Files in the directory may have been moved, deleted, or replaced.
+  CanonicalPathCache::Instance().Invalidate();
+  FileStatCache::Instance().InvalidateAll();
+  
+  if (changedDirectories.empty()) {
+    firstDirectoryChangeTimer.start();
   }
+  changedDirectories.insert(path);
   
-  ReloadDirectory(dirItem);
+  // Wait until the notifications settle, but do not postpone the reload
+  // indefinitely during long-running operations.
+  int remainingMaxDelay = std::max<int>(0, kMaxDirectoryReloadDelay - firstDirectoryChangeTimer.elapsed());
+  changedDirectoriesTimer.start(std::min(kDirectoryReloadDelay, remainingMaxDelay));
+}
+
+void ProjectTreeView::ReloadChangedDirectories() {
+  std::unordered_set<QString> directories;
+  directories.swap(changedDirectories);
+  
+  tree->setUpdatesEnabled(false);
+  for (const QString& path : directories) {
+    // If there is no item for the directory anymore, then it has been
+    // collapsed, or deleted together with its parent directory in the
+    // meantime.
+    QTreeWidgetItem* dirItem = GetItemForPath(path, false);
+    if (dirItem) {
+      ReloadDirectory(dirItem);
+    }
+  }
+  tree->setUpdatesEnabled(true);
 }
 
 void ProjectTreeView::GitWatcherNotification(const QString& path) {
@@ -335,9 +375,14 @@ void ProjectTreeView::GitUpdate() {
   // Schedule all open files for a git diff update.
   // TODO: This logic seems like it would better be placed on a higher level,
   //       as it has nothing to do with the ProjectTreeView.
+  GitDiff::Instance().InvalidateCache();
   for (int i = 0; i < mainWindow->GetNumDocuments(); ++ i) {
     std::shared_ptr<Document> document = mainWindow->GetDocument(i);
     DocumentWidget* widget = mainWindow->GetWidgetForDocument(document.get());
+    if (widget->IsLargeFileMode()) {
+      // Large files are only diffed on request.
+      continue;
+    }
     GitDiff::Instance().RequestDiff(document, widget, mainWindow);
   }
 }
@@ -353,14 +398,17 @@ void ProjectTreeView::ItemExpanded(QTreeWidgetItem* item) {
   // Add a watcher for this directory.
   watcher.addPath(dir.path());
   
-  // Add the directory items as children.
-  QStringList entryList = dir.entryList(
+  // Add the directory items as children. Adding them all at once avoids
+  // repeated updates of the view for large directories.
+  QFileInfoList entries = dir.entryInfoList(
       QDir::NoDotAndDotDot | QDir::Files | QDir::Dirs | QDir::Hidden,
       QDir::Name | QDir::DirsFirst | QDir::IgnoreCase);
-  QTreeWidgetItem* lastItem = nullptr;
-  for (const QString& entry : entryList) {
-    lastItem = InsertItemFor(item, dir.filePath(entry), lastItem);
+  QList<QTreeWidgetItem*> newItems;
+  newItems.reserve(entries.size());
+  for (const QFileInfo& entry : entries) {
+    newItems.push_back(CreateItemFor(entry));
   }
+  item->addChildren(newItems);
   
   item->setChildIndicatorPolicy(QTreeWidgetItem::DontShowIndicatorWhenChildless);
 }
@@ -373,25 +421,8 @@ void ProjectTreeView::ItemCollapsed(QTreeWidgetItem* item) {
   watcher.removePath(dir.path());
   
   // Delete all children and remove any watchers for them.
-  std::vector<QTreeWidgetItem*> workList = {item};
-  std::vector<QTreeWidgetItem*> doneList;
-  while (!workList.empty()) {
-    QTreeWidgetItem* curItem = workList.back();
-    workList.pop_back();
-    
-    // Add all children to the work list
-    for (int i = curItem->childCount() - 1; i >= 0; -- i) {
-      workList.push_back(curItem->child(i));
-    }
-    
-    if (curItem != item) {
-      doneList.push_back(curItem);
-    }
-  }
-  
-  for (int i = static_cast<int>(doneList.size()) - 1; i >= 0; -- i) {
-    watcher.removePath(GetItemPath(doneList[i]));
-    delete doneList[i];
+  for (int i = item->childCount() - 1; i >= 0; -- i) {
+    DeleteItemAndWatchers(item->child(i));
   }
   
   item->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
@@ -611,49 +642,56 @@ void ProjectTreeView::DeleteSelectedItems() {
   }
 }
 
-QTreeWidgetItem* ProjectTreeView::InsertItemFor(QTreeWidgetItem* parentFolder, const QString& path, QTreeWidgetItem* prevItem) {
-  QString parentFolderPath = GetItemPath(parentFolder);
-  QDir parentDir(parentFolderPath);
-  QFileInfo fileInfo(path);
+QTreeWidgetItem* ProjectTreeView::CreateItemFor(const QFileInfo& fileInfo) {
   bool isDir = fileInfo.isDir();
   QString itemName = fileInfo.fileName();
   
-  if (prevItem == nullptr) {
-    for (int i = 0, count = parentFolder->childCount(); i < count; ++ i) {
-      QTreeWidgetItem* child = parentFolder->child(i);
-      if (isDir) {
-        if (!QFileInfo(parentDir.filePath(child->data(0, Qt::UserRole).toString())).isDir() ||
-            child->text(0) > itemName) {  // TODO: Does this comparison correspond to the file sorting of dir.entryList()?
-          break;
-        }
-      } else {
-        if (!QFileInfo(parentDir.filePath(child->data(0, Qt::UserRole).toString())).isDir() &&
-            child->text(0) > itemName) {  // TODO: Does this comparison correspond to the file sorting of dir.entryList()?
-          break;
-        }
-      }
-      prevItem = child;
-    }
-  }
-  
-  QTreeWidgetItem* newItem = new QTreeWidgetItem(parentFolder, prevItem);
+  QTreeWidgetItem* newItem = new QTreeWidgetItem();
   newItem->setText(0, itemName);
-  newItem->setIcon(0, iconProvider.icon(path));
   newItem->setData(0, Qt::UserRole, itemName);
+  newItem->setData(0, kIsDirRole, isDir);
   newItem->setChildIndicatorPolicy(QTreeWidgetItem::DontShowIndicatorWhenChildless);
   
   if (isDir) {
+    newItem->setIcon(0, folderIcon);
     if (!QDir(fileInfo.filePath()).isEmpty()) {
       newItem->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
     }
   } else {
-    QString canonicalPath = fileInfo.canonicalFilePath();
-    ApplyItemStyles(newItem, canonicalPath);
+    // Determining the icon for a file may require looking up its MIME type,
+    // so the icons are cached by file suffix.
+    auto iconIt = fileIconsBySuffix.find(fileInfo.suffix());
+    if (iconIt == fileIconsBySuffix.end()) {
+      iconIt = fileIconsBySuffix.emplace(fileInfo.suffix(), iconProvider.icon(fileInfo)).first;
+    }
+    newItem->setIcon(0, iconIt->second);
   }
   
   return newItem;
 }
 
+void ProjectTreeView::DeleteItemAndWatchers(QTreeWidgetItem* item) {
+  // Exactly the expanded directories are watched.
+  QStringList watchedPaths;
+  std::vector<QTreeWidgetItem*> workList = {item};
+  while (!workList.empty()) {
+    QTreeWidgetItem* curItem = workList.back();
+    workList.pop_back();
+    
+    if (curItem->isExpanded()) {
+      watchedPaths.push_back(GetItemPath(curItem));
+    }
+    for (int i = curItem->childCount() - 1; i >= 0; -- i) {
+      workList.push_back(curItem->child(i));
+    }
+  }
+  
+  if (!watchedPaths.isEmpty()) {
+    watcher.removePaths(watchedPaths);
+  }
+  delete item;
+}
+
 QString ProjectTreeView::GetItemPath(QTreeWidgetItem* item) {
   if (item->parent() == nullptr ||
       item->parent() == tree->invisibleRootItem()) {
@@ -733,13 +771,30 @@ std::shared_ptr<Project> ProjectTreeView::GetProjectForItem(QTreeWidgetItem* ite
   return nullptr;
 }
 
-void ProjectTreeView::ApplyItemStyles(QTreeWidgetItem* item, const QString& canonicalPath) {
+void ProjectTreeView::ApplyItemStyles(const QModelIndex& index, QStyleOptionViewItem* option) {
+  // Project items are styled via their item data.
+  if (!index.parent().isValid()) {
+    return;
+  }
+  
+  // Determine the item's path and the path of its project item. The paths of
+  // the project items are canonical, so the paths of the other items are
+  // canonical as well unless there are symlinks within the project.
+  QString path = index.data(Qt::UserRole).toString();
+  QModelIndex projectIndex = index.parent();
+  while (projectIndex.parent().isValid()) {
+    path = projectIndex.data(Qt::UserRole).toString() + QStringLiteral("/") + path;
+    projectIndex = projectIndex.parent();
+  }
+  QString projectPath = projectIndex.data(Qt::UserRole).toString();
+  path = projectPath + (projectPath.endsWith('/') ? QStringLiteral("") : QStringLiteral("/")) + path;
+  
   // Check open / current state
   bool isOpened = false;
   bool isCurrent = false;
-  if (mainWindow->IsFileOpen(canonicalPath)) {
+  if (mainWindow->IsFileOpen(path)) {
     Document* currentDocument = mainWindow->GetCurrentDocument().get();
-    if (currentDocument && currentDocument->path() == canonicalPath) {
+    if (currentDocument && currentDocument->path() == path) {
       isCurrent = true;
     } else {
       isOpened = true;
@@ -749,7 +804,7 @@ void ProjectTreeView::ApplyItemStyles(QTreeWidgetItem* item, const QString& cano
   // Check git state
   bool isModified = false;
   bool isUntracked = false;
-  ProjectGitStatus::FileStatus fileStatus = GetFileStatusFor(item);
+  ProjectGitStatus::FileStatus fileStatus = GetFileStatusFor(projectPath, path);
   switch (fileStatus) {
   case ProjectGitStatus::FileStatus::Modified:
     isModified = true;
@@ -766,28 +821,27 @@ void ProjectTreeView::ApplyItemStyles(QTreeWidgetItem* item, const QString& cano
   // Apply styles.
   auto applyStyle = [&](const Settings::ConfigurableTextStyle& style, bool force = false) {
     if (style.affectsText || force) {
-      item->setTextColor(0, style.textColor);
-      QFont font = item->font(0);
-      font.setBold(style.bold);
-      item->setFont(0, font);
+      option->palette.setColor(QPalette::Text, style.textColor);
+      option->font.setBold(style.bold);
     }
     if (style.affectsBackground || force) {
-      item->setBackgroundColor(0, style.backgroundColor);
+      option->backgroundBrush = style.backgroundColor;
     }
   };
   
-  applyStyle(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ProjectTreeViewDefault), true);
+  std::shared_ptr<const Settings::StyleSnapshot> styles = Settings::Instance().GetStyleSnapshot();
+  applyStyle(styles->GetTextStyle(Settings::TextStyle::ProjectTreeViewDefault), true);
   if (isUntracked) {
-    applyStyle(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ProjectTreeViewUntrackedItem));
+    applyStyle(styles->GetTextStyle(Settings::TextStyle::ProjectTreeViewUntrackedItem));
   }
   if (isModified) {
-    applyStyle(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ProjectTreeViewModifiedItem));
+    applyStyle(styles->GetTextStyle(Settings::TextStyle::ProjectTreeViewModifiedItem));
   }
   if (isOpened) {
-    applyStyle(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ProjectTreeViewOpenedItem));
+    applyStyle(styles->GetTextStyle(Settings::TextStyle::ProjectTreeViewOpenedItem));
   }
   if (isCurrent) {
-    applyStyle(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::ProjectTreeViewCurrentItem));
+    applyStyle(styles->GetTextStyle(Settings::TextStyle::ProjectTreeViewCurrentItem));
   }
 }
 
@@ -801,114 +855,139 @@ void ProjectTreeView::SetProjectMayRequireReconfiguration(QTreeWidgetItem* item,
   }
 }
 
+/// Appends the paths of the file items among the children of @p item, which
+/// has the path @p itemPath, to @p paths. Recurses into expanded directories.
+static void AppendVisibleFilePaths(QTreeWidgetItem* item, const QString& itemPath, std::vector<QString>* paths) {
+  QString prefix = itemPath + (itemPath.endsWith('/') ? QStringLiteral("") : QStringLiteral("/"));
+  for (int i = 0, count = item->childCount(); i < count; ++ i) {
+    QTreeWidgetItem* child = item->child(i);
+    QString childPath = prefix + child->data(0, Qt::UserRole).toString();
+    if (!child->data(0, kIsDirRole).toBool()) {
+      paths->push_back(childPath);
+    } else if (child->isExpanded()) {
+      AppendVisibleFilePaths(child, childPath, paths);
+    }
+  }
+}
+
 void ProjectTreeView::UpdateGitStatus() {
-  // TODO: Perform this in a background thread
+  StallMarker stallMarker("ProjectTreeView::UpdateGitStatus");
+  std::vector<QString> projectPaths;
+  std::unordered_map<QString, QString> projectPathsByCanonicalPath;
+  for (const auto& project : mainWindow->GetProjects()) {
+    projectPaths.push_back(QFileInfo(project->GetYAMLFilePath()).dir().path());
+    projectPathsByCanonicalPath[QFileInfo(projectPaths.back()).canonicalFilePath()] = projectPaths.back();
+  }
   
-  projectGitStatuses.clear();
+  // Collect the files in the expanded directories, whose status is queried
+  // first. Their paths are built like in ApplyItemStyles().
+  std::unordered_map<QString, std::vector<QString>> visibleFiles;
+  QTreeWidgetItem* treeRoot = tree->invisibleRootItem();
+  for (int i = 0, count = treeRoot->childCount(); i < count; ++ i) {
+    QTreeWidgetItem* projectItem = treeRoot->child(i);
+    QString projectItemPath = projectItem->data(0, Qt::UserRole).toString();
+    auto pathIt = projectPathsByCanonicalPath.find(projectItemPath);
+    if (projectItem->isExpanded() && pathIt != projectPathsByCanonicalPath.end()) {
+      AppendVisibleFilePaths(projectItem, projectItemPath, &visibleFiles[pathIt->second]);
+    }
+  }
   
-  for (const auto& project : mainWindow->GetProjects()) {
-    QString projectPath = QFileInfo(project->GetYAMLFilePath()).dir().path();
-    
-    // Open repository
-    git_repository* repo = nullptr;
-    int result = git_repository_open_ext(&repo, projectPath.toLocal8Bit(), GIT_REPOSITORY_OPEN_NO_SEARCH, nullptr);
-    std::shared_ptr<git_repository> repo_deleter(repo, [&](git_repository* repo){ git_repository_free(repo); });
-    if (result == GIT_ENOTFOUND) {
-      // There is no git repository at the project path.
-      continue;
-    } else if (result != 0) {
-      qDebug() << "Failed to open the git repository at" << projectPath << "(some possible reasons: repo corruption or system errors), libgit2 error code:" << result;
-      continue;
+  // The callback is called in the Qt thread, so the QPointer can be checked
+  // safely there.
+  QPointer<ProjectTreeView> self(this);
+  GitStatus::Instance().RequestStatus(projectPaths, visibleFiles, [self](ProjectGitStatusMap* statuses) {
+    if (self) {
+      self->SetGitStatuses(statuses);
     }
-    
-    if (git_repository_is_bare(repo)) {
+  });
+}
+
+void ProjectTreeView::SetGitStatuses(ProjectGitStatusMap* newStatuses) {
+  // Statuses that were only queried for some files update the current status
+  // of these files. The statuses of the other projects remain as they are.
+  bool isPartialUpdate = false;
+  for (auto& item : *newStatuses) {
+    ProjectGitStatus* partialStatus = item.second.get();
+    if (partialStatus->queriedPaths.empty()) {
       continue;
     }
+    isPartialUpdate = true;
     
-    std::shared_ptr<ProjectGitStatus> projectStatus(new ProjectGitStatus());
-    projectGitStatuses[projectPath] = projectStatus;
-    
-    // Get the branch name for HEAD
-    git_reference* head = nullptr;
-    result = git_repository_head(&head, repo);
-    std::shared_ptr<git_reference> head_deleter(head, [&](git_reference* ref){ git_reference_free(ref); });
-    
-    if (result == GIT_EUNBORNBRANCH || result == GIT_ENOTFOUND) {
-      projectStatus->branchName = tr("(not on any branch)");
-    } else if (result != 0) {
-      qDebug() << "There was an error getting the branch for the git repository at" << projectPath << ", libgit2 error code:" << result;
-      continue;
-    } else {
-      projectStatus->branchName = QString::fromUtf8(git_reference_shorthand(head));
+    std::shared_ptr<ProjectGitStatus> mergedStatus(new ProjectGitStatus());
+    auto oldIt = projectGitStatuses.find(item.first);
+    if (oldIt != projectGitStatuses.end()) {
+      *mergedStatus = *oldIt->second;
     }
-    
-    // Get the working directory of the repository. Returned paths will be relative to this directory.
-    QDir workDir(QString::fromLocal8Bit(git_repository_workdir(repo)));
-    
-    // Query repository status (i.e.: lists of untracked files in working copy, and modified files between HEAD->index and index->worktree).
-    // We display the merged HEAD<->index and index<->worktree differences here.
-    git_status_options opts;
-    memset(&opts, 0, sizeof(git_status_options));
-    opts.version = GIT_STATUS_OPTIONS_INIT;
-    opts.show  = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
-    opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
-                 GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
-    git_status_list* status = nullptr;
-    result = git_status_list_new(&status, repo, &opts);
-    std::shared_ptr<git_status_list> status_deleter(status, [&](git_status_list* status){ git_status_list_free(status); });
-    if (result != 0) {
-      qDebug() << "There was an error getting the status list for the git repository at" << projectPath << ", libgit2 error code:" << result;
-      continue;
+    mergedStatus->branchName = partialStatus->branchName;
+    mergedStatus->queriedPaths.clear();
+    for (const QString& path : partialStatus->queriedPaths) {
+      auto newFileIt = partialStatus->fileStatuses.find(path);
+      if (newFileIt != partialStatus->fileStatuses.end()) {
+        mergedStatus->fileStatuses[path] = newFileIt->second;
+      } else {
+        mergedStatus->fileStatuses.erase(path);
+      }
     }
-    
-    int numStatusItems = git_status_list_entrycount(status);
-    for (int i = 0; i < numStatusItems; ++ i) {
-      const git_status_entry* s = git_status_byindex(status, i);
+    mergedStatus->numModifications = 0;
+    mergedStatus->numUntracked = 0;
+    for (const auto& fileStatus : mergedStatus->fileStatuses) {
+      if (fileStatus.second == ProjectGitStatus::FileStatus::Modified) {
+        ++ mergedStatus->numModifications;
+      } else if (fileStatus.second == ProjectGitStatus::FileStatus::Untracked) {
+        ++ mergedStatus->numUntracked;
+      }
+    }
+    item.second = mergedStatus;
+  }
+  if (isPartialUpdate) {
+    for (const auto& item : projectGitStatuses) {
+      newStatuses->emplace(item.first, item.second);
+    }
+  }
+  
+  // Determine the files whose status changed. Only the items for those need to
+  // be re-styled.
+  std::unordered_set<QString> changedPaths;
+  auto addChangedPaths = [&](const ProjectGitStatusMap& statuses, const ProjectGitStatusMap& otherStatuses) {
+    for (const auto& projectStatus : statuses) {
+      auto otherIt = otherStatuses.find(projectStatus.first);
+      const ProjectGitStatus* otherStatus = (otherIt != otherStatuses.end()) ? otherIt->second.get() : nullptr;
       
-      if (s->index_to_workdir && s->status == GIT_STATUS_WT_NEW) {
-        // Untracked file.
-        QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(s->index_to_workdir->old_file.path))).canonicalFilePath();
-        projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Untracked;
-      } else if (s->status == GIT_STATUS_CURRENT) {
-        // No changes to this file.
-        continue;
-      } else if ((s->status & GIT_STATUS_INDEX_NEW) ||
-                 (s->status & GIT_STATUS_INDEX_MODIFIED) ||
-                 (s->status & GIT_STATUS_INDEX_TYPECHANGE)) {
-        // Modified file (HEAD<->index).
-        const char* old_path = s->head_to_index->old_file.path;
-        const char* new_path = s->head_to_index->new_file.path;
-        QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(old_path ? old_path : new_path))).canonicalFilePath();
-        projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Modified;
-      } else if (s->index_to_workdir &&
-                 ((s->status & GIT_STATUS_WT_MODIFIED) ||
-                  (s->status & GIT_STATUS_WT_TYPECHANGE) ||
-                  (s->status & GIT_STATUS_WT_RENAMED))) {
-        // Modified file (index<->worktree).
-        const char* old_path = s->index_to_workdir->old_file.path;
-        const char* new_path = s->index_to_workdir->new_file.path;
-        QString filePath = QFileInfo(workDir.filePath(QString::fromLocal8Bit(old_path ? old_path : new_path))).canonicalFilePath();
-        projectStatus->fileStatuses[filePath] = ProjectGitStatus::FileStatus::Modified;
+      for (const auto& fileStatus : projectStatus.second->fileStatuses) {
+        if (!otherStatus) {
+          changedPaths.insert(fileStatus.first);
+          continue;
+        }
+        auto otherFileIt = otherStatus->fileStatuses.find(fileStatus.first);
+        if (otherFileIt == otherStatus->fileStatuses.end() || otherFileIt->second != fileStatus.second) {
+          changedPaths.insert(fileStatus.first);
+        }
       }
     }
+  };
+  addChangedPaths(projectGitStatuses, *newStatuses);
+  addChangedPaths(*newStatuses, projectGitStatuses);
+  
+  projectGitStatuses.swap(*newStatuses);
+  
+  // Repaint the visible items, which applies their new styles.
+  if (!changedPaths.empty()) {
+    tree->viewport()->update();
   }
   
-  UpdateHighlighting();
+  QTreeWidgetItem* treeRoot = tree->invisibleRootItem();
+  for (int i = 0, count = treeRoot->childCount(); i < count; ++ i) {
+    UpdateProjectItemText(treeRoot->child(i));
+  }
 }
 
-ProjectTreeView::ProjectGitStatus::FileStatus ProjectTreeView::GetFileStatusFor(QTreeWidgetItem* item) {
-  QTreeWidgetItem* projectItem = item;
-  while (projectItem->parent() && projectItem->parent() != tree->invisibleRootItem()) {
-    projectItem = projectItem->parent();
-  }
-  
-  QString projectPath = projectItem->data(0, Qt::UserRole).toString();
+ProjectGitStatus::FileStatus ProjectTreeView::GetFileStatusFor(const QString& projectPath, const QString& path) {
   auto projectIt = projectGitStatuses.find(projectPath);
   if (projectIt == projectGitStatuses.end()) {
     return ProjectGitStatus::FileStatus::Invalid;
   }
   
-  auto fileIt = projectIt->second->fileStatuses.find(GetItemPath(item));
+  auto fileIt = projectIt->second->fileStatuses.find(path);
   if (fileIt == projectIt->second->fileStatuses.end()) {
     return ProjectGitStatus::FileStatus::NotModified;
   }
@@ -6,26 +6,33 @@
 
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <QFileIconProvider>
+#include <QElapsedTimer>
 #include <QFileSystemWatcher>
 #include <QObject>
 #include <QTimer>
 
 #include "cide/find_and_replace_in_files.h"
+#include "cide/git_status.h"
 #include "cide/util.h"
 
 class DockWidgetWithClosedSignal;
 class MainWindow;
 class Project;
 class QAction;
+class QFileInfo;
 class QMenu;
+class QModelIndex;
+class QStyleOptionViewItem;
 class QTreeWidgetItem;
 class TreeWidgetWithRightClickSignal;
 
 /// Displays a file tree of the opened projects.
 class ProjectTreeView : public QObject {
  Q_OBJECT
+ friend class ProjectTreeItemDelegate;
  public:
   ~ProjectTreeView();
   void Initialize(MainWindow* mainWindow, QAction* showProjectFilesDockAction, FindAndReplaceInFiles* findAndReplaceInFiles);
@@ -43,12 +50,17 @@ class ProjectTreeView : public QObject {
   
   void UpdateProjects();
   void UpdateHighlighting();
+  
+  /// Updates the children of the given (expanded) directory item to the
+  /// current directory contents. Items for entries that still exist are kept,
+  /// including their expanded sub-trees.
   void ReloadDirectory(QTreeWidgetItem* dirItem);
   
   void ProjectMayRequireReconfiguration();
   void ProjectConfigured();
   
   void FileWatcherNotification(const QString& path);
+  void ReloadChangedDirectories();
   void GitWatcherNotification(const QString& path);
   void GitUpdate();
   
@@ -68,29 +80,30 @@ class ProjectTreeView : public QObject {
   void UpdateGitStatus();
   
  private:
-  struct ProjectGitStatus {
-    enum class FileStatus {
-      Modified = 0,
-      Untracked,
-      
-      NotModified,
-      Invalid
-    };
-    
-    QString branchName;
-    
-    /// Maps the full canonical path of the file to its status
-    std::unordered_map<QString, FileStatus> fileStatuses;
-  };
-  
-  QTreeWidgetItem* InsertItemFor(QTreeWidgetItem* parentFolder, const QString& path, QTreeWidgetItem* prevItem = nullptr);
+  /// Creates a (parentless) item for the file or directory @p fileInfo.
+  QTreeWidgetItem* CreateItemFor(const QFileInfo& fileInfo);
   QString GetItemPath(QTreeWidgetItem* item);
   QTreeWidgetItem* GetItemForPath(const QString& path, bool expandCollapsedDirs);
   std::shared_ptr<Project> GetProjectForItem(QTreeWidgetItem* item);
-  void ApplyItemStyles(QTreeWidgetItem* item, const QString& canonicalPath);
+  
+  /// Applies the styles for the git status and opened state of the item with
+  /// the given @p index to @p option. Called by ProjectTreeItemDelegate when
+  /// painting the item.
+  void ApplyItemStyles(const QModelIndex& index, QStyleOptionViewItem* option);
   void SetProjectMayRequireReconfiguration(QTreeWidgetItem* item, bool enable);
+  void UpdateProjectItemText(QTreeWidgetItem* projectItem);
+  
+  /// Deletes @p item and all of its children, and stops watching the
+  /// directories among them.
+  void DeleteItemAndWatchers(QTreeWidgetItem* item);
   
-  ProjectGitStatus::FileStatus GetFileStatusFor(QTreeWidgetItem* item);
+  /// Replaces projectGitStatuses with @p newStatuses and repaints the items if
+  /// the status of any file changed.
+  void SetGitStatuses(ProjectGitStatusMap* newStatuses);
+  
+  /// Returns the git status of the file with the given @p path in the project
+  /// whose (project item) path is @p projectPath.
+  ProjectGitStatus::FileStatus GetFileStatusFor(const QString& projectPath, const QString& path);
   
   
   QMenu* contextMenu;
@@ -109,15 +122,25 @@ class ProjectTreeView : public QObject {
   DockWidgetWithClosedSignal* dock;
   TreeWidgetWithRightClickSignal* tree;
   QFileIconProvider iconProvider;
+  QIcon folderIcon;
+  std::unordered_map<QString, QIcon> fileIconsBySuffix;
   
   QColor projectNeedingReconfigurationColor = qRgb(255, 255, 180);
   
-  std::unordered_map<QString, std::shared_ptr<ProjectGitStatus>> projectGitStatuses;
+  ProjectGitStatusMap projectGitStatuses;
   QFileSystemWatcher gitWatcher;
   QTimer gitUpdateTimer;
   
   QFileSystemWatcher watcher;
   
+  /// Directories for which the watcher reported changes, which are reloaded
+  /// together once the changes have settled (see ReloadChangedDirectories()).
+  /// This turns the many notifications caused by, for example, a git checkout
+  /// into a single reload of each affected directory.
+  std::unordered_set<QString> changedDirectories;
+  QTimer changedDirectoriesTimer;
+  QElapsedTimer firstDirectoryChangeTimer;
+  
   FindAndReplaceInFiles* findAndReplaceInFiles;
   MainWindow* mainWindow;
 };
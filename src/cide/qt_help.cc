@@ -8,9 +8,21 @@
 #include <QDebug>
 #include <QDir>
 #include <QHelpEngineCore>
+#include <QPointer>
+#include <QRegularExpression>
+#include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QTimer>
 
+#include "cide/qt_thread.h"
+
+/// Maximum number of files kept in the cache of QtHelp::GetFileData(). This
+/// is enough for a few pages including their images.
+constexpr int kFileDataCacheSize = 64;
+
 QtHelp::QtHelp() {
+  cancelIndexing = false;
+  
   // Start the help engine with a collection file where all external help files
   // will be registered. The collection file will be created if it does not exist
   // yet.
@@ -23,6 +35,7 @@ QtHelp::QtHelp() {
 }
 
 QtHelp::~QtHelp() {
+  Exit();
   delete helpEngine;
 }
 
@@ -43,6 +56,11 @@ bool QtHelp::RegisterQCHFile(const QString& path, QString* errorReason) {
   if (!result) {
     *errorReason = helpEngine->error();
   }
+  lock.unlock();
+  
+  if (result) {
+    BuildIdentifierIndex();
+  }
   return result;
 }
 
@@ -58,6 +76,11 @@ bool QtHelp::UnregisterNamespace(const QString& namespaceName, QString* errorRea
   if (!result) {
     *errorReason = helpEngine->error();
   }
+  lock.unlock();
+  
+  if (result) {
+    BuildIdentifierIndex();
+  }
   return result;
 }
 
@@ -89,6 +112,14 @@ QUrl QtHelp::QueryIdentifier(const QString& identifier) {
     return QUrl();
   }
   
+  std::unique_lock<std::mutex> indexLock(identifierIndexMutex);
+  if (identifierIndex) {
+    auto it = identifierIndex->find(identifier);
+    return (it != identifierIndex->end()) ? it->second : QUrl();
+  }
+  indexLock.unlock();
+  
+  std::unique_lock<std::mutex> lock(engineMutex);
   QMap<QString, QUrl> links = helpEngine->linksForIdentifier(identifier);
   if (links.count()) {
     return links.constBegin().value();
@@ -98,11 +129,191 @@ QUrl QtHelp::QueryIdentifier(const QString& identifier) {
 }
 
 QByteArray QtHelp::GetFileData(const QUrl& url) {
+  QString key = GetFileDataCacheKey(url);
+  std::unique_lock<std::mutex> cacheLock(fileDataCacheMutex);
+  auto it = fileDataCacheMap.find(key);
+  if (it != fileDataCacheMap.end()) {
+    fileDataCache.splice(fileDataCache.begin(), fileDataCache, it->second);
+    return it->second->second;
+  }
+  cacheLock.unlock();
+  
+  std::unique_lock<std::mutex> engineLock(engineMutex);
   if (!IsReady()) {
     return QByteArray();
-  } else {
-    return helpEngine->fileData(url);
   }
+  QByteArray data = helpEngine->fileData(url);
+  engineLock.unlock();
+  
+  cacheLock.lock();
+  if (fileDataCacheMap.count(key) == 0) {
+    fileDataCache.emplace_front(key, data);
+    fileDataCacheMap[key] = fileDataCache.begin();
+    while (fileDataCache.size() > kFileDataCacheSize) {
+      fileDataCacheMap.erase(fileDataCache.back().first);
+      fileDataCache.pop_back();
+    }
+  }
+  return data;
+}
+
+bool QtHelp::IsFileDataCached(const QUrl& url) {
+  std::unique_lock<std::mutex> lock(fileDataCacheMutex);
+  return fileDataCacheMap.count(GetFileDataCacheKey(url)) > 0;
+}
+
+QString QtHelp::GetFileDataCacheKey(const QUrl& url) {
+  return url.toString(QUrl::RemoveFragment);
+}
+
+void QtHelp::LoadPageAsync(const QUrl& url, std::function<void()>&& callback) {
+  std::unique_lock<std::mutex> lock(loaderMutex);
+  loaderRequests.emplace_back(url, std::move(callback));
+  if (!loaderThread) {
+    loaderThread.reset(new std::thread(&QtHelp::LoaderThreadMain, this));
+  }
+  lock.unlock();
+  loaderCondition.notify_one();
+}
+
+void QtHelp::LoaderThreadMain() {
+  // Images and style sheets referenced by a page.
+  QRegularExpression resourceRegex(QStringLiteral("<(?:img\\s[^>]*\\bsrc|link\\s[^>]*\\bhref)\\s*=\\s*\"([^\"]+)\""), QRegularExpression::CaseInsensitiveOption);
+  
+  std::unique_lock<std::mutex> lock(loaderMutex);
+  while (true) {
+    loaderCondition.wait(lock, [&]() { return exitLoader || !loaderRequests.empty(); });
+    if (exitLoader) {
+      return;
+    }
+    std::pair<QUrl, std::function<void()>> request = std::move(loaderRequests.front());
+    loaderRequests.pop_front();
+    lock.unlock();
+    
+    QByteArray page = GetFileData(request.first);
+    QRegularExpressionMatchIterator matchIt = resourceRegex.globalMatch(QString::fromUtf8(page));
+    while (matchIt.hasNext()) {
+      QUrl resourceUrl(matchIt.next().captured(1));
+      if (resourceUrl.isRelative()) {
+        resourceUrl = request.first.resolved(resourceUrl);
+      }
+      GetFileData(resourceUrl);
+    }
+    
+    PostToQtThread(std::move(request.second));
+    
+    lock.lock();
+  }
+}
+
+void QtHelp::BuildIdentifierIndex() {
+  // The registered files may have changed, so the cached file data may be
+  // outdated.
+  std::unique_lock<std::mutex> cacheLock(fileDataCacheMutex);
+  fileDataCache.clear();
+  fileDataCacheMap.clear();
+  cacheLock.unlock();
+  
+  // Stop a previous, now outdated, index build.
+  if (indexThread) {
+    cancelIndexing = true;
+    indexThread->join();
+    indexThread.reset();
+    cancelIndexing = false;
+  }
+  
+  std::unique_lock<std::mutex> lock(engineMutex);
+  if (!IsReady()) {
+    return;
+  }
+  QStringList namespaces = helpEngine->registeredDocumentations();
+  QStringList qchPaths;
+  for (const QString& namespaceName : namespaces) {
+    qchPaths << helpEngine->documentationFileName(namespaceName);
+  }
+  lock.unlock();
+  
+  indexThread.reset(new std::thread(&QtHelp::IndexThreadMain, this, namespaces, qchPaths));
+}
+
+void QtHelp::Exit() {
+  if (indexThread) {
+    cancelIndexing = true;
+    indexThread->join();
+    indexThread.reset();
+  }
+  
+  std::unique_lock<std::mutex> lock(loaderMutex);
+  exitLoader = true;
+  lock.unlock();
+  loaderCondition.notify_all();
+  if (loaderThread) {
+    loaderThread->join();
+    loaderThread.reset();
+  }
+}
+
+void QtHelp::IndexThreadMain(QStringList namespaces, QStringList qchPaths) {
+  // Like QHelpEngineCore::linksForIdentifier(), use the link to the file with
+  // the alphabetically first title if there are multiple for an identifier.
+  std::unordered_map<QString, std::pair<QString, QUrl>> titlesAndUrls;
+  
+  for (int i = 0; i < qchPaths.size(); ++ i) {
+    // The .qch files are SQLite databases. Read them directly, since
+    // QHelpEngineCore does not provide a way to list all identifiers.
+    QString connectionName = QStringLiteral("cide_qch_index_%1").arg(i);
+    {
+      QSqlDatabase database = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), connectionName);
+      database.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY"));
+      database.setDatabaseName(qchPaths[i]);
+      if (!database.open()) {
+        qDebug() << "QtHelp: Failed to open" << qchPaths[i] << "for indexing";
+      } else {
+        QSqlQuery query(database);
+        query.setForwardOnly(true);
+        if (!query.exec(QStringLiteral(
+            "SELECT a.Identifier, d.Title, e.Name, d.Name, a.Anchor "
+            "FROM IndexTable a, FileNameTable d, FolderTable e "
+            "WHERE a.FileId = d.FileId AND d.FolderId = e.Id AND a.Identifier != ''"))) {
+          qDebug() << "QtHelp: Failed to read the identifiers of" << qchPaths[i];
+        }
+        while (query.next()) {
+          if (cancelIndexing) {
+            break;
+          }
+          
+          QString title = query.value(1).toString();
+          auto it = titlesAndUrls.find(query.value(0).toString());
+          if (it != titlesAndUrls.end() && it->second.first <= title) {
+            continue;
+          }
+          
+          QString anchor = query.value(4).toString();
+          QUrl url(QStringLiteral("qthelp://") + namespaces[i] + QStringLiteral("/") + query.value(2).toString() + QStringLiteral("/") + query.value(3).toString() +
+                   (anchor.isEmpty() ? QStringLiteral("") : (QStringLiteral("#") + anchor)));
+          if (it != titlesAndUrls.end()) {
+            it->second = std::make_pair(title, url);
+          } else {
+            titlesAndUrls.emplace(query.value(0).toString(), std::make_pair(title, url));
+          }
+        }
+      }
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    
+    if (cancelIndexing) {
+      return;
+    }
+  }
+  
+  std::shared_ptr<IdentifierIndex> newIndex(new IdentifierIndex());
+  newIndex->reserve(titlesAndUrls.size());
+  for (auto& item : titlesAndUrls) {
+    newIndex->emplace(item.first, std::move(item.second.second));
+  }
+  
+  std::unique_lock<std::mutex> lock(identifierIndexMutex);
+  identifierIndex = newIndex;
 }
 
 
@@ -114,7 +325,19 @@ HelpBrowser::HelpBrowser(QWidget* parent)
 void HelpBrowser::setSource(const QUrl& name) {
   currentUrl = name;
   
-  QTextBrowser::setSource(name);
+  if (QtHelp::Instance().IsFileDataCached(name)) {
+    QTextBrowser::setSource(name);
+    return;
+  }
+  
+  // Load the page in the background, such that reading it from the .qch file
+  // does not stall the Qt thread.
+  QPointer<HelpBrowser> browser(this);
+  QtHelp::Instance().LoadPageAsync(name, [browser, name]() {
+    if (browser && browser->currentUrl == name) {
+      browser->QTextBrowser::setSource(name);
+    }
+  });
 }
 
 QVariant HelpBrowser::loadResource(int type, const QUrl& name) {
@@ -4,9 +4,20 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <QTextBrowser>
+#include <QUrl>
+
+#include "cide/util.h"
 
 class QHelpEngineCore;
 
@@ -30,16 +41,71 @@ class QtHelp {
   QStringList GetRegisteredNamespaces();
   
   /// Queries for documentation for the given identifier
-  /// (for example, "std::string::push_back" or "QString").
+  /// (for example, "std::string::push_back" or "QString"). Once the
+  /// identifier index is built (see BuildIdentifierIndex()), this is a hash
+  /// map lookup, otherwise it queries the help engine.
   QUrl QueryIdentifier(const QString& identifier);
   
+  /// Returns the (decompressed) content of the file at @p url. Recently used
+  /// files are cached. This is thread-safe.
   QByteArray GetFileData(const QUrl& url);
   
+  /// Returns whether the content of the file at @p url is cached, such that
+  /// GetFileData() returns quickly.
+  bool IsFileDataCached(const QUrl& url);
+  
+  /// Loads the page at @p url and the images and style sheets that it
+  /// references into the cache of GetFileData() in a background thread, and
+  /// then calls @p callback in the Qt thread. This allows to display pages
+  /// without reading them from the .qch files in the Qt thread.
+  void LoadPageAsync(const QUrl& url, std::function<void()>&& callback);
+  
+  /// Starts building an in-memory index of all identifiers in the registered
+  /// documentation files in a background thread. This is called at startup
+  /// and whenever the registered files change.
+  void BuildIdentifierIndex();
+  
+  /// Stops building the identifier index. Must be called before exiting the
+  /// program.
+  void Exit();
+  
  private:
+  typedef std::unordered_map<QString, QUrl> IdentifierIndex;
+  
   QtHelp();
   
+  /// Reads the identifiers of the given .qch files into a new index.
+  void IndexThreadMain(QStringList namespaces, QStringList qchPaths);
+  
+  /// Processes the requests of LoadPageAsync().
+  void LoaderThreadMain();
+  
+  /// Returns the key of @p url in the file data cache.
+  static QString GetFileDataCacheKey(const QUrl& url);
+  
   std::mutex engineMutex;
   QHelpEngineCore* helpEngine;
+  
+  /// Maps identifiers to the URL of their documentation, or null if the index
+  /// has not been built yet. Protected by identifierIndexMutex.
+  std::shared_ptr<const IdentifierIndex> identifierIndex;
+  std::mutex identifierIndexMutex;
+  
+  std::unique_ptr<std::thread> indexThread;
+  std::atomic<bool> cancelIndexing;
+  
+  /// Cache for GetFileData(), ordered from the most recently to the least
+  /// recently used file. Protected by fileDataCacheMutex.
+  std::list<std::pair<QString, QByteArray>> fileDataCache;
+  std::unordered_map<QString, std::list<std::pair<QString, QByteArray>>::iterator> fileDataCacheMap;
+  std::mutex fileDataCacheMutex;
+  
+  /// Requests of LoadPageAsync(), protected by loaderMutex.
+  std::deque<std::pair<QUrl, std::function<void()>>> loaderRequests;
+  bool exitLoader = false;
+  std::mutex loaderMutex;
+  std::condition_variable loaderCondition;
+  std::unique_ptr<std::thread> loaderThread;
 };
 
 /// Widget to display a help page loaded from a .qch documentation file via QtHelp.
@@ -48,6 +114,9 @@ class HelpBrowser : public QTextBrowser {
  public:
   HelpBrowser(QWidget* parent = nullptr);
   
+  /// Shows the page at @p name. If the page is not cached by QtHelp, it is
+  /// loaded in the background first, and shown once it is loaded (unless
+  /// setSource() has been called again in the meantime).
   void setSource(const QUrl& name) override;
   QVariant loadResource(int type, const QUrl& name) override;
   
@@ -5,19 +5,112 @@
 #include "cide/qt_thread.h"
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include <QApplication>
 #include <QDebug>
 #include <QThread>
 #include <QTimer>
 
+#include "cide/performance_counters.h"
+#include "cide/profiler.h"
+#include "cide/stall_detector.h"
+
+/// A function queued with PostToQtThread(), together with its call site.
+struct QueuedFunction {
+  std::function<void()> f;
+  const char* callerFile;
+  int callerLine;
+};
+
+/// The queue of functions for PostToQtThread().
+struct QtThreadQueue {
+  std::mutex mutex;
+  std::vector<QueuedFunction> functions;
+  
+  /// Index of the next function in functions to run.
+  std::size_t next = 0;
+  
+  /// Single-shot timer (living in the Qt thread) that runs the queued
+  /// functions when it fires.
+  QTimer* timer = nullptr;
+  
+  /// Whether the timer has been started (or the queue is being processed) such
+  /// that the functions that are queued now will be run without starting the
+  /// timer again.
+  bool runScheduled = false;
+};
+
+static QtThreadQueue& GetQtThreadQueue() {
+  static QtThreadQueue queue;
+  return queue;
+}
+
+static void RunQueuedFunctionsInQtThread() {
+  QtThreadQueue& queue = GetQtThreadQueue();
+  std::unique_lock<std::mutex> lock(queue.mutex);
+  while (queue.next < queue.functions.size()) {
+    QueuedFunction& queued = queue.functions[queue.next];
+    std::function<void()> f;
+    f.swap(queued.f);
+    const char* callerFile = queued.callerFile;
+    int callerLine = queued.callerLine;
+    ++ queue.next;
+    if (queue.next < queue.functions.size()) {
+      // If f runs a nested event loop, the remaining functions must still be
+      // run by it, since f might wait for a thread that waits for them.
+      queue.timer->start(0);
+    }
+    lock.unlock();
+    {
+      StallMarker marker("PostToQtThread", callerFile, callerLine);
+      f();
+    }
+    lock.lock();
+  }
+  queue.functions.clear();
+  queue.next = 0;
+  queue.runScheduled = false;
+}
+
+bool PostToQtThread(
+    std::function<void()>&& f,
+    const char* callerFile,
+    int callerLine) {
+  // If there is no qApp, we cannot run the function.
+  if (!qApp) {
+    qDebug() << "Error: PostToQtThread(): No qApp exists. Not running the function.";
+    return false;
+  }
+  
+  QtThreadQueue& queue = GetQtThreadQueue();
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  queue.functions.push_back(QueuedFunction{std::move(f), callerFile, callerLine});
+  if (queue.runScheduled) {
+    return true;
+  }
+  queue.runScheduled = true;
+  
+  if (!queue.timer) {
+    queue.timer = new QTimer();
+    queue.timer->moveToThread(qApp->thread());
+    queue.timer->setSingleShot(true);
+    QObject::connect(queue.timer, &QTimer::timeout, &RunQueuedFunctionsInQtThread);
+  }
+  QMetaObject::invokeMethod(queue.timer, "start", Qt::QueuedConnection, Q_ARG(int, 0));
+  return true;
+}
+
 bool RunInQtThreadBlocking(
-    const std::function<void()>& f) {
+    const std::function<void()>& f,
+    const char* callerFile,
+    int callerLine) {
   // If there is no qApp, we cannot run the function.
   if (!qApp) {
     qDebug() << "Error: RunInQtThreadBlocking(): No qApp exists. Not running the function.";
@@ -26,33 +119,38 @@ bool RunInQtThreadBlocking(
   
   // If the current thread is the Qt thread, we can run the function directly.
   if (QThread::currentThread() == qApp->thread()) {
+    StallMarker marker("RunInQtThreadBlocking", callerFile, callerLine);
     f();
     return true;
   }
   
-  // Use a queued connection to run the function.
+  // Queue the function for the Qt thread.
+  ProfilerScope profilerScope("RunInQtThreadBlocking");
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  double runMs = 0;
   std::mutex done_mutex;
   std::condition_variable done_condition;
   std::atomic<bool> done;
   done = false;
   
-  QTimer* timer = new QTimer();
-  timer->moveToThread(qApp->thread());
-  timer->setSingleShot(true);
-  QObject::connect(timer, &QTimer::timeout, [&]() {
+  PostToQtThread([&]() {
+    std::chrono::steady_clock::time_point runStartTime = std::chrono::steady_clock::now();
+    StallMarker marker("RunInQtThreadBlocking", callerFile, callerLine);
     f();
-    timer->deleteLater();
+    runMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStartTime).count();
     
     std::lock_guard<std::mutex> lock(done_mutex);
     done = true;
     done_condition.notify_all();
-  });
-  QMetaObject::invokeMethod(timer, "start", Qt::QueuedConnection, Q_ARG(int, 0));
+  }, callerFile, callerLine);
   
   std::unique_lock<std::mutex> lock(done_mutex);
   while (!done) {
     done_condition.wait(lock);
   }
+  lock.unlock();
+  PerformanceCounters::Instance().RecordQtThreadBlockingCall(
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count(), runMs);
   return true;
 }
 
@@ -60,7 +158,9 @@ bool RunInQtThreadBlocking(
     const std::function<void()>& f,
     std::mutex* abortedMutex,
     std::atomic<bool>* aborted,
-    std::condition_variable* abortedCondition) {
+    std::condition_variable* abortedCondition,
+    const char* callerFile,
+    int callerLine) {
   // If aborted is already true, exit right away.
   if (aborted && *aborted) {
     return false;
@@ -74,11 +174,13 @@ bool RunInQtThreadBlocking(
   
   // If the current thread is the Qt thread, we can run the function directly.
   if (QThread::currentThread() == qApp->thread()) {
+    StallMarker marker("RunInQtThreadBlocking", callerFile, callerLine);
     f();
     return true;
   }
   
-  // Use a queued connection to run the function.
+  // Queue the function for the Qt thread.
+  ProfilerScope profilerScope("RunInQtThreadBlocking");
   std::mutex done_mutex;
   std::mutex* mutexToUse = abortedMutex ? abortedMutex : &done_mutex;
   std::condition_variable done_condition;
@@ -92,32 +194,27 @@ bool RunInQtThreadBlocking(
   std::shared_ptr<std::atomic<bool>> lambdaExited(new std::atomic<bool>());
   *lambdaExited = false;
   
-  QTimer* timer = new QTimer();
-  timer->moveToThread(qApp->thread());
-  timer->setSingleShot(true);
-  QObject::connect(timer, &QTimer::timeout, [&, timer, abortExecutionMutex, abortExecution, lambdaExited]() {
+  PostToQtThread([&, abortExecutionMutex, abortExecution, lambdaExited]() {
     std::lock_guard<std::mutex> abortExecutionLock(*abortExecutionMutex);
     if (*abortExecution) {
-      timer->deleteLater();
       *lambdaExited = true;
       return;
     }
     
     std::lock_guard<std::mutex> lock(*mutexToUse);
     if (*abortExecution) {
-      timer->deleteLater();
       *lambdaExited = true;
       return;
     }
     
-    f();
-    
-    timer->deleteLater();
+    {
+      StallMarker marker("RunInQtThreadBlocking", callerFile, callerLine);
+      f();
+    }
     
     done = true;
     conditionToUse->notify_all();
-  });
-  QMetaObject::invokeMethod(timer, "start", Qt::QueuedConnection, Q_ARG(int, 0));
+  }, callerFile, callerLine);
   
   // Wait for the function to finish, or for RunInQtThreadBlocking() to be aborted.
   std::unique_lock<std::mutex> lock(*mutexToUse);
@@ -7,12 +7,55 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+
+#include "cide/stall_detector.h"
+
+/// Queues function @p f to be run in the Qt thread and returns without waiting
+/// for it. All functions queued with this (including those of the
+/// RunInQtThread...() functions) are run in the order in which they were
+/// queued. The functions that are queued at the time the Qt thread processes
+/// the queue are run in a single event loop turn, so posting many functions
+/// from worker threads only costs a single Qt event. @p f is also queued if
+/// this is called from the Qt thread.
+/// If there is no QApplication object, the function cannot be run.
+/// In this case, false is returned.
+/// @p callerFile and @p callerLine default to the call site. They are shown by
+/// the StallDetector if @p f stalls the Qt thread.
+bool PostToQtThread(
+    std::function<void()>&& f,
+    const char* callerFile = CIDE_CALLER_FILE,
+    int callerLine = CIDE_CALLER_LINE);
 
 /// Runs function @p f in the Qt thread. Blocks until it completes.
 /// If there is no QApplication object, the function cannot be run.
 /// In this case, false is returned.
 bool RunInQtThreadBlocking(
-    const std::function<void()>& f);
+    const std::function<void()>& f,
+    const char* callerFile = CIDE_CALLER_FILE,
+    int callerLine = CIDE_CALLER_LINE);
+
+/// Runs function @p f in the Qt thread without blocking (see PostToQtThread()),
+/// and returns a future for its result. This allows worker threads to continue
+/// working while the Qt thread runs @p f, and to only wait for the result once
+/// it is needed. Never wait for the future in the Qt thread, since @p f is
+/// always queued. If there is no QApplication object, the future reports a
+/// std::future_error (broken promise) since @p f cannot be run.
+template <typename F>
+auto RunInQtThreadAsync(
+    F&& f,
+    const char* callerFile = CIDE_CALLER_FILE,
+    int callerLine = CIDE_CALLER_LINE) -> std::future<decltype(f())> {
+  typedef decltype(f()) ResultT;
+  std::shared_ptr<std::packaged_task<ResultT()>> task(new std::packaged_task<ResultT()>(std::forward<F>(f)));
+  std::future<ResultT> future = task->get_future();
+  PostToQtThread([task]() {
+    (*task)();
+  }, callerFile, callerLine);
+  return future;
+}
 
 struct RunInQtThreadAbortData {
   inline RunInQtThreadAbortData()
@@ -60,14 +103,18 @@ bool RunInQtThreadBlocking(
     const std::function<void()>& f,
     std::mutex* abortedMutex,
     std::atomic<bool>* aborted,
-    std::condition_variable* abortedCondition);
+    std::condition_variable* abortedCondition,
+    const char* callerFile = CIDE_CALLER_FILE,
+    int callerLine = CIDE_CALLER_LINE);
 
 /// Version of RunInQtThreadBlocking() with abort support that takes a
 /// RunInQtThreadAbortData struct as parameter for convenience.
 inline bool RunInQtThreadBlocking(
     const std::function<void()>& f,
-    RunInQtThreadAbortData* abortData) {
-  return RunInQtThreadBlocking(f, &abortData->abortedMutex, &abortData->aborted, &abortData->abortedCondition);
+    RunInQtThreadAbortData* abortData,
+    const char* callerFile = CIDE_CALLER_FILE,
+    int callerLine = CIDE_CALLER_LINE) {
+  return RunInQtThreadBlocking(f, &abortData->abortedMutex, &abortData->aborted, &abortData->abortedCondition, callerFile, callerLine);
 }
 
 inline void AbortRunInQtThreadBlocking(
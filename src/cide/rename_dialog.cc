@@ -4,22 +4,32 @@
 
 #include "rename_dialog.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
 #include <clang-c/Index.h>
 #include <QBoxLayout>
+#include <QEventLoop>
 #include <QIcon>
 #include <QLabel>
 #include <QLineEdit>
 #include <QMessageBox>
+#include <QProgressDialog>
 #include <QPushButton>
 #include <QRadioButton>
 #include <QThread>
 #include <QTreeWidget>
 
+#include "cide/canonical_path_cache.h"
 #include "cide/clang_index.h"
 #include "cide/clang_parser.h"
 #include "cide/clang_utils.h"
 #include "cide/cpp_utils.h"
+#include "cide/cpu_budget.h"
 #include "cide/document_widget.h"
+#include "cide/file_replace.h"
 #include "cide/main_window.h"
 #include "cide/parse_thread_pool.h"
 #include "cide/qt_thread.h"
@@ -40,6 +50,13 @@ RenameDialog::RenameDialog(DocumentWidget* widget, const QString& itemUSR, const
       "Searches in the current file, and all files included by it only. Very fast."));
   localSearchLabel->setWordWrap(true);
   
+  indexedSearchCheck = new QRadioButton(tr("Indexed search"));
+  QLabel* indexedSearchLabel = new QLabel(tr(
+      "Searches in the project files that the index knows to reference or declare the search item, and in all files included by those files."
+      " Files whose function bodies were skipped during indexing are searched if they may contain the search text."
+      " May miss occurrences for the same reasons as the semi-global search."));
+  indexedSearchLabel->setWordWrap(true);
+  
   semiGlobalSearchCheck = new QRadioButton(tr("Semi-global search"));
   QLabel* semiGlobalSearchLabel = new QLabel(tr(
       "Searches in all project files known to include a declaration of the search item, and in all files included by those files."
@@ -71,10 +88,12 @@ RenameDialog::RenameDialog(DocumentWidget* widget, const QString& itemUSR, const
   QGridLayout* searchModesLayout = new QGridLayout();
   searchModesLayout->addWidget(localSearchCheck, 0, 0);
   searchModesLayout->addWidget(localSearchLabel, 0, 1);
-  searchModesLayout->addWidget(semiGlobalSearchCheck, 1, 0);
-  searchModesLayout->addWidget(semiGlobalSearchLabel, 1, 1);
-  searchModesLayout->addWidget(globalSearchCheck, 2, 0);
-  searchModesLayout->addWidget(globalSearchLabel, 2, 1);
+  searchModesLayout->addWidget(indexedSearchCheck, 1, 0);
+  searchModesLayout->addWidget(indexedSearchLabel, 1, 1);
+  searchModesLayout->addWidget(semiGlobalSearchCheck, 2, 0);
+  searchModesLayout->addWidget(semiGlobalSearchLabel, 2, 1);
+  searchModesLayout->addWidget(globalSearchCheck, 3, 0);
+  searchModesLayout->addWidget(globalSearchLabel, 3, 1);
   searchModesLayout->setColumnStretch(1, 1);
   
   QHBoxLayout* renameLayout = new QHBoxLayout();
@@ -101,6 +120,7 @@ RenameDialog::RenameDialog(DocumentWidget* widget, const QString& itemUSR, const
   
   // --- Connections ---
   connect(localSearchCheck, &QRadioButton::clicked, this, &RenameDialog::SearchModeChanged);
+  connect(indexedSearchCheck, &QRadioButton::clicked, this, &RenameDialog::SearchModeChanged);
   connect(semiGlobalSearchCheck, &QRadioButton::clicked, this, &RenameDialog::SearchModeChanged);
   connect(globalSearchCheck, &QRadioButton::clicked, this, &RenameDialog::SearchModeChanged);
   
@@ -167,6 +187,7 @@ void RenameDialog::SetInitialCursorOrSelection() {
 
 void RenameDialog::ClearSearchResults() {
   occurrencesTree->clear();
+  shownResultPaths.clear();
   searchInProgressLabel->show();
   renameButton->setEnabled(false);
 }
@@ -178,6 +199,8 @@ void RenameDialog::SearchModeChanged() {
   
   if (localSearchCheck->isChecked()) {
     searchMode = SearchMode::LocalSearch;
+  } else if (indexedSearchCheck->isChecked()) {
+    searchMode = SearchMode::IndexedSearch;
   } else if (semiGlobalSearchCheck->isChecked()) {
     searchMode = SearchMode::SemiGlobalSearch;
   } else {  // if (globalSearchCheck->isChecked()) {
@@ -193,18 +216,48 @@ void RenameDialog::Rename() {
   // If a search is currently running, abort it.
   ExitSearchThread();
   
-  // Perform all replacements.
+  // Perform all replacements. Open documents are modified in memory, all
+  // other files on disk in the background.
   MainWindow* mainWindow = widget->GetMainWindow();
+  std::vector<QString> diskPaths;
+  std::unordered_map<QString, std::shared_ptr<std::vector<Occurrence>>> diskOccurrences;
   for (const auto& fileAndMap : resultMap) {
     QString path = fileAndMap.first;
-    const std::vector<Occurrence>& occurrences = *fileAndMap.second;
     
     Document* document;
     DocumentWidget* documentWidget;
     if (mainWindow->GetDocumentAndWidgetForPath(path, &document, &documentWidget)) {
-      RenameInDocument(documentWidget, occurrences);
+      RenameInDocument(documentWidget, *fileAndMap.second);
     } else {
-      RenameInFileOnDisk(path, occurrences);
+      diskPaths.push_back(path);
+      diskOccurrences[path] = fileAndMap.second;
+    }
+  }
+  
+  if (!diskPaths.empty()) {
+    QString newName = renameToEdit->text();
+    FileReplace replace(diskPaths, [&diskOccurrences, newName](const QString& path, QString* text) {
+      return RenameInText(*diskOccurrences.at(path), newName, text);
+    });
+    
+    // Show the progress while waiting for the files to be written, keeping
+    // the UI responsive.
+    QProgressDialog progress(tr("Renaming in files..."), QString(), 0, diskPaths.size(), this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(250);
+    QEventLoop eventLoop;
+    int numFilesDone;
+    int numFiles;
+    while (!replace.GetProgress(&numFilesDone, &numFiles)) {
+      progress.setValue(numFilesDone);
+      eventLoop.processEvents(QEventLoop::ExcludeUserInputEvents);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    progress.setValue(numFiles);
+    
+    QString errorMessages = replace.GetErrorMessages();
+    if (!errorMessages.isEmpty()) {
+      QMessageBox::warning(this, tr("Rename"), errorMessages);
     }
   }
   
@@ -229,6 +282,8 @@ void RenameDialog::ThreadMain() {
     thisSearchMode = searchMode;
     lock.unlock();
     
+    // The user waits for the search results, so this is interactive work.
+    CPUBudgetScope budgetScope(CPUBudget::QoS::Interactive);
     PerformSearch(thisSearchMode);
     
     lock.lock();
@@ -240,8 +295,11 @@ void RenameDialog::ThreadMain() {
 }
 
 void RenameDialog::PerformSearch(SearchMode mode) {
+  resultsMutex.lock();
   searchErrors.clear();
   occurrenceMap.clear();
+  newResultPaths.clear();
+  resultsMutex.unlock();
   
   RunInQtThreadBlocking([&]() {
     searchInProgressLabel->setText(tr("<b>Search in progress ...</b>"));
@@ -251,6 +309,9 @@ void RenameDialog::PerformSearch(SearchMode mode) {
   case SearchMode::LocalSearch:
     PerformLocalSearch();
     break;
+  case SearchMode::IndexedSearch:
+    PerformIndexedSearch();
+    break;
   case SearchMode::SemiGlobalSearch:
     PerformSemiGlobalSearch();
     break;
@@ -265,39 +326,7 @@ void RenameDialog::PerformSearch(SearchMode mode) {
       return;
     }
     
-    QDir projectDir = QDir::root();
-    auto project = widget->GetMainWindow()->GetCurrentProject();
-    if (project) {
-      projectDir = QFileInfo(project->GetYAMLFilePath()).dir();
-    }
-    
-    // Create tree widget items
-    QTreeWidgetItem* lastFileItem = nullptr;
-    for (const auto& fileAndMap : occurrenceMap) {
-      QString path = fileAndMap.first;
-      const std::vector<Occurrence>& occurrences = *fileAndMap.second;
-      
-      lastFileItem = new QTreeWidgetItem(occurrencesTree, lastFileItem);
-      occurrencesTree->setItemWidget(
-          lastFileItem, 0,
-          new QLabel(QStringLiteral("<b>%1</b>: %2 matches").arg(projectDir.relativeFilePath(path).toHtmlEscaped()).arg(occurrences.size())));
-      lastFileItem->setExpanded(true);
-      
-      // TODO: Merge multiple occurrences in the same line into a single QTreeWidgetItem
-      QTreeWidgetItem* lastLineItem = nullptr;
-      for (const Occurrence& occ : occurrences) {
-        lastLineItem = new QTreeWidgetItem(lastFileItem, lastLineItem);
-        lastLineItem->setFlags(lastLineItem->flags() | Qt::ItemNeverHasChildren);
-        lastLineItem->setData(0, Qt::UserRole, QStringLiteral("file://%1:%2:%3").arg(path).arg(occ.line + 1).arg(occ.column + 1));
-        QString labelText =
-            tr("<span style=\"color:gray;\">Line %1:</span> %2").arg(occ.line + 1).arg(
-                occ.lineText.left(occ.column).toHtmlEscaped() +
-                QStringLiteral("<b style=\"background-color:#efedec;\">") + occ.lineText.mid(occ.column, occ.length).toHtmlEscaped() + QStringLiteral("</b>") +
-                occ.lineText.right(occ.lineText.size() - (occ.column + occ.length)));
-        QLabel* lineLabel = new QLabel(labelText);
-        occurrencesTree->setItemWidget(lastLineItem, 0, lineLabel);
-      }
-    }
+    ShowNewSearchResults();
     
     // Update other widgets
     searchInProgressLabel->hide();
@@ -310,6 +339,57 @@ void RenameDialog::PerformSearch(SearchMode mode) {
   });
 }
 
+void RenameDialog::ShowNewSearchResults() {
+  std::vector<QString> paths;
+  resultsMutex.lock();
+  paths.swap(newResultPaths);
+  resultsMutex.unlock();
+  if (paths.empty()) {
+    return;
+  }
+  
+  QDir projectDir = QDir::root();
+  auto project = widget->GetMainWindow()->GetCurrentProject();
+  if (project) {
+    projectDir = QFileInfo(project->GetYAMLFilePath()).dir();
+  }
+  
+  // Create tree widget items. The files are inserted in the order of their
+  // paths, regardless of the order in which they were searched.
+  for (const QString& path : paths) {
+    resultsMutex.lock();
+    std::shared_ptr<std::vector<Occurrence>> occurrencesPtr = occurrenceMap[path];
+    resultsMutex.unlock();
+    const std::vector<Occurrence>& occurrences = *occurrencesPtr;
+    
+    auto shownIt = std::lower_bound(shownResultPaths.begin(), shownResultPaths.end(), path);
+    int fileItemIndex = shownIt - shownResultPaths.begin();
+    shownResultPaths.insert(shownIt, path);
+    
+    QTreeWidgetItem* fileItem = new QTreeWidgetItem();
+    occurrencesTree->insertTopLevelItem(fileItemIndex, fileItem);
+    occurrencesTree->setItemWidget(
+        fileItem, 0,
+        new QLabel(QStringLiteral("<b>%1</b>: %2 matches").arg(projectDir.relativeFilePath(path).toHtmlEscaped()).arg(occurrences.size())));
+    fileItem->setExpanded(true);
+    
+    // TODO: Merge multiple occurrences in the same line into a single QTreeWidgetItem
+    QTreeWidgetItem* lastLineItem = nullptr;
+    for (const Occurrence& occ : occurrences) {
+      lastLineItem = new QTreeWidgetItem(fileItem, lastLineItem);
+      lastLineItem->setFlags(lastLineItem->flags() | Qt::ItemNeverHasChildren);
+      lastLineItem->setData(0, Qt::UserRole, QStringLiteral("file://%1:%2:%3").arg(path).arg(occ.line + 1).arg(occ.column + 1));
+      QString labelText =
+          tr("<span style=\"color:gray;\">Line %1:</span> %2").arg(occ.line + 1).arg(
+              occ.lineText.left(occ.column).toHtmlEscaped() +
+              QStringLiteral("<b style=\"background-color:#efedec;\">") + occ.lineText.mid(occ.column, occ.length).toHtmlEscaped() + QStringLiteral("</b>") +
+              occ.lineText.right(occ.lineText.size() - (occ.column + occ.length)));
+      QLabel* lineLabel = new QLabel(labelText);
+      occurrencesTree->setItemWidget(lastLineItem, 0, lineLabel);
+    }
+  }
+}
+
 struct SearchForUSRVisitorData {
   CXTranslationUnit TU;
   bool searchInSearchFileOnly;
@@ -475,6 +555,97 @@ void RenameDialog::PerformLocalSearch() {
   SearchInFiles({path}, true);
 }
 
+void RenameDialog::PerformIndexedSearch() {
+  // Find the files containing the definition or declarations of the search
+  // item, and the files that reference it, via the USR indexes.
+  QByteArray USR = itemUSR.toUtf8();
+  std::unordered_set<QString> relevantFiles;
+  RunInQtThreadBlocking([&]() {
+    USRStorage::Instance().GetFilesForUSRLookup(widget->GetDocument()->path(), widget->GetMainWindow(), &relevantFiles);
+  });
+  std::vector<std::pair<QString, USRDecl>> foundDecls;  // pair of file path and USR
+  USRStorage::Instance().LookupUSRs(USR, relevantFiles, &foundDecls);
+  std::unordered_set<QString> occurrenceFiles;
+  std::unordered_set<QString> filesWithIncompleteReferences;
+  USRStorage::Instance().LookupUSRReferences(USR, relevantFiles, &occurrenceFiles, &filesWithIncompleteReferences);
+  
+  std::unordered_set<QString> filesWithDeclarations;
+  for (const auto& item : foundDecls) {
+    filesWithDeclarations.insert(item.first);
+    occurrenceFiles.insert(item.first);
+  }
+  
+  // Determine the source files to parse: each file that may contain
+  // occurrences must be contained in or included by one of them. The files
+  // whose references are not known completely may contain occurrences unless
+  // the content indexes know that they do not contain the item's spelling.
+  std::unordered_set<QString> filesToSearch;
+  RunInQtThreadBlocking([&]() {
+    if (haveNewSearchRequest) {
+      return;
+    }
+    
+    const auto& projects = widget->GetMainWindow()->GetProjects();
+    std::unordered_set<QString> skippedFiles;
+    for (const auto& project : projects) {
+      project->GetContentIndex().FindFilesThatCannotContain(itemSpelling, Qt::CaseSensitive, &skippedFiles);
+    }
+    for (const QString& path : filesWithIncompleteReferences) {
+      if (skippedFiles.count(path) == 0) {
+        occurrenceFiles.insert(path);
+      }
+    }
+    
+    // Only source files that include a declaration can contain occurrences.
+    std::unordered_set<QString> candidateSourceFiles;
+    for (const auto& project : projects) {
+      for (const QString& fileWithDeclaration : filesWithDeclarations) {
+        project->FindAllFilesThatInclude(fileWithDeclaration, &candidateSourceFiles);
+      }
+    }
+    
+    // Search in the source files with occurrences first, then add one source
+    // file for each remaining (header) file that is not included by any of
+    // the files to search yet.
+    std::vector<QString> sortedOccurrenceFiles(occurrenceFiles.begin(), occurrenceFiles.end());
+    std::sort(sortedOccurrenceFiles.begin(), sortedOccurrenceFiles.end());
+    for (const QString& path : sortedOccurrenceFiles) {
+      if (candidateSourceFiles.count(path) > 0) {
+        filesToSearch.insert(path);
+      }
+    }
+    for (const QString& path : sortedOccurrenceFiles) {
+      if (filesToSearch.count(path) > 0) {
+        continue;
+      }
+      
+      std::unordered_set<QString> includingFiles;
+      for (const auto& project : projects) {
+        project->FindAllFilesThatInclude(path, &includingFiles);
+      }
+      QString chosenFile;
+      for (const QString& includingFile : includingFiles) {
+        if (candidateSourceFiles.count(includingFile) == 0) {
+          continue;
+        }
+        if (filesToSearch.count(includingFile) > 0) {
+          chosenFile.clear();
+          break;
+        }
+        if (chosenFile.isEmpty() || includingFile < chosenFile) {
+          chosenFile = includingFile;
+        }
+      }
+      if (!chosenFile.isEmpty()) {
+        filesToSearch.insert(chosenFile);
+      }
+    }
+  });
+  
+  // Search in the resulting files.
+  SearchInFiles(filesToSearch, true);
+}
+
 void RenameDialog::PerformSemiGlobalSearch() {
   // First, find the definition and all declarations of the search item via its USR.
   std::unordered_set<QString> relevantFiles;
@@ -501,14 +672,8 @@ void RenameDialog::PerformSemiGlobalSearch() {
     }
     
     for (const auto& project : widget->GetMainWindow()->GetProjects()) {
-      for (int targetIdx = 0; targetIdx < project->GetNumTargets(); ++ targetIdx) {
-        const Target& target = project->GetTarget(targetIdx);
-        for (const QString& fileWithDeclaration : filesWithDeclarations) {
-          QStringList newFilesToSearch = target.FindAllFilesThatInclude(fileWithDeclaration);
-          for (const QString& path : newFilesToSearch) {
-            filesToSearch.insert(path);
-          }
-        }
+      for (const QString& fileWithDeclaration : filesWithDeclarations) {
+        project->FindAllFilesThatInclude(fileWithDeclaration, &filesToSearch);
       }
     }
   });
@@ -519,9 +684,11 @@ void RenameDialog::PerformSemiGlobalSearch() {
 
 void RenameDialog::PerformGlobalSearch() {
   constexpr bool kDebug = false;
-
-  // Get the root path of the current file's project
+  
+  // Get the root path of the current file's project, and the files that the
+  // projects' content indexes know not to contain the item's spelling.
   QString rootDir;
+  std::unordered_set<QString> skippedFiles;
   RunInQtThreadBlocking([&]() {
     if (haveNewSearchRequest) {
       return;
@@ -534,8 +701,11 @@ void RenameDialog::PerformGlobalSearch() {
         break;
       }
     }
+    for (const auto& project : widget->GetMainWindow()->GetProjects()) {
+      project->GetContentIndex().FindFilesThatCannotContain(itemSpelling, Qt::CaseSensitive, &skippedFiles);
+    }
   });
-
+  
   if (kDebug) {
     qDebug() << "Global search root dir:" << rootDir;
   }
@@ -571,6 +741,10 @@ void RenameDialog::PerformGlobalSearch() {
           workList.push_back(childDir);
         }
       } else if (GuessIsCFile(fileInfo.filePath())) {
+        if (!skippedFiles.empty() && skippedFiles.count(fileInfo.canonicalFilePath()) > 0) {
+          continue;
+        }
+        
         // Read the file to see whether it contains the search term.
         if (kDebug) {
           qDebug() << "Considering file:" << fileInfo.filePath();
@@ -599,31 +773,61 @@ void RenameDialog::PerformGlobalSearch() {
 }
 
 void RenameDialog::SearchInFiles(const std::unordered_set<QString>& paths, bool searchInIncludedFiles) {
-  // TODO: Search in multiple files simultaneously with multithreading
-  int numPaths = paths.size();
-  int searchedPaths = 0;
+  // Search in the files with multiple threads. Each thread takes the next file
+  // that has not been taken yet, such that the load is balanced even if some
+  // files take much longer to parse than others.
+  std::vector<QString> pathList(paths.begin(), paths.end());
+  int numPaths = pathList.size();
+  std::atomic<int> nextPathIndex;
+  nextPathIndex = 0;
+  std::atomic<int> numSearchedPaths;
+  numSearchedPaths = 0;
+  auto searchFiles = [&]() {
+    while (!haveNewSearchRequest) {
+      int pathIndex = nextPathIndex++;
+      if (pathIndex >= numPaths) {
+        return;
+      }
+      SearchInFile(pathList[pathIndex], searchInIncludedFiles);
+      ++ numSearchedPaths;
+    }
+  };
   
-  for (const QString& path : paths) {
-    if (haveNewSearchRequest) {
-      return;
+  int threadCount = std::min<int>(std::max<int>(1, std::thread::hardware_concurrency()), numPaths);
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < threadCount; ++ i) {
+    workerThreads.emplace_back(searchFiles);
+  }
+  
+  // Report the progress and show the results found so far in batches while
+  // the worker threads are running.
+  bool finished = false;
+  while (!finished) {
+    finished = numSearchedPaths == numPaths || haveNewSearchRequest;
+    if (!finished) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
     RunInQtThreadBlocking([&]() {
-      searchInProgressLabel->setText(tr("<b>Search in progress (%1%) ...</b>").arg((searchedPaths * 100) / numPaths));
+      if (haveNewSearchRequest) {
+        return;
+      }
+      searchInProgressLabel->setText(tr("<b>Search in progress (%1%) ...</b>").arg((numSearchedPaths * 100) / std::max(1, numPaths)));
+      ShowNewSearchResults();
     });
-    
-    SearchInFile(path, searchInIncludedFiles);
-    ++ searchedPaths;
+  }
+  
+  for (std::thread& thread : workerThreads) {
+    thread.join();
   }
 }
 
-
 static void VisitInclusions(
     CXFile included_file,
     CXSourceLocation* /*inclusion_stack*/,
     unsigned /*include_len*/,
     CXClientData client_data) {
   std::unordered_set<QString>* includedPaths = reinterpret_cast<std::unordered_set<QString>*>(client_data);
-  includedPaths->insert(QFileInfo(GetClangFilePath(included_file)).canonicalFilePath());
+  includedPaths->insert(CachedCanonicalFilePath(GetClangFilePath(included_file)));
 }
 
 void RenameDialog::SearchInFile(const QString& path, bool searchInIncludedFiles) {
@@ -710,16 +914,21 @@ void RenameDialog::SearchInFile(const QString& path, bool searchInIncludedFiles)
         clang_findReferencesInFile(visitorData.result, clangFile, referencesVisitor);
         
         if (context.gotReferenceWithinMacro) {
+          std::unique_lock<std::mutex> lock(resultsMutex);
           searchErrors += tr("Found a possible occurrence in a macro in file: %1\n").arg(fileToSearch);
         }
         
         // Store the occurrences in the occurrenceMap.
         // TODO: We could already have a result from another TU. Due to different
         //       preprocessor definitions, that result could be different. Merge the results.
+        //       Currently, the first result is kept, since it may already be displayed.
         if (!occurrences.empty()) {
           std::shared_ptr<std::vector<Occurrence>> sharedVector(new std::vector<Occurrence>());
           sharedVector->swap(occurrences);
-          occurrenceMap[fileToSearch] = sharedVector;
+          std::unique_lock<std::mutex> lock(resultsMutex);
+          if (occurrenceMap.insert(std::make_pair(fileToSearch, sharedVector)).second) {
+            newResultPaths.push_back(fileToSearch);
+          }
         }
       }
     }
@@ -728,7 +937,7 @@ void RenameDialog::SearchInFile(const QString& path, bool searchInIncludedFiles)
   // Return / dispose the file's TU.
   if (TU) {
     RunInQtThreadBlocking([&]() {
-      widget->GetDocument()->GetTUPool()->PutTU(TU, false);
+      pathDocument->GetTUPool()->PutTU(TU, false);
     });
   } else {
     clang_disposeTranslationUnit(clangTU);
@@ -765,7 +974,7 @@ void RenameDialog::GetTUFromDocument(Document* document, std::shared_ptr<ClangTU
     RunInQtThreadBlocking([&]() {
       *TU = document->GetTUPool()->TakeMostUpToDateTU();
     });
-    if (TU) {
+    if (*TU) {
       break;
     }
     
@@ -774,12 +983,12 @@ void RenameDialog::GetTUFromDocument(Document* document, std::shared_ptr<ClangTU
 }
 
 void RenameDialog::ParseFileToGetTU(const QString& path, CXTranslationUnit* clangTU) {
-  std::vector<QByteArray> commandLineArgs;
+  std::shared_ptr<const CompileCommandLine> commandLine;
   std::vector<const char*> commandLineArgPtrs;
   
   std::vector<CXUnsavedFile> unsavedFiles;
-  std::vector<std::string> unsavedFileContents;
-  std::vector<std::string> unsavedFilePaths;
+  std::vector<std::shared_ptr<const QByteArray>> unsavedFileContents;
+  std::vector<QByteArray> unsavedFilePaths;
   
   bool exit = false;
   RunInQtThreadBlocking([&]() {
@@ -794,10 +1003,10 @@ void RenameDialog::ParseFileToGetTU(const QString& path, CXTranslationUnit* clan
     }
     
     // Get command line arguments for parsing
-    commandLineArgs = settings->BuildCommandLineArgs(true, path, usedProject.get());
-    commandLineArgPtrs.resize(commandLineArgs.size());
-    for (int i = 0; i < commandLineArgs.size(); ++ i) {
-      commandLineArgPtrs[i] = commandLineArgs[i].data();
+    commandLine = settings->GetCommandLine(true, path, usedProject.get());
+    commandLineArgPtrs.resize(commandLine->args.size());
+    for (int i = 0; i < commandLine->args.size(); ++ i) {
+      commandLineArgPtrs[i] = commandLine->args[i].constData();
     }
     
     // Get the contents of all unsaved files from the main window
@@ -841,49 +1050,72 @@ void RenameDialog::ParseFileToGetTU(const QString& path, CXTranslationUnit* clan
 }
 
 void RenameDialog::RenameInDocument(DocumentWidget* widget, const std::vector<Occurrence>& occurrences) {
-  widget->GetDocument()->StartUndoStep();
-  for (int i = static_cast<int>(occurrences.size()) - 1; i >= 0; -- i) {
-    const Occurrence& occ = occurrences[i];
-    
+  std::vector<Replacement> replacements;
+  replacements.reserve(occurrences.size());
+  for (const Occurrence& occ : occurrences) {
     DocumentLocation startLoc = widget->MapLineColToDocumentLocation(occ.line, occ.column);
-    DocumentRange occRange(startLoc, startLoc + occ.length);
-    widget->Replace(occRange, renameToEdit->text());
+    replacements.emplace_back(DocumentRange(startLoc, startLoc + occ.length), renameToEdit->text());
+  }
+  std::sort(replacements.begin(), replacements.end(), [](const Replacement& a, const Replacement& b) {
+    return a.range.start < b.range.start;
+  });
+  
+  // Occurrences may be reported more than once, only rename them once.
+  replacements.erase(std::unique(replacements.begin(), replacements.end(), [](const Replacement& a, const Replacement& b) {
+    return a.range.start == b.range.start;
+  }), replacements.end());
+  if (!replacements.empty()) {
+    widget->ReplaceMany(replacements);
   }
-  widget->GetDocument()->EndUndoStep();
 }
 
-void RenameDialog::RenameInFileOnDisk(const QString& path, const std::vector<Occurrence>& occurrences) {
-  QFile file(path);
-  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-    QMessageBox::warning(this, tr("Rename"), tr("Failed to open file: %1").arg(path));
-    return;
-  }
+bool RenameDialog::RenameInText(const std::vector<Occurrence>& occurrences, const QString& newName, QString* text) {
+  // Sort the occurrences by their position. Occurrences may be reported more
+  // than once, only rename them once.
+  std::vector<Occurrence> sortedOccurrences = occurrences;
+  std::sort(sortedOccurrences.begin(), sortedOccurrences.end(), [](const Occurrence& a, const Occurrence& b) {
+    return (a.line != b.line) ? (a.line < b.line) : (a.column < b.column);
+  });
+  sortedOccurrences.erase(std::unique(sortedOccurrences.begin(), sortedOccurrences.end(), [](const Occurrence& a, const Occurrence& b) {
+    return a.line == b.line && a.column == b.column;
+  }), sortedOccurrences.end());
   
-  QString modifiedFileText;
+  QString modifiedText;
+  modifiedText.reserve(text->size());
   
   int currentOccurrence = 0;
-  int line = -1;  // zero-based
-  while (!file.atEnd()) {
-    ++ line;
-    
-    QString lineText = QString::fromUtf8(file.readLine());  // TODO: Allow reading other formats than UTF-8 only?
+  int line = 0;  // zero-based
+  int lineStart = 0;
+  while (lineStart < text->size() && currentOccurrence < sortedOccurrences.size()) {
+    int lineEnd = text->indexOf('\n', lineStart);
+    lineEnd = (lineEnd < 0) ? text->size() : (lineEnd + 1);
     
-    if (currentOccurrence < occurrences.size() &&
-        occurrences[currentOccurrence].line == line) {
-      const Occurrence& occ = occurrences[currentOccurrence];
-      lineText = occ.lineText;
-      lineText.replace(occ.column, occ.length, renameToEdit->text());
-      
-      ++ currentOccurrence;
+    if (sortedOccurrences[currentOccurrence].line != line) {
+      modifiedText += text->midRef(lineStart, lineEnd - lineStart);
+    } else {
+      // Replace the occurrences in this line, starting from the last one such
+      // that the columns of the others remain valid.
+      int lineOccurrencesEnd = currentOccurrence;
+      while (lineOccurrencesEnd < sortedOccurrences.size() &&
+             sortedOccurrences[lineOccurrencesEnd].line == line) {
+        ++ lineOccurrencesEnd;
+      }
+      QString lineText = text->mid(lineStart, lineEnd - lineStart);
+      for (int i = lineOccurrencesEnd - 1; i >= currentOccurrence; -- i) {
+        lineText.replace(sortedOccurrences[i].column, sortedOccurrences[i].length, newName);
+      }
+      modifiedText += lineText;
+      currentOccurrence = lineOccurrencesEnd;
     }
     
-    modifiedFileText += lineText;
+    lineStart = lineEnd;
+    ++ line;
   }
-  
-  file.close();
-  if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-    file.write(modifiedFileText.toUtf8());
-  } else {
-    QMessageBox::warning(this, tr("Rename"), tr("File not writable: %1").arg(path));
+  if (currentOccurrence == 0) {
+    return false;
   }
+  modifiedText += text->midRef(lineStart);
+  
+  text->swap(modifiedText);
+  return true;
 }
@@ -62,6 +62,7 @@ class RenameDialog : public QDialog {
  private:
   enum class SearchMode {
     LocalSearch = 0,
+    IndexedSearch,
     SemiGlobalSearch,
     GlobalSearch
   };
@@ -70,17 +71,28 @@ class RenameDialog : public QDialog {
   
   void PerformSearch(SearchMode mode);
   void PerformLocalSearch();
+  void PerformIndexedSearch();
   void PerformSemiGlobalSearch();
   void PerformGlobalSearch();
   
+  /// Searches in the given files in parallel on multiple threads, while
+  /// showing the results found so far.
   void SearchInFiles(const std::unordered_set<QString>& paths, bool searchInIncludedFiles);
   void SearchInFile(const QString& path, bool searchInIncludedFiles);
   
+  /// Adds the files in newResultPaths to the occurrences tree. Must be called
+  /// from the Qt thread.
+  void ShowNewSearchResults();
+  
   void GetTUFromDocument(Document* document, std::shared_ptr<ClangTU>* TU);
   void ParseFileToGetTU(const QString& path, CXTranslationUnit* clangTU);
   
   void RenameInDocument(DocumentWidget* widget, const std::vector<Occurrence>& occurrences);
-  void RenameInFileOnDisk(const QString& path, const std::vector<Occurrence>& occurrences);
+  
+  /// Replaces the @p occurrences in @p text, which is the content of the file
+  /// that they were found in, with @p newName. Returns whether anything was
+  /// replaced.
+  static bool RenameInText(const std::vector<Occurrence>& occurrences, const QString& newName, QString* text);
   
   
   // Search thread
@@ -91,10 +103,21 @@ class RenameDialog : public QDialog {
   bool haveNewSearchRequest;
   std::condition_variable newSearchRequestCondition;
   bool exitThread;
+  
+  // Results of the running search, protected by resultsMutex since
+  // SearchInFiles() searches with multiple threads.
+  std::mutex resultsMutex;
   std::map<QString, std::shared_ptr<std::vector<Occurrence>>> occurrenceMap;
+  QString searchErrors;
+  
+  /// Paths in occurrenceMap that have not been added to occurrencesTree yet.
+  std::vector<QString> newResultPaths;
+  
+  /// Sorted paths of the files that are shown in occurrencesTree. Only
+  /// accessed from the Qt thread.
+  std::vector<QString> shownResultPaths;
   
   // Search results
-  QString searchErrors;
   std::map<QString, std::shared_ptr<std::vector<Occurrence>>> resultMap;
   
   // The USR of the item to search for
@@ -103,6 +126,7 @@ class RenameDialog : public QDialog {
   
   // UI
   QRadioButton* localSearchCheck;
+  QRadioButton* indexedSearchCheck;
   QRadioButton* semiGlobalSearchCheck;
   QRadioButton* globalSearchCheck;
   
@@ -4,6 +4,8 @@
 
 #include "cide/run_gdb.h"
 
+#include <algorithm>
+
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
@@ -18,108 +20,6 @@
 #include "cide/settings.h"
 
 
-/// Stores results given by the GDB/MI interface. The key attribute is always
-/// valid. In addition, *one of* the following must be valid:
-/// - value
-/// - resultList
-/// However, it is possible that a valid list is empty.
-struct GDBResult {
-  QByteArray key;
-  
-  QByteArray value;
-  std::vector<GDBResult> resultList;
-  
-  
-  /// When calling this function, the cursor must be set on the first character
-  /// of the result. After the function returns, the cursor will be set
-  /// on the character after the result.
-  bool Read(const QByteArray& line, int* cursor) {
-    // Read variable name
-    int equalsIdx = line.indexOf('=', *cursor);
-    if (equalsIdx < 0) {
-      qDebug() << "ERROR: Failed to read result in line ('=' character not found):" << line << "  remaining to parse:" << line.mid(*cursor);
-      return false;
-    }
-    key = line.mid(*cursor, equalsIdx - *cursor);
-    *cursor = equalsIdx + 1;
-    
-    // Read value
-    return ReadValue(line, cursor);
-  }
-  
-  bool ReadValue(const QByteArray& line, int* cursor) {
-    if (line[*cursor] == '"') {
-      // Read C string into value
-      ++ *cursor;
-      while (*cursor < line.size() && line[*cursor] != '"') {
-        if (line[*cursor] == '\\' && *cursor < line.size() - 1) {
-          // TODO: Are there some codes that must be handled specifically, for example \t to insert a tab character?
-          value += line[*cursor + 1];
-          *cursor += 2;
-          continue;
-        }
-        value += line[*cursor];
-        ++ *cursor;
-      }
-      if (*cursor >= line.size()) {
-        qDebug() << "ERROR: Failed to read result in line (unexpected end of C string):" << line;
-        return false;
-      }
-      ++ *cursor;
-    } else if (line[*cursor] == '{' || line[*cursor] == '[') {
-      char endChar = (line[*cursor] == '{') ? '}' : ']';
-      
-      // Read valueList or resultList
-      ++ *cursor;
-      bool isValueList = true;
-      bool endRead = false;
-      while (*cursor < line.size()) {
-        if (line[*cursor] == endChar) {
-          // End of list
-          endRead = true;
-          ++ *cursor;
-          break;
-        } else if (line[*cursor] == ',') {
-          // Read the next item in a list
-          ++ *cursor;
-        } else if (line[*cursor] == '"' || line[*cursor] == '{' || line[*cursor] == '[') {
-          isValueList = true;
-        } else if (QChar::fromLatin1(line[*cursor]).isLetter()) {
-          isValueList = false;
-        } else {
-          qDebug() << "ERROR: Failed to read result in line (unexpected character while reading list):" << line;
-          return false;
-        }
-        
-        if (isValueList) {
-          // Read a valueList item
-          resultList.emplace_back();
-          if (!resultList.back().ReadValue(line, cursor)) {
-            return false;
-          }
-        } else {
-          // Read a resultList item
-          resultList.emplace_back();
-          if (!resultList.back().Read(line, cursor)) {
-            return false;
-          }
-        }
-      }
-      if (!endRead) {
-        qDebug() << "ERROR: Failed to read result in line (end of list/tuple missing):" << line;
-        return false;
-      }
-    } else {
-      qDebug() << "ERROR: Failed to read result in line (unknown character at start of result value):" << line;
-      qDebug() << "       character:" << line[*cursor] << ", cursor:" << *cursor;
-      return false;
-    }
-    
-    return true;
-  }
-};
-
-
 GDBRunner::GDBRunner() {
   emitStateChanges = false;
   waitingForType = 0;
@@ -192,6 +92,10 @@ void GDBRunner::Start(const QString& workingDir, const QStringList& programAndAr
   emitStateChanges = false;
   running = false;
   interrupted = false;
+  logOutput = Settings::Instance().GetLogDebuggerOutput();
+  stdoutBuffer.Clear();
+  pendingCommands.clear();
+  stackRequestToken = -1;
   
   if (programAndArguments.empty()) {
     qDebug() << "GDBRunner::Start: programAndArguments is empty";
@@ -476,21 +380,76 @@ bool GDBRunner::IsInterrupted() {
 }
 
 void GDBRunner::GetThreadList() {
-  constexpr const char* cmd = "-thread-info\n";
-  process.write(cmd);
+  SendCommand(QStringLiteral("-thread-list-ids"), [this](const GDBMIRecord& record) {
+    int firstNode = record.FirstChild(record.root());
+    if (record.IsClass("done") && firstNode != -1 && record.IsKey(firstNode, "thread-ids")) {
+      ParseThreadIds(record);
+      emit ThreadListUpdated();
+    }
+  });
+}
+
+void GDBRunner::GetThreadDetails(int threadId) {
+  SendCommand(QStringLiteral("-thread-info %1").arg(threadId), [this](const GDBMIRecord& record) {
+    int firstNode = record.FirstChild(record.root());
+    if (record.IsClass("done") && firstNode != -1 && record.IsKey(firstNode, "threads")) {
+      ParseThreadInfo(record);
+    }
+  });
 }
 
-void GDBRunner::GetStackTrace(int threadId) {
-  if (threadId == -1) {
-    process.write(QStringLiteral("-stack-list-frames\n").toLocal8Bit());
-  } else {
-    process.write(QStringLiteral("-stack-list-frames --thread %1\n").arg(threadId).toLocal8Bit());
+void GDBRunner::GetStackTrace(int threadId, int firstFrame) {
+  if (firstFrame == 0) {
+    stackFrames.clear();
   }
+  stackTraceComplete = false;
+  stackRequestFirstFrame = firstFrame;
+  int lastFrame = firstFrame + kStackFramesPageSize - 1;
+  
+  QString command = (threadId == -1) ?
+      QStringLiteral("-stack-list-frames %1 %2").arg(firstFrame).arg(lastFrame) :
+      QStringLiteral("-stack-list-frames --thread %1 %2 %3").arg(threadId).arg(firstFrame).arg(lastFrame);
+  stackRequestToken = SendCommand(command, [this](const GDBMIRecord& record) {
+    // Discard responses to requests that have been superseded, e.g. for a
+    // thread that is not selected anymore.
+    if (record.token() != stackRequestToken) {
+      return;
+    }
+    stackRequestToken = -1;
+    
+    // The record is an error if, e.g., the stack has fewer frames than the
+    // requested first frame.
+    int oldFrameCount = stackFrames.size();
+    int firstNode = record.FirstChild(record.root());
+    if (record.IsClass("done") && firstNode != -1 && record.IsKey(firstNode, "stack")) {
+      ParseStackTrace(record, firstNode, &stackFrames);
+    }
+    stackTraceComplete = stackFrames.size() - oldFrameCount < kStackFramesPageSize;
+    emit StackTraceUpdated(stackRequestFirstFrame);
+  });
 }
 
-void GDBRunner::EvaluateExpression(const QString& expression, int threadId, int frameIndex) {
-  waitingForToken = nextToken;
-  process.write(QStringLiteral("%1-data-evaluate-expression --thread %2 --frame %3 \"%4\"\n").arg(nextToken++).arg(threadId).arg(frameIndex).arg(expression).toLocal8Bit());
+int GDBRunner::SendCommand(const QString& command, const ResultCallback& callback) {
+  int token = nextToken++;
+  pendingCommands[token] = callback;
+  process.write(QString::number(token).toLocal8Bit() + command.toLocal8Bit() + "\n");
+  return token;
+}
+
+void GDBRunner::EvaluateExpression(const QString& expression, int threadId, int frameIndex,
+                                   const std::function<void (bool success, const QString& value)>& callback) {
+  QString command = QStringLiteral("-data-evaluate-expression --thread %1 --frame %2 \"%3\"").arg(threadId).arg(frameIndex).arg(expression);
+  SendCommand(command, [callback](const GDBMIRecord& record) {
+    // Extract error message or value.
+    int firstNode = record.FirstChild(record.root());
+    if (record.IsClass("error") && firstNode != -1 && record.IsKey(firstNode, "msg")) {
+      callback(false, record.StringValue(firstNode));
+    } else if (record.IsClass("done") && firstNode != -1 && record.IsKey(firstNode, "value")) {
+      callback(true, record.StringValue(firstNode));
+    } else {
+      qDebug() << "ERROR: Failed to extract result from response to -data-evaluate-expression";
+    }
+  });
   
   // NOTE: Did not seem to work:
 //   process.write(QStringLiteral("-var-create tempExpr %1 %2\n").arg(frameAddress).arg(expression).toLocal8Bit());
@@ -498,17 +457,33 @@ void GDBRunner::EvaluateExpression(const QString& expression, int threadId, int
 //   process.write(QStringLiteral("-var-delete tempExpr\n").toLocal8Bit());
 }
 
+void GDBRunner::EvaluateExpression(const QString& expression, int threadId, int frameIndex) {
+  EvaluateExpression(expression, threadId, frameIndex, [this](bool /*success*/, const QString& value) {
+    emit ResponseReceived(value);
+  });
+}
+
 void GDBRunner::ReadyReadStdOut() {
-  int oldSize = stdoutCache.size();
-  stdoutCache += process.readAllStandardOutput();
-  // qDebug() << "STDOUT:" << stdoutCache.mid(oldSize);
-  
-  for (int i = oldSize; i < stdoutCache.size(); ++ i) {
-    if (stdoutCache[i] == '\n' || stdoutCache[i] == '\r') {
-      ParseLine(stdoutCache.left(i));
-      stdoutCache.remove(0, i + ((stdoutCache[i] == '\n') ? 1 : 2));
-      i = -1;
+  QByteArray data = process.readAllStandardOutput();
+  stdoutBuffer.Append(data.constData(), data.size());
+  
+  // Parse all complete lines. The line buffer and the record are re-used for
+  // all lines, such that this usually does not allocate memory.
+  while (stdoutBuffer.TakeLine(&lineBuffer)) {
+    if (!lineBuffer.isEmpty() && lineBuffer.endsWith('\r')) {
+      lineBuffer.chop(1);
     }
+    if (lineBuffer.isEmpty()) {
+      continue;
+    }
+    if (logOutput) {
+      qDebug() << "GDB: " << lineBuffer;
+    }
+    if (!record.Parse(&lineBuffer)) {
+      qDebug() << "ERROR: Failed to parse GDB/MI output line:" << record.text();
+      continue;
+    }
+    HandleRecord(record);
   }
 }
 
@@ -518,35 +493,10 @@ void GDBRunner::ReadyReadStdErr() {
   qDebug() << "STDERR:" << stderrCache.mid(oldSize);
 }
 
-void GDBRunner::ParseLine(const QByteArray& line) {
+void GDBRunner::HandleRecord(const GDBMIRecord& record) {
   // See this page for the syntax of lines:
   // https://sourceware.org/gdb/onlinedocs/gdb/GDB_002fMI-Output-Syntax.html#GDB_002fMI-Output-Syntax
   
-  qDebug() << "GDB: " << line;
-  if (line.isEmpty()) {
-    return;
-  }
-  
-  // Disregard "(gdb) " lines
-  if (line.compare("(gdb) ") == 0) {
-    if (waitingForType == 0 && line == waitingForStatus) {
-      waitingDone = true;
-    }
-    return;
-  }
-  
-  // Check for a numerical token (sequence of digits)
-  QByteArray cursorString;
-  int cursor = 0;
-  while (cursor < line.size() && line[cursor] >= '0' && line[cursor] <= '9') {
-    cursorString += line[cursor];
-    ++ cursor;
-  }
-  int token = -1;
-  if (!cursorString.isEmpty()) {
-    token = cursorString.toInt();
-  }
-  
   // The first character indicates the type of message:
   // Messages followed by a C string:
     // & - GDB internal log
@@ -557,90 +507,50 @@ void GDBRunner::ParseLine(const QByteArray& line) {
     // * - asynchronous execution state changes
     // + - asynchronous status output on the progress of slow operations
     // ^ - responses to commands
-  QChar messageTypeChar = line[cursor];
-  QByteArray asyncOrResultClass;
-  std::vector<GDBResult> results;
-  
-  if (messageTypeChar == '&' ||
-      messageTypeChar == '@' ||
-      messageTypeChar == '~') {
-    // Read C string
-    // TODO
-  } else if (messageTypeChar == '=' ||
-             messageTypeChar == '*' ||
-             messageTypeChar == '+' ||
-             messageTypeChar == '^') {
-    // Read structured output
-    // Read the word until the line-end or comma
-    int commaIdx = line.indexOf(',', cursor + 1);
-    if (commaIdx >= 0) {
-      asyncOrResultClass = line.mid(cursor + 1, commaIdx - (cursor + 1));
-    } else {
-      asyncOrResultClass = line.mid(cursor + 1);
-    }
-    
-    if (messageTypeChar == '^') {
-      // For this type of message, the set of possible result classes is well-known.
-      if (asyncOrResultClass != "done" &&
-          asyncOrResultClass != "running" &&
-          asyncOrResultClass != "connected" &&
-          asyncOrResultClass != "error" &&
-          asyncOrResultClass != "exit") {
-        qDebug() << "ERROR: Failed to parse line (unexpected result class):" << line;
-        return;
-      }
-    } else {
-      // For this types of messages, the set of possible result classes is not well-defined.
-    }
-    
-    // Parse the results (variable = value).
-    cursor = cursor + 2 + asyncOrResultClass.size();
-    while (cursor < line.size()) {
-      results.emplace_back();
-      if (!results.back().Read(line, &cursor)) {
-        return;
-      }
-      
-      // Jump over the (potential) comma separating the next result
-      ++ cursor;
+  // The "(gdb) " prompt has type 0.
+  char messageTypeChar = record.type();
+  int root = record.root();
+  
+  if (messageTypeChar == 0) {
+    if (waitingForType == 0 && record.text() == waitingForStatus) {
+      waitingDone = true;
     }
-  } else {
-    qDebug() << "ERROR: Failed to parse line (unexpected initial character):" << line;
+    return;
+  } else if (messageTypeChar == '&' ||
+             messageTypeChar == '@' ||
+             messageTypeChar == '~') {
+    // TODO: Show C string output
     return;
   }
   
-  
-  // Interpret the parsed message.
-  // TODO: Make separate function for this
-  
   if (messageTypeChar == waitingForType &&
-      asyncOrResultClass == waitingForStatus) {
+      record.asyncOrResultClass() == waitingForStatus) {
     waitingDone = true;
   }
   
   if (messageTypeChar == '*') {
-    if (asyncOrResultClass == "running" && emitStateChanges) {
+    if (record.IsClass("running") && emitStateChanges) {
       emit Resumed();
-    } else if (asyncOrResultClass == "stopped" && emitStateChanges) {
+    } else if (record.IsClass("stopped") && emitStateChanges) {
       emit Interrupted();
     }
   } else if (messageTypeChar == '=') {
-    if (asyncOrResultClass == "thread-group-started") {
-      for (const GDBResult& result : results) {
-        if (result.key == "pid") {
-          bool ok;
-          lastThreadGroupId = result.value.toInt(&ok);
-          if (!ok) {
-            qDebug() << "ERROR: Cannot parse pid of thread-group-started as int";
-          } else {
-            qDebug() << "New lastThreadGroupId:" << lastThreadGroupId;
-          }
+    if (record.IsClass("thread-group-started")) {
+      int pidNode = record.Find(root, "pid");
+      if (pidNode != -1) {
+        int pid = record.IntValue(pidNode);
+        if (pid == -1) {
+          qDebug() << "ERROR: Cannot parse pid of thread-group-started as int";
+        } else {
+          lastThreadGroupId = pid;
+          qDebug() << "New lastThreadGroupId:" << lastThreadGroupId;
         }
       }
-    } else if (asyncOrResultClass == "thread-group-exited" && emitStateChanges) {
+    } else if (record.IsClass("thread-group-exited") && emitStateChanges) {
       int exitCode = -1;
-      if (results.back().key == "exit-code") {
-        exitCode = results.back().value.toInt();
+      int lastNode = record.LastChild(root);
+      if (lastNode != -1 && record.IsKey(lastNode, "exit-code")) {
+        exitCode = record.IntValue(lastNode);
       }
       
       // Emit the Stopped signal and exit the debugger.
@@ -652,36 +562,16 @@ void GDBRunner::ParseLine(const QByteArray& line) {
       constexpr const char* cmd = "-gdb-exit\n";
       process.write(cmd);
     }
-  } else if (messageTypeChar == '^') {
-    if (asyncOrResultClass == "done") {
-      if (!results.empty() && results.front().key == "threads") {
-        // Received list of threads.
-        ParseThreadInfo(results, &currentThreadId, &threadIdAndFrame);
-        emit ThreadListUpdated();
-      } else if (!results.empty() && results.front().key == "stack") {
-        // Received stack trace.
-        ParseStackTrace(results.front().resultList, &stackFrames);
-        emit StackTraceUpdated();
-      }
+  } else if (messageTypeChar == '^' && record.token() != -1) {
+    // Dispatch the result record to the callback of its command.
+    auto it = pendingCommands.find(record.token());
+    if (it != pendingCommands.end()) {
+      // Remove the callback before calling it, since it may send new commands.
+      ResultCallback callback = std::move(it->second);
+      pendingCommands.erase(it);
+      callback(record);
     }
   }
-  
-  if (waitingForToken != -1 &&
-      token == waitingForToken) {
-    waitingForToken = -1;
-    
-    // Extract error message or value.
-    QString result;
-    if (asyncOrResultClass == "error" && results.size() >= 1 && results[0].key == "msg") {
-      result = results[0].value;
-    } else if (asyncOrResultClass == "done" && results.size() >= 1 && results[0].key == "value") {
-      result = results[0].value;
-    } else {
-      qDebug() << "ERROR: Failed to extract result from response that GDBRunner waited for";
-      return;
-    }
-    emit ResponseReceived(result);
-  }
 }
 
 void GDBRunner::WaitForOutput(char type, const QString& status) {
@@ -695,10 +585,29 @@ void GDBRunner::WaitForOutput(char type, const QString& status) {
   }
 }
 
-void GDBRunner::ParseThreadInfo(
-    const std::vector<GDBResult>& results,
-    int* currentThreadId,
-    std::vector<std::pair<int, QString>>* threadIdAndFrame) {
+void GDBRunner::ParseThreadIds(const GDBMIRecord& record) {
+  // Example:
+  // thread-ids={thread-id="3",thread-id="2",thread-id="1"},
+  // current-thread-id="1",number-of-threads="3"
+  
+  int root = record.root();
+  currentThreadId = record.ChildInt(root, "current-thread-id");
+  
+  int threadIds = record.FirstChild(root);
+  threadIdAndFrame.clear();
+  threadIdAndFrame.reserve(record.node(threadIds).childCount);
+  for (int idNode = record.FirstChild(threadIds); idNode != -1; idNode = record.NextSibling(idNode)) {
+    int id = record.IntValue(idNode);
+    threadIdAndFrame.emplace_back(id, tr("[%1]").arg(id));
+  }
+  
+  std::sort(threadIdAndFrame.begin(), threadIdAndFrame.end(),
+            [](const std::pair<int, QString>& a, const std::pair<int, QString>& b) {
+    return a.first < b.first;
+  });
+}
+
+void GDBRunner::ParseThreadInfo(const GDBMIRecord& record) {
   // Example (current-thread-id may be omitted):
   // threads=[
   // {id="2",target-id="Thread 0xb7e14b90 (LWP 21257)",
@@ -711,45 +620,36 @@ void GDBRunner::ParseThreadInfo(
   //            state="running"}],
   // current-thread-id="1"
   
-  if (results.back().key == "current-thread-id") {
-    *currentThreadId = results.back().value.toInt();
-  } else {
-    *currentThreadId = -1;
-  }
-  
-  const std::vector<GDBResult>& threadList = results.front().resultList;
-  for (const GDBResult& threadInfo : threadList) {
-    threadIdAndFrame->emplace_back();
-    std::pair<int, QString>* newThread = &threadIdAndFrame->back();
+  int threadList = record.FirstChild(record.root());
+  for (int threadInfo = record.FirstChild(threadList); threadInfo != -1; threadInfo = record.NextSibling(threadInfo)) {
+    int id = record.ChildInt(threadInfo, "id");
+    auto it = std::lower_bound(threadIdAndFrame.begin(), threadIdAndFrame.end(), id,
+                               [](const std::pair<int, QString>& a, int id) {
+      return a.first < id;
+    });
+    if (it == threadIdAndFrame.end() || it->first != id) {
+      continue;
+    }
     
-    QString name;
+    QString name = record.ChildString(threadInfo, "name");
     QString frame;
-    
-    for (const GDBResult& attribute : threadInfo.resultList) {
-      if (attribute.key == "id") {
-        newThread->first = attribute.value.toInt();
-      } else if (attribute.key == "name") {
-        name = attribute.value;
-      } else if (attribute.key == "frame") {
-        frame = GetShortFrameDescription(attribute.resultList);
-      }
+    int frameNode = record.Find(threadInfo, "frame");
+    if (frameNode != -1) {
+      frame = GetShortFrameDescription(record, frameNode);
     }
     
     if (name.isEmpty()) {
-      newThread->second = tr("[%1] in: %2").arg(newThread->first).arg(frame);
+      it->second = tr("[%1] in: %2").arg(id).arg(frame);
     } else {
-      newThread->second = tr("[%1] %2 in: %3").arg(newThread->first).arg(name).arg(frame);
+      it->second = tr("[%1] %2 in: %3").arg(id).arg(name).arg(frame);
     }
+    emit ThreadDetailsUpdated(id);
   }
-  
-  std::sort(threadIdAndFrame->begin(), threadIdAndFrame->end(),
-            [](const std::pair<int, QString>& a, const std::pair<int, QString>& b) {
-    return a.first < b.first;
-  });
 }
 
 void GDBRunner::ParseStackTrace(
-    const std::vector<GDBResult>& results,
+    const GDBMIRecord& record,
+    int stackNode,
     std::vector<StackFrame>* frames) {
   // Example:
   // frame={level=\"0\",addr=\"0x00007ffff73b5360\",func=\"__read_nocancel\",file=\"../sysdeps/unix/syscall-template.S\",fullname=\"/build/eglibc-xkFqqE/eglibc-2.19/io/../sysdeps/unix/syscall-template.S\",line=\"81\"},
@@ -761,48 +661,36 @@ void GDBRunner::ParseStackTrace(
   // frame={level=\"6\",addr=\"0x00007ffff7b49393\",func=\"std::basic_istream<char, std::char_traits<char> >& std::operator>><char, std::char_traits<char>, std::allocator<char> >(std::basic_istream<char, std::char_traits<char> >&, std::basic_string<char, std::char_traits<char>, std::allocator<char> >&)\",from=\"/usr/lib/x86_64-linux-gnu/libstdc++.so.6\"},
   // frame={level=\"7\",addr=\"0x0000000000400bbb\",func=\"main\",file=\"/home/thomas/Projects/test-project/src/main.cc\",fullname=\"/home/thomas/Projects/test-project/src/main.cc\",line=\"24\"}"
   
-  frames->resize(results.size());
-  for (int i = 0; i < frames->size(); ++ i) {
-    // Set defaults
-    (*frames)[i].level = -1;
-    (*frames)[i].line = -1;
-    
-    // Parse attributes
-    const std::vector<GDBResult>& frameAttributes = results[i].resultList;
-    for (const GDBResult& attribute : frameAttributes) {
-      if (attribute.key == "level") {
-        (*frames)[i].level = attribute.value.toInt();
-      } else if (attribute.key == "line") {
-        (*frames)[i].line = attribute.value.toInt();
-      } else if (attribute.key == "fullname") {
-        (*frames)[i].path = attribute.value;
-      } else if (attribute.key == "addr") {
-        (*frames)[i].address = attribute.value;
-      }
-    }
-    
-    (*frames)[i].shortDescription = QStringLiteral("(%1) %2").arg((*frames)[i].level).arg(GetShortFrameDescription(frameAttributes));
+  int i = frames->size();
+  frames->resize(i + record.node(stackNode).childCount);
+  for (int frameNode = record.FirstChild(stackNode); frameNode != -1; frameNode = record.NextSibling(frameNode), ++ i) {
+    StackFrame& frame = (*frames)[i];
+    frame.level = record.ChildInt(frameNode, "level");
+    frame.line = record.ChildInt(frameNode, "line");
+    frame.path = record.ChildString(frameNode, "fullname");
+    frame.address = record.ChildString(frameNode, "addr");
+    frame.shortDescription = QStringLiteral("(%1) %2").arg(frame.level).arg(GetShortFrameDescription(record, frameNode));
   }
 }
 
-QString GDBRunner::GetShortFrameDescription(const std::vector<GDBResult>& frameAttributes) {
+QString GDBRunner::GetShortFrameDescription(const GDBMIRecord& record, int frameNode) {
   QString func;  // may be absent
   QString addr;  // always present
   QString file;  // may be absent
   QString line;  // may be absent
   QString from;  // may be absent
   
-  for (const GDBResult& attribute : frameAttributes) {
-    if (attribute.key == "func") {
-      func = attribute.value;
-    } else if (attribute.key == "addr") {
-      addr = attribute.value;
-    } else if (attribute.key == "file") {
-      file = attribute.value;
-    } else if (attribute.key == "line") {
-      line = attribute.value;
-    } else if (attribute.key == "from") {
-      from = attribute.value;
+  for (int attribute = record.FirstChild(frameNode); attribute != -1; attribute = record.NextSibling(attribute)) {
+    if (record.IsKey(attribute, "func")) {
+      func = record.StringValue(attribute);
+    } else if (record.IsKey(attribute, "addr")) {
+      addr = record.StringValue(attribute);
+    } else if (record.IsKey(attribute, "file")) {
+      file = record.StringValue(attribute);
+    } else if (record.IsKey(attribute, "line")) {
+      line = record.StringValue(attribute);
+    } else if (record.IsKey(attribute, "from")) {
+      from = record.StringValue(attribute);
     }
   }
   
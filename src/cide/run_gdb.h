@@ -4,11 +4,15 @@
 
 #pragma once
 
+#include <functional>
+#include <unordered_map>
+
 #include <QByteArray>
 #include <QObject>
 #include <QProcess>
 
-struct GDBResult;
+#include "cide/build_output.h"
+#include "cide/gdb_mi_parser.h"
 
 struct StackFrame {
   /// A short description of the frame, intended for display.
@@ -51,21 +55,61 @@ class GDBRunner : public QObject {
   /// asynchronous state yet.
   bool IsInterrupted();
   
+  /// Requests the IDs of all threads, without their frames (which would
+  /// require gdb to unwind the stack of every thread).
   /// Calling this causes an asynchronous request. The result is ready when the
   /// ThreadListUpdated() signal is emitted and can be obtained by calling
-  /// GetCurrentThreadId() and GetThreadIdAndFrames().
+  /// GetCurrentThreadId() and GetThreadIdAndFrames(). The descriptions then
+  /// only contain the thread IDs until GetThreadDetails() is called for a
+  /// thread.
   void GetThreadList();
   inline int GetCurrentThreadId() const { return currentThreadId; }
   inline const std::vector<std::pair<int, QString>>& GetThreadIdAndFrames() const { return threadIdAndFrame; }
   
-  /// Requests a stack trace for a given thread, or for the current thread if
-  /// threadId is -1.
+  /// Requests the name and current frame of the given thread. The result is
+  /// ready when the ThreadDetailsUpdated() signal is emitted for this thread,
+  /// and is stored in the thread's description in GetThreadIdAndFrames().
+  void GetThreadDetails(int threadId);
+  
+  /// Requests a page of the stack trace for a given thread, or for the current
+  /// thread if threadId is -1, starting at frame level @p firstFrame. If
+  /// firstFrame is zero, previously fetched frames are discarded, otherwise
+  /// the page is appended to them.
   /// Calling this causes an asynchronous request. The result is ready when the
-  /// StackTraceUpdated() signal is emitted and can be obtained by calling
-  /// GetStackTraceResult().
-  void GetStackTrace(int threadId = -1);
+  /// StackTraceUpdated() signal is emitted (with the index of the first frame
+  /// of the page) and can be obtained by calling GetStackTraceResult().
+  void GetStackTrace(int threadId = -1, int firstFrame = 0);
   inline const std::vector<StackFrame>& GetStackTraceResult() const { return stackFrames; }
   
+  /// Returns whether GetStackTraceResult() contains all frames of the stack.
+  inline bool IsStackTraceComplete() const { return stackTraceComplete; }
+  
+  /// Returns whether a stack trace page has been requested but not received yet.
+  inline bool IsStackTraceRequestPending() const { return stackRequestToken != -1; }
+  
+  /// The number of frames that GetStackTrace() requests at once.
+  static constexpr int kStackFramesPageSize = 64;
+  
+  /// Callback for the result record of a command sent with SendCommand().
+  /// The record is only valid during the call.
+  typedef std::function<void (const GDBMIRecord& record)> ResultCallback;
+  
+  /// Sends the MI command @p command (without token and newline) to gdb,
+  /// tagged with a new numeric token, and returns the token. Once gdb responds
+  /// with the result record for this token, @p callback is called with it.
+  /// The command is written immediately, so multiple commands may be pending
+  /// at the same time; gdb processes them in order.
+  int SendCommand(const QString& command, const ResultCallback& callback);
+  
+  /// Evaluates the expression in the given frame. The result is passed to
+  /// @p callback once it has been received: success is false if gdb returned
+  /// an error, in which case the value contains the error message. Multiple
+  /// evaluations may be pending at the same time.
+  void EvaluateExpression(const QString& expression, int threadId, int frameIndex,
+                          const std::function<void (bool success, const QString& value)>& callback);
+  
+  /// Variant of EvaluateExpression() that emits ResponseReceived() with the
+  /// result.
   void EvaluateExpression(const QString& expression, int threadId, int frameIndex);
   
  signals:
@@ -75,7 +119,8 @@ class GDBRunner : public QObject {
   void Stopped(int exitCode);
   
   void ThreadListUpdated();
-  void StackTraceUpdated();
+  void ThreadDetailsUpdated(int threadId);
+  void StackTraceUpdated(int firstNewFrame);
   void ResponseReceived(QString value);
   
  private slots:
@@ -83,36 +128,54 @@ class GDBRunner : public QObject {
   void ReadyReadStdErr();
   
  private:
-  void ParseLine(const QByteArray& line);
+  void HandleRecord(const GDBMIRecord& record);
   
   void WaitForOutput(char type, const QString& status);
   
-  void ParseThreadInfo(
-      const std::vector<GDBResult>& results,
-      int* currentThreadId,
-      std::vector<std::pair<int, QString>>* threadIdAndFrame);
+  void ParseThreadIds(const GDBMIRecord& record);
+  void ParseThreadInfo(const GDBMIRecord& record);
   void ParseStackTrace(
-      const std::vector<GDBResult>& results,
+      const GDBMIRecord& record,
+      int stackNode,
       std::vector<StackFrame>* frames);
-  QString GetShortFrameDescription(const std::vector<GDBResult>& frameAttributes);
+  QString GetShortFrameDescription(const GDBMIRecord& record, int frameNode);
   
   
-  /// Cached thread info results
+  /// Cached thread info results, ordered by increasing thread ID
   int currentThreadId;
   std::vector<std::pair<int, QString>> threadIdAndFrame;
   
   /// Cached stack trace results
   std::vector<StackFrame> stackFrames;
+  bool stackTraceComplete = true;
+  
+  /// Token of the pending stack trace request, or -1 if there is none, and
+  /// the first frame level requested by it. Responses to earlier requests
+  /// (e.g., for a thread that is not selected anymore) are discarded.
+  int stackRequestToken = -1;
+  int stackRequestFirstFrame = 0;
   
   /// Attributes for waiting for confirmation messages from gdb
   char waitingForType;
   QString waitingForStatus;
   bool waitingDone;
   
-  int waitingForToken = -1;
+  /// Callbacks for the commands sent with SendCommand() whose result records
+  /// have not been received yet, indexed by token.
+  std::unordered_map<int, ResultCallback> pendingCommands;
+  
+  /// Buffer for gdb's standard output until a newline is encountered
+  LineRingBuffer stdoutBuffer;
+  
+  /// Line and record that are re-used for parsing each line of output
+  QByteArray lineBuffer;
+  GDBMIRecord record;
+  
+  /// Whether to log all gdb output with qDebug(), see
+  /// Settings::GetLogDebuggerOutput().
+  bool logOutput = false;
   
-  /// Caches for gdb output until a newline is encountered
-  QByteArray stdoutCache;
+  /// Cache for gdb's standard error output
   QByteArray stderrCache;
   
   /// The gdb process
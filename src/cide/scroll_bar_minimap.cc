@@ -4,15 +4,36 @@
 
 #include "cide/scroll_bar_minimap.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
 #include <QPainter>
 #include <QPaintEvent>
 
+#include "cide/cpu_budget.h"
 #include "cide/document.h"
 #include "cide/document_range.h"
 #include "cide/document_widget.h"
+#include "cide/performance_profile.h"
 #include "cide/qt_thread.h"
 #include "cide/text_utils.h"
 
+/// Number of map rows that a worker thread renders at once. The rows are
+/// distributed among the threads in tiles of this size.
+constexpr int kMinimapRowsPerTile = 1024;
+
+/// Maximum number of lines that a sampled map renders, see UpdateMap().
+constexpr int kMaxSampledMapHeight = 16384;
+
+/// Maximum number of rows of the map image. This exceeds the height at which
+/// the map is displayed on common screens. For documents with more lines,
+/// consecutive lines are averaged into each row, such that the memory use of
+/// the map and the cost of scaling it for display do not grow with the
+/// document length.
+constexpr int kMaxMapHeight = 4096;
+
 ScrollbarMinimap::ScrollbarMinimap(const std::shared_ptr<Document>& document, DocumentWidget* widget, int width, QWidget* parent)
   : QWidget(parent),
     mapWidth(width),
@@ -37,7 +58,7 @@ ScrollbarMinimap::~ScrollbarMinimap() {
   mapUpdateThread = nullptr;
 }
 
-void ScrollbarMinimap::UpdateMap(const std::vector<DocumentRange>& layoutLines, const std::shared_ptr<Document>& documentCopy) {
+void ScrollbarMinimap::UpdateMap(const std::vector<DocumentRange>& layoutLines, const std::shared_ptr<Document>& documentCopy, bool sampled) {
   // Update the scroll range
   maxScroll = layoutLines.size() - 1;
   
@@ -49,7 +70,17 @@ void ScrollbarMinimap::UpdateMap(const std::vector<DocumentRange>& layoutLines,
     requestDocument.reset(new Document());
     requestDocument->AssignTextAndStyles(*document);
   }
-  requestLayout = layoutLines;
+  int lineStride = sampled ? ((static_cast<int>(layoutLines.size()) + kMaxSampledMapHeight - 1) / kMaxSampledMapHeight) : 1;
+  if (lineStride > 1) {
+    requestLayout.clear();
+    requestLayout.reserve(layoutLines.size() / lineStride + 1);
+    for (int line = 0; line < layoutLines.size(); line += lineStride) {
+      requestLayout.push_back(layoutLines[line]);
+    }
+  } else {
+    requestLayout = layoutLines;
+  }
+  requestLineCount = layoutLines.size();
   haveRequest = true;
   newUpdateRequestCondition.notify_one();
 }
@@ -57,6 +88,7 @@ void ScrollbarMinimap::UpdateMap(const std::vector<DocumentRange>& layoutLines,
 void ScrollbarMinimap::SetDiffLines(const std::vector<LineDiff>& diffLines) {
   std::vector<DiffLine> newDiffLines;
   std::vector<int> newDiffRemovals;
+  newDiffLines.reserve(diffLines.size());
   
   for (const LineDiff& diff : diffLines) {
     if (diff.type == LineDiff::Type::Removed) {
@@ -87,12 +119,16 @@ void ScrollbarMinimap::paintEvent(QPaintEvent* event) {
   
   // Draw minimap.
   int mapRenderHeight = GetMapRenderHeight();
-  if (!map.isNull()) {
-    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
-    painter.drawImage(
-        QRect(1, 0, mapWidth, mapRenderHeight),
-        map,
-        map.rect());
+  if (!map.isNull() && mapRenderHeight > 0) {
+    qreal devicePixelRatio = devicePixelRatioF();
+    QSize scaledSize = QSize(mapWidth, mapRenderHeight) * devicePixelRatio;
+    if (scaledMap.isNull() ||
+        scaledMap.size() != scaledSize ||
+        scaledMap.devicePixelRatio() != devicePixelRatio) {
+      scaledMap = QPixmap::fromImage(map.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+      scaledMap.setDevicePixelRatio(devicePixelRatio);
+    }
+    painter.drawPixmap(1, 0, scaledMap);
   }
   
   // Draw background below minimap
@@ -106,8 +142,8 @@ void ScrollbarMinimap::paintEvent(QPaintEvent* event) {
     // Draw diff lines.
     for (const DiffLine& diffLine : diffLines) {
       constexpr int kAdditionalLineExtent = 0;
-      int y0 = (mapRenderHeight * (diffLine.firstLine - kAdditionalLineExtent + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * map.height()) + 0.5f;
-      int y1 = (mapRenderHeight * (diffLine.lastLine + kAdditionalLineExtent + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * map.height()) + 0.5f;
+      int y0 = (mapRenderHeight * (diffLine.firstLine - kAdditionalLineExtent + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * mapLineCount) + 0.5f;
+      int y1 = (mapRenderHeight * (diffLine.lastLine + kAdditionalLineExtent + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * mapLineCount) + 0.5f;
       
       painter.setPen(Qt::NoPen);
       painter.setBrush(QBrush(diffLine.color));
@@ -116,7 +152,7 @@ void ScrollbarMinimap::paintEvent(QPaintEvent* event) {
     
     // Draw diff removals.
     for (int diffRemoval : diffRemovals) {
-      int y = (mapRenderHeight * (diffRemoval + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * map.height()) + 0.5f;
+      int y = (mapRenderHeight * (diffRemoval + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * mapLineCount) + 0.5f;
       
       painter.setPen(Qt::NoPen);
       painter.setBrush(QBrush(qRgb(255, 0, 0)));
@@ -125,7 +161,7 @@ void ScrollbarMinimap::paintEvent(QPaintEvent* event) {
     
     // Draw line attribute lines.
     for (const MapLine& mapLine : mapLines) {
-      int y = (mapRenderHeight * (mapLine.line + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * map.height()) + 0.5f;
+      int y = (mapRenderHeight * (mapLine.line + 0.5f) * widget->GetLineHeight()) / (widget->GetLineHeight() * mapLineCount) + 0.5f;
       
       painter.setPen(qRgb(200, 200, 200));
       painter.setBrush(QBrush(mapLine.color));
@@ -133,23 +169,46 @@ void ScrollbarMinimap::paintEvent(QPaintEvent* event) {
     }
     
     // Draw the visible window.
-    int windowStart = (mapRenderHeight * widget->GetYScroll()) / (widget->GetLineHeight() * map.height());
-    int windowEnd = (mapRenderHeight * (widget->GetYScroll() + widget->height() + 0.5f * widget->GetLineHeight())) / (widget->GetLineHeight() * map.height());
+    paintedWindowRect = GetVisibleWindowRect(mapRenderHeight);
+    QRect windowRect = paintedWindowRect.adjusted(0, 0, -1, -1);  // without the outline
     
     painter.setPen(Qt::NoPen);
     painter.setBrush(QBrush(qRgb(0, 0, 255)));
     painter.setOpacity(0.2f);
-    painter.drawRect(1, windowStart, mapWidth - 1, windowEnd - windowStart);
+    painter.drawRect(windowRect);
     
     painter.setPen(qRgb(0, 0, 255));
     painter.setBrush(Qt::NoBrush);
     painter.setOpacity(1.f);
-    painter.drawRect(1, windowStart, mapWidth - 1, windowEnd - windowStart);
+    painter.drawRect(windowRect);
     
     painter.end();
+  } else {
+    paintedWindowRect = QRect();
+  }
+}
+
+void ScrollbarMinimap::ScrollChanged() {
+  if (map.isNull()) {
+    return;
+  }
+  QRect windowRect = GetVisibleWindowRect(GetMapRenderHeight());
+  if (windowRect != paintedWindowRect) {
+    update(paintedWindowRect.united(windowRect));
   }
 }
 
+QRect ScrollbarMinimap::GetVisibleWindowRect(int mapRenderHeight) {
+  if (map.isNull() || mapLineCount == 0 || widget->GetLineHeight() <= 0) {
+    return QRect();
+  }
+  int windowStart = (mapRenderHeight * widget->GetYScroll()) / (widget->GetLineHeight() * mapLineCount);
+  int windowEnd = (mapRenderHeight * (widget->GetYScroll() + widget->height() + 0.5f * widget->GetLineHeight())) / (widget->GetLineHeight() * mapLineCount);
+  // The outline drawn with a one-pixel pen extends one pixel further to the
+  // right and bottom than the filled area.
+  return QRect(1, windowStart, mapWidth, windowEnd - windowStart + 1);
+}
+
 void ScrollbarMinimap::mousePressEvent(QMouseEvent* event) {
   if (event->button() == Qt::LeftButton || event->button() == Qt::MiddleButton) {
     SetScroll(event->y());
@@ -185,7 +244,54 @@ int ScrollbarMinimap::GetMapRenderHeight() {
     return 0;
   } else {
     float character_height_by_width = widget->GetLineHeight() / static_cast<float>(widget->GetCharWidth());
-    return std::min(height(), static_cast<int>(character_height_by_width * map.height() + 0.5f));
+    return std::min(height(), static_cast<int>(character_height_by_width * mapLineCount + 0.5f));
+  }
+}
+
+void ScrollbarMinimap::RasterizeLine(Document* document, const DocumentRange& range, int mapWidth, uchar* ptr) {
+  // Render the line characters, one style run at a time.
+  int charactersInLine = 0;
+  if (!range.IsEmpty()) {
+    for (Document::StyleRunIterator it(document, range.start.offset); it.GetRunStart() < range.end.offset; ++ it) {
+      if (!it.IsValid()) {
+        qDebug() << "ERROR: Style run iterator became invalid while iterating until the line end (according to the layout). Is there a mismatch between the document and the layout?";
+        break;
+      }
+      
+      // Blend the character color with the background color to make the
+      // text rendering look less "heavy". This also makes it look more like
+      // a zoomed-out version of the actual text since only a small percentage
+      // of the character rectangles is taken up by the character color, so
+      // it is expected that a lot of the background color is blended in.
+      const HighlightStyle& style = it.GetStyle();
+      constexpr float kDampenFactor = 0.45f;
+      uchar red = (255 * (1 - kDampenFactor) + style.textColor.red() * kDampenFactor) + 0.5f;
+      uchar green = (255 * (1 - kDampenFactor) + style.textColor.green() * kDampenFactor) + 0.5f;
+      uchar blue = (255 * (1 - kDampenFactor) + style.textColor.blue() * kDampenFactor) + 0.5f;
+      
+      const QChar* text = it.GetText();
+      int size = std::min(it.GetRunEnd(), range.end.offset) - it.GetRunStart();
+      for (int c = 0; c < size; ++ c) {
+        if (IsWhitespace(text[c])) {
+          *ptr++ = 255;
+          *ptr++ = 255;
+          *ptr++ = 255;
+        } else {
+          *ptr++ = red;
+          *ptr++ = green;
+          *ptr++ = blue;
+        }
+      }
+      charactersInLine += size;
+    }
+  }
+  
+  // Render the line background color to the right of the characters
+  while (charactersInLine < mapWidth) {
+    *ptr++ = 255;
+    *ptr++ = 255;
+    *ptr++ = 255;
+    ++ charactersInLine;
   }
 }
 
@@ -195,6 +301,18 @@ void ScrollbarMinimap::MapUpdateThreadMain() {
   QColor errorColor = qRgb(255, 0, 0);
   QColor warningColor = qRgb(0, 255, 0);
   
+  // The previous map, the content hashes of its rows (mapped to the first
+  // row with each hash), and the document it was rendered from. Rows whose
+  // lines have unchanged content are copied from the previous map instead of
+  // rendering them again. The document is kept alive such that its blocks are not freed,
+  // which keeps the block identities in the hashes unique (see
+  // Document::HashRangeContent()).
+  QImage previousMap;
+  std::unordered_map<std::size_t, int> previousRowForHash;
+  std::shared_ptr<Document> previousDocument;
+  
+  std::chrono::steady_clock::time_point lastUpdateTime;
+  
   while (true) {
     std::unique_lock<std::mutex> lock(updateRequestMutex);
     if (mExit) {
@@ -207,116 +325,160 @@ void ScrollbarMinimap::MapUpdateThreadMain() {
       }
     }
     
+    // Limit the update rate as configured by the performance profile. Since
+    // new requests replace older ones, the updates in between are skipped.
+    auto nextUpdateTime = lastUpdateTime + std::chrono::milliseconds(GetPerformanceProfileParameters().minMinimapUpdateIntervalMilliseconds);
+    while (!mExit && std::chrono::steady_clock::now() < nextUpdateTime) {
+      newUpdateRequestCondition.wait_until(lock, nextUpdateTime);
+    }
+    if (mExit) {
+      return;
+    }
+    lastUpdateTime = std::chrono::steady_clock::now();
+    
     std::shared_ptr<Document> workingDocument = requestDocument;
     requestDocument = nullptr;
     std::vector<DocumentRange> workingLayout;
     workingLayout.swap(requestLayout);
+    int workingLineCount = requestLineCount;
     haveRequest = false;
     
     lock.unlock();
     
-    // Perform the update
-    QImage newMap(mapWidth, workingLayout.size(), QImage::Format_RGB888);
+    CPUBudgetScope budgetScope(CPUBudget::QoS::Normal, &mExit);
+    if (!budgetScope.acquired()) {
+      return;
+    }
+    
+    // Perform the update. The map rows are distributed among multiple threads
+    // in tiles, using as many helper threads as the CPUBudget allows. If there
+    // are more lines than kMaxMapHeight, the lines from getRowStartLine(row) to
+    // getRowStartLine(row + 1) are averaged into each row.
+    int lineCount = workingLayout.size();
+    int mapHeight = std::min(lineCount, kMaxMapHeight);
+    auto getRowStartLine = [&](int row) {
+      return static_cast<int>((static_cast<long long>(row) * lineCount) / mapHeight);
+    };
+    QImage newMap(mapWidth, mapHeight, QImage::Format_RGB888);
     std::vector<MapLine> newMapLines;
+    std::vector<std::size_t> newRowHashes(mapHeight);
+    
+    uchar* newMapBits = newMap.bits();
+    int newMapBytesPerLine = newMap.bytesPerLine();
+    const uchar* previousMapBits = previousMap.isNull() ? nullptr : previousMap.constBits();
+    int previousMapBytesPerLine = previousMap.bytesPerLine();
     
-    Document::CharacterAndStyleIterator it(workingDocument.get());
-    for (int line = 0; line < workingLayout.size(); ++ line) {
+    auto getMapRange = [&](int line) {
       const DocumentRange& lineRange = workingLayout[line];
-      while (it.IsValid() && it.GetCharacterOffset() < lineRange.start.offset) {
-        ++ it;
-      }
-      
-      uchar* ptr = newMap.bits() + line * newMap.bytesPerLine();
-      
-      // NOTE: This was changed to render these lines over the minimap during
-      //       the paintEvent afterwards. This allows to easily keep them at a
-      //       minimum width.
-//       // If this is a special line (having a bookmark or a problem), color the
-//       // whole line in blue or red/green.
-//       int lineAttributes = workingDocument->lineAttributes(line);  // TODO: iterate over lines with LineIterator for faster access? Maybe add a way to initialize the character&style iterator quickly from the line iterator?
-//       if (lineAttributes != 0) {
-//         // <Determine color...>
-//         for (int i = 0; i < mapWidth; ++ i) {
-//           *ptr++ = lineColor.red();
-//           *ptr++ = lineColor.green();
-//           *ptr++ = lineColor.blue();
-//         }
-//         continue;
-//       }
+      return DocumentRange(lineRange.start.offset, std::min(lineRange.end.offset, lineRange.start.offset + mapWidth));
+    };
+    
+    std::atomic<int> nextTile(0);
+    auto renderTiles = [&]() {
+      std::vector<uchar> lineRow;
+      std::vector<int> rowSums;
       
-      // Render the line characters
-      int charactersInLine = 0;
-      while (it.GetCharacterOffset() < lineRange.end.offset && charactersInLine < mapWidth) {
-        if (!it.IsValid()) {
-          qDebug() << "ERROR: Character iterator became invalid while iterating until the line end (according to the layout). Is there a mismatch between the document and the layout?";
-          qDebug() << "line: " << line << ", workingLayout.size(): " << workingLayout.size();
-          break;
+      while (true) {
+        int firstRow = kMinimapRowsPerTile * nextTile++;
+        if (firstRow >= mapHeight) {
+          return;
         }
-        if (IsWhitespace(it.GetChar())) {
-          *ptr++ = 255;
-          *ptr++ = 255;
-          *ptr++ = 255;
-        } else {
-          const HighlightRange& style = it.GetStyle();
-          // Blend the character color with the background color to make the
-          // text rendering look less "heavy". This also makes it look more like
-          // a zoomed-out version of the actual text since only a small percentage
-          // of the character rectangles is taken up by the character color, so
-          // it is expected that a lot of the background color is blended in.
-          constexpr float kDampenFactor = 0.45f;
-          *ptr++ = (255 * (1 - kDampenFactor) + style.textColor.red() * kDampenFactor) + 0.5f;
-          *ptr++ = (255 * (1 - kDampenFactor) + style.textColor.green() * kDampenFactor) + 0.5f;
-          *ptr++ = (255 * (1 - kDampenFactor) + style.textColor.blue() * kDampenFactor) + 0.5f;
+        int endRow = std::min(mapHeight, firstRow + kMinimapRowsPerTile);
+        for (int row = firstRow; row < endRow; ++ row) {
+          int firstLine = getRowStartLine(row);
+          int endLine = getRowStartLine(row + 1);
+          uchar* ptr = newMapBits + row * newMapBytesPerLine;
+          
+          // For rows with multiple lines, the row hash combines the line
+          // hashes, such that the row is only rendered again if one of its
+          // lines changed.
+          std::size_t rowHash = workingDocument->HashRangeContent(getMapRange(firstLine));
+          for (int line = firstLine + 1; line < endLine; ++ line) {
+            rowHash ^= workingDocument->HashRangeContent(getMapRange(line)) + 0x9e3779b9 + (rowHash << 6) + (rowHash >> 2);
+          }
+          newRowHashes[row] = rowHash;
+          
+          auto it = previousMapBits ? previousRowForHash.find(rowHash) : previousRowForHash.end();
+          if (it != previousRowForHash.end()) {
+            memcpy(ptr, previousMapBits + it->second * previousMapBytesPerLine, 3 * mapWidth);
+          } else if (endLine - firstLine == 1) {
+            RasterizeLine(workingDocument.get(), getMapRange(firstLine), mapWidth, ptr);
+          } else {
+            lineRow.resize(3 * mapWidth);
+            rowSums.assign(3 * mapWidth, 0);
+            for (int line = firstLine; line < endLine; ++ line) {
+              RasterizeLine(workingDocument.get(), getMapRange(line), mapWidth, lineRow.data());
+              for (int i = 0; i < 3 * mapWidth; ++ i) {
+                rowSums[i] += lineRow[i];
+              }
+            }
+            int numLines = endLine - firstLine;
+            for (int i = 0; i < 3 * mapWidth; ++ i) {
+              ptr[i] = (rowSums[i] + numLines / 2) / numLines;
+            }
+          }
         }
-        ++ charactersInLine;
-        ++ it;
       }
-      
-      // Render the line background color to the right of the characters
-      while (charactersInLine < mapWidth) {
-        *ptr++ = 255;
-        *ptr++ = 255;
-        *ptr++ = 255;
-        ++ charactersInLine;
+    };
+    
+    int numTiles = (mapHeight + kMinimapRowsPerTile - 1) / kMinimapRowsPerTile;
+    int threadCount = std::max(1, std::min<int>(std::thread::hardware_concurrency(), numTiles));
+    std::vector<std::thread> workerThreads;
+    for (int i = 1; i < threadCount; ++ i) {
+      if (!CPUBudget::Instance().TryAcquire(CPUBudget::QoS::Normal)) {
+        break;
       }
+      workerThreads.emplace_back([&]() {
+        renderTiles();
+        CPUBudget::Instance().Release(CPUBudget::QoS::Normal);
+      });
+    }
+    renderTiles();
+    for (std::thread& thread : workerThreads) {
+      thread.join();
+    }
+    
+    previousMap = newMap;
+    previousRowForHash.clear();
+    for (int row = 0; row < mapHeight; ++ row) {
+      previousRowForHash.emplace(newRowHashes[row], row);
     }
+    std::shared_ptr<Document> outdatedDocument = previousDocument;
+    previousDocument = workingDocument;
     
     // Collect all places where lines should be drawn over the minimap.
-    int line = 0;
-    Document::LineIterator lineIt(workingDocument.get());
-    while (lineIt.IsValid()) {
-      int lineAttributes = lineIt.GetAttributes();
-      if (lineAttributes != 0) {
-        float red = 0;
-        float green = 0;
-        float blue = 0;
-        int bgColorCount = 0;
-        // The checks are done in order of preference for the case that there are
-        // multiple flags for a single line.
-        if (lineAttributes & static_cast<int>(LineAttribute::Bookmark)) {
-          red += bookmarkColor.red();
-          green += bookmarkColor.green();
-          blue += bookmarkColor.blue();
-          ++ bgColorCount;
-        }
-        if (lineAttributes & static_cast<int>(LineAttribute::Error)) {
-          red += errorColor.red();
-          green += errorColor.green();
-          blue += errorColor.blue();
-          ++ bgColorCount;
-        }
-        if (lineAttributes & static_cast<int>(LineAttribute::Warning)) {
-          red += warningColor.red();
-          green += warningColor.green();
-          blue += warningColor.blue();
-          ++ bgColorCount;
-        }
-        QColor lineColor = qRgb(red / bgColorCount, green / bgColorCount, blue / bgColorCount);
-        newMapLines.emplace_back(line, lineColor);
-      }
+    std::vector<std::pair<int, int>> linesWithAttributes;
+    workingDocument->GetLinesWithAttributes(&linesWithAttributes);
+    for (const std::pair<int, int>& lineWithAttributes : linesWithAttributes) {
+      int line = lineWithAttributes.first;
+      int lineAttributes = lineWithAttributes.second;
       
-      ++ lineIt;
-      ++ line;
+      float red = 0;
+      float green = 0;
+      float blue = 0;
+      int bgColorCount = 0;
+      // The checks are done in order of preference for the case that there are
+      // multiple flags for a single line.
+      if (lineAttributes & static_cast<int>(LineAttribute::Bookmark)) {
+        red += bookmarkColor.red();
+        green += bookmarkColor.green();
+        blue += bookmarkColor.blue();
+        ++ bgColorCount;
+      }
+      if (lineAttributes & static_cast<int>(LineAttribute::Error)) {
+        red += errorColor.red();
+        green += errorColor.green();
+        blue += errorColor.blue();
+        ++ bgColorCount;
+      }
+      if (lineAttributes & static_cast<int>(LineAttribute::Warning)) {
+        red += warningColor.red();
+        green += warningColor.green();
+        blue += warningColor.blue();
+        ++ bgColorCount;
+      }
+      QColor lineColor = qRgb(red / bgColorCount, green / bgColorCount, blue / bgColorCount);
+      newMapLines.emplace_back(line, lineColor);
     }
     
     // Transfer the new map to the main (Qt) thread and make it update the display.
@@ -332,8 +494,11 @@ void ScrollbarMinimap::MapUpdateThreadMain() {
       // necessary anymore now that the file watcher is created lazily, but we
       // still do it here to be on the safe side.
       workingDocument.reset();
+      outdatedDocument.reset();
       
       map = newMap;
+      scaledMap = QPixmap();
+      mapLineCount = workingLineCount;
       mapLines.swap(newMapLines);
       update(rect());
     }, &abortData);
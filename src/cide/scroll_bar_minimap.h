@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <QPixmap>
 #include <QWidget>
 
 #include <atomic>
@@ -24,10 +25,17 @@ class ScrollbarMinimap : public QWidget {
   ~ScrollbarMinimap();
   
   /// Note: documentCopy can be null. In this case, ScrollbarMinimap will do the copy itself.
-  void UpdateMap(const std::vector<DocumentRange>& layoutLines, const std::shared_ptr<Document>& documentCopy);
+  /// If @p sampled is true, only an evenly spaced sample of at most
+  /// kMaxSampledMapHeight lines is rendered (used for very large documents).
+  void UpdateMap(const std::vector<DocumentRange>& layoutLines, const std::shared_ptr<Document>& documentCopy, bool sampled = false);
   
   void SetDiffLines(const std::vector<LineDiff>& diffLines);
   
+  /// Must be called when the vertical scroll position of the widget changed.
+  /// Only repaints the old and new marker of the visible window, instead of
+  /// the whole minimap.
+  void ScrollChanged();
+  
  protected:
   void paintEvent(QPaintEvent* event) override;
   
@@ -41,8 +49,16 @@ class ScrollbarMinimap : public QWidget {
   int GetMapRenderHeight();
   void SetScroll(int clickY);
   
+  /// Returns the area that is covered by the marker of the visible window
+  /// (including its outline), given the map render height.
+  QRect GetVisibleWindowRect(int mapRenderHeight);
+  
   void MapUpdateThreadMain();
   
+  /// Renders the characters in @p range (which is a single line, shortened to
+  /// at most @p mapWidth characters) into one row of the RGB888 map at @p ptr.
+  static void RasterizeLine(Document* document, const DocumentRange& range, int mapWidth, uchar* ptr);
+  
   
   struct MapLine {
     inline MapLine(int line, QColor color)
@@ -73,7 +89,17 @@ class ScrollbarMinimap : public QWidget {
   };
   
   QImage map;
+  /// The map scaled to the size at which it is displayed (in device pixels),
+  /// such that paintEvent() does not need to scale it for every frame (in
+  /// particular while scrolling). Null if it must be scaled again.
+  QPixmap scaledMap;
+  /// The area of the visible window marker that was painted last.
+  QRect paintedWindowRect;
   int mapWidth;
+  /// Number of document lines that the map represents. This differs from the
+  /// map height if the map is sampled, or if multiple lines are averaged into
+  /// each row of the map (for documents with more than kMaxMapHeight lines).
+  int mapLineCount = 0;
   std::vector<MapLine> mapLines;
   std::vector<DiffLine> diffLines;
   std::vector<int> diffRemovals;
@@ -86,6 +112,7 @@ class ScrollbarMinimap : public QWidget {
   std::atomic<bool> haveRequest;
   std::shared_ptr<Document> requestDocument;
   std::vector<DocumentRange> requestLayout;
+  int requestLineCount;
   
   int maxScroll = 0;
   
@@ -4,16 +4,22 @@
 
 #include "cide/search_bar.h"
 
+#include <algorithm>
+#include <unordered_set>
+
 #include <QApplication>
 #include <QDebug>
 #include <QKeyEvent>
 #include <QPainter>
+#include <QTimer>
 
 #include "cide/main_window.h"
 #include "cide/clang_parser.h"
 #include "cide/clang_utils.h"
+#include "cide/qt_thread.h"
 #include "cide/search_list_widget.h"
 #include "cide/settings.h"
+#include "cide/text_utils.h"
 
 SearchBar::SearchBar(MainWindow* mainWindow, QWidget *parent)
     : QLineEdit(parent),
@@ -24,9 +30,16 @@ SearchBar::SearchBar(MainWindow* mainWindow, QWidget *parent)
   mListWidget = new SearchListWidget(this);
   
   connect(this, &SearchBar::textChanged, this, &SearchBar::SearchTextChanged);
+  
+  globalSymbolItemsCanceled = false;
 }
 
 SearchBar::~SearchBar() {
+  if (globalSymbolItemsThread) {
+    globalSymbolItemsCanceled = true;
+    globalSymbolItemsAbortData.Abort();
+    globalSymbolItemsThread->join();
+  }
   delete mListWidget;
 }
 
@@ -191,18 +204,18 @@ void SearchBar::GetCurrentContext() {
   DocumentWidget* widget = mainWindow->GetCurrentDocumentWidget();
   if (widget) {
     std::shared_ptr<Document> document = widget->GetDocument();
-    std::vector<Context> contextStack = document->GetContextsAt(widget->MapCursorToDocument());
+    std::vector<const Context*> contextStack = document->GetContextsAt(widget->MapCursorToDocument());
     currentContexts = QStringLiteral("");
-    for (const auto& context : contextStack) {
+    for (const Context* context : contextStack) {
       if (!currentContexts.isEmpty()) {
         currentContexts += QStringLiteral(", ");
       }
-      if (context.nameInDescriptionRange.IsValid()) {
+      if (context->nameInDescriptionRange.IsValid()) {
         currentContextBoldRanges.push_back(DocumentRange(
-            context.nameInDescriptionRange.start + currentContexts.size(),
-            context.nameInDescriptionRange.end + currentContexts.size()));
+            context->nameInDescriptionRange.start + currentContexts.size(),
+            context->nameInDescriptionRange.end + currentContexts.size()));
       }
-      currentContexts += context.description;
+      currentContexts += context->description;
     }
   }
   
@@ -216,92 +229,157 @@ void SearchBar::GetCurrentContext() {
 }
 
 void SearchBar::ComputeItems() {
-  std::vector<SearchListItem> items;
-  
-  DocumentWidget* widget = mainWindow->GetCurrentDocumentWidget();
-  if (widget) {
-    std::shared_ptr<Document> document = widget->GetDocument();
+  // List the contexts in the current file?
+  if (mode == Mode::LocalContexts) {
+    std::shared_ptr<std::vector<SearchListItem>> items(new std::vector<SearchListItem>());
     
-    // List the contexts in the current file?
-    if (mode == Mode::LocalContexts) {
+    DocumentWidget* widget = mainWindow->GetCurrentDocumentWidget();
+    if (widget) {
+      std::shared_ptr<Document> document = widget->GetDocument();
       const auto& contexts = document->GetContexts();
+      items->reserve(contexts.size());
       for (const auto& context : contexts) {
-        items.emplace_back(SearchListItem::Type::LocalContext, context.description, context.name);
-        items.back().displayTextBoldRange = context.nameInDescriptionRange;
-        items.back().jumpLocation = context.range.start;
+        items->emplace_back(SearchListItem::Type::LocalContext, context.description, context.name);
+        SearchListItem& item = items->back();
+        item.foldedFilterText = FoldCaseForFuzzyTextMatch(context.name);
+        item.displayTextBoldRange = context.nameInDescriptionRange;
+        item.jumpLocation = context.range.start;
       }
     }
+    
+    mListWidget->SetItems(items);
   }
   
   // List the project files?
   if (mode == Mode::Files) {
-    std::unordered_set<QString> addedPaths;
-    auto addPath = [&](const QString& path) {
-      if (addedPaths.count(path) == 0) {
-        addedPaths.insert(path);
-        items.emplace_back(SearchListItem::Type::ProjectFile, path, path);
-        items.back().displayTextBoldRange = DocumentRange::Invalid();
-      }
-    };
-    
-    for (const auto& project : mainWindow->GetProjects()) {
-      QDir projectDir = QFileInfo(project->GetYAMLFilePath()).dir();
-      
-      int numTargets = project->GetNumTargets();
-      for (int targetIndex = 0; targetIndex < numTargets; ++ targetIndex) {
-        const Target& target = project->GetTarget(targetIndex);
-        for (const SourceFile& source : target.sources) {
-          addPath(source.path);
-          
-          for (const QString& includedPath : source.includedPaths) {
-            // Do not include external headers.
-            // TODO: Maybe these could be included as well as an option.
-            if (!includedPath.startsWith(projectDir.path())) {
-              continue;
-            }
-            
-            addPath(includedPath);
-          }
-        }
-      }
-    }
+    UpdateProjectFileItems();
+    mListWidget->SetItems(projectFileItems);
     
     // TODO: Include an item to open non-project files or create new files
   }
   
-  // List global symbols?
+  // List global symbols? If the symbols changed, the previous items are
+  // listed until the new ones have been created in the background.
   if (mode == Mode::GlobalSymbols) {
-    USRStorage::Instance().Lock();
+    UpdateGlobalSymbolItems();
+    if (globalSymbolItems) {
+      mListWidget->SetItems(globalSymbolItems);
+    } else {
+      mListWidget->SetItems(std::shared_ptr<std::vector<SearchListItem>>(new std::vector<SearchListItem>()));
+    }
+  }
+  
+  mListWidget->Relayout();
+}
+
+void SearchBar::UpdateProjectFileItems() {
+  const auto& projects = mainWindow->GetProjects();
+  bool upToDate = projectFileItemsVersions.size() == projects.size();
+  for (int i = 0; i < projects.size() && upToDate; ++ i) {
+    upToDate = projectFileItemsVersions[i].first == projects[i].get() &&
+               projectFileItemsVersions[i].second == projects[i]->GetFileIndexVersion();
+  }
+  if (upToDate && projectFileItems) {
+    return;
+  }
+  
+  std::shared_ptr<std::vector<SearchListItem>> items(new std::vector<SearchListItem>());
+  projectFileItemsVersions.clear();
+  std::unordered_set<QString> addedPaths;
+  std::vector<QString> paths;
+  for (const auto& project : projects) {
+    projectFileItemsVersions.emplace_back(project.get(), project->GetFileIndexVersion());
     
-    const auto& USRs = USRStorage::Instance().GetAllUSRs();
-    for (auto fileIt = USRs.begin(), endFileIt = USRs.end(); fileIt != endFileIt; ++ fileIt) {
-      for (auto usrIt = fileIt->second->map.begin(), endUsrIt = fileIt->second->map.end(); usrIt != endUsrIt; ++ usrIt) {
-        if (usrIt->second.namePos < 0) {
-          continue;
-        }
-        bool isClassDeclLike = IsClassDeclLikeCursorKind(usrIt->second.kind);
-        if (!isClassDeclLike && !IsFunctionDeclLikeCursorKind(usrIt->second.kind)) {
-          continue;
-        }
-        if (isClassDeclLike && !usrIt->second.isDefinition) {
-          continue;
-        }
-        
-        items.emplace_back(
-            SearchListItem::Type::GlobalSymbol,
-            QObject::tr("%1 at %2:%3:%4").arg(usrIt->second.spelling).arg(fileIt->first).arg(usrIt->second.line).arg(usrIt->second.column),
-            usrIt->second.spelling.mid(usrIt->second.namePos, usrIt->second.nameSize));
-        // if (usrIt->second.namePos >= 0) {
-          items.back().displayTextBoldRange = DocumentRange(usrIt->second.namePos, usrIt->second.namePos + usrIt->second.nameSize);
-        // } else {
-        //   items.back().displayTextBoldRange = DocumentRange::Invalid();
-        // }
+    project->GetProjectFilePaths(&paths);
+    std::sort(paths.begin(), paths.end());
+    for (const QString& path : paths) {
+      // Skip files that are shared with a previously listed project.
+      if (!addedPaths.insert(path).second) {
+        continue;
       }
+      items->emplace_back(SearchListItem::Type::ProjectFile, path, path);
+      SearchListItem& item = items->back();
+      item.displayTextBoldRange = DocumentRange::Invalid();
+      item.foldedFilterText = FoldCaseForFuzzyTextMatch(path);
+    }
+  }
+  
+  projectFileItems = items;
+}
+
+void SearchBar::UpdateGlobalSymbolItems() {
+  // If the items are being created already, this is called again once they
+  // are done.
+  if (globalSymbolItemsThread) {
+    return;
+  }
+  
+  std::vector<std::shared_ptr<const GlobalSymbolFile>> symbolFiles;
+  USRStorage::Instance().GetGlobalSymbols(&symbolFiles);
+  if (globalSymbolItems && symbolFiles == globalSymbolItemsFiles) {
+    return;
+  }
+  
+  globalSymbolItemsCanceled = false;
+  globalSymbolItemsAbortData.aborted = false;
+  globalSymbolItemsThread.reset(new std::thread(&SearchBar::GlobalSymbolItemsThreadMain, this, symbolFiles));
+}
+
+void SearchBar::GlobalSymbolItemsThreadMain(std::vector<std::shared_ptr<const GlobalSymbolFile>> symbolFiles) {
+  std::size_t numSymbols = 0;
+  for (const auto& file : symbolFiles) {
+    numSymbols += file->symbols.size();
+  }
+  std::shared_ptr<std::vector<SearchListItem>> items(new std::vector<SearchListItem>());
+  items->reserve(numSymbols);
+  
+  // Note: The display texts of the items are created on demand by the list
+  // widget.
+  for (const auto& file : symbolFiles) {
+    if (globalSymbolItemsCanceled) {
+      return;
     }
+    for (const GlobalSymbol& symbol : file->symbols) {
+      items->emplace_back(SearchListItem::Type::GlobalSymbol, QString(), symbol.name);
+      SearchListItem& item = items->back();
+      item.foldedFilterText = symbol.foldedName;
+      item.displayTextBoldRange = DocumentRange(symbol.namePos, symbol.namePos + symbol.name.size());
+      item.symbolSpelling = symbol.spelling;
+      item.symbolPath = file->path;
+      item.symbolLine = symbol.line;
+      item.symbolColumn = symbol.column;
+    }
+  }
+  
+  RunInQtThreadBlocking([&]() {
+    globalSymbolItems = items;
+    globalSymbolItemsFiles.swap(symbolFiles);
     
-    USRStorage::Instance().Unlock();
+    // Join this thread only after it returned from RunInQtThreadBlocking().
+    QTimer::singleShot(0, this, &SearchBar::GlobalSymbolItemsCreated);
+  }, &globalSymbolItemsAbortData);
+}
+
+void SearchBar::GlobalSymbolItemsCreated() {
+  if (!globalSymbolItemsThread) {
+    return;
+  }
+  globalSymbolItemsThread->join();
+  globalSymbolItemsThread.reset();
+  
+  if (mode != Mode::GlobalSymbols || !hasFocus()) {
+    return;
   }
   
-  mListWidget->SetItems(std::move(items));
+  // Symbols may have been published in the meantime.
+  UpdateGlobalSymbolItems();
+  
+  mListWidget->SetItems(globalSymbolItems);
+  if (!text().isEmpty()) {
+    mListWidget->SetFilterText(text());
+  }
   mListWidget->Relayout();
+  if (mListWidget->HasItems()) {
+    mListWidget->show();
+  }
 }
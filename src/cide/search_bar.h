@@ -4,12 +4,21 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <QLineEdit>
 
 #include "cide/document_range.h"
+#include "cide/qt_thread.h"
+#include "cide/search_list_widget.h"
 
+struct GlobalSymbolFile;
 class MainWindow;
-class SearchListWidget;
+class Project;
 
 class SearchBar : public QLineEdit {
  Q_OBJECT
@@ -44,7 +53,11 @@ class SearchBar : public QLineEdit {
   
  private slots:
   void SearchTextChanged();
-
+  
+  /// Called in the Qt thread after the background thread created
+  /// globalSymbolItems.
+  void GlobalSymbolItemsCreated();
+  
  protected:
   void focusInEvent(QFocusEvent* event) override;
   void focusOutEvent(QFocusEvent* event) override;
@@ -58,6 +71,33 @@ class SearchBar : public QLineEdit {
   
   void ComputeItems();
   
+  /// Updates projectFileItems if the files of the projects changed since they
+  /// were last listed.
+  void UpdateProjectFileItems();
+  
+  /// Starts to update globalSymbolItems in a background thread if the
+  /// published global symbols changed since they were last listed.
+  void UpdateGlobalSymbolItems();
+  
+  void GlobalSymbolItemsThreadMain(std::vector<std::shared_ptr<const GlobalSymbolFile>> symbolFiles);
+  
+  
+  /// The items for the files of all projects, with the folded filter texts
+  /// for fuzzy matching computed already, and the projects and their
+  /// Project::GetFileIndexVersion() at the time the items were created.
+  std::shared_ptr<const std::vector<SearchListItem>> projectFileItems;
+  std::vector<std::pair<const Project*, unsigned int>> projectFileItemsVersions;
+  
+  /// The items for all global symbols, and the symbol files that they were
+  /// created from. Since the files are immutable once they are published by
+  /// USRStorage, the items remain valid as long as the same files are listed.
+  std::shared_ptr<const std::vector<SearchListItem>> globalSymbolItems;
+  std::vector<std::shared_ptr<const GlobalSymbolFile>> globalSymbolItemsFiles;
+  
+  // Background thread that creates globalSymbolItems
+  std::shared_ptr<std::thread> globalSymbolItemsThread;
+  std::atomic<bool> globalSymbolItemsCanceled;
+  RunInQtThreadAbortData globalSymbolItemsAbortData;
   
   QString currentContexts;
   std::vector<DocumentRange> currentContextBoldRanges;
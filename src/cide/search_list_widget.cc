@@ -4,18 +4,56 @@
 
 #include "cide/search_list_widget.h"
 
+#include <algorithm>
+
 #include <QDebug>
 #include <QPainter>
 #include <QPaintEvent>
 
 #include "cide/document_widget.h"
 #include "cide/main_window.h"
+#include "cide/qt_thread.h"
 #include "cide/search_bar.h"
 #include "cide/settings.h"
 
+/// Item count from which on the items are scored in background threads
+/// instead of in the Qt thread.
+constexpr int kMinItemsForBackgroundScoring = 2000;
+
+/// Number of items that are scored by a thread at a time.
+constexpr int kScoringChunkSize = 512;
+
+/// The texts that the items of a SearchListWidget are filtered with: items of
+/// type ProjectFile are matched to filepathText, all others to defaultText.
+struct SearchListFilterTexts {
+  inline SearchListFilterTexts(const QString& defaultText, const QString& filepathText)
+      : defaultText(defaultText),
+        defaultTextFolded(FoldCaseForFuzzyTextMatch(defaultText)),
+        filepathText(filepathText),
+        filepathTextFolded(FoldCaseForFuzzyTextMatch(filepathText)) {}
+  
+  inline void Score(const SearchListItem& item, FuzzyTextMatchScore* score) const {
+    if (item.type == SearchListItem::Type::ProjectFile) {
+      ComputeFuzzyTextMatch(filepathText, filepathTextFolded, item.filterText, item.foldedFilterText, score);
+    } else {
+      ComputeFuzzyTextMatch(defaultText, defaultTextFolded, item.filterText, item.foldedFilterText, score);
+    }
+  }
+  
+  inline bool IsMatch(const SearchListItem& item, const FuzzyTextMatchScore& score) const {
+    return IsFuzzyTextMatch(score, ((item.type == SearchListItem::Type::ProjectFile) ? filepathText : defaultText).size());
+  }
+  
+  QString defaultText;
+  QString defaultTextFolded;
+  QString filepathText;
+  QString filepathTextFolded;
+};
+
 struct SearchBarItemSorter {
-  inline SearchBarItemSorter(SearchListItem* items)
-      : items(items) {}
+  inline SearchBarItemSorter(const SearchListItem* items, const FuzzyTextMatchScore* scores)
+      : items(items),
+        scores(scores) {}
   
   inline bool operator() (int indexA, int indexB) const {
     const SearchListItem& itemA = items[indexA];
@@ -23,7 +61,7 @@ struct SearchBarItemSorter {
     
     // Sort based on the match quality between the items' filter texts and the
     // text input by the user.
-    int scoreComparison = itemA.matchScore.Compare(itemB.matchScore);
+    int scoreComparison = scores[indexA].Compare(scores[indexB]);
     if (scoreComparison != -1) {
       return scoreComparison;
     }
@@ -39,12 +77,14 @@ struct SearchBarItemSorter {
     return indexA < indexB;
   }
   
-  SearchListItem* items;
+  const SearchListItem* items;
+  const FuzzyTextMatchScore* scores;
 };
 
 
 SearchListWidget::SearchListWidget(SearchBar* searchBarWidget, QWidget* parent)
-    : QWidget(parent, GetCustomTooltipWindowFlags()) {
+    : QWidget(parent, GetCustomTooltipWindowFlags()),
+      mItems(new std::vector<SearchListItem>()) {
   setFocusPolicy(Qt::NoFocus);
   setAutoFillBackground(false);
   
@@ -52,23 +92,41 @@ SearchListWidget::SearchListWidget(SearchBar* searchBarWidget, QWidget* parent)
   connect(scrollBar, &QScrollBar::valueChanged, this, &SearchListWidget::ScrollChanged);
   
   this->searchBarWidget = searchBarWidget;
+  
+  scoringCanceled = false;
+}
+
+SearchListWidget::~SearchListWidget() {
+  StopScoringJob();
 }
 
-SearchListWidget::~SearchListWidget() {}
+QString SearchListItem::GetDisplayText() const {
+  if (displayText.isNull() && type == Type::GlobalSymbol) {
+    return QObject::tr("%1 at %2:%3:%4").arg(symbolSpelling).arg(symbolPath).arg(symbolLine).arg(symbolColumn);
+  }
+  return displayText;
+}
 
-void SearchListWidget::SetItems(const std::vector<SearchListItem>&& items) {
+
+void SearchListWidget::SetItems(const std::shared_ptr<const std::vector<SearchListItem>>& items) {
+  StopScoringJob();
+  
   mItems = items;
-  mSortOrder.resize(mItems.size());
-  for (int i = 0, size = mItems.size(); i < size; ++ i) {
+  int numItems = mItems->size();
+  mSortOrder.resize(numItems);
+  for (int i = 0; i < numItems; ++ i) {
     mSortOrder[i] = i;
   }
-  numShownItems = mItems.size();
+  mMatchScores.assign(numItems, FuzzyTextMatchScore(0, 0, true, 0));
+  numShownItems = numItems;
   
   selectedItem = 0;
   yScroll = 0;
 }
 
 void SearchListWidget::SetFilterText(const QString& text) {
+  StopScoringJob();
+  
   QString defaultFilterText = text.trimmed();
   
   // Try to parse the text as "filepath:line:column" or "filepath:line".
@@ -86,34 +144,59 @@ void SearchListWidget::SetFilterText(const QString& text) {
     }
   }
   
-  // Score each item according to how well it matches the new filter text.
-  constexpr int kMaxNonMatchedCharacters = 2;
-  int minMatchedCharactersDefault = std::max(0, defaultFilterText.size() - kMaxNonMatchedCharacters);
-  int minMatchedCharactersFilepath = std::max(0, filepathFilterText.size() - kMaxNonMatchedCharacters);
-  numShownItems = 0;
-  for (int i = 0, numItems = mItems.size(); i < numItems; ++ i) {
-    SearchListItem& item = mItems[i];
-    
-    QString* filterText;
-    int minMatchedCharacters;
-    if (item.type == SearchListItem::Type::ProjectFile) {
-      filterText = &filepathFilterText;
-      minMatchedCharacters = minMatchedCharactersFilepath;
-    } else {
-      filterText = &defaultFilterText;
-      minMatchedCharacters = minMatchedCharactersDefault;
-    }
-    
-    ComputeFuzzyTextMatch(*filterText, item.filterText, &item.matchScore);
-    if (item.matchScore.matchedCharacters >= minMatchedCharacters) {
-      ++ numShownItems;
-    }
+  // Scoring all global symbols on every keystroke would make the UI lag, so
+  // for large item counts, the items are scored in the background while the
+  // widget keeps showing the previous results.
+  int numItemsToScore = GetNumCandidateItems(defaultFilterText, filepathFilterText);
+  if (numItemsToScore < kMinItemsForBackgroundScoring) {
+    ApplyFilterText(defaultFilterText, filepathFilterText);
+    return;
+  }
+  
+  pendingFilterText = defaultFilterText;
+  pendingFilterTextFilepath = filepathFilterText;
+  filterPending = true;
+  scoringCanceled = false;
+  scoringAbortData.aborted = false;
+  std::vector<int> candidates(mSortOrder.begin(), mSortOrder.begin() + numItemsToScore);
+  scoringThread.reset(new std::thread(&SearchListWidget::ScoringThreadMain, this, defaultFilterText, filepathFilterText, candidates));
+}
+
+int SearchListWidget::GetNumCandidateItems(const QString& defaultFilterText, const QString& filepathFilterText) const {
+  // If both filter texts extend the previous ones, then the items that did not
+  // match the previous texts cannot match the new ones either (see
+  // ComputeFuzzyTextMatch()), so only the previously shown items, which are at
+  // the start of mSortOrder, need to be scored again. Otherwise, all items are
+  // scored.
+  if (defaultFilterText.startsWith(filterText) &&
+      filepathFilterText.startsWith(filterTextFilepath)) {
+    return numShownItems;
   }
+  return mItems->size();
+}
+
+void SearchListWidget::ApplyFilterText(const QString& defaultFilterText, const QString& filepathFilterText) {
+  // Score each candidate item according to how well it matches the new filter
+  // text, and move the items that match to the start of mSortOrder.
+  const std::vector<SearchListItem>& items = *mItems;
+  SearchListFilterTexts texts(defaultFilterText, filepathFilterText);
+  auto candidatesEnd = mSortOrder.begin() + GetNumCandidateItems(defaultFilterText, filepathFilterText);
+  for (auto it = mSortOrder.begin(); it != candidatesEnd; ++ it) {
+    texts.Score(items[*it], &mMatchScores[*it]);
+  }
+  auto shownEnd = std::partition(mSortOrder.begin(), candidatesEnd, [&](int index) {
+    return texts.IsMatch(items[index], mMatchScores[index]);
+  });
+  numShownItems = shownEnd - mSortOrder.begin();
   
-  // Sort the items.
+  // Sort the shown items.
   numSortedItems = std::min<std::size_t>(maxNumVisibleItems, numShownItems);
-  std::partial_sort(mSortOrder.begin(), mSortOrder.begin() + numSortedItems, mSortOrder.end(), SearchBarItemSorter(mItems.data()));
+  std::partial_sort(mSortOrder.begin(), mSortOrder.begin() + numSortedItems, shownEnd, SearchBarItemSorter(items.data(), mMatchScores.data()));
   
+  FilterTextChanged(defaultFilterText, filepathFilterText);
+}
+
+void SearchListWidget::FilterTextChanged(const QString& defaultFilterText, const QString& filepathFilterText) {
   // We currently never preserve the selection when the filter text changes.
   selectedItem = 0;
   yScroll = 0;
@@ -124,6 +207,90 @@ void SearchListWidget::SetFilterText(const QString& text) {
   Relayout();
 }
 
+void SearchListWidget::StopScoringJob() {
+  if (!scoringThread) {
+    return;
+  }
+  
+  scoringCanceled = true;
+  scoringAbortData.Abort();
+  scoringThread->join();
+  scoringThread.reset();
+  filterPending = false;
+}
+
+void SearchListWidget::ScoringThreadMain(QString defaultFilterText, QString filepathFilterText, std::vector<int> candidates) {
+  // Note: The items are immutable, and mItems is only replaced by SetItems(),
+  // which cancels this job first, so the items can be read here while the Qt
+  // thread uses them as well.
+  const std::vector<SearchListItem>& items = *mItems;
+  const int numCandidates = candidates.size();
+  const SearchListFilterTexts texts(defaultFilterText, filepathFilterText);
+  std::vector<FuzzyTextMatchScore> scores(items.size(), FuzzyTextMatchScore(0, 0, true, 0));
+  
+  // Score the items in chunks, distributed over multiple threads.
+  std::atomic<int> nextChunkStart(0);
+  auto scoreChunks = [&]() {
+    while (!scoringCanceled) {
+      int chunkStart = nextChunkStart.fetch_add(kScoringChunkSize);
+      if (chunkStart >= numCandidates) {
+        return;
+      }
+      int chunkEnd = std::min(numCandidates, chunkStart + kScoringChunkSize);
+      for (int i = chunkStart; i < chunkEnd; ++ i) {
+        int index = candidates[i];
+        texts.Score(items[index], &scores[index]);
+      }
+    }
+  };
+  
+  int numThreads = std::min<int>(
+      std::max<int>(1, std::thread::hardware_concurrency()),
+      (numCandidates + kScoringChunkSize - 1) / kScoringChunkSize);
+  std::vector<std::thread> helperThreads;
+  for (int i = 1; i < numThreads; ++ i) {
+    helperThreads.emplace_back(scoreChunks);
+  }
+  scoreChunks();
+  for (std::thread& thread : helperThreads) {
+    thread.join();
+  }
+  if (scoringCanceled) {
+    return;
+  }
+  
+  // Move the candidates that still match to the front and sort the best ones,
+  // such that only these need to be handed to the Qt thread before the widget
+  // can show them.
+  auto matchingEnd = std::partition(candidates.begin(), candidates.end(), [&](int index) {
+    return texts.IsMatch(items[index], scores[index]);
+  });
+  int numMatching = matchingEnd - candidates.begin();
+  int numSorted = std::min(maxNumVisibleItems, numMatching);
+  std::partial_sort(candidates.begin(), candidates.begin() + numSorted, matchingEnd, SearchBarItemSorter(items.data(), scores.data()));
+  if (scoringCanceled) {
+    return;
+  }
+  
+  RunInQtThreadBlocking([&]() {
+    if (scoringCanceled) {
+      return;
+    }
+    
+    // Since SetFilterText() cancels this job, the first numCandidates
+    // elements of mSortOrder are still a permutation of the candidates (while
+    // their order might have been changed by ExtendItemSort()).
+    for (int index : candidates) {
+      mMatchScores[index] = scores[index];
+    }
+    std::copy(candidates.begin(), candidates.end(), mSortOrder.begin());
+    numShownItems = numMatching;
+    numSortedItems = numSorted;
+    filterPending = false;
+    FilterTextChanged(defaultFilterText, filepathFilterText);
+  }, &scoringAbortData);
+}
+
 void SearchListWidget::Relayout() {
   // Get font metrics
   QFontMetrics fontMetrics(Settings::Instance().GetDefaultFont());
@@ -161,6 +328,16 @@ void SearchListWidget::Relayout() {
 }
 
 void SearchListWidget::Accept() {
+  // If the items are still being scored for the current filter text, finish
+  // the scoring in the Qt thread, since the user expects to get the best match
+  // for the text that they typed.
+  if (filterPending) {
+    QString defaultFilterText = pendingFilterText;
+    QString filepathFilterText = pendingFilterTextFilepath;
+    StopScoringJob();
+    ApplyFilterText(defaultFilterText, filepathFilterText);
+  }
+  
   if (numShownItems == 0) {
     return;
   }
@@ -168,7 +345,7 @@ void SearchListWidget::Accept() {
     qDebug() << "Error: SearchListWidget::Accept(): Invalid value of selectedItem";
     return;
   }
-  const SearchListItem& item = mItems[mSortOrder[selectedItem]];
+  const SearchListItem& item = (*mItems)[mSortOrder[selectedItem]];
   if (item.type == SearchListItem::Type::LocalContext) {
     DocumentWidget* widget = searchBarWidget->GetMainWindow()->GetCurrentDocumentWidget();
     if (widget) {
@@ -190,12 +367,7 @@ void SearchListWidget::Accept() {
     }
     searchBarWidget->GetMainWindow()->GotoDocumentLocation(jumpUrl);
   } else if (item.type == SearchListItem::Type::GlobalSymbol) {
-    QStringList words = item.displayText.split(" ");
-    if (words.empty()) {
-      qDebug() << "Error: Cannot parse jump location for a GlobalSymbol from display string:" << item.displayText;
-    } else {
-      searchBarWidget->GetMainWindow()->GotoDocumentLocation(QStringLiteral("file://") + words.back());
-    }
+    searchBarWidget->GetMainWindow()->GotoDocumentLocation(QStringLiteral("file://%1:%2:%3").arg(item.symbolPath).arg(item.symbolLine).arg(item.symbolColumn));
   } else {
     qDebug() << "Error: SearchListWidget::Accept(): Item type not handled.";
   }
@@ -224,15 +396,18 @@ void SearchListWidget::paintEvent(QPaintEvent* event) {
   
   int currentY = 1 + minItem * lineHeight - yScroll;
   for (int itemIndex = minItem; itemIndex <= maxItem; ++ itemIndex) {
-    const SearchListItem& item = mItems[mSortOrder[itemIndex]];
+    int index = mSortOrder[itemIndex];
+    const SearchListItem& item = (*mItems)[index];
+    const FuzzyTextMatchScore& matchScore = mMatchScores[index];
+    QString displayText = item.GetDisplayText();
     
     int visibleHeight = std::min(height() - 1 - currentY, lineHeight);
     
     // Draw the line background
     int intensity = 255 - std::min(80, 20 * std::max(
-        item.matchScore.matchErrors,
-        ((item.type == SearchListItem::Type::ProjectFile) ? filterTextFilepath.size() : filterText.size()) - item.matchScore.matchedCharacters));
-    if (item.matchScore.matchedStartIndex > 0) {
+        matchScore.matchErrors,
+        ((item.type == SearchListItem::Type::ProjectFile) ? filterTextFilepath.size() : filterText.size()) - matchScore.matchedCharacters));
+    if (matchScore.matchedStartIndex > 0) {
       intensity = std::min(intensity, 255 - 20);
     }
     QColor backgroundColor = qRgb(intensity, intensity, intensity);
@@ -248,7 +423,7 @@ void SearchListWidget::paintEvent(QPaintEvent* event) {
     bool usingBoldFont = false;
     
     int xCoord = 1;
-    for (int c = 0, size = item.displayText.size(); c < size; ++ c) {
+    for (int c = 0, size = displayText.size(); c < size; ++ c) {
       int visibleWidth = std::min(width() - 1 - xCoord, charWidth);
       
       bool bold = item.displayTextBoldRange.ContainsCharacter(c);
@@ -258,7 +433,7 @@ void SearchListWidget::paintEvent(QPaintEvent* event) {
       }
       
       // Draw the character
-      painter.drawText(QRect(xCoord, currentY, visibleWidth, visibleHeight), Qt::AlignLeft | Qt::AlignTop | Qt::TextSingleLine, item.displayText.at(c));
+      painter.drawText(QRect(xCoord, currentY, visibleWidth, visibleHeight), Qt::AlignLeft | Qt::AlignTop | Qt::TextSingleLine, displayText.at(c));
       xCoord += charWidth;
     }
     
@@ -352,6 +527,6 @@ void SearchListWidget::ExtendItemSort(int itemIndex) {
   // Note: we arbitrarily add maxNumVisibleItems to itemIndex here such that we
   // won't need to sort again until this new index is reached.
   int newNumSortedItems = std::min<std::size_t>(itemIndex + maxNumVisibleItems, numShownItems);
-  std::partial_sort(mSortOrder.begin() + numSortedItems, mSortOrder.begin() + newNumSortedItems, mSortOrder.end(), SearchBarItemSorter(mItems.data()));
+  std::partial_sort(mSortOrder.begin() + numSortedItems, mSortOrder.begin() + newNumSortedItems, mSortOrder.begin() + numShownItems, SearchBarItemSorter(mItems->data(), mMatchScores.data()));
   numSortedItems = newNumSortedItems;
 }
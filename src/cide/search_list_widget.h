@@ -4,11 +4,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include <QScrollBar>
 #include <QWidget>
 
 #include "cide/document_location.h"
 #include "cide/document_range.h"
+#include "cide/qt_thread.h"
 #include "cide/text_utils.h"
 
 class SearchBar;
@@ -29,13 +35,17 @@ struct SearchListItem {
   inline SearchListItem(Type type, const QString& displayText, const QString& filterText)
       : type(type),
         displayText(displayText),
-        filterText(filterText),
-        matchScore(FuzzyTextMatchScore(0, 0, true, 0)) {}
+        filterText(filterText) {}
   
   /// Type of this item.
   Type type;
   
-  /// Text displayed in the list widget
+  /// Returns the text displayed in the list widget. For items of type
+  /// GlobalSymbol, this is created from the symbol attributes on each call,
+  /// since there may be millions of these items while only few are displayed.
+  QString GetDisplayText() const;
+  
+  /// Text displayed in the list widget. Use GetDisplayText() to access it.
   QString displayText;
   
   /// Range of text within displayText that should be displayed in bold
@@ -44,11 +54,20 @@ struct SearchListItem {
   /// If not empty, text that the user input is matched to
   QString filterText;
   
+  /// The result of FoldCaseForFuzzyTextMatch() for filterText. This must be
+  /// set by the creator of the item, since the items are immutable once they
+  /// are passed to SearchListWidget::SetItems().
+  QString foldedFilterText;
+  
   /// For type == LocalContext, the location to jump to on activating the item.
   DocumentLocation jumpLocation;
   
-  /// Match score between this item and the text input by the user.
-  FuzzyTextMatchScore matchScore;
+  /// For type == GlobalSymbol, the spelling of the symbol and its location
+  /// (with 1-based line and column).
+  QString symbolSpelling;
+  QString symbolPath;
+  int symbolLine = 0;
+  int symbolColumn = 0;
 };
 
 class SearchListWidget : public QWidget {
@@ -60,11 +79,16 @@ class SearchListWidget : public QWidget {
   /// Destructor.
   ~SearchListWidget();
   
-  /// Sets the list of items displayed in the widget.
-  void SetItems(const std::vector<SearchListItem>&& items);
+  /// Sets the list of items displayed in the widget. The items are not copied
+  /// or modified, so the same item list may be kept by the caller and passed
+  /// to this function again.
+  void SetItems(const std::shared_ptr<const std::vector<SearchListItem>>& items);
   
   /// Updates the filter text (i.e., the text typed by the user) with which the
-  /// items are filtered.
+  /// items are filtered. If the new filter text extends the previous one, only
+  /// the items that were shown before are scored again. For large item counts,
+  /// the items are scored in background threads, and the widget keeps showing
+  /// the previous results until the new ones are available.
   void SetFilterText(const QString& text);
   
   /// (Re)computes the widget size and position. Only needs to be called after
@@ -75,7 +99,7 @@ class SearchListWidget : public QWidget {
   void Accept();
   
   /// Returns whether this widget contains at least one item that can possibly be shown.
-  inline bool HasItems() const { return !mItems.empty(); }
+  inline bool HasItems() const { return !mItems->empty(); }
   
  protected:
   void paintEvent(QPaintEvent* event) override;
@@ -90,6 +114,22 @@ class SearchListWidget : public QWidget {
  private:
   void EnsureSelectionIsVisible();
   
+  /// Returns the number of items at the start of mSortOrder that need to be
+  /// scored for the given filter texts.
+  int GetNumCandidateItems(const QString& defaultFilterText, const QString& filepathFilterText) const;
+  
+  /// Scores and sorts the items for the given filter texts in the Qt thread.
+  void ApplyFilterText(const QString& defaultFilterText, const QString& filepathFilterText);
+  
+  /// Stores the filter texts that the items have been scored for, resets the
+  /// selection, and updates the widget.
+  void FilterTextChanged(const QString& defaultFilterText, const QString& filepathFilterText);
+  
+  /// Cancels the running scoring job (if any) and waits for it to exit.
+  void StopScoringJob();
+  
+  void ScoringThreadMain(QString defaultFilterText, QString filepathFilterText, std::vector<int> candidates);
+  
   /// Extends the sorting of items to at least the given index.
   void ExtendItemSort(int itemIndex);
   
@@ -100,8 +140,11 @@ class SearchListWidget : public QWidget {
   QString filterTextFilepath;
   
   /// Stores all search list items (in arbitrary order). The first displayed
-  /// item is mItems[mSortOrder[0]].
-  std::vector<SearchListItem> mItems;
+  /// item is (*mItems)[mSortOrder[0]].
+  std::shared_ptr<const std::vector<SearchListItem>> mItems;
+  
+  /// Match score between each item in mItems and the text input by the user.
+  std::vector<FuzzyTextMatchScore> mMatchScores;
   
   /// The order of items in this vector determines the order in which items are
   /// displayed. Indexes into mItems.
@@ -116,7 +159,8 @@ class SearchListWidget : public QWidget {
   /// index gets into the view, the sorting must be extended first.
   int numSortedItems;
   
-  /// Number of shown items. Any possible additional items are hidden.
+  /// Number of shown items, which are at the start of mSortOrder. Any possible
+  /// additional items are hidden.
   int numShownItems = 0;
   
   
@@ -132,6 +176,19 @@ class SearchListWidget : public QWidget {
   /// Search bar which this list belongs to.
   SearchBar* searchBarWidget;
   
+  // Background scoring job
+  std::shared_ptr<std::thread> scoringThread;
+  std::atomic<bool> scoringCanceled;
+  RunInQtThreadAbortData scoringAbortData;
+  
+  /// Whether a job is scoring the items for pendingFilterText and
+  /// pendingFilterTextFilepath.
+  bool filterPending = false;
+  
+  /// The filter texts that are being scored in the background.
+  QString pendingFilterText;
+  QString pendingFilterTextFilepath;
+  
   
   int lineHeight;
   int charWidth;
@@ -28,6 +28,8 @@
 #include <QStackedLayout>
 #include <QTableWidget>
 
+#include "cide/clang_tu_pool.h"
+#include "cide/document.h"
 #include "cide/text_utils.h"
 #include "cide/util.h"
 #include "cide/qt_help.h"
@@ -130,6 +132,7 @@ void Settings::SetConfigurableColor(Color id, QRgb value) {
   
   color.value = value;
   QSettings().setValue(color.keyName, ToHexColorString(value));
+  UpdateStyleSnapshot();
 }
 
 void Settings::AddConfigurableTextStyle(TextStyle id, const QString& name, const char* configurationKeyName, bool affectsText, const QRgb& textColor, bool bold, bool affectsBackground, const QRgb& backgroundColor) {
@@ -176,6 +179,19 @@ void Settings::SetConfigurableTextStyle(TextStyle id, bool affectsText, const QR
   
   style.backgroundColor = backgroundColor;
   settings.setValue(style.keyName + QStringLiteral("/background_color"), ToHexColorString(backgroundColor));
+  UpdateStyleSnapshot();
+}
+
+void Settings::UpdateStyleSnapshot() {
+  std::shared_ptr<StyleSnapshot> snapshot(new StyleSnapshot());
+  std::shared_ptr<const StyleSnapshot> oldSnapshot = std::atomic_load(&styleSnapshot);
+  snapshot->version = oldSnapshot ? (oldSnapshot->version + 1) : 0;
+  snapshot->colors.resize(configuredColors.size());
+  for (int i = 0, size = configuredColors.size(); i < size; ++ i) {
+    snapshot->colors[i] = configuredColors[i].value;
+  }
+  snapshot->textStyles = configuredTextStyles;
+  std::atomic_store(&styleSnapshot, std::shared_ptr<const StyleSnapshot>(snapshot));
 }
 
 void Settings::LoadLocalVariableColorPool() {
@@ -267,8 +283,12 @@ Settings::Settings() {
   // Load the local-variable color pool
   LoadLocalVariableColorPool();
   
+  // Apply the performance profile
+  SetCurrentPerformanceProfile(GetPerformanceProfile());
+  
   // Set up the list of actions for which custom shortcuts can be configured
   AddConfigurableShortcut(tr("Build current target"), buildCurrentTargetShortcut, QKeySequence(Qt::Key_F7));
+  AddConfigurableShortcut(tr("Compile current file"), compileCurrentFileShortcut, QKeySequence(Qt::CTRL + Qt::Key_F7));
   AddConfigurableShortcut(tr("Start debugging"), startDebuggingShortcut, QKeySequence(Qt::Key_F9));
   AddConfigurableShortcut(tr("Search bar: Search in files"), searchInFilesShortcut, QKeySequence(Qt::Key_F4));
   AddConfigurableShortcut(tr("Search bar: Search local contexts"), searchLocalContextsShortcut, QKeySequence(Qt::Key_F5));
@@ -281,6 +301,7 @@ Settings::Settings() {
   AddConfigurableShortcut(tr("Open file"), openFileShortcut, QKeySequence::Open);
   AddConfigurableShortcut(tr("Save file"), saveFileShortcut, QKeySequence::Save);
   AddConfigurableShortcut(tr("Save file as..."), saveAsFileShortcut, QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_S));
+  AddConfigurableShortcut(tr("Save all files"), saveAllFilesShortcut, QKeySequence());
   AddConfigurableShortcut(tr("Close file"), closeFileShortcut, QKeySequence::Close);
   AddConfigurableShortcut(tr("Quit program"), quitShortcut, QKeySequence::Quit);
   AddConfigurableShortcut(tr("Find and replace in files"), findAndReplaceInFilesShortcut, QKeySequence(Qt::CTRL + Qt::ALT + Qt::Key_F));
@@ -322,6 +343,7 @@ Settings::Settings() {
   AddConfigurableColor(Color::GitDiffAdded, tr("Git diff: Added lines marker"), "git_diff_add", qRgb(0, 255, 0));
   AddConfigurableColor(Color::GitDiffModified, tr("Git diff: Modified lines marker"), "git_diff_modified", qRgb(255, 255, 0));
   AddConfigurableColor(Color::GitDiffRemoved, tr("Git diff: Removed lines marker"), "git_diff_removed", qRgb(255, 0, 0));
+  AddConfigurableColor(Color::GitBlameText, tr("Git blame: Gutter text"), "git_blame_text", qRgb(128, 128, 128));
   
   // Set up the list of text styles which can be configured
   configuredTextStyles.resize(static_cast<int>(TextStyle::NumTextStyles));
@@ -372,6 +394,8 @@ Settings::Settings() {
   AddConfigurableTextStyle(TextStyle::ProjectTreeViewOpenedItem, tr("Project tree view: Opened item"), "project_tree_view_opened_item", false, qRgb(0, 0, 0), false, true, qRgb(237, 233, 215));
   AddConfigurableTextStyle(TextStyle::ProjectTreeViewModifiedItem, tr("Project tree view: Modified item"), "project_tree_view_modified_item", true, qRgb(255, 100, 0), false, false, qRgb(255, 255, 255));
   AddConfigurableTextStyle(TextStyle::ProjectTreeViewUntrackedItem, tr("Project tree view: Untracked item"), "project_tree_view_untracked_item", true, qRgb(100, 100, 255), false, false, qRgb(255, 255, 255));
+  
+  UpdateStyleSnapshot();
 }
 
 void Settings::ShowSettingsWindow(QWidget* parent) {
@@ -505,11 +529,15 @@ QWidget* SettingsDialog::CreateGeneralCategory() {
   columnMarkerLayout->addWidget(showColumnMarkerCheck);
   columnMarkerLayout->addWidget(columnMarkerEdit);
   
+  showGitBlameCheck = new QCheckBox(tr("Show git blame next to the lines"));
+  showGitBlameCheck->setChecked(Settings::Instance().GetShowGitBlame());
+  
   QVBoxLayout* layout = new QVBoxLayout();
   layout->addLayout(fontSizeLayout);
   layout->addLayout(headerSourceOrderingLayout);
   layout->addLayout(codeCompletionConfirmationLayout);
   layout->addLayout(columnMarkerLayout);
+  layout->addWidget(showGitBlameCheck);
   layout->addStretch(1);
   
   // --- Connections ---
@@ -531,6 +559,9 @@ QWidget* SettingsDialog::CreateGeneralCategory() {
   connect(columnMarkerEdit, &QLineEdit::textChanged, [&](const QString& text) {
     Settings::Instance().SetColumnMarkerPosition(text.toInt());
   });
+  connect(showGitBlameCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetShowGitBlame(state == Qt::Checked);
+  });
   
   QWidget* categoryWidget = new QWidget();
   categoryWidget->setLayout(layout);
@@ -683,6 +714,79 @@ QWidget* SettingsDialog::CreateCodeParsingCategory() {
   defaultCompilerLayout->addWidget(defaultCompilerChoosePathButton);
   
   layout->addLayout(defaultCompilerLayout);
+  
+  QLabel* performanceProfileLabel = new QLabel(tr("Background work profile (the number of threads and TUs per document take effect after a restart): "));
+  QComboBox* performanceProfileCombo = new QComboBox();
+  performanceProfileCombo->addItem(tr("Performance"), QVariant(static_cast<int>(PerformanceProfile::Performance)));
+  performanceProfileCombo->addItem(tr("Balanced"), QVariant(static_cast<int>(PerformanceProfile::Balanced)));
+  performanceProfileCombo->addItem(tr("Battery"), QVariant(static_cast<int>(PerformanceProfile::Battery)));
+  performanceProfileCombo->setCurrentIndex(performanceProfileCombo->findData(QVariant(static_cast<int>(Settings::Instance().GetPerformanceProfile()))));
+  QHBoxLayout* performanceProfileLayout = new QHBoxLayout();
+  performanceProfileLayout->addWidget(performanceProfileLabel);
+  performanceProfileLayout->addWidget(performanceProfileCombo);
+  
+  layout->addLayout(performanceProfileLayout);
+  
+  QLabel* parseThreadCountLabel = new QLabel(tr("Number of parse threads (0 meaning one per CPU core, changes take effect after a restart): "));
+  QLineEdit* parseThreadCountEdit = new QLineEdit(QString::number(Settings::Instance().GetParseThreadCount()));
+  parseThreadCountEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), parseThreadCountEdit));
+  QHBoxLayout* parseThreadCountLayout = new QHBoxLayout();
+  parseThreadCountLayout->addWidget(parseThreadCountLabel);
+  parseThreadCountLayout->addWidget(parseThreadCountEdit);
+  
+  layout->addLayout(parseThreadCountLayout);
+  
+  QLabel* TUMemoryBudgetLabel = new QLabel(tr("Memory budget for the parsed translation units of open documents in MiB (0 meaning no limit): "));
+  QLineEdit* TUMemoryBudgetEdit = new QLineEdit(QString::number(Settings::Instance().GetTUMemoryBudgetMB()));
+  TUMemoryBudgetEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), TUMemoryBudgetEdit));
+  QHBoxLayout* TUMemoryBudgetLayout = new QHBoxLayout();
+  TUMemoryBudgetLayout->addWidget(TUMemoryBudgetLabel);
+  TUMemoryBudgetLayout->addWidget(TUMemoryBudgetEdit);
+  
+  layout->addLayout(TUMemoryBudgetLayout);
+  
+  QLabel* undoHistoryMemoryLimitLabel = new QLabel(tr("Memory limit for the undo history of each document in MiB (0 meaning no limit): "));
+  QLineEdit* undoHistoryMemoryLimitEdit = new QLineEdit(QString::number(Settings::Instance().GetUndoHistoryMemoryLimitMB()));
+  undoHistoryMemoryLimitEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), undoHistoryMemoryLimitEdit));
+  QHBoxLayout* undoHistoryMemoryLimitLayout = new QHBoxLayout();
+  undoHistoryMemoryLimitLayout->addWidget(undoHistoryMemoryLimitLabel);
+  undoHistoryMemoryLimitLayout->addWidget(undoHistoryMemoryLimitEdit);
+  
+  layout->addLayout(undoHistoryMemoryLimitLayout);
+  
+  QLabel* largeFileLineThresholdLabel = new QLabel(tr("Number of lines from which on files are opened in large-file mode, without parsing (0 meaning no limit): "));
+  QLineEdit* largeFileLineThresholdEdit = new QLineEdit(QString::number(Settings::Instance().GetLargeFileLineThreshold()));
+  largeFileLineThresholdEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), largeFileLineThresholdEdit));
+  QHBoxLayout* largeFileLineThresholdLayout = new QHBoxLayout();
+  largeFileLineThresholdLayout->addWidget(largeFileLineThresholdLabel);
+  largeFileLineThresholdLayout->addWidget(largeFileLineThresholdEdit);
+  
+  layout->addLayout(largeFileLineThresholdLayout);
+  
+  QLabel* largeFileSizeThresholdLabel = new QLabel(tr("File size in MiB from which on files are opened in large-file mode (0 meaning no limit): "));
+  QLineEdit* largeFileSizeThresholdEdit = new QLineEdit(QString::number(Settings::Instance().GetLargeFileSizeThresholdMB()));
+  largeFileSizeThresholdEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), largeFileSizeThresholdEdit));
+  QHBoxLayout* largeFileSizeThresholdLayout = new QHBoxLayout();
+  largeFileSizeThresholdLayout->addWidget(largeFileSizeThresholdLabel);
+  largeFileSizeThresholdLayout->addWidget(largeFileSizeThresholdEdit);
+  
+  layout->addLayout(largeFileSizeThresholdLayout);
+  
+  QCheckBox* indexInWorkerProcessesCheck = new QCheckBox(tr("Index files that are not open in separate processes (isolates libclang crashes and releases its memory)"));
+  indexInWorkerProcessesCheck->setChecked(Settings::Instance().GetIndexInWorkerProcesses());
+  layout->addWidget(indexInWorkerProcessesCheck);
+  
+  QCheckBox* indexInSharedServiceCheck = new QCheckBox(tr("Index files that are not open in a background service that is shared by all CIDE instances"));
+  indexInSharedServiceCheck->setChecked(Settings::Instance().GetIndexInSharedService());
+  layout->addWidget(indexInSharedServiceCheck);
+  
+  QCheckBox* useTUCacheCheck = new QCheckBox(tr("Keep the parsed translation units of closed documents on disk for faster reopening"));
+  useTUCacheCheck->setChecked(Settings::Instance().GetUseTUCache());
+  layout->addWidget(useTUCacheCheck);
+  
+  QCheckBox* useHighlightCacheCheck = new QCheckBox(tr("Keep the highlighting and problems of closed documents on disk to show them right away on reopening"));
+  useHighlightCacheCheck->setChecked(Settings::Instance().GetUseHighlightCache());
+  layout->addWidget(useHighlightCacheCheck);
   layout->addStretch(1);
   
   // --- Connections ---
@@ -702,6 +806,56 @@ QWidget* SettingsDialog::CreateCodeParsingCategory() {
     Settings::Instance().SetDefaultCompiler(path);
   });
   
+  connect(performanceProfileCombo, QOverload<int>::of(&QComboBox::currentIndexChanged), [performanceProfileCombo, TUMemoryBudgetEdit](int index) {
+    Settings::Instance().SetPerformanceProfile(static_cast<PerformanceProfile>(performanceProfileCombo->itemData(index).toInt()));
+    
+    // Unless the TU memory budget is configured explicitly, it follows the
+    // profile. Update the edit without storing the value as configured.
+    int budgetMB = Settings::Instance().GetTUMemoryBudgetMB();
+    ClangTUPoolManager::Instance().SetMemoryBudget(static_cast<std::size_t>(budgetMB) * 1024 * 1024);
+    TUMemoryBudgetEdit->blockSignals(true);
+    TUMemoryBudgetEdit->setText(QString::number(budgetMB));
+    TUMemoryBudgetEdit->blockSignals(false);
+  });
+  
+  connect(parseThreadCountEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetParseThreadCount(text.toInt());
+  });
+  
+  connect(TUMemoryBudgetEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetTUMemoryBudgetMB(text.toInt());
+    ClangTUPoolManager::Instance().SetMemoryBudget(static_cast<std::size_t>(text.toInt()) * 1024 * 1024);
+  });
+  
+  connect(undoHistoryMemoryLimitEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetUndoHistoryMemoryLimitMB(text.toInt());
+    Document::SetUndoHistoryMemoryLimit(static_cast<std::size_t>(text.toInt()) * 1024 * 1024);
+  });
+  
+  connect(largeFileLineThresholdEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetLargeFileLineThreshold(text.toInt());
+  });
+  
+  connect(largeFileSizeThresholdEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetLargeFileSizeThresholdMB(text.toInt());
+  });
+  
+  connect(indexInWorkerProcessesCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetIndexInWorkerProcesses(state == Qt::Checked);
+  });
+  
+  connect(indexInSharedServiceCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetIndexInSharedService(state == Qt::Checked);
+  });
+  
+  connect(useTUCacheCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetUseTUCache(state == Qt::Checked);
+  });
+  
+  connect(useHighlightCacheCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetUseHighlightCache(state == Qt::Checked);
+  });
+  
   QWidget* categoryWidget = new QWidget();
   categoryWidget->setLayout(layout);
   return categoryWidget;
@@ -720,6 +874,13 @@ QWidget* SettingsDialog::CreateCodeHighlightingCategory() {
   QCheckBox* darkenNonContextRegionsCheck = new QCheckBox(tr("Darken empty lines outside of functions, classes, and similar contexts"));
   darkenNonContextRegionsCheck->setChecked(Settings::Instance().GetDarkenNonContextRegions());
   
+  QLabel* maxPhraseHighlightCountLabel = new QLabel(tr("Maximum number of highlighted occurrences of the selected word (0 meaning no limit): "));
+  QLineEdit* maxPhraseHighlightCountEdit = new QLineEdit(QString::number(Settings::Instance().GetMaxPhraseHighlightCount()));
+  maxPhraseHighlightCountEdit->setValidator(new QIntValidator(0, std::numeric_limits<int>::max(), maxPhraseHighlightCountEdit));
+  QHBoxLayout* maxPhraseHighlightCountLayout = new QHBoxLayout();
+  maxPhraseHighlightCountLayout->addWidget(maxPhraseHighlightCountLabel);
+  maxPhraseHighlightCountLayout->addWidget(maxPhraseHighlightCountEdit);
+  
   commentMarkerList = new QListWidget();
   QPushButton* addCommentMarkerButton = new QPushButton(tr("+"));
   removeCommentMarkerButton = new QPushButton(tr("-"));
@@ -742,6 +903,7 @@ QWidget* SettingsDialog::CreateCodeHighlightingCategory() {
   layout->addWidget(highlightCurrentLineCheck);
   layout->addWidget(highlightTrailingSpacesCheck);
   layout->addWidget(darkenNonContextRegionsCheck);
+  layout->addLayout(maxPhraseHighlightCountLayout);
   layout->addLayout(commentMarkerLayout);
   layout->addStretch(1);
   
@@ -750,6 +912,9 @@ QWidget* SettingsDialog::CreateCodeHighlightingCategory() {
   connect(highlightCurrentLineCheck, &QCheckBox::stateChanged, &Settings::Instance(), &Settings::SetHighlightCurrentLine);
   connect(highlightTrailingSpacesCheck, &QCheckBox::stateChanged, &Settings::Instance(), &Settings::SetHighlightTrailingSpaces);
   connect(darkenNonContextRegionsCheck, &QCheckBox::stateChanged, &Settings::Instance(), &Settings::SetDarkenNonContextRegions);
+  connect(maxPhraseHighlightCountEdit, &QLineEdit::textChanged, [&](const QString& text) {
+    Settings::Instance().SetMaxPhraseHighlightCount(text.toInt());
+  });
   connect(commentMarkerList, &QListWidget::currentRowChanged, [&](int row) {
     removeCommentMarkerButton->setEnabled(row >= 0);
   });
@@ -1150,14 +1315,21 @@ QWidget* SettingsDialog::CreateDebuggingCategory() {
   gdbBinaryLayout->addWidget(gdbBinaryLabel);
   gdbBinaryLayout->addWidget(gdbBinaryEdit);
   
+  QCheckBox* logOutputCheck = new QCheckBox(tr("Log all debugger output to the console (slow for large outputs)"));
+  logOutputCheck->setChecked(Settings::Instance().GetLogDebuggerOutput());
+  
   QVBoxLayout* layout = new QVBoxLayout();
   layout->addLayout(gdbBinaryLayout);
+  layout->addWidget(logOutputCheck);
   layout->addStretch(1);
   
   // --- Connections ---
   connect(gdbBinaryEdit, &QLineEdit::textEdited, [&](const QString& text) {
     Settings::Instance().SetGDBPath(text);
   });
+  connect(logOutputCheck, &QCheckBox::stateChanged, [&](int state) {
+    Settings::Instance().SetLogDebuggerOutput(state == Qt::Checked);
+  });
   
   QWidget* categoryWidget = new QWidget();
   categoryWidget->setLayout(layout);
@@ -14,6 +14,7 @@
 #include <QSettings>
 #include <QTableWidget>
 
+#include "cide/performance_profile.h"
 #include "cide/util.h"
 
 class ActionWithConfigurableShortcut;
@@ -54,6 +55,7 @@ struct WordCompletion {
 
 // List of configuration key names for configurable shortcuts
 constexpr const char* buildCurrentTargetShortcut = "build_current_target";
+constexpr const char* compileCurrentFileShortcut = "compile_current_file";
 constexpr const char* startDebuggingShortcut = "start_debugging";
 constexpr const char* searchInFilesShortcut = "search_in_files";
 constexpr const char* searchLocalContextsShortcut = "search_local_contexts";
@@ -66,6 +68,7 @@ constexpr const char* newFileShortcut = "new_file";
 constexpr const char* openFileShortcut = "open_file";
 constexpr const char* saveFileShortcut = "save_file";
 constexpr const char* saveAsFileShortcut = "save_file_as";
+constexpr const char* saveAllFilesShortcut = "save_all_files";
 constexpr const char* closeFileShortcut = "close_file";
 constexpr const char* quitShortcut = "quit_program";
 constexpr const char* findAndReplaceInFilesShortcut = "find_and_replace_in_files";
@@ -118,6 +121,7 @@ class Settings : public QObject {
     GitDiffAdded,
     GitDiffModified,
     GitDiffRemoved,
+    GitBlameText,
     NumColors
   };
   
@@ -221,6 +225,25 @@ class Settings : public QObject {
     QRgb backgroundColor;
   };
   
+  /// Immutable copy of all configured colors and text styles. Code that looks
+  /// up many styles (for example, per token or per painted frame) should get
+  /// the current snapshot once with GetStyleSnapshot() and use it for the
+  /// whole pass. Snapshots may be used from any thread, and remain valid (but
+  /// outdated) if the settings change in the meantime.
+  struct StyleSnapshot {
+    inline QRgb GetColor(Color id) const { return colors[static_cast<int>(id)]; }
+    inline const ConfigurableTextStyle& GetTextStyle(TextStyle id) const { return textStyles[static_cast<int>(id)]; }
+    
+    /// Increases each time that a color or text style is changed.
+    int version;
+    
+    /// Indexed by static_cast<int>(color_id) with color_id of type Color.
+    std::vector<QRgb> colors;
+    
+    /// Indexed by static_cast<int>(textstyle_id) with textstyle_id of type TextStyle.
+    std::vector<ConfigurableTextStyle> textStyles;
+  };
+  
   
   static Settings& Instance();
   
@@ -243,6 +266,10 @@ class Settings : public QObject {
   inline const ConfigurableTextStyle& GetConfiguredTextStyle(TextStyle id) const { return configuredTextStyles[static_cast<int>(id)]; }
   void SetConfigurableTextStyle(TextStyle id, bool affectsText, const QRgb& textColor, bool bold, bool affectsBackground, const QRgb& backgroundColor);
   
+  /// Returns the current snapshot of the configured colors and text styles.
+  /// This function is thread-safe.
+  inline std::shared_ptr<const StyleSnapshot> GetStyleSnapshot() const { return std::atomic_load(&styleSnapshot); }
+  
   void LoadLocalVariableColorPool();
   void SaveLocalVariableColorPool();
   inline int GetLocalVariableColorPoolSize() const { return localVariableColorPool.size(); }
@@ -280,6 +307,78 @@ class Settings : public QObject {
     return QSettings().value("gdb_path", "gdb").toString();
   }
   
+  /// Returns whether all output of the debugger is logged to the console
+  /// (for debugging the debugger integration).
+  inline bool GetLogDebuggerOutput() const {
+    return QSettings().value("log_debugger_output", false).toBool();
+  }
+  
+  /// Returns the profile that configures the amount of background work (see
+  /// PerformanceProfile).
+  inline PerformanceProfile GetPerformanceProfile() const {
+    int profile = QSettings().value("performance_profile", static_cast<int>(PerformanceProfile::Balanced)).toInt();
+    if (profile < 0 || profile >= static_cast<int>(PerformanceProfile::NumProfiles)) {
+      return PerformanceProfile::Balanced;
+    }
+    return static_cast<PerformanceProfile>(profile);
+  }
+  
+  /// Returns the configured number of threads for parsing and indexing. Zero
+  /// means that the number is determined automatically (depending on the
+  /// PerformanceProfile).
+  inline int GetParseThreadCount() const {
+    return QSettings().value("parse_thread_count", 0).toInt();
+  }
+  
+  /// Returns the configured memory budget for the libclang TUs of all open
+  /// documents in MiB. Zero means that there is no limit. If the budget is
+  /// not configured, it is determined by the PerformanceProfile.
+  inline int GetTUMemoryBudgetMB() const {
+    return QSettings().value("tu_memory_budget_mb", GetPerformanceProfileParameters().TUMemoryBudgetMB).toInt();
+  }
+  
+  /// Returns the configured memory limit for the undo history of each
+  /// document in MiB. Zero means that there is no limit.
+  inline int GetUndoHistoryMemoryLimitMB() const {
+    return QSettings().value("undo_history_memory_limit_mb", 256).toInt();
+  }
+  
+  /// Returns the number of lines, respectively the size in MiB, from which on
+  /// documents are opened in large-file mode (see
+  /// DocumentWidget::IsLargeFileMode()). Zero disables the threshold.
+  inline int GetLargeFileLineThreshold() const {
+    return QSettings().value("large_file_line_threshold", 200000).toInt();
+  }
+  
+  inline int GetLargeFileSizeThresholdMB() const {
+    return QSettings().value("large_file_size_threshold_mb", 16).toInt();
+  }
+  
+  /// Returns whether files that are not open are indexed in worker processes
+  /// (see IndexFileInWorkerProcess()).
+  inline bool GetIndexInWorkerProcesses() const {
+    return QSettings().value("index_in_worker_processes", false).toBool();
+  }
+  
+  /// Returns whether files that are not open are indexed in the index service
+  /// that is shared by all CIDE instances of the user (see
+  /// IndexFileInIndexService()).
+  inline bool GetIndexInSharedService() const {
+    return QSettings().value("index_in_shared_service", false).toBool();
+  }
+  
+  /// Returns whether the TUs of closed documents are kept on disk (see
+  /// TUCache).
+  inline bool GetUseTUCache() const {
+    return QSettings().value("use_tu_cache", true).toBool();
+  }
+  
+  /// Returns whether the highlighting, contexts, and problems of closed
+  /// documents are kept on disk (see HighlightCache).
+  inline bool GetUseHighlightCache() const {
+    return QSettings().value("use_highlight_cache", true).toBool();
+  }
+  
   inline bool GetUsePerVariableColoring() {
     return QSettings().value("per_variable_coloring", true).toBool();
   }
@@ -296,6 +395,13 @@ class Settings : public QObject {
     return QSettings().value("darken_non_context_regions", true).toBool();
   }
   
+  /// Returns the maximum number of occurrences of the selected word or phrase
+  /// that get highlighted. Occurrences close to the visible part of the
+  /// document are preferred.
+  inline int GetMaxPhraseHighlightCount() {
+    return QSettings().value("max_phrase_highlight_count", 2000).toInt();
+  }
+  
   inline bool GetSourceLeftOfHeaderOrdering() {
     return QSettings().value("source_left_of_header", true).toBool();
   }
@@ -308,6 +414,12 @@ class Settings : public QObject {
     return QSettings().value("column_marker_position", 80).toInt();
   }
   
+  /// Returns whether the commit that last changed each line (as determined
+  /// by git blame) is shown in a gutter left of the document text.
+  inline bool GetShowGitBlame() {
+    return QSettings().value("show_git_blame", false).toBool();
+  }
+  
   inline QStringList GetCommentMarkers() {
     static QStringList defaultCommentMarkers = {"TODO", "FIXME", "TEST", "HACK", "END"};
     return QSettings().value("comment_markers", defaultCommentMarkers).toStringList();
@@ -384,6 +496,51 @@ class Settings : public QObject {
     QSettings().setValue("gdb_path", path);
   }
   
+  inline void SetLogDebuggerOutput(bool enable) const {
+    QSettings().setValue("log_debugger_output", enable);
+  }
+  
+  inline void SetParseThreadCount(int count) const {
+    QSettings().setValue("parse_thread_count", count);
+  }
+  
+  inline void SetPerformanceProfile(PerformanceProfile profile) const {
+    QSettings().setValue("performance_profile", static_cast<int>(profile));
+    SetCurrentPerformanceProfile(profile);
+  }
+  
+  inline void SetTUMemoryBudgetMB(int megabytes) const {
+    QSettings().setValue("tu_memory_budget_mb", megabytes);
+  }
+  
+  inline void SetUndoHistoryMemoryLimitMB(int megabytes) const {
+    QSettings().setValue("undo_history_memory_limit_mb", megabytes);
+  }
+  
+  inline void SetLargeFileLineThreshold(int lines) const {
+    QSettings().setValue("large_file_line_threshold", lines);
+  }
+  
+  inline void SetLargeFileSizeThresholdMB(int megabytes) const {
+    QSettings().setValue("large_file_size_threshold_mb", megabytes);
+  }
+  
+  inline void SetIndexInWorkerProcesses(bool enable) const {
+    QSettings().setValue("index_in_worker_processes", enable);
+  }
+  
+  inline void SetIndexInSharedService(bool enable) const {
+    QSettings().setValue("index_in_shared_service", enable);
+  }
+  
+  inline void SetUseTUCache(bool enable) const {
+    QSettings().setValue("use_tu_cache", enable);
+  }
+  
+  inline void SetUseHighlightCache(bool enable) const {
+    QSettings().setValue("use_highlight_cache", enable);
+  }
+  
   inline void SetUsePerVariableColoring(bool enable) {
     QSettings().setValue("per_variable_coloring", enable);
   }
@@ -400,6 +557,10 @@ class Settings : public QObject {
     QSettings().setValue("darken_non_context_regions", enable);
   }
   
+  inline void SetMaxPhraseHighlightCount(int count) {
+    QSettings().setValue("max_phrase_highlight_count", count);
+  }
+  
   inline void SetSourceLeftOfHeaderOrdering(bool enable) {
     QSettings().setValue("source_left_of_header", enable);
   }
@@ -412,6 +573,10 @@ class Settings : public QObject {
     QSettings().setValue("column_marker_position", position);
   }
   
+  inline void SetShowGitBlame(bool enable) {
+    QSettings().setValue("show_git_blame", enable);
+  }
+  
   inline void SetCommentMarkers(const QStringList& markers) {
     QSettings().setValue("comment_markers", markers);
   }
@@ -444,6 +609,9 @@ class Settings : public QObject {
  private:
   Settings();
   
+  /// Publishes a new StyleSnapshot with the current colors and text styles.
+  void UpdateStyleSnapshot();
+  
   QFont defaultFont;
   QFont boldFont;
   
@@ -459,6 +627,11 @@ class Settings : public QObject {
   /// Indexed by static_cast<int>(textstyle_id) with textstyle_id of type TextStyle.
   std::vector<ConfigurableTextStyle> configuredTextStyles;
   
+  /// Copy of configuredColors and configuredTextStyles that is replaced (and
+  /// never modified) on each change. Accessed with std::atomic_load() and
+  /// std::atomic_store().
+  std::shared_ptr<const StyleSnapshot> styleSnapshot;
+  
   std::vector<QRgb> localVariableColorPool;
 };
 
@@ -490,6 +663,7 @@ class SettingsDialog : public QDialog {
   QComboBox* codeCompletionConfirmationCombo;
   QCheckBox* showColumnMarkerCheck;
   QLineEdit* columnMarkerEdit;
+  QCheckBox* showGitBlameCheck;
   
   // "Auto-completions/corrections" category
   QWidget* CreateAutoCompletionsCorrectionsCategory();
@@ -0,0 +1,323 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <git2.h>
+#include <QApplication>
+#include <QEventLoop>
+#include <QFileInfo>
+
+#include "cide/background_reclaimer.h"
+#include "cide/code_info.h"
+#include "cide/crash_backup.h"
+#include "cide/document.h"
+#include "cide/document_widget.h"
+#include "cide/git_diff.h"
+#include "cide/git_status.h"
+#include "cide/main_window.h"
+#include "cide/parse_thread_pool.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/qt_help.h"
+#include "cide/qt_thread.h"
+#include "cide/tu_cache.h"
+
+// Concurrency soak benchmark for the interplay of editing with parsing, code
+// info requests, git diffs and crash backups. Run as:
+//   CIDESoakBenchmark <project.cide> <seconds> <requestsPerSecond> <file> [<file> ...]
+// The benchmark loads the project, opens the given files and waits for them to
+// be parsed. Then, for the given duration, it performs one tick at the given
+// rate, in which one of the documents is edited (alternately inserting and
+// removing a comment line) and a code completion, hover info or goto request
+// is made in it. Requests are made without waiting for the previous ones, so
+// reparses, TU contention and request discarding happen like during fast
+// typing. At the end, the throughput, the numbers of rejected and dropped
+// requests (see CodeInfo::Statistics), and latency percentiles are printed.
+//
+// The benchmark does not rely on the timing for correctness, so it can also
+// be run in builds with sanitizers (with a lower request rate). The files on
+// disk are not modified.
+
+/// Maximum time that the benchmark waits for a document to get parsed.
+constexpr double kParseTimeoutSeconds = 600;
+
+/// Text that is inserted and removed again by the edits.
+static const QString kInsertedText = QStringLiteral("// soak benchmark edit\n");
+
+/// State of one of the opened documents.
+struct SoakDocument {
+  QString canonicalPath;
+  Document* document = nullptr;
+  DocumentWidget* widget = nullptr;
+  
+  /// Offset of the inserted text, or -1 if it is not inserted at the moment.
+  int insertedOffset = -1;
+};
+
+static double SecondsSince(std::chrono::steady_clock::time_point startTime) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+/// Prints the latency percentiles of the given measurements (in seconds).
+static void PrintLatencies(const char* name, std::vector<double> seconds) {
+  if (seconds.empty()) {
+    std::cout << name << ": no measurements" << std::endl;
+    return;
+  }
+  
+  std::sort(seconds.begin(), seconds.end());
+  auto percentile = [&](double p) {
+    int index = std::max(0, static_cast<int>(std::ceil(p * seconds.size())) - 1);
+    return 1000 * seconds[index];
+  };
+  double sum = 0;
+  for (double value : seconds) {
+    sum += value;
+  }
+  
+  std::cout << name << " [" << seconds.size() << "]: "
+            << "p50 " << percentile(0.5) << " ms, "
+            << "p90 " << percentile(0.9) << " ms, "
+            << "p99 " << percentile(0.99) << " ms, "
+            << "p99.9 " << percentile(0.999) << " ms, "
+            << "max " << (1000 * seconds.back()) << " ms, "
+            << "mean " << (1000 * sum / seconds.size()) << " ms" << std::endl;
+}
+
+/// Waits until the given document has been parsed. Returns false on timeout.
+static bool WaitForParse(Document* document) {
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  while (SecondsSince(startTime) < kParseTimeoutSeconds) {
+    bool parsed = false;
+    RunInQtThreadBlocking([&]() {
+      if (ParseThreadPool::Instance().DoesAParseRequestExistForDocument(document) ||
+          ParseThreadPool::Instance().IsDocumentBeingParsed(document)) {
+        return;
+      }
+      int numParsedTUs = 0;
+      if (ClangTUPool* TUPool = document->GetTUPoolIfAllocated()) {
+        TUPool->GetMemoryUsage(&numParsedTUs);
+      }
+      parsed = numParsedTUs > 0;
+    });
+    if (parsed) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return false;
+}
+
+/// Alternately inserts kInsertedText at the start of a random line of the
+/// document, and removes it again. Must be called in the Qt thread.
+static void EditDocument(SoakDocument* soakDocument, std::mt19937* generator) {
+  DocumentWidget* widget = soakDocument->widget;
+  if (soakDocument->insertedOffset >= 0) {
+    widget->Replace(DocumentRange(soakDocument->insertedOffset, soakDocument->insertedOffset + kInsertedText.size()), QString());
+    soakDocument->insertedOffset = -1;
+  } else {
+    int line = std::uniform_int_distribution<int>(0, std::max(0, soakDocument->document->LineCount() - 1))(*generator);
+    DocumentLocation location = widget->MapLineColToDocumentLocation(line, 0);
+    widget->Replace(DocumentRange(location, location), kInsertedText);
+    soakDocument->insertedOffset = location.offset;
+  }
+}
+
+static int RunBenchmark(const QString& projectPath, double durationSeconds, double requestsPerSecond, const QStringList& filePaths) {
+  // Create a MainWindow in the Qt thread which will also get destructed in the Qt thread again
+  std::shared_ptr<MainWindow> mainWindow;
+  RunInQtThreadBlocking([&]() {
+    mainWindow.reset(new MainWindow(), [&](MainWindow* ptr) {
+      RunInQtThreadBlocking([&]() {
+        delete ptr;
+      });
+    });
+  });
+  
+  // Load the project
+  bool loaded = false;
+  RunInQtThreadBlocking([&]() {
+    loaded = mainWindow->LoadProject(projectPath, nullptr);
+  });
+  if (!loaded) {
+    std::cout << "Failed to load the project: " << projectPath.toStdString() << std::endl;
+    return 1;
+  }
+  
+  // Open the files and parse them
+  std::vector<SoakDocument> documents(filePaths.size());
+  for (int i = 0; i < filePaths.size(); ++ i) {
+    SoakDocument& soakDocument = documents[i];
+    soakDocument.canonicalPath = QFileInfo(filePaths[i]).canonicalFilePath();
+    RunInQtThreadBlocking([&]() {
+      mainWindow->Open(soakDocument.canonicalPath);
+      mainWindow->GetDocumentAndWidgetForPath(soakDocument.canonicalPath, &soakDocument.document, &soakDocument.widget);
+    });
+    if (!soakDocument.document || !WaitForParse(soakDocument.document)) {
+      std::cout << "Failed to open and parse: " << filePaths[i].toStdString() << std::endl;
+      return 1;
+    }
+  }
+  
+  // Collect the request latencies
+  std::mutex latenciesMutex;
+  std::vector<double> completionSeconds;
+  std::vector<double> infoSeconds;
+  std::vector<double> gotoSeconds;
+  CodeInfo::Instance().SetRequestFinishedCallback([&](CodeInfoRequest::Type type, double durationMs) {
+    std::unique_lock<std::mutex> lock(latenciesMutex);
+    if (type == CodeInfoRequest::Type::CodeCompletion) {
+      completionSeconds.push_back(0.001 * durationMs);
+    } else if (type == CodeInfoRequest::Type::Info) {
+      infoSeconds.push_back(0.001 * durationMs);
+    } else if (type == CodeInfoRequest::Type::GotoReferencedCursor) {
+      gotoSeconds.push_back(0.001 * durationMs);
+    }
+  });
+  CodeInfo::Statistics initialStatistics = CodeInfo::Instance().GetStatistics();
+  
+  // Run the ticks
+  std::mt19937 generator(/*seed*/ 0);
+  std::chrono::steady_clock::duration tickInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(1 / requestsPerSecond));
+  std::vector<double> tickSeconds;
+  int numTicks = 0;
+  int numLateTicks = 0;
+  int maxQueuedParseRequests = 0;
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point nextTickTime = startTime;
+  while (SecondsSince(startTime) < durationSeconds) {
+    if (std::chrono::steady_clock::now() > nextTickTime + tickInterval) {
+      // The previous tick took longer than the interval.
+      ++ numLateTicks;
+      nextTickTime = std::chrono::steady_clock::now();
+    } else {
+      std::this_thread::sleep_until(nextTickTime);
+    }
+    nextTickTime += tickInterval;
+    
+    SoakDocument& soakDocument = documents[numTicks % documents.size()];
+    int requestKind = numTicks % 3;
+    ++ numTicks;
+    
+    // The tick's edit and request are made in a single Qt thread call, whose
+    // duration (including waiting for the Qt thread) is measured.
+    std::chrono::steady_clock::time_point tickStartTime = std::chrono::steady_clock::now();
+    RunInQtThreadBlocking([&]() {
+      EditDocument(&soakDocument, &generator);
+      
+      DocumentWidget* widget = soakDocument.widget;
+      int line = std::uniform_int_distribution<int>(0, std::max(0, soakDocument.document->LineCount() - 1))(generator);
+      int column = std::uniform_int_distribution<int>(0, 40)(generator);
+      DocumentLocation location = widget->MapLineColToDocumentLocation(line, column);
+      if (requestKind == 0) {
+        widget->SetCursor(location, false);
+        CodeInfo::Instance().RequestCodeCompletion(widget);
+      } else if (requestKind == 1) {
+        CodeInfo::Instance().RequestCodeInfo(widget, location);
+      } else {
+        CodeInfo::Instance().GotoReferencedCursor(widget, location);
+      }
+      
+      int numForClosedFiles;
+      int numForOpenDocuments;
+      int numForCurrentDocument;
+      ParseThreadPool::Instance().GetNumQueuedRequests(&numForClosedFiles, &numForOpenDocuments, &numForCurrentDocument);
+      maxQueuedParseRequests = std::max(maxQueuedParseRequests, numForOpenDocuments + numForCurrentDocument);
+    });
+    tickSeconds.push_back(SecondsSince(tickStartTime));
+  }
+  double soakSeconds = SecondsSince(startTime);
+  
+  // Let the remaining requests finish and undo the remaining edits
+  CodeInfo::Instance().WaitUntilIdle();
+  CodeInfo::Instance().SetRequestFinishedCallback(nullptr);
+  RunInQtThreadBlocking([&]() {
+    for (SoakDocument& soakDocument : documents) {
+      if (soakDocument.insertedOffset >= 0) {
+        EditDocument(&soakDocument, &generator);
+      }
+      soakDocument.widget->CloseCodeCompletion();
+    }
+  });
+  
+  CodeInfo::Statistics statistics = CodeInfo::Instance().GetStatistics();
+  int numProcessedRequests = statistics.numProcessedRequests - initialStatistics.numProcessedRequests;
+  std::cout << "Ticks: " << numTicks << " in " << soakSeconds << " s (" << (numTicks / soakSeconds) << " ticks/s, "
+            << numLateTicks << " late), each with one edit and one code info request" << std::endl;
+  std::cout << "Processed requests: " << numProcessedRequests << " (" << (numProcessedRequests / soakSeconds) << " requests/s)" << std::endl;
+  std::cout << "Rejected requests: " << (statistics.numRejectedRequests - initialStatistics.numRejectedRequests) << std::endl;
+  std::cout << "Discarded queued requests: " << (statistics.numDiscardedRequests - initialStatistics.numDiscardedRequests) << std::endl;
+  std::cout << "Dropped while waiting for a TU: " << (statistics.numDroppedWhileWaitingForTU - initialStatistics.numDroppedWhileWaitingForTU) << std::endl;
+  std::cout << "Waits for a TU (no free TU in the pool): " << (statistics.numTUWaits - initialStatistics.numTUWaits) << std::endl;
+  std::cout << "Maximum queued parse requests for open documents: " << maxQueuedParseRequests << std::endl;
+  PrintLatencies("Tick in Qt thread", tickSeconds);
+  PrintLatencies("Code completion", completionSeconds);
+  PrintLatencies("Hover info", infoSeconds);
+  PrintLatencies("Goto referenced cursor", gotoSeconds);
+  
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // Initialize libgit2
+  git_libgit2_init();
+  
+  QApplication qapp(argc, argv);
+  QCoreApplication::setOrganizationName("PuzzlePaint");
+  QCoreApplication::setOrganizationDomain("puzzlepaint.net");
+  QCoreApplication::setApplicationName("CIDE");
+  
+  if (argc < 5) {
+    std::cout << "Usage: " << argv[0] << " <project.cide> <seconds> <requestsPerSecond> <file> [<file> ...]" << std::endl;
+    return 1;
+  }
+  QString projectPath = QString::fromLocal8Bit(argv[1]);
+  double durationSeconds = atof(argv[2]);
+  double requestsPerSecond = atof(argv[3]);
+  QStringList filePaths;
+  for (int i = 4; i < argc; ++ i) {
+    filePaths.push_back(QString::fromLocal8Bit(argv[i]));
+  }
+  if (durationSeconds <= 0 || requestsPerSecond <= 0) {
+    std::cout << "The duration and the request rate must be positive." << std::endl;
+    return 1;
+  }
+  
+  // Run the benchmark in a second thread while the main thread runs a Qt event
+  // loop. This allows RunInQtThreadBlocking() to operate correctly.
+  int result;
+  std::atomic<bool> finished;
+  finished = false;
+  
+  std::thread benchmarkThread([&]() {
+    result = RunBenchmark(projectPath, durationSeconds, requestsPerSecond, filePaths);
+    ParseThreadPool::Instance().ExitAllThreads();
+    TUCache::Instance().Exit();
+    CodeInfo::Instance().Exit();
+    CrashBackup::Instance().Exit();
+    GitDiff::Instance().Exit();
+    GitStatus::Instance().Exit();
+    PhraseHighlighter::Instance().Exit();
+    QtHelp::Instance().Exit();
+    BackgroundReclaimer::Instance().Exit();
+    finished = true;
+  });
+  
+  QEventLoop exitEventLoop;
+  while (!finished) {
+    exitEventLoop.processEvents();
+  }
+  benchmarkThread.join();
+  
+  return result;
+}
@@ -0,0 +1,152 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/stall_detector.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <QApplication>
+#include <QDebug>
+#include <QFileInfo>
+#include <QThread>
+#include <QTimer>
+
+/// Interval of the heartbeat timer in the Qt thread.
+constexpr int kHeartbeatIntervalMilliseconds = 100;
+
+/// Interval in which the watchdog thread checks the heartbeat.
+constexpr std::chrono::milliseconds kCheckInterval(100);
+
+/// Maximum number of different marker descriptions that are logged for a
+/// single stall.
+constexpr int kMaxDescriptionsPerStall = 4;
+
+StallDetector& StallDetector::Instance() {
+  static StallDetector instance;
+  return instance;
+}
+
+StallDetector::StallDetector() {
+  markerDepth = 0;
+  lastHeartbeat = NowMilliseconds();
+}
+
+void StallDetector::Start() {
+  lastHeartbeat = NowMilliseconds();
+  
+  QTimer* heartbeatTimer = new QTimer(qApp);
+  QObject::connect(heartbeatTimer, &QTimer::timeout, [this]() {
+    lastHeartbeat = NowMilliseconds();
+  });
+  heartbeatTimer->start(kHeartbeatIntervalMilliseconds);
+  
+  mThread.reset(new std::thread(&StallDetector::ThreadMain, this));
+}
+
+void StallDetector::Exit() {
+  exitMutex.lock();
+  mExit = true;
+  exitMutex.unlock();
+  exitCondition.notify_all();
+  
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void StallDetector::PushMarker(const char* name, const char* file, int line) {
+  int depth = markerDepth;
+  if (depth < kMaxMarkerDepth) {
+    markers[depth].name = name;
+    markers[depth].file = file;
+    markers[depth].line = line;
+  }
+  markerDepth = depth + 1;
+}
+
+void StallDetector::PopMarker() {
+  -- markerDepth;
+}
+
+std::int64_t StallDetector::NowMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+QString StallDetector::DescribeMarkers() {
+  QString result;
+  int depth = std::min<int>(markerDepth, kMaxMarkerDepth);
+  for (int i = 0; i < depth; ++ i) {
+    if (!result.isEmpty()) {
+      result += QStringLiteral(" > ");
+    }
+    result += QString::fromUtf8(markers[i].name);
+    const char* file = markers[i].file;
+    if (file) {
+      result += QStringLiteral(" (%1:%2)").arg(QFileInfo(QString::fromUtf8(file)).fileName()).arg(markers[i].line);
+    }
+  }
+  if (markerDepth > kMaxMarkerDepth) {
+    result += QStringLiteral(" > ...");
+  }
+  return result;
+}
+
+void StallDetector::ThreadMain() {
+  bool inStall = false;
+  std::int64_t stallHeartbeat = 0;
+  std::vector<QString> stallDescriptions;
+  
+  std::unique_lock<std::mutex> lock(exitMutex);
+  while (!mExit) {
+    exitCondition.wait_for(lock, kCheckInterval);
+    if (mExit) {
+      return;
+    }
+    
+    std::int64_t heartbeat = lastHeartbeat;
+    std::int64_t delay = NowMilliseconds() - heartbeat - kHeartbeatIntervalMilliseconds;
+    if (delay > kStallThresholdMilliseconds) {
+      if (!inStall) {
+        inStall = true;
+        stallHeartbeat = heartbeat;
+        stallDescriptions.clear();
+      }
+      
+      // Capture what the Qt thread is doing. This may change during a stall,
+      // for example if a blocking call runs many queued functions.
+      QString description = DescribeMarkers();
+      if (!description.isEmpty() &&
+          stallDescriptions.size() < kMaxDescriptionsPerStall &&
+          std::find(stallDescriptions.begin(), stallDescriptions.end(), description) == stallDescriptions.end()) {
+        stallDescriptions.push_back(description);
+      }
+    } else if (inStall && heartbeat != stallHeartbeat) {
+      inStall = false;
+      std::int64_t durationMs = heartbeat - stallHeartbeat - kHeartbeatIntervalMilliseconds;
+      if (stallDescriptions.empty()) {
+        qDebug() << "StallDetector: The Qt thread stalled for" << durationMs << "ms (in unmarked code)";
+      } else {
+        qDebug() << "StallDetector: The Qt thread stalled for" << durationMs << "ms in:";
+        for (const QString& description : stallDescriptions) {
+          qDebug() << "  " << description;
+        }
+      }
+    }
+  }
+}
+
+StallMarker::StallMarker(const char* name, const char* file, int line) {
+  active = QThread::currentThread() == qApp->thread();
+  if (active) {
+    StallDetector::Instance().PushMarker(name, file, line);
+  }
+}
+
+StallMarker::~StallMarker() {
+  if (active) {
+    StallDetector::Instance().PopMarker();
+  }
+}
@@ -0,0 +1,111 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <QString>
+
+// The file and line of the calling code, for use as default arguments of
+// functions that record their call sites (such as RunInQtThreadBlocking()).
+#if defined(__GNUC__) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1926)
+  #define CIDE_CALLER_FILE __builtin_FILE()
+  #define CIDE_CALLER_LINE __builtin_LINE()
+#else
+  #define CIDE_CALLER_FILE "unknown"
+  #define CIDE_CALLER_LINE 0
+#endif
+
+/// Watchdog that detects stalls of the Qt thread's event loop. A timer in the
+/// Qt thread regularly records a heartbeat, and a watchdog thread checks that
+/// the heartbeat does not fall behind by more than kStallThresholdMilliseconds.
+///
+/// To tell what the Qt thread was doing during a stall, code that may take
+/// long in the Qt thread is annotated with StallMarker scopes. This includes
+/// the functions run with RunInQtThreadBlocking() and PostToQtThread(), which
+/// are marked with their call sites. While a stall lasts, the watchdog
+/// captures the active markers, and once it ends, the stall is logged with its
+/// duration and the captured markers.
+class StallDetector {
+ public:
+  /// Event loop delays above this are reported as stalls.
+  static constexpr int kStallThresholdMilliseconds = 500;
+  
+  static StallDetector& Instance();
+  
+  /// Starts the heartbeat timer and the watchdog thread. Must be called in the
+  /// Qt thread.
+  void Start();
+  
+  /// Stops the watchdog thread.
+  void Exit();
+  
+  /// Pushes, respectively pops, a marker for the Qt thread. Use StallMarker
+  /// instead of calling these directly. @p name, and @p file if non-null, must
+  /// be string literals (since only the pointers are stored).
+  void PushMarker(const char* name, const char* file, int line);
+  void PopMarker();
+  
+ private:
+  struct Marker {
+    std::atomic<const char*> name;
+    std::atomic<const char*> file;
+    std::atomic<int> line;
+  };
+  
+  StallDetector();
+  
+  /// Returns the milliseconds on the steady clock.
+  static std::int64_t NowMilliseconds();
+  
+  /// Returns a description of the active markers (outermost first). This is
+  /// called in the watchdog thread while the Qt thread is stalled, so the
+  /// markers are not expected to change while they are read.
+  QString DescribeMarkers();
+  
+  void ThreadMain();
+  
+  
+  /// Maximum number of nested markers that are recorded. Deeper markers are
+  /// counted but not stored.
+  static constexpr int kMaxMarkerDepth = 16;
+  
+  Marker markers[kMaxMarkerDepth];
+  std::atomic<int> markerDepth;
+  
+  /// Time of the last heartbeat of the Qt thread (see NowMilliseconds()).
+  std::atomic<std::int64_t> lastHeartbeat;
+  
+  std::mutex exitMutex;
+  std::condition_variable exitCondition;
+  bool mExit = false;
+  std::shared_ptr<std::thread> mThread;
+};
+
+/// Marks what the Qt thread is doing for the StallDetector, from the
+/// construction of this object to its destruction. Does nothing outside of the
+/// Qt thread.
+///
+///   {
+///     StallMarker marker("UpdateGitStatus");
+///     ...
+///   }
+class StallMarker {
+ public:
+  StallMarker(const char* name, const char* file = nullptr, int line = 0);
+  ~StallMarker();
+  
+  StallMarker(const StallMarker& other) = delete;
+  StallMarker& operator= (const StallMarker& other) = delete;
+  
+ private:
+  bool active;
+};
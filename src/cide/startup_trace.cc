@@ -0,0 +1,39 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/startup_trace.h"
+
+#include <QDebug>
+
+bool StartupTrace::enabled = false;
+std::chrono::steady_clock::time_point StartupTrace::startTime;
+std::chrono::steady_clock::time_point StartupTrace::phaseStartTime;
+
+void StartupTrace::Start() {
+  enabled = !qgetenv("CIDE_TRACE_STARTUP").isEmpty();
+  startTime = std::chrono::steady_clock::now();
+  phaseStartTime = startTime;
+}
+
+void StartupTrace::EndPhase(const char* name) {
+  if (!enabled) {
+    return;
+  }
+  
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  qDebug().nospace() << "Startup: " << name << ": "
+                     << std::chrono::duration<double, std::milli>(now - phaseStartTime).count() << " ms (at "
+                     << std::chrono::duration<double, std::milli>(now - startTime).count() << " ms)";
+  phaseStartTime = now;
+}
+
+void StartupTrace::Finish(const char* name) {
+  if (!enabled) {
+    return;
+  }
+  
+  EndPhase(name);
+  qDebug().nospace() << "Startup: total: " << std::chrono::duration<double, std::milli>(phaseStartTime - startTime).count() << " ms";
+  enabled = false;
+}
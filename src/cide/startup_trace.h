@@ -0,0 +1,30 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <chrono>
+
+/// Reports the time taken by each phase of the program startup if the
+/// environment variable CIDE_TRACE_STARTUP is set (to a non-empty value).
+/// The phases are reported with qDebug() as they end.
+class StartupTrace {
+ public:
+  /// Starts the trace. Must be called at the start of main().
+  static void Start();
+  
+  /// Ends the current phase with the given name, and starts the next one.
+  static void EndPhase(const char* name);
+  
+  /// Ends the trace with the given name of the last phase, also reporting the
+  /// total startup time. Further calls of EndPhase() are ignored.
+  static void Finish(const char* name);
+  
+  inline static bool IsEnabled() { return enabled; }
+  
+ private:
+  static bool enabled;
+  static std::chrono::steady_clock::time_point startTime;
+  static std::chrono::steady_clock::time_point phaseStartTime;
+};
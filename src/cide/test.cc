@@ -2,22 +2,51 @@
 // This file is part of CIDE, licensed under the new BSD license.
 // See the COPYING file in the project root for the license text.
 
+#include <algorithm>
 #include <atomic>
 
 #include <git2.h>
 #include <gtest/gtest.h>
 #include <QApplication>
+#include <QDateTime>
 #include <QStandardPaths>
 
+#include "cide/background_reclaimer.h"
+#include "cide/build_dependencies.h"
+#include "cide/build_output.h"
+#include "cide/clang_highlighting.h"
+#include "cide/clang_index.h"
 #include "cide/code_completion_widget.h"
 #include "cide/code_info.h"
+#include "cide/code_info_get_info.h"
+#include "cide/comment_marker_index.h"
+#include "cide/cpu_budget.h"
 #include "cide/crash_backup.h"
 #include "cide/document.h"
+#include "cide/fenwick_tree.h"
+#include "cide/file_id_table.h"
+#include "cide/file_search.h"
+#include "cide/file_stat_cache.h"
+#include "cide/gdb_mi_parser.h"
 #include "cide/git_diff.h"
+#include "cide/git_status.h"
+#include "cide/highlight_cache.h"
+#include "cide/include_file_index.h"
+#include "cide/indexing_statistics.h"
+#include "cide/lexical_highlighter.h"
 #include "cide/main_window.h"
+#include "cide/mapped_file_viewer.h"
 #include "cide/parse_thread_pool.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/preamble_cache.h"
 #include "cide/project.h"
 #include "cide/qt_thread.h"
+#include "cide/settings.h"
+#include "cide/text_regex.h"
+#include "cide/text_utils.h"
+#include "cide/trigram_index.h"
+#include "cide/tu_cache.h"
+#include "cide/usr_index_cache.h"
 
 int main(int argc, char** argv) {
   // Initialize libgit2
@@ -35,9 +64,13 @@ int main(int argc, char** argv) {
   std::thread testThread([&]() {
     result = RUN_ALL_TESTS();
     ParseThreadPool::Instance().ExitAllThreads();
+    TUCache::Instance().Exit();
     CodeInfo::Instance().Exit();
     CrashBackup::Instance().Exit();
     GitDiff::Instance().Exit();
+    GitStatus::Instance().Exit();
+    PhraseHighlighter::Instance().Exit();
+    BackgroundReclaimer::Instance().Exit();
     finished = true;
   });
   
@@ -53,6 +86,37 @@ int main(int argc, char** argv) {
 // TODO: Wait for parse thread pool to be idle after each test?
 
 
+TEST(FenwickTree, PrefixSumsAndSearch) {
+  std::vector<int> values = {3, 0, 5, 1, 0, 0, 7};
+  FenwickTree tree;
+  tree.Build(values.size(), [&](int index) { return values[index]; });
+  
+  int sum = 0;
+  for (int i = 0; i < values.size(); ++ i) {
+    EXPECT_EQ(sum, tree.PrefixSum(i));
+    EXPECT_EQ(values[i], tree.Value(i));
+    sum += values[i];
+  }
+  EXPECT_EQ(sum, tree.Total());
+  
+  tree.Add(1, 2);
+  values[1] += 2;
+  
+  // For each sum, the search must return the index of the (non-empty) value
+  // which contains it.
+  int index = 0;
+  int start = 0;
+  for (int s = 0; s < tree.Total(); ++ s) {
+    while (s >= start + values[index]) {
+      start += values[index];
+      ++ index;
+    }
+    int prefixSum;
+    EXPECT_EQ(index, tree.FindLastPrefixAtMost(s, &prefixSum));
+    EXPECT_EQ(start, prefixSum);
+  }
+}
+
 TEST(TextBlock, Append1) {
   TextBlock blockA("a\n", true);
   TextBlock blockB("b\n", false);
@@ -109,6 +173,34 @@ TEST(TextBlock, HighlightRangeAppend) {
   EXPECT_EQ(42, blockA.styleRanges(0)[0].rangeIndex);
 }
 
+TEST(TextBlock, PoolSplit) {
+  std::shared_ptr<TextBlockPool> pool(new TextBlockPool());
+  std::shared_ptr<TextBlock> blockA = TextBlockPool::MakeBlock(pool, QStringLiteral("a\nb\nc\n"), true);
+  EXPECT_EQ(1, pool->UsedChunkCount());
+  
+  std::vector<std::shared_ptr<TextBlock>> parts = blockA->Split(2, pool);
+  ASSERT_EQ(2, parts.size());
+  EXPECT_EQ(3, pool->UsedChunkCount());
+  EXPECT_EQ("a\n", blockA->text());
+  EXPECT_EQ("b\n", parts[0]->text());
+  EXPECT_EQ("c\n", parts[1]->text());
+  
+  // Released chunks are re-used.
+  TextBlock* oldAddress = parts[1].get();
+  parts.pop_back();
+  EXPECT_EQ(2, pool->UsedChunkCount());
+  std::shared_ptr<TextBlock> blockB = TextBlockPool::MakeBlock(pool, *parts[0]);
+  EXPECT_EQ(3, pool->UsedChunkCount());
+  EXPECT_EQ(oldAddress, blockB.get());
+  EXPECT_EQ("b\n", blockB->text());
+  
+  // The pool stays alive while blocks allocated from it exist.
+  pool.reset();
+  blockA.reset();
+  parts.clear();
+  EXPECT_EQ("b\n", blockB->text());
+}
+
 
 TEST(Document, LineIterator) {
   std::vector<int> blockSizes = {3, 4, 5, 6, 7};
@@ -216,6 +308,136 @@ TEST(Document, NewlineCountAndOffsets) {
   EXPECT_TRUE(doc.DebugCheckNewlineoffsets());
 }
 
+TEST(Document, Open) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = tmpDir.filePath("cide_test_document_open.txt");
+  
+  // Write lines with Windows line endings and multi-byte UTF-8 characters that
+  // fall onto the boundaries of the (small) blocks.
+  QString groundTruth;
+  QFile file(filePath);
+  ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  for (int i = 0; i < 100; ++ i) {
+    QString line = QStringLiteral("Line %1 \u00e4\u20ac\U0001F600").arg(i);
+    file.write(line.toUtf8() + "\r\n");
+    groundTruth += line + QStringLiteral("\n");
+  }
+  file.write("End");
+  groundTruth += QStringLiteral("End");
+  file.close();
+  
+  Document doc(5);
+  ASSERT_TRUE(doc.Open(filePath));
+  EXPECT_EQ(groundTruth.toStdString(), doc.GetDocumentText().toStdString());
+  EXPECT_EQ(101, doc.LineCount());
+  EXPECT_TRUE(doc.DebugCheckNewlineoffsets());
+  
+  QFile::remove(filePath);
+}
+
+TEST(Document, Reload) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = tmpDir.filePath("cide_test_document_reload.txt");
+  
+  auto writeFile = [&](const QByteArray& content) {
+    QFile file(filePath);
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.write(content);
+    file.close();
+  };
+  
+  QString originalText = QStringLiteral("a\nb\nc\nd\ne\nf\ng");
+  writeFile(originalText.toUtf8());
+  Document doc(3);
+  ASSERT_TRUE(doc.Open(filePath));
+  doc.AddLineAttributes(3, static_cast<int>(LineAttribute::Bookmark));
+  
+  // Insert a line, change a line, remove a line, and append lines after the
+  // last line (which did not end with a newline).
+  QString newText = QStringLiteral("x\na\nB\nc\nd\nf\ng\nh\n");
+  writeFile(newText.toUtf8());
+  ASSERT_TRUE(doc.Reload());
+  EXPECT_EQ(newText.toStdString(), doc.GetDocumentText().toStdString());
+  EXPECT_FALSE(doc.HasUnsavedChanges());
+  EXPECT_TRUE(doc.DebugCheckNewlineoffsets());
+  
+  // The bookmark of the unchanged line "d" moved with it.
+  EXPECT_EQ(static_cast<int>(LineAttribute::Bookmark), doc.lineAttributes(4));
+  
+  // The reload can be undone.
+  doc.Undo();
+  EXPECT_EQ(originalText.toStdString(), doc.GetDocumentText().toStdString());
+  
+  QFile::remove(filePath);
+}
+
+TEST(Document, Save) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = tmpDir.filePath("cide_test_document_save.txt");
+  
+  QString text;
+  for (int i = 0; i < 100; ++ i) {
+    text += QStringLiteral("Line %1 \u00e4\U0001F600\n").arg(i);
+  }
+  Document doc(3);
+  doc.Replace(doc.FullDocumentRange(), text);
+  ASSERT_TRUE(doc.Save(filePath));
+  
+  QFile file(filePath);
+  ASSERT_TRUE(file.open(QIODevice::ReadOnly | QIODevice::Text));
+  EXPECT_EQ(text.toUtf8(), file.readAll());
+  file.close();
+  
+  QFile::remove(filePath);
+}
+
+TEST(Document, SaveInSteps) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = tmpDir.filePath("cide_test_document_save_in_steps.txt");
+  
+  Document doc(3);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("first\n"));
+  std::shared_ptr<const DocumentSnapshot> snapshot = doc.BeginSave();
+  
+  // Edits after BeginSave() are neither written nor marked as saved.
+  DocumentLocation end = doc.FullDocumentRange().end;
+  doc.Replace(DocumentRange(end, end), QStringLiteral("second\n"));
+  ASSERT_TRUE(Document::WriteSnapshot(*snapshot, filePath));
+  doc.FinishSave(filePath, snapshot->version(), true);
+  EXPECT_EQ(QFileInfo(filePath).canonicalFilePath(), doc.path());
+  EXPECT_TRUE(doc.HasUnsavedChanges());
+  
+  QFile file(filePath);
+  ASSERT_TRUE(file.open(QIODevice::ReadOnly | QIODevice::Text));
+  EXPECT_EQ(QByteArray("first\n"), file.readAll());
+  file.close();
+  
+  QFile::remove(filePath);
+}
+
+TEST(Document, EncodeDocumentTextUtf8) {
+  // Use a tiny block size such that surrogate pairs get split between blocks.
+  QString text;
+  for (int i = 0; i < 20; ++ i) {
+    text += QStringLiteral("ascii %1\n\u00e4\U0001F600x\n").arg(i);
+  }
+  Document doc(3);
+  doc.Replace(doc.FullDocumentRange(), text);
+  EXPECT_EQ(text.toUtf8(), doc.EncodeDocumentTextUtf8());
+  EXPECT_EQ(text.toUtf8(), *doc.GetDocumentTextUtf8());
+  
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral(""));
+  EXPECT_EQ(QByteArray(), doc.EncodeDocumentTextUtf8());
+}
+
 TEST(Document, Replace) {
   // Create the document with a very small desired block size such that the test
   // will likely use (and thus text) many blocks
@@ -255,7 +477,7 @@ TEST(Document, Replace) {
     doc.Replace(replacedRange, newText);
     groundTruth = groundTruth.left(replacedRange.start.offset) + newText + groundTruth.right(groundTruth.size() - replacedRange.end.offset);
 //     qDebug() << "new text:     " << groundTruth;
-    
+
     // Block statistics check
     int blockCount;
     float avgBlockSize;
@@ -295,6 +517,141 @@ TEST(Document, ReplaceOnBlockBoundary) {
   EXPECT_EQ("AABBCC", doc.GetDocumentText().toStdString());
 }
 
+TEST(Document, CompactBlocks) {
+  constexpr int desiredBlockSize = 4;
+  Document doc(desiredBlockSize);
+  QString groundTruth;
+  for (int i = 0; i < 200; ++ i) {
+    // Insert the lines one by one, since large insertions create large blocks
+    // directly.
+    QString line = QStringLiteral("line %1\n").arg(i);
+    doc.Replace(DocumentRange(groundTruth.size(), groundTruth.size()), line);
+    groundTruth += line;
+  }
+  
+  int blockCount;
+  float avgBlockSize;
+  int maxBlockSize;
+  float avgStyleRanges;
+  doc.DebugGetBlockStatistics(&blockCount, &avgBlockSize, &maxBlockSize, &avgStyleRanges);
+  int initialBlockCount = blockCount;
+  
+  // Compact the blocks after an edit in the middle of the document
+  doc.Replace(DocumentRange(500, 500), QStringLiteral("x\ny"));
+  groundTruth.insert(500, QStringLiteral("x\ny"));
+  doc.CompactBlocks();
+  
+  doc.DebugGetBlockStatistics(&blockCount, &avgBlockSize, &maxBlockSize, &avgStyleRanges);
+  EXPECT_LT(blockCount, initialBlockCount / 4);
+  EXPECT_LE(maxBlockSize, doc.LargeBlockSize());
+  ASSERT_EQ(groundTruth.toStdString(), doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  ASSERT_EQ(1 + groundTruth.count('\n'), doc.LineCount());
+  
+  // Editing within the large blocks and next to the last edit must work as
+  // before
+  for (int offset : {3, 502, 1100}) {
+    doc.Replace(DocumentRange(offset, offset + 2), QStringLiteral("ab\n"));
+    groundTruth.replace(offset, 2, QStringLiteral("ab\n"));
+    ASSERT_EQ(groundTruth.toStdString(), doc.GetDocumentText().toStdString());
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+    ASSERT_EQ(1 + groundTruth.count('\n'), doc.LineCount());
+  }
+}
+
+TEST(Document, InsertLargeText) {
+  constexpr int desiredBlockSize = 4;
+  Document doc(desiredBlockSize);
+  QString groundTruth = QStringLiteral("abc\ndef\n");
+  doc.Replace(doc.FullDocumentRange(), groundTruth);
+  
+  QString largeText;
+  for (int i = 0; i < 300; ++ i) {
+    largeText += QStringLiteral("line %1\n").arg(i);
+  }
+  ASSERT_GE(largeText.size(), 2 * doc.LargeBlockSize());
+  
+  // Insert at the start, in the middle, and at the end of the document, and
+  // replace a range that spans many blocks.
+  std::vector<DocumentRange> ranges = {DocumentRange(0, 0), DocumentRange(largeText.size() + 5, largeText.size() + 5), DocumentRange(20, 1000)};
+  for (const DocumentRange& range : ranges) {
+    doc.Replace(range, largeText, true, nullptr, true);
+    groundTruth.replace(range.start.offset, range.size(), largeText);
+    ASSERT_EQ(groundTruth.toStdString(), doc.GetDocumentText().toStdString());
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+    ASSERT_EQ(1 + groundTruth.count('\n'), doc.LineCount());
+  }
+  doc.Replace(DocumentRange(groundTruth.size(), groundTruth.size()), largeText, true, nullptr, true);
+  groundTruth += largeText;
+  ASSERT_EQ(groundTruth.toStdString(), doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  
+  // Most of the inserted text is in large blocks.
+  int blockCount;
+  float avgBlockSize;
+  int maxBlockSize;
+  float avgStyleRanges;
+  doc.DebugGetBlockStatistics(&blockCount, &avgBlockSize, &maxBlockSize, &avgStyleRanges);
+  EXPECT_GT(avgBlockSize, 4 * desiredBlockSize);
+  
+  // Undoing the insertions restores the original text.
+  for (int i = 0; i < 4; ++ i) {
+    ASSERT_TRUE(doc.Undo());
+  }
+  EXPECT_EQ("abc\ndef\n", doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+}
+
+TEST(Document, GetReplacementFrom) {
+  constexpr int desiredBlockSize = 8;
+  Document doc(desiredBlockSize);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("abc\ndef\nghi\njkl\nmno\npqr\n"));
+  
+  for (int i = 0; i < 100; ++ i) {
+    Document older;
+    older.AssignTextAndStyles(doc);
+    Replacement replacement;
+    EXPECT_FALSE(doc.GetReplacementFrom(older, &replacement));
+    
+    // Make a random edit
+    DocumentRange fullRange = doc.FullDocumentRange();
+    int pos1 = rand() % (fullRange.end.offset + 1);
+    int pos2 = rand() % (fullRange.end.offset + 1);
+    QString newText = QString(rand() % 4, QChar('a' + i % 26)) + ((rand() % 3 == 0) ? QStringLiteral("\n") : QString());
+    doc.Replace(DocumentRange(std::min(pos1, pos2), std::max(pos1, pos2)), newText);
+    
+    // Applying the returned replacement to the older text must result in the
+    // new text
+    if (doc.GetReplacementFrom(older, &replacement)) {
+      older.Replace(replacement.range, replacement.text);
+    }
+    ASSERT_EQ(doc.GetDocumentText().toStdString(), older.GetDocumentText().toStdString());
+  }
+}
+
+TEST(Document, HashRangeContent) {
+  Document doc(8);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("abcdefgh\nijklmnop\nqrstuvwx\n"));
+  Document copy;
+  copy.AssignTextAndStyles(doc);
+  
+  DocumentRange firstLine(0, 8);
+  DocumentRange lastLine(18, 26);
+  std::size_t firstLineHash = copy.HashRangeContent(firstLine);
+  std::size_t lastLineHash = copy.HashRangeContent(lastLine);
+  EXPECT_EQ(firstLineHash, doc.HashRangeContent(firstLine));
+  EXPECT_NE(firstLineHash, doc.HashRangeContent(lastLine));
+  
+  // Changing the last line must only change its hash
+  doc.Replace(DocumentRange(20, 21), QStringLiteral("S"));
+  EXPECT_EQ(firstLineHash, doc.HashRangeContent(firstLine));
+  EXPECT_NE(lastLineHash, doc.HashRangeContent(lastLine));
+  
+  // Changing the style of the first line must change its hash
+  doc.AddHighlightRange(DocumentRange(2, 4), false, qRgb(255, 0, 0), false);
+  EXPECT_NE(firstLineHash, doc.HashRangeContent(firstLine));
+}
+
 TEST(Document, LineAttributes) {
   Document doc;
   
@@ -311,6 +668,56 @@ TEST(Document, LineAttributes) {
   EXPECT_EQ(1, doc.lineAttributes(2));
 }
 
+TEST(Document, FindLinesWithAttributes) {
+  // Use small blocks such that the lines are spread over many blocks.
+  constexpr int desiredBlockSize = 16;
+  Document doc(desiredBlockSize);
+  QString text;
+  for (int i = 0; i < 100; ++ i) {
+    text += QStringLiteral("line %1\n").arg(i);
+  }
+  doc.Replace(doc.FullDocumentRange(), text);
+  
+  const int bookmark = static_cast<int>(LineAttribute::Bookmark);
+  const int error = static_cast<int>(LineAttribute::Error);
+  EXPECT_EQ(-1, doc.FindNextLineWithAttributes(0, bookmark));
+  EXPECT_EQ(-1, doc.FindPreviousLineWithAttributes(100, bookmark));
+  
+  doc.SetLineAttributes(3, bookmark);
+  doc.SetLineAttributes(40, error);
+  doc.SetLineAttributes(77, bookmark | error);
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  
+  EXPECT_EQ(3, doc.FindNextLineWithAttributes(0, bookmark));
+  EXPECT_EQ(3, doc.FindNextLineWithAttributes(3, bookmark));
+  EXPECT_EQ(77, doc.FindNextLineWithAttributes(4, bookmark));
+  EXPECT_EQ(40, doc.FindNextLineWithAttributes(4, error));
+  EXPECT_EQ(-1, doc.FindNextLineWithAttributes(78, bookmark | error));
+  EXPECT_EQ(77, doc.FindPreviousLineWithAttributes(100, bookmark));
+  EXPECT_EQ(3, doc.FindPreviousLineWithAttributes(76, bookmark));
+  EXPECT_EQ(40, doc.FindPreviousLineWithAttributes(76, error));
+  EXPECT_EQ(-1, doc.FindPreviousLineWithAttributes(2, bookmark | error));
+  
+  std::vector<std::pair<int, int>> lines;
+  doc.GetLinesWithAttributes(&lines);
+  std::vector<std::pair<int, int>> expectedLines = {{3, bookmark}, {40, error}, {77, bookmark | error}};
+  EXPECT_EQ(expectedLines, lines);
+  
+  // Inserting lines before the attributed lines must move them.
+  doc.Replace(DocumentRange(0, 0), QStringLiteral("new\nlines\n"));
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  EXPECT_EQ(5, doc.FindNextLineWithAttributes(0, bookmark));
+  EXPECT_EQ(79, doc.FindNextLineWithAttributes(6, bookmark));
+  
+  doc.RemoveLineAttributes(5, bookmark);
+  doc.RemoveLineAttributes(79, bookmark);
+  ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  EXPECT_EQ(-1, doc.FindNextLineWithAttributes(0, bookmark));
+  doc.GetLinesWithAttributes(&lines);
+  expectedLines = {{42, error}, {79, error}};
+  EXPECT_EQ(expectedLines, lines);
+}
+
 TEST(Document, HighlightRanges1) {
   std::vector<int> blockSizes = {1, 2, 3};
   for (int blockSize : blockSizes) {
@@ -395,6 +802,169 @@ TEST(Document, HighlightRanges3) {
   }
 }
 
+TEST(Document, ReapplyHighlightRangesMatchesIncrementalApplication) {
+  auto getColors = [](Document& doc) {
+    std::vector<QRgb> colors;
+    Document::CharacterAndStyleIterator it(&doc, 0);
+    while (it.IsValid()) {
+      colors.push_back(it.GetStyle().textColor.rgb());
+      ++ it;
+    }
+    return colors;
+  };
+  
+  std::vector<int> blockSizes = {1, 3, 8, 100};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("int main(int argc, char** argv) {\n  return 0;\n}\n// Comment"));
+    int documentSize = doc.FullDocumentRange().end.offset;
+    
+    // Add random, overlapping ranges with distinct colors one by one.
+    srand(blockSize);
+    HighlightBuffer buffer;
+    for (int i = 0; i < 50; ++ i) {
+      int pos1 = rand() % (documentSize + 1);
+      int pos2 = rand() % (documentSize + 1);
+      DocumentRange range(std::min(pos1, pos2), std::max(pos1, pos2));
+      doc.AddHighlightRange(range, false, qRgb(i + 1, 0, 0), false);
+      buffer.AddHighlightRange(range, false, qRgb(i + 1, 0, 0), false);
+    }
+    std::vector<QRgb> incrementalColors = getColors(doc);
+    
+    // Apply the same ranges in bulk.
+    doc.ApplyHighlightBuffer(&buffer);
+    EXPECT_EQ(incrementalColors, getColors(doc)) << "blockSize: " << blockSize;
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  }
+}
+
+TEST(Document, ApplyHighlightBufferDelta) {
+  auto getColors = [](Document& doc) {
+    std::vector<QRgb> colors;
+    Document::CharacterAndStyleIterator it(&doc, 0);
+    while (it.IsValid()) {
+      colors.push_back(it.GetStyle().textColor.rgb());
+      ++ it;
+    }
+    return colors;
+  };
+  auto makeBuffer = [](const std::vector<std::pair<DocumentRange, QRgb>>& ranges, HighlightBuffer* buffer) {
+    for (const std::pair<DocumentRange, QRgb>& range : ranges) {
+      buffer->AddHighlightRange(range.first, false, range.second, false);
+    }
+  };
+  
+  std::vector<int> blockSizes = {1, 3, 8, 100};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("int main(int argc, char** argv) {\n  return 0;\n}\n// Comment"));
+    int documentSize = doc.FullDocumentRange().end.offset;
+    
+    DocumentRange changedRange = DocumentRange::Invalid();
+    QObject::connect(&doc, &Document::HighlightingChanged, [&](const DocumentRange& range) {
+      changedRange = range;
+    });
+    
+    // Random, overlapping ranges with distinct colors
+    srand(blockSize);
+    std::vector<std::pair<DocumentRange, QRgb>> ranges;
+    for (int i = 0; i < 50; ++ i) {
+      int pos1 = rand() % (documentSize + 1);
+      int pos2 = rand() % (documentSize + 1);
+      ranges.emplace_back(DocumentRange(std::min(pos1, pos2), std::max(pos1, pos2)), qRgb(i + 1, 0, 0));
+    }
+    HighlightBuffer buffer;
+    makeBuffer(ranges, &buffer);
+    doc.ApplyHighlightBuffer(&buffer);
+    doc.FinishedHighlightingChanges();
+    std::vector<QRgb> colors = getColors(doc);
+    
+    // Applying the same ranges again does not change anything.
+    HighlightBuffer sameBuffer;
+    makeBuffer(ranges, &sameBuffer);
+    doc.ApplyHighlightBuffer(&sameBuffer);
+    doc.FinishedHighlightingChanges();
+    EXPECT_TRUE(changedRange.IsInvalid()) << "blockSize: " << blockSize;
+    EXPECT_EQ(colors, getColors(doc)) << "blockSize: " << blockSize;
+    
+    // Adding a range on top only changes its part of the document.
+    ranges.emplace_back(DocumentRange(documentSize - 3, documentSize), qRgb(0, 255, 0));
+    HighlightBuffer addedBuffer;
+    makeBuffer(ranges, &addedBuffer);
+    doc.ApplyHighlightBuffer(&addedBuffer);
+    doc.FinishedHighlightingChanges();
+    ASSERT_TRUE(changedRange.IsValid()) << "blockSize: " << blockSize;
+    EXPECT_LE(changedRange.start.offset, documentSize - 3) << "blockSize: " << blockSize;
+    EXPECT_EQ(documentSize, changedRange.end.offset) << "blockSize: " << blockSize;
+    if (blockSize < 8) {
+      EXPECT_GT(changedRange.start.offset, 0) << "blockSize: " << blockSize;
+    }
+    
+    // Changes to the colors and the order of precedence result in the same
+    // styles as applying the ranges to a document without highlighting.
+    ranges[40].second = qRgb(0, 0, 255);
+    ranges.insert(ranges.begin() + 10, std::make_pair(DocumentRange(2, 20), qRgb(255, 0, 255)));
+    ranges.erase(ranges.begin() + 20);
+    HighlightBuffer changedBuffer;
+    makeBuffer(ranges, &changedBuffer);
+    doc.ApplyHighlightBuffer(&changedBuffer);
+    
+    Document freshDoc(blockSize);
+    freshDoc.Replace(freshDoc.FullDocumentRange(), doc.TextForRange(doc.FullDocumentRange()));
+    HighlightBuffer freshBuffer;
+    makeBuffer(ranges, &freshBuffer);
+    freshDoc.ApplyHighlightBuffer(&freshBuffer);
+    EXPECT_EQ(getColors(freshDoc), getColors(doc)) << "blockSize: " << blockSize;
+  }
+}
+
+TEST(Document, StyleRunIterator) {
+  std::vector<int> blockSizes = {1, 3, 8, 100};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("int main(int argc, char** argv) {\n  return 0;\n}\n// Comment"));
+    int documentSize = doc.FullDocumentRange().end.offset;
+    
+    // Add random, overlapping ranges to both layers.
+    srand(blockSize);
+    for (int i = 0; i < 50; ++ i) {
+      int pos1 = rand() % (documentSize + 1);
+      int pos2 = rand() % (documentSize + 1);
+      int layer = i % 2;
+      doc.AddHighlightRange(DocumentRange(std::min(pos1, pos2), std::max(pos1, pos2)), i % 3 == 0, qRgb(i + 1, 0, 0), i % 5 == 0, layer == 0 || i % 4 == 1, layer == 1, qRgb(0, i + 1, 0), layer);
+    }
+    
+    // The runs must cover the document without gaps and must have the same
+    // style as each of their characters.
+    for (int start : {0, 5, documentSize - 1}) {
+      Document::CharacterAndStyleIterator charIt(&doc, start);
+      Document::StyleRunIterator runIt(&doc, start);
+      EXPECT_EQ(start, runIt.GetRunStart());
+      int runCount = 0;
+      while (runIt.IsValid()) {
+        ASSERT_GT(runIt.GetSize(), 0);
+        ++ runCount;
+        for (int c = 0; c < runIt.GetSize(); ++ c) {
+          ASSERT_TRUE(charIt.IsValid());
+          EXPECT_EQ(charIt.GetCharacterOffset(), runIt.GetRunStart() + c);
+          EXPECT_EQ(charIt.GetChar(), runIt.GetText()[c]);
+          HighlightStyle style = charIt.GetStyle();
+          EXPECT_EQ(style.textColor.rgb(), runIt.GetStyle().textColor.rgb());
+          EXPECT_EQ(style.bold, runIt.GetStyle().bold);
+          EXPECT_EQ(style.affectsBackground, runIt.GetStyle().affectsBackground);
+          EXPECT_EQ(style.backgroundColor.rgb(), runIt.GetStyle().backgroundColor.rgb());
+          EXPECT_EQ(charIt.GetStyleOfLayer(0).isNonCodeRange, runIt.IsNonCode());
+          ++ charIt;
+        }
+        ++ runIt;
+      }
+      EXPECT_FALSE(charIt.IsValid());
+      EXPECT_EQ(documentSize, runIt.GetRunStart());
+      EXPECT_LE(runCount, documentSize - start);
+    }
+  }
+}
+
 TEST(Document, HighlightRangeUpdatingOnEdits) {
   auto expectStyle = [](Document& doc, const QString& bold, const QString& testName) {
     ASSERT_EQ(bold.size(), doc.FullDocumentRange().size());
@@ -411,7 +981,7 @@ TEST(Document, HighlightRangeUpdatingOnEdits) {
   std::vector<int> blockSizes = {1, 2, 3, 4, 5, 6, 100};
   for (int blockSize : blockSizes) {
 //     qDebug() << "blockSize:" << blockSize;
-    
+
     // Test: Style on word gets extended when typing characters on the right
     {
       Document doc(blockSize);
@@ -539,31 +1109,1205 @@ TEST(Document, UndoRedo) {
   }
 }
 
+TEST(Document, UndoHistoryCompaction) {
+  // Combined undo steps with adjacent replacements (that get coalesced)
+  Document doc(4);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("aaaa c aaa"));
+  doc.StartUndoStep();
+  for (int offset = 0; offset < 8; offset += 2) {
+    doc.Replace(DocumentRange(offset, offset + 1), QStringLiteral("bb"));
+  }
+  for (int offset = 13; offset >= 11; -- offset) {
+    doc.Replace(DocumentRange(offset, offset + 1), QStringLiteral(""));
+  }
+  doc.EndUndoStep();
+  EXPECT_EQ("bbbbbbbb c ", doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.Undo());
+  EXPECT_EQ("aaaa c aaa", doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.Redo());
+  EXPECT_EQ("bbbbbbbb c ", doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.DebugCheckVersionGraph());
+  
+  // Overwriting characters one by one is undone as a single step
+  doc.Replace(DocumentRange(0, 1), QStringLiteral("x"));
+  doc.Replace(DocumentRange(1, 2), QStringLiteral("y"));
+  EXPECT_EQ("xybbbbbb c ", doc.GetDocumentText().toStdString());
+  ASSERT_TRUE(doc.Undo());
+  EXPECT_EQ("bbbbbbbb c ", doc.GetDocumentText().toStdString());
+  
+  // Large texts are stored compressed
+  QString largeText(100000, 'l');
+  doc.Replace(doc.FullDocumentRange(), largeText, true, nullptr, true);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("small"), true, nullptr, true);
+  ASSERT_TRUE(doc.Undo());
+  EXPECT_TRUE(largeText == doc.GetDocumentText());
+  ASSERT_TRUE(doc.Redo());
+  EXPECT_EQ("small", doc.GetDocumentText().toStdString());
+  
+  // The undo history is pruned if it exceeds the memory limit
+  Document::SetUndoHistoryMemoryLimit(64 * 1024);
+  Document limitedDoc;
+  for (int i = 0; i < 100; ++ i) {
+    limitedDoc.Replace(limitedDoc.FullDocumentRange(), QString(4096, QChar('a' + i % 26)), true, nullptr, true);
+  }
+  ASSERT_TRUE(limitedDoc.DebugCheckVersionGraph());
+  int undoCount = 0;
+  while (limitedDoc.Undo()) {
+    ++ undoCount;
+  }
+  EXPECT_GE(undoCount, 1);
+  EXPECT_LT(undoCount, 20);
+  Document::SetUndoHistoryMemoryLimit(static_cast<std::size_t>(Settings::Instance().GetUndoHistoryMemoryLimitMB()) * 1024 * 1024);
+}
 
-TEST(CodeCompletion, Sorting) {
-  for (int testIndex = 0; testIndex < 2; ++ testIndex) {
-    std::vector<CompletionItem> items;
+TEST(Document, EstimateMemoryUsage) {
+  Document doc(4);
+  DocumentMemoryUsage emptyUsage = doc.EstimateMemoryUsage();
+  
+  doc.Replace(doc.FullDocumentRange(), QString(1000, QLatin1Char('a')));
+  DocumentMemoryUsage usage = doc.EstimateMemoryUsage();
+  EXPECT_GE(usage.text, 1000 * sizeof(QChar));
+  EXPECT_GT(usage.undoHistory, emptyUsage.undoHistory);
+  EXPECT_EQ(usage.text + usage.highlights + usage.undoHistory + usage.other, usage.Total());
+}
+
+TEST(Document, Find) {
+  QString text = QStringLiteral("abcABCabc\nxyzABcab\nabcabc");
+  std::vector<QString> searchStrings = {
+      QStringLiteral("abc"), QStringLiteral("ABC"), QStringLiteral("c\nx"),
+      QStringLiteral("cabc"), QStringLiteral("b"), QStringLiteral("abcABCabc\nxyz"),
+      QStringLiteral("notfound")};
+  
+  for (int blockSize = 1; blockSize < 12; ++ blockSize) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), text);
+    
+    for (const QString& searchString : searchStrings) {
+      for (int matchCase = 0; matchCase < 2; ++ matchCase) {
+        Qt::CaseSensitivity caseSensitivity = matchCase ? Qt::CaseSensitive : Qt::CaseInsensitive;
+        for (int start = 0; start <= text.size(); ++ start) {
+          int expected = text.indexOf(searchString, start, caseSensitivity);
+          DocumentLocation result = doc.Find(searchString, start, true, matchCase);
+          EXPECT_EQ(expected, result.IsInvalid() ? -1 : result.offset);
+          
+          expected = (start >= searchString.size()) ? text.lastIndexOf(searchString, start - searchString.size(), caseSensitivity) : -1;
+          result = doc.Find(searchString, start, false, matchCase);
+          EXPECT_EQ(expected, result.IsInvalid() ? -1 : result.offset);
+        }
+      }
+    }
+  }
+}
+
+TEST(Document, ReplaceMany) {
+  QString initialText = QStringLiteral("one two\nthree four\n\nfive six seven\neight");
+  for (int blockSize = 1; blockSize < 12; ++ blockSize) {
+    std::vector<Replacement> replacements = {
+        Replacement(DocumentRange(0, 3), QStringLiteral("1")),
+        Replacement(DocumentRange(4, 4), QStringLiteral("inserted\nlines\n")),
+        Replacement(DocumentRange(7, 14), QStringLiteral("")),
+        Replacement(DocumentRange(19, 29), QStringLiteral("long replacement text")),
+        Replacement(DocumentRange(29, 29), QStringLiteral("!")),
+        Replacement(DocumentRange(35, 40), QStringLiteral("8\n"))};
+    
+    // Apply the replacements one by one (back to front) for comparison.
+    Document expectedDoc(blockSize);
+    expectedDoc.Replace(expectedDoc.FullDocumentRange(), initialText);
+    for (int i = static_cast<int>(replacements.size()) - 1; i >= 0; -- i) {
+      expectedDoc.Replace(replacements[i].range, replacements[i].text);
+    }
     
-    items.emplace_back();
-    items.back().filterText = (testIndex == 0) ? "Test" : "Something";
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), initialText);
+    doc.ReplaceMany(replacements);
+    EXPECT_EQ(expectedDoc.GetDocumentText().toStdString(), doc.GetDocumentText().toStdString());
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
     
-    items.emplace_back();
-    items.back().filterText = (testIndex == 0) ? "Something" : "Test";
+    // All replacements are undone with a single undo step.
+    ASSERT_TRUE(doc.Undo());
+    EXPECT_EQ(initialText.toStdString(), doc.GetDocumentText().toStdString());
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+    ASSERT_TRUE(doc.Redo());
+    EXPECT_EQ(expectedDoc.GetDocumentText().toStdString(), doc.GetDocumentText().toStdString());
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+    ASSERT_TRUE(doc.DebugCheckVersionGraph());
+  }
+  
+  // Unsorted ranges are rejected.
+  Document doc;
+  doc.Replace(doc.FullDocumentRange(), initialText);
+  doc.ReplaceMany({Replacement(DocumentRange(4, 7), QStringLiteral("2")),
+                   Replacement(DocumentRange(0, 3), QStringLiteral("1"))});
+  EXPECT_EQ(initialText.toStdString(), doc.GetDocumentText().toStdString());
+}
+
+TEST(Document, UndoRedoCombinedStep) {
+  QString initialText = QStringLiteral("one two\nthree four\n\nfive six seven\neight");
+  
+  // Combined undo steps of edits front to back, back to front, and in mixed
+  // order (which cannot be applied with ReplaceMany()).
+  std::vector<std::vector<Replacement>> editLists = {
+      {Replacement(DocumentRange(0, 3), QStringLiteral("1")),
+       Replacement(DocumentRange(2, 5), QStringLiteral("2\n2")),
+       Replacement(DocumentRange(9, 9), QStringLiteral("!"))},
+      {Replacement(DocumentRange(35, 40), QStringLiteral("8")),
+       Replacement(DocumentRange(8, 13), QStringLiteral("")),
+       Replacement(DocumentRange(0, 0), QStringLiteral("zero "))},
+      {Replacement(DocumentRange(8, 13), QStringLiteral("3")),
+       Replacement(DocumentRange(0, 3), QStringLiteral("1")),
+       Replacement(DocumentRange(20, 24), QStringLiteral("5 and 6"))}};
+  for (const std::vector<Replacement>& edits : editLists) {
+    for (int blockSize = 1; blockSize < 12; ++ blockSize) {
+      Document doc(blockSize);
+      doc.Replace(doc.FullDocumentRange(), initialText);
+      doc.StartUndoStep();
+      for (const Replacement& edit : edits) {
+        doc.Replace(edit.range, edit.text);
+      }
+      doc.EndUndoStep();
+      QString editedText = doc.GetDocumentText();
+      
+      for (int i = 0; i < 2; ++ i) {
+        ASSERT_TRUE(doc.Undo());
+        EXPECT_EQ(initialText.toStdString(), doc.GetDocumentText().toStdString());
+        ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+        ASSERT_TRUE(doc.Redo());
+        EXPECT_EQ(editedText.toStdString(), doc.GetDocumentText().toStdString());
+        ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+        ASSERT_TRUE(doc.DebugCheckVersionGraph());
+      }
+    }
+  }
+}
+
+TEST(Document, TextChangeCounter) {
+  Document doc(4);
+  std::vector<std::pair<DocumentRange, int>> replacements;
+  int lastCounter = doc.textChangeCounter();
+  QObject::connect(&doc, &Document::TextReplaced, [&](const DocumentRange& oldRange, int newTextSize, int textChangeCounter) {
+    EXPECT_EQ(lastCounter + 1, textChangeCounter);
+    lastCounter = textChangeCounter;
+    replacements.emplace_back(oldRange, newTextSize);
+  });
+  
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("Cartoon"));
+  doc.Replace(DocumentRange(0, 4), QStringLiteral("Ty"));
+  ASSERT_EQ(2, replacements.size());
+  EXPECT_EQ(0, replacements[1].first.start.offset);
+  EXPECT_EQ(4, replacements[1].first.end.offset);
+  EXPECT_EQ(2, replacements[1].second);
+  
+  // The counter must also increase for undo steps, even though the version
+  // decreases.
+  int versionBeforeUndo = doc.version();
+  ASSERT_TRUE(doc.Undo());
+  EXPECT_LT(doc.version(), versionBeforeUndo);
+  ASSERT_EQ(3, replacements.size());
+  EXPECT_EQ(0, replacements[2].first.start.offset);
+  EXPECT_EQ(2, replacements[2].first.end.offset);
+  EXPECT_EQ(4, replacements[2].second);
+  EXPECT_EQ(lastCounter, doc.textChangeCounter());
+}
+
+
+TEST(Document, LastCodeChangeCounter) {
+  // Returns whether the replacement was classified as affecting the code.
+  auto affectsCode = [](const DocumentRange& range, const QString& newText) {
+    Document doc(4);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("int a;  /* note */\nint b; // x\n"));
+    doc.AddHighlightRange(DocumentRange(8, 18), true, qRgb(0, 128, 0), false);
+    doc.AddHighlightRange(DocumentRange(26, 30), true, qRgb(0, 128, 0), false);
+    int counter = doc.lastCodeChangeCounter();
+    doc.Replace(range, newText);
+    return doc.lastCodeChangeCounter() != counter;
+  };
+  
+  // Comments
+  EXPECT_FALSE(affectsCode(DocumentRange(12, 12), QStringLiteral("x")));
+  EXPECT_FALSE(affectsCode(DocumentRange(11, 13), QStringLiteral("\n")));
+  EXPECT_TRUE(affectsCode(DocumentRange(12, 12), QStringLiteral("*/")));
+  EXPECT_TRUE(affectsCode(DocumentRange(16, 17), QStringLiteral("")));
+  EXPECT_TRUE(affectsCode(DocumentRange(18, 18), QStringLiteral("x")));
+  EXPECT_FALSE(affectsCode(DocumentRange(30, 30), QStringLiteral("y")));
+  EXPECT_TRUE(affectsCode(DocumentRange(30, 30), QStringLiteral("\n")));
+  
+  // Whitespace
+  EXPECT_FALSE(affectsCode(DocumentRange(7, 7), QStringLiteral(" ")));
+  EXPECT_FALSE(affectsCode(DocumentRange(6, 7), QStringLiteral("")));
+  EXPECT_TRUE(affectsCode(DocumentRange(2, 2), QStringLiteral(" ")));
+  EXPECT_TRUE(affectsCode(DocumentRange(25, 25), QStringLiteral("\n")));
+  
+  // Code
+  EXPECT_TRUE(affectsCode(DocumentRange(4, 4), QStringLiteral("a")));
+}
+
+TEST(Document, PreambleHash) {
+  Document doc(4);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("// c\n#include <a>\n/* x\n*/ #define B \\\n  1\nint a;\nint b;\n"));
+  std::size_t hash = doc.preambleHash();
+  
+  // Edits after the preamble region do not change the hash
+  int codeOffset = doc.GetDocumentText().indexOf(QStringLiteral("int b"));
+  doc.Replace(DocumentRange(codeOffset, codeOffset), QStringLiteral("#include <c>\n"));
+  EXPECT_EQ(hash, doc.preambleHash());
+  
+  // Edits within the continued #define change it
+  int defineOffset = doc.GetDocumentText().indexOf(QStringLiteral("1\n"));
+  doc.Replace(DocumentRange(defineOffset, defineOffset + 1), QStringLiteral("2"));
+  EXPECT_NE(hash, doc.preambleHash());
+  hash = doc.preambleHash();
+  
+  // Adding a directive at the end of the preamble region changes it
+  int endOffset = doc.GetDocumentText().indexOf(QStringLiteral("int a"));
+  doc.Replace(DocumentRange(endOffset, endOffset), QStringLiteral("#include <d>\n"));
+  EXPECT_NE(hash, doc.preambleHash());
+  hash = doc.preambleHash();
+  
+  // Commenting out the first line of code extends the region
+  endOffset = doc.GetDocumentText().indexOf(QStringLiteral("int a"));
+  doc.Replace(DocumentRange(endOffset, endOffset), QStringLiteral("//"));
+  EXPECT_NE(hash, doc.preambleHash());
+}
+
+TEST(Document, AssignTextAndStylesIsCopyOnWrite) {
+  std::vector<int> blockSizes = {2, 4, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("Cartoon\nTyphoon\nBoon"));
     
-    CodeCompletionWidget* widget = new CodeCompletionWidget(std::move(items), nullptr, QPoint(0, 0), nullptr);
-    widget->SetFilterText(QStringLiteral("TeAst"));
-    std::vector<CompletionItem> sortedItems = widget->GetSortedItems();
+    Document copy;
+    copy.AssignTextAndStyles(doc);
+    EXPECT_EQ(doc.GetDocumentText().toStdString(), copy.GetDocumentText().toStdString());
+    EXPECT_EQ(3, copy.LineCount());
     
-    EXPECT_EQ(2, sortedItems.size());
+    // Changes to the original must not affect the copy, and vice versa.
+    doc.Replace(DocumentRange(0, 4), QStringLiteral("Ty"));
+    doc.SetLineAttributes(1, 1);
+    EXPECT_EQ("Tyoon\nTyphoon\nBoon", doc.GetDocumentText().toStdString());
+    EXPECT_EQ("Cartoon\nTyphoon\nBoon", copy.GetDocumentText().toStdString());
+    EXPECT_EQ(0, copy.lineAttributes(1));
     
-    // "Te[A]st" matched with "Test"
-    EXPECT_EQ(4, sortedItems[0].matchScore.matchedCharacters);
-    EXPECT_EQ(1, sortedItems[0].matchScore.matchErrors);
-    EXPECT_TRUE(sortedItems[0].matchScore.matchedCase);
-    EXPECT_EQ(0, sortedItems[0].matchScore.matchedStartIndex);
+    copy.Replace(DocumentRange(8, 15), QStringLiteral(""));
+    EXPECT_EQ("Tyoon\nTyphoon\nBoon", doc.GetDocumentText().toStdString());
+    EXPECT_EQ("Cartoon\n\nBoon", copy.GetDocumentText().toStdString());
+    EXPECT_EQ(1, doc.lineAttributes(1));
     
-    // "Te" matched with "et"
-    EXPECT_EQ(2, sortedItems[1].matchScore.matchedCharacters);
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+    ASSERT_TRUE(copy.DebugCheckNewlineoffsets());
+  }
+}
+
+TEST(Document, Snapshot) {
+  Document doc(4);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("Cartoon\nTyphoon\n\u00e4Boon"));
+  
+  DocumentSnapshot snapshot(&doc);
+  EXPECT_EQ(doc.version(), snapshot.version());
+  EXPECT_EQ(doc.textChangeCounter(), snapshot.textChangeCounter());
+  
+  // Changes to the document must not affect the snapshot.
+  doc.Replace(DocumentRange(0, 4), QStringLiteral("Ty\n"));
+  EXPECT_NE(doc.textChangeCounter(), snapshot.textChangeCounter());
+  
+  std::vector<unsigned> expectedLineStarts = {0, 8, 16};
+  EXPECT_EQ(expectedLineStarts, snapshot.GetLineStarts());
+  EXPECT_EQ(QStringLiteral("Cartoon\nTyphoon\n\u00e4Boon").toUtf8(), *snapshot.GetTextUtf8());
+  EXPECT_EQ("Ty\noon\nTyphoon\n\u00e4Boon", doc.GetDocumentText().toStdString());
+  
+  // Snapshots are only published after enabling them, and are updated
+  // by the Qt thread after changes.
+  RunInQtThreadBlocking([&]() {
+    Document publishedDoc;
+    EXPECT_FALSE(publishedDoc.GetSnapshot());
+    publishedDoc.SetPublishSnapshots(true);
+    std::shared_ptr<const DocumentSnapshot> firstSnapshot = publishedDoc.GetSnapshot();
+    ASSERT_TRUE(firstSnapshot);
+    
+    publishedDoc.Replace(publishedDoc.FullDocumentRange(), QStringLiteral("Cartoon"));
+    EXPECT_EQ(firstSnapshot, publishedDoc.GetSnapshot());
+    
+    QEventLoop eventLoop;
+    while (publishedDoc.GetSnapshot()->textChangeCounter() != publishedDoc.textChangeCounter()) {
+      eventLoop.processEvents();
+    }
+    EXPECT_EQ(QByteArray("Cartoon"), *publishedDoc.GetSnapshot()->GetTextUtf8());
+    EXPECT_EQ(publishedDoc.GetSnapshot(), publishedDoc.UpdateSnapshot());
+  });
+}
+
+TEST(Document, ApplyHighlightBuffer) {
+  Document doc(2);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("ABC\nDEF"));
+  doc.AddHighlightRange(DocumentRange(0, 1), false, qRgb(255, 0, 0), true);  // Make 'A' bold
+  doc.AddContext(QStringLiteral("old"), QStringLiteral("old"), DocumentRange(0, 3), DocumentRange(0, 3));
+  doc.SetLineAttributes(0, static_cast<int>(LineAttribute::Error) | static_cast<int>(LineAttribute::Bookmark));
+  
+  HighlightBuffer buffer;
+  buffer.AddHighlightRange(DocumentRange(5, 6), false, qRgb(255, 0, 0), true);  // Make 'E' bold
+  buffer.AddHighlightRange(DocumentRange(6, 6), false, qRgb(255, 0, 0), true);  // Empty, ignored
+  buffer.AddContext(QStringLiteral("new"), QStringLiteral("new"), DocumentRange(0, 3), DocumentRange(4, 7));
+  buffer.AddProblemLineAttributes(DocumentLocation(4), static_cast<int>(LineAttribute::Warning));
+  EXPECT_FALSE(doc.ApplyHighlightBuffer(&buffer));  // no problems before and after
+  
+  EXPECT_EQ(2, doc.GetHighlightRanges(0).size());
+  EXPECT_FALSE(Document::CharacterAndStyleIterator(&doc, 0).GetStyle().bold);
+  EXPECT_TRUE(Document::CharacterAndStyleIterator(&doc, 5).GetStyle().bold);
+  
+  ASSERT_EQ(1, doc.GetContexts().size());
+  EXPECT_EQ("new", doc.GetContexts().begin()->name.toStdString());
+  
+  // Only the warning / error line attributes are replaced.
+  EXPECT_EQ(static_cast<int>(LineAttribute::Bookmark), doc.lineAttributes(0));
+  EXPECT_EQ(static_cast<int>(LineAttribute::Warning), doc.lineAttributes(1));
+  
+  // Attributes for the same line are combined, and changed lines are updated.
+  HighlightBuffer secondBuffer;
+  secondBuffer.AddProblemLineAttributes(DocumentLocation(0), static_cast<int>(LineAttribute::Warning));
+  secondBuffer.AddProblemLineAttributes(DocumentLocation(4), static_cast<int>(LineAttribute::Error));
+  secondBuffer.AddProblemLineAttributes(DocumentLocation(0), static_cast<int>(LineAttribute::Error));
+  doc.ApplyHighlightBuffer(&secondBuffer);
+  EXPECT_EQ(static_cast<int>(LineAttribute::Bookmark) | static_cast<int>(LineAttribute::Warning) | static_cast<int>(LineAttribute::Error), doc.lineAttributes(0));
+  EXPECT_EQ(static_cast<int>(LineAttribute::Error), doc.lineAttributes(1));
+}
+
+TEST(Document, GetContextsAt) {
+  Document doc(4);
+  doc.Replace(doc.FullDocumentRange(), QString(100, 'x'));
+  doc.AddContext(QStringLiteral("ns"), QStringLiteral("ns"), DocumentRange::Invalid(), DocumentRange(0, 90));
+  doc.AddContext(QStringLiteral("a"), QStringLiteral("a"), DocumentRange::Invalid(), DocumentRange(10, 20));
+  doc.AddContext(QStringLiteral("b"), QStringLiteral("b"), DocumentRange::Invalid(), DocumentRange(30, 60));
+  doc.AddContext(QStringLiteral("b1"), QStringLiteral("b1"), DocumentRange::Invalid(), DocumentRange(40, 50));
+  
+  auto names = [&](int offset) {
+    std::string result;
+    for (const Context* context : doc.GetContextsAt(DocumentLocation(offset))) {
+      result += context->name.toStdString() + " ";
+    }
+    return result;
+  };
+  EXPECT_EQ("ns ", names(5));
+  EXPECT_EQ("ns a ", names(15));
+  EXPECT_EQ("ns ", names(25));
+  EXPECT_EQ("ns b b1 ", names(45));
+  EXPECT_EQ("ns b ", names(55));
+  EXPECT_EQ("", names(95));
+  
+  // The index is updated after edits.
+  doc.Replace(DocumentRange(0, 0), QString(10, 'y'));
+  EXPECT_EQ("ns ", names(15));
+  EXPECT_EQ("ns a ", names(25));
+  doc.ClearContexts();
+  EXPECT_EQ("", names(25));
+}
+
+TEST(Document, FindMatchingBracket) {
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    QString text = QStringLiteral("f(a[1], {b}) { /* } ) */ if (x) { g(); } }\n(");
+    doc.Replace(doc.FullDocumentRange(), text);
+    int commentStart = text.indexOf(QStringLiteral("/*"));
+    int commentEnd = text.indexOf(QStringLiteral("*/")) + 2;
+    doc.AddHighlightRange(DocumentRange(commentStart, commentEnd), true, qRgb(0, 128, 0), false);
+    
+    // Checks that the brackets at the two offsets match each other.
+    auto expectMatch = [&](int a, int b) {
+      EXPECT_EQ(b, doc.FindMatchingBracket(Document::CharacterAndStyleIterator(&doc, a))) << "blockSize: " << blockSize << ", offset: " << a;
+      EXPECT_EQ(a, doc.FindMatchingBracket(Document::CharacterAndStyleIterator(&doc, b))) << "blockSize: " << blockSize << ", offset: " << b;
+    };
+    expectMatch(text.indexOf('('), text.indexOf(')', text.indexOf('}')));
+    expectMatch(text.indexOf('['), text.indexOf(']'));
+    expectMatch(text.indexOf('{'), text.indexOf('}'));
+    expectMatch(text.indexOf('{', commentStart - 2), text.lastIndexOf('}'));
+    expectMatch(text.indexOf(QStringLiteral("(x")), text.indexOf(QStringLiteral(") {")));
+    
+    // Unmatched bracket
+    EXPECT_EQ(-1, doc.FindMatchingBracket(Document::CharacterAndStyleIterator(&doc, text.size() - 1)));
+    
+    // The cached block summaries are updated after edits.
+    doc.Replace(DocumentRange(text.size() - 1, text.size()), QStringLiteral(")"));
+    doc.Replace(DocumentRange(0, 0), QStringLiteral("("));
+    EXPECT_EQ(text.size(), doc.FindMatchingBracket(Document::CharacterAndStyleIterator(&doc, 0)));
+    EXPECT_EQ(0, doc.FindMatchingBracket(Document::CharacterAndStyleIterator(&doc, text.size())));
+  }
+}
+
+TEST(Document, FindIdentifierOccurrences) {
+  InitializeSymbolArray();
+  
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    QString text = QStringLiteral("value = value2 + value;\nfoo(value, xvalue)->value");
+    doc.Replace(doc.FullDocumentRange(), text);
+    
+    // Returns the start offsets of the occurrences of the identifier.
+    auto findStarts = [&](const QString& identifier) {
+      std::vector<DocumentRange> occurrences;
+      doc.FindIdentifierOccurrences(identifier, &occurrences);
+      std::vector<int> starts;
+      for (const DocumentRange& range : occurrences) {
+        EXPECT_EQ(identifier.size(), range.size());
+        starts.push_back(range.start.offset);
+      }
+      return starts;
+    };
+    
+    EXPECT_EQ(std::vector<int>({0, 17, 28, 44}), findStarts(QStringLiteral("value"))) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::vector<int>({8}), findStarts(QStringLiteral("value2"))) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::vector<int>({35}), findStarts(QStringLiteral("xvalue"))) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::vector<int>(), findStarts(QStringLiteral("alue"))) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::vector<int>(), findStarts(QStringLiteral("value ="))) << "blockSize: " << blockSize;
+    
+    // The cached indexes are updated after edits.
+    doc.Replace(DocumentRange(28, 33), QStringLiteral("other"));
+    doc.Replace(DocumentRange(0, 0), QStringLiteral("x"));
+    EXPECT_EQ(std::vector<int>({18, 45}), findStarts(QStringLiteral("value"))) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::vector<int>({0, 36}), findStarts(QStringLiteral("xvalue"))) << "blockSize: " << blockSize;
+  }
+}
+
+TEST(Document, HighlightStyleTable) {
+  Document doc(2);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("ABCDEF"));
+  int initialStyleCount = doc.GetHighlightStyles().size();
+  
+  // Ranges with equal styles share the same style table entry.
+  doc.AddHighlightRange(DocumentRange(0, 1), false, qRgb(255, 0, 0), true);
+  doc.AddHighlightRange(DocumentRange(2, 3), false, qRgb(255, 0, 0), true);
+  doc.AddHighlightRange(DocumentRange(4, 5), false, qRgb(0, 0, 255), false);
+  EXPECT_EQ(initialStyleCount + 2, doc.GetHighlightStyles().size());
+  
+  // The style IDs of a HighlightBuffer are mapped to the document's table.
+  HighlightBuffer buffer;
+  buffer.AddHighlightRange(DocumentRange(1, 2), false, qRgb(0, 0, 255), false);
+  buffer.AddHighlightRange(DocumentRange(3, 4), false, qRgb(255, 0, 0), true);
+  EXPECT_EQ(2, buffer.styles.size());
+  doc.ApplyHighlightBuffer(&buffer);
+  EXPECT_EQ(initialStyleCount + 2, doc.GetHighlightStyles().size());
+  
+  EXPECT_FALSE(Document::CharacterAndStyleIterator(&doc, 0).GetStyle().bold);
+  EXPECT_EQ(qRgb(0, 0, 255), Document::CharacterAndStyleIterator(&doc, 1).GetStyle().textColor.rgb());
+  EXPECT_TRUE(Document::CharacterAndStyleIterator(&doc, 3).GetStyle().bold);
+  EXPECT_EQ(qRgb(255, 0, 0), Document::CharacterAndStyleIterator(&doc, 3).GetStyle().textColor.rgb());
+}
+
+TEST(Document, RebaseHighlightBuffer) {
+  Document doc(2);
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("int a;\nint b;\nint c;"));
+  int parsedCounter = doc.textChangeCounter();
+  
+  // Highlights for the parsed version of the text: "a", "b", and "c".
+  HighlightBuffer buffer;
+  buffer.AddHighlightRange(DocumentRange(4, 5), false, qRgb(255, 0, 0), true);
+  buffer.AddHighlightRange(DocumentRange(11, 12), false, qRgb(255, 0, 0), true);
+  buffer.AddHighlightRange(DocumentRange(18, 19), false, qRgb(255, 0, 0), true);
+  buffer.AddProblemLineAttributes(DocumentLocation(14), static_cast<int>(LineAttribute::Error));
+  
+  // Edit the document: insert a line at the start and remove "b".
+  doc.Replace(DocumentRange(0, 0), QStringLiteral("// x\n"));
+  doc.Replace(DocumentRange(16, 17), QStringLiteral(""));
+  EXPECT_EQ("// x\nint a;\nint ;\nint c;", doc.GetDocumentText().toStdString());
+  
+  std::vector<TextReplacement> replacements;
+  ASSERT_TRUE(doc.GetTextReplacementsSince(parsedCounter, &replacements));
+  ASSERT_EQ(2, replacements.size());
+  EXPECT_FALSE(doc.GetTextReplacementsSince(doc.textChangeCounter() + 1, &replacements));
+  
+  ASSERT_TRUE(doc.GetTextReplacementsSince(parsedCounter, &replacements));
+  buffer.Rebase(replacements);
+  ASSERT_EQ(2, buffer.ranges.size());
+  EXPECT_EQ(9, buffer.ranges[0].range.start.offset);
+  EXPECT_EQ(10, buffer.ranges[0].range.end.offset);
+  EXPECT_EQ(22, buffer.ranges[1].range.start.offset);
+  EXPECT_EQ(23, buffer.ranges[1].range.end.offset);
+  
+  doc.ApplyHighlightBuffer(&buffer);
+  EXPECT_TRUE(Document::CharacterAndStyleIterator(&doc, 9).GetStyle().bold);
+  EXPECT_TRUE(Document::CharacterAndStyleIterator(&doc, 22).GetStyle().bold);
+  EXPECT_EQ(static_cast<int>(LineAttribute::Error), doc.lineAttributes(3));
+  EXPECT_EQ(0, doc.lineAttributes(2));
+  
+  // Re-assigning the text cannot be mapped.
+  Document other;
+  int counter = doc.textChangeCounter();
+  doc.AssignTextAndStyles(other);
+  EXPECT_FALSE(doc.GetTextReplacementsSince(counter, &replacements));
+}
+
+TEST(Document, LineForLocation) {
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    QString text = QStringLiteral("ab\n\ncde\nf\n");
+    doc.Replace(doc.FullDocumentRange(), text);
+    
+    int line = 0;
+    for (int offset = 0; offset <= text.size(); ++ offset) {
+      EXPECT_EQ(line, doc.LineForLocation(DocumentLocation(offset))) << "blockSize: " << blockSize << ", offset: " << offset;
+      if (offset < text.size() && text[offset] == '\n') {
+        ++ line;
+      }
+    }
+  }
+}
+
+TEST(Document, LineStarts) {
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("ab\n\ncde\nf\n"));
+    doc.Replace(DocumentRange(4, 5), QStringLiteral("x\ny"));
+    ASSERT_EQ("ab\n\nx\nyde\nf\n", doc.GetDocumentText().toStdString());
+    
+    std::vector<unsigned> expectedLineStarts;
+    Document::LineIterator lineIt(&doc);
+    while (lineIt.IsValid()) {
+      expectedLineStarts.push_back(lineIt.GetLineStart().offset);
+      ++ lineIt;
+    }
+    ASSERT_EQ(6, expectedLineStarts.size());
+    
+    std::vector<unsigned> lineStarts;
+    doc.GetLineStarts(&lineStarts);
+    EXPECT_EQ(expectedLineStarts, lineStarts) << "blockSize: " << blockSize;
+    
+    for (int line = 0; line < expectedLineStarts.size(); ++ line) {
+      EXPECT_EQ(expectedLineStarts[line], doc.LineStart(line).offset) << "blockSize: " << blockSize << ", line: " << line;
+    }
+    EXPECT_FALSE(doc.LineStart(-1).IsValid());
+    EXPECT_FALSE(doc.LineStart(expectedLineStarts.size()).IsValid());
+  }
+}
+
+TEST(Document, Utf8Offsets) {
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QString::fromUtf8("a\u00e4b\n\u20ac\U0001D11Ex"));
+    doc.Replace(DocumentRange(1, 1), QString::fromUtf8("\u00f6\u00f6c"));
+    QString text = doc.GetDocumentText();
+    ASSERT_EQ(QString::fromUtf8("a\u00f6\u00f6c\u00e4b\n\u20ac\U0001D11Ex"), text);
+    
+    EXPECT_EQ(text.toUtf8().size(), doc.Utf8Size()) << "blockSize: " << blockSize;
+    for (int offset = 0; offset <= text.size(); ++ offset) {
+      if (offset > 0 && text[offset - 1].isHighSurrogate()) {
+        continue;
+      }
+      int utf8Offset = text.left(offset).toUtf8().size();
+      EXPECT_EQ(utf8Offset, doc.Utf8OffsetForLocation(offset)) << "blockSize: " << blockSize << ", offset: " << offset;
+      EXPECT_EQ(offset, doc.LocationForUtf8Offset(utf8Offset).offset) << "blockSize: " << blockSize << ", offset: " << offset;
+    }
+    
+    // Offsets within the encoding of a character map to its start.
+    EXPECT_EQ(1, doc.LocationForUtf8Offset(2).offset);
+    EXPECT_EQ(text.size(), doc.LocationForUtf8Offset(1000).offset);
+    ASSERT_TRUE(doc.DebugCheckNewlineoffsets());
+  }
+}
+
+
+TEST(FileSearch, FindOccurrencesInUtf8Text) {
+  QByteArray text = QString::fromUtf8("abc Abc\r\n\u00e4abc\n\nxabcabc").toUtf8();
+  
+  std::vector<FileSearchMatch> matches;
+  FindOccurrencesInUtf8Text(text.constData(), text.size(), QStringLiteral("abc"), Qt::CaseSensitive, &matches);
+  ASSERT_EQ(3, matches.size());
+  EXPECT_EQ(1, matches[0].line);
+  EXPECT_EQ(QStringLiteral("abc Abc"), matches[0].lineText);
+  ASSERT_EQ(1, matches[0].columns.size());
+  EXPECT_EQ(0, matches[0].columns[0]);
+  EXPECT_EQ(2, matches[1].line);
+  ASSERT_EQ(1, matches[1].columns.size());
+  EXPECT_EQ(1, matches[1].columns[0]);
+  EXPECT_EQ(4, matches[2].line);
+  ASSERT_EQ(2, matches[2].columns.size());
+  EXPECT_EQ(1, matches[2].columns[0]);
+  EXPECT_EQ(4, matches[2].columns[1]);
+  
+  matches.clear();
+  FindOccurrencesInUtf8Text(text.constData(), text.size(), QStringLiteral("aBC"), Qt::CaseInsensitive, &matches);
+  ASSERT_EQ(3, matches.size());
+  ASSERT_EQ(2, matches[0].columns.size());
+  EXPECT_EQ(4, matches[0].columns[1]);
+  
+  matches.clear();
+  FindOccurrencesInUtf8Text(text.constData(), text.size(), QString::fromUtf8("\u00c4A"), Qt::CaseInsensitive, &matches);
+  ASSERT_EQ(1, matches.size());
+  EXPECT_EQ(2, matches[0].line);
+  ASSERT_EQ(1, matches[0].columns.size());
+  EXPECT_EQ(0, matches[0].columns[0]);
+}
+
+TEST(PhraseHighlighter, FindOccurrences) {
+  InitializeSymbolArray();
+  QString text = QStringLiteral("foo foobar foo(x) xfoo foo");
+  
+  std::vector<DocumentRange> occurrences;
+  PhraseHighlighter::FindOccurrences(text, QStringLiteral("foo"), DocumentRange(0, 0), 0, &occurrences);
+  ASSERT_EQ(3, occurrences.size());
+  EXPECT_EQ(0, occurrences[0].start.offset);
+  EXPECT_EQ(3, occurrences[0].end.offset);
+  EXPECT_EQ(11, occurrences[1].start.offset);
+  EXPECT_EQ(23, occurrences[2].start.offset);
+  
+  // Symbols do not need to be delimited
+  PhraseHighlighter::FindOccurrences(text, QStringLiteral("("), DocumentRange(0, 0), 0, &occurrences);
+  ASSERT_EQ(1, occurrences.size());
+  EXPECT_EQ(14, occurrences[0].start.offset);
+  
+  // With a limited count, the occurrences closest to the focus range are preferred
+  PhraseHighlighter::FindOccurrences(text, QStringLiteral("foo"), DocumentRange(20, 26), 1, &occurrences);
+  ASSERT_EQ(1, occurrences.size());
+  EXPECT_EQ(23, occurrences[0].start.offset);
+  
+  PhraseHighlighter::FindOccurrences(text, QStringLiteral("foo"), DocumentRange(20, 26), 2, &occurrences);
+  ASSERT_EQ(2, occurrences.size());
+  EXPECT_EQ(11, occurrences[0].start.offset);
+  EXPECT_EQ(23, occurrences[1].start.offset);
+  
+  // Search across multiple chunks in both directions
+  QString longText;
+  for (int i = 0; i < 100000; ++ i) {
+    longText += QStringLiteral("x ");
+  }
+  PhraseHighlighter::FindOccurrences(longText, QStringLiteral("x"), DocumentRange(100000, 100002), 3, &occurrences);
+  ASSERT_EQ(3, occurrences.size());
+  EXPECT_EQ(99998, occurrences[0].start.offset);
+  EXPECT_EQ(100000, occurrences[1].start.offset);
+  EXPECT_EQ(100002, occurrences[2].start.offset);
+  
+  PhraseHighlighter::FindOccurrences(longText, QStringLiteral("x"), DocumentRange(100000, 100002), 0, &occurrences);
+  EXPECT_EQ(100000, occurrences.size());
+}
+
+TEST(FileSearch, FindRegexMatchesInUtf8Text) {
+  QByteArray text = QString::fromUtf8("int a = 12;\r\n\nx = 345 + 6\n").toUtf8();
+  TextRegex regex;
+  ASSERT_TRUE(regex.Compile(QStringLiteral("\\d+"), true));
+  
+  std::vector<FileSearchMatch> matches;
+  FindRegexMatchesInUtf8Text(text.constData(), text.size(), regex, &matches);
+  ASSERT_EQ(2, matches.size());
+  EXPECT_EQ(1, matches[0].line);
+  EXPECT_EQ(QStringLiteral("int a = 12;"), matches[0].lineText);
+  ASSERT_EQ(1, matches[0].columns.size());
+  EXPECT_EQ(8, matches[0].columns[0]);
+  EXPECT_EQ(2, matches[0].lengths[0]);
+  EXPECT_EQ(3, matches[1].line);
+  ASSERT_EQ(2, matches[1].columns.size());
+  EXPECT_EQ(4, matches[1].columns[0]);
+  EXPECT_EQ(3, matches[1].lengths[0]);
+  EXPECT_EQ(10, matches[1].columns[1]);
+  EXPECT_EQ(1, matches[1].lengths[1]);
+}
+
+
+TEST(TextRegex, Matching) {
+  // Returns the matches of the pattern in the text, as "start:length" strings.
+  auto findAll = [](const QString& pattern, const QString& text, bool matchCase = true) {
+    TextRegex regex;
+    EXPECT_TRUE(regex.Compile(pattern, matchCase)) << pattern.toStdString();
+    std::vector<std::pair<int, int>> matches;
+    if (regex.IsValid()) {
+      TextRegexMatcher matcher(regex);
+      matcher.FindAll(text, &matches);
+    }
+    QString result;
+    for (const std::pair<int, int>& match : matches) {
+      result += QStringLiteral("%1:%2 ").arg(match.first).arg(match.second);
+    }
+    return result.trimmed().toStdString();
+  };
+  
+  EXPECT_EQ("1:3 5:3", findAll(QStringLiteral("abc"), QStringLiteral("xabc abc")));
+  EXPECT_EQ("0:3 4:3", findAll(QStringLiteral("abc"), QStringLiteral("ABC aBc"), false));
+  EXPECT_EQ("", findAll(QStringLiteral("abc"), QStringLiteral("ABC aBc"), true));
+  EXPECT_EQ("0:2 3:4", findAll(QStringLiteral("a.|b+"), QStringLiteral("axxbbbb")));
+  EXPECT_EQ("1:3", findAll(QStringLiteral("[0-9]+"), QStringLiteral("x123y")));
+  EXPECT_EQ("0:1 3:2", findAll(QStringLiteral("[^a-c\\s]+"), QStringLiteral("x bxy")));
+  EXPECT_EQ("0:3 4:3", findAll(QStringLiteral("\\w+"), QStringLiteral("foo bar")));
+  EXPECT_EQ("0:2", findAll(QStringLiteral("a{2}"), QStringLiteral("aaa")));
+  EXPECT_EQ("0:3 3:2", findAll(QStringLiteral("a{2,3}"), QStringLiteral("aaaaa")));
+  EXPECT_EQ("0:1 1:1", findAll(QStringLiteral("a+?"), QStringLiteral("aa")));
+  EXPECT_EQ("0:5", findAll(QStringLiteral("(?:ab)+c"), QStringLiteral("ababc")));
+  
+  // Alternatives are preferred in order, as in Perl.
+  EXPECT_EQ("0:1", findAll(QStringLiteral("a|ab"), QStringLiteral("ab")));
+  EXPECT_EQ("0:2", findAll(QStringLiteral("ab|a"), QStringLiteral("ab")));
+  
+  // Anchors
+  EXPECT_EQ("0:1 4:1", findAll(QStringLiteral("^x"), QStringLiteral("xyx\nx")));
+  EXPECT_EQ("2:1 4:1", findAll(QStringLiteral("x$"), QStringLiteral("xyx\nx")));
+  EXPECT_EQ("0:3", findAll(QStringLiteral("\\bfoo\\b"), QStringLiteral("foo foobar")));
+  
+  // Empty matches are not returned.
+  EXPECT_EQ("1:2", findAll(QStringLiteral("b*"), QStringLiteral("abb")));
+  
+  // Patterns that are pathological for backtracking engines
+  QString longText(10000, 'a');
+  EXPECT_EQ("", findAll(QStringLiteral("(a*)*b"), longText));
+  
+  // Invalid patterns
+  TextRegex regex;
+  QString errorMessage;
+  EXPECT_FALSE(regex.Compile(QStringLiteral("(ab"), true, &errorMessage));
+  EXPECT_FALSE(errorMessage.isEmpty());
+  EXPECT_FALSE(regex.Compile(QStringLiteral("ab)"), true));
+  EXPECT_FALSE(regex.Compile(QStringLiteral("*a"), true));
+  EXPECT_FALSE(regex.Compile(QStringLiteral("[b-a]"), true));
+  EXPECT_FALSE(regex.Compile(QStringLiteral("a{1000000}"), true));
+  EXPECT_FALSE(regex.IsValid());
+}
+
+TEST(Document, FindRegex) {
+  QString text = QStringLiteral("foo 12\nbar 345\nbaz");
+  TextRegex regex;
+  ASSERT_TRUE(regex.Compile(QStringLiteral("\\d+$"), true));
+  
+  for (int blockSize = 1; blockSize < 8; ++ blockSize) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), text);
+    
+    DocumentRange match = doc.FindRegex(regex, 0, true);
+    EXPECT_EQ(4, match.start.offset);
+    EXPECT_EQ(6, match.end.offset);
+    match = doc.FindRegex(regex, 5, true);
+    EXPECT_EQ(5, match.start.offset);
+    EXPECT_EQ(6, match.end.offset);
+    match = doc.FindRegex(regex, 7, true);
+    EXPECT_EQ(11, match.start.offset);
+    EXPECT_EQ(14, match.end.offset);
+    EXPECT_TRUE(doc.FindRegex(regex, 14, true).IsInvalid());
+    
+    match = doc.FindRegex(regex, doc.FullDocumentRange().end, false);
+    EXPECT_EQ(11, match.start.offset);
+    EXPECT_EQ(14, match.end.offset);
+    match = doc.FindRegex(regex, 13, false);
+    EXPECT_EQ(4, match.start.offset);
+    EXPECT_EQ(6, match.end.offset);
+    
+    std::vector<DocumentRange> matches;
+    doc.FindAllRegex(regex, doc.FullDocumentRange(), &matches);
+    ASSERT_EQ(2, matches.size());
+    EXPECT_EQ(11, matches[1].start.offset);
+  }
+}
+
+
+TEST(FileIdTable, SortedIncludes) {
+  FileIdTable& table = FileIdTable::Instance();
+  int idA = table.GetOrAddId(QStringLiteral("/cide_test/a.h"));
+  EXPECT_EQ(idA, table.GetOrAddId(QStringLiteral("/cide_test/a.h")));
+  EXPECT_EQ(idA, table.GetId(QStringLiteral("/cide_test/a.h")));
+  EXPECT_EQ(-1, table.GetId(QStringLiteral("/cide_test/unknown.h")));
+  EXPECT_EQ(QStringLiteral("/cide_test/a.h"), table.GetPath(idA));
+  
+  SourceFile source;
+  std::vector<QString> paths = {QStringLiteral("/cide_test/c.h"), QStringLiteral("/cide_test/a.h"), QStringLiteral("/cide_test/b.h"), QStringLiteral("/cide_test/c.h")};
+  table.GetOrAddSortedIds(paths, &source.includedFileIds);
+  ASSERT_EQ(3, source.includedFileIds.size());
+  EXPECT_TRUE(std::is_sorted(source.includedFileIds.begin(), source.includedFileIds.end()));
+  EXPECT_TRUE(source.Includes(QStringLiteral("/cide_test/b.h")));
+  EXPECT_FALSE(source.Includes(QStringLiteral("/cide_test/d.h")));
+  
+  std::vector<QString> includedPaths;
+  source.GetIncludedPaths(&includedPaths);
+  std::sort(includedPaths.begin(), includedPaths.end());
+  EXPECT_EQ(QStringLiteral("/cide_test/a.h"), includedPaths[0]);
+  EXPECT_EQ(QStringLiteral("/cide_test/c.h"), includedPaths[2]);
+}
+
+TEST(TrigramIndex, Trigrams) {
+  QByteArray text("Hello World\nHello");
+  std::vector<quint32> textTrigrams;
+  TrigramIndex::ExtractTrigrams(text.constData(), text.size(), &textTrigrams);
+  EXPECT_EQ(text.size() - 2 - 3, textTrigrams.size());  // "Hel", "ell", "llo" occur twice
+  EXPECT_TRUE(std::is_sorted(textTrigrams.begin(), textTrigrams.end()));
+  
+  std::vector<quint32> queryTrigrams;
+  ASSERT_TRUE(TrigramIndex::GetQueryTrigrams(QStringLiteral("WORLD"), Qt::CaseInsensitive, &queryTrigrams));
+  EXPECT_EQ(3, queryTrigrams.size());
+  EXPECT_TRUE(std::includes(textTrigrams.begin(), textTrigrams.end(), queryTrigrams.begin(), queryTrigrams.end()));
+  
+  ASSERT_TRUE(TrigramIndex::GetQueryTrigrams(QStringLiteral("Worlds"), Qt::CaseSensitive, &queryTrigrams));
+  EXPECT_FALSE(std::includes(textTrigrams.begin(), textTrigrams.end(), queryTrigrams.begin(), queryTrigrams.end()));
+  
+  EXPECT_FALSE(TrigramIndex::GetQueryTrigrams(QStringLiteral("ab"), Qt::CaseSensitive, &queryTrigrams));
+  EXPECT_FALSE(TrigramIndex::GetQueryTrigrams(QString::fromUtf8("h\u00e9llo"), Qt::CaseInsensitive, &queryTrigrams));
+}
+
+TEST(IncludeFileIndex, GetEntries) {
+  QDir tmpDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation));
+  QDir testDir(tmpDir.filePath("cide_include_file_index_test"));
+  testDir.removeRecursively();
+  ASSERT_TRUE(testDir.mkpath("a/sub"));
+  ASSERT_TRUE(testDir.mkpath("b"));
+  for (const char* path : {"a/x.h", "a/sub/z.h", "b/x.h", "b/y"}) {
+    QFile file(testDir.filePath(path));
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  }
+  
+  std::vector<QString> includeDirs = {testDir.filePath("a"), testDir.filePath("b")};
+  std::vector<IncludeFileIndex::Entry> entries;
+  IncludeFileIndex::Instance().GetEntries(includeDirs, QStringLiteral(""), &entries);
+  ASSERT_EQ(3, entries.size());
+  EXPECT_EQ(QStringLiteral("sub"), entries[0].name);
+  EXPECT_TRUE(entries[0].isDirectory);
+  EXPECT_EQ(QStringLiteral("x.h"), entries[1].name);
+  EXPECT_FALSE(entries[1].isDirectory);
+  EXPECT_EQ(QStringLiteral("y"), entries[2].name);
+  
+  IncludeFileIndex::Instance().GetEntries(includeDirs, QStringLiteral("sub/"), &entries);
+  ASSERT_EQ(1, entries.size());
+  EXPECT_EQ(QStringLiteral("z.h"), entries[0].name);
+  
+  IncludeFileIndex::Instance().GetEntries(includeDirs, QStringLiteral("missing/"), &entries);
+  EXPECT_TRUE(entries.empty());
+  
+  testDir.removeRecursively();
+}
+
+
+TEST(BuildDependencies, NinjaDependencyLog) {
+  QDir tmpDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation));
+  QDir testDir(tmpDir.filePath("cide_build_dependencies_ninja_test"));
+  testDir.removeRecursively();
+  ASSERT_TRUE(testDir.mkpath("build"));
+  ASSERT_TRUE(testDir.mkpath("src"));
+  for (const char* name : {"src/a.cc", "src/a.h", "src/b.h"}) {
+    QFile file(testDir.filePath(name));
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  }
+  QDir buildDir(testDir.filePath("build"));
+  
+  // Writes a log in version 4 of the format.
+  QByteArray log = "# ninjadeps\n";
+  auto appendUInt32 = [&](quint32 value) {
+    for (int i = 0; i < 4; ++ i) {
+      log += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+  };
+  appendUInt32(4);
+  int pathId = 0;
+  auto appendPathRecord = [&](const QByteArray& path) {
+    int paddedSize = (path.size() + 3) & ~3;
+    appendUInt32(paddedSize + 4);
+    log += path;
+    log += QByteArray(paddedSize - path.size(), '\0');
+    appendUInt32(~static_cast<quint32>(pathId));
+    ++ pathId;
+  };
+  auto appendDepsRecord = [&](quint32 outputId, const std::vector<quint32>& inputIds) {
+    appendUInt32(0x80000000u | (4 + 8 + 4 * inputIds.size()));
+    appendUInt32(outputId);
+    appendUInt32(1234);  // mtime
+    appendUInt32(0);
+    for (quint32 id : inputIds) {
+      appendUInt32(id);
+    }
+  };
+  appendPathRecord("a.o");  // 0
+  appendPathRecord("../src/a.cc");  // 1
+  appendPathRecord("../src/a.h");  // 2
+  appendPathRecord(testDir.filePath("src/b.h").toLocal8Bit());  // 3
+  appendPathRecord("../src/missing.h");  // 4
+  appendDepsRecord(0, {1, 2});
+  // A later record for the same output replaces the earlier one.
+  appendDepsRecord(0, {1, 2, 3, 4});
+  // A truncated record at the end is ignored.
+  appendUInt32(100);
+  log += "abc";
+  
+  QString logPath = buildDir.filePath(".ninja_deps");
+  QFile logFile(logPath);
+  ASSERT_TRUE(logFile.open(QIODevice::WriteOnly));
+  logFile.write(log);
+  logFile.close();
+  
+  BuildDependencyMap dependencies;
+  ASSERT_TRUE(ReadBuildDependencies(buildDir, &dependencies));
+  ASSERT_EQ(1, dependencies.size());
+  QString sourcePath = QFileInfo(testDir.filePath("src/a.cc")).canonicalFilePath();
+  ASSERT_EQ(1, dependencies.count(sourcePath));
+  const std::vector<QString>& sourceDependencies = dependencies[sourcePath];
+  ASSERT_EQ(2, sourceDependencies.size());
+  EXPECT_EQ(QFileInfo(testDir.filePath("src/a.h")).canonicalFilePath(), sourceDependencies[0]);
+  EXPECT_EQ(QFileInfo(testDir.filePath("src/b.h")).canonicalFilePath(), sourceDependencies[1]);
+  
+  // Logs with a wrong signature are rejected.
+  dependencies.clear();
+  log[0] = 'X';
+  ASSERT_TRUE(logFile.open(QIODevice::WriteOnly));
+  logFile.write(log);
+  logFile.close();
+  EXPECT_FALSE(ReadNinjaDependencyLog(logPath, buildDir, &dependencies));
+  EXPECT_TRUE(dependencies.empty());
+  
+  testDir.removeRecursively();
+}
+
+TEST(BuildDependencies, DepFile) {
+  QDir tmpDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation));
+  QDir testDir(tmpDir.filePath("cide_build_dependencies_depfile_test"));
+  testDir.removeRecursively();
+  ASSERT_TRUE(testDir.mkpath("build/sub"));
+  ASSERT_TRUE(testDir.mkpath("src/with space"));
+  for (const char* name : {"src/a.cc", "src/a.h", "src/with space/b.h"}) {
+    QFile file(testDir.filePath(name));
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  }
+  QDir buildDir(testDir.filePath("build"));
+  
+  QFile depFile(buildDir.filePath("sub/a.o.d"));
+  ASSERT_TRUE(depFile.open(QIODevice::WriteOnly));
+  depFile.write("sub/a.o: ../src/a.cc ../src/a.h \\\n"
+                " ../src/with\\ space/b.h ../src/missing.h\n"
+                "../src/a.h:\n");
+  depFile.close();
+  
+  BuildDependencyMap dependencies;
+  ASSERT_TRUE(ReadBuildDependencies(buildDir, &dependencies));
+  ASSERT_EQ(1, dependencies.size());
+  QString sourcePath = QFileInfo(testDir.filePath("src/a.cc")).canonicalFilePath();
+  ASSERT_EQ(1, dependencies.count(sourcePath));
+  const std::vector<QString>& sourceDependencies = dependencies[sourcePath];
+  ASSERT_EQ(2, sourceDependencies.size());
+  EXPECT_EQ(QFileInfo(testDir.filePath("src/a.h")).canonicalFilePath(), sourceDependencies[0]);
+  EXPECT_EQ(QFileInfo(testDir.filePath("src/with space/b.h")).canonicalFilePath(), sourceDependencies[1]);
+  
+  testDir.removeRecursively();
+}
+
+
+TEST(BuildOutput, LineRingBuffer) {
+  LineRingBuffer buffer;
+  QByteArray line;
+  EXPECT_FALSE(buffer.TakeLine(&line));
+  
+  // Add lines in chunks of varying sizes such that the ring buffer wraps around.
+  QByteArray text;
+  for (int i = 0; i < 200; ++ i) {
+    text += QByteArray("line ") + QByteArray::number(i) + "\n";
+  }
+  int lineIndex = 0;
+  int chunkSize = 1;
+  for (int offset = 0; offset < text.size(); offset += chunkSize, chunkSize = (chunkSize * 7) % 31 + 1) {
+    buffer.Append(text.constData() + offset, std::min<int>(chunkSize, text.size() - offset));
+    while (buffer.TakeLine(&line)) {
+      EXPECT_EQ(QByteArray("line ") + QByteArray::number(lineIndex), line);
+      ++ lineIndex;
+    }
+  }
+  EXPECT_EQ(200, lineIndex);
+  EXPECT_EQ(0, buffer.size());
+  
+  buffer.Append("partial", 7);
+  EXPECT_FALSE(buffer.TakeLine(&line));
+  EXPECT_EQ(7, buffer.size());
+}
+
+TEST(BuildOutput, Parser) {
+  BuildOutputParser parser;
+  parser.Reset(BuildOutputParser::Mode::Ninja);
+  parser.AddOutput("[1/10] Building CXX object a.cc.o\n../src/a.cc:3:5: err", false);
+  parser.AddOutput("or: expected ';'\n../src/a.cc:2:1: note: here\n[2/", false);
+  parser.WaitUntilIdle();
+  
+  BuildOutputUpdate update;
+  ASSERT_TRUE(parser.TakeUpdate(&update));
+  EXPECT_EQ(QStringLiteral("[1/10] Building CXX object a.cc.o\n../src/a.cc:3:5: error: expected ';'\n../src/a.cc:2:1: note: here\n"), update.outputText);
+  EXPECT_EQ(1, update.progressValue);
+  EXPECT_EQ(10, update.progressMaximum);
+  ASSERT_EQ(2, update.issues.size());
+  EXPECT_EQ(BuildIssue::Type::Error, update.issues[0].type);
+  EXPECT_EQ(BuildIssue::Type::Note, update.issues[1].type);
+  EXPECT_FALSE(parser.TakeUpdate(&update));
+  
+  parser.AddOutput("10] Linking\n", false);
+  parser.WaitUntilIdle();
+  ASSERT_TRUE(parser.TakeUpdate(&update));
+  EXPECT_EQ(2, update.progressValue);
+  EXPECT_TRUE(update.issues.empty());
+}
+
+
+TEST(GDBMIRecord, Parse) {
+  GDBMIRecord record;
+  QByteArray line = "12^done,threads=[{id=\"2\",target-id=\"Thread \\\"x\\\"\",frame={level=\"0\",args=[]}},{id=\"1\"}],current-thread-id=\"1\"";
+  ASSERT_TRUE(record.Parse(&line));
+  EXPECT_EQ(12, record.token());
+  EXPECT_EQ('^', record.type());
+  EXPECT_TRUE(record.IsClass("done"));
+  
+  int threads = record.Find(record.root(), "threads");
+  ASSERT_NE(-1, threads);
+  EXPECT_EQ(GDBMIRecord::ValueType::List, record.node(threads).type);
+  EXPECT_EQ(2, record.node(threads).childCount);
+  int thread = record.FirstChild(threads);
+  EXPECT_EQ(2, record.ChildInt(thread, "id"));
+  EXPECT_EQ(QStringLiteral("Thread \"x\""), record.ChildString(thread, "target-id"));
+  int frame = record.Find(thread, "frame");
+  ASSERT_NE(-1, frame);
+  EXPECT_EQ(0, record.ChildInt(frame, "level"));
+  EXPECT_EQ(0, record.node(record.Find(frame, "args")).childCount);
+  EXPECT_EQ(1, record.ChildInt(record.NextSibling(thread), "id"));
+  EXPECT_TRUE(record.IsKey(record.LastChild(record.root()), "current-thread-id"));
+  EXPECT_EQ(1, record.ChildInt(record.root(), "current-thread-id"));
+  
+  // Re-use the record for other lines
+  line = "~\"text\\n\"";
+  ASSERT_TRUE(record.Parse(&line));
+  EXPECT_EQ('~', record.type());
+  EXPECT_EQ(-1, record.token());
+  EXPECT_EQ(QStringLiteral("text\n"), record.StringValue(record.FirstChild(record.root())));
+  
+  line = "*stopped";
+  ASSERT_TRUE(record.Parse(&line));
+  EXPECT_TRUE(record.IsClass("stopped"));
+  EXPECT_EQ(-1, record.FirstChild(record.root()));
+  
+  line = "(gdb) ";
+  ASSERT_TRUE(record.Parse(&line));
+  EXPECT_EQ(0, record.type());
+  
+  line = "^unknown";
+  EXPECT_FALSE(record.Parse(&line));
+  line = "^done,list=[\"a\"";
+  EXPECT_FALSE(record.Parse(&line));
+}
+
+
+TEST(FuzzyTextMatch, Extension) {
+  // Appending characters to the text must not increase the number of matched
+  // characters by more than the number of appended characters, since
+  // incremental filtering relies on this.
+  std::vector<QString> items = {"Test", "tset", "SetFilterText", "setFilter", "TeSt_t", "a", ""};
+  std::vector<QString> texts = {"T", "Te", "Tes", "Test", "Tset", "Txst", "Testt", "SetFT", "setfiltertext", "eT"};
+  std::vector<QString> suffixes = {"t", "e", "xt", "Se"};
+  for (const QString& item : items) {
+    for (const QString& text : texts) {
+      FuzzyTextMatchScore score;
+      ComputeFuzzyTextMatch(text, item, &score);
+      for (const QString& suffix : suffixes) {
+        FuzzyTextMatchScore extendedScore;
+        ComputeFuzzyTextMatch(text + suffix, item, &extendedScore);
+        EXPECT_LE(extendedScore.matchedCharacters, score.matchedCharacters + suffix.size())
+            << "text: " << text.toStdString() << ", suffix: " << suffix.toStdString() << ", item: " << item.toStdString();
+      }
+    }
+  }
+}
+
+TEST(FuzzyTextMatch, LongItems) {
+  // The match lies beyond the first 64 characters of the item, which the
+  // matcher examines in blocks of 64 characters.
+  QString item = QString(100, 'x') + QStringLiteral("Test") + QString(30, 'y');
+  
+  FuzzyTextMatchScore score;
+  ComputeFuzzyTextMatch(QStringLiteral("Test"), item, &score);
+  EXPECT_EQ(4, score.matchedCharacters);
+  EXPECT_EQ(0, score.matchErrors);
+  EXPECT_TRUE(score.matchedCase);
+  EXPECT_EQ(100, score.matchedStartIndex);
+  
+  ComputeFuzzyTextMatch(QStringLiteral("tSet"), FoldCaseForFuzzyTextMatch(QStringLiteral("tSet")), item, FoldCaseForFuzzyTextMatch(item), &score);
+  EXPECT_EQ(4, score.matchedCharacters);
+  EXPECT_EQ(1, score.matchErrors);
+  EXPECT_FALSE(score.matchedCase);
+  EXPECT_EQ(100, score.matchedStartIndex);
+  
+  EXPECT_EQ(QString::fromUtf8("\xc3\xa4" "bc_d"), FoldCaseForFuzzyTextMatch(QString::fromUtf8("\xc3\x84" "Bc_D")));
+}
+
+TEST(TextUtils, CharacterScanning) {
+  InitializeSymbolArray();
+  
+  // The text contains runs that are longer and shorter than the 8 characters
+  // that are compared at once, and non-ASCII characters.
+  QString text = QStringLiteral("identifier_with_digits_0123 = a;\n\t  \t    x\n\n") +
+                 QString::fromUtf8("\xc3\xa4hnlich_\xc3\xbc ++++++++++ \n") +
+                 QString(20, ' ') + QStringLiteral("end");
+  const QChar* data = text.constData();
+  int size = text.size();
+  
+  for (int start = 0; start <= size; ++ start) {
+    int expectedNewline = text.indexOf('\n', start);
+    EXPECT_EQ(expectedNewline, FindNewline(data, start, size)) << "start: " << start;
+    EXPECT_EQ(text.midRef(start).count('\n'), CountNewlines(data, start, size)) << "start: " << start;
+    
+    if (start == size) {
+      break;
+    }
+    int charType = GetCharType(text[start]);
+    for (bool stopAtNewline : {false, true}) {
+      int expectedEnd = start;
+      while (expectedEnd < size && GetCharType(text[expectedEnd]) == charType && !(stopAtNewline && text[expectedEnd] == '\n')) {
+        ++ expectedEnd;
+      }
+      EXPECT_EQ(expectedEnd, FindCharTypeRunEnd(data, start, size, charType, stopAtNewline)) << "start: " << start;
+      
+      int expectedStart = start + 1;
+      while (expectedStart > 0 && GetCharType(text[expectedStart - 1]) == charType && !(stopAtNewline && text[expectedStart - 1] == '\n')) {
+        -- expectedStart;
+      }
+      EXPECT_EQ(expectedStart, FindCharTypeRunStart(data, 0, start + 1, charType, stopAtNewline)) << "start: " << start;
+    }
+  }
+}
+
+TEST(Document, RangeForWordAt) {
+  InitializeSymbolArray();
+  
+  std::vector<int> blockSizes = {2, 3, 128};
+  for (int blockSize : blockSizes) {
+    Document doc(blockSize);
+    doc.Replace(doc.FullDocumentRange(), QStringLiteral("int long_identifier_name = 42;  \n  value->x"));
+    
+    auto wordAt = [&](int characterOffset) {
+      DocumentRange range = doc.RangeForWordAt(characterOffset);
+      return std::make_pair(range.start.offset, range.end.offset);
+    };
+    EXPECT_EQ(std::make_pair(0, 3), wordAt(1)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(4, 24), wordAt(4)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(4, 24), wordAt(23)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(25, 26), wordAt(25)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(29, 30), wordAt(29)) << "blockSize: " << blockSize;
+    // Whitespace is not extended over newlines.
+    EXPECT_EQ(std::make_pair(30, 32), wordAt(31)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(30, 33), wordAt(32)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(33, 35), wordAt(34)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(35, 40), wordAt(37)) << "blockSize: " << blockSize;
+    EXPECT_EQ(std::make_pair(42, 43), wordAt(42)) << "blockSize: " << blockSize;
+    EXPECT_FALSE(doc.RangeForWordAt(43).IsValid()) << "blockSize: " << blockSize;
+  }
+}
+
+
+TEST(CodeCompletion, Sorting) {
+  for (int testIndex = 0; testIndex < 2; ++ testIndex) {
+    std::vector<CompletionItem> items;
+    
+    items.emplace_back();
+    items.back().filterText = (testIndex == 0) ? "Test" : "Something";
+    
+    items.emplace_back();
+    items.back().filterText = (testIndex == 0) ? "Something" : "Test";
+    
+    CodeCompletionWidget* widget = new CodeCompletionWidget(std::move(items), nullptr, QPoint(0, 0), nullptr);
+    widget->SetFilterText(QStringLiteral("TeAst"));
+    std::vector<CompletionItem> sortedItems = widget->GetSortedItems();
+    
+    EXPECT_EQ(2, sortedItems.size());
+    
+    // "Te[A]st" matched with "Test"
+    EXPECT_EQ(4, sortedItems[0].matchScore.matchedCharacters);
+    EXPECT_EQ(1, sortedItems[0].matchScore.matchErrors);
+    EXPECT_TRUE(sortedItems[0].matchScore.matchedCase);
+    EXPECT_EQ(0, sortedItems[0].matchScore.matchedStartIndex);
+    
+    // "Te" matched with "et"
+    EXPECT_EQ(2, sortedItems[1].matchScore.matchedCharacters);
     EXPECT_EQ(1, sortedItems[1].matchScore.matchErrors);
     EXPECT_FALSE(sortedItems[1].matchScore.matchedCase);
     EXPECT_EQ(3, sortedItems[1].matchScore.matchedStartIndex);
@@ -606,6 +2350,154 @@ TEST(CodeCompletion, Sorting) {
   }
 }
 
+TEST(CodeCompletion, BackgroundScoring) {
+  // Use enough items to make the widget score them in the background.
+  std::vector<CompletionItem> items;
+  for (int i = 0; i < 5000; ++ i) {
+    items.emplace_back();
+    items.back().filterText = QStringLiteral("Item%1").arg(i);
+  }
+  items.emplace_back();
+  items.back().filterText = QStringLiteral("Test");
+  
+  CodeCompletionWidget* widget = new CodeCompletionWidget(std::move(items), nullptr, QPoint(0, 0), nullptr);
+  
+  // Start a job that gets canceled by the next call.
+  widget->SetFilterText(QStringLiteral("Item"));
+  widget->SetFilterText(QStringLiteral("Tst"));
+  EXPECT_TRUE(widget->IsFilterPending());
+  
+  QEventLoop eventLoop;
+  while (widget->IsFilterPending()) {
+    eventLoop.processEvents();
+  }
+  
+  std::vector<CompletionItem> sortedItems = widget->GetSortedItems();
+  ASSERT_FALSE(sortedItems.empty());
+  EXPECT_EQ(QStringLiteral("Test"), sortedItems[0].filterText);
+  
+  delete widget;
+}
+
+
+TEST(ClangTUPool, WaitForReturnedTU) {
+  ClangTUPool pool(1);
+  unsigned int returnCounter = pool.GetReturnCounter();
+  std::shared_ptr<ClangTU> TU = pool.TakeMostUpToDateTU();
+  ASSERT_TRUE(TU != nullptr);
+  EXPECT_TRUE(pool.TakeMostUpToDateTU() == nullptr);
+  
+  // Without a returned TU, waiting times out.
+  EXPECT_FALSE(pool.WaitForReturnedTU(returnCounter, std::chrono::steady_clock::now() + std::chrono::milliseconds(10)));
+  
+  // Returning the TU from another thread wakes up the waiting thread.
+  std::thread putThread([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pool.PutTU(TU, false);
+  });
+  EXPECT_TRUE(pool.WaitForReturnedTU(returnCounter, std::chrono::steady_clock::now() + std::chrono::seconds(10)));
+  putThread.join();
+  EXPECT_EQ(1, pool.GetNumFreeTUs());
+  
+  // A TU that was returned before starting to wait is not missed.
+  EXPECT_TRUE(pool.WaitForReturnedTU(returnCounter, std::chrono::steady_clock::now()));
+}
+
+TEST(ClangTUPool, TakeStaleTUForCatchUp) {
+  ClangTUPool pool(2);
+  
+  // Uninitialized TUs cannot be caught up.
+  EXPECT_TRUE(pool.TakeStaleTUForCatchUp() == nullptr);
+  
+  // Set up two TUs for the same command line that were parsed for different
+  // versions of the document. No libclang TU is required for this.
+  std::shared_ptr<const CompileCommandLine> commandLine =
+      std::make_shared<CompileCommandLine>(std::vector<QByteArray>{"-DTEST"});
+  std::shared_ptr<ClangTU> stale = pool.TakeMostUpToDateTU();
+  std::shared_ptr<ClangTU> fresh = pool.TakeMostUpToDateTU();
+  ASSERT_TRUE(stale != nullptr);
+  ASSERT_TRUE(fresh != nullptr);
+  stale->Set(nullptr, commandLine);
+  fresh->Set(nullptr, commandLine);
+  stale->SetParseStamp(1);
+  fresh->SetParseStamp(2);
+  stale->SetTextChangeCounter(3);
+  fresh->SetTextChangeCounter(5);
+  pool.PutTU(stale, false);
+  pool.PutTU(fresh, false);
+  
+  // The stale TU is returned.
+  std::shared_ptr<ClangTU> TU = pool.TakeStaleTUForCatchUp();
+  EXPECT_EQ(stale, TU);
+  EXPECT_EQ(1, pool.GetNumFreeTUs());
+  
+  // Once both TUs are for the same version, there is nothing to catch up.
+  TU->SetTextChangeCounter(5);
+  pool.PutTU(TU, false);
+  EXPECT_TRUE(pool.TakeStaleTUForCatchUp() == nullptr);
+  EXPECT_EQ(2, pool.GetNumFreeTUs());
+}
+
+TEST(Project, CompileSettingsHash) {
+  CompileSettings a;
+  a.language = CompileSettings::Language::CXX;
+  a.includes = {QStringLiteral("/include")};
+  a.defines = {QStringLiteral("DEBUG")};
+  CompileSettings b = a;
+  EXPECT_TRUE(a == b);
+  EXPECT_EQ(a.Hash(), b.Hash());
+  
+  // Moving an entry to another list must change the hash.
+  b.includes.clear();
+  b.systemIncludes = {QStringLiteral("/include")};
+  EXPECT_FALSE(a == b);
+  EXPECT_NE(a.Hash(), b.Hash());
+}
+
+TEST(Project, CompileSettingsPool) {
+  std::shared_ptr<CompileSettings> a(new CompileSettings());
+  a->language = CompileSettings::Language::CXX;
+  a->defines = {QStringLiteral("DEBUG")};
+  std::shared_ptr<CompileSettings> b(new CompileSettings(*a));
+  std::shared_ptr<CompileSettings> c(new CompileSettings(*a));
+  c->defines.clear();
+  
+  // Equal settings are interned to the same instance.
+  CompileSettingsPool pool;
+  EXPECT_EQ(a, pool.Intern(a));
+  EXPECT_EQ(a, pool.Intern(b));
+  EXPECT_EQ(c, pool.Intern(c));
+  EXPECT_EQ(2, pool.size());
+  
+  // Settings that are only referenced by the pool are removed.
+  c.reset();
+  pool.RemoveUnused();
+  EXPECT_EQ(1, pool.size());
+  EXPECT_EQ(a, pool.Intern(b));
+}
+
+TEST(Project, CompileSettingsCommandLine) {
+  CompileSettings settings;
+  settings.language = CompileSettings::Language::CXX;
+  settings.defines = {QStringLiteral("DEBUG")};
+  
+  std::shared_ptr<const CompileCommandLine> a = settings.GetCommandLine(true, QStringLiteral("/a.cc"), nullptr);
+  std::shared_ptr<const CompileCommandLine> b = settings.GetCommandLine(true, QStringLiteral("/b.cc"), nullptr);
+  std::shared_ptr<const CompileCommandLine> header = settings.GetCommandLine(true, QStringLiteral("/a.h"), nullptr);
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, header);
+  EXPECT_FALSE(CompileCommandLine::Equal(a, header));
+  EXPECT_TRUE(a->args == settings.BuildCommandLineArgs(true, QStringLiteral("/a.cc"), nullptr));
+  
+  // A modified copy must not reuse the command lines of the original.
+  CompileSettings copy = settings;
+  copy.defines.clear();
+  std::shared_ptr<const CompileCommandLine> copyCommandLine = copy.GetCommandLine(true, QStringLiteral("/a.cc"), nullptr);
+  EXPECT_FALSE(CompileCommandLine::Equal(a, copyCommandLine));
+  
+  CompileSettings equalCopy = settings;
+  EXPECT_TRUE(CompileCommandLine::Equal(a, equalCopy.GetCommandLine(true, QStringLiteral("/a.cc"), nullptr)));
+}
 
 TEST(Project, Reconfigure) {
   // Create a project in a temporary directory
@@ -681,6 +2573,16 @@ TEST(Project, Reconfigure) {
   newSourceFile.write(newSourceFileText.toUtf8());
   newSourceFile.close();
   
+  // The settings of the new file are guessed (and the guess gets cached) as
+  // long as it is not part of the project.
+  QString newSourcePath = QFileInfo(newSourceFile.fileName()).canonicalFilePath();
+  bool isGuess;
+  int guessQuality;
+  RunInQtThreadBlocking([&]() {
+    project->FindSettingsForFile(newSourcePath, &isGuess, &guessQuality);
+  });
+  EXPECT_TRUE(isGuess);
+  
   // Reconfigure the project
   QString errorReason;
   bool result;
@@ -692,6 +2594,12 @@ TEST(Project, Reconfigure) {
   }
   ASSERT_TRUE(result) << "Reconfiguring failed.";
   
+  // The cached guess must not be used anymore.
+  RunInQtThreadBlocking([&]() {
+    project->FindSettingsForFile(newSourcePath, &isGuess, &guessQuality);
+  });
+  EXPECT_FALSE(isGuess);
+  
   // Verify that the initial source file is still marked as indexed (taken over
   // from the initial configuration), and the new file is not indexed yet.
   for (int targetIdx = 0; targetIdx < project->GetNumTargets(); ++ targetIdx) {
@@ -705,6 +2613,17 @@ TEST(Project, Reconfigure) {
       }
     }
   }
+  
+  // Verify that the compile settings are found for the new source file, and
+  // are guessed for other files in the project directory.
+  bool isGuess;
+  int guessQuality;
+  EXPECT_TRUE(project->FindSettingsForFile(newSourceFile.fileName(), &isGuess, &guessQuality) != nullptr);
+  EXPECT_FALSE(isGuess);
+  EXPECT_TRUE(project->GetSourceFile(newSourceFile.fileName()) != nullptr);
+  EXPECT_TRUE(project->FindSettingsForFile(projectDir.filePath("other.cc"), &isGuess, &guessQuality) != nullptr);
+  EXPECT_TRUE(isGuess);
+  EXPECT_GE(guessQuality, projectDir.path().size());
 }
 
 
@@ -746,6 +2665,78 @@ TEST(RunInQtThreadBlocking, Abort) {
   });
 }
 
+/// Tests that functions posted to the Qt thread run in order, and that
+/// RunInQtThreadAsync() returns their results.
+TEST(RunInQtThreadAsync, Order) {
+  std::vector<int> order;
+  std::future<int> lastResult;
+  std::thread workerThread([&]() {
+    for (int i = 0; i < 100; ++ i) {
+      PostToQtThread([&order, i]() {
+        order.push_back(i);
+      });
+    }
+    lastResult = RunInQtThreadAsync([&]() {
+      return static_cast<int>(order.size());
+    });
+  });
+  workerThread.join();
+  
+  // All functions must run when processing the events in the Qt thread.
+  QEventLoop eventLoop;
+  while (lastResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+    eventLoop.processEvents();
+  }
+  EXPECT_EQ(100, lastResult.get());
+  ASSERT_EQ(100, order.size());
+  for (int i = 0; i < 100; ++ i) {
+    EXPECT_EQ(i, order[i]);
+  }
+}
+
+
+/// Tests that MainWindow's path and document lookups follow opening and
+/// closing documents.
+TEST(MainWindow, DocumentLookups) {
+  QString path = QDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation)).filePath("cide_document_lookup_test.txt");
+  QFile file(path);
+  ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  file.write("text\n");
+  file.close();
+  QString canonicalPath = QFileInfo(path).canonicalFilePath();
+  
+  std::shared_ptr<MainWindow> mainWindow;
+  RunInQtThreadBlocking([&]() {
+    mainWindow.reset(new MainWindow(), [&](MainWindow* ptr) {
+      RunInQtThreadBlocking([&]() {
+        delete ptr;
+      });
+    });
+  });
+  
+  RunInQtThreadBlocking([&]() {
+    EXPECT_FALSE(mainWindow->IsFileOpen(canonicalPath));
+    EXPECT_EQ(mainWindow->GetDocumentForPath(canonicalPath), nullptr);
+    
+    mainWindow->Open(path);
+    std::shared_ptr<Document> document = mainWindow->GetDocumentForPath(canonicalPath);
+    ASSERT_NE(document, nullptr);
+    EXPECT_EQ(document, mainWindow->GetCurrentDocument());
+    EXPECT_EQ(mainWindow->GetWidgetForDocument(document.get()), mainWindow->GetCurrentDocumentWidget());
+    
+    // Opening the file again must activate the existing tab.
+    mainWindow->New();
+    mainWindow->Open(path);
+    EXPECT_EQ(mainWindow->GetNumDocuments(), 2);
+    EXPECT_EQ(document, mainWindow->GetCurrentDocument());
+    
+    mainWindow->CloseDocument();
+    EXPECT_FALSE(mainWindow->IsFileOpen(canonicalPath));
+    EXPECT_EQ(mainWindow->GetWidgetForDocument(document.get()), nullptr);
+  });
+  
+  QFile::remove(path);
+}
 
 /// Tests that a C++ file can be successfully parsed.
 TEST(Parsing, ParseFile) {
@@ -823,3 +2814,802 @@ TEST(Parsing, ParseFile) {
     EXPECT_EQ(document->GetContexts().begin()->name, "main");
   });
 }
+
+
+TEST(ClangReferenceMap, MatchesFindReferencesInFile) {
+  QString path = QDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation)).filePath("cide_reference_map_test.cc");
+  QByteArray text =
+      "struct Point { int x; };\n"
+      "int Sum(const Point& p, int factor) {\n"
+      "  int result = p.x * factor;\n"
+      "  return result + p.x;\n"
+      "}\n";
+  QFile file(path);
+  ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  file.write(text);
+  file.close();
+  
+  ClangIndex index;
+  const char* args[] = {"-std=c++11"};
+  CXTranslationUnit clangTU = nullptr;
+  ASSERT_EQ(CXError_Success, clang_parseTranslationUnit2(
+      index.index(), path.toUtf8().data(), args, 1, nullptr, 0,
+      clang_defaultEditingTranslationUnitOptions(), &clangTU));
+  CXFile clangFile = clang_getFile(clangTU, path.toUtf8().data());
+  
+  // Collect the references while visiting the AST for highlighting
+  std::vector<unsigned> lineOffsets = {0};
+  for (int i = 0; i < text.size() - 1; ++ i) {
+    if (text[i] == '\n') {
+      lineOffsets.push_back(i + 1);
+    }
+  }
+  HighlightBuffer highlights;
+  ClangReferenceMap referenceMap(clangFile);
+  HighlightingASTVisitorData visitorData;
+  visitorData.highlights = &highlights;
+  visitorData.TU = clangTU;
+  visitorData.file = clangFile;
+  visitorData.lineOffsets = &lineOffsets;
+  visitorData.prevCursor = clang_getNullCursor();
+  visitorData.perVariableColoring = false;
+  visitorData.referenceMap = &referenceMap;
+  VisitMainFileAST_AddHighlightingAndContexts(&visitorData);
+  
+  auto getStartOffsets = [](const std::vector<CXSourceRange>& ranges) {
+    std::vector<unsigned> offsets;
+    for (const CXSourceRange& range : ranges) {
+      unsigned offset;
+      clang_getFileLocation(clang_getRangeStart(range), nullptr, nullptr, nullptr, &offset);
+      offsets.push_back(offset);
+    }
+    std::sort(offsets.begin(), offsets.end());
+    return offsets;
+  };
+  
+  // Uses of "x", "factor", and "result"
+  std::pair<int, int> lineAndColumns[] = {{3, 18}, {3, 22}, {4, 10}};
+  for (const std::pair<int, int>& lineAndColumn : lineAndColumns) {
+    CXCursor cursor = clang_getCursor(clangTU, clang_getLocation(clangTU, clangFile, lineAndColumn.first, lineAndColumn.second));
+    
+    std::vector<CXSourceRange> mapRanges;
+    ASSERT_TRUE(referenceMap.Find(cursor, &mapRanges));
+    
+    std::vector<CXSourceRange> clangRanges;
+    CXCursorAndRangeVisitor referencesVisitor;
+    referencesVisitor.context = &clangRanges;
+    referencesVisitor.visit = [](void* context, CXCursor /*cursor*/, CXSourceRange range) {
+      static_cast<std::vector<CXSourceRange>*>(context)->push_back(range);
+      return CXVisit_Continue;
+    };
+    clang_findReferencesInFile(cursor, clangFile, referencesVisitor);
+    
+    EXPECT_EQ(getStartOffsets(clangRanges), getStartOffsets(mapRanges));
+    EXPECT_GE(mapRanges.size(), 2);
+  }
+  
+  clang_disposeTranslationUnit(clangTU);  QFile::remove(path);
+}
+
+TEST(ClangHighlighting, PerVariableColorsAreKeptOnEdits) {
+  QString path = QDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation)).filePath("cide_variable_colors_test.cc");
+  
+  // Highlights the given text with a pool of four colors and returns the
+  // assigned color indices.
+  auto highlight = [&](const QByteArray& text, const VariableColorIndices* previousIndices, VariableColorIndices* indices) {
+    QFile file(path);
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.write(text);
+    file.close();
+    
+    ClangIndex index;
+    const char* args[] = {"-std=c++11"};
+    CXTranslationUnit clangTU = nullptr;
+    ASSERT_EQ(CXError_Success, clang_parseTranslationUnit2(
+        index.index(), path.toUtf8().data(), args, 1, nullptr, 0,
+        clang_defaultEditingTranslationUnitOptions(), &clangTU));
+    
+    std::vector<unsigned> lineOffsets = {0};
+    for (int i = 0; i < text.size() - 1; ++ i) {
+      if (text[i] == '\n') {
+        lineOffsets.push_back(i + 1);
+      }
+    }
+    HighlightBuffer highlights;
+    HighlightingASTVisitorData visitorData;
+    visitorData.highlights = &highlights;
+    visitorData.TU = clangTU;
+    visitorData.file = clang_getFile(clangTU, path.toUtf8().data());
+    visitorData.lineOffsets = &lineOffsets;
+    visitorData.prevCursor = clang_getNullCursor();
+    visitorData.perVariableColoring = true;
+    visitorData.variableColors = {qRgb(255, 0, 0), qRgb(0, 255, 0), qRgb(0, 0, 255), qRgb(255, 255, 0)};
+    visitorData.previousVariableColorIndices = previousIndices;
+    VisitMainFileAST_AddHighlightingAndContexts(&visitorData);
+    
+    ASSERT_EQ(1, visitorData.variableColorIndices.byFunction.size());
+    *indices = visitorData.variableColorIndices;
+    clang_disposeTranslationUnit(clangTU);
+  };
+  
+  VariableColorIndices oldIndices;
+  highlight(
+      "int Func(int a) {\n"
+      "  int b = a;\n"
+      "  int c = b;\n"
+      "  return c;\n"
+      "}\n", nullptr, &oldIndices);
+  const std::unordered_map<QByteArray, int>& oldColors = oldIndices.byFunction.begin()->second;
+  ASSERT_EQ(3, oldColors.size());
+  EXPECT_NE(oldColors.at("a"), oldColors.at("b"));
+  EXPECT_NE(oldColors.at("a"), oldColors.at("c"));
+  EXPECT_NE(oldColors.at("b"), oldColors.at("c"));
+  
+  // Insert a variable before the others. They must keep their colors, and the
+  // new variable must get the remaining one.
+  VariableColorIndices newIndices;
+  highlight(
+      "int Func(int a) {\n"
+      "  int z = 0;\n"
+      "  int b = a;\n"
+      "  int c = b;\n"
+      "  return c + z;\n"
+      "}\n", &oldIndices, &newIndices);
+  const std::unordered_map<QByteArray, int>& newColors = newIndices.byFunction.begin()->second;
+  ASSERT_EQ(4, newColors.size());
+  EXPECT_EQ(oldColors.at("a"), newColors.at("a"));
+  EXPECT_EQ(oldColors.at("b"), newColors.at("b"));
+  EXPECT_EQ(oldColors.at("c"), newColors.at("c"));
+  EXPECT_EQ(6 - oldColors.at("a") - oldColors.at("b") - oldColors.at("c"), newColors.at("z"));
+  
+  QFile::remove(path);
+}
+
+/// Tests storing and loading indexing results with the USRIndexCache.
+TEST(USRIndexCache, SaveAndLoad) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString sourceFilePath = tmpDir.filePath("cide_test_usr_index_cache.cc");
+  QFile sourceFile(sourceFilePath);
+  ASSERT_TRUE(sourceFile.open(QIODevice::WriteOnly | QIODevice::Text));
+  sourceFile.write("int something() {return 33;}\n");
+  sourceFile.close();
+  QString canonicalPath = QFileInfo(sourceFilePath).canonicalFilePath();
+  
+  std::vector<QByteArray> commandLineArgs = {"-fspell-checking", "-DTEST"};
+  
+  USRIndexCache::Entry entry;
+  entry.includes.emplace_back(canonicalPath, QFileInfo(canonicalPath).lastModified().toSecsSinceEpoch());
+  entry.USRs[canonicalPath].emplace_back("c:@F@something#", USRDecl("int something()", 1, 5, true, CXCursor_FunctionDecl, 4, 9));
+  ASSERT_TRUE(USRIndexCache::Instance().Save(canonicalPath, commandLineArgs, entry));
+  
+  // Load the entry again
+  USRIndexCache::Entry loadedEntry;
+  ASSERT_TRUE(USRIndexCache::Instance().Load(canonicalPath, commandLineArgs, &loadedEntry));
+  ASSERT_EQ(1, loadedEntry.includes.size());
+  EXPECT_EQ(entry.includes[0], loadedEntry.includes[0]);
+  ASSERT_EQ(1, loadedEntry.USRs.size());
+  const auto& loadedUSRs = loadedEntry.USRs[canonicalPath];
+  ASSERT_EQ(1, loadedUSRs.size());
+  EXPECT_EQ("c:@F@something#", loadedUSRs[0].first);
+  EXPECT_EQ("int something()", loadedUSRs[0].second.spelling);
+  EXPECT_EQ(1, loadedUSRs[0].second.line);
+  EXPECT_EQ(5, loadedUSRs[0].second.column);
+  EXPECT_TRUE(loadedUSRs[0].second.isDefinition);
+  EXPECT_EQ(CXCursor_FunctionDecl, loadedUSRs[0].second.kind);
+  EXPECT_EQ(4, loadedUSRs[0].second.namePos);
+  EXPECT_EQ(9, loadedUSRs[0].second.nameSize);
+  
+  // The entry must not be used for different command-line arguments
+  std::vector<QByteArray> otherCommandLineArgs = {"-fspell-checking", "-DOTHER"};
+  EXPECT_FALSE(USRIndexCache::Instance().Load(canonicalPath, otherCommandLineArgs, &loadedEntry));
+  
+  // The entry must not be used anymore once the file is gone (and the
+  // FileStatCache has been notified about it)
+  ASSERT_TRUE(QFile::remove(sourceFilePath));
+  FileStatCache::Instance().Invalidate(canonicalPath);
+  EXPECT_FALSE(USRIndexCache::Instance().Load(canonicalPath, commandLineArgs, &loadedEntry));
+  
+  USRIndexCache::Instance().Remove(canonicalPath);
+}
+
+TEST(CommentMarkerIndex, FindCommentMarkers) {
+  InitializeSymbolArray();
+  
+  QByteArray text =
+      "// TODO: first\n"
+      "int a = 0;  /* FIXME second\n"
+      "   HACK third */\n"
+      "const char* s = \"TODO not in a comment\";\n"
+      "char c = '\"';  // TODOS is no marker, TODO(name) is\n"
+      "int n = 1'000;  // \xc3\xa4 TODO\n"
+      "auto r = R\"x(// TODO not a comment)x\";\n";
+  std::vector<CommentMarker> markers;
+  CommentMarkerIndex::FindCommentMarkers(text, QStringList() << "TODO" << "FIXME" << "HACK", &markers);
+  ASSERT_EQ(5, markers.size());
+  
+  EXPECT_EQ(0, markers[0].line);
+  EXPECT_EQ(3, markers[0].column);
+  EXPECT_EQ("TODO", markers[0].marker);
+  EXPECT_EQ("first", markers[0].text);
+  
+  EXPECT_EQ(1, markers[1].line);
+  EXPECT_EQ(15, markers[1].column);
+  EXPECT_EQ("FIXME", markers[1].marker);
+  EXPECT_EQ("second", markers[1].text);
+  
+  EXPECT_EQ(2, markers[2].line);
+  EXPECT_EQ(3, markers[2].column);
+  EXPECT_EQ("HACK", markers[2].marker);
+  EXPECT_EQ("third", markers[2].text);
+  
+  EXPECT_EQ(4, markers[3].line);
+  EXPECT_EQ(38, markers[3].column);
+  EXPECT_EQ("(name) is", markers[3].text);
+  
+  // The column is given in UTF-16 code units.
+  EXPECT_EQ(5, markers[4].line);
+  EXPECT_EQ(21, markers[4].column);
+  EXPECT_EQ("", markers[4].text);
+}
+
+TEST(CommentMarkerIndex, UpdateFiles) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString sourceFilePath = tmpDir.filePath("cide_test_comment_marker_index.cc");
+  QFile sourceFile(sourceFilePath);
+  ASSERT_TRUE(sourceFile.open(QIODevice::WriteOnly | QIODevice::Text));
+  sourceFile.write("int x;  // TODO: test\n");
+  sourceFile.close();
+  QString canonicalPath = QFileInfo(sourceFilePath).canonicalFilePath();
+  
+  // Only test with a marker that is enabled in the settings.
+  QStringList markerWords = Settings::Instance().GetCommentMarkers();
+  if (!markerWords.contains("TODO")) {
+    ASSERT_TRUE(QFile::remove(sourceFilePath));
+    return;
+  }
+  
+  std::vector<std::pair<QString, qint64>> files = {std::make_pair(canonicalPath, static_cast<qint64>(1))};
+  CommentMarkerSet markers;
+  CommentMarkerIndex::Instance().UpdateFiles(files, nullptr, &markers);
+  EXPECT_EQ(markerWords, markers.markerWords);
+  ASSERT_EQ(1, markers.files.size());
+  ASSERT_EQ(1, markers.files[canonicalPath].size());
+  EXPECT_EQ("test", markers.files[canonicalPath][0].text);
+  
+  std::vector<std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>> indexedFiles;
+  CommentMarkerIndex::Instance().GetAllMarkers(&indexedFiles);
+  auto it = std::find_if(indexedFiles.begin(), indexedFiles.end(), [&](const std::pair<QString, std::shared_ptr<const std::vector<CommentMarker>>>& item) {
+    return item.first == canonicalPath;
+  });
+  ASSERT_TRUE(it != indexedFiles.end());
+  EXPECT_EQ(1, it->second->size());
+  
+  // For a new modification time, known markers (as loaded from the
+  // USRIndexCache) are used instead of scanning the file.
+  files[0].second = 2;
+  CommentMarkerSet knownMarkers;
+  knownMarkers.markerWords = markerWords;
+  CommentMarkerIndex::Instance().UpdateFiles(files, &knownMarkers, &markers);
+  EXPECT_TRUE(markers.files.empty());
+  
+  ASSERT_TRUE(QFile::remove(sourceFilePath));
+}
+
+TEST(FileStatCache, ModificationTimes) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = QFileInfo(tmpDir.filePath("cide_test_file_stat_cache.txt")).absoluteFilePath();
+  QFile::remove(filePath);
+  FileStatCache& cache = FileStatCache::Instance();
+  cache.Invalidate(filePath);
+  EXPECT_EQ(-1, cache.GetModificationTime(filePath));
+  
+  QFile file(filePath);
+  ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  file.write("test");
+  file.close();
+  
+  // The cached result stays valid until the entry is invalidated (or expires)
+  EXPECT_EQ(-1, cache.GetModificationTime(filePath));
+  cache.Invalidate(filePath);
+  EXPECT_EQ(QFileInfo(filePath).lastModified().toSecsSinceEpoch(), cache.GetModificationTime(filePath));
+  
+  ASSERT_TRUE(QFile::remove(filePath));
+  cache.InvalidateAll();
+  EXPECT_EQ(-1, cache.GetModificationTime(filePath));
+}
+
+TEST(CPUBudget, QoSClasses) {
+  CPUBudget& budget = CPUBudget::Instance();
+  
+  // Take all free slots
+  int acquiredCount = 0;
+  while (budget.TryAcquire(CPUBudget::QoS::Normal)) {
+    ++ acquiredCount;
+  }
+  EXPECT_GE(budget.GetUsedSlotCount(), budget.GetSlotCount());
+  
+  // Interactive work is admitted nevertheless
+  ASSERT_TRUE(budget.Acquire(CPUBudget::QoS::Interactive));
+  ++ acquiredCount;
+  
+  // Waiting for a slot can be cancelled
+  std::atomic<bool> cancel(true);
+  EXPECT_FALSE(budget.Acquire(CPUBudget::QoS::Normal, &cancel));
+  EXPECT_FALSE(budget.Acquire(CPUBudget::QoS::Background, &cancel));
+  
+  // Free all but one slot. Background work leaves the last free slot to the
+  // other classes.
+  for (int i = 0; i < acquiredCount; ++ i) {
+    budget.Release(CPUBudget::QoS::Normal);
+  }
+  int remainingCount = 0;
+  while (budget.GetUsedSlotCount() < budget.GetSlotCount() - 1 &&
+         budget.TryAcquire(CPUBudget::QoS::Normal)) {
+    ++ remainingCount;
+  }
+  EXPECT_FALSE(budget.TryAcquire(CPUBudget::QoS::Background));
+  EXPECT_TRUE(budget.TryAcquire(CPUBudget::QoS::Normal));
+  ++ remainingCount;
+  for (int i = 0; i < remainingCount; ++ i) {
+    budget.Release(CPUBudget::QoS::Normal);
+  }
+  
+  // While a build runs, background work is throttled to a single slot
+  if (budget.GetSlotCount() >= 3) {
+    budget.SetBuildRunning(true);
+    EXPECT_TRUE(budget.TryAcquire(CPUBudget::QoS::Background));
+    EXPECT_FALSE(budget.TryAcquire(CPUBudget::QoS::Background));
+    budget.SetBuildRunning(false);
+    EXPECT_TRUE(budget.TryAcquire(CPUBudget::QoS::Background));
+    budget.Release(CPUBudget::QoS::Background);
+    budget.Release(CPUBudget::QoS::Background);
+  }
+}
+
+TEST(ParseThreadPool, FullParseProfileForRecentDocuments) {
+  ParseThreadPool& pool = ParseThreadPool::Instance();
+  QStringList openDocuments;
+  for (int i = 0; i <= ParseThreadPool::kNumRecentDocumentsWithFullParse; ++ i) {
+    openDocuments.push_back(QStringLiteral("/cide_test_document_%1.cc").arg(i));
+  }
+  
+  // Activate all documents in turn. The first one then drops out of the
+  // recently current documents.
+  for (const QString& path : openDocuments) {
+    pool.SetOpenAndCurrentDocuments(path, openDocuments);
+    EXPECT_TRUE(pool.UseFullParseProfileFor(path));
+  }
+  EXPECT_FALSE(pool.UseFullParseProfileFor(openDocuments.front()));
+  EXPECT_TRUE(pool.UseFullParseProfileFor(openDocuments.back()));
+  
+  // Closed documents are removed.
+  QString closedDocument = openDocuments.takeLast();
+  pool.SetOpenAndCurrentDocuments(openDocuments.back(), openDocuments);
+  EXPECT_FALSE(pool.UseFullParseProfileFor(closedDocument));
+  
+  pool.SetOpenAndCurrentDocuments(QString(), QStringList());
+  EXPECT_FALSE(pool.UseFullParseProfileFor(openDocuments.back()));
+}
+
+TEST(BackgroundReclaimer, DestroysInBackgroundThread) {
+  std::atomic<bool> destroyed(false);
+  std::thread::id destroyingThread;
+  std::shared_ptr<int> object(new int(0), [&](int* pointer) {
+    destroyingThread = std::this_thread::get_id();
+    delete pointer;
+    destroyed = true;
+  });
+  
+  BackgroundReclaimer::Instance().Release(std::move(object));
+  EXPECT_FALSE(object);
+  for (int i = 0; i < 1000 && !destroyed; ++ i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_TRUE(destroyed);
+  EXPECT_NE(std::this_thread::get_id(), destroyingThread);
+}
+
+TEST(MappedTextFile, LinesAndFind) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString filePath = tmpDir.filePath("cide_test_mapped_text_file.txt");
+  
+  // Write more lines than fit into one stride of the line index.
+  constexpr int kLineCount = 3 * MappedTextFile::kLineIndexStride + 10;
+  QByteArray content;
+  for (int line = 0; line < kLineCount; ++ line) {
+    content += "Line " + QByteArray::number(line) + ((line % 2 == 0) ? "\n" : "\r\n");
+  }
+  QFile file(filePath);
+  ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+  file.write(content);
+  file.close();
+  
+  MappedTextFile mapped;
+  ASSERT_TRUE(mapped.Open(filePath));
+  EXPECT_EQ(content.size(), mapped.size());
+  bool complete = false;
+  for (int i = 0; i < 1000 && !complete; ++ i) {
+    mapped.GetIndexedLineCount(&complete);
+    if (!complete) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ASSERT_TRUE(complete);
+  
+  // The trailing newline starts an empty last line, as in documents.
+  ASSERT_EQ(kLineCount + 1, mapped.GetIndexedLineCount());
+  for (int line = 0; line < kLineCount; ++ line) {
+    EXPECT_EQ(QStringLiteral("Line %1").arg(line), mapped.GetLineText(line, 100));
+    EXPECT_EQ(line, mapped.LineForOffset(mapped.LineStart(line) + 2));
+  }
+  EXPECT_EQ(QString(), mapped.GetLineText(kLineCount, 100));
+  EXPECT_EQ(QStringLiteral("Li"), mapped.GetLineText(0, 2));
+  EXPECT_EQ(-1, mapped.LineStart(kLineCount + 1));
+  
+  qint64 lineStart = mapped.LineStart(700);
+  EXPECT_EQ(lineStart, mapped.Find("Line 700", 0, true, true));
+  EXPECT_EQ(lineStart, mapped.Find("line 700", 0, true, false));
+  EXPECT_EQ(-1, mapped.Find("line 700", 0, true, true));
+  EXPECT_EQ(lineStart, mapped.Find("Line 700", content.size(), false, true));
+  EXPECT_EQ(-1, mapped.Find("Line 700", lineStart + 1, true, true));
+  
+  QFile::remove(filePath);
+}
+
+/// Tests saving the highlighting of a document with the HighlightCache and
+/// loading it again.
+TEST(HighlightCache, SaveAndLoad) {
+  QString canonicalPath = QStringLiteral("/cide_test_highlight_cache/file.cc");
+  QString text = QStringLiteral("int something() {\n  return 33;\n}\n");
+  std::vector<QByteArray> commandLineArgs = {"-DTEST"};
+  
+  Document document;
+  document.Replace(document.FullDocumentRange(), text);
+  document.AddHighlightRange(DocumentRange(0, 3), false, qRgb(0, 0, 255), true);
+  document.AddHighlightRange(DocumentRange(4, 13), false, qRgb(255, 0, 0), false);
+  document.AddContext(QStringLiteral("something"), QStringLiteral("int something()"), DocumentRange(4, 13), DocumentRange(0, 32));
+  ASSERT_TRUE(HighlightCache::Instance().Save(canonicalPath, commandLineArgs, &document));
+  
+  Document loadedDocument;
+  loadedDocument.Replace(loadedDocument.FullDocumentRange(), text);
+  HighlightBuffer highlights;
+  ASSERT_TRUE(HighlightCache::Instance().Load(canonicalPath, commandLineArgs, &loadedDocument, &highlights));
+  loadedDocument.ApplyHighlightBuffer(&highlights, /*layer*/ 0);
+  
+  Document::CharacterAndStyleIterator it(&document, 0);
+  Document::CharacterAndStyleIterator loadedIt(&loadedDocument, 0);
+  while (it.IsValid()) {
+    ASSERT_TRUE(loadedIt.IsValid());
+    EXPECT_EQ(it.GetStyle().textColor.rgb(), loadedIt.GetStyle().textColor.rgb());
+    EXPECT_EQ(it.GetStyle().bold, loadedIt.GetStyle().bold);
+    ++ it;
+    ++ loadedIt;
+  }
+  ASSERT_EQ(1u, loadedDocument.GetContexts().size());
+  EXPECT_EQ(QStringLiteral("something"), loadedDocument.GetContexts().begin()->name);
+  EXPECT_EQ(0, loadedDocument.GetContexts().begin()->range.start.offset);
+  EXPECT_EQ(32, loadedDocument.GetContexts().begin()->range.end.offset);
+  
+  // The entry must not be used for different command-line arguments or a
+  // different text
+  std::vector<QByteArray> otherCommandLineArgs = {"-DOTHER"};
+  HighlightBuffer otherHighlights;
+  EXPECT_FALSE(HighlightCache::Instance().Load(canonicalPath, otherCommandLineArgs, &loadedDocument, &otherHighlights));
+  loadedDocument.Replace(DocumentRange(0, 0), QStringLiteral(" "));
+  EXPECT_FALSE(HighlightCache::Instance().Load(canonicalPath, commandLineArgs, &loadedDocument, &otherHighlights));
+  
+  HighlightCache::Instance().Remove(canonicalPath);
+  EXPECT_FALSE(HighlightCache::Instance().Load(canonicalPath, commandLineArgs, &document, &otherHighlights));
+}
+
+/// Tests saving a parsed TU with the TUCache and loading it again.
+TEST(TUCache, SaveAndLoad) {
+  QString tmpPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
+  QDir tmpDir(tmpPath);
+  ASSERT_TRUE(tmpDir.mkpath("."));
+  QString sourceFilePath = tmpDir.filePath("cide_test_tu_cache.cc");
+  QFile sourceFile(sourceFilePath);
+  ASSERT_TRUE(sourceFile.open(QIODevice::WriteOnly | QIODevice::Text));
+  sourceFile.write("int something() {return 33;}\n");
+  sourceFile.close();
+  QString canonicalPath = QFileInfo(sourceFilePath).canonicalFilePath();
+  
+  std::vector<QByteArray> commandLineArgs = {"-DTEST"};
+  std::vector<const char*> commandLineArgPtrs = {commandLineArgs[0].constData()};
+  
+  // Parse the file
+  std::shared_ptr<ClangTU> TU(new ClangTU());
+  CXTranslationUnit clangTU;
+  ASSERT_EQ(CXError_Success, clang_parseTranslationUnit2(
+      TU->index(), canonicalPath.toLocal8Bit().data(),
+      commandLineArgPtrs.data(), commandLineArgPtrs.size(),
+      nullptr, 0, CXTranslationUnit_None, &clangTU));
+  TU->Set(clangTU, std::make_shared<CompileCommandLine>(std::vector<QByteArray>(commandLineArgs)));
+  TU->GetIncludes().emplace_back(canonicalPath.toUtf8(), QFileInfo(canonicalPath).lastModified().toSecsSinceEpoch());
+  TU->SetParsedFromFilesOnDisk(true);
+  
+  // Save it, and wait until it can be loaded
+  TUCache::Instance().Remove(canonicalPath);
+  TUCache::Instance().SaveAsync(canonicalPath, TU);
+  TU.reset();
+  
+  ClangIndex index;
+  CXTranslationUnit loadedTU = nullptr;
+  for (int i = 0; i < 1000; ++ i) {
+    if (TUCache::Instance().Load(canonicalPath, commandLineArgs, index.index(), &loadedTU)) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(loadedTU != nullptr);
+  CXFile file = clang_getFile(loadedTU, canonicalPath.toUtf8().data());
+  EXPECT_TRUE(file != nullptr);
+  CXCursor cursor = clang_getCursor(loadedTU, clang_getLocation(loadedTU, file, 1, 5));
+  EXPECT_EQ(CXCursor_FunctionDecl, clang_getCursorKind(cursor));
+  clang_disposeTranslationUnit(loadedTU);
+  
+  // The entry must not be used for different command-line arguments
+  std::vector<QByteArray> otherCommandLineArgs = {"-DOTHER"};
+  EXPECT_FALSE(TUCache::Instance().Load(canonicalPath, otherCommandLineArgs, index.index(), &loadedTU));
+  
+  // The entry must not be used anymore once the file is gone (and the
+  // FileStatCache has been notified about it)
+  ASSERT_TRUE(QFile::remove(sourceFilePath));
+  FileStatCache::Instance().Invalidate(canonicalPath);
+  EXPECT_FALSE(TUCache::Instance().Load(canonicalPath, commandLineArgs, index.index(), &loadedTU));
+  
+  TUCache::Instance().Remove(canonicalPath);
+}
+
+TEST(USRStorage, LookupUSRs) {
+  QString headerPath = "/cide_test_usr_storage/header.h";
+  QString sourcePath = "/cide_test_usr_storage/source.cc";
+  QString otherPath = "/cide_test_usr_storage/other.cc";
+  
+  USRStorage& storage = USRStorage::Instance();
+  storage.Lock();
+  storage.AddUSRMapReference(headerPath);
+  storage.AddUSRMapReference(sourcePath);
+  storage.AddUSRMapReference(otherPath);
+  
+  USRsByFile USRs;
+  USRs[headerPath].emplace_back("c:@F@something#", USRDecl("int something()", 1, 5, false, CXCursor_FunctionDecl, 4, 9));
+  USRs[sourcePath].emplace_back("c:@F@something#", USRDecl("int something()", 3, 5, true, CXCursor_FunctionDecl, 4, 9));
+  USRs[sourcePath].emplace_back("c:@F@other#", USRDecl("int other()", 4, 5, true, CXCursor_FunctionDecl, 4, 5));
+  storage.StoreUSRsForTU(sourcePath, "hash", {}, USRs);
+  USRsByFile otherUSRs;
+  otherUSRs[otherPath].emplace_back("c:@F@something#", USRDecl("int something()", 7, 5, true, CXCursor_FunctionDecl, 4, 9));
+  storage.StoreUSRsForTU(otherPath, "hash", {}, otherUSRs);
+  storage.Unlock();
+  
+  // Only the decls in the relevant files must be returned
+  std::vector<std::pair<QString, USRDecl>> foundDecls;
+  storage.LookupUSRs("c:@F@something#", {headerPath, sourcePath}, &foundDecls);
+  ASSERT_EQ(2, foundDecls.size());
+  std::sort(foundDecls.begin(), foundDecls.end(), [](const std::pair<QString, USRDecl>& a, const std::pair<QString, USRDecl>& b) {
+    return a.second.line < b.second.line;
+  });
+  EXPECT_EQ(headerPath, foundDecls[0].first);
+  EXPECT_EQ(sourcePath, foundDecls[1].first);
+  EXPECT_TRUE(foundDecls[1].second.isDefinition);
+  
+  // The global symbol table snapshot must have been published on unlocking
+  std::vector<std::shared_ptr<const GlobalSymbolFile>> symbolFiles;
+  storage.GetGlobalSymbols(&symbolFiles);
+  int numSourceSymbols = -1;
+  for (const auto& file : symbolFiles) {
+    if (file->path == sourcePath) {
+      numSourceSymbols = file->symbols.size();
+    }
+  }
+  EXPECT_EQ(2, numSourceSymbols);
+  
+  // Re-storing the USRs of the source file must replace its index entries
+  storage.Lock();
+  USRs[sourcePath].clear();
+  storage.StoreUSRsForTU(sourcePath, "hash", {}, USRs);
+  storage.Unlock();
+  foundDecls.clear();
+  storage.LookupUSRs("c:@F@something#", {headerPath, sourcePath, otherPath}, &foundDecls);
+  EXPECT_EQ(2, foundDecls.size());
+  foundDecls.clear();
+  storage.LookupUSRs("c:@F@other#", {headerPath, sourcePath, otherPath}, &foundDecls);
+  EXPECT_EQ(0, foundDecls.size());
+  
+  // Removing a file's USRMap must remove its index entries
+  storage.Lock();
+  storage.RemoveUSRMapReference(otherPath);
+  storage.Unlock();
+  foundDecls.clear();
+  storage.LookupUSRs("c:@F@something#", {headerPath, sourcePath, otherPath}, &foundDecls);
+  ASSERT_EQ(1, foundDecls.size());
+  EXPECT_EQ(headerPath, foundDecls[0].first);
+  
+  storage.Lock();
+  storage.RemoveUSRMapReference(headerPath);
+  storage.RemoveUSRMapReference(sourcePath);
+  storage.Unlock();
+}
+
+TEST(USRStorage, LookupUSRReferences) {
+  QString headerPath = "/cide_test_usr_references/header.h";
+  QString sourcePath = "/cide_test_usr_references/source.cc";
+  QString otherPath = "/cide_test_usr_references/other.cc";
+  
+  USRStorage& storage = USRStorage::Instance();
+  storage.Lock();
+  storage.AddUSRMapReference(headerPath);
+  storage.AddUSRMapReference(sourcePath);
+  storage.AddUSRMapReference(otherPath);
+  
+  USRsByFile USRs;
+  USRs[headerPath].emplace_back("c:@F@something#", USRDecl("int something()", 1, 5, false, CXCursor_FunctionDecl, 4, 9));
+  USRReferencesByFile references;
+  references[sourcePath] = {"c:@F@something#"};
+  storage.StoreUSRsForTU(sourcePath, "hash", {}, USRs, references, true);
+  USRReferencesByFile otherReferences;
+  otherReferences[otherPath] = {"c:@F@other#"};
+  storage.StoreUSRsForTU(otherPath, "hash", {}, USRsByFile(), otherReferences, false);
+  storage.Unlock();
+  
+  // Only the source file references the USR. The other file must be reported
+  // as possibly referencing it since its references are incomplete.
+  std::unordered_set<QString> referencingFiles;
+  std::unordered_set<QString> filesWithIncompleteReferences;
+  storage.LookupUSRReferences("c:@F@something#", {headerPath, sourcePath, otherPath}, &referencingFiles, &filesWithIncompleteReferences);
+  EXPECT_EQ(std::unordered_set<QString>({sourcePath}), referencingFiles);
+  EXPECT_EQ(1, filesWithIncompleteReferences.count(otherPath));
+  EXPECT_EQ(0, filesWithIncompleteReferences.count(sourcePath));
+  
+  // Re-storing the source file without the reference must remove it from the
+  // index
+  storage.Lock();
+  references[sourcePath].clear();
+  storage.StoreUSRsForTU(sourcePath, "hash", {}, USRs, references, true);
+  storage.Unlock();
+  referencingFiles.clear();
+  storage.LookupUSRReferences("c:@F@something#", {headerPath, sourcePath, otherPath}, &referencingFiles, &filesWithIncompleteReferences);
+  EXPECT_TRUE(referencingFiles.empty());
+  
+  storage.Lock();
+  storage.RemoveUSRMapReference(headerPath);
+  storage.RemoveUSRMapReference(sourcePath);
+  storage.RemoveUSRMapReference(otherPath);
+  storage.Unlock();
+}
+
+TEST(USRStorage, InternedStringPool) {
+  InternedStringPool<QByteArray> pool;
+  QByteArray a = pool.Intern(QByteArray("c:@F@something#"));
+  QByteArray b = pool.Intern(QByteArray("c:@F@") + QByteArray("something#"));
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(a.constData(), b.constData());
+  EXPECT_EQ(1, pool.size());
+  
+  // Strings that are only referenced by the pool get freed eventually
+  a = QByteArray();
+  b = QByteArray();
+  for (int i = 0; i < 10000; ++ i) {
+    pool.Intern(QByteArray::number(i));
+  }
+  EXPECT_LT(pool.size(), 10000);
+}
+
+TEST(PreambleCache, ExtractIncludePrefix) {
+  QString text =
+      "// Copyright header\n"
+      "/* Block\n"
+      "   comment */\n"
+      "\n"
+      "#include <vector>\n"
+      "#  include \"cide_test_nonexistent_header.h\"  // comment\n"
+      "#include <QString>\n"
+      "\n"
+      "#define SOMETHING\n"
+      "#include <map>\n";
+  EXPECT_EQ(QByteArray(
+      "#include <vector>\n"
+      "#include \"cide_test_nonexistent_header.h\"\n"
+      "#include <QString>\n"),
+      PreambleCache::ExtractIncludePrefix(text, "/"));
+  
+  // Too short include prefixes are not used
+  EXPECT_TRUE(PreambleCache::ExtractIncludePrefix("#include <vector>\nint a;\n", "/").isEmpty());
+}
+
+TEST(GetInfoCache, LeastRecentlyUsed) {
+  GetInfoCache cache(2);
+  QString html;
+  QUrl url;
+  EXPECT_FALSE(cache.Lookup("a", &html, &url));
+  
+  cache.Insert("a", "<b>a</b>", QUrl("https://a.example"));
+  cache.Insert("b", "<b>b</b>", QUrl());
+  ASSERT_TRUE(cache.Lookup("a", &html, &url));
+  EXPECT_EQ(QStringLiteral("<b>a</b>"), html);
+  EXPECT_EQ(QUrl("https://a.example"), url);
+  
+  // Inserting a third entry removes the least recently used one ("b")
+  cache.Insert("c", "<b>c</b>", QUrl());
+  EXPECT_TRUE(cache.Lookup("a", &html, &url));
+  EXPECT_FALSE(cache.Lookup("b", &html, &url));
+  EXPECT_TRUE(cache.Lookup("c", &html, &url));
+  
+  // Replacing an entry
+  cache.Insert("c", "<b>c2</b>", QUrl());
+  ASSERT_TRUE(cache.Lookup("c", &html, &url));
+  EXPECT_EQ(QStringLiteral("<b>c2</b>"), html);
+  EXPECT_TRUE(cache.Lookup("a", &html, &url));
+}
+
+TEST(IndexingStatistics, SlowestFiles) {
+  IndexingStatistics& statistics = IndexingStatistics::Instance();
+  statistics.Clear();
+  
+  statistics.AddIndexedFile("/a.cc", 10, 100, 5, false);
+  statistics.AddIndexedFile("/b.cc", 30, 200, 50, false);
+  statistics.AddIndexedFile("/c.cc", 20, 300, 10, true);
+  EXPECT_EQ(3, statistics.GetIndexedFileCount());
+  EXPECT_DOUBLE_EQ(60, statistics.GetTotalDurationMs());
+  EXPECT_GT(statistics.GetFilesPerSecond(), 0);
+  
+  std::vector<IndexingStatistics::FileEntry> slowest = statistics.GetSlowestFiles(2);
+  ASSERT_EQ(2, slowest.size());
+  EXPECT_EQ(QStringLiteral("/b.cc"), slowest[0].canonicalPath);
+  EXPECT_EQ(50, slowest[0].includeCount);
+  EXPECT_EQ(QStringLiteral("/c.cc"), slowest[1].canonicalPath);
+  EXPECT_TRUE(slowest[1].fromCache);
+  
+  // Re-indexing a file replaces its previous result
+  statistics.AddIndexedFile("/b.cc", 5, 200, 50, false);
+  EXPECT_EQ(3, statistics.GetIndexedFileCount());
+  slowest = statistics.GetSlowestFiles(10);
+  ASSERT_EQ(3, slowest.size());
+  EXPECT_EQ(QStringLiteral("/c.cc"), slowest[0].canonicalPath);
+  EXPECT_EQ(QStringLiteral("/b.cc"), slowest[2].canonicalPath);
+  
+  statistics.Clear();
+  EXPECT_EQ(0, statistics.GetIndexedFileCount());
+}
+
+TEST(LexicalHighlighter, HighlightAndUpdate) {
+  Document doc;
+  doc.Replace(doc.FullDocumentRange(), QStringLiteral("int a;\nchar* s = \"/*\";\n/* c\nd */ int b;\n#include <vector>\n"));
+  auto isNonCode = [&](int offset) {
+    return Document::CharacterAndStyleIterator(&doc, offset).GetStyleOfLayer(0).isNonCodeRange;
+  };
+  
+  LexicalHighlighter highlighter;
+  highlighter.HighlightDocument(&doc);
+  EXPECT_TRUE(highlighter.IsActive(&doc));
+  EXPECT_EQ(Settings::Instance().GetConfiguredTextStyle(Settings::TextStyle::LanguageKeyword).textColor,
+            Document::CharacterAndStyleIterator(&doc, 0).GetStyleOfLayer(0).textColor);
+  EXPECT_FALSE(isNonCode(0));   // int
+  EXPECT_TRUE(isNonCode(18));   // string literal
+  EXPECT_FALSE(isNonCode(21));  // ;
+  EXPECT_TRUE(isNonCode(28));   // continued block comment
+  EXPECT_FALSE(isNonCode(33));  // int
+  EXPECT_TRUE(isNonCode(50));   // include path
+  
+  // Opening a block comment in the first line affects the following lines
+  doc.Replace(DocumentRange(0, 0), QStringLiteral("/*"));
+  highlighter.TextReplaced(&doc, DocumentRange(0, 0), 2, doc.textChangeCounter());
+  EXPECT_TRUE(highlighter.HighlightChangedLines(&doc));
+  EXPECT_TRUE(isNonCode(2));
+  EXPECT_TRUE(isNonCode(9));
+  EXPECT_FALSE(isNonCode(35));
+  EXPECT_TRUE(highlighter.IsActive(&doc));
+  EXPECT_FALSE(highlighter.HighlightChangedLines(&doc));
+  
+  // Other highlighting (from parsing) deactivates the highlighter
+  doc.AddHighlightRange(DocumentRange(0, 1), false, qRgb(255, 0, 0), true);
+  EXPECT_FALSE(highlighter.IsActive(&doc));
+}
@@ -4,8 +4,25 @@
 
 #include "cide/text_block.h"
 
+#include <algorithm>
+
 #include <QStringBuilder>
 
+#include "cide/text_utils.h"
+
+/// Returns the number of bytes that the UTF-16 code unit @p c contributes to
+/// the UTF-8 encoding of the text. Each half of a surrogate pair contributes
+/// two bytes, such that the pair yields the four bytes of its encoding.
+static inline int Utf8LengthOfCodeUnit(QChar c) {
+  ushort unicode = c.unicode();
+  if (unicode < 0x80) {
+    return 1;
+  } else if (unicode < 0x800 || c.isSurrogate()) {
+    return 2;
+  } else {
+    return 3;
+  }
+}
 
 TextBlock::TextBlock() {
   mLineAttributes.emplace_back(-1, 0);
@@ -21,11 +38,12 @@ TextBlock::TextBlock(const QString& text, bool isFirst) {
     mLineAttributes.emplace_back(-1, 0);
   }
   
-  for (int c = 0, size = mText.size(); c < size; ++ c) {
-    if (mText[c] == '\n') {
-      mLineAttributes.emplace_back(c, 0);
-    }
+  const QChar* data = mText.constData();
+  int size = mText.size();
+  for (int c = FindNewline(data, 0, size); c >= 0; c = FindNewline(data, c + 1, size)) {
+    mLineAttributes.emplace_back(c, 0);
   }
+  UpdateUtf8Mapping();
   
   for (int layer = 0; layer < kLayerCount; ++ layer) {
     mStyleRanges[layer].emplace_back(0, 0);
@@ -83,7 +101,7 @@ void TextBlock::Replace(const DocumentRange& range, const QString& newText, Text
 //   qDebug() << "oldLineRangeStart" << oldLineRangeStart;
 //   qDebug() << "oldLineRangeEnd" << oldLineRangeEnd;
   
-  int numNewNewlines = newText.count('\n');
+  int numNewNewlines = CountNewlines(newText.constData(), 0, newText.size());
   
 //   qDebug() << "numOldNewlines" << numOldNewlines;
 //   qDebug() << "numNewNewlines" << numNewNewlines;
@@ -107,18 +125,13 @@ void TextBlock::Replace(const DocumentRange& range, const QString& newText, Text
     int cursor = 0;
     for (int a = oldLineRangeStart; a <= lastResultingLine; ++ a) {
       // Find the next newline in the replaced text.
-      while (true) {
-        if (newText[cursor] == '\n') {
-          mLineAttributes[a].offset = cursor + range.start.offset;
-//           qDebug() << "Newline" << a << "within replaced range has been set to offset" << mLineAttributes[a].offset;
-          if (numOldNewlines != numNewNewlines) {
-            mLineAttributes[a].attributes = 0;
-          }
-          ++ cursor;
-          break;
-        }
-        ++ cursor;
+      cursor = FindNewline(newText.constData(), cursor, newText.size());
+      mLineAttributes[a].offset = cursor + range.start.offset;
+//       qDebug() << "Newline" << a << "within replaced range has been set to offset" << mLineAttributes[a].offset;
+      if (numOldNewlines != numNewNewlines) {
+        mLineAttributes[a].attributes = 0;
       }
+      ++ cursor;
     }
   }
   
@@ -377,66 +390,74 @@ void TextBlock::Replace(const DocumentRange& range, const QString& newText, Text
   
   // Update the text
   mText = mText.left(range.start.offset) % newText % mText.right(mText.size() - range.end.offset);
+  UpdateUtf8Mapping();
 }
 
 void TextBlock::InsertStyleRange(const DocumentRange& range, int highlightRangeIndex, int layer) {
   auto& styleRanges = mStyleRanges[layer];
   
-  for (std::size_t i = 0, end = styleRanges.size(); i < end; ++ i) {
-    // Skip over existing ranges that end before the new range starts
-    DocumentLocation otherRangeEnd = (i == end - 1) ? mText.size() : styleRanges[i + 1].start;
-    if (otherRangeEnd <= range.start) {
-      continue;
+  // Find the existing range that contains the start of the new range (ranges
+  // that end before the new range starts are skipped over).
+  int styleIndex = FindStyleIndexForCharacter(range.start.offset, layer);
+  if (styleIndex < 0) {
+    return;
+  }
+  std::size_t i = styleIndex;
+  std::size_t end = styleRanges.size();
+  DocumentLocation otherRangeEnd = (i == end - 1) ? mText.size() : styleRanges[i + 1].start;
+  if (otherRangeEnd <= range.start) {
+    return;
+  }
+  
+  if (styleRanges[i].start == range.start) {
+    // Insert the new range before the current one
+    styleRanges.insert(styleRanges.begin() + i, StyleRange(range.start, highlightRangeIndex));
+    ++ i;
+  } else {
+    // Insert the new range after the current one.
+    styleRanges.insert(styleRanges.begin() + (i + 1), StyleRange(range.start, highlightRangeIndex));
+    if (otherRangeEnd > range.end) {
+      // A part of the other range remains on the right side. Insert a new
+      // range for this.
+      styleRanges.insert(styleRanges.begin() + (i + 2), StyleRange(range.end, styleRanges[i].rangeIndex));
+      return;
     }
-    
-    if (styleRanges[i].start == range.start) {
-      // Insert the new range before the current one
-      styleRanges.insert(styleRanges.begin() + i, StyleRange(range.start, highlightRangeIndex));
-      ++ i;
-    } else {
-      // Insert the new range after the current one.
-      styleRanges.insert(styleRanges.begin() + (i + 1), StyleRange(range.start, highlightRangeIndex));
-      if (otherRangeEnd > range.end) {
-        // A part of the other range remains on the right side. Insert a new
-        // range for this.
-        styleRanges.insert(styleRanges.begin() + (i + 2), StyleRange(range.end, styleRanges[i].rangeIndex));
-        break;
-      }
-      i += 2;
+    i += 2;
+  }
+  
+  // i is now at the first range following the inserted one. Check whether any
+  // following ranges need to be deleted or shrunk.
+  std::size_t firstFollowingRange = i;
+  ++ end;
+  for (; i < end; ++ i) {
+    if (styleRanges[i].start >= range.end) {
+      break;
     }
+    otherRangeEnd = (i == end - 1) ? mText.size() : styleRanges[i + 1].start;
     
-    // i is now at the first range following the inserted one. Check whether any
-    // following ranges need to be deleted or shrunk.
-    std::size_t firstFollowingRange = i;
-    ++ end;
-    for (; i < end; ++ i) {
-      if (styleRanges[i].start >= range.end) {
-        break;
-      }
-      otherRangeEnd = (i == end - 1) ? mText.size() : styleRanges[i + 1].start;
-      
-      if (otherRangeEnd == range.end) {
-        styleRanges.erase(styleRanges.begin() + firstFollowingRange,
-                          styleRanges.begin() + (i + 1));
-        break;
-      } else if (otherRangeEnd > range.end) {
-        styleRanges[i].start = range.end;
-        styleRanges.erase(styleRanges.begin() + firstFollowingRange,
-                          styleRanges.begin() + i);
-        break;
-      }
+    if (otherRangeEnd == range.end) {
+      styleRanges.erase(styleRanges.begin() + firstFollowingRange,
+                        styleRanges.begin() + (i + 1));
+      break;
+    } else if (otherRangeEnd > range.end) {
+      styleRanges[i].start = range.end;
+      styleRanges.erase(styleRanges.begin() + firstFollowingRange,
+                        styleRanges.begin() + i);
+      break;
     }
-    
-    break;
   }
 }
 
-int TextBlock::FindStyleIndexForCharacter(int characterOffset, int layer) {
-  auto& styleRanges = mStyleRanges[layer];
-  for (int i = styleRanges.size() - 1; i >= 0; -- i) {
-    if (styleRanges[i].start.offset <= characterOffset) {
-      return i;
-    }
+int TextBlock::FindStyleIndexForCharacter(int characterOffset, int layer) const {
+  // Find the last range that starts at or before the character.
+  const auto& styleRanges = mStyleRanges[layer];
+  auto it = std::upper_bound(
+      styleRanges.begin(), styleRanges.end(), characterOffset,
+      [](int offset, const StyleRange& style) {
+        return offset < style.start.offset;
+      });
+  if (it != styleRanges.begin()) {
+    return static_cast<int>(it - styleRanges.begin()) - 1;
   }
   qDebug() << "Error: FindStyleIndexForCharacter() did not find a range for character offset" << characterOffset << ", this should never happen.";
   return -1;
@@ -447,71 +468,85 @@ void TextBlock::ClearStyleRanges(int layer) {
   mStyleRanges[layer].emplace_back(0, 0);
 }
 
+void TextBlock::SetStyleRanges(std::vector<StyleRange>* styleRanges, int layer) {
+  mStyleRanges[layer].swap(*styleRanges);
+}
+
 QString TextBlock::TextForRange(const DocumentRange& range) {
   return mText.mid(range.start.offset, range.end.offset - range.start.offset);
 }
 
-std::vector<std::shared_ptr<TextBlock>> TextBlock::Split(int desiredBlockSize) {
+std::vector<std::shared_ptr<TextBlock>> TextBlock::Split(int desiredBlockSize, const std::shared_ptr<TextBlockPool>& pool) {
   int oldSize = mText.size();
   int numBlocks = std::max(2, (mText.size() + desiredBlockSize / 2) / desiredBlockSize);
   
   std::vector<std::shared_ptr<TextBlock>> result(numBlocks - 1);
   for (int i = result.size() - 1; i >= 0; -- i) {
-    int pos = ((i + 1) * oldSize) / numBlocks;
-    int posNext = ((i + 2) * oldSize) / numBlocks;
-    
-    result[i].reset(new TextBlock(QStringLiteral(""), false));
-    TextBlock* block = result[i].get();
-    
-    block->mText = mText.mid(pos, posNext - pos);
+    result[i] = TextBlockPool::MakeBlock(pool, QStringLiteral(""), false);
+    MoveTailTo(((i + 1) * oldSize) / numBlocks, result[i].get());
+  }
+  
+  UpdateUtf8Mapping();
+  return result;
+}
+
+std::shared_ptr<TextBlock> TextBlock::SplitAt(int offset, const std::shared_ptr<TextBlockPool>& pool) {
+  std::shared_ptr<TextBlock> result = TextBlockPool::MakeBlock(pool, QStringLiteral(""), false);
+  MoveTailTo(offset, result.get());
+  UpdateUtf8Mapping();
+  return result;
+}
+
+void TextBlock::MoveTailTo(int pos, TextBlock* block) {
+  block->mText = mText.mid(pos);
+  block->UpdateUtf8Mapping();
+  mText.truncate(pos);
+  
+  int firstLine = 0;
+  for (int a = static_cast<int>(mLineAttributes.size()) - 1; a >= 0; -- a) {
+    if (mLineAttributes[a].offset < pos) {
+      firstLine = a + 1;
+      break;
+    }
+  }
+  if (firstLine < mLineAttributes.size()) {
+    block->mLineAttributes.assign(mLineAttributes.begin() + firstLine, mLineAttributes.end());
+    for (NewlineAttributes& att : block->mLineAttributes) {
+      att.offset -= pos;
+    }
+    mLineAttributes.erase(mLineAttributes.begin() + firstLine, mLineAttributes.end());
+  }
+  
+  for (int layer = 0; layer < kLayerCount; ++ layer) {
+    auto& styleRanges = mStyleRanges[layer];
+    auto& blockStyleRanges = block->mStyleRanges[layer];
     
-    int firstLine = 0;
-    for (int a = static_cast<int>(mLineAttributes.size()) - 1; a >= 0; -- a) {
-      if (mLineAttributes[a].offset < pos) {
-        firstLine = a + 1;
+    int firstStyle = 0;
+    for (int s = static_cast<int>(styleRanges.size()) - 1; s >= 0; -- s) {
+      if (styleRanges[s].start < pos) {
+        firstStyle = s + 1;
         break;
       }
     }
-    if (firstLine < mLineAttributes.size()) {
-      block->mLineAttributes.assign(mLineAttributes.begin() + firstLine, mLineAttributes.end());
-      for (NewlineAttributes& att : block->mLineAttributes) {
-        att.offset -= pos;
+    if (firstStyle < styleRanges.size()) {
+      // Reserve space for the style that may be inserted at the front below
+      // to avoid a re-allocation.
+      blockStyleRanges.reserve(styleRanges.size() - firstStyle + 1);
+      blockStyleRanges.assign(styleRanges.begin() + firstStyle, styleRanges.end());
+      for (StyleRange& style : blockStyleRanges) {
+        style.start -= pos;
       }
-      mLineAttributes.erase(mLineAttributes.begin() + firstLine, mLineAttributes.end());
-    }
-    
-    for (int layer = 0; layer < kLayerCount; ++ layer) {
-      auto& styleRanges = mStyleRanges[layer];
-      auto& blockStyleRanges = block->mStyleRanges[layer];
+      styleRanges.erase(styleRanges.begin() + firstStyle, styleRanges.end());
       
-      int firstStyle = 0;
-      for (int s = static_cast<int>(styleRanges.size()) - 1; s >= 0; -- s) {
-        if (styleRanges[s].start < pos) {
-          firstStyle = s + 1;
-          break;
-        }
-      }
-      if (firstStyle < styleRanges.size()) {
-        blockStyleRanges.assign(styleRanges.begin() + firstStyle, styleRanges.end());
-        for (StyleRange& style : blockStyleRanges) {
-          style.start -= pos;
-        }
-        styleRanges.erase(styleRanges.begin() + firstStyle, styleRanges.end());
-        
-        if (blockStyleRanges.front().start.offset > 0) {
-          // Insert last style from previous block
-          blockStyleRanges.insert(blockStyleRanges.begin(), StyleRange(0, styleRanges.back().rangeIndex));
-        }
-      } else {
-        // Use last style from previous block
-        blockStyleRanges.assign({StyleRange(0, styleRanges.back().rangeIndex)});
+      if (blockStyleRanges.front().start.offset > 0) {
+        // Insert last style from previous block
+        blockStyleRanges.insert(blockStyleRanges.begin(), StyleRange(0, styleRanges.back().rangeIndex));
       }
+    } else {
+      // Use last style from previous block
+      blockStyleRanges.assign({StyleRange(0, styleRanges.back().rangeIndex)});
     }
   }
-  
-  int posNext = (1 * oldSize) / numBlocks;
-  mText = mText.left(posNext);
-  return result;
 }
 
 void TextBlock::Append(const TextBlock& other) {
@@ -519,7 +554,14 @@ void TextBlock::Append(const TextBlock& other) {
   std::size_t oldStylesSize[kLayerCount] = {mStyleRanges[0].size(), mStyleRanges[1].size()};
   int oldLength = mText.size();
   
+  int oldUtf8Size = mUtf8Size;
+  
   mText += other.mText;
+  mUtf8Size += other.mUtf8Size;
+  mNonAsciiCharacters.reserve(mNonAsciiCharacters.size() + other.mNonAsciiCharacters.size());
+  for (const std::pair<int, int>& entry : other.mNonAsciiCharacters) {
+    mNonAsciiCharacters.emplace_back(entry.first + oldLength, entry.second + oldUtf8Size);
+  }
   mLineAttributes.insert(mLineAttributes.end(), other.mLineAttributes.begin(), other.mLineAttributes.end());
   for (int layer = 0; layer < kLayerCount; ++ layer) {
     bool sameBorderStyle = (mStyleRanges[layer].back().rangeIndex == other.mStyleRanges[layer].front().rangeIndex);
@@ -536,6 +578,64 @@ void TextBlock::Append(const TextBlock& other) {
   }
 }
 
+int TextBlock::Utf8OffsetForCharacter(int characterOffset) const {
+  // Find the last non-ASCII character before characterOffset.
+  auto it = std::lower_bound(
+      mNonAsciiCharacters.begin(), mNonAsciiCharacters.end(), characterOffset,
+      [](const std::pair<int, int>& entry, int offset) {
+        return entry.first < offset;
+      });
+  if (it == mNonAsciiCharacters.begin()) {
+    return characterOffset;
+  }
+  -- it;
+  return it->second + (characterOffset - it->first - 1);
+}
+
+int TextBlock::CharacterForUtf8Offset(int utf8Offset) const {
+  // Find the first non-ASCII character that ends after utf8Offset.
+  auto it = std::upper_bound(
+      mNonAsciiCharacters.begin(), mNonAsciiCharacters.end(), utf8Offset,
+      [](int offset, const std::pair<int, int>& entry) {
+        return offset < entry.second;
+      });
+  int result = (it == mNonAsciiCharacters.begin()) ?
+               utf8Offset :
+               ((it - 1)->first + 1 + (utf8Offset - (it - 1)->second));
+  if (it != mNonAsciiCharacters.end()) {
+    // utf8Offset may be within the encoding of this character.
+    result = std::min(result, it->first);
+  }
+  return result;
+}
+
+void TextBlock::UpdateUtf8Mapping() {
+  mUtf8Size = 0;
+  mNonAsciiCharacters.clear();
+  for (int c = 0, size = mText.size(); c < size; ++ c) {
+    int length = Utf8LengthOfCodeUnit(mText[c]);
+    mUtf8Size += length;
+    if (length > 1) {
+      mNonAsciiCharacters.emplace_back(c, mUtf8Size);
+    }
+  }
+}
+
+std::size_t TextBlock::TextMemoryUsage() const {
+  return sizeof(TextBlock) +
+         mText.capacity() * sizeof(QChar) +
+         mNonAsciiCharacters.capacity() * sizeof(std::pair<int, int>) +
+         mLineAttributes.capacity() * sizeof(NewlineAttributes);
+}
+
+std::size_t TextBlock::StyleMemoryUsage() const {
+  std::size_t result = 0;
+  for (int layer = 0; layer < kLayerCount; ++ layer) {
+    result += mStyleRanges[layer].capacity() * sizeof(StyleRange);
+  }
+  return result;
+}
+
 bool TextBlock::DebugCheckNewlineoffsets(bool isFirst) const {
   int a = 0;
   if (isFirst) {
@@ -579,3 +679,55 @@ bool TextBlock::DebugCheckNewlineoffsets(bool isFirst) const {
   
   return true;
 }
+
+int TextBlock::CountLinesWithAttributes() const {
+  int count = 0;
+  for (const NewlineAttributes& line : mLineAttributes) {
+    if (line.attributes != 0) {
+      ++ count;
+    }
+  }
+  return count;
+}
+
+
+void* TextBlockPool::Allocate(std::size_t size) {
+  if (size > kChunkSize) {
+    return ::operator new(size);
+  }
+  
+  std::unique_lock<std::mutex> lock(mMutex);
+  if (!mFreeList) {
+    // Allocate a new slab and put all of its chunks into the free list.
+    mSlabs.emplace_back(new char[kChunksPerSlab * kChunkSize]);
+    char* slab = mSlabs.back().get();
+    for (int i = kChunksPerSlab - 1; i >= 0; -- i) {
+      FreeChunk* chunk = reinterpret_cast<FreeChunk*>(slab + i * kChunkSize);
+      chunk->next = mFreeList;
+      mFreeList = chunk;
+    }
+  }
+  
+  FreeChunk* chunk = mFreeList;
+  mFreeList = chunk->next;
+  ++ mUsedChunkCount;
+  return chunk;
+}
+
+void TextBlockPool::Deallocate(void* memory, std::size_t size) {
+  if (size > kChunkSize) {
+    ::operator delete(memory);
+    return;
+  }
+  
+  std::unique_lock<std::mutex> lock(mMutex);
+  FreeChunk* chunk = static_cast<FreeChunk*>(memory);
+  chunk->next = mFreeList;
+  mFreeList = chunk;
+  -- mUsedChunkCount;
+}
+
+int TextBlockPool::UsedChunkCount() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  return mUsedChunkCount;
+}
@@ -4,13 +4,17 @@
 
 #pragma once
 
+#include <cstddef>
 #include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include <QString>
 
 #include "cide/document_range.h"
 
+class TextBlockPool;
 
 /// A small block of text within a Document. The block is kept small such that
 /// edit operations can be done quickly, without causing changes to other
@@ -62,22 +66,48 @@ class TextBlock {
   /// Inserts the StyleRange for a highlight range in the document.
   void InsertStyleRange(const DocumentRange& range, int highlightRangeIndex, int layer);
   
-  int FindStyleIndexForCharacter(int characterOffset, int layer);
+  /// Returns the index of the style range that contains the given character,
+  /// using binary search.
+  int FindStyleIndexForCharacter(int characterOffset, int layer) const;
   
   void ClearStyleRanges(int layer);
   
+  /// Replaces the style ranges of @p layer with @p styleRanges (swapping
+  /// them). The ranges must be ordered by increasing offset, cover the whole
+  /// block, and start with a range at offset 0.
+  void SetStyleRanges(std::vector<StyleRange>* styleRanges, int layer);
+  
   /// Returns the document text for the given range.
   QString TextForRange(const DocumentRange& range);
   
   /// Splits this block into two or more. The first part stays within this object, while
   /// the second (and potential other) parts are returned as new blocks by this function.
-  std::vector<std::shared_ptr<TextBlock>> Split(int desiredBlockSize);
+  /// If @p pool is given, the new blocks are allocated from it.
+  std::vector<std::shared_ptr<TextBlock>> Split(int desiredBlockSize, const std::shared_ptr<TextBlockPool>& pool = nullptr);
+  
+  /// Splits this block at @p offset, which must be larger than zero and
+  /// smaller than the text size. The text after @p offset (with its line
+  /// attributes and styles) is moved into a new block that is returned. If
+  /// @p pool is given, the new block is allocated from it.
+  std::shared_ptr<TextBlock> SplitAt(int offset, const std::shared_ptr<TextBlockPool>& pool = nullptr);
   
   /// Merges the other block into this block by appending the other block.
   void Append(const TextBlock& other);
   
   bool DebugCheckNewlineoffsets(bool isFirst) const;
   
+  /// Returns the number of entries in lineAttributes() with non-zero
+  /// attributes.
+  int CountLinesWithAttributes() const;
+  
+  /// Returns the approximate number of bytes used by the block itself and its
+  /// text (including the per-line and non-ASCII character data).
+  std::size_t TextMemoryUsage() const;
+  
+  /// Returns the approximate number of bytes used by the style ranges of the
+  /// block (of all layers).
+  std::size_t StyleMemoryUsage() const;
+  
   inline const QString& text() const { return mText; }
   
   inline const std::vector<NewlineAttributes>& lineAttributes() const { return mLineAttributes; }
@@ -85,25 +115,47 @@ class TextBlock {
   
   inline const std::vector<StyleRange>& styleRanges(int layer) const { return mStyleRanges[layer]; }
   
-  inline void SetCachedOffsets(unsigned int startOffset, unsigned int startLine) {
-    cachedStartOffset = startOffset;
-    cachedStartLine = startLine;
-  }
+  /// Returns the size of the text in UTF-8 encoding.
+  inline int utf8Size() const { return mUtf8Size; }
   
-  inline unsigned int GetCachedStartOffset() const { return cachedStartOffset; }
-  inline unsigned int GetCachedEndOffset() const { return cachedStartOffset + mText.size(); }
+  /// Returns the UTF-8 offset that corresponds to the (UTF-16) character
+  /// offset @p characterOffset within this block, using binary search.
+  int Utf8OffsetForCharacter(int characterOffset) const;
   
-  inline unsigned int GetCachedStartLine() const { return cachedStartLine; }
-  inline unsigned int GetCachedEndLine() const { return cachedStartLine + mLineAttributes.size(); }
+  /// Returns the (UTF-16) character offset that corresponds to the UTF-8
+  /// offset @p utf8Offset within this block, using binary search. Offsets
+  /// within the encoding of a character are mapped to the start of the
+  /// character.
+  int CharacterForUtf8Offset(int utf8Offset) const;
   
   
   /// The number of style layers.
   static constexpr int kLayerCount = 2;
   
  private:
+  /// Re-computes mUtf8Size and mNonAsciiCharacters from mText.
+  void UpdateUtf8Mapping();
+  
+  /// Moves the text from @p pos to the end, together with its line attributes
+  /// and styles, into the empty block @p block. @p pos must be larger than
+  /// zero. The UTF-8 mapping of this block is not updated.
+  void MoveTailTo(int pos, TextBlock* block);
+  
+  
   /// The text in this block.
   QString mText;
   
+  /// The size of mText in UTF-8 encoding.
+  int mUtf8Size = 0;
+  
+  /// Sparse mapping between UTF-16 and UTF-8 offsets within mText. Contains one
+  /// element for each UTF-16 code unit that is encoded with more than one byte
+  /// in UTF-8, ordered by increasing offset: the first value is the offset of
+  /// the code unit within mText, the second value is the UTF-8 offset at its
+  /// end. Characters in between are ASCII characters with one byte each. For
+  /// ASCII text, the vector is thus empty.
+  std::vector<std::pair<int, int>> mNonAsciiCharacters;
+  
   /// Contains one element (offset, attributes) for each newline character within this block,
   /// where offset is the offset of the newline character within @a text, and attributes is
   /// a combination of LineAttribute flags combined by logical or. The attributes apply to
@@ -118,14 +170,97 @@ class TextBlock {
   /// the beginning of the text block. There are two layers, a bottom layer [0]
   /// and a top layer [1].
   std::vector<StyleRange> mStyleRanges[kLayerCount];
+};
+
+
+/// Pool of fixed-size memory chunks from which a Document allocates its
+/// TextBlocks. Each chunk holds a block together with the control block of its
+/// shared_ptr (see MakeBlock()), so creating a block during an edit usually
+/// only pops a chunk from the free list instead of calling the allocator.
+/// Chunks are never returned to the system before the pool is destroyed. The
+/// pool is kept alive by the blocks allocated from it, so blocks may outlive
+/// the Document (e.g., in snapshots). The pool is thread-safe.
+class TextBlockPool {
+ public:
+  TextBlockPool() = default;
+  TextBlockPool(const TextBlockPool& other) = delete;
+  TextBlockPool& operator= (const TextBlockPool& other) = delete;
+  
+  /// Returns memory for @p size bytes. Sizes up to kChunkSize are served from
+  /// the pool, larger sizes from the global allocator.
+  void* Allocate(std::size_t size);
+  
+  /// Releases memory that was returned by Allocate() with the same @p size.
+  void Deallocate(void* memory, std::size_t size);
+  
+  /// Returns the number of chunks that are currently allocated from the pool.
+  int UsedChunkCount();
+  
+  /// Creates a TextBlock from the given constructor arguments. If @p pool is
+  /// non-null, the block is allocated from it, otherwise with make_shared().
+  template <typename... Args>
+  static std::shared_ptr<TextBlock> MakeBlock(const std::shared_ptr<TextBlockPool>& pool, Args&&... args);
+  
+  
+  /// Size of a chunk; large enough for a TextBlock and its control block.
+  static constexpr std::size_t kChunkSize =
+      ((sizeof(TextBlock) + 64 + alignof(std::max_align_t) - 1) / alignof(std::max_align_t)) * alignof(std::max_align_t);
   
-  /// The cached absolute offset of the block's first character in the document.
-  /// This is only valid if it has been (re)calculated after the latest change.
-  /// The Document stores whether that is the case.
-  unsigned int cachedStartOffset;
+ private:
+  /// Number of chunks that are allocated at once if the free list is empty.
+  static constexpr int kChunksPerSlab = 64;
+  
+  /// Free chunks, linked through their first bytes.
+  struct FreeChunk {
+    FreeChunk* next;
+  };
   
-  /// The cached absolute offset of the block's first new line in the document.
-  /// This is only valid if it has been (re)calculated after the latest change.
-  /// The Document stores whether that is the case.
-  unsigned int cachedStartLine;
+  std::mutex mMutex;
+  FreeChunk* mFreeList = nullptr;
+  int mUsedChunkCount = 0;
+  std::vector<std::unique_ptr<char[]>> mSlabs;
 };
+
+
+/// Allocator for std::allocate_shared() that uses a TextBlockPool.
+template <typename T>
+class TextBlockPoolAllocator {
+ public:
+  typedef T value_type;
+  
+  inline explicit TextBlockPoolAllocator(const std::shared_ptr<TextBlockPool>& pool)
+      : mPool(pool) {}
+  
+  template <typename U>
+  inline TextBlockPoolAllocator(const TextBlockPoolAllocator<U>& other)
+      : mPool(other.pool()) {}
+  
+  inline T* allocate(std::size_t n) {
+    return static_cast<T*>(mPool->Allocate(n * sizeof(T)));
+  }
+  
+  inline void deallocate(T* p, std::size_t n) {
+    mPool->Deallocate(p, n * sizeof(T));
+  }
+  
+  inline const std::shared_ptr<TextBlockPool>& pool() const { return mPool; }
+  
+  template <typename U>
+  inline bool operator== (const TextBlockPoolAllocator<U>& other) const { return mPool == other.pool(); }
+  
+  template <typename U>
+  inline bool operator!= (const TextBlockPoolAllocator<U>& other) const { return mPool != other.pool(); }
+  
+ private:
+  std::shared_ptr<TextBlockPool> mPool;
+};
+
+
+template <typename... Args>
+std::shared_ptr<TextBlock> TextBlockPool::MakeBlock(const std::shared_ptr<TextBlockPool>& pool, Args&&... args) {
+  if (pool) {
+    return std::allocate_shared<TextBlock>(TextBlockPoolAllocator<TextBlock>(pool), std::forward<Args>(args)...);
+  } else {
+    return std::make_shared<TextBlock>(std::forward<Args>(args)...);
+  }
+}
@@ -0,0 +1,657 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/text_regex.h"
+
+#include <algorithm>
+#include <functional>
+
+#include <QObject>
+
+/// Maximum number of instructions of a compiled pattern. The matching time
+/// per character is proportional to the program size, so this keeps the
+/// matching fast for patterns with large repetition counts.
+constexpr int kMaxRegexProgramSize = 2000;
+
+/// Maximum repetition count in {n,m} quantifiers.
+constexpr int kMaxRegexRepetitions = 1000;
+
+/// Node of the syntax tree of a parsed pattern.
+struct RegexNode {
+  enum class Type {
+    Character = 0,
+    Any,
+    Class,
+    Concatenation,
+    Alternation,
+    Repetition,
+    Assertion
+  };
+  
+  inline RegexNode(Type type)
+      : type(type) {}
+  
+  Type type;
+  
+  /// For Character: the character. For Assertion: the assertion type.
+  int value = 0;
+  
+  /// For Class: the character ranges, and whether the class is negated.
+  std::vector<std::pair<ushort, ushort>> ranges;
+  bool negated = false;
+  
+  /// For Repetition: the repetition bounds (with max being -1 if unbounded),
+  /// and whether the repetition is greedy.
+  int min = 0;
+  int max = 0;
+  bool greedy = true;
+  
+  /// Indices of the child nodes.
+  std::vector<int> children;
+};
+
+/// Recursive-descent parser for the syntax described in TextRegex.
+class RegexParser {
+ public:
+  inline RegexParser(const QString& pattern)
+      : pattern(pattern) {}
+  
+  /// Parses the pattern into @p nodes. Returns the index of the root node, or
+  /// -1 if the pattern is invalid (in which case errorMessage is set).
+  int Parse(std::vector<RegexNode>* nodes) {
+    this->nodes = nodes;
+    int root = ParseAlternation();
+    if (root >= 0 && pos < pattern.size()) {
+      // The only way to stop before the end is an unmatched ')'.
+      return Error(QObject::tr("Unmatched )"));
+    }
+    return root;
+  }
+  
+  QString errorMessage;
+  
+ private:
+  int Error(const QString& message) {
+    if (errorMessage.isEmpty()) {
+      errorMessage = message;
+    }
+    return -1;
+  }
+  
+  int AddNode(RegexNode::Type type) {
+    nodes->emplace_back(type);
+    return nodes->size() - 1;
+  }
+  
+  int ParseAlternation() {
+    int first = ParseConcatenation();
+    if (first < 0 || pos >= pattern.size() || pattern[pos] != '|') {
+      return first;
+    }
+    
+    int alternation = AddNode(RegexNode::Type::Alternation);
+    (*nodes)[alternation].children.push_back(first);
+    while (pos < pattern.size() && pattern[pos] == '|') {
+      ++ pos;
+      int alternative = ParseConcatenation();
+      if (alternative < 0) {
+        return -1;
+      }
+      (*nodes)[alternation].children.push_back(alternative);
+    }
+    return alternation;
+  }
+  
+  int ParseConcatenation() {
+    int concatenation = AddNode(RegexNode::Type::Concatenation);
+    while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')') {
+      int item = ParseRepetition();
+      if (item < 0) {
+        return -1;
+      }
+      (*nodes)[concatenation].children.push_back(item);
+    }
+    return concatenation;
+  }
+  
+  int ParseRepetition() {
+    int atom = ParseAtom();
+    while (atom >= 0 && pos < pattern.size()) {
+      int min;
+      int max;
+      QChar c = pattern[pos];
+      if (c == '*') {
+        min = 0;
+        max = -1;
+        ++ pos;
+      } else if (c == '+') {
+        min = 1;
+        max = -1;
+        ++ pos;
+      } else if (c == '?') {
+        min = 0;
+        max = 1;
+        ++ pos;
+      } else if (c == '{') {
+        if (!ParseBounds(&min, &max)) {
+          return -1;
+        }
+      } else {
+        break;
+      }
+      
+      RegexNode::Type atomType = (*nodes)[atom].type;
+      if (atomType == RegexNode::Type::Assertion) {
+        return Error(QObject::tr("Nothing to repeat"));
+      }
+      
+      int repetition = AddNode(RegexNode::Type::Repetition);
+      RegexNode& node = (*nodes)[repetition];
+      node.min = min;
+      node.max = max;
+      if (pos < pattern.size() && pattern[pos] == '?') {
+        node.greedy = false;
+        ++ pos;
+      }
+      node.children.push_back(atom);
+      atom = repetition;
+    }
+    return atom;
+  }
+  
+  bool ParseNumber(int* number) {
+    int start = pos;
+    *number = 0;
+    while (pos < pattern.size() && pattern[pos] >= '0' && pattern[pos] <= '9') {
+      *number = std::min(10 * *number + (pattern[pos].unicode() - '0'), kMaxRegexRepetitions + 1);
+      ++ pos;
+    }
+    return pos > start;
+  }
+  
+  /// Parses a quantifier of the form {n}, {n,}, or {n,m}.
+  bool ParseBounds(int* min, int* max) {
+    ++ pos;  // skip '{'
+    if (!ParseNumber(min)) {
+      Error(QObject::tr("Invalid quantifier"));
+      return false;
+    }
+    *max = *min;
+    if (pos < pattern.size() && pattern[pos] == ',') {
+      ++ pos;
+      if (!ParseNumber(max)) {
+        *max = -1;
+      }
+    }
+    if (pos >= pattern.size() || pattern[pos] != '}') {
+      Error(QObject::tr("Invalid quantifier"));
+      return false;
+    }
+    ++ pos;
+    
+    if (*min > kMaxRegexRepetitions || *max > kMaxRegexRepetitions) {
+      Error(QObject::tr("Repetition count too large"));
+      return false;
+    } else if (*max >= 0 && *max < *min) {
+      Error(QObject::tr("Invalid quantifier"));
+      return false;
+    }
+    return true;
+  }
+  
+  int ParseAtom() {
+    QChar c = pattern[pos];
+    ++ pos;
+    
+    if (c == '(') {
+      if (pos + 1 < pattern.size() && pattern[pos] == '?') {
+        if (pattern[pos + 1] != ':') {
+          return Error(QObject::tr("Unsupported group type"));
+        }
+        pos += 2;
+      }
+      int group = ParseAlternation();
+      if (group < 0) {
+        return -1;
+      }
+      if (pos >= pattern.size() || pattern[pos] != ')') {
+        return Error(QObject::tr("Unmatched ("));
+      }
+      ++ pos;
+      return group;
+    } else if (c == '[') {
+      return ParseClass();
+    } else if (c == '.') {
+      return AddNode(RegexNode::Type::Any);
+    } else if (c == '^' || c == '$') {
+      int assertion = AddNode(RegexNode::Type::Assertion);
+      (*nodes)[assertion].value = static_cast<int>((c == '^') ? TextRegexAssertion::LineStart : TextRegexAssertion::LineEnd);
+      return assertion;
+    } else if (c == '*' || c == '+' || c == '?' || c == '{') {
+      return Error(QObject::tr("Nothing to repeat"));
+    } else if (c == '\\') {
+      if (pos >= pattern.size()) {
+        return Error(QObject::tr("Trailing backslash"));
+      }
+      QChar escaped = pattern[pos];
+      ++ pos;
+      if (escaped == 'b' || escaped == 'B') {
+        int assertion = AddNode(RegexNode::Type::Assertion);
+        (*nodes)[assertion].value = static_cast<int>((escaped == 'b') ? TextRegexAssertion::WordBoundary : TextRegexAssertion::NotWordBoundary);
+        return assertion;
+      }
+      int node = AddNode(RegexNode::Type::Class);
+      if (AddEscapedClass(escaped, &(*nodes)[node].ranges, &(*nodes)[node].negated)) {
+        return node;
+      }
+      (*nodes)[node].type = RegexNode::Type::Character;
+      if (!GetEscapedCharacter(escaped, &(*nodes)[node].value)) {
+        return Error(QObject::tr("Unknown escape sequence: \\%1").arg(escaped));
+      }
+      return node;
+    }
+    
+    int node = AddNode(RegexNode::Type::Character);
+    (*nodes)[node].value = c.unicode();
+    return node;
+  }
+  
+  /// If @p escaped is one of the class escapes \d, \w, \s, \D, \W, \S, adds
+  /// its ranges and returns true.
+  static bool AddEscapedClass(QChar escaped, std::vector<std::pair<ushort, ushort>>* ranges, bool* negated) {
+    QChar lower = escaped.toLower();
+    if (lower == 'd') {
+      ranges->emplace_back('0', '9');
+    } else if (lower == 'w') {
+      ranges->emplace_back('a', 'z');
+      ranges->emplace_back('A', 'Z');
+      ranges->emplace_back('0', '9');
+      ranges->emplace_back('_', '_');
+    } else if (lower == 's') {
+      ranges->emplace_back(' ', ' ');
+      ranges->emplace_back('\t', '\r');  // \t, \n, \v, \f, \r
+    } else {
+      return false;
+    }
+    *negated = escaped.isUpper();
+    return true;
+  }
+  
+  /// Returns the character for the escape sequence "\" @p escaped.
+  static bool GetEscapedCharacter(QChar escaped, int* character) {
+    switch (escaped.unicode()) {
+    case 't': *character = '\t'; return true;
+    case 'n': *character = '\n'; return true;
+    case 'r': *character = '\r'; return true;
+    case 'f': *character = '\f'; return true;
+    case 'v': *character = '\v'; return true;
+    }
+    if (escaped.isLetterOrNumber()) {
+      return false;
+    }
+    *character = escaped.unicode();
+    return true;
+  }
+  
+  int ParseClass() {
+    int node = AddNode(RegexNode::Type::Class);
+    std::vector<std::pair<ushort, ushort>> ranges;
+    bool negated = false;
+    if (pos < pattern.size() && pattern[pos] == '^') {
+      negated = true;
+      ++ pos;
+    }
+    
+    bool first = true;
+    while (true) {
+      if (pos >= pattern.size()) {
+        return Error(QObject::tr("Unmatched ["));
+      }
+      QChar c = pattern[pos];
+      ++ pos;
+      if (c == ']' && !first) {
+        break;
+      }
+      first = false;
+      
+      int character = c.unicode();
+      if (c == '\\') {
+        if (pos >= pattern.size()) {
+          return Error(QObject::tr("Trailing backslash"));
+        }
+        QChar escaped = pattern[pos];
+        ++ pos;
+        bool escapeNegated;
+        if (AddEscapedClass(escaped, &ranges, &escapeNegated)) {
+          if (escapeNegated) {
+            return Error(QObject::tr("Negated escapes are not supported in character classes"));
+          }
+          continue;
+        }
+        if (escaped == 'b') {
+          character = '\b';
+        } else if (!GetEscapedCharacter(escaped, &character)) {
+          return Error(QObject::tr("Unknown escape sequence: \\%1").arg(escaped));
+        }
+      }
+      
+      // Range?
+      if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+        ++ pos;
+        int rangeEnd = pattern[pos].unicode();
+        ++ pos;
+        if (rangeEnd == '\\') {
+          if (pos >= pattern.size() || !GetEscapedCharacter(pattern[pos], &rangeEnd)) {
+            return Error(QObject::tr("Invalid character range"));
+          }
+          ++ pos;
+        }
+        if (rangeEnd < character) {
+          return Error(QObject::tr("Invalid character range"));
+        }
+        ranges.emplace_back(character, rangeEnd);
+      } else {
+        ranges.emplace_back(character, character);
+      }
+    }
+    
+    (*nodes)[node].ranges.swap(ranges);
+    (*nodes)[node].negated = negated;
+    return node;
+  }
+  
+  
+  const QString& pattern;
+  int pos = 0;
+  std::vector<RegexNode>* nodes;
+};
+
+
+bool TextRegex::CharacterClass::Contains(QChar c) const {
+  ushort u = c.unicode();
+  bool contained = false;
+  for (const std::pair<ushort, ushort>& range : ranges) {
+    if (u >= range.first && u <= range.second) {
+      contained = true;
+      break;
+    }
+  }
+  return contained != negated;
+}
+
+bool TextRegex::Compile(const QString& pattern, bool matchCase, QString* errorMessage) {
+  mProgram.clear();
+  mClasses.clear();
+  mMatchCase = matchCase;
+  
+  std::vector<RegexNode> nodes;
+  RegexParser parser(pattern);
+  int root = parser.Parse(&nodes);
+  if (root < 0) {
+    if (errorMessage) {
+      *errorMessage = parser.errorMessage;
+    }
+    return false;
+  }
+  
+  // Convert the syntax tree to the program. Repetitions with bounds are
+  // expanded, for example, x{2,3} is compiled like xxx?.
+  std::vector<Instruction> program;
+  std::function<bool(int)> compileNode = [&](int index) {
+    const RegexNode& node = nodes[index];
+    switch (node.type) {
+    case RegexNode::Type::Character:
+      program.emplace_back(Op::Character, Fold(QChar(node.value)).unicode());
+      break;
+    case RegexNode::Type::Any:
+      program.emplace_back(Op::Any);
+      break;
+    case RegexNode::Type::Class:
+      program.emplace_back(Op::Class, static_cast<int>(mClasses.size()));
+      mClasses.emplace_back();
+      mClasses.back().ranges = node.ranges;
+      mClasses.back().negated = node.negated;
+      break;
+    case RegexNode::Type::Concatenation:
+      for (int child : node.children) {
+        if (!compileNode(child)) {
+          return false;
+        }
+      }
+      break;
+    case RegexNode::Type::Alternation: {
+      std::vector<int> jumpsToEnd;
+      for (int i = 0; i < static_cast<int>(node.children.size()); ++ i) {
+        int split = -1;
+        if (i < static_cast<int>(node.children.size()) - 1) {
+          split = program.size();
+          program.emplace_back(Op::Split, split + 1);
+        }
+        if (!compileNode(node.children[i])) {
+          return false;
+        }
+        if (split >= 0) {
+          jumpsToEnd.push_back(program.size());
+          program.emplace_back(Op::Jump);
+          program[split].arg2 = program.size();
+        }
+      }
+      for (int jump : jumpsToEnd) {
+        program[jump].arg1 = program.size();
+      }
+      break;
+    }
+    case RegexNode::Type::Repetition: {
+      for (int i = 0; i < node.min; ++ i) {
+        if (!compileNode(node.children[0])) {
+          return false;
+        }
+      }
+      if (node.max < 0) {
+        // Loop: split -> (child, jump back to split) or end
+        int split = program.size();
+        program.emplace_back(Op::Split);
+        if (!compileNode(node.children[0])) {
+          return false;
+        }
+        program.emplace_back(Op::Jump, split);
+        int body = split + 1;
+        int end = program.size();
+        program[split].arg1 = node.greedy ? body : end;
+        program[split].arg2 = node.greedy ? end : body;
+      } else {
+        // Optional repetitions: split -> (child, split -> ...) or end
+        std::vector<int> splits;
+        for (int i = node.min; i < node.max; ++ i) {
+          splits.push_back(program.size());
+          program.emplace_back(Op::Split);
+          if (!compileNode(node.children[0])) {
+            return false;
+          }
+        }
+        int end = program.size();
+        for (int split : splits) {
+          program[split].arg1 = node.greedy ? (split + 1) : end;
+          program[split].arg2 = node.greedy ? end : (split + 1);
+        }
+      }
+      break;
+    }
+    case RegexNode::Type::Assertion:
+      program.emplace_back(Op::Assertion, node.value);
+      break;
+    }
+    return static_cast<int>(program.size()) <= kMaxRegexProgramSize;
+  };
+  
+  if (!compileNode(root)) {
+    if (errorMessage) {
+      *errorMessage = QObject::tr("The pattern is too complex");
+    }
+    mClasses.clear();
+    return false;
+  }
+  program.emplace_back(Op::Match);
+  mProgram.swap(program);
+  return true;
+}
+
+bool TextRegex::Consumes(const Instruction& instruction, QChar c) const {
+  switch (instruction.op) {
+  case Op::Character:
+    return Fold(c).unicode() == instruction.arg1;
+  case Op::Any:
+    return c != '\n';
+  case Op::Class: {
+    const CharacterClass& characterClass = mClasses[instruction.arg1];
+    if (characterClass.Contains(c)) {
+      return true;
+    }
+    if (!mMatchCase) {
+      return characterClass.Contains(c.toLower()) || characterClass.Contains(c.toUpper());
+    }
+    return false;
+  }
+  default:
+    return false;
+  }
+}
+
+
+TextRegexMatcher::TextRegexMatcher(const TextRegex& regex)
+    : mRegex(regex) {
+  mVisited.resize(regex.mProgram.size(), 0);
+}
+
+void TextRegexMatcher::Reset(int offset, int previousChar) {
+  mThreads.clear();
+  mPosition = offset;
+  mPreviousChar = previousChar;
+  mMatchStart = -1;
+  mMatchEnd = -1;
+}
+
+bool TextRegexMatcher::Feed(const QChar* text, int size) {
+  for (int i = 0; i < size; ++ i) {
+    if (Step(text[i].unicode(), true)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TextRegexMatcher::Finish(int nextChar) {
+  Step(nextChar, false);
+  return mMatchStart >= 0;
+}
+
+void TextRegexMatcher::FindAll(const QString& text, std::vector<std::pair<int, int>>* matches) {
+  int offset = 0;
+  while (offset < text.size()) {
+    Reset(offset, (offset > 0) ? text[offset - 1].unicode() : -1);
+    if (!Feed(text.constData() + offset, text.size() - offset) &&
+        !Finish(-1)) {
+      break;
+    }
+    matches->emplace_back(mMatchStart, mMatchEnd - mMatchStart);
+    offset = mMatchEnd;
+  }
+}
+
+bool TextRegexMatcher::Step(int nextChar, bool consume) {
+  // Determine the instructions that are reached at the current position, in
+  // order of preference. Starting a new match at this position has the lowest
+  // preference (and is only useful if a character follows, since empty
+  // matches are not returned).
+  ++ mGeneration;
+  mReached.clear();
+  for (const Thread& thread : mThreads) {
+    AddThread(thread.pc, thread.start, nextChar);
+  }
+  if (mMatchStart < 0 && consume) {
+    AddThread(0, mPosition, nextChar);
+  }
+  
+  // Advance the threads over the next character. A thread that reaches the
+  // Match instruction records a match, and the threads with lower preference
+  // are discarded.
+  mNextThreads.clear();
+  for (const Thread& thread : mReached) {
+    const TextRegex::Instruction& instruction = mRegex.mProgram[thread.pc];
+    if (instruction.op == TextRegex::Op::Match) {
+      if (thread.start < mPosition) {
+        mMatchStart = thread.start;
+        mMatchEnd = mPosition;
+        break;
+      }
+    } else if (consume && mRegex.Consumes(instruction, QChar(static_cast<ushort>(nextChar)))) {
+      mNextThreads.emplace_back(thread.pc + 1, thread.start);
+    }
+  }
+  mThreads.swap(mNextThreads);
+  
+  if (consume) {
+    ++ mPosition;
+    mPreviousChar = nextChar;
+  }
+  return mMatchStart >= 0 && mThreads.empty();
+}
+
+void TextRegexMatcher::AddThread(int pc, int start, int nextChar) {
+  const std::vector<TextRegex::Instruction>& program = mRegex.mProgram;
+  mStack.clear();
+  mStack.push_back(pc);
+  while (!mStack.empty()) {
+    int current = mStack.back();
+    mStack.pop_back();
+    if (mVisited[current] == mGeneration) {
+      continue;
+    }
+    mVisited[current] = mGeneration;
+    
+    const TextRegex::Instruction& instruction = program[current];
+    switch (instruction.op) {
+    case TextRegex::Op::Jump:
+      mStack.push_back(instruction.arg1);
+      break;
+    case TextRegex::Op::Split:
+      // Push the preferred branch last such that it is followed first.
+      mStack.push_back(instruction.arg2);
+      mStack.push_back(instruction.arg1);
+      break;
+    case TextRegex::Op::Assertion:
+      if (AssertionHolds(static_cast<TextRegexAssertion>(instruction.arg1), nextChar)) {
+        mStack.push_back(current + 1);
+      }
+      break;
+    default:
+      mReached.emplace_back(current, start);
+      break;
+    }
+  }
+}
+
+/// Returns whether @p c (which may be -1 for "no character") is a word
+/// character for \b.
+static bool IsRegexWordChar(int c) {
+  if (c < 0) {
+    return false;
+  }
+  QChar character(static_cast<ushort>(c));
+  return character == '_' || character.isLetterOrNumber();
+}
+
+bool TextRegexMatcher::AssertionHolds(TextRegexAssertion type, int nextChar) const {
+  switch (type) {
+  case TextRegexAssertion::LineStart:
+    return mPreviousChar < 0 || mPreviousChar == '\n';
+  case TextRegexAssertion::LineEnd:
+    return nextChar < 0 || nextChar == '\n';
+  case TextRegexAssertion::WordBoundary:
+    return IsRegexWordChar(mPreviousChar) != IsRegexWordChar(nextChar);
+  case TextRegexAssertion::NotWordBoundary:
+    return IsRegexWordChar(mPreviousChar) == IsRegexWordChar(nextChar);
+  }
+  return false;
+}
@@ -0,0 +1,195 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <QChar>
+#include <QString>
+
+/// Zero-width assertions in a TextRegex.
+enum class TextRegexAssertion {
+  LineStart = 0,  // ^
+  LineEnd,  // $
+  WordBoundary,  // \b
+  NotWordBoundary  // \B
+};
+
+/// A regular expression for searching in text. It is compiled to a program
+/// for a Pike VM (a simulation of the expression's nondeterministic automaton
+/// that never backtracks), so matching takes time linear in the length of the
+/// text for any pattern, and the text can be streamed through a
+/// TextRegexMatcher in arbitrary chunks.
+///
+/// Supported syntax:
+/// - Characters, which match themselves. The characters .[]()|*+?{}^$\ must
+///   be escaped with a backslash to match them literally.
+/// - "." matches any character except a line break.
+/// - Character classes such as [abc], [a-z], [^0-9], which may contain \d, \w
+///   and \s.
+/// - \d, \w, \s (digits, word characters, whitespace), and their negations
+///   \D, \W, \S. \t, \n, \r, \f, \v.
+/// - ^ and $ match at the start and end of lines, \b and \B at (non-)word
+///   boundaries.
+/// - Grouping with (...) or (?:...) (groups do not capture), alternatives with
+///   |, and the quantifiers *, +, ?, {n}, {n,}, {n,m}, each of which may be
+///   followed by ? to make it lazy.
+///
+/// The first match in the text is returned, where matches starting earlier
+/// are preferred, and among the matches starting at the same position, the
+/// quantifiers and alternatives determine the preference as in Perl. Empty
+/// matches are never returned.
+class TextRegex {
+ public:
+  /// Compiles @p pattern. Returns true if successful. Otherwise, returns false
+  /// and sets @p errorMessage if it is non-null.
+  bool Compile(const QString& pattern, bool matchCase, QString* errorMessage = nullptr);
+  
+  /// Returns whether a pattern has been compiled successfully.
+  inline bool IsValid() const { return !mProgram.empty(); }
+  
+ private:
+  friend class TextRegexMatcher;
+  
+  enum class Op {
+    /// Matches the character in arg1.
+    Character = 0,
+    
+    /// Matches any character except '\n'.
+    Any,
+    
+    /// Matches a character in the class with index arg1 in mClasses.
+    Class,
+    
+    /// Continues at arg1 (which is preferred) and at arg2.
+    Split,
+    
+    /// Continues at arg1.
+    Jump,
+    
+    /// Continues if the assertion arg1 (a TextRegexAssertion) holds.
+    Assertion,
+    
+    /// The pattern has been matched.
+    Match
+  };
+  
+  struct Instruction {
+    inline Instruction(Op op, int arg1 = 0, int arg2 = 0)
+        : op(op),
+          arg1(arg1),
+          arg2(arg2) {}
+    
+    Op op;
+    int arg1;
+    int arg2;
+  };
+  
+  struct CharacterClass {
+    bool Contains(QChar c) const;
+    
+    /// Inclusive ranges of the characters in the class.
+    std::vector<std::pair<ushort, ushort>> ranges;
+    
+    bool negated = false;
+  };
+  
+  /// Returns the case-folded character if the pattern is case-insensitive,
+  /// or the character itself otherwise.
+  inline QChar Fold(QChar c) const {
+    if (mMatchCase) {
+      return c;
+    }
+    ushort u = c.unicode();
+    if (u < 0x80) {
+      return QChar((u >= 'A' && u <= 'Z') ? (u - 'A' + 'a') : u);
+    }
+    return c.toLower();
+  }
+  
+  /// Returns whether the instruction @p instruction (that consumes a
+  /// character) matches @p c.
+  bool Consumes(const Instruction& instruction, QChar c) const;
+  
+  std::vector<Instruction> mProgram;
+  std::vector<CharacterClass> mClasses;
+  bool mMatchCase = true;
+};
+
+/// Finds the first match of a TextRegex in text that is given in chunks, for
+/// example, the blocks of a Document. The time taken is linear in the length
+/// of the text that gets fed in.
+class TextRegexMatcher {
+ public:
+  /// @p regex must be valid and must outlive this object.
+  explicit TextRegexMatcher(const TextRegex& regex);
+  
+  /// Starts a new search at (text) offset @p offset. @p previousChar is the
+  /// character before the offset (for ^ and \b), or -1 at the start of the
+  /// text.
+  void Reset(int offset, int previousChar);
+  
+  /// Feeds the next @p size characters of the text. Returns true as soon as
+  /// the match has been determined (see matchStart() and matchEnd()), in which
+  /// case the remaining characters may not have been used.
+  bool Feed(const QChar* text, int size);
+  
+  /// Ends the text (or the range to search in). @p nextChar is the character
+  /// after it (for $ and \b), or -1 at the end of the text. Returns true if
+  /// a match has been found.
+  bool Finish(int nextChar);
+  
+  inline int matchStart() const { return mMatchStart; }
+  inline int matchEnd() const { return mMatchEnd; }
+  
+  /// Appends all (non-overlapping) matches in the complete text @p text to
+  /// @p matches, as pairs of start offset and length.
+  void FindAll(const QString& text, std::vector<std::pair<int, int>>* matches);
+  
+ private:
+  struct Thread {
+    inline Thread(int pc, int start)
+        : pc(pc),
+          start(start) {}
+    
+    int pc;
+    int start;
+  };
+  
+  /// Processes the position mPosition, with @p nextChar being the character
+  /// at it (or -1 at the end of the text). If @p consume is true, advances
+  /// over this character. Returns true if the match has been determined.
+  bool Step(int nextChar, bool consume);
+  
+  /// Follows the non-consuming instructions from @p pc and appends the
+  /// reached consuming and Match instructions to mReached, in order of
+  /// preference.
+  void AddThread(int pc, int start, int nextChar);
+  
+  bool AssertionHolds(TextRegexAssertion type, int nextChar) const;
+  
+  
+  const TextRegex& mRegex;
+  
+  /// Threads that continue at the current position, in order of preference.
+  std::vector<Thread> mThreads;
+  
+  /// Temporary lists used in Step().
+  std::vector<Thread> mReached;
+  std::vector<Thread> mNextThreads;
+  std::vector<int> mStack;
+  
+  /// For each instruction, the value of mGeneration in the last Step() in
+  /// which it was reached.
+  std::vector<int> mVisited;
+  int mGeneration = 0;
+  
+  int mPosition = 0;
+  int mPreviousChar = -1;
+  
+  int mMatchStart = -1;
+  int mMatchEnd = -1;
+};
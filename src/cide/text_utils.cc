@@ -4,10 +4,15 @@
 
 #include "cide/text_utils.h"
 
+#include <algorithm>
 #include <mutex>
 
 #include <QString>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 std::vector<bool> isSymbolArray;
 
 void InitializeSymbolArray() {
@@ -47,100 +52,342 @@ void InitializeSymbolArray() {
   mutex.unlock();
 }
 
+QString FoldCaseForFuzzyTextMatch(const QString& text) {
+  const int size = text.size();
+  QString result(size, Qt::Uninitialized);
+  const QChar* in = text.constData();
+  QChar* out = result.data();
+  for (int i = 0; i < size; ++ i) {
+    ushort c = in[i].unicode();
+    if (c < 0x80) {
+      out[i] = QChar((c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c);
+    } else {
+      out[i] = in[i].toLower();
+    }
+  }
+  return result;
+}
+
+/// Returns the index of the lowest set bit in @p value, which must not be zero.
+static inline int LowestSetBit(quint64 value) {
+#ifdef __GNUC__
+  return __builtin_ctzll(value);
+#else
+  int index = 0;
+  while ((value & 1) == 0) {
+    value >>= 1;
+    ++ index;
+  }
+  return index;
+#endif
+}
+
+#ifdef __SSE2__
+/// Loads the 8 characters at @p text (which need not be aligned).
+static inline __m128i Load8Characters(const QChar* text) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+}
+
+/// Returns a mask with 2 bits (one per byte) set for each of the 8 @p chars
+/// that equals @p c.
+static inline int EqualMask(__m128i chars, ushort c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(chars, _mm_set1_epi16(static_cast<short>(c))));
+}
+
+/// Returns an all-ones lane for each of the 8 @p chars in [@p first, @p last].
+static inline __m128i InRange(__m128i chars, ushort first, ushort last) {
+  // After subtracting @p first, the characters below the range wrap around to
+  // large values, so a single unsigned comparison (by means of a saturating
+  // subtraction) suffices.
+  __m128i shifted = _mm_sub_epi16(chars, _mm_set1_epi16(static_cast<short>(first)));
+  __m128i excess = _mm_subs_epu16(shifted, _mm_set1_epi16(static_cast<short>(last - first)));
+  return _mm_cmpeq_epi16(excess, _mm_setzero_si128());
+}
+
+/// Returns whether all 8 @p chars belong to a run of @p charType that can be
+/// skipped without looking at the characters individually.
+static inline bool IsSkippableRun(__m128i chars, int charType, bool stopAtNewline) {
+  __m128i matches;
+  if (charType == static_cast<int>(CharacterType::Letter)) {
+    matches = _mm_or_si128(
+        _mm_or_si128(InRange(_mm_or_si128(chars, _mm_set1_epi16(0x20)), 'a', 'z'),
+                     InRange(chars, '0', '9')),
+        _mm_cmpeq_epi16(chars, _mm_set1_epi16('_')));
+  } else if (charType == static_cast<int>(CharacterType::Whitespace)) {
+    matches = _mm_or_si128(_mm_cmpeq_epi16(chars, _mm_set1_epi16(' ')),
+                           _mm_cmpeq_epi16(chars, _mm_set1_epi16('\t')));
+    if (!stopAtNewline) {
+      matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, _mm_set1_epi16('\n')));
+    }
+  } else {
+    return false;
+  }
+  return _mm_movemask_epi8(matches) == 0xFFFF;
+}
+#endif
+
+/// Returns whether @p c continues a run of @p charType for
+/// FindCharTypeRunEnd() and FindCharTypeRunStart().
+static inline bool ContinuesRun(QChar c, int charType, bool stopAtNewline) {
+  return GetCharType(c) == charType && !(stopAtNewline && c == '\n');
+}
+
+int FindNewline(const QChar* text, int start, int end) {
+  int pos = start;
+#ifdef __SSE2__
+  for (; pos + 8 <= end; pos += 8) {
+    int mask = EqualMask(Load8Characters(text + pos), '\n');
+    if (mask != 0) {
+      return pos + LowestSetBit(mask) / 2;
+    }
+  }
+#endif
+  for (; pos < end; ++ pos) {
+    if (text[pos] == '\n') {
+      return pos;
+    }
+  }
+  return -1;
+}
+
+int CountNewlines(const QChar* text, int start, int end) {
+  int count = 0;
+  int pos = start;
+#ifdef __SSE2__
+  for (; pos + 8 <= end; pos += 8) {
+    int mask = EqualMask(Load8Characters(text + pos), '\n');
+    // Each newline sets two bits of the mask.
+    while (mask != 0) {
+      mask &= mask - 1;
+      ++ count;
+    }
+  }
+  count /= 2;
+#endif
+  for (; pos < end; ++ pos) {
+    if (text[pos] == '\n') {
+      ++ count;
+    }
+  }
+  return count;
+}
+
+int FindCharTypeRunEnd(const QChar* text, int start, int end, int charType, bool stopAtNewline) {
+  int pos = start;
+  while (pos < end) {
+#ifdef __SSE2__
+    if (pos + 8 <= end && IsSkippableRun(Load8Characters(text + pos), charType, stopAtNewline)) {
+      pos += 8;
+      continue;
+    }
+#endif
+    if (!ContinuesRun(text[pos], charType, stopAtNewline)) {
+      break;
+    }
+    ++ pos;
+  }
+  return pos;
+}
+
+int FindCharTypeRunStart(const QChar* text, int start, int end, int charType, bool stopAtNewline) {
+  int pos = end;
+  while (pos > start) {
+#ifdef __SSE2__
+    if (pos - 8 >= start && IsSkippableRun(Load8Characters(text + pos - 8), charType, stopAtNewline)) {
+      pos -= 8;
+      continue;
+    }
+#endif
+    if (!ContinuesRun(text[pos - 1], charType, stopAtNewline)) {
+      break;
+    }
+    -- pos;
+  }
+  return pos;
+}
+
 void ComputeFuzzyTextMatch(const QString& text, const QString& item, FuzzyTextMatchScore* score) {
-  int textSize = text.size();
+  ComputeFuzzyTextMatch(text, FoldCaseForFuzzyTextMatch(text), item, FoldCaseForFuzzyTextMatch(item), score);
+}
+
+void ComputeFuzzyTextMatch(const QString& text, const QString& textFolded, const QString& item, const QString& itemFolded, FuzzyTextMatchScore* score) {
+  const int textSize = text.size();
+  const int size = item.size();
+  const QChar* textChars = text.constData();
+  const QChar* textLower = textFolded.constData();
+  const QChar* itemChars = item.constData();
+  const QChar* itemLower = itemFolded.constData();
   
   score->matchedCharacters = 0;
   score->matchErrors = std::numeric_limits<int>::max();
   score->matchedCase = false;
   score->matchedStartIndex = std::numeric_limits<int>::max();
-  for (int start = 0, size = item.size(); start < size; ++ start) {
-    // Count the number of matching characters for comparing "text" and "item" from position "start" in "item".
-    int matchedCharacters = 0;
-    int matchErrors = 0;
-    bool matchedCase = true;
+  
+  // Any match from position "start" in "item" must involve item[start] or
+  // item[start + 1] being equal to text[0] or text[1] (disregarding case).
+  // Other start positions result in a matchedCharacters of zero, which can
+  // only improve the initial score, so they are skipped after position 0
+  // has been tried. The candidate positions are determined for 64 positions at
+  // a time in a bit mask.
+  const QChar firstChar = (textSize > 0) ? textLower[0] : QChar();
+  const QChar secondChar = (textSize > 1) ? textLower[1] : firstChar;
+  auto isAnchor = [&](int pos) {
+    return pos < size && textSize > 0 && (itemLower[pos] == firstChar || itemLower[pos] == secondChar);
+  };
+  
+  for (int blockStart = 0; blockStart < size; blockStart += 64) {
+    int blockEnd = std::min(size, blockStart + 64);
+    quint64 anchors = 0;
+    for (int pos = blockStart; pos < blockEnd; ++ pos) {
+      anchors |= static_cast<quint64>(isAnchor(pos)) << (pos - blockStart);
+    }
+    quint64 candidates = anchors | (anchors >> 1) | (static_cast<quint64>(isAnchor(blockEnd)) << 63);
+    if (blockStart == 0) {
+      candidates |= 1;
+    }
     
-    int pos = start;
-    for (int c = 0; c < textSize; ++ c) {
-      const QChar& filterTextChar = item[pos];
-      const QChar& textChar = text[c];
-      
-      // Case-sensitive match?
-      if (filterTextChar == textChar) {
-        ++ matchedCharacters;
+    while (candidates != 0) {
+      int start = blockStart + LowestSetBit(candidates);
+      candidates &= candidates - 1;
+      if (start >= size) {
+        break;
       }
-      // Case-insensitive match?
-      else if (filterTextChar.toLower() == textChar.toLower()) {
-        ++ matchedCharacters;
-        matchedCase = false;
+      
+      // Check whether the early exit below would have happened for one of the
+      // skipped start positions.
+      if (start > 0 &&
+          ((score->matchedCase && score->matchedCharacters >= size - (start - 1)) ||
+           (!score->matchedCase && score->matchedCharacters > size - (start - 1)))) {
+        return;
       }
-      // Order of characters swapped?
-      else if (c < textSize - 1 &&
-                pos < size - 1 &&
-                item[pos + 1].toLower() == text[c].toLower() &&
-                item[pos].toLower() == text[c + 1].toLower()) {
-        matchedCharacters += 2;
-        ++ matchErrors;
-        if (item[pos + 1] != text[c] ||
-            item[pos] != text[c + 1]) {
-          matchedCase = false;
+      
+      // Count the number of matching characters for comparing "text" and "item" from position "start" in "item".
+      int matchedCharacters = 0;
+      int matchErrors = 0;
+      bool matchedCase = true;
+      
+      int pos = start;
+      for (int c = 0; c < textSize; ++ c) {
+        // Case-sensitive match?
+        if (itemChars[pos] == textChars[c]) {
+          ++ matchedCharacters;
         }
-        ++ c;
-        ++ pos;
-      }
-      // Extra character in text?
-      else if (c < textSize - 1 &&
-                filterTextChar.toLower() == text[c + 1].toLower()) {
-        ++ matchErrors;
-        ++ matchedCharacters;
-        if (filterTextChar != text[c + 1]) {
+        // Case-insensitive match?
+        else if (itemLower[pos] == textLower[c]) {
+          ++ matchedCharacters;
           matchedCase = false;
         }
-        ++ c;
-      }
-      // Wrong character in text?
-      else if (c < textSize - 1 &&
-                pos < size - 1 &&
-                item[pos + 1].toLower() == text[c + 1].toLower()) {
-        ++ matchErrors;
-        ++ matchedCharacters;
-        if (item[pos + 1] != text[c + 1]) {
-          matchedCase = false;
+        // Order of characters swapped?
+        else if (c < textSize - 1 &&
+                  pos < size - 1 &&
+                  itemLower[pos + 1] == textLower[c] &&
+                  itemLower[pos] == textLower[c + 1]) {
+          matchedCharacters += 2;
+          ++ matchErrors;
+          if (itemChars[pos + 1] != textChars[c] ||
+              itemChars[pos] != textChars[c + 1]) {
+            matchedCase = false;
+          }
+          ++ c;
+          ++ pos;
         }
-        ++ c;
-        ++ pos;
-      }
-      // Missing character in text?
-      else if (pos < size - 1 &&
-                item[pos + 1].toLower() == textChar.toLower()) {
-        ++ matchErrors;
-        ++ matchedCharacters;
-        if (item[pos + 1] != textChar) {
-          matchedCase = false;
+        // Extra character in text?
+        else if (c < textSize - 1 &&
+                  itemLower[pos] == textLower[c + 1]) {
+          ++ matchErrors;
+          ++ matchedCharacters;
+          if (itemChars[pos] != textChars[c + 1]) {
+            matchedCase = false;
+          }
+          ++ c;
         }
+        // Wrong character in text?
+        else if (c < textSize - 1 &&
+                  pos < size - 1 &&
+                  itemLower[pos + 1] == textLower[c + 1]) {
+          ++ matchErrors;
+          ++ matchedCharacters;
+          if (itemChars[pos + 1] != textChars[c + 1]) {
+            matchedCase = false;
+          }
+          ++ c;
+          ++ pos;
+        }
+        // Missing character in text?
+        else if (pos < size - 1 &&
+                  itemLower[pos + 1] == textLower[c]) {
+          ++ matchErrors;
+          ++ matchedCharacters;
+          if (itemChars[pos + 1] != textChars[c]) {
+            matchedCase = false;
+          }
+          ++ pos;
+        } else {
+          break;
+        }
+        
         ++ pos;
-      } else {
-        break;
+        if (pos >= size) {
+          break;
+        }
       }
       
-      ++ pos;
-      if (pos >= size) {
-        break;
+      if (matchedCharacters > score->matchedCharacters ||
+              (matchedCharacters == score->matchedCharacters && (matchErrors < score->matchErrors ||
+                  (matchErrors == score->matchErrors && matchedCase && !score->matchedCase)))) {
+        score->matchedCharacters = matchedCharacters;
+        score->matchErrors = matchErrors;
+        score->matchedCase = matchedCase;
+        score->matchedStartIndex = start;
+      }
+      if ((score->matchedCase && score->matchedCharacters >= size - start) ||
+          (!score->matchedCase && score->matchedCharacters > size - start)) {
+        // No better match possible, exit early.
+        return;
       }
     }
-    
-    if (matchedCharacters > score->matchedCharacters ||
-            (matchedCharacters == score->matchedCharacters && (matchErrors < score->matchErrors ||
-                (matchErrors == score->matchErrors && matchedCase && !score->matchedCase)))) {
-      score->matchedCharacters = matchedCharacters;
-      score->matchErrors = matchErrors;
-      score->matchedCase = matchedCase;
-      score->matchedStartIndex = start;
+  }
+}
+
+
+TextSearchPattern::TextSearchPattern(const QString& pattern, bool matchCase)
+    : mMatchCase(matchCase) {
+  mPattern = matchCase ? pattern : FoldCaseForFuzzyTextMatch(pattern);
+  const int size = mPattern.size();
+  
+  for (int i = 0; i < 256; ++ i) {
+    mForwardShift[i] = size;
+    mBackwardShift[i] = size;
+  }
+  for (int i = 0; i < size - 1; ++ i) {
+    mForwardShift[Bucket(mPattern[i])] = size - 1 - i;
+  }
+  for (int i = size - 1; i >= 1; -- i) {
+    mBackwardShift[Bucket(mPattern[i])] = i;
+  }
+}
+
+int TextSearchPattern::FindForwards(const QChar* text, int minStart, int maxStart) const {
+  const int last = mPattern.size() - 1;
+  const QChar lastChar = mPattern[last];
+  for (int start = minStart; start <= maxStart; ) {
+    QChar c = Fold(text[start + last]);
+    if (c == lastChar && MatchesAt(text + start, last)) {
+      return start;
     }
-    if ((score->matchedCase && score->matchedCharacters >= size - start) ||
-        (!score->matchedCase && score->matchedCharacters > size - start)) {
-      // No better match possible, exit early.
-      break;
+    start += mForwardShift[Bucket(c)];
+  }
+  return -1;
+}
+
+int TextSearchPattern::FindBackwards(const QChar* text, int minStart, int maxStart) const {
+  const QChar firstChar = mPattern[0];
+  for (int start = maxStart; start >= minStart; ) {
+    QChar c = Fold(text[start]);
+    if (c == firstChar && MatchesAt(text + start, 0)) {
+      return start;
     }
+    start -= mBackwardShift[Bucket(c)];
   }
+  return -1;
 }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <QChar>
+#include <QString>
 
 #include <vector>
 
@@ -93,6 +94,31 @@ inline bool IsIdentifierChar(QChar c) {
          (c == '_');
 }
 
+/// Returns the offset of the first newline in [@p start, @p end) of @p text,
+/// or -1 if there is none. Compares 8 characters at a time using SSE2 if
+/// available.
+int FindNewline(const QChar* text, int start, int end);
+
+/// Returns the number of newlines in [@p start, @p end) of @p text (using SSE2
+/// if available).
+int CountNewlines(const QChar* text, int start, int end);
+
+/// Returns the first offset in [@p start, @p end) of @p text at which the
+/// character is not of type @p charType (see GetCharType()), or @p end if
+/// there is none. If @p stopAtNewline is true, newlines also end the run.
+///
+/// Runs of ASCII identifier characters (for CharacterType::Letter) and of
+/// spaces and tabs (for CharacterType::Whitespace) are skipped 8 characters
+/// at a time using SSE2 if available. This assumes that none of these
+/// characters is defined as a symbol with DefineAsSymbol().
+int FindCharTypeRunEnd(const QChar* text, int start, int end, int charType, bool stopAtNewline);
+
+/// Analogous to FindCharTypeRunEnd(), but searches backwards from @p end:
+/// Returns the smallest offset in [@p start, @p end] such that all characters
+/// from there to @p end are of type @p charType (and are no newlines, if
+/// @p stopAtNewline is true).
+int FindCharTypeRunStart(const QChar* text, int start, int end, int charType, bool stopAtNewline);
+
 struct FuzzyTextMatchScore {
   /// Constructor which leaves the struct uninitialized.
   inline FuzzyTextMatchScore() = default;
@@ -134,4 +160,97 @@ struct FuzzyTextMatchScore {
 
 /// Computes how well the 'text' matches the 'item' while accounting for some
 /// possible spelling mistakes and being relatively quick to compute.
+///
+/// Appending characters to 'text' increases the resulting matchedCharacters by
+/// at most the number of appended characters. Thus, if an item does not match
+/// a text according to IsFuzzyTextMatch(), it does not match any extension of
+/// this text either, which allows to filter lists incrementally while the user
+/// is typing.
 void ComputeFuzzyTextMatch(const QString& text, const QString& item, FuzzyTextMatchScore* score);
+
+/// Version of ComputeFuzzyTextMatch() that takes the results of
+/// FoldCaseForFuzzyTextMatch() for the text and the item in addition. This
+/// avoids case-folding the characters over and over again when matching
+/// many items, and should be used in all performance-critical places.
+void ComputeFuzzyTextMatch(const QString& text, const QString& textFolded, const QString& item, const QString& itemFolded, FuzzyTextMatchScore* score);
+
+/// Returns @p text with each UTF-16 code unit converted to lowercase (with a
+/// fast path for ASCII characters). The result has the same size as @p text.
+QString FoldCaseForFuzzyTextMatch(const QString& text);
+
+/// Maximum number of characters of a filter text that may remain unmatched
+/// for an item to be considered as matching the text.
+constexpr int kMaxNonMatchedCharacters = 2;
+
+/// Returns whether the given score, computed by ComputeFuzzyTextMatch() for a
+/// text of size @p textSize, is good enough to consider the item as matching.
+inline bool IsFuzzyTextMatch(const FuzzyTextMatchScore& score, int textSize) {
+  return score.matchedCharacters >= textSize - kMaxNonMatchedCharacters;
+}
+
+
+/// Searches for occurrences of a fixed string in text with the
+/// Boyer-Moore-Horspool algorithm. For case-insensitive searches, the search
+/// string is case-folded once on construction, and the text characters are
+/// folded as they are compared (in the same way as QChar::toLower(), with a
+/// fast path for ASCII characters).
+class TextSearchPattern {
+ public:
+  /// @p pattern must not be empty.
+  TextSearchPattern(const QString& pattern, bool matchCase);
+  
+  /// Returns the smallest start offset in [@p minStart, @p maxStart] of an
+  /// occurrence in @p text, or -1 if there is none. All characters of the
+  /// occurrences must be within [text, text + textSize), i.e., @p maxStart
+  /// must not be larger than textSize - size().
+  int FindForwards(const QChar* text, int minStart, int maxStart) const;
+  
+  /// Analogous to FindForwards(), but returns the largest start offset.
+  int FindBackwards(const QChar* text, int minStart, int maxStart) const;
+  
+  /// Returns the length of the search string.
+  inline int size() const { return mPattern.size(); }
+  
+ private:
+  inline QChar Fold(QChar c) const {
+    if (mMatchCase) {
+      return c;
+    }
+    ushort u = c.unicode();
+    if (u < 0x80) {
+      return QChar((u >= 'A' && u <= 'Z') ? (u - 'A' + 'a') : u);
+    }
+    return c.toLower();
+  }
+  
+  /// Bucket of a character in the skip tables.
+  static inline int Bucket(QChar c) {
+    return c.unicode() & 0xFF;
+  }
+  
+  /// Returns whether the occurrence starting at @p text matches, skipping the
+  /// character at @p skipIndex (which has been compared already).
+  inline bool MatchesAt(const QChar* text, int skipIndex) const {
+    const QChar* pattern = mPattern.constData();
+    for (int i = 0, size = mPattern.size(); i < size; ++ i) {
+      if (i != skipIndex && Fold(text[i]) != pattern[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  /// The (case-folded, if mMatchCase is false) search string.
+  QString mPattern;
+  
+  bool mMatchCase;
+  
+  /// Shifts for searching forwards, indexed by the Bucket() of the text
+  /// character aligned with the last character of the pattern. Characters
+  /// that share a bucket get the smallest of their shifts, which is safe.
+  int mForwardShift[256];
+  
+  /// Shifts for searching backwards, indexed by the Bucket() of the text
+  /// character aligned with the first character of the pattern.
+  int mBackwardShift[256];
+};
@@ -0,0 +1,209 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/trigram_index.h"
+
+#include <algorithm>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+/// Files that are larger than this are not indexed (and thus always need to
+/// be searched).
+constexpr qint64 kMaxIndexedFileSize = 16 * 1024 * 1024;
+
+static inline quint32 ToLowerAscii(quint32 c) {
+  return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c;
+}
+
+TrigramIndex::TrigramIndex() {
+  connect(&watcher, &QFileSystemWatcher::fileChanged, this, &TrigramIndex::FileChanged);
+  
+  mExit = false;
+  mThread.reset(new std::thread(&TrigramIndex::ThreadMain, this));
+}
+
+TrigramIndex::~TrigramIndex() {
+  mutex.lock();
+  mExit = true;
+  mutex.unlock();
+  newWorkCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+void TrigramIndex::SetFiles(const std::unordered_set<QString>& canonicalPaths) {
+  QStringList removedPaths;
+  
+  mutex.lock();
+  for (auto it = files.begin(); it != files.end(); ) {
+    if (canonicalPaths.count(it->first) == 0) {
+      removedPaths.append(it->first);
+      it = files.erase(it);
+    } else {
+      ++ it;
+    }
+  }
+  mutex.unlock();
+  
+  if (!removedPaths.isEmpty()) {
+    watcher.removePaths(removedPaths);
+  }
+  AddFiles(canonicalPaths);
+}
+
+void TrigramIndex::AddFiles(const std::unordered_set<QString>& canonicalPaths) {
+  QStringList addedPaths;
+  
+  mutex.lock();
+  for (const QString& path : canonicalPaths) {
+    if (path.isEmpty() || files.count(path) > 0) {
+      continue;
+    }
+    files[path] = IndexedFile();
+    QueueFile(path);
+    addedPaths.append(path);
+  }
+  mutex.unlock();
+  
+  if (!addedPaths.isEmpty()) {
+    watcher.addPaths(addedPaths);
+    newWorkCondition.notify_one();
+  }
+}
+
+bool TrigramIndex::FindFilesThatCannotContain(const QString& text, Qt::CaseSensitivity caseSensitivity, std::unordered_set<QString>* paths) {
+  std::vector<quint32> queryTrigrams;
+  if (!GetQueryTrigrams(text, caseSensitivity, &queryTrigrams)) {
+    return false;
+  }
+  
+  std::unique_lock<std::mutex> lock(mutex);
+  for (const auto& item : files) {
+    const IndexedFile& file = item.second;
+    if (!file.upToDate) {
+      continue;
+    }
+    // Both trigram lists are sorted, so we can check for inclusion in linear
+    // time.
+    if (!std::includes(file.trigrams.begin(), file.trigrams.end(), queryTrigrams.begin(), queryTrigrams.end())) {
+      paths->insert(item.first);
+    }
+  }
+  return true;
+}
+
+void TrigramIndex::ExtractTrigrams(const char* data, qint64 size, std::vector<quint32>* trigrams) {
+  trigrams->clear();
+  if (size < 3) {
+    return;
+  }
+  trigrams->reserve(size - 2);
+  
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  quint32 trigram = (ToLowerAscii(bytes[0]) << 8) | ToLowerAscii(bytes[1]);
+  for (qint64 i = 2; i < size; ++ i) {
+    trigram = ((trigram << 8) | ToLowerAscii(bytes[i])) & 0xffffff;
+    trigrams->push_back(trigram);
+  }
+  
+  std::sort(trigrams->begin(), trigrams->end());
+  trigrams->erase(std::unique(trigrams->begin(), trigrams->end()), trigrams->end());
+}
+
+bool TrigramIndex::GetQueryTrigrams(const QString& text, Qt::CaseSensitivity caseSensitivity, std::vector<quint32>* trigrams) {
+  QByteArray textUtf8 = text.toUtf8();
+  if (textUtf8.size() < 3) {
+    return false;
+  }
+  if (caseSensitivity == Qt::CaseInsensitive) {
+    // The index only folds the case of ASCII characters.
+    for (char c : textUtf8) {
+      if (static_cast<unsigned char>(c) >= 0x80) {
+        return false;
+      }
+    }
+  }
+  
+  ExtractTrigrams(textUtf8.constData(), textUtf8.size(), trigrams);
+  return true;
+}
+
+void TrigramIndex::FileChanged(const QString& path) {
+  mutex.lock();
+  auto it = files.find(path);
+  if (it == files.end()) {
+    mutex.unlock();
+    return;
+  }
+  IndexedFile& file = it->second;
+  file.upToDate = false;
+  file.trigrams = std::vector<quint32>();
+  ++ file.changeCounter;
+  QueueFile(path);
+  mutex.unlock();
+  newWorkCondition.notify_one();
+  
+  // If the file was replaced (as some editors do when saving), the watcher
+  // stops watching it, so add it again.
+  if (!watcher.files().contains(path) && QFileInfo(path).exists()) {
+    watcher.addPath(path);
+  }
+}
+
+void TrigramIndex::ThreadMain() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (queuedPaths.empty() && !mExit) {
+      newWorkCondition.wait(lock);
+    }
+    if (mExit) {
+      return;
+    }
+    
+    QString path = queuedPaths.back();
+    queuedPaths.pop_back();
+    queuedPathsSet.erase(path);
+    auto it = files.find(path);
+    if (it == files.end()) {
+      continue;
+    }
+    int changeCounter = it->second.changeCounter;
+    lock.unlock();
+    
+    // Extract the trigrams from the file.
+    // TODO: Allow reading other formats than UTF-8 only?
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() > kMaxIndexedFileSize) {
+      continue;
+    }
+    std::vector<quint32> trigrams;
+    qint64 size = file.size();
+    uchar* data = (size > 0) ? file.map(0, size) : nullptr;
+    if (data) {
+      ExtractTrigrams(reinterpret_cast<const char*>(data), size, &trigrams);
+      file.unmap(data);
+    } else {
+      QByteArray content = file.readAll();
+      ExtractTrigrams(content.constData(), content.size(), &trigrams);
+    }
+    file.close();
+    
+    lock.lock();
+    it = files.find(path);
+    if (it != files.end() && it->second.changeCounter == changeCounter) {
+      it->second.trigrams.swap(trigrams);
+      it->second.upToDate = true;
+    }
+  }
+}
+
+void TrigramIndex::QueueFile(const QString& path) {
+  if (queuedPathsSet.insert(path).second) {
+    queuedPaths.push_back(path);
+  }
+}
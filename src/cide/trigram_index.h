@@ -0,0 +1,104 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <QFileSystemWatcher>
+#include <QObject>
+#include <QString>
+
+#include "cide/util.h"
+
+/// Index of the trigrams (sequences of three bytes) that occur in the content
+/// of a set of files. This allows to quickly determine the files that cannot
+/// contain a given text, such that text searches only need to look at the
+/// remaining files. The index is built in a background thread and kept
+/// up-to-date by watching the files for changes. Files that have not been
+/// (re-)indexed yet are never reported as not containing a text.
+///
+/// The trigrams are stored with ASCII letters converted to lowercase, such
+/// that the index can be used for both case-sensitive and case-insensitive
+/// searches.
+class TrigramIndex : public QObject {
+ Q_OBJECT
+ public:
+  TrigramIndex();
+  
+  /// Waits for the indexing thread to exit.
+  ~TrigramIndex();
+  
+  /// Sets the files to be indexed (given by their canonical paths). Files that
+  /// were indexed before but are not in @p canonicalPaths are removed from the
+  /// index. Must be called from the Qt thread.
+  void SetFiles(const std::unordered_set<QString>& canonicalPaths);
+  
+  /// Adds files to be indexed (given by their canonical paths). Files that are
+  /// in the index already are not changed. Must be called from the Qt thread.
+  void AddFiles(const std::unordered_set<QString>& canonicalPaths);
+  
+  /// Inserts the canonical paths of all indexed files that certainly do not
+  /// contain @p text into @p paths. Returns false if the index cannot be used
+  /// to narrow down the search for this text (for example, because it is
+  /// shorter than three bytes). Can be called from any thread.
+  bool FindFilesThatCannotContain(const QString& text, Qt::CaseSensitivity caseSensitivity, std::unordered_set<QString>* paths);
+  
+  /// Returns the sorted, unique trigrams in the given UTF-8 encoded data.
+  static void ExtractTrigrams(const char* data, qint64 size, std::vector<quint32>* trigrams);
+  
+  /// Returns the sorted, unique trigrams that a file must contain if it
+  /// contains @p text. Returns false if this is not possible for the given
+  /// text.
+  static bool GetQueryTrigrams(const QString& text, Qt::CaseSensitivity caseSensitivity, std::vector<quint32>* trigrams);
+  
+ private slots:
+  void FileChanged(const QString& path);
+  
+ private:
+  struct IndexedFile {
+    /// Sorted, unique trigrams of the file's content. Only valid if upToDate
+    /// is true.
+    std::vector<quint32> trigrams;
+    
+    /// Whether the trigrams have been extracted from the current version of
+    /// the file.
+    bool upToDate = false;
+    
+    /// Counter that is increased for each change of the file. This is used to
+    /// detect changes that happened while the file was being indexed.
+    int changeCounter = 0;
+  };
+  
+  void ThreadMain();
+  
+  /// Adds @p path to the work queue if it is not in it already. mutex must be
+  /// locked.
+  void QueueFile(const QString& path);
+  
+  /// Watches all files in the index for changes.
+  QFileSystemWatcher watcher;
+  
+  /// Protects all attributes below.
+  std::mutex mutex;
+  
+  /// Maps the canonical path of each file to its indexed data.
+  std::unordered_map<QString, IndexedFile> files;
+  
+  /// Paths of the files that need to be (re-)indexed.
+  std::vector<QString> queuedPaths;
+  std::unordered_set<QString> queuedPathsSet;
+  
+  // Threading
+  std::condition_variable newWorkCondition;
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
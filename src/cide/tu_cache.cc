@@ -0,0 +1,240 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/tu_cache.h"
+
+#include <algorithm>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "cide/clang_tu_pool.h"
+#include "cide/file_stat_cache.h"
+#include "cide/usr_index_cache.h"
+
+/// Identifies the metadata file format. Must be increased whenever the format
+/// changes, such that existing cache entries are discarded.
+constexpr quint32 kTUCacheMagic = 0x43545543;  // "CTUC"
+constexpr quint32 kTUCacheVersion = 1;
+
+/// Maximum total size of the serialized ASTs in the cache.
+constexpr qint64 kMaxTUCacheSize = 2048ll * 1024 * 1024;
+
+TUCache& TUCache::Instance() {
+  static TUCache instance;
+  return instance;
+}
+
+TUCache::~TUCache() {
+  Exit();
+}
+
+void TUCache::SaveAsync(const QString& canonicalPath, const std::shared_ptr<ClangTU>& TU) {
+  requestMutex.lock();
+  
+  // Replace an older request for the same file.
+  for (int i = 0; i < saveRequests.size(); ++ i) {
+    if (saveRequests[i].canonicalPath == canonicalPath) {
+      saveRequests.erase(saveRequests.begin() + i);
+      break;
+    }
+  }
+  
+  SaveRequest newRequest;
+  newRequest.canonicalPath = canonicalPath;
+  newRequest.TU = TU;
+  saveRequests.push_back(newRequest);
+  requestMutex.unlock();
+  newRequestCondition.notify_one();
+}
+
+bool TUCache::Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, CXIndex index, CXTranslationUnit* TU) {
+  QString basePath = GetCacheFileBasePath(canonicalPath);
+  QFile metaFile(basePath + QStringLiteral(".meta"));
+  if (!metaFile.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  
+  QDataStream stream(&metaFile);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  quint32 magic;
+  quint32 version;
+  QString storedPath;
+  QByteArray storedArgsHash;
+  qint64 ASTFileSize;
+  stream >> magic >> version;
+  if (magic != kTUCacheMagic || version != kTUCacheVersion) {
+    return false;
+  }
+  stream >> storedPath >> storedArgsHash >> ASTFileSize;
+  if (storedPath != canonicalPath ||
+      storedArgsHash != USRIndexCache::HashCommandLineArgs(commandLineArgs)) {
+    return false;
+  }
+  
+  // Check whether any of the files that were seen while parsing changed since
+  // the TU was saved.
+  quint32 numIncludes;
+  stream >> numIncludes;
+  for (quint32 i = 0; i < numIncludes; ++ i) {
+    QString includePath;
+    qint64 modificationTime;
+    stream >> includePath >> modificationTime;
+    if (stream.status() != QDataStream::Ok) {
+      return false;
+    }
+    
+    if (FileStatCache::Instance().GetModificationTime(includePath) != modificationTime) {
+      return false;
+    }
+  }
+  
+  QString ASTPath = basePath + QStringLiteral(".ast");
+  if (QFileInfo(ASTPath).size() != ASTFileSize) {
+    return false;
+  }
+  
+  CXErrorCode result = clang_createTranslationUnit2(index, ASTPath.toLocal8Bit().data(), TU);
+  if (result != CXError_Success) {
+    qDebug() << "TUCache: Failed to load the saved TU for" << canonicalPath;
+    Remove(canonicalPath);
+    return false;
+  }
+  return true;
+}
+
+void TUCache::Remove(const QString& canonicalPath) {
+  QString basePath = GetCacheFileBasePath(canonicalPath);
+  QFile::remove(basePath + QStringLiteral(".meta"));
+  QFile::remove(basePath + QStringLiteral(".ast"));
+}
+
+void TUCache::Exit() {
+  requestMutex.lock();
+  mExit = true;
+  requestMutex.unlock();
+  newRequestCondition.notify_all();
+  if (mThread) {
+    mThread->join();
+    mThread.reset();
+  }
+}
+
+TUCache::TUCache() {
+  QString cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir dir(cachePath);
+  dir = dir.filePath("tu_cache");
+  dir.mkpath(".");
+  cacheDir = dir.path();
+  
+  mExit = false;
+  mThread.reset(new std::thread(&TUCache::ThreadMain, this));
+}
+
+void TUCache::ThreadMain() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(requestMutex);
+    // Finish the pending requests before exiting, since the TUs of the
+    // documents that are open on exit are saved only then.
+    while (saveRequests.empty()) {
+      if (mExit) {
+        return;
+      }
+      newRequestCondition.wait(lock);
+    }
+    SaveRequest request = saveRequests.front();
+    saveRequests.erase(saveRequests.begin());
+    lock.unlock();
+    
+    if (Save(request)) {
+      Prune();
+    }
+  }
+}
+
+bool TUCache::Save(const SaveRequest& request) {
+  ClangTU* TU = request.TU.get();
+  if (!TU->isInitialized()) {
+    return false;
+  }
+  
+  QString basePath = GetCacheFileBasePath(request.canonicalPath);
+  QString metaPath = basePath + QStringLiteral(".meta");
+  QString ASTPath = basePath + QStringLiteral(".ast");
+  
+  // Remove the old metadata first, such that Load() never pairs it with the
+  // new AST file.
+  QFile::remove(metaPath);
+  
+  QString temporaryASTPath = ASTPath + QStringLiteral(".tmp");
+  int saveResult = clang_saveTranslationUnit(TU->TU(), temporaryASTPath.toLocal8Bit().data(), clang_defaultSaveOptions(TU->TU()));
+  if (saveResult != CXSaveError_None) {
+    qDebug() << "TUCache: Failed to save the TU for" << request.canonicalPath << "(error" << saveResult << ")";
+    QFile::remove(temporaryASTPath);
+    return false;
+  }
+  QFile::remove(ASTPath);
+  if (!QFile::rename(temporaryASTPath, ASTPath)) {
+    QFile::remove(temporaryASTPath);
+    return false;
+  }
+  
+  QSaveFile metaFile(metaPath);
+  if (!metaFile.open(QIODevice::WriteOnly)) {
+    qDebug() << "TUCache: Cannot write metadata file:" << metaPath;
+    return false;
+  }
+  
+  QDataStream stream(&metaFile);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  stream << kTUCacheMagic << kTUCacheVersion;
+  stream << request.canonicalPath
+         << USRIndexCache::HashCommandLineArgs(TU->GetCommandLine()->args)
+         << QFileInfo(ASTPath).size();
+  
+  const std::vector<ClangTU::IncludeWithModificationTime>& includes = TU->GetIncludes();
+  stream << static_cast<quint32>(includes.size());
+  for (const ClangTU::IncludeWithModificationTime& include : includes) {
+    stream << QFileInfo(QString::fromUtf8(include.path)).canonicalFilePath()
+           << static_cast<qint64>(include.lastModificationTime);
+  }
+  
+  if (stream.status() != QDataStream::Ok) {
+    metaFile.cancelWriting();
+    return false;
+  }
+  return metaFile.commit();
+}
+
+void TUCache::Prune() {
+  QDir cacheQDir(cacheDir);
+  QFileInfoList ASTFiles = cacheQDir.entryInfoList(QStringList() << QStringLiteral("*.ast"), QDir::Files, QDir::Time);  // newest first
+  
+  qint64 totalSize = 0;
+  for (const QFileInfo& info : ASTFiles) {
+    totalSize += info.size();
+  }
+  
+  for (int i = ASTFiles.size() - 1; i >= 0 && totalSize > kMaxTUCacheSize; -- i) {
+    QString basePath = ASTFiles[i].absoluteFilePath();
+    basePath.chop(4);  // ".ast"
+    QFile::remove(basePath + QStringLiteral(".meta"));
+    QFile::remove(ASTFiles[i].absoluteFilePath());
+    totalSize -= ASTFiles[i].size();
+  }
+}
+
+QString TUCache::GetCacheFileBasePath(const QString& canonicalPath) const {
+  QByteArray pathHash = QCryptographicHash::hash(canonicalPath.toUtf8(), QCryptographicHash::Sha1).toHex();
+  return QDir(cacheDir).filePath(QString::fromLatin1(pathHash));
+}
@@ -0,0 +1,87 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <clang-c/Index.h>
+#include <QByteArray>
+#include <QString>
+
+class ClangTU;
+
+/// Stores the libclang TUs of closed documents on disk (using
+/// clang_saveTranslationUnit()), such that reopening a document, also after
+/// restarting the program, can show the semantic highlighting and answer code
+/// info requests right away instead of waiting for the first parse.
+///
+/// An entry consists of the serialized AST and a metadata file. It is only
+/// valid if the command-line arguments for parsing the file are unchanged and
+/// all files seen while parsing it (the file itself and all included files)
+/// still have the same modification times as when the entry was created.
+///
+/// TUs that were loaded from the cache cannot be reparsed or used for code
+/// completion by libclang, so the document must be parsed normally as well
+/// (see ClangTU::IsLoadedFromCache()). The total size of the cache is limited;
+/// the least recently saved entries are removed first.
+class TUCache {
+ public:
+  static TUCache& Instance();
+  
+  ~TUCache();
+  
+  /// Saves the given TU of the file @p canonicalPath in a background thread.
+  /// The TU must have been parsed from the files on disk (see
+  /// ClangTU::IsParsedFromFilesOnDisk()), and must not be used by the caller
+  /// anymore.
+  void SaveAsync(const QString& canonicalPath, const std::shared_ptr<ClangTU>& TU);
+  
+  /// Tries to load the TU for the file @p canonicalPath with the given
+  /// @p commandLineArgs using @p index. Returns true and sets @p TU if a valid
+  /// entry was found, false otherwise.
+  bool Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, CXIndex index, CXTranslationUnit* TU);
+  
+  /// Removes the entry for the file @p canonicalPath, if any.
+  void Remove(const QString& canonicalPath);
+  
+  /// Finishes the pending save requests, then makes the save thread exit and
+  /// waits for it.
+  void Exit();
+  
+ private:
+  struct SaveRequest {
+    QString canonicalPath;
+    std::shared_ptr<ClangTU> TU;
+  };
+  
+  TUCache();
+  
+  void ThreadMain();
+  
+  bool Save(const SaveRequest& request);
+  
+  /// Removes the least recently saved entries while the total size of the
+  /// cache exceeds kMaxTUCacheSize.
+  void Prune();
+  
+  QString GetCacheFileBasePath(const QString& canonicalPath) const;
+  
+  
+  // Thread input handling
+  std::mutex requestMutex;
+  std::condition_variable newRequestCondition;
+  std::vector<SaveRequest> saveRequests;
+  
+  QString cacheDir;
+  
+  // Threading
+  std::atomic<bool> mExit;
+  std::shared_ptr<std::thread> mThread;
+};
@@ -0,0 +1,339 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <git2.h>
+#include <QApplication>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QKeyEvent>
+#include <QKeySequence>
+#include <QTextStream>
+
+#include "cide/background_reclaimer.h"
+#include "cide/code_info.h"
+#include "cide/crash_backup.h"
+#include "cide/document.h"
+#include "cide/document_widget.h"
+#include "cide/git_diff.h"
+#include "cide/git_status.h"
+#include "cide/main_window.h"
+#include "cide/parse_thread_pool.h"
+#include "cide/phrase_highlighter.h"
+#include "cide/qt_help.h"
+#include "cide/qt_thread.h"
+#include "cide/tu_cache.h"
+
+// Typing latency benchmark for DocumentWidget. Run as:
+//   CIDETypingBenchmark <source file> [keystrokes]
+// The benchmark opens the given (preferably large) source file in an offscreen
+// main window and replays a keystroke stream in it, sending each key press
+// to the DocumentWidget and then repainting it synchronously. The key press
+// covers the document modification (InsertText() / Replace()) and the checks
+// that run on each edit, such as bracket and phrase highlighting and word
+// completion; the repaint covers CheckRelayout() and paintEvent(). Latency
+// percentiles are printed for each phase. The file on disk is not modified.
+//
+// The keystroke file contains one entry per line:
+//   goto <line> <column>   (moves the cursor; not measured)
+//   type <text>            (one key press per character of the text)
+//   key <key sequence>     (a single key press, e.g., "Return", "Backspace",
+//                           "Ctrl+Left"; see QKeySequence::fromString())
+// line and column are 1-based. Empty lines and lines starting with '#' are
+// ignored. If no keystroke file is given, a synthetic stream is used that
+// types a few lines of code at positions spread over the file.
+
+struct Keystroke {
+  enum class Type {
+    Goto = 0,
+    KeyPress
+  };
+  
+  Type type;
+  
+  // For Type::Goto (1-based)
+  int line;
+  int column;
+  
+  // For Type::KeyPress
+  int key;
+  Qt::KeyboardModifiers modifiers;
+  QString text;
+};
+
+static double SecondsSince(std::chrono::steady_clock::time_point startTime) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+/// Prints the latency percentiles of the given measurements (in seconds).
+static void PrintLatencies(const char* name, std::vector<double> seconds) {
+  if (seconds.empty()) {
+    std::cout << name << ": no measurements" << std::endl;
+    return;
+  }
+  
+  std::sort(seconds.begin(), seconds.end());
+  auto percentile = [&](double p) {
+    int index = std::max(0, static_cast<int>(std::ceil(p * seconds.size())) - 1);
+    return 1000 * seconds[index];
+  };
+  double sum = 0;
+  for (double value : seconds) {
+    sum += value;
+  }
+  
+  std::cout << name << " [" << seconds.size() << " keystrokes]: "
+            << "p50 " << percentile(0.5) << " ms, "
+            << "p90 " << percentile(0.9) << " ms, "
+            << "p99 " << percentile(0.99) << " ms, "
+            << "max " << (1000 * seconds.back()) << " ms, "
+            << "mean " << (1000 * sum / seconds.size()) << " ms" << std::endl;
+}
+
+static Keystroke CreateKeyPress(int key, Qt::KeyboardModifiers modifiers, const QString& text) {
+  Keystroke keystroke;
+  keystroke.type = Keystroke::Type::KeyPress;
+  keystroke.key = key;
+  keystroke.modifiers = modifiers;
+  keystroke.text = text;
+  return keystroke;
+}
+
+/// Appends one key press per character of @p text to @p keystrokes.
+static void AppendTypedText(const QString& text, std::vector<Keystroke>* keystrokes) {
+  for (QChar c : text) {
+    // Qt uses the upper-case character code as key code for letters.
+    keystrokes->push_back(CreateKeyPress(c.toUpper().unicode(), c.isUpper() ? Qt::ShiftModifier : Qt::NoModifier, QString(c)));
+  }
+}
+
+static bool LoadKeystrokes(const QString& path, std::vector<Keystroke>* keystrokes) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    std::cout << "Cannot read the keystroke file: " << path.toStdString() << std::endl;
+    return false;
+  }
+  
+  QTextStream stream(&file);
+  int lineNumber = 0;
+  while (!stream.atEnd()) {
+    QString line = stream.readLine();
+    ++ lineNumber;
+    if (line.trimmed().isEmpty() || line.trimmed().startsWith('#')) {
+      continue;
+    }
+    
+    int spacePos = line.indexOf(' ');
+    QString command = line.left(spacePos);
+    QString argument = (spacePos >= 0) ? line.mid(spacePos + 1) : QString();
+    bool ok = false;
+    if (command == "goto") {
+      QStringList words = argument.split(' ', QString::SkipEmptyParts);
+      bool lineOk = false;
+      bool columnOk = false;
+      Keystroke keystroke;
+      keystroke.type = Keystroke::Type::Goto;
+      if (words.size() == 2) {
+        keystroke.line = words[0].toInt(&lineOk);
+        keystroke.column = words[1].toInt(&columnOk);
+      }
+      ok = lineOk && columnOk;
+      if (ok) {
+        keystrokes->push_back(keystroke);
+      }
+    } else if (command == "type") {
+      AppendTypedText(argument, keystrokes);
+      ok = !argument.isEmpty();
+    } else if (command == "key") {
+      QKeySequence sequence = QKeySequence::fromString(argument.trimmed());
+      ok = sequence.count() == 1;
+      if (ok) {
+        int combination = sequence[0];
+        int key = combination & ~Qt::KeyboardModifierMask;
+        QString text;
+        if (key == Qt::Key_Tab) {
+          text = QStringLiteral("\t");
+        } else if (key == Qt::Key_Return) {
+          text = QStringLiteral("\r");
+        }
+        keystrokes->push_back(CreateKeyPress(key, static_cast<Qt::KeyboardModifiers>(combination & Qt::KeyboardModifierMask), text));
+      }
+    }
+    
+    if (!ok) {
+      std::cout << "Invalid entry in line " << lineNumber << " of the keystroke file: " << line.toStdString() << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Creates a keystroke stream that types some code (with typos that are
+/// corrected again) at @p siteCount positions spread over a file with
+/// @p lineCount lines.
+static void CreateSyntheticKeystrokes(int lineCount, int siteCount, std::vector<Keystroke>* keystrokes) {
+  for (int site = 0; site < siteCount; ++ site) {
+    Keystroke gotoKeystroke;
+    gotoKeystroke.type = Keystroke::Type::Goto;
+    gotoKeystroke.line = 1 + static_cast<int>((site + 0.5) * lineCount / siteCount);
+    gotoKeystroke.column = 1;
+    keystrokes->push_back(gotoKeystroke);
+    
+    keystrokes->push_back(CreateKeyPress(Qt::Key_End, Qt::NoModifier, QString()));
+    keystrokes->push_back(CreateKeyPress(Qt::Key_Return, Qt::NoModifier, QStringLiteral("\r")));
+    AppendTypedText(QStringLiteral("if (valeu"), keystrokes);
+    for (int i = 0; i < 2; ++ i) {
+      keystrokes->push_back(CreateKeyPress(Qt::Key_Backspace, Qt::NoModifier, QString()));
+    }
+    AppendTypedText(QStringLiteral("ue.size() > kMinSize) {"), keystrokes);
+    keystrokes->push_back(CreateKeyPress(Qt::Key_Return, Qt::NoModifier, QStringLiteral("\r")));
+    AppendTypedText(QStringLiteral("result += Compute(value[0], \"text\", 42);"), keystrokes);
+    for (int i = 0; i < 5; ++ i) {
+      keystrokes->push_back(CreateKeyPress(Qt::Key_Left, Qt::ControlModifier, QString()));
+    }
+    keystrokes->push_back(CreateKeyPress(Qt::Key_End, Qt::NoModifier, QString()));
+    keystrokes->push_back(CreateKeyPress(Qt::Key_Return, Qt::NoModifier, QStringLiteral("\r")));
+    AppendTypedText(QStringLiteral("}"), keystrokes);
+  }
+}
+
+static int RunBenchmark(const QString& filePath, const QString& keystrokesPath) {
+  std::vector<Keystroke> keystrokes;
+  if (!keystrokesPath.isEmpty() && !LoadKeystrokes(keystrokesPath, &keystrokes)) {
+    return 1;
+  }
+  
+  // Create a MainWindow in the Qt thread which will also get destructed in the Qt thread again
+  std::shared_ptr<MainWindow> mainWindow;
+  RunInQtThreadBlocking([&]() {
+    mainWindow.reset(new MainWindow(), [&](MainWindow* ptr) {
+      RunInQtThreadBlocking([&]() {
+        delete ptr;
+      });
+    });
+    mainWindow->resize(1600, 1000);
+    mainWindow->show();
+  });
+  
+  // Open the file
+  QString canonicalPath = QFileInfo(filePath).canonicalFilePath();
+  Document* document = nullptr;
+  DocumentWidget* widget = nullptr;
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  RunInQtThreadBlocking([&]() {
+    mainWindow->Open(canonicalPath);
+    mainWindow->GetDocumentAndWidgetForPath(canonicalPath, &document, &widget);
+  });
+  if (!widget) {
+    std::cout << "Failed to open the file: " << filePath.toStdString() << std::endl;
+    return 1;
+  }
+  int lineCount = 0;
+  RunInQtThreadBlocking([&]() {
+    lineCount = document->LineCount();
+    widget->setFocus();
+    widget->repaint();
+  });
+  std::cout << "Opening the file (" << lineCount << " lines): " << (1000 * SecondsSince(startTime)) << " ms" << std::endl;
+  
+  if (keystrokesPath.isEmpty()) {
+    CreateSyntheticKeystrokes(lineCount, /*siteCount*/ 20, &keystrokes);
+  }
+  
+  // Replay the keystrokes. Each keystroke is replayed in its own
+  // RunInQtThreadBlocking() call, such that the Qt thread processes other
+  // events in between (such as phrase highlight results), like during typing.
+  std::vector<double> keySeconds;
+  std::vector<double> paintSeconds;
+  std::vector<double> totalSeconds;
+  for (const Keystroke& keystroke : keystrokes) {
+    RunInQtThreadBlocking([&]() {
+      if (keystroke.type == Keystroke::Type::Goto) {
+        widget->SetCursor(widget->MapLineColToDocumentLocation(keystroke.line - 1, keystroke.column - 1), false);
+        widget->repaint();
+        return;
+      }
+      
+      std::chrono::steady_clock::time_point keyStartTime = std::chrono::steady_clock::now();
+      QKeyEvent pressEvent(QEvent::KeyPress, keystroke.key, keystroke.modifiers, keystroke.text);
+      QApplication::sendEvent(widget, &pressEvent);
+      QKeyEvent releaseEvent(QEvent::KeyRelease, keystroke.key, keystroke.modifiers, keystroke.text);
+      QApplication::sendEvent(widget, &releaseEvent);
+      keySeconds.push_back(SecondsSince(keyStartTime));
+      
+      std::chrono::steady_clock::time_point paintStartTime = std::chrono::steady_clock::now();
+      widget->repaint();
+      paintSeconds.push_back(SecondsSince(paintStartTime));
+      
+      totalSeconds.push_back(SecondsSince(keyStartTime));
+    });
+  }
+  PrintLatencies("Key press", keySeconds);
+  PrintLatencies("Repaint", paintSeconds);
+  PrintLatencies("Total", totalSeconds);
+  
+  RunInQtThreadBlocking([&]() {
+    widget->CloseCodeCompletion();
+  });
+  
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // Initialize libgit2
+  git_libgit2_init();
+  
+  // Render offscreen, unless requested otherwise.
+  if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  
+  QApplication qapp(argc, argv);
+  QCoreApplication::setOrganizationName("PuzzlePaint");
+  QCoreApplication::setOrganizationDomain("puzzlepaint.net");
+  QCoreApplication::setApplicationName("CIDE");
+  
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <source file> [keystrokes]" << std::endl;
+    return 1;
+  }
+  QString filePath = QString::fromLocal8Bit(argv[1]);
+  QString keystrokesPath = (argc >= 3) ? QString::fromLocal8Bit(argv[2]) : QString();
+  
+  // Run the benchmark in a second thread while the main thread runs a Qt event
+  // loop. This allows RunInQtThreadBlocking() to operate correctly.
+  int result;
+  std::atomic<bool> finished;
+  finished = false;
+  
+  std::thread benchmarkThread([&]() {
+    result = RunBenchmark(filePath, keystrokesPath);
+    ParseThreadPool::Instance().ExitAllThreads();
+    TUCache::Instance().Exit();
+    CodeInfo::Instance().Exit();
+    CrashBackup::Instance().Exit();
+    GitDiff::Instance().Exit();
+    GitStatus::Instance().Exit();
+    PhraseHighlighter::Instance().Exit();
+    QtHelp::Instance().Exit();
+    BackgroundReclaimer::Instance().Exit();
+    finished = true;
+  });
+  
+  QEventLoop exitEventLoop;
+  while (!finished) {
+    exitEventLoop.processEvents();
+  }
+  benchmarkThread.join();
+  
+  return result;
+}
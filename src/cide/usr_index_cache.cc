@@ -0,0 +1,259 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "cide/usr_index_cache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "cide/file_stat_cache.h"
+
+/// Identifies the cache file format. Must be increased whenever the format
+/// changes, such that existing cache files are discarded.
+constexpr quint32 kUSRIndexCacheMagic = 0x43494458;  // "CIDX"
+constexpr quint32 kUSRIndexCacheVersion = 3;
+
+USRIndexCache& USRIndexCache::Instance() {
+  static USRIndexCache instance;
+  return instance;
+}
+
+bool USRIndexCache::Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Entry* entry) {
+  QFile file(GetCacheFilePath(canonicalPath));
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  quint32 magic;
+  quint32 version;
+  QString storedPath;
+  QByteArray storedArgsHash;
+  stream >> magic >> version;
+  if (magic != kUSRIndexCacheMagic || version != kUSRIndexCacheVersion) {
+    return false;
+  }
+  stream >> storedPath >> storedArgsHash;
+  if (storedPath != canonicalPath ||
+      storedArgsHash != HashCommandLineArgs(commandLineArgs)) {
+    return false;
+  }
+  
+  // Read the included files and check whether any of them changed since the
+  // cache entry was written.
+  quint32 numIncludes;
+  stream >> numIncludes;
+  entry->includes.resize(numIncludes);
+  for (quint32 i = 0; i < numIncludes; ++ i) {
+    std::pair<QString, qint64>& include = entry->includes[i];
+    stream >> include.first >> include.second;
+    if (stream.status() != QDataStream::Ok) {
+      return false;
+    }
+    
+    if (FileStatCache::Instance().GetModificationTime(include.first) != include.second) {
+      return false;
+    }
+  }
+  
+  if (!ReadEntryData(&stream, entry)) {
+    return false;
+  }
+  return ReadCommentMarkers(&stream, &entry->commentMarkers);
+}
+
+bool USRIndexCache::Save(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, const Entry& entry) {
+  QDir cacheQDir(cacheDir);
+  if (!cacheQDir.exists()) {
+    cacheQDir.mkpath(".");
+  }
+  
+  // Use QSaveFile such that no partially written cache file can be seen by
+  // Load(), even if it runs concurrently or the program crashes while writing.
+  QSaveFile file(GetCacheFilePath(canonicalPath));
+  if (!file.open(QIODevice::WriteOnly)) {
+    qDebug() << "Error: Cannot write USR index cache file:" << file.fileName();
+    return false;
+  }
+  
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  
+  stream << kUSRIndexCacheMagic << kUSRIndexCacheVersion;
+  stream << canonicalPath << HashCommandLineArgs(commandLineArgs);
+  
+  stream << static_cast<quint32>(entry.includes.size());
+  for (const std::pair<QString, qint64>& include : entry.includes) {
+    stream << include.first << include.second;
+  }
+  
+  WriteEntryData(entry, &stream);
+  WriteCommentMarkers(entry.commentMarkers, &stream);
+  
+  if (stream.status() != QDataStream::Ok) {
+    file.cancelWriting();
+    return false;
+  }
+  return file.commit();
+}
+
+void USRIndexCache::Remove(const QString& canonicalPath) {
+  QFile::remove(GetCacheFilePath(canonicalPath));
+}
+
+void USRIndexCache::Clear() {
+  QDir cacheQDir(cacheDir);
+  QStringList cacheFiles = cacheQDir.entryList(QDir::NoDotAndDotDot | QDir::Files);
+  for (const QString& cacheFilename : cacheFiles) {
+    QFile::remove(cacheQDir.filePath(cacheFilename));
+  }
+}
+
+USRIndexCache::USRIndexCache() {
+  QString cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir dir(cachePath);
+  dir = dir.filePath("usr_index");
+  dir.mkpath(".");
+  cacheDir = dir.path();
+}
+
+QString USRIndexCache::GetCacheFilePath(const QString& canonicalPath) const {
+  QByteArray pathHash = QCryptographicHash::hash(canonicalPath.toUtf8(), QCryptographicHash::Sha1).toHex();
+  return QDir(cacheDir).filePath(QString::fromLatin1(pathHash));
+}
+
+QByteArray USRIndexCache::HashCommandLineArgs(const std::vector<QByteArray>& commandLineArgs) {
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  for (const QByteArray& arg : commandLineArgs) {
+    hash.addData(arg);
+    hash.addData("\0", 1);
+  }
+  return hash.result();
+}
+
+void USRIndexCache::WriteEntryData(const Entry& entry, QDataStream* stream) {
+  *stream << static_cast<quint32>(entry.USRs.size());
+  for (const auto& fileUSRs : entry.USRs) {
+    *stream << fileUSRs.first << static_cast<quint32>(fileUSRs.second.size());
+    for (const std::pair<QByteArray, USRDecl>& item : fileUSRs.second) {
+      const USRDecl& decl = item.second;
+      *stream << item.first
+              << decl.spelling
+              << static_cast<qint32>(decl.line)
+              << static_cast<qint32>(decl.column)
+              << decl.isDefinition
+              << static_cast<qint32>(decl.kind)
+              << static_cast<qint32>(decl.namePos)
+              << static_cast<qint32>(decl.nameSize);
+    }
+  }
+  
+  *stream << entry.referencesComplete << static_cast<quint32>(entry.references.size());
+  for (const auto& fileReferences : entry.references) {
+    *stream << fileReferences.first << static_cast<quint32>(fileReferences.second.size());
+    for (const QByteArray& USR : fileReferences.second) {
+      *stream << USR;
+    }
+  }
+}
+
+bool USRIndexCache::ReadEntryData(QDataStream* stream, Entry* entry) {
+  quint32 numFiles;
+  *stream >> numFiles;
+  entry->USRs.clear();
+  entry->USRs.reserve(numFiles);
+  for (quint32 fileIndex = 0; fileIndex < numFiles; ++ fileIndex) {
+    QString filePath;
+    quint32 numUSRs;
+    *stream >> filePath >> numUSRs;
+    if (stream->status() != QDataStream::Ok) {
+      return false;
+    }
+    
+    std::vector<std::pair<QByteArray, USRDecl>>& fileUSRs = entry->USRs[filePath];
+    fileUSRs.reserve(numUSRs);
+    for (quint32 i = 0; i < numUSRs; ++ i) {
+      QByteArray USR;
+      QString spelling;
+      qint32 line;
+      qint32 column;
+      bool isDefinition;
+      qint32 kind;
+      qint32 namePos;
+      qint32 nameSize;
+      *stream >> USR >> spelling >> line >> column >> isDefinition >> kind >> namePos >> nameSize;
+      fileUSRs.emplace_back(USR, USRDecl(spelling, line, column, isDefinition, static_cast<CXCursorKind>(kind), namePos, nameSize));
+    }
+  }
+  
+  // Read the referenced USRs.
+  *stream >> entry->referencesComplete >> numFiles;
+  entry->references.clear();
+  entry->references.reserve(numFiles);
+  for (quint32 fileIndex = 0; fileIndex < numFiles; ++ fileIndex) {
+    QString filePath;
+    quint32 numReferences;
+    *stream >> filePath >> numReferences;
+    if (stream->status() != QDataStream::Ok) {
+      return false;
+    }
+    
+    std::vector<QByteArray>& fileReferences = entry->references[filePath];
+    fileReferences.resize(numReferences);
+    for (quint32 i = 0; i < numReferences; ++ i) {
+      *stream >> fileReferences[i];
+    }
+  }
+  
+  return stream->status() == QDataStream::Ok;
+}
+
+void USRIndexCache::WriteCommentMarkers(const CommentMarkerSet& markers, QDataStream* stream) {
+  *stream << markers.markerWords << static_cast<quint32>(markers.files.size());
+  for (const auto& fileMarkers : markers.files) {
+    *stream << fileMarkers.first << static_cast<quint32>(fileMarkers.second.size());
+    for (const CommentMarker& marker : fileMarkers.second) {
+      *stream << static_cast<qint32>(marker.line)
+              << static_cast<qint32>(marker.column)
+              << marker.marker
+              << marker.text;
+    }
+  }
+}
+
+bool USRIndexCache::ReadCommentMarkers(QDataStream* stream, CommentMarkerSet* markers) {
+  quint32 numFiles;
+  *stream >> markers->markerWords >> numFiles;
+  markers->files.clear();
+  markers->files.reserve(numFiles);
+  for (quint32 fileIndex = 0; fileIndex < numFiles; ++ fileIndex) {
+    QString filePath;
+    quint32 numMarkers;
+    *stream >> filePath >> numMarkers;
+    if (stream->status() != QDataStream::Ok) {
+      return false;
+    }
+    
+    std::vector<CommentMarker>& fileMarkers = markers->files[filePath];
+    fileMarkers.resize(numMarkers);
+    for (quint32 i = 0; i < numMarkers; ++ i) {
+      CommentMarker& marker = fileMarkers[i];
+      qint32 line;
+      qint32 column;
+      *stream >> line >> column >> marker.marker >> marker.text;
+      marker.line = line;
+      marker.column = column;
+    }
+  }
+  
+  return stream->status() == QDataStream::Ok;
+}
@@ -0,0 +1,92 @@
+// Copyright 2020 Thomas Schöps
+// This file is part of CIDE, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QString>
+
+#include "cide/clang_parser.h"
+#include "cide/comment_marker_index.h"
+#include "cide/util.h"
+
+/// Stores the indexing results of project source files (their list of included
+/// files and the USRs that were extracted from their translation units) on
+/// disk, such that files whose inputs did not change do not need to be
+/// re-parsed for indexing after restarting the program.
+/// 
+/// Each source file is stored in its own cache file. An entry is only valid if
+/// the command-line arguments that are used to parse the file are unchanged and
+/// all files seen while parsing it (the source file itself and all included
+/// files) still have the same modification times as when the entry was created.
+/// 
+/// This class is thread-safe (each cache file is written atomically).
+class USRIndexCache {
+ public:
+  struct Entry {
+    /// Canonical paths of all files that were seen while parsing the source file
+    /// (including the source file itself), together with their last
+    /// modification times (in seconds since epoch).
+    std::vector<std::pair<QString, qint64>> includes;
+    
+    /// The USRs that parsing the source file yielded, grouped by the canonical
+    /// path of the file they are located in.
+    USRsByFile USRs;
+    
+    /// The referenced USRs, grouped by the canonical path of the file that
+    /// references them, and whether they were collected with function bodies.
+    USRReferencesByFile references;
+    bool referencesComplete = false;
+    
+    /// The comment markers in the files of @a includes (see
+    /// CommentMarkerIndex).
+    CommentMarkerSet commentMarkers;
+  };
+  
+  static USRIndexCache& Instance();
+  
+  /// Tries to load the cache entry for the source file @p canonicalPath. Returns
+  /// true if a valid entry was found for the given @p commandLineArgs. Returns
+  /// false if no entry exists or it is outdated.
+  bool Load(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, Entry* entry);
+  
+  /// Stores the cache entry for the source file @p canonicalPath, replacing any
+  /// existing entry for it. Returns true on success, false otherwise.
+  bool Save(const QString& canonicalPath, const std::vector<QByteArray>& commandLineArgs, const Entry& entry);
+  
+  /// Removes the cache entry for the source file @p canonicalPath, if any.
+  void Remove(const QString& canonicalPath);
+  
+  /// Deletes all cache files.
+  void Clear();
+  
+  /// Returns a hash of the given command-line arguments. Equal hashes
+  /// identify equal compile settings.
+  static QByteArray HashCommandLineArgs(const std::vector<QByteArray>& commandLineArgs);
+  
+  /// Writes the USRs and references of @p entry (but not its includes and
+  /// comment markers) to @p stream, in the format of the cache files. This is
+  /// also used for index bundles (see ExportIndexBundle()).
+  static void WriteEntryData(const Entry& entry, QDataStream* stream);
+  
+  /// Reads data that was written with WriteEntryData() into @p entry. Returns
+  /// true on success.
+  static bool ReadEntryData(QDataStream* stream, Entry* entry);
+  
+ private:
+  USRIndexCache();
+  
+  QString GetCacheFilePath(const QString& canonicalPath) const;
+  
+  static void WriteCommentMarkers(const CommentMarkerSet& markers, QDataStream* stream);
+  static bool ReadCommentMarkers(QDataStream* stream, CommentMarkerSet* markers);
+  
+  
+  QString cacheDir;
+};
@@ -4,7 +4,18 @@
 
 #include "cide/util.h"
 
+#ifdef WIN32
+  #include <windows.h>
+#elif defined(__linux__)
+  #include <fcntl.h>
+  #include <malloc.h>
+  #include <sys/resource.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
 #include <QDir>
+#include <QFile>
 #include <QPushButton>
 #include <QProcessEnvironment>
 
@@ -100,6 +111,47 @@ QRgb ParseHexColor(const QString& text) {
   return qRgb(r, g, b);
 }
 
+void LowerCurrentThreadPriority() {
+#ifdef WIN32
+  // Lowers both the CPU and the I/O priority of the thread.
+  SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+  // On Linux, the nice value and the I/O priority apply to individual threads
+  // when given their thread ID.
+  constexpr int kBackgroundNiceValue = 10;
+  pid_t threadId = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, threadId, kBackgroundNiceValue);
+  
+  // Use the lowest priority within the best-effort I/O class. There is no
+  // glibc wrapper for ioprio_set(), and the constants are not exported in a
+  // userspace header on all systems.
+  constexpr int kIOPrioWhoProcess = 1;
+  constexpr int kIOPrioClassShift = 13;
+  constexpr int kIOPrioClassBestEffort = 2;
+  constexpr int kIOPrioLowestLevel = 7;
+  syscall(SYS_ioprio_set, kIOPrioWhoProcess, threadId, (kIOPrioClassBestEffort << kIOPrioClassShift) | kIOPrioLowestLevel);
+#endif
+}
+
+void AdviseWillReadFile(const QString& path) {
+#if defined(__linux__)
+  int fd = open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#else
+  (void) path;
+#endif
+}
+
+void ReturnFreedMemoryToSystem() {
+#if defined(__GLIBC__)
+  malloc_trim(0);
+#endif
+}
+
 QString ToHexColorString(const QRgb& color) {
   return QStringLiteral("%1%2%3")
       .arg(static_cast<uint>(qRed(color)), 2, 16, QLatin1Char('0'))
@@ -53,6 +53,27 @@ void MinimizeButtonSize(QPushButton* button, float factor);
 QString FindDefaultClangBinaryPath();
 
 
+/// Lowers the CPU and I/O scheduling priority of the calling thread, such that
+/// it yields to the user interface and to other programs (e.g., a running
+/// build). Note that unprivileged threads generally cannot raise their
+/// priority again afterwards, so this should only be used for threads that do
+/// background work for their whole lifetime.
+void LowerCurrentThreadPriority();
+
+
+/// Tells the operating system that the file with the given path will be read
+/// soon, such that it can start reading it into its page cache in the
+/// background. Returns without waiting for the read. This does nothing on
+/// systems other than Linux.
+void AdviseWillReadFile(const QString& path);
+
+/// Returns freed heap memory to the operating system, if the C library keeps
+/// it otherwise. This can take a while, so it should be called from a
+/// background thread after freeing large amounts of memory. This does
+/// nothing for C libraries other than glibc.
+void ReturnFreedMemoryToSystem();
+
+
 /// Returns a set of Qt::WindowFlags that allow for making custom tooltip-style widgets.
 /// Using Qt::ToolTip worked on Linux but failed on Windows, since those tooltips
 /// automatically close under a variety of conditions there, such as any mouse clicks.
@@ -86,7 +107,7 @@ class DockWidgetWithClosedSignal : public QDockWidget {
  public:
   inline DockWidgetWithClosedSignal(const QString& title, QWidget* parent = nullptr)
       : QDockWidget(title, parent) {}
-  
+      
  signals:
   void closed();
   
@@ -106,7 +127,7 @@ class WidgetWithRightClickSignal : public QWidget {
  public:
   inline WidgetWithRightClickSignal(QWidget* parent = nullptr)
       : QWidget(parent) {}
-  
+      
  signals:
   void rightClicked(QPoint pos, QPoint globalPos);
   
@@ -129,7 +150,7 @@ class TreeWidgetWithRightClickSignal : public QTreeWidget {
  public:
   inline TreeWidgetWithRightClickSignal(QWidget* parent = nullptr)
       : QTreeWidget(parent) {}
-  
+      
  signals:
   void itemRightClicked(QTreeWidgetItem* item, QPoint pos);
   void rightClicked(QPoint pos);